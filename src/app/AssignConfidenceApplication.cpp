@@ -7,14 +7,21 @@
 #include "AssignConfidenceApplication.h"
 #include "ComputeQValues.h"
 #include "io/MatchCollectionParser.h"
+#include "io/MatchFileColumns.h"
+#include "io/ScoreIndex.h"
 #include "PosteriorEstimator.h"
 #include "util/FileUtils.h"
+#include "util/ParallelSort.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
+#include "util/ThreadPool.h"
 
+#include "boost/bind.hpp"
 #include "boost/tuple/tuple.hpp" // This will be <tuple> once we move to C++11.
 #include "boost/tuple/tuple_comparison.hpp"
+#include "boost/unordered_map.hpp"
 
+#include <algorithm>
 #include <map>
 #include <utility>
 
@@ -29,7 +36,7 @@ static const double EPSILON = 0.00000000000001;
 * \returns a blank ComputeQValues object
 */
 AssignConfidenceApplication::AssignConfidenceApplication():
-  spectrum_flag_(NULL), iteration_cnt_(0) {
+  spectrum_flag_(NULL), iteration_cnt_(0), input_target_(NULL), input_decoy_(NULL) {
 }
 
 /**
@@ -55,7 +62,9 @@ int stringToIndex(string myString) {
 */
 
 int AssignConfidenceApplication::main(int argc, char** argv) {
-  return main(Params::GetStrings("target input"));
+  vector<string> input_files = Params::GetStrings("target input");
+  expand_shard_manifests(input_files);
+  return main(input_files);
 }
 
 int AssignConfidenceApplication::main(const vector<string> input_files) {
@@ -154,15 +163,34 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
       "with score: %s", score_param.c_str());
   }
 
+  if (Params::GetBool("columnar-psm-loading")) {
+    bool tab_delimited = true;
+    for (vector<string>::const_iterator i = input_files.begin(); i != input_files.end(); ++i) {
+      tab_delimited = tab_delimited && (StringUtils::IEndsWith(*i, ".txt") ||
+                                        StringUtils::IEndsWith(*i, ".txt.gz"));
+    }
+    if (estimation_method == TDC_METHOD && !sidak && spectrum_flag_ == NULL &&
+        !Params::GetBool("pepxml-output") && tab_delimited &&
+        (score_type == INVALID_SCORER_TYPE || scoreColumn(score_type) != INVALID_COL)) {
+      return mainColumnar(input_files, score_type);
+    }
+    carp(CARP_WARNING, "Not using columnar-psm-loading, which needs tab-delimited input, "
+         "estimation-method = tdc, sidak = F and no pepXML output.");
+  }
+
   // Create two match collections, for targets and decoys.
   MatchCollection* decoy_matches = new MatchCollection();
   MatchCollection* target_matches = new MatchCollection();
 
   bool distinct_matches = false;
   MatchCollectionParser parser;
-  std::map<string, FLOAT_T> BestPeptideScore;
+  // Best score of each distinct peptide, by its id in peptide_ids
+  StringInterner peptide_ids;
+  vector<FLOAT_T> best_peptide_scores;
+  boost::unordered_map<Crux::Match*, int> match_peptide_ids; // of the current file
   
   for (vector<string>::const_iterator iter = input_files.begin(); iter != input_files.end(); ++iter) {
+    match_peptide_ids.clear();
     string target_path = *iter;
     string decoy_path = *iter;
 
@@ -174,11 +202,11 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
 
     check_target_decoy_files(target_path, decoy_path);
 
-    if (!FileUtils::Exists(target_path)) {
+    if (input_target_ == NULL && !FileUtils::Exists(target_path)) {
       carp(CARP_FATAL, "Target file %s not found", target_path.c_str());
     }
 
-    if (!FileUtils::Exists(decoy_path)) {
+    if (input_target_ != NULL ? input_decoy_ == NULL : !FileUtils::Exists(decoy_path)) {
       if (estimation_method == MIXMAX_METHOD) {
         carp(CARP_FATAL, "Cannot find file %s.", decoy_path.c_str());
         carp(CARP_FATAL, "Decoy file from separate target-decoy search is required "
@@ -188,7 +216,8 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
       decoy_path = "";
     }
 
-    MatchCollection* match_collection =
+    MatchCollection* match_collection = input_target_ != NULL ?
+      parser.create(input_target_, target_path, Params::GetString("protein-database")) :
       parser.create(target_path, Params::GetString("protein-database"));
     distinct_matches = match_collection->getHasDistinctMatches();
 
@@ -240,8 +269,9 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
 
     // Find and keep the best score for each peptide.
     if (estimation_method == PEPTIDE_LEVEL_METHOD) {
-      peptide_level_filtering(match_collection, &BestPeptideScore, score_type, ascending);
-      carp(CARP_INFO, "%d distinct target peptides.", BestPeptideScore.size());
+      peptide_level_filtering(match_collection, &peptide_ids, &best_peptide_scores,
+                              &match_peptide_ids, score_type, ascending);
+      carp(CARP_INFO, "%d distinct target peptides.", peptide_ids.Size());
     }
 
     target_matches->setScoredType(score_type, match_collection->getScoredType(score_type));
@@ -260,7 +290,9 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
     int num_decoy_peptide_skipped = 0;
     
     if (decoy_path != "") {
-      MatchCollection* temp_collection = parser.create(decoy_path, Params::GetString("protein-database"));
+      MatchCollection* temp_collection = input_decoy_ != NULL ?
+        parser.create(input_decoy_, decoy_path, Params::GetString("protein-database")) :
+        parser.create(decoy_path, Params::GetString("protein-database"));
       carp(CARP_INFO, "Found %d PSMs in %s.", temp_collection->getMatchTotal(),
            decoy_path.c_str());
 
@@ -313,8 +345,9 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
 
       // Find and keep the best score for each decoy peptide.
       if (estimation_method == PEPTIDE_LEVEL_METHOD) {
-        peptide_level_filtering(temp_collection, &BestPeptideScore, score_type, ascending);
-        carp(CARP_INFO, "%d distinct target+decoy peptides.", BestPeptideScore.size());
+        peptide_level_filtering(temp_collection, &peptide_ids, &best_peptide_scores,
+                                &match_peptide_ids, score_type, ascending);
+        carp(CARP_INFO, "%d distinct target+decoy peptides.", peptide_ids.Size());
       }
 
       if (estimation_method != MIXMAX_METHOD) {
@@ -439,11 +472,13 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
       // Find and keep the best score for each decoy peptide.
       if (estimation_method == PEPTIDE_LEVEL_METHOD) {
         FLOAT_T score = match->getScore(score_type);
-        string peptideStr = getPeptideSeq(match);
+        boost::unordered_map<Crux::Match*, int>::const_iterator peptide_id =
+          match_peptide_ids.find(match);
 
-        FLOAT_T bestScore;
-        try {
-          bestScore = BestPeptideScore.at(peptideStr);
+        if (peptide_id == match_peptide_ids.end()) {
+          carp(CARP_DEBUG, "Error in peptide-level filtering");
+        } else {
+          FLOAT_T& bestScore = best_peptide_scores[peptide_id->second];
           if (bestScore != score) {  //not the best scoring peptide
             if (is_decoy) {
               num_decoy_peptide_skipped++;
@@ -452,10 +487,8 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
             }
             continue;
           } else {
-            BestPeptideScore.at(peptideStr) += ascending ? -1.0 : 1.0;  //make sure only one best scoring peptide reported.
+            bestScore += ascending ? -1.0 : 1.0;  //make sure only one best scoring peptide reported.
           }
-        } catch (const std::out_of_range& oor) {
-          carp(CARP_DEBUG, "Error in peptide-level filtering");
         }
       }
 
@@ -498,54 +531,8 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
 
   // get from the input files which columns to print in the output files
   if (iteration_cnt_ == 0) {
-    vector<bool> cols_to_print(NUMBER_MATCH_COLUMNS);
-    cols_to_print[FILE_COL] = Params::GetBool("file-column");
-    cols_to_print[SCAN_COL] = true;
-    cols_to_print[CHARGE_COL] = true;
-    cols_to_print[SPECTRUM_PRECURSOR_MZ_COL] = true;
-    cols_to_print[SPECTRUM_NEUTRAL_MASS_COL] = true;
-    cols_to_print[PEPTIDE_MASS_COL] = true;
-    cols_to_print[DELTA_CN_COL] = target_matches->getScoredType(DELTA_CN);
-    cols_to_print[SP_SCORE_COL] = target_matches->getScoredType(SP);
-    cols_to_print[SP_RANK_COL] = target_matches->getScoredType(SP);
-    cols_to_print[XCORR_SCORE_COL] = !target_matches->getScoredType(TIDE_SEARCH_EXACT_PVAL);
-    cols_to_print[XCORR_RANK_COL] = true;
-    cols_to_print[EVALUE_COL] = target_matches->getScoredType(EVALUE);
-    cols_to_print[EXACT_PVALUE_COL] = target_matches->getScoredType(TIDE_SEARCH_EXACT_PVAL);
-    cols_to_print[PVALUE_COL] = target_matches->getScoredType(LOGP_BONF_WEIBULL_XCORR);
-    cols_to_print[SIDAK_ADJUSTED_COL] = sidak;
-    if (target_matches->getScoredType(TIDE_SEARCH_EXACT_PVAL)) {
-      cols_to_print[REFACTORED_SCORE_COL] = true;
-    }
-    cols_to_print[BY_IONS_MATCHED_COL] = target_matches->getScoredType(BY_IONS_MATCHED);
-    cols_to_print[BY_IONS_TOTAL_COL] = target_matches->getScoredType(BY_IONS_TOTAL);
-
-    if (distinct_matches) {
-      cols_to_print[DISTINCT_MATCHES_SPECTRUM_COL] = true;
-    } else {
-      cols_to_print[MATCHES_SPECTRUM_COL] = true;
-    }
-    switch (estimation_method) {
-    case TDC_METHOD:
-    case PEPTIDE_LEVEL_METHOD: // FIXME: Make a peptide-level q-value column. --WSN 4 Feb 2016
-      cols_to_print[QVALUE_TDC_COL] = true;
-      break;
-    case MIXMAX_METHOD:
-      cols_to_print[QVALUE_MIXMAX_COL] = true;
-      break;
-    case NUMBER_METHOD_TYPES:
-    case INVALID_METHOD:
-      carp(CARP_FATAL, "No estimation method specified.");
-    }
-    cols_to_print[SEQUENCE_COL] = true;
-    cols_to_print[CLEAVAGE_TYPE_COL] = true;
-    cols_to_print[PROTEIN_ID_COL] = true;
-    cols_to_print[FLANKING_AA_COL] = true;
-    if (spectrum_flag_ != NULL) {
-      cols_to_print[INDEX_NAME_COL] = true;
-    }
-
-    output_->writeHeaders(cols_to_print);
+    output_->writeHeaders(getColumnsToPrint(target_matches, sidak, distinct_matches,
+                                            estimation_method));
   }
   switch (estimation_method) {
   case TDC_METHOD:
@@ -581,22 +568,9 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
       carp(CARP_FATAL, "No estimation method specified.");
   }
 
-  unsigned int fdr1 = 0;
-  unsigned int fdr5 = 0;
-  unsigned int fdr10 = 0;
-  for (vector<FLOAT_T>::const_iterator i = qvalues.begin(); i != qvalues.end(); i++) {
-    if (*i < 0.01) ++fdr1;
-    if (*i < 0.05) ++fdr5;
-    if (*i < 0.10) ++fdr10;
-  }
-  carp(CARP_INFO, "Number of PSMs at 1%% FDR = %d.", fdr1);
-  carp(CARP_INFO, "Number of PSMs at 5%% FDR = %d.", fdr5);
-  carp(CARP_INFO, "Number of PSMs at 10%% FDR = %d.", fdr10);
+  reportFdrCounts(qvalues);
 
-  // Store p-values to q-values as a hash, and then assign them.
-  map<FLOAT_T, FLOAT_T> qvalue_hash = store_arrays_as_hash(target_scores, qvalues);
-
-  target_matches->assignQValues(&qvalue_hash, score_type, derived_score_type);
+  target_matches->assignQValues(target_scores, qvalues, score_type, derived_score_type);
 
   // Store targets by score.
   target_matches->sort(score_type);
@@ -644,6 +618,491 @@ int AssignConfidenceApplication::main(const vector<string> input_files) {
 } // Main
 
 
+/**
+ * \returns Which columns to print in the output files, given the scores that
+ * target_matches has.
+ */
+vector<bool> AssignConfidenceApplication::getColumnsToPrint(
+  MatchCollection* target_matches,
+  bool sidak,
+  bool distinct_matches,
+  ESTIMATION_METHOD_T estimation_method
+) const {
+  vector<bool> cols_to_print(NUMBER_MATCH_COLUMNS);
+  cols_to_print[FILE_COL] = Params::GetBool("file-column");
+  cols_to_print[SCAN_COL] = true;
+  cols_to_print[CHARGE_COL] = true;
+  cols_to_print[SPECTRUM_PRECURSOR_MZ_COL] = true;
+  cols_to_print[SPECTRUM_NEUTRAL_MASS_COL] = true;
+  cols_to_print[PEPTIDE_MASS_COL] = true;
+  cols_to_print[DELTA_CN_COL] = target_matches->getScoredType(DELTA_CN);
+  cols_to_print[SP_SCORE_COL] = target_matches->getScoredType(SP);
+  cols_to_print[SP_RANK_COL] = target_matches->getScoredType(SP);
+  cols_to_print[XCORR_SCORE_COL] = !target_matches->getScoredType(TIDE_SEARCH_EXACT_PVAL);
+  cols_to_print[XCORR_RANK_COL] = true;
+  cols_to_print[EVALUE_COL] = target_matches->getScoredType(EVALUE);
+  cols_to_print[EXACT_PVALUE_COL] = target_matches->getScoredType(TIDE_SEARCH_EXACT_PVAL);
+  cols_to_print[PVALUE_COL] = target_matches->getScoredType(LOGP_BONF_WEIBULL_XCORR);
+  cols_to_print[SIDAK_ADJUSTED_COL] = sidak;
+  if (target_matches->getScoredType(TIDE_SEARCH_EXACT_PVAL)) {
+    cols_to_print[REFACTORED_SCORE_COL] = true;
+  }
+  cols_to_print[BY_IONS_MATCHED_COL] = target_matches->getScoredType(BY_IONS_MATCHED);
+  cols_to_print[BY_IONS_TOTAL_COL] = target_matches->getScoredType(BY_IONS_TOTAL);
+
+  if (distinct_matches) {
+    cols_to_print[DISTINCT_MATCHES_SPECTRUM_COL] = true;
+  } else {
+    cols_to_print[MATCHES_SPECTRUM_COL] = true;
+  }
+  switch (estimation_method) {
+  case TDC_METHOD:
+  case PEPTIDE_LEVEL_METHOD: // FIXME: Make a peptide-level q-value column. --WSN 4 Feb 2016
+    cols_to_print[QVALUE_TDC_COL] = true;
+    break;
+  case MIXMAX_METHOD:
+    cols_to_print[QVALUE_MIXMAX_COL] = true;
+    break;
+  case NUMBER_METHOD_TYPES:
+  case INVALID_METHOD:
+    carp(CARP_FATAL, "No estimation method specified.");
+  }
+  cols_to_print[SEQUENCE_COL] = true;
+  cols_to_print[CLEAVAGE_TYPE_COL] = true;
+  cols_to_print[PROTEIN_ID_COL] = true;
+  cols_to_print[FLANKING_AA_COL] = true;
+  if (spectrum_flag_ != NULL) {
+    cols_to_print[INDEX_NAME_COL] = true;
+  }
+
+  return cols_to_print;
+}
+
+/**
+ * \returns The column that MatchFileReader reads the given score from, or
+ * INVALID_COL if it is not read from a single column.
+ */
+MATCH_COLUMNS_T AssignConfidenceApplication::scoreColumn(SCORER_TYPE_T score_type) {
+  switch (score_type) {
+  case SP:
+    return SP_SCORE_COL;
+  case XCORR:
+    return XCORR_SCORE_COL;
+  case EVALUE:
+    return EVALUE_COL;
+  case LOGP_BONF_WEIBULL_XCORR:
+    return PVALUE_COL;
+  case PERCOLATOR_SCORE:
+    return PERCOLATOR_SCORE_COL;
+  case PERCOLATOR_QVALUE:
+    return PERCOLATOR_QVALUE_COL;
+  case QRANKER_SCORE:
+    return QRANKER_SCORE_COL;
+  case QRANKER_QVALUE:
+    return QRANKER_QVALUE_COL;
+  case BARISTA_SCORE:
+    return BARISTA_SCORE_COL;
+  case BARISTA_QVALUE:
+    return BARISTA_QVALUE_COL;
+  case TIDE_SEARCH_EXACT_PVAL:
+    return EXACT_PVALUE_COL;
+  case TIDE_SEARCH_REFACTORED_XCORR:
+    return REFACTORED_SCORE_COL;
+  default:
+    return INVALID_COL;
+  }
+}
+
+/**
+ * Orders rows of MatchFileColumns best score first.
+ */
+class CompareRowScores {
+ public:
+  explicit CompareRowScores(bool ascending) : ascending_(ascending) {}
+  bool operator()(const pair<const MatchFileColumns*, size_t>& x,
+                  const pair<const MatchFileColumns*, size_t>& y) const {
+    FLOAT_T score_x = x.first->getScore(x.second);
+    FLOAT_T score_y = y.first->getScore(y.second);
+    return ascending_ ? Match::ScoreLess(score_x, score_y)
+                      : Match::ScoreGreater(score_x, score_y);
+  }
+ protected:
+  bool ascending_;
+};
+
+/**
+ * One input of mainColumnar(): a target or concatenated file, the decoy
+ * file of it if there is one, and the ids of the spectrum files they name.
+ */
+struct ColumnarInput {
+  ColumnarInput() : target(NULL), decoy(NULL), indexed(false) {}
+  string target_path;
+  string decoy_path;
+  MatchFileColumns* target;
+  MatchFileColumns* decoy;
+  map<string, int> file_ids;
+  bool indexed;  ///< whether the target rows came from a score index
+};
+
+/**
+ * Loads the rows of the open files of input, the target rows from the
+ * score index of a concatenated file if there is one to use.
+ */
+static void loadColumnarInput(
+  ColumnarInput* input,
+  MATCH_COLUMNS_T score_col,
+  int max_rank,
+  bool ascending,
+  bool use_score_index
+) {
+  // The score index of a concatenated file lists its rows best first.
+  ScoreIndex score_index;
+  input->indexed = use_score_index && input->decoy == NULL &&
+    score_index.read(input->target_path, score_col, ascending) &&
+    input->target->load(score_index, max_rank);
+  if (!input->indexed) {
+    input->target->load(score_col, max_rank, false, &input->file_ids);
+  }
+  if (input->decoy != NULL) {
+    input->decoy->load(score_col, max_rank, true, &input->file_ids);
+  }
+}
+
+/**
+ * TDC q-values for tab-delimited input, computed from a few typed columns
+ * of each file (see MatchFileColumns) rather than from Match objects. The
+ * competition, tie breaking and q-values are those of main(); the other
+ * fields of each target are copied to the output as given.
+ */
+int AssignConfidenceApplication::mainColumnar(
+  const vector<string>& input_files,
+  SCORER_TYPE_T score_type
+) {
+  const int top_match = 1;
+  int max_rank = Params::GetInt("top-match-in");
+  bool distinct_matches = false;
+  bool ascending = false;
+  // Only records which scores the input has, for getColumnsToPrint()
+  MatchCollection scored_types;
+  vector<MatchFileColumns*> target_files;
+  vector<pair<const MatchFileColumns*, size_t> > targets;
+  vector<FLOAT_T> decoy_scores;
+  // With a score index for every file, the targets of each file come in
+  // order, and these are the ends of their runs in targets.
+  bool use_score_index = Params::GetBool("score-index");
+  bool all_indexed = true;
+  vector<size_t> target_runs(1, 0);
+
+  // Open every input and find the score; the rows are loaded afterwards,
+  // all files at once.
+  vector<ColumnarInput> inputs(input_files.size());
+  for (size_t input = 0; input < input_files.size(); input++) {
+    string target_path = input_files[input];
+    string decoy_path = input_files[input];
+
+    if (target_path.find("decoy") != string::npos) {
+      carp(CARP_FATAL, "%s appears to be a decoy file. Only target or concatenated files "
+        "should be given to assign-confidence because it automatically searches for "
+        "corresponding decoy files.", target_path.c_str());
+    }
+
+    check_target_decoy_files(target_path, decoy_path);
+
+    if (!FileUtils::Exists(target_path)) {
+      carp(CARP_FATAL, "Target file %s not found", target_path.c_str());
+    }
+    if (!FileUtils::Exists(decoy_path)) {
+      carp(CARP_DEBUG, "Decoy file %s not found", decoy_path.c_str());
+      decoy_path = "";
+    }
+
+    MatchFileColumns* target_file = new MatchFileColumns();
+    target_files.push_back(target_file);
+    if (!target_file->open(target_path)) {
+      carp(CARP_FATAL, "Cannot read PSMs from %s.", target_path.c_str());
+    }
+    inputs[input].target_path = target_path;
+    inputs[input].decoy_path = decoy_path;
+    inputs[input].target = target_file;
+
+    // If necessary, automatically identify the score type.
+    if (score_type == INVALID_SCORER_TYPE) {
+      SCORER_TYPE_T scoreTypes[] = { XCORR, EVALUE, TIDE_SEARCH_EXACT_PVAL,
+                                     LOGP_BONF_WEIBULL_XCORR, PERCOLATOR_SCORE };
+      for (size_t i = 0; i < sizeof(scoreTypes) / sizeof(SCORER_TYPE_T); i++) {
+        if (target_file->hasColumn(scoreColumn(scoreTypes[i]))) {
+          score_type = scoreTypes[i];
+          carp(CARP_INFO, "Automatically detected score type: %s",
+               scorer_type_to_string(score_type));
+          break;
+        }
+      }
+      if (score_type == INVALID_SCORER_TYPE) {
+        carp(CARP_FATAL, "Could not detect score type. Specify the score type using the "
+                         "\"score\" parameter.");
+      }
+    }
+    int direction = getDirection(score_type);
+    if (direction == -1) {
+      ascending = false;
+    } else if (direction == 1) {
+      ascending = true;
+    } else {
+      carp(CARP_FATAL, "Cannot infer sort order for score %s.",
+           scorer_type_to_string(score_type));
+    }
+    carp(CARP_INFO, "Score type=%s, sorting in %s order",
+         scorer_type_to_string(score_type),
+         ascending ? "ascending" : "descending");
+
+    MATCH_COLUMNS_T score_col = scoreColumn(score_type);
+    if (!target_file->hasColumn(score_col)) {
+      const char* score_str = scorer_type_to_string(score_type);
+      carp(CARP_FATAL, "The PSM feature \"%s\" was not found in file \"%s\".",
+           score_str, target_path.c_str());
+    }
+    if (decoy_path != "") {
+      inputs[input].decoy = new MatchFileColumns();
+      if (!inputs[input].decoy->open(decoy_path)) {
+        carp(CARP_FATAL, "Cannot read PSMs from %s.", decoy_path.c_str());
+      }
+    }
+  }
+
+  // Parse the files side by side. Each input numbers the spectrum files of
+  // its own target and decoy files, so the ids do not depend on which
+  // input is parsed first.
+  {
+    ThreadPool::TaskGroup group;
+    for (size_t input = 0; input < inputs.size(); input++) {
+      group.Run(boost::bind(&loadColumnarInput, &inputs[input], scoreColumn(score_type),
+                            max_rank, ascending, use_score_index));
+    }
+    group.Wait();
+  }
+
+  // The competition, with its random tie breaking, and the gathering of
+  // scores go through the inputs in the order given, however the parsing
+  // went.
+  for (size_t input = 0; input < inputs.size(); input++) {
+    const string& target_path = inputs[input].target_path;
+    const string& decoy_path = inputs[input].decoy_path;
+    MatchFileColumns* target_file = inputs[input].target;
+    bool indexed = inputs[input].indexed;
+    if (indexed) {
+      carp(CARP_INFO, "Using the score index of %s.", target_path.c_str());
+    }
+    all_indexed = all_indexed && indexed;
+    carp(CARP_INFO, "Found %d PSMs in %s.", target_file->size(), target_path.c_str());
+    if (score_type == LOGP_BONF_WEIBULL_XCORR) {
+      negateLogPValues(target_file->getScores());
+    }
+
+    distinct_matches = target_file->hasColumn(DISTINCT_MATCHES_SPECTRUM_COL);
+    scored_types.setScoredType(EVALUE, target_file->hasColumn(EVALUE_COL));
+    scored_types.setScoredType(DELTA_CN, target_file->hasColumn(DELTA_CN_COL));
+    scored_types.setScoredType(SP, target_file->hasColumn(SP_SCORE_COL));
+    scored_types.setScoredType(BY_IONS_MATCHED, target_file->hasColumn(BY_IONS_MATCHED_COL));
+    scored_types.setScoredType(BY_IONS_TOTAL, target_file->hasColumn(BY_IONS_TOTAL_COL));
+
+    // Counters just to let the user know what's up.
+    int num_target_rank_skipped = 0;
+    int num_decoy_rank_skipped = 0;
+
+    // Rows of target_file that go on to the q-value computation
+    vector<size_t> kept;
+    if (inputs[input].decoy != NULL) {
+      MatchFileColumns& decoy_file = *inputs[input].decoy;
+      carp(CARP_INFO, "Found %d PSMs in %s.", decoy_file.size(), decoy_path.c_str());
+      if (score_type == LOGP_BONF_WEIBULL_XCORR) {
+        negateLogPValues(decoy_file.getScores());
+      }
+
+      // key = (filename, scan number, charge, rank, row), sorted so that the
+      // first of tied top-ranked decoys comes first among equal keys
+      vector<boost::tuple<int, int, int, int, size_t> > decoy_keys;
+      decoy_keys.reserve(decoy_file.size());
+      for (size_t row = 0; row < decoy_file.size(); row++) {
+        // Only use top-ranked matches.
+        if (decoy_file.getRank(row) > top_match) {
+          num_decoy_rank_skipped++;
+          continue;
+        }
+        decoy_keys.push_back(boost::make_tuple(
+          decoy_file.getFile(row), decoy_file.getScan(row), decoy_file.getCharge(row),
+          decoy_file.getRank(row), row));
+      }
+      ParallelSort::Sort(decoy_keys.begin(), decoy_keys.end(),
+                         less< boost::tuple<int, int, int, int, size_t> >());
+
+      int numCompetitions = 0;
+      int numLostDecoys = 0;
+      int numTies = 0;
+      for (size_t row = 0; row < target_file->size(); row++) {
+        // Only use top-ranked matches.
+        if (target_file->getRank(row) > top_match) {
+          num_target_rank_skipped++;
+          continue;
+        }
+
+        // Retrieve the index of the corresponding decoy PSM.
+        boost::tuple<int, int, int, int, size_t> key(
+          target_file->getFile(row), target_file->getScan(row),
+          target_file->getCharge(row), target_file->getRank(row), 0);
+        vector<boost::tuple<int, int, int, int, size_t> >::const_iterator decoy =
+          lower_bound(decoy_keys.begin(), decoy_keys.end(), key);
+        if (decoy == decoy_keys.end() || decoy->get<0>() != key.get<0>() ||
+            decoy->get<1>() != key.get<1>() || decoy->get<2>() != key.get<2>() ||
+            decoy->get<3>() != key.get<3>()) {
+          carp(CARP_DEBUG, "Failed to find decoy for scan=%d charge=%d rank=%d.",
+               key.get<1>(), key.get<2>(), key.get<3>());
+          numLostDecoys++;
+          kept.push_back(row);
+          continue;
+        }
+
+        // This is where the target-decoy competition happens.
+        FLOAT_T decoy_score = decoy_file.getScore(decoy->get<4>());
+        float score_difference = target_file->getScore(row) - decoy_score;
+        numCompetitions++;
+        // Randomly break ties.
+        if (fabs(score_difference) < 1e-10) {
+          numTies++;
+          score_difference += 0.5 - ((double)myrandom() / UNIFORM_INT_DISTRIBUTION_MAX);
+        }
+        if (ascending) { // smaller scores are better
+          score_difference *= -1.0;
+        }
+        if (score_difference >= 0.0) {
+          kept.push_back(row);
+        } else {
+          decoy_scores.push_back(decoy_score);
+        }
+      }
+      if (numCompetitions > 0) {
+        carp(CARP_INFO, "Randomly broke %d ties in %d target-decoy competitions.",
+             numTies, numCompetitions);
+      }
+      if (numLostDecoys > 0) {
+        carp(CARP_INFO, "Failed to find %d decoys.", numLostDecoys);
+      }
+      delete inputs[input].decoy;
+      inputs[input].decoy = NULL;
+    } else {
+      for (size_t row = 0; row < target_file->size(); row++) {
+        kept.push_back(row);
+      }
+    }
+
+    // Gather the scores of targets and decoys.
+    for (vector<size_t>::const_iterator i = kept.begin(); i != kept.end(); ++i) {
+      bool is_decoy = target_file->isDecoy(*i);
+      if (target_file->getRank(*i) > top_match) {
+        if (is_decoy) {
+          num_decoy_rank_skipped++;
+        } else {
+          num_target_rank_skipped++;
+        }
+        continue;
+      }
+      if (is_decoy) {
+        decoy_scores.push_back(target_file->getScore(*i));
+      } else {
+        targets.push_back(make_pair(target_file, *i));
+      }
+    }
+    if (num_decoy_rank_skipped + num_target_rank_skipped > 0) {
+      carp(CARP_INFO, "Skipped %d target and %d decoy PSMs with rank > %d.",
+           num_target_rank_skipped, num_decoy_rank_skipped, top_match);
+    }
+    target_runs.push_back(targets.size());
+  }
+  scored_types.setScoredType(score_type, true);
+
+  if (iteration_cnt_ == 0) {
+    output_->writeHeaders(getColumnsToPrint(&scored_types, false, distinct_matches,
+                                            TDC_METHOD));
+  }
+
+  // Compute q-values. The targets are sorted in the order that
+  // compute_decoy_qvalues_tdc() sorts their scores, so that the q-values
+  // line up with them. Runs from score indexes only need merging, which
+  // like the stable sort keeps tied targets in file order.
+  if (all_indexed) {
+    for (size_t i = 2; i < target_runs.size(); i++) {
+      inplace_merge(targets.begin(), targets.begin() + target_runs[i - 1],
+                    targets.begin() + target_runs[i], CompareRowScores(ascending));
+    }
+  } else {
+    ParallelSort::Sort(targets.begin(), targets.end(), CompareRowScores(ascending));
+  }
+  vector<FLOAT_T> target_scores;
+  target_scores.reserve(targets.size());
+  for (size_t i = 0; i < targets.size(); i++) {
+    target_scores.push_back(targets[i].first->getScore(targets[i].second));
+  }
+  carp(CARP_INFO, "There are %d target and %d decoy PSMs for q-value computation.",
+       target_scores.size(), decoy_scores.size());
+  vector<FLOAT_T> qvalues =
+    compute_decoy_qvalues_tdc(target_scores, decoy_scores, ascending, 1.0);
+  reportFdrCounts(qvalues);
+
+  // Targets with equal scores get the q-value of the last of them, as they
+  // do from MatchCollection::assignQValues().
+  for (size_t i = targets.size(); i-- > 1; ) {
+    if (target_scores[i - 1] == target_scores[i]) {
+      qvalues[i - 1] = qvalues[i];
+    }
+  }
+
+  // Store targets by score.
+  for (size_t i = 0; i < targets.size(); i++) {
+    FLOAT_T score = target_scores[i];
+    FLOAT_T qvalue = (isinf(score) || isnan(score)) ?
+      numeric_limits<FLOAT_T>::quiet_NaN() : qvalues[i];
+    output_->writeMatchRow(*targets[i].first, targets[i].second, QVALUE_TDC_COL, qvalue);
+  }
+  output_->writeFooters();
+  delete output_;
+
+  for (vector<MatchFileColumns*>::iterator i = target_files.begin();
+       i != target_files.end();
+       ++i) {
+    delete *i;
+  }
+  return 0;
+}
+
+/**
+ * Turns p-values into the -log(p-values) that MatchFileReader reads them as.
+ */
+void AssignConfidenceApplication::negateLogPValues(
+  vector<FLOAT_T>& scores
+) {
+  for (vector<FLOAT_T>::iterator i = scores.begin(); i != scores.end(); ++i) {
+    *i = *i > 0 ? -log(*i) : numeric_limits<FLOAT_T>::infinity();
+  }
+}
+
+/**
+ * Logs the number of PSMs at 1%, 5% and 10% FDR.
+ */
+void AssignConfidenceApplication::reportFdrCounts(
+  const vector<FLOAT_T>& qvalues
+) {
+  unsigned int fdr1 = 0;
+  unsigned int fdr5 = 0;
+  unsigned int fdr10 = 0;
+  for (vector<FLOAT_T>::const_iterator i = qvalues.begin(); i != qvalues.end(); i++) {
+    if (*i < 0.01) ++fdr1;
+    if (*i < 0.05) ++fdr5;
+    if (*i < 0.10) ++fdr10;
+  }
+  carp(CARP_INFO, "Number of PSMs at 1%% FDR = %d.", fdr1);
+  carp(CARP_INFO, "Number of PSMs at 5%% FDR = %d.", fdr5);
+  carp(CARP_INFO, "Number of PSMs at 10%% FDR = %d.", fdr10);
+}
+
 /**
 * Find the best-scoring match for each peptide in a given collection.
 * Only consider the top-ranked PSM per spectrum.
@@ -654,11 +1113,13 @@ void AssignConfidenceApplication::identify_best_psm_per_peptide(
   MatchCollection* all_matches,
   SCORER_TYPE_T score_type
 ) {
-  /* Instantiate a hash table.  key = peptide; value = maximal xcorr
-     for that peptide. */
-  map<string, FLOAT_T> best_score_per_peptide;
+  /* Number the peptides in a hash table, and keep the maximal xcorr of
+     each peptide by its number. */
+  StringInterner peptide_ids;
+  vector<FLOAT_T> best_score_per_peptide;
+  vector<int> match_peptide_ids; // of each top-ranked match, in order
 
-  // Store in the hash the best score per peptide.
+  // Store the best score per peptide.
   MatchIterator* match_iterator 
     = new MatchIterator(all_matches, score_type, false);
   while(match_iterator->hasNext()) {
@@ -669,44 +1130,39 @@ void AssignConfidenceApplication::identify_best_psm_per_peptide(
       char *peptide = match->getModSequenceStrWithSymbols();
       FLOAT_T this_score = match->getScore(score_type);
 
-      map<string, FLOAT_T>::iterator map_position 
-        = best_score_per_peptide.find(peptide);
-
-      if (map_position == best_score_per_peptide.end()) {
-        best_score_per_peptide[peptide] = this_score;
+      int id = peptide_ids.Intern(peptide);
+      if (id == (int)best_score_per_peptide.size()) {
+        best_score_per_peptide.push_back(this_score);
       } else {
         // FIXME: Need a generic compare operator for score_type.
-        if (map_position->second < this_score) {
-          best_score_per_peptide[peptide] = this_score;
+        if (best_score_per_peptide[id] < this_score) {
+          best_score_per_peptide[id] = this_score;
         }
       }
+      match_peptide_ids.push_back(id);
       free(peptide);
     }
   }
   delete match_iterator;
 
 
-  // Set the best_per_peptide Boolean in the match, based on the hash.
+  // Set the best_per_peptide Boolean in the match, based on the best scores.
+  vector<int>::const_iterator peptide_id = match_peptide_ids.begin();
   match_iterator = new MatchIterator(all_matches, score_type, false);
   while(match_iterator->hasNext()) {
     Match* match = match_iterator->next();
 
      // Skip matches that are not top-ranked.
     if (match->getRank(score_type) == 1) {
-      char* peptide = match->getModSequenceStrWithSymbols();
       FLOAT_T this_score = match->getScore(score_type);
+      FLOAT_T& best_score = best_score_per_peptide[*peptide_id++];
 
-      map<string, FLOAT_T>::iterator map_position 
-        = best_score_per_peptide.find(peptide);
-
-      if (map_position->second == this_score) {
+      if (best_score == this_score) {
         match->setBestPerPeptide();
         
         // Prevent ties from causing two peptides to be best.
-        best_score_per_peptide[peptide] = HUGE_VAL;
+        best_score = HUGE_VAL;
       }
-      
-      free(peptide);
     }
   }
   delete match_iterator;
@@ -734,21 +1190,6 @@ void AssignConfidenceApplication::convert_fdr_to_qvalue(
   }
 }
 
-/**
- * Store two parallel arrays of floats in a hash table.
- */
-map<FLOAT_T, FLOAT_T> AssignConfidenceApplication::store_arrays_as_hash(
-  const vector<FLOAT_T>& keys,
-  const vector<FLOAT_T>& values
-) {
-  map<FLOAT_T, FLOAT_T> return_value;
-  for (size_t i = 0; i < keys.size(); i++) {
-    carp(CARP_DETAILED_DEBUG, "%g maps to %g", keys[i], values[i]);
-    return_value[keys[i]] = values[i];
-  }
-  return return_value;
-}
-
 /**
  * \brief Compute q-values from a given set of scores, using a second
  * set of scores as an empirical null.  Sorts the incoming target
@@ -770,11 +1211,11 @@ vector<FLOAT_T> AssignConfidenceApplication::compute_decoy_qvalues_tdc(
 
   // Sort both sets of scores.
   if (ascending) {
-    sort(target_scores.begin(), target_scores.end(), Match::ScoreLess);
-    sort(decoy_scores.begin(), decoy_scores.end(), Match::ScoreLess);
+    ParallelSort::Sort(target_scores.begin(), target_scores.end(), Match::ScoreLess);
+    ParallelSort::Sort(decoy_scores.begin(), decoy_scores.end(), Match::ScoreLess);
   } else {
-    sort(target_scores.begin(), target_scores.end(), Match::ScoreGreater);
-    sort(decoy_scores.begin(), decoy_scores.end(), Match::ScoreGreater);
+    ParallelSort::Sort(target_scores.begin(), target_scores.end(), Match::ScoreGreater);
+    ParallelSort::Sort(decoy_scores.begin(), decoy_scores.end(), Match::ScoreGreater);
   }
 
   // Compute false discovery rate for each target score.
@@ -852,11 +1293,11 @@ vector<FLOAT_T> AssignConfidenceApplication::compute_decoy_qvalues_mixmax(
 
   //Sort decoy and target stores
   if (ascending) {
-    sort(target_scores.begin(), target_scores.end(), greater<FLOAT_T>());
-    sort(decoy_scores.begin(), decoy_scores.end(), greater<FLOAT_T>());
+    ParallelSort::Sort(target_scores.begin(), target_scores.end(), greater<FLOAT_T>());
+    ParallelSort::Sort(decoy_scores.begin(), decoy_scores.end(), greater<FLOAT_T>());
   } else {
-    sort(target_scores.begin(), target_scores.end());
-    sort(decoy_scores.begin(), decoy_scores.end());
+    ParallelSort::Sort(target_scores.begin(), target_scores.end(), less<FLOAT_T>());
+    ParallelSort::Sort(decoy_scores.begin(), decoy_scores.end(), less<FLOAT_T>());
   }
 
   //histogram of the target scores.
@@ -936,7 +1377,9 @@ vector<FLOAT_T> AssignConfidenceApplication::compute_decoy_qvalues_mixmax(
 
 void AssignConfidenceApplication::peptide_level_filtering(
   MatchCollection* match_collection,
-  std::map<string, FLOAT_T>* BestPeptideScore, 
+  StringInterner* peptide_ids,
+  vector<FLOAT_T>* best_peptide_scores,
+  boost::unordered_map<Crux::Match*, int>* match_peptide_ids,
   SCORER_TYPE_T score_type,
   bool ascending) {
 
@@ -945,17 +1388,16 @@ void AssignConfidenceApplication::peptide_level_filtering(
     while (temp_iter->hasNext()) {
       Crux::Match* match = temp_iter->next();
       FLOAT_T score = match->getScore(score_type);
-      string peptideStr = getPeptideSeq(match);
+      int peptide_id = peptide_ids->Intern(getPeptideSeq(match));
+      (*match_peptide_ids)[match] = peptide_id;
 
-      FLOAT_T bestScore = 0.0;
-      try {
-        bestScore = BestPeptideScore->at(peptideStr);
-      } catch (const std::out_of_range& oor) {
-        BestPeptideScore->insert(std::pair<string, FLOAT_T>(peptideStr, score));
+      if (peptide_id == (int)best_peptide_scores->size()) {
+        best_peptide_scores->push_back(score);
         continue;
       }
-      if ((ascending && bestScore > score) || (!ascending && score > bestScore)) {
-        BestPeptideScore->at(peptideStr) = score;
+      FLOAT_T& best = (*best_peptide_scores)[peptide_id];
+      if ((ascending && best > score) || (!ascending && score > best)) {
+        best = score;
       }
     }
     delete temp_iter;
@@ -998,6 +1440,11 @@ void AssignConfidenceApplication::setFinalIteration(bool is_final) {
   is_final_ = is_final;
 }
 
+void AssignConfidenceApplication::setInputStreams(istream* target, istream* decoy) {
+  input_target_ = target;
+  input_decoy_ = decoy;
+}
+
 unsigned int AssignConfidenceApplication::getAcceptedPSMs() {
   return accepted_psms_;
 }
@@ -1109,9 +1556,13 @@ vector<string> AssignConfidenceApplication::getOptions() const {
     "parameter-file",
     "overwrite",
     "output-dir",
+    "compress-output",
     "list-of-files",
     "combine-charge-states",
     "combine-modified-peptides",
+    "columnar-psm-loading",
+    "score-index",
+    "num-threads",
     "fileroot"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
@@ -21,6 +21,8 @@
 #include "model/MatchCollection.h"
 #include "io/OutputFiles.h"
 #include "model/Peptide.h"
+#include "util/StringInterner.h"
+#include "boost/unordered_map.hpp"
 
 /**
  * Legal values for the --estimation-method option.
@@ -44,6 +46,9 @@ class AssignConfidenceApplication : public CruxApplication {
   unsigned int accepted_psms_;
   string index_name_;
   bool is_final_;
+  // If not NULL, the PSMs of the single input file, which is not read
+  std::istream* input_target_;
+  std::istream* input_decoy_;
 
  public:
   map<pair<string, unsigned int>, bool>* getSpectrumFlag();
@@ -63,6 +68,12 @@ class AssignConfidenceApplication : public CruxApplication {
   */
   void setFinalIteration(bool is_final);
 
+  /**
+  * Reads the PSMs of the input file, and of its decoy file if decoy is not
+  * NULL, from these streams rather than from disk (for Cascade Search).
+  */
+  void setInputStreams(std::istream* target, std::istream* decoy);
+
   /**
   * \returns a blank ComputeQValues object
   */
@@ -134,7 +145,9 @@ class AssignConfidenceApplication : public CruxApplication {
 
   void peptide_level_filtering(
     MatchCollection* match_collection,
-    std::map<string, FLOAT_T>* BestPeptideScore,
+    StringInterner* peptide_ids, ///< numbers the distinct peptides -in/out
+    std::vector<FLOAT_T>* best_peptide_scores, ///< by peptide id -in/out
+    boost::unordered_map<Crux::Match*, int>* match_peptide_ids, ///< -out
     SCORER_TYPE_T score_type,
     bool ascending);
   
@@ -143,9 +156,6 @@ class AssignConfidenceApplication : public CruxApplication {
     SCORER_TYPE_T score_type);
   void convert_fdr_to_qvalue(
     std::vector<FLOAT_T>& qvalues); ///< Come in as FDRs, go out as q-values.
-  map<FLOAT_T, FLOAT_T> store_arrays_as_hash(
-    const std::vector<FLOAT_T>& keys,
-    const std::vector<FLOAT_T>& values);
   std::vector<FLOAT_T> compute_decoy_qvalues_tdc(
     std::vector<FLOAT_T>& target_scores,
     std::vector<FLOAT_T>& decoy_scores,
@@ -156,6 +166,23 @@ class AssignConfidenceApplication : public CruxApplication {
     std::vector<FLOAT_T>& decoy_scores,
     bool ascending,
     FLOAT_T pi_zero);
+
+ protected:
+  /**
+   * TDC q-values for tab-delimited input, computed from typed columns of
+   * the files instead of Match objects (see columnar-psm-loading).
+   */
+  int mainColumnar(
+    const vector<string>& input_files,
+    SCORER_TYPE_T score_type);
+  std::vector<bool> getColumnsToPrint(
+    MatchCollection* target_matches,
+    bool sidak,
+    bool distinct_matches,
+    ESTIMATION_METHOD_T estimation_method) const;
+  static MATCH_COLUMNS_T scoreColumn(SCORER_TYPE_T score_type);
+  static void negateLogPValues(std::vector<FLOAT_T>& scores);
+  static void reportFdrCounts(const std::vector<FLOAT_T>& qvalues);
 };
 
 #endif //ASSIGNCONFIDENCE_H
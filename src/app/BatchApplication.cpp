@@ -0,0 +1,186 @@
+/**
+ * \file BatchApplication.cpp
+ * \brief Runs a file of Crux commands, one after another, in one process
+ ************************************************************/
+#include <fstream>
+#include "BatchApplication.h"
+#include "CruxApplicationList.h"
+#include "io/carp.h"
+#include "util/Params.h"
+#include "util/StringUtils.h"
+#include "util/ThreadPool.h"
+#include "util/utils.h"
+
+using namespace std;
+
+/**
+ * \returns a BatchApplication object that runs the commands of the
+ * applications that add_applications adds
+ */
+BatchApplication::BatchApplication(AddApplications add_applications)
+  : add_applications_(add_applications) {
+}
+
+/**
+ * Destructor
+ */
+BatchApplication::~BatchApplication() {
+}
+
+/**
+ * main method for BatchApplication
+ */
+int BatchApplication::main(int argc, char** argv) {
+  if (add_applications_ == NULL) {
+    carp(CARP_FATAL, "batch has no commands to run.");
+  }
+  string batch_file = Params::GetString("batch file");
+  ifstream batch(batch_file.c_str());
+  if (!batch.good()) {
+    carp(CARP_FATAL, "Cannot open the batch file %s", batch_file.c_str());
+  }
+
+  // Start the worker pool now, so that it has at least the num-threads of
+  // batch rather than that of the first command; a command that asks for
+  // more grows it.
+  carp(CARP_DEBUG, "Commands share %d pool threads.", ThreadPool::Threads());
+
+  int num_commands = 0, num_failed = 0;
+  int line_number = 0;
+  string line;
+  while (getline(batch, line)) {
+    ++line_number;
+    line = StringUtils::Trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    ++num_commands;
+    if (runCommand(StringUtils::Fields(line), line_number) != 0) {
+      ++num_failed;
+    }
+  }
+
+  carp(CARP_INFO, "Ran %d commands from %s, %d of which failed.",
+       num_commands, batch_file.c_str(), num_failed);
+  return num_failed == 0 ? 0 : 1;
+}
+
+int BatchApplication::runCommand(const vector<string>& words, int line_number) {
+  // The applications keep state from one run to the next, so each command
+  // gets new ones, deleted with the list once it has run.
+  CruxApplicationList applications("crux");
+  add_applications_(&applications);
+  CruxApplication* application = applications.find(words[0]);
+  if (application == NULL) {
+    carp(CARP_ERROR, "Line %d of the batch file: cannot find %s in available "
+         "applications", line_number, words[0].c_str());
+    return -1;
+  } else if (application->getName() == getName()) {
+    carp(CARP_ERROR, "Line %d of the batch file: batch cannot run itself",
+         line_number);
+    return -1;
+  }
+
+  // The arguments as crux's main would see them, with the program name
+  // ahead of the command; the command's log echoes them from there.
+  vector<string> args(1, "crux");
+  args.insert(args.end(), words.begin(), words.end());
+  vector<char*> argv;
+  for (vector<string>::iterator i = args.begin(); i != args.end(); ++i) {
+    argv.push_back(&(*i)[0]);
+  }
+  argv.push_back(NULL);
+  int argc = (int)args.size();
+
+  // Each command starts from the defaults and its own log, as if run alone.
+  close_log_file();
+  Params::Reset();
+  double start = wall_clock();
+  application->initialize(argc - 1, &argv[1]);
+  int ret = application->main(argc - 1, &argv[1]);
+
+  carp(CARP_INFO, "Finished crux %s in %.3g s.", words[0].c_str(),
+       (wall_clock() - start) / 1e6);
+  carp(CARP_INFO, "Return Code:%i", ret);
+  close_log_file();
+  return ret;
+}
+
+/**
+ * \returns the command name for BatchApplication
+ */
+string BatchApplication::getName() const {
+  return "batch";
+}
+
+/**
+ * \returns the description for BatchApplication
+ */
+string BatchApplication::getDescription() const {
+  return
+    "[[nohtml:Run a file of Crux commands in one process.]]"
+    "[[html:<p>Batch runs the Crux commands that it reads, one per line, from a "
+    "file, one after another and in one process, so that each of many short "
+    "commands does not pay again to start Crux. Each line is written as on the "
+    "command line, without the leading <code>crux</code>. Every command starts "
+    "with all parameters at their defaults, and reads only its own options and "
+    "parameter file; each should be given its own <code>--output-dir</code>, in "
+    "which it writes its log and parameter file as it would if run alone. The "
+    "commands share one pool of worker threads, of the size given by the "
+    "num-threads of batch, or by that of a command that asks for more threads, "
+    "from that command on: a command's own num-threads still sets into how many "
+    "parts it splits its work, but the parts run on the threads of the pool. A "
+    "command that "
+    "fails fatally ends the batch.</p>]]";
+}
+
+/**
+ * \returns the command arguments
+ */
+vector<string> BatchApplication::getArgs() const {
+  string arr[] = {
+    "batch file"
+  };
+  return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
+}
+
+/**
+ * \returns the command options
+ */
+vector<string> BatchApplication::getOptions() const {
+  string arr[] = {
+    "metrics-address",
+    "metrics-port",
+    "num-threads",
+    "verbosity"
+  };
+  return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
+}
+
+/**
+ * \returns the command outputs
+ */
+vector< pair<string, string> > BatchApplication::getOutputs() const {
+  vector< pair<string, string> > outputs;
+  outputs.push_back(make_pair("output",
+    "the outputs of each command, in the output directory given to it."));
+  return outputs;
+}
+
+COMMAND_T BatchApplication::getCommand() const {
+  return MISC_COMMAND;
+}
+
+/**
+ * \returns whether the application needs the output directory or not.
+ */
+bool BatchApplication::needsOutputDirectory() const {
+  return false;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,95 @@
+/**
+ * \file BatchApplication.h
+ * \brief Runs a file of Crux commands, one after another, in one process
+ ***********************************************************/
+#ifndef BATCHAPPLICATION_H
+#define BATCHAPPLICATION_H
+
+#include "CruxApplication.h"
+
+#include <string>
+#include <vector>
+
+class CruxApplicationList;
+
+class BatchApplication: public CruxApplication {
+
+ public:
+
+  /**
+   * Fills a list with new objects of the applications batch may run.
+   */
+  typedef void (*AddApplications)(CruxApplicationList* applications);
+
+  /**
+   * \returns a BatchApplication object that runs the commands of the
+   * applications that add_applications adds
+   */
+  explicit BatchApplication(AddApplications add_applications = NULL);
+
+  /**
+   * Destructor
+   */
+  ~BatchApplication();
+
+  /**
+   * main method for BatchApplication
+   */
+  virtual int main(int argc, char** argv);
+
+  /**
+   * \returns the command name for BatchApplication
+   */
+  virtual std::string getName() const;
+
+  /**
+   * \returns the description for BatchApplication
+   */
+  virtual std::string getDescription() const;
+
+  /**
+   * \returns the command arguments
+   */
+  virtual std::vector<std::string> getArgs() const;
+
+  /**
+   * \returns the command options
+   */
+  virtual std::vector<std::string> getOptions() const;
+
+  /**
+   * \returns the command outputs
+   */
+  virtual std::vector< std::pair<std::string, std::string> > getOutputs() const;
+
+  /**
+   * \returns the enum of the application, default MISC_COMMAND
+   */
+  virtual COMMAND_T getCommand() const;
+
+  /**
+   * \returns whether the application needs the output directory or not.
+   */
+  virtual bool needsOutputDirectory() const;
+
+ private:
+
+  /**
+   * Run the command of one line of the batch file, with the parameters
+   * back at their defaults and on a new application object, so that nothing
+   * from the commands before it carries over; returns its return code.
+   */
+  int runCommand(const std::vector<std::string>& words, int line_number);
+
+  AddApplications add_applications_;
+
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -10,6 +10,7 @@
 #include "util/StringUtils.h"
 #include "util/FileUtils.h"
 #include "stdio.h"
+#include <sstream>
 #include "boost/filesystem.hpp"
 
 using namespace std;
@@ -34,6 +35,9 @@ CascadeSearchApplication::~CascadeSearchApplication() {
  */
 int CascadeSearchApplication::main(int argc, char** argv) {
   map<pair<string, unsigned int>, bool>* spectrum_flag = new map<pair<string, unsigned int>, bool>;
+  // The spectra are read and sorted once, in the first round, and each round
+  // leaves only those not yet identified.
+  map<string, SpectrumCollection*> spectrum_store;
 
   carp(CARP_INFO, "Running cascade-search...");
 
@@ -44,9 +48,12 @@ int CascadeSearchApplication::main(int argc, char** argv) {
   int return_code;
   for (unsigned int cascade_cnt = 0; cascade_cnt < database_indices.size(); ++cascade_cnt) {
 
-    //carry out tide-search
+    //carry out tide-search, keeping its results in memory
     TideSearchApplication TideSearchProgram;
+    stringstream target_results, decoy_results;
     TideSearchProgram.setSpectrumFlag(spectrum_flag);
+    TideSearchProgram.setSpectrumStore(&spectrum_store);
+    TideSearchProgram.setResultStreams(&target_results, &decoy_results);
     return_code = TideSearchProgram.main(Params::GetStrings("tide spectra file"), database_indices[cascade_cnt]);
     if (return_code != 0) {
       return return_code;
@@ -63,17 +70,21 @@ int CascadeSearchApplication::main(int argc, char** argv) {
     AssignConfidenceProgram.setOutput(output);
     AssignConfidenceProgram.setIndexName(database_indices[cascade_cnt]);
     AssignConfidenceProgram.setFinalIteration(cascade_cnt + 1 == database_indices.size());
+    if (TideSearchProgram.resultsInMemory()) {
+      AssignConfidenceProgram.setInputStreams(&target_results,
+        decoy_results.tellp() > 0 ? &decoy_results : NULL);
+    }
 
     return_code = AssignConfidenceProgram.main(bridge_file_name);
     if (return_code != 0) {
       return return_code;
     }
     spectrum_flag = AssignConfidenceProgram.getSpectrumFlag();
+    removeIdentified(*spectrum_flag, &spectrum_store);
 
-    //remove tide-search and assign-confidence output files.
-    string outputdir = Params::GetString("output-dir");
-    RemoveTempFiles(outputdir, TideSearchProgram.getName());
-    RemoveTempFiles(outputdir, AssignConfidenceProgram.getName());
+    // Remove what tide-search wrote to disk: binary results, and the QC
+    // report and the like, which the next round writes again.
+    RemoveTempFiles(Params::GetString("output-dir"), TideSearchProgram.getName());
 
     int numAccepted = AssignConfidenceProgram.getAcceptedPSMs();
     if (numAccepted < CASCADE_TERMINATION_CONDITION) {
@@ -86,10 +97,44 @@ int CascadeSearchApplication::main(int argc, char** argv) {
 
   }
   delete output;
+  for (map<string, SpectrumCollection*>::iterator i = spectrum_store.begin();
+       i != spectrum_store.end();
+       ++i) {
+    delete i->second;
+  }
 
   return 0;
 }
 
+/**
+ * Removes the spectrum-charge pairs accepted so far from the stored spectra,
+ * so that later rounds neither keep nor iterate over them.
+ */
+void CascadeSearchApplication::removeIdentified(
+  const map<pair<string, unsigned int>, bool>& spectrum_flag,
+  map<string, SpectrumCollection*>* spectrum_store
+) {
+  for (map<string, SpectrumCollection*>::iterator i = spectrum_store->begin();
+       i != spectrum_store->end();
+       ++i) {
+    const vector<SpectrumCollection::SpecCharge>* spec_charges = i->second->SpecCharges();
+    vector<char> removed(spec_charges->size(), 0);
+    int num_removed = 0;
+    for (size_t j = 0; j < spec_charges->size(); j++) {
+      const SpectrumCollection::SpecCharge& sc = (*spec_charges)[j];
+      if (spectrum_flag.find(pair<string, unsigned int>(i->first,
+            sc.spectrum->SpectrumNumber() * 10 + sc.charge)) != spectrum_flag.end()) {
+        removed[j] = 1;
+        ++num_removed;
+      }
+    }
+    i->second->RemoveSpecCharges(removed);
+    carp(CARP_DEBUG, "Keeping %d spectrum-charge combinations of %s for the next "
+         "round; %d were identified.", (int)spec_charges->size(), i->first.c_str(),
+         num_removed);
+  }
+}
+
 /**
  * \returns the command name for CascadeSearchApplication
  */
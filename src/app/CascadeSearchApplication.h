@@ -9,8 +9,11 @@
 
 #include "CruxApplication.h"
 
+#include <map>
 #include <string>
 
+class SpectrumCollection;
+
 class CascadeSearchApplication: public CruxApplication {
 
  public:
@@ -73,6 +76,15 @@ class CascadeSearchApplication: public CruxApplication {
   virtual void processParams();
   void RemoveTempFiles(const std::string& path, const std::string& prefix);
 
+  /**
+   * Removes the spectrum-charge pairs accepted so far from the stored spectra,
+   * so that later rounds neither keep nor iterate over them.
+   */
+  static void removeIdentified(
+    const std::map<std::pair<std::string, unsigned int>, bool>& spectrum_flag,
+    std::map<std::string, SpectrumCollection*>* spectrum_store
+  );
+
 
   static const int CASCADE_TERMINATION_CONDITION;
 
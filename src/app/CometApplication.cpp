@@ -4,6 +4,7 @@
  *****************************************************************************/
 #include "CometSearch/Common.h"
 #include "CometSearch/CometSearchManager.h"
+#include "MSReader.h"
 #include "util/AminoAcidUtil.h"
 #include "util/CarpStreamBuf.h"
 #include "util/FileUtils.h"
@@ -13,6 +14,7 @@
 #include "ParamMedicApplication.h"
 #include "io/DelimitedFileWriter.h"
 #include "io/DelimitedFile.h"
+#include "io/SpectrumCache.h"
 
 using namespace std;
 
@@ -156,6 +158,58 @@ void CometApplication::setEnzyme(
   searchManager_.SetParam(param, "TODO", e);
 }
 
+/**
+ * \returns the file for Comet to read the spectra of spectrum_file from
+ */
+string CometApplication::getCachedSpectrumFile(
+  const string& cache_dir,
+  const string& spectrum_file
+  ) {
+  // The MS2 formats keep no activation method, so the cached copy would lose
+  // what activation_method selects on
+  if (cache_dir.empty() || Params::GetString("activation_method") != "ALL" ||
+      StringUtils::IEndsWith(spectrum_file, ".ms2") ||
+      StringUtils::IEndsWith(spectrum_file, ".cms2") ||
+      StringUtils::IEndsWith(spectrum_file, ".mgf")) {
+    return spectrum_file;
+  }
+  vector<string> conversion_params(1, "ms_level");
+  string cached = SpectrumCache::Path(cache_dir, spectrum_file, "cms2",
+                                      conversion_params);
+  if (FileUtils::Exists(cached)) {
+    carp(CARP_INFO, "Using cached spectrum file %s for %s",
+         cached.c_str(), spectrum_file.c_str());
+    return cached;
+  }
+
+  carp(CARP_INFO, "Converting %s to a cached cms2 file", spectrum_file.c_str());
+  MSToolkit::MSReader reader;
+  MSToolkit::Spectrum spectrum;
+  reader.setFilter(Params::GetInt("ms_level") == 3 ? MSToolkit::MS3 : MSToolkit::MS2);
+  if (!reader.readFile(spectrum_file.c_str(), spectrum)) {
+    // Let Comet read the file itself, and report what is wrong with it
+    carp(CARP_WARNING, "Could not convert %s, searching it uncached",
+         spectrum_file.c_str());
+    return spectrum_file;
+  }
+  MSToolkit::MSObject spectra;
+  while (spectrum.getScanNumber() != 0) {
+    spectra.add(spectrum);
+    reader.readFile(NULL, spectrum);
+  }
+  // Written under another name first, so that a search that stops partway
+  // does not leave a truncated file to be reused
+  string tmp = cached + ".tmp";
+  if (!reader.writeFile(tmp.c_str(), MSToolkit::cms2, spectra)) {
+    carp(CARP_WARNING, "Could not write %s, searching %s uncached",
+         tmp.c_str(), spectrum_file.c_str());
+    FileUtils::Remove(tmp);
+    return spectrum_file;
+  }
+  FileUtils::Rename(tmp, cached);
+  return cached;
+}
+
 /**
  * Sets the parameters for the Comet application using the crux parameters
  */
@@ -173,12 +227,13 @@ void CometApplication::setCometParameters(
     last_scan = StringUtils::FromString<int>(tokens[1]);
   }
 
+  string cache_dir = SpectrumCache::Dir();
   for (vector<string>::const_iterator i = spec_files.begin(); i != spec_files.end(); i++) {
     if (!FileUtils::Exists(*i)) {
       carp(CARP_FATAL, "Spectra File Not Found:%s", i->c_str());
     }
     InputFileInfo* pInputFile = new InputFileInfo();
-    strcpy(pInputFile->szFileName, i->c_str());
+    strcpy(pInputFile->szFileName, getCachedSpectrumFile(cache_dir, *i).c_str());
     pInputFile->iAnalysisType = analysis_type;
     if (analysis_type == AnalysisType_SpecificScanRange) {
       pInputFile->iFirstScan = first_scan;
@@ -330,6 +385,7 @@ vector<string> CometApplication::getOptions() const {
     "output-dir",
     "overwrite",
     "parameter-file",
+    "spectrum-cache-dir",
     "verbosity",
     // Database
     "decoy_search",
@@ -30,6 +30,15 @@ class CometApplication: public CruxApplication {
                  const std::string& sampleParam,
                  const std::string& missedCleavageParam);
 
+  /**
+   * \returns the file for Comet to read the spectra of spectrum_file from:
+   * a compressed MS2 copy in cache_dir, converted now if no previous search
+   * has done so, or spectrum_file itself if it is as quick to parse or
+   * cache_dir is "".
+   */
+  std::string getCachedSpectrumFile(const std::string& cache_dir,
+                                    const std::string& spectrum_file);
+
  public:
 
   /**
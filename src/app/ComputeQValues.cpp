@@ -4,12 +4,35 @@
  *****************************************************************************/
 #include "ComputeQValues.h"
 #include "io/OutputFiles.h"
+#include "util/ParallelSort.h"
 #include "util/Params.h"
 #include "PosteriorEstimator.h"
 
 
 using namespace std;
 
+namespace {
+
+// Orders positions in the targets followed by the decoys as
+// getScoreVector() orders their (score, is_target) pairs.
+struct ScoreLabelOrder {
+  ScoreLabelOrder(const vector<FLOAT_T>& targets, const vector<FLOAT_T>& decoys,
+                  bool ascending)
+    : targets_(&targets), decoys_(&decoys), ascending_(ascending) {}
+  pair<double, bool> label(size_t i) const {
+    return i < targets_->size() ? make_pair((double) (*targets_)[i], true) :
+      make_pair((double) (*decoys_)[i - targets_->size()], false);
+  }
+  bool operator()(size_t x, size_t y) const {
+    return ascending_ ? label(x) < label(y) : label(y) < label(x);
+  }
+  const vector<FLOAT_T>* targets_;
+  const vector<FLOAT_T>* decoys_;
+  bool ascending_;
+};
+
+}  // namespace
+
 /**
  * \returns a blank ComputeQValues object
  */
@@ -56,8 +79,23 @@ vector<double> ComputeQValues::compute_PEP(
     carp(CARP_FATAL, "Cannot compute PEP without target or decoy scores.");
   }
 
-  vector< pair<double, bool> > score_labels =
-    getScoreVector(target_scores, decoy_scores, ascending);
+  // Sort the positions of the scores, targets before decoys, in the order
+  // of getScoreVector(), so that the place of each target in score_labels is
+  // known without searching for it.
+  size_t num_targets = target_scores.size();
+  vector<size_t> order(num_targets + decoy_scores.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  ScoreLabelOrder labels(target_scores, decoy_scores, ascending);
+  ParallelSort::Sort(order.begin(), order.end(), labels);
+  vector< pair<double, bool> > score_labels(order.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    score_labels[i] = labels.label(order[i]);
+  }
+  if (ascending) {
+    PosteriorEstimator::setReversed(true);
+  }
   double pi0 = estimatePi0(score_labels);
 
   // estimate PEPs
@@ -70,29 +108,17 @@ vector<double> ComputeQValues::compute_PEP(
 
   // now score_labels and PEPs are similarly sorted
 
-  // pull out the PEPs in the order that the scores were given
+  // pull out the PEPs in the order that the scores were given; equal
+  // targets all take the PEP of the first of them
   vector<double> pep(PEP_vector.size(), 0);
-  for (int target_idx = 0; target_idx < target_scores.size(); target_idx++) {
-    // the score to return next    
-    double curr_target_score = target_scores[target_idx];
-
-    // find its position in score_labels
-    vector< pair<double, bool> >::iterator found_score_pos;
-    if (ascending) {
-      found_score_pos 
-        = lower_bound(score_labels.begin(), score_labels.end(), 
-                      make_pair(curr_target_score, true));
-    } else {
-      found_score_pos 
-        = lower_bound(score_labels.begin(), score_labels.end(), 
-                    make_pair(curr_target_score, true),
-                    greater<pair<double, bool> >()); 
+  size_t first_equal = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    if (score_labels[i] != score_labels[first_equal]) {
+      first_equal = i;
+    }
+    if (order[i] < num_targets) {
+      pep[order[i]] = PEP_vector[first_equal];
     }
-
-    size_t found_index = distance(score_labels.begin(), found_score_pos);
-
-    // pull out the PEP at the same position in PEP_vector
-    pep[target_idx] = PEP_vector[found_index];
   }
   return pep;
 }
@@ -114,10 +140,10 @@ vector< pair<double, bool> > ComputeQValues::getScoreVector(
 
   // sort them 
   if (ascending) {
-    sort(scores.begin(), scores.end());
+    ParallelSort::Sort(scores.begin(), scores.end(), less< pair<double, bool> >());
     PosteriorEstimator::setReversed(true);
   } else {
-    sort(scores.begin(), scores.end(), greater< pair<double, bool> > ());
+    ParallelSort::Sort(scores.begin(), scores.end(), greater< pair<double, bool> >());
   }
 
   return scores;
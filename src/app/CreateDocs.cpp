@@ -36,10 +36,13 @@
 #include "StatColumn.h"
 #include "TideIndexApplication.h"
 #include "TideSearchApplication.h"
+#include "TideServerApplication.h"
+#include "TideLibrarySearchApplication.h"
 #include "CometApplication.h"
 #include "app/CascadeSearchApplication.h"
 #include "app/AssignConfidenceApplication.h"
 #include "app/SubtractIndexApplication.h"
+#include "app/BatchApplication.h"
 
 using namespace std;
 
@@ -53,6 +56,7 @@ int CreateDocs::main(int argc, char** argv) {
   CruxApplicationList apps("crux");
   apps.add(new AssignConfidenceApplication());
   apps.add(new Barista());
+  apps.add(new BatchApplication());
   apps.add(new CascadeSearchApplication());  
   apps.add(new CometApplication());
   apps.add(new CreateDocs());
@@ -79,6 +83,8 @@ int CreateDocs::main(int argc, char** argv) {
   apps.add(new SubtractIndexApplication());
   apps.add(new TideIndexApplication());
   apps.add(new TideSearchApplication());
+  apps.add(new TideServerApplication());
+  apps.add(new TideLibrarySearchApplication());
   apps.add(new XLinkAssignIons());
   apps.add(new XLinkScoreSpectrum());
   
@@ -14,6 +14,7 @@
 #include "util/Params.h"
 #include "util/StringUtils.h"
 #include "util/GlobalParams.h"
+#include "util/MetricsServer.h"
 #include "util/WinCrux.h"
 
 #include <iostream>
@@ -110,11 +111,14 @@ void CruxApplication::initialize(int argc, char** argv) {
     // Post data to Google Analytics using a separate thread
     boost::thread analytics_thread(postToAnalytics, getName());
   }
+  if (Params::GetInt("metrics-port") > 0) {
+    MetricsServer::Start(Params::GetString("metrics-address"), Params::GetInt("metrics-port"));
+  }
 
   if (needsOutputDirectory()) {
     // Write the parameter file
     string paramFile = make_file_path(getFileStem() + ".params.txt");
-    ofstream* file = FileUtils::GetWriteStream(paramFile, Params::GetBool("overwrite"));
+    ostream* file = FileUtils::GetWriteStream(paramFile, Params::GetBool("overwrite"));
     if (file == NULL) {
       throw runtime_error("Could not open " + paramFile + " for writing");
     }
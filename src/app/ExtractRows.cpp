@@ -7,8 +7,11 @@
 #include "ExtractRows.h"
 
 #include <iostream>
+#include <stdexcept>
+#include <boost/thread.hpp>
 
 #include "io/DelimitedFileReader.h"
+#include "io/DelimitedFileScan.h"
 #include "io/DelimitedFile.h"
 #include "io/carp.h"
 #include "parameter.h"
@@ -60,6 +63,168 @@ bool passesThreshold(
   return false;
 }
 
+/**
+ * Sets passes[i] to whether values[i] op threshold, for a block of values
+ * at once.
+ */
+template<typename TValue>
+static void evaluateBlock(
+  const vector<TValue>& values,
+  TValue threshold,
+  COMPARISON_T comparison,
+  vector<char>* passes) {
+
+  passes->resize(values.size());
+  size_t num_values = values.size();
+  switch (comparison) {
+    case COMPARISON_LT:
+      for (size_t i = 0; i < num_values; i++) {
+        (*passes)[i] = values[i] < threshold;
+      }
+      break;
+    case COMPARISON_LTE:
+      for (size_t i = 0; i < num_values; i++) {
+        (*passes)[i] = values[i] <= threshold;
+      }
+      break;
+    case COMPARISON_EQ:
+      for (size_t i = 0; i < num_values; i++) {
+        (*passes)[i] = values[i] == threshold;
+      }
+      break;
+    case COMPARISON_GTE:
+      for (size_t i = 0; i < num_values; i++) {
+        (*passes)[i] = values[i] >= threshold;
+      }
+      break;
+    case COMPARISON_GT:
+      for (size_t i = 0; i < num_values; i++) {
+        (*passes)[i] = values[i] > threshold;
+      }
+      break;
+    case COMPARISON_NEQ:
+      for (size_t i = 0; i < num_values; i++) {
+        (*passes)[i] = values[i] != threshold;
+      }
+      break;
+    case NUMBER_COMPARISONS:
+    case COMPARISON_INVALID:
+      carp(CARP_FATAL, "Invalid comparison type!");
+  }
+}
+
+/**
+ * Filters the blocks of a mapped file: each block's fields are parsed into
+ * values, the comparison is evaluated over all of them, and the rows that
+ * pass are gathered into the block's output, which is printed in file
+ * order. A field that is not a number stops the block there, and is thrown
+ * once the rows before it are printed, as the row-by-row loop would.
+ */
+class ExtractRowsVisitor : public ScanVisitor {
+ public:
+  ExtractRowsVisitor(COLTYPE_T column_type, COMPARISON_T comparison,
+                     const string& column_value, int num_slots)
+    : column_type_(column_type), comparison_(comparison), column_value_(column_value),
+      int_value_(0), float_value_(0), slots_(num_slots) {
+    if (column_type_ == COLTYPE_INT) {
+      int_value_ = StringUtils::FromString<int>(column_value);
+    } else if (column_type_ == COLTYPE_REAL) {
+      float_value_ = StringUtils::FromString<FLOAT_T>(column_value);
+    }
+  }
+
+  virtual void visit(size_t slot, const ScanBlock& block) {
+    Slot& out = slots_[slot];
+    size_t num_rows = block.row_begin.size();
+    out.bad_field.clear();
+    out.failed = false;
+    size_t parsed = num_rows;
+    switch (column_type_) {
+      case COLTYPE_INT:
+        out.ints.resize(num_rows);
+        for (size_t i = 0; i < num_rows && parsed == num_rows; i++) {
+          if (!DelimitedFileReader::TryInteger(block.field_begin[i], block.field_end[i],
+                                               &out.ints[i])) {
+            parsed = i;
+          }
+        }
+        out.ints.resize(parsed);
+        evaluateBlock(out.ints, int_value_, comparison_, &out.passes);
+        break;
+      case COLTYPE_REAL:
+        out.floats.resize(num_rows);
+        for (size_t i = 0; i < num_rows && parsed == num_rows; i++) {
+          if (!DelimitedFileReader::TryFloat(block.field_begin[i], block.field_end[i],
+                                             &out.floats[i])) {
+            parsed = i;
+          }
+        }
+        out.floats.resize(parsed);
+        evaluateBlock(out.floats, float_value_, comparison_, &out.passes);
+        break;
+      default:
+        out.passes.resize(num_rows);
+        for (size_t i = 0; i < num_rows; i++) {
+          size_t length = block.field_end[i] - block.field_begin[i];
+          // compare() orders the value against the field; rows pass on field op value
+          int field_vs_value =
+            -column_value_.compare(0, string::npos, block.field_begin[i], length);
+          bool passes = false;
+          switch (comparison_) {
+            case COMPARISON_LT: passes = field_vs_value < 0; break;
+            case COMPARISON_LTE: passes = field_vs_value <= 0; break;
+            case COMPARISON_EQ: passes = field_vs_value == 0; break;
+            case COMPARISON_GTE: passes = field_vs_value >= 0; break;
+            case COMPARISON_GT: passes = field_vs_value > 0; break;
+            case COMPARISON_NEQ: passes = field_vs_value != 0; break;
+            default:
+              carp(CARP_FATAL, "Invalid comparison type!");
+          }
+          out.passes[i] = passes;
+        }
+        break;
+    }
+    if (parsed < num_rows) {
+      out.failed = true;
+      out.bad_field.assign(block.field_begin[parsed], block.field_end[parsed]);
+    }
+    out.rows.clear();
+    for (size_t i = 0; i < parsed; i++) {
+      if (out.passes[i]) {
+        out.rows.append(block.row_begin[i], block.row_end[i]);
+        out.rows += '\n';
+      }
+    }
+  }
+
+  virtual bool finish(size_t slot) {
+    Slot& out = slots_[slot];
+    cout.write(out.rows.data(), out.rows.size());
+    if (out.failed) {
+      cout.flush();
+      throw runtime_error("Could not convert string '" + out.bad_field + "'");
+    }
+    return true;
+  }
+
+ private:
+  struct Slot {
+    vector<int> ints;
+    vector<FLOAT_T> floats;
+    vector<char> passes;
+    string rows;
+    bool failed;
+    string bad_field;
+  };
+
+  COLTYPE_T column_type_;
+  COMPARISON_T comparison_;
+  string column_value_;
+  int int_value_;
+  FLOAT_T float_value_;
+  vector<Slot> slots_;
+};
+
 /**
  * main method for ExtractRows
  */
@@ -73,6 +238,10 @@ int ExtractRows::main(int argc, char** argv) {
   COLTYPE_T column_type = get_column_type_parameter("column-type");
   COMPARISON_T comparison = get_comparison_parameter("comparison");
   char delimiter = get_delimiter_parameter("delimiter");
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = max(1, (int)boost::thread::hardware_concurrency());
+  }
 
 
   DelimitedFileReader delimited_file(delimited_filename, true, delimiter);
@@ -83,6 +252,10 @@ int ExtractRows::main(int argc, char** argv) {
       column_name.c_str(),
       delimited_file.getAvailableColumnsString().c_str());
   }
+  if (column_type != COLTYPE_INT && column_type != COLTYPE_REAL &&
+      column_type != COLTYPE_STRING) {
+    carp(CARP_FATAL, "Unknown column type");
+  }
 
   if (Params::GetBool("header")) {
     cout << delimited_file.getHeaderString() << endl;
@@ -90,6 +263,15 @@ int ExtractRows::main(int argc, char** argv) {
 
   string column_value_str = Params::GetString("column value");
 
+  // Files that can be mapped are scanned in parallel blocks.
+  DelimitedFileScan scan;
+  if (scan.open(delimited_filename, delimiter)) {
+    ExtractRowsVisitor visitor(column_type, comparison, column_value_str, num_threads);
+    scan.scan(column_idx, num_threads, &visitor);
+    cout.flush();
+    return 0;
+  }
+
   while (delimited_file.hasNext()) {
     bool passes = false;
     switch(column_type) {
@@ -164,6 +346,7 @@ vector<string> ExtractRows::getOptions() const {
     "header",
     "comparison",
     "column-type",
+    "num-threads",
     "verbosity"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
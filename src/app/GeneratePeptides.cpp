@@ -1,15 +1,21 @@
 #include "GeneratePeptides.h"
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "parameter.h"
 #include "model/ProteinPeptideIterator.h"
 #include "util/mass.h"
 #include "util/FileUtils.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
+#include "util/ThreadPool.h"
 
 using namespace std;
 
 MASS_TYPE_T GeneratePeptides::massType_ = AVERAGE;
 
+// proteins read from the FASTA and cleaved on the threads at a time
+static const size_t kProteinsPerBatch = 4096;
+
 GeneratePeptides::GeneratePeptides() {
 }
 
@@ -26,12 +32,13 @@ int GeneratePeptides::main(int argc, char** argv) {
   massType_ = get_mass_type_parameter("isotopic-mass");
   bool overwrite = Params::GetBool("overwrite");
 
-  string targetsFile = make_file_path("generate-peptides.target.txt");
-  string decoysFile = make_file_path("generate-peptides.decoy.txt");
+  string extension = Params::GetBool("compress-output") ? ".txt.gz" : ".txt";
+  string targetsFile = make_file_path("generate-peptides.target" + extension);
+  string decoysFile = make_file_path("generate-peptides.decoy" + extension);
 
-  ofstream* targetPeptides = create_stream_in_path(targetsFile.c_str(), NULL, overwrite);
-  ofstream* decoyPeptides = decoyType != NO_DECOYS
-    ? create_stream_in_path(decoysFile.c_str(), NULL, overwrite)
+  ostream* targetPeptides = createPeptideList(targetsFile, overwrite);
+  ostream* decoyPeptides = decoyType != NO_DECOYS
+    ? createPeptideList(decoysFile, overwrite)
     : NULL;
 
   string decoyFastaPath = canGenerateDecoyProteins()
@@ -42,11 +49,55 @@ int GeneratePeptides::main(int argc, char** argv) {
   return 0;
 }
 
+/**
+ * Opens a peptide list for writing, gzipped if its name ends in .gz.
+ * Exits if the file exists and overwrite is false.
+ */
+ostream* GeneratePeptides::createPeptideList(
+  const string& path, ///< path of the list
+  bool overwrite ///< replace the file if it exists
+) {
+  if (FileUtils::Exists(path)) {
+    if (!overwrite) {
+      carp(CARP_FATAL, "The file '%s' already exists and cannot be overwritten. "
+           "Use --overwrite T to replace or choose a different output file name",
+           path.c_str());
+    }
+    carp(CARP_WARNING, "The file '%s' already exists and will be overwritten.", path.c_str());
+  }
+  ostream* out = FileUtils::GetWriteStream(path, true);
+  if (out == NULL) {
+    carp(CARP_FATAL, "Failed to create and open file: %s", path.c_str());
+  }
+  return out;
+}
+
+/**
+ * Cleaves the proteins thread, thread + numThreads, ... of sequences,
+ * storing the peptides of each in the same place in cleaved.
+ */
+void GeneratePeptides::cleaveProteins(
+  const vector<string>* sequences, ///< Protein sequences to cleave
+  size_t thread, ///< first protein to cleave
+  size_t numThreads, ///< proteins between those this thread cleaves
+  ENZYME_T enzyme,  ///< Enzyme to use for cleavage
+  DIGEST_T digest,  ///< Digestion to use for cleavage
+  int missedCleavages,  ///< Maximum allowed missed cleavages
+  int minLength,  //< Min length of peptides to return
+  int maxLength,  //< Max length of peptides to return
+  vector< vector<CleavedPeptide> >* cleaved  ///< peptides of each protein
+) {
+  for (size_t i = thread; i < sequences->size(); i += numThreads) {
+    (*cleaved)[i] = cleaveProtein((*sequences)[i], enzyme, digest,
+                                  missedCleavages, minLength, maxLength);
+  }
+}
+
 void GeneratePeptides::processFasta(
   const string& fastaPath,
-  ofstream* targetList,
+  ostream* targetList,
   const string& decoyFastaPath,
-  ofstream* decoyList,
+  ostream* decoyList,
   DECOY_TYPE_T decoyType
 ) {
   double minMass = Params::GetDouble("min-mass");
@@ -76,42 +127,79 @@ void GeneratePeptides::processFasta(
   map< OrderedPeptide, vector<string> > peptideToProtein;
   int proteinTotal = 0, peptideTotal = 0;
 
-  // Iterate over all proteins from this FASTA
-  while (true) {
-    string id, proteinSequence;
-    if (!getNextProtein(*fasta, &id, &proteinSequence)) {
-      break;
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = boost::thread::hardware_concurrency();
+  }
+  numThreads = max(1, numThreads);
+  // The amino acid masses are set up on first use, which must not be on the
+  // threads.
+  get_mass_amino_acid('A', massType_);
+
+  // Read the proteins from this FASTA in batches; each batch is cleaved on
+  // the threads, and its peptides are then collected in protein order
+  vector<string> ids, sequences;
+  vector< vector<CleavedPeptide> > cleaved;
+  bool more = true;
+  while (more) {
+    ids.clear();
+    sequences.clear();
+    while (ids.size() < kProteinsPerBatch) {
+      string id, proteinSequence;
+      if (!getNextProtein(*fasta, &id, &proteinSequence)) {
+        more = false;
+        break;
+      }
+      ids.push_back(id);
+      sequences.push_back(proteinSequence);
     }
-    ++proteinTotal;
-    carp(CARP_DEBUG, "Read %s", id.c_str());
-
-    // Get peptides
-    vector<CleavedPeptide> peptides =
-      cleaveProtein(proteinSequence, enzyme, digest, missed, minLen, maxLen);
-    peptideTotal += peptides.size();
-
-    // Write reversed protein to decoy FASTA, if protein reverse
-    if (decoyFasta && proteinReverse) {
-      reverse(proteinSequence.begin(), proteinSequence.end());
-      *decoyFasta << '>' << decoyPrefix << id << endl
-                  << proteinSequence << endl;
+    if (ids.empty()) {
+      break;
     }
 
-    // Iterate over all peptides from this protein
-    for (vector<CleavedPeptide>::const_iterator i = peptides.begin();
-         i != peptides.end();
-         i++) {
-      FLOAT_T mass = i->Mass();
-      if (mass < minMass || mass > maxMass) {
-        carp(CARP_DETAILED_DEBUG, "Skipping peptide with mass %f", mass);
-        continue;
+    cleaved.assign(ids.size(), vector<CleavedPeptide>());
+    size_t batchThreads = min((size_t)numThreads, ids.size());
+    ThreadPool::TaskGroup threads;
+    for (size_t t = 1; t < batchThreads; t++) {
+      threads.Run(boost::bind(&GeneratePeptides::cleaveProteins, &sequences,
+        t, batchThreads, enzyme, digest, missed, minLen, maxLen, &cleaved));
+    }
+    cleaveProteins(&sequences, 0, batchThreads, enzyme, digest, missed, minLen, maxLen,
+                   &cleaved);
+    threads.Wait();
+
+    for (size_t p = 0; p < ids.size(); p++) {
+      const string& id = ids[p];
+      string& proteinSequence = sequences[p];
+      ++proteinTotal;
+      carp(CARP_DEBUG, "Read %s", id.c_str());
+
+      const vector<CleavedPeptide>& peptides = cleaved[p];
+      peptideTotal += peptides.size();
+
+      // Write reversed protein to decoy FASTA, if protein reverse
+      if (decoyFasta && proteinReverse) {
+        reverse(proteinSequence.begin(), proteinSequence.end());
+        *decoyFasta << '>' << decoyPrefix << id << endl
+                    << proteinSequence << endl;
       }
-      const string& sequence = i->Sequence();
-      pair<set<string>::iterator, bool> insert = targets.insert(sequence);
-      if (insert.second) {
-        peptideToProtein[*i] = vector<string>(1, id);
-      } else {
-        peptideToProtein[*i].push_back(id);
+
+      // Iterate over all peptides from this protein
+      for (vector<CleavedPeptide>::const_iterator i = peptides.begin();
+           i != peptides.end();
+           i++) {
+        FLOAT_T mass = i->Mass();
+        if (mass < minMass || mass > maxMass) {
+          carp(CARP_DETAILED_DEBUG, "Skipping peptide with mass %f", mass);
+          continue;
+        }
+        const string& sequence = i->Sequence();
+        pair<set<string>::iterator, bool> insert = targets.insert(sequence);
+        if (insert.second) {
+          peptideToProtein[*i] = vector<string>(1, id);
+        } else {
+          peptideToProtein[*i].push_back(id);
+        }
       }
     }
   }
@@ -558,6 +646,8 @@ vector<string> GeneratePeptides::getOptions() const {
     "decoy-prefix",
     "keep-terminal-aminos",
     "mod-precision",
+    "num-threads",
+    "compress-output",
     "overwrite",
     "fileroot",
     "output-dir",
@@ -573,7 +663,8 @@ vector< pair<string, string> > GeneratePeptides::getOutputs() const {
     "A text file containing the target peptides, one per line. Each line has "
     "three tab-delimited columns, containing the peptide sequence, the m+h "
     "mass of the unmodified peptide, and a comma-delimited list of protein IDs "
-    "in which the peptide occurs."));
+    "in which the peptide occurs. With compress-output, the file is gzipped "
+    "and its name ends in .gz."));
   outputs.push_back(make_pair("generate-peptides.decoy.txt",
     "A text file containing the decoy peptides, one per line. Each line has "
     "three tab-delimited columns, containing the peptide sequence, the m+h "
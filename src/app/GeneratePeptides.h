@@ -58,12 +58,21 @@ class GeneratePeptides : public CruxApplication {
 
   void processFasta(
     const std::string& fastaPath,
-    std::ofstream* targetList,
+    std::ostream* targetList,
     const std::string& decoyFastaPath,
-    std::ofstream* decoyList,
+    std::ostream* decoyList,
     DECOY_TYPE_T decoyType
   );
 
+  /**
+   * Opens a peptide list for writing, gzipped if its name ends in .gz.
+   * Exits if the file exists and overwrite is false.
+   */
+  static std::ostream* createPeptideList(
+    const std::string& path, ///< path of the list
+    bool overwrite ///< replace the file if it exists
+  );
+
   /**
    * Check if we can generate decoy proteins with the current settings.
    */
@@ -96,6 +105,22 @@ class GeneratePeptides : public CruxApplication {
    * Makes a decoy from the sequence.
    * Returns false on failure, and decoyOut will be the same as seq.
    */
+  /**
+   * Cleaves the proteins thread, thread + numThreads, ... of sequences,
+   * storing the peptides of each in the same place in cleaved.
+   */
+  static void cleaveProteins(
+    const std::vector<std::string>* sequences, ///< Protein sequences to cleave
+    size_t thread, ///< first protein to cleave
+    size_t numThreads, ///< proteins between those this thread cleaves
+    ENZYME_T enzyme,  ///< Enzyme to use for cleavage
+    DIGEST_T digest,  ///< Digestion to use for cleavage
+    int missedCleavages,  ///< Maximum allowed missed cleavages
+    int minLength,  //< Min length of peptides to return
+    int maxLength,  //< Max length of peptides to return
+    std::vector< std::vector<CleavedPeptide> >* cleaved  ///< peptides of each protein
+  );
+
   static bool makeDecoy(
     const std::string& seq, ///< sequence to make decoy from
     const std::set<std::string>& targetSeqs,  ///< targets to check against
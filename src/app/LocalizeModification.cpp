@@ -8,10 +8,79 @@
 #include "io/SpectrumRecordSpectrumCollection.h"
 #include "io/SpectrumRecordWriter.h"
 #include "util/StringUtils.h"
+#include "util/ThreadPool.h"
 #include "TideSearchApplication.h"
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
+// Matches whose evidence vectors are computed together; they use the
+// memory of about two evidence vectors each.
+static const size_t kMatchesPerWindow = 1024;
+
+struct LocalizeGroup;
+
+/**
+ * A match, and the evidence vectors it is scored against: the first for
+ * the unmodified peptide, the second for the modified ones.
+ */
+struct LocalizeJob {
+  explicit LocalizeJob(Crux::Match* m)
+    : match(m), spectrum(NULL), group(NULL), unmodifiedBin(0), modifiedBin(-1),
+      unmodifiedEvidence(NULL), modifiedEvidence(NULL) {}
+  Crux::Match* match;
+  Spectrum* spectrum; ///< NULL if it has no peaks
+  LocalizeGroup* group;
+  int unmodifiedBin;
+  int modifiedBin; ///< -1 if no modified peptides are scored
+  const vector<double>* unmodifiedEvidence;
+  const vector<double>* modifiedEvidence;
+};
+
+/**
+ * The matches to one spectrum that share its preprocessing, which depends
+ * on the spectrum and the largest precursor mass bin.
+ */
+struct LocalizeGroup {
+  LocalizeGroup(const Spectrum* spectrum, int maxPrecursorMass, double binWidth,
+                double binOffset)
+    : cache(binWidth, binOffset) {
+    cache.SetSpectrum(spectrum, maxPrecursorMass);
+  }
+  EvidenceCache cache;
+  vector<LocalizeJob*> jobs;
+};
+
+/**
+ * Computes the evidence vectors of the next groups not yet taken, until
+ * there are none.
+ */
+static void computeEvidence(
+  vector<LocalizeGroup*>* groups,
+  size_t* nextGroup,
+  boost::mutex* groupMutex
+) {
+  while (true) {
+    LocalizeGroup* group;
+    {
+      boost::mutex::scoped_lock lock(*groupMutex);
+      if (*nextGroup >= groups->size()) {
+        return;
+      }
+      group = (*groups)[(*nextGroup)++];
+    }
+    for (vector<LocalizeJob*>::iterator i = group->jobs.begin(); i != group->jobs.end(); i++) {
+      LocalizeJob* job = *i;
+      int charge = job->match->getCharge();
+      job->unmodifiedEvidence = &group->cache.Evidence(charge, job->unmodifiedBin);
+      if (job->modifiedBin >= 0) {
+        job->modifiedEvidence = &group->cache.Evidence(charge, job->modifiedBin);
+      }
+    }
+  }
+}
+
 LocalizeModificationApplication::LocalizeModificationApplication() {
   for (int i = 0; i <= 100; i++) {
     progress_.insert(i);
@@ -31,6 +100,10 @@ LocalizeModificationApplication::~LocalizeModificationApplication() {
  *       where the modification is (spectrum neutral mass - peptide mass)
  *     - Score each of these modified peptides against the spectrum
  *     - Report to output file
+ *   The matches are taken in windows. Each spectrum of a window is
+ *   preprocessed once for all of its matches, and the evidence vectors are
+ *   computed on num-threads threads; the peptides are then scored and
+ *   written in order.
  */
 int LocalizeModificationApplication::main(int argc, char** argv) {
   string inputFile = Params::GetString("input PSM file");
@@ -99,101 +172,175 @@ int LocalizeModificationApplication::main(int argc, char** argv) {
   tps.binOffset_ = binOffset;
 
   int topMatch = Params::GetInt("top-match");
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = max(1, (int)boost::thread::hardware_concurrency());
+  }
+  double minModMass = Params::GetDouble("min-mod-mass");
   uint64_t curStep = 0;
+  // The bins of the evidence vectors depend only on the bin width and
+  // offset, which every match's MassConstants::Init() sets alike.
+  vector<LocalizeJob> jobs;
   matchIter = new MatchIterator(matches);
-  while (matchIter->hasNext()) {
-    Crux::Match* match = matchIter->next();
-    Crux::Spectrum* cruxSpectrum = match->getSpectrum();
-    int scan = match->getSpectrum()->getFirstScan();
-    string spectrumFile = match->getFilePath();
-    Crux::SpectrumCollection* collection = spectrumCollections[spectrumFile];
-    if ((cruxSpectrum = collection->getSpectrum(scan)) == NULL) {
-      carp(CARP_FATAL, "Spectrum %d not found in %s", scan, spectrumFile.c_str());
-    } else if (cruxSpectrum->getNumPeaks() == 0) {
-      delete cruxSpectrum;
-      carp(CARP_WARNING, "Spectrum %d had 0 peaks, skipping", scan);
+  VariableModTable* firstModTable = NULL;
+  while (matchIter->hasNext() || !jobs.empty()) {
+    // Read a window of matches, and the spectra they need
+    if (matchIter->hasNext() && jobs.size() < kMatchesPerWindow) {
+      Crux::Match* match = matchIter->next();
+      if (firstModTable == NULL) {
+        firstModTable = getModTable(match);
+        MassConstants::Init(firstModTable->ParsedModTable(),
+                            firstModTable->ParsedNtpepModTable(),
+                            firstModTable->ParsedCtpepModTable(), binWidth, binOffset);
+      }
+      jobs.push_back(LocalizeJob(match));
       continue;
     }
-    cruxSpectrum->sortPeaks(_PEAK_LOCATION);
-    double precursorMz = cruxSpectrum->getPrecursorMz();
-    int charge = match->getCharge();
-    Spectrum spectrum(scan, precursorMz);
-    spectrum.AddChargeState(charge);
-    spectrum.ReservePeaks(cruxSpectrum->getNumPeaks());
-    for (PeakIterator i = cruxSpectrum->begin(); i != cruxSpectrum->end(); i++) {
-      spectrum.AddPeak((*i)->getLocation(), (*i)->getIntensity());
+    // Preprocess each spectrum once on the main thread, and compute the
+    // evidence vectors of each group of matches to it on the threads.
+    map<pair<string, int>, Spectrum*> spectra;
+    map<pair<Spectrum*, int>, LocalizeGroup*> groupIndex;
+    vector<LocalizeGroup*> groups;
+    for (vector<LocalizeJob>::iterator job = jobs.begin(); job != jobs.end(); job++) {
+      Crux::Match* match = job->match;
+      int scan = match->getSpectrum()->getFirstScan();
+      string spectrumFile = match->getFilePath();
+      pair<string, int> spectrumKey(spectrumFile, scan);
+      map<pair<string, int>, Spectrum*>::iterator found = spectra.find(spectrumKey);
+      if (found == spectra.end()) {
+        Crux::Spectrum* cruxSpectrum;
+        Crux::SpectrumCollection* collection = spectrumCollections[spectrumFile];
+        Spectrum* spectrum = NULL;
+        if ((cruxSpectrum = collection->getSpectrum(scan)) == NULL) {
+          carp(CARP_FATAL, "Spectrum %d not found in %s", scan, spectrumFile.c_str());
+        } else if (cruxSpectrum->getNumPeaks() > 0) {
+          cruxSpectrum->sortPeaks(_PEAK_LOCATION);
+          spectrum = new Spectrum(scan, cruxSpectrum->getPrecursorMz());
+          spectrum->AddChargeState(match->getCharge());
+          spectrum->ReservePeaks(cruxSpectrum->getNumPeaks());
+          for (PeakIterator i = cruxSpectrum->begin(); i != cruxSpectrum->end(); i++) {
+            spectrum->AddPeak((*i)->getLocation(), (*i)->getIntensity());
+          }
+        }
+        delete cruxSpectrum;
+        found = spectra.insert(make_pair(spectrumKey, spectrum)).first;
+      }
+      job->spectrum = found->second;
+      if (job->spectrum == NULL) {
+        continue;
+      }
+      double neutralMass = match->getNeutralMass();
+      int maxPrecursorMass = MassConstants::mass2bin(neutralMass + MAX_XCORR_OFFSET + 30) + 50;
+      pair<Spectrum*, int> groupKey(job->spectrum, maxPrecursorMass);
+      map<pair<Spectrum*, int>, LocalizeGroup*>::iterator group = groupIndex.find(groupKey);
+      if (group == groupIndex.end()) {
+        groups.push_back(new LocalizeGroup(job->spectrum, maxPrecursorMass, binWidth, binOffset));
+        group = groupIndex.insert(make_pair(groupKey, groups.back())).first;
+      }
+      job->group = group->second;
+      job->unmodifiedBin =
+        MassConstants::mass2bin(match->getPeptide()->calcModifiedMass());
+      job->group->jobs.push_back(&*job);
+      if (fabs(calcModMass(match)) >= minModMass) {
+        job->modifiedBin = MassConstants::mass2bin(neutralMass);
+      }
+    }
+    size_t nextGroup = 0;
+    boost::mutex groupMutex;
+    ThreadPool::TaskGroup threads;
+    for (int i = 1; i < numThreads && i < (int)groups.size(); i++) {
+      threads.Run(boost::bind(&computeEvidence, &groups, &nextGroup, &groupMutex));
     }
-    delete cruxSpectrum;
-
-    // Create proteins/peptides
-    VariableModTable* modTable = getModTable(match);
-    MassConstants::Init(modTable->ParsedModTable(),
-                        modTable->ParsedNtpepModTable(), modTable->ParsedCtpepModTable(),
-                        binWidth, binOffset);
-    Crux::Peptide* cruxPeptide = match->getPeptide();
-    vector<const pb::Protein*> proteins = createPbProteins(cruxPeptide);
-    vector<pb::AuxLocation> auxLocs;
-    vector<pb::Peptide> peptides = createPbPeptides(match, modTable, &auxLocs);
-
-    // Score each peptide
-    carp(CARP_DETAILED_INFO, "Scoring modified forms of %s against spectrum %d",
-         cruxPeptide->getModifiedSequenceWithMasses().c_str(), scan);
-    Results results(modTable);
-    double neutralMass = match->getNeutralMass();
-    int maxPrecursorMass = MassConstants::mass2bin(neutralMass + MAX_XCORR_OFFSET + 30) + 50;
-    vector<double> evidence = spectrum.CreateEvidenceVector(binWidth, binOffset, charge,
-      (MassConstants::mass2bin(cruxPeptide->calcModifiedMass()) - 0.5 + binOffset) * binWidth, maxPrecursorMass);
-    for (vector<pb::Peptide>::const_iterator i = peptides.begin(); i != peptides.end(); i++) {
-      Peptide peptide(*i, proteins);
-      tps.Clear();
-      peptide.ComputeBTheoreticalPeaks(&tps);
-
-      if (i == peptides.begin() + 1) {
-        // After we've scored the unmodified peptide, create new evidence vector for scoring the modified peptides
-        evidence = spectrum.CreateEvidenceVector(binWidth, binOffset, charge,
-          (MassConstants::mass2bin(neutralMass) - 0.5 + binOffset) * binWidth, maxPrecursorMass);
+    computeEvidence(&groups, &nextGroup, &groupMutex);
+    threads.Wait();
+
+    // Score and write the matches in order
+    for (vector<LocalizeJob>::const_iterator job = jobs.begin(); job != jobs.end(); job++) {
+      Crux::Match* match = job->match;
+      int scan = match->getSpectrum()->getFirstScan();
+      if (job->spectrum == NULL) {
+        carp(CARP_WARNING, "Spectrum %d had 0 peaks, skipping", scan);
+        continue;
+      }
+      int charge = match->getCharge();
+      double precursorMz = job->spectrum->PrecursorMZ();
+
+      // Create proteins/peptides
+      VariableModTable* modTable = getModTable(match);
+      MassConstants::Init(modTable->ParsedModTable(),
+                          modTable->ParsedNtpepModTable(), modTable->ParsedCtpepModTable(),
+                          binWidth, binOffset);
+      Crux::Peptide* cruxPeptide = match->getPeptide();
+      vector<const pb::Protein*> proteins = createPbProteins(cruxPeptide);
+      vector<pb::AuxLocation> auxLocs;
+      vector<pb::Peptide> peptides = createPbPeptides(match, modTable, &auxLocs);
+
+      // Score each peptide
+      carp(CARP_DETAILED_INFO, "Scoring modified forms of %s against spectrum %d",
+           cruxPeptide->getModifiedSequenceWithMasses().c_str(), scan);
+      Results results(modTable);
+      double neutralMass = match->getNeutralMass();
+      const vector<double>* evidence = job->unmodifiedEvidence;
+      for (vector<pb::Peptide>::const_iterator i = peptides.begin(); i != peptides.end(); i++) {
+        Peptide peptide(*i, proteins);
+        tps.Clear();
+        peptide.ComputeBTheoreticalPeaks(&tps);
+
+        if (i == peptides.begin() + 1) {
+          // After we've scored the unmodified peptide, use the evidence vector for scoring the modified peptides
+          evidence = job->modifiedEvidence;
+        }
+
+        double xcorr = 0;
+        for (vector<unsigned int>::const_iterator j = tps.unordered_peak_list_.begin();
+            j != tps.unordered_peak_list_.end();
+            j++) {
+          xcorr += (*evidence)[*j];
+        }
+        results.Add(cruxPeptide, &peptide, xcorr / 10000);
+      }
+      delete modTable;
+      for (vector<const pb::Protein*>::const_iterator i = proteins.begin(); i != proteins.end(); i++) {
+        delete *i;
       }
 
-      double xcorr = 0;
-      for (vector<unsigned int>::const_iterator j = tps.unordered_peak_list_.begin();
-          j != tps.unordered_peak_list_.end();
-          j++) {
-        xcorr += evidence[*j];
+      // Write to output file
+      results.Sort();
+      for (size_t i = 0; i < topMatch && i < results.Size(); i++) {
+        Crux::Peptide& peptide = *(results.Peptide(i));
+        char* flanking = peptide.getFlankingAAs();
+        string flankingStr(flanking);
+        free(flanking);
+        writer.setColumnCurrentRow(FILE_COL,                  match->getFilePath());
+        writer.setColumnCurrentRow(SCAN_COL,                  scan);
+        writer.setColumnCurrentRow(CHARGE_COL,                charge);
+        writer.setColumnCurrentRow(SPECTRUM_PRECURSOR_MZ_COL, precursorMz);
+        writer.setColumnCurrentRow(SPECTRUM_NEUTRAL_MASS_COL, neutralMass);
+        writer.setColumnCurrentRow(PEPTIDE_MASS_COL,          peptide.calcModifiedMass());
+        writer.setColumnCurrentRow(XCORR_SCORE_COL,           results.XCorr(i));
+        writer.setColumnCurrentRow(SEQUENCE_COL,              peptide.getModifiedSequenceWithMasses());
+        writer.setColumnCurrentRow(MODIFICATIONS_COL,         peptide.getModsString());
+        writer.setColumnCurrentRow(PROTEIN_ID_COL,            peptide.getProteinIdsLocations());
+        writer.setColumnCurrentRow(FLANKING_AA_COL,           flankingStr);
+        writer.setColumnCurrentRow(TARGET_DECOY_COL,          match->isDecoy() ? "decoy" : "target");
+        writer.writeRow();
       }
-      results.Add(cruxPeptide, &peptide, xcorr / 10000);
+
+      curStep += cruxPeptide->getLength() + 1;
+      reportProgress(curStep, numSteps);
     }
-    delete modTable;
-    for (vector<const pb::Protein*>::const_iterator i = proteins.begin(); i != proteins.end(); i++) {
+
+    for (vector<LocalizeGroup*>::iterator i = groups.begin(); i != groups.end(); i++) {
       delete *i;
     }
-
-    // Write to output file
-    results.Sort();
-    for (size_t i = 0; i < topMatch && i < results.Size(); i++) {
-      Crux::Peptide& peptide = *(results.Peptide(i));
-      char* flanking = peptide.getFlankingAAs();
-      string flankingStr(flanking);
-      free(flanking);
-      writer.setColumnCurrentRow(FILE_COL,                  match->getFilePath());
-      writer.setColumnCurrentRow(SCAN_COL,                  scan);
-      writer.setColumnCurrentRow(CHARGE_COL,                charge);
-      writer.setColumnCurrentRow(SPECTRUM_PRECURSOR_MZ_COL, precursorMz);
-      writer.setColumnCurrentRow(SPECTRUM_NEUTRAL_MASS_COL, neutralMass);
-      writer.setColumnCurrentRow(PEPTIDE_MASS_COL,          peptide.calcModifiedMass());
-      writer.setColumnCurrentRow(XCORR_SCORE_COL,           results.XCorr(i));
-      writer.setColumnCurrentRow(SEQUENCE_COL,              peptide.getModifiedSequenceWithMasses());
-      writer.setColumnCurrentRow(MODIFICATIONS_COL,         peptide.getModsString());
-      writer.setColumnCurrentRow(PROTEIN_ID_COL,            peptide.getProteinIdsLocations());
-      writer.setColumnCurrentRow(FLANKING_AA_COL,           flankingStr);
-      writer.setColumnCurrentRow(TARGET_DECOY_COL,          match->isDecoy() ? "decoy" : "target");
-      writer.writeRow();
+    for (map<pair<string, int>, Spectrum*>::iterator i = spectra.begin(); i != spectra.end(); i++) {
+      delete i->second;
     }
-
-    curStep += cruxPeptide->getLength() + 1;
-    reportProgress(curStep, numSteps);
+    jobs.clear();
   }
   delete matchIter;
   delete matches;
+  delete firstModTable;
 
   for (map<string, Crux::SpectrumCollection*>::const_iterator i = spectrumCollections.begin();
        i != spectrumCollections.end();
@@ -223,6 +370,7 @@ vector<string> LocalizeModificationApplication::getOptions() const {
   string arr[] = {
     "min-mod-mass",
     "mod-precision",
+    "num-threads",
     "top-match",
     "output-dir",
     "overwrite",
@@ -4,6 +4,7 @@
 #include "MakePinApplication.h"
 #include "io/PinWriter.h"
 #include "parameter.h"
+#include "util/FileUtils.h"
 #include "util/Params.h"
 #include "io/MatchCollectionParser.h"
 #include "io/SQTReader.h"
@@ -48,9 +49,34 @@ int MakePinApplication::main(const vector<string>& paths) {
     carp(CARP_FATAL, "No search paths found!");
   }
 
-  MatchCollection* target_collection = new MatchCollection();
-  MatchCollection* decoy_collection = new MatchCollection();
+  //prepare output file 
+  string output_filename = Params::GetString("output-file");
+  if (output_filename.empty()) {
+    string fileroot = Params::GetString("fileroot");
+    if (!fileroot.empty()) {
+      fileroot += ".";
+    }
+    output_filename = fileroot + "make-pin.pin";
+  }
+  string output_dir = Params::GetString("output-dir");
+
+  // Each file is parsed and written on its own, with every feature, to
+  // one row file for targets and one for decoys. Which features the pin
+  // has depends on all of the files, so the rows are cut down to those
+  // features once the last file has been read.
+  string row_path = output_dir.empty() ? output_filename : output_dir + "/" + output_filename;
+  string target_rows_file = row_path + ".targets.tmp";
+  string decoy_rows_file = row_path + ".decoys.tmp";
+  PinWriter target_rows, decoy_rows;
+  target_rows.openFile(target_rows_file, "", true);
+  decoy_rows.openFile(decoy_rows_file, "", true);
+  target_rows.enableAllFeatures();
+  decoy_rows.enableAllFeatures();
+  int top_match = Params::GetInt("top-match");
 
+  bool scored_types[NUMBER_SCORER_TYPES] = { false };
+  bool distinct_matches = false;
+  int num_targets = 0, num_decoys = 0;
   int max_charge = 0;
   for (vector<string>::const_iterator iter = paths.begin(); iter != paths.end(); ++iter) {
     carp(CARP_INFO, "Parsing %s", iter->c_str());
@@ -59,84 +85,76 @@ int MakePinApplication::main(const vector<string>& paths) {
     }
 
     MatchCollection* current_collection = parser.create(iter->c_str(), "");
-    if (!target_collection->getHasDistinctMatches() && current_collection->getHasDistinctMatches()) {
-      target_collection->setHasDistinctMatches(true);
-      decoy_collection->setHasDistinctMatches(true);
+    if (current_collection->getHasDistinctMatches()) {
+      distinct_matches = true;
     }
     for (int scorer_idx = (int)SP; scorer_idx < (int)NUMBER_SCORER_TYPES; scorer_idx++) {
-      SCORER_TYPE_T cur_type = (SCORER_TYPE_T)scorer_idx;
-      bool scored = current_collection->getScoredType(cur_type);
-      target_collection->setScoredType(cur_type, scored);
-      decoy_collection->setScoredType(cur_type, scored);
+      scored_types[scorer_idx] = current_collection->getScoredType((SCORER_TYPE_T)scorer_idx);
     }
     MatchIterator match_iter(current_collection);
     while (match_iter.hasNext()) {
       Crux::Match* match = match_iter.next();
       if (match->getNullPeptide()) {
-        decoy_collection->addMatch(match);
+        ++num_decoys;
       } else {
-        target_collection->addMatch(match);
+        ++num_targets;
       }
       int charge = match->getCharge();
       if (charge > max_charge) {
         max_charge = charge;
       }
     }
+    target_rows.write(current_collection, top_match, false);
+    decoy_rows.write(current_collection, top_match, true);
     delete current_collection;
   }
+  target_rows.closeFile();
+  decoy_rows.closeFile();
 
   carp(CARP_INFO, "There are %d target matches and %d decoys",
-       target_collection->getMatchTotal(), decoy_collection->getMatchTotal());
+       num_targets, num_decoys);
   carp(CARP_INFO, "Maximum observed charge is %d.", max_charge);
   if (Params::GetInt("max-charge-feature") != 0) {
     max_charge = Params::GetInt("max-charge-feature");
     carp(CARP_INFO, "Maximum charge feature set to %d.", max_charge);
   }    
-  if (target_collection->getMatchTotal() == 0) {
+  if (num_targets == 0) {
+    FileUtils::Remove(target_rows_file);
+    FileUtils::Remove(decoy_rows_file);
     carp(CARP_FATAL, "No target matches found!");
-  } else if (decoy_collection->getMatchTotal() == 0) {
+  } else if (num_decoys == 0) {
+    FileUtils::Remove(target_rows_file);
+    FileUtils::Remove(decoy_rows_file);
     carp(CARP_FATAL, "No decoy matches found!  Did you set 'decoy-prefix' properly?");
   }
 
-  //prepare output file 
-  string output_filename = Params::GetString("output-file");
-  if (output_filename.empty()) {
-    string fileroot = Params::GetString("fileroot");
-    if (!fileroot.empty()) {
-      fileroot += ".";
-    }
-    output_filename = fileroot + "make-pin.pin";
-  }
   PinWriter writer;
-  writer.openFile(output_filename, Params::GetString("output-dir"),
-                  Params::GetBool("overwrite"));
+  writer.openFile(output_filename, output_dir, Params::GetBool("overwrite"));
 
   for (int i = 1; i <= max_charge; i++) {
     writer.setEnabledStatus("Charge" + StringUtils::ToString(i), true);
   }
-  writer.setEnabledStatus("deltCn", target_collection->getScoredType(DELTA_CN));
-  writer.setEnabledStatus("deltLCn", target_collection->getScoredType(DELTA_LCN));
-  bool is_sp = target_collection->getScoredType(SP);
+  writer.setEnabledStatus("deltCn", scored_types[DELTA_CN]);
+  writer.setEnabledStatus("deltLCn", scored_types[DELTA_LCN]);
+  bool is_sp = scored_types[SP];
   writer.setEnabledStatus("lnrSp", is_sp);
   writer.setEnabledStatus("Sp", is_sp);
   writer.setEnabledStatus("IonFrac", is_sp);
-  bool is_refactored_xcorr = target_collection->getScoredType(TIDE_SEARCH_REFACTORED_XCORR);
+  bool is_refactored_xcorr = scored_types[TIDE_SEARCH_REFACTORED_XCORR];
   writer.setEnabledStatus("XCorr", !is_refactored_xcorr);
   writer.setEnabledStatus("RefactoredXCorr", is_refactored_xcorr);
-  writer.setEnabledStatus("NegLog10PValue",
-                          target_collection->getScoredType(TIDE_SEARCH_EXACT_PVAL));
-  if (writer.getEnabledStatus("lnNumSP") && target_collection->getHasDistinctMatches()) {
+  writer.setEnabledStatus("NegLog10PValue", scored_types[TIDE_SEARCH_EXACT_PVAL]);
+  if (writer.getEnabledStatus("lnNumSP") && distinct_matches) {
     writer.setEnabledStatus("lnNumSP", false);
     writer.setEnabledStatus("lnNumDSP", true);
   }
 
   //write .pin file 
   writer.printHeader();
-  writer.write(target_collection, vector<MatchCollection*>(1, decoy_collection),
-               Params::GetInt("top-match"));
-
-  delete target_collection;
-  delete decoy_collection;
+  writer.appendRows(target_rows_file, target_rows.getRowFeatures());
+  writer.appendRows(decoy_rows_file, decoy_rows.getRowFeatures());
+  FileUtils::Remove(target_rows_file);
+  FileUtils::Remove(decoy_rows_file);
 
   return 0;
 }
@@ -20,6 +20,107 @@
 #include "io/PSMWriter.h"
 #include "io/SQTReader.h"
 
+// Spectra are written once they have at least this many PSMs between them.
+static const int kBatchMatches = 10000;
+
+/**
+ * Warns if the parser detected distinct matches differently from the
+ * distinct-matches parameter.
+ */
+static void warnDistinctMatches(bool detected, bool distinct_matches) {
+  if (detected != distinct_matches) {
+    const char* matchType = detected ? "distinct" : "not distinct";
+    carp(CARP_WARNING, "Parser has detected that matches are %s, but parameter "
+         "distinct-matches is set to %s. We will assume that matches are %s",
+         matchType, distinct_matches ? "distinct" : "not distinct",
+         matchType);
+  }
+}
+
+/**
+ * Collects the PSMs of a reader into batches of whole spectra and writes
+ * each batch as it fills, so that only one batch is in memory at a time.
+ */
+class PSMBatchWriter : public PSMVisitor {
+ public:
+  PSMBatchWriter(
+    PSMWriter* writer,
+    const string& database,
+    bool isTabDelimited, ///< take distinct matches from the reader
+    bool distinct_matches
+  ) : writer_(writer), database_(database), isTabDelimited_(isTabDelimited),
+    distinct_matches_(distinct_matches), found_distinct_matches_(distinct_matches),
+    warned_(false), batch_(NULL) {
+    std::fill(scored_types_, scored_types_ + NUMBER_SCORER_TYPES, false);
+  }
+
+  ~PSMBatchWriter() {
+    flush();
+  }
+
+  void visitMatch(Crux::Match* match, MatchCollection* state) {
+    for (int i = 0; i < NUMBER_SCORER_TYPES; i++) {
+      scored_types_[i] = state->getScoredType((SCORER_TYPE_T)i);
+    }
+    if (isTabDelimited_) {
+      found_distinct_matches_ = state->getHasDistinctMatches();
+    }
+    if (batch_ == NULL) {
+      batch_ = new MatchCollection();
+      batch_->preparePostProcess();
+    }
+    batch_->addMatchToPostMatchCollection(match);
+    Crux::Match::freeMatch(match);
+  }
+
+  void visitSpectrumEnd(Crux::Spectrum* spectrum) {
+    spectra_.push_back(spectrum);
+    if (batch_ != NULL && batch_->getMatchTotal() >= kBatchMatches) {
+      flush();
+    }
+  }
+
+  /**
+   * Writes the batch, then frees it and the spectra that are done
+   */
+  void flush() {
+    if (batch_ != NULL) {
+      for (int i = 0; i < NUMBER_SCORER_TYPES; i++) {
+        batch_->setScoredType((SCORER_TYPE_T)i, scored_types_[i]);
+      }
+      if (!isTabDelimited_) {
+        batch_->setHasDistinctMatches(distinct_matches_);
+      } else {
+        batch_->setHasDistinctMatches(found_distinct_matches_);
+        if (!warned_) {
+          warnDistinctMatches(found_distinct_matches_, distinct_matches_);
+          warned_ = true;
+        }
+      }
+      if (batch_->getMatchTotal() > 0) {
+        writer_->write(batch_, database_);
+      }
+      delete batch_;
+      batch_ = NULL;
+    }
+    for (vector<Crux::Spectrum*>::iterator i = spectra_.begin(); i != spectra_.end(); ++i) {
+      delete *i;
+    }
+    spectra_.clear();
+  }
+
+ protected:
+  PSMWriter* writer_;
+  string database_;
+  bool isTabDelimited_;
+  bool distinct_matches_;
+  bool found_distinct_matches_;
+  bool warned_;
+  bool scored_types_[NUMBER_SCORER_TYPES];
+  MatchCollection* batch_;
+  vector<Crux::Spectrum*> spectra_; ///< whose matches are all in the batch
+};
+
 PSMConvertApplication::PSMConvertApplication() {
 }
 
@@ -60,7 +161,10 @@ void PSMConvertApplication::convertFile(string input_format, string output_forma
            "sqt, pin, pepxml, mzidentml, barista-xml");
     }
   } else {
-    if (StringUtils::IEndsWith(input_file, ".txt")) {
+    if (StringUtils::IEndsWith(input_file, ".txt") ||
+        StringUtils::IEndsWith(input_file, ".txt.gz") ||
+        StringUtils::IEndsWith(input_file, ".bin") ||
+        StringUtils::IEndsWith(input_file, ".bin.gz")) {
       reader = new MatchFileReader(input_file.c_str(), data);
       isTabDelimited = true;
     } else if (StringUtils::IEndsWith(input_file, ".html")) {
@@ -77,27 +181,12 @@ void PSMConvertApplication::convertFile(string input_format, string output_forma
       carp(CARP_FATAL, "Barista-XML format has not been implemented yet");
     } else {
       carp(CARP_FATAL, "Could not determine input format, "
-           "Please name your files ending with .txt, .html, .sqt, .pin, "
+           "Please name your files ending with .txt, .txt.gz, .bin, .html, .sqt, .pin, "
            ".xml, .mzid, .barista.xml or use the --input-format option to "
            "specify file type");
     }
   }
   
-  MatchCollection* collection = reader->parse();
-  
-  if (!isTabDelimited) {
-    collection->setHasDistinctMatches(distinct_matches);
-  } else if (collection->getHasDistinctMatches() != distinct_matches) {
-    const char* matchType = collection->getHasDistinctMatches() ?
-    "distinct" : "not distinct";
-    carp(CARP_WARNING, "Parser has detected that matches are %s, but parameter "
-         "distinct-matches is set to %s. We will assume that matches are %s",
-         matchType, distinct_matches ? "distinct" : "not distinct",
-         matchType);
-  }
-  
-  carp(CARP_INFO, "Reader has been succesfully parsed");
-  
   // What will be used when PSMWriter is finished.
   
   PSMWriter* writer;
@@ -132,11 +221,26 @@ void PSMConvertApplication::convertFile(string input_format, string output_forma
   string output_file_name = make_file_path(output_file_name_builder.str());
   
   writer->openFile(this, output_file_name, PSMWriter::PSMS);
-  writer->write(collection, database_file);
+  if (writer->canAppend()) {
+    // the writer takes the PSMs a batch of spectra at a time, as they are read
+    PSMBatchWriter batches(writer, database_file, isTabDelimited, distinct_matches);
+    reader->visit(&batches);
+    batches.flush();
+    carp(CARP_INFO, "Reader has been succesfully parsed");
+  } else {
+    MatchCollection* collection = reader->parse();
+    if (!isTabDelimited) {
+      collection->setHasDistinctMatches(distinct_matches);
+    } else {
+      warnDistinctMatches(collection->getHasDistinctMatches(), distinct_matches);
+    }
+    carp(CARP_INFO, "Reader has been succesfully parsed");
+    writer->write(collection, database_file);
+    delete collection;
+  }
   writer->closeFile();
   
   // Clean Up
-  delete collection;
   delete reader;
   delete writer;
 
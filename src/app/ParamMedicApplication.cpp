@@ -3,9 +3,12 @@
 #include "io/SpectrumCollectionFactory.h"
 #include "parameter.h"
 #include "util/Params.h"
+#include "util/ThreadPool.h"
 
 #include <cmath>
 #include <numeric>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 using namespace Crux;
 using namespace std;
@@ -100,6 +103,7 @@ vector<string> ParamMedicApplication::getOptions() const {
   string arr[] = {
     "verbosity",
     "spectrum-parser",
+    "num-threads",
     "pm-min-precursor-mz",
     "pm-max-precursor-mz",
     "pm-min-frag-mz",
@@ -153,28 +157,144 @@ ParamMedicErrorCalculator::~ParamMedicErrorCalculator() {
   }
 }
 
-void ParamMedicErrorCalculator::processFiles(const vector<string>& files) {
+void ParamMedicErrorCalculator::processFiles(const vector<string>& files, bool keepLast,
+                                             size_t maxSpectra) {
+  size_t remaining = maxSpectra;
   for (vector<string>::const_iterator i = files.begin(); i != files.end(); i++) {
+    if (maxSpectra > 0 && remaining == 0) {
+      carp(CARP_INFO, "param-medic processed the first %d spectra; not reading the "
+           "rest.", (int)maxSpectra);
+      break;
+    }
     carp(CARP_INFO, "param-medic processing input file %s...", i->c_str());
     SpectrumCollection* collection = SpectrumCollectionFactory::create(*i);
     collection->parse();
-    for (SpectrumIterator j = collection->begin(); j != collection->end(); j++) {
-      processSpectrum(*j);
+    // processSpectrum truncates the peaks, so kept spectra are processed as copies
+    bool keep = keepLast && i + 1 == files.end();
+    vector<Spectrum*> spectra;
+    for (SpectrumIterator j = collection->begin();
+         j != collection->end() && (maxSpectra == 0 || spectra.size() < remaining);
+         j++) {
+      if (keep) {
+        copies_.push_back(new Spectrum(**j));
+        spectra.push_back(copies_.back());
+      } else {
+        spectra.push_back(*j);
+      }
     }
-    delete collection;
+    remaining -= maxSpectra > 0 ? spectra.size() : 0;
+    processSpectra(spectra);
     clearBins();
+    if (keep) {
+      SpectrumCollectionFactory::keep(*i, collection);
+    } else {
+      delete collection;
+    }
   }
 }
 
-void ParamMedicErrorCalculator::processSpectrum(Spectrum* spectrum) {
-  ++numTotalSpectra_;
-
-  if (spectrum->getNumPeaks() < Params::GetInt("pm-min-scan-frag-peaks")) {
+void ParamMedicErrorCalculator::processSpectra(const vector<Spectrum*>& spectra) {
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = boost::thread::hardware_concurrency();
+  }
+  if (numThreads < 2 || spectra.size() < 2) {
+    for (vector<Spectrum*>::const_iterator i = spectra.begin(); i != spectra.end(); i++) {
+      processSpectrum(*i);
+    }
     return;
   }
 
-  double precursorMz = getPrecursorMz(spectrum);
-  if (!(Params::GetDouble("pm-min-precursor-mz") <= precursorMz && precursorMz <= Params::GetDouble("pm-max-precursor-mz"))) {
+  // deal out the precursor bins; spectra that don't qualify go to the first share
+  vector<int> owners;
+  owners.reserve(spectra.size());
+  for (vector<Spectrum*>::const_iterator i = spectra.begin(); i != spectra.end(); i++) {
+    double precursorMz;
+    int bin = getPassingBinIndex(*i, &precursorMz);
+    owners.push_back(bin < 0 ? 0 : bin % numThreads);
+  }
+
+  vector<ParamMedicErrorCalculator*> workers;
+  vector< vector< pair<size_t, size_t> > > pairings(numThreads);
+  ThreadPool::TaskGroup threads;
+  for (int t = 0; t < numThreads; t++) {
+    workers.push_back(new ParamMedicErrorCalculator());
+    for (map<int, Spectrum*>::const_iterator i = spectra_.begin(); i != spectra_.end(); i++) {
+      if (i->first % numThreads == t) {
+        workers.back()->spectra_.insert(*i);
+      }
+    }
+    threads.Run(boost::bind(&ParamMedicErrorCalculator::processShare,
+      workers.back(), &spectra, &owners, t, &pairings[t]));
+  }
+  threads.Wait();
+
+  // merge the pairs in the order processing the spectra one by one gives them
+  vector< pair<size_t, int> > order;
+  for (int t = 0; t < numThreads; t++) {
+    for (vector< pair<size_t, size_t> >::const_iterator i = pairings[t].begin();
+         i != pairings[t].end();
+         i++) {
+      order.push_back(make_pair(i->first, t));
+    }
+  }
+  sort(order.begin(), order.end());
+  vector<size_t> nextPairing(numThreads, 0);
+  vector<size_t> nextFragment(numThreads, 0);
+  for (vector< pair<size_t, int> >::const_iterator i = order.begin(); i != order.end(); i++) {
+    int t = i->second;
+    ParamMedicErrorCalculator* worker = workers[t];
+    size_t numFragments = pairings[t][nextPairing[t]].second;
+    pairedPrecursorMzs_.push_back(worker->pairedPrecursorMzs_[nextPairing[t]++]);
+    pairedFragmentPeaks_.insert(pairedFragmentPeaks_.end(),
+      worker->pairedFragmentPeaks_.begin() + nextFragment[t],
+      worker->pairedFragmentPeaks_.begin() + nextFragment[t] + numFragments);
+    nextFragment[t] += numFragments;
+  }
+
+  for (vector<ParamMedicErrorCalculator*>::iterator i = workers.begin(); i != workers.end(); i++) {
+    numTotalSpectra_ += (*i)->numTotalSpectra_;
+    numPassingSpectra_ += (*i)->numPassingSpectra_;
+    numSpectraSameBin_ += (*i)->numSpectraSameBin_;
+    numSpectraWithinPpm_ += (*i)->numSpectraWithinPpm_;
+    numSpectraWithinPpmAndScans_ += (*i)->numSpectraWithinPpmAndScans_;
+    numMultipleFragBins_ += (*i)->numMultipleFragBins_;
+    numSingleFragBins_ += (*i)->numSingleFragBins_;
+    // the bins carry over to the next call, as they would one spectrum at a time
+    for (map<int, Spectrum*>::const_iterator j = (*i)->spectra_.begin(); j != (*i)->spectra_.end(); j++) {
+      spectra_[j->first] = j->second;
+    }
+    // the fragment peaks now belong to this calculator
+    (*i)->pairedFragmentPeaks_.clear();
+    delete *i;
+  }
+}
+
+void ParamMedicErrorCalculator::processShare(
+  const vector<Spectrum*>* spectra,
+  const vector<int>* owners,
+  int share,
+  vector< pair<size_t, size_t> >* pairings
+) {
+  for (size_t i = 0; i < spectra->size(); i++) {
+    if ((*owners)[i] != share) {
+      continue;
+    }
+    size_t numPairs = pairedPrecursorMzs_.size();
+    size_t numFragments = pairedFragmentPeaks_.size();
+    processSpectrum((*spectra)[i]);
+    if (pairedPrecursorMzs_.size() > numPairs) {
+      pairings->push_back(make_pair(i, pairedFragmentPeaks_.size() - numFragments));
+    }
+  }
+}
+
+void ParamMedicErrorCalculator::processSpectrum(Spectrum* spectrum) {
+  ++numTotalSpectra_;
+
+  double precursorMz;
+  int precursorBinIndex = getPassingBinIndex(spectrum, &precursorMz);
+  if (precursorBinIndex < 0) {
     return;
   }
 
@@ -183,7 +303,6 @@ void ParamMedicErrorCalculator::processSpectrum(Spectrum* spectrum) {
   spectrum->sortPeaks(_PEAK_INTENSITY);
   spectrum->truncatePeaks(Params::GetInt("pm-top-n-frag-peaks"));
 
-  int precursorBinIndex = getBinIndexPrecursor(precursorMz);
   map<int, Spectrum*>::const_iterator prevIter = spectra_.find(precursorBinIndex);
   if (prevIter != spectra_.end()) {
     // there was a previous spectrum in this bin; check to see if they're a pair
@@ -224,6 +343,10 @@ void ParamMedicErrorCalculator::processSpectrum(Spectrum* spectrum) {
 
 void ParamMedicErrorCalculator::clearBins() {
   spectra_.clear();
+  for (vector<Spectrum*>::iterator i = copies_.begin(); i != copies_.end(); i++) {
+    delete *i;
+  }
+  copies_.clear();
 }
 
 void ParamMedicErrorCalculator::calcMassErrorDist(
@@ -451,6 +574,17 @@ double ParamMedicErrorCalculator::getPrecursorMz(const Spectrum* spectrum) const
   return -1;
 }
 
+int ParamMedicErrorCalculator::getPassingBinIndex(const Spectrum* spectrum, double* precursorMz) const {
+  if (spectrum->getNumPeaks() < Params::GetInt("pm-min-scan-frag-peaks")) {
+    return -1;
+  }
+  *precursorMz = getPrecursorMz(spectrum);
+  if (!(Params::GetDouble("pm-min-precursor-mz") <= *precursorMz && *precursorMz <= Params::GetDouble("pm-max-precursor-mz"))) {
+    return -1;
+  }
+  return getBinIndexPrecursor(*precursorMz);
+}
+
 vector< pair<const Peak*, const Peak*> > ParamMedicErrorCalculator::pairFragments(
   const Spectrum* prev,
   const Spectrum* cur
@@ -541,30 +675,37 @@ double ParamMedicModel::getSigma() const {
 }
 
 double ParamMedicModel::summarize(const vector<double>& x) {
-  vector<double> r;
-  r.reserve(x.size() * 2);
-  normal_.logProbability(x, &r);
-  uniform_.logProbability(x, &r);
+  const size_t n = x.size();
+  if (n == 0) {
+    return 0;
+  }
+  r_.resize(n * 2);
+  double* rNormal = &r_[0];
+  double* rUniform = &r_[n];
+  normal_.logProbability(x, rNormal);
+  uniform_.logProbability(x, rUniform);
 
   double logProbSum = 0;
-  for (size_t i = 0; i < x.size(); i++) {
-    double total = -numeric_limits<double>::infinity();
-
-    for (size_t j = 0; j < 2; j++) {
-      r[j * x.size() + i] += weights_[j];
-      total = pairLse(total, r[j * x.size() + i]);
-    }
-
-    for (size_t j = 0; j < 2; j++) {
-      r[j * x.size() + i] = exp(r[j * x.size() + i] - total);
-      summaries_[j] += r[j * x.size() + i];
-    }
-
+  double summary0 = summaries_[0];
+  double summary1 = summaries_[1];
+  for (size_t i = 0; i < n; i++) {
+    double r0 = rNormal[i] + weights_[0];
+    double r1 = rUniform[i] + weights_[1];
+    // pairLse(-inf, r0) is r0
+    double total = pairLse(r0, r1);
+    r0 = exp(r0 - total);
+    r1 = exp(r1 - total);
+    rNormal[i] = r0;
+    rUniform[i] = r1;
+    summary0 += r0;
+    summary1 += r1;
     logProbSum += total;
   }
+  summaries_[0] = summary0;
+  summaries_[1] = summary1;
 
-  normal_.summarize(x, &r[0]);
-  uniform_.summarize(x, &r[x.size()]);
+  normal_.summarize(x, rNormal);
+  uniform_.summarize(x, rUniform);
   return logProbSum;
 }
 
@@ -623,18 +764,34 @@ double ParamMedicModel::NormalDistribution::getSigma() const {
   return sigma_;
 }
 
-void ParamMedicModel::NormalDistribution::logProbability(const vector<double>& x, vector<double>* r) const {
-  for (vector<double>::const_iterator i = x.begin(); i != x.end(); i++) {
-    r->push_back(logSigmaSqrt2Pi_ - pow(*i - mu_, 2) / twoSigmaSquared_);
+void ParamMedicModel::NormalDistribution::logProbability(const vector<double>& x, double* r) const {
+  // locals and a plain indexed loop, so the compiler can vectorize it
+  const double* data = &x[0];
+  const size_t n = x.size();
+  const double mu = mu_;
+  const double logSigmaSqrt2Pi = logSigmaSqrt2Pi_;
+  const double twoSigmaSquared = twoSigmaSquared_;
+  for (size_t i = 0; i < n; i++) {
+    double d = data[i] - mu;
+    r[i] = logSigmaSqrt2Pi - d * d / twoSigmaSquared;
   }
 }
 
 void ParamMedicModel::NormalDistribution::summarize(const vector<double>& x, double* weights) {
-  for (size_t i = 0; i < x.size(); i++) {
-    summaries_[0] += weights[i];
-    summaries_[1] += weights[i] * x[i];
-    summaries_[2] += weights[i] * pow(x[i], 2);
-  }
+  // sum into locals rather than through summaries_, which may alias weights
+  const double* data = &x[0];
+  const size_t n = x.size();
+  double s0 = summaries_[0];
+  double s1 = summaries_[1];
+  double s2 = summaries_[2];
+  for (size_t i = 0; i < n; i++) {
+    s0 += weights[i];
+    s1 += weights[i] * data[i];
+    s2 += weights[i] * (data[i] * data[i]);
+  }
+  summaries_[0] = s0;
+  summaries_[1] = s1;
+  summaries_[2] = s2;
 }
 
 void ParamMedicModel::NormalDistribution::fromSummaries() {
@@ -663,9 +820,15 @@ ParamMedicModel::UniformDistribution::UniformDistribution(double start, double e
 ParamMedicModel::UniformDistribution::~UniformDistribution() {
 }
 
-void ParamMedicModel::UniformDistribution::logProbability(const vector<double>& x, vector<double>* r) const {
-  for (vector<double>::const_iterator i = x.begin(); i != x.end(); i++) {
-    r->push_back(start_ <= *i && *i <= end_ ? logP_ : -numeric_limits<double>::infinity());
+void ParamMedicModel::UniformDistribution::logProbability(const vector<double>& x, double* r) const {
+  const double* data = &x[0];
+  const size_t n = x.size();
+  const double start = start_;
+  const double end = end_;
+  const double logP = logP_;
+  const double outside = -numeric_limits<double>::infinity();
+  for (size_t i = 0; i < n; i++) {
+    r[i] = start <= data[i] && data[i] <= end ? logP : outside;
   }
 }
 
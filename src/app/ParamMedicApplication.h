@@ -23,8 +23,17 @@ class ParamMedicErrorCalculator {
   ParamMedicErrorCalculator();
   virtual ~ParamMedicErrorCalculator();
 
-  void processFiles(const std::vector<std::string>& files);
+  // keepLast keeps the spectra of the last file with SpectrumCollectionFactory
+  // for the next tool that reads it; they are then left unchanged. With
+  // maxSpectra > 0, only the first maxSpectra spectra, in file order, are
+  // processed, and the files after them are not read
+  void processFiles(const std::vector<std::string>& files, bool keepLast = false,
+                    size_t maxSpectra = 0);
   void processSpectrum(Crux::Spectrum* spectrum);
+  // processSpectrum for all of spectra, in order, on num-threads threads;
+  // spectra in different precursor bins never pair, so each thread takes
+  // whole bins and the pairs are then merged back into spectrum order
+  void processSpectra(const std::vector<Crux::Spectrum*>& spectra);
   void clearBins();
 
   // this is to be run after all spectra have been processed;
@@ -49,6 +58,17 @@ class ParamMedicErrorCalculator {
   int getBinIndexPrecursor(double mz) const;
   int getBinIndexFragment(double mz) const;
   double getPrecursorMz(const Crux::Spectrum* spectrum) const;
+  // precursor bin of a spectrum that qualifies for pairing, otherwise -1
+  int getPassingBinIndex(const Crux::Spectrum* spectrum, double* precursorMz) const;
+
+  // processSpectrum for the spectra owned by share, recording the index and
+  // number of fragment pairs of every spectrum that paired
+  void processShare(
+    const std::vector<Crux::Spectrum*>* spectra,
+    const std::vector<int>* owners,
+    int share,
+    std::vector< std::pair<size_t, size_t> >* pairings
+  );
 
   // given two spectra, pair up their fragments that are in the same bin
   std::vector< std::pair<const Peak*, const Peak*> > pairFragments(
@@ -80,6 +100,7 @@ class ParamMedicErrorCalculator {
   int numSingleFragBins_;
   // map from bin index to current spectrum
   std::map<int, Crux::Spectrum*> spectra_;
+  std::vector<Crux::Spectrum*> copies_; // of kept spectra, owned until clearBins
   // the paired peak values that we'll use to estimate mass error
   std::vector< std::pair<const Peak*, const Peak*> > pairedFragmentPeaks_;
   std::vector< std::pair<double, double> > pairedPrecursorMzs_;
@@ -130,7 +151,7 @@ class ParamMedicModel {
     virtual ~NormalDistribution();
     double getMu() const;
     double getSigma() const;
-    void logProbability(const std::vector<double>& x, std::vector<double>* r) const;
+    void logProbability(const std::vector<double>& x, double* r) const;
     void summarize(const std::vector<double>& x, double* r);
     void fromSummaries();
     void clearSummaries();
@@ -147,7 +168,7 @@ class ParamMedicModel {
    public:
     UniformDistribution(double start, double end);
     virtual ~UniformDistribution();
-    void logProbability(const std::vector<double>& x, std::vector<double>* r) const;
+    void logProbability(const std::vector<double>& x, double* r) const;
     void summarize(const std::vector<double>& x, double* r);
     void summarize();
     void fromSummaries();
@@ -163,6 +184,9 @@ class ParamMedicModel {
   UniformDistribution uniform_;
   double weights_[2];
   double summaries_[2];
+  // log probabilities, then responsibilities, of the normal and then the
+  // uniform component for each point; kept across the iterations of fit
+  std::vector<double> r_;
 };
 
 #endif
@@ -12,6 +12,10 @@
 #include <sstream>
 #include <iomanip>
 #include <ios>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <boost/thread.hpp>
 #include "util/CarpStreamBuf.h"
 #include "util/FileUtils.h"
 #include "util/Params.h"
@@ -45,15 +49,18 @@ int PercolatorApplication::main(int argc, char** argv) {
   carp(CARP_INFO, "Reading file %s", input_pin.c_str());
 
   // Check if we need to run make-pin first
+  bool made_pin = false;
   if (Params::GetBool("list-of-files") ||
       StringUtils::IEndsWith(input_pin, ".txt") ||
       StringUtils::IEndsWith(input_pin, ".sqt") ||
       StringUtils::IEndsWith(input_pin, ".pep.xml") ||
-      StringUtils::IEndsWith(input_pin, ".mzid")) {
+      StringUtils::IEndsWith(input_pin, ".mzid") ||
+      StringUtils::IEndsWith(input_pin, ".shards")) {
     vector<string> result_files;
     get_search_result_paths(input_pin, result_files);
 
     input_pin = make_file_path("make-pin.pin");
+    made_pin = true;
 
     vector<string>::const_iterator fileIter = result_files.begin();
     if (StringUtils::IEndsWith(*fileIter, ".pin")) {
@@ -107,7 +114,12 @@ int PercolatorApplication::main(int argc, char** argv) {
       carp(CARP_INFO, "File conversion complete.");
     }
   }
-  return main(input_pin);
+  int ret = main(input_pin);
+  if (made_pin && !Params::GetBool("pin-output")) {
+    // The pin was only made for Percolator to read
+    FileUtils::Remove(input_pin);
+  }
+  return ret;
 }
 
 /**
@@ -358,6 +370,15 @@ int PercolatorApplication::main(
   streambuf* old = std::cerr.rdbuf();
   std::cerr.rdbuf(&buffer);
 
+#ifdef _OPENMP
+  // Percolator trains its cross-validation folds in OpenMP parallel loops
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = boost::thread::hardware_concurrency();
+  }
+  omp_set_num_threads(num_threads < 1 ? 1 : num_threads);
+#endif
+
   /* Call percolatorMain */
   PercolatorAdapter pCaller;
   try {
@@ -512,6 +533,7 @@ vector<string> PercolatorApplication::getOptions() const {
     "max-charge-feature",
     "maxiter",
     "mzid-output",
+    "num-threads",
     "only-psms",
     "output-dir",
     "output-weights",
@@ -521,6 +543,7 @@ vector<string> PercolatorApplication::getOptions() const {
     "pepxml-output",
     "percolator-seed",
     "picked-protein",
+    "pin-output",
     "pout-output",
     "protein",
     "protein-enzyme",
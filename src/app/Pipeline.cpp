@@ -8,14 +8,168 @@
 #include "util/Params.h"
 #include "util/StringUtils.h"
 #include "TideSearchApplication.h"
+#include "TideMatchSet.h"
 #include "CometApplication.h"
+#include <limits>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
-PipelineApplication::PipelineApplication() {
+// Bullseye holds about this many bytes for each byte of its MS1 and MS2 files.
+static const long long BULLSEYE_BYTES_PER_FILE_BYTE = 4;
+
+namespace {
+
+/**
+ * A step of the pipeline, which may start once the steps it comes after have
+ * finished, and then takes the given threads and bytes until it finishes.
+ */
+struct PipelineTask {
+  string name;
+  vector<size_t> after;
+  int threads;
+  long long memory;
+  boost::function<int()> run;
+};
+
+/**
+ * Runs tasks on their own threads, each as soon as those it comes after have
+ * finished and the threads and memory it needs are free. A task that needs
+ * more than there is runs alone. Ready tasks start in the order given. After
+ * a task fails no more are started.
+ */
+class TaskRunner {
+ public:
+  TaskRunner(const vector<PipelineTask>& tasks, int threads, long long budget)
+    : tasks_(tasks), threads_(threads), budget_(budget),
+      state_(tasks.size(), WAITING), running_(0), usedThreads_(0),
+      usedMemory_(0), failed_(tasks.size()), ret_(0) {
+  }
+
+  // Returns 0, or the return code of the task that failed.
+  int run() {
+    boost::thread_group workers;
+    boost::mutex::scoped_lock lock(mutex_);
+    while (true) {
+      size_t next = ret_ == 0 ? nextTask() : tasks_.size();
+      if (next == tasks_.size()) {
+        if (running_ == 0) {
+          break;
+        }
+        changed_.wait(lock);
+        continue;
+      }
+      state_[next] = RUNNING;
+      ++running_;
+      usedThreads_ += tasks_[next].threads;
+      usedMemory_ += tasks_[next].memory;
+      workers.create_thread(boost::bind(&TaskRunner::runTask, this, next));
+    }
+    lock.unlock();
+    workers.join_all();
+    for (size_t i = 0; i < tasks_.size(); ++i) {
+      if (state_[i] == WAITING) {
+        carp(CARP_DEBUG, "Did not run %s", tasks_[i].name.c_str());
+      }
+    }
+    return ret_;
+  }
+
+  // The task that failed, if one did.
+  const PipelineTask* failed() const {
+    return failed_ < tasks_.size() ? &tasks_[failed_] : NULL;
+  }
+
+ private:
+  enum State { WAITING, RUNNING, DONE };
+
+  size_t nextTask() const {
+    for (size_t i = 0; i < tasks_.size(); ++i) {
+      if (state_[i] != WAITING) {
+        continue;
+      }
+      const PipelineTask& task = tasks_[i];
+      bool ready = true;
+      for (vector<size_t>::const_iterator j = task.after.begin(); j != task.after.end(); ++j) {
+        ready = ready && state_[*j] == DONE;
+      }
+      if (ready && (running_ == 0 ||
+                    (usedThreads_ + task.threads <= threads_ &&
+                     (budget_ <= 0 || usedMemory_ + task.memory <= budget_)))) {
+        return i;
+      }
+    }
+    return tasks_.size();
+  }
+
+  void runTask(size_t i) {
+    const PipelineTask& task = tasks_[i];
+    carp(CARP_INFO, "Running %s...", task.name.c_str());
+    int ret = task.run();
+    boost::mutex::scoped_lock lock(mutex_);
+    state_[i] = DONE;
+    --running_;
+    usedThreads_ -= task.threads;
+    usedMemory_ -= task.memory;
+    if (ret != 0 && ret_ == 0) {
+      ret_ = ret;
+      failed_ = i;
+    }
+    changed_.notify_all();
+  }
+
+  const vector<PipelineTask>& tasks_;
+  int threads_;
+  long long budget_;
+  boost::mutex mutex_;
+  boost::condition_variable changed_;
+  vector<State> state_;
+  int running_;
+  int usedThreads_;
+  long long usedMemory_;
+  size_t failed_;
+  int ret_;
+};
+
+}
+
+/**
+ * The results of fractions searched one at a time, written to the files the
+ * search of all of them would have written.
+ */
+struct MergedResults {
+  vector<string> files;
+  ostream* target;
+  ostream* decoy;
+};
+
+// Appends results to *out, opening it as path first, without the header if
+// it is already open.
+static void appendResults(stringstream& results, const string& path, ostream** out) {
+  if (results.tellp() <= 0) {
+    return;
+  }
+  if (*out == NULL) {
+    *out = TideSearchApplication::createResultsFile(path, Params::GetBool("overwrite"), false);
+  } else {
+    results.ignore(numeric_limits<streamsize>::max(), '\n');
+  }
+  if (results.peek() != EOF) {
+    **out << results.rdbuf();
+  }
+}
+
+PipelineApplication::PipelineApplication()
+  : overlap_(false), threads_(1), budget_(0), bullseyeMemory_(0), searchMemory_(0) {
 }
 
 PipelineApplication::~PipelineApplication() {
+  for (vector<CruxApplication*>::iterator i = apps_.begin(); i != apps_.end(); i++) {
+    delete *i;
+  }
 }
 
 int PipelineApplication::main(int argc, char** argv) {
@@ -29,34 +183,82 @@ int PipelineApplication::main(int argc, char** argv) {
   vector<string> spectra = Params::GetStrings("mass spectra");
   string database = Params::GetString("peptide source");
 
+  // Each step comes after the one before it, except that with overlap_ each
+  // fraction is searched as soon as bullseye has finished with it, while
+  // bullseye goes on to the next.
+  vector<PipelineTask> tasks;
   vector<string> resultsFiles;
-  while (!apps_.empty()) {
-    CruxApplication* cur = apps_.front();
-    carp(CARP_INFO, "Running %s...", cur->getName().c_str());
-    int ret;
+  MergedResults merged;
+  merged.target = merged.decoy = NULL;
+  for (vector<CruxApplication*>::iterator i = apps_.begin(); i != apps_.end(); i++) {
+    CruxApplication* cur = *i;
+    PipelineTask task;
+    task.name = cur->getName();
+    task.threads = 1;
+    task.memory = 0;
+    if (!tasks.empty()) {
+      task.after.push_back(tasks.size() - 1);
+    }
     switch (cur->getCommand()) {
       case BULLSEYE_COMMAND:
-        ret = runBullseye(cur, &spectra);
+        if (!overlap_) {
+          task.memory = bullseyeMemory_;
+          task.run = boost::bind(&PipelineApplication::runBullseye, this, cur, &spectra);
+          tasks.push_back(task);
+          break;
+        }
+        for (size_t j = 0; j < spectra.size(); j++) {
+          task.name = cur->getName() + " on " + spectra[j];
+          task.memory = bullseyeMemory_;
+          task.run = boost::bind(&PipelineApplication::runBullseyeOn, this, cur, &spectra[j]);
+          tasks.push_back(task);
+          task.after.assign(1, tasks.size() - 1);
+        }
         break;
       case COMET_COMMAND:
       case TIDE_SEARCH_COMMAND:
-        ret = runSearch(cur, spectra, database, &resultsFiles);
+        task.threads = threads_;
+        task.memory = searchMemory_;
+        if (!overlap_) {
+          task.run = boost::bind(&PipelineApplication::runSearch, this, cur,
+                                 boost::cref(spectra), boost::cref(database), &resultsFiles);
+          tasks.push_back(task);
+          break;
+        }
+        // Fraction j comes after bullseye on it, and after fraction j - 1,
+        // whose results are written first.
+        resultsFiles = merged.files = getExpectedResultsFiles(cur, spectra);
+        task.threads = max(1, threads_ - 1);
+        for (size_t j = 0, bullseye = tasks.size() - spectra.size(); j < spectra.size(); j++) {
+          task.name = cur->getName() + " on fraction " + StringUtils::ToString((int)j + 1);
+          task.after.assign(1, bullseye + j);
+          if (j > 0) {
+            task.after.push_back(tasks.size() - 1);
+          }
+          task.run = boost::bind(&PipelineApplication::runSearchOn, this, &spectra, j, &merged);
+          tasks.push_back(task);
+        }
         break;
       case QVALUE_COMMAND:
       case PERCOLATOR_COMMAND:
-        ret = runPostProcessor(cur, resultsFiles);
+        task.threads = threads_;
+        task.run = boost::bind(&PipelineApplication::runPostProcessor, this, cur,
+                               boost::cref(resultsFiles));
+        tasks.push_back(task);
         break;
       default:
         carp(CARP_FATAL, "Pipeline is not set up to run command '%s'",
                          cur->getName().c_str());
         break;
     }
-    delete cur;
-    apps_.erase(apps_.begin());
+  }
 
-    if (ret != 0) {
-      carp(CARP_FATAL, "Error running %s", cur->getName().c_str());
-    }
+  TaskRunner runner(tasks, threads_, budget_);
+  int ret = runner.run();
+  delete merged.target;
+  delete merged.decoy;
+  if (ret != 0) {
+    carp(CARP_FATAL, "Error running %s", runner.failed()->name.c_str());
   }
 
   return 0;
@@ -143,6 +345,16 @@ vector<string> PipelineApplication::getExpectedResultsFiles(
 }
 
 int PipelineApplication::runBullseye(CruxApplication* app, vector<string>* spectra) {
+  for (vector<string>::iterator i = spectra->begin(); i != spectra->end(); i++) {
+    int ret = runBullseyeOn(app, &*i);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+int PipelineApplication::runBullseyeOn(CruxApplication* app, string* spectrum) {
   if (app->getCommand() != BULLSEYE_COMMAND) {
     carp(CARP_FATAL, "Something went wrong.");
   }
@@ -151,24 +363,22 @@ int PipelineApplication::runBullseye(CruxApplication* app, vector<string>* spect
   if (outFormat.empty()) {
     outFormat = "ms2";
   }
-  for (vector<string>::iterator i = spectra->begin(); i != spectra->end(); i++) {
-    string ms1 = *i;
-    if (StringUtils::IEndsWith(ms1, ".ms2") || StringUtils::IEndsWith(ms1, ".cms2")) {
-      string ms1Check = ms1.substr(0, ms1.length() - 1) + '1';
-      if (FileUtils::Exists(ms1Check)) {
-        ms1 = ms1Check;
-      }
-    }
-    string outBase = make_file_path(app->getFileStem() + "." + FileUtils::BaseName(*i));
-    string outMatch = outBase + ".pid." + outFormat;
-    string outNoMatch = outBase + ".nopid." + outFormat;
-    int ret = ((CruxBullseyeApplication*)app)->main(ms1, *i, outMatch, outNoMatch);
-    if (ret != 0) {
-      carp(CARP_ERROR, "Error running Bullseye on '%s'", i->c_str());
-      return ret;
+  string ms1 = *spectrum;
+  if (StringUtils::IEndsWith(ms1, ".ms2") || StringUtils::IEndsWith(ms1, ".cms2")) {
+    string ms1Check = ms1.substr(0, ms1.length() - 1) + '1';
+    if (FileUtils::Exists(ms1Check)) {
+      ms1 = ms1Check;
     }
-    *i = outMatch;
   }
+  string outBase = make_file_path(app->getFileStem() + "." + FileUtils::BaseName(*spectrum));
+  string outMatch = outBase + ".pid." + outFormat;
+  string outNoMatch = outBase + ".nopid." + outFormat;
+  int ret = ((CruxBullseyeApplication*)app)->main(ms1, *spectrum, outMatch, outNoMatch);
+  if (ret != 0) {
+    carp(CARP_ERROR, "Error running Bullseye on '%s'", spectrum->c_str());
+    return ret;
+  }
+  *spectrum = outMatch;
   return 0;
 }
 
@@ -198,6 +408,27 @@ int PipelineApplication::runSearch(
   return ((TideSearchApplication*)app)->main(spectra);
 }
 
+int PipelineApplication::runSearchOn(
+  const vector<string>* spectra,
+  size_t fraction,
+  MergedResults* results
+) {
+  carp(CARP_INFO, "Searching %s against database '%s'", (*spectra)[fraction].c_str(),
+                  Params::GetString("peptide source").c_str());
+  TideSearchApplication search;
+  stringstream target, decoy;
+  search.setResultStreams(&target, &decoy);
+  int ret = search.main(vector<string>(1, (*spectra)[fraction]));
+  if (ret != 0) {
+    return ret;
+  }
+  appendResults(target, results->files[0], &results->target);
+  if (results->files.size() > 1) {
+    appendResults(decoy, results->files[1], &results->decoy);
+  }
+  return 0;
+}
+
 int PipelineApplication::runPostProcessor(
   CruxApplication* app,
   const vector<string>& resultsFiles
@@ -224,9 +455,11 @@ int PipelineApplication::runPostProcessor(
   }
 
   string pin;
+  bool made_pin = false;
   if (resultsFiles.size() == 1 && StringUtils::IEndsWith(resultsFiles.front(), ".pin")) {
     pin = resultsFiles.front();
   } else {
+    made_pin = true;
     // If passed anything but a single pin file, run make-pin
     pin = make_file_path("make-pin.pin");
     carp(CARP_INFO, "Running make-pin");
@@ -235,7 +468,12 @@ int PipelineApplication::runPostProcessor(
     }
     carp(CARP_INFO, "Finished make-pin.");
   }
-  return ((PercolatorApplication*)app)->main(pin);
+  int ret = ((PercolatorApplication*)app)->main(pin);
+  if (made_pin && !Params::GetBool("pin-output")) {
+    // The pin was only made for Percolator to read
+    FileUtils::Remove(pin);
+  }
+  return ret;
 }
 
 string PipelineApplication::getName() const {
@@ -344,5 +582,55 @@ void PipelineApplication::processParams() {
   for (vector<CruxApplication*>::iterator i = apps_.begin(); i != apps_.end(); i++) {
     (*i)->processParams();
   }
+
+  // Tide-search is told what bullseye leaves of the threads and memory, so
+  // that the fractions can overlap.
+  threads_ = Params::GetInt("num-threads");
+  if (threads_ < 1) {
+    threads_ = max(1, (int)boost::thread::hardware_concurrency());
+  }
+  budget_ = (long long)Params::GetInt("max-memory") << 20;
+  bullseyeMemory_ = Params::GetBool("bullseye") ? estimateBullseyeMemory(spectra) : 0;
+  searchMemory_ = budget_;
+  overlap_ = canOverlap(spectra);
+  if (overlap_) {
+    carp(CARP_DEBUG, "Searching each fraction once bullseye has finished with it");
+    if (threads_ > 1) {
+      Params::Set("num-threads", threads_ - 1);
+    }
+    if (budget_ > 0 && 2 * bullseyeMemory_ <= budget_) {
+      searchMemory_ = budget_ - bullseyeMemory_;
+      Params::Set("max-memory", (int)(searchMemory_ >> 20));
+    }
+  }
+}
+
+/**
+ * Whether the fractions can be searched one at a time and their results
+ * joined into what a search of them all would have written: tide-search
+ * after bullseye, on more than one fraction, writing text results and
+ * nothing that covers all the fractions at once.
+ */
+bool PipelineApplication::canOverlap(const vector<string>& spectra) const {
+  return Params::GetBool("bullseye") && spectra.size() > 1 &&
+    Params::GetString("search-engine") != "comet" &&
+    Params::GetBool("txt-output") && !Params::GetBool("pin-output") &&
+    !Params::GetBool("pepxml-output") && !Params::GetBool("mzid-output") &&
+    !Params::GetBool("sqt-output") && !TideMatchSet::binaryOutput() &&
+    !Params::GetBool("compress-output") && !Params::GetBool("qc-report") &&
+    !Params::GetBool("peptide-centric-search");
+}
+
+long long PipelineApplication::estimateBullseyeMemory(const vector<string>& spectra) {
+  long long most = 0;
+  for (vector<string>::const_iterator i = spectra.begin(); i != spectra.end(); i++) {
+    long long bytes = FileUtils::Exists(*i) ? FileUtils::Size(*i) : 0;
+    string ms1 = i->substr(0, i->length() - 1) + '1';
+    if (StringUtils::IEndsWith(*i, "2") && FileUtils::Exists(ms1)) {
+      bytes += FileUtils::Size(ms1);
+    }
+    most = max(most, BULLSEYE_BYTES_PER_FILE_BYTE * bytes);
+  }
+  return most;
 }
 
@@ -3,6 +3,8 @@
 
 #include "CruxApplication.h"
 
+struct MergedResults;
+
 class PipelineApplication : public CruxApplication {
  public:
   PipelineApplication();
@@ -22,14 +24,26 @@ class PipelineApplication : public CruxApplication {
 
  private:
   std::vector<CruxApplication*> apps_;
+  // Whether fractions are searched one at a time, each as soon as bullseye
+  // has finished with it, rather than all together after bullseye.
+  bool overlap_;
+  int threads_;                 // for all the steps together
+  long long budget_;            // bytes for all the steps together, 0 if none
+  long long bullseyeMemory_;    // estimated bytes for bullseye on one fraction
+  long long searchMemory_;      // bytes tide-search plans for
 
   static void checkParams();
   static std::vector<std::string> getExpectedResultsFiles(
     CruxApplication* app,
     const std::vector<std::string>& spectra
   );
+  bool canOverlap(const std::vector<std::string>& spectra) const;
+  static long long estimateBullseyeMemory(const std::vector<std::string>& spectra);
   int runBullseye(CruxApplication* app,
                   std::vector<std::string>* spectra);
+  int runBullseyeOn(CruxApplication* app, std::string* spectrum);
+  int runSearchOn(const std::vector<std::string>* spectra, size_t fraction,
+                  MergedResults* results);
   int runSearch(CruxApplication* app,
                 const std::vector<std::string>& spectra,
                 const std::string& database,
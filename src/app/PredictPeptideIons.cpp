@@ -6,7 +6,9 @@
  *
  * DESCRIPTION: Main method for the predict-peptide-ions.
  *              Given a peptide sequence, and a charge state, predict
- *              the fragmentation ions.
+ *              the fragmentation ions. Given a tide index in place of
+ *              the sequence, write the b and y ion ladders of all of
+ *              its peptides.
  */
 
 #include "PredictPeptideIons.h"
@@ -21,6 +23,8 @@
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "io/carp.h"
 #include "util/crux-utils.h"
 #include "model/objects.h"
@@ -29,11 +33,72 @@
 #include "model/IonSeries.h"
 #include "model/IonConstraint.h"
 #include "model/Peptide.h"
+#include "util/FileUtils.h"
 #include "util/Params.h"
+#include "util/StringUtils.h"
+#include "util/ThreadPool.h"
+#include "app/tide/index_shards.h"
+#include "app/tide/records_to_vector-inl.h"
+#include "app/tide/peptide.h"
+#include "app/tide/theoretical_peak_set.h"
 
 using namespace std;
 using namespace Crux;
 
+// peptides read from the index and turned into ladders on the threads at a
+// time
+static const size_t kPeptidesPerBatch = 1 << 16;
+
+/**
+ * A workspace for Peptide::ComputeTheoreticalPeaks() that keeps the m/z of
+ * each b and y ion it is given, at charges 1 and 2, in place of its bin.
+ */
+class IonLadder : public TheoreticalPeakSet {
+ public:
+  void Clear() {
+    for (int i = 0; i < 2; ++i) {
+      b_[i].clear();
+      y_[i].clear();
+    }
+  }
+  void AddBIon(double mass, int charge) {
+    b_[charge - 1].push_back(Mz(mass + MassConstants::B, charge));
+  }
+  void AddYIon(double mass, int charge) {
+    y_[charge - 1].push_back(Mz(mass + MassConstants::Y, charge));
+  }
+  void GetPeaks(TheoreticalPeakArr* peaks_charge_1,
+                TheoreticalPeakArr* negs_charge_1,
+                TheoreticalPeakArr* peaks_charge_2,
+                TheoreticalPeakArr* negs_charge_2,
+                const pb::Peptide* peptide = NULL) {
+  }
+
+  // b1, b2, ... and y1, y2, ... at charge
+  const vector<double>& B(int charge) const { return b_[charge - 1]; }
+  const vector<double>& Y(int charge) const { return y_[charge - 1]; }
+
+ private:
+  static double Mz(double mass, int charge) {
+    return (mass + charge * MASS_PROTON) / charge;
+  }
+
+  vector<double> b_[2];
+  vector<double> y_[2];
+};
+
+/**
+ * Appends the ions to out as a comma-delimited list.
+ */
+static void appendIons(const vector<double>& ions, int precision, string* out) {
+  char buffer[64];
+  for (size_t i = 0; i < ions.size(); ++i) {
+    int length = snprintf(buffer, sizeof(buffer), i == 0 ? "%.*f" : ",%.*f",
+                          precision, ions[i]);
+    out->append(buffer, length);
+  }
+}
+
 /**
  * \returns A blank PredictPeptideIons object.
  */
@@ -55,6 +120,10 @@ int PredictPeptideIons::main(int argc, char** argv) {
   string peptide_sequence = Params::GetString("peptide sequence");
   int charge_state = Params::GetInt("charge state");
 
+  if (FileUtils::Exists(FileUtils::Join(peptide_sequence, "pepix"))) {
+    return predictIndexIons(peptide_sequence, charge_state);
+  }
+
   /* Get Options */
   ION_TYPE_T ion_type;
   string_to_ion_type(Params::GetString("primary-ions"), &ion_type);
@@ -113,8 +182,8 @@ int PredictPeptideIons::main(int argc, char** argv) {
   // print settings
   printf("# PEPTIDE: %s\n", peptide_sequence.c_str());
   printf("# AVERAGE: %f MONO:%f\n",
-    Peptide::calcSequenceMass(peptide_sequence, AVERAGE),
-    Peptide::calcSequenceMass(peptide_sequence, MONO));
+    Crux::Peptide::calcSequenceMass(peptide_sequence, AVERAGE),
+    Crux::Peptide::calcSequenceMass(peptide_sequence, MONO));
   printf("# CHARGE: %d\n", charge_state);
   printf("# MAX-ION-CHARGE: %s\n", max_ion_charge.c_str());
   printf("# NH3 modification: %d\n", neutral_loss_count[NH3]);
@@ -132,6 +201,176 @@ int PredictPeptideIons::main(int argc, char** argv) {
   return 0;
 }
 
+/**
+ * Writes the b and y ion ladders of the peptides of a tide index, up to the
+ * fragment charge that max-ion-charge allows for charge_state, to
+ * predict-peptide-ions.ions.txt in the output directory. The peptides are
+ * read in batches, and the ladders of each batch are made on the threads.
+ */
+int PredictPeptideIons::predictIndexIons(
+  const string& index_dir, ///< directory of the tide index
+  int charge_state ///< charge of the peptides
+) {
+  string peptides_file = FileUtils::Join(index_dir, "pepix");
+  string proteins_file = FileUtils::Join(index_dir, "protix");
+
+  // the same limit on fragment charges as IonConstraint
+  int max_charge = max(1, charge_state - 1);
+  string max_ion_charge = Params::GetString("max-ion-charge");
+  if (max_ion_charge != "peptide") {
+    int charge_val;
+    if (StringUtils::TryFromString(max_ion_charge, &charge_val)) {
+      max_charge = min(charge_val, max_charge);
+    } else {
+      carp(CARP_WARNING, "Charge is not valid:%s", max_ion_charge.c_str());
+    }
+  }
+  if (max_charge > 2) {
+    carp(CARP_WARNING, "Ion ladders from a tide index are written for fragment "
+         "charges 1 and 2 only.");
+    max_charge = 2;
+  }
+
+  carp(CARP_INFO, "Reading proteins...");
+  ProteinVec proteins;
+  pb::Header protein_header;
+  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins,
+      proteins_file, &protein_header)) {
+    carp(CARP_FATAL, "Error reading index (%s)", proteins_file.c_str());
+  }
+
+  pb::Header peptides_header;
+  HeadedRecordReader peptide_reader(peptides_file, &peptides_header);
+  if (peptides_header.file_type() != pb::Header::PEPTIDES ||
+      !peptides_header.has_peptides_header()) {
+    carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
+  }
+  const pb::Header::PeptidesHeader& pepHeader = peptides_header.peptides_header();
+  MassConstants::Init(&pepHeader.mods(), &pepHeader.nterm_mods(), &pepHeader.cterm_mods(),
+                      Params::GetDouble("mz-bin-width"),
+                      Params::GetDouble("mz-bin-offset"));
+
+  // If the index is sharded by mass, the peptides come from the shards.
+  vector<IndexShard> shards;
+  ShardedRecordReader* shard_reader = NULL;
+  string shard_manifest = ShardManifestName(peptides_file);
+  if (FileUtils::Exists(shard_manifest)) {
+    if (!ReadShardManifest(shard_manifest, &shards)) {
+      carp(CARP_FATAL, "Error reading the shard manifest %s", shard_manifest.c_str());
+    }
+    shard_reader = new ShardedRecordReader(shards, false);
+  }
+  RecordReader* reader = peptide_reader.Reader();
+
+  string output_folder = Params::GetString("output-dir");
+  bool overwrite = Params::GetBool("overwrite");
+  if (create_output_directory(output_folder, overwrite) == -1) {
+    carp(CARP_FATAL, "Unable to create output directory %s.", output_folder.c_str());
+  }
+  string output_file = make_file_path(getName() + ".ions.txt" +
+    (Params::GetBool("compress-output") ? ".gz" : ""));
+  if (FileUtils::Exists(output_file) && !overwrite) {
+    carp(CARP_FATAL, "The file '%s' already exists and cannot be overwritten. "
+         "Use --overwrite T to replace or choose a different output file name",
+         output_file.c_str());
+  }
+  ostream* output_stream = FileUtils::GetWriteStream(output_file, true);
+  if (output_stream == NULL) {
+    carp(CARP_FATAL, "Failed to create and open file: %s", output_file.c_str());
+  }
+  *output_stream << "sequence\tpeptide mass\tion charge\tb ions\ty ions" << endl;
+
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = boost::thread::hardware_concurrency();
+  }
+  num_threads = max(1, num_threads);
+  bool skip_decoys = Params::GetBool("skip-decoys");
+  int precision = Params::GetInt("mass-precision");
+
+  vector<pb::Peptide> batch(kPeptidesPerBatch);
+  vector<string> text(num_threads);
+  long peptide_count = 0;
+  while (true) {
+    size_t size = 0;
+    while (size < batch.size() &&
+           !(shard_reader != NULL ? shard_reader->Done() : reader->Done())) {
+      if (shard_reader != NULL) {
+        shard_reader->Read(&batch[size]);
+      } else {
+        reader->Read(&batch[size]);
+      }
+      if (!skip_decoys || !batch[size].is_decoy()) {
+        ++size;
+      }
+    }
+    if (size == 0) {
+      break;
+    }
+    peptide_count += size;
+
+    // each thread writes the ladders of a run of the batch
+    size_t threads = min((size_t)num_threads, size);
+    ThreadPool::TaskGroup thread_group;
+    for (size_t t = 1; t < threads; ++t) {
+      thread_group.Run(boost::bind(&PredictPeptideIons::writeIonLadders,
+        &batch, size * t / threads, size * (t + 1) / threads, &proteins,
+        max_charge, precision, &text[t]));
+    }
+    writeIonLadders(&batch, 0, size / threads, &proteins, max_charge, precision, &text[0]);
+    thread_group.Wait();
+    for (size_t t = 0; t < threads; ++t) {
+      output_stream->write(text[t].data(), text[t].size());
+    }
+  }
+  carp(CARP_INFO, "Wrote the ion ladders of %ld peptides to %s.",
+       peptide_count, output_file.c_str());
+
+  delete shard_reader;
+  delete output_stream;
+  for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
+    delete *i;
+  }
+  return 0;
+}
+
+/**
+ * Writes, to out, one line for each of the peptides [begin, end) of batch and
+ * each fragment charge up to max_charge: the peptide, its mass, the charge,
+ * and its b and y ions at that charge.
+ */
+void PredictPeptideIons::writeIonLadders(
+  const vector<pb::Peptide>* batch, ///< peptides read from the index
+  size_t begin, ///< first peptide to write
+  size_t end, ///< one past the last peptide to write
+  const ProteinVec* proteins, ///< proteins of the index
+  int max_charge, ///< highest fragment charge
+  int precision, ///< digits after the decimal point
+  string* out ///< text of the lines
+) {
+  out->clear();
+  IonLadder ladder;
+  char buffer[64];
+  for (size_t i = begin; i < end; ++i) {
+    ::Peptide peptide((*batch)[i], *proteins);
+    ladder.Clear();
+    peptide.ComputeTheoreticalPeaks(&ladder);
+    string sequence = peptide.SeqWithMods();
+    int length = snprintf(buffer, sizeof(buffer), "\t%.*f", precision, peptide.Mass());
+    for (int charge = 1; charge <= max_charge; ++charge) {
+      out->append(sequence);
+      out->append(buffer, length);
+      out->push_back('\t');
+      out->append(StringUtils::ToString(charge));
+      out->push_back('\t');
+      appendIons(ladder.B(charge), precision, out);
+      out->push_back('\t');
+      appendIons(ladder.Y(charge), precision, out);
+      out->push_back('\n');
+    }
+  }
+}
+
 /**
  * \returns The command name for PredictPeptideIons.
  */
@@ -147,7 +386,10 @@ string PredictPeptideIons::getDescription() const {
     "[[nohtml:Given a peptide and a charge state, predict the m/z values of "
     "the resulting fragment ions.]]"
     "[[html:<p>Given a peptide and a charge state, predict the corresponding "
-    "fragment ions according to the provided options.</p>]]";
+    "fragment ions according to the provided options.</p><p>If the peptide "
+    "sequence is instead the directory of an index made by tide-index, the "
+    "b and y ion ladders of every peptide in the index are written, in "
+    "bulk, to a file in the output directory.</p>]]";
 }
 
 /**
@@ -173,7 +415,14 @@ vector<string> PredictPeptideIons::getOptions() const {
     "max-ion-charge",
     "fragment-mass",
     "nh3",
-    "h2o"
+    "h2o",
+    "skip-decoys",
+    "mass-precision",
+    "num-threads",
+    "compress-output",
+    "fileroot",
+    "output-dir",
+    "overwrite"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -207,6 +456,16 @@ vector< pair<string, string> > PredictPeptideIons::getOutputs() const {
     "<li>&lt;isotope&gt; is the number of adjacent isotopic peaks</li>"
     "<li>&lt;flank&gt; is the number of flanking ions</li>"
     "</ul></p>"));
+  outputs.push_back(make_pair("predict-peptide-ions.ions.txt",
+    "written in place of the above when the peptide sequence is a tide index: "
+    "a tab-delimited file with one line for each peptide of the index and "
+    "each fragment charge (1 and, for peptides of charge 3 or more, 2), "
+    "giving the peptide with its modifications, its neutral mass, the "
+    "fragment charge, and comma-delimited lists of the m/z of its b ions "
+    "b1, b2, ... and of its y ions y1, y2, .... Only the primary b and y "
+    "ions are written; the neutral loss, isotope and flanking options do "
+    "not apply. With compress-output, the file is gzipped and its name ends "
+    "in .gz."));
   return outputs;
 }
 
@@ -15,8 +15,40 @@
 #include "io/carp.h"
 #include "parameter.h"
 
+namespace pb {
+class Peptide;
+class Protein;
+}
+
 class PredictPeptideIons: public CruxApplication {
 
+ protected:
+  /**
+   * Writes the b and y ion ladders of the peptides of a tide index, up to
+   * the fragment charge that max-ion-charge allows for charge_state, to
+   * predict-peptide-ions.ions.txt in the output directory. The peptides are
+   * read in batches, and the ladders of each batch are made on the threads.
+   */
+  int predictIndexIons(
+    const std::string& index_dir, ///< directory of the tide index
+    int charge_state ///< charge of the peptides
+  );
+
+  /**
+   * Writes, to out, one line for each of the peptides [begin, end) of batch
+   * and each fragment charge up to max_charge: the peptide, its mass, the
+   * charge, and its b and y ions at that charge.
+   */
+  static void writeIonLadders(
+    const std::vector<pb::Peptide>* batch, ///< peptides read from the index
+    size_t begin, ///< first peptide to write
+    size_t end, ///< one past the last peptide to write
+    const std::vector<const pb::Protein*>* proteins, ///< proteins of the index
+    int max_charge, ///< highest fragment charge
+    int precision, ///< digits after the decimal point
+    std::string* out ///< text of the lines
+  );
+
  public:
   /**
    * \returns A blank PredictPeptideIons object.
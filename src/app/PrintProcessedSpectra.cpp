@@ -9,10 +9,15 @@
  *              xcorr and print peaks in ms2 format to new file.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "PrintProcessedSpectra.h"
 #include "io/SpectrumCollectionFactory.h"
 #include "util/Params.h"
 #include "util/GlobalParams.h"
+#include "util/ThreadPool.h"
 
 using namespace std;
 
@@ -60,6 +65,12 @@ int PrintProcessedSpectra::main(int argc, char** argv) {
   //fprintf(output_ms2, "%s", header);
   fprintf(output_ms2, "H\tComment\tSpectra processed as for Xcorr\n");
 
+  FILE* output_bin = NULL;
+  if (Params::GetBool("binary-output")) {
+    output_bin = create_file_in_path(output_ms2_name + ".bin", output_dir, overwrite);
+    fwrite("CRUXPPS1", 1, 8, output_bin);
+  }
+
   // create iterator for getting spectra
   FilteredSpectrumChargeIterator* spectrum_iterator =
     new FilteredSpectrumChargeIterator(spectra);
@@ -68,26 +79,53 @@ int PrintProcessedSpectra::main(int argc, char** argv) {
     carp(CARP_FATAL, "Could create spectrum iterator");
   }
 
-  // loop over all spectra, process, print
+  vector<ProcessedPair> pairs;
+  int group = -1;
   while (spectrum_iterator->hasNext()) {
     SpectrumZState cur_zstate;
-    int cur_charge = 0;
-    Crux::Spectrum* cur_spectrum = 
-      spectrum_iterator->next(cur_zstate);
+    Crux::Spectrum* cur_spectrum = spectrum_iterator->next(cur_zstate);
+    if (pairs.empty() || pairs.back().spectrum != cur_spectrum) {
+      ++group;
+    }
+    pairs.push_back(ProcessedPair(cur_spectrum, cur_zstate, group));
+  }
+  delete spectrum_iterator;
 
-    cur_charge = cur_zstate.getCharge();
-    carp(CARP_DETAILED_INFO, "Processing spectrum %d charge %d.",
-         cur_spectrum->getFirstScan(), cur_charge);
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = boost::thread::hardware_concurrency();
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
 
-    // change the peak values
-    FLOAT_T* intensities = NULL;
-    int max_mz_bin = 0;
-    Scorer::getProcessedPeaks(cur_spectrum, cur_charge, XCORR,
-                        &intensities, &max_mz_bin, stop_after);
+  // loop over the pairs a batch at a time, processing the spectra of a batch
+  // in parallel and then printing them in order
+  const size_t kBatchSize = 4096;
+  for (size_t begin = 0; begin < pairs.size(); begin += kBatchSize) {
+    size_t end = min(pairs.size(), begin + kBatchSize);
+    if (num_threads > 1) {
+      ThreadPool::TaskGroup workers;
+      for (int t = 0; t < num_threads; t++) {
+        workers.Run(boost::bind(&PrintProcessedSpectra::processPairs,
+          &pairs, begin, end, t, num_threads, stop_after, output_bin != NULL));
+      }
+      workers.Wait();
+    } else {
+      processPairs(&pairs, begin, end, 0, 1, stop_after, output_bin != NULL);
+    }
+    for (size_t i = begin; i < end; i++) {
+      fputs(pairs[i].ms2.c_str(), output_ms2);
+      string().swap(pairs[i].ms2);
+    }
+    if (output_bin != NULL) {
+      writeBinaryBlock(pairs, begin, end, output_bin);
+    }
+  }
 
-    // print processed spectrum
-    cur_spectrum->printProcessedPeaks(cur_zstate,
-                                      intensities, max_mz_bin, output_ms2);
+  if (output_bin != NULL) {
+    writeBinaryBlock(pairs, 0, 0, output_bin);
+    fclose(output_bin);
   }
 
   // close output file
@@ -139,6 +177,8 @@ vector<string> PrintProcessedSpectra::getOptions() const {
   string arr[] = {
     "stop-after",
     "output-units",
+    "binary-output",
+    "num-threads",
     "spectrum-parser",
     "use-z-line",
     "verbosity",
@@ -156,6 +196,9 @@ vector< pair<string, string> > PrintProcessedSpectra::getOutputs() const {
   outputs.push_back(make_pair("output file",
     "The name of the file in which the processed spectra will be printed in "
     "MS2 format."));
+  outputs.push_back(make_pair("output file.bin",
+    "With binary-output, the processed spectra in the column-oriented binary "
+    "format described under binary-output."));
   return outputs;
 }
 
@@ -174,6 +217,89 @@ bool PrintProcessedSpectra::needsOutputDirectory() const {
   return true;
 }
 
+void PrintProcessedSpectra::processPairs(
+  vector<ProcessedPair>* pairs,
+  size_t begin,
+  size_t end,
+  int first,
+  int stride,
+  OBSERVED_PREPROCESS_STEP_T stop_after,
+  bool binary
+) {
+  for (size_t i = begin; i < end; i++) {
+    ProcessedPair& pair = (*pairs)[i];
+    if (pair.group % stride != first) {
+      continue;
+    }
+    int cur_charge = pair.zstate.getCharge();
+    carp(CARP_DETAILED_INFO, "Processing spectrum %d charge %d.",
+         pair.spectrum->getFirstScan(), cur_charge);
+
+    // change the peak values
+    FLOAT_T* intensities = NULL;
+    int max_mz_bin = 0;
+    Scorer::getProcessedPeaks(pair.spectrum, cur_charge, XCORR,
+                              &intensities, &max_mz_bin, stop_after);
+
+    pair.spectrum->formatProcessedPeaks(pair.zstate, intensities, max_mz_bin,
+                                        &pair.ms2);
+    if (binary) {
+      for (int bin = 0; bin < max_mz_bin; bin++) {
+        if (intensities[bin] != 0) {
+          pair.bins.push_back(bin);
+          pair.intensities.push_back(intensities[bin]);
+        }
+      }
+    }
+    free(intensities);
+  }
+}
+
+// Append the little-endian bytes of x to out.
+template<typename T>
+static void AppendLittleEndian(T x, string* out) {
+  unsigned char bytes[sizeof(T)];
+  memcpy(bytes, &x, sizeof(T));
+  unsigned int one = 1;
+  if (*(unsigned char*)&one != 1) {
+    reverse(bytes, bytes + sizeof(T));
+  }
+  out->append((const char*)bytes, sizeof(T));
+}
+
+void PrintProcessedSpectra::writeBinaryBlock(
+  const vector<ProcessedPair>& pairs,
+  size_t begin,
+  size_t end,
+  FILE* file
+) {
+  string block;
+  AppendLittleEndian((int32_t)(end - begin), &block);
+  for (size_t i = begin; i < end; i++) {
+    AppendLittleEndian((int32_t)pairs[i].spectrum->getFirstScan(), &block);
+  }
+  for (size_t i = begin; i < end; i++) {
+    AppendLittleEndian((int32_t)pairs[i].zstate.getCharge(), &block);
+  }
+  for (size_t i = begin; i < end; i++) {
+    AppendLittleEndian((double)pairs[i].spectrum->getPrecursorMz(), &block);
+  }
+  for (size_t i = begin; i < end; i++) {
+    AppendLittleEndian((int32_t)pairs[i].bins.size(), &block);
+  }
+  for (size_t i = begin; i < end; i++) {
+    for (size_t j = 0; j < pairs[i].bins.size(); j++) {
+      AppendLittleEndian((int32_t)pairs[i].bins[j], &block);
+    }
+  }
+  for (size_t i = begin; i < end; i++) {
+    for (size_t j = 0; j < pairs[i].intensities.size(); j++) {
+      AppendLittleEndian(pairs[i].intensities[j], &block);
+    }
+  }
+  fwrite(block.data(), 1, block.size(), file);
+}
+
 /*
  * Local Variables:
  * mode: c
@@ -77,7 +77,44 @@ class PrintProcessedSpectra: public CruxApplication {
 
   virtual bool needsOutputDirectory() const;
 
+ protected:
+  /**
+   * A spectrum-charge pair to process, and what processing it gave.
+   */
+  struct ProcessedPair {
+    Crux::Spectrum* spectrum;
+    SpectrumZState zstate;
+    int group;  ///< the ordinal of spectrum, so a thread gets all its charges
+    std::string ms2;  ///< the pair in ms2 format
+    std::vector<int> bins;  ///< for binary-output, the nonzero bins
+    std::vector<float> intensities;  ///< and their intensities
+    ProcessedPair(Crux::Spectrum* spectrum_, const SpectrumZState& zstate_, int group_)
+      : spectrum(spectrum_), zstate(zstate_), group(group_) {}
+  };
 
+  /**
+   * Process the pairs [begin, end) of pairs whose group is first modulo
+   * stride.
+   */
+  static void processPairs(
+    std::vector<ProcessedPair>* pairs,
+    size_t begin,
+    size_t end,
+    int first,
+    int stride,
+    OBSERVED_PREPROCESS_STEP_T stop_after,
+    bool binary
+  );
+
+  /**
+   * Write one block of the binary output, for pairs [begin, end).
+   */
+  static void writeBinaryBlock(
+    const std::vector<ProcessedPair>& pairs,
+    size_t begin,
+    size_t end,
+    FILE* file
+  );
 };
 
 
@@ -5,11 +5,21 @@
 #include "parameter.h"
 #include "app/tide/records_to_vector-inl.h"
 #include "app/tide/peptide.h"
+#include "app/tide/index_shards.h"
+#include "util/FileUtils.h"
 #include "util/Params.h"
+#include "util/StringUtils.h"
+#include "util/ThreadPool.h"
+#include <set>
 #include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
+// peptides read from the index and parsed and written on the threads at a time
+static const size_t kPeptidesPerBatch = 1 << 16;
+
 ReadTideIndex::ReadTideIndex() {
 }
 
@@ -42,10 +52,29 @@ int ReadTideIndex::main(int argc, char** argv) {
   }
   carp(CARP_DEBUG, "Read %d auxlocs", locations.size());
 
+  // The proteins whose peptides are written, if not all of them
+  vector<bool> wanted_proteins;
+  string protein_filter = Params::GetString("protein-filter");
+  if (!protein_filter.empty()) {
+    vector<string> names = StringUtils::Split(protein_filter, ',');
+    set<string> wanted_names(names.begin(), names.end());
+    wanted_proteins.resize(proteins.size(), false);
+    size_t found = 0;
+    for (size_t i = 0; i < proteins.size(); ++i) {
+      if (proteins[i]->has_name() && wanted_names.count(proteins[i]->name()) > 0) {
+        wanted_proteins[i] = true;
+        ++found;
+      }
+    }
+    if (found == 0) {
+      carp(CARP_WARNING, "None of the proteins of protein-filter are in the index.");
+    }
+  }
+
   // Read peptides index file
   carp(CARP_INFO, "Reading peptides...");
   pb::Header peptides_header;
-  HeadedRecordReader peptide_reader(peptides_file, &peptides_header);
+  HeadedRecordReader peptide_reader(peptides_file, &peptides_header, -1, true);
   if (peptides_header.file_type() != pb::Header::PEPTIDES ||
       !peptides_header.has_peptides_header()) {
     carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
@@ -56,44 +85,160 @@ int ReadTideIndex::main(int argc, char** argv) {
                       Params::GetDouble("mz-bin-width"),
                       Params::GetDouble("mz-bin-offset"));
 
+  // If the index is sharded by mass, the peptides come from the shards.
+  vector<IndexShard> shards;
+  ShardedRecordReader* shard_reader = NULL;
+  string shard_manifest = ShardManifestName(peptides_file);
+  if (FileUtils::Exists(shard_manifest)) {
+    if (!ReadShardManifest(shard_manifest, &shards)) {
+      carp(CARP_FATAL, "Error reading the shard manifest %s", shard_manifest.c_str());
+    }
+    shard_reader = new ShardedRecordReader(shards, true);
+  }
+  RecordReader* reader = peptide_reader.Reader();
+
+  // The peptides are in order of mass, so the mass range is read from the
+  // last skip table entry below min-mass up to the first peptide past max-mass.
+  double min_mass = Params::IsDefault("min-mass") ? 0 : Params::GetDouble("min-mass");
+  double max_mass = Params::IsDefault("max-mass") ? BILLION : Params::GetDouble("max-mass");
+  if (min_mass > 0) {
+    if (shard_reader != NULL) {
+      shard_reader->SkipBelow(min_mass);
+    } else {
+      reader->SkipTo(min_mass);
+    }
+  }
+
   // Set up output file
   string output_file = make_file_path(getName() + ".peptides.txt");
   ofstream* output_stream = create_stream_in_path(
     output_file.c_str(), NULL, Params::GetBool("overwrite"));
   *output_stream << get_column_header(SEQUENCE_COL) << '\t'
-                 << get_column_header(PROTEIN_ID_COL) << endl;
+                 << get_column_header(PEPTIDE_MASS_COL) << '\t'
+                 << get_column_header(PROTEIN_ID_COL) << '\n';
 
-  RecordReader* reader = peptide_reader.Reader();
-  while (!reader->Done()) {
-    // Read peptide
-    pb::Peptide pb_peptide;
-    reader->Read(&pb_peptide);
-    if (Params::GetBool("skip-decoys") && pb_peptide.is_decoy()) {
-      continue;
-    }
-    Peptide peptide(pb_peptide, proteins);
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = boost::thread::hardware_concurrency();
+  }
+  num_threads = max(1, num_threads);
 
-    // Output to file
-    *output_stream << peptide.SeqWithMods() << '\t'
-                   << proteins[peptide.FirstLocProteinId()]->name();
-    if (peptide.HasAuxLocationsIndex()) {
-      const pb::AuxLocation* aux_loc = locations[peptide.AuxLocationsIndex()];
-      for (int i = 0; i < aux_loc->location_size(); i++) {
-        const pb::Protein* protein = proteins[aux_loc->location(i).protein_id()];
-        if (protein->has_name()) {
-          *output_stream << ';' << protein->name();
-        }
+  // The records of a batch are read as they are, and parsed and written on
+  // the threads.
+  WriteOptions options;
+  options.proteins = &proteins;
+  options.locations = &locations;
+  options.wanted_proteins = &wanted_proteins;
+  options.skip_decoys = Params::GetBool("skip-decoys");
+  options.min_mass = min_mass;
+  options.max_mass = max_mass;
+  options.precision = Params::GetInt("mass-precision");
+  vector<string> records(kPeptidesPerBatch);
+  vector<pb::Peptide> batch(kPeptidesPerBatch);
+  vector<string> text(num_threads);
+  long peptide_count = 0;
+  bool done = false;
+  while (!done) {
+    size_t size = 0;
+    while (size < records.size() &&
+           !(shard_reader != NULL ? shard_reader->Done() : reader->Done())) {
+      if (shard_reader != NULL) {
+        shard_reader->ReadBytes(&records[size]);
+      } else {
+        reader->ReadBytes(&records[size]);
       }
+      ++size;
     }
-    *output_stream << endl;
+    if (size == 0) {
+      break;
+    }
+
+    // each thread writes the peptides of a run of the batch
+    size_t threads = min((size_t)num_threads, size);
+    ThreadPool::TaskGroup thread_group;
+    for (size_t t = 1; t < threads; ++t) {
+      thread_group.Run(boost::bind(&ReadTideIndex::writePeptides,
+        &records, &batch, size * t / threads, size * (t + 1) / threads,
+        &options, &text[t]));
+    }
+    writePeptides(&records, &batch, 0, size / threads, &options, &text[0]);
+    thread_group.Wait();
+    for (size_t t = 0; t < threads; ++t) {
+      output_stream->write(text[t].data(), text[t].size());
+    }
+    peptide_count += size;
+    done = batch[size - 1].mass() > max_mass;
   }
+  carp(CARP_DEBUG, "Read %ld peptides", peptide_count);
 
+  delete shard_reader;
   output_stream->close();
   delete output_stream;
 
   return 0;
 }
 
+/**
+ * Parses the records [begin, end) of records into batch and writes, to out,
+ * one line for each of them that passes the filters: the peptide, its mass,
+ * and the proteins it occurs in.
+ */
+void ReadTideIndex::writePeptides(
+  const vector<string>* records, ///< encoded peptides read from the index
+  vector<pb::Peptide>* batch, ///< the peptides, as parsed
+  size_t begin, ///< first peptide to write
+  size_t end, ///< one past the last peptide to write
+  const WriteOptions* options, ///< the index and the filters
+  string* out ///< text of the lines
+) {
+  const ProteinVec* proteins = options->proteins;
+  const vector<const pb::AuxLocation*>* locations = options->locations;
+  const vector<bool>* wanted_proteins = options->wanted_proteins;
+  out->clear();
+  char buffer[64];
+  for (size_t i = begin; i < end; ++i) {
+    pb::Peptide& pb_peptide = (*batch)[i];
+    if (!pb_peptide.ParseFromString((*records)[i])) {
+      carp(CARP_FATAL, "Error reading a peptide of the index");
+    }
+    if ((options->skip_decoys && pb_peptide.is_decoy()) ||
+        pb_peptide.mass() < options->min_mass ||
+        pb_peptide.mass() > options->max_mass) {
+      continue;
+    }
+    const pb::AuxLocation* aux_loc = pb_peptide.has_aux_locations_index() ?
+      (*locations)[pb_peptide.aux_locations_index()] : NULL;
+    if (!wanted_proteins->empty() &&
+        !(*wanted_proteins)[pb_peptide.first_location().protein_id()]) {
+      bool wanted = false;
+      for (int j = 0; aux_loc != NULL && j < aux_loc->location_size() && !wanted; ++j) {
+        wanted = (*wanted_proteins)[aux_loc->location(j).protein_id()];
+      }
+      if (!wanted) {
+        continue;
+      }
+    }
+    Peptide peptide(pb_peptide, *proteins);
+
+    // Output to file
+    out->append(peptide.SeqWithMods());
+    int length = snprintf(buffer, sizeof(buffer), "\t%.*f\t",
+                          options->precision, peptide.Mass());
+    out->append(buffer, length);
+    out->append((*proteins)[peptide.FirstLocProteinId()]->name());
+    if (aux_loc != NULL) {
+      for (int j = 0; j < aux_loc->location_size(); j++) {
+        const pb::Protein* protein = (*proteins)[aux_loc->location(j).protein_id()];
+        if (protein->has_name()) {
+          out->push_back(';');
+          out->append(protein->name());
+        }
+      }
+    }
+    out->push_back('\n');
+  }
+}
+
 string ReadTideIndex::getName() const {
   return "read-tide-index";
 }
@@ -112,7 +257,12 @@ vector<string> ReadTideIndex::getArgs() const {
 
 vector<string> ReadTideIndex::getOptions() const {
   string arr[] = {
-    "skip-decoys"
+    "skip-decoys",
+    "min-mass",
+    "max-mass",
+    "protein-filter",
+    "mass-precision",
+    "num-threads"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -120,8 +270,9 @@ vector<string> ReadTideIndex::getOptions() const {
 vector< pair<string, string> > ReadTideIndex::getOutputs() const {
   vector< pair<string, string> > outputs;
   outputs.push_back(make_pair("read-tide-index.peptides.txt",
-    "a tab-delimited file containing two columns with headers: the peptide, and "
-    "a semicolon-delimited list of IDs of the proteins that peptide occurs in."));
+    "a tab-delimited file containing three columns with headers: the peptide, "
+    "its mass, and a semicolon-delimited list of IDs of the proteins that peptide "
+    "occurs in."));
   outputs.push_back(make_pair("read-tide-index.params.txt",
     "a file containing the name and value of all parameters/options for the "
     "current operation. Not all parameters in the file may have been used in "
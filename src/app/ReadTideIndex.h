@@ -8,9 +8,12 @@
 #include <iomanip>
 #include <fstream>
 #include <string>
+#include <vector>
 #include <gflags/gflags.h>
 #include "tide/spectrum_collection.h"
 #include "tide/records.h"
+#include "peptides.pb.h"
+#include "raw_proteins.pb.h"
 
 using namespace std;
 
@@ -68,7 +71,33 @@ class ReadTideIndex : public CruxApplication {
   virtual bool hidden() const;
 
  protected:
+  /**
+   * What writePeptides() needs besides the records, which is the same for
+   * every batch.
+   */
+  struct WriteOptions {
+    const vector<const pb::Protein*>* proteins; ///< proteins of the index
+    const vector<const pb::AuxLocation*>* locations; ///< auxlocs of the index
+    const vector<bool>* wanted_proteins; ///< proteins to write, or empty for all
+    bool skip_decoys; ///< whether to leave out decoys
+    double min_mass; ///< lightest peptide to write
+    double max_mass; ///< heaviest peptide to write
+    int precision; ///< digits after the decimal point
+  };
 
+  /**
+   * Parses the records [begin, end) of records into batch and writes, to
+   * out, one line for each of them that passes the filters: the peptide,
+   * its mass, and the proteins it occurs in.
+   */
+  static void writePeptides(
+    const vector<string>* records, ///< encoded peptides read from the index
+    vector<pb::Peptide>* batch, ///< the peptides, as parsed
+    size_t begin, ///< first peptide to write
+    size_t end, ///< one past the last peptide to write
+    const WriteOptions* options, ///< the index and the filters
+    string* out ///< text of the lines
+  );
 };
 
 #endif
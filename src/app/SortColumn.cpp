@@ -10,11 +10,192 @@
 #include "fdstream.hpp"
 
 #include <errno.h>
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "util/WinCrux.h"
 #include "util/Params.h"
 
 using namespace std;
 
+// Memory for the rows being sorted when memory-limit is not set.
+static const long long DEFAULT_SORT_MEMORY_MB = 1024;
+static const size_t MIN_RUN_BYTES = 1 << 20;
+// Rows are written, and runs read, in blocks of this size.
+static const size_t OUTPUT_BLOCK_BYTES = 4 << 20;
+static const size_t MIN_READ_BUFFER_BYTES = 64 << 10;
+static const size_t MAX_READ_BUFFER_BYTES = 4 << 20;
+
+/**
+ * The key of a row: its number, or for strings the position of its field
+ * in the run's text.
+ */
+struct SortKey {
+  double number;
+  size_t text_begin;
+  size_t text_length;
+  size_t row;
+};
+
+/**
+ * Rows read from the file, each ending in a newline: row i is
+ * lines[line_begin[i], line_begin[i + 1]), and keys[i] its key until the
+ * keys are sorted.
+ */
+struct SortRun {
+  SortRun() : line_begin(1, 0) {}
+  string lines;
+  vector<size_t> line_begin;
+  vector<SortKey> keys;
+};
+
+/**
+ * A row of a run file, followed by its line_length bytes.
+ */
+struct RunRecord {
+  double number;
+  uint32_t text_begin; ///< of the key, within the row
+  uint32_t text_length;
+  uint32_t line_length;
+  uint32_t reserved;
+};
+
+static int compareText(const char* a, size_t a_length, const char* b, size_t b_length) {
+  int result = memcmp(a, b, min(a_length, b_length));
+  if (result != 0) {
+    return result;
+  }
+  return a_length < b_length ? -1 : (a_length > b_length ? 1 : 0);
+}
+
+/**
+ * Orders the keys of a run, breaking ties by row.
+ */
+class KeyOrder {
+ public:
+  KeyOrder(const string* lines, bool ascending) : lines_(lines), ascending_(ascending) {}
+  bool operator()(const SortKey& a, const SortKey& b) const {
+    int result;
+    if (lines_ != NULL) {
+      result = compareText(lines_->data() + a.text_begin, a.text_length,
+                           lines_->data() + b.text_begin, b.text_length);
+    } else {
+      result = a.number < b.number ? -1 : (b.number < a.number ? 1 : 0);
+    }
+    if (result == 0) {
+      result = a.row < b.row ? -1 : 1;
+    }
+    return ascending_ ? result < 0 : result > 0;
+  }
+ private:
+  const string* lines_; ///< the text of string keys, or NULL for numbers
+  bool ascending_;
+};
+
+/**
+ * Writes to an ostream in large blocks.
+ */
+class OutputBlock {
+ public:
+  explicit OutputBlock(ostream& os) : os_(os) { block_.reserve(OUTPUT_BLOCK_BYTES); }
+  ~OutputBlock() { flush(); }
+  void append(const char* data, size_t size) {
+    block_.append(data, size);
+    if (block_.size() >= OUTPUT_BLOCK_BYTES) {
+      flush();
+    }
+  }
+  void append(const string& data) { append(data.data(), data.size()); }
+  void append(char c) { append(&c, 1); }
+  void flush() {
+    if (!block_.empty()) {
+      os_.write(block_.data(), block_.size());
+      block_.clear();
+    }
+    os_.flush();
+  }
+ private:
+  ostream& os_;
+  string block_;
+};
+
+/**
+ * Reads the rows of a run file in order, through a large buffer.
+ */
+class RunReader {
+ public:
+  RunReader(const string& filename, size_t buffer_bytes)
+    : buffer_(buffer_bytes), done_(false) {
+    file_ = fopen(filename.c_str(), "rb");
+    if (file_ == NULL) {
+      carp(CARP_FATAL, "Error opening temp file %s!\n Error: %s",
+           filename.c_str(), strerror(errno));
+    }
+    setvbuf(file_, &buffer_[0], _IOFBF, buffer_.size());
+    next();
+  }
+  ~RunReader() { fclose(file_); }
+  bool done() const { return done_; }
+  const string& line() const { return line_; }
+  double number() const { return record_.number; }
+  const char* text() const { return line_.data() + record_.text_begin; }
+  size_t textLength() const { return record_.text_length; }
+  void next() {
+    if (fread(&record_, sizeof(record_), 1, file_) != 1) {
+      done_ = true;
+      return;
+    }
+    line_.resize(record_.line_length);
+    if (record_.line_length > 0 &&
+        fread(&line_[0], record_.line_length, 1, file_) != 1) {
+      carp(CARP_FATAL, "Error reading temp file!");
+    }
+  }
+ private:
+  FILE* file_;
+  vector<char> buffer_;
+  bool done_;
+  RunRecord record_;
+  string line_;
+};
+
+/**
+ * Whether the current row of run a comes before that of run b. Finished
+ * runs come last, and ties are broken by run.
+ */
+class RunOrder {
+ public:
+  RunOrder(const vector<RunReader*>& runs, bool strings, bool ascending)
+    : runs_(runs), strings_(strings), ascending_(ascending) {}
+  bool operator()(size_t a, size_t b) const {
+    const RunReader* run_a = runs_[a];
+    const RunReader* run_b = runs_[b];
+    if (run_a->done() || run_b->done()) {
+      return !run_a->done() || (run_b->done() && a < b);
+    }
+    int result;
+    if (strings_) {
+      result = compareText(run_a->text(), run_a->textLength(),
+                           run_b->text(), run_b->textLength());
+    } else {
+      result = run_a->number() < run_b->number() ? -1 :
+        (run_b->number() < run_a->number() ? 1 : 0);
+    }
+    if (result == 0) {
+      result = a < b ? -1 : 1;
+    }
+    return ascending_ ? result < 0 : result > 0;
+  }
+ private:
+  const vector<RunReader*>& runs_;
+  bool strings_;
+  bool ascending_;
+};
+
 
 /**
  * \returns a blank SortColumn object
@@ -40,6 +221,14 @@ int SortColumn::main(int argc, char** argv) {
   ascending_ = Params::GetBool("ascending");
   delimiter_ = get_delimiter_parameter("delimiter");
   header_ = Params::GetBool("header");
+  num_threads_ = Params::GetInt("num-threads");
+  if (num_threads_ < 1) {
+    num_threads_ = max(1, (int)boost::thread::hardware_concurrency());
+  }
+  long long memory = Params::GetInt("memory-limit");
+  memory = (memory > 0 ? memory : DEFAULT_SORT_MEMORY_MB) << 20;
+  // One run is read while each thread sorts and writes another.
+  run_bytes_ = max((size_t)MIN_RUN_BYTES, (size_t)(memory / (num_threads_ + 1) / 2));
 
   DelimitedFileReader delimited_file(delimited_filename_, true, delimiter_);
   
@@ -53,124 +242,84 @@ int SortColumn::main(int argc, char** argv) {
   }
 
   col_sort_idx_ = (unsigned int)col_sort_idx;
+  if (column_type_ != COLTYPE_STRING && column_type_ != COLTYPE_INT &&
+      column_type_ != COLTYPE_REAL) {
+    carp(CARP_FATAL, "Unknow column type");
+  }
 
   /*
    * So to be able to handle sorting large files without reading the
    * whole file into memory, we implement a divide-then-merge approach.  
-   * Meaning that we read in a maximum number of rows, sort these, 
-   * then write out the sorted delimited file to a temporary file.  
-   * After processing all of the rows in the original file, we then
-   * merge all the temporary files created, printing out the full sorted file.  
+   * Meaning that we read rows up to a number of bytes, parsing the key of
+   * each once, then sort them and write them to a temporary file (a run)
+   * on another thread while the next rows are read. After processing all
+   * of the rows in the original file, we then merge all the runs,
+   * printing out the full sorted file.  
    */
-  vector<int> temp_file_descriptors;
-  vector<boost::fdostream*> temp_file_streams;
-  vector<string> temp_filenames;
-
-  DelimitedFile* temp_delimited = new DelimitedFile(delimiter_);
-  for (unsigned int col_idx=0;col_idx < delimited_file.numCols();col_idx++) {
-    temp_delimited->addColumn(delimited_file.getColumnName(col_idx));
+  OutputBlock out(cout);
+  if (header_) {
+    out.append(delimited_file.getHeaderString());
+    out.append('\n');
   }
 
-  //Maximum number of rows to read before sorting then saving to a temporary file.
-  //In the future, we can set this number to be based upon how much memory
-  //is available on the system.  We want to make it large enough so that we
-  //don't have to create/merge too many temporary files, but small enough so
-  //that sort-by-column doesn't crash from not enough memory or affect the
-  //other processes on the computer.
-  int max_rows = 200000;
-
-  int current_count = 0;
-
-  while(delimited_file.hasNext()) {
-
-    unsigned int new_row = temp_delimited->addRow();
-    for (unsigned int col_idx = 0;col_idx < delimited_file.numCols();col_idx++) {
-      temp_delimited->setString(col_idx, new_row, delimited_file.getString(col_idx));
+  vector<string> temp_filenames;
+  deque<boost::thread*> writers;
+  SortRun* run = new SortRun();
+  while (true) {
+    bool more = delimited_file.hasNext();
+    if (more) {
+      addRow(delimited_file, run);
+      delimited_file.next();
+      if (run->lines.size() < run_bytes_) {
+        continue;
+      }
     }
-
-    current_count++;
-
-    if (current_count >= max_rows) {
-      carp(CARP_DEBUG, "Sorting %i rows", max_rows);
-      sortDelimited(temp_delimited);
-
+    if (!more && temp_filenames.empty()) {
+      //no temporary files used, print out the sorted output.
+      sortRun(run);
+      for (size_t i = 0; i < run->keys.size(); i++) {
+        size_t row = run->keys[i].row;
+        out.append(run->lines.data() + run->line_begin[row],
+                   run->line_begin[row + 1] - run->line_begin[row]);
+      }
+      delete run;
+      break;
+    }
+    if (!run->keys.empty()) {
       char ctemp_filename[50] = "SortColumn_XXXXXX";
-    
       int fd = mkstemp(ctemp_filename);
       if (fd == -1) {
-        carp(CARP_ERROR, "Error creating temp file!\n "
+        carp(CARP_FATAL, "Error creating temp file!\n "
                          "Error: %s", strerror(errno));
-        return(-1);
       }
-      
-      string temp_filename(ctemp_filename);
-  
-      boost::fdostream* out = new boost::fdostream(fd);
-  
-      (*out) << (*temp_delimited);
-      temp_file_streams.push_back(out);
-      temp_file_descriptors.push_back(fd);
-      temp_filenames.push_back(temp_filename);
-      delete(temp_delimited);
-
-      //create a new delimited file.
-      temp_delimited = new DelimitedFile(delimiter_);
-
-      for (unsigned int col_idx = 0;col_idx < delimited_file.numCols();col_idx++) {
-        temp_delimited->setString(col_idx, new_row, delimited_file.getString(col_idx));
+      temp_filenames.push_back(ctemp_filename);
+      carp(CARP_DEBUG, "Sorting %d rows into %s", (int)run->keys.size(), ctemp_filename);
+      if ((int)writers.size() >= num_threads_) {
+        writers.front()->join();
+        delete writers.front();
+        writers.pop_front();
       }
-      //reset to count so that we can read in the next batch of rows.
-      current_count = 0;
-  
+      writers.push_back(new boost::thread(boost::bind(&SortColumn::writeRun, this, run, fd)));
+      run = new SortRun();
     }
-
-    delimited_file.next();
-  } 
-
-  //done reading the file, now print out the sorted version.
-
-  if (temp_file_descriptors.size() == 0) {
-
-    //no temporary files used, print out the sorted output.
-    sortDelimited(temp_delimited);
-    cout << (*temp_delimited);
-    delete temp_delimited;
-  } else {
-
-    //sort the current and save to a temporary file. 
-    sortDelimited(temp_delimited);
-    char ctemp_filename[50] = "SortColumn_XXXXXX";
-
-    int fd = mkstemp(ctemp_filename);
-
-    if (fd == -1) {
-      carp(CARP_ERROR, "Error creating temp file!\n "
-                       "Error: %s", strerror(errno));
-        return(-1);
-    }
-
-    string temp_filename(ctemp_filename);
-
-    boost::fdostream* out = new boost::fdostream(fd);
-    (*out) << (*temp_delimited);
-    temp_file_streams.push_back(out);
-    temp_file_descriptors.push_back(fd);
-    temp_filenames.push_back(temp_filename);
-    delete(temp_delimited);
-
-    //flush everything.
-    for (unsigned int i=0; i < temp_file_descriptors.size(); i++) {
-      temp_file_streams[i]->flush();
+    if (!more) {
+      delete run;
+      break;
     }
+  }
+  for (deque<boost::thread*>::iterator i = writers.begin(); i != writers.end(); ++i) {
+    (*i)->join();
+    delete *i;
+  }
 
+  if (!temp_filenames.empty()) {
     //merge the temporary files together, printing out the merged output.
-    mergeDelimitedFiles(temp_filenames);
+    mergeRuns(temp_filenames, &out);
   }
-  
+  out.flush();
+
   //clean everything up
-  for (unsigned int idx=0; idx < temp_file_descriptors.size(); idx++) {
-    delete temp_file_streams[idx];
-    close(temp_file_descriptors[idx]);
+  for (unsigned int idx=0; idx < temp_filenames.size(); idx++) {
     remove(temp_filenames[idx].c_str());
   }
 
@@ -215,6 +364,8 @@ vector<string> SortColumn::getOptions() const {
     "header",
     "column-type",
     "ascending",
+    "memory-limit",
+    "num-threads",
     "verbosity"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
@@ -232,132 +383,145 @@ vector< pair<string, string> > SortColumn::getOutputs() const {
 }
 
 /**
- * sorts the delimited file based upon the column type parameter
+ * adds the current row of the file to the run, parsing its key once.
  */
-void SortColumn::sortDelimited(
-  DelimitedFile* delimited ///< delimited file to sort.
+void SortColumn::addRow(
+  DelimitedFileReader& delimited_file, ///< file whose current row to add
+  SortRun* run ///< run to add it to
   ) {
-
-  switch(column_type_) {
-
-    case COLTYPE_STRING:
-      delimited->sortByStringColumn(column_name_string_, ascending_);
+  const string& line = delimited_file.getString();
+  SortKey key;
+  key.number = 0;
+  key.row = run->keys.size();
+  key.text_begin = run->lines.size();
+  key.text_length = 0;
+  switch (column_type_) {
+    case COLTYPE_STRING: {
+      // the field of the sort column, within the row
+      size_t begin = 0;
+      for (unsigned int col_idx = 0; col_idx < col_sort_idx_ && begin != string::npos;
+           col_idx++) {
+        begin = line.find(delimiter_, begin);
+        begin = begin == string::npos ? begin : begin + 1;
+      }
+      if (begin != string::npos) {
+        size_t end = line.find(delimiter_, begin);
+        key.text_begin += begin;
+        key.text_length = (end == string::npos ? line.size() : end) - begin;
+      }
       break;
+    }
     case COLTYPE_INT:
-      delimited->sortByIntegerColumn(column_name_string_, ascending_);
+      key.number = delimited_file.getInteger(col_sort_idx_);
       break;
-    case COLTYPE_REAL:
-      delimited->sortByFloatColumn(column_name_string_, ascending_);
+    default:
+      key.number = delimited_file.getDouble(col_sort_idx_);
       break;
-    case NUMBER_COLTYPES:
-    case COLTYPE_INVALID:
-      carp(CARP_FATAL, "Unknow column type");
   }
+  run->lines.append(line);
+  run->lines += '\n';
+  run->line_begin.push_back(run->lines.size());
+  run->keys.push_back(key);
 }
 
 /**
- * merges a list of sorted delimited files and prints 
- * out the resulting sorted file.  This method accomplishes this
- * by testing the current row of each temporary file against
- * the others.  If it's compare value is the smallest (or largest when descending)
- * then printout that temporary file's row and advance the next row.
- * Keep iterating until all rows for all temporary files are printed out.
+ * sorts the keys of a run. Rows with equal keys keep the order of the file
+ * when ascending, and are reversed when descending, so that a descending
+ * sort is the reverse of an ascending one.
  */
-void SortColumn::mergeDelimitedFiles(
-  vector<string>& temp_filenames
+void SortColumn::sortRun(
+  SortRun* run ///< run to sort
   ) {
+  sort(run->keys.begin(), run->keys.end(),
+       KeyOrder(column_type_ == COLTYPE_STRING ? &run->lines : NULL, ascending_));
+}
 
-  //open the temporary delimited files using a reader.
-  vector<DelimitedFileReader*> delimited_files;
-  for (unsigned int idx=0;idx < temp_filenames.size();idx++) {
-    delimited_files.push_back(new DelimitedFileReader(temp_filenames[idx], delimiter_));
-  }
-  
-  //print out the header if requested.
-  if (header_) {
-    cout << delimited_files[0]->getHeaderString() << endl;
-  }
-
-  int best_idx = -1;
-
-  do {
-    best_idx = -1;
-    //find the temporary file whose current row's column value is the
-    //smallest or largest.
-    for (unsigned int idx = 0;idx < delimited_files.size();idx++) {
-      if (delimited_files[idx]->hasNext()) {
-        if (best_idx == -1) {
-          best_idx = idx;
-        } else {
-          int compare_result = compare(delimited_files[idx], delimited_files[best_idx]);
-          if ((ascending_) && (compare_result == -1)) {
-            best_idx = idx;
-          } else if ((!ascending_) && (compare_result == 1)) {
-            best_idx = idx;
-          }
-        }
-      }
-  
-      //if a best was found, print out the row and advance to the
-      //next row.
-      if (best_idx != -1) {
-        cout << delimited_files[best_idx]->getString() << endl;
-        delimited_files[best_idx]->next();
-      }
+/**
+ * sorts a run and writes it to the temporary file fd, then frees it. Each
+ * row is written after its key, so that the merge does not parse it again.
+ */
+void SortColumn::writeRun(
+  SortRun* run, ///< run to sort and write
+  int fd ///< temporary file, closed when written
+  ) {
+  sortRun(run);
+  {
+    boost::fdostream stream(fd);
+    OutputBlock out(stream);
+    for (size_t i = 0; i < run->keys.size(); i++) {
+      const SortKey& key = run->keys[i];
+      RunRecord record;
+      record.number = key.number;
+      record.text_begin = (uint32_t)(key.text_begin - run->line_begin[key.row]);
+      record.text_length = (uint32_t)key.text_length;
+      record.line_length = (uint32_t)(run->line_begin[key.row + 1] - run->line_begin[key.row]);
+      record.reserved = 0;
+      out.append((const char*)&record, sizeof(record));
+      out.append(run->lines.data() + run->line_begin[key.row], record.line_length);
+    }
+    out.flush();
+    if (!stream.good()) {
+      carp(CARP_FATAL, "Error writing temp file!\n Error: %s", strerror(errno));
     }
-    //iterate until all rows of all temporary files are printed out.
-  } while (best_idx != -1);
-
-  for (unsigned int idx = 0; idx < temp_filenames.size(); idx++) {
-    delete delimited_files[idx];
   }
+  close(fd);
+  delete run;
 }
 
 /**
- * \returns the result of comparing two file(s) current row and column: 
- * 1 : file1 > file2
- * -1 : file1 < file2
- * 0 : file1 = file2
+ * merges a list of sorted runs and prints out the resulting sorted
+ * file. The runs' current rows are kept in a loser tree: the root holds
+ * the run whose row comes next, and each inner node the run that lost the
+ * match there, so that advancing the winner replays only its path to the
+ * root. Equal rows are taken from the runs in file order (reversed when
+ * descending), so that the merge is stable like the sort of each run.
  */
-int SortColumn::compare(
-  DelimitedFileReader* file1, 
-  DelimitedFileReader* file2
+void SortColumn::mergeRuns(
+  const vector<string>& temp_filenames, ///< runs, in file order
+  OutputBlock* out ///< where to print the merged rows
   ) {
+  size_t num_runs = temp_filenames.size();
+  // Read buffers large enough to read sequentially, within the memory the
+  // runs were sorted in.
+  size_t buffer_bytes = min((size_t)MAX_READ_BUFFER_BYTES,
+                            max((size_t)MIN_READ_BUFFER_BYTES,
+                                run_bytes_ * (num_threads_ + 1) / num_runs));
+  vector<RunReader*> runs;
+  for (size_t idx = 0; idx < num_runs; idx++) {
+    runs.push_back(new RunReader(temp_filenames[idx], buffer_bytes));
+  }
 
-  bool isless = false;
-  bool isequal = false;
-  
-  switch (column_type_) {
-    case COLTYPE_STRING:
-      isless = file1->getString(col_sort_idx_) < file2->getString(col_sort_idx_);
-      if (!isless) {
-        isequal = file1->getString(col_sort_idx_) == file2->getString(col_sort_idx_);
-      }
-    break;
-    case COLTYPE_REAL:
-      isless = file1->getDouble(col_sort_idx_) < file2->getDouble(col_sort_idx_);
-      if (!isless) {
-        isequal = file1->getDouble(col_sort_idx_) == file2->getDouble(col_sort_idx_);
-      }
-    break;
-    case COLTYPE_INT:
-      isless = file1->getInteger(col_sort_idx_) < file2->getInteger(col_sort_idx_);
-      if (!isless) {
-        isequal = file1->getInteger(col_sort_idx_) == file2->getInteger(col_sort_idx_);
+  RunOrder before(runs, column_type_ == COLTYPE_STRING, ascending_);
+  // tree[0] is the winner; inner node n has children 2n and 2n + 1, and
+  // run i is the leaf num_runs + i.
+  vector<size_t> tree(num_runs);
+  vector<size_t> winners(2 * num_runs);
+  for (size_t idx = 0; idx < num_runs; idx++) {
+    winners[num_runs + idx] = idx;
+  }
+  for (size_t node = num_runs - 1; node >= 1; node--) {
+    size_t left = winners[2 * node];
+    size_t right = winners[2 * node + 1];
+    bool left_wins = before(left, right);
+    winners[node] = left_wins ? left : right;
+    tree[node] = left_wins ? right : left;
+  }
+  tree[0] = num_runs == 1 ? 0 : winners[1];
+
+  while (!runs[tree[0]]->done()) {
+    size_t winner = tree[0];
+    out->append(runs[winner]->line());
+    runs[winner]->next();
+    for (size_t node = (num_runs + winner) / 2; node >= 1; node /= 2) {
+      if (before(tree[node], winner)) {
+        swap(tree[node], winner);
       }
-    break;
-    case NUMBER_COLTYPES:
-    case COLTYPE_INVALID:
-      carp(CARP_FATAL, "Column type invalid!");
-
+    }
+    tree[0] = winner;
   }
 
-  if (isless) {
-    return -1;
-  } else if (isequal) {
-    return 0;
-  } else {
-    return 1;
+  for (size_t idx = 0; idx < num_runs; idx++) {
+    delete runs[idx];
   }
 }
 
@@ -14,6 +14,9 @@
 #include <string>
 #include <vector>
 
+struct SortRun;
+class OutputBlock;
+
 class SortColumn: public CruxApplication {
 
  protected:
@@ -26,31 +29,40 @@ class SortColumn: public CruxApplication {
   bool header_;               ///<print out the header?
   unsigned int col_sort_idx_; ///<column index to sort by
 
+  int num_threads_;            ///<threads that sort and write runs
+  size_t run_bytes_;          ///<rows read before they are sorted into a run
+
   //private methods.
   /**
-   * sorts the delimited file based upon the column type parameter
+   * adds the current row of the file to the run, parsing its key once.
+   */
+  void addRow(
+    DelimitedFileReader& delimited_file,
+    SortRun* run
+  );
+
+  /**
+   * sorts the keys of a run.
    */
-  void sortDelimited(
-    DelimitedFile* delimited
+  void sortRun(
+    SortRun* run
   );
 
   /**
-   * merges a list of sorted delimited files and prints 
-   * out the resulting sorted file.
+   * sorts a run and writes it to the temporary file fd, then frees it.
    */
-  void mergeDelimitedFiles(
-    std::vector<std::string>& temp_filenames
+  void writeRun(
+    SortRun* run,
+    int fd
   );
 
   /**
-   * /returns the result of comparing two file(s) current row and column: 
-   * 1 : file1 > file2
-   * -1 : file1 < file2
-   * 0 : file1 = file2
+   * merges a list of sorted runs and prints out the resulting sorted
+   * file.
    */
-  int compare(
-    DelimitedFileReader* file1,
-    DelimitedFileReader* file2
+  void mergeRuns(
+    const std::vector<std::string>& temp_filenames,
+    OutputBlock* out
   );
 
 
@@ -6,9 +6,48 @@
 #include "model/Peptide.h"
 #include "model/ProteinPeptideIterator.h"
 #include "io/SpectrumCollectionFactory.h"
+#include "util/GlobalParams.h"
+#include "util/StringUtils.h"
+#include "util/mass.h"
+#include "util/StringInterner.h"
+#include "util/ThreadPool.h"
+#include <algorithm>
+#include <climits>
+#include <queue>
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 using namespace std;
 using namespace Crux;
+
+namespace {
+
+// The peptide numbers of a protein, a range of SpectralCounts'
+// protein_peptides_. Rows are equal when they hold the same peptides.
+struct PeptideRow {
+  PeptideRow(const int* b, const int* e) : begin(b), end(e) {}
+  bool operator==(const PeptideRow& other) const {
+    return end - begin == other.end - other.begin && equal(begin, end, other.begin);
+  }
+  const int* begin;
+  const int* end;
+};
+
+struct PeptideRowHash {
+  size_t operator()(const PeptideRow& row) const {
+    return boost::hash_range(row.begin, row.end);
+  }
+};
+
+bool comparePeptideRows(const pair<PeptideRow, int>& x,
+                        const pair<PeptideRow, int>& y) {
+  return lexicographical_compare(x.first.begin, x.first.end,
+                                 y.first.begin, y.first.end);
+}
+
+}  // namespace
 /**
  * Default constructor.
  */
@@ -26,7 +65,6 @@ SpectralCounts::SpectralCounts()
     protein_scores_(protein_id_less_than),
     protein_scores_unique_(protein_id_less_than),
     protein_scores_shared_(protein_id_less_than),
-    protein_supporting_peptides_(protein_id_less_than),
     protein_meta_protein_(protein_id_less_than),
     meta_mapping_(comparePeptideSets),
     meta_protein_scores_(compareMetaProteins),
@@ -141,22 +179,53 @@ void SpectralCounts::getParameterValues() {
  * ProteinToPeptide
  */
 void SpectralCounts::getProteinToPeptides() {
+  StringInterner protein_ids;
+  vector< pair<int, int> > incidence; // (protein, peptide) numbers
   for (PeptideToScore::iterator pep_it = peptide_scores_.begin();
        pep_it != peptide_scores_.end(); ++pep_it) {
     Peptide* peptide = pep_it->first;
+    int peptide_num = inference_peptides_.size();
+    inference_peptides_.push_back(peptide);
     for(PeptideSrcIterator iter = peptide->getPeptideSrcBegin();
         iter!= peptide->getPeptideSrcEnd();
         ++iter) {
-      PeptideSrc* peptide_src = *iter; 
-      Protein* protein = peptide_src->getParentProtein();
-      if (protein_supporting_peptides_.find(protein) == 
-          protein_supporting_peptides_.end()) {
-        PeptideSet newset(Peptide::lessThan);
-        protein_supporting_peptides_.insert(make_pair(protein, newset));
+      Protein* protein = (*iter)->getParentProtein();
+      int protein_num = protein_ids.Intern(protein->getIdPointer());
+      if (protein_num == (int)inference_proteins_.size()) {
+        inference_proteins_.push_back(protein);
+      }
+      incidence.push_back(make_pair(protein_num, peptide_num));
+    }
+  }
+
+  // Count the pairs into rows; the peptides of each row come in order, and a
+  // peptide found more than once in a protein is kept once.
+  int num_proteins = inference_proteins_.size();
+  protein_peptide_begin_.assign(num_proteins + 1, 0);
+  for (size_t i = 0; i < incidence.size(); i++) {
+    protein_peptide_begin_[incidence[i].first + 1]++;
+  }
+  for (int i = 0; i < num_proteins; i++) {
+    protein_peptide_begin_[i + 1] += protein_peptide_begin_[i];
+  }
+  vector<int> next(protein_peptide_begin_.begin(), protein_peptide_begin_.end() - 1);
+  protein_peptides_.resize(incidence.size());
+  for (size_t i = 0; i < incidence.size(); i++) {
+    protein_peptides_[next[incidence[i].first]++] = incidence[i].second;
+  }
+  int out = 0;
+  for (int i = 0; i < num_proteins; i++) {
+    int begin = protein_peptide_begin_[i];
+    int end = protein_peptide_begin_[i + 1];
+    protein_peptide_begin_[i] = out;
+    for (int j = begin; j < end; j++) {
+      if (j == begin || protein_peptides_[j] != protein_peptides_[j - 1]) {
+        protein_peptides_[out++] = protein_peptides_[j];
       }
-      protein_supporting_peptides_[protein].insert(peptide);
     }
   }
+  protein_peptide_begin_[num_proteins] = out;
+  protein_peptides_.resize(out);
 }
 
 
@@ -427,53 +496,200 @@ void SpectralCounts::computeEmpai() {
   PeptideConstraint::free(constraint);
 }
 
+static bool compareSlots(const pair<int, Peak*>& a, const pair<int, Peak*>& b) {
+  return a.first < b.first;
+}
+
+// Orders matches by the index of their spectrum.
+struct SpectrumOrder {
+  explicit SpectrumOrder(const vector<size_t>& spectrum) : spectrum_(spectrum) {}
+  bool operator()(size_t a, size_t b) const { return spectrum_[a] < spectrum_[b]; }
+  const vector<size_t>& spectrum_;
+};
+
+// The peak lookup of Spectrum::getNearestPeak(): peaks are kept in slots of
+// 1 / MZ_TO_PEAK_ARRAY_RESOLUTION m/z, the most intense in each, up to
+// MAX_PEAK_MZ.
+static const int MZ_TO_PEAK_ARRAY_RESOLUTION = 5;
+static const int MAX_PEAK_MZ = 5000;
+
+/**
+ * The peaks of the spectra of the matches, and the b and y ion masses of the
+ * matches, as flat arrays: spectrum s has the occupied slots
+ * [peak_begin[s], peak_begin[s + 1]), in slot order, and match i the residue
+ * masses [residue_begin[i], residue_begin[i + 1]).
+ */
+struct SinBatch {
+  vector<size_t> peak_begin;
+  vector<int> slot;
+  vector<FLOAT_T> mz;
+  vector<FLOAT_T> intensity;
+
+  vector<size_t> spectrum;  // of each match
+  vector<int> max_charge;   // of the ions of each match
+  vector<size_t> residue_begin;
+  vector<FLOAT_T> residue_mass;
+};
+
+// The intensity of the peak nearest mz, no further than max, in spectrum s,
+// as Spectrum::getNearestPeak() finds it.
+static FLOAT_T nearestIntensity(const SinBatch& batch, size_t s, FLOAT_T mz, FLOAT_T max) {
+  int min_idx = (int)((mz - max) * MZ_TO_PEAK_ARRAY_RESOLUTION + 0.5);
+  min_idx = min_idx < 0 ? 0 : min_idx;
+  int max_idx = (int)((mz + max) * MZ_TO_PEAK_ARRAY_RESOLUTION + 0.5);
+  max_idx = min(max_idx, MAX_PEAK_MZ * MZ_TO_PEAK_ARRAY_RESOLUTION - 1);
+  const int* slots = &batch.slot[0];
+  size_t i = lower_bound(slots + batch.peak_begin[s], slots + batch.peak_begin[s + 1],
+                         min_idx) - slots;
+  FLOAT_T min_distance = BILLION;
+  FLOAT_T nearest = 0;
+  for (; i < batch.peak_begin[s + 1] && slots[i] <= max_idx; i++) {
+    FLOAT_T distance = fabs(mz - batch.mz[i]);
+    if (distance <= max && distance < min_distance) {
+      nearest = batch.intensity[i];
+      min_distance = distance;
+    }
+  }
+  return nearest;
+}
+
 /**
- * For the spectrum associated with the match, sum the intensities of
- * all b and y ions that are not modified.
- * \return The sum of unmodified b and y ions.
+ * Sums, for matches [begin, end) of order, the intensities of the peaks
+ * nearest their unmodified b and y ions, in the order in which IonSeries
+ * predicts the ions.
  */
-FLOAT_T SpectralCounts::sumMatchIntensity(Match* match,
-                                        Crux::SpectrumCollection* spectra) {
-  FLOAT_T match_intensity = 0;
-  char* peptide_seq = match->getSequence();
-  MODIFIED_AA_T* modified_sequence = match->getModSequence();
-  int charge = match->getCharge();
-  Spectrum* temp = match->getSpectrum();
-  int scan = temp->getFirstScan();
-
-  Spectrum* spectrum = spectra->getSpectrum(scan);
-
-  if (spectrum == NULL) {
-    carp(CARP_FATAL, "scan: %d doesn't exist or not found!");
-    return 0.0;
-  }
-
-  Ion* ion;
-  SCORER_TYPE_T score_type = XCORR;
-  IonConstraint* ion_constraint =
-    IonConstraint::newIonConstraintSmart(score_type, charge);
-  IonSeries* ion_series = new IonSeries(ion_constraint, charge);
-  ion_series->update(peptide_seq, modified_sequence);
-  ion_series->predictIons();
-  for (IonIterator ion_it = ion_series->begin();
-       ion_it != ion_series->end(); ++ion_it) {
-    ion = (*ion_it);
-    if (ion -> getType() == B_ION || ion -> getType() == Y_ION) {
-      if (!ion->isModified()) {
-        Peak * peak = spectrum->getNearestPeak(ion->getMassZ(),
-                                                bin_width_);
-        if (peak != NULL) {
-          match_intensity += peak->getIntensity();
+static void sumIntensities(const SinBatch& batch, const vector<size_t>& order,
+                           size_t begin, size_t end, FLOAT_T bin_width,
+                           vector<FLOAT_T>* intensities) {
+  vector<FLOAT_T> mass_matrix;
+  for (size_t k = begin; k < end; k++) {
+    size_t i = order[k];
+    size_t s = batch.spectrum[i];
+    int length = batch.residue_begin[i + 1] - batch.residue_begin[i];
+    const FLOAT_T* residues = &batch.residue_mass[0] + batch.residue_begin[i];
+    mass_matrix.resize(length + 1);
+    mass_matrix[0] = 0;
+    mass_matrix[1] = residues[0];
+    for (int j = 2; j <= length; j++) {
+      mass_matrix[j] = mass_matrix[j - 1] + residues[j - 1];
+    }
+    FLOAT_T sum = 0;
+    for (int cleavage = 1; cleavage < length; cleavage++) {
+      FLOAT_T b = mass_matrix[cleavage];
+      FLOAT_T y = mass_matrix[length] - mass_matrix[length - cleavage];
+      y += MASS_H2O_MONO;
+      for (int pass = 0; pass < 2; pass++) {
+        FLOAT_T mass = pass == 0 ? b : y;
+        for (int charge = 1; charge <= batch.max_charge[i]; charge++) {
+          FLOAT_T h_mass = MASS_H_MONO;
+          FLOAT_T mz = (mass + (h_mass * (FLOAT_T)charge)) / (FLOAT_T)charge;
+          sum += nearestIntensity(batch, s, mz, bin_width);
         }
       }
     }
+    (*intensities)[i] = sum;
   }
-  delete ion_series;
-  free(peptide_seq);
-
-  return match_intensity;
 }
 
+/**
+ * For each match, in the order of matches, sum the intensities of the peaks
+ * of its spectrum nearest its b and y ions that are not modified, as
+ * IonSeries predicts the ions for XCorr and Spectrum::getNearestPeak() finds
+ * the peaks. The spectra are read once into flat arrays, and the matches
+ * are then summed in parallel, grouped by spectrum.
+ */
+void SpectralCounts::sumMatchIntensities(const vector<Match*>& matches,
+                                         Crux::SpectrumCollection* spectra,
+                                         vector<FLOAT_T>* intensities) {
+  SinBatch batch;
+  map<int, size_t> spectrum_index;  // by first scan
+  for (vector<Match*>::const_iterator i = matches.begin(); i != matches.end(); ++i) {
+    spectrum_index.insert(make_pair((*i)->getSpectrum()->getFirstScan(), 0));
+  }
+  spectra->parse();
+  vector<pair<int, Peak*> > slots;
+  batch.peak_begin.push_back(0);
+  for (SpectrumIterator i = spectra->begin(); i != spectra->end(); ++i) {
+    map<int, size_t>::iterator index = spectrum_index.find((*i)->getFirstScan());
+    if (index == spectrum_index.end() || index->second != 0) {
+      continue;
+    }
+    index->second = batch.peak_begin.size();
+    // The most intense peak of each slot, the first of equals
+    slots.clear();
+    for (PeakIterator j = (*i)->begin(); j != (*i)->end(); ++j) {
+      slots.push_back(make_pair((int)((*j)->getLocation() * MZ_TO_PEAK_ARRAY_RESOLUTION), *j));
+    }
+    stable_sort(slots.begin(), slots.end(), compareSlots);
+    for (size_t j = 0; j < slots.size(); j++) {
+      if (j > 0 && slots[j].first == slots[j - 1].first) {
+        if (batch.intensity.back() < slots[j].second->getIntensity()) {
+          batch.mz.back() = slots[j].second->getLocation();
+          batch.intensity.back() = slots[j].second->getIntensity();
+        }
+        continue;
+      }
+      batch.slot.push_back(slots[j].first);
+      batch.mz.push_back(slots[j].second->getLocation());
+      batch.intensity.push_back(slots[j].second->getIntensity());
+    }
+    batch.peak_begin.push_back(batch.slot.size());
+  }
+  batch.slot.push_back(INT_MAX);  // so that &slot[0] is valid
+
+  const string& max_ion_charge = GlobalParams::getMaxIonCharge();
+  int ion_charge_limit = 0;
+  if (max_ion_charge != "peptide" &&
+      !StringUtils::TryFromString(max_ion_charge, &ion_charge_limit)) {
+    carp(CARP_WARNING, "Charge is not valid:%s", max_ion_charge.c_str());
+  }
+  batch.residue_begin.push_back(0);
+  for (vector<Match*>::const_iterator i = matches.begin(); i != matches.end(); ++i) {
+    Match* match = *i;
+    int scan = match->getSpectrum()->getFirstScan();
+    size_t s = spectrum_index[scan];
+    if (s == 0) {
+      carp(CARP_FATAL, "scan: %d doesn't exist or not found!", scan);
+    }
+    batch.spectrum.push_back(s - 1);
+    // The ion charges of IonConstraint::newIonConstraintSequestXcorr()
+    int charge = match->getCharge();
+    int max_charge = max(1, charge - 1);
+    if (ion_charge_limit > 0) {
+      max_charge = min(max_charge, ion_charge_limit);
+    }
+    batch.max_charge.push_back(min(max_charge, charge));
+    MODIFIED_AA_T* modified_sequence = match->getModSequence();
+    int length = match->getPeptide()->getLength();
+    for (int j = 0; j < length; j++) {
+      batch.residue_mass.push_back(get_mass_mod_amino_acid(modified_sequence[j], MONO));
+    }
+    free(modified_sequence);
+    batch.residue_begin.push_back(batch.residue_mass.size());
+  }
+
+  vector<size_t> order(matches.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  stable_sort(order.begin(), order.end(), SpectrumOrder(batch.spectrum));
+
+  intensities->assign(matches.size(), 0);
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = max(1, (int)boost::thread::hardware_concurrency());
+  }
+  num_threads = (int)min((size_t)num_threads, max((size_t)1, matches.size()));
+  ThreadPool::TaskGroup threads;
+  for (int t = 0; t < num_threads; t++) {
+    size_t begin = order.size() * t / num_threads;
+    size_t end = order.size() * (t + 1) / num_threads;
+    threads.Run(boost::bind(sumIntensities, boost::cref(batch),
+                                      boost::cref(order), begin, end, bin_width_,
+                                      intensities));
+  }
+  threads.Wait();
+}
 
 /**
  * Generate a score for each peptide in the set of matches.  Populate
@@ -495,16 +711,21 @@ void SpectralCounts::getPeptideScores() {
     spectra = SpectrumCollectionFactory::create(Params::GetString("input-ms2"));
   }
 
-  for(set<Match*>::iterator match_it = matches_.begin();
-      match_it != matches_.end(); ++match_it) {
+  // for sin, calculate total ion intensity for each match by
+  // summing up peak intensities
+  vector<Match*> matches(matches_.begin(), matches_.end());
+  vector<FLOAT_T> intensities;
+  if (measure_ == MEASURE_SIN) {
+    sumMatchIntensities(matches, spectra, &intensities);
+  }
+
+  for (size_t match_idx = 0; match_idx < matches.size(); ++match_idx) {
 
     FLOAT_T match_intensity = 1; // for NSAF just count each for the peptide/
 
-    Match* match = (*match_it);
-    // for sin, calculate total ion intensity for match by
-    // summing up peak intensities
+    Match* match = matches[match_idx];
     if (measure_ == MEASURE_SIN) {
-      match_intensity = sumMatchIntensity(match, spectra);
+      match_intensity = intensities[match_idx];
     }
 
     // add ion_intensity to peptide scores
@@ -816,20 +1037,57 @@ bool SpectralCounts::sortRankedProteins(
  */
 void SpectralCounts::getMetaMapping() {
   carp(CARP_DEBUG, "Creating a mapping of meta protein to peptides");
-  int count = 0;
-  for(ProteinToPeptides::iterator prot_it = protein_supporting_peptides_.begin();
-       prot_it != protein_supporting_peptides_.end(); ++prot_it) {
-    Protein* protein = prot_it->first;
-    PeptideSet pep_set = prot_it->second;
-
-    if (meta_mapping_.find(pep_set) == meta_mapping_.end()) {
-      MetaProtein meta_protein(protein_id_less_than);
-      count++;
-      meta_mapping_.insert(make_pair(pep_set, meta_protein));
+  // proteins with the same row of peptides form a meta protein
+  boost::unordered_map<PeptideRow, int, PeptideRowHash> row_meta;
+  vector< vector<int> > members;
+  for (int i = 0; i < (int)inference_proteins_.size(); i++) {
+    PeptideRow row(&protein_peptides_[0] + protein_peptide_begin_[i],
+                   &protein_peptides_[0] + protein_peptide_begin_[i + 1]);
+    pair<boost::unordered_map<PeptideRow, int, PeptideRowHash>::iterator, bool> found =
+      row_meta.insert(make_pair(row, (int)members.size()));
+    if (found.second) {
+      members.push_back(vector<int>());
     }
-    meta_mapping_[pep_set].insert(protein);
+    members[found.first->second].push_back(i);
+  }
+
+  // Peptide numbers follow Peptide::lessThan, so comparing rows as sequences
+  // gives the order of comparePeptideSets.
+  vector< pair<PeptideRow, int> > metas(row_meta.begin(), row_meta.end());
+  sort(metas.begin(), metas.end(), comparePeptideRows);
+  meta_protein_members_.clear();
+  for (size_t i = 0; i < metas.size(); i++) {
+    meta_protein_members_.push_back(members[metas[i].second]);
+    meta_mapping_.insert(meta_mapping_.end(),
+      make_pair(makePeptideSet(metas[i].first.begin, metas[i].first.end),
+                makeMetaProtein(i)));
   }
+}
 
+/**
+ * \returns the PeptideSet of the peptide numbers [begin, end), which are
+ * in order
+ */
+SpectralCounts::PeptideSet SpectralCounts::makePeptideSet(const int* begin,
+                                                          const int* end) {
+  PeptideSet peptides(Peptide::lessThan);
+  for (const int* i = begin; i != end; ++i) {
+    peptides.insert(peptides.end(), inference_peptides_[*i]);
+  }
+  return peptides;
+}
+
+/**
+ * \returns the proteins of meta protein meta, the meta_mapping_ order
+ * number set by getMetaMapping()
+ */
+MetaProtein SpectralCounts::makeMetaProtein(int meta) {
+  MetaProtein proteins(protein_id_less_than);
+  const vector<int>& members = meta_protein_members_[meta];
+  for (vector<int>::const_iterator i = members.begin(); i != members.end(); ++i) {
+    proteins.insert(inference_proteins_[*i]);
+  }
+  return proteins;
 }
 
 /**
@@ -887,43 +1145,69 @@ void SpectralCounts::getMetaRanks() {
  * Greedily finds a peptide-to-protein mapping where each
  * peptide is only mapped to a single meta-protein. 
  *
- * Would of been better to implement with priority queue w/
- * adjancency lists: O(n*log(n)) but input size should be
- * small enough that performance should not be an issue.
+ * The meta protein with the most peptides not yet mapped is taken next,
+ * the later in meta_mapping_ order on ties. A heap holds the meta proteins
+ * by their count of unmapped peptides; taking one lowers the counts of the
+ * others that share its peptides, and their stale heap entries are skipped.
  */
 void SpectralCounts::performParsimonyAnalysis() {
   carp(CARP_DEBUG, "Performing Greedy Parsimony analysis");
+  int num_metas = meta_protein_members_.size();
+  int num_peptides = inference_peptides_.size();
+
+  // the meta proteins of each peptide, in compressed sparse rows
+  vector<int> peptide_meta_begin(num_peptides + 1, 0);
+  for (int m = 0; m < num_metas; m++) {
+    int protein = meta_protein_members_[m][0];
+    for (int j = protein_peptide_begin_[protein]; j < protein_peptide_begin_[protein + 1]; j++) {
+      peptide_meta_begin[protein_peptides_[j] + 1]++;
+    }
+  }
+  for (int p = 0; p < num_peptides; p++) {
+    peptide_meta_begin[p + 1] += peptide_meta_begin[p];
+  }
+  vector<int> peptide_metas(peptide_meta_begin[num_peptides]);
+  vector<int> next(peptide_meta_begin.begin(), peptide_meta_begin.end() - 1);
+  vector<int> unmapped(num_metas);
+  priority_queue< pair<int, int> > queue;
+  for (int m = 0; m < num_metas; m++) {
+    int protein = meta_protein_members_[m][0];
+    for (int j = protein_peptide_begin_[protein]; j < protein_peptide_begin_[protein + 1]; j++) {
+      peptide_metas[next[protein_peptides_[j]]++] = m;
+    }
+    unmapped[m] = protein_peptide_begin_[protein + 1] - protein_peptide_begin_[protein];
+    queue.push(make_pair(unmapped[m], m));
+  }
+
   MetaMapping result(comparePeptideSets);
-  vector< pair<PeptideSet, MetaProtein > > peps_vector;
-
-  // get all meta mappings into a vector 
-  for (MetaMapping::iterator meta_iter = meta_mapping_.begin();
-       meta_iter != meta_mapping_.end(); ++meta_iter) {
-    peps_vector.push_back((*meta_iter));
-  }
-
-
-  // greedy algorithm to pick off the meta proteins with
-  // most peptide mappings
-  while (!peps_vector.empty()) {
-    sort(peps_vector.begin(), peps_vector.end(), setsAreEqualSize);
-    pair<PeptideSet, MetaProtein> node = peps_vector.back();
-    peps_vector.pop_back();
-    if (node.first.size() == 0) { break; }// do not enter anything without peptide sizes
-    result.insert(node);
-    PeptideSet cur_peptides = node.first;
-    // update the peptide sets for the rest of meta proteins
-    for (vector< pair<PeptideSet, MetaProtein > >::iterator
-         iter = peps_vector.begin();
-         iter != peps_vector.end(); ++iter) {
-      PeptideSet peptides = (*iter).first;
-      PeptideSet difference(Peptide::lessThan);
-      set_difference(peptides.begin(), peptides.end(),
-                     cur_peptides.begin(), cur_peptides.end(),
-                     inserter(difference, difference.end()),
-                    Peptide::lessThan);
-      (*iter).first = difference;
+  vector<char> mapped(num_peptides, 0);
+  vector<char> taken(num_metas, 0);
+  while (!queue.empty()) {
+    pair<int, int> top = queue.top();
+    queue.pop();
+    int m = top.second;
+    if (taken[m] || top.first != unmapped[m]) {
+      continue;
+    }
+    if (unmapped[m] == 0) { break; } // do not enter anything without peptide sizes
+    taken[m] = 1;
+    PeptideSet peptides(Peptide::lessThan);
+    int protein = meta_protein_members_[m][0];
+    for (int j = protein_peptide_begin_[protein]; j < protein_peptide_begin_[protein + 1]; j++) {
+      int p = protein_peptides_[j];
+      if (mapped[p]) {
+        continue;
+      }
+      mapped[p] = 1;
+      peptides.insert(peptides.end(), inference_peptides_[p]);
+      for (int k = peptide_meta_begin[p]; k < peptide_meta_begin[p + 1]; k++) {
+        int other = peptide_metas[k];
+        if (!taken[other]) {
+          queue.push(make_pair(--unmapped[other], other));
+        }
+      }
     }
+    result.insert(make_pair(peptides, makeMetaProtein(m)));
   }
   meta_mapping_ = result;
 }
@@ -1041,13 +1325,15 @@ vector<string> SpectralCounts::getOptions() const {
     "fileroot",
     "output-dir",
     "overwrite",
+    "compress-output",
     "unique-mapping",
     "quant-level",
     "measure",
     "custom-threshold-name",
     "custom-threshold-min",
     "mzid-use-pass-threshold",
-    "protein-database"
+    "protein-database",
+    "num-threads"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -1130,16 +1416,6 @@ bool SpectralCounts::compareMetaProteins(MetaProtein set_one,
   return set_one.size() < set_two.size();
 }
 
-/**
- * Compare the size of the PeptideSets in the two given pairs.
- * \returns True if the PeptideSets are the same size, else false.
- */
-bool SpectralCounts::setsAreEqualSize(
-  const pair<PeptideSet, MetaProtein>& peps_one ,
-  const pair<PeptideSet, MetaProtein>& peps_two) {
-  return ((peps_one).first.size() < (peps_two).first.size());
-}
-
 bool SpectralCounts::compareMetaScorePair(
   const std::pair<FLOAT_T, MetaProtein>& x,
   const std::pair<FLOAT_T, MetaProtein>& y) {
@@ -51,13 +51,6 @@ class SpectralCounts: public CruxApplication {
    */
   typedef std::map<PeptideSet, MetaProtein, 
               bool(*)(PeptideSet, PeptideSet) > MetaMapping;
-  /**
-   * \typedef ProteinToPeptides
-   * Mapping of Protein objects to a set of peptides that are part
-   * of the protein sequence
-   */
-  typedef std::map<Crux::Protein*, PeptideSet , 
-    bool(*)(Crux::Protein*, Crux::Protein*)> ProteinToPeptides;
   /**
    * \typedef MetaToScore
    * \brief Mapping of MetaProtein to the score assigned to it
@@ -89,6 +82,8 @@ class SpectralCounts: public CruxApplication {
   void getProteinToPeptides();
   void getProteinToMetaProtein();
   void getMetaMapping();
+  PeptideSet makePeptideSet(const int* begin, const int* end);
+  MetaProtein makeMetaProtein(int meta);
   void getMetaRanks();
   void getMetaScores();
   void performParsimonyAnalysis();
@@ -101,8 +96,9 @@ class SpectralCounts: public CruxApplication {
 
   void computeEmpai();
   void makeUniqueMapping();
-  FLOAT_T sumMatchIntensity(Crux::Match* match,
-                          Crux::SpectrumCollection* spectra);
+  void sumMatchIntensities(const std::vector<Crux::Match*>& matches,
+                           Crux::SpectrumCollection* spectra,
+                           std::vector<FLOAT_T>* intensities);
   SCORER_TYPE_T get_qval_type(MatchCollection* match_collection);
 
   void writeRankedPeptides();
@@ -169,7 +165,17 @@ class SpectralCounts: public CruxApplication {
   ProteinToScore protein_scores_unique_;
   ProteinToScore protein_scores_shared_;
 
-  ProteinToPeptides protein_supporting_peptides_;
+  // Protein inference works on numbers: the peptides of peptide_scores_ by
+  // their order there, the proteins they come from by first appearance.
+  std::vector<Crux::Peptide*> inference_peptides_;
+  std::vector<Crux::Protein*> inference_proteins_;
+  // The sorted peptide numbers of each protein, in compressed sparse rows:
+  // those of protein i are [protein_peptide_begin_[i], protein_peptide_begin_[i+1])
+  std::vector<int> protein_peptide_begin_;
+  std::vector<int> protein_peptides_;
+  // For each meta protein, in the order of meta_mapping_, its proteins and
+  // a protein that has its peptides
+  std::vector< std::vector<int> > meta_protein_members_;
   ProteinToMetaProtein protein_meta_protein_;
   MetaMapping meta_mapping_;
   MetaToScore meta_protein_scores_;
@@ -178,8 +184,6 @@ class SpectralCounts: public CruxApplication {
   // comparison function declarations
   static bool comparePeptideSets(PeptideSet, PeptideSet);
   static bool compareMetaProteins(MetaProtein, MetaProtein);
-  static bool setsAreEqualSize(const std::pair<PeptideSet, MetaProtein>&,
-                               const std::pair<PeptideSet, MetaProtein>&);
   static bool compareMetaScorePair(const std::pair<FLOAT_T, MetaProtein>&,
                                    const std::pair<FLOAT_T, MetaProtein>&);
  
@@ -6,8 +6,13 @@
 #include "StatColumn.h"
 
 #include "io/DelimitedFile.h"
+#include "io/DelimitedFileScan.h"
 #include "util/Params.h"
 
+#include <algorithm>
+#include <stdexcept>
+#include <boost/thread.hpp>
+
 using namespace std;
 
 
@@ -24,6 +29,55 @@ StatColumn::StatColumn() {
 StatColumn::~StatColumn() {
 }
 
+/**
+ * Parses the values of the blocks of a mapped file, and appends them to the
+ * data and the sum in file order, so that the sum is the one the row-by-row
+ * loop adds up. A field that is not a number is thrown.
+ */
+class StatColumnVisitor : public ScanVisitor {
+ public:
+  StatColumnVisitor(int num_slots, vector<FLOAT_T>* data, FLOAT_T* sum)
+    : slots_(num_slots), data_(data), sum_(sum) {}
+
+  virtual void visit(size_t slot, const ScanBlock& block) {
+    Slot& out = slots_[slot];
+    size_t num_rows = block.row_begin.size();
+    out.values.resize(num_rows);
+    out.failed = false;
+    for (size_t i = 0; i < num_rows; i++) {
+      if (!DelimitedFileReader::TryFloat(block.field_begin[i], block.field_end[i],
+                                         &out.values[i])) {
+        out.failed = true;
+        out.bad_field.assign(block.field_begin[i], block.field_end[i]);
+        break;
+      }
+    }
+  }
+
+  virtual bool finish(size_t slot) {
+    const Slot& out = slots_[slot];
+    if (out.failed) {
+      throw runtime_error("Could not convert string '" + out.bad_field + "'");
+    }
+    for (size_t i = 0; i < out.values.size(); i++) {
+      *sum_ += out.values[i];
+    }
+    data_->insert(data_->end(), out.values.begin(), out.values.end());
+    return true;
+  }
+
+ private:
+  struct Slot {
+    vector<FLOAT_T> values;
+    bool failed;
+    string bad_field;
+  };
+
+  vector<Slot> slots_;
+  vector<FLOAT_T>* data_;
+  FLOAT_T* sum_;
+};
+
 /**
  * main method for StatColumn
  */
@@ -31,6 +85,11 @@ int StatColumn::main(int argc, char** argv) {
   delimited_filename_ = Params::GetString("tsv file");
   column_name_string_ = Params::GetString("column name");
   delimiter_ = get_delimiter_parameter("delimiter");
+  header_ = Params::GetBool("header");
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = std::max(1, (int)boost::thread::hardware_concurrency());
+  }
 
   DelimitedFileReader delimited_file(delimited_filename_, true, delimiter_);
   
@@ -47,15 +106,22 @@ int StatColumn::main(int argc, char** argv) {
 
   FLOAT_T sum = 0;
 
-  while (delimited_file.hasNext()) {
+  // Files that can be mapped are parsed in parallel blocks.
+  DelimitedFileScan scan;
+  if (scan.open(delimited_filename_, delimiter_)) {
+    StatColumnVisitor visitor(num_threads, &data, &sum);
+    scan.scan(col_idx, num_threads, &visitor);
+  } else {
+    while (delimited_file.hasNext()) {
 
-    FLOAT_T current = delimited_file.getFloat(col_idx);
-    data.push_back(current);
-    sum += current;
-    delimited_file.next();
+      FLOAT_T current = delimited_file.getFloat(col_idx);
+      data.push_back(current);
+      sum += current;
+      delimited_file.next();
 
+    }
   }
-  
+
   sort(data.begin(), data.end(), less<FLOAT_T>());
 
   unsigned int num_points = data.size();
@@ -152,6 +218,7 @@ vector<string> StatColumn::getOptions() const {
   string arr[] = {
     "delimiter",
     "header",
+    "num-threads",
     "precision",
     "verbosity"
   };
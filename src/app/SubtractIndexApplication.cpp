@@ -2,6 +2,7 @@
  * \file SubtractIndexApplication.cpp
  * \brief Iterative PSM meta-search via Cascade protocol
  ************************************************************/
+#include <cstring>
 #include "SubtractIndexApplication.h"
 #include "io/OutputFiles.h"
 #include "AssignConfidenceApplication.h"
@@ -18,6 +19,69 @@
 
 using namespace std;
 
+// Read the next peptide, if there is one.
+static bool readNextPeptide(HeadedRecordReader& reader, pb::Peptide* peptide) {
+  if (reader.Done()) {
+    return false;
+  } else if (!reader.Read(peptide)) {
+    carp(CARP_FATAL, "Error reading peptides");
+  }
+  return true;
+}
+
+// Move *next, and the peptides that follow it with the same mass, into the
+// start of *group, whose peptides are reused so that their fields keep their
+// storage. Returns the number moved.
+static size_t readGroup(HeadedRecordReader& reader, double mass,
+                        pb::Peptide* next, bool* more, vector<pb::Peptide>* group) {
+  size_t size = 0;
+  for (; *more && next->mass() == mass; *more = readNextPeptide(reader, next)) {
+    if (size == group->size()) {
+      group->push_back(pb::Peptide());
+    }
+    (*group)[size++].Swap(next);
+  }
+  return size;
+}
+
+static const char* residuesOf(const pb::Peptide& peptide, const ProteinVec& proteins) {
+  const pb::Location& location = peptide.first_location();
+  return proteins[location.protein_id()]->residues().data() + location.pos();
+}
+
+// Whether two peptides have the same modified sequence, compared in place in
+// their proteins. Both indexes share a modification table, so the same
+// modification has the same code in each.
+static bool sameSequence(const pb::Peptide& a, const ProteinVec& proteins_a,
+                         const pb::Peptide& b, const ProteinVec& proteins_b) {
+  if (a.length() != b.length() ||
+      a.modifications_size() != b.modifications_size() ||
+      memcmp(residuesOf(a, proteins_a), residuesOf(b, proteins_b), a.length()) != 0) {
+    return false;
+  }
+  for (int i = 0; i < a.modifications_size(); ++i) {
+    int j = 0;
+    while (j < b.modifications_size() && b.modifications(j) != a.modifications(i)) {
+      ++j;
+    }
+    if (j == b.modifications_size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether decoy was made from target: a decoy protein ends with the residues
+// of the target it was made from.
+static bool isDecoyOf(const pb::Peptide& decoy, const pb::Peptide& target,
+                      const ProteinVec& proteins) {
+  const string& residues = proteins[decoy.first_location().protein_id()]->residues();
+  size_t length = target.length();
+  return (size_t)decoy.length() == length && residues.length() >= length &&
+    memcmp(residues.data() + residues.length() - length,
+           residuesOf(target, proteins), length) == 0;
+}
+
 /**
  * \returns a blank SubtractIndexApplication object
  */
@@ -56,7 +120,7 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   carp(CARP_DEBUG, "Read %d proteins", proteins1.size());
   
   pb::Header peptides_header1;
-  HeadedRecordReader peptide_reader1(peptides_file1, &peptides_header1);
+  HeadedRecordReader peptide_reader1(peptides_file1, &peptides_header1, -1, true);
   if (peptides_header1.file_type() != pb::Header::PEPTIDES ||
     !peptides_header1.has_peptides_header()) {
     carp(CARP_FATAL, "Error reading index (%s)", peptides_file1.c_str());
@@ -79,7 +143,7 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   string proteins_file2 = index2 + "/protix";
   carp(CARP_INFO, "Reading index %s", index2.c_str());
   pb::Header peptides_header2;
-  HeadedRecordReader peptide_reader2(peptides_file2, &peptides_header2);
+  HeadedRecordReader peptide_reader2(peptides_file2, &peptides_header2, -1, true);
   ProteinVec proteins2;
   pb::Header protein_header2;
   if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins2,
@@ -121,6 +185,9 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   }
   //copy aux and protein files;
   FileUtils::Copy(auxlocs_file1, out_aux);
+  if (FileUtils::Exists(auxlocs_file1 + ".flat")) {
+    FileUtils::Copy(auxlocs_file1 + ".flat", out_aux + ".flat");
+  }
   FileUtils::Copy(proteins_file1, out_proteins);
 
   pb::Header new_header;
@@ -130,141 +197,79 @@ int SubtractIndexApplication::main(int argc, char** argv) {
   pb::Header_PeptidesHeader* subheader = new_header.mutable_peptides_header();
   subheader->CopyFrom(peptides_header1.peptides_header());
   subheader->set_has_peaks(true);
+  subheader->clear_skip_table();  // the offsets are not those of the output
   pb::Header_Source* source = new_header.add_source();
   source->mutable_header()->CopyFrom(peptides_header1);
+  source->mutable_header()->mutable_peptides_header()->clear_skip_table();
   HeadedRecordWriter writer(out_peptides, new_header);
   CHECK(peptide_reader1.OK());
   CHECK(peptide_reader2.OK());
   CHECK(writer.OK());
 
   int mass_precision = Params::GetInt("mass-precision");
-  vector< pair<pb::Peptide, bool> > pepList1;
-  vector<pb::Peptide> pepList2;
-  bool done = false;
-  while (!peptide_reader1.Done()) {
-    // populate lists of peptides
-    pb::Peptide pep1;
-    peptide_reader1.Read(&pep1);
-    pepList1.push_back(make_pair(pep1, false));
-    while (pepList1.front().first.mass() == pepList1.back().first.mass()) {
-      if (peptide_reader1.Done()) {
-        done = true;
-        break;
-      }
-      peptide_reader1.Read(&pep1);
-      pepList1.push_back(make_pair(pep1, false));
-    }
-    if (done) {
-      break;
-    }
-    double curMass = pepList1.front().first.mass();
-    if (!pepList2.empty() && pepList2.back().mass() < curMass) {
-      pepList2.clear();
-    }
-    if (pepList2.empty() || pepList2.front().mass() == curMass) {
-      while (!peptide_reader2.Done()) {
-        pb::Peptide pep2;
-        peptide_reader2.Read(&pep2);
-        if (pep2.mass() < curMass) {
-          continue;
-        }
-        pepList2.push_back(pep2);
-        if (pep2.mass() > curMass) {
-          break;
-        }
-      }
+  // Both peptide files are sorted by mass. Peptides of equal mass are taken a
+  // group at a time from index 1, and compared only with the peptides of the
+  // same mass in index 2, ahead of which index 2 skips by its skip table.
+  pb::Peptide next1, next2;
+  bool more1 = readNextPeptide(peptide_reader1, &next1);
+  bool more2 = readNextPeptide(peptide_reader2, &next2);
+  vector<pb::Peptide> group1, group2;
+  vector<bool> matched;
+  int64_t count = 0, removed = 0;
+  while (more1) {
+    double mass = next1.mass();
+    size_t size1 = readGroup(peptide_reader1, mass, &next1, &more1, &group1);
+    while (more2 && next2.mass() < mass) {
+      peptide_reader2.Reader()->SkipTo(mass);
+      more2 = readNextPeptide(peptide_reader2, &next2);
     }
+    size_t size2 = more2 && next2.mass() == mass ?
+      readGroup(peptide_reader2, mass, &next2, &more2, &group2) : 0;
 
-    // match targets to decoys
-    map<vector< pair<pb::Peptide, bool> >::iterator, vector< pair<pb::Peptide, bool> >::iterator> targetToDecoy;
-    for (vector< pair<pb::Peptide, bool> >::iterator i = pepList1.begin(); i != pepList1.end(); i++) {
-      if (i->first.is_decoy()) {
+    // A target of index 1 found in index 2 is removed, and so is its decoy.
+    matched.assign(size1, false);
+    for (size_t i = 0; i < size1 && size2 > 0; ++i) {
+      const pb::Peptide& target = group1[i];
+      if (target.is_decoy()) {
         continue;
       }
-      Peptide iPep(i->first, proteins1);
-      for (vector< pair<pb::Peptide, bool> >::iterator j = pepList1.begin(); j != pepList1.end(); j++) {
-        if (!j->first.is_decoy()) {
-          continue;
-        }
-        Peptide jPep(j->first, proteins1);
-        const pb::Protein* jProtein = proteins1[jPep.FirstLocProteinId()];
-        const string& residues = jProtein->residues();
-        const string originalTarget = residues.substr(residues.length() - jPep.Len());
-        if (iPep.Seq() == originalTarget) {
-          targetToDecoy[i] = j;
+      for (size_t j = 0; j < size2; ++j) {
+        if (!group2[j].is_decoy() &&
+            sameSequence(target, proteins1, group2[j], proteins2)) {
+          matched[i] = true;
           break;
         }
       }
-    }
-
-    // match peptides in lists
-    for (vector< pair<pb::Peptide, bool> >::iterator i = pepList1.begin(); i != pepList1.end(); i++) {
-      if (i->first.mass() > curMass) {
-        break;
-      } else if (i->first.is_decoy()) {
-        continue; // don't match decoys
+      if (!matched[i]) {
+        continue;
       }
-      string pepStr1 = getModifiedPeptideSeq(&i->first, &proteins1);
-      for (vector<pb::Peptide>::const_iterator j = pepList2.begin(); j != pepList2.end(); j++) {
-        if (j->mass() > curMass) {
-          break;
-        } else if (j->is_decoy()) {
-          continue;
-        }
-        string pepStr2 = getModifiedPeptideSeq(&*j, &proteins2);
-        if (pepStr1 == pepStr2) {
-          i->second = true;
-          map<vector< pair<pb::Peptide, bool> >::iterator, vector< pair<pb::Peptide, bool> >::iterator>::iterator lookup = targetToDecoy.find(i);
-          if (lookup != targetToDecoy.end()) {
-            lookup->second->second = true; // mark decoy as matched
-          }
+      for (size_t j = 0; j < size1; ++j) {
+        if (group1[j].is_decoy() && isDecoyOf(group1[j], target, proteins1)) {
+          matched[j] = true;
           break;
         }
       }
     }
 
     // write peptides
-    for (vector< pair<pb::Peptide, bool> >::iterator i = pepList1.begin(); i != pepList1.end(); i++) {
-      if (i->first.mass() > curMass) {
-        break;
-      } else if (!i->second) {
-        CHECK(writer.Write(&i->first));
-        if (write_peptides) {
-          string pepStr = getModifiedPeptideSeq(&i->first, &proteins1);
-          double mass = i->first.mass();
-          if (!i->first.is_decoy()) {
-            if (out_target_list) {
-              *out_target_list << pepStr << '\t'
-                               << StringUtils::ToString(mass, mass_precision)
-                               << endl;
-            }
-          } else {
-            if (out_decoy_list) {
-              *out_decoy_list << pepStr << '\t'
-                              << StringUtils::ToString(mass, mass_precision)
-                              << endl;
-            }
-          }
-        }
-      }
-    }
-
-    // clean up peptide lists
-    if (!pepList1.empty()) {
-      if (pepList1.back().first.mass() == curMass) {
-        pepList1.clear();
-      } else {
-        pepList1.erase(pepList1.begin(), pepList1.end() - 1);
+    for (size_t i = 0; i < size1; ++i) {
+      if (matched[i]) {
+        ++removed;
+        continue;
       }
-    }
-    if (!pepList2.empty()) {
-      if (pepList2.back().mass() == curMass) {
-        pepList2.clear();
-      } else {
-        pepList2.erase(pepList2.begin(), pepList2.end() - 1);
+      const pb::Peptide& peptide = group1[i];
+      CHECK(writer.Write(&peptide));
+      ++count;
+      ofstream* out_list = peptide.is_decoy() ? out_decoy_list : out_target_list;
+      if (write_peptides && out_list) {
+        *out_list << getModifiedPeptideSeq(&peptide, &proteins1) << '\t'
+                  << StringUtils::ToString(peptide.mass(), mass_precision)
+                  << endl;
       }
     }
   }
+  carp(CARP_INFO, "Wrote %lld peptides and removed %lld", (long long)count,
+       (long long)removed);
 
   return 0;
 }
@@ -6,11 +6,18 @@
 #include "util/Params.h"
 #include "util/FileUtils.h"
 #include "util/StringUtils.h"
+#include "util/mass.h"
+#include "util/ThreadPool.h"
 #include "GeneratePeptides.h"
 #include "TideIndexApplication.h"
 #include "TideMatchSet.h"
+#include "app/tide/aux_locations.h"
+#include "app/tide/index_shards.h"
+#include "app/tide/loser_tree.h"
 #include "app/tide/modifications.h"
 #include "app/tide/records_to_vector-inl.h"
+#include "boost/cstdint.hpp"
+#include "boost/unordered_map.hpp"
 
 #ifdef _MSC_VER
 #include <io.h>
@@ -18,7 +25,8 @@
 
 extern void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
                                 const string& input_filename,
-                                const string& output_filename);
+                                const string& output_filename,
+                                bool store_peaks);
 extern void AddMods(HeadedRecordReader* reader,
                     string out_file,
                     string tmpDir,                    
@@ -28,6 +36,7 @@ extern void AddMods(HeadedRecordReader* reader,
 DECLARE_int32(max_mods);
 DECLARE_int32(min_mods);
 DECLARE_int32(modsoutputter_file_threshold);
+DECLARE_int32(mods_threads);
 
 TideIndexApplication::TideIndexApplication() {
 }
@@ -35,6 +44,101 @@ TideIndexApplication::TideIndexApplication() {
 TideIndexApplication::~TideIndexApplication() {
 }
 
+class TideIndexApplication::PeptideGroups {
+ public:
+  typedef boost::uint64_t Hash;
+
+  // Polynomial hashes of the prefixes of one protein sequence, from which
+  // the hash of any of its peptides takes constant time, instead of hashing
+  // the residues of every peptide cleaved from it again.
+  class ProteinHashes {
+   public:
+    explicit ProteinHashes(const string& sequence)
+      : prefixes_(sequence.size() + 1, 0), powers_(sequence.size() + 1, 1) {
+      for (size_t i = 0; i < sequence.size(); ++i) {
+        prefixes_[i + 1] = prefixes_[i] * BASE + (unsigned char)sequence[i];
+        powers_[i + 1] = powers_[i] * BASE;
+      }
+    }
+    Hash Of(int pos, int length) const {
+      return prefixes_[pos + length] - prefixes_[pos] * powers_[length];
+    }
+   private:
+    vector<Hash> prefixes_;
+    vector<Hash> powers_;
+  };
+
+  // The same hash as ProteinHashes, of residues on their own.
+  static Hash Of(const char* residues, int length) {
+    Hash hash = 0;
+    for (int i = 0; i < length; ++i) {
+      hash = hash * BASE + (unsigned char)residues[i];
+    }
+    return hash;
+  }
+
+  /**
+   * Adds peptide, whose residues have the given hash. If an equal peptide
+   * (see TideIndexPeptide::operator ==) was added before, peptide becomes
+   * another location of it and false is returned; otherwise peptide is given
+   * a new group, and true is returned so that it goes on the heap.
+   */
+  bool Add(TideIndexPeptide* peptide, Hash hash) {
+    hash ^= (Hash)peptide->getLength() << 56;
+    pair<Index::const_iterator, Index::const_iterator> range =
+      index_.equal_range(hash);
+    for (Index::const_iterator i = range.first; i != range.second; ++i) {
+      Group& group = groups_[i->second];
+      if (group.first == *peptide) {
+        Location location = {
+          peptide->getProteinId(), peptide->getProteinPos(), -1 };
+        if (group.tail < 0) {
+          group.head = locations_.size();
+        } else {
+          locations_[group.tail].next = locations_.size();
+        }
+        group.tail = locations_.size();
+        locations_.push_back(location);
+        return false;
+      }
+    }
+    peptide->setGroup(groups_.size());
+    Group group = { *peptide, -1, -1 };
+    index_.insert(make_pair(hash, (int)groups_.size()));
+    groups_.push_back(group);
+    return true;
+  }
+
+  // Appends the (protein, position) of every copy added to group after the
+  // first.
+  void GetLocations(int group, vector< pair<int, int> >* out) const {
+    for (int i = groups_[group].head; i >= 0; i = locations_[i].next) {
+      out->push_back(make_pair(locations_[i].proteinId, locations_[i].proteinPos));
+    }
+  }
+
+ private:
+  static const Hash BASE = 0x100000001b3ULL;
+
+  struct Group {
+    TideIndexPeptide first;
+    int head;  // first of its other locations, or -1
+    int tail;
+  };
+
+  struct Location {
+    int proteinId;
+    int proteinPos;
+    int next;
+  };
+
+  typedef boost::unordered_multimap<Hash, int> Index;
+
+  Index index_;
+  vector<Group> groups_;
+  vector<Location> locations_;
+};
+
 int TideIndexApplication::main(int argc, char** argv) {
   return main(Params::GetString("protein fasta file"),
               Params::GetString("index name"),
@@ -66,6 +170,10 @@ int TideIndexApplication::main(
   FLAGS_max_mods = Params::GetInt("max-mods");
   FLAGS_min_mods = Params::GetInt("min-mods");
   FLAGS_modsoutputter_file_threshold = Params::GetInt("modsoutputter-threshold");
+  FLAGS_mods_threads = Params::GetInt("num-threads");
+  if (FLAGS_mods_threads < 1) {
+    FLAGS_mods_threads = boost::thread::hardware_concurrency();
+  }
   bool allowDups = Params::GetBool("allow-dups");
   if (FLAGS_min_mods > FLAGS_max_mods) {
     carp(CARP_FATAL, "The value for 'min-mods' cannot be greater than the value "
@@ -83,42 +191,46 @@ int TideIndexApplication::main(
   }
 
   VariableModTable var_mod_table;
-  var_mod_table.ClearTables();
-  //parse regular amino acid modifications
-  string mods_spec = Params::GetString("mods-spec");
-  carp(CARP_DEBUG, "mods_spec='%s'", mods_spec.c_str());
-  if (!var_mod_table.Parse(mods_spec.c_str())) {
-    carp(CARP_FATAL, "Error parsing mods");
-  }
-  //parse terminal modifications
-  mods_spec = Params::GetString("cterm-peptide-mods-spec");
-  if (!mods_spec.empty() && !var_mod_table.Parse(mods_spec.c_str(), CTPEP)) {
-    carp(CARP_FATAL, "Error parsing c-terminal peptide mods");
-  }
-  mods_spec = Params::GetString("nterm-peptide-mods-spec");
-  if (!mods_spec.empty() && !var_mod_table.Parse(mods_spec.c_str(), NTPEP)) {
-    carp(CARP_FATAL, "Error parsing n-terminal peptide mods");
-  }
-  mods_spec = Params::GetString("cterm-protein-mods-spec");
-  if (!mods_spec.empty() && !var_mod_table.Parse(mods_spec.c_str(), CTPRO)) {
-    carp(CARP_FATAL, "Error parsing c-terminal protein mods");
-  }
-  mods_spec = Params::GetString("nterm-protein-mods-spec");
-  if (!mods_spec.empty() && !var_mod_table.Parse(mods_spec.c_str(), NTPRO)) {
-    carp(CARP_FATAL, "Error parsing n-terminal protein mods");
+  parseMods(&var_mod_table);
+
+  // With search-time-mods the index holds only the unmodified peptides, and
+  // tide-search applies the variable modifications of the header itself.
+  bool search_time_mods = Params::GetBool("search-time-mods") &&
+    var_mod_table.Unique_delta_size() > 0;
+  if (search_time_mods &&
+      (!Params::GetString("cterm-protein-mods-spec").empty() ||
+       !Params::GetString("nterm-protein-mods-spec").empty())) {
+    carp(CARP_WARNING, "search-time-mods does not support protein terminal "
+                       "modifications; storing the modified peptides instead.");
+    search_time_mods = false;
   }
 
-  var_mod_table.SerializeUniqueDeltas();
-
+  // The bins only matter if the theoretical peaks are stored.
+  bool store_peaks = Params::GetBool("store-peaks");
+  if (search_time_mods && store_peaks) {
+    carp(CARP_WARNING, "store-peaks is ignored with search-time-mods.");
+    store_peaks = false;
+  }
   if (!MassConstants::Init(var_mod_table.ParsedModTable(), 
     var_mod_table.ParsedNtpepModTable(), 
-    var_mod_table.ParsedCtpepModTable(), 0, 0)) {
+    var_mod_table.ParsedCtpepModTable(),
+    store_peaks ? Params::GetDouble("mz-bin-width") : 0,
+    store_peaks ? Params::GetDouble("mz-bin-offset") : 0)) {
     carp(CARP_FATAL, "Error in MassConstants::Init");
   }
 
   DECOY_TYPE_T decoy_type = get_tide_decoy_type_parameter("decoy-format");
   string decoyPrefix = Params::GetString("decoy-prefix");
 
+  string base_index = Params::GetString("append-to-index");
+  if (!base_index.empty()) {
+    if (!FileUtils::Exists(FileUtils::Join(base_index, "pepix"))) {
+      carp(CARP_FATAL, "Index %s does not exist", base_index.c_str());
+    } else if (AbsPath(base_index) == AbsPath(index)) {
+      carp(CARP_FATAL, "The index to append to must differ from the output index");
+    }
+  }
+
   // Set up output paths
   bool overwrite = Params::GetBool("overwrite");
 
@@ -155,6 +267,8 @@ int TideIndexApplication::main(
       FileUtils::Remove(out_proteins);
       FileUtils::Remove(out_peptides);
       FileUtils::Remove(out_aux);
+      FileUtils::Remove(out_aux + ".flat");
+      RemoveIndexShards(out_peptides);
       FileUtils::Remove(modless_peptides);
       FileUtils::Remove(peakless_peptides);
     } else {
@@ -169,9 +283,12 @@ int TideIndexApplication::main(
   pb::Header proteinPbHeader;
   vector<TideIndexPeptide> peptideHeap;
   vector<string*> proteinSequences;
+  vector<string> peptideRuns;
+  PeptideGroups peptideGroups;
   fastaToPb(cmd_line, enzyme_t, digestion, missed_cleavages, min_mass, max_mass,
             min_length, max_length, allowDups, mass_type, decoy_type, fasta, out_proteins,
-            proteinPbHeader, peptideHeap, proteinSequences, out_decoy_fasta);
+            proteinPbHeader, peptideHeap, proteinSequences, out_decoy_fasta,
+            out_peptides + ".run", peptideRuns, peptideGroups);
 
   pb::Header header_with_mods;
 
@@ -204,12 +321,25 @@ int TideIndexApplication::main(
   del->mutable_variable_mod()->Clear();
   del->mutable_unique_deltas()->Clear();
 
-  bool need_mods = var_mod_table.Unique_delta_size() > 0;
+  if (search_time_mods) {
+    pep_header.set_search_time_mods(true);
+    pep_header.set_max_mods(FLAGS_max_mods);
+    pep_header.set_min_mods(FLAGS_min_mods);
+  }
+
+  bool need_mods = var_mod_table.Unique_delta_size() > 0 && !search_time_mods;
 
   string basic_peptides = need_mods ? modless_peptides : peakless_peptides;
   carp(CARP_DETAILED_DEBUG, "basic_peptides=%s", basic_peptides.c_str());
 
-  writePeptidesAndAuxLocs(peptideHeap, basic_peptides, out_aux, header_no_mods);
+  writePeptidesAndAuxLocs(peptideHeap, peptideRuns, &peptideGroups,
+                          proteinSequences, basic_peptides, out_aux,
+                          search_time_mods ? header_with_mods : header_no_mods);
+  for (vector<string>::const_iterator i = peptideRuns.begin();
+       i != peptideRuns.end();
+       ++i) {
+    FileUtils::Remove(*i);
+  }
   // Do some clean up
   for (vector<string*>::iterator i = proteinSequences.begin();
        i != proteinSequences.end();
@@ -228,78 +358,17 @@ int TideIndexApplication::main(
     AddMods(&reader, peakless_peptides, Params::GetString("temp-dir"), header_with_mods, proteins, &var_mod_table);
   }
 
+  // The peptide lists are written from the peptides while their peaks are
+  // computed, both reading peakless_peptides.
+  ThreadPool::TaskGroup listGroup;
   if (out_target_list) {
-    // Write peptide lists
-    carp(CARP_INFO, "Writing peptide lists...");
-
-    // This set holds target peptide strings
-    set<string> targetPepStrs;
-    // This vector holds decoy peptide strings and masses
-    vector< pair<string, double> > decoyPepStrs;
-    // Read peptides protocol buffer file
-    vector<const pb::AuxLocation*> locations;
-    if (!ReadRecordsToVector<pb::AuxLocation>(&locations, out_aux)) {
-      carp(CARP_FATAL, "Error reading auxlocs file");
-    }
-    int mass_precision = Params::GetInt("mass-precision");
-    // Iterate over all protocol buffer peptides
-    unsigned int writeCountTargets = 0, writeCountDecoys = 0;
-    HeadedRecordReader reader(peakless_peptides, NULL);
-    while (!reader.Done()) {
-      pb::Peptide* protobuf = new pb::Peptide;
-      reader.Read(protobuf);
-      pb::Peptide* peptide = protobuf;
-      bool writeTarget = true;
-      bool writeDecoy = false;
-
-      if (out_decoy_list) {
-        writeDecoy = peptide->is_decoy();
-        writeTarget = !writeDecoy;
-      }
-      string pep_str = getModifiedPeptideSeq(peptide, &proteins);
-
-      if (writeTarget) {
-        // This is a target, output it
-        targetPepStrs.insert(pep_str);
-        *out_target_list << pep_str << '\t'
-                         << StringUtils::ToString(peptide->mass(),
-                                                  mass_precision) << endl;
-        ++writeCountTargets;
-      }
-      if (writeDecoy) {
-        // This is a decoy, save it to output later
-        decoyPepStrs.push_back(make_pair(pep_str, peptide->mass()));
-        ++writeCountDecoys;
-      }
-      delete peptide;
-    }
-
-    // Iterate over saved decoys and output them
-    for (vector< pair<string, double> >::const_iterator i = decoyPepStrs.begin();
-         i != decoyPepStrs.end();
-         ++i) {
-      *out_decoy_list << i->first << '\t'
-                      << StringUtils::ToString(i->second, mass_precision);
-      if (targetPepStrs.find(i->first) != targetPepStrs.end()) {
-        *out_decoy_list << "\t*";
-      }
-      *out_decoy_list << endl;
-    }
-
-    // Close and clean up streams
-    if (out_decoy_list) {
-      out_decoy_list->close();
-      delete out_decoy_list;
-    }
-    out_target_list->close();
-    delete out_target_list;
-
-    carp(CARP_DEBUG, "Wrote %d targets and %d decoys to peptide list",
-         writeCountTargets, writeCountDecoys);
+    listGroup.Run(boost::bind(&TideIndexApplication::writePeptideLists,
+      peakless_peptides, &proteins, out_target_list, out_decoy_list));
   }
 
   carp(CARP_INFO, "Precomputing theoretical spectra...");
-  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides);
+  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides, store_peaks);
+  listGroup.Wait();
 
   // Clean up
   for (vector<const pb::Protein*>::iterator i = proteins.begin();
@@ -318,9 +387,65 @@ int TideIndexApplication::main(
   FileUtils::Remove(modless_peptides);
   FileUtils::Remove(peakless_peptides);
 
+  if (!base_index.empty()) {
+    appendToIndex(base_index, index);
+  }
+
+  if (Params::GetBool("compress-index")) {
+    const int COMPRESSED_BLOCK_SIZE = 64 << 10;
+    compressPeptides(out_peptides, COMPRESSED_BLOCK_SIZE);
+  } else if (Params::GetInt("index-skip-interval") > 0) {
+    addSkipTable(out_peptides, Params::GetInt("index-skip-interval"));
+  }
+
+  // The shards are copies; pepix stays whole for the applications that read
+  // all of it.
+  int numShards = Params::GetInt("index-shards");
+  if (numShards > 1) {
+    WriteIndexShards(out_peptides, numShards);
+  }
+
+  if (Params::GetBool("flat-auxlocs")) {
+    if (!AuxLocations::WriteFlat(out_aux, out_aux + ".flat")) {
+      carp(CARP_FATAL, "Error writing %s.flat", out_aux.c_str());
+    }
+  } else {
+    // Not left over from an index this one replaces
+    FileUtils::Remove(out_aux + ".flat");
+  }
+
   return 0;
 }
 
+void TideIndexApplication::parseMods(VariableModTable* varModTable) {
+  varModTable->ClearTables();
+  //parse regular amino acid modifications
+  string mods_spec = Params::GetString("mods-spec");
+  carp(CARP_DEBUG, "mods_spec='%s'", mods_spec.c_str());
+  if (!varModTable->Parse(mods_spec.c_str())) {
+    carp(CARP_FATAL, "Error parsing mods");
+  }
+  //parse terminal modifications
+  mods_spec = Params::GetString("cterm-peptide-mods-spec");
+  if (!mods_spec.empty() && !varModTable->Parse(mods_spec.c_str(), CTPEP)) {
+    carp(CARP_FATAL, "Error parsing c-terminal peptide mods");
+  }
+  mods_spec = Params::GetString("nterm-peptide-mods-spec");
+  if (!mods_spec.empty() && !varModTable->Parse(mods_spec.c_str(), NTPEP)) {
+    carp(CARP_FATAL, "Error parsing n-terminal peptide mods");
+  }
+  mods_spec = Params::GetString("cterm-protein-mods-spec");
+  if (!mods_spec.empty() && !varModTable->Parse(mods_spec.c_str(), CTPRO)) {
+    carp(CARP_FATAL, "Error parsing c-terminal protein mods");
+  }
+  mods_spec = Params::GetString("nterm-protein-mods-spec");
+  if (!mods_spec.empty() && !varModTable->Parse(mods_spec.c_str(), NTPRO)) {
+    carp(CARP_FATAL, "Error parsing n-terminal protein mods");
+  }
+
+  varModTable->SerializeUniqueDeltas();
+}
+
 string TideIndexApplication::getName() const {
   return "tide-index";
 }
@@ -359,7 +484,9 @@ vector<string> TideIndexApplication::getArgs() const {
 vector<string> TideIndexApplication::getOptions() const {
   string arr[] = {
     "allow-dups",
+    "append-to-index",
     "clip-nterm-methionine",
+    "compress-index",
     "cterm-peptide-mods-spec",
     "cterm-protein-mods-spec",
     "custom-enzyme",
@@ -367,25 +494,34 @@ vector<string> TideIndexApplication::getOptions() const {
     "decoy-prefix",
     "digestion",
     "enzyme",
+    "flat-auxlocs",
+    "index-shards",
+    "index-skip-interval",
     "isotopic-mass",
     "keep-terminal-aminos",
     "mass-precision",
     "max-length",
     "max-mass",
     "max-mods",
+    "memory-limit",
     "min-length",
     "min-mass",
     "min-mods",
     "missed-cleavages",
     "mod-precision",
     "mods-spec",
+    "mz-bin-offset",
+    "mz-bin-width",
     "nterm-peptide-mods-spec",
     "nterm-protein-mods-spec",
+    "num-threads",
     "output-dir",
     "overwrite",
     "parameter-file",
     "peptide-list",
+    "search-time-mods",
     "seed",
+    "store-peaks",
     "temp-dir",
     "verbosity"
   };
@@ -432,7 +568,10 @@ void TideIndexApplication::fastaToPb(
   pb::Header& outProteinPbHeader,
   vector<TideIndexPeptide>& outPeptideHeap,
   vector<string*>& outProteinSequences,
-  ofstream* decoyFasta
+  ofstream* decoyFasta,
+  const string& peptideRunPrefix,
+  vector<string>& outPeptideRuns,
+  PeptideGroups& outPeptideGroups
 ) {
   typedef GeneratePeptides::CleavedPeptide PeptideInfo;
 
@@ -448,6 +587,26 @@ void TideIndexApplication::fastaToPb(
 
   outPeptideHeap.clear();
   outProteinSequences.clear();
+  outPeptideRuns.clear();
+  // Past memory-limit, the peptides collected so far are written to disk as a
+  // sorted run.
+  size_t maxHeapPeptides = (size_t)Params::GetInt("memory-limit") * (1 << 20) /
+                           sizeof(TideIndexPeptide);
+
+  // Proteins are read and cleaved in batches. The threads only cleave the
+  // proteins of a batch and compute the peptide masses; the peptides are then
+  // added in protein order, so the index does not depend on the number of
+  // threads.
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = boost::thread::hardware_concurrency();
+  }
+  DigestSettings digestSettings = {
+    enzyme, digestion, missedCleavages, minLength, maxLength, massType };
+  const size_t DIGEST_BATCH_SIZE = 4096;
+  vector<string*> batchSequences;
+  vector<string> batchNames;
+  vector<DigestedProtein> batchPeptides;
 
   HeadedRecordWriter proteinWriter(proteinPbFile, outProteinPbHeader);
   ifstream fastaStream(fasta.c_str(), ifstream::in);
@@ -461,45 +620,64 @@ void TideIndexApplication::fastaToPb(
 
   // Iterate over all proteins in FASTA file
   unsigned int targetsGenerated = 0, decoysGenerated = 0;
-  while (GeneratePeptides::getNextProtein(fastaStream, &proteinName, proteinSequence)) {
-    outProteinSequences.push_back(proteinSequence);
-    cleavedPeptideInfo.push_back(make_pair(
-      ProteinInfo(proteinName, proteinSequence), vector<PeptideInfo>()));
-    const ProteinInfo& proteinInfo = cleavedPeptideInfo.back().first;
-    vector<PeptideInfo>& cleavedPeptides = cleavedPeptideInfo.back().second;
-    // Write pb::Protein
-    getPbProtein(++curProtein, proteinName, *proteinSequence, pbProtein);
-    proteinWriter.Write(&pbProtein);
-    cleavedPeptides = GeneratePeptides::cleaveProtein(
-      *proteinSequence, enzyme, digestion, missedCleavages, minLength, maxLength);
-    // Iterate over all generated peptides for this protein
-    for (vector<PeptideInfo>::iterator i = cleavedPeptides.begin();
-         i != cleavedPeptides.end(); ) {
-      FLOAT_T pepMass = calcPepMassTide(i->Sequence(), massType);
-      if (pepMass < 0.0) {
-        // Sequence contained some invalid character
-        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", i->Sequence().c_str());
-        ++invalidPepCnt;
-        i = cleavedPeptides.erase(i);
-        continue;
-      } else if (pepMass < minMass || pepMass > maxMass) {
-        // Skip to next peptide if not in mass range
-        ++i;
-        continue;
-      }
-      // Add target to heap
-      TideIndexPeptide pepTarget(
-        pepMass, i->Length(), proteinSequence, curProtein, i->Position(), false);
-      outPeptideHeap.push_back(pepTarget);
-      push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
-      if (!allowDups && decoyType != NO_DECOYS) {
-        const string* setTarget = &*(setTargets.insert(i->Sequence()).first);
-        targetInfo.insert(make_pair(setTarget, TargetInfo(proteinInfo, i->Position(), pepMass)));
+  bool moreProteins = true;
+  while (moreProteins) {
+    batchSequences.clear();
+    batchNames.clear();
+    while (batchSequences.size() < DIGEST_BATCH_SIZE &&
+           (moreProteins = GeneratePeptides::getNextProtein(
+              fastaStream, &proteinName, proteinSequence))) {
+      outProteinSequences.push_back(proteinSequence);
+      batchSequences.push_back(proteinSequence);
+      batchNames.push_back(proteinName);
+      proteinSequence = new string;
+    }
+    digestProteins(batchSequences, digestSettings, numThreads, batchPeptides);
+
+    for (size_t k = 0; k < batchSequences.size(); ++k) {
+      string* sequence = batchSequences[k];
+      cleavedPeptideInfo.push_back(make_pair(
+        ProteinInfo(batchNames[k], sequence), vector<PeptideInfo>()));
+      const ProteinInfo& proteinInfo = cleavedPeptideInfo.back().first;
+      vector<PeptideInfo>& cleavedPeptides = cleavedPeptideInfo.back().second;
+      // Write pb::Protein
+      getPbProtein(++curProtein, batchNames[k], *sequence, pbProtein);
+      proteinWriter.Write(&pbProtein);
+      const DigestedProtein& digested = batchPeptides[k];
+      cleavedPeptides.reserve(digested.peptides.size());
+      PeptideGroups::ProteinHashes hashes(*sequence);
+      // Iterate over all generated peptides for this protein
+      for (size_t j = 0; j < digested.peptides.size(); ++j) {
+        const PeptideInfo& peptide = digested.peptides[j];
+        FLOAT_T pepMass = digested.masses[j];
+        if (pepMass < 0.0) {
+          // Sequence contained some invalid character
+          carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", peptide.Sequence().c_str());
+          ++invalidPepCnt;
+          continue;
+        }
+        cleavedPeptides.push_back(peptide);
+        if (pepMass < minMass || pepMass > maxMass) {
+          // Skip to next peptide if not in mass range
+          continue;
+        }
+        ++targetsGenerated;
+        // Add target to heap, unless it is a copy of one already there
+        TideIndexPeptide pepTarget(
+          pepMass, peptide.Length(), sequence, curProtein, peptide.Position(), false);
+        if (!outPeptideGroups.Add(&pepTarget,
+              hashes.Of(peptide.Position(), peptide.Length()))) {
+          continue;
+        }
+        outPeptideHeap.push_back(pepTarget);
+        push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
+        if (!allowDups && decoyType != NO_DECOYS) {
+          const string* setTarget = &*(setTargets.insert(peptide.Sequence()).first);
+          targetInfo.insert(make_pair(setTarget, TargetInfo(proteinInfo, peptide.Position(), pepMass)));
+        }
       }
-      ++targetsGenerated;
-      ++i;
+      spillPeptideRun(outPeptideHeap, maxHeapPeptides, peptideRunPrefix, outPeptideRuns);
     }
-    proteinSequence = new string;
   }
   delete proteinSequence;
   if (targetsGenerated == 0) {
@@ -513,54 +691,74 @@ void TideIndexApplication::fastaToPb(
     if (decoyFasta) {
       carp(CARP_INFO, "Writing reverse-protein fasta and decoys...");
     }
-    for (vector< pair< ProteinInfo, vector<PeptideInfo> > >::const_iterator i =
-         cleavedPeptideInfo.begin(); i != cleavedPeptideInfo.end(); ++i) {
-      string decoyProtein = *(i->first.sequence);
-      reverse(decoyProtein.begin(), decoyProtein.end());
-      if (decoyFasta) {
-        (*decoyFasta) << ">"<< decoyPrefix << i->first.name << endl
-                      << decoyProtein << endl;
+    for (size_t first = 0; first < cleavedPeptideInfo.size();
+         first += DIGEST_BATCH_SIZE) {
+      size_t last = min(first + DIGEST_BATCH_SIZE, cleavedPeptideInfo.size());
+      batchSequences.clear();
+      for (size_t i = first; i < last; ++i) {
+        string* decoyProtein = new string(*(cleavedPeptideInfo[i].first.sequence));
+        reverse(decoyProtein->begin(), decoyProtein->end());
+        batchSequences.push_back(decoyProtein);
       }
-      vector<PeptideInfo> cleavedReverse = GeneratePeptides::cleaveProtein(
-        decoyProtein, enzyme, digestion, missedCleavages, minLength, maxLength);
-      // Iterate over all generated peptides for this protein
-      for (vector<PeptideInfo>::iterator j = cleavedReverse.begin();
-           j != cleavedReverse.end();
-           ++j) {
-        FLOAT_T pepMass = calcPepMassTide(j->Sequence(), massType);
-        if (pepMass < 0.0) {
-          // Sequence contained some invalid character
-          carp(CARP_DEBUG, "Ignoring invalid sequence in decoy fasta <%s>",
-               j->Sequence().c_str());
-          ++invalidPepCnt;
-          continue;
-        } else if (pepMass < minMass || pepMass > maxMass) {
-          // Skip to next peptide if not in mass range
-          continue;
-        } else if (!allowDups && setTargets.find(j->Sequence()) != setTargets.end()) {
-          // Sequence already exists as a target
-          continue;
+      digestProteins(batchSequences, digestSettings, numThreads, batchPeptides);
+
+      for (size_t i = first; i < last; ++i) {
+        const ProteinInfo& targetProtein = cleavedPeptideInfo[i].first;
+        const string& decoyProtein = *batchSequences[i - first];
+        if (decoyFasta) {
+          (*decoyFasta) << ">"<< decoyPrefix << targetProtein.name << endl
+                        << decoyProtein << endl;
         }
-        string* decoySequence = new string(j->Sequence());
-        outProteinSequences.push_back(decoySequence);
-
-        // Write pb::Protein
-        getDecoyPbProtein(++curProtein, ProteinInfo(i->first.name, &decoyProtein),
-                          *decoySequence, j->Position(), pbProtein);
-        proteinWriter.Write(&pbProtein);
-        // Add decoy to heap
-        TideIndexPeptide pepDecoy(pepMass, j->Length(), decoySequence,
-          curProtein, (j->Position() > 0) ? 1 : 0, true);
-        outPeptideHeap.push_back(pepDecoy);
-        push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
-          greater<TideIndexPeptide>());
-        ++decoysGenerated;
+        const DigestedProtein& digested = batchPeptides[i - first];
+        // Iterate over all generated peptides for this protein
+        for (size_t j = 0; j < digested.peptides.size(); ++j) {
+          const PeptideInfo& peptide = digested.peptides[j];
+          FLOAT_T pepMass = digested.masses[j];
+          if (pepMass < 0.0) {
+            // Sequence contained some invalid character
+            carp(CARP_DEBUG, "Ignoring invalid sequence in decoy fasta <%s>",
+                 peptide.Sequence().c_str());
+            ++invalidPepCnt;
+            continue;
+          } else if (pepMass < minMass || pepMass > maxMass) {
+            // Skip to next peptide if not in mass range
+            continue;
+          } else if (!allowDups && setTargets.find(peptide.Sequence()) != setTargets.end()) {
+            // Sequence already exists as a target
+            continue;
+          }
+          string* decoySequence = new string(peptide.Sequence());
+          outProteinSequences.push_back(decoySequence);
+
+          // Write pb::Protein
+          getDecoyPbProtein(++curProtein, ProteinInfo(targetProtein.name, &decoyProtein),
+                            *decoySequence, peptide.Position(), pbProtein);
+          proteinWriter.Write(&pbProtein);
+          ++decoysGenerated;
+          // Add decoy to heap, unless it is a copy of one already there
+          TideIndexPeptide pepDecoy(pepMass, peptide.Length(), decoySequence,
+            curProtein, (peptide.Position() > 0) ? 1 : 0, true);
+          if (!outPeptideGroups.Add(&pepDecoy, PeptideGroups::Of(
+                pepDecoy.getResidues(), pepDecoy.getLength()))) {
+            continue;
+          }
+          outPeptideHeap.push_back(pepDecoy);
+          push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
+            greater<TideIndexPeptide>());
+        }
+        spillPeptideRun(outPeptideHeap, maxHeapPeptides, peptideRunPrefix, outPeptideRuns);
+      }
+      for (vector<string*>::iterator i = batchSequences.begin();
+           i != batchSequences.end();
+           ++i) {
+        delete *i;
       }
     }
   } else if (!allowDups) {
     for (set<string>::const_iterator i = setTargets.begin();
          i != setTargets.end();
          ++i) {
+      spillPeptideRun(outPeptideHeap, maxHeapPeptides, peptideRunPrefix, outPeptideRuns);
       const string* setTarget = &*i;
       const map<const string*, TargetInfo>::iterator targetLookup =
         targetInfo.find(setTarget);
@@ -569,7 +767,8 @@ void TideIndexApplication::fastaToPb(
       FLOAT_T pepMass = targetLookup->second.mass;
       if(generateDecoy(*setTarget, targetToDecoy, &setTargets, &setDecoys, decoyType, allowDups, failedDecoyCnt,
                     decoysGenerated, curProtein, proteinInfo, startLoc, pbProtein,
-                    pepMass, outPeptideHeap, outProteinSequences)) {
+                    pepMass, outPeptideHeap, outProteinSequences,
+                    outPeptideGroups)) {
         proteinWriter.Write(&pbProtein);
       } else {
         continue;
@@ -583,13 +782,15 @@ void TideIndexApplication::fastaToPb(
       for (vector<PeptideInfo>::const_iterator j = i->second.begin();
            j != i->second.end();
            ++j) {
+        spillPeptideRun(outPeptideHeap, maxHeapPeptides, peptideRunPrefix, outPeptideRuns);
         const string setTarget = j->Sequence();
         const ProteinInfo& proteinInfo = i->first;
         const int startLoc = j->Position();
         FLOAT_T pepMass = calcPepMassTide(j->Sequence(), massType);
         if(generateDecoy(setTarget, targetToDecoy, NULL, NULL, decoyType, allowDups, failedDecoyCnt,
                       decoysGenerated, curProtein, proteinInfo, startLoc, pbProtein,
-                      pepMass, outPeptideHeap, outProteinSequences)) {
+                      pepMass, outPeptideHeap, outProteinSequences,
+                      outPeptideGroups)) {
           proteinWriter.Write(&pbProtein);
         } else {
           continue;
@@ -598,6 +799,10 @@ void TideIndexApplication::fastaToPb(
     }
 
   }
+  if (!outPeptideRuns.empty()) {
+    // The rest of the peptides go in one last run
+    spillPeptideRun(outPeptideHeap, 1, peptideRunPrefix, outPeptideRuns);
+  }
   if (invalidPepCnt > 0) {
     carp(CARP_INFO, "Ignoring %d peptide sequences containing unrecognized characters", invalidPepCnt);
   }
@@ -632,8 +837,194 @@ void TideIndexApplication::fastaToPb(
   }
 }
 
+void TideIndexApplication::digestProteins(
+  const vector<string*>& sequences,
+  const DigestSettings& settings,
+  int numThreads,
+  vector<DigestedProtein>& out
+) {
+  out.clear();
+  out.resize(sequences.size());
+  int threads = min(numThreads, (int)sequences.size());
+  if (threads <= 1) {
+    digestProteinShare(&sequences, &settings, 0, 1, &out);
+    return;
+  }
+  // The amino acid masses behind GeneratePeptides::CleavedPeptide::Mass() are
+  // set up on first use; do that before the threads race to it.
+  get_mass_amino_acid('A', AVERAGE);
+  ThreadPool::TaskGroup threadgroup;
+  for (int t = 0; t < threads; ++t) {
+    threadgroup.Run(boost::bind(&TideIndexApplication::digestProteinShare,
+      &sequences, &settings, t, threads, &out));
+  }
+  threadgroup.Wait();
+}
+
+void TideIndexApplication::digestProteinShare(
+  const vector<string*>* sequences,
+  const DigestSettings* settings,
+  int first,
+  int stride,
+  vector<DigestedProtein>* out
+) {
+  // Proteins are dealt out in turn, so that long proteins are spread over the
+  // threads.
+  for (size_t i = first; i < sequences->size(); i += stride) {
+    DigestedProtein& digested = (*out)[i];
+    digested.peptides = GeneratePeptides::cleaveProtein(*(*sequences)[i],
+      settings->enzyme, settings->digestion, settings->missedCleavages,
+      settings->minLength, settings->maxLength);
+    digested.masses.resize(digested.peptides.size());
+    for (size_t j = 0; j < digested.peptides.size(); ++j) {
+      digested.masses[j] =
+        calcPepMassTide(digested.peptides[j].Sequence(), settings->massType);
+    }
+  }
+}
+
+class TideIndexApplication::SortedPeptides {
+ public:
+  SortedPeptides(vector<TideIndexPeptide>& peptideHeap,
+                 const vector<string>& runs,
+                 const vector<string*>& proteinSequences)
+    : peptideHeap_(peptideHeap), proteinSequences_(proteinSequences), tree_(NULL) {
+    if (runs.empty()) {
+      carp(CARP_DEBUG, "%d peptides in heap", peptideHeap_.size());
+      sort_heap(peptideHeap_.begin(), peptideHeap_.end(),
+                greater<TideIndexPeptide>());
+      return;
+    }
+    carp(CARP_INFO, "Merging %d sorted runs of peptides", runs.size());
+    vector<bool> exhausted;
+    for (vector<string>::const_iterator i = runs.begin(); i != runs.end(); ++i) {
+      Run* run = new Run(*i);
+      if (!run->reader.OK()) {
+        carp(CARP_FATAL, "Error reading peptides from %s", i->c_str());
+      }
+      runs_.push_back(run);
+      exhausted.push_back(!Advance(run));
+    }
+    tree_ = new LoserTree<Run, RunLess>(runs_, exhausted);
+  }
+
+  ~SortedPeptides() {
+    delete tree_;
+    for (vector<Run*>::iterator i = runs_.begin(); i != runs_.end(); ++i) {
+      delete *i;
+    }
+  }
+
+  bool Next(TideIndexPeptide* peptide) {
+    if (tree_ == NULL) {
+      if (peptideHeap_.empty()) {
+        return false;
+      }
+      *peptide = peptideHeap_.back();
+      peptideHeap_.pop_back();
+      return true;
+    }
+    if (tree_->Empty()) {
+      return false;
+    }
+    Run* run = tree_->Top();
+    *peptide = run->peptide;
+    tree_->Replay(!Advance(run));
+    return true;
+  }
+
+ private:
+  struct Run {
+    explicit Run(const string& file) : reader(file, 1 << 20) {}
+    RecordReader reader;
+    pb::Peptide record;
+    TideIndexPeptide peptide;
+  };
+
+  struct RunLess {
+    bool operator()(const Run* lhs, const Run* rhs) const {
+      return peptideRunLess(lhs->peptide, rhs->peptide);
+    }
+  };
+
+  bool Advance(Run* run) {
+    if (run->reader.Done()) {
+      return false;
+    } else if (!run->reader.Read(&run->record)) {
+      carp(CARP_FATAL, "Error reading sorted run of peptides");
+    }
+    const pb::Location& location = run->record.first_location();
+    run->peptide = TideIndexPeptide(run->record.mass(), run->record.length(),
+      proteinSequences_[location.protein_id()], location.protein_id(),
+      location.pos(), run->record.is_decoy());
+    run->peptide.setGroup(run->record.has_id() ? run->record.id() : -1);
+    return true;
+  }
+
+  vector<TideIndexPeptide>& peptideHeap_;
+  const vector<string*>& proteinSequences_;
+  vector<Run*> runs_;
+  LoserTree<Run, RunLess>* tree_;
+};
+
+bool TideIndexApplication::peptideRunLess(
+  const TideIndexPeptide& lhs,
+  const TideIndexPeptide& rhs
+) {
+  if (rhs > lhs) {
+    return true;
+  } else if (lhs > rhs) {
+    return false;
+  } else if (lhs.getProteinId() != rhs.getProteinId()) {
+    return lhs.getProteinId() < rhs.getProteinId();
+  }
+  return lhs.getProteinPos() < rhs.getProteinPos();
+}
+
+void TideIndexApplication::spillPeptideRun(
+  vector<TideIndexPeptide>& peptideHeap,
+  size_t maxPeptides,
+  const string& runPrefix,
+  vector<string>& runs
+) {
+  if (maxPeptides == 0 || peptideHeap.size() < maxPeptides) {
+    return;
+  }
+  string runFile = runPrefix + "." + StringUtils::ToString(runs.size()) + ".tmp";
+  carp(CARP_INFO, "Writing %d peptides to %s", peptideHeap.size(), runFile.c_str());
+  sort(peptideHeap.begin(), peptideHeap.end(), peptideRunLess);
+  {
+    RecordWriter writer(runFile, 1 << 20);
+    if (!writer.OK()) {
+      carp(CARP_FATAL, "Error creating %s", runFile.c_str());
+    }
+    pb::Peptide record;
+    for (vector<TideIndexPeptide>::const_iterator i = peptideHeap.begin();
+         i != peptideHeap.end();
+         ++i) {
+      record.Clear();
+      record.set_mass(i->getMass());
+      record.set_length(i->getLength());
+      record.mutable_first_location()->set_protein_id(i->getProteinId());
+      record.mutable_first_location()->set_pos(i->getProteinPos());
+      record.set_is_decoy(i->isDecoy());
+      if (i->getGroup() >= 0) {
+        record.set_id(i->getGroup());
+      }
+      if (!writer.Write(&record)) {
+        carp(CARP_FATAL, "I/O error writing %s", runFile.c_str());
+      }
+    }
+  }
+  runs.push_back(runFile);
+  peptideHeap.clear();
+}
+
 void TideIndexApplication::writePeptidesAndAuxLocs(
   vector<TideIndexPeptide>& peptideHeap,
+  const vector<string>& peptideRuns,
+  const PeptideGroups* peptideGroups,
+  const vector<string*>& proteinSequences,
   const string& peptidePbFile,
   const string& auxLocsPbFile,
   pb::Header& pbHeader
@@ -692,24 +1083,49 @@ void TideIndexApplication::writePeptidesAndAuxLocs(
   auxLocsSource->mutable_header()->CopyFrom(pbHeader);
   HeadedRecordWriter auxLocWriter(auxLocsPbFile, auxLocsHeader);
 
+  writeSortedPeptides(peptideHeap, peptideRuns, peptideGroups,
+                      proteinSequences, peptideWriter, auxLocWriter);
+}
+
+int TideIndexApplication::writeSortedPeptides(
+  vector<TideIndexPeptide>& peptideHeap,
+  const vector<string>& peptideRuns,
+  const PeptideGroups* peptideGroups,
+  const vector<string*>& proteinSequences,
+  HeadedRecordWriter& peptideWriter,
+  HeadedRecordWriter& auxLocWriter
+) {
   pb::Peptide pbPeptide;
   pb::AuxLocation pbAuxLoc;
   int auxLocIdx = -1;
-  carp(CARP_DEBUG, "%d peptides in heap", peptideHeap.size());
   int count = 0;
-  sort_heap(peptideHeap.begin(), peptideHeap.end(),
-            greater<TideIndexPeptide>());
-  while (!peptideHeap.empty()) {
-    TideIndexPeptide curPeptide(peptideHeap.back());
-    peptideHeap.pop_back();
-    // For duplicate peptides we only record the location
-    while (!peptideHeap.empty() && peptideHeap.back() == curPeptide) {
-      pb::Location* location = pbAuxLoc.add_location();
-      location->set_protein_id(peptideHeap.back().getProteinId());
-      location->set_pos(peptideHeap.back().getProteinPos());
-      peptideHeap.pop_back();
+  SortedPeptides sortedPeptides(peptideHeap, peptideRuns, proteinSequences);
+  TideIndexPeptide curPeptide, nextPeptide;
+  vector< pair<int, int> > locations;
+  bool morePeptides = sortedPeptides.Next(&nextPeptide);
+  while (morePeptides) {
+    curPeptide = nextPeptide;
+    // For duplicate peptides we only record the location: those of the
+    // copies grouped by fastaToPb, and those of equal peptides that reached
+    // the heap anyway (from the other runs, or from buildMemoryIndex).
+    locations.clear();
+    do {
+      locations.push_back(make_pair(nextPeptide.getProteinId(),
+                                    nextPeptide.getProteinPos()));
+      if (peptideGroups != NULL && nextPeptide.getGroup() >= 0) {
+        peptideGroups->GetLocations(nextPeptide.getGroup(), &locations);
+      }
+    } while ((morePeptides = sortedPeptides.Next(&nextPeptide)) &&
+             nextPeptide == curPeptide);
+    // The first location is the first in protein order, whatever order the
+    // copies came off the heap in.
+    sort(locations.begin(), locations.end());
+    for (size_t i = 1; i < locations.size(); ++i) {
+      addAuxLoc(locations[i].first, locations[i].second, pbAuxLoc);
     }
     getPbPeptide(count, curPeptide, pbPeptide);
+    pbPeptide.mutable_first_location()->set_protein_id(locations[0].first);
+    pbPeptide.mutable_first_location()->set_pos(locations[0].second);
     // Not all peptides have aux locations associated with them. Check to see
     // if GetGroup added any locations to aux_location. If yes, only then
     // assign the corresponding array index to the peptide and write it out.
@@ -727,6 +1143,486 @@ void TideIndexApplication::writePeptidesAndAuxLocs(
       carp(CARP_INFO, "Wrote %d peptides", count);
     }
   }
+  return count;
+}
+
+bool TideIndexApplication::isPeptideList(const string& file) {
+  ifstream in(file.c_str());
+  string line;
+  while (getline(in, line)) {
+    line = StringUtils::Trim(line);
+    if (!line.empty()) {
+      return line[0] != '>';
+    }
+  }
+  return false;
+}
+
+void TideIndexApplication::buildMemoryIndex(
+  const string& input,
+  TideMemoryIndex* index
+) {
+  double minMass = Params::GetDouble("min-mass");
+  double maxMass = Params::GetDouble("max-mass");
+  int minLength = Params::GetInt("min-length");
+  int maxLength = Params::GetInt("max-length");
+  bool monoisotopic = Params::GetString("isotopic-mass") != "average";
+  MASS_TYPE_T massType = monoisotopic ? MONO : AVERAGE;
+  int missedCleavages = Params::GetInt("missed-cleavages");
+  DIGEST_T digestion = get_digest_type_parameter("digestion");
+  ENZYME_T enzyme = get_enzyme_type_parameter("enzyme");
+  string enzymeName(enzyme_type_to_string(enzyme));
+
+  VariableModTable varModTable;
+  parseMods(&varModTable);
+  if (!MassConstants::Init(varModTable.ParsedModTable(),
+        varModTable.ParsedNtpepModTable(),
+        varModTable.ParsedCtpepModTable(), 0, 0)) {
+    carp(CARP_FATAL, "Error in MassConstants::Init");
+  }
+
+  // A peptide list has a protein of each sequence, which is its one peptide.
+  bool peptideList = isPeptideList(input);
+  vector<string*> sequences;
+  vector<string> names;
+  ifstream in(input.c_str());
+  if (peptideList) {
+    string line;
+    while (getline(in, line)) {
+      line = StringUtils::Trim(line);
+      if (!line.empty()) {
+        names.push_back(line);
+        sequences.push_back(new string(line));
+      }
+    }
+  } else {
+    string name;
+    string* sequence = new string;
+    while (GeneratePeptides::getNextProtein(in, &name, sequence)) {
+      names.push_back(name);
+      sequences.push_back(sequence);
+      sequence = new string;
+    }
+    delete sequence;
+  }
+  vector<DigestedProtein> digested;
+  if (!peptideList) {
+    int numThreads = Params::GetInt("num-threads");
+    if (numThreads < 1) {
+      numThreads = boost::thread::hardware_concurrency();
+    }
+    DigestSettings settings = {
+      enzyme, digestion, missedCleavages, minLength, maxLength, massType };
+    digestProteins(sequences, settings, numThreads, digested);
+  }
+
+  vector<TideIndexPeptide> peptideHeap;
+  unsigned int invalidPepCnt = 0;
+  pb::Protein pbProtein;
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    getPbProtein(i, names[i], *sequences[i], pbProtein);
+    index->proteins.push_back(new pb::Protein(pbProtein));
+    if (peptideList) {
+      FLOAT_T pepMass = calcPepMassTide(*sequences[i], massType);
+      if (pepMass < 0.0) {
+        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", sequences[i]->c_str());
+        ++invalidPepCnt;
+      } else if (pepMass >= minMass && pepMass <= maxMass) {
+        peptideHeap.push_back(TideIndexPeptide(
+          pepMass, sequences[i]->length(), sequences[i], i, 0, false));
+      }
+      continue;
+    }
+    for (size_t j = 0; j < digested[i].peptides.size(); ++j) {
+      const GeneratePeptides::CleavedPeptide& peptide = digested[i].peptides[j];
+      FLOAT_T pepMass = digested[i].masses[j];
+      if (pepMass < 0.0) {
+        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", peptide.Sequence().c_str());
+        ++invalidPepCnt;
+      } else if (pepMass >= minMass && pepMass <= maxMass) {
+        peptideHeap.push_back(TideIndexPeptide(
+          pepMass, peptide.Length(), sequences[i], i, peptide.Position(), false));
+      }
+    }
+  }
+  if (invalidPepCnt > 0) {
+    carp(CARP_INFO, "Ignoring %d peptide sequences containing unrecognized characters", invalidPepCnt);
+  }
+  if (peptideHeap.empty()) {
+    carp(CARP_FATAL, "No target sequences generated.  Is \'%s\' a FASTA file "
+         "or a list of peptides?", input.c_str());
+  }
+  make_heap(peptideHeap.begin(), peptideHeap.end(), greater<TideIndexPeptide>());
+
+  pb::Header header;
+  header.set_file_type(pb::Header::PEPTIDES);
+  header.set_command_line("crux tide-search " + input);
+  pb::Header_Source* source = header.add_source();
+  source->set_filename(AbsPath(input));
+  source->set_filetype(peptideList ? "peptides" : "fasta");
+  pb::Header_PeptidesHeader& pepHeader = *(header.mutable_peptides_header());
+  pepHeader.set_min_mass(minMass);
+  pepHeader.set_max_mass(maxMass);
+  pepHeader.set_min_length(minLength);
+  pepHeader.set_max_length(maxLength);
+  pepHeader.set_monoisotopic_precursor(monoisotopic);
+  pepHeader.set_enzyme(enzymeName);
+  if (enzymeName != "no-enzyme") {
+    pepHeader.set_full_digestion(digestion == FULL_DIGEST);
+    pepHeader.set_max_missed_cleavages(missedCleavages);
+  }
+  pepHeader.mutable_mods()->CopyFrom(*(varModTable.ParsedModTable()));
+  pepHeader.mutable_nterm_mods()->CopyFrom(*(varModTable.ParsedNtpepModTable()));
+  pepHeader.mutable_cterm_mods()->CopyFrom(*(varModTable.ParsedCtpepModTable()));
+  if (varModTable.Unique_delta_size() > 0) {
+    pepHeader.set_search_time_mods(true);
+    pepHeader.set_max_mods(Params::GetInt("max-mods"));
+    pepHeader.set_min_mods(Params::GetInt("min-mods"));
+  }
+  pepHeader.set_has_peaks(false);
+  pepHeader.set_decoys(NO_DECOYS);
+
+  pb::Header auxLocsHeader;
+  auxLocsHeader.set_file_type(pb::Header::AUX_LOCATIONS);
+  auxLocsHeader.add_source()->mutable_header()->CopyFrom(header);
+
+  // The writers finish the records before the streams let go of the bytes.
+  int count;
+  {
+    google::protobuf::io::StringOutputStream peptideStream(&index->peptides);
+    google::protobuf::io::StringOutputStream auxLocStream(&index->auxlocs);
+    HeadedRecordWriter peptideWriter(&peptideStream, header);
+    HeadedRecordWriter auxLocWriter(&auxLocStream, auxLocsHeader);
+    count = writeSortedPeptides(peptideHeap, vector<string>(), NULL, sequences,
+                                peptideWriter, auxLocWriter);
+  }
+  for (vector<string*>::iterator i = sequences.begin(); i != sequences.end(); ++i) {
+    delete *i;
+  }
+  carp(CARP_INFO, "Built an index of %d peptides from %d %s in memory.", count,
+       (int)index->proteins.size(), peptideList ? "sequences" : "proteins");
+}
+
+void TideIndexApplication::writePeptideLists(
+  const string& peptidesFile,
+  const ProteinVec* proteins,
+  ofstream* targetList,
+  ofstream* decoyList
+) {
+  carp(CARP_INFO, "Writing peptide lists...");
+
+  // This set holds target peptide strings
+  set<string> targetPepStrs;
+  // This vector holds decoy peptide strings and masses
+  vector< pair<string, double> > decoyPepStrs;
+  int mass_precision = Params::GetInt("mass-precision");
+  // Iterate over all protocol buffer peptides
+  unsigned int writeCountTargets = 0, writeCountDecoys = 0;
+  HeadedRecordReader reader(peptidesFile, NULL);
+  pb::Peptide protobuf;  // reused, so its buffers are too
+  while (!reader.Done()) {
+    reader.Read(&protobuf);
+    pb::Peptide* peptide = &protobuf;
+    bool writeTarget = true;
+    bool writeDecoy = false;
+
+    if (decoyList) {
+      writeDecoy = peptide->is_decoy();
+      writeTarget = !writeDecoy;
+    }
+    string pep_str = getModifiedPeptideSeq(peptide, proteins);
+
+    if (writeTarget) {
+      // This is a target, output it
+      targetPepStrs.insert(pep_str);
+      *targetList << pep_str << '\t'
+                  << StringUtils::ToString(peptide->mass(),
+                                           mass_precision) << endl;
+      ++writeCountTargets;
+    }
+    if (writeDecoy) {
+      // This is a decoy, save it to output later
+      decoyPepStrs.push_back(make_pair(pep_str, peptide->mass()));
+      ++writeCountDecoys;
+    }
+  }
+
+  // Iterate over saved decoys and output them
+  for (vector< pair<string, double> >::const_iterator i = decoyPepStrs.begin();
+       i != decoyPepStrs.end();
+       ++i) {
+    *decoyList << i->first << '\t'
+               << StringUtils::ToString(i->second, mass_precision);
+    if (targetPepStrs.find(i->first) != targetPepStrs.end()) {
+      *decoyList << "\t*";
+    }
+    *decoyList << endl;
+  }
+
+  // Close and clean up streams
+  if (decoyList) {
+    decoyList->close();
+    delete decoyList;
+  }
+  targetList->close();
+  delete targetList;
+
+  carp(CARP_DEBUG, "Wrote %d targets and %d decoys to peptide list",
+       writeCountTargets, writeCountDecoys);
+}
+
+// Read the next peptide, if there is one.
+static bool readNextPeptide(HeadedRecordReader& reader, pb::Peptide* peptide) {
+  if (reader.Done()) {
+    return false;
+  } else if (!reader.Read(peptide)) {
+    carp(CARP_FATAL, "Error reading peptides");
+  }
+  return true;
+}
+
+void TideIndexApplication::appendToIndex(
+  const string& baseIndex,
+  const string& index
+) {
+  carp(CARP_INFO, "Merging with index %s...", baseIndex.c_str());
+  string baseProteinsFile = FileUtils::Join(baseIndex, "protix");
+  string basePeptidesFile = FileUtils::Join(baseIndex, "pepix");
+  string baseAuxLocsFile = FileUtils::Join(baseIndex, "auxlocs");
+  string proteinsFile = FileUtils::Join(index, "protix");
+  string peptidesFile = FileUtils::Join(index, "pepix");
+  string auxLocsFile = FileUtils::Join(index, "auxlocs");
+  // The index just built is moved aside for the merged one
+  string newProteinsFile = proteinsFile + ".new.tmp";
+  string newPeptidesFile = peptidesFile + ".new.tmp";
+  string newAuxLocsFile = auxLocsFile + ".new.tmp";
+  FileUtils::Rename(proteinsFile, newProteinsFile);
+  FileUtils::Rename(peptidesFile, newPeptidesFile);
+  FileUtils::Rename(auxLocsFile, newAuxLocsFile);
+
+  ProteinVec baseProteins, newProteins;
+  pb::Header baseProteinsHeader;
+  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&baseProteins,
+        baseProteinsFile, &baseProteinsHeader) ||
+      !ReadRecordsToVector<pb::Protein, const pb::Protein>(&newProteins,
+        newProteinsFile)) {
+    carp(CARP_FATAL, "Error reading proteins");
+  }
+  vector<const pb::AuxLocation*> baseAuxLocs, newAuxLocs;
+  pb::Header auxLocsHeader;
+  if (!ReadRecordsToVector<pb::AuxLocation>(&baseAuxLocs, baseAuxLocsFile) ||
+      !ReadRecordsToVector<pb::AuxLocation>(&newAuxLocs, newAuxLocsFile,
+                                            &auxLocsHeader)) {
+    carp(CARP_FATAL, "Error reading auxlocs");
+  }
+
+  pb::Header basePeptidesHeader, peptidesHeader;
+  HeadedRecordReader baseReader(basePeptidesFile, &basePeptidesHeader);
+  HeadedRecordReader newReader(newPeptidesFile, &peptidesHeader);
+  // Skip tables are particular to each file; the merged file gets its own.
+  // It gets no residue mass counts, since the peptides both indexes have are
+  // only written once; exact-p-value searches count them from the peptides.
+  basePeptidesHeader.mutable_peptides_header()->clear_skip_table();
+  peptidesHeader.mutable_peptides_header()->clear_skip_table();
+  basePeptidesHeader.mutable_peptides_header()->clear_residue_mass_counts();
+  peptidesHeader.mutable_peptides_header()->clear_residue_mass_counts();
+  if (!baseReader.OK() || !newReader.OK()) {
+    carp(CARP_FATAL, "Error reading peptides");
+  } else if (basePeptidesHeader.peptides_header().SerializeAsString() !=
+             peptidesHeader.peptides_header().SerializeAsString()) {
+    carp(CARP_FATAL, "Index %s was built with different settings (digestion, "
+         "mass and length limits, modifications, decoys or stored peaks)",
+         baseIndex.c_str());
+  }
+
+  // Proteins of the base index first, then the new ones numbered after them
+  int proteinOffset = baseProteins.size();
+  {
+    HeadedRecordWriter proteinWriter(proteinsFile, baseProteinsHeader);
+    for (ProteinVec::const_iterator i = baseProteins.begin(); i != baseProteins.end(); ++i) {
+      proteinWriter.Write(*i);
+    }
+    pb::Protein protein;
+    for (ProteinVec::const_iterator i = newProteins.begin(); i != newProteins.end(); ++i) {
+      protein.CopyFrom(**i);
+      protein.set_id(protein.id() + proteinOffset);
+      proteinWriter.Write(&protein);
+    }
+  }
+
+  // Both peptide files are sorted by mass. Peptides of equal mass are taken a
+  // group at a time from each file, and a new peptide with the same modified
+  // sequence as one of the base index only adds its locations to that one.
+  HeadedRecordWriter peptideWriter(peptidesFile, peptidesHeader);
+  HeadedRecordWriter auxLocWriter(auxLocsFile, auxLocsHeader);
+  pb::Peptide basePeptide, newPeptide;
+  bool moreBase = readNextPeptide(baseReader, &basePeptide);
+  bool moreNew = readNextPeptide(newReader, &newPeptide);
+  vector<pb::Peptide> baseGroup, newGroup;
+  vector<pb::AuxLocation> baseGroupLocs, newGroupLocs;
+  int64_t count = 0, duplicates = 0;
+  int auxLocIdx = -1;
+  while (moreBase || moreNew) {
+    double mass = (moreBase && (!moreNew || basePeptide.mass() <= newPeptide.mass()))
+      ? basePeptide.mass() : newPeptide.mass();
+    baseGroup.clear();
+    newGroup.clear();
+    for (; moreBase && basePeptide.mass() == mass;
+         moreBase = readNextPeptide(baseReader, &basePeptide)) {
+      baseGroup.push_back(basePeptide);
+    }
+    for (; moreNew && newPeptide.mass() == mass;
+         moreNew = readNextPeptide(newReader, &newPeptide)) {
+      newGroup.push_back(newPeptide);
+    }
+
+    baseGroupLocs.assign(baseGroup.size(), pb::AuxLocation());
+    for (size_t i = 0; i < baseGroup.size(); ++i) {
+      if (baseGroup[i].has_aux_locations_index()) {
+        baseGroupLocs[i].CopyFrom(*baseAuxLocs[baseGroup[i].aux_locations_index()]);
+      }
+    }
+    vector<string> baseSeqs;
+    if (!newGroup.empty()) {
+      for (size_t i = 0; i < baseGroup.size(); ++i) {
+        baseSeqs.push_back(getModifiedPeptideSeq(&baseGroup[i], &baseProteins));
+      }
+    }
+    vector<bool> duplicate(newGroup.size(), false);
+    newGroupLocs.assign(newGroup.size(), pb::AuxLocation());
+    for (size_t j = 0; j < newGroup.size(); ++j) {
+      pb::Peptide& peptide = newGroup[j];
+      string seq = getModifiedPeptideSeq(&peptide, &newProteins);
+      pb::Location* first = peptide.mutable_first_location();
+      first->set_protein_id(first->protein_id() + proteinOffset);
+      pb::AuxLocation& locs = newGroupLocs[j];
+      if (peptide.has_aux_locations_index()) {
+        locs.CopyFrom(*newAuxLocs[peptide.aux_locations_index()]);
+        for (int k = 0; k < locs.location_size(); ++k) {
+          pb::Location* location = locs.mutable_location(k);
+          location->set_protein_id(location->protein_id() + proteinOffset);
+        }
+      }
+      for (size_t i = 0; i < baseGroup.size(); ++i) {
+        if (baseGroup[i].is_decoy() == peptide.is_decoy() && baseSeqs[i] == seq) {
+          baseGroupLocs[i].add_location()->CopyFrom(*first);
+          baseGroupLocs[i].MergeFrom(locs);
+          duplicate[j] = true;
+          ++duplicates;
+          break;
+        }
+      }
+    }
+
+    for (size_t n = 0; n < baseGroup.size() + newGroup.size(); ++n) {
+      bool fromBase = n < baseGroup.size();
+      size_t k = fromBase ? n : n - baseGroup.size();
+      if (!fromBase && duplicate[k]) {
+        continue;
+      }
+      pb::Peptide& peptide = fromBase ? baseGroup[k] : newGroup[k];
+      const pb::AuxLocation& locs = fromBase ? baseGroupLocs[k] : newGroupLocs[k];
+      peptide.set_id(count++);
+      peptide.clear_aux_locations_index();
+      if (locs.location_size() > 0) {
+        peptide.set_aux_locations_index(++auxLocIdx);
+        auxLocWriter.Write(&locs);
+      }
+      peptideWriter.Write(&peptide);
+    }
+  }
+  carp(CARP_INFO, "Added %d proteins; the index has %d peptides, %d of the new "
+       "peptides were already in it", (int)newProteins.size(), (int)count,
+       (int)duplicates);
+
+  for (ProteinVec::iterator i = baseProteins.begin(); i != baseProteins.end(); ++i) {
+    delete *i;
+  }
+  for (ProteinVec::iterator i = newProteins.begin(); i != newProteins.end(); ++i) {
+    delete *i;
+  }
+  for (vector<const pb::AuxLocation*>::iterator i = baseAuxLocs.begin();
+       i != baseAuxLocs.end();
+       ++i) {
+    delete *i;
+  }
+  for (vector<const pb::AuxLocation*>::iterator i = newAuxLocs.begin();
+       i != newAuxLocs.end();
+       ++i) {
+    delete *i;
+  }
+  FileUtils::Remove(newProteinsFile);
+  FileUtils::Remove(newPeptidesFile);
+  FileUtils::Remove(newAuxLocsFile);
+}
+
+void TideIndexApplication::addSkipTable(
+  const string& peptidesFile,
+  int interval
+) {
+  // The first pass finds the offsets, which are the same in the rewritten
+  // file since they are counted from the end of the header.
+  pb::Header header;
+  pb::Header::PeptidesHeader::SkipTable* skip;
+  {
+    HeadedRecordReader reader(peptidesFile, &header);
+    if (!reader.OK()) {
+      carp(CARP_FATAL, "Error reading %s", peptidesFile.c_str());
+    }
+    skip = header.mutable_peptides_header()->mutable_skip_table();
+    skip->Clear();
+    pb::Peptide peptide;
+    google::protobuf::int64 offset = 0;
+    for (long count = 0; readNextPeptide(reader, &peptide); ++count) {
+      if (count % interval == 0) {
+        skip->add_mass(peptide.mass());
+        skip->add_offset(offset);
+      }
+      int size = peptide.ByteSize();
+      offset += google::protobuf::io::CodedOutputStream::VarintSize32(size) + size;
+    }
+  }
+  carp(CARP_DEBUG, "Writing a skip table of %d peptides", skip->mass_size());
+
+  string skipFile = peptidesFile + ".skip.tmp";
+  {
+    pb::Header oldHeader;
+    HeadedRecordReader reader(peptidesFile, &oldHeader);
+    HeadedRecordWriter writer(skipFile, header);
+    pb::Peptide peptide;
+    while (readNextPeptide(reader, &peptide)) {
+      writer.Write(&peptide);
+    }
+  }
+  FileUtils::Rename(skipFile, peptidesFile);
+}
+
+void TideIndexApplication::compressPeptides(
+  const string& peptidesFile,
+  int blockSize
+) {
+  carp(CARP_INFO, "Compressing %s...", peptidesFile.c_str());
+  string blockedFile = peptidesFile + ".blocked.tmp";
+  {
+    pb::Header header;
+    HeadedRecordReader reader(peptidesFile, &header);
+    BlockedRecordWriter writer(blockedFile, blockSize);
+    if (!reader.OK() || !writer.OK()) {
+      carp(CARP_FATAL, "Error compressing %s", peptidesFile.c_str());
+    }
+    // The block index takes the place of a skip table
+    header.mutable_peptides_header()->clear_skip_table();
+    writer.Write(&header);
+    pb::Peptide peptide;
+    while (readNextPeptide(reader, &peptide)) {
+      writer.Write(&peptide, peptide.mass());
+    }
+    writer.Close();
+    if (!writer.OK()) {
+      carp(CARP_FATAL, "Error writing %s", blockedFile.c_str());
+    }
+  }
+  FileUtils::Rename(blockedFile, peptidesFile);
 }
 
 FLOAT_T TideIndexApplication::calcPepMassTide(
@@ -904,7 +1800,8 @@ bool TideIndexApplication::generateDecoy(
   pb::Protein& pbProtein,
   FLOAT_T pepMass,
   vector<TideIndexPeptide>& outPeptideHeap,
-  vector<string*>& outProteinSequences
+  vector<string*>& outProteinSequences,
+  PeptideGroups& peptideGroups
 ) {
   const map<const string, const string*>::const_iterator decoyCheck =
         targetToDecoy.find(setTarget);
@@ -939,13 +1836,16 @@ bool TideIndexApplication::generateDecoy(
   // Write pb::Protein
   getDecoyPbProtein(++curProtein, proteinInfo, *decoySequence,
                     startLoc, pbProtein);
-  // Add decoy to heap
+  ++decoysGenerated;
+  // Add decoy to heap, unless it is a copy of one already there
   TideIndexPeptide pepDecoy(
               pepMass, setTarget.length(), decoySequence, curProtein, (startLoc > 0) ? 1 : 0, true);
-  outPeptideHeap.push_back(pepDecoy);
-  push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
-    greater<TideIndexPeptide>());
-  ++decoysGenerated;
+  if (peptideGroups.Add(&pepDecoy, PeptideGroups::Of(
+        pepDecoy.getResidues(), pepDecoy.getLength()))) {
+    outPeptideHeap.push_back(pepDecoy);
+    push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
+      greater<TideIndexPeptide>());
+  }
   return true;
 }
 
@@ -15,11 +15,14 @@
 #include "tide/peptide.h"
 #include "tide/theoretical_peak_set.h"
 #include "tide/abspath.h"
+#include "GeneratePeptides.h"
 #include "TideSearchApplication.h"
 #include "util/crux-utils.h"
 
 using namespace std;
 
+class VariableModTable;
+
 std::string getModifiedPeptideSeq(const pb::Peptide* peptide, const ProteinVec* proteins);
 
 class TideIndexApplication : public CruxApplication {
@@ -77,6 +80,15 @@ class TideIndexApplication : public CruxApplication {
 
   virtual COMMAND_T getCommand() const;
 
+  /**
+   * The mass of an unmodified peptide, from the MassConstants tables with
+   * their static modifications, or -1 if it has a residue with no mass.
+   */
+  static FLOAT_T calcPepMassTide(
+    const std::string& sequence,
+    MASS_TYPE_T massType
+  );
+
  protected:
 
   class TideIndexPeptide {
@@ -87,8 +99,9 @@ class TideIndexApplication : public CruxApplication {
     int proteinPos_;
     const char* residues_;  // points at protein sequence
     bool decoy_;
+    int group_;  // in the PeptideGroups of fastaToPb, or -1
    public:
-    TideIndexPeptide() {}
+    TideIndexPeptide() : group_(-1) {}
     TideIndexPeptide(double mass, int length, string* proteinSeq,
                      int proteinId, int proteinPos, bool decoy) {
       mass_ = mass;
@@ -97,6 +110,7 @@ class TideIndexApplication : public CruxApplication {
       proteinPos_ = proteinPos;
       residues_ = proteinSeq->data() + proteinPos;
       decoy_ = decoy;
+      group_ = -1;
     }
     TideIndexPeptide(const TideIndexPeptide& other) {
       mass_ = other.mass_;
@@ -105,13 +119,17 @@ class TideIndexApplication : public CruxApplication {
       proteinPos_ = other.proteinPos_;
       residues_ = other.residues_;
       decoy_ = other.decoy_;
+      group_ = other.group_;
     }
     double getMass() const { return mass_; }
     int getLength() const { return length_; }
     int getProteinId() const { return proteinId_; }
     int getProteinPos() const { return proteinPos_; }
+    const char* getResidues() const { return residues_; }
     string getSequence() const { return string(residues_, length_); }
     bool isDecoy() const { return decoy_; }
+    int getGroup() const { return group_; }
+    void setGroup(int group) { group_ = group; }
 
     friend bool operator >(
       const TideIndexPeptide& lhs, const TideIndexPeptide& rhs) {
@@ -136,6 +154,15 @@ class TideIndexApplication : public CruxApplication {
     }
   };
 
+  // Reads the peptides collected by fastaToPb in sorted order, from the heap
+  // or by merging the runs written by spillPeptideRun().
+  class SortedPeptides;
+
+  // The distinct peptides seen by fastaToPb, found by a hash of their
+  // residues, each with the locations of its other copies. Only the first
+  // copy of a peptide goes on the heap.
+  class PeptideGroups;
+
   struct ProteinInfo {
     string name;
     const string* sequence;
@@ -151,6 +178,47 @@ class TideIndexApplication : public CruxApplication {
       : proteinInfo(protein), start(startLoc), mass(pepMass) {}
   };
 
+  // How fastaToPb cleaves proteins.
+  struct DigestSettings {
+    ENZYME_T enzyme;
+    DIGEST_T digestion;
+    int missedCleavages;
+    int minLength;
+    int maxLength;
+    MASS_TYPE_T massType;
+  };
+
+  // The peptides cleaved from one protein, and their masses (negative for a
+  // sequence with an unrecognized character).
+  struct DigestedProtein {
+    std::vector<GeneratePeptides::CleavedPeptide> peptides;
+    std::vector<FLOAT_T> masses;
+  };
+
+  /**
+   * Cleaves sequences into out, which is resized to match, on up to
+   * numThreads threads. Each protein is cleaved independently of the others,
+   * so the result does not depend on the number of threads.
+   */
+  static void digestProteins(
+    const std::vector<string*>& sequences,
+    const DigestSettings& settings,
+    int numThreads,
+    std::vector<DigestedProtein>& out
+  );
+
+  /**
+   * Cleaves sequences[first], sequences[first + stride], ...; the share of
+   * digestProteins done by one thread.
+   */
+  static void digestProteinShare(
+    const std::vector<string*>* sequences,
+    const DigestSettings* settings,
+    int first,
+    int stride,
+    std::vector<DigestedProtein>* out
+  );
+
   static void fastaToPb(
     const std::string& commandLine,
     const ENZYME_T enzyme,
@@ -168,19 +236,123 @@ class TideIndexApplication : public CruxApplication {
     pb::Header& outProteinPbHeader,
     std::vector<TideIndexPeptide>& outPeptideHeap,
     std::vector<string*>& outProteinSequences,
-    std::ofstream* decoyFasta
+    std::ofstream* decoyFasta,
+    const std::string& peptideRunPrefix,
+    std::vector<std::string>& outPeptideRuns,
+    PeptideGroups& outPeptideGroups
+  );
+
+  /**
+   * Orders peptides as operator >, in the other direction, with ties broken
+   * by protein and position, so that sorted runs merge deterministically.
+   */
+  static bool peptideRunLess(
+    const TideIndexPeptide& lhs,
+    const TideIndexPeptide& rhs
+  );
+
+  /**
+   * If peptideHeap holds at least maxPeptides peptides (and maxPeptides is
+   * not 0), writes them sorted to a new file runPrefix.<n>.tmp, adds its name
+   * to runs, and empties peptideHeap.
+   */
+  static void spillPeptideRun(
+    std::vector<TideIndexPeptide>& peptideHeap,
+    size_t maxPeptides,
+    const std::string& runPrefix,
+    std::vector<std::string>& runs
   );
 
+  /**
+   * Writes the peptides of peptideHeap, or, if any runs were spilled, those
+   * of the runs and peptideHeap merged, in mass order. The locations of a
+   * peptide, including those of its group in peptideGroups (if any), are
+   * written in protein order.
+   */
   static void writePeptidesAndAuxLocs(
     std::vector<TideIndexPeptide>& peptideHeap, // will be destroyed.
+    const std::vector<std::string>& peptideRuns,
+    const PeptideGroups* peptideGroups,
+    const std::vector<string*>& proteinSequences,
     const std::string& peptidePbFile,
     const std::string& auxLocsPbFile,
     pb::Header& pbHeader
   );
 
-  static FLOAT_T calcPepMassTide(
-    const std::string& sequence,
-    MASS_TYPE_T massType
+  /**
+   * Writes the peptides as writePeptidesAndAuxLocs, to peptideWriter and
+   * auxLocWriter, and returns how many there are.
+   */
+  static int writeSortedPeptides(
+    std::vector<TideIndexPeptide>& peptideHeap, // will be destroyed.
+    const std::vector<std::string>& peptideRuns,
+    const PeptideGroups* peptideGroups,
+    const std::vector<string*>& proteinSequences,
+    HeadedRecordWriter& peptideWriter,
+    HeadedRecordWriter& auxLocWriter
+  );
+
+  /**
+   * Whether file is a list of peptide sequences, one per line, rather than
+   * a FASTA file: its first line that is not blank does not start with '>'.
+   */
+  static bool isPeptideList(const std::string& file);
+
+  /**
+   * Builds the index of the FASTA file or peptide list input in memory, for
+   * tide-search, with the digestion, mass and length parameters of
+   * tide-index. The variable modifications are left for the search to apply
+   * (see search-time-mods), and there are no decoys.
+   */
+  static void buildMemoryIndex(
+    const std::string& input,
+    TideMemoryIndex* index
+  );
+
+  /**
+   * Parses the amino acid and terminal modifications of the parameters into
+   * varModTable.
+   */
+  static void parseMods(VariableModTable* varModTable);
+
+  /**
+   * Writes each peptide of peptidesFile to targetList or, if it is a decoy
+   * and there is a decoyList, to decoyList, and closes and deletes both.
+   */
+  static void writePeptideLists(
+    const std::string& peptidesFile,
+    const ProteinVec* proteins,
+    std::ofstream* targetList,
+    std::ofstream* decoyList
+  );
+
+  /**
+   * Merges the index in the directory index, built from new proteins, into
+   * the existing index baseIndex, replacing the files in index with the
+   * result. The new proteins are numbered after those of baseIndex, and a new
+   * peptide that is already in baseIndex becomes another location of it.
+   */
+  static void appendToIndex(
+    const std::string& baseIndex,
+    const std::string& index
+  );
+
+  /**
+   * Rewrites the peptide file peptidesFile with a skip table in its header
+   * that gives the mass and offset of every interval-th peptide.
+   */
+  static void addSkipTable(
+    const std::string& peptidesFile,
+    int interval
+  );
+
+  /**
+   * Rewrites the peptide file peptidesFile compressed in blocks of about
+   * blockSize bytes, keyed by mass (see record_blocks.h).
+   */
+  static void compressPeptides(
+    const std::string& peptidesFile,
+    int blockSize
   );
 
   static void getPbProtein(
@@ -212,7 +384,8 @@ class TideIndexApplication : public CruxApplication {
 
   /**
    * Generates decoy for the target peptide, writes the decoy protein to pbProtein
-   * and adds decoy to the heap.
+   * and adds decoy to the heap, or to its group in peptideGroups if it is a
+   * copy of a peptide already there.
    */
   static bool generateDecoy(
     const string& setTarget,
@@ -229,7 +402,8 @@ class TideIndexApplication : public CruxApplication {
     pb::Protein& pbProtein,
     FLOAT_T pepMass,
     vector<TideIndexPeptide>& outPeptideHeap,
-    vector<string*>& outProteinSequences
+    vector<string*>& outProteinSequences,
+    PeptideGroups& peptideGroups
   );
 
   virtual void processParams();
@@ -0,0 +1,356 @@
+/**
+ * \file TideLibrarySearchApplication.cpp
+ * \brief Matches spectra against a spectral library, then searches the rest
+ * with tide-search
+ ************************************************************/
+#include <algorithm>
+#include <fstream>
+#include "TideLibrarySearchApplication.h"
+#include "TideSearchApplication.h"
+#include "app/tide/mass_constants.h"
+#include "app/tide/max_mz.h"
+#include "app/tide/spectral_library.h"
+#include "app/tide/spectrum_collection.h"
+#include "app/tide/spectrum_preprocess.h"
+#include "io/carp.h"
+#include "io/DelimitedFileReader.h"
+#include "util/crux-utils.h"
+#include "util/FileUtils.h"
+#include "util/Params.h"
+#include "util/StringUtils.h"
+
+using namespace std;
+
+namespace {
+
+// The preprocessed peaks of a spectrum-charge pair as a unit vector, as the
+// spectra of the library are kept.
+void LibraryPeaks(ObservedPeakSet* observed, const SpectrumCollection::SpecCharge& sc,
+                  SparseSpectrum::Peaks* peaks) {
+  observed->PreprocessSpectrum(*sc.spectrum, sc.charge);
+  observed->MainPeaks(peaks);
+  SparseSpectrum::Normalize(peaks);
+}
+
+struct LibraryPsm {
+  double q_value;
+  string file;
+  unsigned int scan_charge;
+  string sequence;
+
+  bool operator<(const LibraryPsm& other) const { return q_value < other.q_value; }
+};
+
+}  // namespace
+
+/**
+ * \returns a blank TideLibrarySearchApplication object
+ */
+TideLibrarySearchApplication::TideLibrarySearchApplication() {
+}
+
+/**
+ * Destructor
+ */
+TideLibrarySearchApplication::~TideLibrarySearchApplication() {
+}
+
+/**
+ * main method for TideLibrarySearchApplication
+ */
+int TideLibrarySearchApplication::main(int argc, char** argv) {
+  carp(CARP_INFO, "Running tide-library-search...");
+
+  // The spectra are read and sorted once, matched against the library, and
+  // those that do not match are searched against the database from the same
+  // store, as by cascade-search.
+  vector<string> spectra_files = Params::GetStrings("tide spectra file");
+  map<string, SpectrumCollection*> spectrum_store;
+  map<pair<string, unsigned int>, bool> spectrum_flag;
+  TideSearchApplication search;
+  search.setSpectrumStore(&spectrum_store);
+  int threads = Params::GetInt("num-threads");
+  if (threads < 1) {
+    threads = boost::thread::hardware_concurrency();
+  }
+  vector<TideSearchApplication::InputFile> input_files = search.getInputFiles(spectra_files);
+  double highest_mz = 0;
+  for (vector<TideSearchApplication::InputFile>::const_iterator f = input_files.begin();
+       f != input_files.end(); ++f) {
+    carp(CARP_INFO, "Reading spectrum file %s.", f->SpectrumRecords.c_str());
+    SpectrumCollection* spectra = TideSearchApplication::loadSpectra(f->SpectrumRecords,
+                                                                     threads);
+    carp(CARP_INFO, "Read %d spectra.", spectra->Size());
+    spectrum_store[f->OriginalName] = spectra;
+    highest_mz = max(highest_mz, spectra->FindHighestMZ());
+    if (!f->Keep) {
+      FileUtils::Remove(f->SpectrumRecords);
+    }
+  }
+
+  // Preprocessing needs only the bins; tide-search sets the masses of the
+  // index again.
+  pb::ModTable no_mods;
+  MassConstants::Init(&no_mods, &no_mods, &no_mods, Params::GetDouble("mz-bin-width"),
+                      Params::GetDouble("mz-bin-offset"));
+  MaxBin::SetGlobalMax(highest_mz);
+
+  SpectralLibrary library(Params::GetString("spectral-library"));
+  int num_matched = matchLibrary(library, spectrum_store, &spectrum_flag);
+  carp(CARP_INFO, "Matched %d spectrum-charge combinations to the spectral library; "
+       "searching the rest against the database.", num_matched);
+
+  search.setSpectrumFlag(&spectrum_flag);
+  int return_code = search.main(spectra_files, Params::GetString("tide database"));
+
+  string psms_file = Params::GetString("library-psms");
+  if (return_code == 0 && !psms_file.empty()) {
+    // The search initialized the masses of the index, with the same bins.
+    MaxBin::SetGlobalMax(highest_mz);
+    addPsms(psms_file, spectrum_store, &library);
+    if (!library.Write()) {
+      carp(CARP_ERROR, "Could not write the spectral library %s.",
+           Params::GetString("spectral-library").c_str());
+      return_code = 1;
+    }
+  }
+
+  for (map<string, SpectrumCollection*>::iterator i = spectrum_store.begin();
+       i != spectrum_store.end();
+       ++i) {
+    delete i->second;
+  }
+  return return_code;
+}
+
+int TideLibrarySearchApplication::matchLibrary(
+  const SpectralLibrary& library,
+  const map<string, SpectrumCollection*>& spectrum_store,
+  map<pair<string, unsigned int>, bool>* spectrum_flag
+) {
+  string matches_file = make_file_path("tide-library-search.library.txt");
+  ofstream out(matches_file.c_str());
+  if (!out.good()) {
+    carp(CARP_FATAL, "Cannot write %s", matches_file.c_str());
+  }
+  out << "file\tscan\tcharge\tspectrum precursor m/z\tspectrum neutral mass\t"
+         "library neutral mass\tcosine\tsequence" << endl;
+  out.precision(Params::GetInt("precision"));
+  out << fixed;
+
+  double tolerance = Params::GetDouble("library-precursor-tolerance");
+  double min_cosine = Params::GetDouble("library-min-cosine");
+  ObservedPeakSet observed(MassConstants::bin_width_, MassConstants::bin_offset_,
+                           Params::GetBool("use-neutral-loss-peaks"),
+                           Params::GetBool("use-flanking-peaks"));
+  SparseSpectrum::Peaks peaks;
+  SpectralLibrary::Match match;
+  int num_matched = 0;
+  for (map<string, SpectrumCollection*>::const_iterator i = spectrum_store.begin();
+       i != spectrum_store.end() && library.Mapped(); ++i) {
+    const vector<SpectrumCollection::SpecCharge>* spec_charges = i->second->SpecCharges();
+    for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges->begin();
+         sc != spec_charges->end(); ++sc) {
+      LibraryPeaks(&observed, *sc, &peaks);
+      if (!library.Find(peaks, sc->neutral_mass, sc->charge, tolerance, min_cosine,
+                        &match)) {
+        continue;
+      }
+      int scan = sc->spectrum->SpectrumNumber();
+      out << i->first << '\t' << scan << '\t' << sc->charge << '\t'
+          << sc->PrecursorMZ() << '\t' << sc->neutral_mass << '\t'
+          << match.neutral_mass << '\t' << match.cosine << '\t'
+          << match.sequence << '\n';
+      (*spectrum_flag)[pair<string, unsigned int>(i->first, scan * 10 + sc->charge)] = true;
+      ++num_matched;
+    }
+  }
+  return num_matched;
+}
+
+void TideLibrarySearchApplication::addPsms(
+  const string& psms_file,
+  const map<string, SpectrumCollection*>& spectrum_store,
+  SpectralLibrary* library
+) {
+  DelimitedFileReader reader(psms_file);
+  int file_col = reader.findColumn("file");
+  int scan_col = reader.findColumn("scan");
+  int charge_col = reader.findColumn("charge");
+  int sequence_col = reader.findColumn("sequence");
+  int q_value_col = -1;
+  const vector<string>& columns = reader.getColumnNames();
+  for (size_t i = 0; i < columns.size() && q_value_col < 0; ++i) {
+    if (StringUtils::EndsWith(columns[i], "q-value")) {
+      q_value_col = i;
+    }
+  }
+  if (scan_col < 0 || charge_col < 0 || sequence_col < 0 || q_value_col < 0) {
+    carp(CARP_FATAL, "%s needs scan, charge, sequence and q-value columns.",
+         psms_file.c_str());
+  }
+  if (file_col < 0 && spectrum_store.size() > 1) {
+    carp(CARP_FATAL, "%s needs a file column for several spectrum files.",
+         psms_file.c_str());
+  }
+
+  // The best PSM of each peptide and charge goes into the library.
+  double threshold = Params::GetDouble("q-value-threshold");
+  vector<LibraryPsm> psms;
+  for (; reader.hasNext(); reader.next()) {
+    LibraryPsm psm;
+    psm.q_value = reader.getDouble(q_value_col);
+    if (psm.q_value > threshold) {
+      continue;
+    }
+    psm.file = file_col >= 0 ? reader.getString(file_col) : spectrum_store.begin()->first;
+    psm.scan_charge = reader.getInteger(scan_col) * 10 + reader.getInteger(charge_col);
+    psm.sequence = reader.getString(sequence_col);
+    psms.push_back(psm);
+  }
+  stable_sort(psms.begin(), psms.end());
+
+  map<pair<string, unsigned int>, const SpectrumCollection::SpecCharge*> spec_charges;
+  for (map<string, SpectrumCollection*>::const_iterator i = spectrum_store.begin();
+       i != spectrum_store.end(); ++i) {
+    const vector<SpectrumCollection::SpecCharge>* file_charges = i->second->SpecCharges();
+    for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = file_charges->begin();
+         sc != file_charges->end(); ++sc) {
+      spec_charges[pair<string, unsigned int>(
+        i->first, sc->spectrum->SpectrumNumber() * 10 + sc->charge)] = &*sc;
+    }
+  }
+  ObservedPeakSet observed(MassConstants::bin_width_, MassConstants::bin_offset_,
+                           Params::GetBool("use-neutral-loss-peaks"),
+                           Params::GetBool("use-flanking-peaks"));
+  SparseSpectrum::Peaks peaks;
+  int num_added = 0, num_missing = 0;
+  for (vector<LibraryPsm>::const_iterator i = psms.begin(); i != psms.end(); ++i) {
+    map<pair<string, unsigned int>, const SpectrumCollection::SpecCharge*>::const_iterator
+      found = spec_charges.find(make_pair(i->file, i->scan_charge));
+    if (found == spec_charges.end()) {
+      ++num_missing;
+      continue;
+    }
+    const SpectrumCollection::SpecCharge& sc = *found->second;
+    LibraryPeaks(&observed, sc, &peaks);
+    library->Add(peaks, sc.neutral_mass, sc.charge, i->sequence);
+    ++num_added;
+  }
+  carp(CARP_INFO, "Adding the spectra of %d PSMs of %s with q-values at or below %g "
+       "to the spectral library.", num_added, psms_file.c_str(), threshold);
+  if (num_missing > 0) {
+    carp(CARP_WARNING, "%d PSMs of %s are not of the spectra searched; not adding "
+         "them.", num_missing, psms_file.c_str());
+  }
+}
+
+/**
+ * \returns the command name for TideLibrarySearchApplication
+ */
+string TideLibrarySearchApplication::getName() const {
+  return "tide-library-search";
+}
+
+/**
+ * \returns the description for TideLibrarySearchApplication
+ */
+string TideLibrarySearchApplication::getDescription() const {
+  return
+    "[[nohtml:Match spectra against a spectral library of confidently "
+    "identified spectra, then search those that do not match against a "
+    "database with tide-search.]]"
+    "[[html:<p>Tide-library-search first matches each spectrum-charge "
+    "combination against a spectral library: the preprocessed peaks of "
+    "spectra that earlier searches identified with confidence, binned as for "
+    "tide-search and kept as unit vectors. A combination matches the library "
+    "spectrum of the same charge, within library-precursor-tolerance, with the "
+    "highest cosine at or above library-min-cosine; the library is indexed by "
+    "precursor mass, and a 64-bit signature of each spectrum rules out most "
+    "dissimilar ones before the cosine is computed. The combinations that do "
+    "not match are searched against the database by tide-search, which takes "
+    "all of its options.</p><p>Given library-psms, the PSMs of the spectra "
+    "searched, such as the output of assign-confidence for an earlier run, the "
+    "spectra of those with q-values at or below q-value-threshold are added to "
+    "the library, one for each peptide and charge.</p>]]";
+}
+
+/**
+ * \returns the command arguments
+ */
+vector<string> TideLibrarySearchApplication::getArgs() const {
+  string arr[] = {
+    "tide spectra file+",
+    "tide database"
+  };
+  return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
+}
+
+/**
+ * \returns the command options
+ */
+vector<string> TideLibrarySearchApplication::getOptions() const {
+  string arr[] = {
+    "library-min-cosine",
+    "library-precursor-tolerance",
+    "library-psms",
+    "q-value-threshold",
+    "spectral-library"
+  };
+  vector<string> options(arr, arr + sizeof(arr) / sizeof(string));
+  addOptionsFrom<TideSearchApplication>(&options);
+  return options;
+}
+
+/**
+ * \returns the command outputs
+ */
+vector< pair<string, string> > TideLibrarySearchApplication::getOutputs() const {
+  vector< pair<string, string> > outputs;
+  outputs.push_back(make_pair("tide-library-search.library.txt",
+    "a tab-delimited text file of the spectrum-charge combinations that "
+    "matched the spectral library, with the cosine and the peptide of the "
+    "library spectrum of each."));
+  outputs.push_back(make_pair("tide-search.target.txt",
+    "a tab-delimited text file containing the target PSMs of the combinations "
+    "that did not match. See <a href=\"../file-formats/txt-format.html\">"
+    "txt file format</a> for a list of the fields."));
+  outputs.push_back(make_pair("tide-search.decoy.txt",
+    "a tab-delimited text file containing their decoy PSMs, if the index has "
+    "decoys."));
+  outputs.push_back(make_pair("tide-library-search.params.txt",
+    "a file containing the name and value of all parameters/options for the "
+    "current operation. Not all parameters in the file may have been used in "
+    "the operation. The resulting file can be used with the --parameter-file "
+    "option for other Crux programs."));
+  outputs.push_back(make_pair("tide-library-search.log.txt",
+    "a log file containing a copy of all messages that were printed to the "
+    "screen during execution."));
+  return outputs;
+}
+
+COMMAND_T TideLibrarySearchApplication::getCommand() const {
+  return MISC_COMMAND;
+}
+
+/**
+ * \returns whether the application needs the output directory or not.
+ */
+bool TideLibrarySearchApplication::needsOutputDirectory() const {
+  return true;
+}
+
+void TideLibrarySearchApplication::processParams() {
+  if (Params::GetString("spectral-library").empty()) {
+    carp(CARP_FATAL, "tide-library-search needs a spectral-library.");
+  }
+  TideSearchApplication search;
+  search.processParams();
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
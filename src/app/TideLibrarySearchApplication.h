@@ -0,0 +1,105 @@
+/**
+ * \file TideLibrarySearchApplication.h
+ * \brief Matches spectra against a spectral library, then searches the rest
+ * with tide-search
+ ***********************************************************/
+#ifndef TIDELIBRARYSEARCHAPPLICATION_H
+#define TIDELIBRARYSEARCHAPPLICATION_H
+
+#include "CruxApplication.h"
+
+#include <map>
+#include <string>
+
+class SpectrumCollection;
+class SpectralLibrary;
+
+class TideLibrarySearchApplication: public CruxApplication {
+
+ public:
+
+  /**
+   * \returns a blank TideLibrarySearchApplication object
+   */
+  TideLibrarySearchApplication();
+
+  /**
+   * Destructor
+   */
+  ~TideLibrarySearchApplication();
+
+  /**
+   * main method for TideLibrarySearchApplication
+   */
+  virtual int main(int argc, char** argv);
+
+  /**
+   * \returns the command name for TideLibrarySearchApplication
+   */
+  virtual std::string getName() const;
+
+  /**
+   * \returns the description for TideLibrarySearchApplication
+   */
+  virtual std::string getDescription() const;
+
+  /**
+   * \returns the command arguments
+   */
+  virtual std::vector<std::string> getArgs() const;
+
+  /**
+   * \returns the command options
+   */
+  virtual std::vector<std::string> getOptions() const;
+
+  /**
+   * \returns the command outputs
+   */
+  virtual std::vector< std::pair<std::string, std::string> > getOutputs() const;
+
+  /**
+   * \returns the enum of the application, default MISC_COMMAND
+   */
+  virtual COMMAND_T getCommand() const;
+
+  /**
+   * \returns whether the application needs the output directory or not.
+   */
+  virtual bool needsOutputDirectory() const;
+
+  virtual void processParams();
+
+ private:
+
+  /**
+   * Writes the spectrum-charge pairs of spectrum_store that match a spectrum
+   * of library to a file, and flags them so that tide-search skips them.
+   * \returns the number of pairs matched.
+   */
+  int matchLibrary(
+    const SpectralLibrary& library,
+    const std::map<std::string, SpectrumCollection*>& spectrum_store,
+    std::map<std::pair<std::string, unsigned int>, bool>* spectrum_flag
+  );
+
+  /**
+   * Adds to library the spectra of spectrum_store that the confident PSMs of
+   * psms_file identify.
+   */
+  void addPsms(
+    const std::string& psms_file,
+    const std::map<std::string, SpectrumCollection*>& spectrum_store,
+    SpectralLibrary* library
+  );
+
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -7,93 +7,249 @@
  * the data from Tide into Crux objects, which increases runtime.
  */
 
+#include <cmath>
 #include <fstream>
 #include <iomanip>
 
 #include "TideIndexApplication.h"
 #include "TideMatchSet.h"
 #include "TideSearchApplication.h"
+#include "util/GlobalParams.h"
+#include "util/Instrumentation.h"
+#include "util/MemoryAccounting.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
 
+namespace {
+
+/**
+ * Fields of result rows, written to a stream as tab-delimited text.
+ */
+class TextRow {
+ public:
+  explicit TextRow(ostream* out, vector<ScoreIndex::Entry>* scores = NULL)
+    : out_(out), first_(true), scores_(scores) {}
+
+  /**
+   * Notes the row about to be written for a score index, with its score as
+   * it is read back from the text.
+   */
+  void Index(double score, int precision, bool fixed, int rank, bool decoy) {
+    if (scores_ == NULL) {
+      return;
+    }
+    size_t length = StringUtils::FormatNumber(number_, score, precision, fixed);
+    number_[min(length, StringUtils::NUMBER_BUFFER_SIZE - 1)] = '\0';
+    ScoreIndex::Entry entry;
+    entry.score = strtod(number_, NULL);
+    entry.offset = (uint64_t) out_->tellp();
+    entry.rank = rank;
+    entry.decoy = decoy ? 1 : 0;
+    scores_->push_back(entry);
+  }
+
+  template<typename T>
+  void Field(const T& value) {
+    Separate();
+    *out_ << value;
+  }
+
+  /**
+   * A number written with the given precision, as in StringUtils::ToString.
+   */
+  void Number(double value, int precision, bool fixed = true) {
+    Separate();
+    out_->write(number_, StringUtils::FormatNumber(number_, value, precision, fixed));
+  }
+
+  void End() {
+    *out_ << '\n';
+    first_ = true;
+  }
+
+ private:
+  void Separate() {
+    if (!first_) {
+      *out_ << '\t';
+    }
+    first_ = false;
+  }
+
+  ostream* out_;
+  bool first_;
+  vector<ScoreIndex::Entry>* scores_;
+  char number_[StringUtils::NUMBER_BUFFER_SIZE];
+};
+
+/**
+ * Fields of result rows, kept as the typed columns of a binary block.
+ */
+class BinaryRow {
+ public:
+  explicit BinaryRow(BinaryMatchBatch* batch) : batch_(batch) {}
+
+  void Index(double score, int precision, bool fixed, int rank, bool decoy) {}
+
+  void Field(int value) { batch_->addInt(value); }
+  void Field(float value) { batch_->addDouble(value); }
+  void Field(double value) { batch_->addDouble(value); }
+  void Field(const string& value) { batch_->addString(value); }
+  void Field(const char* value) { batch_->addString(value); }
+
+  /**
+   * Numbers are kept at full precision.
+   */
+  void Number(double value, int precision, bool fixed = true) {
+    batch_->addDouble(value);
+  }
+
+  void End() { batch_->endRow(); }
+
+ private:
+  BinaryMatchBatch* batch_;
+};
+
+} // namespace
+
 string TideMatchSet::CleavageType;
 char TideMatchSet::match_collection_loc_[] = {0};
 char TideMatchSet::decoy_match_collection_loc_[] = {0};
 
+/**
+ * Peptides reported for many spectra, or at several ranks, would otherwise
+ * have their protein lists built anew each time. Entries are kept by mass;
+ * once there are LOCATION_CACHE_SIZE of them the lightest are dropped, since
+ * the active window has moved on to heavier peptides.
+ */
+struct TideMatchSet::LocationCache {
+  static const size_t LOCATION_CACHE_SIZE = 1 << 16;
+  // (mass, (id, decoy)); a decoy made at search time shares its target's id
+  typedef map<pair<double, pair<int, bool> >, Locations> EntryMap;
+
+  LocationCache() : generation(location_generation_) {}
+
+  int generation;
+  EntryMap entries;
+};
+
+boost::thread_specific_ptr<TideMatchSet::LocationCache> TideMatchSet::location_cache_;
+int TideMatchSet::location_generation_ = 0;
+vector<const ModificationDefinition*> TideMatchSet::mod_definitions_;
+
+/**
+ * In peptide-centric search a spectrum is reported with many peptides, and
+ * the Sp preprocessing of the spectrum costs far more than scoring one
+ * peptide. Scorers are kept by spectrum and charge, and dropped all at once
+ * when there are SP_SCORER_CACHE_SIZE of them; reported spectra move with
+ * the active window, so few come back after that.
+ */
+struct TideMatchSet::SpScorerCache {
+  static const size_t SP_SCORER_CACHE_SIZE = 256;
+  typedef map<pair<const Spectrum*, int>, SpScorer*> EntryMap;
+
+  SpScorerCache() : generation(location_generation_) {}
+  ~SpScorerCache() { Clear(); }
+
+  void Clear() {
+    for (EntryMap::iterator i = entries.begin(); i != entries.end(); ++i) {
+      delete i->second;
+    }
+    entries.clear();
+  }
+
+  int generation;
+  EntryMap entries;
+};
+
+boost::thread_specific_ptr<TideMatchSet::SpScorerCache> TideMatchSet::sp_scorer_cache_;
+
 TideMatchSet::TideMatchSet(Arr* matches, double max_mz)
-  : matches_(matches), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0) {
+  : matches_(matches), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0),
+    peptides_(NULL), targets_(0), decoys_(0), candidates_(-1) {
 }
 
 TideMatchSet::TideMatchSet(Peptide* peptide, double max_mz)
-  : peptide_(peptide), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0) {
+  : peptide_(peptide), max_mz_(max_mz), exact_pval_search_(false), elution_window_(0),
+    peptides_(NULL), targets_(0), decoys_(0), candidates_(-1) {
 }
 
 TideMatchSet::~TideMatchSet() {
 }
 
+void TideMatchSet::SetPeptides(const vector<const Peptide*>* peptides,
+                               int targets, int decoys) {
+  peptides_ = peptides;
+  targets_ = targets;
+  decoys_ = decoys;
+}
+
 /**
  * Write peptide centric matches to output files
  * This is for writing tab-delimited only
  */
 void TideMatchSet::report(
-  ofstream* target_file,  ///< target file to write to
-  ofstream* decoy_file, ///< decoy file to write to
+  ostream* target_file,  ///< target file to write to
+  ostream* decoy_file, ///< decoy file to write to
   int top_matches,
   const ActivePeptideQueue* peptides, ///< peptide queue
   const ProteinVec& proteins, ///< proteins corresponding with peptides
-  const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
+  const AuxLocations& locations,  ///< auxiliary locations
   bool compute_sp ///< whether to compute sp or not
 ) {
-  if (peptide_->spectrum_matches_array.size() == 0) {
+  if (peptide_->NumHits() == 0) {
     return;
   }
+  CRUX_TIME_STAGE(STAGE_REPORT);
+  vector<Peptide::spectrum_matches>& matches = peptide_->Hits();
 
+  // Unless they are smoothed over an elution window, the peptide keeps only
+  // its best top_matches + 1 hits, so sorting them here is cheap.
   carp(CARP_DETAILED_DEBUG, "TideMatchSet reporting top %d of %d peptide centric matches",
-       top_matches, peptide_->spectrum_matches_array.size());
+       top_matches, peptide_->TotalHits());
 
   int charge;
   double score;
   double d_cn = 0.0;
-  int nHit = peptide_->spectrum_matches_array.size();
+  int nHit = matches.size();
 
   if (nHit < top_matches) {
       top_matches = nHit;
   }
   if (exact_pval_search_) {
-    sort(peptide_->spectrum_matches_array.begin(),
-         peptide_->spectrum_matches_array.end(),
+    sort(matches.begin(),
+         matches.end(),
          Peptide::spectrum_matches::compPV);
   } else {
-    sort(peptide_->spectrum_matches_array.begin(),
-         peptide_->spectrum_matches_array.end(),
+    sort(matches.begin(),
+         matches.end(),
          Peptide::spectrum_matches::compSC);
   } 
  
   for (int cnt = 0; cnt < nHit; ++cnt) {
     d_cn = 0.0;
     if (exact_pval_search_ == true) {
-      score = peptide_->spectrum_matches_array[cnt].score1_;
+      score = matches[cnt].score1_;
       if (cnt < nHit-1) {
-        d_cn = (double)((log10(peptide_->spectrum_matches_array[cnt+1].score1_)
-                       - log10(peptide_->spectrum_matches_array[cnt].score1_))
-                       /max((FLOAT_T)(-1*log10(peptide_->spectrum_matches_array[cnt].score1_)), FLOAT_T(1)));
+        d_cn = (double)((log10(matches[cnt+1].score1_)
+                       - log10(matches[cnt].score1_))
+                       /max((FLOAT_T)(-1*log10(matches[cnt].score1_)), FLOAT_T(1)));
       }
     } else {
-      score = (double)(peptide_->spectrum_matches_array[cnt].score1_ / 100000000.0);
+      score = (double)(matches[cnt].score1_ / 100000000.0);
       if (cnt < nHit-1) {
         d_cn = (double)( score 
-                      - (double)(peptide_->spectrum_matches_array[cnt+1].score1_ / 100000000.0)
+                      - (double)(matches[cnt+1].score1_ / 100000000.0)
                       / (double)max((FLOAT_T)score , FLOAT_T(1)));
       }
     }
-    peptide_->spectrum_matches_array[cnt].score1_ = score;
-    peptide_->spectrum_matches_array[cnt].d_cn_ = d_cn;
-    peptide_->spectrum_matches_array[cnt].score3_ = nHit;
+    matches[cnt].score1_ = score;
+    matches[cnt].d_cn_ = d_cn;
+    matches[cnt].score3_ = peptide_->TotalHits();
   }
   //smoothing primary scores in the elution window, only in DIA mode.
   if (elution_window_ > 0) {
-    sort(peptide_->spectrum_matches_array.begin(), 
-         peptide_->spectrum_matches_array.end(),
+    sort(matches.begin(), 
+         matches.end(),
          Peptide::spectrum_matches::compRT);
     int cnt;
     double mean = 1.0;
@@ -103,45 +259,44 @@ void TideMatchSet::report(
     flank = flank > nHit ? nHit : flank;
 
     for (cnt = 0; cnt < flank; ++cnt) {
-      mean *= peptide_->spectrum_matches_array[cnt].score1_;
+      mean *= matches[cnt].score1_;
     }
     int top = flank;
     int bottom = 0;
     for (cnt = 0; cnt < nHit; ++cnt) {
-      peptide_->spectrum_matches_array[cnt].elution_score_ = pow(mean, 1.0/(top-bottom));
+      matches[cnt].elution_score_ = pow(mean, 1.0/(top-bottom));
       if (top < nHit) {
-        mean *= peptide_->spectrum_matches_array[top].score1_;
+        mean *= matches[top].score1_;
         ++top;
       }
       if (cnt >= flank-1) {
-        mean /= peptide_->spectrum_matches_array[bottom].score1_;
+        mean /= matches[bottom].score1_;
         ++bottom;
       }
     }
     //reorder PSMs according to the smoothed p-value
-    sort(peptide_->spectrum_matches_array.begin(),
-         peptide_->spectrum_matches_array.end(),
+    sort(matches.begin(),
+         matches.end(),
          Peptide::spectrum_matches::compES);
   }
-  peptide_->spectrum_matches_array.resize(top_matches);
+  matches.resize(top_matches);
   if (compute_sp) {
     vector<pair<double, int> > spScoreRank;
     spScoreRank.reserve(top_matches);
     for (int cnt = 0; cnt < top_matches; ++cnt) {  
-      SpScorer sp_scorer(proteins, *peptide_->spectrum_matches_array[cnt].spectrum_, 
-                         peptide_->spectrum_matches_array[cnt].charge_, max_mz_);
-      pb::Peptide* pb_peptide = getPbPeptide(*peptide_);
-      sp_scorer.Score(*pb_peptide, peptide_->spectrum_matches_array[cnt].spData_);
-      spScoreRank.push_back(make_pair(-1*peptide_->spectrum_matches_array[cnt].spData_.sp_score, cnt));
+      SpScorer* sp_scorer = getSpScorer(proteins, matches[cnt].spectrum_,
+                                        matches[cnt].charge_);
+      sp_scorer->Score(*peptide_, matches[cnt].spData_);
+      spScoreRank.push_back(make_pair(-1*matches[cnt].spData_.sp_score, cnt));
     }
     sort(spScoreRank.begin(), spScoreRank.end());
     for (size_t i = 0; i < spScoreRank.size(); ++i) {
-      peptide_->spectrum_matches_array[spScoreRank[i].second].spData_.sp_rank = i;
+      matches[spScoreRank[i].second].spData_.sp_rank = i;
     }
   }  
   // target peptide or concat search
-  ofstream* file =
-    (Params::GetBool("concat") || !peptide_->IsDecoy()) ? target_file : decoy_file;
+  ostream* file =
+    (GlobalParams::getConcat() || !peptide_->IsDecoy()) ? target_file : decoy_file;
   writeToFile(file, peptides, proteins, locations, compute_sp);
 }
 
@@ -149,10 +304,10 @@ void TideMatchSet::report(
  * Helper function for tab delimited report function for peptide centric search
  */
 void TideMatchSet::writeToFile(
-  ofstream* file,
+  ostream* file,
   const ActivePeptideQueue* peptides,
   const ProteinVec& proteins,
-  const vector<const pb::AuxLocation*>& locations,
+  const AuxLocations& locations,
   bool compute_sp ///< whether to compute sp or not
 ) {
   if (!file) {
@@ -161,34 +316,19 @@ void TideMatchSet::writeToFile(
   int cur = 0;
 
   const Peptide* peptide = peptides->GetPeptide(0);
-  const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
-  int pos = peptide->FirstLocPos();
-  string proteinNames = getProteinName(*protein,
-      (!protein->has_target_pos()) ? pos : protein->target_pos());
-  string flankingAAs, n_term, c_term;
-  getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
-  flankingAAs = n_term + c_term;
+  // A decoy made during the search has the locations of its target
+  bool searchDecoy = peptide->IsDecoy() && TideSearchApplication::searchTimeDecoys();
+  const Locations& peptideLocations = getLocations(peptide, proteins, locations);
+  const string& proteinNames = peptideLocations.protein_names;
+  const string& flankingAAs = peptideLocations.flanking_aas;
+  const pb::Protein* protein = peptideLocations.last_protein;
 
-  int precision = Params::GetInt("precision");
-
-  // look for other locations
-  if (peptide->HasAuxLocationsIndex()) {
-      const pb::AuxLocation* aux = locations[peptide->AuxLocationsIndex()];
-      for (int i = 0; i < aux->location_size(); ++i) {
-      const pb::Location& location = aux->location(i);
-      protein = proteins[location.protein_id()];
-      pos = location.pos();
-      proteinNames += "," + getProteinName(*protein,
-          (!protein->has_target_pos()) ? pos : protein->target_pos());
-      getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
-      flankingAAs += "," + n_term + c_term;
-      }
-  }
+  int precision = GlobalParams::getPrecision();
 
   Crux::Peptide cruxPep = getCruxPeptide(peptide);
   for (vector<Peptide::spectrum_matches>::const_iterator 
-        i = peptide_->spectrum_matches_array.begin(); 
-        i != peptide_->spectrum_matches_array.end(); 
+        i = peptide_->Hits().begin(); 
+        i != peptide_->Hits().end(); 
         ++i) {
     Spectrum* spectrum = i->spectrum_;
     
@@ -223,7 +363,7 @@ void TideMatchSet::writeToFile(
     }
     *file << i->score3_ << '\t';
 
-    if (Params::GetBool("concat")) {
+    if (GlobalParams::getConcat()) {
       *file << peptides->ActiveTargets() + peptides->ActiveDecoys() << '\t';
     } else {
       *file << (!peptide->IsDecoy() ? peptides->ActiveTargets() : peptides->ActiveDecoys()) << '\t';
@@ -234,12 +374,15 @@ void TideMatchSet::writeToFile(
           << proteinNames << '\t'
           << flankingAAs  << '\t'
           << cruxPep.getDecoyType();
-    if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
+    if (searchDecoy) {
+      *file << '\t' << proteins[peptide->FirstLocProteinId()]->residues().substr(
+        peptide->FirstLocPos(), peptide->Len());
+    } else if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
       // write target sequence
       const string& residues = protein->residues();
       *file << '\t'
             << residues.substr(residues.length() - peptide->Len());
-    } else if (Params::GetBool("concat") && !TideSearchApplication::proteinLevelDecoys()) {
+    } else if (GlobalParams::getConcat() && !TideSearchApplication::proteinLevelDecoys()) {
       *file << '\t'
             << cruxPep.getUnshuffledSequence();
     }
@@ -252,29 +395,46 @@ void TideMatchSet::writeToFile(
  * This is for writing tab-delimited only
  */
 void TideMatchSet::report(
-  ofstream* target_file,  ///< target file to write to
-  ofstream* decoy_file, ///< decoy file to write to
+  ostream* target_file,  ///< target file to write to
+  ostream* decoy_file, ///< decoy file to write to
   int top_n,  ///< number of matches to report
   const string& spectrum_filename, ///< name of spectrum file
   const Spectrum* spectrum, ///< spectrum for matches
   int charge, ///< charge for matches
+  double precursor_mz, ///< precursor m/z of the charge state
   const ActivePeptideQueue* peptides, ///< peptide queue
   const ProteinVec& proteins,  ///< proteins corresponding with peptides
-  const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
+  const AuxLocations& locations,  ///< auxiliary locations
   bool compute_sp, ///< whether to compute sp or not
   bool highScoreBest, //< indicates semantics of score magnitude
-  boost::mutex * rwlock
+  ResultBuffer* buffer ///< thread's output buffer, or NULL to write directly
 ) {
   if (matches_->size() == 0) {
     return;
   }
+  CRUX_TIME_STAGE(STAGE_REPORT);
 
+  int candidates = candidates_ >= 0 ? candidates_ : matches_->size();
   carp(CARP_DETAILED_DEBUG, "Tide MatchSet reporting top %d of %d matches",
-       top_n, matches_->size());
+       top_n, candidates);
 
   vector<Arr::iterator> targets, decoys;
   gatherTargetsAndDecoys(peptides, proteins, targets, decoys, top_n, highScoreBest);
 
+  QCStatistics* stats = buffer ? buffer->Stats() : NULL;
+  if (stats) {
+    double spectrum_mass = (precursor_mz - MASS_PROTON) * charge;
+    stats->addSpectrum(charge, candidates);
+    for (int i = 0; i < 2; i++) {
+      const vector<Arr::iterator>& best = i == 0 ? targets : decoys;
+      if (!best.empty()) {
+        const Peptide* peptide = getPeptide(peptides, best[0]->rank);
+        double score = exact_pval_search_ ? -log10(best[0]->xcorr_pval) : best[0]->xcorr_score;
+        stats->addTopMatch(peptide->IsDecoy(), score, spectrum_mass, peptide->Mass());
+      }
+    }
+  }
+
   map<Arr::iterator, FLOAT_T> delta_cn_map;
   map<Arr::iterator, FLOAT_T> delta_lcn_map;
   computeDeltaCns(targets, &delta_cn_map, &delta_lcn_map);
@@ -286,135 +446,522 @@ void TideMatchSet::report(
     computeSpData(targets, &sp_map, &sp_scorer, peptides);
     computeSpData(decoys, &sp_map, &sp_scorer, peptides);
   }
-  writeToFile(target_file, top_n, targets, spectrum_filename, spectrum, charge,
+  if (buffer && buffer->Binary()) {
+    if (target_file) {
+      BinaryRow row(buffer->TargetBatch());
+      writeRows(&row, top_n, targets, spectrum_filename, spectrum, charge, precursor_mz,
+                peptides, proteins, locations, delta_cn_map, delta_lcn_map,
+                compute_sp ? &sp_map : NULL);
+    }
+    if (decoy_file) {
+      BinaryRow row(buffer->DecoyBatch());
+      writeRows(&row, top_n, decoys, spectrum_filename, spectrum, charge, precursor_mz,
+                peptides, proteins, locations, delta_cn_map, delta_lcn_map,
+                compute_sp ? &sp_map : NULL);
+    }
+    return;
+  }
+  ostream* target_out = target_file;
+  ostream* decoy_out = decoy_file;
+  if (buffer) {
+    target_out = target_file ? buffer->Target() : NULL;
+    decoy_out = decoy_file ? buffer->Decoy() : NULL;
+  }
+  writeToFile(target_out, top_n, targets, spectrum_filename, spectrum, charge, precursor_mz,
               peptides, proteins, locations, delta_cn_map, delta_lcn_map,
-              compute_sp ? &sp_map : NULL, rwlock);
-  writeToFile(decoy_file, top_n, decoys, spectrum_filename, spectrum, charge,
+              compute_sp ? &sp_map : NULL, buffer ? buffer->TargetScores() : NULL);
+  writeToFile(decoy_out, top_n, decoys, spectrum_filename, spectrum, charge, precursor_mz,
               peptides, proteins, locations, delta_cn_map, delta_lcn_map,
-              compute_sp ? &sp_map : NULL, rwlock);
+              compute_sp ? &sp_map : NULL);
 }
 
 /**
  * Helper function for tab delimited report function
  */
 void TideMatchSet::writeToFile(
-  ofstream* file,
+  ostream* file,
   int top_n,
   const vector<Arr::iterator>& vec,
   const string& spectrum_filename,
   const Spectrum* spectrum,
   int charge,
+  double precursor_mz,
   const ActivePeptideQueue* peptides,
   const ProteinVec& proteins,
-  const vector<const pb::AuxLocation*>& locations,
+  const AuxLocations& locations,
   const map<Arr::iterator, FLOAT_T>& delta_cn_map,
   const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
   const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
-  boost::mutex * rwlock
+  vector<ScoreIndex::Entry>* scores
 ) {
   if (!file) {
     return;
   }
+  TextRow row(file, scores);
+  writeRows(&row, top_n, vec, spectrum_filename, spectrum, charge, precursor_mz, peptides,
+            proteins, locations, delta_cn_map, delta_lcn_map, sp_map);
+}
 
-  int massPrecision = Params::GetInt("mass-precision");
-  int precision = Params::GetInt("precision");
+template<typename Row>
+void TideMatchSet::writeRows(
+  Row* row,
+  int top_n,
+  const vector<Arr::iterator>& vec,
+  const string& spectrum_filename,
+  const Spectrum* spectrum,
+  int charge,
+  double precursor_mz,
+  const ActivePeptideQueue* peptides,
+  const ProteinVec& proteins,
+  const AuxLocations& locations,
+  const map<Arr::iterator, FLOAT_T>& delta_cn_map,
+  const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
+  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
+) {
+  int massPrecision = GlobalParams::getMassPrecision();
+  int precision = GlobalParams::getPrecision();
 
   int cur = 0;
-  int concatDistinctMatches = peptides->ActiveTargets() + peptides->ActiveDecoys();
+  int concatDistinctMatches = activeTargets(peptides) + activeDecoys(peptides);
 
   const vector<Arr::iterator>::const_iterator cutoff =
     (vec.size() >= top_n) ? vec.begin() + top_n : vec.end();
 
   for (vector<Arr::iterator>::const_iterator i = vec.begin(); i != cutoff; ++i) {
-    const Peptide* peptide = peptides->GetPeptide((*i)->rank);
-    const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
-    int pos = peptide->FirstLocPos();
-    string proteinNames = getProteinName(*protein,
-      (!protein->has_target_pos()) ? pos : protein->target_pos());
-    string flankingAAs, n_term, c_term;
-    getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
-    flankingAAs = n_term + c_term;
-
-    // look for other locations
-    if (peptide->HasAuxLocationsIndex()) {
-      const pb::AuxLocation* aux = locations[peptide->AuxLocationsIndex()];
-      for (int i = 0; i < aux->location_size(); ++i) {
-        const pb::Location& location = aux->location(i);
-        protein = proteins[location.protein_id()];
-        pos = location.pos();
-        proteinNames += "," + getProteinName(*protein,
-          (!protein->has_target_pos()) ? pos : protein->target_pos());
-        getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
-        flankingAAs += "," + n_term + c_term;
-      }
-    }
+    const Peptide* peptide = getPeptide(peptides, (*i)->rank);
+    // A decoy made during the search has the locations of its target
+    bool searchDecoy = peptide->IsDecoy() && TideSearchApplication::searchTimeDecoys();
+    const Locations& peptideLocations = getLocations(peptide, proteins, locations);
+    const pb::Protein* protein = peptideLocations.last_protein;
 
     Crux::Peptide cruxPep = getCruxPeptide(peptide);
     const SpScorer::SpScoreData* sp_data = sp_map ? &(sp_map->at(*i).first) : NULL;
 
-    rwlock->lock();
-    if (Params::GetBool("file-column")) {
-      *file << spectrum_filename << '\t';
+    if (exact_pval_search_) {
+      row->Index((*i)->xcorr_pval, precision, false, cur + 1, peptide->IsDecoy());
+    } else {
+      row->Index((*i)->xcorr_score, precision, true, cur + 1, peptide->IsDecoy());
     }
-    *file << spectrum->SpectrumNumber() << '\t'
-          << charge << '\t'
-          << StringUtils::ToString(spectrum->PrecursorMZ(), massPrecision) << '\t'
-          << StringUtils::ToString((spectrum->PrecursorMZ() - MASS_PROTON) * charge, massPrecision) << '\t'
-          << StringUtils::ToString(cruxPep.calcModifiedMass(), massPrecision) << '\t'
-          << delta_cn_map.at(*i) << '\t'
-          << delta_lcn_map.at(*i) << '\t';
+    if (GlobalParams::getFileColumn()) {
+      row->Field(spectrum_filename);
+    }
+    row->Field(spectrum->SpectrumNumber());
+    row->Field(charge);
+    row->Number(precursor_mz, massPrecision);
+    row->Number((precursor_mz - MASS_PROTON) * charge, massPrecision);
+    row->Number(cruxPep.calcModifiedMass(), massPrecision);
+    row->Field(delta_cn_map.at(*i));
+    row->Field(delta_lcn_map.at(*i));
     if (sp_map) {
-      *file << StringUtils::ToString(sp_data->sp_score, precision) << '\t'
-            << sp_map->at(*i).second << '\t';
+      row->Number(sp_data->sp_score, precision);
+      row->Field(sp_map->at(*i).second);
     }
 
     // Use scientific notation for exact p-value, but not refactored XCorr.
     if (exact_pval_search_) {
-      *file << StringUtils::ToString((*i)->xcorr_pval, precision, false) << '\t';
-      *file << StringUtils::ToString((*i)->xcorr_score, precision, true) << '\t';
+      row->Number((*i)->xcorr_pval, precision, false);
+      row->Number((*i)->xcorr_score, precision, true);
     } else {
-      *file << StringUtils::ToString((*i)->xcorr_score, precision, true) << '\t';
-    }      
-    *file << ++cur << '\t';
+      row->Number((*i)->xcorr_score, precision, true);
+    }
+    row->Field(++cur);
     if (sp_map) {
-      *file << sp_data->matched_ions << '\t'
-            << sp_data->total_ions << '\t';
+      row->Field(sp_data->matched_ions);
+      row->Field(sp_data->total_ions);
     }
 
-    if (Params::GetBool("concat")) {
-      *file << concatDistinctMatches << '\t';
+    if (GlobalParams::getConcat()) {
+      row->Field(concatDistinctMatches);
     } else {
-      *file << (!peptide->IsDecoy() ? peptides->ActiveTargets() : peptides->ActiveDecoys()) << '\t';
+      row->Field(!peptide->IsDecoy() ? activeTargets(peptides) : activeDecoys(peptides));
     }
 
-    *file << cruxPep.getModifiedSequenceWithMasses() << '\t'
-          << cruxPep.getModsString() << '\t'
-          << CleavageType << '\t'
-          << proteinNames << '\t'
-          << flankingAAs;
-    if (peptide->IsDecoy()) {
-      *file << "\tdecoy";
-    } else {
-      *file << "\ttarget";
-    }
-    if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
+    row->Field(cruxPep.getModifiedSequenceWithMasses());
+    row->Field(cruxPep.getModsString());
+    row->Field(CleavageType);
+    row->Field(peptideLocations.protein_names);
+    row->Field(peptideLocations.flanking_aas);
+    row->Field(peptide->IsDecoy() ? "decoy" : "target");
+    if (searchDecoy) {
+      row->Field(proteins[peptide->FirstLocProteinId()]->residues().substr(
+        peptide->FirstLocPos(), peptide->Len()));
+    } else if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
       // write target sequence
       const string& residues = protein->residues();
-      *file << '\t'
-            << residues.substr(residues.length() - peptide->Len());
-    } else if (Params::GetBool("concat") && !TideSearchApplication::proteinLevelDecoys()) {
-      *file << '\t'
-            << cruxPep.getUnshuffledSequence();
+      row->Field(residues.substr(residues.length() - peptide->Len()));
+    } else if (GlobalParams::getConcat() && !TideSearchApplication::proteinLevelDecoys()) {
+      row->Field(cruxPep.getUnshuffledSequence());
     }
-    *file << endl;
-    rwlock->unlock();
+    row->End();
+  }
+}
+
+
+
+TideMatchSet::ResultSink::ResultSink(
+  ostream* target_file,
+  ostream* decoy_file,
+  bool ordered,
+  bool in_order_chunks
+) : target_file_(target_file), decoy_file_(decoy_file), ordered_(ordered),
+    in_order_chunks_(in_order_chunks), binary_(binaryOutput()), next_(0),
+    pending_bytes_(0), pending_limit_((size_t)Params::GetInt("output-pending-bytes")),
+    finished_(false),
+    collect_stats_(Params::GetBool("qc-report")), write_time_(0), wait_time_(0),
+    checkpoint_interval_(0), last_checkpoint_(0), score_index_(NULL),
+    score_index_offset_(0), score_index_complete_(true) {
+  if (target_file_ || decoy_file_) {
+    writer_ = boost::thread(boost::bind(&TideMatchSet::ResultSink::WriterLoop, this));
+  }
+}
+
+TideMatchSet::ResultSink::~ResultSink() {
+  Finish();
+}
+
+void TideMatchSet::ResultSink::Finish() {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (finished_) {
+      return;
+    }
+    finished_ = true;
+    cond_.notify_all();
+  }
+  if (writer_.joinable()) {
+    writer_.join();
+  }
+  if (!pending_.empty()) {
+    carp(CARP_ERROR, "%d chunks of search results were never written",
+         pending_.size());
+  }
+  // The results files get reread for conversion to other formats.
+  if (target_file_) {
+    target_file_->flush();
+  }
+  if (decoy_file_) {
+    decoy_file_->flush();
+  }
+  if (!checkpoint_path_.empty() && pending_.empty()) {
+    WriteCheckpoint(next_);
+  }
+  carp(CARP_INFO, "Writing search results took %.3g s on the writer thread; "
+       "search threads waited %.3g s for it.", write_time_ / 1e6, wait_time_ / 1e6);
+}
+
+void TideMatchSet::ResultSink::SetCheckpoint(
+  const string& path,
+  const string& position,
+  double interval
+) {
+  boost::mutex::scoped_lock lock(mutex_);
+  checkpoint_path_ = path;
+  checkpoint_position_ = position;
+  checkpoint_interval_ = interval * 1e6;
+  last_checkpoint_ = wall_clock();
+}
+
+/**
+ * Flushes the results files and records how far they have got, writing a
+ * new checkpoint file over the old one so that a crash leaves one or the
+ * other whole. Called with mutex_ released, by the only thread writing the
+ * files.
+ */
+void TideMatchSet::ResultSink::WriteCheckpoint(int written) {
+  long long target_offset = -1, decoy_offset = -1;
+  if (target_file_) {
+    target_file_->flush();
+    target_offset = (long long)target_file_->tellp();
+  }
+  if (decoy_file_) {
+    decoy_file_->flush();
+    decoy_offset = (long long)decoy_file_->tellp();
+  }
+  string tmp = checkpoint_path_ + ".tmp";
+  {
+    ofstream out(tmp.c_str());
+    out << checkpoint_position_ << '\n'
+        << "spec-charges " << written << '\n'
+        << "target-offset " << target_offset << '\n'
+        << "decoy-offset " << decoy_offset << '\n';
+    out.close();
+    if (!out) {
+      carp(CARP_WARNING, "Could not write checkpoint %s", tmp.c_str());
+      return;
+    }
+  }
+  if (rename(tmp.c_str(), checkpoint_path_.c_str()) != 0) {
+    carp(CARP_WARNING, "Could not replace checkpoint %s", checkpoint_path_.c_str());
+  }
+}
+
+void TideMatchSet::ResultSink::SetScoreIndex(ScoreIndex* index) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (target_file_ == NULL || binary_) {
+    return;
+  }
+  score_index_ = index;
+  score_index_offset_ = (uint64_t) target_file_->tellp();
+}
+
+void TideMatchSet::ResultSink::ScoreIndexIncomplete() {
+  boost::mutex::scoped_lock lock(mutex_);
+  score_index_complete_ = false;
+}
+
+void TideMatchSet::ResultSink::AddStats(const QCStatistics& stats) {
+  boost::mutex::scoped_lock lock(mutex_);
+  stats_.merge(stats);
+}
+
+void TideMatchSet::ResultSink::Write(
+  const string& target,
+  const string& decoy,
+  const vector<ScoreIndex::Entry>& target_scores
+) {
+  boost::mutex::scoped_lock lock(mutex_);
+  WaitForRoom(lock);
+  WriteUnlocked(target, decoy, target_scores);
+}
+
+void TideMatchSet::ResultSink::Submit(
+  int begin,
+  int end,
+  const string& target,
+  const string& decoy,
+  const vector<ScoreIndex::Entry>& target_scores
+) {
+  boost::mutex::scoped_lock lock(mutex_);
+  WaitForRoom(lock);
+  WaitForTurn(lock, begin);
+  if (begin != next_) {
+    PendingChunk& chunk = pending_[begin];
+    chunk.end = end;
+    chunk.target = target;
+    chunk.decoy = decoy;
+    chunk.target_scores = target_scores;
+    pending_bytes_ += target.size() + decoy.size();
+    MemoryAccounting::Add(MEMORY_OUTPUT_BUFFERS, target.size() + decoy.size());
+    return;
+  }
+  WriteUnlocked(target, decoy, target_scores);
+  next_ = end;
+  // Write out any chunks that were waiting on this one.
+  map<int, PendingChunk>::iterator i;
+  while ((i = pending_.find(next_)) != pending_.end()) {
+    WriteUnlocked(i->second.target, i->second.decoy, i->second.target_scores);
+    next_ = i->second.end;
+    size_t bytes = i->second.target.size() + i->second.decoy.size();
+    pending_bytes_ -= bytes;
+    MemoryAccounting::Add(MEMORY_OUTPUT_BUFFERS, -(long long)bytes);
+    pending_.erase(i);
+  }
+  // Threads waiting for their turn
+  cond_.notify_all();
+}
+
+/**
+ * Hands a batch to the writer thread. Requires mutex_ to be held.
+ */
+void TideMatchSet::ResultSink::WriteUnlocked(
+  const string& target,
+  const string& decoy,
+  const vector<ScoreIndex::Entry>& target_scores
+) {
+  if (target_file_) {
+    target_buffer_ += target;
+    MemoryAccounting::Add(MEMORY_OUTPUT_BUFFERS, target.size());
+  }
+  if (score_index_ != NULL) {
+    // The text reaches the file in the order it is handed over.
+    vector<ScoreIndex::Entry>& entries = score_index_->entries();
+    for (vector<ScoreIndex::Entry>::const_iterator i = target_scores.begin();
+         i != target_scores.end();
+         ++i) {
+      entries.push_back(*i);
+      entries.back().offset += score_index_offset_;
+    }
+    score_index_offset_ += target.size();
+  }
+  if (decoy_file_) {
+    decoy_buffer_ += decoy;
+    MemoryAccounting::Add(MEMORY_OUTPUT_BUFFERS, decoy.size());
+  }
+  if (!target_buffer_.empty() || !decoy_buffer_.empty()) {
+    cond_.notify_all();
+  }
+}
+
+/**
+ * Waits, holding lock on mutex_, until the writer has taken the buffers if
+ * they are full.
+ */
+void TideMatchSet::ResultSink::WaitForRoom(boost::mutex::scoped_lock& lock) {
+  if (target_buffer_.size() + decoy_buffer_.size() < pending_limit_) {
+    return;
+  }
+  double start = wall_clock();
+  while (target_buffer_.size() + decoy_buffer_.size() >= pending_limit_) {
+    cond_.wait(lock);
+  }
+  wait_time_ += wall_clock() - start;
+}
+
+/**
+ * Waits, holding lock on mutex_, while the chunk starting at begin is not
+ * next and the reorder buffer is full. Only safe when every thread submits
+ * its chunks in order, so that the thread holding the next chunk is never
+ * itself waiting here.
+ */
+void TideMatchSet::ResultSink::WaitForTurn(boost::mutex::scoped_lock& lock, int begin) {
+  if (!in_order_chunks_ || begin == next_ || pending_bytes_ < pending_limit_) {
+    return;
+  }
+  double start = wall_clock();
+  while (begin != next_ && pending_bytes_ >= pending_limit_) {
+    cond_.wait(lock);
+  }
+  wait_time_ += wall_clock() - start;
+}
+
+/**
+ * The writer thread: swaps out the buffers search threads fill and writes
+ * them to the files, until Finish() is called and nothing is left.
+ */
+void TideMatchSet::ResultSink::WriterLoop() {
+  string target, decoy;
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    while (target_buffer_.empty() && decoy_buffer_.empty() && !finished_) {
+      cond_.wait(lock);
+    }
+    if (target_buffer_.empty() && decoy_buffer_.empty()) {
+      break;
+    }
+    target.swap(target_buffer_);
+    decoy.swap(decoy_buffer_);
+    // In ordered mode the buffers held everything before next_
+    int written = next_;
+    MemoryAccounting::Add(MEMORY_OUTPUT_BUFFERS, -(long long) (target.size() + decoy.size()));
+    cond_.notify_all();
+    lock.unlock();
+
+    double start = wall_clock();
+    CRUX_COUNT(COUNTER_BYTES_WRITTEN, target.size() + decoy.size());
+    if (!target.empty()) {
+      target_file_->write(target.data(), target.size());
+      target.clear();
+    }
+    if (!decoy.empty()) {
+      decoy_file_->write(decoy.data(), decoy.size());
+      decoy.clear();
+    }
+    if (!checkpoint_path_.empty() && wall_clock() - last_checkpoint_ >= checkpoint_interval_) {
+      WriteCheckpoint(written);
+      last_checkpoint_ = wall_clock();
+    }
+    lock.lock();
+    write_time_ += wall_clock() - start;
+#ifdef CRUX_INSTRUMENT
+    Instrumentation::Add(STAGE_OUTPUT, wall_clock() - start);
+#endif
+  }
+}
+
+TideMatchSet::ResultBuffer::ResultBuffer(ResultSink* sink)
+  : sink_(sink), begin_(0), end_(0), target_mark_(0), decoy_mark_(0) {
+}
+
+TideMatchSet::ResultBuffer::~ResultBuffer() {
+  Flush();
+  if (sink_->CollectsStats()) {
+    sink_->AddStats(stats_);
+  }
+}
+
+void TideMatchSet::ResultBuffer::BeginChunk(int begin, int end) {
+  begin_ = begin;
+  end_ = end;
+}
+
+void TideMatchSet::ResultBuffer::EndChunk() {
+  if (sink_->Ordered()) {
+    if (begin_ < end_) {
+      string target, decoy;
+      vector<ScoreIndex::Entry> target_scores;
+      Take(&target, &decoy, &target_scores);
+      sink_->Submit(begin_, end_, target, decoy, target_scores);
+    }
+    begin_ = end_;
+  } else if (Bytes() >= FLUSH_BYTES) {
+    Flush();
+  }
+}
+
+void TideMatchSet::ResultBuffer::Flush() {
+  if (sink_->Ordered()) {
+    // Ordered output is only ever handed over a whole chunk at a time.
+    return;
+  }
+  if (Bytes() > 0) {
+    string target, decoy;
+    vector<ScoreIndex::Entry> target_scores;
+    Take(&target, &decoy, &target_scores);
+    sink_->Write(target, decoy, target_scores);
+  }
+}
+
+void TideMatchSet::ResultBuffer::Mark() {
+  target_mark_ = target_.tellp();
+  decoy_mark_ = decoy_.tellp();
+}
+
+void TideMatchSet::ResultBuffer::SinceMark(string* target, string* decoy) {
+  target->resize(target_.tellp() - target_mark_);
+  target_.seekg(target_mark_);
+  target_.read(&(*target)[0], target->size());
+  decoy->resize(decoy_.tellp() - decoy_mark_);
+  decoy_.seekg(decoy_mark_);
+  decoy_.read(&(*decoy)[0], decoy->size());
+}
+
+void TideMatchSet::ResultBuffer::Append(const string& target, const string& decoy) {
+  if (sink_->IndexesScores() && !target.empty()) {
+    sink_->ScoreIndexIncomplete();
+  }
+  target_.write(target.data(), target.size());
+  decoy_.write(decoy.data(), decoy.size());
+}
+
+size_t TideMatchSet::ResultBuffer::Bytes() {
+  if (sink_->Binary()) {
+    return target_batch_.bytes() + decoy_batch_.bytes();
+  }
+  return (size_t)target_.tellp() + (size_t)decoy_.tellp();
+}
+
+void TideMatchSet::ResultBuffer::Take(
+  string* target,
+  string* decoy,
+  vector<ScoreIndex::Entry>* target_scores
+) {
+  target_scores->swap(target_scores_);
+  target_scores_.clear();
+  if (sink_->Binary()) {
+    target_batch_.appendTo(target);
+    decoy_batch_.appendTo(decoy);
+  } else {
+    *target = target_.str();
+    *decoy = decoy_.str();
+    target_.str("");
+    decoy_.str("");
   }
 }
 
 /**
  * Write headers for tab delimited file
  */
-void TideMatchSet::writeHeaders(ofstream* file, bool decoyFile, bool sp) {
+void TideMatchSet::writeHeaders(ostream* file, bool decoyFile, bool sp) {
   if (!file) {
     return;
   }
@@ -426,7 +973,7 @@ void TideMatchSet::writeHeaders(ofstream* file, bool decoyFile, bool sp) {
     PROTEIN_ID_COL, FLANKING_AA_COL, TARGET_DECOY_COL, ORIGINAL_TARGET_SEQUENCE_COL
   };
   size_t numHeaders = sizeof(headers) / sizeof(int);
-  bool writtenHeader = false;
+  vector<string> names;
   for (size_t i = 0; i < numHeaders; ++i) {
     int header = headers[i];
     if (!sp &&
@@ -435,41 +982,44 @@ void TideMatchSet::writeHeaders(ofstream* file, bool decoyFile, bool sp) {
       continue;
     } else if (header == ORIGINAL_TARGET_SEQUENCE_COL &&
                (TideSearchApplication::proteinLevelDecoys() ||
-                (!decoyFile && !Params::GetBool("concat")))) {
+                (!decoyFile && !GlobalParams::getConcat()))) {
       continue;
     }
-    if (writtenHeader) {
-      *file << '\t';
-    }
     if (header == FILE_COL &&
-        (!Params::GetBool("file-column") || Params::GetBool("peptide-centric-search"))) {
+        (!GlobalParams::getFileColumn() || Params::GetBool("peptide-centric-search"))) {
       continue;
     }
-    if (header == XCORR_SCORE_COL && Params::GetBool("exact-p-value")) {
-      *file << get_column_header(EXACT_PVALUE_COL) << '\t'
-            << get_column_header(REFACTORED_SCORE_COL);
+    if (header == XCORR_SCORE_COL && GlobalParams::getExactPValue()) {
+      names.push_back(get_column_header(EXACT_PVALUE_COL));
+      names.push_back(get_column_header(REFACTORED_SCORE_COL));
       if (Params::GetInt("elution-window-size") > 0) {
-        *file << '\t' << get_column_header(ELUTION_WINDOW_COL);
+        names.push_back(get_column_header(ELUTION_WINDOW_COL));
       }
-      writtenHeader = true;
       continue;
     }
-    if (header == DISTINCT_MATCHES_SPECTRUM_COL) {
-      if (Params::GetBool("peptide-centric-search")) {
-        *file << get_column_header(DISTINCT_MATCHES_PEPTIDE_COL) << '\t';
-        *file << get_column_header(DISTINCT_MATCHES_SPECTRUM_COL);
-      } else {
-        *file << get_column_header(DISTINCT_MATCHES_SPECTRUM_COL);
-      }
-      writtenHeader = true;
-      continue;
+    if (header == DISTINCT_MATCHES_SPECTRUM_COL &&
+        Params::GetBool("peptide-centric-search")) {
+      names.push_back(get_column_header(DISTINCT_MATCHES_PEPTIDE_COL));
     }
-    *file << get_column_header(header);
-    writtenHeader = true;
+    names.push_back(get_column_header(header));
+  }
+  if (binaryOutput()) {
+    BinaryMatchFile::WriteHeader(file, names);
+    return;
+  }
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (i > 0) {
+      *file << '\t';
+    }
+    *file << names[i];
   }
   *file << endl;
 }
 
+bool TideMatchSet::binaryOutput() {
+  return Params::GetString("txt-format") == "binary";
+}
+
 void TideMatchSet::initModMap(const pb::ModTable& modTable, ModPosition position) {
   for (int i = 0; i < modTable.variable_mod_size(); i++) {
     const pb::Modification& mod = modTable.variable_mod(i);
@@ -483,31 +1033,64 @@ void TideMatchSet::initModMap(const pb::ModTable& modTable, ModPosition position
       ModificationDefinition::NewStaticMod(mod.amino_acids(), mod.delta(), position);
     }
   }
+  // Called after MassConstants::Init(), once for each mod table
+  mod_definitions_.resize(MassConstants::NumUniqueDeltas());
+  for (size_t i = 0; i < mod_definitions_.size(); i++) {
+    mod_definitions_[i] = ModificationDefinition::Find(MassConstants::UniqueDelta(i), false);
+  }
 }
 
-Crux::Peptide TideMatchSet::getCruxPeptide(const Peptide* peptide) {
-  return Crux::Peptide(peptide->Seq(), getMods(peptide));
+/**
+ * \returns The definition of the mod with code mod_code, or NULL if there is
+ * none, and sets mod_index to the index of the residue it modifies.
+ */
+const ModificationDefinition* TideMatchSet::findModDefinition(int mod_code, int* mod_index) {
+  int unique_delta_index;
+  MassConstants::DecodeMod(mod_code, mod_index, &unique_delta_index);
+  if (unique_delta_index < (int)mod_definitions_.size() &&
+      mod_definitions_[unique_delta_index] != NULL) {
+    return mod_definitions_[unique_delta_index];
+  }
+  double mod_delta = MassConstants::UniqueDelta(unique_delta_index);
+  const ModificationDefinition* modDef = ModificationDefinition::Find(mod_delta, false);
+  if (modDef == NULL) {
+    carp(CARP_ERROR, "Could not find modification with delta %f", mod_delta);
+  }
+  return modDef;
 }
 
-vector<Crux::Modification> TideMatchSet::getMods(const Peptide* peptide) {
-  vector<Crux::Modification> modVector;
-  string seq(peptide->Seq());
+Crux::Peptide TideMatchSet::getCruxPeptide(const Peptide* peptide) {
+  Crux::Peptide cruxPep(peptide->Seq());
   const ModCoder::Mod* mods;
   int pep_mods = peptide->Mods(&mods);
   for (int i = 0; i < pep_mods; i++) {
     int mod_index;
-    double mod_delta;
-    MassConstants::DecodeMod(mods[i], &mod_index, &mod_delta);
-    const ModificationDefinition* modDef = ModificationDefinition::Find(mod_delta, false);
-    if (modDef == NULL) {
-      carp(CARP_ERROR, "Could not find modification with delta %f", mod_delta);
-      continue;
+    const ModificationDefinition* modDef = findModDefinition(mods[i], &mod_index);
+    if (modDef != NULL) {
+      cruxPep.addMod(modDef, mod_index);
     }
-    modVector.push_back(Crux::Modification(modDef, mod_index));
   }
+  return cruxPep;
+}
+
+vector<Crux::Modification> TideMatchSet::getMods(const Peptide* peptide) {
+  vector<Crux::Modification> modVector;
+  getMods(peptide, &modVector);
   return modVector;
 }
 
+void TideMatchSet::getMods(const Peptide* peptide, vector<Crux::Modification>* mods) {
+  const ModCoder::Mod* codes;
+  int pep_mods = peptide->Mods(&codes);
+  for (int i = 0; i < pep_mods; i++) {
+    int mod_index;
+    const ModificationDefinition* modDef = findModDefinition(codes[i], &mod_index);
+    if (modDef != NULL) {
+      mods->push_back(Crux::Modification(modDef, mod_index));
+    }
+  }
+}
+
 void TideMatchSet::gatherTargetsAndDecoys(
   const ActivePeptideQueue* peptides,
   const ProteinVec& proteins,
@@ -522,7 +1105,7 @@ void TideMatchSet::gatherTargetsAndDecoys(
     make_heap(matches_->begin(), matches_->end(), highScoreBest ? lessXcorrScore : moreXcorrScore);
   }
   
-  if (!Params::GetBool("concat") && TideSearchApplication::hasDecoys()) {
+  if (!GlobalParams::getConcat() && TideSearchApplication::hasDecoys()) {
     for (Arr::iterator i = matches_->end(); i != matches_->begin(); ) {
       if (exact_pval_search_) {
         pop_heap(matches_->begin(), i--, highScoreBest ? lessXcorrPvalScore : moreXcorrPvalScore);
@@ -530,7 +1113,7 @@ void TideMatchSet::gatherTargetsAndDecoys(
         pop_heap(matches_->begin(), i--, highScoreBest ? lessXcorrScore : moreXcorrScore);
       }
 
-      const Peptide& peptide = *(peptides->GetPeptide(i->rank));
+      const Peptide& peptide = *(getPeptide(peptides, i->rank));
       const pb::Protein& protein = *(proteins[peptide.FirstLocProteinId()]);
       vector<Arr::iterator>* vec_ptr = !peptide.IsDecoy() ? &targetsOut : &decoysOut;
       if (vec_ptr->size() < top_n + 1) {
@@ -550,31 +1133,81 @@ void TideMatchSet::gatherTargetsAndDecoys(
   }
 }
 
-/**
- * Create a pb peptide from Tide peptide
- */
-pb::Peptide* TideMatchSet::getPbPeptide(const Peptide& peptide) {
-  pb::Peptide* pb_peptide = new pb::Peptide();
-  pb_peptide->set_id(peptide.Id());
-  pb_peptide->set_mass(peptide.Mass());
-  pb_peptide->set_length(peptide.Len());
-  if (peptide.HasAuxLocationsIndex()) {
-    pb_peptide->set_aux_locations_index(peptide.AuxLocationsIndex());
+void TideMatchSet::clearLocationCache() {
+  ++location_generation_;
+}
+
+SpScorer* TideMatchSet::getSpScorer(
+  const ProteinVec& proteins,
+  const Spectrum* spectrum,
+  int charge
+) const {
+  SpScorerCache* cache = sp_scorer_cache_.get();
+  if (cache == NULL || cache->generation != location_generation_) {
+    cache = new SpScorerCache();
+    sp_scorer_cache_.reset(cache);
+  }
+  SpScorerCache::EntryMap::key_type key(spectrum, charge);
+  SpScorerCache::EntryMap::iterator found = cache->entries.find(key);
+  if (found != cache->entries.end()) {
+    return found->second;
   }
+  if (cache->entries.size() >= SpScorerCache::SP_SCORER_CACHE_SIZE) {
+    cache->Clear();
+  }
+  SpScorer* sp_scorer = new SpScorer(proteins, *spectrum, charge, max_mz_);
+  cache->entries[key] = sp_scorer;
+  return sp_scorer;
+}
 
-  // Copy over all the modifications for this Peptide
-  const ModCoder::Mod* mods;
-  int pep_mods = peptide.Mods(&mods);
-  for (int i = 0; i < pep_mods; ++i) {
-    pb_peptide->add_modifications(mods[i]);
+const TideMatchSet::Locations& TideMatchSet::getLocations(
+  const Peptide* peptide,
+  const ProteinVec& proteins,
+  const AuxLocations& locations
+) {
+  LocationCache* cache = location_cache_.get();
+  if (cache == NULL || cache->generation != location_generation_) {
+    cache = new LocationCache();
+    location_cache_.reset(cache);
+  }
+  LocationCache::EntryMap::key_type key(peptide->Mass(),
+    make_pair(peptide->Id(), peptide->IsDecoy()));
+  LocationCache::EntryMap::iterator found = cache->entries.find(key);
+  if (found != cache->entries.end()) {
+    return found->second;
   }
+  if (cache->entries.size() >= LocationCache::LOCATION_CACHE_SIZE) {
+    LocationCache::EntryMap::iterator end = cache->entries.begin();
+    advance(end, LocationCache::LOCATION_CACHE_SIZE / 2);
+    cache->entries.erase(cache->entries.begin(), end);
+  }
+  Locations& entry = cache->entries[key];
 
-  // Copy over the Peptide's first location within the first protein
-  pb::Location* first_location = pb_peptide->mutable_first_location();
-  first_location->set_protein_id(peptide.FirstLocProteinId());
-  first_location->set_pos(peptide.FirstLocPos());
+  const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
+  int pos = peptide->FirstLocPos();
+  // A decoy made during the search has the locations of its target
+  bool searchDecoy = peptide->IsDecoy() && TideSearchApplication::searchTimeDecoys();
+  string decoyPrefix = searchDecoy ? GlobalParams::getDecoyPrefix() : "";
+  string n_term, c_term;
+  entry.protein_names = decoyPrefix + getProteinName(*protein,
+    (!protein->has_target_pos()) ? pos : protein->target_pos());
+  getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
+  entry.flanking_aas = n_term + c_term;
 
-  return pb_peptide;
+  // look for other locations
+  if (peptide->HasAuxLocationsIndex()) {
+    int aux = peptide->AuxLocationsIndex();
+    for (int i = 0; i < locations.NumLocations(aux); ++i) {
+      protein = proteins[locations.ProteinId(aux, i)];
+      pos = locations.Pos(aux, i);
+      entry.protein_names += "," + decoyPrefix + getProteinName(*protein,
+        (!protein->has_target_pos()) ? pos : protein->target_pos());
+      getFlankingAAs(peptide, protein, pos, &n_term, &c_term);
+      entry.flanking_aas += "," + n_term + c_term;
+    }
+  }
+  entry.last_protein = protein;
+  return entry;
 }
 
 /**
@@ -611,14 +1244,14 @@ void TideMatchSet::computeDeltaCns(
 ) {
   vector<FLOAT_T> scores;
   for (vector<Arr::iterator>::const_iterator i = vec.begin(); i != vec.end(); i++) {
-    if (Params::GetBool("exact-p-value")) {
+    if (GlobalParams::getExactPValue()) {
       scores.push_back((*i)->xcorr_pval);
     } else {
       scores.push_back((*i)->xcorr_score);
     }
   }
   vector< pair<FLOAT_T, FLOAT_T> > deltaCns = MatchCollection::calculateDeltaCns(
-    scores, !Params::GetBool("exact-p-value") ? XCORR : TIDE_SEARCH_EXACT_PVAL);
+    scores, !GlobalParams::getExactPValue() ? XCORR : TIDE_SEARCH_EXACT_PVAL);
   for (int i = 0; i < vec.size(); i++) {
     delta_cn_map->insert(make_pair(vec[i], deltaCns[i].first));
     delta_lcn_map->insert(make_pair(vec[i], deltaCns[i].second));
@@ -631,14 +1264,17 @@ void TideMatchSet::computeSpData(
   SpScorer* sp_scorer,
   const ActivePeptideQueue* peptides
 ) {
+  vector<const Peptide*> vecPeptides;
+  vecPeptides.reserve(vec.size());
+  for (vector<Arr::iterator>::const_iterator i = vec.begin(); i != vec.end(); ++i) {
+    vecPeptides.push_back(getPeptide(peptides, (*i)->rank));
+  }
+  vector<SpScorer::SpScoreData> scores;
+  sp_scorer->Score(vecPeptides, &scores);
   vector< pair<Arr::iterator, SpScorer::SpScoreData> > spData;
   spData.reserve(vec.size());
-  for (vector<Arr::iterator>::const_iterator i = vec.begin(); i != vec.end(); ++i) {
-    spData.push_back(make_pair(*i, SpScorer::SpScoreData()));
-    const Peptide& peptide = *(peptides->GetPeptide((*i)->rank));
-    pb::Peptide* pb_peptide = getPbPeptide(peptide);
-    sp_scorer->Score(*pb_peptide, spData.back().second);
-    delete pb_peptide;
+  for (size_t i = 0; i < vec.size(); ++i) {
+    spData.push_back(make_pair(vec[i], scores[i]));
   }
   sort(spData.begin(), spData.end(), spGreater());
   for (size_t i = 0; i < spData.size(); ++i) {
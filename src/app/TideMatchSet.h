@@ -2,15 +2,21 @@
 #define TIDE_MATCH_SET_H
 
 #include <boost/thread.hpp>
+#include <map>
+#include <sstream>
 #include <vector>
 #include "raw_proteins.pb.h"
 #include "tide/records.h"
 #include "tide/active_peptide_queue.h"  // no include guard
+#include "tide/aux_locations.h"
 #include "tide/fixed_cap_array.h"
 #include "tide/peptide.h"
 #include "tide/sp_scorer.h"
 #include "tide/spectrum_collection.h"
 
+#include "io/BinaryMatchFile.h"
+#include "io/QCStatistics.h"
+#include "io/ScoreIndex.h"
 #include "model/Modification.h"
 #include "model/PostProcessProtein.h"
 
@@ -40,6 +46,211 @@ class TideMatchSet {
   };
   typedef FixedCapacityArray<Scores> Arr;
 
+  /**
+   * Destination for spectrum-centric results shared by all search threads.
+   * Threads format their PSMs into a ResultBuffer of their own, without any
+   * locking, and hand the text to the sink in large batches. In ordered mode
+   * each batch holds the output of one chunk of consecutive spectrum-charge
+   * pairs, and the batches are written in spectrum-charge order, so the files
+   * do not depend on the number of threads: they are the same, byte for byte,
+   * as those of a single-threaded search. Chunks that finish ahead of their
+   * turn wait in a reorder buffer keyed on their first spectrum-charge pair.
+   * When threads hand over their chunks in increasing order, a thread whose
+   * chunk is not next waits while the reorder buffer holds pending_limit_, so
+   * one slow chunk cannot make the buffer grow without bound. With
+   * txt-format = binary the batches are blocks of a binary match file (see
+   * BinaryMatchFile.h).
+   *
+   * The files are written by a writer thread of the sink's own, so a slow
+   * filesystem does not hold up scoring. Batches collect in a pair of
+   * buffers while the writer writes out the previous pair; search threads
+   * wait only when the buffers already hold pending_limit_.
+   *
+   * With qc-report, each thread also collects QC statistics of the matches
+   * it reports, and the sink merges them as the threads finish.
+   *
+   * With a score index, each thread also notes the score of every text row
+   * it formats for the target file, and the sink adds the rows, at their
+   * offsets in the file, to the index as it hands their text to the writer.
+   */
+  class ResultSink {
+   public:
+    /**
+     * in_order_chunks says that each thread submits its chunks in increasing
+     * order, which lets the reorder buffer be bounded.
+     */
+    ResultSink(ostream* target_file, ostream* decoy_file, bool ordered,
+               bool in_order_chunks = false);
+    ~ResultSink();
+
+    bool Ordered() const { return ordered_; }
+    bool Binary() const { return binary_; }
+    bool CollectsStats() const { return collect_stats_; }
+
+    /**
+     * Merge a thread's QC statistics into those of the sink.
+     */
+    void AddStats(const QCStatistics& stats);
+    const QCStatistics& Stats() const { return stats_; }
+
+    /**
+     * Add the rows written to the target file from now on to index (text
+     * output only). Not once the threads have started.
+     */
+    void SetScoreIndex(ScoreIndex* index);
+    bool IndexesScores() const { return score_index_ != NULL; }
+
+    /**
+     * Whether every row written for the index is in it; text that was not
+     * formatted row by row, as from a result memo, leaves it incomplete.
+     */
+    bool ScoreIndexComplete() const { return score_index_complete_; }
+    void ScoreIndexIncomplete();
+
+    /**
+     * Write a batch immediately (unordered mode). target_scores are the
+     * index entries of the rows of target, at their offsets in it.
+     */
+    void Write(const string& target, const string& decoy,
+               const vector<ScoreIndex::Entry>& target_scores);
+
+    /**
+     * Queue the output of spectrum-charge pairs [begin, end); it is written
+     * once everything before begin has been written (ordered mode).
+     */
+    void Submit(int begin, int end, const string& target, const string& decoy,
+                const vector<ScoreIndex::Entry>& target_scores);
+
+    /**
+     * Start the output at spectrum-charge pair first rather than 0, as when
+     * resuming a search (ordered mode).
+     */
+    void Resume(int first) { next_ = first; }
+
+    /**
+     * Every interval seconds, and when the sink finishes, have the writer
+     * record in path the given position of the search, the number of
+     * spectrum-charge pairs whose results have been written and the offsets
+     * the results files have been flushed to (ordered mode).
+     */
+    void SetCheckpoint(const string& path, const string& position, double interval);
+
+    /**
+     * Write out everything handed to the sink, stop the writer thread and
+     * report how long it spent writing.
+     */
+    void Finish();
+
+   private:
+    struct PendingChunk {
+      int end;
+      string target;
+      string decoy;
+      vector<ScoreIndex::Entry> target_scores;
+    };
+
+    void WriteUnlocked(const string& target, const string& decoy,
+                       const vector<ScoreIndex::Entry>& target_scores);
+    void WaitForRoom(boost::mutex::scoped_lock& lock);
+    void WaitForTurn(boost::mutex::scoped_lock& lock, int begin);
+    void WriterLoop();
+    void WriteCheckpoint(int written);
+
+    boost::mutex mutex_;
+    boost::condition_variable cond_;
+    ostream* target_file_;
+    ostream* decoy_file_;
+    bool ordered_;
+    bool in_order_chunks_;
+    bool binary_;
+    int next_;  // first spectrum-charge pair not yet written (ordered mode)
+    map<int, PendingChunk> pending_;
+    size_t pending_bytes_;
+    // Search threads wait once this much output is waiting to be written,
+    // or to take its turn in ordered mode (output-pending-bytes).
+    size_t pending_limit_;
+    string target_buffer_;  // handed over, not yet taken by the writer
+    string decoy_buffer_;
+    bool finished_;
+    bool collect_stats_;
+    QCStatistics stats_;
+    double write_time_;  // microseconds the writer spent writing
+    double wait_time_;  // microseconds search threads waited for room
+    string checkpoint_path_;  // empty for no checkpoints
+    string checkpoint_position_;
+    double checkpoint_interval_;  // microseconds
+    double last_checkpoint_;
+    ScoreIndex* score_index_;  // NULL for none
+    uint64_t score_index_offset_;  // of the next target text handed over
+    bool score_index_complete_;
+    boost::thread writer_;
+  };
+
+  /**
+   * One search thread's buffered output; see ResultSink.
+   */
+  class ResultBuffer {
+   public:
+    explicit ResultBuffer(ResultSink* sink);
+    ~ResultBuffer();
+
+    ostream* Target() { return &target_; }
+    ostream* Decoy() { return &decoy_; }
+    bool Binary() const { return sink_->Binary(); }
+    BinaryMatchBatch* TargetBatch() { return &target_batch_; }
+    BinaryMatchBatch* DecoyBatch() { return &decoy_batch_; }
+    // NULL unless the sink collects QC statistics.
+    QCStatistics* Stats() { return sink_->CollectsStats() ? &stats_ : NULL; }
+    // NULL unless the sink keeps a score index; offsets are in Target().
+    vector<ScoreIndex::Entry>* TargetScores() {
+      return sink_->IndexesScores() ? &target_scores_ : NULL;
+    }
+
+    /**
+     * Mark the start and end of a chunk of spectrum-charge pairs [begin, end)
+     * claimed by this thread.
+     */
+    void BeginChunk(int begin, int end);
+    void EndChunk();
+
+    /**
+     * Hand everything buffered so far to the sink (unordered mode).
+     */
+    void Flush();
+
+    /**
+     * The text reported since the last Mark(), for a memo of the results
+     * (see result_memo.h), and memoized text to take the place of a report.
+     * Text output only.
+     */
+    void Mark();
+    void SinceMark(string* target, string* decoy);
+    void Append(const string& target, const string& decoy);
+
+   private:
+    // Unordered buffers are handed over once they grow past this size.
+    static const size_t FLUSH_BYTES = 1 << 20;
+
+    size_t Bytes();
+
+    /**
+     * Move everything buffered so far into target and decoy.
+     */
+    void Take(string* target, string* decoy, vector<ScoreIndex::Entry>* target_scores);
+
+    ResultSink* sink_;
+    stringstream target_;
+    stringstream decoy_;
+    BinaryMatchBatch target_batch_;
+    BinaryMatchBatch decoy_batch_;
+    QCStatistics stats_;
+    vector<ScoreIndex::Entry> target_scores_;
+    int begin_;
+    int end_;
+    streampos target_mark_;
+    streampos decoy_mark_;
+  };
+
   // Matches will be an array of pairs, (score, counter), where counter refers
   // to the index within the ActivePeptideQueue, counting from the back.  This
   // slight complication is due to the way the generated machine code fills the
@@ -55,16 +266,30 @@ class TideMatchSet {
   
   ~TideMatchSet();
 
+  /**
+   * Take the peptide of each match from peptides, indexed by rank, instead of
+   * from the ActivePeptideQueue given to report(), with targets and decoys
+   * candidates in all. For matches gathered over several blocks of the index
+   * (see open-search-block-size), whose peptides are no longer in any queue.
+   */
+  void SetPeptides(const vector<const Peptide*>* peptides, int targets, int decoys);
+
+  /**
+   * The number of candidates the spectrum was scored against, for matches
+   * that hold only the best of them. By default it is the number of matches.
+   */
+  void SetCandidates(int candidates) { candidates_ = candidates; }
+
     /**
    * Write peptide centric matches to output files
    */
   void report(
-    ofstream* target_file,  ///< target file to write to
-    ofstream* decoy_file, ///< decoy file to write to
+    ostream* target_file,  ///< target file to write to
+    ostream* decoy_file, ///< decoy file to write to
     int top_matches,
     const ActivePeptideQueue* peptides, ///< peptide queue
     const ProteinVec& proteins, ///< proteins corresponding with peptides
-    const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
+    const AuxLocations& locations,  ///< auxiliary locations
     bool compute_sp ///< whether to compute sp or not
   );
 
@@ -72,28 +297,43 @@ class TideMatchSet {
    * Write spectrum centric to output files
    */
   void report(
-    ofstream* target_file,  ///< target file to write to
-    ofstream* decoy_file, ///< decoy file to write to
+    ostream* target_file,  ///< target file to write to
+    ostream* decoy_file, ///< decoy file to write to
     int top_n,  ///< number of matches to report
     const string& spectrum_filename, ///< name of spectrum file
     const Spectrum* spectrum, ///< spectrum for matches
     int charge, ///< charge for matches
+    double precursor_mz, ///< precursor m/z of the charge state
     const ActivePeptideQueue* peptides, ///< peptide queue
     const ProteinVec& proteins, ///< proteins corresponding with peptides
-    const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
+    const AuxLocations& locations,  ///< auxiliary locations
     bool compute_sp, ///< whether to compute sp or not
     bool highScoreBest, //< indicates semantics of score magnitude
-    boost::mutex * rwlock
+    ResultBuffer* buffer ///< thread's output buffer, or NULL to write directly
   );
 
   static void writeHeaders(
-    ofstream* file,
+    ostream* file,
     bool decoyFile,
     bool sp
   );
 
+  /**
+   * \returns Whether tab-delimited results are written in the binary
+   * format (txt-format = binary).
+   */
+  static bool binaryOutput();
+
   static void initModMap(const pb::ModTable& modTable, ModPosition position);
   static std::vector<Crux::Modification> getMods(const Peptide* peptide);
+  // Appends the mods of peptide to mods
+  static void getMods(const Peptide* peptide, std::vector<Crux::Modification>* mods);
+
+  /**
+   * Forget the cached protein names and flanking residues of reported
+   * peptides, before a search with different proteins.
+   */
+  static void clearLocationCache();
 
   static string CleavageType;
 
@@ -103,34 +343,81 @@ class TideMatchSet {
   Peptide* peptide_;  
   double max_mz_;
 
+  // Set by SetPeptides().
+  const vector<const Peptide*>* peptides_;
+  int targets_, decoys_;
+  // Set by SetCandidates(), or -1.
+  int candidates_;
+
+  const Peptide* getPeptide(const ActivePeptideQueue* peptides, int rank) const {
+    return peptides_ ? (*peptides_)[rank] : peptides->GetPeptide(rank);
+  }
+  int activeTargets(const ActivePeptideQueue* peptides) const {
+    return peptides_ ? targets_ : peptides->ActiveTargets();
+  }
+  int activeDecoys(const ActivePeptideQueue* peptides) const {
+    return peptides_ ? decoys_ : peptides->ActiveDecoys();
+  }
+
   // For allocation
   static char match_collection_loc_[sizeof(MatchCollection)];
   static char decoy_match_collection_loc_[sizeof(MatchCollection)];
 
+  /**
+   * The protein names and flanking residues of a peptide, as reported.
+   */
+  struct Locations {
+    string protein_names;
+    string flanking_aas;
+    const pb::Protein* last_protein;  // of the last location
+  };
+
+  // Each thread's recently reported peptides; see getLocations().
+  struct LocationCache;
+  static boost::thread_specific_ptr<LocationCache> location_cache_;
+  static int location_generation_;  // bumped by clearLocationCache()
+
+  // The definition of each unique delta of MassConstants, so that reporting a
+  // mod need not search the definitions by mass; built by initModMap()
+  static std::vector<const ModificationDefinition*> mod_definitions_;
+  static const ModificationDefinition* findModDefinition(int mod_code, int* mod_index);
+
+  // Each thread's Sp preprocessing of recently reported spectra; see
+  // getSpScorer().
+  struct SpScorerCache;
+  static boost::thread_specific_ptr<SpScorerCache> sp_scorer_cache_;
+
+  // Matches are ordered by score, and those with equal scores by rank, the
+  // higher rank being the better, so that the matches reported, and their
+  // order, do not depend on the order of the array.
   static bool lessXcorrScore(const Scores& x, const Scores& y) {
-    return x.xcorr_score < y.xcorr_score;
+    return x.xcorr_score < y.xcorr_score ||
+      (x.xcorr_score == y.xcorr_score && x.rank < y.rank);
   }
   
   static bool moreXcorrScore(const Scores& x, const Scores& y) {
-    return x.xcorr_score > y.xcorr_score;
+    return x.xcorr_score > y.xcorr_score ||
+      (x.xcorr_score == y.xcorr_score && x.rank < y.rank);
   }
 
   static bool lessXcorrPvalScore(const Scores& x, const Scores& y) {
-    return x.xcorr_pval < y.xcorr_pval;
+    return x.xcorr_pval < y.xcorr_pval ||
+      (x.xcorr_pval == y.xcorr_pval && x.rank < y.rank);
   }
 
   static bool moreXcorrPvalScore(const Scores& x, const Scores& y) {
-    return x.xcorr_pval > y.xcorr_pval;
+    return x.xcorr_pval > y.xcorr_pval ||
+      (x.xcorr_pval == y.xcorr_pval && x.rank < y.rank);
   }
 
 /**
    * Helper function for tab delimited report function for peptide centric
    */
   void writeToFile(
-    ofstream* file,
+    ostream* file,
     const ActivePeptideQueue* peptides,
     const ProteinVec& proteins,
-    const vector<const pb::AuxLocation*>& locations,
+    const AuxLocations& locations,
     bool compute_sp ///< whether to compute sp or not
   );
   
@@ -138,19 +425,41 @@ class TideMatchSet {
    * Helper function for tab delimited report function
    */
   void writeToFile(
-    ofstream* file,
+    ostream* file,
     int top_n,
     const vector<Arr::iterator>& vec,
     const string& spectrum_filename,
     const Spectrum* spectrum,
     int charge,
+    double precursor_mz,
     const ActivePeptideQueue* peptides,
     const ProteinVec& proteins,
-    const vector<const pb::AuxLocation*>& locations,
+    const AuxLocations& locations,
     const map<Arr::iterator, FLOAT_T>& delta_cn_map,
     const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
     const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
-    boost::mutex * rwlock
+    vector<ScoreIndex::Entry>* scores = NULL  ///< for the rows, if not NULL
+  );
+
+  /**
+   * Writes the fields of the rows of the matches for writeToFile to row,
+   * a TextRow or a BinaryRow (see TideMatchSet.cpp).
+   */
+  template<typename Row>
+  void writeRows(
+    Row* row,
+    int top_n,
+    const vector<Arr::iterator>& vec,
+    const string& spectrum_filename,
+    const Spectrum* spectrum,
+    int charge,
+    double precursor_mz,
+    const ActivePeptideQueue* peptides,
+    const ProteinVec& proteins,
+    const AuxLocations& locations,
+    const map<Arr::iterator, FLOAT_T>& delta_cn_map,
+    const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
+    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
   );
 
   Crux::Peptide getCruxPeptide(const Peptide* peptide);
@@ -165,12 +474,25 @@ class TideMatchSet {
   );
 
   /**
-   * Create a pb peptide from Tide peptide
+   * \returns The Locations of peptide, from the calling thread's cache of
+   * recently reported peptides if it is there.
    */
-  static pb::Peptide* getPbPeptide(
-    const Peptide& peptide
+  static const Locations& getLocations(
+    const Peptide* peptide,
+    const ProteinVec& proteins,
+    const AuxLocations& locations
   );
 
+  /**
+   * \returns An SpScorer for spectrum at charge, from the calling thread's
+   * cache if the spectrum was reported recently.
+   */
+  SpScorer* getSpScorer(
+    const ProteinVec& proteins,
+    const Spectrum* spectrum,
+    int charge
+  ) const;
+
   /**
    * Gets the protein name with the index appended.
    */
@@ -196,7 +518,7 @@ class TideMatchSet {
     map<Arr::iterator, FLOAT_T>* delta_lcn_map
   );
 
-  static void computeSpData(
+  void computeSpData(
     const vector<Arr::iterator>& vec,
     map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_rank_map,
     SpScorer* sp_scorer,
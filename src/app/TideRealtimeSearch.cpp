@@ -0,0 +1,176 @@
+/**
+ * \file TideRealtimeSearch.cpp
+ * \brief Searches single spectra from memory against an index kept resident,
+ * for real-time search during acquisition
+ ************************************************************/
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include "TideRealtimeSearch.h"
+#include "app/tide/mass_constants.h"
+#include "app/tide/max_mz.h"
+#include "app/tide/peak_index.h"
+#include "app/tide/records_to_vector-inl.h"
+#include "app/tide/spectrum_preprocess.h"
+#include "io/carp.h"
+#include "util/FileUtils.h"
+#include "util/Instrumentation.h"
+#include "util/Params.h"
+#include "util/StringUtils.h"
+
+using namespace std;
+
+TideRealtimeSearch::TideRealtimeSearch(const string& index, double highest_mz,
+                                       int top_k, int latency_samples)
+  : peptide_reader_(NULL), queue_(NULL), num_peptides_(0), top_k_(top_k),
+    observed_(NULL), latencies_(max(0, latency_samples)), num_searches_(0) {
+  string peptides_file = FileUtils::Join(index, "pepix");
+  string proteins_file = FileUtils::Join(index, "protix");
+  carp(CARP_INFO, "Reading index %s for real-time search", index.c_str());
+
+  pb::Header protein_header;
+  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins_,
+      proteins_file, &protein_header)) {
+    carp(CARP_FATAL, "Error reading index (%s)", proteins_file.c_str());
+  }
+  peptide_reader_ = new HeadedRecordReader(peptides_file, &peptides_header_, -1,
+                                           Params::GetBool("mmap-index"));
+  if ((peptides_header_.file_type() != pb::Header::PEPTIDES) ||
+      !peptides_header_.has_peptides_header()) {
+    carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
+  }
+  if (Params::GetBool("exact-p-value")) {
+    carp(CARP_WARNING, "Real-time search scores XCorr only; ignoring exact-p-value.");
+  }
+
+  const pb::Header::PeptidesHeader& pepHeader = peptides_header_.peptides_header();
+  double bin_width = Params::GetDouble("mz-bin-width");
+  double bin_offset = Params::GetDouble("mz-bin-offset");
+  MassConstants::Init(&pepHeader.mods(), &pepHeader.nterm_mods(),
+                      &pepHeader.cterm_mods(), bin_width, bin_offset);
+  // The programs are compiled for the peaks up to highest_mz.
+  MaxBin::SetGlobalMax(highest_mz);
+
+  queue_ = new ActivePeptideQueue(peptide_reader_->Reader(), proteins_,
+    PeakIndexScorer::Select(Params::GetString("scoring-backend")));
+  queue_->SetBinSize(bin_width, bin_offset);
+  queue_->UseStoredPeaks(pepHeader.has_peaks_bin_width() &&
+                         pepHeader.peaks_bin_width() == bin_width &&
+                         pepHeader.peaks_bin_offset() == bin_offset);
+  if (pepHeader.search_time_mods()) {
+    queue_->ExpandMods(pepHeader);
+  }
+  string search_decoys = Params::GetString("search-decoys");
+  if ((DECOY_TYPE_T)pepHeader.decoys() == NO_DECOYS && search_decoys != "none") {
+    string seed = Params::GetString("seed");
+    queue_->GenerateDecoys(search_decoys == "shuffle", seed == "time" ?
+      (unsigned int)time(NULL) : StringUtils::FromString<unsigned>(seed));
+  }
+  // The whole index as one block, so that a spectrum of any mass finds its
+  // candidates already compiled.
+  num_peptides_ = queue_->LoadBlock(numeric_limits<int>::max());
+  carp(CARP_INFO, "Holding %d peptides for real-time search.", num_peptides_);
+
+  window_type_ = string_to_window_type(Params::GetString("precursor-window-type"));
+  precursor_window_ = Params::GetDouble("precursor-window");
+  max_charge_ = Params::GetInt("max-precursor-charge");
+  negative_isotope_errors_ = search_.getNegativeIsotopeErrors();
+
+  observed_ = new ObservedPeakSet(bin_width, bin_offset,
+                                  Params::GetBool("use-neutral-loss-peaks"),
+                                  Params::GetBool("use-flanking-peaks"));
+  min_mass_.reserve(negative_isotope_errors_.size());
+  max_mass_.reserve(negative_isotope_errors_.size());
+  for (int i = 0; i < 2; i++) {
+    best_[i].reserve(top_k_);
+  }
+  matches_.reserve(2 * top_k_);
+  sorted_latencies_.reserve(latencies_.size());
+}
+
+TideRealtimeSearch::~TideRealtimeSearch() {
+  delete observed_;
+  delete queue_;
+  delete peptide_reader_;
+  for (ProteinVec::iterator i = proteins_.begin(); i != proteins_.end(); ++i) {
+    delete const_cast<pb::Protein*>(*i);
+  }
+}
+
+int TideRealtimeSearch::search(const Spectrum& spectrum, int charge, Listener* listener) {
+  CRUX_TIME_STAGE(STAGE_REALTIME_SEARCH);
+  double start = wall_clock();
+  SpectrumCollection::SpecCharge sc((spectrum.PrecursorMZ() - MASS_PROTON) * charge,
+                                    charge, const_cast<Spectrum*>(&spectrum), 0);
+  min_mass_.clear();
+  max_mass_.clear();
+  double min_range, max_range;
+  search_.computeWindow(sc, window_type_, precursor_window_, max_charge_,
+                        &negative_isotope_errors_, &min_mass_, &max_mass_,
+                        &min_range, &max_range);
+  candidate_status_.clear();
+  int candidates = queue_->SelectActiveRange(&min_mass_, &max_mass_, &candidate_status_);
+  ActivePeptideQueue::Selection selection = queue_->GetSelection();
+  best_[0].clear();
+  best_[1].clear();
+  if (candidates > 0) {
+    observed_->PreprocessSpectrum(spectrum, charge);
+    int queue_size = candidate_status_.size();
+    scores_.Reserve(queue_size);
+    search_.collectScoresCompiled(queue_, &spectrum, *observed_, &scores_,
+                                  queue_size, charge);
+    for (TideMatchSet::Arr2::iterator it = scores_.begin(); it != scores_.end(); ++it) {
+      if (!candidate_status_[queue_size - it->second]) {
+        continue;
+      }
+      const Peptide* peptide = *(selection.end - it->second);
+      TideSearchApplication::keepMatch(&best_[peptide->IsDecoy() ? 1 : 0], *it, top_k_);
+    }
+  }
+  matches_.clear();
+  for (int i = 0; i < 2; i++) {
+    sort_heap(best_[i].begin(), best_[i].end(), greater< pair<int, int> >());
+    for (vector< pair<int, int> >::const_iterator j = best_[i].begin();
+         j != best_[i].end(); ++j) {
+      Match match = { *(selection.end - j->second),
+                      j->first / TideSearchApplication::XCORR_SCALING };
+      matches_.push_back(match);
+    }
+  }
+  if (!latencies_.empty()) {
+    latencies_[num_searches_ % latencies_.size()] = wall_clock() - start;
+  }
+  ++num_searches_;
+  if (listener != NULL) {
+    listener->SpectrumSearched(spectrum, charge, matches_.empty() ? NULL : &matches_[0],
+                               best_[0].size(), best_[1].size(), candidates);
+  }
+  return candidates;
+}
+
+double TideRealtimeSearch::latencyPercentile(double fraction) const {
+  size_t n = min((long long)latencies_.size(), num_searches_);
+  if (n == 0) {
+    return 0;
+  }
+  sorted_latencies_.assign(latencies_.begin(), latencies_.begin() + n);
+  size_t k = min(n - 1, (size_t)(max(0.0, fraction) * n));
+  nth_element(sorted_latencies_.begin(), sorted_latencies_.begin() + k,
+              sorted_latencies_.end());
+  return sorted_latencies_[k];
+}
+
+void TideRealtimeSearch::logLatencies() const {
+  carp(CARP_INFO, "Real-time search latencies over the last %d of %lld searches "
+       "(us): median %.0f, 90%% %.0f, 99%% %.0f, 99.9%% %.0f.",
+       (int)min((long long)latencies_.size(), num_searches_), num_searches_,
+       latencyPercentile(0.5), latencyPercentile(0.9), latencyPercentile(0.99),
+       latencyPercentile(0.999));
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
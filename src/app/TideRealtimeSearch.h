@@ -0,0 +1,115 @@
+/**
+ * \file TideRealtimeSearch.h
+ * \brief Searches single spectra from memory against an index kept resident,
+ * for real-time search during acquisition
+ ***********************************************************/
+#ifndef TIDEREALTIMESEARCH_H
+#define TIDEREALTIMESEARCH_H
+
+#include "TideSearchApplication.h"
+
+#include <string>
+#include <vector>
+
+class HeadedRecordReader;
+
+/**
+ * Keeps the whole peptide index of a tide-index directory in memory, compiled
+ * for scoring, and searches one spectrum at a time as it is handed over, with
+ * the tide-search parameters (precursor window, isotope errors, bins, scoring
+ * backend and decoys) given when it is made. Once the first searches have
+ * grown its scratch space to the largest window, a search allocates nothing.
+ * An object serves one thread at a time; each thread may have its own.
+ */
+class TideRealtimeSearch {
+
+ public:
+
+  struct Match {
+    const Peptide* peptide;  // valid for the lifetime of the object
+    double xcorr;
+  };
+
+  /**
+   * Receives the matches of each search, best first: the top_k targets and
+   * then the top_k decoys, if the index has any.
+   */
+  class Listener {
+   public:
+    virtual ~Listener() {}
+    virtual void SpectrumSearched(const Spectrum& spectrum, int charge,
+                                  const Match* matches, int num_targets,
+                                  int num_decoys, int candidates) = 0;
+  };
+
+  /**
+   * Reads the index, for spectra with no peak above highest_mz, keeping
+   * the top_k best targets and decoys of each search and the latencies of
+   * the last latency_samples searches.
+   */
+  TideRealtimeSearch(const std::string& index, double highest_mz, int top_k,
+                     int latency_samples = 10000);
+
+  ~TideRealtimeSearch();
+
+  /**
+   * Searches spectrum at charge and passes its matches to listener.
+   * \returns the number of candidates scored.
+   */
+  int search(const Spectrum& spectrum, int charge, Listener* listener);
+
+  /**
+   * \returns the number of peptides held, decoys included.
+   */
+  int size() const { return num_peptides_; }
+
+  const ProteinVec& proteins() const { return proteins_; }
+
+  /**
+   * \returns the latency, in microseconds, that the given fraction of the
+   * recorded searches took at most, or 0 before the first search.
+   */
+  double latencyPercentile(double fraction) const;
+
+  /**
+   * Logs the median, 90th, 99th and 99.9th percentiles of the latencies.
+   */
+  void logLatencies() const;
+
+ private:
+
+  TideSearchApplication search_;
+  ProteinVec proteins_;
+  pb::Header peptides_header_;
+  HeadedRecordReader* peptide_reader_;
+  ActivePeptideQueue* queue_;
+  int num_peptides_;
+
+  WINDOW_TYPE_T window_type_;
+  double precursor_window_;
+  int max_charge_;
+  vector<int> negative_isotope_errors_;
+  int top_k_;
+
+  // Scratch space, reused by every search
+  ObservedPeakSet* observed_;
+  vector<double> min_mass_, max_mass_;
+  vector<bool> candidate_status_;
+  TideMatchSet::Arr2 scores_;
+  vector< pair<int, int> > best_[2];
+  vector<Match> matches_;
+
+  // The latencies of the last searches, as a ring
+  vector<double> latencies_;
+  long long num_searches_;
+  mutable vector<double> sorted_latencies_;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
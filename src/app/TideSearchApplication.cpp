@@ -1,22 +1,59 @@
 #include <cstdio>
-#include "app/tide/abspath.h"
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include "app/tide/content_hash.h"
+#include "app/tide/index_shards.h"
+#include "app/tide/memory_plan.h"
+#include "app/tide/numa.h"
+#include "app/tide/preprocessed_store.h"
+#include "app/tide/result_memo.h"
 #include "app/tide/records_to_vector-inl.h"
+#include "app/tide/scan_index.h"
+#include "app/tide/search_cluster.h"
+#include "app/tide/spectrum_clusters.h"
 
 #include "io/carp.h"
+#include "io/DelimitedFileReader.h"
 #include "parameter.h"
+#include "io/SpectrumCache.h"
+#include "io/SpectrumCollectionFactory.h"
 #include "io/SpectrumRecordWriter.h"
 #include "TideIndexApplication.h"
 #include "TideSearchApplication.h"
 #include "ParamMedicApplication.h"
 #include "PSMConvertApplication.h"
 #include "tide/mass_constants.h"
+#include "tide/peak_index.h"
 #include "TideMatchSet.h"
 #include "util/Params.h"
 #include "util/FileUtils.h"
+#include "util/GlobalParams.h"
+#include "util/Instrumentation.h"
+#include "util/MemoryAccounting.h"
 #include "util/StringUtils.h"
+#include "util/ThreadPool.h"
 
 bool TideSearchApplication::HAS_DECOYS = false;
 bool TideSearchApplication::PROTEIN_LEVEL_DECOYS = false;
+bool TideSearchApplication::SEARCH_TIME_DECOYS = false;
+bool TideSearchApplication::keep_index_ = false;
+string TideSearchApplication::kept_index_;
+ProteinVec TideSearchApplication::kept_proteins_;
+AuxLocations* TideSearchApplication::kept_locations_ = NULL;
+
+/**
+ * Estimated bytes held by the proteins of an index.
+ */
+static long long ProteinBytes(const ProteinVec& proteins) {
+  long long bytes = proteins.size() * sizeof(const pb::Protein*);
+  for (ProteinVec::const_iterator i = proteins.begin(); i != proteins.end(); ++i) {
+    bytes += sizeof(pb::Protein) + (*i)->name().capacity() + (*i)->residues().capacity();
+  }
+  return bytes;
+}
 
 /* This constant is the product of the original "magic number" (10000,
  * on line 4622 of search28.c) that was used to rescale the XCorr
@@ -34,10 +71,22 @@ const double TideSearchApplication::XCORR_SCALING = 100000000.0;
 const double TideSearchApplication::RESCALE_FACTOR = 20.0;
 
 TideSearchApplication::TideSearchApplication():
-  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL) {
+  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL),
+  spectrum_store_(NULL), preprocessed_store_(NULL), result_memo_(NULL),
+  result_target_(NULL), result_decoy_(NULL),
+  slice_(0), num_slices_(0), open_search_block_size_(0), fragment_index_candidates_(0), fragment_index_peaks_(0),
+  checkpoint_interval_(0), resume_first_(0), score_index_(NULL),
+  memory_index_(NULL) {
+}
+
+TideMemoryIndex::~TideMemoryIndex() {
+  for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
+    delete *i;
+  }
 }
 
 TideSearchApplication::~TideSearchApplication() {
+  delete memory_index_;
   if (!remove_index_.empty()) {
     carp(CARP_DEBUG, "Removing temp index '%s'", remove_index_.c_str());
     FileUtils::Remove(remove_index_);
@@ -54,6 +103,284 @@ int TideSearchApplication::main(const vector<string>& input_files) {
 int TideSearchApplication::main(const vector<string>& input_files, const string input_index) {
   carp(CARP_INFO, "Running tide-search...");
 
+  if (num_slices_ == 0 && Params::GetInt("coordinator-port") > 0) {
+    return coordinateSearch();
+  } else if (num_slices_ == 0 && !Params::GetString("coordinator").empty()) {
+    return workForCoordinator(input_files, input_index);
+  }
+
+  setUpThreads();
+
+  const string index = input_index;
+  string peptides_file = FileUtils::Join(index, "pepix");
+
+  int charge_to_search = getChargeToSearch();
+  int min_scan, max_scan;
+  getScanRange(&min_scan, &max_scan);
+
+  //check to compute exact p-value 
+  exact_pval_search_ = Params::GetBool("exact-p-value");
+  bin_width_  = Params::GetDouble("mz-bin-width");
+  bin_offset_ = Params::GetDouble("mz-bin-offset");
+  // for now don't allow XCorr p-value searches with variable bin width
+  if (exact_pval_search_ && !Params::IsDefault("mz-bin-width")) {
+    carp(CARP_FATAL, "Tide-search with XCorr p-values and variable bin width "
+                     "is not allowed in this version of Crux.");
+  }
+
+  // Check compute-sp parameter
+  bool compute_sp = Params::GetBool("compute-sp");
+  if (Params::GetBool("sqt-output") && !compute_sp) {
+    compute_sp = true;
+    carp(CARP_INFO, "Setting compute-sp=T because SQT output is enabled.");
+  }
+
+  vector<int> negative_isotope_errors = getNegativeIsotopeErrors();
+
+  ProteinVec proteins;
+  AuxLocations* locations = loadIndex(index, &proteins);
+
+  // Must be set before the first FifoAllocator is created.
+  string huge_pages = Params::GetString("fifo-huge-pages");
+  if (huge_pages == "transparent") {
+    FifoPage::SetHugePages(FIFO_HUGE_PAGES_TRANSPARENT);
+  } else if (huge_pages == "explicit") {
+    FifoPage::SetHugePages(FIFO_HUGE_PAGES_EXPLICIT);
+  }
+
+  //open a copy of peptide buffer for Amino Acid Frequency (AAF) calculation.
+  double* aaFreqN = NULL;
+  double* aaFreqI = NULL;
+  double* aaFreqC = NULL;
+  int* aaMass = NULL;
+  int nAA = 0;
+  if (exact_pval_search_) {
+    nAA = countAAFrequencies(peptides_file, proteins, &aaFreqN, &aaFreqI, &aaFreqC, &aaMass);
+  }
+
+  carp(CARP_DEBUG, "%s %d auxiliary locations.",
+       locations->Mapped() ? "Mapped" : "Read", locations->Size());
+
+  bool use_shared_window = setUpSearchModes();
+
+  ScoringBackend scoring_backend = PeakIndexScorer::Select(Params::GetString("scoring-backend"));
+  carp(CARP_DEBUG, "Using the %s scoring backend.", PeakIndexScorer::Name(scoring_backend));
+
+  MemoryPlan plan = planMemory(index, input_files, negative_isotope_errors,
+                               scoring_backend, &use_shared_window);
+
+  // Read peptides index file
+  pb::Header peptides_header;
+  PeptideQueueSettings queue_settings;
+  queue_settings.peptides_file = peptides_file;
+  queue_settings.peptides_header = &peptides_header;
+  queue_settings.map_index = Params::GetBool("mmap-index");
+  queue_settings.read_ahead = Params::GetInt("index-read-ahead");
+  queue_settings.backend = scoring_backend;
+  queue_settings.shuffle_decoys = Params::GetString("search-decoys") == "shuffle";
+  queue_settings.shared_window = use_shared_window;
+
+  PeptideSources sources;
+  for (int i = 0; i < (use_shared_window ? 1 : NUM_THREADS); i++) {
+    sources.readers.push_back(openPeptides(peptides_file, &peptides_header,
+                                           queue_settings.map_index));
+  }
+  sources.shard_readers.assign(sources.readers.size(), (ShardedRecordReader*)NULL);
+  sources.shared_source = NULL;
+  sources.shared_window = NULL;
+
+  if ((peptides_header.file_type() != pb::Header::PEPTIDES) ||
+      !peptides_header.has_peptides_header()) {
+    carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
+  }
+
+  vector<IndexShard> shards;
+  readShards(peptides_file, &shards);
+  queue_settings.shards = &shards;
+
+  const pb::Header::PeptidesHeader& pepHeader = peptides_header.peptides_header();
+  queue_settings.decoy_seed = setUpDecoys(peptides_header);
+  queue_settings.stored_peaks = applyIndexHeader(peptides_header);
+
+  ostream* target_file = NULL;
+  ostream* decoy_file = NULL;
+
+  bool overwrite = Params::GetBool("overwrite");
+  stringstream ss;
+  ss << Params::GetString("enzyme") << '-' << Params::GetString("digestion");
+  TideMatchSet::CleavageType = ss.str();
+  if (TideMatchSet::binaryOutput() && Params::GetBool("peptide-centric-search")) {
+    carp(CARP_FATAL, "txt-format = binary is not available with peptide-centric-search.");
+  }
+  bool in_memory = resultsInMemory();
+
+  Checkpoint checkpoint;
+  bool resumed;
+  bool resume = setUpCheckpoint(in_memory, &checkpoint, &resumed, &overwrite);
+
+  openResultsFiles(resume, checkpoint, overwrite, compute_sp, &target_file, &decoy_file);
+  setUpScoreIndex(resume);
+
+  vector<InputFile> sr = getInputFiles(input_files);
+  SpectrumCollectionFactory::clearKept();
+  if (spectrum_store_ != NULL) {
+    for (vector<InputFile>::const_iterator f = sr.begin(); f != sr.end(); f++) {
+      map<string, SpectrumCollection*>::iterator stored = spectrum_store_->find(f->OriginalName);
+      if (stored != spectrum_store_->end()) {
+        spectra_[f->SpectrumRecords] = stored->second;
+      }
+    }
+  }
+
+  WINDOW_TYPE_T window_type = string_to_window_type(Params::GetString("precursor-window-type"));
+  int max_spectra = maxSpectraInMemory(plan);
+  bool merge_files = mergeSpectrumFiles(sr.size(), max_spectra);
+
+  // A peptide-centric search scores each peptide with a known retention time
+  // only against the spectra near it.
+  string rtimes_file = Params::GetString("peptide-retention-times");
+  map<string, double> peptide_rtimes;
+  if (!rtimes_file.empty()) {
+    if (!Params::GetBool("peptide-centric-search")) {
+      carp(CARP_WARNING, "peptide-retention-times is used only with "
+                         "peptide-centric-search.");
+    } else {
+      readPeptideRTimes(rtimes_file, &peptide_rtimes);
+    }
+  }
+  queue_settings.peptide_rtimes = &peptide_rtimes;
+
+  // Loop through spectrum files, or search all of them at once
+  for (vector<InputFile>::const_iterator f = sr.begin(); f != sr.end(); ) {
+    vector<InputFile>::const_iterator f_end = merge_files ? sr.end() : f + 1;
+    int file_index = f - sr.begin();
+    if (resume && file_index < checkpoint.file) {
+      // Searched before the checkpoint
+      for (; f != f_end; ++f) {
+        if (!f->Keep) {
+          remove(f->SpectrumRecords.c_str());
+        }
+      }
+      continue;
+    }
+    openPeptideQueues(queue_settings, proteins, &sources);
+
+    string spectra_file = f->SpectrumRecords;
+    SearchSpectra search_spectra;
+    readSearchSpectra(f, f_end, max_spectra, window_type, &search_spectra);
+    SpectrumCollection* spectra = search_spectra.spectra;
+    bool merged = search_spectra.merged_spectra.size() > 1;
+
+    double highest_mz = highestSearchMz(search_spectra);
+    carp(CARP_DEBUG, "Maximum observed m/z = %f.", highest_mz);
+    MaxBin::SetGlobalMax(highest_mz);
+    if (num_slices_ > 0) {
+      sliceSearchSpectra(&search_spectra);
+    }
+    openPreprocessedStore(search_spectra);
+    openResultMemo(search_spectra, shards, pepHeader.search_time_mods(), f->OriginalName);
+
+    // Do the search
+    carp(CARP_INFO, "Starting search.");
+    if (spectrum_flag_ == NULL) {
+      resetMods();
+    }
+    SpectrumCollection batch;
+    size_t next_key = 0;
+    if (resume && search_spectra.stream) {
+      next_key = checkpoint.batch;
+    }
+    do {
+      const vector<SpectrumCollection::SpecCharge>* spec_charges;
+      stringstream position;
+      position << "file " << file_index << '\n' << "batch " << next_key;
+      checkpoint_position_ = position.str();
+      resume_first_ = resume ? checkpoint.spec_charges : 0;
+      resume = false;
+      if (search_spectra.stream) {
+        size_t end = min(search_spectra.keys.size(), next_key + max_spectra);
+        vector<SpectrumCollection::SpecChargeKey> batch_keys(
+          search_spectra.keys.begin() + next_key, search_spectra.keys.begin() + end);
+        if (!batch.ReadSpectrumBatch(spectra_file, batch_keys)) {
+          carp(CARP_FATAL, "Error reading spectrum file %s", spectra_file.c_str());
+        }
+        carp(CARP_DEBUG, "Searching spectrum-charge combinations %d to %d.",
+             (int)next_key + 1, (int)end);
+        next_key = end;
+        spec_charges = batch.SpecCharges();
+      } else if (merged) {
+        spec_charges = &search_spectra.merged_charges;
+      } else if (num_slices_ > 0) {
+        spec_charges = &search_spectra.sliced_charges;
+      } else {
+        spec_charges = spectra->SpecCharges();
+      }
+      if (spec_charges->empty()) {
+        continue;
+      }
+      search(f->OriginalName, spec_charges, sources.queues, proteins,
+             *locations, Params::GetDouble("precursor-window"), window_type,
+             Params::GetDouble("spectrum-min-mz"), Params::GetDouble("spectrum-max-mz"),
+             min_scan, max_scan, Params::GetInt("min-peaks"), charge_to_search,
+             Params::GetInt("top-match"), search_spectra.highest_peak,
+             target_file, decoy_file, compute_sp, nAA, aaFreqN, aaFreqI, aaFreqC,
+             aaMass, &negative_isotope_errors,
+             merged ? &search_spectra.merged_files : NULL);
+    } while (search_spectra.stream && next_key < search_spectra.keys.size());
+
+    closePreprocessedStore(spectra_file);
+    closeResultMemo(spectra_file);
+    releaseSearchSpectra(f, search_spectra);
+
+    // convert tab delimited to other file formats.
+    convertResults();
+
+    // Delete temporary spectrumrecords files
+    for (; f != f_end; ++f) {
+      if (!f->Keep) {
+        carp(CARP_DEBUG, "Deleting %s", f->SpectrumRecords.c_str());
+        remove(f->SpectrumRecords.c_str());
+      }
+    }
+
+    // Clean up
+    closePeptideQueues(&sources, shards.size());
+
+  } // End of spectrum file loop
+  if (checkpoint_interval_ > 0 || resumed) {
+    // The search is done
+    remove(checkpoint_file_.c_str());
+  }
+
+  reportFifoStats();
+  if (!keep_index_) {
+    // The pool's pages are left for the next search of a kept index.
+    FifoPage::ReleasePool();
+    freeIndex(proteins, locations);
+  }
+  if (target_file && !in_memory) {
+    delete target_file;
+    if (decoy_file) {
+      delete decoy_file;
+    }
+  }
+  writeScoreIndex();
+  if (Params::GetBool("qc-report")) {
+    writeQCReport();
+  }
+  MemoryAccounting::LogPeaks();
+#ifdef CRUX_INSTRUMENT
+  Instrumentation::WriteSummary(outputPath("tide-search.instrumentation.json"));
+#endif
+  delete[] aaFreqN;
+  delete[] aaFreqI;
+  delete[] aaFreqC;
+  delete[] aaMass;
+
+  return 0;
+}
+
+void TideSearchApplication::setUpThreads() {
   // prevent different output formats from using threading
   if (!Params::GetBool("peptide-centric-search")) {
     NUM_THREADS = Params::GetInt("num-threads");
@@ -69,255 +396,725 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     carp(CARP_FATAL, "Requested more than 64 threads.");
   }
   carp(CARP_INFO, "Number of Threads: %d", NUM_THREADS);
+  // Before the proteins are read, so that they are interleaved.
+  if (Params::GetBool("numa-placement") && NUM_THREADS > 1) {
+    if (Numa::Init()) {
+      carp(CARP_INFO, "Placing search threads on %d NUMA nodes.", Numa::Nodes());
+    } else {
+      carp(CARP_INFO, "numa-placement has no effect on this machine, which has "
+                      "one NUMA node.");
+    }
+  }
+}
 
-  const string index = input_index;
-  string peptides_file = FileUtils::Join(index, "pepix");
-  string proteins_file = FileUtils::Join(index, "protix");
-  string auxlocs_file = FileUtils::Join(index, "auxlocs");
-
-  // Check spectrum-charge parameter
+int TideSearchApplication::getChargeToSearch() {
   string charge_string = Params::GetString("spectrum-charge");
-  int charge_to_search;
   if (charge_string == "all") {
     carp(CARP_DEBUG, "Searching all charge states");
-    charge_to_search = 0;
-  } else {
-    charge_to_search = atoi(charge_string.c_str());
-    if (charge_to_search < 1 || charge_to_search > 6) {
-      carp(CARP_FATAL, "Invalid spectrum-charge value %s", charge_string.c_str());
-    }
-    carp(CARP_INFO, "Searching charge state %d", charge_to_search);
+    return 0;
+  }
+  int charge_to_search = atoi(charge_string.c_str());
+  if (charge_to_search < 1 || charge_to_search > 6) {
+    carp(CARP_FATAL, "Invalid spectrum-charge value %s", charge_string.c_str());
   }
+  carp(CARP_INFO, "Searching charge state %d", charge_to_search);
+  return charge_to_search;
+}
 
-  // Check scan-number parameter
+void TideSearchApplication::getScanRange(int* min_scan, int* max_scan) {
   string scan_range = Params::GetString("scan-number");
-  int min_scan, max_scan;
   if (scan_range.empty()) {
-    min_scan = 0;
-    max_scan = BILLION;
+    *min_scan = 0;
+    *max_scan = BILLION;
     carp(CARP_DEBUG, "Searching all scans");
   } else if (scan_range.find('-') == string::npos) {
     // Single scan
-    min_scan = max_scan = atoi(scan_range.c_str());
-    carp(CARP_INFO, "Searching single scan %d", min_scan);
+    *min_scan = *max_scan = atoi(scan_range.c_str());
+    carp(CARP_INFO, "Searching single scan %d", *min_scan);
   } else {
-    if (!get_range_from_string(scan_range.c_str(), min_scan, max_scan)) {
+    if (!get_range_from_string(scan_range.c_str(), *min_scan, *max_scan)) {
       carp(CARP_FATAL, "The scan number range '%s' is invalid. "
            "Must be of the form <first>-<last>.", scan_range.c_str());
     }
-    if (min_scan > max_scan) {
-      carp(CARP_FATAL, "Invalid scan range: %d to %d.", min_scan, max_scan);
+    if (*min_scan > *max_scan) {
+      carp(CARP_FATAL, "Invalid scan range: %d to %d.", *min_scan, *max_scan);
     }
-    carp(CARP_INFO, "Searching scan range %d to %d.", min_scan, max_scan);
+    carp(CARP_INFO, "Searching scan range %d to %d.", *min_scan, *max_scan);
   }
-  //check to compute exact p-value 
-  exact_pval_search_ = Params::GetBool("exact-p-value");
-  bin_width_  = Params::GetDouble("mz-bin-width");
-  bin_offset_ = Params::GetDouble("mz-bin-offset");
-  // for now don't allow XCorr p-value searches with variable bin width
-  if (exact_pval_search_ && !Params::IsDefault("mz-bin-width")) {
-    carp(CARP_FATAL, "Tide-search with XCorr p-values and variable bin width "
-                     "is not allowed in this version of Crux.");
-  }
-
-  // Check compute-sp parameter
-  bool compute_sp = Params::GetBool("compute-sp");
-  if (Params::GetBool("sqt-output") && !compute_sp) {
-    compute_sp = true;
-    carp(CARP_INFO, "Setting compute-sp=T because SQT output is enabled.");
-  }
-
-  vector<int> negative_isotope_errors = getNegativeIsotopeErrors();
+}
 
-  ProteinVec proteins;
-  carp(CARP_INFO, "Reading index %s", index.c_str());
-  // Read proteins index file
-  pb::Header protein_header;
-  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins,
-      proteins_file, &protein_header)) {
-    carp(CARP_FATAL, "Error reading index (%s)", proteins_file.c_str());
+AuxLocations* TideSearchApplication::loadIndex(const string& index, ProteinVec* proteins) {
+  AuxLocations* locations;
+  if (keep_index_ && index == kept_index_) {
+    carp(CARP_INFO, "Using the loaded index %s", index.c_str());
+    *proteins = kept_proteins_;
+    locations = kept_locations_;
+  } else {
+    releaseIndex();
+    Numa::InterleaveScope interleave;
+    locations = new AuxLocations;
+    if (memory_index_ != NULL) {
+      // The search owns its proteins, as those of a file.
+      carp(CARP_INFO, "Using the index of %s built in memory", index.c_str());
+      for (ProteinVec::const_iterator i = memory_index_->proteins.begin();
+           i != memory_index_->proteins.end(); ++i) {
+        proteins->push_back(new pb::Protein(**i));
+      }
+      HeadedRecordReader auxlocs_reader(&memory_index_->auxlocs);
+      if (!locations->Read(&auxlocs_reader)) {
+        carp(CARP_FATAL, "Error reading the index built in memory");
+      }
+    } else {
+      carp(CARP_INFO, "Reading index %s", index.c_str());
+      string proteins_file = FileUtils::Join(index, "protix");
+      string auxlocs_file = FileUtils::Join(index, "auxlocs");
+      // Read proteins index file
+      pb::Header protein_header;
+      if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(proteins,
+          proteins_file, &protein_header)) {
+        carp(CARP_FATAL, "Error reading index (%s)", proteins_file.c_str());
+      }
+      // Read auxlocs index file
+      if (!locations->Read(auxlocs_file, FileUtils::Join(index, "auxlocs.flat"))) {
+        carp(CARP_FATAL, "Error reading index (%s)", auxlocs_file.c_str());
+      }
+    }
+    MemoryAccounting::Add(MEMORY_PROTEINS, ProteinBytes(*proteins));
+    if (keep_index_) {
+      kept_index_ = index;
+      kept_proteins_ = *proteins;
+      kept_locations_ = locations;
+    }
   }
   int64_t targetProteinCount = 0;
-  for (ProteinVec::const_iterator i = proteins.begin(); i != proteins.end(); i++) {
+  for (ProteinVec::const_iterator i = proteins->begin(); i != proteins->end(); i++) {
     if (!(*i)->has_target_pos()) {
       ++targetProteinCount;
     }
   }
   carp(CARP_INFO, "Read %d target proteins", targetProteinCount);
+  return locations;
+}
 
-  //open a copy of peptide buffer for Amino Acid Frequency (AAF) calculation.
-  double* aaFreqN = NULL;
-  double* aaFreqI = NULL;
-  double* aaFreqC = NULL;
-  int* aaMass = NULL;
-  int nAA = 0;
+void TideSearchApplication::freeIndex(ProteinVec& proteins, AuxLocations* locations) {
+  MemoryAccounting::Add(MEMORY_PROTEINS, -ProteinBytes(proteins));
+  for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
+    delete *i;
+  }
+  delete locations;
+}
 
-  if (exact_pval_search_) {
-    pb::Header aaf_peptides_header;
-    HeadedRecordReader aaf_peptide_reader(peptides_file, &aaf_peptides_header);
+int TideSearchApplication::countAAFrequencies(
+  const string& peptides_file,
+  const ProteinVec& proteins,
+  double** aaFreqN,
+  double** aaFreqI,
+  double** aaFreqC,
+  int** aaMass
+) {
+  int nAA;
+  pb::Header aaf_peptides_header;
+  HeadedRecordReader* aaf_peptide_reader =
+    openPeptides(peptides_file, &aaf_peptides_header, false);
 
-    if ((aaf_peptides_header.file_type() != pb::Header::PEPTIDES) ||
-        !aaf_peptides_header.has_peptides_header()) {
-      carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
-    }
+  if ((aaf_peptides_header.file_type() != pb::Header::PEPTIDES) ||
+      !aaf_peptides_header.has_peptides_header()) {
+    carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
+  }
+  if (aaf_peptides_header.peptides_header().has_residue_mass_counts()) {
+    // Counted by tide-index, so the index need not be read twice
+    nAA = ActivePeptideQueue::AAFrequencyFromCounts(
+      aaf_peptides_header.peptides_header().residue_mass_counts(),
+      bin_width_, bin_offset_, aaFreqN, aaFreqI, aaFreqC, aaMass);
+  } else {
     MassConstants::Init(&aaf_peptides_header.peptides_header().mods(), 
       &aaf_peptides_header.peptides_header().nterm_mods(), 
       &aaf_peptides_header.peptides_header().cterm_mods(),
                         bin_width_, bin_offset_);
     ActivePeptideQueue* active_peptide_queue =
-      new ActivePeptideQueue(aaf_peptide_reader.Reader(), proteins);
+      new ActivePeptideQueue(aaf_peptide_reader->Reader(), proteins);
     nAA = active_peptide_queue->CountAAFrequency(bin_width_, bin_offset_,
-                                                 &aaFreqN, &aaFreqI, &aaFreqC, &aaMass);
+                                                 aaFreqN, aaFreqI, aaFreqC, aaMass);
     delete active_peptide_queue;
-  } // End calculation of amino acid frequencies.
-
-  // Read auxlocs index file
-  vector<const pb::AuxLocation*> locations;
-  if (!ReadRecordsToVector<pb::AuxLocation>(&locations, auxlocs_file)) {
-    carp(CARP_FATAL, "Error reading index (%s)", auxlocs_file.c_str());
   }
-  carp(CARP_DEBUG, "Read %d auxiliary locations.", locations.size());
+  delete aaf_peptide_reader;
+  return nAA;
+}
 
-  // Read peptides index file
-  pb::Header peptides_header;
+bool TideSearchApplication::setUpSearchModes() {
+  // With a shared peptide window only one reader is needed; the threads get
+  // views onto the window instead of queues of their own.
+  bool use_shared_window = Params::GetBool("shared-peptide-window") && NUM_THREADS > 1;
+  if (use_shared_window && exact_pval_search_) {
+    carp(CARP_WARNING, "shared-peptide-window is not supported with exact-p-value; "
+                       "each thread will read its own copy of the index.");
+    use_shared_window = false;
+  }
+  // Peptide-centric hits are kept on the peptides and reported as they leave
+  // a queue, which views onto a shared window cannot do.
+  if (use_shared_window && Params::GetBool("peptide-centric-search")) {
+    carp(CARP_WARNING, "shared-peptide-window is not supported with "
+                       "peptide-centric-search; each thread will read its own copy "
+                       "of the index.");
+    use_shared_window = false;
+  }
+  open_search_block_size_ = Params::GetInt("open-search-block-size");
+  if (open_search_block_size_ > 0 &&
+      (exact_pval_search_ || Params::GetBool("peptide-centric-search"))) {
+    carp(CARP_WARNING, "open-search-block-size is not supported with exact-p-value "
+                       "or peptide-centric-search; searching without blocks.");
+    open_search_block_size_ = 0;
+  }
+  fragment_index_candidates_ = Params::GetInt("fragment-index-candidates");
+  fragment_index_peaks_ = Params::GetInt("fragment-index-peaks");
+  if (fragment_index_candidates_ > 0 && open_search_block_size_ == 0) {
+    carp(CARP_WARNING, "fragment-index-candidates is only used with "
+                       "open-search-block-size; scoring all candidates.");
+    fragment_index_candidates_ = 0;
+  }
+  if (use_shared_window && open_search_block_size_ > 0) {
+    carp(CARP_WARNING, "shared-peptide-window is not supported with "
+                       "open-search-block-size; each thread will read its own copy "
+                       "of the index.");
+    use_shared_window = false;
+  }
+  return use_shared_window;
+}
 
-  vector<HeadedRecordReader*> peptide_reader;
-  for (int i = 0; i < NUM_THREADS; i++) {
-    peptide_reader.push_back(new HeadedRecordReader(peptides_file, &peptides_header));
+MemoryPlan TideSearchApplication::planMemory(
+  const string& index,
+  const vector<string>& input_files,
+  const vector<int>& negative_isotope_errors,
+  ScoringBackend scoring_backend,
+  bool* use_shared_window
+) {
+  MemoryPlanInput plan_input;
+  plan_input.index = memory_index_ != NULL ? "" : index;
+  plan_input.spectrum_files = input_files;
+  plan_input.max_spectra_in_memory = Params::GetInt("max-spectra-in-memory");
+  plan_input.merge_spectrum_files = Params::GetBool("merge-spectrum-files") &&
+    input_files.size() > 1 && plan_input.max_spectra_in_memory == 0;
+  plan_input.window_type =
+    string_to_window_type(Params::GetString("precursor-window-type"));
+  plan_input.precursor_window = Params::GetDouble("precursor-window");
+  plan_input.max_charge = Params::GetInt("max-precursor-charge");
+  plan_input.isotope_span = negative_isotope_errors.empty() ? 0 : ISOTOPE_SPACING *
+    (*max_element(negative_isotope_errors.begin(), negative_isotope_errors.end()) -
+     *min_element(negative_isotope_errors.begin(), negative_isotope_errors.end()));
+  plan_input.threads = NUM_THREADS;
+  plan_input.shared_window = *use_shared_window;
+  plan_input.jit = scoring_backend == SCORING_JIT;
+  plan_input.search_time_decoys = Params::GetString("search-decoys") != "none";
+  plan_input.can_stream = !Params::GetBool("peptide-centric-search") &&
+                          open_search_block_size_ == 0;
+  plan_input.budget = (long long)Params::GetInt("max-memory") << 20;
+  MemoryEstimate estimate = EstimateMemory(plan_input);
+  MemoryPlan plan = PlanMemory(plan_input, estimate);
+  carp(CARP_INFO, "Estimated memory: %.1f MB for proteins and locations, %.1f MB "
+       "for each peptide window of %.0f peptides, %.1f MB for the spectra of %lld "
+       "spectrum-charge pairs.", estimate.fixed / 1048576.0,
+       estimate.per_window / 1048576.0, estimate.window_peptides,
+       estimate.spectra / 1048576.0, estimate.spec_charges);
+  if (plan_input.budget > 0) {
+    if (!plan.fits) {
+      carp(CARP_WARNING, "The search needs about %.1f MB even with one thread and "
+           "%d spectrum-charge pairs in memory, more than max-memory=%d.",
+           plan.total / 1048576.0, plan.max_spectra_in_memory,
+           Params::GetInt("max-memory"));
+    }
+    if (plan.threads != NUM_THREADS) {
+      carp(CARP_INFO, "Using %d threads rather than %d to fit max-memory.",
+           plan.threads, NUM_THREADS);
+      NUM_THREADS = plan.threads;
+      *use_shared_window = *use_shared_window && NUM_THREADS > 1;
+    }
+    if (plan.max_spectra_in_memory != plan_input.max_spectra_in_memory) {
+      carp(CARP_INFO, "Reading %d spectrum-charge pairs at a time to fit max-memory.",
+           plan.max_spectra_in_memory);
+    }
   }
+  carp(CARP_INFO, "Estimated peak memory: %.1f MB.", plan.total / 1048576.0);
+  return plan;
+}
 
-  if ((peptides_header.file_type() != pb::Header::PEPTIDES) ||
-      !peptides_header.has_peptides_header()) {
-    carp(CARP_FATAL, "Error reading index (%s)", peptides_file.c_str());
+void TideSearchApplication::readShards(const string& peptides_file,
+                                       vector<IndexShard>* shards) {
+  string shard_manifest = ShardManifestName(peptides_file);
+  if (FileUtils::Exists(shard_manifest)) {
+    if (!ReadShardManifest(shard_manifest, shards)) {
+      carp(CARP_FATAL, "Error reading the shard manifest %s", shard_manifest.c_str());
+    }
+    carp(CARP_INFO, "Reading peptides from %d index shards.", (int)shards->size());
   }
+}
 
-  const pb::Header::PeptidesHeader& pepHeader = peptides_header.peptides_header();
-  DECOY_TYPE_T headerDecoyType = (DECOY_TYPE_T)pepHeader.decoys();
+unsigned int TideSearchApplication::setUpDecoys(const pb::Header& peptides_header) {
+  DECOY_TYPE_T headerDecoyType = (DECOY_TYPE_T)peptides_header.peptides_header().decoys();
+  // A previous search in this process may have been of another index.
+  HAS_DECOYS = PROTEIN_LEVEL_DECOYS = SEARCH_TIME_DECOYS = false;
   if (headerDecoyType != NO_DECOYS) {
     HAS_DECOYS = true;
     if (headerDecoyType == PROTEIN_REVERSE_DECOYS) {
       PROTEIN_LEVEL_DECOYS = true;
     }
   }
+  string search_decoys = Params::GetString("search-decoys");
+  unsigned int decoy_seed = 0;
+  if (search_decoys != "none") {
+    if (HAS_DECOYS) {
+      carp(CARP_WARNING, "The index already has decoys; ignoring search-decoys.");
+    } else {
+      HAS_DECOYS = SEARCH_TIME_DECOYS = true;
+      string seed = Params::GetString("seed");
+      decoy_seed = seed == "time" ? (unsigned int)time(NULL) :
+        StringUtils::FromString<unsigned>(seed);
+      carp(CARP_INFO, "Generating %s decoys with seed %u.", search_decoys.c_str(),
+           decoy_seed);
+    }
+  }
+  return decoy_seed;
+}
 
+bool TideSearchApplication::applyIndexHeader(const pb::Header& peptides_header) {
+  const pb::Header::PeptidesHeader& pepHeader = peptides_header.peptides_header();
   MassConstants::Init(&pepHeader.mods(), &pepHeader.nterm_mods(), 
     &pepHeader.cterm_mods(), bin_width_, bin_offset_);
+  // Peaks stored in the index are only good for the bins they were made with.
+  bool stored_peaks = pepHeader.has_peaks_bin_width() &&
+                      pepHeader.peaks_bin_width() == bin_width_ &&
+                      pepHeader.peaks_bin_offset() == bin_offset_;
+  if (stored_peaks) {
+    carp(CARP_INFO, "Using the theoretical peaks stored in the index.");
+  } else if (pepHeader.has_peaks_bin_width()) {
+    carp(CARP_INFO, "The index stores theoretical peaks for mz-bin-width %g and "
+         "mz-bin-offset %g; computing them for this search instead.",
+         pepHeader.peaks_bin_width(), pepHeader.peaks_bin_offset());
+  }
   ModificationDefinition::ClearAll();
   TideMatchSet::initModMap(pepHeader.mods(), ANY);
   TideMatchSet::initModMap(pepHeader.nterm_mods(), PEPTIDE_N);
   TideMatchSet::initModMap(pepHeader.cterm_mods(), PEPTIDE_C);
+  if (pepHeader.search_time_mods()) {
+    carp(CARP_INFO, "Applying the variable modifications of the index during "
+                    "the search.");
+  }
+  return stored_peaks;
+}
 
-  ofstream* target_file = NULL;
-  ofstream* decoy_file = NULL;
+bool TideSearchApplication::setUpCheckpoint(bool in_memory, Checkpoint* checkpoint,
+                                            bool* resumed, bool* overwrite) {
+  // Checkpoints need the results of each pair to reach the files in the
+  // order of spec_charges, so that those written are the ones before a
+  // position.
+  checkpoint_interval_ = Params::GetInt("checkpoint-interval");
+  checkpoint_file_ = outputPath("tide-search.checkpoint");
+  bool resume = Params::GetBool("resume");
+  if ((checkpoint_interval_ > 0 || resume) &&
+      (in_memory || Params::GetBool("peptide-centric-search") ||
+       open_search_block_size_ > 0 || spectrum_flag_ != NULL ||
+       !Params::GetBool("ordered-output") || Params::GetBool("compress-output"))) {
+    carp(CARP_WARNING, "Checkpoints need a spectrum-centric search that writes "
+         "uncompressed results files with ordered-output; not using them.");
+    checkpoint_interval_ = 0;
+    resume = false;
+  }
+  *resumed = resume;
+  if (resume && !readCheckpoint(checkpoint_file_, checkpoint)) {
+    carp(CARP_WARNING, "There is no checkpoint %s; starting the search from the "
+         "beginning.", checkpoint_file_.c_str());
+    resume = false;
+    *overwrite = true;
+  }
+  if (resume) {
+    carp(CARP_INFO, "Resuming the search of spectrum file %d after %d "
+         "spectrum-charge combinations.", checkpoint->file + 1,
+         (int)(checkpoint->batch + checkpoint->spec_charges));
+  }
+  return resume;
+}
 
-  bool overwrite = Params::GetBool("overwrite");
-  stringstream ss;
-  ss << Params::GetString("enzyme") << '-' << Params::GetString("digestion");
-  TideMatchSet::CleavageType = ss.str();
+void TideSearchApplication::openResultsFiles(
+  bool resume,
+  const Checkpoint& checkpoint,
+  bool overwrite,
+  bool compute_sp,
+  ostream** target_file,
+  ostream** decoy_file
+) {
+  bool binary = TideMatchSet::binaryOutput();
+  bool in_memory = resultsInMemory();
   if (!Params::GetBool("concat")) {
-    string target_file_name = make_file_path("tide-search.target.txt");
-    target_file = create_stream_in_path(target_file_name.c_str(), NULL, overwrite);
+    string target_file_name = outputPath(resultsFileName("tide-search.target."));
+    *target_file = in_memory ? result_target_ : resume ?
+      reopenResultsFile(target_file_name, checkpoint.target_offset, binary) :
+      createResultsFile(target_file_name, overwrite, binary);
     output_file_name_ = target_file_name;
     if (HAS_DECOYS) {
-      string decoy_file_name = make_file_path("tide-search.decoy.txt");
-      decoy_file = create_stream_in_path(decoy_file_name.c_str(), NULL, overwrite);
+      string decoy_file_name = outputPath(resultsFileName("tide-search.decoy."));
+      *decoy_file = in_memory ? result_decoy_ : resume ?
+        reopenResultsFile(decoy_file_name, checkpoint.decoy_offset, binary) :
+        createResultsFile(decoy_file_name, overwrite, binary);
     }
   } else {
-    string concat_file_name = make_file_path("tide-search.txt");
-    target_file = create_stream_in_path(concat_file_name.c_str(), NULL, overwrite);
+    string concat_file_name = outputPath(resultsFileName("tide-search."));
+    *target_file = in_memory ? result_target_ : resume ?
+      reopenResultsFile(concat_file_name, checkpoint.target_offset, binary) :
+      createResultsFile(concat_file_name, overwrite, binary);
     output_file_name_ = concat_file_name;
   }
 
-  if (target_file) {
-    TideMatchSet::writeHeaders(target_file, false, compute_sp);
-    TideMatchSet::writeHeaders(decoy_file, true, compute_sp);
+  if (*target_file && !resume) {
+    TideMatchSet::writeHeaders(*target_file, false, compute_sp);
+    TideMatchSet::writeHeaders(*decoy_file, true, compute_sp);
   }
+}
 
-  vector<InputFile> sr = getInputFiles(input_files);
+void TideSearchApplication::setUpScoreIndex(bool resume) {
+  // The rows of a concatenated text results file, sorted by score, for
+  // assign-confidence.
+  if (Params::GetBool("score-index")) {
+    if (!Params::GetBool("concat") || TideMatchSet::binaryOutput() ||
+        resultsInMemory() || resume || Params::GetBool("compress-output") ||
+        Params::GetBool("peptide-centric-search")) {
+      carp(CARP_WARNING, "score-index needs a spectrum-centric search that writes an "
+           "uncompressed, concatenated tab-delimited results file from the start; "
+           "not writing one.");
+    } else {
+      score_index_ = new ScoreIndex();
+    }
+  }
+}
 
-  // Loop through spectrum files
-  for (vector<InputFile>::const_iterator f = sr.begin(); f != sr.end(); f++) {
-    if (!peptide_reader[0]) {
-      for (int i = 0; i < NUM_THREADS; i++) {
-        peptide_reader[i] = new HeadedRecordReader(peptides_file, &peptides_header);
-      }
+void TideSearchApplication::writeScoreIndex() {
+  if (score_index_ != NULL) {
+    if (exact_pval_search_) {
+      score_index_->write(output_file_name_, EXACT_PVALUE_COL, true);
+    } else {
+      score_index_->write(output_file_name_, XCORR_SCORE_COL, false);
     }
+    delete score_index_;
+    score_index_ = NULL;
+  }
+}
+
+int TideSearchApplication::maxSpectraInMemory(const MemoryPlan& plan) const {
+  int max_spectra = plan.max_spectra_in_memory;
+  if (max_spectra > 0 && (Params::GetBool("peptide-centric-search") ||
+                          open_search_block_size_ > 0)) {
+    carp(CARP_WARNING, "max-spectra-in-memory is not supported with "
+                       "peptide-centric-search or open-search-block-size; "
+                       "reading each spectrum file whole.");
+    max_spectra = 0;
+  }
+  return max_spectra;
+}
 
-    vector<ActivePeptideQueue*> active_peptide_queue;
+bool TideSearchApplication::mergeSpectrumFiles(size_t num_files, int max_spectra) const {
+  // Merged, the spectra of all the files are searched in one pass over the
+  // index, and each result keeps the name of the file of its spectrum.
+  bool merge_files = Params::GetBool("merge-spectrum-files") && num_files > 1;
+  if (merge_files && (max_spectra > 0 || Params::GetBool("peptide-centric-search"))) {
+    carp(CARP_WARNING, "merge-spectrum-files is not supported with "
+                       "max-spectra-in-memory or peptide-centric-search; "
+                       "searching each spectrum file separately.");
+    merge_files = false;
+  }
+  return merge_files;
+}
+
+void TideSearchApplication::openPeptideQueues(
+  const PeptideQueueSettings& settings,
+  ProteinVec& proteins,
+  PeptideSources* sources
+) {
+  int num_readers = sources->readers.size();
+  if (!sources->readers[0]) {
+    for (int i = 0; i < num_readers; i++) {
+      sources->readers[i] = openPeptides(settings.peptides_file,
+                                         settings.peptides_header, settings.map_index);
+    }
+  }
+  if (!settings.shards->empty()) {
+    for (int i = 0; i < num_readers; i++) {
+      sources->shard_readers[i] = new ShardedRecordReader(*settings.shards,
+                                                          settings.map_index);
+    }
+  }
+
+  const pb::Header::PeptidesHeader& pepHeader = settings.peptides_header->peptides_header();
+  vector<ActivePeptideQueue*>& queues = sources->queues;
+  queues.clear();
+  if (settings.shared_window) {
+    ActivePeptideQueue* source = sources->shard_readers[0] != NULL ?
+      new ActivePeptideQueue(sources->shard_readers[0], proteins, settings.backend) :
+      new ActivePeptideQueue(sources->readers[0]->Reader(), proteins, settings.backend);
+    source->SetBinSize(bin_width_, bin_offset_);
+    source->UseStoredPeaks(settings.stored_peaks);
+    if (pepHeader.search_time_mods()) {
+      source->ExpandMods(pepHeader);
+    }
+    if (SEARCH_TIME_DECOYS) {
+      source->GenerateDecoys(settings.shuffle_decoys, settings.decoy_seed);
+    }
+    if (!settings.peptide_rtimes->empty()) {
+      source->SetPeptideRTimes(settings.peptide_rtimes);
+    }
+    if (settings.read_ahead > 0) {
+      source->StartReadAhead(settings.read_ahead);
+    }
+    sources->shared_source = source;
+    sources->shared_window = new SharedPeptideWindow(source, NUM_THREADS);
+    for (int i = 0; i < NUM_THREADS; i++) {
+      Numa::NodeScope node(Numa::ThreadNode(i));
+      queues.push_back(new ActivePeptideQueue(sources->shared_window, i, proteins));
+      queues[i]->SetBinSize(bin_width_, bin_offset_);
+    }
+  } else {
     for (int i = 0; i < NUM_THREADS; i++) {
-      active_peptide_queue.push_back(new ActivePeptideQueue(peptide_reader[i]->Reader(), proteins));
-      active_peptide_queue[i]->SetBinSize(bin_width_, bin_offset_);
+      Numa::NodeScope node(Numa::ThreadNode(i));
+      queues.push_back(sources->shard_readers[i] != NULL ?
+        new ActivePeptideQueue(sources->shard_readers[i], proteins, settings.backend) :
+        new ActivePeptideQueue(sources->readers[i]->Reader(), proteins, settings.backend));
+      queues[i]->SetBinSize(bin_width_, bin_offset_);
+      queues[i]->UseStoredPeaks(settings.stored_peaks);
+      if (pepHeader.search_time_mods()) {
+        queues[i]->ExpandMods(pepHeader);
+      }
+      if (SEARCH_TIME_DECOYS) {
+        queues[i]->GenerateDecoys(settings.shuffle_decoys, settings.decoy_seed);
+      }
+      if (!settings.peptide_rtimes->empty()) {
+        queues[i]->SetPeptideRTimes(settings.peptide_rtimes);
+      }
+      queues[i]->UseFragmentIndex(fragment_index_candidates_ > 0);
+      if (open_search_block_size_ == 0) {
+        queues[i]->CompileOnDemand();
+      }
+      if (settings.read_ahead > 0) {
+        queues[i]->StartReadAhead(settings.read_ahead);
+      }
     }
+  }
+}
 
-    string spectra_file = f->SpectrumRecords;
-    SpectrumCollection* spectra = NULL;
-    map<string, SpectrumCollection*>::iterator spectraIter = spectra_.find(spectra_file);
-    if (spectraIter == spectra_.end()) {
-      carp(CARP_INFO, "Reading spectrum file %s.", spectra_file.c_str());
-      spectra = loadSpectra(spectra_file);
-      carp(CARP_INFO, "Read %d spectra.", spectra->Size());
-    } else {
-      spectra = spectraIter->second;
+void TideSearchApplication::closePeptideQueues(PeptideSources* sources, size_t num_shards) {
+  for (size_t i = 0; i < sources->queues.size(); i++) {
+    delete sources->queues[i];
+  }
+  sources->queues.clear();
+  delete sources->shared_window;
+  delete sources->shared_source;
+  sources->shared_window = NULL;
+  sources->shared_source = NULL;
+  for (size_t i = 0; i < sources->readers.size(); i++) {
+    delete sources->readers[i];
+    sources->readers[i] = NULL;
+    if (sources->shard_readers[i] != NULL) {
+      carp(CARP_DEBUG, "Opened %d of %d index shards.",
+           sources->shard_readers[i]->ShardsOpened(), (int)num_shards);
     }
+    delete sources->shard_readers[i];
+    sources->shard_readers[i] = NULL;
+  }
+}
 
-    double highest_mz = spectra->FindHighestMZ();
-    unsigned int spectrum_num = spectra->SpecCharges()->size();
-    if (spectrum_num > 0 && exact_pval_search_) {
-      highest_mz = spectra->SpecCharges()->at(spectrum_num - 1).neutral_mass;
+void TideSearchApplication::readSearchSpectra(
+  vector<InputFile>::const_iterator f,
+  vector<InputFile>::const_iterator f_end,
+  int max_spectra,
+  WINDOW_TYPE_T window_type,
+  SearchSpectra* search_spectra
+) {
+  const string& spectra_file = f->SpectrumRecords;
+  SpectrumCollection* spectra = NULL;
+  map<string, SpectrumCollection*>::iterator spectraIter = spectra_.find(spectra_file);
+  // Streamed, only the masses of the spectrum-charge pairs are kept for the
+  // whole file, and the spectra are read a batch of pairs at a time.
+  bool stream_spectra = max_spectra > 0 && spectraIter == spectra_.end() &&
+                        spectrum_store_ == NULL;
+  vector<SpectrumCollection::SpecChargeKey>& keys = search_spectra->keys;
+  double highest_peak;
+  if (stream_spectra) {
+    carp(CARP_INFO, "Reading the precursors of spectrum file %s.", spectra_file.c_str());
+    if (!SpectrumCollection::ReadSpectrumKeys(spectra_file, &keys, &highest_peak)) {
+      carp(CARP_FATAL, "Error reading spectrum file %s", spectra_file.c_str());
     }
-    carp(CARP_DEBUG, "Maximum observed m/z = %f.", highest_mz);
-    MaxBin::SetGlobalMax(highest_mz);
-    // Do the search
-    carp(CARP_INFO, "Starting search.");
-    if (spectrum_flag_ == NULL) {
-      resetMods();
+    sort(keys.begin(), keys.end(), ScKeySortByMz(
+      window_type == WINDOW_MZ ? Params::GetDouble("precursor-window") : 0));
+    carp(CARP_INFO, "Read %d spectrum-charge combinations; searching them "
+         "%d at a time.", (int)keys.size(), max_spectra);
+  } else if (spectraIter == spectra_.end()) {
+    carp(CARP_INFO, "Reading spectrum file %s.", spectra_file.c_str());
+    spectra = loadSpectra(spectra_file, NUM_THREADS);
+    carp(CARP_INFO, "Read %d spectra.", spectra->Size());
+    highest_peak = spectra->FindHighestMZ();
+    storeSpectra(*f, spectra);
+  } else {
+    spectra = spectraIter->second;
+    highest_peak = spectra->FindHighestMZ();
+  }
+
+  // The spectra of the other files of a merged search, and the merged
+  // spectrum-charge pairs of all the files
+  vector<SpectrumCollection*>& merged_spectra = search_spectra->merged_spectra;
+  vector<const string*> merged_names(1, &f->OriginalName);
+  merged_spectra.assign(1, spectra);
+  for (vector<InputFile>::const_iterator g = f + 1; g != f_end; ++g) {
+    map<string, SpectrumCollection*>::iterator kept = spectra_.find(g->SpectrumRecords);
+    if (kept != spectra_.end()) {
+      merged_spectra.push_back(kept->second);
+    } else {
+      carp(CARP_INFO, "Reading spectrum file %s.", g->SpectrumRecords.c_str());
+      merged_spectra.push_back(loadSpectra(g->SpectrumRecords, NUM_THREADS));
+      carp(CARP_INFO, "Read %d spectra.", merged_spectra.back()->Size());
+      storeSpectra(*g, merged_spectra.back());
     }
-    search(f->OriginalName, spectra->SpecCharges(), active_peptide_queue, proteins,
-           locations, Params::GetDouble("precursor-window"),
-           string_to_window_type(Params::GetString("precursor-window-type")),
-           Params::GetDouble("spectrum-min-mz"), Params::GetDouble("spectrum-max-mz"),
-           min_scan, max_scan, Params::GetInt("min-peaks"), charge_to_search,
-           Params::GetInt("top-match"), spectra->FindHighestMZ(),
-           target_file, decoy_file, compute_sp, nAA, aaFreqN, aaFreqI, aaFreqC,
-           aaMass, &negative_isotope_errors);
+    merged_names.push_back(&g->OriginalName);
+    highest_peak = max(highest_peak, merged_spectra.back()->FindHighestMZ());
+  }
+  if (merged_spectra.size() > 1) {
+    mergeSpecCharges(merged_spectra, merged_names, &search_spectra->merged_charges,
+                     &search_spectra->merged_files);
+    carp(CARP_INFO, "Searching %d spectrum-charge combinations from %d files together.",
+         (int)search_spectra->merged_charges.size(), (int)merged_spectra.size());
+  }
+  search_spectra->spectra = spectra;
+  search_spectra->stream = stream_spectra;
+  search_spectra->highest_peak = highest_peak;
+}
 
-    if (spectraIter == spectra_.end()) {
-      delete spectra;
+double TideSearchApplication::highestSearchMz(const SearchSpectra& search_spectra) const {
+  double highest_mz = search_spectra.highest_peak;
+  if (exact_pval_search_) {
+    if (search_spectra.stream && !search_spectra.keys.empty()) {
+      highest_mz = search_spectra.keys.back().neutral_mass;
+    } else if (!search_spectra.merged_files.empty()) {
+      highest_mz = search_spectra.merged_charges.back().neutral_mass;
+    } else if (!search_spectra.stream &&
+               !search_spectra.spectra->SpecCharges()->empty()) {
+      highest_mz = search_spectra.spectra->SpecCharges()->back().neutral_mass;
     }
+  }
+  return highest_mz;
+}
 
-    // convert tab delimited to other file formats.
-    convertResults();
+void TideSearchApplication::sliceSearchSpectra(SearchSpectra* search_spectra) const {
+  size_t begin, end;
+  if (search_spectra->stream) {
+    vector<SpectrumCollection::SpecChargeKey>& keys = search_spectra->keys;
+    sliceRange(keys.size(), &begin, &end);
+    keys.erase(keys.begin() + end, keys.end());
+    keys.erase(keys.begin(), keys.begin() + begin);
+  } else if (search_spectra->merged_spectra.size() > 1) {
+    vector<SpectrumCollection::SpecCharge>& merged_charges = search_spectra->merged_charges;
+    vector<const string*>& merged_files = search_spectra->merged_files;
+    sliceRange(merged_charges.size(), &begin, &end);
+    merged_charges.erase(merged_charges.begin() + end, merged_charges.end());
+    merged_charges.erase(merged_charges.begin(), merged_charges.begin() + begin);
+    merged_files.erase(merged_files.begin() + end, merged_files.end());
+    merged_files.erase(merged_files.begin(), merged_files.begin() + begin);
+  } else {
+    const vector<SpectrumCollection::SpecCharge>* spec_charges =
+      search_spectra->spectra->SpecCharges();
+    sliceRange(spec_charges->size(), &begin, &end);
+    search_spectra->sliced_charges.assign(spec_charges->begin() + begin,
+                                          spec_charges->begin() + end);
+  }
+  carp(CARP_INFO, "Searching spectrum-charge combinations %d to %d of slice %d of %d.",
+       (int)begin + 1, (int)end, slice_ + 1, num_slices_);
+}
 
-    // Delete temporary spectrumrecords file
-    if (!f->Keep) {
-      carp(CARP_DEBUG, "Deleting %s", spectra_file.c_str());
-      remove(spectra_file.c_str());
+void TideSearchApplication::releaseSearchSpectra(
+  vector<InputFile>::const_iterator f,
+  const SearchSpectra& search_spectra
+) {
+  for (size_t i = 0; i < search_spectra.merged_spectra.size(); i++) {
+    if (spectra_.find((f + i)->SpectrumRecords) == spectra_.end()) {
+      delete search_spectra.merged_spectra[i];
     }
+  }
+}
 
-    // Clean up
-    for (int i = 0; i < NUM_THREADS; i++) {
-      delete active_peptide_queue[i];
-      delete peptide_reader[i];
-      peptide_reader[i] = NULL;
-    }
+void TideSearchApplication::openPreprocessedStore(const SearchSpectra& search_spectra) {
+  // Only the spectra of a file searched whole and by itself are stored,
+  // since the key of a store is made from all of them.
+  string preprocessed_dir = Params::GetString("preprocessed-store");
+  if (preprocessed_dir.empty()) {
+    return;
+  }
+  if (search_spectra.stream || search_spectra.merged_spectra.size() > 1) {
+    carp(CARP_WARNING, "The preprocessed-store is not used for streamed or "
+         "merged spectrum files.");
+  } else {
+    preprocessed_store_ = new PreprocessedStore(
+      preprocessed_dir, PreprocessedStore::Key(*search_spectra.spectra));
+  }
+}
 
-  } // End of spectrum file loop
+void TideSearchApplication::closePreprocessedStore(const string& spectra_file) {
+  if (preprocessed_store_ != NULL) {
+    if (!preprocessed_store_->Write()) {
+      carp(CARP_WARNING, "Could not write the preprocessed spectra of %s to %s.",
+           spectra_file.c_str(), Params::GetString("preprocessed-store").c_str());
+    }
+    delete preprocessed_store_;
+    preprocessed_store_ = NULL;
+  }
+}
 
-  for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
-    delete *i;
+void TideSearchApplication::openResultMemo(
+  const SearchSpectra& search_spectra,
+  const vector<IndexShard>& shards,
+  bool search_time_mods,
+  const string& spectrum_file
+) {
+  // The memo holds text results spectrum by spectrum, and needs the content
+  // hashes of the shards to tell which of them still hold.
+  string memo_dir = Params::GetString("result-memo");
+  if (memo_dir.empty()) {
+    return;
   }
-  if (target_file) {
-    delete target_file;
-    if (decoy_file) {
-      delete decoy_file;
+  bool hashed = !shards.empty();
+  for (vector<IndexShard>::const_iterator i = shards.begin(); i != shards.end(); ++i) {
+    hashed = hashed && i->content_hash != 0;
+  }
+  if (!hashed || search_time_mods) {
+    carp(CARP_WARNING, "The result-memo needs an index built with index-shards "
+         "and without search-time-mods; searching every spectrum.");
+  } else if (search_spectra.stream || search_spectra.merged_spectra.size() > 1 ||
+             exact_pval_search_ || Params::GetBool("peptide-centric-search") ||
+             open_search_block_size_ > 0 || TideMatchSet::binaryOutput() ||
+             Params::GetBool("qc-report")) {
+    carp(CARP_WARNING, "The result-memo is not used for streamed or merged "
+         "spectrum files, exact p-values, peptide-centric or open searches, "
+         "binary results or qc-report; searching every spectrum.");
+  } else {
+    result_memo_ = new ResultMemo(memo_dir,
+                                  resultMemoKey(*search_spectra.spectra, spectrum_file),
+                                  shards);
+  }
+}
+
+void TideSearchApplication::closeResultMemo(const string& spectra_file) {
+  if (result_memo_ != NULL) {
+    if (!result_memo_->Write()) {
+      carp(CARP_WARNING, "Could not write the results of %s to %s.",
+           spectra_file.c_str(), Params::GetString("result-memo").c_str());
     }
+    delete result_memo_;
+    result_memo_ = NULL;
   }
-  delete[] aaFreqN;
-  delete[] aaFreqI;
-  delete[] aaFreqC;
-  delete[] aaMass;
+}
 
-  return 0;
+void TideSearchApplication::reportFifoStats() {
+  FifoAllocStats fifo_stats = FifoPage::Stats();
+  carp(CARP_DEBUG, "FIFO allocators: %lu bytes allocated; %lu pages mapped "
+       "(%.1f MB, %lu of them huge), %lu reused.",
+       (unsigned long) fifo_stats.bytes_allocated,
+       (unsigned long) fifo_stats.pages_mapped,
+       fifo_stats.bytes_mapped / (double) (1 << 20),
+       (unsigned long) fifo_stats.huge_pages_mapped,
+       (unsigned long) fifo_stats.pages_reused);
 }
 
 vector<int> TideSearchApplication::getNegativeIsotopeErrors() const {
@@ -349,67 +1146,286 @@ vector<int> TideSearchApplication::getNegativeIsotopeErrors() const {
   return negative_isotope_errors;
 }
 
+// Whether file is a spectrumrecords file, going by its header; the spectra
+// themselves are only read for the search.
+static bool IsSpectrumRecords(const string& file) {
+  pb::Header header;
+  HeadedRecordReader reader(file, &header);
+  return reader.OK() && header.file_type() == pb::Header::SPECTRA;
+}
+
 vector<TideSearchApplication::InputFile> TideSearchApplication::getInputFiles(
   const vector<string>& filepaths
 ) const {
   // Try to read all spectrum files as spectrumrecords, convert those that fail
   vector<InputFile> input_sr;
+  string cache_dir = SpectrumCache::Dir();
+  const char* kConversionParams[] = {
+    "spectrum-parser", "scan-number", "use-z-line", "pm-ignore-no-charge",
+    "multiplexed-spectra"
+  };
+  vector<string> conversion_params(kConversionParams, kConversionParams +
+    sizeof(kConversionParams) / sizeof(*kConversionParams));
   for (vector<string>::const_iterator f = filepaths.begin(); f != filepaths.end(); f++) {
-    SpectrumCollection spectra;
-    pb::Header spectrum_header;
+    if (spectrum_store_ != NULL && spectrum_store_->count(*f) > 0) {
+      // Read by an earlier search; main() searches the stored spectra
+      input_sr.push_back(InputFile(*f, *f, true));
+      continue;
+    }
     string spectrumrecords = *f;
     bool keepSpectrumrecords = true;
-    if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
+    if (!IsSpectrumRecords(spectrumrecords)) {
+      string cached;
+      if (!cache_dir.empty() && Params::GetString("store-spectra").empty()) {
+        cached = SpectrumCache::Path(cache_dir, *f, "spectrumrecords",
+                                   conversion_params);
+        if (IsSpectrumRecords(cached)) {
+          carp(CARP_INFO, "Using cached spectrumrecords file %s for %s",
+               cached.c_str(), f->c_str());
+          input_sr.push_back(InputFile(*f, cached, true));
+          continue;
+        }
+      }
       // Failed, try converting to spectrumrecords file
       carp(CARP_INFO, "Converting %s to spectrumrecords format", f->c_str());
       carp(CARP_INFO, "Elapsed time starting conversion: %.3g s", wall_clock() / 1e6);
       spectrumrecords = Params::GetString("store-spectra");
-      keepSpectrumrecords = !spectrumrecords.empty();
-      if (!keepSpectrumrecords) {
-        spectrumrecords = make_file_path(FileUtils::BaseName(*f) + ".spectrumrecords.tmp");
+      keepSpectrumrecords = !spectrumrecords.empty() || !cached.empty();
+      if (!cached.empty()) {
+        // Converted under another name first, so that a search that stops
+        // partway does not leave a truncated file to be reused
+        spectrumrecords = cached + ".tmp";
+      } else if (!keepSpectrumrecords) {
+        spectrumrecords = outputPath(FileUtils::BaseName(*f) + ".spectrumrecords.tmp");
       } else if (filepaths.size() > 1) {
         carp(CARP_FATAL, "Cannot use store-spectra option with multiple input "
                          "spectrum files");
       }
       carp(CARP_DEBUG, "New spectrumrecords filename: %s", spectrumrecords.c_str());
-      if (!SpectrumRecordWriter::convert(*f, spectrumrecords)) {
+      // Files that are kept are indexed by scan for tools that look up
+      // single spectra
+      if (!SpectrumRecordWriter::convert(*f, spectrumrecords, NUM_THREADS,
+                                         keepSpectrumrecords)) {
         carp(CARP_FATAL, "Error converting %s to spectrumrecords format", f->c_str());
       }
+      if (!cached.empty()) {
+        FileUtils::Rename(spectrumrecords, cached);
+        FileUtils::Rename(ScanIndex::FileName(spectrumrecords),
+                          ScanIndex::FileName(cached));
+        spectrumrecords = cached;
+      }
       carp(CARP_DEBUG, "Reading converted spectrum file %s", spectrumrecords.c_str());
       // Re-read converted file as spectrumrecords file
-      if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
+      if (!IsSpectrumRecords(spectrumrecords)) {
         carp(CARP_DEBUG, "Deleting %s", spectrumrecords.c_str());
         FileUtils::Remove(spectrumrecords);
         carp(CARP_FATAL, "Error reading spectra file %s", spectrumrecords.c_str());
       }
     }
-    input_sr.push_back(InputFile(*f, spectrumrecords, keepSpectrumrecords));
+    input_sr.push_back(InputFile(*f, spectrumrecords, keepSpectrumrecords));
+  }
+  return input_sr;
+}
+
+SpectrumCollection* TideSearchApplication::loadSpectra(const string& file,
+                                                       int threads) {
+  SpectrumCollection* spectra = new SpectrumCollection();
+  pb::Header header;
+  // All the threads read the spectra.
+  Numa::InterleaveScope interleave;
+  {
+    CRUX_TIME_STAGE(STAGE_SPECTRUM_LOAD);
+    if (!spectra->ReadSpectrumRecords(file, &header)) {
+      carp(CARP_FATAL, "Error reading spectrum file %s", file.c_str());
+    }
+  }
+  CRUX_TIME_STAGE(STAGE_SPECTRUM_SORT);
+  if (string_to_window_type(Params::GetString("precursor-window-type")) != WINDOW_MZ) {
+    spectra->Sort(0, threads);
+  } else {
+    spectra->Sort(Params::GetDouble("precursor-window"), threads);
+  }
+  return spectra;
+}
+
+void TideSearchApplication::mergeSpecCharges(
+  const vector<SpectrumCollection*>& spectra,
+  const vector<const string*>& names,
+  vector<SpectrumCollection::SpecCharge>* spec_charges,
+  vector<const string*>* spectrum_files
+) {
+  // The order loadSpectra() sorted each file in
+  bool by_mz = string_to_window_type(Params::GetString("precursor-window-type")) == WINDOW_MZ;
+  ScSortByMz mz_order(Params::GetDouble("precursor-window"));
+
+  size_t total = 0;
+  for (size_t i = 0; i < spectra.size(); i++) {
+    total += spectra[i]->SpecCharges()->size();
+  }
+  spec_charges->clear();
+  spec_charges->reserve(total);
+  spectrum_files->clear();
+  spectrum_files->reserve(total);
+
+  // There are few files, so take the least of their next pairs each time;
+  // ties go to the earlier file.
+  vector<size_t> next(spectra.size(), 0);
+  while (spec_charges->size() < total) {
+    const SpectrumCollection::SpecCharge* least = NULL;
+    size_t least_file = 0;
+    for (size_t i = 0; i < spectra.size(); i++) {
+      const vector<SpectrumCollection::SpecCharge>* sc = spectra[i]->SpecCharges();
+      if (next[i] == sc->size()) {
+        continue;
+      }
+      const SpectrumCollection::SpecCharge* x = &(*sc)[next[i]];
+      if (least == NULL || (by_mz ? mz_order(*x, *least) : *x < *least)) {
+        least = x;
+        least_file = i;
+      }
+    }
+    spec_charges->push_back(*least);
+    spectrum_files->push_back(names[least_file]);
+    ++next[least_file];
+  }
+}
+
+void TideSearchApplication::readPeptideRTimes(const string& file,
+                                              map<string, double>* rtimes) {
+  DelimitedFileReader reader(file);
+  int sequence_col = reader.findColumn("sequence");
+  int rtime_col = reader.findColumn("retention time");
+  if (sequence_col < 0 || rtime_col < 0) {
+    carp(CARP_FATAL, "%s needs sequence and retention time columns.", file.c_str());
+  }
+  for (; reader.hasNext(); reader.next()) {
+    // Modifications, in brackets, are dropped.
+    const string& sequence = reader.getString(sequence_col);
+    string residues;
+    int depth = 0;
+    for (string::const_iterator i = sequence.begin(); i != sequence.end(); ++i) {
+      if (*i == '[' || *i == '(') {
+        ++depth;
+      } else if (*i == ']' || *i == ')') {
+        --depth;
+      } else if (depth == 0 && isupper(*i)) {
+        residues += *i;
+      }
+    }
+    // The first time given for a sequence is kept.
+    rtimes->insert(make_pair(residues, reader.getDouble(rtime_col)));
+  }
+  carp(CARP_INFO, "Read the retention times of %d peptides from %s.",
+       (int)rtimes->size(), file.c_str());
+}
+
+void TideSearchApplication::storeSpectra(const InputFile& file, SpectrumCollection* spectra) {
+  if (spectrum_store_ != NULL) {
+    (*spectrum_store_)[file.OriginalName] = spectra;
+    spectra_[file.SpectrumRecords] = spectra;
+  }
+}
+
+void TideSearchApplication::preprocessSpectrum(
+  ObservedPeakSet* observed,
+  const Spectrum& spectrum,
+  int charge,
+  long int* num_range_skipped,
+  long int* num_precursors_skipped,
+  long int* num_isotopes_skipped,
+  long int* num_retained
+) {
+  PreprocessedStore* store = preprocessed_store_;
+  if (store != NULL && store->Mapped()) {
+    int size;
+    const int* entry = store->Find(spectrum.SpectrumNumber(), charge,
+                                   spectrum.HighestPrecursorMZ(charge), &size);
+    if (entry != NULL) {
+      observed->LoadPreprocessed(entry, size, num_range_skipped,
+                                 num_precursors_skipped, num_isotopes_skipped,
+                                 num_retained);
+      return;
+    }
+  }
+  long int counts[4] = { *num_range_skipped, *num_precursors_skipped,
+                         *num_isotopes_skipped, *num_retained };
+  observed->PreprocessSpectrum(spectrum, charge, num_range_skipped,
+                               num_precursors_skipped, num_isotopes_skipped,
+                               num_retained);
+  if (store != NULL && !store->Mapped()) {
+    counts[0] = *num_range_skipped - counts[0];
+    counts[1] = *num_precursors_skipped - counts[1];
+    counts[2] = *num_isotopes_skipped - counts[2];
+    counts[3] = *num_retained - counts[3];
+    vector<int> entry;
+    observed->SavePreprocessed(counts, &entry);
+    store->Add(spectrum.SpectrumNumber(), charge, spectrum.HighestPrecursorMZ(charge), entry);
   }
-  return input_sr;
 }
 
-SpectrumCollection* TideSearchApplication::loadSpectra(const string& file) {
-  SpectrumCollection* spectra = new SpectrumCollection();
-  pb::Header header;
-  if (!spectra->ReadSpectrumRecords(file, &header)) {
-    carp(CARP_FATAL, "Error reading spectrum file %s", file.c_str());
+uint64_t TideSearchApplication::resultMemoKey(const SpectrumCollection& spectra,
+                                             const string& spectrum_file) const {
+  // The options that change neither what is reported for a spectrum nor how
+  // it is written
+  static const char* const kIgnored[] = {
+    "checkpoint-interval", "compress-output", "coordinator", "coordinator-address",
+    "coordinator-port", "fifo-huge-pages", "index-read-ahead", "max-memory",
+    "max-spectra-in-memory", "mmap-index", "mzid-output", "num-threads", "num-workers",
+    "numa-placement",
+    "ordered-output", "output-dir", "overwrite", "parameter-file", "pepxml-output",
+    "pin-output", "preprocessed-store", "print-search-progress", "result-memo",
+    "resume", "spectrum-batch-size", "spectrum-cache-dir", "spectrum-chunk-size",
+    "sqt-output", "store-index", "store-spectra", "txt-output", "verbosity"
+  };
+  const char* const* ignored_end = kIgnored + sizeof(kIgnored) / sizeof(kIgnored[0]);
+  ContentHash hash;
+  hash.Add(PreprocessedStore::Key(spectra));
+  hash.Add(spectrum_file);
+  vector<string> options = getOptions();
+  for (vector<string>::const_iterator i = options.begin(); i != options.end(); ++i) {
+    bool ignored = false;
+    for (const char* const* j = kIgnored; j != ignored_end; ++j) {
+      ignored = ignored || *i == *j;
+    }
+    if (!ignored) {
+      hash.Add(*i);
+      hash.Add(Params::GetString(*i));
+    }
   }
-  if (string_to_window_type(Params::GetString("precursor-window-type")) != WINDOW_MZ) {
-    spectra->Sort();
-  } else {
-    spectra->Sort<ScSortByMz>(ScSortByMz(Params::GetDouble("precursor-window")));
+  return hash.Value();
+}
+
+const string& TideSearchApplication::spectrumFilename(
+  const thread_data* my_data,
+  const SpectrumCollection::SpecCharge* sc
+) {
+  if (my_data->spectrum_files == NULL) {
+    return my_data->spectrum_filename;
   }
-  return spectra;
+  return *(*my_data->spectrum_files)[sc - &(*my_data->spec_charges)[0]];
+}
+
+/**
+ * Runs search() on a thread of the pool, which then goes back to running
+ * on any core for the tasks after it.
+ */
+void TideSearchApplication::searchTask(void* threadarg) {
+  search(threadarg);
+  Numa::UnbindThread();
 }
 
 void TideSearchApplication::search(void* threadarg) {
   struct thread_data *my_data = (struct thread_data *) threadarg;
+  Numa::BindThread(my_data->thread_num);
+  if (open_search_block_size_ > 0) {
+    searchOpenBlocks(my_data);
+    return;
+  }
 
-  const string& spectrum_filename = my_data->spectrum_filename;
   const vector<SpectrumCollection::SpecCharge>* spec_charges = my_data->spec_charges;
   ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
   ProteinVec& proteins = my_data->proteins;
-  vector<const pb::AuxLocation*>& locations = my_data->locations;
+  const AuxLocations& locations = *my_data->locations;
   double precursor_window = my_data->precursor_window;
   WINDOW_TYPE_T window_type = my_data->window_type;
   double spectrum_min_mz = my_data->spectrum_min_mz;
@@ -420,37 +1436,57 @@ void TideSearchApplication::search(void* threadarg) {
   int search_charge = my_data->search_charge;
   int top_matches = my_data->top_matches;
   double highest_mz = my_data->highest_mz;
-  ofstream* target_file = my_data->target_file;
-  ofstream* decoy_file = my_data->decoy_file;
+  ostream* target_file = my_data->target_file;
+  ostream* decoy_file = my_data->decoy_file;
   bool compute_sp = my_data->compute_sp;
-  int64_t thread_num = my_data->thread_num;
-  int64_t num_threads = my_data->num_threads;
   int nAA = my_data->nAA;
   double* aaFreqN = my_data->aaFreqN;
   double* aaFreqI = my_data->aaFreqI;
   double* aaFreqC = my_data->aaFreqC;
   int* aaMass = my_data->aaMass;
-  vector<boost::mutex*> locks_array = my_data->locks_array;
   vector<int>* negative_isotope_errors = my_data->negative_isotope_errors;
 
   double bin_width = my_data->bin_width;
   double bin_offset = my_data->bin_offset;
   bool exact_pval_search = my_data->exact_pval_search;
-  map<pair<string, unsigned int>, bool>* spectrum_flag = my_data->spectrum_flag;
+  const vector<char>* identified = my_data->identified;
 
-  int* sc_index = my_data->sc_index;
-  int* total_candidate_peptides = my_data->total_candidate_peptides;
+  // Shared counters; each thread bumps them without taking a lock.
+  boost::atomic<int>* sc_index = my_data->sc_index;
+  boost::atomic<int64_t>* total_candidate_peptides = my_data->total_candidate_peptides;
+  double search_start = my_data->search_start;
+
+  boost::atomic<int>* sc_cursor = my_data->sc_cursor;
+  int chunk_size = my_data->chunk_size;
+  thread_stats* stats = my_data->stats;
+  TideMatchSet::ResultBuffer result_buffer(my_data->result_sink);
 
   // params
   bool peptide_centric = Params::GetBool("peptide-centric-search");
   bool use_neutral_loss_peaks = Params::GetBool("use-neutral-loss-peaks");
   bool use_flanking_peaks = Params::GetBool("use-flanking-peaks");
   int max_charge = Params::GetInt("max-precursor-charge");
+  int batch_size = max(1, Params::GetInt("spectrum-batch-size"));
+  double min_quality = Params::GetDouble("min-spectrum-quality");
 
   // This is the main search loop.
-  ObservedPeakSet observed(bin_width, bin_offset,
-                           use_neutral_loss_peaks,
-                           use_flanking_peaks);    
+  spectrum_batch batch(batch_size, bin_width, bin_offset,
+                       use_neutral_loss_peaks, use_flanking_peaks);
+
+  // Per-spectrum scratch space. It is reused from one spectrum-charge pair to
+  // the next (growing when needed), so that once the arrays have reached
+  // their working sizes the search loop itself does not allocate.
+  vector<double> min_mass_buf, max_mass_buf;
+  vector<bool> candidate_status_buf;
+  TideMatchSet::Arr exact_matches;
+  vector<int> pep_mass_int_buf, pep_mass_int_unique_buf;
+  vector< vector<int> > evidence_obs_buf;
+  vector<int> score_offset_obs_buf;
+  vector< vector<double> > p_value_score_obs_buf;
+  vector<int> sort_evidence_obs_buf;
+  vector<double> dyn_prog_buf;
+  EvidenceCache evidence_cache(bin_width, bin_offset);
+  string memo_target, memo_decoy;
 
   // Keep track of observed peaks that get filtered out in various ways.
   long int num_range_skipped = 0;
@@ -459,34 +1495,48 @@ void TideSearchApplication::search(void* threadarg) {
   long int num_retained = 0;
 
   // cycle through spectrum-charge pairs, sorted by neutral mass
-  FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
   int print_interval = Params::GetInt("print-search-progress");
 
-  for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges->begin()+thread_num;
-       sc < spec_charges->begin() + (spec_charges->size());
-       sc = sc + num_threads) {
-    locks_array[LOCK_REPORTING]->lock();
-    ++(*sc_index);
-    if (print_interval > 0 && *sc_index > 0 && *sc_index % print_interval == 0) {
-      carp(CARP_INFO, "%d spectrum-charge combinations searched, %.0f%% complete",
-           *sc_index, *sc_index / sc_total * 100);
+  // Spectrum-charge pairs are claimed in chunks from a cursor shared by all
+  // threads, so a thread that finishes its chunk early simply takes the next
+  // one instead of waiting on threads stuck in dense mass regions.
+  const int sc_count = (int)spec_charges->size();
+  int chunk_end = 0;
+  for (int sc_pos = chunk_end; ; ++sc_pos) {
+    if (sc_pos == chunk_end) {
+      // A batch never spans chunks: its results have to be buffered before
+      // the chunk is handed off.
+      scoreSpectrumBatch(my_data, &batch, peptide_centric, &result_buffer);
+      // Handing over the chunk may wait for the thread with the chunk before
+      // it, which may in turn be waiting to extend a shared window.
+      active_peptide_queue->ReleaseSharedWindow();
+      reserveSharedWindow(active_peptide_queue, *spec_charges,
+                          sc_cursor->load(boost::memory_order_relaxed),
+                          window_type, precursor_window, max_charge,
+                          negative_isotope_errors, &min_mass_buf, &max_mass_buf);
+      sc_pos = claimSpecChargeChunk(sc_cursor, chunk_size, sc_count, &chunk_end, stats,
+                                    &result_buffer);
+      if (sc_pos >= sc_count) {
+        break;
+      }
+    }
+    const SpectrumCollection::SpecCharge* sc = &(*spec_charges)[sc_pos];
+    int searched = sc_index->fetch_add(1, boost::memory_order_relaxed);
+    if (print_interval > 0 && searched > 0 && searched % print_interval == 0) {
+      reportSearchProgress(searched, sc_count,
+                           total_candidate_peptides->load(boost::memory_order_relaxed),
+                           search_start);
     }
-    locks_array[LOCK_REPORTING]->unlock();
 
     Spectrum* spectrum = sc->spectrum;
-    double precursor_mz = spectrum->PrecursorMZ();
+    double precursor_mz = sc->PrecursorMZ();
     int charge = sc->charge;
     int scan_num = spectrum->SpectrumNumber();
-    if (spectrum_flag != NULL) {
-      locks_array[LOCK_CASCADE]->lock();
-      map<pair<string, unsigned int>, bool>::iterator spectrum_id;
-      spectrum_id = spectrum_flag->find(pair<string, unsigned int>(
-        spectrum_filename, scan_num * 10 + charge));
-      if (spectrum_id != spectrum_flag->end()) {
-        locks_array[LOCK_CASCADE]->unlock();
-        continue;
-      }
-      locks_array[LOCK_CASCADE]->unlock();
+    if (identified != NULL && (*identified)[sc_pos]) {
+      continue;
+    }
+    if (my_data->clusters != NULL && my_data->clusters->Member(sc_pos)) {
+      continue;  // scored along with its representative
     }
 
     if (precursor_mz < spectrum_min_mz || precursor_mz > spectrum_max_mz ||
@@ -497,70 +1547,52 @@ void TideSearchApplication::search(void* threadarg) {
     }
     // The active peptide queue holds the candidate peptides for spectrum.
     // Calculate and set the window, depending on the window type.
-    vector<double>* min_mass = new vector<double>();
-    vector<double>* max_mass = new vector<double>();
-    vector<bool>* candidatePeptideStatus = new vector<bool>();
+    vector<double>* min_mass = &min_mass_buf;
+    vector<double>* max_mass = &max_mass_buf;
+    vector<bool>* candidatePeptideStatus = &candidate_status_buf;
+    min_mass->clear();
+    max_mass->clear();
+    candidatePeptideStatus->clear();
     double min_range, max_range;
     computeWindow(*sc, window_type, precursor_window, max_charge,
                   negative_isotope_errors, min_mass, max_mass, &min_range, &max_range);
+    if (result_memo_ != NULL && result_memo_->Find(scan_num, charge, precursor_mz,
+                                                   min_range, max_range,
+                                                   &memo_target, &memo_decoy)) {
+      // Reported after the spectra before it in the batch, in its own turn
+      scoreSpectrumBatch(my_data, &batch, peptide_centric, &result_buffer);
+      result_buffer.Append(memo_target, memo_decoy);
+      result_memo_->Add(scan_num, charge, precursor_mz, memo_target, memo_decoy);
+      continue;
+    }
     if (!exact_pval_search) {  //execute original tide-search program
+      // A spectrum whose window no longer overlaps the batch gains nothing
+      // from joining it.
+      if (batch.size > 0 && min_range > batch.max_range) {
+        scoreSpectrumBatch(my_data, &batch, peptide_centric, &result_buffer);
+      }
       // Normalize the observed spectrum and compute the cache of
       // frequently-needed values for taking dot products with theoretical
-      // spectra.
-      observed.PreprocessSpectrum(*spectrum, charge, &num_range_skipped,
-                                  &num_precursors_skipped,
-                                  &num_isotopes_skipped, &num_retained);
-      int nCandPeptide = active_peptide_queue->SetActiveRange(
-        min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
-      if (nCandPeptide == 0) {
+      // spectra, in the slot it will take, unless another precursor
+      // hypothesis of it in the batch has the same preprocessed spectrum.
+      ObservedPeakSet* observed = batch.preprocessed(sc);
+      if (observed == NULL) {
+        observed = batch.peak_sets[batch.size];
+        preprocessSpectrum(observed, *spectrum, charge, &num_range_skipped,
+                           &num_precursors_skipped, &num_isotopes_skipped,
+                           &num_retained);
+      } else {
+        batch.filter_cache.Skip(*spectrum);
+      }
+      if (min_quality > 0 && observed->Quality(sc->neutral_mass) < min_quality) {
+        stats->low_quality++;
         continue;
       }
-      locks_array[LOCK_CANDIDATES]->lock();
-      *total_candidate_peptides += nCandPeptide;
-      locks_array[LOCK_CANDIDATES]->unlock();
-
-      int candidatePeptideStatusSize = candidatePeptideStatus->size();
-      TideMatchSet::Arr2 match_arr2(candidatePeptideStatusSize); // Scored peptides will go here.
-
-      // Programs for taking the dot-product with the observed spectrum are laid
-      // out in memory managed by the active_peptide_queue, one program for each
-      // candidate peptide. The programs will store the results directly into
-      // match_arr. We now pass control to those programs.
-      collectScoresCompiled(active_peptide_queue, spectrum, observed, &match_arr2,
-                            candidatePeptideStatusSize, charge);
-
-      // matches will arrange the results in a heap by score, return the top
-      // few, and recover the association between counter and peptide. We output
-      // the top matches.
-      if (peptide_centric) {
-        deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
-        TideMatchSet::Arr2::iterator it = match_arr2.begin();
-        for (; it != match_arr2.end(); ++iter_, ++it) {
-          int peptide_idx = candidatePeptideStatusSize - (it->second);
-          if ((*candidatePeptideStatus)[peptide_idx]) {
-            (*iter_)->AddHit(spectrum, it->first, 0.0, it->second, charge);
-          }
-        }
-      } else {  //spectrum centric match report.
-        TideMatchSet::Arr match_arr(nCandPeptide); 
-        for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
-             it != match_arr2.end();
-             ++it) {
-          int peptide_idx = candidatePeptideStatusSize - (it->second);
-          if ((*candidatePeptideStatus)[peptide_idx]) {
-            TideMatchSet::Scores curScore;
-            curScore.xcorr_score = (double)(it->first / XCORR_SCALING);
-            curScore.rank = it->second;
-            match_arr.push_back(curScore);
-          }
-        }
-
-        TideMatchSet matches(&match_arr, highest_mz);
-        matches.exact_pval_search_ = exact_pval_search;
-        matches.report(target_file, decoy_file, top_matches, spectrum_filename,
-                       spectrum, charge, active_peptide_queue, proteins,
-                       locations, compute_sp, true, locks_array[LOCK_RESULTS]);
-      }  //end peptide_centric == true
+      int slot = batch.add(sc, *min_mass, *max_mass, min_range, max_range);
+      batch.observed[slot] = observed;
+      if (batch.size == batch.capacity) {
+        scoreSpectrumBatch(my_data, &batch, peptide_centric, &result_buffer);
+      }
     } else {  // execute exact-pval-search
       const int minDeltaMass = aaMass[0];
       const int maxDeltaMass = aaMass[nAA - 1];
@@ -573,11 +1605,10 @@ void TideSearchApplication::search(void* threadarg) {
       int maxPrecurMass = floor(MaxBin::Global().CacheBinEnd() + 50.0); // TODO works, but is this the best way to get?
       int nCandPeptide = active_peptide_queue->SetActiveRangeBIons(min_mass, max_mass, min_range, max_range, candidatePeptideStatus);
       int candidatePeptideStatusSize = candidatePeptideStatus->size();
-      locks_array[LOCK_CANDIDATES]->lock();
-      *total_candidate_peptides += nCandPeptide;
-      locks_array[LOCK_CANDIDATES]->unlock();
+      total_candidate_peptides->fetch_add(nCandPeptide, boost::memory_order_relaxed);
 
-      TideMatchSet::Arr match_arr(nCandPeptide); //scored peptides will go here
+      TideMatchSet::Arr& match_arr = exact_matches; //scored peptides will go here
+      match_arr.Reserve(nCandPeptide);
 
       // iterators needed at multiple places in following code
       deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
@@ -591,10 +1622,13 @@ void TideSearchApplication::search(void* threadarg) {
        * Written by Jeff Howbert, October, 2013.
        * Ported to and integrated with Tide by Jeff Howbert, November, 2013.
        */
-      int peidx = 0, pe = 0, ma, pepMaInt;
-      int* pepMassInt = new int[nCandPeptide];
-      vector<int> pepMassIntUnique;
-      pepMassIntUnique.reserve(nCandPeptide);
+      int peidx = 0, pe = 0, pepMaInt;
+      if ((int)pep_mass_int_buf.size() < nCandPeptide + 1) {
+        pep_mass_int_buf.resize(nCandPeptide + 1);
+      }
+      int* pepMassInt = &pep_mass_int_buf[0];
+      vector<int>& pepMassIntUnique = pep_mass_int_unique_buf;
+      pepMassIntUnique.clear();
 
       for (iter_ = active_peptide_queue->iter_; iter_ != active_peptide_queue->end_; ++iter_) {
         if ((*candidatePeptideStatus)[peidx]) {
@@ -611,25 +1645,39 @@ void TideSearchApplication::search(void* threadarg) {
                                                pepMassIntUnique.end());
       pepMassIntUnique.erase(last, pepMassIntUnique.end());
       int nPepMassIntUniq = (int)pepMassIntUnique.size();
+      // From here on each candidate only needs the position of its mass in
+      // pepMassIntUnique, so store that in place of the mass.
+      for (int i = 0; i < pe; i++) {
+        pepMassInt[i] = std::lower_bound(pepMassIntUnique.begin(), pepMassIntUnique.end(),
+                                         pepMassInt[i]) - pepMassIntUnique.begin();
+      }
 
-      vector< vector<int> > evidenceObs(nPepMassIntUniq, vector<int>(maxPrecurMass, 0));
-      int* scoreOffsetObs = new int[nPepMassIntUniq];
-      double** pValueScoreObs = new double*[nPepMassIntUniq];
-      int* intensArrayTheor = new int[maxPrecurMass]; // initialized later in loop
+      // The outer vectors only ever grow, so that the inner ones keep their
+      // storage from spectrum to spectrum.
+      if ((int)evidence_obs_buf.size() < nPepMassIntUniq) {
+        evidence_obs_buf.resize(nPepMassIntUniq);
+        p_value_score_obs_buf.resize(nPepMassIntUniq);
+        score_offset_obs_buf.resize(nPepMassIntUniq);
+      }
+      // The spectrum is preprocessed for evidence once for all of its
+      // unique masses.
+      evidence_cache.SetSpectrum(spectrum, maxPrecurMass);
+      vector< vector<int> >& evidenceObs = evidence_obs_buf;
+      vector< vector<double> >& pValueScoreObs = p_value_score_obs_buf;
+      vector<int>& scoreOffsetObs = score_offset_obs_buf;
       for (pe = 0; pe < nPepMassIntUniq; pe++) {
         scoreOffsetObs[pe] = 0;
         pepMaInt = pepMassIntUnique[pe];
         // preprocess to create one integerized evidence vector for each cluster of masses among selected peptides
-        double pepMassMonoMean = (pepMaInt - 0.5 + bin_offset) * bin_width;
-        evidenceObs[pe] = spectrum->CreateEvidenceVectorDiscretized(
-          bin_width, bin_offset, charge, pepMassMonoMean, maxPrecurMass);
+        evidence_cache.EvidenceDiscretized(charge, pepMaInt, &evidenceObs[pe]);
         // NOTE: will have to go back to separate dynamic programming for
         //       target and decoy if they have different probNI and probC
         int maxEvidence = *std::max_element(evidenceObs[pe].begin(), evidenceObs[pe].end());
         int minEvidence = *std::min_element(evidenceObs[pe].begin(), evidenceObs[pe].end());
         // estimate maxScore and minScore
         int maxNResidue = (int)floor((double)pepMaInt / (double)minDeltaMass);
-        vector<int> sortEvidenceObs(evidenceObs[pe].begin(), evidenceObs[pe].end());
+        vector<int>& sortEvidenceObs = sort_evidence_obs_buf;
+        sortEvidenceObs.assign(evidenceObs[pe].begin(), evidenceObs[pe].end());
         std::sort(sortEvidenceObs.begin(), sortEvidenceObs.end(), greater<int>());
         int maxScore = 0;
         int minScore = 0;
@@ -642,12 +1690,12 @@ void TideSearchApplication::search(void* threadarg) {
         int bottomRowBuffer = maxEvidence + 1;
         int topRowBuffer = -minEvidence;
         int nRowDynProg = bottomRowBuffer - minScore + 1 + maxScore + topRowBuffer;
-        pValueScoreObs[pe] = new double[nRowDynProg];
+        pValueScoreObs[pe].resize(nRowDynProg);
 
         scoreOffsetObs[pe] = calcScoreCount(maxPrecurMass, &evidenceObs[pe][0], pepMaInt,
                                             maxEvidence, minEvidence, maxScore, minScore, 
                                             nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
-                                            pValueScoreObs[pe]);
+                                            &pValueScoreObs[pe][0], &dyn_prog_buf);
       }
 
       // ***** calculate p-values for peptide-spectrum matches ***********************************
@@ -656,31 +1704,29 @@ void TideSearchApplication::search(void* threadarg) {
       pe = 0;
       for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) {
         if ((*candidatePeptideStatus)[peidx]) {
-          int pepMassIntIdx = 0;
-          for (ma = 0; ma < nPepMassIntUniq; ma++) {
-            if (pepMassIntUnique[ma] == pepMassInt[pe]) {
-              pepMassIntIdx = ma;
-              break;
-            }
-          }
-          // score XCorr for target peptide with integerized evidenceObs array
-          for (ma = 0; ma < maxPrecurMass; ma++) {
-            intensArrayTheor[ma] = 0;
-          }
-          for (vector<unsigned int>::const_iterator iter_uint = iter1_->unordered_peak_list_.begin();
-               iter_uint != iter1_->unordered_peak_list_.end();
-               iter_uint++) {
-            intensArrayTheor[*iter_uint] = 1;
-          }
-
+          int pepMassIntIdx = pepMassInt[pe];
+          // score XCorr for target peptide with integerized evidenceObs
+          // array. The theoretical spectrum is 1 at each b ion and 0
+          // elsewhere, so this is the sum of the evidence at the b ions.
+          // They come in increasing mass order, so a bin holding more than
+          // one of them is seen as a run, and counts once.
+          const int* evidence = &evidenceObs[pepMassIntIdx][0];
+          const vector<unsigned int>& peaks = iter1_->unordered_peak_list_;
           int scoreRefactInt = 0;
-          for (ma = 0; ma < maxPrecurMass; ma++) {
-            scoreRefactInt += evidenceObs[pepMassIntIdx][ma] * intensArrayTheor[ma];
+          unsigned int prev_peak = (unsigned int)maxPrecurMass;
+          for (vector<unsigned int>::const_iterator iter_uint = peaks.begin();
+               iter_uint != peaks.end();
+               iter_uint++) {
+            if (*iter_uint < (unsigned int)maxPrecurMass && *iter_uint != prev_peak) {
+              scoreRefactInt += evidence[*iter_uint];
+            }
+            prev_peak = *iter_uint;
           }
           int scoreCountIdx = scoreRefactInt + scoreOffsetObs[pepMassIntIdx];
           double pValue = pValueScoreObs[pepMassIntIdx][scoreCountIdx];
           if (peptide_centric) {
-              (*iter_)->AddHit(spectrum, pValue, (double)scoreRefactInt, candidatePeptideStatusSize - peidx, charge);
+              (*iter_)->AddHit(spectrum, pValue, (double)scoreRefactInt, candidatePeptideStatusSize - peidx, charge,
+                               active_peptide_queue->HitCapacity(), true);
           } else {
             TideMatchSet::Scores curScores;
             curScores.xcorr_pval = pValue;
@@ -690,160 +1736,971 @@ void TideSearchApplication::search(void* threadarg) {
           }
           ++pe;
         }
-
-        // move to next peptide and b ion queue
-        ++iter_; // TODO need to add test to make sure haven't gone past available peptides
-        ++iter1_; // TODO need to add test to make sure haven't gone past available b ion queues
+
+        // move to next peptide and b ion queue
+        ++iter_; // TODO need to add test to make sure haven't gone past available peptides
+        ++iter1_; // TODO need to add test to make sure haven't gone past available b ion queues
+      }
+      if (!peptide_centric) {
+        // matches will arrange the results in a heap by score, return the top
+        // few, and recover the association between counter and peptide. We output
+        // the top matches.
+        TideMatchSet matches(&match_arr, highest_mz);
+        matches.exact_pval_search_ = exact_pval_search;
+
+        matches.report(target_file, decoy_file, top_matches,
+                       spectrumFilename(my_data, sc), spectrum, charge, precursor_mz,
+                       active_peptide_queue, proteins,
+                       locations, compute_sp, false, &result_buffer);
+
+      } // end peptide_centric == true
+    } // end exact-pval-search
+  }
+  stats->finish_time = wall_clock();
+  active_peptide_queue->FinishSharedWindow();
+
+  num_range_skipped += batch.member_counts[0];
+  num_precursors_skipped += batch.member_counts[1];
+  num_isotopes_skipped += batch.member_counts[2];
+  num_retained += batch.member_counts[3];
+  reportPeakCounts(my_data, num_range_skipped, num_precursors_skipped,
+                   num_isotopes_skipped, num_retained);
+}
+
+void TideSearchApplication::reportPeakCounts(
+  thread_data* my_data,
+  long int num_range_skipped,
+  long int num_precursors_skipped,
+  long int num_isotopes_skipped,
+  long int num_retained
+) {
+  if ( !Params::GetBool("skip-preprocessing") ) {
+    int64_t thread_num = my_data->thread_num;
+    my_data->locks_array[LOCK_REPORTING]->lock();
+    long int total_peaks = num_precursors_skipped + num_isotopes_skipped + num_range_skipped + num_retained;
+    if ( total_peaks == 0 ){
+      carp(CARP_INFO, "[Thread %d]: Warning: no peaks found.", thread_num);
+    } else {
+      carp(CARP_INFO,
+           "[Thread %d]: Deleted %d precursor, %d isotope and %d out-of-range peaks.",
+           thread_num, num_precursors_skipped, num_isotopes_skipped, num_range_skipped);
+    }
+    if ( num_retained == 0 ) {
+      carp(CARP_INFO, "[Thread %d]: Warning: no peaks retained.", thread_num);
+    } else {
+      carp(CARP_INFO, "[Thread %d]: Retained %g%% of peaks.",
+           thread_num, (100.0 * num_retained) / total_peaks);
+    }
+    my_data->locks_array[LOCK_REPORTING]->unlock();
+  }
+}
+
+void TideSearchApplication::search(
+  const string& spectrum_filename,
+  const vector<SpectrumCollection::SpecCharge>* spec_charges,
+  vector<ActivePeptideQueue*> active_peptide_queue,
+  ProteinVec& proteins,
+  const AuxLocations& locations,
+  double precursor_window,
+  WINDOW_TYPE_T window_type,
+  double spectrum_min_mz,
+  double spectrum_max_mz,
+  int min_scan,
+  int max_scan,
+  int min_peaks,
+  int search_charge,
+  int top_matches,
+  double highest_mz,
+  ostream* target_file,
+  ostream* decoy_file,
+  bool compute_sp,
+  int nAA, 
+  double* aaFreqN,
+  double* aaFreqI,
+  double* aaFreqC,
+  int* aaMass,
+  vector<int>* negative_isotope_errors,
+  const vector<const string*>* spectrum_files
+) {
+  // Create an array of locks.
+  vector<boost::mutex *> locks_array;
+  for (int i = 0; i < NUMBER_LOCK_TYPES; i++) {
+    locks_array.push_back(new boost::mutex());
+  }
+
+  int elution_window = Params::GetInt("elution-window-size");
+  bool peptide_centric = Params::GetBool("peptide-centric-search");
+
+  // initialize fields required for output
+  boost::atomic<int> sc_index(0);
+  boost::atomic<int64_t> total_candidate_peptides(0);
+  FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
+
+  if (peptide_centric == false) {
+    elution_window = 0;
+  }
+
+  double rtime_tolerance = peptide_centric ? Params::GetDouble("peptide-rt-tolerance") : 0;
+  for (int i = 0; i < NUM_THREADS; i++) {
+    active_peptide_queue[i]->setElutionWindow(elution_window);
+    active_peptide_queue[i]->setPeptideCentric(peptide_centric);
+    active_peptide_queue[i]->SetRTimeTolerance(rtime_tolerance);
+  }
+
+  if (elution_window > 0 && elution_window % 2 == 0) {
+    for (int i = 0; i < NUM_THREADS; i++) {
+      active_peptide_queue[i]->setElutionWindow(elution_window+1);
+    }
+  }
+
+  if (!peptide_centric || !exact_pval_search_) {
+    for (int i = 0; i < NUM_THREADS; i++) {
+      active_peptide_queue[i]->setElutionWindow(0);
+    }
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    // For each batch after the first of a streamed file
+    active_peptide_queue[i]->RestartSharedWindow();
+    active_peptide_queue[i]->SetOutputs(
+      NULL, &locations, top_matches, compute_sp, target_file, decoy_file, highest_mz);
+  }
+
+  // Chunks need to be small enough that the threads finish close together,
+  // but large enough that a thread does not spend its time skipping over
+  // peptides that belong to chunks claimed by other threads.
+  int chunk_size = Params::GetInt("spectrum-chunk-size");
+  if (chunk_size <= 0) {
+    chunk_size = max(1, min(256, (int)spec_charges->size() / (int)(NUM_THREADS * 32)));
+  }
+  carp(CARP_DEBUG, "Spectrum-charge chunk size: %d", chunk_size);
+  boost::atomic<int> sc_cursor(0);
+  vector<thread_stats> stats(NUM_THREADS);
+  TideMatchSet::clearLocationCache();
+  // Open-search threads finish their spectra in mass order within each
+  // block, not in chunk order.
+  TideMatchSet::ResultSink result_sink(target_file, decoy_file,
+                                       Params::GetBool("ordered-output"),
+                                       open_search_block_size_ == 0);
+  if (resume_first_ > 0) {
+    sc_cursor = resume_first_;
+    result_sink.Resume(resume_first_);
+  }
+  if (checkpoint_interval_ > 0) {
+    result_sink.SetCheckpoint(checkpoint_file_, checkpoint_position_, checkpoint_interval_);
+  }
+  if (score_index_ != NULL) {
+    result_sink.SetScoreIndex(score_index_);
+  }
+
+  // In cascade-search, mark the spectrum-charge pairs already accepted in an
+  // earlier round by their position in spec_charges. The threads read this
+  // without locking; the cascade map itself is only touched here.
+  vector<char> identified;
+  if (spectrum_flag_ != NULL) {
+    identified.resize(spec_charges->size(), 0);
+    int num_identified = 0;
+    for (size_t i = 0; i < spec_charges->size(); i++) {
+      const SpectrumCollection::SpecCharge& sc = (*spec_charges)[i];
+      const string& sc_file = spectrum_files != NULL ? *(*spectrum_files)[i] : spectrum_filename;
+      if (spectrum_flag_->find(pair<string, unsigned int>(sc_file,
+            sc.spectrum->SpectrumNumber() * 10 + sc.charge)) != spectrum_flag_->end()) {
+        identified[i] = 1;
+        ++num_identified;
+      }
+    }
+    carp(CARP_DEBUG, "Skipping %d spectrum-charge combinations identified in earlier "
+         "cascade rounds.", num_identified);
+  }
+
+  // Clusters of near-identical spectra are searched through one of them. A
+  // pair that would not be searched is in no cluster.
+  SpectrumClusters* clusters = NULL;
+  double min_cosine = Params::GetDouble("cluster-spectra");
+  if (min_cosine > 0) {
+    if (exact_pval_search_ || peptide_centric || open_search_block_size_ > 0 ||
+        result_memo_ != NULL) {
+      carp(CARP_WARNING, "cluster-spectra is not used with exact p-values, "
+           "peptide-centric or open searches, or a result-memo.");
+    } else {
+      int max_charge = Params::GetInt("max-precursor-charge");
+      vector<bool> searched(spec_charges->size());
+      for (size_t i = 0; i < spec_charges->size(); i++) {
+        const SpectrumCollection::SpecCharge& sc = (*spec_charges)[i];
+        double precursor_mz = sc.PrecursorMZ();
+        int scan_num = sc.spectrum->SpectrumNumber();
+        searched[i] = !(spectrum_flag_ != NULL && identified[i]) &&
+          precursor_mz >= spectrum_min_mz && precursor_mz <= spectrum_max_mz &&
+          scan_num >= min_scan && scan_num <= max_scan &&
+          sc.spectrum->Size() >= min_peaks &&
+          (search_charge == 0 || sc.charge == search_charge) && sc.charge <= max_charge;
+      }
+      clusters = new SpectrumClusters(*spec_charges, searched, resume_first_, chunk_size,
+                                      min_cosine,
+                                      Params::GetDouble("cluster-precursor-tolerance"));
+      carp(CARP_INFO, "Scoring %d spectrum-charge combinations only against the "
+           "best matches of a near-identical one.", clusters->NumMembers());
+    }
+  }
+
+  double search_start = wall_clock();
+
+  // Creating structs to hold information required for each thread to search through
+  // a spec charge
+
+  vector<thread_data> thread_data_array;
+  for (int i= 0; i < NUM_THREADS; i++) {
+      thread_data_array.push_back(thread_data(spectrum_filename, spec_charges, active_peptide_queue[i],
+      proteins, &locations, precursor_window, window_type, spectrum_min_mz,
+      spectrum_max_mz, min_scan, max_scan, min_peaks, search_charge, top_matches,
+      highest_mz, target_file, decoy_file, compute_sp,
+      i, NUM_THREADS, nAA, aaFreqN, aaFreqI, aaFreqC, aaMass, locks_array, 
+      bin_width_, bin_offset_, exact_pval_search_,
+      spectrum_flag_ != NULL ? &identified : NULL, &sc_index, &total_candidate_peptides,
+      search_start, negative_isotope_errors,
+      &sc_cursor, chunk_size, &stats[i], &result_sink, spectrum_files));
+    thread_data_array.back().clusters = clusters;
+  }
+
+  ThreadPool::TaskGroup threadgroup;
+
+  // Launch threads
+  for (int64_t t = 1; t < NUM_THREADS; t++) {
+    threadgroup.Run(boost::bind(&TideSearchApplication::searchTask, this, (void *) &(thread_data_array[t])));
+  }
+
+  // Searches through part of the spec charge vector while waiting for threads are busy
+  searchTask( (void *) &(thread_data_array[0]) );
+
+  // Join threads
+  threadgroup.Wait();
+
+  double search_end = wall_clock();
+  result_sink.Finish();
+  qc_stats_.merge(result_sink.Stats());
+  if (score_index_ != NULL && !result_sink.ScoreIndexComplete()) {
+    carp(CARP_WARNING, "Some results came from a result memo; not writing a score index.");
+    delete score_index_;
+    score_index_ = NULL;
+  }
+  if (NUM_THREADS > 1) {
+    for (int i = 0; i < NUM_THREADS; i++) {
+      carp(CARP_INFO, "[Thread %d]: Searched %d spectrum-charge combinations in %d chunks, "
+           "busy %.3g s, idle %.3g s.", i, stats[i].spec_charges, stats[i].chunks,
+           (stats[i].finish_time - search_start) / 1e6,
+           (search_end - stats[i].finish_time) / 1e6);
+    }
+  }
+
+  int low_quality = 0;
+  for (int i = 0; i < NUM_THREADS; i++) {
+    low_quality += stats[i].low_quality;
+  }
+  if (low_quality > 0) {
+    carp(CARP_INFO, "Skipped %d spectrum-charge combinations below min-spectrum-quality.",
+         low_quality);
+  }
+
+  carp(CARP_INFO, "Time per spectrum-charge combination: %lf s.", wall_clock() / (1e6*sc_total));
+  carp(CARP_INFO, "Average number of candidates per spectrum-charge combination: %lf ",
+                  total_candidate_peptides.load() / sc_total);
+  for (int i = 0; i < NUMBER_LOCK_TYPES; i++) {
+    delete locks_array[i];
+  }
+  delete clusters;
+}
+
+int TideSearchApplication::claimSpecChargeChunk(
+  boost::atomic<int>* cursor,
+  int chunk_size,
+  int total,
+  int* chunk_end,
+  thread_stats* stats,
+  TideMatchSet::ResultBuffer* buffer
+) {
+  buffer->EndChunk();
+  // The cursor never moves past total, so a chunk size near the int limit
+  // cannot wrap it around, however many threads keep claiming
+  int chunk_begin = cursor->load(boost::memory_order_relaxed);
+  do {
+    if (chunk_begin >= total) {
+      *chunk_end = total;
+      return total;
+    }
+    *chunk_end = total - chunk_begin <= chunk_size ? total : chunk_begin + chunk_size;
+  } while (!cursor->compare_exchange_weak(chunk_begin, *chunk_end,
+                                          boost::memory_order_relaxed));
+  ++stats->chunks;
+  stats->spec_charges += *chunk_end - chunk_begin;
+  buffer->BeginChunk(chunk_begin, *chunk_end);
+  return chunk_begin;
+}
+
+void TideSearchApplication::reserveSharedWindow(
+  ActivePeptideQueue* active_peptide_queue,
+  const vector<SpectrumCollection::SpecCharge>& spec_charges,
+  int next,
+  WINDOW_TYPE_T window_type,
+  double precursor_window,
+  int max_charge,
+  vector<int>* negative_isotope_errors,
+  vector<double>* min_mass_buf,
+  vector<double>* max_mass_buf
+) {
+  if (!active_peptide_queue->IsSharedWindowView()) {
+    return;
+  }
+  if (next >= (int)spec_charges.size()) {
+    active_peptide_queue->ReserveSharedWindow(numeric_limits<double>::infinity());
+    return;
+  }
+  // Chunks are claimed in increasing order, so the pair at the cursor, even
+  // if another thread claims it first, is no heavier than any this thread
+  // will claim.
+  double min_range, max_range;
+  min_mass_buf->clear();
+  max_mass_buf->clear();
+  computeWindow(spec_charges[next], window_type, precursor_window, max_charge,
+                negative_isotope_errors, min_mass_buf, max_mass_buf,
+                &min_range, &max_range);
+  active_peptide_queue->ReserveSharedWindow(min_range);
+}
+
+void TideSearchApplication::reportSearchProgress(
+  int searched,
+  int total,
+  int64_t candidates,
+  double search_start
+) {
+  double elapsed = (wall_clock() - search_start) / 1e6;
+  double spectra_rate = elapsed > 0 ? searched / elapsed : 0;
+  double candidate_rate = elapsed > 0 ? candidates / elapsed : 0;
+  double eta = spectra_rate > 0 ? (total - searched) / spectra_rate : 0;
+  carp(CARP_INFO, "%d spectrum-charge combinations searched, %.0f%% complete",
+       searched, searched * 100.0 / total);
+  carp(CARP_INFO, "Search progress: searched=%d total=%d elapsed_s=%.1f "
+       "spectra_per_s=%.1f candidates_per_s=%.0f eta_s=%.0f",
+       searched, total, elapsed, spectra_rate, candidate_rate, eta);
+}
+
+int TideSearchApplication::spectrum_batch::add(
+  const SpectrumCollection::SpecCharge* sc,
+  const vector<double>& sc_min_mass,
+  const vector<double>& sc_max_mass,
+  double sc_min_range,
+  double sc_max_range
+) {
+  int slot = size++;
+  spec_charges[slot] = sc;
+  observed[slot] = peak_sets[slot];
+  min_mass[slot] = sc_min_mass;
+  max_mass[slot] = sc_max_mass;
+  if (slot == 0) {
+    min_range = sc_min_range;
+    max_range = sc_max_range;
+    min_mass_front = sc_min_mass.front();
+    max_mass_back = sc_max_mass.back();
+  } else {
+    min_range = min(min_range, sc_min_range);
+    max_range = max(max_range, sc_max_range);
+    min_mass_front = min(min_mass_front, sc_min_mass.front());
+    max_mass_back = max(max_mass_back, sc_max_mass.back());
+  }
+  return slot;
+}
+
+ObservedPeakSet* TideSearchApplication::spectrum_batch::preprocessed(
+  const SpectrumCollection::SpecCharge* sc
+) const {
+  if (!sc->spectrum->Multiplexed()) {
+    return NULL;
+  }
+  for (int i = 0; i < size; i++) {
+    if (spec_charges[i]->spectrum == sc->spectrum && spec_charges[i]->charge == sc->charge) {
+      return observed[i];
+    }
+  }
+  return NULL;
+}
+
+void TideSearchApplication::scoreSpectrumBatch(
+  thread_data* my_data,
+  spectrum_batch* batch,
+  bool peptide_centric,
+  TideMatchSet::ResultBuffer* result_buffer
+) {
+  int num_spectra = batch->size;
+  if (num_spectra == 0) {
+    return;
+  }
+  batch->size = 0;
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+
+  // Load the peptides for the whole batch at once, then pick out each
+  // spectrum's candidates. A batch of one goes straight to its own window.
+  if (num_spectra > 1) {
+    batch->union_min[0] = batch->min_mass_front;
+    batch->union_max[0] = batch->max_mass_back;
+    batch->union_status.clear();
+    if (active_peptide_queue->SetActiveRange(&batch->union_min, &batch->union_max,
+                                             batch->min_range, batch->max_range,
+                                             &batch->union_status) == 0) {
+      return;
+    }
+  }
+  vector<int>& scored = batch->scored;
+  scored.clear();
+  for (int k = 0; k < num_spectra; k++) {
+    vector<bool>* status = &batch->candidate_status[k];
+    status->clear();
+    active_peptide_queue->SetSpectrumRTime(batch->spec_charges[k]->spectrum->RTime());
+    batch->num_candidates[k] = (num_spectra > 1) ?
+      active_peptide_queue->SelectActiveRange(&batch->min_mass[k], &batch->max_mass[k], status) :
+      active_peptide_queue->SetActiveRange(&batch->min_mass[k], &batch->max_mass[k],
+                                           batch->min_range, batch->max_range, status);
+    if (batch->num_candidates[k] == 0) {
+      continue;
+    }
+    my_data->total_candidate_peptides->fetch_add(batch->num_candidates[k],
+                                                 boost::memory_order_relaxed);
+    batch->selections[k] = active_peptide_queue->GetSelection();
+    // Scored peptides will go here.
+    batch->scores[k]->Reserve(status->size());
+    scored.push_back(k);
+  }
+  if (scored.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < scored.size(); i++) {
+    active_peptide_queue->NeedProgs(batch->spec_charges[scored[i]]->charge);
+  }
+
+  if (active_peptide_queue->Backend() == SCORING_JIT || scored.size() == 1) {
+    // Programs for taking the dot-product with the observed spectrum are laid
+    // out in memory managed by the active_peptide_queue, one program for each
+    // candidate peptide. The programs will store the results directly into
+    // match_arr. We now pass control to those programs.
+    for (size_t i = 0; i < scored.size(); i++) {
+      int k = scored[i];
+      active_peptide_queue->SetSelection(batch->selections[k]);
+      collectScoresCompiled(active_peptide_queue, batch->spec_charges[k]->spectrum,
+                            *batch->observed[k], batch->scores[k],
+                            batch->candidate_status[k].size(), batch->spec_charges[k]->charge);
+    }
+  } else {
+    // Stream each candidate's peak list once for all the spectra in the batch.
+    int n = scored.size();
+    for (int i = 0; i < n; i++) {
+      int k = scored[i];
+      batch->first[i] = batch->selections[k].begin;
+      batch->count[i] = batch->candidate_status[k].size();
+      batch->charge[i] = batch->spec_charges[k]->charge;
+      batch->cache[i] = PeakIndexScorer::Quantized(active_peptide_queue->Backend()) ?
+        batch->observed[k]->GetCache16() : batch->observed[k]->GetCache();
+      batch->results[i] = batch->scores[k]->data();
+      batch->scores[k]->set_size(batch->count[i]);
+    }
+    PeakIndexScorer::ScoreBatch(active_peptide_queue->Backend(), n, &batch->first[0],
+                                &batch->count[0], &batch->charge[0], &batch->cache[0],
+                                &batch->results[0]);
+  }
+
+  // matches will arrange the results in a heap by score, return the top
+  // few, and recover the association between counter and peptide. We output
+  // the top matches.
+  for (size_t i = 0; i < scored.size(); i++) {
+    int k = scored[i];
+    Spectrum* spectrum = batch->spec_charges[k]->spectrum;
+    int charge = batch->spec_charges[k]->charge;
+    TideMatchSet::Arr2* match_arr2 = batch->scores[k];
+    const vector<bool>& candidatePeptideStatus = batch->candidate_status[k];
+    int candidatePeptideStatusSize = candidatePeptideStatus.size();
+    active_peptide_queue->SetSelection(batch->selections[k]);
+    if (peptide_centric) {
+      deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
+      TideMatchSet::Arr2::iterator it = match_arr2->begin();
+      for (; it != match_arr2->end(); ++iter_, ++it) {
+        int peptide_idx = candidatePeptideStatusSize - (it->second);
+        if (candidatePeptideStatus[peptide_idx]) {
+          (*iter_)->AddHit(spectrum, it->first, 0.0, it->second, charge,
+                           active_peptide_queue->HitCapacity(), false);
+        }
+      }
+    } else {  //spectrum centric match report.
+      // Only the best top_matches + 1 targets and decoys (or matches, if
+      // they are reported together) can be reported or used for delta Cn,
+      // so they are selected here rather than copying every score to match_arr.
+      size_t keep = my_data->top_matches + 1;
+      bool split = !GlobalParams::getConcat() && HAS_DECOYS;
+      vector<pair<int, int> >* best = batch->best;
+      best[0].clear();
+      best[1].clear();
+      int threshold = numeric_limits<int>::min();  // no match below it is kept
+      for (TideMatchSet::Arr2::iterator it = match_arr2->begin();
+           it != match_arr2->end();
+           ++it) {
+        // A match tied with the worst one kept may still displace it by rank
+        if (it->first < threshold ||
+            !candidatePeptideStatus[candidatePeptideStatusSize - it->second]) {
+          continue;
+        }
+        int i = (split && active_peptide_queue->GetPeptide(it->second)->IsDecoy()) ? 1 : 0;
+        if (keepMatch(&best[i], *it, keep) && (!split || best[1 - i].size() >= keep)) {
+          threshold = min(best[0].front().first,
+                          split ? best[1].front().first : best[0].front().first);
+        }
       }
-      // clean up
-      delete [] pepMassInt;
-      delete [] scoreOffsetObs;
-      for (pe = 0; pe < nPepMassIntUniq; pe++) {
-        delete [] pValueScoreObs[pe];
+
+      TideMatchSet::Arr& match_arr = batch->matches;
+      match_arr.Reserve(best[0].size() + best[1].size());
+      for (int i = 0; i < 2; i++) {
+        for (size_t j = 0; j < best[i].size(); j++) {
+          TideMatchSet::Scores curScore;
+          curScore.xcorr_score = (double)(best[i][j].first / XCORR_SCALING);
+          curScore.rank = best[i][j].second;
+          match_arr.push_back(curScore);
+        }
       }
-      delete [] pValueScoreObs;
-      delete [] intensArrayTheor;
-      if (!peptide_centric) {
-        // matches will arrange the results in a heap by score, return the top
-        // few, and recover the association between counter and peptide. We output
-        // the top matches.
-        TideMatchSet matches(&match_arr, highest_mz);
-        matches.exact_pval_search_ = exact_pval_search;
 
-        matches.report(target_file, decoy_file, top_matches, spectrum_filename,
-                       spectrum, charge, active_peptide_queue, proteins,
-                       locations, compute_sp, false, locks_array[LOCK_RESULTS]);
+      TideMatchSet matches(&match_arr, my_data->highest_mz);
+      matches.exact_pval_search_ = false;
+      matches.SetCandidates(batch->num_candidates[k]);
+      if (result_memo_ != NULL) {
+        result_buffer->Mark();
+      }
+      matches.report(my_data->target_file, my_data->decoy_file, my_data->top_matches,
+                     spectrumFilename(my_data, batch->spec_charges[k]), spectrum, charge,
+                     batch->spec_charges[k]->PrecursorMZ(), active_peptide_queue,
+                     my_data->proteins, *my_data->locations, my_data->compute_sp, true,
+                     result_buffer);
+      if (result_memo_ != NULL) {
+        string target, decoy;
+        result_buffer->SinceMark(&target, &decoy);
+        result_memo_->Add(spectrum->SpectrumNumber(), charge, batch->spec_charges[k]->PrecursorMZ(),
+                          target, decoy);
+      }
+      if (my_data->clusters != NULL) {
+        scoreClusterMembers(my_data, batch, k, result_buffer);
+      }
+    }  //end peptide_centric == true
+  }
+}
 
-      } // end peptide_centric == true
-    } // end exact-pval-search
-    delete min_mass;
-    delete max_mass;
-    delete candidatePeptideStatus;
+void TideSearchApplication::scoreClusterMembers(
+  thread_data* my_data,
+  spectrum_batch* batch,
+  int k,
+  TideMatchSet::ResultBuffer* result_buffer
+) {
+  const SpectrumClusters* clusters = my_data->clusters;
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+  const ActivePeptideQueue::Selection& selection = batch->selections[k];
+  int max_charge = Params::GetInt("max-precursor-charge");
+  size_t keep = my_data->top_matches + 1;
+  TideMatchSet::Arr2* match_arr2 = batch->scores[k];  // the representative is done with it
+  int rep_pos = batch->spec_charges[k] - &(*my_data->spec_charges)[0];
+  for (int m = clusters->Next(rep_pos); m >= 0; m = clusters->Next(m)) {
+    const SpectrumCollection::SpecCharge* sc = &(*my_data->spec_charges)[m];
+    batch->member_min.clear();
+    batch->member_max.clear();
+    double min_range, max_range;
+    computeWindow(*sc, my_data->window_type, my_data->precursor_window, max_charge,
+                  my_data->negative_isotope_errors, &batch->member_min,
+                  &batch->member_max, &min_range, &max_range);
+    preprocessSpectrum(batch->member_observed, *sc->spectrum, sc->charge,
+                       &batch->member_counts[0], &batch->member_counts[1],
+                       &batch->member_counts[2], &batch->member_counts[3]);
+
+    // The representative's matches are not consecutive in the queue, so
+    // each is scored on its own, as for the fragment index prefilter.
+    int num_scored = 0;
+    for (int i = 0; i < 2; i++) {
+      batch->member_best[i].clear();
+      for (size_t j = 0; j < batch->best[i].size(); j++) {
+        int rank = batch->best[i][j].second;
+        deque<Peptide*>::const_iterator peptide = selection.end - rank;
+        double mass = (*peptide)->Mass();
+        bool in_window = false;
+        for (size_t w = 0; w < batch->member_min.size() && !in_window; w++) {
+          in_window = batch->member_min[w] <= mass && mass <= batch->member_max[w];
+        }
+        if (!in_window) {
+          continue;
+        }
+        ActivePeptideQueue::Selection one = { peptide, peptide + 1, 0, 0 };
+        active_peptide_queue->SetSelection(one);
+        match_arr2->Reserve(1);
+        collectScoresCompiled(active_peptide_queue, sc->spectrum, *batch->member_observed,
+                              match_arr2, 1, sc->charge);
+        keepMatch(&batch->member_best[i], make_pair((*match_arr2)[0].first, rank), keep);
+        ++num_scored;
+      }
+    }
+    if (num_scored == 0) {
+      continue;
+    }
+    my_data->total_candidate_peptides->fetch_add(num_scored, boost::memory_order_relaxed);
+
+    TideMatchSet::Arr& match_arr = batch->matches;
+    match_arr.Reserve(batch->member_best[0].size() + batch->member_best[1].size());
+    for (int i = 0; i < 2; i++) {
+      for (size_t j = 0; j < batch->member_best[i].size(); j++) {
+        TideMatchSet::Scores curScore;
+        curScore.xcorr_score = (double)(batch->member_best[i][j].first / XCORR_SCALING);
+        curScore.rank = batch->member_best[i][j].second;
+        match_arr.push_back(curScore);
+      }
+    }
+    active_peptide_queue->SetSelection(selection);
+    TideMatchSet matches(&match_arr, my_data->highest_mz);
+    matches.exact_pval_search_ = false;
+    matches.SetCandidates(num_scored);
+    matches.report(my_data->target_file, my_data->decoy_file, my_data->top_matches,
+                   spectrumFilename(my_data, sc), sc->spectrum, sc->charge,
+                   sc->PrecursorMZ(), active_peptide_queue,
+                   my_data->proteins, *my_data->locations, my_data->compute_sp, true,
+                   result_buffer);
   }
+  active_peptide_queue->SetSelection(selection);
+}
 
-  if ( !Params::GetBool("skip-preprocessing") ) {
-    locks_array[LOCK_REPORTING]->lock();
-    long int total_peaks = num_precursors_skipped + num_isotopes_skipped + num_range_skipped + num_retained;
-    if ( total_peaks == 0 ){
-      carp(CARP_INFO, "[Thread %d]: Warning: no peaks found.", thread_num);
-    } else {
-      carp(CARP_INFO,
-           "[Thread %d]: Deleted %d precursor, %d isotope and %d out-of-range peaks.",
-           thread_num, num_precursors_skipped, num_isotopes_skipped, num_range_skipped);
+void TideSearchApplication::searchOpenBlocks(thread_data* my_data) {
+  const vector<SpectrumCollection::SpecCharge>* spec_charges = my_data->spec_charges;
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+  const vector<char>* identified = my_data->identified;
+  int max_charge = Params::GetInt("max-precursor-charge");
+  int batch_size = max(1, Params::GetInt("spectrum-batch-size"));
+  int print_interval = Params::GetInt("print-search-progress");
+  TideMatchSet::ResultBuffer result_buffer(my_data->result_sink);
+  spectrum_batch batch(batch_size, my_data->bin_width, my_data->bin_offset,
+                       Params::GetBool("use-neutral-loss-peaks"),
+                       Params::GetBool("use-flanking-peaks"));
+  long int peak_counts[4] = {0, 0, 0, 0};
+
+  // The thread's share of the spectrum-charge pairs is fixed up front, as
+  // every thread reads the whole index anyway. Pairs that are not searched
+  // still get their (empty) turn in ordered output.
+  const int sc_count = (int)spec_charges->size();
+  const int chunk_size = my_data->chunk_size;
+  vector<open_spectrum*> pending;
+  vector<pair<double, int> > order;
+  // 64 bits, as the chunk size may be anything up to a billion
+  for (int64_t begin = (int64_t)my_data->thread_num * chunk_size; begin < sc_count;
+       begin += (int64_t)my_data->num_threads * chunk_size) {
+    int chunk_begin = (int)begin;
+    int chunk_end = (int)min(begin + chunk_size, (int64_t)sc_count);
+    ++my_data->stats->chunks;
+    my_data->stats->spec_charges += chunk_end - chunk_begin;
+    for (int sc_pos = chunk_begin; sc_pos < chunk_end; sc_pos++) {
+      const SpectrumCollection::SpecCharge* sc = &(*spec_charges)[sc_pos];
+      Spectrum* spectrum = sc->spectrum;
+      double precursor_mz = sc->PrecursorMZ();
+      int charge = sc->charge;
+      int scan_num = spectrum->SpectrumNumber();
+      if ((identified != NULL && (*identified)[sc_pos]) ||
+          precursor_mz < my_data->spectrum_min_mz || precursor_mz > my_data->spectrum_max_mz ||
+          scan_num < my_data->min_scan || scan_num > my_data->max_scan ||
+          spectrum->Size() < my_data->min_peaks ||
+          (my_data->search_charge != 0 && charge != my_data->search_charge) ||
+          charge > max_charge) {
+        result_buffer.BeginChunk(sc_pos, sc_pos + 1);
+        result_buffer.EndChunk();
+        my_data->sc_index->fetch_add(1, boost::memory_order_relaxed);
+        continue;
+      }
+      open_spectrum* open = new open_spectrum;
+      open->sc_pos = sc_pos;
+      open->sc = sc;
+      open->preprocessed = false;
+      open->targets = open->decoys = 0;
+      double min_range, max_range;
+      computeWindow(*sc, my_data->window_type, my_data->precursor_window, max_charge,
+                    my_data->negative_isotope_errors, &open->min_mass, &open->max_mass,
+                    &min_range, &max_range);
+      if (fragment_index_candidates_ > 0) {
+        getFragmentBins(*spectrum, charge, fragment_index_peaks_, &open->fragment_bins);
+      }
+      order.push_back(make_pair(open->min_mass.front(), (int)pending.size()));
+      pending.push_back(open);
     }
-    if ( num_retained == 0 ) {
-      carp(CARP_INFO, "[Thread %d]: Warning: no peaks retained.", thread_num);
-    } else {
-      carp(CARP_INFO, "[Thread %d]: Retained %g%% of peaks.",
-           thread_num, (100.0 * num_retained) / total_peaks);
+  }
+  // m/z windows need not grow with neutral mass, so the pairs join the
+  // search in order of their lightest candidate mass.
+  sort(order.begin(), order.end());
+
+  vector<open_spectrum*> active;
+  size_t next = 0;
+  while (active_peptide_queue->LoadBlock(open_search_block_size_) > 0) {
+    double block_max = active_peptide_queue->BlockMaxMass();
+    while (next < order.size() && order[next].first <= block_max) {
+      active.push_back(pending[order[next++].second]);
     }
-    locks_array[LOCK_REPORTING]->unlock();
+    for (size_t i = 0; i < active.size(); i += batch.capacity) {
+      scoreOpenBlock(my_data, &batch, &active[i],
+                     min((int)(active.size() - i), batch.capacity), peak_counts);
+    }
+    // Later blocks only hold peptides at least as heavy as this one's.
+    size_t kept = 0;
+    for (size_t i = 0; i < active.size(); i++) {
+      if (active[i]->max_mass.back() <= block_max) {
+        reportOpenSpectrum(my_data, active[i], &batch, &result_buffer);
+        int searched = my_data->sc_index->fetch_add(1, boost::memory_order_relaxed);
+        if (print_interval > 0 && searched > 0 && searched % print_interval == 0) {
+          reportSearchProgress(searched, sc_count,
+                               my_data->total_candidate_peptides->load(boost::memory_order_relaxed),
+                               my_data->search_start);
+        }
+      } else {
+        active[kept++] = active[i];
+      }
+    }
+    active.resize(kept);
+  }
+  for (; next < order.size(); next++) {
+    active.push_back(pending[order[next].second]);
   }
+  for (size_t i = 0; i < active.size(); i++) {
+    reportOpenSpectrum(my_data, active[i], &batch, &result_buffer);
+    my_data->sc_index->fetch_add(1, boost::memory_order_relaxed);
+  }
+  my_data->stats->finish_time = wall_clock();
 
+  reportPeakCounts(my_data, peak_counts[0], peak_counts[1], peak_counts[2], peak_counts[3]);
 }
 
-void TideSearchApplication::search(
-  const string& spectrum_filename,
-  const vector<SpectrumCollection::SpecCharge>* spec_charges,
-  vector<ActivePeptideQueue*> active_peptide_queue,
-  ProteinVec& proteins,
-  vector<const pb::AuxLocation*>& locations,
-  double precursor_window,
-  WINDOW_TYPE_T window_type,
-  double spectrum_min_mz,
-  double spectrum_max_mz,
-  int min_scan,
-  int max_scan,
-  int min_peaks,
-  int search_charge,
-  int top_matches,
-  double highest_mz,
-  ofstream* target_file,
-  ofstream* decoy_file,
-  bool compute_sp,
-  int nAA, 
-  double* aaFreqN,
-  double* aaFreqI,
-  double* aaFreqC,
-  int* aaMass,
-  vector<int>* negative_isotope_errors
+void TideSearchApplication::getFragmentBins(
+  const Spectrum& spectrum,
+  int charge,
+  int num_peaks,
+  vector<int>* bins
 ) {
-  // Create an array of locks.
-  vector<boost::mutex *> locks_array;
-  for (int i = 0; i < NUMBER_LOCK_TYPES; i++) {
-    locks_array.push_back(new boost::mutex());
+  double max_mz = (spectrum.HighestPrecursorMZ(charge) - MASS_PROTON) * charge + MASS_PROTON;
+  vector<pair<double, int> > peaks;
+  for (int i = 0; i < spectrum.Size(); i++) {
+    if (spectrum.M_Z(i) < max_mz) {
+      peaks.push_back(make_pair(-spectrum.Intensity(i), i));
+    }
   }
+  int n = min(num_peaks, (int)peaks.size());
+  nth_element(peaks.begin(), peaks.begin() + n, peaks.end());
+  bins->clear();
+  for (int i = 0; i < n; i++) {
+    bins->push_back(MassConstants::mass2bin(spectrum.M_Z(peaks[i].second)));
+  }
+  sort(bins->begin(), bins->end());
+  bins->erase(unique(bins->begin(), bins->end()), bins->end());
+}
 
-  int elution_window = Params::GetInt("elution-window-size");
-  bool peptide_centric = Params::GetBool("peptide-centric-search");
-
-  // initialize fields required for output
-  int* sc_index = new int(-1);
-  int* total_candidate_peptides = new int(0);
-  FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
+// Greater-than on scores, for keeping the best matches in a min-heap.
+static bool moreOpenScore(const pair<int, Peptide*>& x, const pair<int, Peptide*>& y) {
+  return x.first > y.first;
+}
 
-  if (peptide_centric == false) {
-    elution_window = 0;
+void TideSearchApplication::scoreOpenBlock(
+  thread_data* my_data,
+  spectrum_batch* batch,
+  open_spectrum* const* spectra,
+  int num_spectra,
+  long int* peak_counts
+) {
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+  long int dummy[4];
+
+  // Only the spectra with candidates in this block get preprocessed.
+  vector<int>& scored = batch->scored;
+  scored.clear();
+  for (int k = 0; k < num_spectra; k++) {
+    open_spectrum* open = spectra[k];
+    vector<bool>* status = &batch->candidate_status[k];
+    status->clear();
+    batch->num_candidates[k] = active_peptide_queue->SelectActiveRange(
+      &open->min_mass, &open->max_mass, status);
+    if (batch->num_candidates[k] == 0) {
+      continue;
+    }
+    my_data->total_candidate_peptides->fetch_add(batch->num_candidates[k],
+                                                 boost::memory_order_relaxed);
+    batch->selections[k] = active_peptide_queue->GetSelection();
+    open->targets += batch->selections[k].targets;
+    open->decoys += batch->selections[k].decoys;
+    long int* counts = open->preprocessed ? dummy : peak_counts;
+    preprocessSpectrum(batch->observed[k], *open->sc->spectrum, open->sc->charge,
+                       &counts[0], &counts[1], &counts[2], &counts[3]);
+    open->preprocessed = true;
+    if (fragment_index_candidates_ > 0 &&
+        batch->num_candidates[k] > fragment_index_candidates_) {
+      scoreOpenPrefiltered(my_data, batch, k, open, batch->selections[k], *status);
+      continue;
+    }
+    batch->scores[k]->Reserve(status->size());
+    scored.push_back(k);
   }
-
-  for (int i = 0; i < NUM_THREADS; i++) {
-    active_peptide_queue[i]->setElutionWindow(elution_window);
-    active_peptide_queue[i]->setPeptideCentric(peptide_centric);
+  if (scored.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < scored.size(); i++) {
+    active_peptide_queue->NeedProgs(batch->spec_charges[scored[i]]->charge);
   }
 
-  if (elution_window > 0 && elution_window % 2 == 0) {
-    for (int i = 0; i < NUM_THREADS; i++) {
-      active_peptide_queue[i]->setElutionWindow(elution_window+1);
+  if (active_peptide_queue->Backend() == SCORING_JIT || scored.size() == 1) {
+    for (size_t i = 0; i < scored.size(); i++) {
+      int k = scored[i];
+      active_peptide_queue->SetSelection(batch->selections[k]);
+      collectScoresCompiled(active_peptide_queue, spectra[k]->sc->spectrum,
+                            *batch->observed[k], batch->scores[k],
+                            batch->candidate_status[k].size(), spectra[k]->sc->charge);
+    }
+  } else {
+    int n = scored.size();
+    for (int i = 0; i < n; i++) {
+      int k = scored[i];
+      batch->first[i] = batch->selections[k].begin;
+      batch->count[i] = batch->candidate_status[k].size();
+      batch->charge[i] = spectra[k]->sc->charge;
+      batch->cache[i] = PeakIndexScorer::Quantized(active_peptide_queue->Backend()) ?
+        batch->observed[k]->GetCache16() : batch->observed[k]->GetCache();
+      batch->results[i] = batch->scores[k]->data();
+      batch->scores[k]->set_size(batch->count[i]);
     }
+    PeakIndexScorer::ScoreBatch(active_peptide_queue->Backend(), n, &batch->first[0],
+                                &batch->count[0], &batch->charge[0], &batch->cache[0],
+                                &batch->results[0]);
   }
 
-  if (!peptide_centric || !exact_pval_search_) {
-    for (int i = 0; i < NUM_THREADS; i++) {
-      active_peptide_queue[i]->setElutionWindow(0);
+  // Keep the top_matches + 1 best targets and decoys; report() needs one
+  // more than it writes for delta cn, and takes them from both kinds when
+  // decoys are not reported separately.
+  size_t keep = my_data->top_matches + 1;
+  for (size_t i = 0; i < scored.size(); i++) {
+    int k = scored[i];
+    open_spectrum* open = spectra[k];
+    const vector<bool>& candidatePeptideStatus = batch->candidate_status[k];
+    int candidatePeptideStatusSize = candidatePeptideStatus.size();
+    deque<Peptide*>::const_iterator end = batch->selections[k].end;
+    TideMatchSet::Arr2* match_arr2 = batch->scores[k];
+    for (TideMatchSet::Arr2::iterator it = match_arr2->begin();
+         it != match_arr2->end();
+         ++it) {
+      if (!candidatePeptideStatus[candidatePeptideStatusSize - it->second]) {
+        continue;
+      }
+      keepOpenMatch(open, it->first, *(end - it->second), keep);
     }
   }
+}
 
-  for (int i = 0; i < NUM_THREADS; i++) {
-    active_peptide_queue[i]->SetOutputs(
-      NULL, &locations, top_matches, compute_sp, target_file, decoy_file, highest_mz);
+void TideSearchApplication::scoreOpenPrefiltered(
+  thread_data* my_data,
+  spectrum_batch* batch,
+  int slot,
+  open_spectrum* open,
+  const ActivePeptideQueue::Selection& selection,
+  const vector<bool>& status
+) {
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+  int first = active_peptide_queue->BlockPosition(selection.begin);
+  int n = status.size();
+  vector<int>& counts = batch->shared_counts;
+  counts.assign(n, 0);
+  active_peptide_queue->GetFragmentIndex()->CountShared(open->fragment_bins, first,
+                                                        first + n, &counts[0]);
+
+  // Most shared bins first; ties go to the lighter peptide.
+  vector<pair<int, int> >& ranked = batch->ranked;
+  ranked.clear();
+  for (int i = 0; i < n; i++) {
+    if (status[i]) {
+      ranked.push_back(make_pair(-counts[i], i));
+    }
   }
-
-  // Creating structs to hold information required for each thread to search through
-  // a spec charge
-
-  vector<thread_data> thread_data_array;
-  for (int i= 0; i < NUM_THREADS; i++) {
-      thread_data_array.push_back(thread_data(spectrum_filename, spec_charges, active_peptide_queue[i],
-      proteins, locations, precursor_window, window_type, spectrum_min_mz,
-      spectrum_max_mz, min_scan, max_scan, min_peaks, search_charge, top_matches,
-      highest_mz, target_file, decoy_file, compute_sp,
-      i, NUM_THREADS, nAA, aaFreqN, aaFreqI, aaFreqC, aaMass, locks_array, 
-      bin_width_, bin_offset_, exact_pval_search_, spectrum_flag_, sc_index, total_candidate_peptides, negative_isotope_errors));
+  int num_scored = min(fragment_index_candidates_, (int)ranked.size());
+  nth_element(ranked.begin(), ranked.begin() + num_scored, ranked.end());
+
+  // The chosen candidates are not consecutive, so each is scored on its own.
+  size_t keep = my_data->top_matches + 1;
+  TideMatchSet::Arr2* match_arr2 = batch->scores[slot];
+  match_arr2->Reserve(1);
+  for (int j = 0; j < num_scored; j++) {
+    deque<Peptide*>::const_iterator peptide =
+      active_peptide_queue->BlockPeptide(first + ranked[j].second);
+    ActivePeptideQueue::Selection one = { peptide, peptide + 1, 0, 0 };
+    active_peptide_queue->SetSelection(one);
+    collectScoresCompiled(active_peptide_queue, open->sc->spectrum, *batch->observed[slot],
+                          match_arr2, 1, open->sc->charge);
+    keepOpenMatch(open, (*match_arr2)[0].first, *peptide, keep);
   }
+}
 
-  boost::thread_group threadgroup;
-
-  // Launch threads
-  for (int64_t t = 1; t < NUM_THREADS; t++) {
-    boost::thread * currthread = new boost::thread(boost::bind(&TideSearchApplication::search, this, (void *) &(thread_data_array[t])));
-    threadgroup.add_thread(currthread);
+bool TideSearchApplication::keepMatch(
+  vector< pair<int, int> >* best,
+  const pair<int, int>& match,
+  size_t keep
+) {
+  if (best->size() < keep) {
+    best->push_back(match);
+    push_heap(best->begin(), best->end(), greater< pair<int, int> >());
+    return best->size() == keep;
+  } else if (match > best->front()) {
+    pop_heap(best->begin(), best->end(), greater< pair<int, int> >());
+    best->back() = match;
+    push_heap(best->begin(), best->end(), greater< pair<int, int> >());
+    return true;
   }
+  return false;
+}
 
-  // Searches through part of the spec charge vector while waiting for threads are busy
-  search( (void *) &(thread_data_array[0]) );
-
-  // Join threads
-  threadgroup.join_all();
+void TideSearchApplication::keepOpenMatch(
+  open_spectrum* open,
+  int score,
+  const Peptide* peptide,
+  size_t keep
+) {
+  vector< pair<int, Peptide*> >& best = open->best[peptide->IsDecoy() ? 1 : 0];
+  if (best.size() < keep) {
+    best.push_back(make_pair(score, new Peptide(*peptide)));
+    push_heap(best.begin(), best.end(), moreOpenScore);
+  } else if (score > best.front().first) {
+    pop_heap(best.begin(), best.end(), moreOpenScore);
+    delete best.back().second;
+    best.back() = make_pair(score, new Peptide(*peptide));
+    push_heap(best.begin(), best.end(), moreOpenScore);
+  }
+}
 
-  carp(CARP_INFO, "Time per spectrum-charge combination: %lf s.", wall_clock() / (1e6*sc_total));
-  carp(CARP_INFO, "Average number of candidates per spectrum-charge combination: %lf ",
-                  (*total_candidate_peptides) / sc_total);
-  for (int i = 0; i < NUMBER_LOCK_TYPES; i++) {
-    delete locks_array[i];
+void TideSearchApplication::reportOpenSpectrum(
+  thread_data* my_data,
+  open_spectrum* open,
+  spectrum_batch* batch,
+  TideMatchSet::ResultBuffer* result_buffer
+) {
+  vector<const Peptide*> peptides;
+  TideMatchSet::Arr& match_arr = batch->matches;
+  match_arr.Reserve(open->best[0].size() + open->best[1].size());
+  for (int i = 0; i < 2; i++) {
+    for (size_t j = 0; j < open->best[i].size(); j++) {
+      TideMatchSet::Scores curScore;
+      curScore.xcorr_score = (double)(open->best[i][j].first / XCORR_SCALING);
+      curScore.rank = peptides.size();
+      match_arr.push_back(curScore);
+      peptides.push_back(open->best[i][j].second);
+    }
   }
-  delete sc_index;
-  delete total_candidate_peptides;
 
+  result_buffer->BeginChunk(open->sc_pos, open->sc_pos + 1);
+  TideMatchSet matches(&match_arr, my_data->highest_mz);
+  matches.exact_pval_search_ = false;
+  matches.SetPeptides(&peptides, open->targets, open->decoys);
+  matches.SetCandidates(open->targets + open->decoys);
+  matches.report(my_data->target_file, my_data->decoy_file, my_data->top_matches,
+                 spectrumFilename(my_data, open->sc), open->sc->spectrum, open->sc->charge,
+                 open->sc->PrecursorMZ(), my_data->active_peptide_queue, my_data->proteins, *my_data->locations,
+                 my_data->compute_sp, true, result_buffer);
+  result_buffer->EndChunk();
+
+  for (size_t i = 0; i < peptides.size(); i++) {
+    delete peptides[i];
+  }
+  delete open;
 }
 
 void TideSearchApplication::collectScoresCompiled(
@@ -857,6 +2714,20 @@ void TideSearchApplication::collectScoresCompiled(
   if (!active_peptide_queue->HasNext()) {
     return;
   }
+  CRUX_TIME_STAGE(STAGE_SCORE);
+  CRUX_COUNT(COUNTER_CANDIDATES_SCORED, queue_size);
+  CRUX_COUNT(COUNTER_SPECTRA_SEARCHED, 1);
+  if (active_peptide_queue->Backend() != SCORING_JIT) {
+    // The queue holds peak index lists rather than programs.
+    PeakIndexScorer::Score(active_peptide_queue->Backend(), active_peptide_queue->iter_,
+                           queue_size, charge,
+                           PeakIndexScorer::Quantized(active_peptide_queue->Backend()) ?
+                             observed.GetCache16() : observed.GetCache(),
+                           match_arr->data());
+    match_arr->set_size(queue_size);
+    return;
+  }
+#ifdef TIDE_HAVE_JIT
   // prog gets the address of the dot-product program for the first peptide
   // in the active queue.
   const void* prog = active_peptide_queue->NextPeptide()->Prog(charge);
@@ -956,12 +2827,122 @@ void TideSearchApplication::collectScoresCompiled(
   // match_arr is filled by the compiled programs, not by calls to
   // push_back(). We have to set the final size explicitly.
   match_arr->set_size(queue_size);
+#endif // TIDE_HAVE_JIT
+}
+
+/**
+ * \returns The name of the tab-delimited results file starting with prefix,
+ * ending in .txt, or in .bin for txt-format = binary, then in .gz for
+ * compress-output.
+ */
+string TideSearchApplication::resultsFileName(const string& prefix) {
+  return prefix + (TideMatchSet::binaryOutput() ? "bin" : "txt") +
+    (Params::GetBool("compress-output") ? ".gz" : "");
+}
+
+/**
+ * Opens a results file for writing, gzipped if its name ends in .gz.
+ * Exits if the file exists and overwrite is false.
+ */
+ostream* TideSearchApplication::createResultsFile(
+  const string& path,
+  bool overwrite,
+  bool binary
+) {
+  if (FileUtils::Exists(path)) {
+    if (!overwrite) {
+      carp(CARP_FATAL, "The file '%s' already exists and cannot be overwritten. "
+           "Use --overwrite T to replace or choose a different output file name",
+           path.c_str());
+    }
+    carp(CARP_WARNING, "The file '%s' already exists and will be overwritten.", path.c_str());
+  }
+  ostream* out = FileUtils::GetWriteStream(path, true, binary);
+  if (out == NULL) {
+    carp(CARP_FATAL, "Failed to create and open file: %s", path.c_str());
+  }
+  return out;
+}
+
+ostream* TideSearchApplication::reopenResultsFile(
+  const string& path,
+  long long offset,
+  bool binary
+) {
+  boost::system::error_code error;
+  if (offset < 0 || !FileUtils::Exists(path) ||
+      (long long)boost::filesystem::file_size(path) < offset) {
+    carp(CARP_FATAL, "The results file '%s' does not hold the results that the "
+         "checkpoint records; start the search again without --resume.", path.c_str());
+  }
+  boost::filesystem::resize_file(path, offset, error);
+  if (error) {
+    carp(CARP_FATAL, "Failed to truncate '%s': %s", path.c_str(), error.message().c_str());
+  }
+  ios::openmode mode = ios::in | ios::out;
+  if (binary) {
+    mode |= ios::binary;
+  }
+  fstream* out = new fstream(path.c_str(), mode);
+  if (!out->good()) {
+    carp(CARP_FATAL, "Failed to open file: %s", path.c_str());
+  }
+  out->seekp(0, ios::end);
+  return out;
+}
+
+/**
+ * Reads a checkpoint that ResultSink::SetCheckpoint() had written.
+ * \returns false if there is none.
+ */
+bool TideSearchApplication::readCheckpoint(const string& path, Checkpoint* checkpoint) {
+  ifstream in(path.c_str());
+  if (!in) {
+    return false;
+  }
+  map<string, long long> values;
+  string key;
+  long long value;
+  while (in >> key >> value) {
+    values[key] = value;
+  }
+  const char* keys[] = { "file", "batch", "spec-charges", "target-offset", "decoy-offset" };
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    if (values.find(keys[i]) == values.end()) {
+      carp(CARP_FATAL, "The checkpoint %s has no %s.", path.c_str(), keys[i]);
+    }
+  }
+  checkpoint->file = values["file"];
+  checkpoint->batch = values["batch"];
+  checkpoint->spec_charges = values["spec-charges"];
+  checkpoint->target_offset = values["target-offset"];
+  checkpoint->decoy_offset = values["decoy-offset"];
+  return true;
+}
+
+/**
+ * Writes tide-search.qc.html from the statistics collected by the searches.
+ */
+void TideSearchApplication::writeQCReport() const {
+  string path = outputPath("tide-search.qc.html");
+  ostream* out = FileUtils::GetWriteStream(path, Params::GetBool("overwrite"));
+  if (out == NULL) {
+    carp(CARP_ERROR, "Could not write the QC report to %s", path.c_str());
+    return;
+  }
+  qc_stats_.writeHTML(out, "tide-search QC report",
+                      exact_pval_search_ ? "-log10(exact p-value)" : "XCorr");
+  delete out;
+  carp(CARP_INFO, "Wrote the QC report to %s", path.c_str());
 }
 
 void TideSearchApplication::convertResults() const {
+  if (!output_dir_.empty() || resultsInMemory()) {
+    return;
+  }
   PSMConvertApplication converter;
   if (!Params::GetBool("concat")) {
-    string target_file_name = make_file_path("tide-search.target.txt");
+    string target_file_name = outputPath(resultsFileName("tide-search.target."));
     if (Params::GetBool("pin-output")) {
       converter.convertFile("tsv", "pin", target_file_name, "tide-search.target.", Params::GetString("protein-database"), true);
     }
@@ -976,7 +2957,7 @@ void TideSearchApplication::convertResults() const {
     }
 
     if (HAS_DECOYS) {
-      string decoy_file_name = make_file_path("tide-search.decoy.txt");
+      string decoy_file_name = outputPath(resultsFileName("tide-search.decoy."));
       if (Params::GetBool("pin-output")) {
         converter.convertFile("tsv", "pin", decoy_file_name, "tide-search.decoy.", Params::GetString("protein-database"), true);
       }
@@ -991,7 +2972,7 @@ void TideSearchApplication::convertResults() const {
       }
     }
   } else {
-    string concat_file_name = make_file_path("tide-search.txt");
+    string concat_file_name = outputPath(resultsFileName("tide-search."));
     if (Params::GetBool("pin-output")) {
       converter.convertFile("tsv", "pin", concat_file_name, "tide-search.", Params::GetString("protein-database"), true);
     }
@@ -1029,7 +3010,7 @@ void TideSearchApplication::computeWindow(
     *max_range = (sc.neutral_mass + (negative_isotope_errors->back() * unit_dalton)) + precursor_window;
     break;
   case WINDOW_MZ: {
-    double mz_minus_proton = sc.spectrum->PrecursorMZ() - MASS_PROTON;
+    double mz_minus_proton = sc.PrecursorMZ() - MASS_PROTON;
     for (vector<int>::const_iterator ie = negative_isotope_errors->begin(); ie != negative_isotope_errors->end(); ++ie) {
       out_min->push_back((mz_minus_proton - precursor_window) * sc.charge + (*ie * unit_dalton));
       out_max->push_back((mz_minus_proton + precursor_window) * sc.charge + (*ie * unit_dalton));
@@ -1063,6 +3044,67 @@ bool TideSearchApplication::proteinLevelDecoys() {
   return PROTEIN_LEVEL_DECOYS;
 }
 
+bool TideSearchApplication::searchTimeDecoys() {
+  return SEARCH_TIME_DECOYS;
+}
+
+void TideSearchApplication::keepIndex(bool keep) {
+  keep_index_ = keep;
+}
+
+HeadedRecordReader* TideSearchApplication::openPeptides(
+  const string& peptides_file,
+  pb::Header* header,
+  bool map_file
+) const {
+  if (memory_index_ != NULL) {
+    return new HeadedRecordReader(&memory_index_->peptides, header);
+  }
+  return new HeadedRecordReader(peptides_file, header, -1, map_file);
+}
+
+bool TideSearchApplication::useMemoryIndex(const string& file) {
+  bool peptide_list = TideIndexApplication::isPeptideList(file);
+  if (!peptide_list && !Params::GetBool("memory-index")) {
+    return false;
+  }
+  const char* unsupported = NULL;
+  if (!Params::GetString("store-index").empty()) {
+    unsupported = "store-index";
+  } else if (!Params::GetString("cterm-protein-mods-spec").empty() ||
+             !Params::GetString("nterm-protein-mods-spec").empty()) {
+    unsupported = "protein terminal modifications";
+  }
+  if (unsupported == NULL) {
+    return true;
+  } else if (peptide_list) {
+    carp(CARP_FATAL, "A list of peptides cannot be searched with %s; "
+         "give a FASTA file or an index instead.", unsupported);
+  }
+  carp(CARP_WARNING, "memory-index is not supported with %s; running "
+       "tide-index instead.", unsupported);
+  return false;
+}
+
+void TideSearchApplication::releaseIndex() {
+  MemoryAccounting::Add(MEMORY_PROTEINS, -ProteinBytes(kept_proteins_));
+  for (ProteinVec::iterator i = kept_proteins_.begin(); i != kept_proteins_.end(); ++i) {
+    delete *i;
+  }
+  delete kept_locations_;
+  kept_index_.clear();
+  kept_proteins_.clear();
+  kept_locations_ = NULL;
+}
+
+void TideSearchApplication::setOutputDirectory(const string& dir) {
+  output_dir_ = dir;
+}
+
+string TideSearchApplication::outputPath(const string& name) const {
+  return output_dir_.empty() ? make_file_path(name) : FileUtils::Join(output_dir_, name);
+}
+
 string TideSearchApplication::getName() const {
   return "tide-search";
 }
@@ -1087,7 +3129,8 @@ string TideSearchApplication::getDescription() const {
     "<p>When <code>tide-search</code> runs, it performs "
     "several intermediate steps, as follows:</p><ol>"
     "<li>If a FASTA file was provided, convert it to an index using "
-    "<code>tide-index</code>.</li>"
+    "<code>tide-index</code> or, with <code>--memory-index</code> or for a "
+    "list of peptides, build the index in memory.</li>"
     "<li>Convert the given "
     "fragmentation spectra to a binary format.</li><li>Search the spectra "
     "against the database and store the results in binary format.</li><li>"
@@ -1114,8 +3157,15 @@ vector<string> TideSearchApplication::getOptions() const {
   string arr[] = {
     "auto-mz-bin-width",
     "auto-precursor-window",
+    "auto-tolerance-multiplier",
+    "auto-tolerance-spectra",
+    "cluster-precursor-tolerance",
+    "cluster-spectra",
     "compute-sp",
     "concat",
+    "coordinator",
+    "coordinator-address",
+    "coordinator-port",
     "deisotope",
     "elution-window-size",
     "exact-p-value",
@@ -1123,17 +3173,30 @@ vector<string> TideSearchApplication::getOptions() const {
     "fileroot",
     "isotope-error",
     "mass-precision",
+    "max-memory",
     "max-precursor-charge",
+    "max-spectra-in-memory",
+    "merge-spectrum-files",
+    "metrics-address",
+    "metrics-port",
     "min-peaks",
+    "min-spectrum-quality",
     "mod-precision",
+    "multiplexed-spectra",
     "mz-bin-offset",
     "mz-bin-width",
     "mzid-output",
     "num-threads",
+    "num-workers",
+    "ordered-output",
     "output-dir",
     "overwrite",
     "parameter-file",
+    "peak-window-width",
+    "peaks-per-window",
     "peptide-centric-search",
+    "peptide-retention-times",
+    "peptide-rt-tolerance",
     "pepxml-output",
     "pin-output",
     "pm-charge",
@@ -1151,20 +3214,43 @@ vector<string> TideSearchApplication::getOptions() const {
     "precision",
     "precursor-window",
     "precursor-window-type",
+    "preprocessed-store",
     "print-search-progress",
     "remove-precursor-peak",
     "remove-precursor-tolerance",
+    "result-memo",
     "scan-number",
+    "score-index",
+    "search-decoys",
+    "seed",
+    "shared-peptide-window",
+    "mmap-index",
+    "index-read-ahead",
+    "fifo-huge-pages",
+    "numa-placement",
+    "fragment-index-candidates",
+    "fragment-index-peaks",
+    "open-search-block-size",
+    "scoring-backend",
+    "spectrum-batch-size",
     "skip-preprocessing",
+    "spectrum-cache-dir",
     "spectrum-charge",
+    "spectrum-chunk-size",
     "spectrum-max-mz",
     "spectrum-min-mz",
     "spectrum-parser",
     "sqt-output",
     "store-index",
+    "memory-index",
     "store-spectra",
     "top-match",
     "txt-output",
+    "txt-format",
+    "compress-output",
+    "qc-report",
+    "checkpoint-interval",
+    "resume",
     "use-flanking-peaks",
     "use-neutral-loss-peaks",
     "use-z-line",
@@ -1177,10 +3263,14 @@ vector< pair<string, string> > TideSearchApplication::getOutputs() const {
   vector< pair<string, string> > outputs;
   outputs.push_back(make_pair("tide-search.target.txt",
     "a tab-delimited text file containing the target PSMs. See <a href=\""
-    "../file-formats/txt-format.html\">txt file format</a> for a list of the fields."));
+    "../file-formats/txt-format.html\">txt file format</a> for a list of the fields. With --txt-format binary, this is "
+    "tide-search.target.bin, holding the same fields in the Crux binary columnar format."));
   outputs.push_back(make_pair("tide-search.decoy.txt",
     "a tab-delimited text file containing the decoy PSMs. This file will only "
     "be created if the index was created with decoys."));
+  outputs.push_back(make_pair("tide-search.qc.html",
+    "an HTML quality-control report of the search. This file will only be "
+    "created if --qc-report T is given."));
   outputs.push_back(make_pair("tide-search.params.txt",
     "a file containing the name and value of all parameters/options for the "
     "current operation. Not all parameters in the file may have been used in "
@@ -1217,7 +3307,8 @@ int TideSearchApplication::calcScoreCount(
   double* aaFreqI,
   double* aaFreqC,
   int* aaMass,
-  double* pValueScoreObs
+  double* pValueScoreObs,
+  vector<double>* dynProgBuf
 ) {
   const int nDeltaMass = nAA;
   int minDeltaMass = aaMass[0];
@@ -1249,20 +3340,14 @@ int TideSearchApplication::calcScoreCount(
   int initCountRow = bottomRowBuffer - minScore;
   int initCountCol = maxDeltaMass + colStart;
 
-  double** dynProgArray = new double*[nRow];
-  for (row = 0; row < nRow; row++) {
-    dynProgArray[row] = new double[nCol];
-    for (col = 0; col < nCol; col++) {
-      dynProgArray[row][col] = 0.0;
-    }
-  }
-  double* scoreCountBinAdjust = 0;
-  scoreCountBinAdjust = new double[nRow];
-  for (row = 0; row < nRow; row++) {
-    scoreCountBinAdjust[row] = 0.0;
-  }
+  // The table is stored column by column in dynProgBuf, which the caller
+  // keeps from one call to the next. Each column is one integer mass, so the
+  // update of a column below reads whole columns at fixed offsets and runs
+  // over contiguous rows.
+  dynProgBuf->assign((size_t)nRow * nCol, 0.0);
+  double* dynProg = &(*dynProgBuf)[0];
 
-  dynProgArray[initCountRow][initCountCol] = 1.0; // initial count of peptides with mass = 1
+  dynProg[initCountCol * nRow + initCountRow] = 1.0; // initial count of peptides with mass = 1
   vector<int> deltaMassCol(nDeltaMass);
   // populate matrix with scores for first (i.e. N-terminal) amino acid in sequence
   for (de = 0; de < nDeltaMass; de++) {
@@ -1270,31 +3355,33 @@ int TideSearchApplication::calcScoreCount(
     row = initCountRow + evidenceObs[ma + colStart];
     col = initCountCol + ma;
     if (col <= maxDeltaMass + colLast) {
-      dynProgArray[row][col] += dynProgArray[initCountRow][initCountCol] * aaFreqN[de];
+      dynProg[col * nRow + row] += dynProg[initCountCol * nRow + initCountRow] * aaFreqN[de];
     }
   }
   // set to zero now that score counts for first amino acid are in matrix
-  dynProgArray[initCountRow][initCountCol] = 0.0;
+  dynProg[initCountCol * nRow + initCountRow] = 0.0;
   // populate matrix with score counts for non-terminal amino acids in sequence 
   for (ma = colFirst; ma < colLast; ma++) {
     col = maxDeltaMass + ma;
     evidence = evidenceObs[ma];
+    double* dst = dynProg + col * nRow;
+    // The terms for each row are added in the same order as a loop over the
+    // amino acids inside a loop over the rows would add them, so the counts
+    // are unchanged; with the amino acids outside, each pass is a
+    // vectorizable multiply-add over a column.
     for (de = 0; de < nDeltaMass; de++) {
-      deltaMassCol[de] = col - aaMass[de];
-    }
-    for (row = rowFirst; row <= rowLast; row++) {
-      evidenceRow = row - evidence;
-      sumScore = dynProgArray[row][col];
-      for (de = 0; de < nDeltaMass; de++) {
-        sumScore += dynProgArray[evidenceRow][deltaMassCol[de]] * aaFreqI[de];
+      const double* src = dynProg + (col - aaMass[de]) * nRow - evidence;
+      const double freq = aaFreqI[de];
+      for (row = rowFirst; row <= rowLast; row++) {
+        dst[row] += src[row] * freq;
       }
-      dynProgArray[row][col] = sumScore;
     }
   }
   // populate matrix with score counts for last (i.e. C-terminal) amino acid in sequence
   ma = colLast;
   col = maxDeltaMass + ma;
   evidence = 0; // no evidence should be added for last amino acid in sequence
+  double* lastCol = dynProg + col * nRow;
   for (de = 0; de < nDeltaMass; de++) {
     deltaMassCol[de] = col - aaMass[de];
   }
@@ -1302,16 +3389,20 @@ int TideSearchApplication::calcScoreCount(
     evidenceRow = row - evidence;
     sumScore = 0.0;
     for (de = 0; de < nDeltaMass; de++) {
-      sumScore += dynProgArray[evidenceRow][deltaMassCol[de]] * aaFreqC[de];  // C-terminal residue
+      sumScore += dynProg[deltaMassCol[de] * nRow + evidenceRow] * aaFreqC[de];  // C-terminal residue
     }
-    dynProgArray[row][col] = sumScore;
+    lastCol[row] = sumScore;
   }
 
   int colScoreCount = maxDeltaMass + colLast;
+  const double* scoreCountCol = dynProg + colScoreCount * nRow;
+  // The table is not needed past this point; its first column holds the
+  // bin adjustments.
+  double* scoreCountBinAdjust = dynProg;
   double totalCount = 0.0;
   for (row = 0; row < nRow; row++) {
     // at this point pValueScoreObs just holds counts from last column of dynamic programming array
-    pValueScoreObs[row] = dynProgArray[row][colScoreCount];
+    pValueScoreObs[row] = scoreCountCol[row];
     totalCount += pValueScoreObs[row];
     scoreCountBinAdjust[row] = pValueScoreObs[row] / 2.0;
   }
@@ -1327,20 +3418,33 @@ int TideSearchApplication::calcScoreCount(
     pValueScoreObs[row] = exp(log(pValueScoreObs[row]) - logTotalCount);
   }
 
-  // clean up
-  for (row = 0; row < nRow; row++) {
-    delete [] dynProgArray[row];
-  }
-  delete [] dynProgArray;
-  delete [] scoreCountBinAdjust;
-
   return scoreOffsetObs;
 }
 
 void TideSearchApplication::processParams() {
+  if (Params::GetInt("coordinator-port") > 0) {
+    // The coordinator only writes what the workers find.
+    return;
+  }
   const string index = Params::GetString("tide database");
   if (!FileUtils::Exists(index)) {
     carp(CARP_FATAL, "'%s' does not exist", index.c_str());
+  } else if (FileUtils::IsRegularFile(index) && useMemoryIndex(index)) {
+    // Index is a FASTA file or peptide list, indexed here
+    carp(CARP_INFO, "Building the index of '%s' in memory", index.c_str());
+    delete memory_index_;
+    memory_index_ = new TideMemoryIndex;
+    TideIndexApplication::buildMemoryIndex(index, memory_index_);
+    // The decoys of decoy-format are made by the search.
+    if (Params::GetString("search-decoys") == "none") {
+      string decoys = Params::GetString("decoy-format");
+      if (decoys == "protein-reverse") {
+        carp(CARP_WARNING, "An index built in memory has peptide-level decoys; "
+                           "using peptide-reverse decoys instead of protein-reverse.");
+        decoys = "peptide-reverse";
+      }
+      Params::Set("search-decoys", decoys);
+    }
   } else if (FileUtils::IsRegularFile(index)) {
     // Index is FASTA file
     carp(CARP_INFO, "Creating index from '%s'", index.c_str());
@@ -1384,7 +3488,11 @@ void TideSearchApplication::processParams() {
                        "precursor-window-type set to 'ppm'.");
     }
     ParamMedicErrorCalculator errCalc;
-    errCalc.processFiles(Params::GetStrings("tide spectra file"));
+    // The spectra of the last file are kept for its conversion to
+    // spectrumrecords, so that it is only read once
+    errCalc.processFiles(Params::GetStrings("tide spectra file"), true,
+                         Params::GetInt("auto-tolerance-spectra"));
+    double multiplier = Params::GetDouble("auto-tolerance-multiplier");
     string precursorFailure, fragmentFailure;
     double precursorSigmaPpm = 0;
     double fragmentSigmaPpm = 0;
@@ -1400,7 +3508,9 @@ void TideSearchApplication::processParams() {
       if (precursorFailure.empty()) {
         carp(CARP_INFO, "Precursor ppm standard deviation: %f", precursorSigmaPpm);
         carp(CARP_INFO, "Precursor error estimate (ppm): %.2f", precursorPredictionPpm);
-        Params::Set("precursor-window", precursorPredictionPpm);
+        carp(CARP_INFO, "Setting precursor-window from %g to %.2f ppm.",
+             Params::GetDouble("precursor-window"), multiplier * precursorPredictionPpm);
+        Params::Set("precursor-window", multiplier * precursorPredictionPpm);
       } else {
         carp(autoPrecursor == "fail" ? CARP_FATAL : CARP_ERROR,
              "failed to calculate precursor error: %s", precursorFailure.c_str());
@@ -1410,7 +3520,9 @@ void TideSearchApplication::processParams() {
       if (fragmentFailure.empty()) {
         carp(CARP_INFO, "Fragment standard deviation (ppm): %f", fragmentSigmaPpm);
         carp(CARP_INFO, "Fragment bin size estimate (Th): %.4f", fragmentPredictionTh);
-        Params::Set("mz-bin-width", fragmentPredictionTh);
+        carp(CARP_INFO, "Setting mz-bin-width from %g to %.4f Th.",
+             Params::GetDouble("mz-bin-width"), multiplier * fragmentPredictionTh);
+        Params::Set("mz-bin-width", multiplier * fragmentPredictionTh);
       } else {
         carp(autoFragment == "fail" ? CARP_FATAL : CARP_ERROR,
              "failed to calculate fragment error: %s", fragmentFailure.c_str());
@@ -1423,6 +3535,130 @@ void TideSearchApplication::setSpectrumFlag(map<pair<string, unsigned int>, bool
   spectrum_flag_ = spectrum_flag;
 }
 
+void TideSearchApplication::setSpectrumStore(map<string, SpectrumCollection*>* spectrum_store) {
+  spectrum_store_ = spectrum_store;
+}
+
+void TideSearchApplication::setResultStreams(ostream* target, ostream* decoy) {
+  result_target_ = target;
+  result_decoy_ = decoy;
+}
+
+bool TideSearchApplication::resultsInMemory() const {
+  return result_target_ != NULL && !TideMatchSet::binaryOutput();
+}
+
+void TideSearchApplication::setSpectrumSlice(int slice, int num_slices) {
+  slice_ = slice;
+  num_slices_ = num_slices;
+}
+
+void TideSearchApplication::sliceRange(size_t n, size_t* begin, size_t* end) const {
+  *begin = (size_t)((unsigned long long)n * slice_ / num_slices_);
+  *end = (size_t)((unsigned long long)n * (slice_ + 1) / num_slices_);
+}
+
+// One of the results files of a coordinator, written as the parts of the
+// workers' chunks come.
+struct ClusterResults {
+  string path;
+  ostream* out;
+  bool fresh;  // no bytes of the current chunk seen yet
+  bool skipping;  // in the header line of the current chunk
+};
+
+// Appends results, the next part of a chunk, to results->out, opening it
+// first, and leaving out the header line that starts each chunk if the file
+// is already open.
+static void appendResults(const string& results, bool first, ClusterResults* file) {
+  if (first) {
+    file->fresh = true;
+    file->skipping = false;
+  }
+  if (results.empty()) {
+    return;
+  }
+  if (file->fresh) {
+    file->fresh = false;
+    if (file->out == NULL) {
+      file->out = TideSearchApplication::createResultsFile(
+        file->path, Params::GetBool("overwrite"), false);
+    } else {
+      file->skipping = true;
+    }
+  }
+  size_t start = 0;
+  if (file->skipping) {
+    start = results.find('\n');
+    if (start == string::npos) {
+      return;
+    }
+    file->skipping = false;
+    ++start;
+  }
+  file->out->write(results.data() + start, results.size() - start);
+}
+
+int TideSearchApplication::coordinateSearch() {
+  if (TideMatchSet::binaryOutput() || Params::GetBool("peptide-centric-search")) {
+    carp(CARP_FATAL, "txt-format = binary and peptide-centric-search are not "
+         "available for a search over several machines.");
+  }
+  // Each worker may get as far ahead of the ones before it as the results of
+  // a search may wait to be written on one machine.
+  ClusterCoordinator coordinator;
+  if (!coordinator.Start(Params::GetString("coordinator-address"),
+                         Params::GetInt("coordinator-port"), Params::GetInt("num-workers"),
+                         (size_t)Params::GetInt("output-pending-bytes"))) {
+    carp(CARP_FATAL, "Cannot coordinate the search.");
+  }
+  bool concat = Params::GetBool("concat");
+  ClusterResults target_file = {
+    outputPath(resultsFileName(concat ? "tide-search." : "tide-search.target.")),
+    NULL, false, false };
+  ClusterResults decoy_file = {
+    outputPath(resultsFileName("tide-search.decoy.")), NULL, false, false };
+  ClusterPart part;
+  while (coordinator.Next(&part)) {
+    appendResults(part.target, part.first, &target_file);
+    appendResults(part.decoy, part.first, &decoy_file);
+  }
+  delete target_file.out;
+  delete decoy_file.out;
+  output_file_name_ = target_file.path;
+  carp(CARP_INFO, "Wrote the results of %d workers.", Params::GetInt("num-workers"));
+  convertResults();
+  return 0;
+}
+
+int TideSearchApplication::workForCoordinator(const vector<string>& input_files,
+                                              const string& index) {
+  if (TideMatchSet::binaryOutput() || Params::GetBool("peptide-centric-search")) {
+    carp(CARP_FATAL, "txt-format = binary and peptide-centric-search are not "
+         "available for a search over several machines.");
+  }
+  ClusterWorker worker;
+  if (!worker.Connect(Params::GetString("coordinator"))) {
+    carp(CARP_FATAL, "Cannot work for the coordinator.");
+  }
+  // The results of each file are sent as they are written, and the index
+  // stays loaded from one file to the next.
+  bool merge = Params::GetBool("merge-spectrum-files") && input_files.size() > 1;
+  keepIndex(true);
+  bool ok = true;
+  for (size_t i = 0; ok && i < input_files.size(); i += merge ? input_files.size() : 1) {
+    TideSearchApplication search;
+    search.setResultStreams(worker.Target(), worker.Decoy());
+    search.setSpectrumSlice(worker.Slice(), worker.NumSlices());
+    ok = search.main(merge ? input_files : vector<string>(1, input_files[i]), index) == 0 &&
+      worker.EndChunk();
+  }
+  keepIndex(false);
+  releaseIndex();
+  worker.Finish(ok);
+  return ok ? 0 : 1;
+}
+
 string TideSearchApplication::getOutputFileName() {
   return output_file_name_;
 }
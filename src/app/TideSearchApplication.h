@@ -7,6 +7,7 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <boost/atomic.hpp>
 #include <gflags/gflags.h>
 #include "peptides.pb.h"
 #include "spectrum.pb.h"
@@ -15,14 +16,32 @@
 
 using namespace std; 
 
+class HeadedRecordReader;
+class PreprocessedStore;
+class ResultMemo;
+class ShardedRecordReader;
+struct IndexShard;
+struct MemoryPlan;
+class SpectrumClusters;
+namespace pb { class Header; }
+
+/**
+ * The index that tide-search builds in memory from a FASTA file or peptide
+ * list (see memory-index): the records tide-index would write to pepix and
+ * auxlocs, and the proteins.
+ */
+struct TideMemoryIndex {
+  ProteinVec proteins;
+  std::string peptides;
+  std::string auxlocs;
+  ~TideMemoryIndex();
+};
+
 /**
  * Locks for multi-threading in Tide.
  */
 enum _tide_search_lock {
-  LOCK_RESULTS,       // Results file output
-  LOCK_CASCADE,       // Only used by cascade-search on spectrum_flag (map)
-  LOCK_CANDIDATES,    // Updating # of candidate peptides
-  LOCK_REPORTING,     // Updating sc_index and reporting progress
+  LOCK_REPORTING,     // Grouping per-thread summary messages
   NUMBER_LOCK_TYPES   // always keep this last so the value
                       // changes as cmds are added
 };
@@ -32,6 +51,8 @@ typedef enum _tide_search_lock TIDE_SEARCH_LOCK_T;
 class TideSearchApplication : public CruxApplication {
 
   friend class SubtractIndexApplication;
+  friend class TideLibrarySearchApplication;
+  friend class TideRealtimeSearch;
 
  protected:
 
@@ -45,6 +66,126 @@ class TideSearchApplication : public CruxApplication {
       OriginalName(name), SpectrumRecords(spectrumrecords), Keep(keep) {}
   };
 
+  /**
+   * Per-thread load balancing statistics, reported at the end of a search.
+   */
+  struct thread_stats {
+    int chunks;           // number of chunks claimed
+    int spec_charges;     // number of spectrum-charge pairs claimed
+    double finish_time;   // wall clock time (us) when the thread ran out of work
+    int low_quality;      // number of pairs skipped by min-spectrum-quality
+    thread_stats() : chunks(0), spec_charges(0), finish_time(0.0), low_quality(0) {}
+  };
+
+  /**
+   * Consecutive spectrum-charge pairs with overlapping candidate windows that
+   * a search thread has preprocessed and will score together, so that each
+   * candidate peptide is read once for the whole batch (see
+   * spectrum-batch-size). Slots are reused from batch to batch.
+   */
+  struct spectrum_batch {
+    int capacity;
+    int size;
+    vector<ObservedPeakSet*> peak_sets;  // one per slot
+    // The preprocessed spectrum of each slot: its own peak set, or that of an
+    // earlier slot with the same preprocessed spectrum
+    vector<ObservedPeakSet*> observed;
+    PeakFilterCache filter_cache;  // shared by observed, see spectrum_preprocess.h
+    vector<const SpectrumCollection::SpecCharge*> spec_charges;
+    vector< vector<double> > min_mass;
+    vector< vector<double> > max_mass;
+    vector< vector<bool> > candidate_status;
+    // Union of the windows of the spectra in the batch.
+    double min_range, max_range;
+    double min_mass_front, max_mass_back;
+
+    // Scratch space for scoreSpectrumBatch(), kept here so that scoring a
+    // batch does not allocate once the arrays have grown to size.
+    vector<TideMatchSet::Arr2*> scores;
+    TideMatchSet::Arr matches;
+    vector<int> scored;
+    vector<int> num_candidates;
+    vector<ActivePeptideQueue::Selection> selections;
+    vector<double> union_min, union_max;
+    vector<bool> union_status;
+    vector<deque<Peptide*>::const_iterator> first;
+    vector<int> count, charge;
+    vector<const int*> cache;
+    vector<pair<int, int>*> results;
+    // For the fragment index prefilter of scoreOpenBlock().
+    vector<int> shared_counts;
+    vector<pair<int, int> > ranked;
+    // Min-heaps by score of the best target and decoy matches of the
+    // spectrum being reported, as (score, rank).
+    vector<pair<int, int> > best[2];
+    // For scoreClusterMembers(): the members of the cluster of the spectrum
+    // being reported, one at a time, and the peaks their preprocessing
+    // removed and kept.
+    ObservedPeakSet* member_observed;
+    vector<double> member_min, member_max;
+    vector<pair<int, int> > member_best[2];
+    long int member_counts[4];
+
+    spectrum_batch(int capacity_, double bin_width, double bin_offset,
+                   bool use_neutral_loss_peaks, bool use_flanking_peaks) :
+      capacity(capacity_), size(0), peak_sets(capacity_), observed(capacity_),
+      spec_charges(capacity_),
+      min_mass(capacity_), max_mass(capacity_), candidate_status(capacity_),
+      min_range(0), max_range(0), min_mass_front(0), max_mass_back(0),
+      scores(capacity_), num_candidates(capacity_), selections(capacity_),
+      union_min(1), union_max(1), first(capacity_), count(capacity_),
+      charge(capacity_), cache(capacity_), results(capacity_),
+      member_observed(new ObservedPeakSet(bin_width, bin_offset,
+                                          use_neutral_loss_peaks, use_flanking_peaks)) {
+      for (int i = 0; i < capacity; i++) {
+        peak_sets[i] = new ObservedPeakSet(bin_width, bin_offset,
+                                           use_neutral_loss_peaks, use_flanking_peaks);
+        peak_sets[i]->SetFilterCache(&filter_cache);
+        observed[i] = peak_sets[i];
+        scores[i] = new TideMatchSet::Arr2();
+      }
+      scored.reserve(capacity);
+      for (int i = 0; i < 4; i++) {
+        member_counts[i] = 0;
+      }
+    }
+    ~spectrum_batch() {
+      for (int i = 0; i < capacity; i++) {
+        delete peak_sets[i];
+        delete scores[i];
+      }
+      delete member_observed;
+    }
+
+    // Add a spectrum-charge pair and return its slot, whose ObservedPeakSet
+    // the caller then fills.
+    int add(const SpectrumCollection::SpecCharge* sc, const vector<double>& sc_min_mass,
+            const vector<double>& sc_max_mass, double sc_min_range, double sc_max_range);
+
+    // The preprocessed spectrum of a slot that sc can share: one of the same
+    // charge and multiplexed spectrum, preprocessed for all of them (see
+    // Spectrum::HighestPrecursorMZ()). NULL if there is none.
+    ObservedPeakSet* preprocessed(const SpectrumCollection::SpecCharge* sc) const;
+  };
+
+  /**
+   * A spectrum-charge pair of an open search in blocks of the index (see
+   * open-search-block-size), from the first block that may hold one of its
+   * candidates to the last. Each block is released before the next one is
+   * read, so the best matches so far are kept with copies of their peptides.
+   */
+  struct open_spectrum {
+    int sc_pos;
+    const SpectrumCollection::SpecCharge* sc;
+    vector<double> min_mass, max_mass;
+    bool preprocessed;     // filtered peaks are only counted the first time
+    int targets, decoys;   // candidates over all blocks so far
+    // Bins of the most intense peaks, for the fragment index prefilter.
+    vector<int> fragment_bins;
+    // Min-heaps by score of the best target and decoy matches.
+    vector< pair<int, Peptide*> > best[2];
+  };
+
   /**
   brief This variable is used with Cascade Search.
   This map contains a flag for each spectrum whether
@@ -57,17 +198,243 @@ class TideSearchApplication : public CruxApplication {
   map<pair<string, unsigned int>, bool>* spectrum_flag_;
   string output_file_name_;
 
+  // QC statistics of the searches so far, for qc-report.
+  QCStatistics qc_stats_;
+
+  // Peptides per block in an open search; 0 to search windows as usual.
+  int open_search_block_size_;
+  // Candidates per spectrum and block that pass the fragment index
+  // prefilter, and observed peaks it uses; 0 to score all candidates.
+  int fragment_index_candidates_;
+  int fragment_index_peaks_;
+
   static bool HAS_DECOYS;
   static bool PROTEIN_LEVEL_DECOYS;
+  static bool SEARCH_TIME_DECOYS;
+
+  // The proteins and auxiliary locations of the index that tide-server keeps
+  // loaded from one search to the next (see keepIndex()).
+  static bool keep_index_;
+  static string kept_index_;
+  static ProteinVec kept_proteins_;
+  static AuxLocations* kept_locations_;
+
+  // If not empty, the directory to write results to instead of output-dir.
+  string output_dir_;
+
+  // A checkpoint of the search, as tide-search.checkpoint records it.
+  struct Checkpoint {
+    int file;  // the spectrum file (or first merged file) being searched
+    long long batch;  // the first spectrum-charge pair of the batch, streamed
+    int spec_charges;  // pairs of spec_charges whose results are written
+    long long target_offset;
+    long long decoy_offset;  // -1 for none
+  };
+  static bool readCheckpoint(const string& path, Checkpoint* checkpoint);
+
+  // Seconds between checkpoints, or 0 for none; the file they go in and the
+  // position of the current search() call to record in them; the pair of
+  // spec_charges at which the call starts.
+  double checkpoint_interval_;
+  string checkpoint_file_;
+  string checkpoint_position_;
+  int resume_first_;
+
+  // If not NULL, the score index of the concatenated results file, filled
+  // by the result sinks of the search() calls (see score-index)
+  ScoreIndex* score_index_;
+
+  // The path of an output file, in output_dir_ or else in output-dir.
+  string outputPath(const string& name) const;
 
   vector<int> getNegativeIsotopeErrors() const;
   vector<InputFile> getInputFiles(const vector<string>& filepaths) const;
-  static SpectrumCollection* loadSpectra(const std::string& file);
+  static SpectrumCollection* loadSpectra(const std::string& file,
+                                         int threads = 1);
+
+  // Add spectra, read from file, to spectrum_store_ if there is one, which
+  // then owns them.
+  void storeSpectra(const InputFile& file, SpectrumCollection* spectra);
+
+  // The retention times, in minutes, of the peptides of the tab-delimited
+  // file, by unmodified sequence (see peptide-retention-times).
+  static void readPeptideRTimes(const string& file, map<string, double>* rtimes);
+
+  // The key of the result memo of the spectra of spectrum_file, searched
+  // with the parameters of this search (see result_memo.h).
+  uint64_t resultMemoKey(const SpectrumCollection& spectra,
+                         const string& spectrum_file) const;
+
+  // PreprocessSpectrum(), or its entry in preprocessed_store_ if it has one;
+  // a store being filled gets an entry for it.
+  void preprocessSpectrum(
+    ObservedPeakSet* observed,
+    const Spectrum& spectrum,
+    int charge,
+    long int* num_range_skipped,
+    long int* num_precursors_skipped,
+    long int* num_isotopes_skipped,
+    long int* num_retained
+  );
+
+  /**
+   * Merge the sorted spectrum-charge pairs of several files into one list in
+   * the same order, recording in spectrum_files the name of the file of each.
+   */
+  static void mergeSpecCharges(
+    const vector<SpectrumCollection*>& spectra,
+    const vector<const string*>& names,
+    vector<SpectrumCollection::SpecCharge>* spec_charges,
+    vector<const string*>* spectrum_files
+  );
+
+  // The steps of main(), each with the parameters it checks.
+
+  // Sets NUM_THREADS from num-threads, and places the threads on the NUMA
+  // nodes if asked to.
+  void setUpThreads();
+
+  // The charge of spectrum-charge, or 0 for all.
+  static int getChargeToSearch();
+
+  // The range of scan-number, [0, BILLION] if it is empty.
+  static void getScanRange(int* min_scan, int* max_scan);
+
+  // Reads the proteins and auxiliary locations of index, or takes those kept
+  // from the last search or of memory_index_, and returns the locations.
+  AuxLocations* loadIndex(const string& index, ProteinVec* proteins);
+
+  // Deletes what loadIndex() read, for an index that is not kept.
+  static void freeIndex(ProteinVec& proteins, AuxLocations* locations);
+
+  // The amino acid frequencies of the peptides, for exact p-values; returns
+  // the number of amino acid masses.
+  int countAAFrequencies(const string& peptides_file, const ProteinVec& proteins,
+                         double** aaFreqN, double** aaFreqI, double** aaFreqC,
+                         int** aaMass);
+
+  // Sets open_search_block_size_ and the fragment index members, dropping
+  // what the other parameters rule out, and returns whether the threads
+  // share a peptide window.
+  bool setUpSearchModes();
+
+  // Fits the search to max-memory (see memory_plan.h), which can lower
+  // NUM_THREADS and so turn off the shared window.
+  MemoryPlan planMemory(const string& index, const vector<string>& input_files,
+                        const vector<int>& negative_isotope_errors,
+                        ScoringBackend scoring_backend, bool* use_shared_window);
+
+  // The shards of peptides_file, or none if it is not sharded. The header
+  // still comes from pepix, but the peptides come from the shards.
+  static void readShards(const string& peptides_file, vector<IndexShard>* shards);
+
+  // Sets HAS_DECOYS and the kinds of decoys searched from the index and
+  // search-decoys, and returns the seed of decoys made during the search.
+  static unsigned int setUpDecoys(const pb::Header& peptides_header);
+
+  // Sets the masses and modifications of the index's peptides, and returns
+  // whether the theoretical peaks stored in the index can be used.
+  bool applyIndexHeader(const pb::Header& peptides_header);
+
+  // Sets the checkpoint members from checkpoint-interval and resume, and
+  // returns whether to resume from checkpoint. resumed is whether there may
+  // be a checkpoint to remove when the search is done; overwrite is set if
+  // there is none to resume from.
+  bool setUpCheckpoint(bool in_memory, Checkpoint* checkpoint, bool* resumed,
+                       bool* overwrite);
+
+  // Opens the results files, or reopens them where checkpoint left them,
+  // and writes their headers if they are new.
+  void openResultsFiles(bool resume, const Checkpoint& checkpoint, bool overwrite,
+                        bool compute_sp, ostream** target_file, ostream** decoy_file);
+
+  // Makes score_index_ if score-index asks for one and the results allow it,
+  // and writes and deletes it when the search is done.
+  void setUpScoreIndex(bool resume);
+  void writeScoreIndex();
+
+  // max-spectra-in-memory as planned, or 0 if the search cannot stream.
+  int maxSpectraInMemory(const MemoryPlan& plan) const;
+
+  // Whether to search the num_files spectrum files together.
+  bool mergeSpectrumFiles(size_t num_files, int max_spectra) const;
+
+  // How the peptide queues of a search read the index.
+  struct PeptideQueueSettings {
+    string peptides_file;
+    pb::Header* peptides_header;
+    const vector<IndexShard>* shards;  // empty if not sharded
+    bool map_index;
+    int read_ahead;
+    ScoringBackend backend;
+    bool shared_window;
+    bool stored_peaks;
+    bool shuffle_decoys;
+    unsigned int decoy_seed;
+    const map<string, double>* peptide_rtimes;
+  };
+
+  // The readers of the index and the peptide queue of each thread: a reader
+  // for each queue, or one reader for a window that the queues view.
+  struct PeptideSources {
+    vector<HeadedRecordReader*> readers;  // NULL once closed
+    vector<ShardedRecordReader*> shard_readers;  // NULL unless sharded
+    vector<ActivePeptideQueue*> queues;
+    ActivePeptideQueue* shared_source;
+    SharedPeptideWindow* shared_window;
+  };
+
+  // Makes the queues for the search of a spectrum file, reopening the
+  // readers if the last file closed them, and closes them all after it.
+  void openPeptideQueues(const PeptideQueueSettings& settings, ProteinVec& proteins,
+                         PeptideSources* sources);
+  static void closePeptideQueues(PeptideSources* sources, size_t num_shards);
+
+  // The spectra of one pass over the index: those of a file, read whole or
+  // streamed, or of several files merged, and the slice of them searched.
+  struct SearchSpectra {
+    SpectrumCollection* spectra;  // NULL if streamed
+    bool stream;
+    vector<SpectrumCollection::SpecChargeKey> keys;  // if streamed
+    double highest_peak;
+    vector<SpectrumCollection*> merged_spectra;  // spectra, then the others
+    vector<SpectrumCollection::SpecCharge> merged_charges;  // if merged
+    vector<const string*> merged_files;  // the file of each merged pair
+    vector<SpectrumCollection::SpecCharge> sliced_charges;  // if num_slices_
+  };
+
+  // Reads the spectra of the files [f, f_end), or the keys of f if it is
+  // streamed, and deletes those not kept in spectra_ after the search.
+  void readSearchSpectra(vector<InputFile>::const_iterator f,
+                         vector<InputFile>::const_iterator f_end, int max_spectra,
+                         WINDOW_TYPE_T window_type, SearchSpectra* search_spectra);
+  void releaseSearchSpectra(vector<InputFile>::const_iterator f,
+                            const SearchSpectra& search_spectra);
+
+  // The highest m/z the bins need: that of the highest peak or, for exact
+  // p-values, the highest precursor mass.
+  double highestSearchMz(const SearchSpectra& search_spectra) const;
+
+  // Keeps only slice_ of the spectrum-charge pairs.
+  void sliceSearchSpectra(SearchSpectra* search_spectra) const;
+
+  // Opens preprocessed_store_ and result_memo_ for the spectra if their
+  // parameters ask for them and the search allows it, and writes and
+  // deletes them after the search of spectra_file.
+  void openPreprocessedStore(const SearchSpectra& search_spectra);
+  void closePreprocessedStore(const string& spectra_file);
+  void openResultMemo(const SearchSpectra& search_spectra,
+                      const vector<IndexShard>& shards, bool search_time_mods,
+                      const string& spectrum_file);
+  void closeResultMemo(const string& spectra_file);
+
+  static void reportFifoStats();
 
   /**
    * Function that contains the search algorithm and performs the search
    */
   void search(void *threadarg);
+  void searchTask(void *threadarg);
 
   /**
     * Calls search(threadarg), and if threading, creates threads calling 
@@ -86,7 +453,7 @@ class TideSearchApplication : public CruxApplication {
     const vector<SpectrumCollection::SpecCharge>* spec_charges,
     vector<ActivePeptideQueue*> active_peptide_queue,
     ProteinVec& proteins,
-    vector<const pb::AuxLocation*>& locations,
+    const AuxLocations& locations,
     double precursor_window,
     WINDOW_TYPE_T window_type,
     double spectrum_min_mz,
@@ -97,15 +464,16 @@ class TideSearchApplication : public CruxApplication {
     int search_charge,
     int top_matches,
     double highest_mz,
-    ofstream* target_file,
-    ofstream* decoy_file,
+    ostream* target_file,
+    ostream* decoy_file,
     bool compute_sp,
     int nAA, 
     double* aaFreqN,
     double* aaFreqI,
     double* aaFreqC,
     int* aaMass,
-    vector<int>* negative_isotope_errors
+    vector<int>* negative_isotope_errors,
+    const vector<const string*>* spectrum_files = NULL
   );
 
   void collectScoresCompiled(
@@ -117,8 +485,67 @@ class TideSearchApplication : public CruxApplication {
     int charge
   );
 
+  /**
+   * Claims the next chunk of consecutive spectrum-charge pairs from the
+   * shared cursor. Returns the index of the first pair in the chunk (which is
+   * >= total when there is no work left) and sets chunk_end to one past the
+   * last pair. Chunks are handed out in increasing order, so each thread sees
+   * non-decreasing precursor masses and its peptide queue only moves forward.
+   * The thread's buffered output for its previous chunk is handed off first.
+   */
+  static int claimSpecChargeChunk(
+    boost::atomic<int>* cursor,
+    int chunk_size,
+    int total,
+    int* chunk_end,
+    thread_stats* stats,
+    TideMatchSet::ResultBuffer* buffer
+  );
+
+  /**
+   * Before a thread claims a chunk, reserves in its view of a shared peptide
+   * window the range of spec_charges[next], the lightest pair it could claim
+   * (or no range if there is none), so that neither the window it holds back
+   * while waiting to hand over its previous chunk, nor the one a view that
+   * has yet to search anything leaves to others, is wrong.
+   */
+  void reserveSharedWindow(
+    ActivePeptideQueue* active_peptide_queue,
+    const vector<SpectrumCollection::SpecCharge>& spec_charges,
+    int next,
+    WINDOW_TYPE_T window_type,
+    double precursor_window,
+    int max_charge,
+    vector<int>* negative_isotope_errors,
+    vector<double>* min_mass_buf,
+    vector<double>* max_mass_buf
+  );
+
+  /**
+   * Prints the periodic print-search-progress message, followed by a
+   * machine-readable line with throughput and estimated time remaining.
+   */
+  static void reportSearchProgress(
+    int searched,
+    int total,
+    int64_t candidates,
+    double search_start
+  );
+
   void convertResults() const;
 
+  /**
+   * Writes tide-search.qc.html from the statistics collected by the searches.
+   */
+  void writeQCReport() const;
+
+  /**
+   * \returns The name of the tab-delimited results file starting with prefix,
+   * ending in .txt, or in .bin for txt-format = binary, then in .gz for
+   * compress-output.
+   */
+  static std::string resultsFileName(const std::string& prefix);
+
   void computeWindow(
     const SpectrumCollection::SpecCharge& sc,
     WINDOW_TYPE_T window_type,
@@ -135,8 +562,19 @@ class TideSearchApplication : public CruxApplication {
     explicit ScSortByMz(double precursor_window) { precursor_window_ = precursor_window; }
     bool operator() (const SpectrumCollection::SpecCharge x,
                      const SpectrumCollection::SpecCharge y) {
-      return (x.spectrum->PrecursorMZ() - MASS_PROTON - precursor_window_) * x.charge <
-             (y.spectrum->PrecursorMZ() - MASS_PROTON - precursor_window_) * y.charge;
+      return (x.PrecursorMZ() - MASS_PROTON - precursor_window_) * x.charge <
+             (y.PrecursorMZ() - MASS_PROTON - precursor_window_) * y.charge;
+    }
+    double precursor_window_;
+  };
+  // The same order for SpecChargeKeys, given with precursor_window 0 for
+  // windows other than m/z, for which the spectra are sorted by neutral mass.
+  struct ScKeySortByMz {
+    explicit ScKeySortByMz(double precursor_window) { precursor_window_ = precursor_window; }
+    bool operator() (const SpectrumCollection::SpecChargeKey& x,
+                     const SpectrumCollection::SpecChargeKey& y) const {
+      return x.neutral_mass - precursor_window_ * x.charge <
+             y.neutral_mass - precursor_window_ * y.charge;
     }
     double precursor_window_;
   };
@@ -145,11 +583,53 @@ class TideSearchApplication : public CruxApplication {
 
   std::string remove_index_;
 
+  // If not NULL, the index built in memory from the FASTA file or peptide
+  // list given as the tide database, which is searched instead of a tide-index
+  // directory
+  TideMemoryIndex* memory_index_;
+
+  // Reads the peptides of memory_index_, if there is one, or else of
+  // peptides_file.
+  HeadedRecordReader* openPeptides(const string& peptides_file,
+                                   pb::Header* header, bool map_file) const;
+
+  // Whether to search the FASTA file or peptide list file through an index
+  // built in memory rather than by tide-index.
+  static bool useMemoryIndex(const string& file);
+
   // this map can be used to preload spectra
   // <spectrumrecords file> -> SpectrumCollection
   // the SpectrumCollection must be sorted
   std::map<std::string, SpectrumCollection*> spectra_;
 
+  // If not NULL, the sorted spectra of the spectrum files searched so far,
+  // by spectrum file name, kept by the caller from one search to the next
+  std::map<std::string, SpectrumCollection*>* spectrum_store_;
+
+  // If not NULL, the preprocessed spectra of the file being searched, on disk
+  // in the preprocessed-store directory
+  PreprocessedStore* preprocessed_store_;
+
+  // If not NULL, the results of earlier searches of the file being searched,
+  // and those of this one, by spectrum-charge pair (see result-memo)
+  ResultMemo* result_memo_;
+
+  // If not NULL, where the text results go instead of the results files
+  std::ostream* result_target_;
+  std::ostream* result_decoy_;
+
+  // If num_slices_ is not 0, only slice slice_ of the spectrum-charge pairs
+  // of each file is searched (see search_cluster.h).
+  int slice_;
+  int num_slices_;
+
+  // The coordinator and worker of a search spread over several machines
+  int coordinateSearch();
+  int workForCoordinator(const vector<string>& input_files, const string& index);
+
+  // The part [*begin, *end) of the n spectrum-charge pairs in slice_.
+  void sliceRange(size_t n, size_t* begin, size_t* end) const;
+
  public:
 
   // See TideSearchApplication.cpp for descriptions of these two constants
@@ -181,6 +661,25 @@ class TideSearchApplication : public CruxApplication {
 
   static bool hasDecoys();
   static bool proteinLevelDecoys();
+  // Whether the decoys are made during the search (see search-decoys).
+  static bool searchTimeDecoys();
+
+  /**
+   * Keep the proteins and auxiliary locations read from an index after a
+   * search, for the next search of the same index to use.
+   */
+  static void keepIndex(bool keep);
+
+  /**
+   * Free the index kept by keepIndex().
+   */
+  static void releaseIndex();
+
+  /**
+   * Write results to dir instead of output-dir. Only the tab-delimited
+   * results are written.
+   */
+  void setOutputDirectory(const string& dir);
 
   /**
    * Returns the command name
@@ -223,7 +722,7 @@ class TideSearchApplication : public CruxApplication {
     const vector<SpectrumCollection::SpecCharge>* spec_charges;
     ActivePeptideQueue* active_peptide_queue;
     ProteinVec proteins;
-    vector<const pb::AuxLocation*> locations;
+    const AuxLocations* locations;
     double precursor_window;
     WINDOW_TYPE_T window_type;
     double spectrum_min_mz;
@@ -234,8 +733,8 @@ class TideSearchApplication : public CruxApplication {
     int search_charge;
     int top_matches;
     double highest_mz;
-    ofstream* target_file;
-    ofstream* decoy_file;
+    ostream* target_file;
+    ostream* decoy_file;
     bool compute_sp;
     int64_t thread_num;
     int64_t num_threads;
@@ -248,21 +747,35 @@ class TideSearchApplication : public CruxApplication {
     double bin_width;
     double bin_offset;
     bool exact_pval_search;
-    map<pair<string, unsigned int>, bool>* spectrum_flag;
-    int* sc_index;
-    int* total_candidate_peptides;
+    const vector<char>* identified;
+    boost::atomic<int>* sc_index;
+    boost::atomic<int64_t>* total_candidate_peptides;
+    double search_start;
     vector<int>* negative_isotope_errors;
+    boost::atomic<int>* sc_cursor;
+    int chunk_size;
+    thread_stats* stats;
+    TideMatchSet::ResultSink* result_sink;
+    // If not NULL, the file of each of spec_charges, in place of spectrum_filename
+    const vector<const string*>* spectrum_files;
+    // If not NULL, the clusters of spec_charges whose members are scored
+    // along with their representatives (see cluster-spectra)
+    const SpectrumClusters* clusters;
 
     thread_data (const string& spectrum_filename_, const vector<SpectrumCollection::SpecCharge>* spec_charges_,
             ActivePeptideQueue* active_peptide_queue_, ProteinVec proteins_,
-            vector<const pb::AuxLocation*> locations_, double precursor_window_,
+            const AuxLocations* locations_, double precursor_window_,
             WINDOW_TYPE_T window_type_, double spectrum_min_mz_, double spectrum_max_mz_,
             int min_scan_, int max_scan_, int min_peaks_, int search_charge_, int top_matches_,
-            double highest_mz_, ofstream* target_file_,
-            ofstream* decoy_file_, bool compute_sp_, int64_t thread_num_, int64_t num_threads_, int nAA_,
+            double highest_mz_, ostream* target_file_,
+            ostream* decoy_file_, bool compute_sp_, int64_t thread_num_, int64_t num_threads_, int nAA_,
             double* aaFreqN_, double* aaFreqI_, double* aaFreqC_, int* aaMass_, vector<boost::mutex*> locks_array_,  
-            double bin_width_, double bin_offset_, bool exact_pval_search_, map<pair<string, unsigned int>, bool>* spectrum_flag_,
-            int* sc_index_, int* total_candidate_peptides_, vector<int>* negative_isotope_errors_) :
+            double bin_width_, double bin_offset_, bool exact_pval_search_, const vector<char>* identified_,
+            boost::atomic<int>* sc_index_, boost::atomic<int64_t>* total_candidate_peptides_,
+            double search_start_, vector<int>* negative_isotope_errors_,
+            boost::atomic<int>* sc_cursor_, int chunk_size_, thread_stats* stats_,
+            TideMatchSet::ResultSink* result_sink_,
+            const vector<const string*>* spectrum_files_) :
             spectrum_filename(spectrum_filename_), spec_charges(spec_charges_), active_peptide_queue(active_peptide_queue_),
             proteins(proteins_), locations(locations_), precursor_window(precursor_window_), window_type(window_type_),
             spectrum_min_mz(spectrum_min_mz_), spectrum_max_mz(spectrum_max_mz_), min_scan(min_scan_), max_scan(max_scan_),
@@ -270,9 +783,20 @@ class TideSearchApplication : public CruxApplication {
             target_file(target_file_), decoy_file(decoy_file_), compute_sp(compute_sp_),
             thread_num(thread_num_), num_threads(num_threads_), nAA(nAA_), aaFreqN(aaFreqN_), aaFreqI(aaFreqI_), aaFreqC(aaFreqC_), 
             aaMass(aaMass_), locks_array(locks_array_), bin_width(bin_width_), bin_offset(bin_offset_), exact_pval_search(exact_pval_search_), 
-            spectrum_flag(spectrum_flag_), sc_index(sc_index_), total_candidate_peptides(total_candidate_peptides_), negative_isotope_errors(negative_isotope_errors_) {}
+            identified(identified_), sc_index(sc_index_), total_candidate_peptides(total_candidate_peptides_),
+            search_start(search_start_), negative_isotope_errors(negative_isotope_errors_),
+            sc_cursor(sc_cursor_), chunk_size(chunk_size_), stats(stats_),
+            result_sink(result_sink_), spectrum_files(spectrum_files_), clusters(NULL) {}
   };
 
+  /**
+   * The name of the file that sc, one of my_data's spec charges, came from.
+   */
+  static const string& spectrumFilename(
+    const thread_data* my_data,
+    const SpectrumCollection::SpecCharge* sc
+  );
+
   int calcScoreCount(
     int numelEvidenceObs,
     int* evidenceObs,
@@ -286,10 +810,149 @@ class TideSearchApplication : public CruxApplication {
     double* aaFreqI,
     double* aaFreqC,
     int* aaMass,
-    double* pValueScoreObs
+    double* pValueScoreObs,
+    vector<double>* dynProgBuf  // scratch space, reused between calls
   );
   
+  /**
+   * Score and report every spectrum-charge pair in batch, then empty it.
+   */
+  void scoreSpectrumBatch(
+    thread_data* my_data,
+    spectrum_batch* batch,
+    bool peptide_centric,
+    TideMatchSet::ResultBuffer* result_buffer
+  );
+
+  /**
+   * Score the members of the cluster of the spectrum in slot k of batch,
+   * just reported, against those of its best matches (in batch->best) that
+   * are in their own windows, and report them.
+   */
+  void scoreClusterMembers(
+    thread_data* my_data,
+    spectrum_batch* batch,
+    int k,
+    TideMatchSet::ResultBuffer* result_buffer
+  );
+
+  /**
+   * Logs a thread's counts of peaks removed by preprocessing, unless
+   * preprocessing was skipped.
+   */
+  static void reportPeakCounts(
+    thread_data* my_data,
+    long int num_range_skipped,
+    long int num_precursors_skipped,
+    long int num_isotopes_skipped,
+    long int num_retained
+  );
+
+  /**
+   * Set bins to the distinct bins of the num_peaks most intense peaks of
+   * spectrum that are lighter than its precursor at charge.
+   */
+  static void getFragmentBins(
+    const Spectrum& spectrum,
+    int charge,
+    int num_peaks,
+    vector<int>* bins
+  );
+
+  /**
+   * search(threadarg) for an open search in blocks: the thread takes every
+   * num_threads-th chunk of spectrum-charge pairs, reads the whole index once
+   * in blocks of open_search_block_size_ peptides, and scores each block
+   * against the pairs whose windows overlap it.
+   */
+  void searchOpenBlocks(thread_data* my_data);
+
+  /**
+   * Score the loaded block against spectra, num_spectra of which fit in
+   * batch, keeping the best matches of each. peak_counts holds the numbers
+   * of out-of-range, precursor, isotope and retained peaks.
+   */
+  void scoreOpenBlock(
+    thread_data* my_data,
+    spectrum_batch* batch,
+    open_spectrum* const* spectra,
+    int num_spectra,
+    long int* peak_counts
+  );
+
+  /**
+   * Score only the candidates of a preprocessed spectrum (selected by
+   * selection and status) with the most fragment bins in common with its
+   * open->fragment_bins, at most fragment_index_candidates_ of them.
+   */
+  void scoreOpenPrefiltered(
+    thread_data* my_data,
+    spectrum_batch* batch,
+    int slot,
+    open_spectrum* open,
+    const ActivePeptideQueue::Selection& selection,
+    const vector<bool>& status
+  );
+
+  /**
+   * Add a (score, rank) match to the min-heap best if it is among the best
+   * keep matches so far. Of matches with equal scores the one of higher rank
+   * is the better, as in TideMatchSet's ordering, so which are kept does not
+   * depend on the order they come in. Returns whether the heap is full and
+   * its worst match may have changed.
+   */
+  static bool keepMatch(
+    vector< pair<int, int> >* best,
+    const pair<int, int>& match,
+    size_t keep
+  );
+
+  /**
+   * Add a match to the best matches of a spectrum-charge pair if it is
+   * among the best keep targets or decoys so far.
+   */
+  static void keepOpenMatch(
+    open_spectrum* open,
+    int score,
+    const Peptide* peptide,
+    size_t keep
+  );
+
+  /**
+   * Report the matches of a spectrum-charge pair that no later block can
+   * hold candidates for, and free them.
+   */
+  void reportOpenSpectrum(
+    thread_data* my_data,
+    open_spectrum* spectrum,
+    spectrum_batch* batch,
+    TideMatchSet::ResultBuffer* result_buffer
+  );
+
   void setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag);
+  // Search the spectra in spectrum_store rather than reading their files
+  // again, and add the spectra of the other files to it.
+  void setSpectrumStore(map<string, SpectrumCollection*>* spectrum_store);
+  // Write the results, with their headers, into target and decoy (which may
+  // be NULL with concat) rather than into files, unless txt-format = binary.
+  void setResultStreams(std::ostream* target, std::ostream* decoy);
+  // Whether the last search wrote its results into the result streams
+  bool resultsInMemory() const;
+  // Search only slice slice of num_slices of the spectrum-charge pairs of
+  // each file, in mass order.
+  void setSpectrumSlice(int slice, int num_slices);
+
+  /**
+   * Opens a results file for writing, gzipped if its name ends in .gz.
+   * Exits if the file exists and overwrite is false.
+   */
+  static std::ostream* createResultsFile(const std::string& path, bool overwrite, bool binary);
+
+  /**
+   * Opens a results file to append to, once it is cut back to offset.
+   */
+  static std::ostream* reopenResultsFile(const std::string& path, long long offset, bool binary);
+
   virtual void processParams();
   string getOutputFileName();
 };
@@ -0,0 +1,207 @@
+/**
+ * \file TideServerApplication.cpp
+ * \brief Runs a series of tide-search jobs against one index that stays loaded
+ ************************************************************/
+#include "TideServerApplication.h"
+#include "TideSearchApplication.h"
+#include "util/crux-utils.h"
+#include "util/Params.h"
+#include "util/StringUtils.h"
+#include "util/FileUtils.h"
+
+using namespace std;
+
+/**
+ * \returns a blank TideServerApplication object
+ */
+TideServerApplication::TideServerApplication() {
+}
+
+/**
+ * Destructor
+ */
+TideServerApplication::~TideServerApplication() {
+}
+
+/**
+ * main method for TideServerApplication
+ */
+int TideServerApplication::main(int argc, char** argv) {
+  carp(CARP_INFO, "Running tide-server...");
+
+  string jobs_file = Params::GetString("server-jobs");
+  ifstream jobs_stream;
+  istream* jobs = &cin;
+  if (!jobs_file.empty()) {
+    jobs_stream.open(jobs_file.c_str());
+    if (!jobs_stream.good()) {
+      carp(CARP_FATAL, "Cannot open the job file %s", jobs_file.c_str());
+    }
+    jobs = &jobs_stream;
+  }
+
+  TideSearchApplication::keepIndex(true);
+  int num_jobs = 0, num_failed = 0;
+  string line;
+  while (getline(*jobs, line)) {
+    line = StringUtils::Trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    ++num_jobs;
+    if (!runJob(line)) {
+      ++num_failed;
+    }
+  }
+  TideSearchApplication::keepIndex(false);
+  TideSearchApplication::releaseIndex();
+
+  carp(CARP_INFO, "Ran %d jobs, %d of which failed.", num_jobs, num_failed);
+  return 0;
+}
+
+bool TideServerApplication::runJob(const string& line) {
+  vector<string> fields = StringUtils::Split(line, '\t');
+  string output_dir = fields[0];
+  vector<string> spectra(fields.begin() + 1, fields.end());
+  bool ok = !spectra.empty();
+  if (!ok) {
+    carp(CARP_ERROR, "The job '%s' names no spectrum files.", line.c_str());
+  }
+  // A missing file would be fatal to the search, and so to the server.
+  for (vector<string>::const_iterator i = spectra.begin(); ok && i != spectra.end(); ++i) {
+    if (!FileUtils::Exists(*i)) {
+      carp(CARP_ERROR, "The spectrum file %s does not exist.", i->c_str());
+      ok = false;
+    }
+  }
+  if (ok && create_output_directory(output_dir, Params::GetBool("overwrite")) == -1) {
+    carp(CARP_ERROR, "Unable to create output directory %s.", output_dir.c_str());
+    ok = false;
+  }
+  if (ok) {
+    carp(CARP_INFO, "Searching %d spectrum files for %s.", (int)spectra.size(),
+         output_dir.c_str());
+    TideSearchApplication search;
+    search.setOutputDirectory(output_dir);
+    ok = search.main(spectra, Params::GetString("tide database")) == 0;
+  }
+  cout << (ok ? "done" : "failed") << '\t' << output_dir << endl;
+  return ok;
+}
+
+/**
+ * \returns the command name for TideServerApplication
+ */
+string TideServerApplication::getName() const {
+  return "tide-server";
+}
+
+/**
+ * \returns the description for TideServerApplication
+ */
+string TideServerApplication::getDescription() const {
+  return
+    "[[nohtml:Run many tide-search jobs against one index, reading the index "
+    "only once.]]"
+    "[[html:<p>Tide-server reads the proteins and auxiliary locations of an index "
+    "once and then runs the tide-search jobs that it reads, one per line, from "
+    "the file given by server-jobs or from standard input, until the end of the "
+    "input. Each job gives an output directory and the spectrum files to search; "
+    "all jobs are searched with the options of the server. This saves each of many "
+    "small searches of the same index from reading the index again. Only "
+    "tab-delimited results are written.</p>]]";
+}
+
+/**
+ * \returns the command arguments
+ */
+vector<string> TideServerApplication::getArgs() const {
+  string arr[] = {
+    "tide database"
+  };
+  return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
+}
+
+/**
+ * \returns the command options
+ */
+vector<string> TideServerApplication::getOptions() const {
+  string arr[] = {
+    "server-jobs"
+  };
+  vector<string> options(arr, arr + sizeof(arr) / sizeof(string));
+  addOptionsFrom<TideSearchApplication>(&options);
+  removeOptionFrom(&options, "auto-mz-bin-width");
+  removeOptionFrom(&options, "auto-precursor-window");
+  removeOptionFrom(&options, "store-index");
+  removeOptionFrom(&options, "store-spectra");
+  return options;
+}
+
+/**
+ * \returns the command outputs
+ */
+vector< pair<string, string> > TideServerApplication::getOutputs() const {
+  vector< pair<string, string> > outputs;
+  outputs.push_back(make_pair("tide-search.target.txt",
+    "for each job, a tab-delimited text file in the job's output directory "
+    "containing the target PSMs. See <a href=\"../file-formats/txt-format.html\">"
+    "txt file format</a> for a list of the fields."));
+  outputs.push_back(make_pair("tide-search.decoy.txt",
+    "for each job, a tab-delimited text file in the job's output directory "
+    "containing the decoy PSMs, if the index has decoys."));
+  outputs.push_back(make_pair("tide-server.params.txt",
+    "a file containing the name and value of all parameters/options for the "
+    "current operation. Not all parameters in the file may have been used in "
+    "the operation. The resulting file can be used with the --parameter-file "
+    "option for other Crux programs."));
+  outputs.push_back(make_pair("tide-server.log.txt",
+    "a log file containing a copy of all messages that were printed to the "
+    "screen during execution."));
+  return outputs;
+}
+
+COMMAND_T TideServerApplication::getCommand() const {
+  return MISC_COMMAND;
+}
+
+/**
+ * \returns whether the application needs the output directory or not.
+ */
+bool TideServerApplication::needsOutputDirectory() const {
+  return true;
+}
+
+void TideServerApplication::processParams() {
+  const string index = Params::GetString("tide database");
+  if (!FileUtils::Exists(index) || FileUtils::IsRegularFile(index)) {
+    carp(CARP_FATAL, "tide-server needs an index made by tide-index, not '%s'",
+         index.c_str());
+  }
+  // These depend on the spectra of each job.
+  if (Params::GetString("auto-precursor-window") != "false" ||
+      Params::GetString("auto-mz-bin-width") != "false") {
+    carp(CARP_WARNING, "tide-server does not estimate the precursor window or "
+                       "the bin width; using the values given.");
+    Params::Set("auto-precursor-window", "false");
+    Params::Set("auto-mz-bin-width", "false");
+  }
+  if (!Params::GetString("store-spectra").empty()) {
+    carp(CARP_WARNING, "tide-server does not store spectra.");
+    Params::Set("store-spectra", "");
+  }
+  if (Params::GetBool("pin-output") || Params::GetBool("pepxml-output") ||
+      Params::GetBool("mzid-output") || Params::GetBool("sqt-output")) {
+    carp(CARP_WARNING, "tide-server writes only tab-delimited results.");
+  }
+  TideSearchApplication search;
+  search.processParams();
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,84 @@
+/**
+ * \file TideServerApplication.h
+ * \brief Runs a series of tide-search jobs against one index that stays loaded
+ ***********************************************************/
+#ifndef TIDESERVERAPPLICATION_H
+#define TIDESERVERAPPLICATION_H
+
+#include "CruxApplication.h"
+
+#include <string>
+
+class TideServerApplication: public CruxApplication {
+
+ public:
+
+  /**
+   * \returns a blank TideServerApplication object
+   */
+  TideServerApplication();
+
+  /**
+   * Destructor
+   */
+  ~TideServerApplication();
+
+  /**
+   * main method for TideServerApplication
+   */
+  virtual int main(int argc, char** argv);
+
+  /**
+   * \returns the command name for TideServerApplication
+   */
+  virtual std::string getName() const;
+
+  /**
+   * \returns the description for TideServerApplication
+   */
+  virtual std::string getDescription() const;
+
+  /**
+   * \returns the command arguments
+   */
+  virtual std::vector<std::string> getArgs() const;
+
+  /**
+   * \returns the command options
+   */
+  virtual std::vector<std::string> getOptions() const;
+
+  /**
+   * \returns the command outputs
+   */
+  virtual std::vector< std::pair<std::string, std::string> > getOutputs() const;
+
+  /**
+   * \returns the enum of the application, default MISC_COMMAND
+   */
+  virtual COMMAND_T getCommand() const;
+
+  /**
+   * \returns whether the application needs the output directory or not.
+   */
+  virtual bool needsOutputDirectory() const;
+
+  virtual void processParams();
+
+ private:
+
+  /**
+   * Run the job on one line of input; returns whether it succeeded.
+   */
+  bool runJob(const std::string& line);
+
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -1,4 +1,115 @@
 #include "CKronik2.h"
+#include <algorithm>
+#include <climits>
+
+//-------------------------------------
+//   Peptide index for processScans()
+//-------------------------------------
+
+//Indexes the peptides of every scan by charge and mass bin, so that the
+//match for a peptide in a nearby scan is found without walking the whole
+//scan, and orders all peptides by intensity so that the next most intense
+//one is found without walking every scan. A peptide is found in the order
+//of its scan's vPep (sorted by intensity) until it is removed.
+class CKronikIndex {
+public:
+  CKronikIndex(vector<sScan>& allScans, double ppm) : scans(allScans), ppmTol(ppm), next(0) {
+    unsigned int i,j;
+    //Masses within ppmTol of each other are at most one bin apart
+    binWidth = ppmTol>0 ? 2.0*ppmTol/1000000 : 0;
+    first.push_back(0);
+    for(i=0;i<scans.size();i++) first.push_back(first[i]+scans[i].vPep->size());
+    used.assign(first.back(),false);
+    for(i=0;i<scans.size();i++){
+      for(j=0;j<scans[i].vPep->size();j++){
+        sIndexed x;
+        x.scan=i;
+        x.pep=j;
+        x.charge=scans[i].vPep->at(j).charge;
+        x.bin=getBin(scans[i].vPep->at(j).monoMass);
+        x.intensity=scans[i].vPep->at(j).intensity;
+        bins.push_back(x);
+        order.push_back(x);
+      }
+      sort(bins.begin()+first[i],bins.begin()+first[i+1],compareBin);
+    }
+    sort(order.begin(),order.end(),compareIntensity);
+  }
+
+  //The most intense peptide left, the first of those in the earliest scan
+  //if several are as intense; as findMax() did by walking the scans.
+  bool nextMax(int& s, int& p){
+    while(next<order.size() && used[first[order[next].scan]+order[next].pep]) next++;
+    if(next==order.size() || !(order[next].intensity>0)) return false;
+    s=order[next].scan;
+    p=order[next].pep;
+    return true;
+  }
+
+  //The first peptide left in scan s of the given charge within ppmTol of
+  //mass, or -1.
+  int find(int s, double mass, int charge){
+    if(binWidth==0 || !(mass>0)) return -1;
+    long long bin=getBin(mass);
+    int best=-1;
+    for(long long b=bin-1;b<=bin+1;b++){
+      sIndexed key;
+      key.charge=charge;
+      key.bin=b;
+      key.pep=-1;
+      vector<sIndexed>::iterator it=lower_bound(bins.begin()+first[s],bins.begin()+first[s+1],key,compareBin);
+      for(;it!=bins.begin()+first[s+1] && it->charge==charge && it->bin==b;it++){
+        if(best>=0 && it->pep>=best) break;
+        if(used[first[s]+it->pep]) continue;
+        double ppm=(scans[s].vPep->at(it->pep).monoMass-mass)/mass*1000000;
+        if(fabs(ppm)<ppmTol) {
+          best=it->pep;
+          break;
+        }
+      }
+    }
+    return best;
+  }
+
+  void remove(int s, int p){
+    used[first[s]+p]=true;
+  }
+
+private:
+  typedef struct sIndexed{
+    int scan;
+    int pep;
+    int charge;
+    long long bin;
+    float intensity;
+  } sIndexed;
+
+  long long getBin(double mass){
+    if(binWidth==0 || !(mass>0)) return LLONG_MIN;
+    return (long long)floor(log(mass)/binWidth);
+  }
+
+  static bool compareBin(const sIndexed& a, const sIndexed& b){
+    if(a.charge!=b.charge) return a.charge<b.charge;
+    if(a.bin!=b.bin) return a.bin<b.bin;
+    return a.pep<b.pep;
+  }
+
+  static bool compareIntensity(const sIndexed& a, const sIndexed& b){
+    if(a.intensity!=b.intensity) return a.intensity>b.intensity;
+    if(a.scan!=b.scan) return a.scan<b.scan;
+    return a.pep<b.pep;
+  }
+
+  vector<sScan>& scans;
+  double ppmTol;
+  double binWidth;           //in log(mass)
+  vector<unsigned int> first; //of each scan's peptides in bins and used
+  vector<sIndexed> bins;     //each scan's peptides by charge, bin and pep
+  vector<sIndexed> order;    //all peptides by intensity
+  vector<bool> used;
+  unsigned int next;         //in order; those before it are used
+};
 
 //-------------------------------------
 //   Constructors and Destructors
@@ -133,8 +244,6 @@ bool CKronik2::processHK(char*  in, char* out) {
 	double td;
 	char tag;
 	bool firstScan;
-  int sIndex,pIndex;
-  int i,j,k,k1,k2;
 
 	char line[256];
 	char* tok;
@@ -142,24 +251,6 @@ bool CKronik2::processHK(char*  in, char* out) {
 	int pepCount=0;
   vector<sScan> allScans;
 
-  double mass;
-  double ppm;
-  int charge;
-  int gap;
-  int matchCount;
-  bool bMatch;
-
-  sPepProfile s;
-  sProfileData p;
-
-  //for tracking which peptides
-  iTwo t;
-  vector<iTwo> vLeft;
-  vector<iTwo> vRight;
-
-  //clear data
-  vPeps.clear();
-
   //Read in the Hardklor results
   firstScan=true;
 	hkr = fopen(in,"rt");
@@ -195,7 +286,39 @@ bool CKronik2::processHK(char*  in, char* out) {
 
   cout << pepCount << " peptides from " << allScans.size() << " scans." << endl;
 
-  for(i=0;i<allScans.size();i++) allScans[i].sortIntRev();
+  return processScans(allScans,out);
+}
+
+//Finds the persistent peptide signals in Hardklor results that are already
+//in memory. The peptides of allScans are used up in the process.
+bool CKronik2::processScans(vector<sScan>& allScans, char* out) {
+  int sIndex,pIndex;
+  int i,j,k,k1,k2;
+
+  int pepCount=0;
+
+  double mass;
+  int charge;
+  int gap;
+  int matchCount;
+  bool bMatch;
+
+  sPepProfile s;
+  sProfileData p;
+
+  //for tracking which peptides
+  iTwo t;
+  vector<iTwo> vLeft;
+  vector<iTwo> vRight;
+
+  //clear data
+  vPeps.clear();
+
+  for(i=0;i<allScans.size();i++) {
+    allScans[i].sortIntRev();
+    pepCount+=allScans[i].vPep->size();
+  }
+  CKronikIndex index(allScans,dPPMTol);
 
   cout << "Finding persistent peptide signals:" << endl;
 
@@ -206,7 +329,7 @@ bool CKronik2::processHK(char*  in, char* out) {
 
   //Perform the Kronik analysis
   while(pepCount>0){
-    if(!findMax(allScans,sIndex,pIndex)) break;
+    if(!index.nextMax(sIndex,pIndex)) break;
 
     mass=allScans[sIndex].vPep->at(pIndex).monoMass;
     charge=allScans[sIndex].vPep->at(pIndex).charge;
@@ -219,17 +342,11 @@ bool CKronik2::processHK(char*  in, char* out) {
     while(i>-1 && gap<=iGapTol){
       bMatch=false;
       t.scan=i;
-      t.pep=-1;
-      for(j=0;j<allScans[i].vPep->size();j++){
-        //if(allScans[i].vPep->at(j).intensity<0.0) continue;
-        ppm=(allScans[i].vPep->at(j).monoMass-mass)/mass*1000000;
-        if(fabs(ppm)<dPPMTol && allScans[i].vPep->at(j).charge==charge){
-          t.pep=j;
-          gap=0;
-          bMatch=true;
-          matchCount++;
-          break;
-        }
+      t.pep=index.find(i,mass,charge);
+      if(t.pep>=0){
+        gap=0;
+        bMatch=true;
+        matchCount++;
       }
       if(!bMatch) gap++;
       vLeft.push_back(t);
@@ -243,17 +360,11 @@ bool CKronik2::processHK(char*  in, char* out) {
     while(i<allScans.size() && gap<=iGapTol){    
       bMatch=false;
       t.scan=i;
-      t.pep=-1;
-      for(j=0;j<allScans[i].vPep->size();j++){
-        //if(allScans[i].vPep->at(j).intensity<0.0) continue;
-        ppm=(allScans[i].vPep->at(j).monoMass-mass)/mass*1000000;
-        if(fabs(ppm)<dPPMTol && allScans[i].vPep->at(j).charge==charge){
-          t.pep=j;
-          gap=0;
-          bMatch=true;
-          matchCount++;
-          break;
-        }
+      t.pep=index.find(i,mass,charge);
+      if(t.pep>=0){
+        gap=0;
+        bMatch=true;
+        matchCount++;
       }
       if(!bMatch) gap++;
       vRight.push_back(t);
@@ -385,21 +496,21 @@ bool CKronik2::processHK(char*  in, char* out) {
 
       vPeps.push_back(s);
 
-      //Erase datapoints already used
+      //Remove datapoints already used
       for(i=0;i<vLeft.size();i++){
         if(vLeft[i].pep<0) continue;
-        allScans[vLeft[i].scan].vPep->erase(allScans[vLeft[i].scan].vPep->begin()+vLeft[i].pep);
+        index.remove(vLeft[i].scan,vLeft[i].pep);
         pepCount--;
       }
       for(i=0;i<vRight.size();i++){
         if(vRight[i].pep<0) continue;
-        allScans[vRight[i].scan].vPep->erase(allScans[vRight[i].scan].vPep->begin()+vRight[i].pep);
+        index.remove(vRight[i].scan,vRight[i].pep);
         pepCount--;
       }
     }
 
-    //erase the one we're looking at
-    allScans[sIndex].vPep->erase(allScans[sIndex].vPep->begin()+pIndex);
+    //remove the one we're looking at
+    index.remove(sIndex,pIndex);
     pepCount--;
 
     //update percent
@@ -411,6 +522,7 @@ bool CKronik2::processHK(char*  in, char* out) {
 
   }
   cerr << endl;
+  for(i=0;i<allScans.size();i++) allScans[i].vPep->clear();
 
   if(out[0]!='\0'){
     FILE* f;
@@ -443,25 +555,6 @@ bool CKronik2::processHK(char*  in, char* out) {
   return true;
 }
 
-
-
-bool CKronik2::findMax(vector<sScan>& v, int& s, int& p){
-  bool found = false;
-  float max=0;
-  unsigned int i;
-  p=0;
-  for(i=0;i<v.size();i++){
-    if(v[i].vPep->size()==0) continue;
-    if(v[i].vPep->at(0).intensity>max){
-      max=v[i].vPep->at(0).intensity;
-      s=i;
-      found = true;
-    }
-  }
-  return found;
-}
-
-
 //-----------------------------------------  
 //                 Tools
 //-----------------------------------------
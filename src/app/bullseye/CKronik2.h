@@ -287,6 +287,7 @@ public:
   int getPercent();
   bool loadHK(char* in);
   bool processHK(char* in, char* out="\0");
+  bool processScans(vector<sScan>& allScans, char* out="\0");
 
   //Tools
   bool getRT(int scanNum, float& rt);
@@ -312,7 +313,6 @@ public:
 
 protected:
 private:
-  bool findMax(vector<sScan>& v, int& s, int& p);
   double interpolate(int x1, int x2, double y1, double y2, int x);
   
   //Statistics functions
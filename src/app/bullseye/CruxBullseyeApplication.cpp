@@ -3,7 +3,9 @@
  * \brief Given a ms1 and ms2 file, run hardklor followed by the bullseye algorithm.
  *****************************************************************************/
 #include "CruxBullseyeApplication.h"
+#include "CKronik2.h"
 #include "app/hardklor/CruxHardklorApplication.h"
+#include "app/hardklor/HardklorTypes.h"
 #include "util/CarpStreamBuf.h"
 #include "io/DelimitedFileWriter.h"
 
@@ -43,6 +45,37 @@ int CruxBullseyeApplication::main(int argc, char** argv) {
   );
 }
 
+/**
+ * Converts the results of an in-memory Hardklor run into the scans that
+ * bullseye reads from a Hardklor file.
+ */
+static void convertHardklorResults(
+  const string& input_ms1,
+  const vector<hkScanMem>& scans,
+  const vector<hkMem>& results,
+  vector<sScan>* hk_scans
+) {
+  hk_scans->resize(scans.size());
+  for (size_t i = 0; i < scans.size(); i++) {
+    sScan& scan = (*hk_scans)[i];
+    scan.scanNum = scans[i].scan;
+    scan.rTime = scans[i].rTime;
+    strncpy(scan.file, input_ms1.c_str(), sizeof(scan.file) - 1);
+    scan.file[sizeof(scan.file) - 1] = '\0';
+    int last = (i + 1 < scans.size()) ? scans[i + 1].firstResult : results.size();
+    for (int j = scans[i].firstResult; j < last; j++) {
+      sPep pep;
+      pep.monoMass = results[j].monoMass;
+      pep.charge = results[j].charge;
+      pep.intensity = results[j].intensity;
+      pep.basePeak = results[j].mz;
+      pep.xCorr = results[j].corr;
+      strcpy(pep.mods, results[j].mods);
+      scan.vPep->push_back(pep);
+    }
+  }
+}
+
 /**
  * main method for CruxBullseyeApplication
  */
@@ -54,15 +87,23 @@ int CruxBullseyeApplication::main(
 ) {
   /* Get parameters. */
   string hardklor_output = Params::GetString("hardklor-file");
+  vector<sScan> hk_scans;
+  bool in_memory = false;
   if (hardklor_output.empty()) {
     hardklor_output = make_file_path("hardklor.mono.txt");
     if (Params::GetBool("overwrite") || (!FileUtils::Exists(hardklor_output))) {
+      // Hand the Hardklor results straight to bullseye, without writing and
+      // parsing them again
       carp(CARP_DEBUG, "Calling hardklor");
-      bool ret = CruxHardklorApplication::main(input_ms1);
+      vector<hkScanMem> scans;
+      vector<hkMem> results;
+      int ret = CruxHardklorApplication::main(input_ms1, &scans, &results);
       if (ret != 0) {
         carp(CARP_WARNING, "Hardklor failed:%d", ret);
         return ret;
       }
+      convertHardklorResults(input_ms1, scans, results, &hk_scans);
+      in_memory = true;
     }
   }
 
@@ -127,7 +168,7 @@ int CruxBullseyeApplication::main(
   cout.rdbuf(&buffer);
 
   /* Call bullseyeMain */
-  int ret = bullseyeMain(be_argc, be_argv);
+  int ret = bullseyeMain(be_argc, be_argv, in_memory ? &hk_scans : NULL);
 
   // Recover stream
   cout.rdbuf(old);
@@ -230,9 +271,6 @@ vector< pair<string, string> > CruxBullseyeApplication::getOutputs() const {
   outputs.push_back(make_pair("bullseye.no-pid.<format>",
     "a file containing the fragmentation spectra for which accurate masses "
     "were not inferred."));
-  outputs.push_back(make_pair("hardklor.mono.txt",
-    "a tab-delimited text file containing one line for each isotope "
-    "distribution, as described <a href=\"hardklor.html\">here</a>."));
   outputs.push_back(make_pair("bullseye.params.txt",
     "a file containing the name and value of all parameters/options for the "
     "current operation. Not all parameters in the file may have been used in "
@@ -11,13 +11,17 @@
 
 #include <string>
 #include <fstream>
+#include <vector>
+
+struct sScan;
 
 class CruxBullseyeApplication: public CruxApplication {
 
  protected:
 
-  //Calls the main method in bullseye
-  int bullseyeMain(int argc, char* argv[]);
+  //Calls the main method in bullseye; if hkScans is given, they are used as
+  //the Hardklor results instead of reading the Hardklor file argument
+  int bullseyeMain(int argc, char* argv[], std::vector<sScan>* hkScans = NULL);
 
  public:
 
@@ -4,6 +4,7 @@
 #ifdef CRUX
 #include "CruxBullseyeApplication.h"
 #endif
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <vector>
@@ -12,6 +13,7 @@ using namespace MSToolkit;
 
 MSFileFormat getFileFormat(char* c);
 void matchMS2(CKronik2& p, char* ms2File, char* outFile, char* outFile2);
+void precursorWindow(sPepProfile& p, double& lowMass, double& highMass);
 void usage();
 
 double mean,stD;
@@ -20,7 +22,7 @@ double rtTolerance;
 bool bMatchPrecursorOnly;
 
 #ifdef CRUX
-int CruxBullseyeApplication::bullseyeMain(int argc, char* argv[]){
+int CruxBullseyeApplication::bullseyeMain(int argc, char* argv[], vector<sScan>* hkScans){
 #else
 int main(int argc, char* argv[]){
 #endif
@@ -91,7 +93,12 @@ int main(int argc, char* argv[]){
 		}
 	}
 
+#ifdef CRUX
+	if(hkScans!=NULL) p1.processScans(*hkScans);
+	else p1.processHK(argv[argc-4]);
+#else
 	p1.processHK(argv[argc-4]);
+#endif
 	if (p1.size() == 0) {
 		cout << "No analysis results, exiting..." << endl;
 		exit(0);
@@ -137,6 +144,10 @@ void matchMS2(CKronik2& p, char* ms2File, char* outFile, char* outFile2){
   int index;
   vector<int> vI;
   vector<int> vHit;
+  vector<int> vCand;
+  vector<pair<double,int> > vWindow;
+  vector<pair<double,int> >::iterator it;
+  double maxWidth;
   MSFileFormat posFF, negFF;
 
   int ch[10];
@@ -193,6 +204,16 @@ void matchMS2(CKronik2& p, char* ms2File, char* outFile, char* outFile2){
     }
     lookup[i]=j;
   }
+
+  //Precursor windows of all persistent peptides, ordered by their lower
+  //bound, so each MS/MS scan only checks the windows that can contain it
+  maxWidth=0.0;
+  for(i=0;i<p.size();i++){
+    precursorWindow(p.at(i),lowMass,highMass);
+    vWindow.push_back(make_pair(lowMass,i));
+    if(highMass-lowMass>maxWidth) maxWidth=highMass-lowMass;
+  }
+  sort(vWindow.begin(),vWindow.end());
   cout << "Done!" << endl;
 
   //Read in the data
@@ -238,19 +259,16 @@ void matchMS2(CKronik2& p, char* ms2File, char* outFile, char* outFile2){
 
     //if base peak wasn't enough, perhaps a different peak was isolated
     if(!bMatchPrecursorOnly){
-      for(i=0;i<p.size();i++){
-        lowMass = (p.at(i).monoMass+p.at(i).charge*1.00727649)/p.at(i).charge-0.05;
-        switch(p.at(i).charge){
-          case 1:
-            highMass = (p.at(i).monoMass+p.at(i).charge*1.00727649)/p.at(i).charge + 3.10;
-            break;
-          case 2:
-            highMass = (p.at(i).monoMass+p.at(i).charge*1.00727649)/p.at(i).charge + 2.10;
-            break;
-          default:
-            highMass = (p.at(i).monoMass+p.at(i).charge*1.00727649)/p.at(i).charge + 4/p.at(i).charge +0.05;
-            break;
-        }
+      vCand.clear();
+      it=lower_bound(vWindow.begin(),vWindow.end(),make_pair(s.getMZ()-maxWidth-0.01,-1));
+      while(it!=vWindow.end() && it->first<s.getMZ()){
+        vCand.push_back(it->second);
+        it++;
+      }
+      sort(vCand.begin(),vCand.end());
+      for(j=0;j<vCand.size();j++){
+        i=vCand[j];
+        precursorWindow(p.at(i),lowMass,highMass);
         if( s.getMZ() > lowMass &&
             s.getMZ() < highMass &&
             s.getRTime() > p.at(i).firstRTime-rtTolerance &&
@@ -390,6 +408,23 @@ void matchMS2(CKronik2& p, char* ms2File, char* outFile, char* outFile2){
 
 }
 
+//The range of precursor m/z values whose isolation would include some
+//isotope peak of the persistent peptide
+void precursorWindow(sPepProfile& p, double& lowMass, double& highMass){
+  lowMass = (p.monoMass+p.charge*1.00727649)/p.charge-0.05;
+  switch(p.charge){
+    case 1:
+      highMass = (p.monoMass+p.charge*1.00727649)/p.charge + 3.10;
+      break;
+    case 2:
+      highMass = (p.monoMass+p.charge*1.00727649)/p.charge + 2.10;
+      break;
+    default:
+      highMass = (p.monoMass+p.charge*1.00727649)/p.charge + 4/p.charge +0.05;
+      break;
+  }
+}
+
 MSFileFormat getFileFormat(char* c){
 
 	char file[256];
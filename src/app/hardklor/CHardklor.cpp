@@ -30,6 +30,8 @@
 #include "CSpecAnalyze.h"
 #include "Smooth.h"
 #include <iomanip>
+#include <boost/bind.hpp>
+#include "util/ThreadPool.h"
 using namespace std;
 
 
@@ -76,6 +78,7 @@ CHardklor::CHardklor(){
 	mercury=NULL;
 	bEcho=true;
   bMem=false;
+  numThreads=1;
 }
 
 CHardklor::CHardklor(CAveragine *a, CMercury8 *m){
@@ -85,6 +88,7 @@ CHardklor::CHardklor(CAveragine *a, CMercury8 *m){
   sa.setMercury(mercury);
 	bEcho=true;
   bMem=false;
+  numThreads=1;
 }
 
 CHardklor::~CHardklor(){
@@ -101,6 +105,10 @@ void CHardklor::SetAveragine(CAveragine *a){
 	sa.setAveragine(averagine);
 }
 
+void CHardklor::SetThreads(int n){
+  numThreads = n<1 ? 1 : n;
+}
+
 void CHardklor::SetMercury(CMercury8 *m){
 	mercury=m;
 	sa.setMercury(mercury);
@@ -173,6 +181,7 @@ void CHardklor::Analyze(Spectrum* s) {
   int winCount=0;
 
   vResults.clear();
+  vScans.clear();
 
   //Ouput file info to user
 	if(bEcho){
@@ -286,13 +295,14 @@ void CHardklor::Analyze(Spectrum* s) {
 
 		//Write scan information to output file.
 		if(curSpec.getScanNumber()!=0){	
+		  if(cs.scan.iUpper>0 && curSpec.getScanNumber()>cs.scan.iUpper) break;
       if(!bMem){
-			  if(cs.scan.iUpper>0 && curSpec.getScanNumber()>cs.scan.iUpper) break;
 			  if(cs.reducedOutput) WriteScanLine(curSpec,fptr,2);
 			  else if(cs.xml) WriteScanLine(curSpec,fptr,1);
 			  else WriteScanLine(curSpec,fptr,0);
       } else {
         currentScanNumber = curSpec.getScanNumber();
+        ScanToMem(curSpec);
       }
 		} else {
 			break; //exit if there is no spectrum left to analyze
@@ -519,6 +529,14 @@ bool CHardklor::AnalyzePeaks(CSpecAnalyze& sa){
 
 	//Restructure mismatch arrays for faster correlation analysis
 	sa.BuildMismatchArrays();
+
+	//The observed half of every correlation of this window
+	obsIntensity.resize(sa.peaks.size());
+	obsSxx=0;
+	for(i=0;i<sa.peaks.size();i++){
+		obsIntensity[i] = sa.peaks.at(i).intensity;
+		obsSxx += (obsIntensity[i]*obsIntensity[i]);
+	}
  
   //Send the distributions, and the observed data points from the spectrum to a recursive
   //algorithm that will sum up every combination of every peptide in each of its chlorinated
@@ -540,8 +558,6 @@ bool CHardklor::AnalyzePeaks(CSpecAnalyze& sa){
 	bsso.clear();
 	switch(cs.algorithm){
 	case SemiComplete:
-		SemiCompleteMethod(match,mismatch,&bsso,1,cs.depth,0);
-		break;
 	case SemiCompleteFast:
 		SemiCompleteFastMethod(match,mismatch,&bsso,1,cs.depth,0);
 		break;
@@ -596,39 +612,25 @@ bool CHardklor::AnalyzePeaks(CSpecAnalyze& sa){
 	return true;
 }
 
+//Cosine angle correlation of the observed peaks with match, and of nothing
+//with the mismatches of the prediction. The observed sums are those of the
+//window, made once in AnalyzePeaks.
 double CHardklor::LinReg(float *match, float *mismatch){
 
   int i,sz;
-  double sxx=0,syy=0,sxy=0;
-  vector<sFloat> v;
-  sFloat tmp;
+  double sxx=obsSxx,syy=0,sxy=0;
 
 	//Correlate matches
-	for(i=0;i<sa.peaks.size();i++){
-		tmp.fLower = sa.peaks.at(i).intensity;
-		tmp.fUpper = match[i];
-		v.push_back(tmp);
-  }
+	sz=(int)obsIntensity.size();
+	for(i=0;i<sz;i++){
+		sxy += (obsIntensity[i]*match[i]);
+		syy += (match[i]*match[i]);
+	}
 
 	//Correlate mismatches with 0
 	for(i=0;i<sa.mismatchSize;i++){
-		if(mismatch[i]>0){
-			tmp.fLower = 0;
-			tmp.fUpper = mismatch[i];
-			v.push_back(tmp);
-		}
-  }
-
-  //Cosine angle correlation
-  sxy=0;
-  sxx=0;
-  syy=0;
-	sz=(int)v.size();
-  for(i=0;i<sz;i++){
-    sxy += (v.at(i).fLower*v.at(i).fUpper);
-    sxx += (v.at(i).fLower*v.at(i).fLower);
-    syy += (v.at(i).fUpper*v.at(i).fUpper);
-  }
+		if(mismatch[i]>0) syy += (mismatch[i]*mismatch[i]);
+	}
 
   if(sxx>0 && syy>0 && sxy>0) return sxy/sqrt(sxx*syy);
   else return 0;
@@ -714,114 +716,15 @@ void CHardklor::BasicMethod(float *match, float *mismatch,SSObject *combo,
   
 };
 
-void CHardklor::SemiCompleteMethod(float *match, float *mismatch,SSObject *combo, 
-			     int depth, int maxDepth, int start){
-
-  SSObject bestCombo = *combo;
-  SSObject recCombo;
-  
-  double RCorr;
-  double bestRCorr = combo->corr;
-  int a,n;
-  unsigned int k;
-
-	float *sumMatch;
-	float *sumMismatch;
-
-	sumMatch = new float[sa.peaks.size()];
-	if(sa.mismatchSize>0){
-		sumMismatch = new float[sa.mismatchSize];
-	} else {
-		sumMismatch = new float[1];
-	};
-	
-  //Iterate through all predicted peptides
-  for(k=start; k<sa.predPep->size(); k++) {
-
-    //check each variant
-    for(n=0; n<sa.predPep->at(k).VariantListSize(); n++){
-      
-			//Add the variant to the distribution being analyzed
-			//Do matches first
-			for(a=0;a<sa.peaks.size();a++){
-				sumMatch[a]=sa.predPep->at(k).GetVariant(n).GetMatch(a).intensity + match[a];
-			};
-
-			//Now add mismatches
-			for(a=0;a<sa.mismatchSize;a++){
-				sumMismatch[a]=sa.predPep->at(k).GetVariant(n).GetMismatch(a).intensity + mismatch[a];
-			};
-      
-      //Correlate this combined distribution with the mass spec data.
-			//SSIterations++;
-      RCorr = LinReg(sumMatch,sumMismatch);
-      
-			recCombo = *combo;
-			recCombo.addVar(k,n);
-			recCombo.corr = RCorr;
-
-
-			//Check if it is the best, if so, mark it
-			if(recCombo.corr>bestCombo.corr) bestCombo = recCombo;
-		
-    }
-  }
-
-	//If we reached threshold, stop here without recursion
-	if(bestCombo.corr>cs.corr) {
-		delete [] sumMatch;
-		delete [] sumMismatch;
-		*combo = bestCombo;
-		return;
-	}
-
-	if(depth<maxDepth){
-
-		//Iterate through all predicted peptides
-		for(k=start; k<sa.predPep->size(); k++) {
-
-			//check each variant
-			for(n=0; n<sa.predPep->at(k).VariantListSize(); n++){
-      
-				//Add the variant to the distribution being analyzed
-				//Do matches first
-				for(a=0;a<sa.peaks.size();a++){
-					sumMatch[a]=sa.predPep->at(k).GetVariant(n).GetMatch(a).intensity + match[a];
-				}
-
-				//Now add mismatches
-				for(a=0;a<sa.mismatchSize;a++){
-					sumMismatch[a]=sa.predPep->at(k).GetVariant(n).GetMismatch(a).intensity + mismatch[a];
-				}
-      
-				recCombo = *combo;
-				recCombo.addVar(k,n);
-				recCombo.corr = RCorr;
-
-				//Check recursions
-				SemiCompleteMethod(sumMatch,sumMismatch,&recCombo,depth+1,maxDepth,k+1);
-
-				//Check if it is the best, if so, mark it
-				if(recCombo.corr>bestCombo.corr) bestCombo = recCombo;
-      
-			}
-    }
-  }
-
-	delete [] sumMatch;
-	delete [] sumMismatch;
-	*combo = bestCombo;
-  
-}
-
+//Both SemiComplete and SemiCompleteFast analysis. The sums of every variant
+//added to the combination are kept for the recursions, rather than built again.
 void CHardklor::SemiCompleteFastMethod(float *match, float *mismatch,SSObject *combo, 
 			     int depth, int maxDepth, int start){
 
   SSObject bestCombo = *combo;
   SSObject recCombo;
   
-  double RCorr;
-  double bestRCorr = combo->corr;
+  double RCorr=0;
   int a,b,n;
   unsigned int k;
 
@@ -830,19 +733,10 @@ void CHardklor::SemiCompleteFastMethod(float *match, float *mismatch,SSObject *c
 		numArrays+=sa.predPep->at(k).VariantListSize();
 	}
 
-	float **sumMatch;
-	float **sumMismatch;
-
-	sumMatch = new float* [numArrays];
-	sumMismatch = new float* [numArrays];
-	for(n=0;n<numArrays;n++){
-		sumMatch[n] = new float[sa.peaks.size()];
-		if(sa.mismatchSize>0){
-			sumMismatch[n] = new float[sa.mismatchSize];
-		} else {
-			sumMismatch[n] = new float[1];
-		}
-	}
+	int arraySize = sa.peaks.size() + (sa.mismatchSize>0 ? sa.mismatchSize : 1);
+	float *sums = new float[numArrays*arraySize+1];
+	float *sumMatch;
+	float *sumMismatch;
 	
 	b=0;
   //Iterate through all predicted peptides
@@ -851,20 +745,23 @@ void CHardklor::SemiCompleteFastMethod(float *match, float *mismatch,SSObject *c
     //check each variant
     for(n=0; n<sa.predPep->at(k).VariantListSize(); n++){
       
+			sumMatch = sums + b*arraySize;
+			sumMismatch = sumMatch + sa.peaks.size();
+
 			//Add the variant to the distribution being analyzed
 			//Do matches first
 			for(a=0;a<sa.peaks.size();a++){
-				sumMatch[b][a]=sa.predPep->at(k).GetVariant(n).GetMatch(a).intensity + match[a];
+				sumMatch[a]=sa.predPep->at(k).GetVariant(n).GetMatch(a).intensity + match[a];
 			}
 
 			//Now add mismatches
 			for(a=0;a<sa.mismatchSize;a++){
-				sumMismatch[b][a]=sa.predPep->at(k).GetVariant(n).GetMismatch(a).intensity + mismatch[a];
+				sumMismatch[a]=sa.predPep->at(k).GetVariant(n).GetMismatch(a).intensity + mismatch[a];
 			}
       
       //Correlate this combined distribution with the mass spec data.
 			//SSIterations++;
-      RCorr = LinReg(sumMatch[b],sumMismatch[b]);
+      RCorr = LinReg(sumMatch,sumMismatch);
       
 			recCombo = *combo;
 			recCombo.addVar(k,n);
@@ -880,13 +777,7 @@ void CHardklor::SemiCompleteFastMethod(float *match, float *mismatch,SSObject *c
 
 	//If we reached threshold, stop here without recursion
 	if(bestCombo.corr>cs.corr) {
-		for(n=0;n<numArrays;n++) {
-			delete [] sumMatch[n];
-			delete [] sumMismatch[n];
-		};
-		delete [] sumMatch;
-		delete [] sumMismatch;
-
+		delete [] sums;
 		*combo = bestCombo;
 		return;
 	}
@@ -894,38 +785,38 @@ void CHardklor::SemiCompleteFastMethod(float *match, float *mismatch,SSObject *c
 	if(depth<maxDepth){
 
 		//Iterate through all predicted peptides
+		vector<SSBranch> branches(numArrays);
 		b=0;
 		for(k=start; k<sa.predPep->size(); k++) {
 
 			//check each variant
 			for(n=0; n<sa.predPep->at(k).VariantListSize(); n++){
       
-				recCombo = *combo;
-				recCombo.addVar(k,n);
-				recCombo.corr = RCorr;
-
-				//Check recursions
-				SemiCompleteFastMethod(sumMatch[b],sumMismatch[b],&recCombo,depth+1,maxDepth,k+1);
-
-				//Check if it is the best, if so, mark it
-				if(recCombo.corr>bestCombo.corr) bestCombo = recCombo;
-      
+				branches[b].match = sums + b*arraySize;
+				branches[b].mismatch = branches[b].match + sa.peaks.size();
+				branches[b].combo = *combo;
+				branches[b].combo.addVar(k,n);
+				branches[b].combo.corr = RCorr;
+				branches[b].start = k+1;
+				branches[b].corr = 0;
 				b++;
 			}
     }
+
+		//Check recursions
+		SearchBranches(branches,depth+1,maxDepth);
+
+		//Check if it is the best, if so, mark it
+		for(b=0;b<numArrays;b++){
+			if(branches[b].combo.corr>bestCombo.corr) bestCombo = branches[b].combo;
+		}
   }
 
-	for(n=0;n<numArrays;n++) {
-		delete [] sumMatch[n];
-		delete [] sumMismatch[n];
-	}
-	delete [] sumMatch;
-	delete [] sumMismatch;
+	delete [] sums;
 	*combo = bestCombo;
   
 }
 
-
 void CHardklor::DynamicMethod(float *match, float *mismatch,SSObject *combo, 
 			     int depth, int maxDepth, int start, double corr){
 
@@ -1000,21 +891,21 @@ void CHardklor::DynamicSemiCompleteMethod(float *match, float *mismatch,SSObject
   SSObject recCombo;
   
   double RCorr;
-  double bestRCorr = combo->corr;
   int a,b,n;
   unsigned int k;
 
 	vector<double> vecCorr;
 
+	int numArrays=0;
+	for(k=start;k<sa.predPep->size();k++){
+		numArrays+=sa.predPep->at(k).VariantListSize();
+	}
+
+	//The sums of every variant are kept for the recursions
+	int arraySize = sa.peaks.size() + (sa.mismatchSize>0 ? sa.mismatchSize : 1);
+	float *sums = new float[numArrays*arraySize+1];
 	float *sumMatch;
 	float *sumMismatch;
-
-	sumMatch = new float[sa.peaks.size()];
-	if(sa.mismatchSize>0){
-		sumMismatch = new float[sa.mismatchSize];
-	} else {
-		sumMismatch = new float[1];
-	}
 	
   //Iterate through all predicted peptides
 	b=0;
@@ -1023,6 +914,9 @@ void CHardklor::DynamicSemiCompleteMethod(float *match, float *mismatch,SSObject
     //check each variant
     for(n=0; n<sa.predPep->at(k).VariantListSize(); n++){
       
+			sumMatch = sums + b*arraySize;
+			sumMismatch = sumMatch + sa.peaks.size();
+
 			//Add the variant to the distribution being analyzed
 			//Do matches first
 			for(a=0;a<sa.peaks.size();a++){
@@ -1053,17 +947,19 @@ void CHardklor::DynamicSemiCompleteMethod(float *match, float *mismatch,SSObject
 
 	//If we reached threshold, stop here without recursion
 	if(bestCombo.corr>cs.corr) {
-		delete [] sumMatch;
-		delete [] sumMismatch;
+		delete [] sums;
 		*combo = bestCombo;
 		return;
 	}
 
 
-	//Otherwise, if we're not at the maximum depth, iterate
+	//Otherwise, if we're not at the maximum depth, iterate over the variants
+	//that improved the correlation
 	b=0;
 	if(depth < maxDepth) {
 
+		vector<SSBranch> branches;
+
 		//Iterate through all predicted peptides
 		for(k=start; k<sa.predPep->size(); k++) {
 
@@ -1071,42 +967,61 @@ void CHardklor::DynamicSemiCompleteMethod(float *match, float *mismatch,SSObject
 			for(n=0; n<sa.predPep->at(k).VariantListSize(); n++){
 
 				if(vecCorr.at(b) > corr) {
-      
-					//Add the variant to the distribution being analyzed
-					//Do matches first
-					for(a=0;a<sa.peaks.size();a++){
-						sumMatch[a]=sa.predPep->at(k).GetVariant(n).GetMatch(a).intensity + match[a];
-					}
-
-					//Now add mismatches
-					for(a=0;a<sa.mismatchSize;a++){
-						sumMismatch[a]=sa.predPep->at(k).GetVariant(n).GetMismatch(a).intensity + mismatch[a];
-					}
-      
-					recCombo = *combo;
-					recCombo.addVar(k,n);
-					recCombo.corr = vecCorr.at(b);
-
-					//Check recursions
-					DynamicSemiCompleteMethod(sumMatch,sumMismatch,&recCombo,depth+1,maxDepth,k+1,vecCorr.at(b));
-
-					//Check if it is the best, if so, mark it
-					if(recCombo.corr>bestCombo.corr) bestCombo = recCombo;
-
+					branches.resize(branches.size()+1);
+					SSBranch& br = branches.back();
+					br.match = sums + b*arraySize;
+					br.mismatch = br.match + sa.peaks.size();
+					br.combo = *combo;
+					br.combo.addVar(k,n);
+					br.combo.corr = vecCorr.at(b);
+					br.start = k+1;
+					br.corr = vecCorr.at(b);
 				}
 				b++;
       
 			}
 		}
 
+		//Check recursions
+		SearchBranches(branches,depth+1,maxDepth);
+
+		//Check if it is the best, if so, mark it
+		for(b=0;b<(int)branches.size();b++){
+			if(branches[b].combo.corr>bestCombo.corr) bestCombo = branches[b].combo;
+		}
+
 	}
 
-	delete [] sumMatch;
-	delete [] sumMismatch;
+	delete [] sums;
 	*combo = bestCombo;
   
 };
 
+//Searches the recursions of one level of a SemiComplete or DynamicSemiComplete
+//analysis. Those of the first level only read the analysis of the window, and
+//none depends on another, so they run on the thread pool. The callers take the
+//best of them in order, so the result is that of searching them one by one.
+void CHardklor::SearchBranches(vector<SSBranch>& branches, int depth, int maxDepth){
+	unsigned int i;
+	if(depth==2 && numThreads>1 && branches.size()>1){
+		ThreadPool::TaskGroup threads;
+		for(i=0;i<branches.size();i++){
+			threads.Run(boost::bind(&CHardklor::SearchBranch,this,&branches[i],depth,maxDepth));
+		}
+		threads.Wait();
+	} else {
+		for(i=0;i<branches.size();i++) SearchBranch(&branches[i],depth,maxDepth);
+	}
+}
+
+void CHardklor::SearchBranch(SSBranch* branch, int depth, int maxDepth){
+	if(cs.algorithm==DynamicSemiComplete){
+		DynamicSemiCompleteMethod(branch->match,branch->mismatch,&branch->combo,depth,maxDepth,branch->start,branch->corr);
+	} else {
+		SemiCompleteFastMethod(branch->match,branch->mismatch,&branch->combo,depth,maxDepth,branch->start);
+	}
+}
+
 void CHardklor::SemiSubtractiveMethod(SSObject *combo, int maxDepth){
 
   SSObject bestCombo = *combo;
@@ -2270,6 +2185,23 @@ int CHardklor::Size(){
   return vResults.size();
 }
 
+int CHardklor::SizeScans(){
+  return vScans.size();
+}
+
+hkScanMem& CHardklor::GetScan(const int& index){
+  return vScans[index];
+}
+
+//Records a scan analyzed in memory; its results follow in vResults
+void CHardklor::ScanToMem(Spectrum& s){
+  hkScanMem m;
+  m.scan=s.getScanNumber();
+  m.rTime=s.getRTime();
+  m.firstResult=vResults.size();
+  vScans.push_back(m);
+}
+
 void CHardklor::SetResultsToMemory(bool b){
   bMem=b;
 }
@@ -47,6 +47,16 @@ public:
   
 };
 
+//One recursion of a SemiComplete search: the combination to add variants to,
+//the sums of its distributions and the first predicted peptide to add.
+struct SSBranch {
+  float *match;
+  float *mismatch;
+  SSObject combo;
+  int start;
+  double corr; //of combo, for DynamicSemiComplete
+};
+
 class CHardklor{
 
  public:
@@ -63,8 +73,11 @@ class CHardklor{
   int GoHardklor(CHardklorSetting sett, Spectrum* s=NULL);
 	void SetAveragine(CAveragine *a);
 	void SetMercury(CMercury8 *m);
+  void SetThreads(int n);
   void SetResultsToMemory(bool b);
   int Size();
+  int SizeScans();
+  hkScanMem& GetScan(const int& index);
 
  protected:
 
@@ -75,6 +88,7 @@ class CHardklor{
   int compareData(const void*, const void*);
   double LinReg(float *match, float *mismatch);
   void ResultToMem(SSObject& obj, CPeriodicTable* PT);
+  void ScanToMem(Spectrum& s);
   void WriteParams(fstream& fptr, int format=1); 
   void WritePepLine(SSObject& obj, CPeriodicTable* PT, fstream& fptr, int format=0); 
   void WriteScanLine(Spectrum& s, fstream& fptr, int format=0); 
@@ -85,7 +99,6 @@ class CHardklor{
 	void DynamicSemiCompleteMethod(float *match, float *mismatch,SSObject* combo, int depth, int maxDepth, int start, double corr);
 	void FewestPeptidesMethod(SSObject *combo, int maxDepth);
 	void FewestPeptidesChoiceMethod(SSObject *combo, int maxDepth);
-	void SemiCompleteMethod(float *match, float *mismatch,SSObject* combo, int depth, int maxDepth, int start);
 	void SemiCompleteFastMethod(float *match, float *mismatch,SSObject* combo, int depth, int maxDepth, int start);
 	void SemiSubtractiveMethod(SSObject *combo, int maxDepth);
 	void FastFewestPeptidesMethod(SSObject *combo, int maxDepth);
@@ -93,6 +106,8 @@ class CHardklor{
 
 	//Analysis algorithm support methods
 	int calcDepth(int start, int max, int depth=1, int count=1);
+	void SearchBranch(SSBranch* branch, int depth, int maxDepth);
+	void SearchBranches(vector<SSBranch>& branches, int depth, int maxDepth);
 
   //Data Members:
 	CSpecAnalyze sa;
@@ -104,6 +119,7 @@ class CHardklor{
 	bool bEcho;
   bool bMem;
   int currentScanNumber;
+  int numThreads; //for the first level of SemiComplete searches
 	fstream fptr; //TODO: Get rid of this and use FILE* instead.
 
 	//Vector for holding peptide list of distribution
@@ -111,6 +127,11 @@ class CHardklor{
 
   //Vector for holding results in memory should that be needed
   vector<hkMem> vResults;
+  vector<hkScanMem> vScans;
+
+  //Observed intensities of the window being analyzed, and their sum of squares
+  vector<float> obsIntensity;
+  double obsSxx;
 
   //Temporary Data Members:
   char bestCh[200];
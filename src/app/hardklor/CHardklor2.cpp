@@ -1,4 +1,8 @@
 #include "CHardklor2.h"
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "util/ThreadPool.h"
 
 CHardklor2::CHardklor2(CAveragine *a, CMercury8 *m, CModelLibrary *lib){
   averagine=a;
@@ -7,6 +11,7 @@ CHardklor2::CHardklor2(CAveragine *a, CMercury8 *m, CModelLibrary *lib){
 	bEcho=true;
   bMem=false;
 	PT=NULL;
+  numThreads=1;
 }
 
 CHardklor2::~CHardklor2(){
@@ -26,11 +31,84 @@ void CHardklor2::Echo(bool b){
 	bEcho=b;
 }
 
+//Analyzes spectra thread, thread+numThreads, ... of a batch, keeping the
+//centroided spectra for the output.
+void CHardklor2::AnalyzeSpectra(vector<Spectrum>* spectra, vector<Spectrum>* centroided, vector< vector<pepHit> >* peps, int thread, int nThreads){
+  for(size_t i=thread;i<spectra->size();i+=nThreads){
+    Spectrum& spec=spectra->at(i);
+    Spectrum& c=centroided->at(i);
+
+		//Smooth if requested
+		if(cs.smooth>0) SG_Smooth(spec,cs.smooth,4);
+
+		//Centroid if needed; notice that this copy wastes a bit of time.
+		//TODO: make this more efficient
+		if(cs.boxcar==0 && !cs.centroid) Centroid(spec,c);
+		else c=spec;
+
+		//There is a bug when using noise reduction that results in out of order m/z values
+		//TODO: fix noise reduction so sorting isn't needed
+		if(c.size()>0) c.sortMZ();
+
+		QuickHardklor(c,peps->at(i));
+  }
+}
+
+//Reads the spectra of the next batch, noise reducing them if requested;
+//curSpec holds the first spectrum of the batch, and is left holding the
+//first spectrum of the batch after. Sets lastBatch if no batch follows.
+void CHardklor2::ReadBatch(MSReader* r, CNoiseReduction* nr, Spectrum* curSpec, Spectrum* s, size_t batchSize, vector<Spectrum>* batch, bool* lastBatch){
+	getExactTime(readStartTime);
+  batch->clear();
+  while(true){
+    batch->push_back(*curSpec);
+    if(s!=NULL) {
+      *lastBatch=true;
+      break;
+    }
+
+	  //Check if any user limits were made and met
+	  if( (cs.scan.iUpper == cs.scan.iLower) && (cs.scan.iLower != 0) ){
+		  *lastBatch=true;
+		  break;
+	  } else if( (cs.scan.iLower < cs.scan.iUpper) && (curSpec->getScanNumber() >= cs.scan.iUpper) ){
+		  *lastBatch=true;
+		  break;
+	  }
+
+	  //Read next spectrum from file.
+	  if(cs.boxcar==0) {
+		  r->readFile(NULL,*curSpec);
+	  } else {
+		  if(cs.boxcarFilter==0){
+			  //possible to not filter?
+        nr->DeNoiseD(*curSpec);
+		  } else {
+		  //case 5: nr.DeNoise(curSpec); break; //this is for filtering without boxcar
+			  nr->DeNoiseC(*curSpec);
+		  }
+	  }
+    if(curSpec->getScanNumber()==0) {
+      *lastBatch=true;
+      break;
+    }
+    if(batch->size()>=batchSize) break;
+  }
+	getExactTime(readStopTime);
+	readTime1=toMicroSec(readStopTime);
+	readTime2=toMicroSec(readStartTime);
+	loadTime+=(readTime1-readTime2);
+}
+
+void CHardklor2::SetThreads(int n){
+  numThreads = n<1 ? 1 : n;
+}
+
 int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 	
 	//Member variables
 	MSReader r;
-	Spectrum curSpec,c;
+	Spectrum curSpec;
 	vector<int> v;
 	FILE* fout;
 	int TotalScans;
@@ -38,7 +116,6 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 	int iPercent;
 	int minutes, seconds;
 	int i;
-	vector<pepHit> vPeps;
 
 	//initialize variables
 	cs=sett;
@@ -52,6 +129,7 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 	getTimerFrequency(timerFrequency);
 
   vResults.clear();
+  vScans.clear();
 
 	//For noise reduction
 	CNoiseReduction nr(&r,cs);
@@ -115,49 +193,99 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
     return -2;
   }
 
-	//Write scan information to output file.
-  if(!bMem){
-    if(cs.reducedOutput) WriteScanLine(curSpec,fout,2);
-    else if(cs.xml) WriteScanLine(curSpec,fout,1);
-    else WriteScanLine(curSpec,fout,0);
-  } else {
-    currentScanNumber = curSpec.getScanNumber();
-  }
-
 	//Output progress indicator
 	if(bEcho) cout << iPercent;
+
+  //Spectra are read in batches on this thread, analyzed on numThreads
+  //threads, each with its own copy of the analysis state, and written
+  //in the order they were read.
+  vector<CHardklor2*> workers;
+  workers.push_back(this);
+  for(i=1;i<numThreads;i++){
+    CHardklor2* worker = new CHardklor2(averagine,mercury,models);
+    worker->cs=cs;
+    worker->PT=PT;
+    workers.push_back(worker);
+  }
+  const size_t batchSize = 8*numThreads;
+  vector<Spectrum> batch;
+  vector<Spectrum> nextBatch;
+  vector<Spectrum> centroided;
+  vector< vector<pepHit> > batchPeps;
+  bool firstScan=true;
+  bool lastBatch=false;
+  bool lastRead=false;
+  boost::thread* reader;
+
+  //Read the first batch; curSpec already holds its first spectrum
+  ReadBatch(&r,&nr,&curSpec,s,batchSize,&batch,&lastRead);
   
   //While there is still data to read in the file.
-  while(true){
-
-		getExactTime(startTime);
-		TotalScans++;
-		
-		//Smooth if requested
-		if(cs.smooth>0) SG_Smooth(curSpec,cs.smooth,4);
-
-		//Centroid if needed; notice that this copy wastes a bit of time.
-		//TODO: make this more efficient
-		if(cs.boxcar==0 && !cs.centroid) Centroid(curSpec,c);
-		else c=curSpec;
-
-		//There is a bug when using noise reduction that results in out of order m/z values
-		//TODO: fix noise reduction so sorting isn't needed
-		if(c.size()>0) c.sortMZ();
+  while(!lastBatch){
+    lastBatch=lastRead;
+
+    //With several threads, the next batch is read and noise reduced while
+    //this one is analyzed
+    reader=NULL;
+    if(!lastBatch && numThreads>1){
+      reader=new boost::thread(boost::bind(&CHardklor2::ReadBatch,this,&r,&nr,&curSpec,s,
+                                           batchSize,&nextBatch,&lastRead));
+    }
 
 		//Analyze
-		QuickHardklor(c,vPeps);
+		getExactTime(startTime);
+    centroided.resize(batch.size());
+    batchPeps.resize(batch.size());
+    if(numThreads==1 || batch.size()==1){
+      AnalyzeSpectra(&batch,&centroided,&batchPeps,0,1);
+    } else {
+      ThreadPool::TaskGroup threads;
+      for(i=0;i<numThreads;i++){
+        threads.Run(boost::bind(&CHardklor2::AnalyzeSpectra,workers[i],
+                                          &batch,&centroided,&batchPeps,i,numThreads));
+      }
+      threads.Wait();
+    }
 
 		//export results
-		for(i=0;i<(int)vPeps.size();i++){
+    for(size_t j=0;j<batch.size();j++){
+      TotalScans++;
+
+			//Write scan information to output file.
       if(!bMem){
-			  if(cs.reducedOutput) WritePepLine(vPeps[i],c,fout,2);
-			  else if(cs.xml) WritePepLine(vPeps[i],c,fout,1);
-			  else WritePepLine(vPeps[i],c,fout,0);
+        if(cs.reducedOutput) {
+          WriteScanLine(batch[j],fout,2);
+        } else if(cs.xml) {
+          if(!firstScan) fprintf(fout,"</Spectrum>\n");
+          WriteScanLine(batch[j],fout,1);
+        } else {
+          WriteScanLine(batch[j],fout,0);
+        }
       } else {
-        ResultToMem(vPeps[i],c);
+        currentScanNumber = batch[j].getScanNumber();
+        ScanToMem(batch[j]);
       }
-		}
+      firstScan=false;
+
+		  for(i=0;i<(int)batchPeps[j].size();i++){
+        if(!bMem){
+			    if(cs.reducedOutput) WritePepLine(batchPeps[j][i],centroided[j],fout,2);
+			    else if(cs.xml) WritePepLine(batchPeps[j][i],centroided[j],fout,1);
+			    else WritePepLine(batchPeps[j][i],centroided[j],fout,0);
+        } else {
+          ResultToMem(batchPeps[j][i],centroided[j]);
+        }
+		  }
+    }
+
+    //Wait for (or read) the next batch
+    if(reader!=NULL){
+      reader->join();
+      delete reader;
+    } else if(!lastBatch){
+      ReadBatch(&r,&nr,&curSpec,s,batchSize,&nextBatch,&lastRead);
+    }
+    batch.swap(nextBatch);
 
 		//Update progress
 		if(bEcho){
@@ -175,50 +303,10 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
     tmpTime1=toMicroSec(stopTime);
     tmpTime2=toMicroSec(startTime);
     analysisTime+=tmpTime1-tmpTime2;
-    
-    if(s!=NULL) break;
-
-		//Check if any user limits were made and met
-		if( (cs.scan.iUpper == cs.scan.iLower) && (cs.scan.iLower != 0) ){
-			break;
-		} else if( (cs.scan.iLower < cs.scan.iUpper) && (curSpec.getScanNumber() >= cs.scan.iUpper) ){
-			break;
-		}
-
-		//Read next spectrum from file.
-		getExactTime(startTime);
-		if(cs.boxcar==0) {
-			r.readFile(NULL,curSpec);
-		} else {
-			if(cs.boxcarFilter==0){
-				//possible to not filter?
-        nr.DeNoiseD(curSpec);
-			} else {
-			//case 5: nr.DeNoise(curSpec); break; //this is for filtering without boxcar
-				nr.DeNoiseC(curSpec);
-			}
-		}
-
-		getExactTime(stopTime);
-		tmpTime1=toMicroSec(stopTime);
-		tmpTime2=toMicroSec(startTime);
-		loadTime+=(tmpTime1-tmpTime2);
-
-		if(curSpec.getScanNumber()!=0){
-			//Write scan information to output file.
-			if(cs.reducedOutput){
-				WriteScanLine(curSpec,fout,2);
-			} else if(cs.xml) {
-				fprintf(fout,"</Spectrum>\n");
-				WriteScanLine(curSpec,fout,1);
-			} else {
-				WriteScanLine(curSpec,fout,0);
-			}
-		} else {
-			break;
-		}
 	}
 
+  for(i=1;i<(int)workers.size();i++) delete workers[i];
+
 	if(!bMem) fclose(fout);
 
 	if(bEcho) {
@@ -256,29 +344,18 @@ int CHardklor2::GoHardklor(CHardklorSetting sett, Spectrum* s){
 
 }
 
-int CHardklor2::BinarySearch(Spectrum& s, double mz, bool floor){
-
-	int mid=s.size()/2;
-	int upper=s.size();
-	int lower=0;
+//Searches peakMZ, the spectrum being deconvolved. With floor, returns the last
+//peak at or below mz, otherwise the first peak at or above it, clamped to the
+//spectrum.
+int CHardklor2::BinarySearch(double mz, bool floor){
 
-	if(mz>=s[s.size()-1].mz) return s.size()-1;
-	if(mz<=s[0].mz) return 0;
-
-	while(s[mid].mz!=mz){
-		if(lower>=upper) break;
-		if(s[mid].mz>mz){
-			upper=mid-1;
-			mid=(lower+upper)/2;
-		} else {
-			lower=mid+1;
-			mid=(lower+upper)/2;
-		}
+	int i;
+	if(floor) {
+		i=(int)(upper_bound(peakMZ.begin(),peakMZ.end(),mz)-peakMZ.begin())-1;
+		return i<0 ? 0 : i;
 	}
-
-	if(floor && s[mid].mz>mz && mid>0) return mid-1;
-	else if(!floor && s[mid].mz<mz && mid<s.size()) return mid+1;
-	else return mid;
+	i=(int)(lower_bound(peakMZ.begin(),peakMZ.end(),mz)-peakMZ.begin());
+	return i>=(int)peakMZ.size() ? (int)peakMZ.size()-1 : i;
 
 }
 
@@ -303,129 +380,75 @@ double CHardklor2::CalcFWHM(double mz,double res,int iType){
 	return deltaM;
 }
 
-//First derivative method, returns base peak intensity of the set
+//First derivative method, returns base peak intensity of the set. Each
+//local maximum of the profile is fit in the same pass that finds it.
 void CHardklor2::Centroid(Spectrum& s, Spectrum& out){
-  int i,j;
-  float maxIntensity;
-  int bestPeak;
+  int i;
+  int sz=s.size();
   bool bLastPos;
-
-	int nextBest;
 	double FWHM;
+	double dif;
 	Peak_T centroid;
 
 	out.clear();
 
   bLastPos=false;
-	for(i=0;i<s.size()-1;i++){
+	for(i=0;i<sz-1;i++){
 
+    //Rising edge
     if(s[i].intensity<s[i+1].intensity) {
       bLastPos=true;
       continue;
-    } else {
-      if(bLastPos){
-				bLastPos=false;
-
-				//find max and add peak
-				maxIntensity=0;
-				for(j=i;j<i+1;j++){
-				  if (s[j].intensity>maxIntensity){
-				    maxIntensity=s[j].intensity;
-				    bestPeak = j;
-				  }
-				}
-
-				//Best estimate of Gaussian centroid
-				//Get 2nd highest point of peak
-				if(bestPeak==s.size()){
-					nextBest=bestPeak-1;
-				} else if(s[bestPeak-1].intensity > s[bestPeak+1].intensity){
-					nextBest=bestPeak-1;
-				} else {
-					nextBest=bestPeak+1;
-				}
-
-				//Get FWHM
-				FWHM = CalcFWHM(s[bestPeak].mz,cs.res400,cs.msType);
-
-				//Calc centroid MZ (in three lines for easy reading)
-				centroid.mz = (FWHM*FWHM*log(s[bestPeak].intensity/s[nextBest].intensity));
-				centroid.mz /= (GAUSSCONST*(s[bestPeak].mz-s[nextBest].mz));
-				centroid.mz += ((s[bestPeak].mz+s[nextBest].mz)/2);
-
-				//Calc centroid intensity
-				centroid.intensity=(float)(s[bestPeak].intensity/exp(-pow((s[bestPeak].mz-centroid.mz)/FWHM,2)*GAUSSCONST));
-
-				//some peaks are funny shaped and have bad gaussian fit.
-				//if error is more than 10%, keep existing intensity
-				if( fabs((s[bestPeak].intensity - centroid.intensity) / centroid.intensity * 100) > 10 ||
-            //not a good check for infinity
-            centroid.intensity>999999999999.9 ||
-            centroid.intensity < 0 ) {
-					centroid.intensity=s[bestPeak].intensity;
-				}
-				
-				//Hack until I put in mass ranges
-				if(centroid.mz<0 || centroid.mz>2000) {
-					//do nothing if invalid mz
-				} else {
-					out.add(centroid);
-				}
-			
-      }
-
     }
+    if(!bLastPos) continue;
+		bLastPos=false;
+
+		//s[i] is the top of a peak; get 2nd highest point of peak
+		Peak_T& best=s[i];
+		Peak_T& nextBest = (s[i-1].intensity > s[i+1].intensity) ? s[i-1] : s[i+1];
+
+		//Get FWHM
+		FWHM = CalcFWHM(best.mz,cs.res400,cs.msType);
+
+		//Calc centroid MZ (in three lines for easy reading)
+		centroid.mz = (FWHM*FWHM*log(best.intensity/nextBest.intensity));
+		centroid.mz /= (GAUSSCONST*(best.mz-nextBest.mz));
+		centroid.mz += ((best.mz+nextBest.mz)/2);
+
+		//Calc centroid intensity
+		dif=(best.mz-centroid.mz)/FWHM;
+		centroid.intensity=(float)(best.intensity/exp(-(dif*dif)*GAUSSCONST));
+
+		//some peaks are funny shaped and have bad gaussian fit.
+		//if error is more than 10%, keep existing intensity
+		if( fabs((best.intensity - centroid.intensity) / centroid.intensity * 100) > 10 ||
+        //not a good check for infinity
+        centroid.intensity>999999999999.9 ||
+        centroid.intensity < 0 ) {
+			centroid.intensity=best.intensity;
+		}
+				
+		//Hack until I put in mass ranges
+		if(centroid.mz<0 || centroid.mz>2000) {
+			//do nothing if invalid mz
+		} else {
+			out.add(centroid);
+		}
   }
 
 }
 
 //returns whether or not the peak is still valid. true if peak still exists, false if peak was solved already.
-bool CHardklor2::CheckForPeak(vector<Result>& vMR, Spectrum& s, int index){
-	double dif=100.0;
-	double massDif;
-	bool match=false;
-
-	int mid=s.size()/2;
-	int upper=s.size();
-	int lower=0;
+bool CHardklor2::CheckForPeak(vector<Result>& vMR, int index){
 
 	double FWHM=CalcFWHM(vMR[index].mass,cs.res400,cs.msType);
 
-	if(vMR[index].mass>=s[s.size()-1].mz) {
-		mid=s.size()-1;
-	} else if(vMR[index].mass<=s[0].mz) {
-		mid=0;
-	} else {
+	//nearest peak to the expected mass
+	int mid=(int)(lower_bound(peakMZ.begin(),peakMZ.end(),vMR[index].mass)-peakMZ.begin());
+	if(mid==(int)peakMZ.size()) mid--;
+	if(mid>0 && fabs(peakMZ[mid-1]-vMR[index].mass)<fabs(peakMZ[mid]-vMR[index].mass)) mid--;
 
-		while(s[mid].mz!=vMR[index].mass){
-			if(lower>=upper) break;
-			if(s[mid].mz>vMR[index].mass){
-				upper=mid-1;
-				mid=(lower+upper)/2;
-			} else {
-				lower=mid+1;
-				mid=(lower+upper)/2;
-			}
-		}
-	}
-
-	dif=fabs(s[mid].mz-vMR[index].mass);
-	if(mid>0){
-		massDif=fabs(s[mid-1].mz-vMR[index].mass);
-		if(massDif<dif) {
-			dif=massDif;
-			mid--;
-		}
-	} 
-	if(mid<s.size()-1){
-		massDif=fabs(s[mid+1].mz-vMR[index].mass);
-		if(massDif<dif) {
-			dif=massDif;
-			mid++;
-		}
-	}
-
-	if(dif<FWHM){
+	if(fabs(peakMZ[mid]-vMR[index].mass)<FWHM){
 		if(mask[mid].intensity>1.0) return false;
 		else return true;
 	}
@@ -441,25 +464,31 @@ int CHardklor2::CompareBPI(const void *p1, const void *p2){
   else return 0;
 }
 
-double CHardklor2::LinReg(vector<float>& mer, vector<float>& obs){
+//Cosine angle correlation of mer and obs. The prefix sums of its terms are
+//kept so that the correlation of any leading part can be had from
+//LinRegPrefix.
+double CHardklor2::LinRegSums(vector<float>& mer, vector<float>& obs){
 
   int i,sz;
-  double sxx=0,syy=0,sxy=0;
 
-  //Cosine angle correlation
-  sxy=0;
-  sxx=0;
-  syy=0;
 	sz=(int)mer.size();
+	sumXY.resize(sz+1);
+	sumXX.resize(sz+1);
+	sumYY.resize(sz+1);
+	sumXY[0]=sumXX[0]=sumYY[0]=0;
   for(i=0;i<sz;i++){
-    sxy += (mer[i]*obs[i]);
-    sxx += (mer[i]*mer[i]);
-    syy += (obs[i]*obs[i]);
+    sumXY[i+1] = sumXY[i] + (mer[i]*obs[i]);
+    sumXX[i+1] = sumXX[i] + (mer[i]*mer[i]);
+    sumYY[i+1] = sumYY[i] + (obs[i]*obs[i]);
   }
+	return LinRegPrefix(sz);
+
+}
 
-  if(sxx>0 && syy>0 && sxy>0) return sxy/sqrt(sxx*syy);
+//Correlation of the first n terms given to LinRegSums
+double CHardklor2::LinRegPrefix(int n){
+  if(sumXX[n]>0 && sumYY[n]>0 && sumXY[n]>0) return sumXY[n]/sqrt(sumXX[n]*sumYY[n]);
   else return 0;
-    
 }
 
 bool CHardklor2::MatchSubSpectrum(Spectrum& s, int peakIndex, pepHit& pep){
@@ -471,11 +500,9 @@ bool CHardklor2::MatchSubSpectrum(Spectrum& s, int peakIndex, pepHit& pep){
 	int maxMercuryIndex[3];
 	vector<int> charges;
 	double dif;
-	vector<float> obs;
-	vector<float> mer;
-	vector<int> vMatchIndex;
-	vector<float> vMatchPeak;
-	vector<Result> vMR;
+	vector<int>& vMatchIndex=subMatchIndex;
+	vector<float>& vMatchPeak=subMatchPeak;
+	vector<Result>& vMR=subMR;
 	Result r;
 	double corr;
 	double da;
@@ -485,8 +512,8 @@ bool CHardklor2::MatchSubSpectrum(Spectrum& s, int peakIndex, pepHit& pep){
 	double bestDA;
 	int bestCharge;
 	double bestMass;
-	vector<int> bestMatchIndex;
-	vector<float> bestMatchPeak;
+	vector<int>& bestMatchIndex=subBestMatchIndex;
+	vector<float>& bestMatchPeak=subBestMatchPeak;
 	int matchCount;
 	int bestMatchCount;
 	int thisMaxIndex=0;
@@ -499,6 +526,8 @@ bool CHardklor2::MatchSubSpectrum(Spectrum& s, int peakIndex, pepHit& pep){
 
 	bestCorr=0.0;
 	bestMatchCount=0;
+	bestMatchIndex.clear();
+	bestMatchPeak.clear();
 
 	//Mark number of variants to analyze
 	if(cs.noBase) varCount=cs.variant->size();
@@ -559,8 +588,8 @@ bool CHardklor2::MatchSubSpectrum(Spectrum& s, int peakIndex, pepHit& pep){
 				//cout << "\tMSS: " << s[peakIndex].mz << " " << s[peakIndex].intensity << "\t" << charges[i] << "\t" << matchCount << "\t" << corr << endl;
 
 				if(corr>bestCorr || (corr>cs.corr && corr+0.025*(matchCount-bestMatchCount)>bestCorr) ){
-					bestMatchIndex=vMatchIndex;
-					bestMatchPeak=vMatchPeak;
+					bestMatchIndex.swap(vMatchIndex);
+					bestMatchPeak.swap(vMatchPeak);
 					bestMatchCount=matchCount;
 					bestCorr=corr;
 					bestMass=model->zeroMass+shft*charges[i];
@@ -611,8 +640,10 @@ double CHardklor2::PeakMatcher(vector<Result>& vMR, Spectrum& s, double lower, d
 	vMatchIndex.clear();
 	vMatchIntensity.clear();
 
-	vector<float> obs;
-	vector<float> mer;
+	vector<float>& obs=matchObs;
+	vector<float>& mer=matchMer;
+	obs.clear();
+	mer.clear();
 				
 	bool match;
 	bool bMax=false;
@@ -683,7 +714,7 @@ double CHardklor2::PeakMatcher(vector<Result>& vMR, Spectrum& s, double lower, d
 	}
 
 	if(matchCount<2) corr=0.0;
-	else corr=LinReg(mer,obs);
+	else corr=LinRegSums(mer,obs);
 
 	//for(j=0;j<mer.size();j++){
   //  cout << "M:" << mer[j] << "\t" << "O:" << obs[j] << endl;
@@ -696,7 +727,7 @@ double CHardklor2::PeakMatcher(vector<Result>& vMR, Spectrum& s, double lower, d
 		mer.pop_back();
 		obs.pop_back();
 		matchCount--;
-		double corr2=LinReg(mer,obs);
+		double corr2=LinRegPrefix((int)mer.size());
 		//cout << "Old corr: " << corr << "(" << matchCount+1 << ")" << " New corr: " << corr2 << endl;
 		if(corr2>corr) {
 			corr=corr2;
@@ -713,8 +744,10 @@ double CHardklor2::PeakMatcherB(vector<Result>& vMR, Spectrum& s, double lower,
 	vMatchIndex.clear();
 	vMatchIntensity.clear();
 
-	vector<float> obs;
-	vector<float> mer;
+	vector<float>& obs=matchObs;
+	vector<float>& mer=matchMer;
+	obs.clear();
+	mer.clear();
 				
 	bool match;
 	bool bMax=false;
@@ -774,14 +807,14 @@ double CHardklor2::PeakMatcherB(vector<Result>& vMR, Spectrum& s, double lower,
 	}
 
 	if(matchCount<2) corr=0.0;
-	else corr=LinReg(mer,obs);
+	else corr=LinRegSums(mer,obs);
 
 	int tmpCount=matchCount;
 	while(corr<0.90 && matchCount>2){
 		mer.pop_back();
 		obs.pop_back();
 		matchCount--;
-		double corr2=LinReg(mer,obs);
+		double corr2=LinRegPrefix((int)mer.size());
 		if(corr2>corr) {
 			corr=corr2;
 			tmpCount=matchCount;
@@ -927,7 +960,11 @@ void CHardklor2::QuickHardklor(Spectrum& s, vector<pepHit>& vPeps) {
 
 	//create mask
 	mask.clear();
-	for(i=0;i<s.size();i++) mask.add(s[i].mz,0);
+	peakMZ.resize(s.size());
+	for(i=0;i<s.size();i++) {
+		mask.add(s[i].mz,0);
+		peakMZ[i]=s[i].mz;
+	}
 
 	//find lowest intensity;
 	for(i=0;i<s.size();i++){
@@ -1051,11 +1088,11 @@ void CHardklor2::QuickHardklor(Spectrum& s, vector<pepHit>& vPeps) {
 					upper+=0.1;
 
 					//Narrow the search to just the area of the spectrum we need
-					lowIndex=BinarySearch(s,lower,true);
-					highIndex=BinarySearch(s,upper,false);
+					lowIndex=BinarySearch(lower,true);
+					highIndex=BinarySearch(upper,false);
 
 					//if max peak shifts to already solved peak, skip
-					if(!CheckForPeak(vMR,s,thisMaxIndex)){
+					if(!CheckForPeak(vMR,thisMaxIndex)){
 						n++;
 						continue;
 					}
@@ -1125,8 +1162,8 @@ void CHardklor2::QuickHardklor(Spectrum& s, vector<pepHit>& vPeps) {
 							if(corr3>corr) {
 
 								corr=corr3;
-								vMatchIndex=vMatchIndex2;
-								vMatchPeak=vMatchPeak2;
+								vMatchIndex.swap(vMatchIndex2);
+								vMatchPeak.swap(vMatchPeak2);
 								matchCount=matchCount2;
 
 								//refine the overlapping one.
@@ -1147,8 +1184,8 @@ void CHardklor2::QuickHardklor(Spectrum& s, vector<pepHit>& vPeps) {
           else tCorr=0.025*(matchCount-bestMatchCount)/bestMatchCount;
 					//cout << "Old best corr: " << bestCorr << "(" << bestMatchCount << ") This corr: " << corr << "," << corr+tCorr << "(" << matchCount << ")" << endl;
 					if(/*corr>bestCorr ||*/ (corr>cs.corr && corr+tCorr>bestCorr) ){
-						bestMatchIndex=vMatchIndex;
-						bestMatchPeak=vMatchPeak;
+						bestMatchIndex.swap(vMatchIndex);
+						bestMatchPeak.swap(vMatchPeak);
 						bestMatchCount=matchCount;
 						bestCorr=corr;
 						bestMass=model->zeroMass+shft*charges[i];
@@ -1362,6 +1399,23 @@ int CHardklor2::Size(){
   return vResults.size();
 }
 
+int CHardklor2::SizeScans(){
+  return vScans.size();
+}
+
+hkScanMem& CHardklor2::GetScan(const int& index){
+  return vScans[index];
+}
+
+//Records a scan analyzed in memory; its results follow in vResults
+void CHardklor2::ScanToMem(Spectrum& s){
+  hkScanMem m;
+  m.scan=s.getScanNumber();
+  m.rTime=s.getRTime();
+  m.firstResult=vResults.size();
+  vScans.push_back(m);
+}
+
 void CHardklor2::WritePepLine(pepHit& ph, Spectrum& s, FILE* fptr, int format){
   int i,j;
 
@@ -39,24 +39,31 @@ class CHardklor2{
   int   GoHardklor(CHardklorSetting sett, Spectrum* s=NULL);
   void    QuickCharge(Spectrum& s, int index, vector<int>& v);
   void  SetResultsToMemory(bool b);
+  void  SetThreads(int n);
   int   Size();
+  int   SizeScans();
+  hkScanMem& GetScan(const int& index);
 
  protected:
 
  private:
   //Methods:
-  int     BinarySearch(Spectrum& s, double mz, bool floor);
+  void    AnalyzeSpectra(vector<Spectrum>* spectra, vector<Spectrum>* centroided, vector< vector<pepHit> >* peps, int thread, int nThreads);
+  int     BinarySearch(double mz, bool floor);
   double  CalcFWHM(double mz,double res,int iType);
   void    Centroid(Spectrum& s, Spectrum& out);
-  bool    CheckForPeak(vector<Result>& vMR, Spectrum& s, int index);
+  bool    CheckForPeak(vector<Result>& vMR, int index);
   int     CompareData(const void*, const void*);
-  double  LinReg(vector<float>& mer, vector<float>& obs);
+  double  LinRegSums(vector<float>& mer, vector<float>& obs);
+  double  LinRegPrefix(int n);
   bool    MatchSubSpectrum(Spectrum& s, int peakIndex, pepHit& pep);
   double  PeakMatcher(vector<Result>& vMR, Spectrum& s, double lower, double upper, double deltaM, int matchIndex, int& matchCount, int& indexOverlap, vector<int>& vMatchIndex, vector<float>& vMatchIntensity);
   double  PeakMatcherB(vector<Result>& vMR, Spectrum& s, double lower, double upper, double deltaM, int matchIndex, int& matchCount, vector<int>& vMatchIndex, vector<float>& vMatchIntensity);
   void    QuickHardklor(Spectrum& s, vector<pepHit>& vPeps);
+  void    ReadBatch(MSReader* r, CNoiseReduction* nr, Spectrum* curSpec, Spectrum* s, size_t batchSize, vector<Spectrum>* batch, bool* lastBatch);
   void    RefineHits(vector<pepHit>& vPeps, Spectrum& s);
   void    ResultToMem(pepHit& ph, Spectrum& s);
+  void    ScanToMem(Spectrum& s);
   void    WritePepLine(pepHit& ph, Spectrum& s, FILE* fptr, int format=0); 
   void    WriteScanLine(Spectrum& s, FILE* fptr, int format=0); 
 
@@ -69,13 +76,28 @@ class CHardklor2{
   CModelLibrary*    models;
   CPeriodicTable*   PT;
   Spectrum          mask;
+  vector<double>    peakMZ;           //m/z of the spectrum being deconvolved, for searching
+
+  //Scratch space reused by the peak matchers
+  vector<float>     matchMer;
+  vector<float>     matchObs;
+  vector<double>    sumXY;            //prefix sums of the correlation terms
+  vector<double>    sumXX;
+  vector<double>    sumYY;
+  vector<Result>    subMR;
+  vector<int>       subMatchIndex;
+  vector<float>     subMatchPeak;
+  vector<int>       subBestMatchIndex;
+  vector<float>     subBestMatchPeak;
   hkMem             hkm;
   bool              bEcho;
   bool              bMem;
   int               currentScanNumber;
+  int               numThreads;       //spectra analyzed at once
 
   //Vector for holding results in memory should that be needed
   vector<hkMem> vResults;
+  vector<hkScanMem> vScans;
 
   //Temporary Data Members:
   char bestCh[200];
@@ -95,6 +117,10 @@ class CHardklor2{
     __int64 timerFrequency;
     __int64 tmpTime1;
     __int64 tmpTime2;
+    __int64 readStartTime;            //timing of the batch reader thread
+    __int64 readStopTime;
+    __int64 readTime1;
+    __int64 readTime2;
     #define getExactTime(a) QueryPerformanceCounter((LARGE_INTEGER*)&a)
     #define getTimerFrequency(a) QueryPerformanceFrequency((LARGE_INTEGER*)&a)
     #define toMicroSec(a) (a)
@@ -107,6 +133,10 @@ class CHardklor2{
     uint64_t analysisTime;
     uint64_t tmpTime1;
     uint64_t tmpTime2;
+    timeval readStartTime;            //timing of the batch reader thread
+    timeval readStopTime;
+    uint64_t readTime1;
+    uint64_t readTime2;
     int timerFrequency;
     #define getExactTime(a) gettimeofday(&a,NULL)
     #define toMicroSec(a) a.tv_sec*1000000+a.tv_usec
@@ -46,6 +46,7 @@ using namespace std;
 
 CMercury8::CMercury8(){
   InitializeData();
+  for (int Z=0; Z<=MAXAtomNo; Z++) Transform[Z].MassRange = 0;
   showOutput = false;
   bAccMass = false;
   bRelAbun = true;
@@ -54,6 +55,7 @@ CMercury8::CMercury8(){
 
 CMercury8::CMercury8(char* fn){
   InitializeData(fn);
+  for (int Z=0; Z<=MAXAtomNo; Z++) Transform[Z].MassRange = 0;
   showOutput = false;
   bAccMass = false;
   bRelAbun = true;
@@ -112,6 +114,7 @@ void CMercury8::Enrich(int c,int e,double d){
   }
 
   EnrichAtoms.push_back(c);
+  Transform[c].MassRange = 0;
 
 }
   
@@ -392,81 +395,81 @@ int CMercury8::ParseMF(char MF[], int *elementcount) {
 /*************************************************/
 void CMercury8::CalcFreq(complex* FreqData, int Ecount, int NumPoints, int MassRange, int MassShift) {
   
-  int    i, j, k, Z;
-  double real, imag, freq, X, theta, r, tempr;
-  double a, b, c, d;
- 
-  /* Calculate first half of Frequency Domain (+)masses */
-  for (i=0; i<NumPoints/2; i++) {
-    
+  int    i, j, Z, half;
+  double freq, r, theta, n;
+  vector<double> LogR, Theta;
+
+  /* Each atom multiplies the transform by that of its element, so the  */
+  /* log magnitudes and phases of the cached element transforms are    */
+  /* summed, weighted by atom counts. Only the (+)masses are computed;  */
+  /* the (-)masses are their conjugates.                                */
+  half = NumPoints/2;
+  LogR.assign(half+1,0.0);
+  Theta.assign(half+1,0.0);
+  for (j=0; j<Ecount; j++) {
+    Z = AtomicNum[j];
+    if (Element[Z].NumAtoms == 0) continue;
+    ElementTransform& t = GetTransform(Z,MassRange);
+    n = Element[Z].NumAtoms;
+    for (i=0; i<=half; i++) {
+      LogR[i] += n * t.LogR[i];
+      Theta[i] += n * t.Theta[i];
+    }
+  }
+
+  /* Convert back to real:imag coordinates, shifted by MassShift, and store */
+  for (i=0; i<=half; i++) {
     freq = (double)i/MassRange;
-    r = 1;
-    theta = 0;
-    for (j=0; j<Ecount; j++) {
-      Z = AtomicNum[j];
-      real = imag = 0;
-      for (k=0; k<Element[Z].NumIsotopes; k++) {
-				X = TWOPI * Element[Z].IntMass[k] * freq;
-				real += Element[Z].IsoProb[k] * cos(X);
-				imag += Element[Z].IsoProb[k] * sin(X);
-      }
-      
-      /* Convert to polar coordinates, r then theta */
-      tempr = sqrt(real*real+imag*imag);
-      r *= pow(tempr,Element[Z].NumAtoms);
-      if (real > 0) theta += Element[Z].NumAtoms * atan(imag/real);
-      else if (real < 0) theta += Element[Z].NumAtoms * (atan(imag/real) + PI);
-      else if (imag > 0) theta += Element[Z].NumAtoms * HALFPI;
-      else theta += Element[Z].NumAtoms * -HALFPI;
-      
-    }  /* end for(j) */
-    
-    /* Convert back to real:imag coordinates and store */
-    a = r * cos(theta);
-    b = r * sin(theta);
-    c = cos(TWOPI*MassShift*freq);
-    d = sin(TWOPI*MassShift*freq);
-    FreqData[i].real = a*c - b*d;
-    FreqData[i].imag = b*c + a*d;
-    
-  }  /* end for(i) */
-  
-  /* Calculate second half of Frequency Domain (-)masses */
-  for (i=NumPoints/2; i<NumPoints; i++) {
-    
-    freq = (double)(i-NumPoints)/MassRange;
-    r = 1;
-    theta = 0;
-    for (j=0; j<Ecount; j++) {
-      Z = AtomicNum[j];
-      real = imag = 0;
-      for (k=0; k<Element[Z].NumIsotopes; k++) {
-				X = TWOPI * Element[Z].IntMass[k] * freq;
-				real += Element[Z].IsoProb[k] * cos(X);
-				imag += Element[Z].IsoProb[k] * sin(X);
-      }
-      
-      /* Convert to polar coordinates, r then theta */
-      tempr = sqrt(real*real+imag*imag);
-      r *= pow(tempr,Element[Z].NumAtoms);
-      if (real > 0) theta += Element[Z].NumAtoms * atan(imag/real);
-      else if (real < 0) theta += Element[Z].NumAtoms * (atan(imag/real) + PI);
-      else if (imag > 0) theta += Element[Z].NumAtoms * HALFPI;
-      else theta += Element[Z].NumAtoms * -HALFPI;
-      
-    }  /* end for(j) */
-    
-    /* Convert back to real:imag coordinates and store */
-    a = r * cos(theta);
-    b = r * sin(theta);
-    c = cos(TWOPI*MassShift*freq);
-    d = sin(TWOPI*MassShift*freq);
-    FreqData[i].real = a*c - b*d;
-    FreqData[i].imag = b*c + a*d;
-    
-  }  /* end of for(i) */
+    r = exp(LogR[i]);
+    theta = Theta[i] + TWOPI*MassShift*freq;
+    FreqData[i].real = r * cos(theta);
+    FreqData[i].imag = r * sin(theta);
+  }
+  for (i=half+1; i<NumPoints; i++) {
+    FreqData[i].real = FreqData[NumPoints-i].real;
+    FreqData[i].imag = -FreqData[NumPoints-i].imag;
+  }
   
 }  /* End of CalcFreq() */
+
+/*************************************************/
+/* FUNCTION GetTransform - called by CalcFreq()  */
+/*************************************************/
+/* Returns the transform of one atom of element Z at the (+)masses of   */
+/* MassRange, computing it if it is not cached. Enrich() and Reset()    */
+/* drop the transforms of the elements whose abundances they change.    */
+ElementTransform& CMercury8::GetTransform(int Z, int MassRange) {
+
+  int    i, k, half;
+  double real, imag, freq, X;
+  ElementTransform& t = Transform[Z];
+
+  if (t.MassRange == MassRange) return t;
+
+  half = MassRange/2;
+  t.LogR.resize(half+1);
+  t.Theta.resize(half+1);
+  for (i=0; i<=half; i++) {
+    freq = (double)i/MassRange;
+    real = imag = 0;
+    for (k=0; k<Element[Z].NumIsotopes; k++) {
+      X = TWOPI * Element[Z].IntMass[k] * freq;
+      real += Element[Z].IsoProb[k] * cos(X);
+      imag += Element[Z].IsoProb[k] * sin(X);
+    }
+
+    /* Convert to polar coordinates, r then theta */
+    t.LogR[i] = 0.5*log(real*real+imag*imag);
+    if (real > 0) t.Theta[i] = atan(imag/real);
+    else if (real < 0) t.Theta[i] = atan(imag/real) + PI;
+    else if (imag > 0) t.Theta[i] = HALFPI;
+    else t.Theta[i] = -HALFPI;
+  }
+  t.MassRange = MassRange;
+
+  return t;
+
+}  /* End of GetTransform() */
   
  
 /*************************************************/
@@ -547,6 +550,7 @@ void CMercury8::Reset(){
     for (j=0;j<Element[EnrichAtoms[i]].NumIsotopes;j++){
       Element[EnrichAtoms[i]].IsoProb[j] = Orig[EnrichAtoms[i]].IsoProb[j];
     }
+    Transform[EnrichAtoms[i]].MassRange = 0;
   }
   EnrichAtoms.clear();
   
@@ -608,7 +612,7 @@ void CMercury8::AccurateMass(int NumElements, int Charge){
   //Start isotope distribution calculation
   //MH notes: How is this different from using -MW instead of -intMW?
   CalcFreq(FreqData,NumElements,NumPoints,MassRange,-intMW);
-  FFT(FreqData,NumPoints,false);
+  FFTrealInverse(FreqData,NumPoints);
 
   //Converts complex numbers back to masses
   ConvertMass(FreqData,NumPoints,PtsPerAmu,MW,tempMW,intMW,MIintMW,1,MolVar,IntMolVar);
@@ -664,7 +668,7 @@ void CMercury8::AccurateMass(int NumElements, int Charge){
     
     //Start isotope distribution calculation
     CalcFreq(AltData,NumElements,NumPoints,MassRange,-intMW);
-    FFT(AltData,NumPoints,false);
+    FFTrealInverse(AltData,NumPoints);
 
     ConvertMass(AltData,NumPoints,PtsPerAmu,MW,tempMW,intMW,MIintMW,1,MolVar,IntMolVar);
     MassToInt(AltData,NumPoints);
@@ -906,7 +910,7 @@ void CMercury8::Mercury(int NumElements, int Charge) {
   //MH notes: How is this different from using -MW instead of -intMW?
   start = clock();
   CalcFreq(FreqData,NumElements,NumPoints,MassRange,-intMW);
-  FFT(FreqData,NumPoints,false);
+  FFTrealInverse(FreqData,NumPoints);
   end = clock();
 
   //Output the results if the user requested an Echo.
@@ -7,6 +7,7 @@
 #include <cstring>
 #include "ctype.h"
 #include <ctime>
+#include <vector>
 #include "mercury.h"
 #include "FFT.h"
 using namespace std;
@@ -22,11 +23,21 @@ typedef struct
  
 } Atomic5;
 
+//Frequency domain transform of one atom of an element, as log magnitude
+//and phase, for the non-negative frequencies of a given mass range.
+typedef struct
+{
+   int MassRange;	/* Mass range the transform was computed for; 0 if none */
+   vector<double> LogR;
+   vector<double> Theta;
+} ElementTransform;
+
 class CMercury8 {
  private:
   //Data Members:
   Atomic5 Element[MAXAtomNo+1];	/* 104 elements allows for Z=103 or Lr */
   Atomic5 Orig[MAXAtomNo+1];
+  ElementTransform Transform[MAXAtomNo+1];	/* cached per element; see CalcFreq */
   int AtomicNum[MAXIsotopes];	/* Atomic numbers of elements parsed from molecular formula */
   bool showOutput;
   bool bAccMass;
@@ -45,6 +56,7 @@ class CMercury8 {
   void ConvertMass(complex*, int, int, double, double, int, int, int, double, double);
   void DefaultValues();
   void GetPeaks(complex*, int, vector<Result>&, int, int);
+  ElementTransform& GetTransform(int, int);
   void InitializeData(char* fn="ISOTOPE.DAT");
   void MassToInt(complex*, int);
   void Mercury(int,int);
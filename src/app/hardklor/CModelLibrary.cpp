@@ -1,9 +1,40 @@
 #include "CModelLibrary.h"
+#include <cstdio>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "app/tide/mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+//Cache file layout: magic, version, sizeof(Peak_T), key length, key, the
+//library boundaries, then one record per model followed by all the peaks.
+//Peaks are 8-byte aligned so they can be used in place from the mapping.
+static const char cacheMagic[8]={'H','K','M','O','D','E','L','S'};
+static const int cacheVersion=1;
+
+typedef struct {
+	float area;
+	int size;
+	double zeroMass;
+	long long peakOffset;
+} cacheRecord;
+
+static size_t align8(size_t n){
+	return (n+7) & ~(size_t)7;
+}
 
 CModelLibrary::CModelLibrary(CAveragine* avg, CMercury8* mer){
 	averagine=avg;
 	mercury=mer;
   libModel=NULL;
+	mapData=NULL;
+	mapSize=0;
 
 	chargeMin=0;
 	chargeCount=0;
@@ -98,8 +129,10 @@ void CModelLibrary::eraseLibrary(){
 
 	for(i=chargeMin;i<chargeCount;i++){
 		for(j=0;j<varCount;j++){
-			for(k=0;k<merCount;k++){
-				delete [] libModel[i][j][k].peaks;
+			if(mapData==NULL){
+				for(k=0;k<merCount;k++){
+					delete [] libModel[i][j][k].peaks;
+				}
 			}
 			delete [] libModel[i][j];
 		}
@@ -108,6 +141,12 @@ void CModelLibrary::eraseLibrary(){
 	delete [] libModel;
 
 	libModel=NULL;
+
+	if(mapData!=NULL){
+		munmap(mapData,mapSize);
+		mapData=NULL;
+		mapSize=0;
+	}
 	
 }
 
@@ -116,4 +155,196 @@ mercuryModel* CModelLibrary::getModel(int charge, int var, double mz){
 	int intMZ=(int)(mz/5);
 	return &libModel[charge][var][intMZ];
 
+}
+
+//Describes the charge range, the averagine variants and the contents of the
+//isotope and periodic table files, which together determine the models.
+string CModelLibrary::libraryKey(int lowCharge, int highCharge, vector<CHardklorVariant>& pepVariants, const char* dataFiles[], int numDataFiles){
+
+	int i,j;
+	char str[256];
+	string key;
+
+	sprintf(str,"charge %d %d\n",lowCharge,highCharge);
+	key+=str;
+	for(i=0;i<(int)pepVariants.size();i++){
+		key+="variant";
+		for(j=0;j<pepVariants[i].sizeAtom();j++){
+			sprintf(str," %d:%d",pepVariants[i].atAtom(j).iLower,pepVariants[i].atAtom(j).iUpper);
+			key+=str;
+		}
+		key+=" |";
+		for(j=0;j<pepVariants[i].sizeEnrich();j++){
+			sprintf(str," %d:%d:%.10g",pepVariants[i].atEnrich(j).atomNum,pepVariants[i].atEnrich(j).isotope,pepVariants[i].atEnrich(j).ape);
+			key+=str;
+		}
+		key+="\n";
+	}
+
+	//Data files are keyed by their contents, so edits invalidate the cache
+	for(i=0;i<numDataFiles;i++){
+		key+="file ";
+		key+=dataFiles[i];
+		key+="\n";
+		FILE* f = dataFiles[i][0]=='\0' ? NULL : fopen(dataFiles[i],"rb");
+		if(f==NULL) continue;
+		unsigned long long hash=14695981039346656037ULL;
+		int c;
+		while((c=fgetc(f))!=EOF){
+			hash^=(unsigned char)c;
+			hash*=1099511628211ULL;
+		}
+		fclose(f);
+		sprintf(str,"%016llx\n",hash);
+		key+=str;
+	}
+
+	return key;
+}
+
+//Maps a library written by saveLibrary. Returns false, leaving the library
+//empty, if the file is missing or was built for anything else.
+bool CModelLibrary::loadLibrary(const char* fn, int lowCharge, int highCharge, vector<CHardklorVariant>& pepVariants, const char* dataFiles[], int numDataFiles){
+
+	int i,j,k;
+
+	if(libModel!=NULL) {
+		cout << "library memory already in use." << endl;
+		return false;
+	}
+
+	int fd=open(fn,O_RDONLY);
+	if(fd<0) return false;
+	struct stat st;
+	if(fstat(fd,&st)!=0 || st.st_size==0){
+		close(fd);
+		return false;
+	}
+	size_t size=(size_t)st.st_size;
+	void* data=mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(data==MAP_FAILED) return false;
+	const char* p=(const char*)data;
+
+	//Header
+	string key=libraryKey(lowCharge,highCharge,pepVariants,dataFiles,numDataFiles);
+	int header[3];
+	size_t keyLen;
+	size_t pos=sizeof(cacheMagic)+sizeof(header);
+	bool ok = size>=pos;
+	if(ok){
+		memcpy(header,p+sizeof(cacheMagic),sizeof(header));
+		ok = memcmp(p,cacheMagic,sizeof(cacheMagic))==0 && header[0]==cacheVersion && header[1]==(int)sizeof(Peak_T) && header[2]==(int)key.size();
+	}
+	if(ok){
+		keyLen=key.size();
+		pos+=keyLen;
+		ok = size>=pos && memcmp(p+pos-keyLen,key.data(),keyLen)==0;
+	}
+	int bounds[4];
+	if(ok){
+		pos=align8(pos);
+		ok = size>=pos+sizeof(bounds);
+	}
+	if(ok){
+		memcpy(bounds,p+pos,sizeof(bounds));
+		pos+=sizeof(bounds);
+		ok = bounds[0]==lowCharge && bounds[1]==highCharge+1 && bounds[2]==(int)pepVariants.size() && bounds[3]>0 &&
+			size>=pos+(size_t)(bounds[1]-bounds[0])*bounds[2]*bounds[3]*sizeof(cacheRecord);
+	}
+	if(!ok){
+		munmap(data,size);
+		return false;
+	}
+
+	mapData=(char*)data;
+	mapSize=size;
+	chargeMin=bounds[0];
+	chargeCount=bounds[1];
+	varCount=bounds[2];
+	merCount=bounds[3];
+
+	const cacheRecord* rec=(const cacheRecord*)(p+pos);
+	libModel = new mercuryModel**[chargeCount];
+	for(i=chargeMin;i<chargeCount;i++){
+		libModel[i] = new mercuryModel*[varCount];
+		for(j=0;j<varCount;j++){
+			libModel[i][j] = new mercuryModel[merCount];
+			for(k=0;k<merCount;k++,rec++){
+				libModel[i][j][k].area=rec->area;
+				libModel[i][j][k].size=rec->size;
+				libModel[i][j][k].zeroMass=rec->zeroMass;
+				if(rec->size==0 || rec->peakOffset<0 || (size_t)rec->peakOffset+rec->size*sizeof(Peak_T)>size) {
+					libModel[i][j][k].size=0;
+					libModel[i][j][k].peaks=NULL;
+				} else {
+					libModel[i][j][k].peaks=(Peak_T*)(mapData+rec->peakOffset);
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+//Writes the current library, built with the given arguments, to fn.
+bool CModelLibrary::saveLibrary(const char* fn, int lowCharge, int highCharge, vector<CHardklorVariant>& pepVariants, const char* dataFiles[], int numDataFiles){
+
+	int i,j,k;
+	const char zeros[8]={0,0,0,0,0,0,0,0};
+
+	if(libModel==NULL) return false;
+
+	FILE* f=fopen(fn,"wb");
+	if(f==NULL) {
+		cout << "Cannot write model library cache " << fn << endl;
+		return false;
+	}
+
+	string key=libraryKey(lowCharge,highCharge,pepVariants,dataFiles,numDataFiles);
+	int header[3]={cacheVersion,(int)sizeof(Peak_T),(int)key.size()};
+	fwrite(cacheMagic,1,sizeof(cacheMagic),f);
+	fwrite(header,sizeof(int),3,f);
+	fwrite(key.data(),1,key.size(),f);
+	size_t pos=sizeof(cacheMagic)+sizeof(header)+key.size();
+	fwrite(zeros,1,align8(pos)-pos,f);
+	pos=align8(pos);
+
+	int bounds[4]={chargeMin,chargeCount,varCount,merCount};
+	fwrite(bounds,sizeof(int),4,f);
+	pos+=sizeof(bounds);
+
+	//Records, then the peaks in the same order
+	size_t peakPos=align8(pos+(size_t)(chargeCount-chargeMin)*varCount*merCount*sizeof(cacheRecord));
+	cacheRecord rec;
+	memset(&rec,0,sizeof(rec));
+	for(i=chargeMin;i<chargeCount;i++){
+		for(j=0;j<varCount;j++){
+			for(k=0;k<merCount;k++){
+				rec.area=libModel[i][j][k].area;
+				rec.size=libModel[i][j][k].size;
+				rec.zeroMass=libModel[i][j][k].zeroMass;
+				rec.peakOffset=(long long)peakPos;
+				fwrite(&rec,sizeof(rec),1,f);
+				pos+=sizeof(rec);
+				peakPos+=rec.size*sizeof(Peak_T);
+			}
+		}
+	}
+	fwrite(zeros,1,align8(pos)-pos,f);
+	for(i=chargeMin;i<chargeCount;i++){
+		for(j=0;j<varCount;j++){
+			for(k=0;k<merCount;k++){
+				if(libModel[i][j][k].size>0) fwrite(libModel[i][j][k].peaks,sizeof(Peak_T),libModel[i][j][k].size,f);
+			}
+		}
+	}
+
+	bool ok = ferror(f)==0;
+	if(fclose(f)!=0) ok=false;
+	if(!ok) {
+		cout << "Cannot write model library cache " << fn << endl;
+		remove(fn);
+	}
+	return ok;
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "CAveragine.h"
 #include "CMercury8.h"
 #include "CHardklorVariant.h"
+#include <string>
 #include <vector>
 
 using namespace std;
@@ -21,9 +22,16 @@ public:
 	void eraseLibrary();
 	mercuryModel* getModel(int charge, int var, double mz);
 
+	//Library cache files. The key names everything else the models depend on,
+	//and a cached library is only used if its key and boundaries match.
+	bool loadLibrary(const char* fn, int lowCharge, int highCharge, vector<CHardklorVariant>& pepVariants, const char* dataFiles[], int numDataFiles);
+	bool saveLibrary(const char* fn, int lowCharge, int highCharge, vector<CHardklorVariant>& pepVariants, const char* dataFiles[], int numDataFiles);
+
 protected:
 
 private:
+	//Functions
+	string libraryKey(int lowCharge, int highCharge, vector<CHardklorVariant>& pepVariants, const char* dataFiles[], int numDataFiles);
 
 	//Data Members
 	int chargeMin;
@@ -35,6 +43,10 @@ private:
 	CMercury8* mercury;
 	mercuryModel*** libModel;
 
+	//Mapped cache file holding the model peaks, if the library was loaded
+	char* mapData;
+	size_t mapSize;
+
 };
 
 #endif
\ No newline at end of file
@@ -536,6 +536,8 @@ bool CNoiseReduction::NewScanAverage(Spectrum& sp, char* file, int width, float
   int posLeft;
   int posRight;
   int index;
+  float inten;
+  double mzSum;
   char cFilter1[256];
   //char cFilter2[256];
 
@@ -543,8 +545,7 @@ bool CNoiseReduction::NewScanAverage(Spectrum& sp, char* file, int width, float
   //double intercept;
 
   sp.clear();
-  Spectrum* specs;
-  specs = new Spectrum[width*2+1];
+  specs.clear();
 
   //if file is not null, create new buffer
   if(file!=NULL){
@@ -553,24 +554,22 @@ bool CNoiseReduction::NewScanAverage(Spectrum& sp, char* file, int width, float
     if(scanNum>0) r->readFile(file,ts,scanNum);
     else r->readFile(file,ts);
     if(ts.getScanNumber()==0) {
-      delete [] specs;
       return false;
     }
     bs.push_back(ts);
-    specs[0]=bs[0];
-    c=CParam(specs[0],3);
+    specs.push_back(&bs[0]);
+    c=CParam(*specs[0],3);
     posA=0;
   } else {
     posA++;
     if(posA>=(int)bs.size()) { //end of buffer, no more data
-      delete [] specs;
       return false; 
     }
-    specs[0]=bs[posA];
-    c=CParam(specs[0],3);
+    specs.push_back(&bs[posA]);
+    c=CParam(*specs[0],3);
   }
 
-  specs[0].getRawFilter(cFilter1,256);
+  specs[0]->getRawFilter(cFilter1,256);
 
   posLeft=posA;
   posRight=posA;
@@ -643,7 +642,8 @@ bool CNoiseReduction::NewScanAverage(Spectrum& sp, char* file, int width, float
     }
 
     if(index==-1)  continue;
-    specs[numScans++]=bs[index];
+    specs.push_back(&bs[index]);
+    numScans++;
 
   }
   
@@ -675,23 +675,26 @@ bool CNoiseReduction::NewScanAverage(Spectrum& sp, char* file, int width, float
   */
 
   //Match peaks between pivot scan (0) and neighbors (the rest)
+  CopyIntensities();
   for(m=0;m<numScans;m++){
     
     vPos.clear();
     for(i=0;i<numScans;i++) vPos.push_back(0);
 
-    for(i=0;i<specs[m].size();i++){ //iterate all points
-      if(specs[m].at(i).intensity<0.1) continue;
-      tmz=specs[m].at(i).mz;
+    for(i=0;i<specs[m]->size();i++){ //iterate all points
+      if(specInten[m][i]<0.1) continue;
+      tmz=specs[m]->at(i).mz;
+      inten=specInten[m][i];
+      mzSum=tmz;
       mzcount=1;
       prec = c * tmz * tmz / 2;
       
       for(k=m+1;k<numScans;k++){ //iterate all neighbors
         dif=100000.0;
 
-        for(j=vPos[k];j<specs[k].size();j++){ //check if point is a match
-          if(specs[k].at(j).intensity<0.1) continue; //skip meaningless datapoints to speed along
-          dt=fabs(tmz-specs[k].at(j).mz);
+        for(j=vPos[k];j<specs[k]->size();j++){ //check if point is a match
+          if(specInten[k][j]<0.1) continue; //skip meaningless datapoints to speed along
+          dt=fabs(tmz-specs[k]->at(j).mz);
 
           if(dt<=dif) {
             if(dt<prec) {
@@ -705,14 +708,14 @@ bool CNoiseReduction::NewScanAverage(Spectrum& sp, char* file, int width, float
               //  intercept=specs[k].at(j).intensity-specs[k].at(j).mz*slope;
               //  specs[m].at(i).intensity+=(tmz*slope+intercept);
               //} else {
-              specs[m].at(i).intensity += specs[k].at(j).intensity;
+              inten += specInten[k][j];
               //}
 
               //Averaging the mz values appears equivalent to realigning all spectra against
               //an average Ledford correction.
-              specs[m].at(i).mz += specs[k].at(j).mz;
+              mzSum += specs[k]->at(j).mz;
               vPos[k]=j+1;
-              specs[k].at(j).intensity=-1.0;
+              specInten[k][j]=-1.0;
               mzcount++;
               break;
             }
@@ -724,15 +727,15 @@ bool CNoiseReduction::NewScanAverage(Spectrum& sp, char* file, int width, float
         }
       }//for k
 
-      sp.add(specs[m].at(i).mz/mzcount,specs[m].at(i).intensity/numScans);
+      sp.add(mzSum/mzcount,inten/numScans);
 
     } //next i
   } //next m
 
   if(sp.size()>0) sp.sortMZ();
-  sp.setScanNumber(specs[0].getScanNumber());
-  sp.setScanNumber(specs[0].getScanNumber(true),true);
-  sp.setRTime(specs[0].getRTime());
+  sp.setScanNumber(specs[0]->getScanNumber());
+  sp.setScanNumber(specs[0]->getScanNumber(true),true);
+  sp.setRTime(specs[0]->getRTime());
   sp.setRawFilter(cFilter1);
 
   if(posLeft>0){
@@ -742,7 +745,6 @@ bool CNoiseReduction::NewScanAverage(Spectrum& sp, char* file, int width, float
       posA--;
     }
   }
-  delete [] specs;
   return true;
 }
 
@@ -1432,13 +1434,12 @@ bool CNoiseReduction::NewScanAveragePlusDeNoise(Spectrum& sp, char* file, int wi
   int posLeft;
   int posRight;
   int index;
+  float inten;
   char cFilter1[256];
   char cFilter2[256];
 
   sp.clear();
-
-  Spectrum* specs;
-  specs = new Spectrum[width*2+1];
+  specs.clear();
 
   //if file is not null, create new buffer
   if(file!=NULL){
@@ -1447,25 +1448,23 @@ bool CNoiseReduction::NewScanAveragePlusDeNoise(Spectrum& sp, char* file, int wi
     if(scanNum>0) r->readFile(file,ts,scanNum);
     else r->readFile(file,ts);
     if(ts.getScanNumber()==0) {
-      delete [] specs;
       return false;
     }
     bs.push_back(ts);
-    specs[0]=bs[0];
-    c=CParam(specs[0],3);
+    specs.push_back(&bs[0]);
+    c=CParam(*specs[0],3);
     posA=0;
   } else {
     posA++;
     if(posA>=(int)bs.size()) { //end of buffer, no more data
-      delete [] specs;
       return false; 
     }
-    specs[0]=bs[posA];
-    c=CParam(specs[0],3);
+    specs.push_back(&bs[posA]);
+    c=CParam(*specs[0],3);
   }
 
   //set our pivot spectrum
-  specs[0].getRawFilter(cFilter1,256);
+  specs[0]->getRawFilter(cFilter1,256);
 
   posLeft=posA;
   posRight=posA;
@@ -1540,7 +1539,8 @@ bool CNoiseReduction::NewScanAveragePlusDeNoise(Spectrum& sp, char* file, int wi
     if(index==-1)  continue;
    
     //ts=bs[index];
-    specs[numScans++]=bs[index];
+    specs.push_back(&bs[index]);
+    numScans++;
 
     //cout << "NumScans: " << numScans << endl;
 
@@ -1548,6 +1548,7 @@ bool CNoiseReduction::NewScanAveragePlusDeNoise(Spectrum& sp, char* file, int wi
 
   //Match peaks between pivot scan (0) and neighbors (the rest)
   //for(m=0;m<cs.ppMatch && m<numScans;m++){
+  CopyIntensities();
   for(m=0;m<1;m++){
 
     //cout << "m " << m << " = " << specs[m].getScanNumber() << endl;
@@ -1556,25 +1557,26 @@ bool CNoiseReduction::NewScanAveragePlusDeNoise(Spectrum& sp, char* file, int wi
     for(i=0;i<numScans;i++) vPos.push_back(0);
     //cout << "Checking " << m << " of " << numScans << " points remaining: " << specs[m].size() << endl;
 
-    for(i=0;i<specs[m].size();i++){ //iterate all points
-      if(specs[m].at(i).intensity<0.1) continue;
-      prec = c * specs[m].at(i).mz * specs[m].at(i).mz / 2;
+    for(i=0;i<specs[m]->size();i++){ //iterate all points
+      if(specInten[m][i]<0.1) continue;
+      prec = c * specs[m]->at(i).mz * specs[m]->at(i).mz / 2;
+      inten=specInten[m][i];
       match=1;
 
       for(k=m+1;k<numScans;k++){ //iterate all neighbors
         dif=100000.0;
 
-        for(j=vPos[k];j<specs[k].size();j++){ //check if point is a match
-          //cout << "Checking " << j << " of " << specs[k].size() << endl;
-          if(specs[k].at(j).intensity<0.1) continue; //skip meaningless datapoints to speed along
-          dt=fabs(specs[m].at(i).mz-specs[k].at(j).mz);
+        for(j=vPos[k];j<specs[k]->size();j++){ //check if point is a match
+          //cout << "Checking " << j << " of " << specs[k]->size() << endl;
+          if(specInten[k][j]<0.1) continue; //skip meaningless datapoints to speed along
+          dt=fabs(specs[m]->at(i).mz-specs[k]->at(j).mz);
           //dt=specs[m].at(i).mz-specs[k].at(j).mz;
           //if(dt<0.0)dt=-dt;
           if(dt<=dif) {
             if(dt<prec) {
-              specs[m].at(i).intensity+=specs[k].at(j).intensity;
+              inten+=specInten[k][j];
               vPos[k]=j+1;
-              specs[k].at(j).intensity=-1.0;
+              specInten[k][j]=-1.0;
               match++;
               break;
             }
@@ -1595,7 +1597,7 @@ bool CNoiseReduction::NewScanAveragePlusDeNoise(Spectrum& sp, char* file, int wi
         //add to temp spectrum
         //cout << specs[m].at(i).mz << " has " << match << " matches." << endl;
         //sp.add(specs[m].at(i).mz,specs[m].at(i).intensity/numScans);
-        sp.add(specs[m].at(i).mz,specs[m].at(i).intensity/match);
+        sp.add(specs[m]->at(i).mz,inten/match);
       }
 
     } //next i
@@ -1605,9 +1607,9 @@ bool CNoiseReduction::NewScanAveragePlusDeNoise(Spectrum& sp, char* file, int wi
   //sort
   //cout << "Done " << sp.size() << endl;
   if(sp.size()>0) sp.sortMZ();
-  sp.setScanNumber(specs[0].getScanNumber());
-  sp.setScanNumber(specs[0].getScanNumber(true),true);
-  sp.setRTime(specs[0].getRTime());
+  sp.setScanNumber(specs[0]->getScanNumber());
+  sp.setScanNumber(specs[0]->getScanNumber(true),true);
+  sp.setRTime(specs[0]->getRTime());
   sp.setRawFilter(cFilter1);
 
   //clear unused buffer
@@ -1619,8 +1621,17 @@ bool CNoiseReduction::NewScanAveragePlusDeNoise(Spectrum& sp, char* file, int wi
     }
   }
 
-  delete [] specs;
-
   return true;
 }
 
+//Copies the intensities of the spectra being averaged to specInten, where
+//the peaks matched to the pivot scan are marked as used
+void CNoiseReduction::CopyIntensities(){
+  unsigned int i,j;
+  if(specInten.size()<specs.size()) specInten.resize(specs.size());
+  for(i=0;i<specs.size();i++){
+    specInten[i].resize(specs[i]->size());
+    for(j=0;j<specs[i]->size();j++) specInten[i][j]=specs[i]->at(j).intensity;
+  }
+}
+
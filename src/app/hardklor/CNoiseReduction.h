@@ -7,6 +7,7 @@
 #include <cmath>
 #include <iostream>
 #include <deque>
+#include <vector>
 
 #define GC 5.5451774444795623
 
@@ -42,7 +43,7 @@ public:
 
 private:
   //Functions
-  
+  void CopyIntensities();
   
   //Data Members
   //int pos;
@@ -53,6 +54,11 @@ private:
   deque<Spectrum> s;
   deque<Spectrum> bs;
 
+  //The scans being averaged, which point into bs instead of copying it, and
+  //their intensities, which are consumed as peaks are matched
+  vector<Spectrum*> specs;
+  vector< vector<float> > specInten;
+
 	/*
 	  __int64 startTime;
     __int64 stopTime;
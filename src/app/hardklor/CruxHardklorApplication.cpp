@@ -14,6 +14,7 @@
 #include "util/Params.h"
 #include "util/StringUtils.h"
 #include "io/DelimitedFileWriter.h"
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -23,11 +24,39 @@ CruxHardklorApplication::CruxHardklorApplication() {
 CruxHardklorApplication::~CruxHardklorApplication() {
 }
 
+/**
+ * Appends the scans and results that a Hardklor engine kept in memory,
+ * pointing the scans at their results' new positions.
+ */
+template<typename Engine>
+static void appendResults(
+  Engine& hardklor,
+  vector<hkScanMem>* scans,
+  vector<hkMem>* results
+) {
+  int offset = results->size();
+  for (int i = 0; i < hardklor.SizeScans(); i++) {
+    scans->push_back(hardklor.GetScan(i));
+    scans->back().firstResult += offset;
+  }
+  for (int i = 0; i < hardklor.Size(); i++) {
+    results->push_back(hardklor[i]);
+  }
+}
+
 int CruxHardklorApplication::main(int argc, char** argv) {
   return main(Params::GetString("spectra"));
 }
 
 int CruxHardklorApplication::main(const string& ms1) {
+  return main(ms1, NULL, NULL);
+}
+
+int CruxHardklorApplication::main(
+  const string& ms1,
+  vector<hkScanMem>* scans,
+  vector<hkMem>* results
+) {
   carp(CARP_INFO, "Hardklor v2.19, April 10 2015");
   carp(CARP_INFO, "Mike Hoopmann, Mike MacCoss");
   carp(CARP_INFO, "Copyright 2007-2015");
@@ -95,7 +124,7 @@ int CruxHardklorApplication::main(const string& ms1) {
   }
 
   // Create all the output files that will be used
-  for (int i = 0; i< hp.size(); i++) {
+  for (int i = 0; i < hp.size() && results == NULL; i++) {
     const char* out = &hp.queue(i).outFile[0];
     if (FileUtils::Exists(out) && !Params::GetBool("overwrite")) {
       carp(CARP_FATAL, "The file '%s' already exists and cannot be overwritten. "
@@ -118,6 +147,16 @@ int CruxHardklorApplication::main(const string& ms1) {
 
   CHardklor h(averagine, mercury);
   CHardklor2 h2(averagine, mercury, models);
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = boost::thread::hardware_concurrency();
+  }
+  h.SetThreads(num_threads);
+  h2.SetThreads(num_threads);
+  h.SetResultsToMemory(results != NULL);
+  h2.SetResultsToMemory(results != NULL);
+  string modelCache = Params::GetString("hardklor-model-cache");
+  const char* dataFiles[] = { hp.queue(0).MercuryFile, hp.queue(0).HardklorFile };
   vector<CHardklorVariant> pepVariants;
   CHardklorVariant hkv;
 
@@ -131,10 +170,27 @@ int CruxHardklorApplication::main(const string& ms1) {
         pepVariants.push_back(hp.queue(i).variant->at(j));
       }
       models->eraseLibrary();
-      models->buildLibrary(hp.queue(i).minCharge, hp.queue(i).maxCharge, pepVariants);
+      if (!modelCache.empty() &&
+          models->loadLibrary(modelCache.c_str(), hp.queue(i).minCharge,
+                              hp.queue(i).maxCharge, pepVariants, dataFiles, 2)) {
+        carp(CARP_INFO, "Read model library from %s", modelCache.c_str());
+      } else {
+        models->buildLibrary(hp.queue(i).minCharge, hp.queue(i).maxCharge, pepVariants);
+        if (!modelCache.empty() &&
+            models->saveLibrary(modelCache.c_str(), hp.queue(i).minCharge,
+                                hp.queue(i).maxCharge, pepVariants, dataFiles, 2)) {
+          carp(CARP_INFO, "Wrote model library to %s", modelCache.c_str());
+        }
+      }
       h2.GoHardklor(hp.queue(i));
+      if (results != NULL) {
+        appendResults(h2, scans, results);
+      }
     } else {
       h.GoHardklor(hp.queue(i));
+      if (results != NULL) {
+        appendResults(h, scans, results);
+      }
     }
   }
 
@@ -250,6 +306,8 @@ vector<string> CruxHardklorApplication::getOptions() const {
     "smooth",
     "sn-window",
     "static-sn",
+    "hardklor-model-cache",
+    "num-threads",
     "parameter-file",
     "verbosity"
   };
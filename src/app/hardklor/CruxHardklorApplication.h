@@ -11,6 +11,10 @@
 
 #include <string>
 #include <fstream>
+#include <vector>
+
+struct hkMem;
+struct hkScanMem;
 
 class CruxHardklorApplication: public CruxApplication {
 
@@ -57,6 +61,18 @@ class CruxHardklorApplication: public CruxApplication {
   static int main(
     const std::string& ms1 ///< file path of spectra to process
   );
+
+  /**
+   * \brief runs hardklor on the input spectra, keeping the scans and
+   * results in memory instead of (when results is not NULL) writing them to
+   * a file
+   * \returns whether hardklor was successful or not
+   */
+  static int main(
+    const std::string& ms1, ///< file path of spectra to process
+    std::vector<hkScanMem>* scans, ///< scans of the results -out
+    std::vector<hkMem>* results ///< results of all scans -out
+  );
   
  protected:
   static void addArg(
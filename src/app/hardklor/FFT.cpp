@@ -119,3 +119,61 @@ void FFTreal(complex* data, int size){
 	
 
 };
+
+//Inverse transform of the spectrum of a real signal, using one complex FFT
+//of half the size. Only data[0..size/2] is read; data[k] for k>size/2 is
+//taken to be the conjugate of data[size-k]. The (real) result is left in
+//data[i].real, with data[i].imag set to 0. Matches the real part of
+//FFT(data,size,false).
+void FFTrealInverse(complex* data, int size){
+
+	int i,k,m;
+	double a,c,s;
+	complex x,y,e,o;
+
+	m=size>>1;
+
+	//Pack the even-indexed outputs into the real part and the odd-indexed
+	//outputs into the imaginary part of a half-size transform
+	x=data[0];
+	y=data[m];
+	data[0].real=x.real+y.real;
+	data[0].imag=x.real-y.real;
+	for(k=1;k<=m/2;k++){
+		i=m-k;
+		x=data[k];
+		y=data[i];
+
+		//even: X[k]+X[k+m], odd: (X[k]-X[k+m])*w^k where X[k+m]=conj(X[m-k])
+		a=-PI*k/m;
+		c=cos(a);
+		s=sin(a);
+		e.real=x.real+y.real;
+		e.imag=x.imag-y.imag;
+		o.real=(x.real-y.real)*c - (x.imag+y.imag)*s;
+		o.imag=(x.real-y.real)*s + (x.imag+y.imag)*c;
+		data[k].real=e.real-o.imag;
+		data[k].imag=e.imag+o.real;
+		if(i==k) break;
+
+		//the same for m-k, whose partner is k; w^(m-k) = -conj(w^k)
+		e.real=y.real+x.real;
+		e.imag=y.imag-x.imag;
+		o.real=-((y.real-x.real)*c + (y.imag+x.imag)*s);
+		o.imag=(y.real-x.real)*s - (y.imag+x.imag)*c;
+		data[i].real=e.real-o.imag;
+		data[i].imag=e.imag+o.real;
+	}
+
+	FFT(data,m,false);
+
+	//Unpack from the top down so no value is overwritten before it is read
+	for(i=m-1;i>=0;i--){
+		x=data[i];
+		data[2*i].real=x.real;
+		data[2*i].imag=0;
+		data[2*i+1].real=x.imag;
+		data[2*i+1].imag=0;
+	}
+
+}
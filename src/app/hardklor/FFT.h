@@ -16,5 +16,6 @@ typedef struct complex{
 void BitReverse(complex* data, int size);
 void FFT(complex* data, int size, bool forward);
 void FFTreal(complex* data, int size);
+void FFTrealInverse(complex* data, int size);
 
 #endif
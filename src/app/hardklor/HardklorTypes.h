@@ -137,4 +137,12 @@ typedef struct hkMem{
   char mods[32];
 } hkMem;
 
+//for storing the scans of modular Hardklor runs; the results of a scan
+//start at firstResult and end where those of the next scan start
+typedef struct hkScanMem{
+  int scan;
+  float rTime;
+  int firstResult;
+} hkScanMem;
+
 #endif
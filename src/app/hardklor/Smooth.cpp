@@ -1,5 +1,27 @@
 #include "Smooth.h"
 #include <iostream>
+#include <map>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+//Savitzky-Golay weights over 2m+1 points for every least-square point t
+//(-m to m), with the weights of t at (t+m)*(2m+1). They only depend on the
+//window, so each window is computed once and shared by all callers.
+static const vector<double>& SG_Weights(int m, int p){
+  static map<pair<int,int>, vector<double> > tables;
+  static boost::mutex tablesMutex;
+
+  boost::mutex::scoped_lock lock(tablesMutex);
+  map<pair<int,int>, vector<double> >::iterator it = tables.find(make_pair(m,p));
+  if(it!=tables.end()) return it->second;
+
+  vector<double> w;
+  int i,t;
+  for(t=-m; t<=m; t++){
+    for(i=-m; i<=m; i++) w.push_back(SG_Weight(i, t, m, p, 0));
+  }
+  return tables.insert(make_pair(make_pair(m,p),w)).first->second;
+}
 
 //Savitzky-Golay smoothing algorithm
 void SG_Smooth(Spectrum& sp, int m, int p){
@@ -9,124 +31,90 @@ void SG_Smooth(Spectrum& sp, int m, int p){
     return;
   }
  
-  int t,i,s;
+  int t,i;
   int k;
-  int c1,c2,c3;
-  double weightSum;
-  double *weight, *holder;
-  weight = new double[2*m+1];
-  holder = new double[sp.size()];
+  int w=2*m+1;
+  int sz=sp.size();
+  const double* weight;
+  double *holder;
+  float *smoothed;
+  const vector<double>& weights = SG_Weights(m,p);
+  holder = new double[sz];
+  smoothed = new float[sz];
   
-  s = 0;   // Derivative order s = 0 for smooth
+  //copy intensities to holder array
+  for(i=0;i<sz;i++) holder[i] = sp.at(i).intensity;
  
-  //copy intensities to holder array and set to 0
-  for(i=0;i<sp.size();i++){
-    holder[i] = sp.at(i).intensity;
-    sp.at(i).intensity=0;
-  }
- 
-  //Calculate the Savitzky-Golay Weights for t = 0
-  c1 = 0;
-  weightSum=0;
-  for(i=-m; i<=m; i++){
-    weight[c1] = SG_Weight(i, 0, m, p, s);
-    weightSum+=weight[c1];
-    c1++;
-  }
-  
-  c1 = 0;
-  t = -m;
   // Smoothing for the points 0 to m-1
   for(k=0; k<m; k++){
-    c3 = 0;
-    for(i=-m; i<=m; i++){
-      sp.at(k).intensity += (float)(SG_Weight(i, t, m, p, s) * holder[k + c3]);
-      c3++;
-    }
-    t++;
+    weight = &weights[k*w];
+    smoothed[k] = 0;
+    for(i=0; i<w; i++) smoothed[k] += (float)(weight[i] * holder[k+i]);
   }
     
-  // Smoothing for the bulk of the chromatogram at t = 0
-  for(k=m;k<sp.size()-m;k++){
-    c2=-m;
-    for(i=0; i<2*m+1; i++){
-      sp.at(k).intensity += (float)(weight[i] * holder[k+c2]);
-      c2++;
-    }
+  // Smoothing for the bulk of the chromatogram at t = 0; plain arrays so
+  // that the compiler can vectorize this loop
+  weight = &weights[m*w];
+  for(k=m;k<sz-m;k++){
+    smoothed[k] = 0;
+    for(i=0; i<w; i++) smoothed[k] += (float)(weight[i] * holder[k-m+i]);
   }
     
   // Smoothing for the points end-m+1 to end
   t = 1;
-  for(k=sp.size()-m; k<sp.size(); k++){
-    c3 = -(2*m+1);
-    for(i=-m; i<=m; i++){
-      sp.at(k).intensity += (float)(SG_Weight(i, t, m, p, s) * holder[k + c3]);
-      c3++;
-    }
+  for(k=sz-m; k<sz; k++){
+    weight = &weights[(t+m)*w];
+    smoothed[k] = 0;
+    for(i=0; i<w; i++) smoothed[k] += (float)(weight[i] * holder[k-w+i]);
     t++;
   }
 
-  delete [] weight;
+  for(k=0;k<sz;k++) sp.at(k).intensity = smoothed[k];
+
   delete [] holder;
+  delete [] smoothed;
 }
 
 //Savitzky-Golay smoothing with an array instead of spectrum object
 void SG_SmoothD(float *d, int sz, int m, int p){
     
-  int t,i,s;
+  int t,i;
   int k;
-  int c1,c2,c3;
-  float *weight,*holder;
-  weight = new float[sz];
+  int w=2*m+1;
+  const double* weight;
+  float *bulkWeight,*holder;
+  const vector<double>& weights = SG_Weights(m,p);
+  bulkWeight = new float[w];
   holder = new float[sz];
   
-  s = 0;   // Derivative order s = 0 for smooth
-  
   for(i=0;i<sz;i++){
     holder[i] = d[i];
     d[i]=0;
   }
 
-  //Calculate the Savitsky-Golay Weights for t = 0
-  c1 = 0;
-  for(i=-m; i<=m; i++){
-    weight[c1] = (float)SG_Weight(i, 0, m , p, s);
-    c1++;
-  }
+  //The weights for t = 0, as floats
+  for(i=0; i<w; i++) bulkWeight[i] = (float)weights[m*w+i];
   
-  c1 = 0;
   // Smoothing for the points 0 to m-1
-  t = -m;
   for(k=0; k<m; k++){
-    c3 = 0;
-    for(i=-m; i<=m; i++){
-      d[k] += (float)(SG_Weight(i, t, m, p, s) * holder[k + c3]);
-      c3++;
-    }
-    t++;
+    weight = &weights[k*w];
+    for(i=0; i<w; i++) d[k] += (float)(weight[i] * holder[k+i]);
   }
     
   // Smoothing for the bulk of the chromatogram at t = 0
   for(k=m;k<sz-m;k++){
-    c2=-m;
-    for(i=0; i<(2*m+1); i++){
-      d[k] += weight[i] * holder[k+c2];
-      c2++;
-    }
+    for(i=0; i<w; i++) d[k] += bulkWeight[i] * holder[k-m+i];
   }
     
   // Smoothing for the points end-m+1 to end
   t = 1;
   for(k=sz-m; k<sz; k++){
-    c3 = -(2*m+1);
-    for(i=-m; i<=m; i++){
-      d[k] += (float)(SG_Weight(i, t, m, p, s) * holder[k + c3]);
-      c3++;
-    }
+    weight = &weights[(t+m)*w];
+    for(i=0; i<w; i++) d[k] += (float)(weight[i] * holder[k-w+i]);
     t++;
   }
 
-  delete [] weight;
+  delete [] bulkWeight;
   delete [] holder;
 
 }
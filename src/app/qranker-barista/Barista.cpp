@@ -3,6 +3,8 @@
 #include "model/Peptide.h"
 #include "app/ComputeQValues.h"
 #include "util/Params.h"
+#include "util/ThreadPool.h"
+#include <boost/bind.hpp>
 
 using namespace std; 
 double Barista :: check_gradients_hinge_one_net(int protind, int label){
@@ -271,13 +273,7 @@ double Barista :: check_gradients_hinge_clones(int protind, int label)
 /**********************************************************/
 int Barista :: getOverFDRPSM(PSMScores &s, NeuralNet &n,double fdr)
 {
-  double* featVec;
-  for(int i = 0; i < s.size(); i++)
-    {
-      featVec = d.psmind2features(s[i].psmind);
-      double *r = n.fprop(featVec);
-      s[i].score = r[0];
-    }
+  s.calcScores(d, n);
 
   int overFDR = s.calcOverFDR(fdr);
  
@@ -383,6 +379,9 @@ void Barista :: clear()
   psmtrainset.clear();
   psmtestset.clear();
   delete[] net_clones; net_clones = 0;
+  for(unsigned int i = 0; i < sgd_workers.size(); i++)
+    delete sgd_workers[i];
+  sgd_workers.clear();
   max_psm_inds.clear();
   max_psm_scores.clear();
   used_peptides.clear();
@@ -2045,33 +2044,98 @@ double Barista :: get_protein_score(int protind, NeuralNet &n)
   return sm;
 }
 
-int Barista :: getOverFDRProt(ProtScores &set, NeuralNet &n, double fdr)
+/**
+ * Sets the score of every protein in set to get_protein_score(protind, n).
+ * Rather than scoring the PSMs of a peptide again for every protein it is
+ * in, this scores each PSM of the set once, in one batch, then takes the
+ * peptide maxima and the protein sums in sweeps over the index arrays.
+ */
+void Barista :: calc_protein_scores(ProtScores &set, NeuralNet &n)
 {
-  double r = 0.0;
+  psmind_to_score.resize(d.get_num_psms());
+  pepind_to_max_score.resize(d.get_num_peptides());
+  pepind_needed.assign(d.get_num_peptides(), 0);
+  needed_psminds.clear();
+  needed_features.clear();
+
+  //the PSMs of the peptides of the set
   for(int i = 0; i < set.size(); i++)
     {
       int protind = set[i].protind;
-      r = get_protein_score(protind,n);
-      set[i].score = r;
+      int num_pep = d.protind2num_pep(protind);
+      int *pepinds = d.protind2pepinds(protind);
+      for(int j = 0; j < num_pep; j++)
+	{
+	  int pepind = pepinds[j];
+	  if(pepind_needed[pepind])
+	    continue;
+	  pepind_needed[pepind] = 1;
+	  int num_psms = d.pepind2num_psm(pepind);
+	  int *psminds = d.pepind2psminds(pepind);
+	  for(int k = 0; k < num_psms; k++)
+	    {
+	      needed_psminds.push_back(psminds[k]);
+	      needed_features.push_back(d.psmind2features(psminds[k]));
+	    }
+	}
+    }
+  needed_scores.resize(needed_psminds.size());
+  if(!needed_psminds.empty())
+    n.fprop_batch(&needed_features[0], needed_psminds.size(), &needed_scores[0]);
+  for(unsigned int k = 0; k < needed_psminds.size(); k++)
+    psmind_to_score[needed_psminds[k]] = needed_scores[k];
+
+  //peptide maxima
+  for(int pepind = 0; pepind < d.get_num_peptides(); pepind++)
+    {
+      if(!pepind_needed[pepind])
+	continue;
+      int num_psms = d.pepind2num_psm(pepind);
+      int *psminds = d.pepind2psminds(pepind);
+      double max_sc = -1000000.0;
+      for(int k = 0; k < num_psms; k++)
+	if(psmind_to_score[psminds[k]] > max_sc)
+	  max_sc = psmind_to_score[psminds[k]];
+      pepind_to_max_score[pepind] = max_sc;
+    }
+
+  //protein sums, in the same order as get_protein_score
+  for(int i = 0; i < set.size(); i++)
+    {
+      int protind = set[i].protind;
+      int num_pep = d.protind2num_pep(protind);
+      int *pepinds = d.protind2pepinds(protind);
+      double sm = 0.0;
+      for(int j = 0; j < num_pep; j++)
+	sm += pepind_to_max_score[pepinds[j]];
+      sm /= pow(d.protind2num_all_pep(protind),alpha);
+      set[i].score = sm;
     }
+}
+
+int Barista :: getOverFDRProt(ProtScores &set, NeuralNet &n, double fdr)
+{
+  calc_protein_scores(set, n);
   return set.calcOverFDR(fdr);
   
 }
 
 int Barista :: getOverFDRProt(ProtScores &set, double fdr)
 {
-  double r = 0.0;
-  for(int i = 0; i < set.size(); i++)
-    {
-      int protind = set[i].protind;
-      r = get_protein_score(protind);
-      set[i].score = r;
-    }
+  //the clones share the weights of net, so this gives the scores
+  //get_protein_score(protind) would
+  calc_protein_scores(set, net);
   return set.calcOverFDR(fdr);
   
 }
 
 double Barista :: get_protein_score(int protind)
+{
+  return get_protein_score(protind, net_clones, max_psm_inds, max_psm_scores);
+}
+
+double Barista :: get_protein_score(int protind, NeuralNet *clones,
+				    vector<int> &max_psm_inds, vector<double> &max_psm_scores)
 {
   int num_pep = d.protind2num_pep(protind);
   int num_all_pep = d.protind2num_all_pep(protind);
@@ -2089,7 +2153,7 @@ double Barista :: get_protein_score(int protind)
       for (int j = 0; j < num_psms; j++)
 	{
 	  double *feat = d.psmind2features(psminds[j]);
-	  double *sc = net_clones[psm_count].fprop(feat);
+	  double *sc = clones[psm_count].fprop(feat);
 	  if(sc[0] > max_sc)
 	    {
 	      max_sc = sc[0];
@@ -2112,6 +2176,12 @@ double Barista :: get_protein_score(int protind)
 }
 
 void Barista :: calc_gradients(int protind, int label)
+{
+  calc_gradients(protind, label, net_clones, max_psm_inds);
+}
+
+void Barista :: calc_gradients(int protind, int label, NeuralNet *clones,
+			       const vector<int> &max_psm_inds)
 {
   int num_pep = d.protind2num_pep(protind);
   int num_all_pep = d.protind2num_all_pep(protind);
@@ -2126,7 +2196,7 @@ void Barista :: calc_gradients(int protind, int label)
       int pepind = pepinds[i];
       int num_psms = d.pepind2num_psm(pepind);
       int clone_ind = psm_count+max_psm_inds[i];
-      net_clones[clone_ind].bprop(gc);
+      clones[clone_ind].bprop(gc);
       psm_count += num_psms;
     }
   delete[] gc;
@@ -2166,21 +2236,97 @@ double Barista :: train_hinge_psm(int psmind, int label)
   return err;
 }
 
+void Barista :: train_sgd_range(SgdWorker *w, int begin, int end, int update_each)
+{
+  for(int i = begin; i < end; i++)
+    {
+      int protind = trainset[sgd_order[i]].protind;
+      int label = trainset[sgd_order[i]].label;
+      double sm = get_protein_score(protind, w->clones, w->max_psm_inds, w->max_psm_scores);
+      w->err_sum += max(0.0,1.0-sm*label);
+      if(sm*label < 1)
+	{
+	  //hogwild: the step goes into the shared weights without a lock
+	  if(update_each)
+	    w->grads.clear_gradients();
+	  calc_gradients(protind, label, w->clones, w->max_psm_inds);
+	  if(update_each)
+	    w->grads.update(mu);
+	}
+    }
+}
+
+double Barista :: train_epoch_parallel()
+{
+  //the proteins are drawn as in serial training, from the one generator
+  int n = trainset.size();
+  sgd_order.resize(n);
+  for(int i = 0; i < n; i++)
+    sgd_order[i] = myrandom_limit(n);
+  int num_workers = sgd_workers.size();
+  for(int t = 0; t < num_workers; t++)
+    sgd_workers[t]->err_sum = 0.0;
+  if(sgd_mode == "hogwild")
+    {
+      ThreadPool::TaskGroup group;
+      for(int t = 0; t < num_workers; t++)
+	group.Run(boost::bind(&Barista::train_sgd_range, this, sgd_workers[t],
+			      (int)((long long)n*t/num_workers),
+			      (int)((long long)n*(t+1)/num_workers), 1));
+      group.Wait();
+    }
+  else
+    {
+      //each worker sums the gradients of its part of the minibatch, and
+      //their sum, in the order of the workers, makes one step, so that the
+      //result depends on the number of threads but not on their timing
+      for(int begin = 0; begin < n; begin += sgd_minibatch)
+	{
+	  int end = min(n, begin+sgd_minibatch);
+	  ThreadPool::TaskGroup group;
+	  for(int t = 0; t < num_workers; t++)
+	    {
+	      sgd_workers[t]->grads.clear_gradients();
+	      group.Run(boost::bind(&Barista::train_sgd_range, this, sgd_workers[t],
+				    begin+(end-begin)*t/num_workers,
+				    begin+(end-begin)*(t+1)/num_workers, 0));
+	    }
+	  group.Wait();
+	  net.clear_gradients();
+	  for(int t = 0; t < num_workers; t++)
+	    net.add_gradients(sgd_workers[t]->grads);
+	  net.update(mu);
+	}
+    }
+  double err_sum = 0.0;
+  for(int t = 0; t < num_workers; t++)
+    err_sum += sgd_workers[t]->err_sum;
+  return err_sum;
+}
+
 void Barista :: train_net(double selectionfdr)
 {
   for (int k = 0; k < nepochs; k++)
     {
     if(verbose > 0)
 	cout << "epoch " << k << endl;
+      double epoch_start = wall_clock();
       double err_sum = 0.0;
-      for(int i = 0; i < trainset.size(); i++)
+      if(sgd_workers.empty())
 	{
-	  int ind = myrandom_limit(trainset.size());
-	  int protind = trainset[ind].protind;
-	  int label = trainset[ind].label;
-	  err_sum += train_hinge(protind,label);
-	}      
+	  for(int i = 0; i < trainset.size(); i++)
+	    {
+	      int ind = myrandom_limit(trainset.size());
+	      int protind = trainset[ind].protind;
+	      int label = trainset[ind].label;
+	      err_sum += train_hinge(protind,label);
+	    }
+	}
+      else
+	err_sum = train_epoch_parallel();
       int fdr_trn = getOverFDRProt(trainset,selectionfdr);
+      carp(CARP_DEBUG, "epoch %d: hinge loss %g, %d proteins at q<%.2f, %.2f s",
+	   k, err_sum, fdr_trn, selectionfdr, (wall_clock()-epoch_start)/1e6);
       
       if(verbose > 0)
 	{
@@ -2397,6 +2543,24 @@ void Barista :: setup_for_training(int trn_to_tst)
   net_clones = new NeuralNet[max_psms_in_prot];
   for (int i = 0; i < max_psms_in_prot;i++)
     net_clones[i].clone(net);
+
+  if(sgd_mode != "serial")
+    {
+      int num_workers = ThreadPool::Threads();
+      carp(CARP_INFO, "training on %d threads (%s)", num_workers, sgd_mode.c_str());
+      for(int t = 0; t < num_workers; t++)
+	{
+	  SgdWorker *w = new SgdWorker;
+	  w->grads = net;
+	  w->grads.share_weights(net);
+	  w->clones = new NeuralNet[max_psms_in_prot];
+	  for (int i = 0; i < max_psms_in_prot;i++)
+	    w->clones[i].clone(w->grads);
+	  w->max_psm_inds.reserve(max_peptides);
+	  w->max_psm_scores.reserve(max_peptides);
+	  sgd_workers.push_back(w);
+	}
+    }
 }
 
 
@@ -2511,6 +2675,8 @@ int Barista :: crux_set_command_line_options(int argc, char *argv[])
   bool spec_features_flag;
 
   opt_type = Params::GetString("optimization");
+  sgd_mode = Params::GetString("barista-sgd");
+  sgd_minibatch = Params::GetInt("barista-minibatch-size");
 
   fileroot = Params::GetString("fileroot");
   if(!fileroot.empty()) {
@@ -2772,6 +2938,9 @@ vector<string> Barista::getOptions() const {
     "list-of-files",
     "feature-file-out",
     "optimization",
+    "barista-sgd",
+    "barista-minibatch-size",
+    "num-threads",
     "spectrum-parser"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
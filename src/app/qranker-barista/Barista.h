@@ -56,6 +56,7 @@ class Barista : public CruxApplication
     max_peptides(0),   
     max_fdr_psm(0),
     max_fdr_pep(0),
+    sgd_minibatch(0),
     parser(NULL){}
   ~Barista(){clear();}
   void clear();
@@ -75,11 +76,33 @@ class Barista : public CruxApplication
 
   void calc_gradients(int protind, int label);
 
+  //the state of one thread of parallel training (see barista-sgd): clones
+  //of net sharing its weights, with gradients of their own
+  struct SgdWorker {
+    NeuralNet grads;
+    NeuralNet *clones;
+    vector<int> max_psm_inds;
+    vector<double> max_psm_scores;
+    double err_sum;
+    SgdWorker() : clones(NULL), err_sum(0.0) {}
+    ~SgdWorker() {delete[] clones;}
+  };
+  double get_protein_score(int protind, NeuralNet *clones,
+                           vector<int> &psm_inds, vector<double> &psm_scores);
+  void calc_gradients(int protind, int label, NeuralNet *clones,
+                      const vector<int> &psm_inds);
+  //trains on the proteins sgd_order[begin..end) of trainset, taking a step
+  //after each one if update_each, else only summing the gradients
+  void train_sgd_range(SgdWorker *w, int begin, int end, int update_each);
+  //one epoch over trainset on all the workers; returns the hinge loss
+  double train_epoch_parallel();
+
   int getOverFDRProt(ProtScores &set, NeuralNet &n, double fdr);
   int getOverFDRProt(ProtScores &set, double fdr);
 
   double get_protein_score(int protind);
   double get_protein_score(int protind, NeuralNet &n);
+  void calc_protein_scores(ProtScores &set, NeuralNet &n);
   double get_protein_score_parsimonious(int protind, NeuralNet &n);
   int getOverFDRProtParsimonious(ProtScores &set, NeuralNet &n, double fdr);
   void computePEP();
@@ -174,6 +197,13 @@ class Barista : public CruxApplication
   int max_peptides;
   vector<int> max_psm_inds;
   vector<double> max_psm_scores;
+  //buffers for calc_protein_scores, indexed by psmind and pepind
+  vector<double> psmind_to_score;
+  vector<double> pepind_to_max_score;
+  vector<char> pepind_needed;
+  vector<int> needed_psminds;
+  vector<double*> needed_features;
+  vector<double> needed_scores;
   
   //for parsimony counts
   vector<int> used_peptides;
@@ -191,6 +221,11 @@ class Barista : public CruxApplication
   ofstream fdebug;
 
   string opt_type;
+  //serial, hogwild or minibatch, and the minibatch size
+  string sgd_mode;
+  int sgd_minibatch;
+  vector<SgdWorker*> sgd_workers;
+  vector<int> sgd_order;
   QRanker qr;
   PepRanker pr;
 
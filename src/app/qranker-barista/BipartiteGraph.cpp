@@ -1,4 +1,5 @@
 #include "BipartiteGraph.h"
+#include <cstring>
 
 void BipartiteGraph::create_bipartite_graph(map<int, set<int> > data)
 {
@@ -65,6 +66,25 @@ void BipartiteGraph::load(ifstream &is)
 
 }
 
+bool BipartiteGraph::load(const char *data, size_t size)
+{
+  clear();
+  int nr, ni;
+  if(size < 2*sizeof(int))
+    return false;
+  memcpy(&nr, data, sizeof(int));
+  memcpy(&ni, data+sizeof(int), sizeof(int));
+  if(nr < 0 || ni < 0 || size != 2*sizeof(int)+sizeof(Range)*nr+sizeof(int)*ni)
+    return false;
+  nranges = nr;
+  nindices = ni;
+  ranges = new Range[nranges];
+  indices = new int[nindices];
+  data += 2*sizeof(int);
+  memcpy(ranges, data, sizeof(Range)*nranges);
+  memcpy(indices, data+sizeof(Range)*nranges, sizeof(int)*nindices);
+  return true;
+}
 
 bool BipartiteGraph::is_index_in_range(int index, int range)
 {
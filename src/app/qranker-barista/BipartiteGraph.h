@@ -27,6 +27,8 @@ class BipartiteGraph{
 
   void save(ofstream &os);
   void load(ifstream &is);
+  //loads what save() wrote from memory; false if size does not match
+  bool load(const char *data, size_t size);
  private:
   int nranges; //how many ranges
   int nindices; //size of the index array
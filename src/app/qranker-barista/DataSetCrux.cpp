@@ -1,4 +1,5 @@
 #include "DataSetCrux.h"
+#include <cstring>
 #include "SQTParser.h"
 
 Dataset::Dataset() 
@@ -27,7 +28,7 @@ Dataset::Dataset()
 
 Dataset::~Dataset()
 {
-  delete[] psmind_to_features; psmind_to_features = (double*)0;
+  clear_features();
   delete[] psmind_to_label; psmind_to_label = (int*)0;
   delete[] psmind_to_pepind; psmind_to_pepind = (int*)0;
   delete[] psmind_to_scan; psmind_to_scan = (int*)0;
@@ -59,6 +60,90 @@ Dataset::~Dataset()
 
 /****************************************************************************/
 
+bool Dataset :: load_features()
+{
+  clear_features();
+  size_t size = 0;
+  if(features_store.open(in_dir))
+    {
+      char *data = features_store.get("psm", &size);
+      if(data != 0 && size == sizeof(double)*num_psms*num_features)
+	{
+	  psmind_to_features = (double*)data;
+	  return true;
+	}
+      features_store.close();
+    }
+
+  ostringstream fname;
+  fname << in_dir << "/" << "psm";
+  ifstream f_psm_feat(fname.str().c_str(),ios::binary);
+  if(!f_psm_feat.is_open())
+    {
+      cout << "could not open file " << fname.str() <<  " for reading data\n";
+      return false;
+    }
+  psmind_to_features = new double[num_psms*num_features];
+  f_psm_feat.read((char*)psmind_to_features,sizeof(double)*num_psms*num_features);
+  f_psm_feat.close();
+  return true;
+}
+
+template<typename T> bool Dataset :: load_table(const char *name, T *&table, int n)
+{
+  table = new T[n];
+  FeatureStore store;
+  size_t size = 0;
+  const char *data = store.open(in_dir) ? store.get(name, &size) : 0;
+  if(data != 0 && size == sizeof(T)*n)
+    {
+      memcpy(table, data, size);
+      return true;
+    }
+
+  ostringstream fname;
+  fname << in_dir << "/" << name;
+  ifstream f_table(fname.str().c_str(),ios::binary);
+  if(!f_table.is_open())
+    {
+      cout << "could not open file " << fname.str() <<  " for reading data\n";
+      return false;
+    }
+  f_table.read((char*)table,sizeof(T)*n);
+  f_table.close();
+  return true;
+}
+
+bool Dataset :: load_graph(const char *name, BipartiteGraph &graph)
+{
+  FeatureStore store;
+  size_t size = 0;
+  const char *data = store.open(in_dir) ? store.get(name, &size) : 0;
+  if(data != 0 && graph.load(data, size))
+    return true;
+
+  ostringstream fname;
+  fname << in_dir << "/" << name;
+  ifstream f_graph(fname.str().c_str(),ios::binary);
+  if(!f_graph.is_open())
+    {
+      cout << "could not open file " << fname.str() <<  " for reading data\n";
+      return false;
+    }
+  graph.load(f_graph);
+  f_graph.close();
+  return true;
+}
+
+void Dataset :: clear_features()
+{
+  if(features_store.is_open())
+    features_store.close();
+  else
+    delete [] psmind_to_features;
+  psmind_to_features = (double*)0;
+}
+
 void Dataset :: load_data_psm_training()
 {
 
@@ -73,22 +158,13 @@ void Dataset :: load_data_psm_training()
   fname.str("");
 
   //psm features
-  fname << in_dir << "/" << "psm";
-  ifstream f_psm_feat(fname.str().c_str(),ios::binary);
-  if(!f_psm_feat.is_open())
-    {
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-    }
-  psmind_to_features = new double[num_psms*num_features];
-  f_psm_feat.read((char*)psmind_to_features,sizeof(double)*num_psms*num_features);
-  f_psm_feat.close();
-  fname.str("");
+  if(!load_features())
+    return;
 }
 
 void Dataset :: clear_data_psm_training()
 {
-  delete [] psmind_to_features; psmind_to_features = (double*)0;
+  clear_features();
 }
 
 void Dataset :: load_labels_psm_training()
@@ -104,12 +180,8 @@ void Dataset :: load_labels_psm_training()
   fname.str("");
 
   //psmind_to_label
-  fname << in_dir << "/psmind_to_label";
-  ifstream f_psmind_to_label(fname.str().c_str(),ios::binary);
-  psmind_to_label = new int[num_psms];
-  f_psmind_to_label.read((char*)psmind_to_label,sizeof(int)*num_psms);
-  f_psmind_to_label.close();
-  fname.str("");
+  if(!load_table("psmind_to_label", psmind_to_label, num_psms))
+    return;
 }
 
 void Dataset :: clear_labels_psm_training()
@@ -441,70 +513,31 @@ void Dataset :: load_data_prot_training()
   fname.str("");
   
   //psm features
-  fname << in_dir << "/" << "psm";
-  ifstream f_psm_feat(fname.str().c_str(),ios::binary);
-  if(!f_psm_feat.is_open()){
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-  }
-  psmind_to_features = new double[num_psms*num_features];
-  f_psm_feat.read((char*)psmind_to_features,sizeof(double)*num_psms*num_features);
-  f_psm_feat.close();
-  fname.str("");
+  if(!load_features())
+    return;
 
 
   //pepind_to_psminds
-  fname << in_dir << "/pepind_to_psminds";
-  ifstream f_pepind_to_psminds(fname.str().c_str(),ios::binary);
-  if(!f_pepind_to_psminds.is_open()){
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-  }
-  pepind_to_psminds.load(f_pepind_to_psminds);
-  f_pepind_to_psminds.close();
-  fname.str("");
+  if(!load_graph("pepind_to_psminds", pepind_to_psminds))
+    return;
   
   //protind_to_num_all_pep
-  fname << in_dir << "/protind_to_num_all_pep";
-  ifstream f_protind_to_num_all_pep(fname.str().c_str(),ios::binary);
-  if(!f_protind_to_num_all_pep.is_open()){
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-  }
-  protind_to_num_all_pep = new int[num_prot];
-  f_protind_to_num_all_pep.read((char*)protind_to_num_all_pep,sizeof(int)*num_prot);
-  f_protind_to_num_all_pep.close();
-  fname.str("");
+  if(!load_table("protind_to_num_all_pep", protind_to_num_all_pep, num_prot))
+    return;
 
   //protind_to_pepinds
-  fname << in_dir << "/protind_to_pepinds";
-  ifstream f_protind_to_pepinds(fname.str().c_str(),ios::binary);
-  if(!f_protind_to_pepinds.is_open())
-    {
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-    }
-  protind_to_pepinds.load(f_protind_to_pepinds);
-  f_protind_to_pepinds.close();
-  fname.str("");
+  if(!load_graph("protind_to_pepinds", protind_to_pepinds))
+    return;
 
   //pepind_to_protinds
-  fname << in_dir << "/pepind_to_protinds";
-  ifstream f_pepind_to_protinds(fname.str().c_str(),ios::binary);
-  if(!f_pepind_to_protinds.is_open())
-    {
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-    }
-  pepind_to_protinds.load(f_pepind_to_protinds);
-  f_pepind_to_protinds.close();
-  fname.str("");
+  if(!load_graph("pepind_to_protinds", pepind_to_protinds))
+    return;
 
 }
 
 void Dataset :: clear_data_prot_training()
 {
-  delete [] psmind_to_features; psmind_to_features = (double*)0;
+  clear_features();
   delete [] protind_to_num_all_pep; protind_to_num_all_pep = (int*)0;
 }
 
@@ -533,43 +566,16 @@ void Dataset :: load_labels_prot_training()
   fname.str("");
 
   //psmind_to_label
-  fname << in_dir << "/psmind_to_label";
-  ifstream f_psmind_to_label(fname.str().c_str(),ios::binary);
-  if(!f_psmind_to_label.is_open())
-    {
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-    }
-  psmind_to_label = new int[num_psms];
-  f_psmind_to_label.read((char*)psmind_to_label,sizeof(int)*num_psms);
-  f_psmind_to_label.close();
-  fname.str("");
+  if(!load_table("psmind_to_label", psmind_to_label, num_psms))
+    return;
   
   //pepind_to_label
-  fname << in_dir << "/pepind_to_label";
-  ifstream f_pepind_to_label(fname.str().c_str(),ios::binary);
-  if(!f_pepind_to_label.is_open())
-    {
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-    }
-  pepind_to_label = new int[num_pep];
-  f_pepind_to_label.read((char*)pepind_to_label,sizeof(int)*num_pep);
-  f_pepind_to_label.close();
-  fname.str("");
+  if(!load_table("pepind_to_label", pepind_to_label, num_pep))
+    return;
   
   //protind_to_label
-  fname << in_dir << "/protind_to_label";
-  ifstream f_protind_to_label(fname.str().c_str(),ios::binary);
-  if(!f_protind_to_label.is_open())
-    {
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-    }
-  protind_to_label = new int[num_prot];
-  f_protind_to_label.read((char*)protind_to_label,sizeof(int)*num_prot);
-  f_protind_to_label.close();
-  fname.str("");
+  if(!load_table("protind_to_label", protind_to_label, num_prot))
+    return;
 
   //ind_to_pep
   fname << in_dir << "/ind_to_pep";
@@ -977,35 +983,20 @@ void Dataset :: load_data_pep_training()
   fname.str("");
   
   //psm features
-  fname << in_dir << "/" << "psm";
-  ifstream f_psm_feat(fname.str().c_str(),ios::binary);
-  if(!f_psm_feat.is_open()){
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-  }
-  psmind_to_features = new double[num_psms*num_features];
-  f_psm_feat.read((char*)psmind_to_features,sizeof(double)*num_psms*num_features);
-  f_psm_feat.close();
-  fname.str("");
+  if(!load_features())
+    return;
 
 
   //pepind_to_psminds
-  fname << in_dir << "/pepind_to_psminds";
-  ifstream f_pepind_to_psminds(fname.str().c_str(),ios::binary);
-  if(!f_pepind_to_psminds.is_open()){
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-  }
-  pepind_to_psminds.load(f_pepind_to_psminds);
-  f_pepind_to_psminds.close();
-  fname.str("");
+  if(!load_graph("pepind_to_psminds", pepind_to_psminds))
+    return;
   
 }
 
 
 void Dataset :: clear_data_pep_training()
 {
-  delete [] psmind_to_features; psmind_to_features = (double*)0;
+  clear_features();
 }
 
 void Dataset :: load_labels_pep_training()
@@ -1033,30 +1024,12 @@ void Dataset :: load_labels_pep_training()
   fname.str("");
 
   //psmind_to_label
-  fname << in_dir << "/psmind_to_label";
-  ifstream f_psmind_to_label(fname.str().c_str(),ios::binary);
-  if(!f_psmind_to_label.is_open())
-    {
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-    }
-  psmind_to_label = new int[num_psms];
-  f_psmind_to_label.read((char*)psmind_to_label,sizeof(int)*num_psms);
-  f_psmind_to_label.close();
-  fname.str("");
+  if(!load_table("psmind_to_label", psmind_to_label, num_psms))
+    return;
   
   //pepind_to_label
-  fname << in_dir << "/pepind_to_label";
-  ifstream f_pepind_to_label(fname.str().c_str(),ios::binary);
-  if(!f_pepind_to_label.is_open())
-    {
-      cout << "could not open file " << fname.str() <<  " for reading data\n";
-      return;
-    }
-  pepind_to_label = new int[num_pep];
-  f_pepind_to_label.read((char*)pepind_to_label,sizeof(int)*num_pep);
-  f_pepind_to_label.close();
-  fname.str("");
+  if(!load_table("pepind_to_label", pepind_to_label, num_pep))
+    return;
 }
 
 void Dataset :: clear_labels_pep_training()
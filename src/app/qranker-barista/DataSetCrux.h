@@ -7,6 +7,7 @@
 #include <cmath>
 #include <map>
 #include "BipartiteGraph.h"
+#include "FeatureStore.h"
 using namespace std;
 
 
@@ -86,6 +87,14 @@ class Dataset
 
 
  protected:
+  //read a training table from in_dir/feature_store if it has it, else
+  //from its own file; false, after a message, if neither can be read
+  bool load_features();
+  template<typename T> bool load_table(const char *name, T *&table, int n);
+  bool load_graph(const char *name, BipartiteGraph &graph);
+  void clear_features();
+
+  FeatureStore features_store; //holds psmind_to_features if it is mapped
   int num_psms;
   int num_pos_psms;
   int num_neg_psms;
@@ -0,0 +1,183 @@
+#include "FeatureStore.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "app/tide/mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "io/carp.h"
+#include "util/FileUtils.h"
+
+static const char magic[8] = "CRUXFST";
+
+//the tables Dataset reads for training, in the order they are stored
+const char* FeatureStore::table_names[] = {
+  "summary",
+  "psm",
+  "psmind_to_label",
+  "psmind_to_pepind",
+  "pepind_to_label",
+  "pepind_to_psminds",
+  "pepind_to_protinds",
+  "protind_to_label",
+  "protind_to_num_all_pep",
+  "protind_to_pepinds",
+  0
+};
+
+FeatureStore::FeatureStore() : data(0), data_size(0)
+{
+}
+
+FeatureStore::~FeatureStore()
+{
+  close();
+}
+
+string FeatureStore::file_name(const string &dir)
+{
+  return dir + "/feature_store";
+}
+
+bool FeatureStore::write(const string &dir)
+{
+  vector<Section> secs;
+  unsigned long long offset = sizeof(magic) + 2*sizeof(unsigned int);
+  for(int i = 0; table_names[i] != 0; i++)
+    {
+      string table = dir + "/" + table_names[i];
+      if(!FileUtils::Exists(table))
+	continue;
+      Section s;
+      memset(s.name, 0, sizeof(s.name));
+      strncpy(s.name, table_names[i], sizeof(s.name)-1);
+      s.size = FileUtils::Size(table);
+      secs.push_back(s);
+      offset += sizeof(Section);
+    }
+  for(unsigned int i = 0; i < secs.size(); i++)
+    {
+      offset = (offset+7) & ~7ULL;
+      secs[i].offset = offset;
+      offset += secs[i].size;
+    }
+
+  string fname = file_name(dir);
+  ofstream os(fname.c_str(), ios::binary);
+  if(!os.is_open())
+    {
+      carp(CARP_WARNING, "could not open %s for writing", fname.c_str());
+      return false;
+    }
+  unsigned int v = version, n = secs.size();
+  os.write(magic, sizeof(magic));
+  os.write((const char*)&v, sizeof(v));
+  os.write((const char*)&n, sizeof(n));
+  for(unsigned int i = 0; i < secs.size(); i++)
+    os.write((const char*)&secs[i], sizeof(Section));
+  vector<char> buf;
+  for(unsigned int i = 0; i < secs.size(); i++)
+    {
+      while((unsigned long long)os.tellp() < secs[i].offset)
+	os.put('\0');
+      ifstream is((dir + "/" + secs[i].name).c_str(), ios::binary);
+      buf.resize(secs[i].size);
+      if(!buf.empty())
+	is.read(&buf[0], buf.size());
+      if((unsigned long long)is.gcount() != secs[i].size)
+	{
+	  carp(CARP_WARNING, "could not read %s/%s", dir.c_str(), secs[i].name);
+	  os.close();
+	  remove(fname.c_str());
+	  return false;
+	}
+      if(!buf.empty())
+	os.write(&buf[0], buf.size());
+    }
+  os.close();
+  if(os.fail())
+    {
+      remove(fname.c_str());
+      return false;
+    }
+  return true;
+}
+
+bool FeatureStore::open(const string &dir)
+{
+  close();
+  string fname = file_name(dir);
+  if(!FileUtils::Exists(fname))
+    return false;
+  data_size = FileUtils::Size(fname);
+  int fd = data_size == 0 ? -1 : ::open(fname.c_str(), O_RDONLY);
+  void *map = fd < 0 ? MAP_FAILED : mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(fd >= 0)
+    ::close(fd);
+  if(map == MAP_FAILED)
+    {
+      data_size = 0;
+      return false;
+    }
+  data = (char*)map;
+
+  //check the header and the section table before trusting them
+  size_t header = sizeof(magic) + 2*sizeof(unsigned int);
+  unsigned int v = 0, n = 0;
+  if(data_size >= header)
+    {
+      memcpy(&v, data+sizeof(magic), sizeof(v));
+      memcpy(&n, data+sizeof(magic)+sizeof(v), sizeof(n));
+    }
+  if(data_size < header || memcmp(data, magic, sizeof(magic)) != 0 || v != version ||
+     n > (data_size-header)/sizeof(Section))
+    {
+      carp(CARP_WARNING, "ignoring %s, which is not a version %d feature store",
+	   fname.c_str(), version);
+      close();
+      return false;
+    }
+  sections.resize(n);
+  if(n > 0)
+    memcpy(&sections[0], data+header, n*sizeof(Section));
+  for(unsigned int i = 0; i < n; i++)
+    {
+      sections[i].name[sizeof(sections[i].name)-1] = '\0';
+      if(sections[i].offset > data_size || sections[i].size > data_size-sections[i].offset)
+	{
+	  carp(CARP_WARNING, "ignoring truncated feature store %s", fname.c_str());
+	  close();
+	  return false;
+	}
+    }
+  return true;
+}
+
+void FeatureStore::close()
+{
+  if(data != 0)
+    munmap(data, data_size);
+  data = 0;
+  data_size = 0;
+  sections.clear();
+}
+
+char* FeatureStore::get(const string &name, size_t *size) const
+{
+  for(unsigned int i = 0; i < sections.size(); i++)
+    {
+      if(name == sections[i].name)
+	{
+	  *size = sections[i].size;
+	  return data+sections[i].offset;
+	}
+    }
+  return 0;
+}
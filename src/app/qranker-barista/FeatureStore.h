@@ -0,0 +1,48 @@
+#ifndef FEATURESTORE_H
+#define FEATURESTORE_H
+#include <string>
+#include <vector>
+using namespace std;
+
+/**
+ * One file, <dir>/feature_store, holding the lookup tables that q-ranker,
+ * barista and the peptide ranker train on: the summary, the PSM feature
+ * matrix, the labels and the PSM-peptide-protein index arrays. SQTParser
+ * writes it next to the separate table files; Dataset maps it into memory
+ * and uses the feature matrix in place, so a re-run on the same tables does
+ * not have to read them again.
+ *
+ * Layout, in native byte order: the 8 byte magic "CRUXFST", a 4 byte
+ * version and a 4 byte section count, then for every section a 40 byte
+ * NUL-padded table name, an 8 byte offset and an 8 byte size, then the
+ * contents of the table files, each starting on an 8 byte boundary.
+ */
+class FeatureStore
+{
+ public:
+  static const unsigned int version = 1;
+
+  FeatureStore();
+  ~FeatureStore();
+
+  //writes dir/feature_store from the training tables in dir
+  static bool write(const string &dir);
+  //maps dir/feature_store; false if it is missing or not this version
+  bool open(const string &dir);
+  void close();
+  inline bool is_open() const {return data != 0;}
+  //returns the contents of the named table and sets *size, or 0 if absent.
+  //The mapping is private, so the contents may be changed in memory.
+  char* get(const string &name, size_t *size) const;
+  static string file_name(const string &dir);
+
+ protected:
+  struct Section {char name[40]; unsigned long long offset; unsigned long long size;};
+  static const char* table_names[];
+
+  char *data;
+  size_t data_size;
+  vector<Section> sections;
+};
+
+#endif //FEATURESTORE_H
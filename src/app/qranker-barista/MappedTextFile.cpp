@@ -0,0 +1,129 @@
+#include "MappedTextFile.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+MappedTextFile :: MappedTextFile(const string &path)
+  : opened(false), data(""), size(0), mapped(false)
+{
+#ifndef _MSC_VER
+  struct stat st;
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return;
+  bool empty = false;
+  if(fstat(fd, &st) == 0)
+    {
+      if(st.st_size == 0)
+	empty = true;
+      else
+	{
+	  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	  if(p != MAP_FAILED)
+	    {
+#ifdef MADV_SEQUENTIAL
+	      madvise(p, st.st_size, MADV_SEQUENTIAL);
+#endif
+	      data = (const char*)p;
+	      size = st.st_size;
+	      mapped = true;
+	    }
+	}
+    }
+  close(fd);
+  opened = mapped || empty;
+  if(opened)
+    return;
+#endif
+  FILE *f = fopen(path.c_str(), "rb");
+  if(f == NULL)
+    return;
+  char chunk[1 << 16];
+  size_t n;
+  while((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    buffer.insert(buffer.end(), chunk, chunk+n);
+  fclose(f);
+  size = buffer.size();
+  if(size > 0)
+    data = &buffer[0];
+  opened = true;
+}
+
+MappedTextFile :: ~MappedTextFile()
+{
+#ifndef _MSC_VER
+  if(mapped)
+    munmap((void*)data, size);
+#endif
+}
+
+const char* MappedTextFile :: line_end(const char *p, const char *end)
+{
+  const char *e = (const char*)memchr(p, '\n', end-p);
+  if(e == NULL)
+    return end;
+  if(e > p && e[-1] == '\r')
+    e--;
+  return e;
+}
+
+const char* MappedTextFile :: next_record(const char *p,
+                                          bool (*is_record_start)(const char *line, const char *end)) const
+{
+  const char *e = end();
+  //from the start of the next line, unless p is one already
+  if(p > data && p < e && p[-1] != '\n')
+    {
+      const char *nl = (const char*)memchr(p, '\n', e-p);
+      p = nl == NULL ? e : nl+1;
+    }
+  while(p < e && is_record_start != NULL && !is_record_start(p, e))
+    {
+      const char *nl = (const char*)memchr(p, '\n', e-p);
+      p = nl == NULL ? e : nl+1;
+    }
+  return p;
+}
+
+bool MappedTextFile :: next_token(const char **p, const char *end, const char **tok, const char **tok_end)
+{
+  const char *q = *p;
+  while(q < end && (*q == ' ' || *q == '\t' || *q == '\r'))
+    q++;
+  if(q == end)
+    {
+      *p = q;
+      return false;
+    }
+  *tok = q;
+  while(q < end && *q != ' ' && *q != '\t' && *q != '\r')
+    q++;
+  *tok_end = q;
+  *p = q;
+  return true;
+}
+
+double MappedTextFile :: to_double(const char *tok, const char *tok_end)
+{
+  char buf[64];
+  size_t n = tok_end-tok < (long)sizeof(buf)-1 ? tok_end-tok : sizeof(buf)-1;
+  memcpy(buf, tok, n);
+  buf[n] = '\0';
+  return strtod(buf, NULL);
+}
+
+int MappedTextFile :: to_int(const char *tok, const char *tok_end)
+{
+  char buf[64];
+  size_t n = tok_end-tok < (long)sizeof(buf)-1 ? tok_end-tok : sizeof(buf)-1;
+  memcpy(buf, tok, n);
+  buf[n] = '\0';
+  return atoi(buf);
+}
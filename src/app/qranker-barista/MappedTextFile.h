@@ -0,0 +1,39 @@
+#ifndef MAPPEDTEXTFILE_H
+#define MAPPEDTEXTFILE_H
+#include <string>
+#include <vector>
+using namespace std;
+
+//A text file mapped into memory (read whole where there is no mmap), for
+//parsers that read its fields in place and split it into chunks of whole
+//records to parse on several threads.
+class MappedTextFile{
+ public:
+  explicit MappedTextFile(const string &path);
+  ~MappedTextFile();
+  inline bool is_open() const {return opened;}
+  inline const char* begin() const {return data;}
+  inline const char* end() const {return data+size;}
+
+  //the first line at or after p that starts a record, or end(); with
+  //is_record_start NULL every line starts one
+  const char* next_record(const char *p,
+                          bool (*is_record_start)(const char *line, const char *end)) const;
+  //the end of the line at p, before its newline, or end
+  static const char* line_end(const char *p, const char *end);
+  //the next run of characters other than spaces and tabs in [*p, end),
+  //moving *p past it; false if there is none
+  static bool next_token(const char **p, const char *end, const char **tok, const char **tok_end);
+  //the number in [tok, tok_end), which need not be null-terminated
+  static double to_double(const char *tok, const char *tok_end);
+  static int to_int(const char *tok, const char *tok_end);
+
+ protected:
+  bool opened;
+  const char *data;
+  size_t size;
+  bool mapped;
+  vector<char> buffer;
+};
+
+#endif
@@ -32,6 +32,16 @@ void Sigmoid :: bprop(State &down, State &up)
     down.dx[k] = up.dx[k]*(1.0-up.x[k])*up.x[k];
 }
 
+void Sigmoid :: fprop_batch(double *x, int num_examples, int stride)
+{
+  for(int k = 0; k < num_neurons; k++)
+    {
+      double *xk = x+k*stride;
+      for(int b = 0; b < num_examples; b++)
+	xk[b] = 1.0/(1.0+exp(-xk[b]));
+    }
+}
+
 
 /******************** Linear*************************/
 void Linear :: make_random()
@@ -62,6 +72,7 @@ void Linear :: resize(int m, int n, int has_b)
       dbias = new double[num_neurons];
       num_refs = new int[1];
       num_refs[0] = 1;
+      owns_weights = 1;
   }
   for(int k = 0; k < num_neurons; k++)
     {
@@ -84,8 +95,14 @@ void Linear :: clear()
       num_refs[0]--;
       if(num_refs[0] < 1)
 	{
-	  delete[] w; w = 0;
-	  delete[] bias; bias = 0;
+	  if(owns_weights)
+	    {
+	      delete[] w;
+	      delete[] bias;
+	    }
+	  w = 0;
+	  bias = 0;
+	  owns_weights = 1;
 	  delete[] dw; dw = 0;
 	  delete[] dbias; dbias = 0;
 	  delete[] num_refs; num_refs = 0;
@@ -134,6 +151,31 @@ void Linear :: clone(Linear &L)
   dbias = L.dbias;
   num_refs = L.num_refs;
   num_refs[0]++;
+  owns_weights = L.owns_weights;
+}
+
+void Linear :: share_weights(Linear &L)
+{
+  assert(L.num_neurons == num_neurons);
+  assert(L.num_features == num_features);
+  assert(num_refs && num_refs[0] == 1);
+  if(owns_weights)
+    {
+      delete[] w;
+      delete[] bias;
+    }
+  w = L.w;
+  bias = L.bias;
+  owns_weights = 0;
+}
+
+void Linear :: add_gradients(Linear &L)
+{
+  for(int i = 0; i < num_neurons*num_features; i++)
+    dw[i] += L.dw[i];
+  if(has_bias)
+    for(int k = 0; k < num_neurons; k++)
+      dbias[k] += L.dbias[k];
 }
 
 
@@ -159,6 +201,31 @@ void Linear :: fprop(State &down, State &up)
 }
 
 
+/**
+ * Same sums as fprop, in the same order, so the scores are identical; the
+ * innermost loop runs over the examples of a block and vectorizes.
+ */
+void Linear :: fprop_batch(const double *down, double *up, int num_examples, int stride)
+{
+  for(int k = 0; k < num_neurons; k++)
+    {
+      double *uk = up+k*stride;
+      for(int b = 0; b < num_examples; b++)
+	uk[b] = 0.0;
+      for(int j = 0; j < num_features; j++)
+	{
+	  double wkj = w[k*num_features+j];
+	  const double *dj = down+j*stride;
+	  for(int b = 0; b < num_examples; b++)
+	    uk[b] += wkj*dj[b];
+	}
+      //if there is a bias
+      if(has_bias)
+	for(int b = 0; b < num_examples; b++)
+	  uk[b] += bias[k];
+    }
+}
+
 void Linear :: bprop(State &down, State &up)
 {
   memset(down.dx,0,sizeof(double)*num_features);
@@ -291,6 +358,21 @@ void NeuralNet :: clone(NeuralNet &N)
   resize_states();
 }
 
+void NeuralNet :: share_weights(NeuralNet &N)
+{
+  assert(is_linear == N.is_linear);
+  lin1.share_weights(N.lin1);
+  if(!is_linear)
+    lin2.share_weights(N.lin2);
+}
+
+void NeuralNet :: add_gradients(NeuralNet &N)
+{
+  lin1.add_gradients(N.lin1);
+  if(!is_linear)
+    lin2.add_gradients(N.lin2);
+}
+
 
 double* NeuralNet :: fprop(double *x)
 {
@@ -307,6 +389,37 @@ double* NeuralNet :: fprop(double *x)
 
 }
 
+void NeuralNet :: fprop_batch(double **x, int num_examples, double *scores)
+{
+  int num_features = lin1.get_num_features();
+  //one row of batch_size values per feature or neuron
+  vector<double> batch_x(num_features*batch_size);
+  vector<double> batch_h(lin1.get_num_neurons()*batch_size);
+  vector<double> batch_out(batch_size);
+  for(int begin = 0; begin < num_examples; begin += batch_size)
+    {
+      int n = num_examples-begin;
+      if(n > batch_size)
+	n = batch_size;
+      //lay the block out one feature per row
+      for(int b = 0; b < n; b++)
+	{
+	  double *xb = x[begin+b];
+	  for(int j = 0; j < num_features; j++)
+	    batch_x[j*batch_size+b] = xb[j];
+	}
+      if(is_linear)
+	lin1.fprop_batch(&batch_x[0], &batch_out[0], n, batch_size);
+      else
+	{
+	  lin1.fprop_batch(&batch_x[0], &batch_h[0], n, batch_size);
+	  sigm1.fprop_batch(&batch_h[0], n, batch_size);
+	  lin2.fprop_batch(&batch_h[0], &batch_out[0], n, batch_size);
+	}
+      memcpy(scores+begin, &batch_out[0], sizeof(double)*n);
+    }
+}
+
 
 void NeuralNet :: clear_gradients()
 {
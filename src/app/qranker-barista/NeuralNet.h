@@ -19,9 +19,10 @@ class State
    len_dx(0),
    x((double*)0),  
    dx((double*)0)  {}
-  inline void resize(int n) {clear(); x = new double[n]; len_x=n; dx = new double[n]; len_dx = n;}
-  inline void resize_dx(int n) {clear(); dx = new double[n]; len_dx = n;}
-  inline void resize_x(int n) {clear(); x = new double[n]; len_x = n;}
+  //the resize functions keep the arrays if they already have the right size
+  inline void resize(int n) {if(len_x == n && len_dx == n) return; clear(); x = new double[n]; len_x=n; dx = new double[n]; len_dx = n;}
+  inline void resize_dx(int n) {if(len_x == 0 && len_dx == n) return; clear(); dx = new double[n]; len_dx = n;}
+  inline void resize_x(int n) {if(len_x == n && len_dx == 0) return; clear(); x = new double[n]; len_x = n;}
   inline void clear(){if(len_x) delete[] x; if(len_dx) delete[] dx; len_x = 0; len_dx=0;}
   ~State(){clear();}
  
@@ -49,6 +50,8 @@ public:
  
   void fprop(State& down, State &up);
   void bprop(State &down, State &up);
+  //applies the sigmoid in place to num_neurons rows of num_examples values
+  void fprop_batch(double *x, int num_examples, int stride);
    
  protected:
   int num_neurons;
@@ -63,6 +66,7 @@ class Linear
    num_neurons(0),
    num_features(0),
    has_bias(1),
+   owns_weights(1),
    num_refs(0),
    w(0),
    bias(0),
@@ -75,6 +79,10 @@ class Linear
   Linear& operator=(Linear &L);
   void copy(Linear &L);
   void clone(Linear &L);
+  //uses the weights of L, which must outlive it, in place of its own, but
+  //keeps its own gradients; call before cloning
+  void share_weights(Linear &L);
+  void add_gradients(Linear &L);
   void make_random();
   
   inline void set_num_features(int nf) {num_features = nf;}
@@ -92,6 +100,8 @@ class Linear
  
   void fprop(State &down, State &up);
   void bprop(State &down, State &up);
+  //down and up hold one row of num_examples values per feature and neuron
+  void fprop_batch(const double *down, double *up, int num_examples, int stride);
   void clear_gradients();
   void update(double mu, double weight_decay=0.0);
   void update1(double mu, double weight_decay = 0.0);
@@ -100,6 +110,7 @@ class Linear
   int num_neurons;
   int num_features;
   int has_bias;
+  int owns_weights;
 
   int *num_refs;
   double *w;
@@ -119,10 +130,17 @@ class NeuralNet {
   void initialize(int nfeatures, int num_hu, int is_lin, int has_bias);
   NeuralNet& operator=(NeuralNet &N);
   void clone(NeuralNet &N);
+  //for parallel training: the weights of N, with gradients of its own
+  void share_weights(NeuralNet &N);
+  //adds the gradients of N to its own
+  void add_gradients(NeuralNet &N);
   void copy(NeuralNet &N);
   void make_random();
 
   double* fprop(double *down);
+  //scores[i] = fprop(x[i])[0], computed a block of examples at a time;
+  //the net is left as it was, so several threads may call it at once
+  void fprop_batch(double **x, int num_examples, double *scores);
   void clear_gradients();
   double* bprop(double *up);
   void update(double mu, double weight_decay=0.0);
@@ -146,6 +164,9 @@ class NeuralNet {
   State s2;
   Linear lin2;
   State finish;
+
+  //block of examples of fprop_batch
+  static const int batch_size = 64;
 };
 
 
@@ -8,8 +8,10 @@
 #include <string>
 #include <math.h>
 using namespace std;
+#include <boost/bind.hpp>
 #include "PSMScores.h"
 #include "util/utils.h"
+#include "util/ThreadPool.h"
 
 inline bool operator>(const PSMScoreHolder &one, const PSMScoreHolder &other) 
     {return (one.score>other.score);}
@@ -45,6 +47,47 @@ void PSMScores::clear()
 double PSMScores::pi0 = 0.9;
 
 
+/**
+ * Scores PSMs [begin, end) of features with the net.
+ */
+static void fpropBlock(NeuralNet* n, vector<double*>* features,
+                       vector<double>* net_scores, int begin, int end) {
+  n->fprop_batch(&(*features)[begin], end - begin, &(*net_scores)[begin]);
+}
+
+/**
+ * Set the score of every PSM to its output from the net.
+ *
+ * The PSMs are scored in blocks on the thread pool. Each score depends only
+ * on its PSM and the net, so the scores are the same on any number of
+ * threads.
+ */
+void PSMScores::calcScores(Dataset &d, NeuralNet &n) {
+  if (scores.empty()) {
+    return;
+  }
+  vector<double*> features(scores.size());
+  vector<double> net_scores(scores.size());
+  for (unsigned int i = 0; i < scores.size(); i++) {
+    features[i] = d.psmind2features(scores[i].psmind);
+  }
+  const int BLOCK_SIZE = 4096;
+  int num_psms = scores.size();
+  if (num_psms <= BLOCK_SIZE || ThreadPool::Threads() == 1) {
+    fpropBlock(&n, &features, &net_scores, 0, num_psms);
+  } else {
+    ThreadPool::TaskGroup blocks;
+    for (int begin = 0; begin < num_psms; begin += BLOCK_SIZE) {
+      blocks.Run(boost::bind(&fpropBlock, &n, &features, &net_scores,
+                             begin, min(begin + BLOCK_SIZE, num_psms)));
+    }
+    blocks.Wait();
+  }
+  for (unsigned int i = 0; i < scores.size(); i++) {
+    scores[i].score = net_scores[i];
+  }
+}
+
 /**
  * Calculate the number of targets that score above a specified FDR.
  */
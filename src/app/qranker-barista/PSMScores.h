@@ -4,6 +4,7 @@
 #include <algorithm>
 using namespace std;
 #include "DataSetCrux.h"
+#include "NeuralNet.h"
 
 
 class PSMScoreHolder{
@@ -28,6 +29,7 @@ public:
     static double pi0;
     double factor;
 
+    void calcScores(Dataset &d, NeuralNet &n);
     int calcOverFDR(double fdr);
     void calcMultiOverFDR(vector<double> &fdr, vector<int> &overFDR);
     inline PSMScoreHolder& operator[](int ix){return scores[ix];}    
@@ -33,16 +33,7 @@ PepRanker::~PepRanker()
 
 int PepRanker :: getOverFDRPSM(PSMScores &set, NeuralNet &n, double fdr)
 {
-  double *r;
-  double* featVec;
-
-  for(int i = 0; i < set.size(); i++)
-    {
-      featVec = d.psmind2features(set[i].psmind);
-      r = n.fprop(featVec);
-      set[i].score = r[0];
-
-    }
+  set.calcScores(d, n);
   return set.calcOverFDR(fdr);
 }
 
@@ -32,31 +32,14 @@ QRanker::~QRanker()
 
 int QRanker :: getOverFDR(PSMScores &set, NeuralNet &n, double fdr)
 {
-  double *r;
-  double* featVec;
-
-  for(int i = 0; i < set.size(); i++)
-    {
-      featVec = d.psmind2features(set[i].psmind);
-      r = n.fprop(featVec);
-      set[i].score = r[0];
-
-    }
+  set.calcScores(d, n);
   return set.calcOverFDR(fdr);
 }
 
 
 void QRanker :: getMultiFDR(PSMScores &set, NeuralNet &n, vector<double> &qvalues)
 {
-  double *r;
-  double* featVec;
-   
-  for(int i = 0; i < set.size(); i++)
-    {
-      featVec = d.psmind2features(set[i].psmind);
-      r = n.fprop(featVec);
-      set[i].score = r[0];
-    }
+  set.calcScores(d, n);
  
   for(unsigned int ct = 0; ct < qvalues.size(); ct++)
     overFDRmulti[ct] = 0;
@@ -1188,7 +1171,8 @@ vector<string> QRanker::getOptions() const {
     "verbosity",
      "list-of-files",
     "feature-file-out",
-    "spectrum-parser"
+    "spectrum-parser",
+    "num-threads"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -1,4 +1,7 @@
 #include "SQTParser.h"
+#include "MappedTextFile.h"
+#include "util/ThreadPool.h"
+#include <boost/bind.hpp>
 
 /******************************/
 
@@ -892,6 +895,78 @@ int SQTParser :: parse_sqt_spectrum_matches(ifstream &is, sqt_match &m)
   
 }
 
+//the parallel parse reads a file this many bytes per thread at a time
+static const size_t SQT_CHUNK_BYTES = 8 << 20;
+
+static bool is_sqt_spectrum_line(const char *line, const char *end)
+{
+  return line[0] == 'S' && (line+1 == end || line[1] == '\t' || line[1] == ' ');
+}
+
+void SQTParser :: parse_sqt_chunk(const char *begin, const char *end, vector<sqt_match> *matches)
+{
+  sqt_match *m = NULL;
+  int num_proteins_in_match = 0;
+  const char *tok, *tok_end;
+  for(const char *line = begin; line < end; )
+    {
+      const char *e = MappedTextFile::line_end(line, end);
+      const char *p = line;
+      if(MappedTextFile::next_token(&p, e, &tok, &tok_end) && tok_end-tok == 1)
+	{
+	  if(*tok == 'S')
+	    {
+	      if(m != NULL && !m->xcorr_rank.empty())
+		m->num_proteins_in_match.push_back(num_proteins_in_match);
+	      matches->push_back(sqt_match());
+	      m = &matches->back();
+	      //scan begin, scan end, charge, two unused fields, precursor ion
+	      //mass, two unused fields and the number of matches considered,
+	      //as read_S_line() reads them
+	      double fields[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+	      for(int i = 0; i < 9 && MappedTextFile::next_token(&p, e, &tok, &tok_end); i++)
+		fields[i] = MappedTextFile::to_double(tok, tok_end);
+	      m->scan = (int)fields[0];
+	      m->charge = (int)fields[2];
+	      m->precursor_mass = fields[5];
+	      m->num_sequence_comparisons = (int)fields[8];
+	      num_proteins_in_match = 0;
+	    }
+	  else if(*tok == 'M' && m != NULL)
+	    {
+	      if(!m->xcorr_rank.empty())
+		m->num_proteins_in_match.push_back(num_proteins_in_match);
+	      num_proteins_in_match = 0;
+	      double fields[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	      for(int i = 0; i < 8 && MappedTextFile::next_token(&p, e, &tok, &tok_end); i++)
+		fields[i] = i == 0 || i == 1 || i == 6 ?
+		  MappedTextFile::to_int(tok, tok_end) : MappedTextFile::to_double(tok, tok_end);
+	      m->xcorr_rank.push_back((int)fields[0]);
+	      m->sp_rank.push_back((int)fields[1]);
+	      m->calc_mass.push_back(fields[2]);
+	      m->delta_cn.push_back(fields[3]);
+	      m->xcorr_score.push_back(fields[4]);
+	      m->sp_score.push_back(fields[5]);
+	      m->num_ions_matched.push_back((int)fields[6]);
+	      m->num_total_ions.push_back(fields[7]);
+	      if(MappedTextFile::next_token(&p, e, &tok, &tok_end))
+		m->peptides.push_back(string(tok, tok_end));
+	      else
+		m->peptides.push_back(string());
+	    }
+	  else if(*tok == 'L' && m != NULL && MappedTextFile::next_token(&p, e, &tok, &tok_end))
+	    {
+	      m->proteins.push_back(string(tok, tok_end));
+	      num_proteins_in_match++;
+	    }
+	}
+      line = e < end ? (const char*)memchr(e, '\n', end-e) : end;
+      line = line == NULL ? end : line+1;
+    }
+  if(m != NULL && !m->xcorr_rank.empty())
+    m->num_proteins_in_match.push_back(num_proteins_in_match);
+}
+
 void SQTParser :: read_sqt_file(ifstream &is, string &decoy_prefix, int final_hits, enzyme enz, bool decoy)
 {
   int cn = 0;
@@ -1279,6 +1354,7 @@ void SQTParser :: clean_up(string dir)
   remove(fname.str().c_str());
   fname.str("");
 
+  remove(FeatureStore::file_name(out_dir).c_str());
 }
 
 
@@ -1492,13 +1568,38 @@ void SQTParser :: digest_database(ifstream &f_db, enzyme e)
 
 
 bool  SQTParser :: read_search_results(string& cur_fname, bool decoy) {
-  ifstream f_sqt(cur_fname.c_str());
+  MappedTextFile f_sqt(cur_fname);
   if(!f_sqt.is_open()){
     carp(CARP_WARNING, "could not open sqt file: %s", cur_fname.c_str());
     return false; 
   }
-      read_sqt_file(f_sqt, decoy_prefix, fhps,e, decoy);
-      f_sqt.close();
+  //the file is parsed on all the threads a round of chunks at a time, each
+  //chunk whole spectra, and the spectra are then added in file order
+  int num_chunks = ThreadPool::Threads();
+  vector< vector<sqt_match> > chunks(num_chunks);
+  const char *p = f_sqt.next_record(f_sqt.begin(), is_sqt_spectrum_line);
+  while(p < f_sqt.end())
+    {
+      ThreadPool::TaskGroup group;
+      for(int i = 0; i < num_chunks; i++)
+	{
+	  size_t left = f_sqt.end()-p;
+	  const char *chunk_end = f_sqt.next_record(p+min(left, SQT_CHUNK_BYTES),
+						    is_sqt_spectrum_line);
+	  chunks[i].clear();
+	  group.Run(boost::bind(&SQTParser::parse_sqt_chunk, p, chunk_end, &chunks[i]));
+	  p = chunk_end;
+	}
+      group.Wait();
+      for(int i = 0; i < num_chunks; i++)
+	for(unsigned int j = 0; j < chunks[i].size(); j++)
+	  {
+	    sqt_match &sm = chunks[i][j];
+	    int num_hits = sm.xcorr_rank.size();
+	    add_matches_to_tables(sm, decoy_prefix, num_hits, fhps, decoy);
+	    extract_features(sm, num_hits, fhps, e);
+	  }
+    }
   return true; 
 }
 
@@ -1587,6 +1688,9 @@ int SQTParser :: run()
   //save the data
   fill_graphs_and_save_data(out_dir);
   close_files();
+  //and pack the training tables into one file for Dataset to map
+  if(!FeatureStore::write(out_dir))
+    carp(CARP_WARNING, "could not write the feature store in %s", out_dir.c_str());
   
   return 1;
 }
@@ -20,6 +20,7 @@
 #include <cstring>
 #include "SpecFeatures.h"
 #include "BipartiteGraph.h"
+#include "FeatureStore.h"
 
 #include "app/CruxApplication.h"
 #include "io/carp.h"
@@ -97,6 +98,9 @@ class SQTParser{
 
   void read_sqt_file(ifstream &is, string &decoy_prefix, int final_hits_per_spectrum, enzyme enz, bool decoy);
   int parse_sqt_spectrum_matches(ifstream &is, sqt_match &m);
+  //parses the spectra of the sqt text [begin, end), which starts at an S line,
+  //in place; safe to run on several chunks of a file at once
+  static void parse_sqt_chunk(const char *begin, const char *end, vector<sqt_match> *matches);
   void read_S_line(ifstream &is, sqt_match &m);
   void read_M_line(ifstream &is, sqt_match &m);
   void digest_database(ifstream &f_db, enzyme e);
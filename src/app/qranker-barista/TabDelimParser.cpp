@@ -87,19 +87,23 @@ TabDelimParser :: ~TabDelimParser()
 
 void TabDelimParser :: get_tokens(string &line, vector<string>&tokens, string &delim)
 {
-  tokens.erase(tokens.begin(), tokens.end());
-  string tmp = line;
-  string tok;
-  size_t pos = tmp.find(delim);
-  while(pos != string::npos)
+  //the tokens are reused line to line, so that their strings keep their
+  //buffers, and the line is scanned once
+  size_t n = 0;
+  size_t start = 0;
+  size_t pos = line.find(delim);
+  while(true)
     {
-      tok = tmp.substr(0,pos);
-      tokens.push_back(tok);
-      tmp = tmp.substr(pos+1, tmp.size());
-      pos = tmp.find(delim);
+      if(n == tokens.size())
+	tokens.push_back(string());
+      size_t stop = pos == string::npos ? line.size() : pos;
+      tokens[n++].assign(line, start, stop-start);
+      if(pos == string::npos)
+	break;
+      start = pos+1;
+      pos = line.find(delim, start);
     }
-  //last token
-  tokens.push_back(tmp);
+  tokens.resize(n);
 }
 
 void TabDelimParser :: first_pass(ifstream &fin)
@@ -1,6 +1,8 @@
 // original author: Benjamin Diament
 // subsequently modified by Attila Kertesz-Farkas, Jeff Howbert
+#include <algorithm>
 #include <deque>
+#include <limits>
 #include <gflags/gflags.h>
 #include "records.h"
 #include "peptides.pb.h"
@@ -9,60 +11,295 @@
 #include "records_to_vector-inl.h"
 #include "theoretical_peak_set.h"
 #include "compiler.h"
+#include "search_mods.h"
 #include "app/TideMatchSet.h"
 #define CHECK(x) GOOGLE_CHECK((x))
 
 DEFINE_int32(fifo_page_size, 1, "Page size for FIFO allocator, in megs");
 
+// For finding the first peptide of a window in a queue sorted by mass.
+static bool LighterThan(const Peptide* peptide, double mass) {
+  return peptide->Mass() < mass;
+}
+
 ActivePeptideQueue::ActivePeptideQueue(RecordReader* reader,
                                        const vector<const pb::Protein*>&
-                                       proteins)
+                                       proteins,
+                                       ScoringBackend backend)
   : reader_(reader),
+    shards_(NULL),
+    read_ahead_(NULL),
+    search_mods_(NULL),
     proteins_(proteins),
     theoretical_peak_set_(2000),   // probably overkill, but no harm
     theoretical_b_peak_set_(200),  // probably overkill, but no harm
-    active_targets_(0), active_decoys_(0),
-    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20),
-    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20),
-    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20) {
+    use_stored_peaks_(false),
+    use_fragment_index_(false),
+    backend_(backend),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false, MEMORY_PEPTIDE_WINDOW),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20, backend == SCORING_JIT),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20, backend == SCORING_JIT),
+    active_targets_(0), active_decoys_(0) {
   CHECK(reader_->OK());
   compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
   compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+  indexer_prog1_ = new TheoreticalPeakIndexer(&fifo_alloc_prog1_);
+  indexer_prog2_ = new TheoreticalPeakIndexer(&fifo_alloc_prog2_);
   peptide_centric_ = false;
   elution_window_ = 0;
+  peptide_rtimes_ = NULL;
+  rtime_tolerance_ = 0;
+  spectrum_rtime_ = 0;
+  decoys_ = false;
+  window_ = NULL;
+  view_ = 0;
+  compile_prog_[0] = compile_prog_[1] = true;
+  back_pending_ = false;
+}
+
+ActivePeptideQueue::ActivePeptideQueue(ShardedRecordReader* shards,
+                                       const vector<const pb::Protein*>&
+                                       proteins,
+                                       ScoringBackend backend)
+  : reader_(NULL),
+    shards_(shards),
+    read_ahead_(NULL),
+    search_mods_(NULL),
+    proteins_(proteins),
+    theoretical_peak_set_(2000),
+    theoretical_b_peak_set_(200),
+    use_stored_peaks_(false),
+    use_fragment_index_(false),
+    backend_(backend),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false, MEMORY_PEPTIDE_WINDOW),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20, backend == SCORING_JIT),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20, backend == SCORING_JIT),
+    active_targets_(0), active_decoys_(0) {
+  CHECK(shards_->OK());
+  compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
+  compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+  indexer_prog1_ = new TheoreticalPeakIndexer(&fifo_alloc_prog1_);
+  indexer_prog2_ = new TheoreticalPeakIndexer(&fifo_alloc_prog2_);
+  peptide_centric_ = false;
+  elution_window_ = 0;
+  peptide_rtimes_ = NULL;
+  rtime_tolerance_ = 0;
+  spectrum_rtime_ = 0;
+  decoys_ = false;
+  window_ = NULL;
+  view_ = 0;
+  compile_prog_[0] = compile_prog_[1] = true;
+  back_pending_ = false;
+}
+
+// A view onto a SharedPeptideWindow. It reads no peptides of its own, so its
+// allocators never get past their first (lazily mapped) page.
+ActivePeptideQueue::ActivePeptideQueue(SharedPeptideWindow* window, int view,
+                                       const vector<const pb::Protein*>&
+                                       proteins)
+  : reader_(NULL),
+    shards_(NULL),
+    read_ahead_(NULL),
+    search_mods_(NULL),
+    proteins_(proteins),
+    theoretical_peak_set_(2000),
+    theoretical_b_peak_set_(200),
+    use_stored_peaks_(false),
+    use_fragment_index_(false),
+    backend_(window->Source()->Backend()),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false, MEMORY_PEPTIDE_WINDOW),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20, false),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20, false),
+    active_targets_(0), active_decoys_(0),
+    window_(window), view_(view) {
+  compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
+  compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+  indexer_prog1_ = new TheoreticalPeakIndexer(&fifo_alloc_prog1_);
+  indexer_prog2_ = new TheoreticalPeakIndexer(&fifo_alloc_prog2_);
+  peptide_centric_ = false;
+  elution_window_ = 0;
+  peptide_rtimes_ = NULL;
+  rtime_tolerance_ = 0;
+  spectrum_rtime_ = 0;
+  decoys_ = false;
+  compile_prog_[0] = compile_prog_[1] = true;
+  back_pending_ = false;
 }
 
 ActivePeptideQueue::~ActivePeptideQueue() {
+  delete read_ahead_;
+  delete search_mods_;
   deque<Peptide*>::iterator i = queue_.begin();
   // for (; i != queue_.end(); ++i)
   //   delete (*i)->PB();
+  for (; i != queue_.end(); ++i)
+    (*i)->ClearHits();
   fifo_alloc_peptides_.ReleaseAll();
   fifo_alloc_prog1_.ReleaseAll();
   fifo_alloc_prog2_.ReleaseAll();
 
   delete compiler_prog1_;
   delete compiler_prog2_;
+  delete indexer_prog1_;
+  delete indexer_prog2_;
+}
+
+void ActivePeptideQueue::StartReadAhead(int capacity) {
+  assert(window_ == NULL && read_ahead_ == NULL);
+  if (shards_ != NULL) {
+    carp(CARP_WARNING, "index-read-ahead is not used with a sharded index");
+    return;
+  }
+  read_ahead_ = new RecordReadAhead<pb::Peptide>(reader_, capacity);
+}
+
+void ActivePeptideQueue::GenerateDecoys(bool shuffle, unsigned int seed) {
+  decoys_ = true;
+  shuffle_decoys_ = shuffle;
+  decoy_seed_ = seed;
+}
+
+void ActivePeptideQueue::ExpandMods(const pb::Header::PeptidesHeader& header) {
+  assert(window_ == NULL && search_mods_ == NULL);
+  search_mods_ = new SearchTimeMods(header, proteins_);
+}
+
+void ActivePeptideQueue::ReadPeptide() {
+  if (search_mods_ != NULL)
+    search_mods_->Pop(&current_pb_peptide_);
+  else
+    ReadRaw(&current_pb_peptide_);
+}
+
+bool ActivePeptideQueue::FillSearchMods() const {
+  while (!search_mods_->Ready() && !RawDone()) {
+    ReadRaw(search_mods_->Base());
+    search_mods_->Add();
+  }
+  return !search_mods_->Empty();
+}
+
+void ActivePeptideQueue::PushDecoyBack() {
+  Peptide* decoy = new(&fifo_alloc_peptides_)
+    Peptide(*queue_.back(), shuffle_decoys_, decoy_seed_, &fifo_alloc_peptides_);
+  queue_.push_back(decoy);
+  back_pending_ = true;
+}
+
+void ActivePeptideQueue::SetPeptideRTime(Peptide* peptide) const {
+  if (peptide_rtimes_ == NULL) {
+    return;
+  }
+  map<string, double>::const_iterator found = peptide_rtimes_->find(peptide->Seq());
+  if (found != peptide_rtimes_->end()) {
+    peptide->SetRTime(found->second);
+  }
+}
+
+void ActivePeptideQueue::SkipBelow(double min_range) {
+  // No modified form of a peptide lighter than this reaches min_range.
+  if (search_mods_ != NULL)
+    min_range -= search_mods_->MaxDelta();
+  if (shards_ != NULL) {
+    shards_->SkipBelow(min_range);
+  } else if (reader_ != NULL && read_ahead_ == NULL) {
+    reader_->SkipTo(min_range);
+  }
 }
 
 // Compute the theoretical peaks of the peptide in the "back" of the queue
-// (i.e. the one most recently read from disk -- the heaviest).
+// (i.e. the one most recently read from disk -- the heaviest), or decode them
+// from its record if they are stored in the index.
 void ActivePeptideQueue::ComputeTheoreticalPeaksBack() {
-  theoretical_peak_set_.Clear();
   Peptide* peptide = queue_.back();
-  peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_, current_pb_peptide_,
-                                   compiler_prog1_, compiler_prog2_);
+  back_pending_ = false;
+  if (!compile_prog_[0] && !compile_prog_[1] && !use_fragment_index_) {
+    // NeedProgs() computes them if some spectrum turns out to need them
+    return;
+  }
+  // A decoy made at search time has no peaks in the index.
+  if (use_stored_peaks_ && !(decoys_ && peptide->IsDecoy())) {
+    // Undo the delta encoding of peak1 and peak2.
+    CRUX_TIME_STAGE(STAGE_PEAK_GENERATION);
+    for (int charge = 0; charge < 2; ++charge) {
+      const google::protobuf::RepeatedField<int>& deltas =
+        charge == 0 ? current_pb_peptide_.peak1() : current_pb_peptide_.peak2();
+      stored_peaks_[charge].Reserve(deltas.size());
+      int code = 0;
+      for (int i = 0; i < deltas.size(); ++i) {
+        code += deltas.Get(i);
+        stored_peaks_[charge].push_back(TheoreticalPeakPair(code));
+      }
+    }
+    if (backend_ == SCORING_JIT) {
+      peptide->CompileTheoreticalPeaks(stored_peaks_, current_pb_peptide_,
+                                       compile_prog_[0] ? compiler_prog1_ : NULL,
+                                       compile_prog_[1] ? compiler_prog2_ : NULL);
+    } else {
+      peptide->CompileTheoreticalPeaks(stored_peaks_, current_pb_peptide_,
+                                       compile_prog_[0] ? indexer_prog1_ : NULL,
+                                       compile_prog_[1] ? indexer_prog2_ : NULL);
+    }
+    return;
+  }
+  ComputeTheoreticalPeaks(peptide, compile_prog_[0], compile_prog_[1]);
 }
 
-bool ActivePeptideQueue::isWithinIsotope(vector<double>* min_mass, vector<double>* max_mass, double mass, int* isotope_idx) {
-  for (int i = *isotope_idx; i < min_mass->size(); ++i) {
-    if (mass >= (*min_mass)[i] && mass <= (*max_mass)[i]) {
-      if (i > *isotope_idx) {
-        *isotope_idx = i;
-      }
-      return true;
+// Compute the theoretical peaks of peptide and generate the programs
+// (prog1 for charges up to 2, prog2 for the others) that are asked for.
+void ActivePeptideQueue::ComputeTheoreticalPeaks(Peptide* peptide, bool prog1, bool prog2) {
+  theoretical_peak_set_.Clear();
+  if (backend_ == SCORING_JIT) {
+    peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_, current_pb_peptide_,
+                                     prog1 ? compiler_prog1_ : NULL,
+                                     prog2 ? compiler_prog2_ : NULL);
+  } else {
+    peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_, current_pb_peptide_,
+                                     prog1 ? indexer_prog1_ : NULL,
+                                     prog2 ? indexer_prog2_ : NULL);
+  }
+}
+
+void ActivePeptideQueue::CompileOnDemand() {
+  assert(window_ == NULL && queue_.empty());
+  compile_prog_[0] = compile_prog_[1] = false;
+}
+
+void ActivePeptideQueue::NeedProgs(int charge) {
+  int prog = charge <= 2 ? 0 : 1;
+  if (compile_prog_[prog]) {
+    return;
+  }
+  compile_prog_[prog] = true;
+  // The programs of an allocator run one into the next in the order of the
+  // queue, so every queued peptide gets the new program now, lightest first,
+  // and each peptide read from here on as it is read. Stored peaks are gone
+  // with their records; the ones computed again are the same.
+  size_t ready = queue_.size() - (back_pending_ ? 1 : 0);
+  for (size_t i = 0; i < ready; ++i) {
+    ComputeTheoreticalPeaks(queue_[i], prog == 0, prog == 1);
+  }
+}
+
+void ActivePeptideQueue::MergeIsotopeWindows(const vector<double>* min_mass,
+                                             const vector<double>* max_mass) {
+  isotope_windows_.clear();
+  for (size_t i = 0; i < min_mass->size(); ++i) {
+    isotope_windows_.push_back(make_pair((*min_mass)[i], (*max_mass)[i]));
+  }
+  sort(isotope_windows_.begin(), isotope_windows_.end());
+  size_t merged = 0;
+  for (size_t i = 1; i < isotope_windows_.size(); ++i) {
+    if (isotope_windows_[i].first <= isotope_windows_[merged].second) {
+      isotope_windows_[merged].second =
+        max(isotope_windows_[merged].second, isotope_windows_[i].second);
+    } else {
+      isotope_windows_[++merged] = isotope_windows_[i];
     }
   }
-  return false;
+  if (!isotope_windows_.empty()) {
+    isotope_windows_.resize(merged + 1);
+  }
 }
 
 int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus) {
@@ -70,7 +307,27 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
   //introduced by m/z selection. see #222 in sourceforge
   //this has to be true:
   // min_range <= min_mass <= max_mass <= max_range
+  CRUX_TIME_STAGE(STAGE_ACTIVE_RANGE);
+
+  if (window_ != NULL) {
+    // The peptides live in the shared window; make sure they are loaded and
+    // keep them locked against trimming until our next call.
+    window_->Acquire(view_, min_range, max_range);
+    return SelectCandidates(window_->Source()->queue_, min_mass, max_mass,
+                            candidatePeptideStatus);
+  }
 
+  DiscardBelow(min_range);
+  LoadThrough(min_range, max_range);
+  return SelectCandidates(queue_, min_mass, max_mass, candidatePeptideStatus);
+}
+
+int ActivePeptideQueue::SelectActiveRange(vector<double>* min_mass, vector<double>* max_mass, vector<bool>* candidatePeptideStatus) {
+  return SelectCandidates(window_ != NULL ? window_->Source()->queue_ : queue_,
+                          min_mass, max_mass, candidatePeptideStatus);
+}
+
+void ActivePeptideQueue::DiscardBelow(double min_range) {
   // queue front() is lightest; back() is heaviest
 
   // delete anything already loaded that falls below min_range
@@ -78,13 +335,13 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     Peptide* peptide = queue_.front();
     //print hits in peptide-centric search
     ReportPeptideHits(peptide);
-    peptide->spectrum_matches_array.clear();
-    vector<Peptide::spectrum_matches>().swap(peptide->spectrum_matches_array);
+    peptide->ClearHits();
     // would delete peptide's underlying pb::Peptide;
     queue_.pop_front();
 //    delete peptide;
   }
   if (queue_.empty()) {
+    back_pending_ = false;
     //cerr << "Releasing All\n";
     fifo_alloc_peptides_.ReleaseAll();
     fifo_alloc_prog1_.ReleaseAll();
@@ -99,7 +356,9 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     fifo_alloc_peptides_.Release(peptide); 
     peptide->ReleaseFifo(&fifo_alloc_prog1_, &fifo_alloc_prog2_);
   }
+}
 
+void ActivePeptideQueue::LoadThrough(double min_range, double max_range) {
   // Enqueue all peptides that are not yet queued but are lighter than
   // max_range. For each new enqueued peptide compute the corresponding
   // theoretical peaks. Data associated with each peptide is allocated by
@@ -109,16 +368,25 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     if (!queue_.empty()) {
       ComputeTheoreticalPeaksBack();
     }
-    while (!(done = reader_->Done())) {
+    SkipBelow(min_range);
+    while (!(done = ReaderDone())) {
       // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
+      ReadPeptide();
       if (current_pb_peptide_.mass() < min_range) {
         // we would delete current_pb_peptide_;
         continue; // skip peptides that fall below min_range
       }
       Peptide* peptide = new(&fifo_alloc_peptides_)
         Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+      SetPeptideRTime(peptide);
       queue_.push_back(peptide);
+      back_pending_ = true;
+      if (decoys_) {
+        // The target's peaks now, so that only the back of the queue lacks
+        // them if it is too heavy.
+        ComputeTheoreticalPeaksBack();
+        PushDecoyBack();
+      }
       if (peptide->Mass() > max_range) {
         break;
       }
@@ -128,24 +396,70 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
   // by now, if not EOF, then the last (and only the last) enqueued
   // peptide is too heavy
   assert(!queue_.empty() || done);
+}
 
+int ActivePeptideQueue::LoadBlock(int max_peptides) {
+  assert(window_ == NULL);
+  for (deque<Peptide*>::iterator i = queue_.begin(); i != queue_.end(); ++i)
+    (*i)->ClearHits();
+  queue_.clear();
+  fifo_alloc_peptides_.ReleaseAll();
+  fifo_alloc_prog1_.ReleaseAll();
+  fifo_alloc_prog2_.ReleaseAll();
+  fragment_index_.Clear();
+
+  while ((int)queue_.size() < max_peptides && !ReaderDone()) {
+    ReadPeptide();
+    Peptide* peptide = new(&fifo_alloc_peptides_)
+      Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+    SetPeptideRTime(peptide);
+    queue_.push_back(peptide);
+    for (int copy = 0; copy < (decoys_ ? 2 : 1); ++copy) {
+      if (copy == 1) {
+        PushDecoyBack();
+      }
+      ComputeTheoreticalPeaksBack();
+      if (use_fragment_index_) {
+        // The charge 1 peaks, whichever way ComputeTheoreticalPeaksBack() got
+        // them.
+        bool stored = use_stored_peaks_ && copy == 0;
+        fragment_index_.AddPeptide(stored ? stored_peaks_[0]
+                                   : theoretical_peak_set_.GetPeaks()[0]);
+      }
+    }
+  }
+  if (use_fragment_index_) {
+    fragment_index_.Build();
+  }
+  return queue_.size();
+}
+
+bool ActivePeptideQueue::CoversRange(double max_range) const {
+  return ReaderDone() ||
+         (!queue_.empty() && queue_.back()->Mass() > max_range);
+}
+
+int ActivePeptideQueue::SelectCandidates(const deque<Peptide*>& queue,
+                                         vector<double>* min_mass,
+                                         vector<double>* max_mass,
+                                         vector<bool>* candidatePeptideStatus) {
   // Set up iterator for use with HasNext(),
   // GetPeptide(), and NextPeptide(). Return the number of enqueued peptides.
-  if (queue_.empty()) {
+  if (queue.empty()) {
     return 0;
   }
 
-  iter_ = queue_.begin();
-  while (iter_ != queue_.end() && (*iter_)->Mass() < min_mass->front()) {
-    ++iter_;
-  }
+  // The queue is sorted by mass, and may hold the whole index (see
+  // LoadBlock()), so the first candidate is found by bisection.
+  iter_ = lower_bound(queue.begin(), queue.end(), min_mass->front(), LighterThan);
 
-  int* isotope_idx = new int(0);
+  MergeIsotopeWindows(min_mass, max_mass);
+  size_t window = 0;
   end_ = iter_;
   int active = 0;
   active_targets_ = active_decoys_ = 0;
-  while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
+  while (end_ != queue.end() && (*end_)->Mass() < max_mass->back() ){
+    if (InIsotopeWindow((*end_)->Mass(), &window) && InElutionWindow(*end_)) {
       ++active;
       candidatePeptideStatus->push_back(true);
       if (!(*end_)->IsDecoy()) {
@@ -158,7 +472,6 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     }
     ++end_;
   }
-  delete isotope_idx;
   if (active == 0) {
     return 0;
   }
@@ -167,6 +480,114 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
 
 }
 
+void ActivePeptideQueue::FinishSharedWindow() {
+  if (window_ != NULL) {
+    window_->Finish(view_);
+  }
+}
+
+void ActivePeptideQueue::ReleaseSharedWindow() {
+  if (window_ != NULL) {
+    window_->Release(view_);
+  }
+}
+
+void ActivePeptideQueue::ReserveSharedWindow(double min_range) {
+  if (window_ != NULL) {
+    window_->Reserve(view_, min_range);
+  }
+}
+
+void ActivePeptideQueue::RestartSharedWindow() {
+  if (window_ != NULL) {
+    window_->Restart(view_);
+  }
+}
+
+SharedPeptideWindow::SharedPeptideWindow(ActivePeptideQueue* source, int num_views)
+  : source_(source), low_water_(num_views, UNSET), holding_(num_views, 0) {
+}
+
+const double SharedPeptideWindow::UNSET = -numeric_limits<double>::infinity();
+
+SharedPeptideWindow::~SharedPeptideWindow() {
+}
+
+void SharedPeptideWindow::Acquire(int view, double min_range, double max_range) {
+  if (holding_[view]) {
+    mutex_.unlock_shared();
+  }
+  mutex_.lock_shared();
+  holding_[view] = 1;
+  // Only the owning view writes its slot, and only while holding the lock
+  // shared, so this never races with a writer reading the low water marks.
+  low_water_[view] = min_range;
+  if (source_->CoversRange(max_range)) {
+    return;
+  }
+
+  // Upgrade to an exclusive lock to extend the window. Another view may have
+  // done the work while we waited, in which case LoadThrough() is a no-op.
+  mutex_.unlock_shared();
+  mutex_.lock();
+  if (!source_->CoversRange(max_range)) {
+    // No view will ever again ask for peptides lighter than the lowest
+    // min_range seen among the views, so those can be dropped. A view that
+    // has neither asked for a range nor reserved one has no spectra to ask
+    // for yet, and is left out.
+    double low_water = numeric_limits<double>::infinity();
+    for (vector<double>::const_iterator i = low_water_.begin();
+         i != low_water_.end();
+         ++i) {
+      if (*i != UNSET) {
+        low_water = min(low_water, *i);
+      }
+    }
+    source_->DiscardBelow(low_water);
+    source_->LoadThrough(low_water, max_range);
+  }
+  mutex_.unlock_and_lock_shared();
+}
+
+void SharedPeptideWindow::Release(int view) {
+  // The low water mark stays, so the peptides the view will ask for next
+  // are kept.
+  if (holding_[view]) {
+    holding_[view] = 0;
+    mutex_.unlock_shared();
+  }
+}
+
+void SharedPeptideWindow::Reserve(int view, double min_range) {
+  // Written before the view can claim its spectra, so a view extending the
+  // window meanwhile keeps what they need.
+  if (holding_[view]) {
+    low_water_[view] = min_range;
+    return;
+  }
+  mutex_.lock_shared();
+  low_water_[view] = min_range;
+  mutex_.unlock_shared();
+}
+
+void SharedPeptideWindow::Finish(int view) {
+  // The view found no more spectra to claim: it holds back nothing.
+  if (!holding_[view]) {
+    mutex_.lock_shared();
+  }
+  low_water_[view] = numeric_limits<double>::infinity();
+  holding_[view] = 0;
+  mutex_.unlock_shared();
+}
+
+void SharedPeptideWindow::Restart(int view) {
+  // As in the constructor: the view holds back nothing until it asks for a
+  // range.
+  mutex_.lock_shared();
+  low_water_[view] = UNSET;
+  mutex_.unlock_shared();
+}
+
 // Compute the b ion only theoretical peaks of the peptide in the "back" of the queue
 // (i.e. the one most recently read from disk -- the heaviest).
 void ActivePeptideQueue::ComputeBTheoreticalPeaksBack() {
@@ -185,8 +606,7 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
     Peptide* peptide = queue_.front();
     // would delete peptide's underlying pb::Peptide;
     ReportPeptideHits(peptide);
-    peptide->spectrum_matches_array.clear();
-    vector<Peptide::spectrum_matches>().swap(peptide->spectrum_matches_array);
+    peptide->ClearHits();
     queue_.pop_front();
     b_ion_queue_.pop_front();
 //    delete peptide;
@@ -205,9 +625,10 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
   // fifo_alloc_peptides_.
   bool done;
   if (queue_.empty() || queue_.back()->Mass() <= max_range) {
-    while (!(done = reader_->Done())) {
+    SkipBelow(min_range);
+    while (!(done = ReaderDone())) {
       // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
+      ReadPeptide();
       if (current_pb_peptide_.mass() < min_range) {
         // we would delete current_pb_peptide_;
         continue; // skip peptides that fall below min_range
@@ -216,6 +637,10 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
         Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
       queue_.push_back(peptide);
       ComputeBTheoreticalPeaksBack();
+      if (decoys_) {
+        PushDecoyBack();
+        ComputeBTheoreticalPeaksBack();
+      }
       if (peptide->Mass() > max_range) {
         break;
       }
@@ -232,13 +657,14 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
     ++iter1_;
   }
 
-  int* isotope_idx = new int(0);
+  MergeIsotopeWindows(min_mass, max_mass);
+  size_t window = 0;
   end_ = iter_;
   end1_ = iter1_;
   int active = 0;
   active_targets_ = active_decoys_ = 0;
   while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
+    if (InIsotopeWindow((*end_)->Mass(), &window)) {
       ++active;
       candidatePeptideStatus->push_back(true);
       if (!(*end_)->IsDecoy()) {
@@ -252,7 +678,6 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
     ++end_;
     ++end1_;
   }
-  delete isotope_idx;
   if (active == 0) {
     return 0;
   }
@@ -280,8 +705,8 @@ int ActivePeptideQueue::CountAAFrequency(
     memset(nvAAMassCounterC, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
     memset(nvAAMassCounterI, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
 
-    while (!(reader_->Done())) { // read all peptides in index
-      reader_->Read(&current_pb_peptide_);
+    while (!(ReaderDone())) { // read all peptides in index
+      ReadPeptide();
       Peptide* peptide = new(&fifo_alloc_peptides_) Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
 
       double* dAAResidueMass = peptide->getAAMasses(); //retrieves the amino acid masses, modifications included
@@ -299,6 +724,75 @@ int ActivePeptideQueue::CountAAFrequency(
       fifo_alloc_peptides_.ReleaseAll();
     }
 
+  int uiUniqueMasses = AAFrequencies(nvAAMassCounterN, nvAAMassCounterI,
+    nvAAMassCounterC, MaxModifiedAAMassBin, cntTerm, cntInside,
+    dAAFreqN, dAAFreqI, dAAFreqC, dAAMass);
+
+  delete[] nvAAMassCounterN;
+  delete[] nvAAMassCounterI;
+  delete[] nvAAMassCounterC;
+  return uiUniqueMasses;
+}
+
+int ActivePeptideQueue::AAFrequencyFromCounts(
+  const pb::Header::PeptidesHeader::ResidueMassCounts& counts,
+  double binWidth,
+  double binOffset,
+  double** dAAFreqN,
+  double** dAAFreqI,
+  double** dAAFreqC,
+  int** dAAMass
+) {
+  unsigned int cntTerm = 0;
+  unsigned int cntInside = 0;
+  const unsigned int MaxModifiedAAMassBin = 2000 / binWidth;
+  unsigned int* nvAAMassCounterN = new unsigned int[MaxModifiedAAMassBin];
+  unsigned int* nvAAMassCounterC = new unsigned int[MaxModifiedAAMassBin];
+  unsigned int* nvAAMassCounterI = new unsigned int[MaxModifiedAAMassBin];
+  memset(nvAAMassCounterN, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
+  memset(nvAAMassCounterC, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
+  memset(nvAAMassCounterI, 0, MaxModifiedAAMassBin * sizeof(unsigned int));
+
+  // Each peptide has one N-terminal residue, so those counts add up to the
+  // peptides CountAAFrequency() would have read.
+  for (int i = 0; i < counts.mass_size(); ++i) {
+    unsigned int bin = (unsigned int)(counts.mass(i) / binWidth + 1.0 - binOffset);
+    if (bin >= MaxModifiedAAMassBin) {
+      continue;
+    }
+    nvAAMassCounterN[bin] += counts.nterm(i);
+    nvAAMassCounterI[bin] += counts.inner(i);
+    nvAAMassCounterC[bin] += counts.cterm(i);
+    cntTerm += counts.nterm(i);
+    cntInside += counts.inner(i);
+  }
+
+  int uiUniqueMasses = AAFrequencies(nvAAMassCounterN, nvAAMassCounterI,
+    nvAAMassCounterC, MaxModifiedAAMassBin, cntTerm, cntInside,
+    dAAFreqN, dAAFreqI, dAAFreqC, dAAMass);
+
+  delete[] nvAAMassCounterN;
+  delete[] nvAAMassCounterI;
+  delete[] nvAAMassCounterC;
+  return uiUniqueMasses;
+}
+
+// Normalize the binned residue counts of CountAAFrequency() and
+// AAFrequencyFromCounts(), keeping the bins some residue falls in.
+int ActivePeptideQueue::AAFrequencies(
+  const unsigned int* nvAAMassCounterN,
+  const unsigned int* nvAAMassCounterI,
+  const unsigned int* nvAAMassCounterC,
+  unsigned int MaxModifiedAAMassBin,
+  unsigned int cntTerm,
+  unsigned int cntInside,
+  double** dAAFreqN,
+  double** dAAFreqI,
+  double** dAAFreqC,
+  int** dAAMass
+) {
+  unsigned int i = 0;
+
   //calculate the unique masses
   unsigned int uiUniqueMasses = 0;
   for (i = 0; i < MaxModifiedAAMassBin; ++i) {
@@ -322,10 +816,6 @@ int ActivePeptideQueue::CountAAFrequency(
       cnt++;
     }
   }
-
-  delete[] nvAAMassCounterN;
-  delete[] nvAAMassCounterI;
-  delete[] nvAAMassCounterC;
   return uiUniqueMasses;
 }
 
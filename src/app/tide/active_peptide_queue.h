@@ -13,32 +13,107 @@
 // SetActiveRange() the client may use the iterator interface HasNext() and
 // NextPeptide() to iterate over the window. The client may also use
 // GetPeptide() to get a specific peptide in the window.
+//
+// Several search threads may share one window of peptides through a
+// SharedPeptideWindow. The window owns a single ActivePeptideQueue that reads,
+// decodes and compiles each peptide once; each thread then uses a "view"
+// ActivePeptideQueue whose SetActiveRange() points into the shared peptides
+// rather than reading its own copy of the index.
 
 #include <deque>
+#include <map>
+#include <math.h>
+#include <boost/thread/shared_mutex.hpp>
+#include "header.pb.h"
 #include "peptides.pb.h"
+#include "aux_locations.h"
 #include "peptide.h"
 #include "theoretical_peak_set.h"
 #include "fifo_alloc.h"
 #include "spectrum_collection.h"
+#include "peak_index.h"
+#include "fragment_index.h"
+#include "record_read_ahead.h"
+#include "index_shards.h"
 #include "io/OutputFiles.h"
+#include "util/Instrumentation.h"
 
 //#include "sp_scorer.h"
 #ifndef ACTIVE_PEPTIDE_QUEUE_H
 #define ACTIVE_PEPTIDE_QUEUE_H
 
 class TheoreticalPeakCompiler;
+class SharedPeptideWindow;
+class SearchTimeMods;
 
 class ActivePeptideQueue {
+  friend class SharedPeptideWindow;
+
  public:
+  // backend determines how candidates are prepared for scoring: as generated
+  // programs (SCORING_JIT) or as peak index lists (see peak_index.h).
   ActivePeptideQueue(RecordReader* reader,
+            const vector<const pb::Protein*>& proteins,
+            ScoringBackend backend = SCORING_JIT);
+
+  // Read the peptides from the mass-range shards of an index instead, skipping
+  // the shards below the active range (see index_shards.h). Read-ahead is not
+  // available for such a queue.
+  ActivePeptideQueue(ShardedRecordReader* shards,
+            const vector<const pb::Protein*>& proteins,
+            ScoringBackend backend = SCORING_JIT);
+
+  // Construct a view onto window. view is the index of this view within the
+  // window, 0 <= view < number of views. The view shares the backend of the
+  // window's source queue.
+  ActivePeptideQueue(SharedPeptideWindow* window, int view,
             const vector<const pb::Protein*>& proteins);
 
   ~ActivePeptideQueue();
 
-  bool isWithinIsotope(vector<double>* min_mass, vector<double>* max_mass, double mass, int* isotope_idx);
-  
   // See above for usage and .cc for implementation details.
   int SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
+  // Re-select the candidates for a narrower window within the range given to
+  // the last SetActiveRange(), without loading or discarding any peptides.
+  // Lets several spectra whose windows overlap share one SetActiveRange().
+  int SelectActiveRange(vector<double>* min_mass, vector<double>* max_mass, vector<bool>* candidatePeptideStatus);
+
+  // The candidates chosen by the last SetActiveRange() or SelectActiveRange(),
+  // so that a client can switch between the selections of several spectra.
+  struct Selection {
+    deque<Peptide*>::const_iterator begin, end;
+    int targets, decoys;
+  };
+  Selection GetSelection() const {
+    Selection selection = { iter_, end_, active_targets_, active_decoys_ };
+    return selection;
+  }
+  void SetSelection(const Selection& selection) {
+    iter_ = selection.begin;
+    end_ = selection.end;
+    active_targets_ = selection.targets;
+    active_decoys_ = selection.decoys;
+  }
+  // Open-search alternative to SetActiveRange(): replace the queue with the
+  // next max_peptides peptides of the index, compiled, whatever their masses,
+  // and return how many were read (0 at the end of the index). Candidates
+  // are then picked with SelectActiveRange(). Not to be mixed with
+  // SetActiveRange(), and not for views.
+  int LoadBlock(int max_peptides);
+  // Mass of the heaviest peptide of the last LoadBlock().
+  double BlockMaxMass() const { return queue_.back()->Mass(); }
+  // Have LoadBlock() build a FragmentIndex of each block, numbering the
+  // peptides by BlockPosition().
+  void UseFragmentIndex(bool use_fragment_index) {
+    use_fragment_index_ = use_fragment_index;
+  }
+  const FragmentIndex* GetFragmentIndex() const { return &fragment_index_; }
+  int BlockPosition(deque<Peptide*>::const_iterator i) const {
+    return i - queue_.begin();
+  }
+  deque<Peptide*>::const_iterator BlockPeptide(int position) const {
+    return queue_.begin() + position;
+  }
   int SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
 
   bool HasNext() const { return iter_ != end_; }
@@ -56,13 +131,51 @@ class ActivePeptideQueue {
  
   int CountAAFrequency(double binWidth, double binOffset, double** dAAFreqN,
                        double** dAAFreqI, double** dAAFreqC, int** dAAMass);
+  // The same frequencies from the residue mass counts tide-index stores in
+  // the header, without reading the peptides.
+  static int AAFrequencyFromCounts(
+    const pb::Header::PeptidesHeader::ResidueMassCounts& counts,
+    double binWidth, double binOffset, double** dAAFreqN, double** dAAFreqI,
+    double** dAAFreqC, int** dAAMass);
   
+  ScoringBackend Backend() const { return backend_; }
+
+  // Take each peptide's theoretical peaks from its record instead of
+  // computing them. Only for an index whose header says the peaks are stored
+  // with the bins of this search; see peptides.proto.
+  void UseStoredPeaks(bool use_stored_peaks) {
+    use_stored_peaks_ = use_stored_peaks;
+  }
+
+  // Follow each target peptide read from the index with a decoy made from
+  // it (see the decoy constructor of Peptide), for an index without decoys.
+  // Not for views.
+  void GenerateDecoys(bool shuffle, unsigned int seed);
+
+  // Apply the variable modifications of header to each peptide read from
+  // the index, for an index built with search-time-mods (see search_mods.h).
+  // Not for views.
+  void ExpandMods(const pb::Header::PeptidesHeader& header);
+
+  // Generate each kind of program (for charges up to 2, and above 2) only
+  // once NeedProgs() is called for a charge that runs it, instead of both for
+  // every peptide read. Call before the first SetActiveRange(). Not for views,
+  // nor with LoadBlock().
+  void CompileOnDemand();
+  // Make sure the candidates have the programs that score spectra of charge.
+  void NeedProgs(int charge);
+
+  // Decode peptides on a background thread, up to capacity ahead of
+  // SetActiveRange(); see record_read_ahead.h. Call before the first
+  // SetActiveRange(). Not for views.
+  void StartReadAhead(int capacity);
+
   int ActiveTargets() const { return active_targets_; }
   int ActiveDecoys() const { return active_decoys_; }
 
   void ReportPeptideHits(Peptide* peptide);
-  void SetOutputs(OutputFiles* output_files, const vector<const pb::AuxLocation*>* locations, int top_matches,
-                  bool compute_sp, ofstream* target_file, ofstream* decoy_file, double highest_mz) {
+  void SetOutputs(OutputFiles* output_files, const AuxLocations* locations, int top_matches,
+                  bool compute_sp, ostream* target_file, ostream* decoy_file, double highest_mz) {
       locations_ = locations;
       output_files_ = output_files;
       top_matches_ = top_matches;
@@ -78,6 +191,46 @@ class ActivePeptideQueue {
   void setElutionWindow(int elution_window) {
     elution_window_ = elution_window;
   }
+
+  // Give the peptides this queue reads the retention times of rtimes, by
+  // their unmodified sequences. For the queue of a SharedPeptideWindow, this
+  // is set on the window's source.
+  void SetPeptideRTimes(const map<string, double>* rtimes) {
+    peptide_rtimes_ = rtimes;
+  }
+  // With a tolerance above 0, a peptide that has a retention time is a
+  // candidate only for spectra whose retention times, as set before each
+  // SetActiveRange() or SelectActiveRange(), are within tolerance of it.
+  void SetRTimeTolerance(double tolerance) { rtime_tolerance_ = tolerance; }
+  void SetSpectrumRTime(double rtime) { spectrum_rtime_ = rtime; }
+
+  // The number of hits a peptide of a peptide-centric search keeps: the top
+  // matches and one more for delta Cn, or all of them (0) if the scores are
+  // smoothed over an elution window.
+  int HitCapacity() const {
+    return elution_window_ > 0 ? 0 : top_matches_ + 1;
+  }
+
+  // A view must call this once when it will request no more ranges, so that
+  // the shared window stops keeping peptides around on its behalf. No-op if
+  // this queue is not a view.
+  void FinishSharedWindow();
+  // Drop the view's hold on the shared window without giving up its place,
+  // before blocking on anything another view may be waiting for (such as its
+  // turn to hand over results), so that the other view can extend the window
+  // meanwhile. The next range requested takes the hold again. No-op if this
+  // queue is not a view.
+  void ReleaseSharedWindow();
+  // Tell the shared window that the view will request no range starting
+  // below min_range (infinity if none at all), before it claims the spectra
+  // that it will request them for, so that the window keeps what they need
+  // and may drop the rest. No-op if this queue is not a view.
+  void ReserveSharedWindow(double min_range);
+  bool IsSharedWindowView() const { return window_ != NULL; }
+  // Undo FinishSharedWindow(), before requesting more ranges, none of which
+  // may start below those requested already; for searching spectra in
+  // batches. No-op if this queue is not a view.
+  void RestartSharedWindow();
   // iter_ points to the current peptide. Client access is by HasNext(),
   // GetPeptide(), and NextPeptide(). end_ points just beyond the last active
   // peptide.
@@ -85,27 +238,107 @@ class ActivePeptideQueue {
   
 //  const ProteinVec& proteins_;
  private:
-  const vector<const pb::AuxLocation*>* locations_;
+  const AuxLocations* locations_;
   OutputFiles* output_files_;
   int top_matches_;
   bool compute_sp_;
-  ofstream* target_file_;
-  ofstream* decoy_file_;
+  ostream* target_file_;
+  ostream* decoy_file_;
   double highest_mz_;
   Peptide* current_peptide_;
   bool exact_pval_search_;
   bool peptide_centric_;
   int elution_window_;
+  const map<string, double>* peptide_rtimes_;
+  double rtime_tolerance_;
+  double spectrum_rtime_;
 
 
 //  Spectrum* spectrum_;
   // IMPLEMENTATION DETAILS
 
   // See .cc file.
+  static int AAFrequencies(const unsigned int* nvAAMassCounterN,
+                           const unsigned int* nvAAMassCounterI,
+                           const unsigned int* nvAAMassCounterC,
+                           unsigned int MaxModifiedAAMassBin,
+                           unsigned int cntTerm, unsigned int cntInside,
+                           double** dAAFreqN, double** dAAFreqI,
+                           double** dAAFreqC, int** dAAMass);
   void ComputeTheoreticalPeaksBack();
+  void ComputeTheoreticalPeaks(Peptide* peptide, bool prog1, bool prog2);
   void ComputeBTheoreticalPeaksBack();
 
+  // The three steps of SetActiveRange(): drop peptides lighter than
+  // min_range, read and compile peptides up to max_range, and point iter_
+  // and end_ at the candidates in queue (which belongs to a shared window
+  // when this queue is a view).
+  void DiscardBelow(double min_range);
+  void LoadThrough(double min_range, double max_range);
+  bool CoversRange(double max_range) const;
+  int SelectCandidates(const deque<Peptide*>& queue, vector<double>* min_mass,
+                       vector<double>* max_mass, vector<bool>* candidatePeptideStatus);
+
+  // Merge the isotope windows [min_mass[i], max_mass[i]] into
+  // isotope_windows_, sorted by mass and disjoint.
+  void MergeIsotopeWindows(const vector<double>* min_mass,
+                           const vector<double>* max_mass);
+  // Whether mass is within one of isotope_windows_. The masses asked about
+  // must not decrease; cursor, starting at 0, keeps the window reached.
+  bool InIsotopeWindow(double mass, size_t* cursor) const {
+    while (*cursor < isotope_windows_.size() && isotope_windows_[*cursor].second < mass)
+      ++*cursor;
+    return *cursor < isotope_windows_.size() && isotope_windows_[*cursor].first <= mass;
+  }
+  vector< pair<double, double> > isotope_windows_;
+
+  // Append the decoy of the peptide at the back of the queue.
+  void PushDecoyBack();
+
+  // Set the retention time of a peptide read, if peptide_rtimes_ has it.
+  void SetPeptideRTime(Peptide* peptide) const;
+  bool InElutionWindow(const Peptide* peptide) const {
+    return rtime_tolerance_ <= 0 || !peptide->HasRTime() ||
+           fabs(peptide->RTime() - spectrum_rtime_) <= rtime_tolerance_;
+  }
+
+  // Move the reader ahead past peptides lighter than min_range, where the
+  // index allows it (see RecordReader::SkipTo()).
+  void SkipBelow(double min_range);
+
+  // The next peptide of the index, through read_ahead_ if there is one, or
+  // of search_mods_ if the index is expanded at search time.
+  bool ReaderDone() const {
+    if (search_mods_ != NULL)
+      return !FillSearchMods();
+    return RawDone();
+  }
+  void ReadPeptide();
+  bool RawDone() const {
+    if (shards_ != NULL)
+      return shards_->Done();
+    return read_ahead_ != NULL ? read_ahead_->Done() : reader_->Done();
+  }
+  void ReadRaw(pb::Peptide* peptide) const {
+    CRUX_TIME_STAGE(STAGE_PEPTIDE_READ);
+    if (shards_ != NULL)
+      shards_->Read(peptide);
+    else if (read_ahead_ != NULL)
+      read_ahead_->Read(peptide);
+    else
+      reader_->Read(peptide);
+  }
+  // Read the index into search_mods_ until its lightest modified peptide is
+  // known; false once both are exhausted.
+  bool FillSearchMods() const;
+
   RecordReader* reader_;
+  ShardedRecordReader* shards_;
+  bool decoys_;  // whether to make decoys; see GenerateDecoys()
+  bool shuffle_decoys_;
+  unsigned int decoy_seed_;
+  RecordReadAhead<pb::Peptide>* read_ahead_;
+  SearchTimeMods* search_mods_;  // see ExpandMods()
   pb::Peptide current_pb_peptide_;
 
   // All amino acid sequences from which the peptides are drawn.
@@ -115,7 +348,20 @@ class ActivePeptideQueue {
   // Gets reused for each new peptide.
   ST_TheoreticalPeakSet theoretical_peak_set_;
   TheoreticalPeakSetBIons theoretical_b_peak_set_;
+
+  // Workspace for decoding stored peaks in place of theoretical_peak_set_.
+  bool use_stored_peaks_;
+  TheoreticalPeakArr stored_peaks_[2];
+
+  // Built by LoadBlock() if use_fragment_index_.
+  bool use_fragment_index_;
+  FragmentIndex fragment_index_;
   
+  // The programs generated as peptides are read; see CompileOnDemand().
+  bool compile_prog_[2];
+  // Whether queue_.back() is still waiting for ComputeTheoreticalPeaksBack().
+  bool back_pending_;
+
   // The active peptides. Lighter peptides are enqueued before heavy ones.
   // queue_ maintains only the peptides that fall within the range specified
   // by the last call to SetActiveRange().
@@ -133,15 +379,57 @@ class ActivePeptideQueue {
   // FifoAllocators allow us to execute the code thus generated,
   // since they set the proper permissions. The set of theoretical peaks for 
   // "dotting" with charge 1 and charge 2 spectra, have different
-  // FifoAllocators and TheoreticalPeakCompilers.
+  // FifoAllocators and TheoreticalPeakCompilers. With any backend other than
+  // SCORING_JIT the same allocators hold peak index lists written by the
+  // TheoreticalPeakIndexers instead, and are not mapped executable.
+  ScoringBackend backend_;
   FifoAllocator fifo_alloc_peptides_;
   FifoAllocator fifo_alloc_prog1_;
   FifoAllocator fifo_alloc_prog2_;
   TheoreticalPeakCompiler* compiler_prog1_;
   TheoreticalPeakCompiler* compiler_prog2_;
+  TheoreticalPeakIndexer* indexer_prog1_;
+  TheoreticalPeakIndexer* indexer_prog2_;
 
   // Number of targets and decoys in active range
   int active_targets_, active_decoys_;
+
+  // Set only for views onto a shared window.
+  SharedPeptideWindow* window_;
+  int view_;
+};
+
+// A window of active peptides shared read-only by several views (one per
+// search thread). Views must move forward monotonically, as with an ordinary
+// ActivePeptideQueue, but need not move together: peptides are discarded only
+// once every view has moved past them. Between Acquire() and the view's next
+// Acquire() or Finish(), the peptides in the view's range are guaranteed to
+// stay in memory; the window is extended or trimmed only when no view holds
+// the lock.
+class SharedPeptideWindow {
+ public:
+  // source must be an ordinary (non-view) queue; it is not owned.
+  SharedPeptideWindow(ActivePeptideQueue* source, int num_views);
+  ~SharedPeptideWindow();
+
+  void Acquire(int view, double min_range, double max_range);
+  void Release(int view);
+  void Reserve(int view, double min_range);
+  void Finish(int view);
+  void Restart(int view);
+
+  ActivePeptideQueue* Source() { return source_; }
+
+ private:
+  ActivePeptideQueue* source_;
+  boost::shared_mutex mutex_;
+  // Lowest mass each view may still ask for: UNSET until it asks for a
+  // range, and infinity once it is finished.
+  static const double UNSET;
+  vector<double> low_water_;
+  // Whether each view currently holds the lock shared. Not vector<bool>, so
+  // that different views can update their own entries concurrently.
+  vector<int> holding_;
 };
 
 /*
@@ -0,0 +1,167 @@
+// Flat auxiliary locations; see aux_locations.h.
+
+#include <cstring>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "aux_locations.h"
+#include "peptides.pb.h"
+#include "records.h"
+#include "util/MemoryAccounting.h"
+
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+
+static const size_t kFlatHeaderSize = 24;
+
+static bool FileSize(const string& file, uint64* size) {
+  struct stat st;
+  if (stat(file.c_str(), &st) != 0) {
+    return false;
+  }
+  *size = (uint64) st.st_size;
+  return true;
+}
+
+AuxLocations::AuxLocations()
+  : start_(NULL), locs_(NULL), size_(0), map_(NULL), map_size_(0),
+    accounted_bytes_(0) {
+  start_vec_.push_back(0);
+  start_ = &start_vec_[0];
+}
+
+AuxLocations::~AuxLocations() {
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+  }
+  MemoryAccounting::Add(MEMORY_PROTEINS, -accounted_bytes_);
+}
+
+bool AuxLocations::Read(const string& auxlocs_file, const string& flat_file) {
+  uint64 source_size;
+  bool read = (!flat_file.empty() && FileSize(auxlocs_file, &source_size) &&
+               Map(flat_file, source_size)) || Parse(auxlocs_file);
+  Account();
+  return read;
+}
+
+bool AuxLocations::Read(HeadedRecordReader* reader) {
+  bool read = Parse(reader);
+  Account();
+  return read;
+}
+
+void AuxLocations::Account() {
+  // A mapped file counts in full, as the search touches all of it.
+  long long bytes = map_size_ +
+    (start_vec_.capacity() + locs_vec_.capacity()) * sizeof(uint32);
+  MemoryAccounting::Add(MEMORY_PROTEINS, bytes - accounted_bytes_);
+  accounted_bytes_ = bytes;
+}
+
+bool AuxLocations::Parse(const string& auxlocs_file) {
+  HeadedRecordReader reader(auxlocs_file);
+  return Parse(&reader);
+}
+
+bool AuxLocations::Parse(HeadedRecordReader* reader) {
+  if (!reader->OK()) {
+    return false;
+  }
+  start_vec_.assign(1, 0);
+  locs_vec_.clear();
+  // One message is reused for every record, so that reading allocates only
+  // as the arrays grow.
+  pb::AuxLocation aux;
+  while (!reader->Done()) {
+    if (!reader->Read(&aux)) {
+      return false;
+    }
+    for (int i = 0; i < aux.location_size(); ++i) {
+      locs_vec_.push_back(aux.location(i).protein_id());
+      locs_vec_.push_back(aux.location(i).pos());
+    }
+    start_vec_.push_back(locs_vec_.size() / 2);
+  }
+  if (!reader->OK()) {
+    return false;
+  }
+  size_ = start_vec_.size() - 1;
+  start_ = &start_vec_[0];
+  locs_ = locs_vec_.empty() ? NULL : &locs_vec_[0];
+  return true;
+}
+
+bool AuxLocations::Map(const string& flat_file, uint64 source_size) {
+  uint64 file_size;
+  if (!FileSize(flat_file, &file_size) || file_size < kFlatHeaderSize) {
+    return false;
+  }
+  int fd = open(flat_file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  void* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  const uint32* words = (const uint32*) data;
+  uint64 recorded_size;
+  memcpy(&recorded_size, words + 2, sizeof(recorded_size));
+  uint64 n = words[4];
+  uint64 starts = (n + 2) & ~(uint64) 1;  // n + 1, rounded up to even
+  bool ok = words[0] == FLAT_AUXLOCS_MAGIC_NUMBER && recorded_size == source_size &&
+    file_size >= kFlatHeaderSize + 4 * starts;
+  if (ok) {
+    const uint32* start = words + kFlatHeaderSize / 4;
+    ok = file_size == kFlatHeaderSize + 4 * starts + 8 * (uint64) start[n];
+  }
+  if (!ok) {
+    carp(CARP_WARNING, "%s does not match the index; reading auxiliary "
+         "locations without it.", flat_file.c_str());
+    munmap(data, file_size);
+    return false;
+  }
+  map_ = data;
+  map_size_ = file_size;
+  size_ = (int) n;
+  start_ = words + kFlatHeaderSize / 4;
+  locs_ = start_ + starts;
+  start_vec_.clear();
+  locs_vec_.clear();
+  return true;
+}
+
+bool AuxLocations::WriteFlat(const string& auxlocs_file, const string& flat_file) {
+  AuxLocations locations;
+  uint64 source_size;
+  if (!FileSize(auxlocs_file, &source_size) || !locations.Parse(auxlocs_file)) {
+    return false;
+  }
+  ofstream out(flat_file.c_str(), ios::out | ios::binary | ios::trunc);
+  uint32 header[6] = { FLAT_AUXLOCS_MAGIC_NUMBER, 0, 0, 0,
+                       (uint32) locations.size_, 0 };
+  memcpy(header + 2, &source_size, sizeof(source_size));
+  out.write((const char*) header, sizeof(header));
+  const vector<uint32>& start = locations.start_vec_;
+  out.write((const char*) &start[0], start.size() * sizeof(uint32));
+  if (start.size() % 2 != 0) {
+    uint32 pad = 0;
+    out.write((const char*) &pad, sizeof(pad));
+  }
+  const vector<uint32>& locs = locations.locs_vec_;
+  if (!locs.empty()) {
+    out.write((const char*) &locs[0], locs.size() * sizeof(uint32));
+  }
+  out.close();
+  return out.good();
+}
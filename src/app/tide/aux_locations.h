@@ -0,0 +1,72 @@
+// The auxiliary locations of the peptides of an index: for each peptide that
+// occurs in more than one place, the proteins and positions after the first
+// (see Peptide::AuxLocationsIndex()). Rather than one pb::AuxLocation, with
+// its own pb::Locations, per peptide, they are kept in two flat arrays: where
+// the locations of each peptide start, and the (protein id, position) pairs.
+//
+// tide-index can also write the arrays themselves next to auxlocs, as
+// auxlocs.flat (see the flat-auxlocs option), for tide-search to map into
+// memory instead of parsing auxlocs:
+//
+//     FLAT_AUXLOCS_MAGIC_NUMBER, 0 (uint32s)
+//     the size of the auxlocs file the arrays were made from (uint64)
+//     the number n of auxiliary locations, 0 (uint32s)
+//     the starts: n + 1 uint32s, then a 0 if n is even
+//     the pairs: 2 * start[n] uint32s
+//
+// all in the byte order of the machine that wrote the file. A flat file that
+// does not match the auxlocs file next to it, as after the index has been
+// changed by a tool that knows nothing of it, is not used.
+
+#ifndef AUX_LOCATIONS_H
+#define AUX_LOCATIONS_H
+
+#include <string>
+#include <vector>
+#include <google/protobuf/stubs/common.h>
+
+using namespace std;
+
+class HeadedRecordReader;
+
+#define FLAT_AUXLOCS_MAGIC_NUMBER  0xfead1236ul
+
+class AuxLocations {
+ public:
+  AuxLocations();
+  ~AuxLocations();
+
+  // Map flat_file if it is not empty and was made from auxlocs_file as it
+  // is now; otherwise read auxlocs_file. Returns false on an error.
+  bool Read(const string& auxlocs_file, const string& flat_file = "");
+
+  // Read the records of reader, as of an index built in memory.
+  bool Read(HeadedRecordReader* reader);
+
+  // Whether the locations are mapped from a flat file.
+  bool Mapped() const { return map_ != NULL; }
+
+  int Size() const { return size_; }
+  int NumLocations(int i) const { return start_[i + 1] - start_[i]; }
+  int ProteinId(int i, int j) const { return locs_[2 * (start_[i] + j)]; }
+  int Pos(int i, int j) const { return locs_[2 * (start_[i] + j) + 1]; }
+
+  // Write the flat form of auxlocs_file to flat_file.
+  static bool WriteFlat(const string& auxlocs_file, const string& flat_file);
+
+ private:
+  bool Map(const string& flat_file, google::protobuf::uint64 source_size);
+  bool Parse(const string& auxlocs_file);
+  bool Parse(HeadedRecordReader* reader);
+  void Account();
+
+  vector<google::protobuf::uint32> start_vec_, locs_vec_;
+  const google::protobuf::uint32* start_;
+  const google::protobuf::uint32* locs_;
+  int size_;
+  void* map_;
+  size_t map_size_;
+  long long accounted_bytes_;  // counted in MemoryAccounting
+};
+
+#endif // AUX_LOCATIONS_H
@@ -0,0 +1,34 @@
+// FNV-1a over the bytes of the values given in turn, for telling when the
+// inputs something was made from have changed (see preprocessed_store.h,
+// result_memo.h and index_shards.h). Not for anything adversarial.
+
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <string>
+#include <google/protobuf/stubs/common.h>
+
+class ContentHash {
+ public:
+  ContentHash() : hash_(14695981039346656037ULL) {}
+
+  template<class T>
+  void Add(const T& value) {
+    AddBytes(&value, sizeof(value));
+  }
+  void Add(const std::string& value) {
+    AddBytes(value.data(), value.size());
+  }
+  void AddBytes(const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; ++i)
+      hash_ = (hash_ ^ bytes[i]) * 1099511628211ULL;
+  }
+
+  google::protobuf::uint64 Value() const { return hash_; }
+
+ private:
+  google::protobuf::uint64 hash_;
+};
+
+#endif // CONTENT_HASH_H
@@ -20,7 +20,7 @@ SpSpectrum::~SpSpectrum() {
 }
 
 void SpSpectrum::PreprocessSpectrum(const Spectrum& spectrum, int charge) {
-  double precursor_mz = spectrum.PrecursorMZ();
+  double precursor_mz = spectrum.HighestPrecursorMZ(charge);
   double experimental_mass_cut_off = precursor_mz*charge + 50;
   double max_intensity = 0;
 
@@ -32,8 +32,7 @@ void SpSpectrum::PreprocessSpectrum(const Spectrum& spectrum, int charge) {
       continue;
 
     // skip all peaks within precursor ion mz +/- 15
-    if((peak_location < precursor_mz + 15) &&  
-       (peak_location > precursor_mz - 15))
+    if(spectrum.PrecursorDistance(peak_location) < 15)
       continue;
     
     // map peak location to bin
@@ -259,6 +258,11 @@ void SpSpectrum::ZeroPeakMeanStdev(int step, double* new_array) {
   double stdev = 0;
   int peak_count = 0;
   for(int idx = 0; idx < IntensityArraySize(); ++idx){
+    // The intensities are never negative, so neither are the mean and the
+    // stdev, and an empty bin cannot be extracted; most bins are empty.
+    if(intensity_array_[idx] <= 0)
+      continue;
+
     peak_count = 0;
   
     // get mean
@@ -17,7 +17,25 @@
 // Pages become available for reuse when all contents are Release()'d.
 //
 // On Linux we use mmap to allocate memory and we mark the page as executable
-// to provide run-time compilation of dot product calculations.
+// to provide run-time compilation of dot product calculations. Allocators that
+// only hold data ask for pages without exec permission.
+//
+// Pages given back by a deleted FifoPage are not unmapped but kept in a
+// process-wide pool, and handed out again to the next FifoPage of the same
+// size and permissions. The search creates a new set of allocators for each
+// spectrum file, and without the pool would map all their pages again. The
+// pool is guarded by a mutex, which is only taken when an allocator runs off
+// the end of its ring of pages, so it costs nothing on the New() path.
+//
+// With huge pages, page sizes are rounded up to 2MB. Transparent huge pages
+// are 2MB-aligned mappings advised with MADV_HUGEPAGE; the kernel backs them
+// with huge pages when it can. Explicit huge pages come from the hugetlb pool
+// (/proc/sys/vm/nr_hugepages); if that is empty we warn once and fall back to
+// transparent huge pages.
+//
+// With NUMA placement (see numa.h), each page is bound to the node of the
+// thread that will use it when it is mapped, and the pool only hands a page
+// out again to a FifoPage for the same node.
 
 #include <sys/types.h>
 #ifdef _MSC_VER
@@ -28,6 +46,9 @@
 #include<stdlib.h>
 #include<assert.h>
 #include<iostream>
+#include<vector>
+#include <boost/thread/mutex.hpp>
+#include "io/carp.h"
 #include "fifo_alloc.h"
 
 using namespace std;
@@ -36,6 +57,71 @@ using namespace std;
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+namespace {
+
+struct PooledPage {
+  void* page;
+  size_t size;
+  bool executable;
+  int node;
+};
+
+FifoHugePages huge_pages_mode = FIFO_HUGE_PAGES_NONE;
+bool hugetlb_failed = false;
+boost::mutex pool_mutex;
+vector<PooledPage> pool;  // only the pages no FifoPage holds
+FifoAllocStats stats = { 0, 0, 0, 0, 0 };
+
+}  // namespace
+
+void FifoPage::SetHugePages(FifoHugePages huge_pages) {
+  huge_pages_mode = huge_pages;
+}
+
+size_t FifoPage::PageSize(size_t size) {
+  if (huge_pages_mode == FIFO_HUGE_PAGES_NONE)
+    return size;
+  return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+FifoAllocStats FifoPage::Stats() {
+  boost::mutex::scoped_lock lock(pool_mutex);
+  return stats;
+}
+
+void FifoPage::ReleasePool() {
+  boost::mutex::scoped_lock lock(pool_mutex);
+  for (vector<PooledPage>::iterator i = pool.begin(); i != pool.end(); ++i)
+    UnmapPage(i->page, i->size);
+  pool.clear();
+}
+
+void* FifoPage::GetPage(size_t size, bool executable, int node) {
+  boost::mutex::scoped_lock lock(pool_mutex);
+  for (vector<PooledPage>::iterator i = pool.begin(); i != pool.end(); ++i) {
+    if (i->size == size && i->executable == executable && i->node == node) {
+      void* page = i->page;
+      *i = pool.back();
+      pool.pop_back();
+      ++stats.pages_reused;
+      return page;
+    }
+  }
+  stats.bytes_mapped += size;
+  ++stats.pages_mapped;
+  void* page = MapPage(size, executable);
+  Numa::BindPages(page, size, node);
+  return page;
+}
+
+void FifoPage::DeletePage(void* page, size_t size, bool executable, int node) {
+  boost::mutex::scoped_lock lock(pool_mutex);
+  PooledPage pooled = { page, size, executable, node };
+  pool.push_back(pooled);
+}
+
 #ifdef MMAP_SENTINEL_CHECK
 #undef NASSERT
 #define SENTINEL_DATA_SIZE 100
@@ -50,9 +136,9 @@ void CheckSentinel(void* p, size_t size) {
     CHECK(((char *) p)[i] == (char) SENTINEL_VALUE);
 }
 
-void* FifoPage::GetPage(size_t size) {
+void* FifoPage::MapPage(size_t size, bool executable) {
   // protections to allow exec (see above)
-  int mmap_prot_mode = PROT_READ | PROT_WRITE | PROT_EXEC;
+  int mmap_prot_mode = PROT_READ | PROT_WRITE | (executable ? PROT_EXEC : 0);
   // for sentinel data before and after
   size_t size_with_sentinels = size + 2 * SENTINEL_DATA_SIZE;
   void* p = mmap(0, size_with_sentinels, mmap_prot_mode, 
@@ -69,25 +155,57 @@ void* FifoPage::GetPage(size_t size) {
   return tmp;
 }
 
-void FifoPage::DeletePage(void* page, size_t size) {
+void FifoPage::UnmapPage(void* page, size_t size) {
   CheckSentinel((char *) page - SENTINEL_DATA_SIZE, SENTINEL_DATA_SIZE);
   CheckSentinel((char *) page + size, SENTINEL_DATA_SIZE);
   cerr << "munmap'ed " << page << endl;
   munmap((char *) page - SENTINEL_DATA_SIZE, size + 2 * SENTINEL_DATA_SIZE);
 }
 #else // MMAP_SENTINEL_CHECK
-void* FifoPage::GetPage(size_t size) {
+// Called with pool_mutex held, so that stats may be updated.
+void* FifoPage::MapPage(size_t size, bool executable) {
   // protections to allow exec (see above)
-  int mmap_prot_mode = PROT_READ | PROT_WRITE | PROT_EXEC;
-  void* p = mmap(0, size, mmap_prot_mode, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (p == NULL) {
+  int mmap_prot_mode = PROT_READ | PROT_WRITE | (executable ? PROT_EXEC : 0);
+  void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge_pages_mode == FIFO_HUGE_PAGES_EXPLICIT && !hugetlb_failed) {
+    p = mmap(0, size, mmap_prot_mode,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      ++stats.huge_pages_mapped;
+      return p;
+    }
+    carp(CARP_WARNING, "Could not map explicit huge pages for the FIFO "
+         "allocators; using transparent huge pages instead.");
+    hugetlb_failed = true;
+  }
+#endif
+#ifdef MADV_HUGEPAGE
+  if (huge_pages_mode != FIFO_HUGE_PAGES_NONE) {
+    // Map one huge page more than needed, and trim to an aligned range.
+    char* q = (char*) mmap(0, size + HUGE_PAGE_SIZE, mmap_prot_mode,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (q != (char*) MAP_FAILED) {
+      char* aligned = (char*) (((size_t) q + HUGE_PAGE_SIZE - 1)
+                               & ~(HUGE_PAGE_SIZE - 1));
+      if (aligned > q)
+        munmap(q, aligned - q);
+      munmap(aligned + size, q + HUGE_PAGE_SIZE - aligned);
+      if (madvise(aligned, size, MADV_HUGEPAGE) == 0)
+        ++stats.huge_pages_mapped;
+      return aligned;
+    }
+  }
+#endif
+  p = mmap(0, size, mmap_prot_mode, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
     cerr << "Failed to allocate FifoPage of size " << size << ". Aborting\n";
     abort();
   }
   return p;
 }
 
-void FifoPage::DeletePage(void* page, size_t size) {
+void FifoPage::UnmapPage(void* page, size_t size) {
   munmap(page, size);
 }
 #endif // MMAP_SENTINEL_CHECK
@@ -96,7 +214,8 @@ void* FifoAllocator::FallbackNew(size_t amount) {
   // Check if a free page is already in our linked list.
   FifoPage* free_page = current_page_->Next(); 
   if (free_page == first_page_) {  // No free page in linked list
-    FifoPage* new_page = new FifoPage(page_size_);
+    FifoPage* new_page = new FifoPage(page_size_, executable_);
+    MemoryAccounting::Add(account_, page_size_);
     current_page_->InsertPage(new_page);
     current_page_ = new_page;
   } else {
@@ -147,10 +266,15 @@ void FifoAllocator::ReleaseAll() {
 }
 
 FifoAllocator::~FifoAllocator() {
+  {
+    boost::mutex::scoped_lock lock(pool_mutex);
+    stats.bytes_allocated += allocated_;
+  }
   FifoPage* page = current_page_;
   do {
     FifoPage* next = page->Next();
     delete page;
+    MemoryAccounting::Add(account_, -(long long) page_size_);
     page = next;
   } while (page != current_page_);
 }
@@ -166,7 +290,3 @@ void FifoAllocator::Show() {
   }
   fprintf(stderr, "\n");
 }
-
-#ifdef MEM_STATS
-size_t FifoAllocator::total_ = 0;
-#endif
@@ -10,7 +10,9 @@
 // A page size, S, is supplied to the FifoAllocator constructor.
 // At most 2 * S extra memory will be allocated.
 //
-// Not thread safe! (TODO 254)
+// A FifoAllocator is not thread safe (TODO 254): each thread should use its
+// own. The pages themselves come from a process-wide pool (see .cc file), so
+// allocators may be created and destroyed on different threads.
 //
 // Unalloc() allows you to deallocate the most recently allocated pointer.
 //
@@ -27,24 +29,53 @@
 #ifndef FIFO_ALLOC_H
 #define FIFO_ALLOC_H
 
-//#define MEM_STATS 1
-
 #include<assert.h>
 #include<stdio.h>
+#include "numa.h"
+#include "util/MemoryAccounting.h"
+
+// Whether FifoPages are backed by 2MB huge pages, which saves TLB misses when
+// a wide window of peptides and programs is live. See fifo_alloc.cc.
+enum FifoHugePages {
+  FIFO_HUGE_PAGES_NONE,
+  FIFO_HUGE_PAGES_TRANSPARENT,  // aligned, and advised as huge to the kernel
+  FIFO_HUGE_PAGES_EXPLICIT      // from the reserved hugetlb pool
+};
+
+// Counts of the memory handed out to FifoAllocators, over the process.
+struct FifoAllocStats {
+  size_t pages_mapped;       // pages obtained from the system
+  size_t huge_pages_mapped;  // ... of which backed by huge pages
+  size_t pages_reused;       // pages handed out again from the pool
+  size_t bytes_mapped;       // total size of the pages obtained
+  size_t bytes_allocated;    // total of New() requests in destroyed allocators
+};
 
 // Used by FifoAllocator; probably not useful alone. See .cc file.
 class FifoPage {
  public:
-  explicit FifoPage(size_t size)
+  explicit FifoPage(size_t size, bool executable = true)
     : size_(size),
-    page_((char*) GetPage(size)),
+    executable_(executable),
+    node_(Numa::PreferredNode()),
+    page_((char*) GetPage(size, executable, node_)),
     end_(page_ + size_),
     next_(this),
     end_used_(page_),
     last_amt_(0) {
   }
 
-  ~FifoPage() { DeletePage(page_, size_); }
+  ~FifoPage() { DeletePage(page_, size_, executable_, node_); }
+
+  // Set how new pages are mapped. Call before any allocators are created.
+  static void SetHugePages(FifoHugePages huge_pages);
+  // The page size to use for a requested size: a multiple of the huge page
+  // size when huge pages are on.
+  static size_t PageSize(size_t size);
+
+  static FifoAllocStats Stats();
+  // Unmap the pages that no allocator is using.
+  static void ReleasePool();
 
   void Clear() { end_used_ = page_; }
   bool Empty() const { return end_used_ == page_; }
@@ -65,9 +96,12 @@ class FifoPage {
     end_used_ -= amount;
   }
 
-  void Unalloc(void* pos) {
+  // Returns the amount given back.
+  size_t Unalloc(void* pos) {
     assert(pos <= end_used_);
-    Unalloc(end_used_ - (char*) pos);
+    size_t amount = end_used_ - (char*) pos;
+    Unalloc(amount);
+    return amount;
   }
 
   void InsertPage(FifoPage* succ) {
@@ -92,30 +126,41 @@ class FifoPage {
 
  private:
   size_t size_;
+  bool executable_;
+  int node_;  // NUMA node the page is bound to, or -1 (see numa.h)
   char* page_;
   char* end_;
   FifoPage* next_;
   char* end_used_;
   size_t last_amt_;
 
-  static void* GetPage(size_t size);
-  static void DeletePage(void* page, size_t size);
+  // GetPage() and DeletePage() go through the pool; MapPage() and
+  // UnmapPage() go to the system.
+  static void* GetPage(size_t size, bool executable, int node);
+  static void DeletePage(void* page, size_t size, bool executable, int node);
+  static void* MapPage(size_t size, bool executable);
+  static void UnmapPage(void* page, size_t size);
 };
 
 
 class FifoAllocator {
  public:
-  explicit FifoAllocator(size_t page_size) : page_size_(page_size) {
-    current_page_ = new FifoPage(page_size_);
+  // Pages are mapped executable unless the allocator will only hold data
+  // (see compiler.h). The pages the allocator holds are counted against
+  // account (see util/MemoryAccounting.h).
+  explicit FifoAllocator(size_t page_size, bool executable = true,
+                         MEMORY_SUBSYSTEM_T account = MEMORY_FIFO_PROGRAMS)
+    : page_size_(FifoPage::PageSize(page_size)), executable_(executable),
+      account_(account), allocated_(0) {
+    current_page_ = new FifoPage(page_size_, executable_);
     first_page_ = current_page_;
+    MemoryAccounting::Add(account_, page_size_);
   }
 
   ~FifoAllocator();
 
   void* New(size_t amount) {
-#ifdef MEM_STATS
-    total_ += amount;
-#endif
+    allocated_ += amount;
     void* result = current_page_->New(amount);
     if (result != NULL)
       return result;
@@ -127,26 +172,27 @@ class FifoAllocator {
   void Release(void* first_used);
   void ReleaseAll();
 
-  void Unalloc(size_t amount) { current_page_->Unalloc(amount); }
-  void Unalloc(void* pos) { current_page_->Unalloc(pos); }
+  void Unalloc(size_t amount) {
+    current_page_->Unalloc(amount);
+    allocated_ -= amount;
+  }
+  void Unalloc(void* pos) { allocated_ -= current_page_->Unalloc(pos); }
 
   void Show();
 
-#ifdef MEM_STATS
-  static size_t Total() { return total_; }
-#endif
+  // Total of all New() requests so far, including those since released.
+  size_t Allocated() const { return allocated_; }
 
  private:
   // Called when current page full
   void* FallbackNew(size_t amount);
 
   size_t page_size_;
+  bool executable_;
+  MEMORY_SUBSYSTEM_T account_;
   FifoPage* first_page_;
   FifoPage* current_page_;
-
-#ifdef MEM_STATS
-  static size_t total_;
-#endif
+  size_t allocated_;
 };
 
 #endif // FIFO_ALLOC_H
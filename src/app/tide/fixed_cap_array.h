@@ -13,6 +13,9 @@
 // iterator supplied to match vector<> template usage.
 //
 // Init() will permit optional use of a FifoAllocator for allocation.
+//
+// Reserve() lets a client reuse one array for inputs of varying size; it only
+// reallocates (and discards the contents) when the capacity must grow.
 
 #ifndef FIXED_CAP_ARRAY_H
 #define FIXED_CAP_ARRAY_H
@@ -23,17 +26,28 @@ template <class C>
 class FixedCapacityArray {
  public:
   explicit FixedCapacityArray(int capacity)
-    : data_(new C[capacity]), size_(0), del_(true) {
+    : data_(new C[capacity]), size_(0), capacity_(capacity), del_(true) {
   }
 
   // must call Init before use
   FixedCapacityArray() 
     : data_(NULL), 
     size_(0),
+    capacity_(0),
     del_(true) {
   }
 
-  void Init(int capacity) { data_ = new C[capacity]; }
+  void Init(int capacity) { data_ = new C[capacity]; capacity_ = capacity; }
+
+  void Reserve(int capacity) {
+    assert(del_);
+    size_ = 0;
+    if (capacity <= capacity_)
+      return;
+    delete[] data_;
+    capacity_ = capacity > 2 * capacity_ ? capacity : 2 * capacity_;
+    data_ = new C[capacity_];
+  }
 
   void Init(FifoAllocator* fifo_alloc, int capacity) {
     if (fifo_alloc == NULL) {
@@ -42,6 +56,7 @@ class FixedCapacityArray {
     }
     void* buffer = fifo_alloc->New(capacity * sizeof(C));
     data_ = (C*) buffer;
+    capacity_ = capacity;
     del_ = false;
   }
 
@@ -72,6 +87,7 @@ class FixedCapacityArray {
  private:
   C* data_;
   int size_;
+  int capacity_;
 
   bool del_; // True if new/delete used. False if FifoAllocator used, 
              // in which case client deallocates.  
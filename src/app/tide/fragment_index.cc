@@ -0,0 +1,61 @@
+// Fragment ion prefilter for open searches; see fragment_index.h.
+
+#include <algorithm>
+#include "fragment_index.h"
+
+void FragmentIndex::Clear() {
+  peptide_bins_.clear();
+  peptide_ends_.clear();
+  bin_starts_.clear();
+  postings_.clear();
+}
+
+void FragmentIndex::AddPeptide(const TheoreticalPeakArr& peaks) {
+  // A b ion and a y ion may share a bin; count the bin once.
+  size_t begin = peptide_bins_.size();
+  for (int i = 0; i < peaks.size(); ++i)
+    peptide_bins_.push_back(peaks[i].Bin());
+  sort(peptide_bins_.begin() + begin, peptide_bins_.end());
+  peptide_bins_.erase(unique(peptide_bins_.begin() + begin, peptide_bins_.end()),
+                      peptide_bins_.end());
+  peptide_ends_.push_back(peptide_bins_.size());
+}
+
+void FragmentIndex::Build() {
+  // Counting sort of (bin, peptide) by bin. Peptides are visited in order, so
+  // each posting list comes out sorted.
+  int num_bins = 0;
+  for (size_t i = 0; i < peptide_bins_.size(); ++i)
+    num_bins = max(num_bins, peptide_bins_[i] + 1);
+  bin_starts_.assign(num_bins + 1, 0);
+  for (size_t i = 0; i < peptide_bins_.size(); ++i)
+    ++bin_starts_[peptide_bins_[i] + 1];
+  for (int bin = 0; bin < num_bins; ++bin)
+    bin_starts_[bin + 1] += bin_starts_[bin];
+
+  postings_.resize(peptide_bins_.size());
+  vector<int> next(bin_starts_.begin(), bin_starts_.end() - 1);
+  int begin = 0;
+  for (size_t peptide = 0; peptide < peptide_ends_.size(); ++peptide) {
+    for (int i = begin; i < peptide_ends_[peptide]; ++i)
+      postings_[next[peptide_bins_[i]]++] = peptide;
+    begin = peptide_ends_[peptide];
+  }
+  // The per-peptide lists are not needed once the postings are built.
+  vector<int>().swap(peptide_bins_);
+}
+
+void FragmentIndex::CountShared(const vector<int>& bins, int first, int last,
+                                int* counts) const {
+  int num_bins = (int)bin_starts_.size() - 1;
+  for (size_t i = 0; i < bins.size(); ++i) {
+    int bin = bins[i];
+    if (bin < 0 || bin >= num_bins)
+      continue;
+    vector<int>::const_iterator end = postings_.begin() + bin_starts_[bin + 1];
+    vector<int>::const_iterator p =
+      lower_bound(postings_.begin() + bin_starts_[bin], end, first);
+    for (; p != end && *p < last; ++p)
+      ++counts[*p - first];
+  }
+}
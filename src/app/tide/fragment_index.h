@@ -0,0 +1,47 @@
+// An inverted index from fragment ion bins to the peptides of one block of
+// the peptide index (see ActivePeptideQueue::LoadBlock()), used as a
+// prefilter in open searches: a spectrum first counts, for each candidate,
+// how many of its most intense peaks fall in a bin of one of the candidate's
+// charge 1 b or y ions, and only the candidates with the highest counts are
+// scored in full.
+//
+// Peptides are numbered from 0 in the order they are added, i.e. by their
+// position in the block. The posting list of each bin holds the numbers of
+// the peptides with a fragment in that bin, in increasing order, so that the
+// candidates of a spectrum, which are consecutive in the block, are found by
+// binary search.
+
+#ifndef FRAGMENT_INDEX_H
+#define FRAGMENT_INDEX_H
+
+#include <vector>
+#include "theoretical_peak_pair.h"
+
+using namespace std;
+
+class FragmentIndex {
+ public:
+  FragmentIndex() {}
+
+  void Clear();
+
+  // Add the next peptide, given its charge 1 theoretical peaks.
+  void AddPeptide(const TheoreticalPeakArr& peaks);
+
+  // Build the posting lists once all the peptides of the block are added.
+  void Build();
+
+  // For each bin of bins, add one to counts[p - first] for each peptide p in
+  // [first, last) with a fragment in that bin. counts must have room for
+  // last - first entries. Each bin should appear only once in bins.
+  void CountShared(const vector<int>& bins, int first, int last,
+                   int* counts) const;
+
+ private:
+  vector<int> peptide_bins_;  // distinct bins of each peptide, in order added
+  vector<int> peptide_ends_;  // end of each peptide's bins in peptide_bins_
+  vector<int> bin_starts_;    // start of each bin's posting list in postings_
+  vector<int> postings_;
+};
+
+#endif // FRAGMENT_INDEX_H
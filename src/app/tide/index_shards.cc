@@ -0,0 +1,253 @@
+// Mass-range shards of a peptide index; see index_shards.h.
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "index_shards.h"
+#include "aux_locations.h"
+#include "content_hash.h"
+#include "peptides.pb.h"
+#include "raw_proteins.pb.h"
+#include "records_to_vector-inl.h"
+#include "util/FileUtils.h"
+
+string ShardManifestName(const string& peptides_file) {
+  return peptides_file + ".shards";
+}
+
+bool ReadShardManifest(const string& manifest, vector<IndexShard>* shards) {
+  shards->clear();
+  ifstream in(manifest.c_str());
+  if (!in.good()) {
+    return false;
+  }
+  string dir = FileUtils::DirName(manifest);
+  string line;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    istringstream fields(line);
+    IndexShard shard;
+    if (!getline(fields, shard.file, '\t') ||
+        !(fields >> shard.min_mass >> shard.max_mass >> shard.peptides)) {
+      carp(CARP_ERROR, "Cannot parse line '%s' of %s", line.c_str(),
+           manifest.c_str());
+      return false;
+    }
+    if (!(fields >> hex >> shard.content_hash)) {
+      shard.content_hash = 0;
+    }
+    if (shard.file[0] != '/') {
+      shard.file = FileUtils::Join(dir, shard.file);
+    }
+    if (!shards->empty() && shard.min_mass < shards->back().max_mass) {
+      carp(CARP_ERROR, "The shards of %s are not in mass order",
+           manifest.c_str());
+      return false;
+    }
+    shards->push_back(shard);
+  }
+  return true;
+}
+
+// Add to hash what a search reports of peptide (see index_shards.h).
+static void HashPeptide(const pb::Peptide& peptide,
+                        const vector<const pb::Protein*>& proteins,
+                        const AuxLocations& locations, ContentHash* hash) {
+  hash->Add(peptide.mass());
+  hash->Add(peptide.length());
+  hash->Add(peptide.is_decoy());
+  hash->Add(peptide.modifications_size());
+  for (int i = 0; i < peptide.modifications_size(); ++i) {
+    hash->Add(peptide.modifications(i));
+  }
+  int num_locations = 1;
+  if (peptide.has_aux_locations_index()) {
+    num_locations += locations.NumLocations(peptide.aux_locations_index());
+  }
+  hash->Add(num_locations);
+  for (int i = 0; i < num_locations; ++i) {
+    int protein_id, pos;
+    if (i == 0) {
+      protein_id = peptide.first_location().protein_id();
+      pos = peptide.first_location().pos();
+    } else {
+      protein_id = locations.ProteinId(peptide.aux_locations_index(), i - 1);
+      pos = locations.Pos(peptide.aux_locations_index(), i - 1);
+    }
+    const pb::Protein* protein = proteins[protein_id];
+    // The residues of the peptide and one on either side
+    int begin = max(pos - 1, 0);
+    int end = min(pos + peptide.length() + 1, (int)protein->residues().size());
+    hash->Add(protein->name());
+    hash->Add(pos);
+    hash->Add(protein->residues().substr(begin, end - begin));
+  }
+}
+
+void WriteIndexShards(const string& peptides_file, int num_shards) {
+  // The first pass counts the peptides, so that the second can cut the
+  // shards at even counts.
+  long long total = 0;
+  {
+    HeadedRecordReader reader(peptides_file);
+    pb::Peptide peptide;
+    while (!reader.Done()) {
+      if (!reader.Read(&peptide)) {
+        carp(CARP_FATAL, "Error reading %s", peptides_file.c_str());
+      }
+      ++total;
+    }
+  }
+  if ((long long)num_shards > total) {
+    num_shards = total > 0 ? (int)total : 1;
+  }
+  carp(CARP_INFO, "Writing %lld peptides in %d shards...", total, num_shards);
+
+  string dir = FileUtils::DirName(peptides_file);
+  string proteins_file = FileUtils::Join(dir, "protix");
+  vector<const pb::Protein*> proteins;
+  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins, proteins_file)) {
+    carp(CARP_FATAL, "Error reading %s", proteins_file.c_str());
+  }
+  AuxLocations locations;
+  if (!locations.Read(FileUtils::Join(dir, "auxlocs"))) {
+    carp(CARP_FATAL, "Error reading the auxiliary locations of %s", dir.c_str());
+  }
+
+  pb::Header header;
+  HeadedRecordReader reader(peptides_file, &header);
+  // The offsets of a skip table would not hold in a shard
+  header.mutable_peptides_header()->clear_skip_table();
+  // What the modification codes of the peptides stand for; the rest of the
+  // header changes with every peptide added to the index.
+  const pb::Header::PeptidesHeader& peptides_header = header.peptides_header();
+  ContentHash header_hash;
+  header_hash.Add(peptides_header.mods().SerializeAsString());
+  header_hash.Add(peptides_header.nterm_mods().SerializeAsString());
+  header_hash.Add(peptides_header.cterm_mods().SerializeAsString());
+  header_hash.Add(peptides_header.decoys());
+  string manifest = ShardManifestName(peptides_file);
+  ofstream out(manifest.c_str());
+  if (!out.good()) {
+    carp(CARP_FATAL, "Cannot create the file %s", manifest.c_str());
+  }
+  out << "# file\tmin mass\tmax mass\tpeptides\tcontent hash" << endl;
+  out.precision(10);
+
+  string base = FileUtils::BaseName(peptides_file);
+  pb::Peptide peptide;
+  for (int k = 0; k < num_shards; ++k) {
+    long long end = total * (k + 1) / num_shards;
+    long long count = end - total * k / num_shards;
+    ostringstream name;
+    name << base << ".shard." << k;
+    HeadedRecordWriter writer(FileUtils::Join(FileUtils::DirName(peptides_file),
+                                              name.str()), header);
+    double min_mass = 0, max_mass = 0;
+    ContentHash hash = header_hash;
+    for (long long i = 0; i < count; ++i) {
+      if (reader.Done() || !reader.Read(&peptide)) {
+        carp(CARP_FATAL, "Error reading %s", peptides_file.c_str());
+      }
+      if (i == 0) {
+        min_mass = peptide.mass();
+      }
+      max_mass = peptide.mass();
+      HashPeptide(peptide, proteins, locations, &hash);
+      writer.Write(&peptide);
+    }
+    out << name.str() << '\t' << min_mass << '\t' << max_mass << '\t'
+        << count << '\t' << hex << hash.Value() << dec << endl;
+  }
+
+  for (vector<const pb::Protein*>::iterator i = proteins.begin();
+       i != proteins.end(); ++i) {
+    delete *i;
+  }
+}
+
+void RemoveIndexShards(const string& peptides_file) {
+  string manifest = ShardManifestName(peptides_file);
+  if (!FileUtils::Exists(manifest)) {
+    return;
+  }
+  vector<IndexShard> shards;
+  if (ReadShardManifest(manifest, &shards)) {
+    for (vector<IndexShard>::const_iterator i = shards.begin();
+         i != shards.end(); ++i) {
+      FileUtils::Remove(i->file);
+    }
+  }
+  FileUtils::Remove(manifest);
+}
+
+ShardedRecordReader::ShardedRecordReader(const vector<IndexShard>& shards,
+                                         bool map_file)
+  : shards_(shards), map_file_(map_file), next_(0), current_(NULL),
+    pending_(false), ok_(true), opened_(0) {
+}
+
+ShardedRecordReader::~ShardedRecordReader() {
+  delete current_;
+}
+
+bool ShardedRecordReader::Done() {
+  if (pending_) {
+    return false;
+  }
+  while (ok_) {
+    if (current_ == NULL) {
+      if (next_ >= shards_.size()) {
+        return true;
+      }
+      const string& file = shards_[next_++].file;
+      current_ = new HeadedRecordReader(file, NULL, -1, map_file_);
+      ++opened_;
+      if (!current_->OK()) {
+        carp(CARP_ERROR, "Cannot read the index shard %s", file.c_str());
+        ok_ = false;
+        break;
+      }
+    }
+    if (!current_->Done()) {
+      pending_ = true;  // current_ has read the size of the next record
+      return false;
+    }
+    delete current_;
+    current_ = NULL;
+  }
+  return true;
+}
+
+bool ShardedRecordReader::Read(google::protobuf::Message* message) {
+  if (!pending_ && Done()) {
+    return false;
+  }
+  pending_ = false;
+  return ok_ = current_->Read(message);
+}
+
+bool ShardedRecordReader::ReadBytes(string* bytes) {
+  if (!pending_ && Done()) {
+    return false;
+  }
+  pending_ = false;
+  return ok_ = current_->Reader()->ReadBytes(bytes);
+}
+
+void ShardedRecordReader::SkipBelow(double mass) {
+  if (current_ != NULL && shards_[next_ - 1].max_mass < mass) {
+    delete current_;
+    current_ = NULL;
+    pending_ = false;
+  }
+  if (current_ == NULL) {
+    while (next_ < shards_.size() && shards_[next_].max_mass < mass) {
+      ++next_;
+    }
+  } else if (!pending_) {
+    current_->Reader()->SkipTo(mass);
+  }
+}
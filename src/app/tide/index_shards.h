@@ -0,0 +1,88 @@
+// An index may also keep its peptides in mass-range shards (see tide-index's
+// index-shards option). Each shard is a complete peptide file, with the header
+// of pepix and the peptides of one mass range, and the text manifest
+// pepix.shards lists the shards in mass order, one per line:
+//
+//     <file> <tab> <min mass> <tab> <max mass> <tab> <number of peptides>
+//            [<tab> <content hash>]
+//
+// The content hash, in hex, covers everything a search reports of the
+// peptides of the shard: their masses, modifications and decoy flags, and
+// the name, position and flanking residues of each of their locations. Two
+// shards with the same hash give the same results to a spectrum, whichever
+// index they are in (see tide-search's result-memo option). Manifests
+// written before there were hashes have none.
+//
+// A file name that is not absolute is taken relative to the directory of the
+// manifest, so shards can be moved to other storage by editing it. Lines
+// starting with '#' are comments.
+//
+// ShardedRecordReader reads the peptides of the shards in order, as one file,
+// and can skip, without opening them, the shards whose peptides are all
+// lighter than a given mass. A search of spectra that cover only part of the
+// mass range then reads only the shards it needs.
+
+#ifndef INDEX_SHARDS_H
+#define INDEX_SHARDS_H
+
+#include <string>
+#include <vector>
+#include <google/protobuf/message.h>
+#include "records.h"
+
+using namespace std;
+
+struct IndexShard {
+  string file;
+  double min_mass;
+  double max_mass;
+  long long peptides;
+  google::protobuf::uint64 content_hash;  // 0 if the manifest gives none
+};
+
+// The name of the manifest of peptides_file.
+string ShardManifestName(const string& peptides_file);
+
+// Read a manifest into shards. Returns false if it cannot be read or parsed.
+bool ReadShardManifest(const string& manifest, vector<IndexShard>* shards);
+
+// Split peptides_file into num_shards shards of about equal numbers of
+// peptides, next to it, and write their manifest. The proteins and auxiliary
+// locations for the content hashes are read from protix and auxlocs next to
+// peptides_file.
+void WriteIndexShards(const string& peptides_file, int num_shards);
+
+// Delete the manifest of peptides_file and the shards that it lists, if any.
+void RemoveIndexShards(const string& peptides_file);
+
+class ShardedRecordReader {
+ public:
+  ShardedRecordReader(const vector<IndexShard>& shards, bool map_file);
+  ~ShardedRecordReader();
+
+  bool OK() const { return ok_; }
+
+  // Whether there are no more peptides; opens the next shard when the
+  // current one is done.
+  bool Done();
+  bool Read(google::protobuf::Message* message);
+  bool ReadBytes(string* bytes);  // see RecordReader::ReadBytes()
+
+  // Skip the rest of the current shard, and the shards after it, while
+  // their heaviest peptide is lighter than mass; within a shard, skip as far
+  // as RecordReader::SkipTo() can.
+  void SkipBelow(double mass);
+
+  int ShardsOpened() const { return opened_; }
+
+ private:
+  vector<IndexShard> shards_;
+  bool map_file_;
+  size_t next_;  // the next shard to open
+  HeadedRecordReader* current_;
+  bool pending_;  // whether Done() has found a record that is not yet Read()
+  bool ok_;
+  int opened_;
+};
+
+#endif // INDEX_SHARDS_H
@@ -0,0 +1,81 @@
+// A tree of losers for merging k sorted runs. The leaves are the runs; each
+// internal node holds the run that lost the match played there, and the
+// overall winner, the run with the least current element, is kept above the
+// root. Once the client has taken the winner's element and advanced that run,
+// Replay() plays the winner's new element up its own path only, one
+// comparison per level, where popping and pushing a binary heap takes about
+// two per level.
+//
+// Less(a, b) must tell whether the current element of run a comes before that
+// of run b. Runs are never compared once they are exhausted; an exhausted run
+// loses to every other run, and ties go to the run with the lower index.
+
+#ifndef LOSER_TREE_H
+#define LOSER_TREE_H
+
+#include <vector>
+
+template<class Run, class Less>
+class LoserTree {
+ public:
+  // exhausted[i] tells whether runs[i] is already out of elements.
+  LoserTree(const std::vector<Run*>& runs, const std::vector<bool>& exhausted,
+            Less less = Less())
+    : runs_(runs), exhausted_(exhausted), less_(less),
+      k_(runs.size()), tree_(runs.size() > 0 ? runs.size() : 1, 0) {
+    if (k_ > 1)
+      tree_[0] = Build(1);
+  }
+
+  // Whether all the runs are exhausted.
+  bool Empty() const { return k_ == 0 || exhausted_[tree_[0]]; }
+
+  // The run holding the least current element.
+  Run* Top() const { return runs_[tree_[0]]; }
+
+  // Restore the tree after the client has advanced Top(); exhausted tells
+  // whether that left the run without elements.
+  void Replay(bool exhausted) {
+    int winner = tree_[0];
+    exhausted_[winner] = exhausted;
+    for (int node = (winner + k_) / 2; node > 0; node /= 2) {
+      if (Beats(tree_[node], winner))
+        std::swap(tree_[node], winner);
+    }
+    tree_[0] = winner;
+  }
+
+ private:
+  // Play the matches below node, leaving the losers there; returns the
+  // winner. Leaf i is node k_ + i.
+  int Build(int node) {
+    if (node >= k_)
+      return node - k_;
+    int left = Build(2 * node);
+    int right = Build(2 * node + 1);
+    if (Beats(right, left)) {
+      tree_[node] = left;
+      return right;
+    }
+    tree_[node] = right;
+    return left;
+  }
+
+  bool Beats(int a, int b) {
+    if (exhausted_[a])
+      return false;
+    if (exhausted_[b])
+      return true;
+    if (less_(runs_[a], runs_[b]))
+      return true;
+    return !less_(runs_[b], runs_[a]) && a < b;
+  }
+
+  std::vector<Run*> runs_;
+  std::vector<bool> exhausted_;
+  Less less_;
+  int k_;
+  std::vector<int> tree_;  // tree_[0] is the winner, tree_[1..k_-1] losers
+};
+
+#endif // LOSER_TREE_H
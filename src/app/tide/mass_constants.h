@@ -97,6 +97,20 @@ class MassConstants {
     mod_coder_.DecodeMod(code, aa_index, &unique_delta_index);
     *delta = unique_deltas_[unique_delta_index];
   }
+  // The index of the delta in UniqueDelta(), rather than the delta itself.
+  static void DecodeMod(int code, int* aa_index, int* unique_delta_index) {
+    mod_coder_.DecodeMod(code, aa_index, unique_delta_index);
+  }
+  static int NumUniqueDeltas() { return unique_deltas_.size(); }
+  static double UniqueDelta(int unique_delta_index) {
+    return unique_deltas_[unique_delta_index];
+  }
+  // code, with its amino acid index changed to aa_index.
+  static int MoveMod(int code, int aa_index) {
+    int old_index, unique_delta_index;
+    mod_coder_.DecodeMod(code, &old_index, &unique_delta_index);
+    return mod_coder_.EncodeMod(aa_index, unique_delta_index);
+  }
   static unsigned int mass2bin(double mass, int charge = 1) {
     return (unsigned int)((mass + (charge - 1)*MASS_PROTON)/(charge*bin_width_) + 1.0 - bin_offset_);
   }
@@ -0,0 +1,252 @@
+// Memory estimates and plans for tide-search; see memory_plan.h.
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <google/protobuf/io/coded_stream.h>
+#include "memory_plan.h"
+#include "fifo_alloc.h"
+#include "header.pb.h"
+#include "index_shards.h"
+#include "peptide.h"
+#include "peptides.pb.h"
+#include "records.h"
+#include "spectrum.pb.h"
+#include "spectrum_collection.h"
+#include "io/carp.h"
+#include "util/FileUtils.h"
+
+DECLARE_int32(fifo_page_size);
+
+// Records read from the start of each file for the averages.
+static const int kSamplePeptides = 2000;
+static const int kSampleSpectra = 500;
+// A compiled program takes six bytes for each peak, and seven for its coda
+// (see compiler.h); a peak list takes four for each peak, and four more.
+static const int kJitBytesPerPeak = 6;
+static const int kJitBytesPerProgram = 7;
+static const int kIndexBytesPerPeak = 4;
+static const int kIndexBytesPerProgram = 4;
+// Without a skip table or shards, the densest window is taken to hold this
+// many times the average density of the index.
+static const double kUniformDensityFactor = 2.0;
+// Scores, observed peaks, evidence vectors and stack of a search thread.
+static const long long kThreadBytes = 16LL << 20;
+// Text and mzML spectrum files are only sized: roughly one peak for every 20
+// bytes of file, 200 peaks and two charges for each spectrum.
+static const double kFileBytesPerPeak = 20;
+static const double kPeaksPerSpectrum = 200;
+static const double kChargesPerSpectrum = 2;
+// Fewer spectrum-charge pairs than this in a batch and the search would
+// spend more time reading than scoring.
+static const int kMinSpectraInMemory = 1000;
+
+static long long RecordBytes(const google::protobuf::Message& message) {
+  int size = message.ByteSize();
+  return google::protobuf::io::CodedOutputStream::VarintSize32(size) + size;
+}
+
+// The most peptides within width Da of each other, from the masses and
+// offsets of every so many peptides.
+static double DensestWindow(const pb::Header::PeptidesHeader::SkipTable& skip,
+                            double bytes_per_peptide, double width) {
+  double most = 0;
+  int j = 0;
+  for (int i = 0; i < skip.mass_size(); ++i) {
+    while (j + 1 < skip.mass_size() && skip.mass(j) < skip.mass(i) + width) {
+      ++j;
+    }
+    most = max(most, (skip.offset(j) - skip.offset(i)) / bytes_per_peptide);
+  }
+  return most;
+}
+
+static double WindowWidth(const MemoryPlanInput& input, double max_mass) {
+  switch (input.window_type) {
+  case WINDOW_MZ:
+    return 2 * input.precursor_window * input.max_charge + input.isotope_span;
+  case WINDOW_PPM:
+    return 2 * input.precursor_window * 1e-6 * max_mass + input.isotope_span;
+  default:
+    return 2 * input.precursor_window + input.isotope_span;
+  }
+}
+
+// Fills in the peptide window of estimate from the index.
+static void EstimateWindow(const MemoryPlanInput& input, MemoryEstimate* estimate) {
+  string pepix = FileUtils::Join(input.index, "pepix");
+  vector<IndexShard> shards;
+  string manifest = ShardManifestName(pepix);
+  if (FileUtils::Exists(manifest) && !ReadShardManifest(manifest, &shards)) {
+    shards.clear();
+  }
+  pb::Header header;
+  HeadedRecordReader reader(shards.empty() ? pepix : shards.front().file, &header);
+  if (!reader.OK() || header.file_type() != pb::Header::PEPTIDES) {
+    carp(CARP_WARNING, "Cannot read %s to estimate memory.", pepix.c_str());
+    return;
+  }
+  const pb::Header::PeptidesHeader& peptides_header = header.peptides_header();
+  long long sample_bytes = 0, sample_residues = 0;
+  int sampled = 0;
+  pb::Peptide peptide;
+  while (sampled < kSamplePeptides && !reader.Done() && reader.Read(&peptide)) {
+    sample_bytes += RecordBytes(peptide);
+    sample_residues += peptide.length();
+    ++sampled;
+  }
+  if (sampled == 0) {
+    return;
+  }
+  double bytes_per_peptide = (double)sample_bytes / sampled;
+  double length = (double)sample_residues / sampled;
+  double width = WindowWidth(input, peptides_header.max_mass());
+
+  double peptides = 0;
+  if (!shards.empty()) {
+    for (vector<IndexShard>::const_iterator i = shards.begin(); i != shards.end(); ++i) {
+      double span = max(i->max_mass - i->min_mass, width);
+      peptides = max(peptides, i->peptides * min(1.0, width / span));
+    }
+  } else if (peptides_header.skip_table().mass_size() > 1) {
+    peptides = DensestWindow(peptides_header.skip_table(), bytes_per_peptide, width);
+  } else {
+    double total = FileUtils::Size(pepix) / bytes_per_peptide;
+    double span = max(peptides_header.max_mass() - peptides_header.min_mass(), width);
+    peptides = min(total, kUniformDensityFactor * total * width / span);
+  }
+  if (input.search_time_decoys && (DECOY_TYPE_T)peptides_header.decoys() == NO_DECOYS) {
+    peptides *= 2;
+  }
+
+  // Theoretical b and y ions at charge 1 for the first program, and at
+  // charges 1 and 2 for the second.
+  double peaks = 6 * max(0.0, length - 1);
+  double program_bytes = input.jit ?
+    kJitBytesPerPeak * peaks + 2 * kJitBytesPerProgram :
+    kIndexBytesPerPeak * peaks + 2 * kIndexBytesPerProgram;
+  estimate->window_peptides = peptides;
+  estimate->per_window = (long long)(peptides * (sizeof(Peptide) + program_bytes)) +
+    3 * (long long)FifoPage::PageSize((size_t)FLAGS_fifo_page_size << 20);
+}
+
+// Adds the spectra of file to estimate.
+static void EstimateSpectra(const string& file, bool merge, MemoryEstimate* estimate) {
+  long long file_bytes = FileUtils::Exists(file) ? FileUtils::Size(file) : 0;
+  double spectra, peaks, charges;
+  pb::Header header;
+  HeadedRecordReader reader(file, &header);
+  if (reader.OK() && header.file_type() == pb::Header::SPECTRA) {
+    long long sample_bytes = 0, sample_peaks = 0, sample_charges = 0;
+    int sampled = 0;
+    pb::Spectrum spectrum;
+    while (sampled < kSampleSpectra && !reader.Done() && reader.Read(&spectrum)) {
+      sample_bytes += RecordBytes(spectrum);
+      sample_peaks += spectrum.peak_m_z_size();
+      sample_charges += spectrum.charge_state_size();
+      ++sampled;
+    }
+    if (sampled == 0) {
+      return;
+    }
+    spectra = file_bytes / ((double)sample_bytes / sampled);
+    peaks = (double)sample_peaks / sampled;
+    charges = max(1.0, (double)sample_charges / sampled);
+  } else {
+    spectra = file_bytes / kFileBytesPerPeak / kPeaksPerSpectrum;
+    peaks = kPeaksPerSpectrum;
+    charges = kChargesPerSpectrum;
+  }
+  double per_spectrum = sizeof(Spectrum) + sizeof(Spectrum*) +
+    2 * sizeof(double) * peaks + sizeof(int) * charges +
+    sizeof(SpectrumCollection::SpecCharge) * charges;
+  long long bytes = (long long)(spectra * per_spectrum);
+  long long spec_charges = (long long)(spectra * charges);
+  if (merge) {
+    estimate->spectra += bytes;
+    estimate->spec_charges += spec_charges;
+  } else {
+    estimate->spectra = max(estimate->spectra, bytes);
+    estimate->spec_charges = max(estimate->spec_charges, spec_charges);
+  }
+  estimate->per_spec_charge = max(estimate->per_spec_charge,
+                                  (long long)(per_spectrum / charges));
+}
+
+MemoryEstimate EstimateMemory(const MemoryPlanInput& input) {
+  MemoryEstimate estimate = { 0, 0, 0, 0, 0, 0 };
+  // The proteins and locations take about twice their records once parsed.
+  // An index built in memory has no files, and is small enough to leave out.
+  if (!input.index.empty()) {
+    string protix = FileUtils::Join(input.index, "protix");
+    string auxlocs = FileUtils::Join(input.index, "auxlocs");
+    if (FileUtils::Exists(protix)) {
+      estimate.fixed += 2 * FileUtils::Size(protix);
+    }
+    if (FileUtils::Exists(auxlocs)) {
+      estimate.fixed += 2 * FileUtils::Size(auxlocs);
+    }
+    EstimateWindow(input, &estimate);
+  }
+  for (vector<string>::const_iterator i = input.spectrum_files.begin();
+       i != input.spectrum_files.end(); ++i) {
+    EstimateSpectra(*i, input.merge_spectrum_files, &estimate);
+  }
+  return estimate;
+}
+
+long long EstimatedTotal(const MemoryPlanInput& input, const MemoryEstimate& estimate,
+                         int threads, int max_spectra_in_memory) {
+  int windows = input.shared_window && threads > 1 ? 1 : threads;
+  long long spectra = max_spectra_in_memory <= 0 ? estimate.spectra :
+    estimate.spec_charges * (long long)sizeof(SpectrumCollection::SpecChargeKey) +
+    min((long long)max_spectra_in_memory, estimate.spec_charges) * estimate.per_spec_charge;
+  return estimate.fixed + windows * estimate.per_window + threads * kThreadBytes + spectra;
+}
+
+MemoryPlan PlanMemory(const MemoryPlanInput& input, const MemoryEstimate& estimate) {
+  MemoryPlan plan;
+  plan.threads = input.threads;
+  plan.max_spectra_in_memory = input.max_spectra_in_memory;
+  plan.total = EstimatedTotal(input, estimate, plan.threads, plan.max_spectra_in_memory);
+  plan.fits = input.budget <= 0 || plan.total <= input.budget;
+  if (plan.fits) {
+    return plan;
+  }
+  for (int threads = input.threads; threads >= 1; --threads) {
+    plan.threads = threads;
+    if (input.max_spectra_in_memory == 0) {
+      plan.max_spectra_in_memory = 0;
+      plan.total = EstimatedTotal(input, estimate, threads, 0);
+      if (plan.total <= input.budget) {
+        plan.fits = true;
+        return plan;
+      }
+    }
+    if (!input.can_stream || estimate.per_spec_charge <= 0) {
+      continue;
+    }
+    // The largest batch that fits, but no larger than the one requested
+    long long base = EstimatedTotal(input, estimate, threads, 1) - estimate.per_spec_charge;
+    long long batch = (input.budget - base) / estimate.per_spec_charge;
+    if (input.max_spectra_in_memory > 0) {
+      batch = min(batch, (long long)input.max_spectra_in_memory);
+    }
+    batch = min(batch, max(estimate.spec_charges, (long long)kMinSpectraInMemory));
+    if (batch >= kMinSpectraInMemory ||
+        (input.max_spectra_in_memory > 0 && batch >= input.max_spectra_in_memory)) {
+      plan.max_spectra_in_memory = (int)batch;
+      plan.total = EstimatedTotal(input, estimate, threads, plan.max_spectra_in_memory);
+      plan.fits = true;
+      return plan;
+    }
+  }
+  // Nothing fits; use as little as the search can.
+  plan.threads = 1;
+  if (input.can_stream) {
+    plan.max_spectra_in_memory = input.max_spectra_in_memory > 0 ?
+      min(input.max_spectra_in_memory, kMinSpectraInMemory) : kMinSpectraInMemory;
+  }
+  plan.total = EstimatedTotal(input, estimate, plan.threads, plan.max_spectra_in_memory);
+  plan.fits = false;
+  return plan;
+}
@@ -0,0 +1,68 @@
+// Estimates of the memory a search will need, and a plan that keeps it within
+// a budget (see tide-search's max-memory option).
+//
+// Most of a search's memory goes to three things: the spectra of the file
+// being searched, the window of candidate peptides that each thread's
+// ActivePeptideQueue keeps with their compiled programs, and the proteins and
+// auxiliary locations of the index. EstimateMemory() sizes each from a sample
+// of the records at the start of the files it is given, and from the
+// densest part of the index's mass range, which the skip table or shard
+// manifest shows. The estimates are rough, but the search's own accounting
+// (util/MemoryAccounting.h) logs what was used, to compare against.
+//
+// PlanMemory() keeps the requested number of threads and reads each spectrum
+// file whole if that fits the budget. Otherwise it streams the spectra, in
+// the largest batches that fit, and if that is not enough it lowers the
+// number of threads.
+
+#ifndef MEMORY_PLAN_H
+#define MEMORY_PLAN_H
+
+#include <string>
+#include <vector>
+#include "model/objects.h"
+
+using namespace std;
+
+struct MemoryPlanInput {
+  string index;                  // tide-index directory, or empty for one in memory
+  vector<string> spectrum_files; // as given to tide-search
+  bool merge_spectrum_files;     // all the files are in memory at once
+  WINDOW_TYPE_T window_type;
+  double precursor_window;
+  int max_charge;
+  double isotope_span;           // Da between the lowest and highest isotope error
+  int threads;
+  bool shared_window;            // one peptide window for all the threads
+  bool jit;                      // programs are compiled rather than peak lists
+  bool search_time_decoys;
+  bool can_stream;               // whether spectra may be read in batches
+  int max_spectra_in_memory;     // as requested, 0 if none
+  long long budget;              // bytes, 0 if none
+};
+
+struct MemoryEstimate {
+  long long fixed;               // proteins and auxiliary locations
+  long long per_window;          // one peptide window and its FIFO pages
+  long long spectra;             // the spectra of the largest file, read whole
+  long long per_spec_charge;     // one spectrum-charge pair, when streamed
+  long long spec_charges;        // in the largest file
+  double window_peptides;        // in the densest window
+};
+
+struct MemoryPlan {
+  int threads;
+  int max_spectra_in_memory;     // 0 reads each spectrum file whole
+  long long total;               // estimated peak bytes
+  bool fits;
+};
+
+MemoryEstimate EstimateMemory(const MemoryPlanInput& input);
+
+// The estimated peak bytes of a search with the given threads and batch size.
+long long EstimatedTotal(const MemoryPlanInput& input, const MemoryEstimate& estimate,
+                         int threads, int max_spectra_in_memory);
+
+MemoryPlan PlanMemory(const MemoryPlanInput& input, const MemoryEstimate& estimate);
+
+#endif // MEMORY_PLAN_H
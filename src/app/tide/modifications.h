@@ -197,6 +197,20 @@ class VariableModTable {
     }
     return true;
   }
+  // Rebuild the table from the modification tables of an index header, as
+  // Parse() and SerializeUniqueDeltas() made them when the index was built.
+  bool Load(const pb::ModTable& mods, const pb::ModTable& nterm_mods,
+            const pb::ModTable& cterm_mods) {
+    ClearTables();
+    unique_delta_.clear();
+    max_counts_.clear();
+    // in the order in which TideIndexApplication parses them
+    Copy(mods, &pb_mod_table_);
+    Copy(cterm_mods, &pb_ctpep_mod_table_);
+    Copy(nterm_mods, &pb_ntpep_mod_table_);
+    return SerializeUniqueDeltas();
+  }
+
   void ClearTables() {
     pb_mod_table_.Clear();
     pb_ntpep_mod_table_.Clear();
@@ -345,6 +359,17 @@ class VariableModTable {
     return false;
   }
 
+  void Copy(const pb::ModTable& from, pb::ModTable* to) {
+    for (int i = 0; i < from.static_mod_size(); ++i)
+      to->add_static_mod()->CopyFrom(from.static_mod(i));
+    for (int i = 0; i < from.variable_mod_size(); ++i) {
+      const pb::Modification& mod = from.variable_mod(i);
+      to->add_variable_mod()->CopyFrom(mod);
+      unique_delta_.push_back(mod.delta());
+      max_counts_.push_back(mod.max_count());
+    }
+  }
+
   typedef vector<pair<int, int> > IntPairVec;
   IntPairVec possibles_[256]; // unique_delta_, max_count_
   IntPairVec possibles_ctpe_[256]; // unique_delta_, max_count_  cterminal peptide
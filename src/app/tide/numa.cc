@@ -0,0 +1,212 @@
+// NUMA placement of the search threads; see numa.h.
+
+#include "numa.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "io/carp.h"
+
+using namespace std;
+
+// From <linux/mempolicy.h>, which not every libc ships.
+static const int kMpolDefault = 0;
+static const int kMpolPreferred = 1;
+static const int kMpolInterleave = 3;
+static const int kMaxNodes = 1024;
+static const int kMaskWords = kMaxNodes / (8 * sizeof(unsigned long));
+
+namespace {
+
+struct Node {
+  int id;
+  vector<int> cpus;
+};
+
+bool enabled = false;
+vector<Node> nodes;
+cpu_set_t process_cpus;
+__thread int preferred_node = -1;
+__thread int bound_node = -1;
+
+// CPU lists in sysfs look like "0-15,32-47".
+vector<int> ParseCpuList(const string& list, const cpu_set_t& allowed) {
+  vector<int> cpus;
+  stringstream in(list);
+  string range;
+  while (getline(in, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    int first = atoi(range.c_str());
+    size_t dash = range.find('-');
+    int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+    for (int cpu = first; cpu <= last; ++cpu) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+void SetPolicy(int mode, int node) {
+  unsigned long mask[kMaskWords];
+  memset(mask, 0, sizeof(mask));
+  if (mode == kMpolInterleave) {
+    for (vector<Node>::const_iterator i = nodes.begin(); i != nodes.end(); ++i) {
+      mask[i->id / (8 * sizeof(unsigned long))] |= 1UL << (i->id % (8 * sizeof(unsigned long)));
+    }
+  } else if (node >= 0) {
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  }
+  if (syscall(SYS_set_mempolicy, mode, mode == kMpolDefault ? NULL : mask,
+              mode == kMpolDefault ? 0 : kMaxNodes) != 0) {
+    carp(CARP_DEBUG, "set_mempolicy failed: %s", strerror(errno));
+  }
+}
+
+// The policy for the calling thread outside an InterleaveScope.
+void RestorePolicy() {
+  if (bound_node >= 0) {
+    SetPolicy(kMpolPreferred, bound_node);
+  } else {
+    SetPolicy(kMpolDefault, -1);
+  }
+}
+
+}  // namespace
+
+bool Numa::Init() {
+  if (enabled) {
+    return true;
+  }
+  if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) != 0) {
+    return false;
+  }
+  nodes.clear();
+  for (int id = 0; id < kMaxNodes; ++id) {
+    stringstream path;
+    path << "/sys/devices/system/node/node" << id << "/cpulist";
+    ifstream in(path.str().c_str());
+    if (!in) {
+      continue;
+    }
+    string list;
+    getline(in, list);
+    Node node;
+    node.id = id;
+    node.cpus = ParseCpuList(list, process_cpus);
+    if (!node.cpus.empty()) {
+      nodes.push_back(node);
+    }
+  }
+  enabled = nodes.size() > 1;
+  return enabled;
+}
+
+bool Numa::Enabled() {
+  return enabled;
+}
+
+int Numa::Nodes() {
+  return enabled ? nodes.size() : 1;
+}
+
+int Numa::ThreadNode(int thread_num) {
+  return enabled ? nodes[thread_num % nodes.size()].id : -1;
+}
+
+void Numa::BindThread(int thread_num) {
+  if (!enabled) {
+    return;
+  }
+  // Consecutive threads go to different nodes, and the threads of a node to
+  // different cores of it.
+  const Node& node = nodes[thread_num % nodes.size()];
+  int cpu = node.cpus[(thread_num / nodes.size()) % node.cpus.size()];
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    carp(CARP_DEBUG, "Could not pin thread %d to CPU %d: %s", thread_num, cpu,
+         strerror(errno));
+  }
+  bound_node = node.id;
+  preferred_node = node.id;
+  RestorePolicy();
+}
+
+void Numa::UnbindThread() {
+  if (!enabled || bound_node < 0) {
+    return;
+  }
+  sched_setaffinity(0, sizeof(process_cpus), &process_cpus);
+  bound_node = -1;
+  preferred_node = -1;
+  RestorePolicy();
+}
+
+int Numa::PreferredNode() {
+  return preferred_node;
+}
+
+Numa::NodeScope::NodeScope(int node) : saved_(preferred_node) {
+  preferred_node = node;
+}
+
+Numa::NodeScope::~NodeScope() {
+  preferred_node = saved_;
+}
+
+void Numa::BindPages(void* addr, size_t size, int node) {
+  if (!enabled || node < 0) {
+    return;
+  }
+  unsigned long mask[kMaskWords];
+  memset(mask, 0, sizeof(mask));
+  mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  // Preferred rather than strict, so that a full node does not fail the
+  // search.
+  if (syscall(SYS_mbind, addr, size, kMpolPreferred, mask, kMaxNodes, 0) != 0) {
+    carp(CARP_DEBUG, "mbind failed: %s", strerror(errno));
+  }
+}
+
+Numa::InterleaveScope::InterleaveScope() : active_(enabled) {
+  if (active_) {
+    SetPolicy(kMpolInterleave, -1);
+  }
+}
+
+Numa::InterleaveScope::~InterleaveScope() {
+  if (active_) {
+    RestorePolicy();
+  }
+}
+
+#else // __linux__
+
+bool Numa::Init() { return false; }
+bool Numa::Enabled() { return false; }
+int Numa::Nodes() { return 1; }
+int Numa::ThreadNode(int thread_num) { return -1; }
+void Numa::BindThread(int thread_num) {}
+void Numa::UnbindThread() {}
+int Numa::PreferredNode() { return -1; }
+Numa::NodeScope::NodeScope(int node) : saved_(-1) {}
+Numa::NodeScope::~NodeScope() {}
+void Numa::BindPages(void* addr, size_t size, int node) {}
+Numa::InterleaveScope::InterleaveScope() : active_(false) {}
+Numa::InterleaveScope::~InterleaveScope() {}
+
+#endif // __linux__
@@ -0,0 +1,63 @@
+// Placement of the search threads and their memory on the nodes of a NUMA
+// machine (see tide-search's numa-placement option).
+//
+// With placement on, search thread t runs on the cores of node t % Nodes(),
+// and the pages its FifoAllocators map are bound to that node, so the
+// peptide window and theoretical peaks of each thread stay in local memory.
+// The data that all the threads read, the proteins and spectra, are loaded
+// with their pages interleaved over the nodes, so that no one node's memory
+// controller serves every thread.
+//
+// Placement uses the Linux scheduler affinity and memory policy system calls
+// directly and needs no libnuma. Elsewhere, and on machines with one node,
+// Init() returns false and every other call does nothing.
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+
+class Numa {
+ public:
+  // Read the node topology from /sys/devices/system/node and turn placement
+  // on. Returns whether the machine has more than one node.
+  static bool Init();
+  static bool Enabled();
+  static int Nodes();
+
+  // The node search thread thread_num is placed on, or -1 without placement.
+  static int ThreadNode(int thread_num);
+
+  // Run the calling thread on a core of ThreadNode(thread_num), and have the
+  // pages it maps come from that node. UnbindThread() lets it run anywhere
+  // again, as before the first BindThread().
+  static void BindThread(int thread_num);
+  static void UnbindThread();
+
+  // The node the FifoPages the calling thread creates are bound to, or -1
+  // for none; BindThread() sets it. NodeScope sets it for a block, e.g.
+  // while the main thread builds the queue of another thread.
+  static int PreferredNode();
+  class NodeScope {
+   public:
+    explicit NodeScope(int node);
+    ~NodeScope();
+   private:
+    int saved_;
+  };
+
+  // Bind the pages of [addr, addr + size) to node, before they are touched.
+  static void BindPages(void* addr, size_t size, int node);
+
+  // While an InterleaveScope is alive, the pages the calling thread touches
+  // for the first time are spread over all the nodes.
+  class InterleaveScope {
+   public:
+    InterleaveScope();
+    ~InterleaveScope();
+   private:
+    bool active_;
+  };
+};
+
+#endif // NUMA_H
@@ -0,0 +1,385 @@
+// Scoring by stored peak indices; see peak_index.h.
+
+#include <assert.h>
+#include "io/carp.h"
+#include "peptide.h"
+#include "peak_index.h"
+#ifdef TIDE_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+#ifdef TIDE_HAVE_NEON
+#include <arm_neon.h>
+#endif
+#ifdef TIDE_HAVE_CUDA
+#include <vector>
+#include "peak_index_cuda.h"
+#endif
+
+ScoringBackend PeakIndexScorer::cuda_host_backend_ = SCORING_SCALAR;
+
+ScoringBackend PeakIndexScorer::Select(const string& name) {
+  bool avx2 = false;
+  bool avx512 = false;
+  bool neon = false;
+#ifdef TIDE_HAVE_NEON
+  neon = true;
+#endif
+#ifdef TIDE_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  avx2 = __builtin_cpu_supports("avx2");
+  avx512 = __builtin_cpu_supports("avx512f");
+#endif
+#ifdef TIDE_HAVE_JIT
+  const ScoringBackend fallback = SCORING_JIT;
+#else
+  const ScoringBackend fallback = SCORING_SCALAR;
+#endif
+  ScoringBackend best = avx512 ? SCORING_AVX512 : avx2 ? SCORING_AVX2 :
+                        neon ? SCORING_NEON : fallback;
+
+  if (name == "auto") {
+    return best;
+  } else if (name == "scalar") {
+    return SCORING_SCALAR;
+  } else if (name == "jit") {
+#ifdef TIDE_HAVE_JIT
+    return SCORING_JIT;
+#endif
+  } else if (name == "avx2") {
+    if (avx2) {
+      return SCORING_AVX2;
+    }
+  } else if (name == "avx512") {
+    if (avx512) {
+      return SCORING_AVX512;
+    }
+  } else if (name == "neon") {
+    if (neon) {
+      return SCORING_NEON;
+    }
+  } else if (name == "scalar16") {
+    return SCORING_SCALAR16;
+  } else if (name == "avx2-16") {
+    if (avx2) {
+      return SCORING_AVX2_16;
+    }
+    carp(CARP_WARNING, "Scoring backend 'avx2-16' is not supported on this host; "
+         "using 'scalar16'.");
+    return SCORING_SCALAR16;
+  } else if (name == "cuda") {
+#ifdef TIDE_HAVE_CUDA
+    if (CudaScoringAvailable()) {
+      // The queue holds peak index lists for the GPU, so the CPU side cannot
+      // use generated programs.
+      cuda_host_backend_ = best == SCORING_JIT ? SCORING_SCALAR : best;
+      return SCORING_CUDA;
+    }
+#endif
+  } else {
+    carp(CARP_WARNING, "Unknown scoring backend '%s'.", name.c_str());
+    return best;
+  }
+  carp(CARP_WARNING, "Scoring backend '%s' is not supported on this host; using '%s'.",
+       name.c_str(), Name(best));
+  return best;
+}
+
+const char* PeakIndexScorer::Name(ScoringBackend backend) {
+  switch (backend) {
+  case SCORING_JIT: return "jit";
+  case SCORING_SCALAR: return "scalar";
+  case SCORING_AVX2: return "avx2";
+  case SCORING_AVX512: return "avx512";
+  case SCORING_NEON: return "neon";
+  case SCORING_CUDA: return "cuda";
+  case SCORING_SCALAR16: return "scalar16";
+  case SCORING_AVX2_16: return "avx2-16";
+  }
+  return "unknown";
+}
+
+void PeakIndexScorer::Score(ScoringBackend backend,
+                            deque<Peptide*>::const_iterator first,
+                            int count, int charge, const int* cache,
+                            pair<int, int>* results) {
+  DotFunc dot = DotFunction(backend);
+  for (int counter = count; counter > 0; --counter, ++first, ++results) {
+    results->first = dot((const int*) (*first)->Prog(charge), cache);
+    results->second = counter;
+  }
+}
+
+void PeakIndexScorer::ScoreBatch(ScoringBackend backend, int num_spectra,
+                                 const deque<Peptide*>::const_iterator* first,
+                                 const int* count, const int* charge,
+                                 const int* const* cache,
+                                 pair<int, int>* const* results) {
+  if (num_spectra == 0) {
+    return;
+  }
+  if (backend == SCORING_CUDA) {
+    ScoreBatchCUDA(num_spectra, first, count, charge, cache, results);
+    return;
+  }
+  DotFunc dot = DotFunction(backend);
+  // Walk the union of the candidate ranges once. Offsets are relative to the
+  // lightest first candidate.
+  deque<Peptide*>::const_iterator begin = first[0];
+  for (int k = 1; k < num_spectra; ++k) {
+    if (first[k] < begin) {
+      begin = first[k];
+    }
+  }
+  assert(num_spectra <= MAX_BATCH_SIZE);
+  int start[MAX_BATCH_SIZE];
+  int union_end = 0;
+  for (int k = 0; k < num_spectra; ++k) {
+    start[k] = first[k] - begin;
+    if (start[k] + count[k] > union_end) {
+      union_end = start[k] + count[k];
+    }
+  }
+  deque<Peptide*>::const_iterator peptide = begin;
+  for (int j = 0; j < union_end; ++j, ++peptide) {
+    for (int k = 0; k < num_spectra; ++k) {
+      int pos = j - start[k];
+      if (pos >= 0 && pos < count[k]) {
+        results[k][pos].first = dot((const int*) (*peptide)->Prog(charge[k]), cache[k]);
+        results[k][pos].second = count[k] - pos;
+      }
+    }
+  }
+}
+
+PeakIndexScorer::DotFunc PeakIndexScorer::DotFunction(ScoringBackend backend) {
+  switch (backend) {
+  case SCORING_AVX2: return DotAVX2;
+  case SCORING_AVX512: return DotAVX512;
+  case SCORING_NEON: return DotNEON;
+  case SCORING_SCALAR16: return DotScalar16;
+  case SCORING_AVX2_16: return DotAVX2_16;
+  case SCORING_CUDA: return DotFunction(cuda_host_backend_);
+  default: break;
+  }
+  assert(backend == SCORING_SCALAR);
+  return DotScalar;
+}
+
+#ifdef TIDE_HAVE_CUDA
+
+void PeakIndexScorer::ScoreBatchCUDA(int num_spectra,
+                                     const deque<Peptide*>::const_iterator* first,
+                                     const int* count, const int* charge,
+                                     const int* const* cache,
+                                     pair<int, int>* const* results) {
+  // As in ScoreBatch(), the candidates are offsets into the union of the
+  // candidate ranges. Its peak lists are packed once for each kind of
+  // program the spectra need (see Peptide::Prog()), lists for charges
+  // above 2 after those for charges 1 and 2.
+  deque<Peptide*>::const_iterator begin = first[0];
+  for (int k = 1; k < num_spectra; ++k) {
+    if (first[k] < begin) {
+      begin = first[k];
+    }
+  }
+  int union_end = 0;
+  bool need[2] = { false, false };
+  for (int k = 0; k < num_spectra; ++k) {
+    union_end = max(union_end, (int)(first[k] - begin) + count[k]);
+    need[charge[k] <= 2 ? 0 : 1] = true;
+  }
+  vector<int> peaks, list_begin;
+  int list_base[2] = { 0, 0 };
+  for (int p = 0; p < 2; ++p) {
+    if (!need[p]) {
+      continue;
+    }
+    list_base[p] = list_begin.size();
+    deque<Peptide*>::const_iterator peptide = begin;
+    for (int j = 0; j < union_end; ++j, ++peptide) {
+      const int* list = (const int*) (*peptide)->Prog(p == 0 ? 2 : 3);
+      list_begin.push_back(peaks.size());
+      peaks.insert(peaks.end(), list + 1, list + 1 + list[0]);
+    }
+  }
+  int num_lists = list_begin.size();
+  list_begin.push_back(peaks.size());
+
+  int cache_size = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+  vector<int> caches((size_t) num_spectra * cache_size);
+  vector<int> first_list(num_spectra);
+  int pairs = 0;
+  for (int k = 0; k < num_spectra; ++k) {
+    copy(cache[k], cache[k] + cache_size, caches.begin() + (size_t) k * cache_size);
+    first_list[k] = list_base[charge[k] <= 2 ? 0 : 1] + (first[k] - begin);
+    pairs += count[k];
+  }
+  vector<int> scores(max(pairs, 1));
+  CudaScoreBatch(peaks.empty() ? NULL : &peaks[0], &list_begin[0], num_lists,
+                 &caches[0], cache_size, num_spectra, &first_list[0], count,
+                 &scores[0]);
+
+  const int* score = &scores[0];
+  for (int k = 0; k < num_spectra; ++k) {
+    for (int pos = 0; pos < count[k]; ++pos) {
+      results[k][pos].first = *score++;
+      results[k][pos].second = count[k] - pos;
+    }
+  }
+}
+
+#else // TIDE_HAVE_CUDA
+
+// Select() never picks cuda without it.
+void PeakIndexScorer::ScoreBatchCUDA(int num_spectra,
+                                     const deque<Peptide*>::const_iterator* first,
+                                     const int* count, const int* charge,
+                                     const int* const* cache,
+                                     pair<int, int>* const* results) {
+  ScoreBatch(SCORING_SCALAR, num_spectra, first, count, charge, cache, results);
+}
+
+#endif // TIDE_HAVE_CUDA
+
+int PeakIndexScorer::DotScalar(const int* peaks, const int* cache) {
+  int count = *peaks++;
+  // Unsigned, so that overflow wraps just as the generated add instructions
+  // do.
+  unsigned int total = 0;
+  for (int i = 0; i < count; ++i) {
+    total += cache[peaks[i]];
+  }
+  return (int) total;
+}
+
+int PeakIndexScorer::DotScalar16(const int* peaks, const int* cache16) {
+  int count = *peaks++;
+  int shift = cache16[0];
+  const short* cache = (const short*) (cache16 + 1);
+  unsigned int total = 0;
+  for (int i = 0; i < count; ++i) {
+    total += cache[peaks[i]];
+  }
+  return (int) (total << shift);
+}
+
+#ifdef TIDE_HAVE_X86_SIMD
+
+__attribute__((target("avx2")))
+int PeakIndexScorer::DotAVX2_16(const int* peaks, const int* cache16) {
+  int count = *peaks++;
+  int shift = cache16[0];
+  // There is no 16-bit gather; each lane gathers the 32 bits starting at its
+  // entry and keeps the low half, sign extended.
+  const int* cache = (const int*) (const void*) ((const short*) (cache16 + 1));
+  __m256i total = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i idx = _mm256_loadu_si256((const __m256i*) (peaks + i));
+    __m256i v = _mm256_i32gather_epi32(cache, idx, 2);
+    total = _mm256_add_epi32(total, _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16));
+  }
+  if (i < count) {
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - i),
+                                      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i idx = _mm256_maskload_epi32(peaks + i, mask);
+    __m256i v = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), cache, idx, mask, 2);
+    total = _mm256_add_epi32(total, _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16));
+  }
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(total),
+                              _mm256_extracti128_si256(total, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (int) ((unsigned int) _mm_cvtsi128_si32(sum) << shift);
+}
+
+__attribute__((target("avx2")))
+int PeakIndexScorer::DotAVX2(const int* peaks, const int* cache) {
+  int count = *peaks++;
+  __m256i total = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i idx = _mm256_loadu_si256((const __m256i*) (peaks + i));
+    total = _mm256_add_epi32(total, _mm256_i32gather_epi32(cache, idx, 4));
+  }
+  if (i < count) {
+    // Masked-off lanes are neither loaded nor gathered, so the last few
+    // peaks never touch memory past the end of the block or the cache.
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - i),
+                                      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i idx = _mm256_maskload_epi32(peaks + i, mask);
+    total = _mm256_add_epi32(total, _mm256_mask_i32gather_epi32(
+      _mm256_setzero_si256(), cache, idx, mask, 4));
+  }
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(total),
+                              _mm256_extracti128_si256(total, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx512f")))
+int PeakIndexScorer::DotAVX512(const int* peaks, const int* cache) {
+  int count = *peaks++;
+  __m512i total = _mm512_setzero_si512();
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i idx = _mm512_loadu_si512(peaks + i);
+    total = _mm512_add_epi32(total, _mm512_i32gather_epi32(idx, cache, 4));
+  }
+  if (i < count) {
+    __mmask16 mask = (__mmask16) ((1u << (count - i)) - 1);
+    __m512i idx = _mm512_maskz_loadu_epi32(mask, peaks + i);
+    total = _mm512_add_epi32(total, _mm512_mask_i32gather_epi32(
+      _mm512_setzero_si512(), mask, idx, cache, 4));
+  }
+  return _mm512_reduce_add_epi32(total);
+}
+
+#else // TIDE_HAVE_X86_SIMD
+
+// Select() never picks these without the matching CPU support.
+int PeakIndexScorer::DotAVX2(const int* peaks, const int* cache) {
+  return DotScalar(peaks, cache);
+}
+
+int PeakIndexScorer::DotAVX512(const int* peaks, const int* cache) {
+  return DotScalar(peaks, cache);
+}
+
+int PeakIndexScorer::DotAVX2_16(const int* peaks, const int* cache16) {
+  return DotScalar16(peaks, cache16);
+}
+
+#endif // TIDE_HAVE_X86_SIMD
+
+#ifdef TIDE_HAVE_NEON
+
+int PeakIndexScorer::DotNEON(const int* peaks, const int* cache) {
+  int count = *peaks++;
+  // There is no gather in Advanced SIMD, so the lanes are filled one load at
+  // a time. Keeping four independent partial sums still lets those loads
+  // overlap, where the scalar loop serializes on a single accumulator.
+  int32x4_t total = vdupq_n_s32(0);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    int32x4_t v = vdupq_n_s32(cache[peaks[i]]);
+    v = vsetq_lane_s32(cache[peaks[i + 1]], v, 1);
+    v = vsetq_lane_s32(cache[peaks[i + 2]], v, 2);
+    v = vsetq_lane_s32(cache[peaks[i + 3]], v, 3);
+    total = vaddq_s32(total, v);
+  }
+  unsigned int sum = (unsigned int) vaddvq_s32(total);
+  for (; i < count; ++i) {
+    sum += cache[peaks[i]];
+  }
+  return (int) sum;
+}
+
+#else // TIDE_HAVE_NEON
+
+int PeakIndexScorer::DotNEON(const int* peaks, const int* cache) {
+  return DotScalar(peaks, cache);
+}
+
+#endif // TIDE_HAVE_NEON
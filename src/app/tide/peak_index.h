@@ -0,0 +1,170 @@
+// An alternative to the generated dot-product programs of compiler.h.
+//
+// Instead of emitting x86 code for each candidate peptide, we store the cache
+// indices of its theoretical peaks as plain data, and score a candidate by
+// summing the cache entries at those indices. This works on any host, does not
+// need executable memory, and lets us use vector instructions (gathers on x86,
+// Advanced SIMD on AArch64) where the CPU has them. The sums are the same 32-bit integer sums the generated
+// programs compute, so scores are identical whichever backend is used.
+//
+// Each peptide's peak list is a block of ints in a FifoAllocator managed by
+// the ActivePeptideQueue, laid out as
+//
+//    [count] [index 0] [index 1] ... [index count-1]
+//
+// and Peptide::Prog() returns the start of the block in place of a program.
+// Blocks for consecutive peptides are consecutive in memory except across
+// FifoAllocator page boundaries, so the scorer follows the peptide queue
+// rather than the blocks themselves.
+//
+// TheoreticalPeakIndexer has the same interface as TheoreticalPeakCompiler,
+// so Peptide can fill either one with the same code.
+//
+// The 16-bit backends score against ObservedPeakSet::GetCache16() instead of
+// the 32-bit cache, which halves the memory the gathers touch, at the cost of
+// scores that are off by up to (peaks of the candidate) * 2^(shift - 1) (see
+// GetCache16()). A preprocessed spectrum's intensities are at most 50, so no
+// entry of the cache exceeds 24 * 50 * 50000 (a primary peak, its two flanks
+// and two neutral losses) and the shift is at most 11: each peak is off by at
+// most 2^10 / XCORR_SCALING = 1.024e-5 in XCorr, and with a hundred peaks XCorr
+// is within about 1e-3 of the exact value.
+
+#ifndef PEAK_INDEX_H
+#define PEAK_INDEX_H
+
+#include <deque>
+#include <string>
+#include <utility>
+#include "fifo_alloc.h"
+#include "max_mz.h"
+#include "theoretical_peak_pair.h"
+
+using namespace std;
+
+class Peptide;
+
+// The generated programs of compiler.h only exist for x86.
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#define TIDE_HAVE_JIT 1
+#endif
+
+// Compilers that let us build the gather kernels without special build flags
+// and check the CPU for them at run time.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define TIDE_HAVE_X86_SIMD 1
+#endif
+
+// Advanced SIMD is part of the AArch64 base architecture.
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define TIDE_HAVE_NEON 1
+#endif
+
+enum ScoringBackend {
+  SCORING_JIT,     // generated x86 programs, see compiler.h
+  SCORING_SCALAR,  // portable C++ loop over the peak indices
+  SCORING_AVX2,    // 8-wide gathers
+  SCORING_AVX512,  // 16-wide gathers
+  SCORING_NEON,    // AArch64 Advanced SIMD
+  SCORING_CUDA,    // batches on an NVIDIA GPU, see peak_index_cuda.h
+  SCORING_SCALAR16,  // as SCORING_SCALAR, on the 16-bit cache
+  SCORING_AVX2_16    // as SCORING_AVX2, on the 16-bit cache
+};
+
+class TheoreticalPeakIndexer {
+ public:
+  explicit TheoreticalPeakIndexer(FifoAllocator* fifo_alloc)
+    : fifo_alloc_(fifo_alloc) {
+  }
+
+  void* Init(int pos_size, int neg_size) {
+    // Init() gets called once per candidate peptide. Only positive peaks are
+    // stored; see peptide.cc.
+    assert(neg_size == 0);
+    block_ = (int*) fifo_alloc_->New(sizeof(int) * (1 + pos_size));
+    pos_ = block_ + 1;
+    return block_;
+  }
+
+  // As in TheoreticalPeakCompiler, peaks past the end of the cache are
+  // dropped.
+  void AddPositive(const TheoreticalPeakArr& peaks) {
+    int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+    for (int i = 0; i < peaks.size(); ++i)
+      if (peaks[i].Code() < end)
+        *pos_++ = peaks[i].Code();
+  }
+
+  void Done() {
+    *block_ = pos_ - block_ - 1;
+    // Give back the room reserved for dropped peaks.
+    fifo_alloc_->Unalloc(pos_);
+  }
+
+ private:
+  FifoAllocator* fifo_alloc_;
+  int* block_;
+  int* pos_;
+};
+
+class PeakIndexScorer {
+ public:
+  // Map a scoring-backend parameter value ("auto", "jit", "scalar", "avx2",
+  // "avx512", "neon", "cuda", "scalar16" or "avx2-16") to a backend this host
+  // can run. "auto" picks the widest vector backend the CPU supports, then the
+  // generated programs where they are available, then the scalar loop; it
+  // never picks cuda or a 16-bit backend. avx2-16 falls back to scalar16. An
+  // explicit choice the host cannot run falls back the same way, with a
+  // warning. With cuda, single spectra are scored on the CPU with the best
+  // peak index backend.
+  static ScoringBackend Select(const string& name);
+
+  static const char* Name(ScoringBackend backend);
+
+  // Whether backend scores against ObservedPeakSet::GetCache16(), which is
+  // then the cache to pass to Score() and ScoreBatch().
+  static bool Quantized(ScoringBackend backend) {
+    return backend == SCORING_SCALAR16 || backend == SCORING_AVX2_16;
+  }
+
+  // Score count consecutive peptides starting at first against cache, for a
+  // spectrum of the given charge. Results are written in the same
+  // (score, counter) form as the generated programs, counter running from
+  // count down to 1.
+  static void Score(ScoringBackend backend, deque<Peptide*>::const_iterator first,
+                    int count, int charge, const int* cache,
+                    pair<int, int>* results);
+
+  // Score several spectra at once. Spectrum k has count[k] candidates
+  // starting at first[k], all within one peptide queue, and is scored into
+  // results[k] as by Score(). Each peptide's peak list is read once and dotted
+  // with the caches of every spectrum it is a candidate for, while the list is
+  // still in L1. With the cuda backend the union of the candidates' peak
+  // lists and the caches are copied to the GPU and every pair is scored
+  // there. num_spectra must not exceed MAX_BATCH_SIZE.
+  static const int MAX_BATCH_SIZE = 256;
+  static void ScoreBatch(ScoringBackend backend, int num_spectra,
+                         const deque<Peptide*>::const_iterator* first,
+                         const int* count, const int* charge,
+                         const int* const* cache, pair<int, int>* const* results);
+
+ private:
+  typedef int (*DotFunc)(const int* peaks, const int* cache);
+  static DotFunc DotFunction(ScoringBackend backend);
+
+  static void ScoreBatchCUDA(int num_spectra,
+                             const deque<Peptide*>::const_iterator* first,
+                             const int* count, const int* charge,
+                             const int* const* cache, pair<int, int>* const* results);
+
+  // The CPU backend for single spectra when Select() picked cuda.
+  static ScoringBackend cuda_host_backend_;
+
+  static int DotScalar(const int* peaks, const int* cache);
+  static int DotAVX2(const int* peaks, const int* cache);
+  static int DotAVX512(const int* peaks, const int* cache);
+  static int DotNEON(const int* peaks, const int* cache);
+  static int DotScalar16(const int* peaks, const int* cache16);
+  static int DotAVX2_16(const int* peaks, const int* cache16);
+};
+
+#endif // PEAK_INDEX_H
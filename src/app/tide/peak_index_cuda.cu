@@ -0,0 +1,122 @@
+// See peak_index_cuda.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cuda_runtime.h>
+#include "peak_index_cuda.h"
+
+#define CUDA_CHECK(x) CudaCheck((x), #x)
+
+static void CudaCheck(cudaError_t err, const char* what) {
+  if (err != cudaSuccess) {
+    fprintf(stderr, "FATAL: %s: %s\n", what, cudaGetErrorString(err));
+    exit(1);
+  }
+}
+
+// One thread per (spectrum, candidate) pair. score_begin[k] is the first
+// pair of spectrum k, and score_begin[num_spectra] the number of pairs.
+__global__ static void DotKernel(const int* peaks, const int* list_begin,
+                                 const int* caches, int cache_size,
+                                 int num_spectra, const int* score_begin,
+                                 const int* first_list, int* scores) {
+  int t = blockIdx.x * blockDim.x + threadIdx.x;
+  if (t >= score_begin[num_spectra]) {
+    return;
+  }
+  int lo = 0, hi = num_spectra;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (score_begin[mid] <= t) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  int list = first_list[lo] + (t - score_begin[lo]);
+  const int* cache = caches + (size_t) lo * cache_size;
+  unsigned int total = 0;
+  for (int i = list_begin[list]; i < list_begin[list + 1]; ++i) {
+    total += cache[peaks[i]];
+  }
+  scores[t] = (int) total;
+}
+
+// Device buffers that only grow, one set per host thread.
+struct DeviceBuffer {
+  int* data;
+  size_t size;
+
+  int* Reserve(size_t n) {
+    if (n > size) {
+      if (data != NULL) {
+        CUDA_CHECK(cudaFree(data));
+      }
+      size = n + n / 2;
+      CUDA_CHECK(cudaMalloc(&data, size * sizeof(int)));
+    }
+    return data;
+  }
+};
+
+struct ThreadBuffers {
+  cudaStream_t stream;
+  DeviceBuffer peaks, list_begin, caches, score_begin, first_list, scores;
+};
+
+static __thread ThreadBuffers* thread_buffers = NULL;
+
+bool CudaScoringAvailable() {
+  int devices = 0;
+  return cudaGetDeviceCount(&devices) == cudaSuccess && devices > 0;
+}
+
+void CudaScoreBatch(const int* peaks, const int* list_begin, int num_lists,
+                    const int* caches, int cache_size, int num_spectra,
+                    const int* first_list, const int* count, int* scores) {
+  if (num_spectra == 0) {
+    return;
+  }
+  ThreadBuffers* b = thread_buffers;
+  if (b == NULL) {
+    b = thread_buffers = (ThreadBuffers*) calloc(1, sizeof(ThreadBuffers));
+    CUDA_CHECK(cudaStreamCreate(&b->stream));
+  }
+  int* score_begin = (int*) malloc((num_spectra + 1) * sizeof(int));
+  score_begin[0] = 0;
+  for (int k = 0; k < num_spectra; ++k) {
+    score_begin[k + 1] = score_begin[k] + count[k];
+  }
+  int pairs = score_begin[num_spectra];
+  size_t num_peaks = list_begin[num_lists];
+  size_t cache_ints = (size_t) num_spectra * cache_size;
+
+  int* d_peaks = b->peaks.Reserve(num_peaks > 0 ? num_peaks : 1);
+  int* d_list_begin = b->list_begin.Reserve(num_lists + 1);
+  int* d_caches = b->caches.Reserve(cache_ints);
+  int* d_score_begin = b->score_begin.Reserve(num_spectra + 1);
+  int* d_first_list = b->first_list.Reserve(num_spectra);
+  int* d_scores = b->scores.Reserve(pairs > 0 ? pairs : 1);
+  cudaStream_t s = b->stream;
+  CUDA_CHECK(cudaMemcpyAsync(d_peaks, peaks, num_peaks * sizeof(int),
+                             cudaMemcpyHostToDevice, s));
+  CUDA_CHECK(cudaMemcpyAsync(d_list_begin, list_begin, (num_lists + 1) * sizeof(int),
+                             cudaMemcpyHostToDevice, s));
+  CUDA_CHECK(cudaMemcpyAsync(d_caches, caches, cache_ints * sizeof(int),
+                             cudaMemcpyHostToDevice, s));
+  CUDA_CHECK(cudaMemcpyAsync(d_score_begin, score_begin, (num_spectra + 1) * sizeof(int),
+                             cudaMemcpyHostToDevice, s));
+  CUDA_CHECK(cudaMemcpyAsync(d_first_list, first_list, num_spectra * sizeof(int),
+                             cudaMemcpyHostToDevice, s));
+  if (pairs > 0) {
+    const int threads = 256;
+    DotKernel<<<(pairs + threads - 1) / threads, threads, 0, s>>>(
+      d_peaks, d_list_begin, d_caches, cache_size, num_spectra, d_score_begin,
+      d_first_list, d_scores);
+    CUDA_CHECK(cudaGetLastError());
+    CUDA_CHECK(cudaMemcpyAsync(scores, d_scores, pairs * sizeof(int),
+                               cudaMemcpyDeviceToHost, s));
+  }
+  CUDA_CHECK(cudaStreamSynchronize(s));
+  free(score_begin);
+}
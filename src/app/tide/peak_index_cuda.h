@@ -0,0 +1,23 @@
+// Batched XCorr dot products on an NVIDIA GPU, for the cuda scoring backend
+// (see peak_index.h). Built only with the CRUX_CUDA CMake option, which
+// defines TIDE_HAVE_CUDA. The interface takes plain arrays so that nvcc never
+// sees the Tide or protobuf headers.
+
+#ifndef PEAK_INDEX_CUDA_H
+#define PEAK_INDEX_CUDA_H
+
+// Whether there is a CUDA device to score on.
+bool CudaScoringAvailable();
+
+// Peak list i is the cache codes peaks[list_begin[i]] to
+// peaks[list_begin[i + 1] - 1]. Spectrum k has its observed cache at
+// caches + k * cache_size and count[k] candidates, the lists first_list[k],
+// first_list[k] + 1, ...; the dot product of each with the cache is written
+// to scores, spectrum by spectrum, in candidate order. Sums wrap as in
+// PeakIndexScorer::DotScalar(). Each calling thread keeps its own device
+// buffers and stream.
+void CudaScoreBatch(const int* peaks, const int* list_begin, int num_lists,
+                    const int* caches, int cache_size, int num_spectra,
+                    const int* first_list, const int* count, int* scores);
+
+#endif // PEAK_INDEX_CUDA_H
@@ -1,5 +1,6 @@
 // Benjamin Diament
 
+#include <algorithm>
 #include <iostream>
 #include <limits>
 #include <gflags/gflags.h>
@@ -10,16 +11,85 @@
 #include "theoretical_peak_set.h"
 #include "peptide.h"
 #include "compiler.h"
+#include "peak_index.h"
+#include "util/Instrumentation.h"
 
 #ifdef DEBUG
 DEFINE_int32(debug_peptide_id, -1, "Peptide id to debug.");
 #endif
 
+const double Peptide::kMaxRTime = (kNoRTime - 1) / 10.0;
+
 #if 0
 DEFINE_bool(flanks, true, "Include flanking peaks.");
 DEFINE_bool(dups_ok, false, "Don't remove duplicate peaks");
 #endif
 
+Peptide::Peptide(const Peptide& target, bool shuffle, unsigned int seed,
+                 FifoAllocator* fifo_alloc)
+  : mass_(target.mass_), residues_(NULL), mods_(NULL),
+  prog1_(NULL), prog2_(NULL), hits_(NULL), id_(target.id_),
+  first_loc_protein_id_(target.first_loc_protein_id_),
+  first_loc_pos_(target.first_loc_pos_),
+  aux_locations_index_(target.aux_locations_index_),
+  len_(target.len_), num_mods_(target.num_mods_), rtime_(target.rtime_),
+  has_aux_locations_index_(target.has_aux_locations_index_),
+  decoy_(true) {
+  // order[i] is the position in target of the decoy's residue i.
+  int len = Len();
+  vector<int> order(len);
+  for (int i = 0; i < len; ++i)
+    order[i] = i;
+  bool changed = false;
+  if (!shuffle && len > 3) {
+    reverse(order.begin() + 1, order.end() - 1);
+    for (int i = 1; i < len - 1 && !changed; ++i)
+      changed = target.residues_[order[i]] != target.residues_[i];
+  }
+  if (!changed && len > 3) {
+    // Seed an xorshift generator with an FNV-1a hash of seed and residues.
+    unsigned int state = 2166136261u;
+    for (int i = 0; i < 4; ++i)
+      state = (state ^ ((seed >> (8 * i)) & 0xff)) * 16777619u;
+    for (int i = 0; i < len; ++i)
+      state = (state ^ (unsigned char) target.residues_[i]) * 16777619u;
+    if (state == 0)
+      state = 1;
+    for (int attempt = 0; attempt < 10 && !changed; ++attempt) {
+      for (int i = len - 2; i > 1; --i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        swap(order[i], order[1 + state % i]);
+      }
+      for (int i = 1; i < len - 1 && !changed; ++i)
+        changed = target.residues_[order[i]] != target.residues_[i];
+    }
+  }
+
+  // Rounded up so that the next Peptide in the FifoAllocator stays 8-byte
+  // aligned.
+  char* residues = (char*) fifo_alloc->New((len + 7) & ~7);
+  for (int i = 0; i < len; ++i)
+    residues[i] = target.residues_[order[i]];
+  residues_ = residues;
+  if (num_mods_ > 0) {
+    vector<int> position(len);
+    for (int i = 0; i < len; ++i)
+      position[order[i]] = i;
+    mods_ = (ModCoder::Mod*) fifo_alloc->New(
+      sizeof(mods_[0]) * ((num_mods_ + 1) & ~1));
+    for (int i = 0; i < num_mods_; ++i) {
+      int index;
+      double delta;
+      MassConstants::DecodeMod(target.mods_[i], &index, &delta);
+      mods_[i] = MassConstants::MoveMod(target.mods_[i], position[index]);
+    }
+    // SeqWithMods() and others expect the modifications in order.
+    sort(mods_, mods_ + num_mods_);
+  }
+}
+
 string Peptide::SeqWithMods() const {
   vector<char> buf(Len() + num_mods_ * 30 + 1);
   int residue_pos = 0;
@@ -121,6 +191,37 @@ void Peptide::AddIons(W* workspace) const {
   }
 }
 
+// The search-time workspace reuses the ions that a peptide shares with the
+// last one of its kind (target or decoy); see
+// TheoreticalPeakSetBYSparse::AddIons().
+template<>
+void Peptide::AddIons<ST_TheoreticalPeakSet>(ST_TheoreticalPeakSet* workspace) const {
+  double max_possible_peak = numeric_limits<double>::infinity();
+  if (MaxBin::Global().MaxBinEnd() > 0)
+    max_possible_peak = MaxBin::Global().CacheBinEnd();
+
+  vector<double> aa_masses(Len());
+  const char* residue = residues_;
+  for (int i = 0; i < Len(); ++i, ++residue) {
+    if (i == 0) { // nterm static pep
+      aa_masses[i] = MassConstants::nterm_mono_table[*residue];
+    } else if (i == Len() - 1) { // cterm static pep
+      aa_masses[i] = MassConstants::cterm_mono_table[*residue];
+    } else { // all other mods
+      aa_masses[i] = MassConstants::mono_table[*residue];
+    }
+  }
+
+  for (int i = 0; i < num_mods_; ++i) {
+    int index;
+    double delta;
+    MassConstants::DecodeMod(mods_[i], &index, &delta);
+    aa_masses[index] += delta;
+  }
+
+  workspace->AddIons(aa_masses, max_possible_peak, decoy_);
+}
+
 template<class W>
 void Peptide::AddBIonsOnly(W* workspace) const {
   // Use workspace to assemble b ions only.
@@ -175,24 +276,28 @@ void DisAsm(const void* prog) {
 }
 #endif
 
+template<class C>
 void Peptide::Compile(const TheoreticalPeakArr* peaks,
                       const pb::Peptide& pb_peptide,
-                      TheoreticalPeakCompiler* compiler_prog1,
-                      TheoreticalPeakCompiler* compiler_prog2) {
-  int pos_size = peaks[0].size();
-  prog1_ = compiler_prog1->Init(pos_size, 0);
-  compiler_prog1->AddPositive(peaks[0]);
-//  compiler_prog1->AddPositive(pb_peptide.peak1());
-//  compiler_prog1->AddNegative(pb_peptide.neg_peak1());
-  compiler_prog1->Done();
-
-  pos_size = peaks[0].size() + peaks[1].size();
-  prog2_ = compiler_prog2->Init(pos_size, 0);
-  compiler_prog2->AddPositive(peaks[0]);
-  compiler_prog2->AddPositive(peaks[1]);
-//  compiler_prog2->AddPositive(pb_peptide.peak2());
-//  compiler_prog2->AddNegative(pb_peptide.neg_peak2());
-  compiler_prog2->Done();
+                      C* compiler_prog1, C* compiler_prog2) {
+  if (compiler_prog1 != NULL) {
+    int pos_size = peaks[0].size();
+    prog1_ = compiler_prog1->Init(pos_size, 0);
+    compiler_prog1->AddPositive(peaks[0]);
+//    compiler_prog1->AddPositive(pb_peptide.peak1());
+//    compiler_prog1->AddNegative(pb_peptide.neg_peak1());
+    compiler_prog1->Done();
+  }
+
+  if (compiler_prog2 != NULL) {
+    int pos_size = peaks[0].size() + peaks[1].size();
+    prog2_ = compiler_prog2->Init(pos_size, 0);
+    compiler_prog2->AddPositive(peaks[0]);
+    compiler_prog2->AddPositive(peaks[1]);
+//    compiler_prog2->AddPositive(pb_peptide.peak2());
+//    compiler_prog2->AddNegative(pb_peptide.neg_peak2());
+    compiler_prog2->Done();
+  }
 /*    cout << Seq() << endl;
     for (int i = 0; i < peaks[0].size(); ++i)
       cout << "Theoretical Peak[" << peaks[0][i].Bin() << "] = "
@@ -223,7 +328,11 @@ void Peptide::ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
                                       TheoreticalPeakCompiler* compiler_prog1,
                                       TheoreticalPeakCompiler* compiler_prog2) {
   // Search-time fast workspace
-  AddIons<ST_TheoreticalPeakSet>(workspace);
+  {
+    CRUX_TIME_STAGE(STAGE_PEAK_GENERATION);
+    AddIons<ST_TheoreticalPeakSet>(workspace);
+  }
+  CRUX_TIME_STAGE(STAGE_PEAK_COMPILE);
 
 #if 0
   TheoreticalPeakArr peaks[2];
@@ -244,6 +353,34 @@ void Peptide::ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
 #endif
 }
 
+void Peptide::ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
+                                      const pb::Peptide& pb_peptide,
+                                      TheoreticalPeakIndexer* indexer_prog1,
+                                      TheoreticalPeakIndexer* indexer_prog2) {
+  {
+    CRUX_TIME_STAGE(STAGE_PEAK_GENERATION);
+    AddIons<ST_TheoreticalPeakSet>(workspace);
+  }
+  CRUX_TIME_STAGE(STAGE_PEAK_COMPILE);
+  Compile(workspace->GetPeaks(), pb_peptide, indexer_prog1, indexer_prog2);
+}
+
+void Peptide::CompileTheoreticalPeaks(const TheoreticalPeakArr* peaks,
+                                      const pb::Peptide& pb_peptide,
+                                      TheoreticalPeakCompiler* compiler_prog1,
+                                      TheoreticalPeakCompiler* compiler_prog2) {
+  CRUX_TIME_STAGE(STAGE_PEAK_COMPILE);
+  Compile(peaks, pb_peptide, compiler_prog1, compiler_prog2);
+}
+
+void Peptide::CompileTheoreticalPeaks(const TheoreticalPeakArr* peaks,
+                                      const pb::Peptide& pb_peptide,
+                                      TheoreticalPeakIndexer* indexer_prog1,
+                                      TheoreticalPeakIndexer* indexer_prog2) {
+  CRUX_TIME_STAGE(STAGE_PEAK_COMPILE);
+  Compile(peaks, pb_peptide, indexer_prog1, indexer_prog2);
+}
+
 // return the amino acid masses in the current peptide
 double* Peptide::getAAMasses(){
   double* masses_charge = new double[Len()];
@@ -270,8 +407,9 @@ double* Peptide::getAAMasses(){
 int NoInlineDotProd(Peptide* peptide, const int* cache, int charge) {
   const void* prog = peptide->Prog(charge);
   int result;
-#ifdef _MSC_VER
+#if defined(_MSC_VER) || !defined(TIDE_HAVE_JIT)
   // FIXME CEG add Windows compatible inline assembly
+  result = 0;
 #else
   __asm__ __volatile__("call *%[prog]\n"
                        : "=a" (result)
@@ -18,11 +18,13 @@
 // product of its theoretical peaks with a given observed spectrum.
 // Specifically, ComputeTheoreticalPeaks() generates a compiled program for
 // doing so.  A different version of the generated program exists for charge 1
-// and  charge 2.
+// and  charge 2. Alternatively, ComputeTheoreticalPeaks() stores just the
+// peak indices, for the backends of peak_index.h.
 
 #ifndef PEPTIDE_H
 #define PEPTIDE_H
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include "raw_proteins.pb.h"
@@ -56,6 +58,7 @@ typedef TheoreticalPeakSetBYSparse ST_TheoreticalPeakSet; // ST="search time"
 // typedef TheoreticalPeakSetMakeAll ST_TheoreticalPeakSet; // ST="search time"
 
 class TheoreticalPeakCompiler;
+class TheoreticalPeakIndexer;
 
 // BIG CAUTION: At search time, you CANNOT expect even the IMPLICIT destructor
 // to get called!! We actually RELY on the fact that when we use FIFO
@@ -70,20 +73,24 @@ class Peptide {
   Peptide(const pb::Peptide& peptide,
           const vector<const pb::Protein*>& proteins,
           FifoAllocator* fifo_alloc = NULL)
-    : len_(peptide.length()), mass_(peptide.mass()), id_(peptide.id()),
+    : mass_(peptide.mass()), mods_(NULL), prog1_(NULL), prog2_(NULL),
+    hits_(NULL), id_(peptide.id()),
     first_loc_protein_id_(peptide.first_location().protein_id()),
     first_loc_pos_(peptide.first_location().pos()), 
-    has_aux_locations_index_(peptide.has_aux_locations_index()),
     aux_locations_index_(peptide.aux_locations_index()),
-    mods_(NULL), num_mods_(0), decoy_(peptide.is_decoy()),
-    prog1_(NULL), prog2_(NULL) {
+    len_(peptide.length()), num_mods_(0), rtime_(kNoRTime),
+    has_aux_locations_index_(peptide.has_aux_locations_index()),
+    decoy_(peptide.is_decoy()) {
     // Set residues_ by pointing to the first occurrence in proteins.
     residues_ = proteins[first_loc_protein_id_]->residues().data() 
                     + first_loc_pos_;
     if (peptide.modifications_size() > 0) {
       num_mods_ = peptide.modifications_size();
       if (fifo_alloc) {
-        mods_ = (ModCoder::Mod*) fifo_alloc->New(sizeof(mods_[0]) * num_mods_);
+        // Rounded up so that the next Peptide in the FifoAllocator stays
+        // 8-byte aligned.
+        mods_ = (ModCoder::Mod*) fifo_alloc->New(
+          sizeof(mods_[0]) * ((num_mods_ + 1) & ~1));
       } else {
         mods_ = new ModCoder::Mod[num_mods_];
       }
@@ -91,6 +98,32 @@ class Peptide {
         mods_[i] = ModCoder::Mod(peptide.modifications(i));
     }
   }
+  // A copy in system memory, e.g. to keep a match after the Peptide's FIFO
+  // memory has been released. Programs and hits are not copied.
+  Peptide(const Peptide& other)
+    : mass_(other.mass_), residues_(other.residues_), mods_(NULL),
+    prog1_(NULL), prog2_(NULL), hits_(NULL), id_(other.id_),
+    first_loc_protein_id_(other.first_loc_protein_id_),
+    first_loc_pos_(other.first_loc_pos_),
+    aux_locations_index_(other.aux_locations_index_),
+    len_(other.len_), num_mods_(other.num_mods_), rtime_(other.rtime_),
+    has_aux_locations_index_(other.has_aux_locations_index_),
+    decoy_(other.decoy_) {
+    if (num_mods_ > 0) {
+      mods_ = new ModCoder::Mod[num_mods_];
+      for (int i = 0; i < num_mods_; ++i)
+        mods_[i] = other.mods_[i];
+    }
+  }
+  // A decoy of target, made at search time: the residues between the first
+  // and the last are reversed or, with shuffle or if reversing leaves them
+  // unchanged, shuffled, and each modification moves with its residue. The
+  // termini stay in place, so that terminal modifications and the mass are
+  // those of the target. The shuffle depends only on seed and the target's
+  // residues, so a target always gets the same decoy. The residues and
+  // modifications are allocated by fifo_alloc, which must be given.
+  Peptide(const Peptide& target, bool shuffle, unsigned int seed,
+          FifoAllocator* fifo_alloc);
   class spectrum_matches {
    public:
       spectrum_matches(Spectrum* spectrum, double score1, double score2,
@@ -134,12 +167,47 @@ class Peptide {
         return a.elution_score_ < b.elution_score_;
       }
   };
-  vector<spectrum_matches> spectrum_matches_array;
+  // The hits of a peptide-centric search. Most peptides of the active window
+  // never get any, so the list is only allocated by the first AddHit().
+  // ClearHits() must be called before the Peptide is released.
+  struct hit_list {
+    hit_list() : total(0) {}
+    vector<spectrum_matches> matches;
+    int total;  // hits added, including those no longer kept
+  };
+  // With capacity > 0, only the best capacity hits are kept, in a heap whose
+  // front is the worst of them; hits are better by compPV if lower_is_better
+  // and by compSC otherwise. With capacity 0, every hit is kept, in order.
   void AddHit(Spectrum* spectrum, double score1, double score2,
-          int score3, int charge) {
-
-    spectrum_matches_array.push_back(spectrum_matches(spectrum,
-                                     score1, score2, score3, charge));
+          int score3, int charge, int capacity = 0, bool lower_is_better = false) {
+    if (hits_ == NULL) {
+      hits_ = new hit_list;
+      if (capacity > 0)
+        hits_->matches.reserve(capacity);
+    }
+    ++hits_->total;
+    vector<spectrum_matches>& matches = hits_->matches;
+    bool (*better)(const spectrum_matches&, const spectrum_matches&) =
+      lower_is_better ? spectrum_matches::compPV : spectrum_matches::compSC;
+    spectrum_matches hit(spectrum, score1, score2, score3, charge);
+    if (capacity <= 0 || (int)matches.size() < capacity) {
+      matches.push_back(hit);
+      if (capacity > 0)
+        push_heap(matches.begin(), matches.end(), better);
+    } else if (better(hit, matches.front())) {
+      pop_heap(matches.begin(), matches.end(), better);
+      matches.back() = hit;
+      push_heap(matches.begin(), matches.end(), better);
+    }
+  }
+  // The hits kept, and the hits added.
+  int NumHits() const { return hits_ == NULL ? 0 : hits_->matches.size(); }
+  int TotalHits() const { return hits_ == NULL ? 0 : hits_->total; }
+  // Only valid if NumHits() > 0.
+  vector<spectrum_matches>& Hits() { return hits_->matches; }
+  void ClearHits() {
+    delete hits_;
+    hits_ = NULL;
   }
 
   // CAUTION: We do NOT expect this destructor to get called when FIFO 
@@ -148,14 +216,20 @@ class Peptide {
   // of the class definition for details.
   ~Peptide() {
     delete[] mods_;
+    delete hits_;
   }
 
   // Allocation by FifoAllocator
   void* operator new(size_t size, FifoAllocator* fifo_alloc) {
     return fifo_alloc->New(size);
   }
+  // Ordinary allocation, for copies.
+  void* operator new(size_t size) {
+    return ::operator new(size);
+  }
 
   string Seq() const { return string(residues_, Len()); } // For display
+  const char* Residues() const { return residues_; }  // Len() of them
 
   string SeqWithMods() const;
 
@@ -175,9 +249,27 @@ class Peptide {
                                const pb::Peptide& pb_peptide,
                                TheoreticalPeakCompiler* compiler_prog1,
                                TheoreticalPeakCompiler* compiler_prog2);
+  // As above, but storing peak index lists (see peak_index.h) in place of
+  // programs.
+  void ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
+                               const pb::Peptide& pb_peptide,
+                               TheoreticalPeakIndexer* indexer_prog1,
+                               TheoreticalPeakIndexer* indexer_prog2);
+  // As the two above, but from peaks[0] and peaks[1] as the workspace would
+  // have produced them, e.g. when they are stored in the index. In each of
+  // these, a NULL compiler or indexer leaves that program as it was.
+  void CompileTheoreticalPeaks(const TheoreticalPeakArr* peaks,
+                               const pb::Peptide& pb_peptide,
+                               TheoreticalPeakCompiler* compiler_prog1,
+                               TheoreticalPeakCompiler* compiler_prog2);
+  void CompileTheoreticalPeaks(const TheoreticalPeakArr* peaks,
+                               const pb::Peptide& pb_peptide,
+                               TheoreticalPeakIndexer* indexer_prog1,
+                               TheoreticalPeakIndexer* indexer_prog2);
   void ComputeBTheoreticalPeaks(TheoreticalPeakSetBIons* workspace) const;
 
-  // Return the appropriate program depending on the precursor charge.
+  // Return the appropriate program (or peak index list) depending on the
+  // precursor charge.
   // TODO 257: fix the unfortunate use of max_charge.
   const void* Prog(int max_charge) const {
     return max_charge <= 2 ? prog1_ : prog2_;
@@ -213,32 +305,48 @@ class Peptide {
   bool IsDecoy() const { return decoy_; }
   double* getAAMasses();
 
+  // The retention time of the peptide, in minutes, if one was set: to the
+  // nearest tenth of a minute, up to kMaxRTime. A decoy made at search time
+  // has the time of its target.
+  bool HasRTime() const { return rtime_ != kNoRTime; }
+  double RTime() const { return rtime_ / 10.0; }
+  void SetRTime(double rtime) {
+    rtime_ = (unsigned short) (min(max(rtime, 0.0), kMaxRTime) * 10 + 0.5);
+  }
+  static const double kMaxRTime;
+
  private:
   template<class W> void AddIons(W* workspace) const;
   template<class W> void AddBIonsOnly(W* workspace) const;
 
-  void Compile(const TheoreticalPeakArr* peaks,
-               const pb::Peptide& pb_peptide,
-               TheoreticalPeakCompiler* compiler_prog1,
-               TheoreticalPeakCompiler* compiler_prog2);
+  // C is TheoreticalPeakCompiler or TheoreticalPeakIndexer.
+  template<class C> void Compile(const TheoreticalPeakArr* peaks,
+                                 const pb::Peptide& pb_peptide,
+                                 C* compiler_prog1, C* compiler_prog2);
           
 
   void Show();
 
-  int len_;
+  static const unsigned short kNoRTime = 0xffff;
+
+  // With wide precursor windows the active window holds millions of
+  // Peptides, so the members are ordered by size to leave no padding: 72
+  // bytes on 64-bit hosts.
   double mass_;
+  const char* residues_;
+  ModCoder::Mod* mods_;
+  void* prog1_;
+  void* prog2_;
+  hit_list* hits_;
   int id_;
   int first_loc_protein_id_;
   int first_loc_pos_;
-  bool has_aux_locations_index_;
   int aux_locations_index_;
-  const char* residues_;
-  int num_mods_;
-  ModCoder::Mod* mods_;
+  unsigned short len_;  // at most MAX_PEPTIDE_LENGTH
+  unsigned short num_mods_;
+  unsigned short rtime_;  // in tenths of a minute
+  bool has_aux_locations_index_;
   bool decoy_;
-
-  void* prog1_;
-  void* prog2_;
 };
 
 #endif // PEPTIDE_H
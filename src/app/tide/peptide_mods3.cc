@@ -13,6 +13,8 @@
 #include <algorithm>
 #include <numeric>
 #include <gflags/gflags.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "abspath.h"
 #include "records.h"
 #include "records_to_vector-inl.h"
@@ -21,10 +23,13 @@
 #include "peptides.pb.h"
 #include "mass_constants.h"
 #include "modifications.h"
+#include "loser_tree.h"
 #include "util/FileUtils.h"
 #include "util/MathUtil.h"
+#include "util/ThreadPool.h"
 #include "io/carp.h"
 #include "app/tide/peptide.h"
+#include "app/tide/search_mods.h"
 
 using namespace std;
 
@@ -39,6 +44,26 @@ DEFINE_int32(min_mods, 0,
 DEFINE_int32(modsoutputter_file_threshold, 1000,
   "Maximum number of temporary files that would be opened by ModsOutputter "
   "before switching to ModsOutputterAlt.");
+DEFINE_int32(mods_threads, 1,
+  "Number of threads used to expand modifications and to sort temporary "
+  "files.");
+
+// Peptides are expanded this many at a time when there are several threads.
+static const size_t MODS_BATCH_SIZE = 1024;
+
+// Call work(first, stride) on each of threads threads, with first running
+// from 0 to threads - 1 and a stride of threads, and wait for all of them.
+template<class Work>
+static void RunShares(int threads, Work work) {
+  if (threads <= 1) {
+    work(0, 1);
+    return;
+  }
+  ThreadPool::TaskGroup threadgroup;
+  for (int t = 0; t < threads; ++t)
+    threadgroup.Run(boost::bind(work, t, threads));
+  threadgroup.Wait();
+}
 
 static string GetTempName(const string& tempDir, int filenum) {
   char buf[64];
@@ -58,12 +83,19 @@ static string GetTempName(const string& tempDir, int filenum) {
 class IModsOutputter {
  public:
   virtual void Output(pb::Peptide* peptide) = 0;
+  // Expand any peptides that Output() has held back for a batch.
+  virtual void Finish() = 0;
   virtual int64_t Total() const = 0;
 };
 
 // Original class to generate modified peptides. Writes to temporary files
 // before merging them. As the number of possible modifications increases, the
 // number of required temporary files can grow extremely large.
+//
+// With several threads, peptides are expanded in batches by worker copies of
+// the outputter, which collect the modified peptides instead of writing them;
+// the collected peptides are then numbered and written in input order, so the
+// result does not depend on the number of threads.
 class ModsOutputter : public IModsOutputter {
  public:
   ModsOutputter(string tmpDir,
@@ -77,7 +109,8 @@ class ModsOutputter : public IModsOutputter {
       max_counts_(*mod_table_->MaxCounts()),
       counts_mapper_vec_(max_counts_.size(), 0),
       final_writer_(final_writer),
-      count_(0) {
+      count_(0),
+      pending_(NULL) {
     numFiles_ = 1;
     for (int i = 0; i < max_counts_.size(); ++i) {
       counts_mapper_vec_[i] = numFiles_;
@@ -89,6 +122,9 @@ class ModsOutputter : public IModsOutputter {
   }
 
   ~ModsOutputter() {
+    for (int i = 0; i < workers_.size(); ++i) {
+      delete workers_[i];
+    }
     for (int i = 0; i < writers_.size(); ++i) {
       delete writers_[i];
     }
@@ -121,6 +157,44 @@ class ModsOutputter : public IModsOutputter {
       }
     }
 
+    InitDeltas();
+    for (int i = 1; i < FLAGS_mods_threads; ++i) {
+      ModsOutputter* worker =
+        new ModsOutputter(tmpDir_, proteins_, mod_table_, NULL);
+      worker->InitDeltas();
+      workers_.push_back(worker);
+    }
+  }
+
+  void Output(pb::Peptide* peptide) {
+    if (workers_.empty()) {
+      Expand(peptide);
+      return;
+    }
+    batch_.push_back(*peptide);
+    if (batch_.size() == MODS_BATCH_SIZE)
+      OutputBatch();
+  }
+
+  void Finish() {
+    if (!batch_.empty())
+      OutputBatch();
+  }
+
+  // Collect the modified forms of peptide in out, with the unmodified mass,
+  // instead of writing them; for an outputter without a writer.
+  void Collect(pb::Peptide* peptide, vector< pair<int, pb::Peptide> >* out) {
+    pending_ = out;
+    Expand(peptide);
+    pending_ = NULL;
+  }
+
+ private:
+  string tmpDir_;
+  int numFiles_;
+  int64_t modPeptideCnt_;
+
+  void InitDeltas() {
     const vector<double>& deltas = *mod_table_->OriginalDeltas();
     delta_by_file_.resize(numFiles_);
     for (int i = 0; i < numFiles_; ++i) {
@@ -135,7 +209,7 @@ class ModsOutputter : public IModsOutputter {
     }
   }
 
-  void Output(pb::Peptide* peptide) {
+  void Expand(pb::Peptide* peptide) {
     peptide_ = peptide;
     const pb::Location& loc = peptide->first_location();
     residues_ = proteins_[loc.protein_id()]->residues().data() + loc.pos();
@@ -143,10 +217,30 @@ class ModsOutputter : public IModsOutputter {
     OutputNtermMods(0, counts);
   }
 
- private:
-  string tmpDir_;
-  int numFiles_;
-  int64_t modPeptideCnt_;
+  // The peptides of batch_ are shared among this outputter and its workers,
+  // which collect the modified forms of batch_[i] in expanded_[i] together
+  // with their temporary files.
+  void OutputBatch() {
+    expanded_.resize(batch_.size());
+    RunShares(workers_.size() + 1,
+              boost::bind(&ModsOutputter::ExpandShare, this, _1, _2));
+    for (size_t i = 0; i < batch_.size(); ++i) {
+      vector< pair<int, pb::Peptide> >& expanded = expanded_[i];
+      for (size_t j = 0; j < expanded.size(); ++j)
+        WriteToFile(expanded[j].first, &expanded[j].second);
+      expanded.clear();
+    }
+    batch_.clear();
+  }
+
+  void ExpandShare(int first, int stride) {
+    ModsOutputter* expander = first == 0 ? this : workers_[first - 1];
+    for (size_t i = first; i < batch_.size(); i += stride) {
+      expander->pending_ = &expanded_[i];
+      expander->Expand(&batch_[i]);
+    }
+    expander->pending_ = NULL;
+  }
 
   class PepReader {
    public:
@@ -180,9 +274,9 @@ class ModsOutputter : public IModsOutputter {
     pb::Peptide current_;
   };
 
-  struct greater_pepreader : public binary_function<PepReader*, PepReader*, bool> {
-    bool operator()(PepReader* x, PepReader* y) {
-      return x != y && *y < *x;
+  struct less_pepreader : public binary_function<PepReader*, PepReader*, bool> {
+    bool operator()(PepReader* x, PepReader* y) const {
+      return *x < *y;
     }
   };
 
@@ -292,7 +386,6 @@ class ModsOutputter : public IModsOutputter {
       return;
     } else if (total == FLAGS_max_mods) {
       if (total >= FLAGS_min_mods) {
-        peptide_->set_id(count_++);
         Write(counts);
       }
       return;
@@ -308,7 +401,6 @@ class ModsOutputter : public IModsOutputter {
         peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
         if (TotalMods(counts) >= FLAGS_min_mods) {
-          peptide_->set_id(count_++);
           Write(counts);
         }
 
@@ -325,7 +417,6 @@ class ModsOutputter : public IModsOutputter {
         peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
         if (TotalMods(counts) >= FLAGS_min_mods) {
-          peptide_->set_id(count_++);
           Write(counts);
         }
 
@@ -345,7 +436,6 @@ class ModsOutputter : public IModsOutputter {
           peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
           if (TotalMods(counts) >= FLAGS_min_mods) {
-            peptide_->set_id(count_++);
             Write(counts);
           }
 
@@ -365,7 +455,6 @@ class ModsOutputter : public IModsOutputter {
           peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
           if (TotalMods(counts) >= FLAGS_min_mods) {
-            peptide_->set_id(count_++);
             Write(counts);
           }
 
@@ -384,7 +473,6 @@ class ModsOutputter : public IModsOutputter {
           peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
           if (TotalMods(counts) >= FLAGS_min_mods) {
-            peptide_->set_id(count_++);
             Write(counts);
           }
 
@@ -394,7 +482,6 @@ class ModsOutputter : public IModsOutputter {
         }
       }
       if (TotalMods(counts) >= FLAGS_min_mods) {
-        peptide_->set_id(count_++);
         Write(counts);
       }
     }
@@ -406,21 +493,21 @@ class ModsOutputter : public IModsOutputter {
     for (int i = 0; i < num_files; ++i)
       readers[i] = new PepReader(GetTempName(tmpDir_, i));
 
-    // initialize heap
-    PepReader** heap_end = &(readers[0]) + num_files;
-    for (PepReader** reader = &(readers[0]); reader < heap_end; ++reader)
-      if (!(*reader)->Advance())
-        swap(*reader--, *--heap_end);
-    make_heap(&(readers[0]), heap_end, greater_pepreader());
+    // The files are merged through a tree of losers, which needs about half
+    // the comparisons of a heap; with a thousand files that is ten per
+    // peptide rather than twenty.
+    vector<bool> exhausted(num_files);
+    for (int i = 0; i < num_files; ++i)
+      exhausted[i] = !readers[i]->Advance();
+    LoserTree<PepReader, less_pepreader> tree(readers, exhausted);
 
-    // do heap merge
     int id = 0;
 #ifndef NDEBUG
     double last_mass = 0.0;
 #endif
-    while (heap_end > &(readers[0])) {
-      pop_heap(&(readers[0]), heap_end, greater_pepreader());
-      pb::Peptide* current = (*(heap_end-1))->Current();
+    while (!tree.Empty()) {
+      PepReader* reader = tree.Top();
+      pb::Peptide* current = reader->Current();
       current->set_id(id++);
 #ifndef NDEBUG
       assert(current->mass() >= last_mass);
@@ -428,11 +515,7 @@ class ModsOutputter : public IModsOutputter {
 #endif
       final_writer_->Write(current);
       CHECK(final_writer_->OK());
-      if ((*(heap_end-1))->Advance()) {
-        push_heap(&(readers[0]), heap_end, greater_pepreader());
-      } else {
-        --heap_end;
-      }
+      tree.Replay(!reader->Advance());
     }
 
     // delete temporary files
@@ -453,16 +536,24 @@ class ModsOutputter : public IModsOutputter {
     return dot;
   }
 
-  RecordWriter* Write(const vector<int>& counts) {
-    ++modPeptideCnt_;
+  void Write(const vector<int>& counts) {
     int index = DotProd(counts);
-    double mass = peptide_->mass();
-    peptide_->set_mass(delta_by_file_[index] + mass);
-    if (!writers_[index]->Write(peptide_)) {
+    if (pending_) {
+      pending_->push_back(make_pair(index, *peptide_));
+      return;
+    }
+    WriteToFile(index, peptide_);
+  }
+
+  void WriteToFile(int index, pb::Peptide* peptide) {
+    ++modPeptideCnt_;
+    peptide->set_id(count_++);
+    double mass = peptide->mass();
+    peptide->set_mass(delta_by_file_[index] + mass);
+    if (!writers_[index]->Write(peptide)) {
       carp(CARP_FATAL, "I/O error writing modifications");
     }
-    peptide_->set_mass(mass);
-    return writers_[index];
+    peptide->set_mass(mass);
   }
 
   const vector<const pb::Protein*>& proteins_;
@@ -476,6 +567,12 @@ class ModsOutputter : public IModsOutputter {
 
   pb::Peptide* peptide_;
   const char* residues_;
+
+  vector<ModsOutputter*> workers_;
+  vector<pb::Peptide> batch_;
+  vector< vector< pair<int, pb::Peptide> > > expanded_;
+  // Where a worker collects the peptides that Write() would write.
+  vector< pair<int, pb::Peptide> >* pending_;
 };
 
 // Alternative class to generate modified peptides. Writes to temporary files
@@ -483,6 +580,11 @@ class ModsOutputter : public IModsOutputter {
 // temporary file associated with that bin; the number of temporary files
 // required is therefore bounded by the variance in peptide masses, rather than
 // the number of possible modifications.
+//
+// With several threads, peptides are expanded in batches and written in input
+// order, and the temporary files, one per mass range, are read and sorted
+// several at a time and written in mass order, so the result does not depend
+// on the number of threads.
 class ModsOutputterAlt : public IModsOutputter {
  public:
   ModsOutputterAlt(string tmpDir,
@@ -533,6 +635,11 @@ class ModsOutputterAlt : public IModsOutputter {
   void Output(pb::Peptide* peptide) {
     if (maxMods_ < 0) {
       return;
+    } else if (FLAGS_mods_threads > 1 && maxMods_ > 0) {
+      batch_.push_back(*peptide);
+      if (batch_.size() == MODS_BATCH_SIZE)
+        OutputBatch();
+      return;
     } else if (FLAGS_min_mods < 1) {
       WritePeptide(peptide); // write unmodified peptide
     }
@@ -552,6 +659,11 @@ class ModsOutputterAlt : public IModsOutputter {
     }
   }
 
+  void Finish() {
+    if (!batch_.empty())
+      OutputBatch();
+  }
+
   // Return the total number of peptides written
   int64_t Total() const { return totalWritten_; }
 
@@ -719,6 +831,40 @@ class ModsOutputterAlt : public IModsOutputter {
     return mass;
   }
 
+  // Expand batch_[i] into expanded_[i] on several threads, then write the
+  // expansions in input order.
+  void OutputBatch() {
+    expanded_.resize(batch_.size());
+    RunShares(FLAGS_mods_threads,
+              boost::bind(&ModsOutputterAlt::ExpandShare, this, _1, _2));
+    for (size_t i = 0; i < batch_.size(); ++i) {
+      vector<pb::Peptide>& expanded = expanded_[i];
+      for (size_t j = 0; j < expanded.size(); ++j) {
+        WritePeptide(&expanded[j]);
+        if (totalWritten_ % 10000 == 0) {
+          carp(CARP_INFO, "Wrote %d peptides to temp files", totalWritten_);
+        }
+      }
+      expanded.clear();
+    }
+    batch_.clear();
+  }
+
+  void ExpandShare(int first, int stride) {
+    for (size_t i = first; i < batch_.size(); i += stride) {
+      pb::Peptide* peptide = &batch_[i];
+      vector<pb::Peptide>& expanded = expanded_[i];
+      if (FLAGS_min_mods < 1) {
+        expanded.push_back(*peptide); // unmodified peptide
+      }
+      ResultMods resultMods(modTable_, modMaxCounts_, maxMods_, peptide, proteins_);
+      while (resultMods.Next()) {
+        resultMods.ModifyPeptide();
+        expanded.push_back(*peptide);
+      }
+    }
+  }
+
   struct PbPeptideSort {
     PbPeptideSort() {}
     inline bool operator() (const pb::Peptide& x, const pb::Peptide& y) {
@@ -756,27 +902,47 @@ class ModsOutputterAlt : public IModsOutputter {
     return writer;
   }
 
-  // Combine all temp files into the final file
+  static void ReadTempFile(const string& file, vector<pb::Peptide>* peptides) {
+    RecordReader reader(file, FLAGS_buf_size << 10);
+    CHECK(reader.OK());
+    while (!reader.Done()) {
+      peptides->push_back(pb::Peptide());
+      reader.Read(&peptides->back());
+      CHECK(reader.OK());
+    }
+    carp(CARP_DEBUG, "Read %d peptides from temp file, sorting...", peptides->size());
+    std::sort(peptides->begin(), peptides->end(), PbPeptideSort());
+  }
+
+  void ReadTempFileShare(int first, int stride) {
+    for (size_t i = first; i < mergeFiles_.size(); i += stride)
+      ReadTempFile(mergeFiles_[i], &merged_[i]);
+  }
+
+  // Combine all temp files into the final file. With several threads, the
+  // next FLAGS_mods_threads files are read and sorted at once.
   void Merge() {
+    size_t group = max(FLAGS_mods_threads, 1);
     while (!tempFiles_.empty()) {
-      map< int, pair<string, RecordWriter*> >::iterator i = tempFiles_.begin();
-      carp(CARP_DEBUG, "Reading temp file %s (id: %d)", i->second.first.c_str(), i->first);
-      RecordReader reader(i->second.first, FLAGS_buf_size << 10);
-      CHECK(reader.OK());
-      vector<pb::Peptide> peptides;
-      while (!reader.Done()) {
-        peptides.push_back(pb::Peptide());
-        reader.Read(&peptides[peptides.size() - 1]);
-        CHECK(reader.OK());
+      mergeFiles_.clear();
+      for (map< int, pair<string, RecordWriter*> >::iterator i = tempFiles_.begin();
+           i != tempFiles_.end() && mergeFiles_.size() < group;
+           i++) {
+        carp(CARP_DEBUG, "Reading temp file %s (id: %d)", i->second.first.c_str(), i->first);
+        mergeFiles_.push_back(i->second.first);
       }
-      DeleteTempFile(i);
-      carp(CARP_DEBUG, "Read %d peptides from temp file, sorting...", peptides.size());
-      std::sort(peptides.begin(), peptides.end(), PbPeptideSort());
-      int64_t id = 0;
-      for (vector<pb::Peptide>::iterator j = peptides.begin(); j != peptides.end(); j++) {
-        j->set_id(id++);
-        writer_->Write(&*j);
-        CHECK(writer_->OK());
+      merged_.resize(mergeFiles_.size());
+      RunShares(mergeFiles_.size(),
+                boost::bind(&ModsOutputterAlt::ReadTempFileShare, this, _1, _2));
+      for (size_t k = 0; k < mergeFiles_.size(); ++k) {
+        DeleteTempFile(tempFiles_.begin());
+        int64_t id = 0;
+        for (vector<pb::Peptide>::iterator j = merged_[k].begin(); j != merged_[k].end(); j++) {
+          j->set_id(id++);
+          writer_->Write(&*j);
+          CHECK(writer_->OK());
+        }
+        vector<pb::Peptide>().swap(merged_[k]);
       }
     }
   }
@@ -805,6 +971,11 @@ class ModsOutputterAlt : public IModsOutputter {
 
   map< int, pair<string, RecordWriter*> > tempFiles_; // id -> file, writer (ids must be in ascending order of mass)
   int64_t totalWritten_;
+
+  vector<pb::Peptide> batch_;
+  vector< vector<pb::Peptide> > expanded_;
+  vector<string> mergeFiles_;
+  vector< vector<pb::Peptide> > merged_;
 };
 
 void AddMods(HeadedRecordReader* reader,
@@ -842,7 +1013,77 @@ void AddMods(HeadedRecordReader* reader,
     CHECK(reader->Read(&peptide));
     outputter->Output(&peptide);
   }
+  outputter->Finish();
   carp(CARP_INFO, "Created %d peptides.", outputter->Total());
   CHECK(reader->OK());
 }
 
+SearchTimeMods::SearchTimeMods(const pb::Header::PeptidesHeader& header,
+                               const vector<const pb::Protein*>& proteins)
+  : outputter_(NULL), last_base_mass_(0), min_delta_(0), max_delta_(0) {
+  if (!table_.Load(header.mods(), header.nterm_mods(), header.cterm_mods())) {
+    carp(CARP_FATAL, "Cannot read the modifications of the index.");
+  }
+  FLAGS_max_mods = header.max_mods();
+  FLAGS_min_mods = header.min_mods();
+  const pb::ModTable* tables[] = { &header.mods(), &header.nterm_mods(),
+                                   &header.cterm_mods() };
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < tables[i]->variable_mod_size(); ++j) {
+      const pb::Modification& mod = tables[i]->variable_mod(j);
+      double delta = mod.delta() * max(1, mod.max_count());
+      if (delta < 0) {
+        min_delta_ += delta;
+      } else {
+        max_delta_ += delta;
+      }
+    }
+  }
+  outputter_ = new ModsOutputter("", proteins, &table_, NULL);
+}
+
+SearchTimeMods::~SearchTimeMods() {
+  delete outputter_;
+  for (vector<pb::Peptide*>::iterator i = held_.begin(); i != held_.end(); ++i) {
+    delete *i;
+  }
+  for (vector<pb::Peptide*>::iterator i = free_.begin(); i != free_.end(); ++i) {
+    delete *i;
+  }
+}
+
+void SearchTimeMods::Add() {
+  last_base_mass_ = base_.mass();
+  expanded_.clear();
+  outputter_->Collect(&base_, &expanded_);
+  for (size_t i = 0; i < expanded_.size(); ++i) {
+    pb::Peptide* peptide;
+    if (free_.empty()) {
+      peptide = new pb::Peptide;
+    } else {
+      peptide = free_.back();
+      free_.pop_back();
+    }
+    peptide->Swap(&expanded_[i].second);
+    double mass = peptide->mass();
+    for (int j = 0; j < peptide->modifications_size(); ++j) {
+      int aa_index, delta_index;
+      table_.DecodeMod(peptide->modifications(j), &aa_index, &delta_index);
+      mass += table_.PossDelta(delta_index);
+    }
+    peptide->set_mass(mass);
+    held_.push_back(peptide);
+    push_heap(held_.begin(), held_.end(), Heavier);
+  }
+}
+
+bool SearchTimeMods::Ready() const {
+  return !held_.empty() && held_.front()->mass() <= last_base_mass_ + min_delta_;
+}
+
+void SearchTimeMods::Pop(pb::Peptide* peptide) {
+  pop_heap(held_.begin(), held_.end(), Heavier);
+  peptide->Swap(held_.back());
+  free_.push_back(held_.back());
+  held_.pop_back();
+}
@@ -3,6 +3,9 @@
 // Add to the index of peptide records the pre-computed theoretical peaks.
 // We store the TheoreticalPeakSetDiff (q.v.) for each peptide. 
 //
+// With store_peaks, the search-time peak sets are stored instead, so that a
+// search using the same m/z bins can skip computing them. See peptides.proto.
+//
 // Example command-line:
 // peptide_peaks --proteins=<raw_proteins.proto input file> \
 //               --in_peptides=<peptides.proto input file> \
@@ -18,13 +21,17 @@
 // case we could eliminate them.
 
 #include <stdio.h>
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <string>
 #include <vector>
+#include <boost/bind.hpp>
 #include "records.h"
 #include "peptide.h"
 #include "theoretical_peak_set.h"
 #include "abspath.h"
+#include "util/ThreadPool.h"
 
 using namespace std;
 
@@ -54,9 +61,106 @@ static void AddPeaksToPB(pb::Peptide* peptide, const TheoreticalPeakArr* peaks,
 }
 */
 
+// Store the search-time peak set of one charge (see
+// TheoreticalPeakSetBYSparse) in dest. The codes are sorted so that the
+// deltas are small and positive; the order does not matter for scoring.
+static void AddSearchPeaksToPB(const TheoreticalPeakArr& peaks,
+                               vector<int>* codes,
+                               google::protobuf::RepeatedField<int>* dest) {
+  codes->clear();
+  for (int i = 0; i < peaks.size(); ++i)
+    codes->push_back(peaks[i].Code());
+  sort(codes->begin(), codes->end());
+  int last_code = 0;
+  for (vector<int>::const_iterator i = codes->begin(); i != codes->end(); ++i) {
+    dest->Add(*i - last_code);
+    last_code = *i;
+  }
+}
+
+// Peptides are read, given their peaks and written this many at a time.
+static const size_t PEAKS_BATCH_SIZE = 4096;
+
+// Read up to PEAKS_BATCH_SIZE peptides into batch, and return how many.
+static size_t ReadBatch(HeadedRecordReader* reader, vector<pb::Peptide>* batch) {
+  batch->resize(PEAKS_BATCH_SIZE);
+  size_t size = 0;
+  for (; size < PEAKS_BATCH_SIZE && !reader->Done(); ++size)
+    CHECK(reader->Read(&(*batch)[size]));
+  return size;
+}
+
+static void WriteBatch(HeadedRecordWriter* writer, vector<pb::Peptide>* batch,
+                       size_t size) {
+  for (size_t i = 0; i < size; ++i)
+    CHECK(writer->Write(&(*batch)[i]));
+}
+
+// Store the search-time peaks of batch[first], batch[first + stride], ...
+static void AddPeaksShare(const vector<const pb::Protein*>* proteins,
+                          vector<pb::Peptide>* batch, size_t size,
+                          int first, int stride) {
+  ST_TheoreticalPeakSet workspace(2000);
+  vector<int> codes;
+  for (size_t i = first; i < size; i += stride) {
+    pb::Peptide& pb_peptide = (*batch)[i];
+    Peptide peptide(pb_peptide, *proteins);
+    workspace.Clear();
+    peptide.ComputeTheoreticalPeaks(&workspace);
+    AddSearchPeaksToPB(workspace.GetPeaks()[0], &codes,
+                       pb_peptide.mutable_peak1());
+    AddSearchPeaksToPB(workspace.GetPeaks()[1], &codes,
+                       pb_peptide.mutable_peak2());
+  }
+}
+
+// Count how often each residue mass is the N-terminal, an inner or the
+// C-terminal residue of the peptides of input_filename, as
+// ActivePeptideQueue::CountAAFrequency() bins them at search time.
+static void CountResidueMasses(const vector<const pb::Protein*>& proteins,
+                               const string& input_filename,
+                               pb::Header::PeptidesHeader::ResidueMassCounts* counts) {
+  map< double, vector<int64_t> > residues;
+  pb::Header header;
+  HeadedRecordReader reader(input_filename, &header);
+  CHECK(reader.OK());
+  pb::Peptide pb_peptide;
+  while (!reader.Done()) {
+    reader.Read(&pb_peptide);
+    Peptide peptide(pb_peptide, proteins);
+    double* masses = peptide.getAAMasses();
+    int len = peptide.Len();
+    for (int i = 0; i < len; ++i) {
+      vector<int64_t>& count = residues[masses[i]];
+      count.resize(3);
+      if (i == 0) {
+        ++count[0];
+      }
+      if (i > 0 && i < len - 1) {
+        ++count[1];
+      }
+      if (i == len - 1) {
+        ++count[2];
+      }
+    }
+    delete[] masses;
+  }
+  CHECK(reader.OK());
+
+  counts->Clear();
+  for (map< double, vector<int64_t> >::const_iterator i = residues.begin();
+       i != residues.end(); ++i) {
+    counts->add_mass(i->first);
+    counts->add_nterm(i->second[0]);
+    counts->add_inner(i->second[1]);
+    counts->add_cterm(i->second[2]);
+  }
+}
+
 void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
 			 const string& input_filename,
-			 const string& output_filename) {
+			 const string& output_filename,
+			 bool store_peaks) {
   pb::Header orig_header, new_header;
   HeadedRecordReader reader(input_filename, &orig_header);
   CHECK(orig_header.file_type() == pb::Header::PEPTIDES);
@@ -66,6 +170,14 @@ void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
   pb::Header_PeptidesHeader* subheader = new_header.mutable_peptides_header();
   subheader->CopyFrom(orig_header.peptides_header());
   subheader->set_has_peaks(true);
+  if (store_peaks) {
+    // MassConstants must have been initialized with the bins to store.
+    subheader->set_peaks_bin_width(MassConstants::bin_width_);
+    subheader->set_peaks_bin_offset(MassConstants::bin_offset_);
+  }
+  // The header goes first, so the peptides are read once more for the counts
+  CountResidueMasses(proteins, input_filename,
+                     subheader->mutable_residue_mass_counts());
   pb::Header_Source* source = new_header.add_source();
   source->mutable_header()->CopyFrom(orig_header);
   source->set_filename(AbsPath(input_filename));
@@ -73,25 +185,24 @@ void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
   CHECK(reader.OK());
   CHECK(writer.OK());
 
-  pb::Peptide pb_peptide;
-//  const int workspace_size = 2000; // More than sufficient for theor. peaks.
-//  TheoreticalPeakSetDiff workspace(workspace_size);
-  while (!reader.Done()) {
-    reader.Read(&pb_peptide);
-/*    Peptide peptide(pb_peptide, proteins);
-    workspace.Clear();
-    peptide.ComputeTheoreticalPeaks(&workspace);
-    TheoreticalPeakArr peaks_charge_1(2000);
-    TheoreticalPeakArr peaks_charge_2(2000);
-    TheoreticalPeakArr negs_charge_1(2000);
-    TheoreticalPeakArr negs_charge_2(2000);
-    workspace.GetPeaks(&peaks_charge_1, &negs_charge_1,
-		       &peaks_charge_2, &negs_charge_2, NULL);
-    AddPeaksToPB(&pb_peptide, &peaks_charge_1, 1, false);
-    AddPeaksToPB(&pb_peptide, &peaks_charge_2, 2, false);
-    AddPeaksToPB(&pb_peptide, &negs_charge_1, 1, true);
-    AddPeaksToPB(&pb_peptide, &negs_charge_2, 2, true);
-*/    CHECK(writer.Write(&pb_peptide));
+  // While the pool computes the peaks of one batch, the batch before it is
+  // written and the one after it read, so that the reading, the peaks and
+  // the writing overlap.
+  vector<pb::Peptide> batches[2];
+  size_t sizes[2] = { ReadBatch(&reader, &batches[0]), 0 };
+  int threads = store_peaks ? ThreadPool::Threads() : 0;
+  int cur = 0;
+  while (sizes[cur] > 0) {
+    int other = 1 - cur;
+    ThreadPool::TaskGroup group;
+    for (int t = 0; t < threads; ++t)
+      group.Run(boost::bind(&AddPeaksShare, &proteins, &batches[cur],
+                            sizes[cur], t, threads));
+    WriteBatch(&writer, &batches[other], sizes[other]);
+    sizes[other] = ReadBatch(&reader, &batches[other]);
+    group.Wait();
+    cur = other;
   }
+  WriteBatch(&writer, &batches[1 - cur], sizes[1 - cur]);
   CHECK(reader.OK());
 }
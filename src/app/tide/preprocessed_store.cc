@@ -0,0 +1,184 @@
+// Preprocessed spectra kept on disk; see preprocessed_store.h.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "preprocessed_store.h"
+#include "content_hash.h"
+#include "mass_constants.h"
+#include "spectrum_collection.h"
+#include "io/carp.h"
+#include "util/FileUtils.h"
+#include "util/Params.h"
+
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+
+static const size_t kStoreHeaderSize = 24;
+
+PreprocessedStore::PreprocessedStore(const string& dir, uint64 key)
+  : key_(key), map_(NULL), map_size_(0), index_(NULL), size_(0),
+    entries_(NULL) {
+  char name[64];
+  sprintf(name, "preprocessed-%016llx.tps", (unsigned long long) key);
+  file_ = FileUtils::Join(dir, name);
+  if (Map()) {
+    carp(CARP_INFO, "Using the %d preprocessed spectra of %s.", (int) size_,
+         file_.c_str());
+  }
+}
+
+PreprocessedStore::~PreprocessedStore() {
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+  }
+}
+
+uint64 PreprocessedStore::Key(const SpectrumCollection& spectra) {
+  ContentHash hash;
+  // Everything PreprocessSpectrum() goes by, but for the global m/z bins,
+  // which change only how the cache is computed, not what it holds.
+  hash.Add(MassConstants::bin_width_);
+  hash.Add(MassConstants::bin_offset_);
+  hash.Add(Params::GetBool("skip-preprocessing"));
+  hash.Add(Params::GetBool("remove-precursor-peak"));
+  hash.Add(Params::GetDouble("remove-precursor-tolerance"));
+  hash.Add(Params::GetDouble("deisotope"));
+  hash.Add(Params::GetInt("peaks-per-window"));
+  hash.Add(Params::GetDouble("peak-window-width"));
+  const vector<SpectrumCollection::SpecCharge>* spec_charges = spectra.SpecCharges();
+  for (vector<SpectrumCollection::SpecCharge>::const_iterator i = spec_charges->begin();
+       i != spec_charges->end(); ++i) {
+    const Spectrum* spectrum = i->spectrum;
+    hash.Add(i->charge);
+    hash.Add(spectrum->SpectrumNumber());
+    hash.Add(i->PrecursorMZ());
+    hash.Add(spectrum->MaxCharge());
+    for (int j = 0; j < spectrum->Size(); ++j) {
+      hash.Add(spectrum->M_Z(j));
+      hash.Add(spectrum->Intensity(j));
+    }
+  }
+  return hash.Value();
+}
+
+bool PreprocessedStore::Map() {
+  struct stat st;
+  if (stat(file_.c_str(), &st) != 0 || (uint64) st.st_size < kStoreHeaderSize) {
+    return false;
+  }
+  uint64 file_size = st.st_size;
+  int fd = open(file_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  void* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  const uint32* words = (const uint32*) data;
+  uint64 recorded_key;
+  memcpy(&recorded_key, words + 2, sizeof(recorded_key));
+  uint64 n = words[4];
+  uint64 index_size = kStoreHeaderSize + n * sizeof(IndexEntry);
+  bool ok = words[0] == PREPROCESSED_STORE_MAGIC_NUMBER && recorded_key == key_ &&
+    file_size >= index_size;
+  const IndexEntry* index = (const IndexEntry*) ((const char*) data + kStoreHeaderSize);
+  if (ok && n > 0) {
+    const IndexEntry& last = index[n - 1];
+    ok = file_size == index_size + 4 * (last.offset + last.size);
+  }
+  if (!ok) {
+    carp(CARP_WARNING, "%s is not a store of these spectra; preprocessing "
+         "them again.", file_.c_str());
+    munmap(data, file_size);
+    return false;
+  }
+  map_ = data;
+  map_size_ = file_size;
+  index_ = index;
+  size_ = n;
+  entries_ = (const int*) ((const char*) data + index_size);
+  return true;
+}
+
+const int* PreprocessedStore::Find(int scan, int charge, double precursor_mz,
+                                   int* size) const {
+  IndexEntry key;
+  key.scan = scan;
+  key.charge = charge;
+  key.precursor_mz = precursor_mz;
+  const IndexEntry* found = lower_bound(index_, index_ + size_, key);
+  if (found == index_ + size_ || key < *found) {
+    return NULL;
+  }
+  *size = found->size;
+  return entries_ + found->offset;
+}
+
+void PreprocessedStore::Add(int scan, int charge, double precursor_mz,
+                            const vector<int>& entry) {
+  IndexEntry index;
+  index.scan = scan;
+  index.charge = charge;
+  index.precursor_mz = precursor_mz;
+  index.size = entry.size();
+  index.unused = 0;
+  boost::mutex::scoped_lock lock(mutex_);
+  index.offset = entries_vec_.size();
+  index_vec_.push_back(index);
+  entries_vec_.insert(entries_vec_.end(), entry.begin(), entry.end());
+}
+
+bool PreprocessedStore::Write() {
+  if (Mapped() || index_vec_.empty()) {
+    return true;
+  }
+  // The entries are written in the order of the index, so that the last
+  // entry of the index ends the file and a truncated store is caught.
+  sort(index_vec_.begin(), index_vec_.end());
+  index_vec_.erase(unique(index_vec_.begin(), index_vec_.end(), IndexEntry::Same),
+                   index_vec_.end());
+  vector<int> entries;
+  entries.reserve(entries_vec_.size());
+  for (vector<IndexEntry>::iterator i = index_vec_.begin(); i != index_vec_.end(); ++i) {
+    size_t offset = entries.size();
+    entries.insert(entries.end(), entries_vec_.begin() + i->offset,
+                   entries_vec_.begin() + i->offset + i->size);
+    i->offset = offset;
+  }
+  vector<int>().swap(entries_vec_);
+
+  // Written under another name and then renamed, so that a search running
+  // at the same time never maps half a store.
+  string tmp_file = file_ + ".tmp";
+  ofstream out(tmp_file.c_str(), ios::out | ios::binary | ios::trunc);
+  uint32 header[6] = { PREPROCESSED_STORE_MAGIC_NUMBER, 0, 0, 0,
+                       (uint32) index_vec_.size(), 0 };
+  memcpy(header + 2, &key_, sizeof(key_));
+  out.write((const char*) header, sizeof(header));
+  out.write((const char*) &index_vec_[0], index_vec_.size() * sizeof(IndexEntry));
+  if (!entries.empty()) {
+    out.write((const char*) &entries[0], entries.size() * sizeof(int));
+  }
+  out.close();
+  if (!out || rename(tmp_file.c_str(), file_.c_str()) != 0) {
+    remove(tmp_file.c_str());
+    return false;
+  }
+  carp(CARP_INFO, "Wrote %d preprocessed spectra to %s.", (int) index_vec_.size(),
+       file_.c_str());
+  return true;
+}
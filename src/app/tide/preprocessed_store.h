@@ -0,0 +1,97 @@
+// A store, on disk, of the preprocessed observed spectra of one spectrum file
+// (see tide-search's preprocessed-store option), so that searches of the same
+// spectra with the same preprocessing, over other databases or with other
+// modifications, skip ObservedPeakSet::PreprocessSpectrum().
+//
+// The store of a file is named after a key that hashes the spectra and the
+// parameters of preprocessing. A search looks for it in the store directory
+// and maps it into memory if it is there; otherwise it collects the entry of
+// each spectrum-charge pair it preprocesses and writes the store when it is
+// done with the file. A store is
+//
+//     PREPROCESSED_STORE_MAGIC_NUMBER, 0 (uint32s)
+//     the key (uint64)
+//     the number n of entries, 0 (uint32s)
+//     n IndexEntries, sorted by scan, charge and precursor m/z
+//     the entries (int32s; see ObservedPeakSet::SavePreprocessed())
+//
+// all in the byte order of the machine that wrote the file.
+
+#ifndef PREPROCESSED_STORE_H
+#define PREPROCESSED_STORE_H
+
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <google/protobuf/stubs/common.h>
+
+using namespace std;
+
+#define PREPROCESSED_STORE_MAGIC_NUMBER  0xfead1237ul
+
+class SpectrumCollection;
+
+class PreprocessedStore {
+ public:
+  // The store for key in dir: mapped, if there is one, and otherwise empty,
+  // to be filled by Add() and written by Write().
+  PreprocessedStore(const string& dir, google::protobuf::uint64 key);
+  ~PreprocessedStore();
+
+  // The key of the store of spectra, preprocessed as the parameters say.
+  static google::protobuf::uint64 Key(const SpectrumCollection& spectra);
+
+  // Whether the store was mapped, rather than is being filled.
+  bool Mapped() const { return map_ != NULL; }
+
+  // The entry of a spectrum-charge pair, and its size in *size, or NULL if
+  // the store has none.
+  const int* Find(int scan, int charge, double precursor_mz, int* size) const;
+
+  // Add the entry of a spectrum-charge pair to a store that is being
+  // filled. May be called by several threads at once.
+  void Add(int scan, int charge, double precursor_mz, const vector<int>& entry);
+
+  // Write a store that was filled. Returns false on an error.
+  bool Write();
+
+ private:
+  struct IndexEntry {
+    int scan;
+    int charge;
+    double precursor_mz;
+    google::protobuf::uint64 offset;  // in words, from the first entry
+    google::protobuf::uint32 size;
+    google::protobuf::uint32 unused;
+
+    bool operator<(const IndexEntry& other) const {
+      if (scan != other.scan)
+        return scan < other.scan;
+      if (charge != other.charge)
+        return charge < other.charge;
+      return precursor_mz < other.precursor_mz;
+    }
+    static bool Same(const IndexEntry& x, const IndexEntry& y) {
+      return !(x < y) && !(y < x);
+    }
+  };
+
+  bool Map();
+
+  string file_;
+  google::protobuf::uint64 key_;
+
+  // A mapped store
+  void* map_;
+  size_t map_size_;
+  const IndexEntry* index_;
+  size_t size_;
+  const int* entries_;
+
+  // A store being filled
+  boost::mutex mutex_;
+  vector<IndexEntry> index_vec_;
+  vector<int> entries_vec_;
+};
+
+#endif // PREPROCESSED_STORE_H
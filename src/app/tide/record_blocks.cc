@@ -0,0 +1,251 @@
+// Compressed blocks of records; see record_blocks.h.
+
+#include <cmath>
+#include <cstring>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <google/protobuf/io/coded_stream.h>
+#include "record_blocks.h"
+#include "io/carp.h"
+
+namespace bio = boost::iostreams;
+using google::protobuf::uint8;
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+using google::protobuf::int64;
+
+// Run size bytes of data through filter, replacing out.
+template<class Filter>
+static void RunFilter(const Filter& filter, const char* data, size_t size,
+                      string* out) {
+  out->clear();
+  bio::filtering_ostream stream;
+  stream.push(filter);
+  stream.push(bio::back_inserter(*out));
+  stream.write(data, size);
+  stream.reset();
+}
+
+static bool ReadFully(int fd, void* data, size_t size) {
+  char* p = (char*) data;
+  while (size > 0) {
+    int n = read(fd, p, size);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static uint32 DecodeUint32(const uint8* p) {
+  return (uint32) p[0] | ((uint32) p[1] << 8) | ((uint32) p[2] << 16) |
+    ((uint32) p[3] << 24);
+}
+
+static uint64 DecodeUint64(const uint8* p) {
+  return (uint64) DecodeUint32(p) | ((uint64) DecodeUint32(p + 4) << 32);
+}
+
+static double DecodeDouble(const uint8* p) {
+  uint64 bits = DecodeUint64(p);
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static void EncodeUint32(uint32 value, uint8* p) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (uint8) (value >> (8 * i));
+  }
+}
+
+static void EncodeUint64(uint64 value, uint8* p) {
+  EncodeUint32((uint32) value, p);
+  EncodeUint32((uint32) (value >> 32), p + 4);
+}
+
+bool ReadRecordBlockIndex(int fd, vector<RecordBlock>* blocks) {
+  blocks->clear();
+  off_t position = lseek(fd, 0, SEEK_CUR);
+  off_t end = lseek(fd, 0, SEEK_END);
+  uint8 buf[12];
+  bool ok = end >= 8 && lseek(fd, end - 8, SEEK_SET) >= 0 &&
+    ReadFully(fd, buf, 8);
+  if (ok) {
+    off_t index = (off_t) DecodeUint64(buf);
+    ok = index < end - 8 && lseek(fd, index, SEEK_SET) >= 0 &&
+      ReadFully(fd, buf, 4);
+    uint32 num_blocks = ok ? DecodeUint32(buf) : 0;
+    ok = ok && (off_t) num_blocks * 16 == end - 8 - index - 4;
+    for (uint32 i = 0; ok && i < num_blocks; ++i) {
+      uint8 entry[16];
+      ok = ReadFully(fd, entry, 16);
+      RecordBlock block;
+      block.offset = (int64) DecodeUint64(entry);
+      block.key = DecodeDouble(entry + 8);
+      blocks->push_back(block);
+    }
+  }
+  lseek(fd, position, SEEK_SET);
+  return ok;
+}
+
+bool BlockInputStream::NextBlock() {
+  if (ended_ || !ok_) {
+    return false;
+  }
+  google::protobuf::io::CodedInputStream input(source_);
+  uint32 raw_size, packed_size;
+  if (!input.ReadLittleEndian32(&raw_size) ||
+      !input.ReadLittleEndian32(&packed_size)) {
+    return ok_ = false;
+  }
+  if (raw_size == 0) {
+    ended_ = true;
+    return false;
+  }
+  string packed;
+  if (!input.ReadString(&packed, packed_size)) {
+    return ok_ = false;
+  }
+  try {
+    RunFilter(bio::zlib_decompressor(), packed.data(), packed.size(), &block_);
+  } catch (const bio::zlib_error& e) {
+    carp(CARP_ERROR, "Error decompressing a block of records: %s", e.what());
+    return ok_ = false;
+  }
+  if (block_.size() != raw_size) {
+    carp(CARP_ERROR, "A block of records has the wrong size");
+    return ok_ = false;
+  }
+  pos_ = 0;
+  ++blocks_read_;
+  return true;
+}
+
+bool BlockInputStream::Next(const void** data, int* size) {
+  while (pos_ >= (int) block_.size()) {
+    if (!NextBlock()) {
+      return false;
+    }
+  }
+  *data = block_.data() + pos_;
+  *size = (int) block_.size() - pos_;
+  pos_ = (int) block_.size();
+  count_ += *size;
+  return true;
+}
+
+void BlockInputStream::BackUp(int count) {
+  pos_ -= count;
+  count_ -= count;
+}
+
+bool BlockInputStream::Skip(int count) {
+  const void* data;
+  int size;
+  while (count > 0 && Next(&data, &size)) {
+    if (size > count) {
+      BackUp(size - count);
+      return true;
+    }
+    count -= size;
+  }
+  return count == 0;
+}
+
+BlockedRecordWriter::BlockedRecordWriter(const string& filename,
+                                         int block_size)
+  : out_(filename.c_str(), ios::out | ios::binary | ios::trunc),
+    block_size_(block_size), block_has_key_(false), block_key_(-HUGE_VAL),
+    offset_(0), closed_(false) {
+  uint8 magic[4];
+  EncodeUint32(BLOCKED_MAGIC_NUMBER, magic);
+  WriteRaw(magic, sizeof(magic));
+}
+
+bool BlockedRecordWriter::Write(const google::protobuf::Message* message) {
+  string bytes;
+  if (!message->SerializeToString(&bytes)) {
+    return false;
+  }
+  uint8 size[5];
+  uint8* end = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(
+    bytes.size(), size);
+  block_.append((const char*) size, end - size);
+  block_.append(bytes);
+  if ((int) block_.size() >= block_size_) {
+    Flush();
+  }
+  return out_.good();
+}
+
+bool BlockedRecordWriter::Write(const google::protobuf::Message* message,
+                                double key) {
+  if (!block_has_key_) {
+    block_has_key_ = true;
+    block_key_ = key;
+  }
+  return Write(message);
+}
+
+void BlockedRecordWriter::Close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  block_ += '\0';  // end-of-records marker
+  Flush();
+  uint8 buf[16];
+  EncodeUint32(0, buf);
+  EncodeUint32(0, buf + 4);
+  WriteRaw(buf, 8);
+  uint64 index = offset_;
+  EncodeUint32(blocks_.size(), buf);
+  WriteRaw(buf, 4);
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    uint64 key;
+    memcpy(&key, &blocks_[i].key, sizeof(key));
+    EncodeUint64(blocks_[i].offset, buf);
+    EncodeUint64(key, buf + 8);
+    WriteRaw(buf, 16);
+  }
+  EncodeUint64(index, buf);
+  WriteRaw(buf, 8);
+  out_.close();
+}
+
+void BlockedRecordWriter::Flush() {
+  if (block_.empty()) {
+    return;
+  }
+  RecordBlock block;
+  block.offset = offset_;
+  block.key = block_key_;
+  blocks_.push_back(block);
+
+  string packed;
+  RunFilter(bio::zlib_compressor(), block_.data(), block_.size(), &packed);
+  uint8 sizes[8];
+  EncodeUint32(block_.size(), sizes);
+  EncodeUint32(packed.size(), sizes + 4);
+  WriteRaw(sizes, sizeof(sizes));
+  WriteRaw(packed.data(), packed.size());
+  block_.clear();
+  // A block with no key of its own, such as one holding only the header,
+  // keeps the key of the block before it.
+  block_has_key_ = false;
+}
+
+void BlockedRecordWriter::WriteRaw(const void* data, size_t size) {
+  out_.write((const char*) data, size);
+  offset_ += size;
+}
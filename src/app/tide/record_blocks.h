@@ -0,0 +1,111 @@
+// A compressed form of a file of records (see records.h). The stream of
+// length-prefixed records that follows the magic number of an ordinary file
+// is cut, at record boundaries, into blocks of about a fixed size, and each
+// block is compressed with zlib on its own:
+//
+//     BLOCKED_MAGIC_NUMBER
+//     for each block: raw size, compressed size (little-endian uint32s),
+//                     compressed bytes
+//     0, 0
+//     the block index: the number of blocks (uint32), then for each block its
+//                      file offset (uint64) and key (double)
+//     the file offset of the block index (uint64)
+//
+// The key of a block is the key of the first record written to it with one,
+// and the keys must not decrease; for a peptide file it is the mass. Given a
+// key, a reader can then go straight to the last block whose key is below
+// it, instead of decoding every record on the way (see
+// RecordReader::SkipTo()).
+//
+// RecordReader recognizes the magic number and reads the records of a
+// blocked file through a BlockInputStream, so clients read either form
+// alike.
+
+#ifndef RECORD_BLOCKS_H
+#define RECORD_BLOCKS_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+using namespace std;
+
+#define BLOCKED_MAGIC_NUMBER  0xfead1235ul
+
+struct RecordBlock {
+  google::protobuf::int64 offset;
+  double key;
+};
+
+// Read the block index at the end of the blocked file open on fd, leaving
+// the file position of fd unchanged.
+bool ReadRecordBlockIndex(int fd, vector<RecordBlock>* blocks);
+
+// The decompressed bytes of the blocks read from source, which must be
+// positioned at the start of a block.
+class BlockInputStream : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  explicit BlockInputStream(google::protobuf::io::ZeroCopyInputStream* source)
+    : source_(source), pos_(0), count_(0), blocks_read_(0), ended_(false),
+      ok_(true) {}
+
+  // Continue from the start of the block at which source is positioned,
+  // discarding what is left of the current block.
+  void Reset(google::protobuf::io::ZeroCopyInputStream* source) {
+    source_ = source;
+    block_.clear();
+    pos_ = 0;
+    ended_ = false;
+  }
+
+  bool OK() const { return ok_; }
+  int BlocksRead() const { return blocks_read_; }
+
+  bool Next(const void** data, int* size);
+  void BackUp(int count);
+  bool Skip(int count);
+  google::protobuf::int64 ByteCount() const { return count_; }
+
+ private:
+  bool NextBlock();
+
+  google::protobuf::io::ZeroCopyInputStream* source_;
+  string block_;
+  int pos_;
+  google::protobuf::int64 count_;
+  int blocks_read_;
+  bool ended_;  // whether the end of the blocks has been read
+  bool ok_;
+};
+
+class BlockedRecordWriter {
+ public:
+  BlockedRecordWriter(const string& filename, int block_size);
+  ~BlockedRecordWriter() { Close(); }
+
+  bool OK() const { return out_.good(); }
+
+  // Write a record that has no key, such as a header.
+  bool Write(const google::protobuf::Message* message);
+  bool Write(const google::protobuf::Message* message, double key);
+
+  // Write the end of records, the last block and the block index.
+  void Close();
+
+ private:
+  void Flush();
+  void WriteRaw(const void* data, size_t size);
+
+  ofstream out_;
+  int block_size_;
+  string block_;
+  bool block_has_key_;
+  double block_key_;
+  google::protobuf::int64 offset_;
+  vector<RecordBlock> blocks_;
+  bool closed_;
+};
+
+#endif // RECORD_BLOCKS_H
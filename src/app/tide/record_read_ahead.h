@@ -0,0 +1,127 @@
+// RecordReadAhead decodes the records of a RecordReader on a background
+// thread, ahead of the client, so that reading and decoding overlap with
+// whatever the client does with the records. With an index on network
+// storage the search threads then wait for the disk only if they get through
+// the read-ahead buffer before the reader thread refills it.
+//
+// Decoded records are handed from the reader thread to the client through a
+// ring of capacity messages indexed by two counters, so neither side takes
+// a lock while the ring is neither empty nor full. A side that finds the
+// ring empty (the client) or full (the reader thread) sleeps on a condition
+// variable until the other side has made progress.
+//
+// The interface follows RecordReader: the client calls Done(), and if it
+// returns false, Read(). There must be a single client, and the underlying
+// reader must not be used directly while a RecordReadAhead reads from it.
+
+#ifndef RECORD_READ_AHEAD_H
+#define RECORD_READ_AHEAD_H
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include "records.h"
+
+template<class Message>
+class RecordReadAhead {
+ public:
+  // reader is not owned, and must outlive this object.
+  RecordReadAhead(RecordReader* reader, int capacity)
+    : reader_(reader), head_(0), tail_(0), finished_(false), stop_(false),
+      client_waiting_(false), reader_waiting_(false) {
+    capacity_ = 1;
+    while (capacity_ < (unsigned int) capacity)
+      capacity_ <<= 1;
+    slots_.resize(capacity_);
+    thread_ = new boost::thread(boost::bind(&RecordReadAhead::Run, this));
+  }
+
+  ~RecordReadAhead() {
+    stop_.store(true);
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      cond_.notify_all();
+    }
+    thread_->join();
+    delete thread_;
+  }
+
+  // Whether there are no more records, waiting for the reader thread if it
+  // has not yet decoded the next one.
+  bool Done() {
+    unsigned int head = head_.load(boost::memory_order_relaxed);
+    if (tail_.load(boost::memory_order_acquire) != head)
+      return false;
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    client_waiting_.store(true);
+    while (tail_.load() == head && !finished_.load())
+      cond_.wait(lock);
+    client_waiting_.store(false);
+    return tail_.load() == head;
+  }
+
+  // Move the next record into message. Only valid after Done() has returned
+  // false. The message's previous contents go back into the ring, so that
+  // its storage is reused.
+  void Read(Message* message) {
+    unsigned int head = head_.load(boost::memory_order_relaxed);
+    message->Swap(&slots_[head & (capacity_ - 1)]);
+    head_.store(head + 1);
+    if (reader_waiting_.load())
+      Wake();
+  }
+
+ private:
+  void Run() {
+    while (!stop_.load(boost::memory_order_relaxed) && !reader_->Done()) {
+      unsigned int tail = tail_.load(boost::memory_order_relaxed);
+      if (tail - head_.load(boost::memory_order_acquire) == capacity_) {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        reader_waiting_.store(true);
+        while (tail - head_.load() == capacity_ && !stop_.load())
+          cond_.wait(lock);
+        reader_waiting_.store(false);
+        if (stop_.load())
+          break;
+      }
+      if (!reader_->Read(&slots_[tail & (capacity_ - 1)]))
+        break;
+      tail_.store(tail + 1);
+      if (client_waiting_.load())
+        Wake();
+    }
+    finished_.store(true);
+    Wake();
+  }
+
+  void Wake() {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    cond_.notify_all();
+  }
+
+  RecordReader* reader_;
+  std::vector<Message> slots_;
+  unsigned int capacity_;  // a power of 2
+
+  // head_ counts the records taken by the client and tail_ the records
+  // decoded; both only grow, and wrap around together.
+  boost::atomic<unsigned int> head_;
+  boost::atomic<unsigned int> tail_;
+  boost::atomic<bool> finished_;
+  boost::atomic<bool> stop_;
+
+  // A side sets its flag before checking the ring a last time and going to
+  // sleep, and the other side checks the flag after updating the ring. These
+  // are sequentially consistent, so one side or the other always sees the
+  // update, and no wakeup is lost.
+  boost::atomic<bool> client_waiting_;
+  boost::atomic<bool> reader_waiting_;
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+
+  boost::thread* thread_;
+};
+
+#endif // RECORD_READ_AHEAD_H
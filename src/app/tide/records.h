@@ -39,6 +39,16 @@
 // Note that CodedInputStream isn't built to handle large streams of
 // input, so it should be reconstructed at each record. Perhaps the
 // underlying ZeroCopyStream should handle EOF determination
+//
+// A RecordReader may instead map its file into memory (see
+// MappedInputStream), in which case records are parsed straight out of the
+// page cache rather than copied into a private buffer first. Processes and
+// threads reading the same file then share one copy of it in memory.
+//
+// A file of records may also be compressed in blocks (see record_blocks.h);
+// RecordReader reads either form. Given a table of keyed file offsets, such
+// as the block index of a blocked file, RecordReader::SkipTo() moves ahead
+// to the records with a given key without decoding the ones before them.
 
 
 #ifndef RECORDS_H
@@ -50,15 +60,19 @@
 #include <fcntl.h>
 #ifdef _MSC_VER
 #include <io.h>
+#include "mman.h"
 #else
 #include <unistd.h>
+#include <sys/mman.h>
 #endif
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
 #include "header.pb.h"
+#include "record_blocks.h"
 #include "io/carp.h"
 
 using namespace std;
@@ -71,7 +85,7 @@ using namespace std;
 class RecordWriter {
  public:
   explicit RecordWriter(const string& filename, int buf_size = -1)
-    : raw_output_(NULL), coded_output_(NULL) {
+    : raw_output_(NULL), coded_output_(NULL), offset_(0) {
     if ((fd_ = open(filename.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
       carp(CARP_FATAL, "Couldn't open file %s for write (errno %d: %s).",
 	   filename.c_str(), errno, strerror(errno));
@@ -82,7 +96,7 @@ class RecordWriter {
   }
   
   explicit RecordWriter(google::protobuf::io::ZeroCopyOutputStream* raw_output)
-    : fd_(-1), raw_output_(raw_output) {
+    : fd_(-1), raw_output_(raw_output), offset_(0) {
     Init();
     raw_output_ = NULL; // we do not own (and will not delete) raw_output
   }
@@ -99,20 +113,27 @@ class RecordWriter {
   bool OK() const { return NULL != coded_output_; }
 
   bool Write(const google::protobuf::Message* message) {
-    coded_output_->WriteVarint32(message->ByteSize());
+    int size = message->ByteSize();
+    coded_output_->WriteVarint32(size);
     if (coded_output_->HadError()) {
       delete coded_output_;
       coded_output_ = NULL;
       return false;
     }
     message->SerializeWithCachedSizes(coded_output_);
+    offset_ += google::protobuf::io::CodedOutputStream::VarintSize32(size) + size;
     return !coded_output_->HadError();
   }
 
+  // The offset in the file at which the next record will start, as
+  // RecordReader::FilePosition() gives it.
+  google::protobuf::int64 Position() const { return offset_; }
+
  private:
   void Init() {
     coded_output_ = new google::protobuf::io::CodedOutputStream(raw_output_);
     coded_output_->WriteLittleEndian32(MAGIC_NUMBER);
+    offset_ = sizeof(google::protobuf::uint32);
     if (coded_output_->HadError()) {
       delete coded_output_;
       coded_output_ = NULL;
@@ -122,32 +143,164 @@ class RecordWriter {
   int fd_;
   google::protobuf::io::ZeroCopyOutputStream* raw_output_;
   google::protobuf::io::CodedOutputStream* coded_output_;
+  google::protobuf::int64 offset_;
 };
 
 
+// A ZeroCopyInputStream over a whole file mapped read-only into memory, or
+// over records already in memory. Next() hands out the bytes themselves, in
+// blocks small enough for the int sizes of the protobuf interfaces.
+class MappedInputStream : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  MappedInputStream(int fd, off_t size)
+    : data_(NULL), size_(size), pos_(0), unmap_(true) {
+    if (size_ <= 0)
+      return;
+    void* data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      return;
+#ifndef _MSC_VER
+    madvise(data, size_, MADV_SEQUENTIAL);
+#endif
+    data_ = (const char*) data;
+  }
+
+  // Not copied; bytes must outlive the stream.
+  explicit MappedInputStream(const string& bytes)
+    : data_(bytes.data()), size_(bytes.size()), pos_(0), unmap_(false) {}
+
+  ~MappedInputStream() {
+    if (data_ != NULL && unmap_)
+      munmap((void*) data_, size_);
+  }
+
+  bool OK() const { return data_ != NULL; }
+
+  bool Next(const void** data, int* size) {
+    if (pos_ >= size_)
+      return false;
+    off_t n = min((off_t) kBlockSize, size_ - pos_);
+    *data = data_ + pos_;
+    *size = (int) n;
+    pos_ += n;
+    return true;
+  }
+
+  void BackUp(int count) { pos_ -= count; }
+
+  void Seek(off_t pos) { pos_ = min(pos, size_); }
+
+  bool Skip(int count) {
+    if (size_ - pos_ < count) {
+      pos_ = size_;
+      return false;
+    }
+    pos_ += count;
+    return true;
+  }
+
+  google::protobuf::int64 ByteCount() const { return pos_; }
+
+ private:
+  static const int kBlockSize = 1 << 26;
+
+  const char* data_;
+  off_t size_;
+  off_t pos_;
+  bool unmap_;
+};
+
 class RecordReader {
  public:
-  explicit RecordReader(const string& filename, int buf_size = -1)
-    : raw_input_(NULL), coded_input_(NULL), size_(UINT32_MAX), valid_(false) {
+  // With map_file, the file is read through a MappedInputStream, falling
+  // back to ordinary reads if it cannot be mapped.
+  explicit RecordReader(const string& filename, int buf_size = -1,
+                        bool map_file = false)
+    : fd_(-1), buf_size_(buf_size), file_input_(NULL), mapped_(NULL),
+      blocks_(NULL), raw_input_(NULL), coded_input_(NULL), stream_base_(0),
+      size_(UINT32_MAX), valid_(false) {
     fd_ = open(filename.c_str(), O_RDONLY);
     if (fd_ < 0)
       return;
-    raw_input_ = new google::protobuf::io::FileInputStream(fd_, buf_size);
-    google::protobuf::io::CodedInputStream coded_input(raw_input_);
-    google::protobuf::uint32 magic_number;
-    if (coded_input.ReadLittleEndian32(&magic_number) 
-        && magic_number == MAGIC_NUMBER)
-      valid_ = true;
+    struct stat file_stat;
+    if (map_file && fstat(fd_, &file_stat) == 0) {
+      MappedInputStream* mapped = new MappedInputStream(fd_, file_stat.st_size);
+      if (mapped->OK()) {
+        file_input_ = mapped_ = mapped;
+      } else {
+        carp(CARP_DEBUG, "Could not map %s (errno %d: %s); reading it instead.",
+             filename.c_str(), errno, strerror(errno));
+        delete mapped;
+      }
+    }
+    if (file_input_ == NULL)
+      file_input_ = new google::protobuf::io::FileInputStream(fd_, buf_size);
+    Start(filename);
+  }
+
+  // Reads the records of a file held in bytes, which must outlive the
+  // reader, as for an index built in memory.
+  explicit RecordReader(const string* bytes)
+    : fd_(-1), buf_size_(-1), file_input_(NULL), mapped_(NULL),
+      blocks_(NULL), raw_input_(NULL), coded_input_(NULL), stream_base_(0),
+      size_(UINT32_MAX), valid_(false) {
+    file_input_ = mapped_ = new MappedInputStream(*bytes);
+    Start("records in memory");
   }
 
   ~RecordReader() {
     if (coded_input_)
       delete coded_input_;
-    delete raw_input_;
+    delete blocks_;
+    delete file_input_;
     if (fd_ >= 0)
       close(fd_);
   }
 
+  // Whether the file is compressed in blocks.
+  bool Blocked() const { return blocks_ != NULL; }
+
+  // Offsets, in the file, of records (or of blocks, in a blocked file) and
+  // the keys at which they start, in order. A blocked file supplies its
+  // block index itself.
+  void SetSkipTable(const vector<RecordBlock>& table) { skip_table_ = table; }
+  const vector<RecordBlock>& SkipTable() const { return skip_table_; }
+
+  // The offset in the file of the next byte of the file, which is that of
+  // the next record between records of a file that is not blocked.
+  google::protobuf::int64 FilePosition() const {
+    return stream_base_ + file_input_->ByteCount();
+  }
+
+  // Move ahead to the last entry of the skip table whose key is below key,
+  // if that is past the current position, so that records with keys below
+  // key may still follow, but records with key do not come before it.
+  // Returns whether it moved. Not between Done() and Read().
+  bool SkipTo(double key) {
+    if (!valid_ || size_ != UINT32_MAX || skip_table_.empty())
+      return false;
+    vector<RecordBlock>::const_iterator i =
+      lower_bound(skip_table_.begin(), skip_table_.end(), key, KeyBelow);
+    if (i == skip_table_.begin())
+      return false;
+    --i;
+    // In a blocked file, the current position is past the whole current
+    // block, so this also rules out the block being read.
+    if (i->offset < FilePosition())
+      return false;
+    Seek(i->offset);
+    return true;
+  }
+
+  // Move to the record at offset, as given by FilePosition() between
+  // records. Not for a blocked file, nor between Done() and Read().
+  bool SeekRecord(google::protobuf::int64 offset) {
+    if (!valid_ || blocks_ != NULL || size_ != UINT32_MAX)
+      return false;
+    Seek(offset);
+    return true;
+  }
+
   bool OK() const { return valid_; }
 
   bool Done() {
@@ -180,12 +333,72 @@ class RecordReader {
     return true;
   }
 
+  // Like Read(), but hands out the encoded record instead of parsing it, so
+  // that it can be parsed later or on another thread.
+  bool ReadBytes(string* bytes) {
+    if (!valid_)
+      return false;
+    assert(size_ != UINT32_MAX);
+    if (!coded_input_->ReadString(bytes, size_))
+      return valid_ = false;
+    delete coded_input_;
+    coded_input_ = NULL;
+    size_ = UINT32_MAX;
+    return true;
+  }
+
  private:
+  // Checks the magic number at the start of file_input_, and reads the
+  // records of a blocked file through a BlockInputStream.
+  void Start(const string& name) {
+    raw_input_ = file_input_;
+    google::protobuf::uint32 magic_number;
+    {
+      google::protobuf::io::CodedInputStream coded_input(raw_input_);
+      if (!coded_input.ReadLittleEndian32(&magic_number))
+        return;
+    }
+    if (magic_number == MAGIC_NUMBER) {
+      valid_ = true;
+    } else if (magic_number == BLOCKED_MAGIC_NUMBER) {
+      if (!ReadRecordBlockIndex(fd_, &skip_table_))
+        carp(CARP_DEBUG, "Could not read the block index of %s.",
+             name.c_str());
+      raw_input_ = blocks_ = new BlockInputStream(file_input_);
+      valid_ = true;
+    }
+  }
+
+  static bool KeyBelow(const RecordBlock& entry, double key) {
+    return entry.key < key;
+  }
+
+  void Seek(google::protobuf::int64 offset) {
+    if (mapped_ != NULL) {
+      mapped_->Seek(offset);
+    } else {
+      delete file_input_;
+      lseek(fd_, offset, SEEK_SET);
+      file_input_ = new google::protobuf::io::FileInputStream(fd_, buf_size_);
+      stream_base_ = offset;
+    }
+    if (blocks_ != NULL)
+      blocks_->Reset(file_input_);
+    else
+      raw_input_ = file_input_;
+  }
+
   int fd_;
-  google::protobuf::io::ZeroCopyInputStream* raw_input_;
+  int buf_size_;
+  google::protobuf::io::ZeroCopyInputStream* file_input_;
+  MappedInputStream* mapped_;  // file_input_, if the file is mapped
+  BlockInputStream* blocks_;   // over file_input_, for a blocked file
+  google::protobuf::io::ZeroCopyInputStream* raw_input_;  // the records
   google::protobuf::io::CodedInputStream* coded_input_;
+  google::protobuf::int64 stream_base_;  // file offset where file_input_ began
   google::protobuf::uint32 size_;
   bool valid_;
+  vector<RecordBlock> skip_table_;
 };
 
 class HeadedRecordWriter {
@@ -220,13 +433,21 @@ class HeadedRecordWriter {
 class HeadedRecordReader {
  public:
   HeadedRecordReader(const string& filename, pb::Header* header = NULL,
-                     int buf_size = -1)
-    : reader_(filename, buf_size), header_(header),
+                     int buf_size = -1, bool map_file = false)
+    : reader_(filename, buf_size, map_file), header_(header),
     del_header_(header == NULL) {
     if (header == NULL)
       header_ = new pb::Header;
-    if (!Done())
-      Read(header_);
+    if (!Done() && Read(header_))
+      UseSkipTable();
+  }
+  // The records of a file held in bytes (see RecordReader).
+  explicit HeadedRecordReader(const string* bytes, pb::Header* header = NULL)
+    : reader_(bytes), header_(header), del_header_(header == NULL) {
+    if (header == NULL)
+      header_ = new pb::Header;
+    if (!Done() && Read(header_))
+      UseSkipTable();
   }
   ~HeadedRecordReader() { if (del_header_) delete header_; }
 
@@ -240,6 +461,24 @@ class HeadedRecordReader {
   const pb::Header* GetHeader() const { return header_; }
 
  private:
+  // The skip table of a peptide file is relative to the end of the header.
+  void UseSkipTable() {
+    if (!header_->has_peptides_header() || reader_.Blocked())
+      return;
+    const pb::Header::PeptidesHeader::SkipTable& skip =
+      header_->peptides_header().skip_table();
+    int size = min(skip.mass_size(), skip.offset_size());
+    if (size == 0)
+      return;
+    google::protobuf::int64 base = reader_.FilePosition();
+    vector<RecordBlock> table(size);
+    for (int i = 0; i < size; ++i) {
+      table[i].offset = base + skip.offset(i);
+      table[i].key = skip.mass(i);
+    }
+    reader_.SetSkipTable(table);
+  }
+
   void ReadMagicNumber();
   RecordReader reader_;
   pb::Header* header_;
@@ -37,8 +37,8 @@ template<class Protobuf>
 int CountRecords(const string& filename) {
   int count = 0;
   HeadedRecordReader reader(filename);
+  Protobuf protobuf;
   while (!reader.Done()) {
-    Protobuf protobuf;
     reader.Read(&protobuf);
     ++count;
   }
@@ -0,0 +1,193 @@
+// Results of earlier searches kept on disk; see result_memo.h.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "result_memo.h"
+#include "io/carp.h"
+#include "util/FileUtils.h"
+
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+
+static const size_t kMemoHeaderSize = 24;
+
+ResultMemo::ResultMemo(const string& dir, uint64 key,
+                       const vector<IndexShard>& shards)
+  : key_(key), map_(NULL), map_size_(0), old_shards_(NULL), num_old_shards_(0),
+    index_(NULL), size_(0), text_(NULL) {
+  for (vector<IndexShard>::const_iterator i = shards.begin(); i != shards.end(); ++i) {
+    Shard shard;
+    shard.min_mass = i->min_mass;
+    shard.max_mass = i->max_mass;
+    shard.content_hash = i->content_hash;
+    shards_.push_back(shard);
+  }
+  char name[64];
+  sprintf(name, "results-%016llx.trm", (unsigned long long) key);
+  file_ = FileUtils::Join(dir, name);
+  if (Map()) {
+    carp(CARP_INFO, "Reusing the results of %d spectrum-charge combinations in %s "
+         "where the index is unchanged.", (int) size_, file_.c_str());
+  }
+}
+
+ResultMemo::~ResultMemo() {
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+  }
+}
+
+bool ResultMemo::Map() {
+  struct stat st;
+  if (stat(file_.c_str(), &st) != 0 || (uint64) st.st_size < kMemoHeaderSize) {
+    return false;
+  }
+  uint64 file_size = st.st_size;
+  int fd = open(file_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  void* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  const uint32* words = (const uint32*) data;
+  uint64 recorded_key;
+  memcpy(&recorded_key, words + 2, sizeof(recorded_key));
+  uint64 s = words[4];
+  uint64 n = words[5];
+  uint64 index_end = kMemoHeaderSize + s * sizeof(Shard) + n * sizeof(IndexEntry);
+  bool ok = words[0] == RESULT_MEMO_MAGIC_NUMBER && recorded_key == key_ &&
+    file_size >= index_end;
+  const Shard* shards = (const Shard*) ((const char*) data + kMemoHeaderSize);
+  const IndexEntry* index = (const IndexEntry*) (shards + s);
+  if (ok && n > 0) {
+    const IndexEntry& last = index[n - 1];
+    ok = file_size == index_end + last.offset + last.target_size + last.decoy_size;
+  }
+  if (!ok) {
+    carp(CARP_WARNING, "%s is not a memo of these spectra; searching them all.",
+         file_.c_str());
+    munmap(data, file_size);
+    return false;
+  }
+  map_ = data;
+  map_size_ = file_size;
+  old_shards_ = shards;
+  num_old_shards_ = s;
+  index_ = index;
+  size_ = n;
+  text_ = (const char*) data + index_end;
+  return true;
+}
+
+void ResultMemo::Overlapping(const Shard* begin, const Shard* end, double min_mass,
+                             double max_mass, vector<uint64>* hashes) {
+  hashes->clear();
+  for (const Shard* i = begin; i != end && i->min_mass <= max_mass; ++i) {
+    if (i->max_mass >= min_mass) {
+      hashes->push_back(i->content_hash);
+    }
+  }
+}
+
+bool ResultMemo::Find(int scan, int charge, double precursor_mz, double min_mass,
+                      double max_mass, string* target, string* decoy) const {
+  if (!Mapped()) {
+    return false;
+  }
+  IndexEntry key;
+  key.scan = scan;
+  key.charge = charge;
+  key.precursor_mz = precursor_mz;
+  const IndexEntry* found = lower_bound(index_, index_ + size_, key);
+  if (found == index_ + size_ || key < *found) {
+    return false;
+  }
+  vector<uint64> old_hashes, hashes;
+  Overlapping(old_shards_, old_shards_ + num_old_shards_, min_mass, max_mass,
+              &old_hashes);
+  const Shard* shards = shards_.empty() ? NULL : &shards_[0];
+  Overlapping(shards, shards + shards_.size(), min_mass, max_mass, &hashes);
+  if (hashes != old_hashes ||
+      find(hashes.begin(), hashes.end(), (uint64) 0) != hashes.end()) {
+    return false;
+  }
+  const char* text = text_ + found->offset;
+  target->assign(text, found->target_size);
+  decoy->assign(text + found->target_size, found->decoy_size);
+  return true;
+}
+
+void ResultMemo::Add(int scan, int charge, double precursor_mz,
+                     const string& target, const string& decoy) {
+  IndexEntry index;
+  index.scan = scan;
+  index.charge = charge;
+  index.precursor_mz = precursor_mz;
+  index.target_size = target.size();
+  index.decoy_size = decoy.size();
+  boost::mutex::scoped_lock lock(mutex_);
+  index.offset = text_vec_.size();
+  index_vec_.push_back(index);
+  text_vec_ += target;
+  text_vec_ += decoy;
+}
+
+bool ResultMemo::Write() {
+  // The text is written in the order of the index, so that the last entry
+  // of the index ends the file and a truncated memo is caught.
+  sort(index_vec_.begin(), index_vec_.end());
+  index_vec_.erase(unique(index_vec_.begin(), index_vec_.end(), IndexEntry::Same),
+                   index_vec_.end());
+  string text;
+  text.reserve(text_vec_.size());
+  for (vector<IndexEntry>::iterator i = index_vec_.begin(); i != index_vec_.end(); ++i) {
+    size_t offset = text.size();
+    text.append(text_vec_, i->offset, i->target_size + i->decoy_size);
+    i->offset = offset;
+  }
+  string().swap(text_vec_);
+
+  // The new memo may replace the mapped one, which is no longer needed.
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+    map_ = NULL;
+  }
+  // Written under another name and then renamed, so that a search running
+  // at the same time never maps half a memo.
+  string tmp_file = file_ + ".tmp";
+  ofstream out(tmp_file.c_str(), ios::out | ios::binary | ios::trunc);
+  uint32 header[6] = { RESULT_MEMO_MAGIC_NUMBER, 0, 0, 0,
+                       (uint32) shards_.size(), (uint32) index_vec_.size() };
+  memcpy(header + 2, &key_, sizeof(key_));
+  out.write((const char*) header, sizeof(header));
+  if (!shards_.empty()) {
+    out.write((const char*) &shards_[0], shards_.size() * sizeof(Shard));
+  }
+  if (!index_vec_.empty()) {
+    out.write((const char*) &index_vec_[0], index_vec_.size() * sizeof(IndexEntry));
+  }
+  out.write(text.data(), text.size());
+  out.close();
+  if (!out || rename(tmp_file.c_str(), file_.c_str()) != 0) {
+    remove(tmp_file.c_str());
+    return false;
+  }
+  carp(CARP_INFO, "Wrote the results of %d spectrum-charge combinations to %s.",
+       (int) index_vec_.size(), file_.c_str());
+  return true;
+}
@@ -0,0 +1,117 @@
+// A memo, on disk, of the results tide-search reported for the spectrum-charge
+// pairs of one spectrum file (see tide-search's result-memo option), so that
+// a search of the same spectra with the same parameters against an index
+// that differs only in some of its shards searches again only the pairs
+// whose precursor windows reach a changed shard.
+//
+// The memo of a file is named after a key that hashes the spectra (as
+// PreprocessedStore::Key()) and the search parameters. It records the shards
+// of the index it was made with (see index_shards.h) and, for each pair, the
+// text the pair added to the target and decoy results. The text of a pair
+// holds for another index if the shards that overlap the pair's window have
+// the same content hashes, in the same order, in both: then the pair has the
+// same candidates and the same results. A memo is
+//
+//     RESULT_MEMO_MAGIC_NUMBER, 0 (uint32s)
+//     the key (uint64)
+//     the number s of shards, the number n of entries (uint32s)
+//     s Shards, in mass order
+//     n IndexEntries, sorted by scan, charge and precursor m/z
+//     the text of the entries, each its target text, then its decoy text
+//
+// all in the byte order of the machine that wrote the file.
+
+#ifndef RESULT_MEMO_H
+#define RESULT_MEMO_H
+
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <google/protobuf/stubs/common.h>
+#include "index_shards.h"
+
+using namespace std;
+
+#define RESULT_MEMO_MAGIC_NUMBER  0xfead1238ul
+
+class ResultMemo {
+ public:
+  // The memo for key in dir, for a search of the index with shards. The memo
+  // there, if any, is mapped to be looked up; the one written by Write()
+  // replaces it.
+  ResultMemo(const string& dir, google::protobuf::uint64 key,
+             const vector<IndexShard>& shards);
+  ~ResultMemo();
+
+  // Whether there was a memo to look up.
+  bool Mapped() const { return map_ != NULL; }
+
+  // The text a spectrum-charge pair whose candidates are the peptides of
+  // [min_mass, max_mass] reported, if the memo has it and it holds for the
+  // shards of this search. Returns false otherwise.
+  bool Find(int scan, int charge, double precursor_mz, double min_mass,
+            double max_mass, string* target, string* decoy) const;
+
+  // Record the text that a spectrum-charge pair reported, looked up or
+  // searched. May be called by several threads at once.
+  void Add(int scan, int charge, double precursor_mz, const string& target,
+           const string& decoy);
+
+  // Write the memo of this search. Returns false on an error.
+  bool Write();
+
+ private:
+  struct Shard {
+    double min_mass;
+    double max_mass;
+    google::protobuf::uint64 content_hash;
+  };
+
+  struct IndexEntry {
+    int scan;
+    int charge;
+    double precursor_mz;
+    google::protobuf::uint64 offset;  // in bytes, from the first text
+    google::protobuf::uint32 target_size;
+    google::protobuf::uint32 decoy_size;
+
+    bool operator<(const IndexEntry& other) const {
+      if (scan != other.scan)
+        return scan < other.scan;
+      if (charge != other.charge)
+        return charge < other.charge;
+      return precursor_mz < other.precursor_mz;
+    }
+    static bool Same(const IndexEntry& x, const IndexEntry& y) {
+      return !(x < y) && !(y < x);
+    }
+  };
+
+  bool Map();
+
+  // The content hashes of the shards of [begin, end) that overlap
+  // [min_mass, max_mass], in order.
+  static void Overlapping(const Shard* begin, const Shard* end, double min_mass,
+                          double max_mass,
+                          vector<google::protobuf::uint64>* hashes);
+
+  string file_;
+  google::protobuf::uint64 key_;
+  vector<Shard> shards_;  // of this search
+
+  // The memo of an earlier search
+  void* map_;
+  size_t map_size_;
+  const Shard* old_shards_;
+  size_t num_old_shards_;
+  const IndexEntry* index_;
+  size_t size_;
+  const char* text_;
+
+  // The memo of this search
+  boost::mutex mutex_;
+  vector<IndexEntry> index_vec_;
+  string text_vec_;
+};
+
+#endif // RESULT_MEMO_H
@@ -0,0 +1,83 @@
+// The scan index of a spectrumrecords file; see scan_index.h.
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include "scan_index.h"
+#include "io/carp.h"
+#include "util/FileUtils.h"
+
+using google::protobuf::int64;
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+
+static bool SameScan(const ScanIndex::Entry& a, const ScanIndex::Entry& b) {
+  return a.scan == b.scan;
+}
+
+string ScanIndex::FileName(const string& spectrum_file) {
+  return spectrum_file + ".scans";
+}
+
+bool ScanIndex::Write(const string& spectrum_file,
+                      const vector<pair<int, int64> >& records) {
+  vector<Entry> entries;
+  for (vector<pair<int, int64> >::const_iterator i = records.begin();
+       i != records.end(); ++i) {
+    if (!entries.empty() && entries.back().scan == i->first) {
+      ++entries.back().records;
+      continue;
+    }
+    Entry entry = { i->first, 1, i->second };
+    entries.push_back(entry);
+  }
+  // A scan that is not contiguous, as from a file with repeated scan
+  // numbers, keeps its first run.
+  stable_sort(entries.begin(), entries.end());
+  entries.erase(unique(entries.begin(), entries.end(), SameScan), entries.end());
+
+  uint64 source_size = FileUtils::Size(spectrum_file);
+  ofstream out(FileName(spectrum_file).c_str(), ios::out | ios::binary | ios::trunc);
+  uint32 header[4] = { SCAN_INDEX_MAGIC_NUMBER, (uint32) entries.size(), 0, 0 };
+  memcpy(header + 2, &source_size, sizeof(source_size));
+  out.write((const char*) header, sizeof(header));
+  if (!entries.empty()) {
+    out.write((const char*) &entries[0], entries.size() * sizeof(Entry));
+  }
+  out.close();
+  return out.good();
+}
+
+bool ScanIndex::Read(const string& spectrum_file) {
+  entries_.clear();
+  string file = FileName(spectrum_file);
+  if (!FileUtils::Exists(file)) {
+    return false;
+  }
+  ifstream in(file.c_str(), ios::in | ios::binary);
+  uint32 header[4];
+  if (!in.read((char*) header, sizeof(header))) {
+    return false;
+  }
+  uint64 source_size;
+  memcpy(&source_size, header + 2, sizeof(source_size));
+  if (header[0] != SCAN_INDEX_MAGIC_NUMBER ||
+      source_size != FileUtils::Size(spectrum_file)) {
+    carp(CARP_DEBUG, "%s does not match %s; not using it.", file.c_str(),
+         spectrum_file.c_str());
+    return false;
+  }
+  entries_.resize(header[1]);
+  if (!entries_.empty() &&
+      !in.read((char*) &entries_[0], entries_.size() * sizeof(Entry))) {
+    entries_.clear();
+    return false;
+  }
+  return true;
+}
+
+const ScanIndex::Entry* ScanIndex::Find(int scan) const {
+  Entry key = { scan, 0, 0 };
+  vector<Entry>::const_iterator i = lower_bound(entries_.begin(), entries_.end(), key);
+  return i != entries_.end() && i->scan == scan ? &*i : NULL;
+}
@@ -0,0 +1,55 @@
+// A spectrumrecords file may have a scan index next to it, in
+// <file>.scans, so that the records of one scan can be read with a seek
+// instead of a pass over the file (see SpectrumRecordWriter::convert() and
+// SpectrumRecordSpectrumCollection::getSpectrum()):
+//
+//     SCAN_INDEX_MAGIC_NUMBER, the number n of scans (uint32s)
+//     the size of the spectrumrecords file the index was made from (uint64)
+//     n entries, in increasing order of scan: the scan number (int32), the
+//         number of records of the scan (uint32), and the file offset of the
+//         first of them (int64)
+//
+// all in the byte order of the machine that wrote the file. The records of a
+// scan, one per charge state, are consecutive. An index made from a file of
+// another size is not used.
+
+#ifndef SCAN_INDEX_H
+#define SCAN_INDEX_H
+
+#include <string>
+#include <vector>
+#include <google/protobuf/stubs/common.h>
+
+using namespace std;
+
+#define SCAN_INDEX_MAGIC_NUMBER  0xfead1237ul
+
+class ScanIndex {
+ public:
+  struct Entry {
+    google::protobuf::int32 scan;
+    google::protobuf::uint32 records;
+    google::protobuf::int64 offset;
+    bool operator<(const Entry& other) const { return scan < other.scan; }
+  };
+
+  // The name of the scan index of spectrum_file.
+  static string FileName(const string& spectrum_file);
+
+  // Write the index of spectrum_file, which must be complete, given the scan
+  // and offset of each of its records in file order.
+  static bool Write(const string& spectrum_file,
+                    const vector<pair<int, google::protobuf::int64> >& records);
+
+  // Read the index of spectrum_file. Returns false if there is none, or if
+  // it does not match the file.
+  bool Read(const string& spectrum_file);
+
+  // The entry for scan, or NULL if the index has none.
+  const Entry* Find(int scan) const;
+
+ private:
+  vector<Entry> entries_;
+};
+
+#endif // SCAN_INDEX_H
@@ -0,0 +1,484 @@
+// The coordinator and workers of a tide-search spread over several machines;
+// see search_cluster.h.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <boost/bind.hpp>
+#include "search_cluster.h"
+#include "io/carp.h"
+#include "util/StringUtils.h"
+#include "crux_version.h"
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#define CLUSTER_SOCKETS 0
+#else
+#define CLUSTER_SOCKETS 1
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// How long a worker keeps trying to reach a coordinator that is not yet
+// listening.
+static const int kConnectSeconds = 120;
+
+// How long the coordinator waits for a new connection to say hello.
+static const int kHelloSeconds = 30;
+
+// Changes whenever the messages change, so that workers and coordinators of
+// different builds refuse each other.
+static const int kProtocol = 2;
+
+// The longest protocol line, and the largest part of a chunk, that a peer
+// may send. A part is read as its bytes arrive rather than all allocated up
+// front.
+static const size_t kMaxLineBytes = 1024;
+static const unsigned long long kMaxPartBytes = 1ULL << 36;
+static const size_t kReadBlockBytes = 1 << 20;
+
+#if CLUSTER_SOCKETS
+
+static bool WriteAll(int socket, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(socket, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool WriteAll(int socket, const string& data) {
+  return WriteAll(socket, data.data(), data.size());
+}
+
+// Grow data only as the bytes come in, so that a peer cannot make us
+// allocate more than it sends.
+static bool ReadAll(int socket, size_t size, string* data) {
+  data->clear();
+  while (data->size() < size) {
+    size_t done = data->size();
+    data->resize(done + min(size - done, kReadBlockBytes));
+    while (done < data->size()) {
+      ssize_t n = recv(socket, &(*data)[done], data->size() - done, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        return false;
+      }
+      done += n;
+    }
+  }
+  return true;
+}
+
+// The lines of the protocol are short; they are read a byte at a time.
+static bool ReadLine(int socket, string* line) {
+  line->clear();
+  char c;
+  while (line->size() < kMaxLineBytes) {
+    ssize_t n = recv(socket, &c, 1, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return false;
+    } else if (c == '\n') {
+      return true;
+    }
+    *line += c;
+  }
+  return false;
+}
+
+// A size sent by the peer, if it is one that we accept.
+static bool ParsePartSize(const string& field, size_t* size) {
+  unsigned long long value;
+  if (!StringUtils::TryFromString(field, &value) || value > kMaxPartBytes ||
+      value != (unsigned long long)(size_t)value) {
+    return false;
+  }
+  *size = (size_t)value;
+  return true;
+}
+
+// Where MSG_NOSIGNAL does not exist, as on OS X, a write to a lost peer
+// raises SIGPIPE unless the socket is told not to.
+static void NoSigPipe(int socket) {
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+// Wait at most seconds, or 0 for ever, in each read from the socket.
+static void SetReadTimeout(int socket, int seconds) {
+  struct timeval timeout;
+  timeout.tv_sec = seconds;
+  timeout.tv_usec = 0;
+  setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static string Hello() {
+  return "hello tide-cluster " + StringUtils::ToString(kProtocol) + ' ' + CRUX_VERSION;
+}
+
+#endif
+
+ClusterCoordinator::ClusterCoordinator()
+  : listener_(-1), backlog_bytes_(0), next_chunk_(0), next_slice_(0),
+    started_chunk_(false) {
+}
+
+ClusterCoordinator::~ClusterCoordinator() {
+  receivers_.join_all();
+#if CLUSTER_SOCKETS
+  for (vector<Worker>::iterator i = workers_.begin(); i != workers_.end(); ++i) {
+    close(i->socket);
+  }
+  if (listener_ >= 0) {
+    close(listener_);
+  }
+#endif
+}
+
+bool ClusterCoordinator::Start(const string& address, int port, int num_workers,
+                               size_t backlog_bytes) {
+  backlog_bytes_ = backlog_bytes;
+#if CLUSTER_SOCKETS
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = address.empty() ? AF_INET : AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo* addresses;
+  string port_string = StringUtils::ToString(port);
+  int error = getaddrinfo(address.empty() ? NULL : address.c_str(), port_string.c_str(),
+                          &hints, &addresses);
+  if (error != 0) {
+    carp(CARP_ERROR, "Cannot resolve %s: %s", address.c_str(), gai_strerror(error));
+    return false;
+  }
+  for (struct addrinfo* a = addresses; a != NULL && listener_ < 0; a = a->ai_next) {
+    int s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (s < 0) {
+      continue;
+    }
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(s, a->ai_addr, a->ai_addrlen) == 0 && listen(s, num_workers) == 0) {
+      listener_ = s;
+    } else {
+      error = errno;
+      close(s);
+    }
+  }
+  freeaddrinfo(addresses);
+  string where = (address.empty() ? string("all interfaces") : address) +
+    ", port " + port_string;
+  if (listener_ < 0) {
+    carp(CARP_ERROR, "Cannot listen on %s (errno %d: %s)", where.c_str(), error,
+         strerror(error));
+    return false;
+  }
+  carp(CARP_INFO, "Waiting on %s for %d workers.", where.c_str(), num_workers);
+  while ((int)workers_.size() < num_workers) {
+    int worker = accept(listener_, NULL, NULL);
+    if (worker < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      carp(CARP_ERROR, "Cannot accept a worker (errno %d: %s)", errno, strerror(errno));
+      return false;
+    }
+    NoSigPipe(worker);
+    SetReadTimeout(worker, kHelloSeconds);
+    string hello;
+    if (!ReadLine(worker, &hello) || hello != Hello()) {
+      carp(CARP_WARNING, "Refused a connection that did not say '%s'.", Hello().c_str());
+      WriteAll(worker, "refused expected " + Hello() + '\n');
+      close(worker);
+      continue;
+    }
+    SetReadTimeout(worker, 0);
+    int slice = workers_.size();
+    if (!WriteAll(worker, "slice " + StringUtils::ToString(slice) + ' ' +
+                  StringUtils::ToString(num_workers) + '\n')) {
+      carp(CARP_WARNING, "Lost a worker before giving it a slice.");
+      close(worker);
+      continue;
+    }
+    Worker w;
+    w.socket = worker;
+    w.chunks = 0;
+    w.done = false;
+    w.failed = false;
+    w.backlog = 0;
+    workers_.push_back(w);
+    carp(CARP_INFO, "Worker %d of %d connected.", slice + 1, num_workers);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    receivers_.create_thread(boost::bind(&ClusterCoordinator::Receive, this, i));
+  }
+  return true;
+#else
+  carp(CARP_ERROR, "A search over several machines is not available on this platform.");
+  return false;
+#endif
+}
+
+void ClusterCoordinator::Receive(size_t slice) {
+#if CLUSTER_SOCKETS
+  int socket = workers_[slice].socket;
+  bool ok = false;
+  string line;
+  while (ReadLine(socket, &line)) {
+    if (line == "done") {
+      ok = true;
+      break;
+    }
+    ClusterPart part;
+    part.first = false;
+    if (line != "end") {
+      vector<string> fields = StringUtils::Split(line, ' ');
+      size_t bytes;
+      if (fields.size() != 2 || (fields[0] != "target" && fields[0] != "decoy") ||
+          !ParsePartSize(fields[1], &bytes) ||
+          !ReadAll(socket, bytes, fields[0] == "target" ? &part.target : &part.decoy)) {
+        break;
+      } else if (bytes == 0) {
+        continue;
+      }
+    }
+    boost::mutex::scoped_lock lock(mutex_);
+    Worker& worker = workers_[slice];
+    // Stop reading from a worker that is too far ahead of the others; its
+    // own writes then wait.
+    while (worker.backlog >= backlog_bytes_) {
+      changed_.wait(lock);
+    }
+    worker.backlog += part.target.size() + part.decoy.size();
+    worker.parts.push_back(ClusterPart());
+    worker.parts.back().target.swap(part.target);
+    worker.parts.back().decoy.swap(part.decoy);
+    if (line == "end") {
+      ++worker.chunks;
+    }
+    changed_.notify_all();
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  workers_[slice].done = true;
+  workers_[slice].failed = !ok;
+  changed_.notify_all();
+#endif
+}
+
+bool ClusterCoordinator::Next(ClusterPart* part) {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    if (workers_.empty()) {
+      return false;
+    }
+    Worker& worker = workers_[next_slice_];
+    if (worker.failed) {
+      carp(CARP_FATAL, "Worker %d failed or lost its connection.", (int)next_slice_ + 1);
+    }
+    if (!worker.parts.empty()) {
+      ClusterPart& next = worker.parts.front();
+      bool end = next.target.empty() && next.decoy.empty();
+      part->target.swap(next.target);
+      part->decoy.swap(next.decoy);
+      part->first = !started_chunk_;
+      worker.backlog -= part->target.size() + part->decoy.size();
+      worker.parts.pop_front();
+      // The receiver may be waiting for room
+      changed_.notify_all();
+      if (!end) {
+        started_chunk_ = true;
+        return true;
+      }
+      started_chunk_ = false;
+      if (++next_slice_ == workers_.size()) {
+        next_slice_ = 0;
+        ++next_chunk_;
+      }
+      continue;
+    }
+    if (worker.done) {
+      // This worker has sent all its chunks; so must the others have.
+      for (size_t j = 0; j < workers_.size(); ++j) {
+        if (!workers_[j].done) {
+          changed_.wait(lock);
+          break;
+        } else if (workers_[j].failed) {
+          carp(CARP_FATAL, "Worker %d failed or lost its connection.", (int)j + 1);
+        } else if (!workers_[j].parts.empty() ||
+                   workers_[j].chunks != next_chunk_ + (j < next_slice_ ? 1 : 0)) {
+          carp(CARP_FATAL, "The workers searched different numbers of spectrum files.");
+        } else if (j + 1 == workers_.size()) {
+          return false;
+        }
+      }
+      continue;
+    }
+    changed_.wait(lock);
+  }
+}
+
+ClusterWorker::ClusterWorker()
+  : socket_(-1), slice_(0), num_slices_(0), target_buf_(this, "target"),
+    decoy_buf_(this, "decoy"), target_(&target_buf_), decoy_(&decoy_buf_) {
+}
+
+ClusterWorker::~ClusterWorker() {
+#if CLUSTER_SOCKETS
+  if (socket_ >= 0) {
+    close(socket_);
+  }
+#endif
+}
+
+bool ClusterWorker::Connect(const string& address) {
+#if CLUSTER_SOCKETS
+  size_t colon = address.rfind(':');
+  if (colon == string::npos || colon == 0) {
+    carp(CARP_ERROR, "The coordinator '%s' is not of the form host:port", address.c_str());
+    return false;
+  }
+  string host = address.substr(0, colon);
+  string port = address.substr(colon + 1);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  for (int attempt = 0; socket_ < 0 && attempt < kConnectSeconds; ++attempt) {
+    if (attempt > 0) {
+      sleep(1);
+    }
+    struct addrinfo* addresses;
+    int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (error != 0) {
+      carp(CARP_ERROR, "Cannot resolve %s: %s", host.c_str(), gai_strerror(error));
+      return false;
+    }
+    for (struct addrinfo* a = addresses; a != NULL && socket_ < 0; a = a->ai_next) {
+      int s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (s >= 0 && connect(s, a->ai_addr, a->ai_addrlen) == 0) {
+        socket_ = s;
+      } else if (s >= 0) {
+        close(s);
+      }
+    }
+    freeaddrinfo(addresses);
+  }
+  if (socket_ < 0) {
+    carp(CARP_ERROR, "Cannot connect to the coordinator at %s", address.c_str());
+    return false;
+  }
+  int on = 1;
+  setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  NoSigPipe(socket_);
+  string line;
+  vector<string> fields;
+  if (!WriteAll(socket_, Hello() + '\n') || !ReadLine(socket_, &line)) {
+    carp(CARP_ERROR, "Lost the coordinator at %s", address.c_str());
+    return false;
+  } else if (line.compare(0, 8, "refused ") == 0) {
+    carp(CARP_ERROR, "The coordinator at %s refused this worker: %s", address.c_str(),
+         line.c_str() + 8);
+    return false;
+  } else if ((fields = StringUtils::Split(line, ' ')).size() != 3 || fields[0] != "slice" ||
+             !StringUtils::TryFromString(fields[1], &slice_) ||
+             !StringUtils::TryFromString(fields[2], &num_slices_) ||
+             slice_ < 0 || slice_ >= num_slices_) {
+    carp(CARP_ERROR, "The coordinator at %s did not give a slice", address.c_str());
+    return false;
+  }
+  carp(CARP_INFO, "Searching slice %d of %d for the coordinator at %s.",
+       slice_ + 1, num_slices_, address.c_str());
+  return true;
+#else
+  carp(CARP_ERROR, "A search over several machines is not available on this platform.");
+  return false;
+#endif
+}
+
+bool ClusterWorker::SendPart(const char* kind, const char* data, size_t size) {
+#if CLUSTER_SOCKETS
+  boost::mutex::scoped_lock lock(send_mutex_);
+  return WriteAll(socket_, string(kind) + ' ' +
+                  StringUtils::ToString((unsigned long)size) + '\n') &&
+    WriteAll(socket_, data, size);
+#else
+  return false;
+#endif
+}
+
+bool ClusterWorker::EndChunk() {
+  target_.flush();
+  decoy_.flush();
+  if (!target_buf_.ok() || !decoy_buf_.ok()) {
+    return false;
+  }
+#if CLUSTER_SOCKETS
+  boost::mutex::scoped_lock lock(send_mutex_);
+  return WriteAll(socket_, "end\n");
+#else
+  return false;
+#endif
+}
+
+ClusterWorker::PartBuf::PartBuf(ClusterWorker* worker, const char* kind)
+  : worker_(worker), kind_(kind), ok_(true) {
+  setp(buffer_, buffer_ + sizeof(buffer_));
+}
+
+int ClusterWorker::PartBuf::overflow(int c) {
+  if (sync() != 0) {
+    return traits_type::eof();
+  } else if (c != traits_type::eof()) {
+    *pptr() = (char)c;
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+// The results a search hands over come here in large writes; they are sent
+// at once, after anything already buffered.
+streamsize ClusterWorker::PartBuf::xsputn(const char* data, streamsize size) {
+  if (size < (streamsize)sizeof(buffer_) / 2) {
+    return streambuf::xsputn(data, size);
+  }
+  return sync() == 0 && Send(data, (size_t)size) ? size : 0;
+}
+
+int ClusterWorker::PartBuf::sync() {
+  size_t size = pptr() - pbase();
+  setp(buffer_, buffer_ + sizeof(buffer_));
+  return Send(buffer_, size) ? 0 : -1;
+}
+
+bool ClusterWorker::PartBuf::Send(const char* data, size_t size) {
+  if (size > 0 && ok_) {
+    ok_ = worker_->SendPart(kind_, data, size);
+  }
+  return ok_;
+}
+
+void ClusterWorker::Finish(bool ok) {
+#if CLUSTER_SOCKETS
+  WriteAll(socket_, ok ? "done\n" : "failed\n");
+#endif
+}
@@ -0,0 +1,144 @@
+// A tide-search spread over several machines (see tide-search's
+// coordinator-port and coordinator options), talking plain TCP.
+//
+// The coordinator listens for num-workers workers and gives each, in the
+// order they connect, one slice of every spectrum file: slice i of n is the
+// i-th of n runs of equal numbers of spectrum-charge pairs, in the mass
+// order in which they are searched. A worker therefore reads only the part
+// of the index that its masses need, and of a sharded index only the shards
+// that cover them. Each worker searches its slice of each file in turn and
+// sends the results, as text, one chunk per file; the coordinator writes
+// chunk k of slice 0, then of slice 1, and so on, then chunk k + 1, which is
+// the order a search on one machine would have written them in.
+//
+// A chunk is sent in parts, as the worker's results are written, rather
+// than once its file is searched. The coordinator writes the parts of the
+// slice whose turn it is as they come, and keeps those of the other slices
+// until their turn, up to a backlog per worker; past that it stops reading
+// from the worker, which then waits to send, and its search threads wait
+// for room for their results.
+//
+// Worker to coordinator:  "hello tide-cluster <protocol> <crux version>\n"
+// Coordinator to worker:  "slice <i> <n>\n", or "refused <reason>\n"
+// Worker to coordinator:  for each file, any number of "target <bytes>\n" or
+//                         "decoy <bytes>\n" and the bytes, then "end\n";
+//                         then "done\n", or "failed\n".
+//
+// A connection that does not say hello in time, or with another protocol or
+// version of crux, is refused and does not take a slice. There is no
+// authentication: anyone who can reach the port can take a slice, so listen
+// on a trusted network (see coordinator-address).
+
+#ifndef SEARCH_CLUSTER_H
+#define SEARCH_CLUSTER_H
+
+#include <deque>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// Part of a chunk: the next bytes of its target or its decoy results.
+struct ClusterPart {
+  string target;
+  string decoy;
+  bool first;  // the first part of its chunk
+};
+
+class ClusterCoordinator {
+ public:
+  ClusterCoordinator();
+  ~ClusterCoordinator();
+
+  // Listen on port, on the interface of address or on all of them if it is
+  // empty, until num_workers workers have connected, and give each its
+  // slice. Each worker may have backlog_bytes of results waiting for their
+  // turn. Returns false if the port cannot be listened on.
+  bool Start(const string& address, int port, int num_workers,
+             size_t backlog_bytes);
+
+  // The next part, in order, waiting for it if need be. Returns false once
+  // every worker has finished and all their parts have been returned. A
+  // worker that fails, or sends fewer chunks than the others, is fatal.
+  bool Next(ClusterPart* part);
+
+ private:
+  struct Worker {
+    int socket;
+    size_t chunks;  // ended so far
+    bool done;
+    bool failed;
+    deque<ClusterPart> parts;  // received, not yet returned; empty ones end a chunk
+    size_t backlog;  // bytes in parts
+  };
+
+  void Receive(size_t slice);
+
+  int listener_;
+  size_t backlog_bytes_;
+  vector<Worker> workers_;
+  boost::thread_group receivers_;
+  boost::mutex mutex_;
+  boost::condition_variable changed_;
+  size_t next_chunk_;
+  size_t next_slice_;
+  bool started_chunk_;  // a part of the next chunk of next_slice_ was returned
+};
+
+class ClusterWorker {
+ public:
+  ClusterWorker();
+  ~ClusterWorker();
+
+  // Connect to the coordinator at host:port, retrying for a while if it is
+  // not yet listening, and read this worker's slice.
+  bool Connect(const string& address);
+
+  int Slice() const { return slice_; }
+  int NumSlices() const { return num_slices_; }
+
+  // Streams for the results of the spectrum file being searched. What is
+  // written to them is sent as it is written, in parts of its chunk.
+  ostream* Target() { return &target_; }
+  ostream* Decoy() { return &decoy_; }
+
+  // Send what is left of the results of the file, and end its chunk.
+  bool EndChunk();
+
+  // Tell the coordinator whether all the files were searched.
+  void Finish(bool ok);
+
+ private:
+  // Sends what is written to it as parts of kind "target" or "decoy".
+  class PartBuf : public streambuf {
+   public:
+    PartBuf(ClusterWorker* worker, const char* kind);
+    bool ok() const { return ok_; }
+   protected:
+    virtual int overflow(int c);
+    virtual streamsize xsputn(const char* data, streamsize size);
+    virtual int sync();
+   private:
+    bool Send(const char* data, size_t size);
+    ClusterWorker* worker_;
+    const char* kind_;
+    char buffer_[1 << 16];  // for the small writes, as of the headers
+    bool ok_;
+  };
+
+  bool SendPart(const char* kind, const char* data, size_t size);
+
+  int socket_;
+  int slice_;
+  int num_slices_;
+  boost::mutex send_mutex_;  // one part at a time on the socket
+  PartBuf target_buf_;
+  PartBuf decoy_buf_;
+  ostream target_;
+  ostream decoy_;
+};
+
+#endif // SEARCH_CLUSTER_H
@@ -0,0 +1,70 @@
+// An index built with tide-index --search-time-mods holds each peptide once,
+// unmodified, and a header with the variable modifications that tide-index
+// would otherwise have applied (see peptide_mods3.cc). SearchTimeMods expands
+// the peptides read from such an index into their modified forms during the
+// search, exactly as tide-index would, and hands them out in mass order.
+//
+// Modified forms are held until no later peptide of the index can have a
+// lighter one. The peptides of the index come in mass order, so a modified
+// form is safe to hand out once it is no heavier than the last peptide read
+// plus the most negative total modification delta.
+
+#ifndef SEARCH_MODS_H
+#define SEARCH_MODS_H
+
+#include <utility>
+#include <vector>
+#include "header.pb.h"
+#include "peptides.pb.h"
+#include "raw_proteins.pb.h"
+#include "modifications.h"
+
+using namespace std;
+
+class ModsOutputter;
+
+class SearchTimeMods {
+ public:
+  // header is that of the index, with the modifications, max_mods and
+  // min_mods with which to expand its peptides. proteins must outlive this
+  // object.
+  SearchTimeMods(const pb::Header::PeptidesHeader& header,
+                 const vector<const pb::Protein*>& proteins);
+  ~SearchTimeMods();
+
+  // The message to read the next peptide of the index into before Add().
+  pb::Peptide* Base() { return &base_; }
+
+  // Expand Base() and hold its modified forms.
+  void Add();
+
+  // Whether the lightest modified form held is known to come before those of
+  // every peptide of the index after Base().
+  bool Ready() const;
+
+  bool Empty() const { return held_.empty(); }
+
+  // Move the lightest modified form held into peptide.
+  void Pop(pb::Peptide* peptide);
+
+  // Bounds on the total mass that modifications add to a peptide, so that a
+  // reader can skip to the peptides that may have modified forms of a mass.
+  double MinDelta() const { return min_delta_; }
+  double MaxDelta() const { return max_delta_; }
+
+ private:
+  static bool Heavier(const pb::Peptide* x, const pb::Peptide* y) {
+    return x->mass() > y->mass();
+  }
+
+  VariableModTable table_;
+  ModsOutputter* outputter_;
+  pb::Peptide base_;
+  double last_base_mass_;
+  double min_delta_, max_delta_;
+  vector< pair<int, pb::Peptide> > expanded_;
+  vector<pb::Peptide*> held_;  // min-heap by mass
+  vector<pb::Peptide*> free_;  // popped messages, reused by Add()
+};
+
+#endif // SEARCH_MODS_H
@@ -37,12 +37,36 @@ bool SpScorer::IonLookup(double mass, int charge, bool previous_ion_matched,
 
 void SpScorer::Score(const pb::Peptide& pb_peptide, SpScoreData& sp_score_data) {
   Peptide peptide(pb_peptide, proteins_);
-  vector<double> m_z(peptide.Len());
-  string sequence = peptide.Seq();
+  Score(peptide, sp_score_data);
+}
+
+void SpScorer::Score(const vector<const Peptide*>& peptides,
+                     vector<SpScoreData>* scores) {
+  scores->assign(peptides.size(), SpScoreData());
+  for (size_t i = 0; i < peptides.size(); i++)
+    Score(*peptides[i], (*scores)[i]);
+}
+
+bool SpScorer::BinLookup(int bin, bool previous_ion_matched,
+                         SpScoreData& sp_score_data) {
+  double intensity = bin < (int)max_mz_ ? sp_spectrum_.Intensity(bin) : 0.0;
+  if (intensity <= 0)
+    return false;
+  sp_score_data.matched_ions++;
+  sp_score_data.intensity_sum += intensity;
+  if (previous_ion_matched)
+    sp_score_data.repeat_count++;
+  return true;
+}
+
+void SpScorer::Score(const Peptide& peptide, SpScoreData& sp_score_data) {
+  int len = peptide.Len();
+  const char* residues = peptide.Residues();
+  m_z_.resize(len);
 
   // Collect m/z values for each residue
-  for (int i = 0; i < sequence.length(); i++)
-    m_z[i] = MassConstants::mono_table[sequence[i]];
+  for (int i = 0; i < len; i++)
+    m_z_[i] = MassConstants::mono_table[residues[i]];
 
   // Account for modifications
   const ModCoder::Mod* mods;
@@ -51,35 +75,40 @@ void SpScorer::Score(const pb::Peptide& pb_peptide, SpScoreData& sp_score_data)
     int index;
     double delta;
     MassConstants::DecodeMod(mods[i], &index, &delta);
-    m_z[index] += delta;
+    m_z_[index] += delta;
+  }
+
+  if (len < 2) {
+    sp_score_data.CalculateSpScore(sp_spectrum_.Beta());
+    return;
   }
 
+  // The bins of all b ions and of all y ions are computed first, then looked
+  // up in the spectrum in the order of the ion-by-ion loop this replaced
+  // (b1, b2 y1, b3 y2, ...), so that the intensities add up the same.
+  int num_ions = len - 1;
   int precursor_charge = (charge_ == 1) ? 2 : charge_;
+  ion_bins_.resize(2 * num_ions);
+  int* b_bins = &ion_bins_[0];
+  int* y_bins = &ion_bins_[num_ions];
   for (int ion_charge = 1; ion_charge < precursor_charge; ion_charge++) {
-    // Needed for keeping track of repeat_count
-    bool previous_b_ion_matched = false;
-    bool previous_y_ion_matched = false;
-
     double b_ion = MASS_PROTON;
     double y_ion = peptide.Mass() + MASS_PROTON;
-
-    for (int i = 0; i < sequence.length(); i++) {
-      // Calculate and look up b-ions
-      if (i < sequence.length()-1) {
-        b_ion += m_z[i];
-        previous_b_ion_matched = IonLookup(b_ion, ion_charge,
-                                           previous_b_ion_matched,
-                                           sp_score_data);
-      }
-
-      // Calculate and look up y-ions
-      if (i > 0) {
-        y_ion -= m_z[i-1];
-        previous_y_ion_matched = IonLookup(y_ion, ion_charge,
-                                           previous_y_ion_matched,
-                                           sp_score_data);
-      }
+    for (int i = 0; i < num_ions; i++) {
+      b_ion += m_z_[i];
+      y_ion -= m_z_[i];
+      b_bins[i] = GetBin(b_ion, ion_charge);
+      y_bins[i] = GetBin(y_ion, ion_charge);
+    }
+    // Needed for keeping track of repeat_count
+    bool previous_b_ion_matched = BinLookup(b_bins[0], false, sp_score_data);
+    bool previous_y_ion_matched = false;
+    for (int i = 1; i < num_ions; i++) {
+      previous_b_ion_matched = BinLookup(b_bins[i], previous_b_ion_matched, sp_score_data);
+      previous_y_ion_matched = BinLookup(y_bins[i - 1], previous_y_ion_matched, sp_score_data);
     }
+    BinLookup(y_bins[num_ions - 1], previous_y_ion_matched, sp_score_data);
+    sp_score_data.total_ions += 2 * num_ions;
   }
 
   sp_score_data.CalculateSpScore(sp_spectrum_.Beta());
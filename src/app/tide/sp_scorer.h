@@ -41,6 +41,8 @@
 typedef vector<const pb::Protein*> ProteinVec;
 typedef vector<const pb::AuxLocation*> AuxLocVec;
 
+class Peptide;
+
 
 class SpScorer {
  public:
@@ -74,6 +76,13 @@ class SpScorer {
            int charge, double max_mz);
 
   void Score(const pb::Peptide& pb_peptide, SpScoreData& sp_score_data);
+  // As above, but straight from a search-time Peptide, which for a decoy made
+  // at search time has the decoy's residues rather than its target's.
+  void Score(const Peptide& peptide, SpScoreData& sp_score_data);
+  // Score each of a spectrum's reported peptides into (*scores)[i], reusing
+  // the ion workspace from one peptide to the next.
+  void Score(const vector<const Peptide*>& peptides,
+             vector<SpScoreData>* scores);
   void RankSpScores(vector<SpScoreData>& scores, 
                     double* smallest_score = NULL);
   double TotalIonIntensity() {return sp_spectrum_.TotalIonIntensity();}
@@ -96,6 +105,13 @@ class SpScorer {
   bool IonLookup(double mass, int charge, bool previous_ion_matched,
                  SpScoreData& sp_score_data);
 
+  // IonLookup() for an ion whose bin is known, without counting it.
+  bool BinLookup(int bin, bool previous_ion_matched, SpScoreData& sp_score_data);
+
+  // Residue masses with their modifications, and the bins of the b and y
+  // ions of the peptide being scored, kept between calls.
+  vector<double> m_z_;
+  vector<int> ion_bins_;
   
   const ProteinVec& proteins_;
   const Spectrum& spectrum_;
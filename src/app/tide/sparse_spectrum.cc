@@ -0,0 +1,81 @@
+// Sparse, binned spectra; see sparse_spectrum.h.
+
+#include <algorithm>
+#include <math.h>
+#include "sparse_spectrum.h"
+
+using google::protobuf::uint64;
+
+namespace {
+
+// Signature bits by which two spectra may differ beyond the expected number
+// for the threshold, about three standard deviations of the estimate.
+const int kSimHashSlack = 12;
+
+uint64 MixBin(uint64 x) {
+  // splitmix64's finalizer
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+}  // namespace
+
+void SparseSpectrum::Normalize(Peaks* peaks) {
+  double norm = 0;
+  for (Peaks::const_iterator i = peaks->begin(); i != peaks->end(); ++i) {
+    norm += i->second * i->second;
+  }
+  if (norm > 0) {
+    norm = 1 / sqrt(norm);
+    for (Peaks::iterator i = peaks->begin(); i != peaks->end(); ++i) {
+      i->second *= norm;
+    }
+  }
+}
+
+uint64 SparseSpectrum::SimHash(const Peaks& peaks) {
+  double sums[64] = { 0 };
+  for (Peaks::const_iterator i = peaks.begin(); i != peaks.end(); ++i) {
+    uint64 h = MixBin(i->first);
+    for (int b = 0; b < 64; ++b) {
+      sums[b] += ((h >> b) & 1) ? i->second : -i->second;
+    }
+  }
+  uint64 signature = 0;
+  for (int b = 0; b < 64; ++b) {
+    if (sums[b] > 0) {
+      signature |= 1ULL << b;
+    }
+  }
+  return signature;
+}
+
+double SparseSpectrum::Dot(const Peaks& x, const Peaks& y) {
+  double dot = 0;
+  Peaks::const_iterator i = x.begin(), j = y.begin();
+  while (i != x.end() && j != y.end()) {
+    if (i->first < j->first) {
+      ++i;
+    } else if (j->first < i->first) {
+      ++j;
+    } else {
+      dot += (i++)->second * (j++)->second;
+    }
+  }
+  return dot;
+}
+
+int SparseSpectrum::MaxSimHashDistance(double min_cosine) {
+  return (int) ceil(64 * acos(max(-1.0, min(1.0, min_cosine))) / acos(-1.0)) +
+         kSimHashSlack;
+}
+
+int SparseSpectrum::SimHashDistance(uint64 x, uint64 y) {
+  int n = 0;
+  for (x ^= y; x != 0; x &= x - 1) {
+    ++n;
+  }
+  return n;
+}
@@ -0,0 +1,38 @@
+// Spectra as sparse vectors of intensities by m/z bin, of unit length, for
+// comparing spectra with one another rather than with peptides: by the
+// cosine between them, their dot product, and by a 64-bit SimHash of each
+// that rules out most dissimilar pairs before the dot product is computed.
+// The fraction of signature bits on which two spectra differ estimates the
+// angle between them over pi. Shared by spectrum clustering (see
+// spectrum_clusters.h) and the spectral library (see spectral_library.h).
+
+#ifndef SPARSE_SPECTRUM_H
+#define SPARSE_SPECTRUM_H
+
+#include <utility>
+#include <vector>
+#include <google/protobuf/stubs/common.h>
+
+using namespace std;
+
+class SparseSpectrum {
+ public:
+  typedef vector<pair<int, double> > Peaks;  // (bin, intensity), by bin
+
+  // Scale peaks to unit length, unless they are all zero.
+  static void Normalize(Peaks* peaks);
+
+  static google::protobuf::uint64 SimHash(const Peaks& peaks);
+
+  // The cosine between x and y, both of unit length.
+  static double Dot(const Peaks& x, const Peaks& y);
+
+  // The most signature bits by which two spectra at a cosine of min_cosine
+  // are expected to differ, with some slack for the error of the estimate.
+  static int MaxSimHashDistance(double min_cosine);
+
+  static int SimHashDistance(google::protobuf::uint64 x,
+                             google::protobuf::uint64 y);
+};
+
+#endif // SPARSE_SPECTRUM_H
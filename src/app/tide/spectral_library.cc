@@ -0,0 +1,235 @@
+// Spectral libraries on disk; see spectral_library.h.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "spectral_library.h"
+#include "mass_constants.h"
+#include "io/carp.h"
+
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+
+static const size_t kLibraryHeaderSize = 24;
+
+namespace {
+
+struct ByIndex {
+  template<typename T>
+  bool operator()(const T& x, const T& y) const { return x.index < y.index; }
+};
+
+}  // namespace
+
+SpectralLibrary::SpectralLibrary(const string& file)
+  : file_(file), map_(NULL), map_size_(0), index_(NULL), size_(0), peaks_(NULL), sequences_(NULL) {
+  if (Map()) {
+    carp(CARP_INFO, "Read a spectral library of %d spectra from %s.", (int) size_,
+         file_.c_str());
+  }
+}
+
+SpectralLibrary::~SpectralLibrary() {
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+  }
+}
+
+bool SpectralLibrary::Map() {
+  struct stat st;
+  if (stat(file_.c_str(), &st) != 0 || (uint64) st.st_size < kLibraryHeaderSize) {
+    return false;
+  }
+  uint64 file_size = st.st_size;
+  int fd = open(file_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  void* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  const uint32* words = (const uint32*) data;
+  double bins[2];
+  memcpy(bins, words + 2, sizeof(bins));
+  uint64 n = words[1];
+  uint64 index_end = kLibraryHeaderSize + n * sizeof(IndexEntry);
+  bool ok = words[0] == SPECTRAL_LIBRARY_MAGIC_NUMBER && file_size >= index_end;
+  if (ok && (bins[0] != MassConstants::bin_width_ || bins[1] != MassConstants::bin_offset_)) {
+    carp(CARP_WARNING, "%s was binned with mz-bin-width %g and mz-bin-offset %g; "
+         "starting a new library.", file_.c_str(), bins[0], bins[1]);
+    munmap(data, file_size);
+    return false;
+  }
+  const IndexEntry* index = (const IndexEntry*) ((const char*) data + kLibraryHeaderSize);
+  uint64 peaks_end = index_end;
+  if (ok && n > 0) {
+    // The peaks and sequences are in the order of the index, so the last
+    // entry ends both and a truncated library is caught.
+    const IndexEntry& last = index[n - 1];
+    peaks_end += (last.peak_offset + last.num_peaks) * sizeof(Peak);
+    ok = file_size == peaks_end + last.sequence_offset + last.sequence_size;
+  }
+  if (!ok) {
+    carp(CARP_WARNING, "%s is not a spectral library; starting a new one.",
+         file_.c_str());
+    munmap(data, file_size);
+    return false;
+  }
+  map_ = data;
+  map_size_ = file_size;
+  index_ = index;
+  size_ = n;
+  peaks_ = (const Peak*) ((const char*) data + index_end);
+  sequences_ = (const char*) data + peaks_end;
+  return true;
+}
+
+double SpectralLibrary::Dot(const SparseSpectrum::Peaks& x, const Peak* y, int size) {
+  double dot = 0;
+  SparseSpectrum::Peaks::const_iterator i = x.begin();
+  const Peak* j = y;
+  const Peak* end = y + size;
+  while (i != x.end() && j != end) {
+    if (i->first < j->bin) {
+      ++i;
+    } else if (j->bin < i->first) {
+      ++j;
+    } else {
+      dot += (i++)->second * (j++)->intensity;
+    }
+  }
+  return dot;
+}
+
+bool SpectralLibrary::Find(const SparseSpectrum::Peaks& peaks, double neutral_mass,
+                           int charge, double tolerance_ppm, double min_cosine,
+                           Match* match) const {
+  if (!Mapped() || peaks.empty()) {
+    return false;
+  }
+  double tolerance = neutral_mass * tolerance_ppm * 1e-6;
+  IndexEntry key;
+  key.charge = charge;
+  key.neutral_mass = neutral_mass - tolerance;
+  const uint64 signature = SparseSpectrum::SimHash(peaks);
+  const int max_bits = SparseSpectrum::MaxSimHashDistance(min_cosine);
+  const IndexEntry* best = NULL;
+  double best_cosine = min_cosine;
+  for (const IndexEntry* i = lower_bound(index_, index_ + size_, key);
+       i != index_ + size_ && i->charge == charge &&
+       i->neutral_mass <= neutral_mass + tolerance; ++i) {
+    if (SparseSpectrum::SimHashDistance(signature, i->simhash) > max_bits) {
+      continue;
+    }
+    double cosine = Dot(peaks, peaks_ + i->peak_offset, i->num_peaks);
+    if (cosine >= best_cosine) {
+      best = i;
+      best_cosine = cosine;
+    }
+  }
+  if (best == NULL) {
+    return false;
+  }
+  match->sequence.assign(sequences_ + best->sequence_offset, best->sequence_size);
+  match->neutral_mass = best->neutral_mass;
+  match->cosine = best_cosine;
+  return true;
+}
+
+void SpectralLibrary::Add(const SparseSpectrum::Peaks& peaks, double neutral_mass,
+                          int charge, const string& sequence) {
+  Entry entry;
+  entry.index.neutral_mass = neutral_mass;
+  entry.index.charge = charge;
+  entry.index.num_peaks = peaks.size();
+  entry.index.simhash = SparseSpectrum::SimHash(peaks);
+  entry.index.sequence_size = sequence.size();
+  entry.index.unused = 0;
+  for (SparseSpectrum::Peaks::const_iterator i = peaks.begin(); i != peaks.end(); ++i) {
+    Peak peak;
+    peak.bin = i->first;
+    peak.intensity = i->second;
+    entry.peaks.push_back(peak);
+  }
+  entry.sequence = sequence;
+  added_.push_back(entry);
+}
+
+bool SpectralLibrary::Write() {
+  vector<Entry> entries;
+  set<pair<string, int> > kept;
+  for (vector<Entry>::const_iterator i = added_.begin(); i != added_.end(); ++i) {
+    if (kept.insert(make_pair(i->sequence, i->index.charge)).second) {
+      entries.push_back(*i);
+    }
+  }
+  vector<Entry>().swap(added_);
+  int num_added = entries.size();
+  for (size_t i = 0; i < size_; ++i) {
+    Entry entry;
+    entry.index = index_[i];
+    entry.sequence.assign(sequences_ + index_[i].sequence_offset, index_[i].sequence_size);
+    if (kept.count(make_pair(entry.sequence, entry.index.charge)) > 0) {
+      continue;
+    }
+    const Peak* peaks = peaks_ + index_[i].peak_offset;
+    entry.peaks.assign(peaks, peaks + index_[i].num_peaks);
+    entries.push_back(entry);
+  }
+  stable_sort(entries.begin(), entries.end(), ByIndex());
+  uint64 peak_offset = 0, sequence_offset = 0;
+  for (vector<Entry>::iterator i = entries.begin(); i != entries.end(); ++i) {
+    i->index.peak_offset = peak_offset;
+    i->index.sequence_offset = sequence_offset;
+    peak_offset += i->peaks.size();
+    sequence_offset += i->sequence.size();
+  }
+
+  // The new library may replace the mapped one, which is no longer needed.
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+    map_ = NULL;
+    size_ = 0;
+  }
+  // Written under another name and then renamed, so that a search running
+  // at the same time never maps half a library.
+  string tmp_file = file_ + ".tmp";
+  ofstream out(tmp_file.c_str(), ios::out | ios::binary | ios::trunc);
+  uint32 header[6] = { SPECTRAL_LIBRARY_MAGIC_NUMBER, (uint32) entries.size() };
+  double bins[2] = { MassConstants::bin_width_, MassConstants::bin_offset_ };
+  memcpy(header + 2, bins, sizeof(bins));
+  out.write((const char*) header, sizeof(header));
+  for (vector<Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+    out.write((const char*) &i->index, sizeof(IndexEntry));
+  }
+  for (vector<Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+    if (!i->peaks.empty()) {
+      out.write((const char*) &i->peaks[0], i->peaks.size() * sizeof(Peak));
+    }
+  }
+  for (vector<Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+    out.write(i->sequence.data(), i->sequence.size());
+  }
+  out.close();
+  if (!out || rename(tmp_file.c_str(), file_.c_str()) != 0) {
+    remove(tmp_file.c_str());
+    return false;
+  }
+  carp(CARP_INFO, "Wrote a spectral library of %d spectra, %d of them new, to %s.",
+       (int) entries.size(), num_added, file_.c_str());
+  return true;
+}
@@ -0,0 +1,113 @@
+// A spectral library on disk (see tide-library-search): preprocessed
+// spectra of confidently identified peptides, each its PeakMain bins as a
+// unit vector (see sparse_spectrum.h), to match new spectra against in
+// place of a database search.
+//
+// The entries are sorted by charge and neutral mass, which partitions them
+// into the windows that a query has to look at. Within its window, the
+// SimHash of each entry, kept beside it, rules out most entries by a
+// comparison of 64 bits, and the cosine is computed only for the rest: an
+// approximate nearest-neighbour search, which may miss a match at just the
+// threshold but finds those well above it. A library is
+//
+//     SPECTRAL_LIBRARY_MAGIC_NUMBER, the number n of entries (uint32s)
+//     the mz-bin-width and mz-bin-offset it was binned with (doubles)
+//     n IndexEntries, sorted by charge and neutral mass
+//     the peaks of the entries, in the order of the index
+//     the sequences of the entries, in the same order
+//
+// all in the byte order of the machine that wrote the file.
+
+#ifndef SPECTRAL_LIBRARY_H
+#define SPECTRAL_LIBRARY_H
+
+#include <string>
+#include <vector>
+#include <google/protobuf/stubs/common.h>
+#include "sparse_spectrum.h"
+
+using namespace std;
+
+#define SPECTRAL_LIBRARY_MAGIC_NUMBER  0xfead1239ul
+
+class SpectralLibrary {
+ public:
+  struct Match {
+    string sequence;
+    double neutral_mass;
+    double cosine;
+  };
+
+  // The library in file, if there is one and it was binned with the bins
+  // of MassConstants, mapped to be looked up; the one written by Write()
+  // replaces it.
+  explicit SpectralLibrary(const string& file);
+  ~SpectralLibrary();
+
+  bool Mapped() const { return map_ != NULL; }
+  size_t Size() const { return size_; }
+
+  // The entry of charge within tolerance_ppm of neutral_mass whose cosine
+  // with peaks, of unit length, is the highest at or above min_cosine.
+  // Returns false if there is none.
+  bool Find(const SparseSpectrum::Peaks& peaks, double neutral_mass, int charge,
+            double tolerance_ppm, double min_cosine, Match* match) const;
+
+  // Add an entry for the library that Write() writes. It replaces an entry
+  // of the same sequence and charge in the mapped library; of several added
+  // for a sequence and charge, the first is kept.
+  void Add(const SparseSpectrum::Peaks& peaks, double neutral_mass, int charge,
+           const string& sequence);
+
+  // Write the mapped entries, with those added, to the file. Returns false
+  // on an error.
+  bool Write();
+
+ private:
+  struct IndexEntry {
+    double neutral_mass;
+    int charge;
+    google::protobuf::uint32 num_peaks;
+    google::protobuf::uint64 simhash;
+    google::protobuf::uint64 peak_offset;      // in peaks, from the first
+    google::protobuf::uint64 sequence_offset;  // in bytes, from the first
+    google::protobuf::uint32 sequence_size;
+    google::protobuf::uint32 unused;
+
+    bool operator<(const IndexEntry& other) const {
+      if (charge != other.charge)
+        return charge < other.charge;
+      return neutral_mass < other.neutral_mass;
+    }
+  };
+
+  struct Peak {
+    int bin;
+    float intensity;
+  };
+
+  struct Entry {
+    IndexEntry index;
+    vector<Peak> peaks;
+    string sequence;
+  };
+
+  bool Map();
+
+  static double Dot(const SparseSpectrum::Peaks& x, const Peak* y, int size);
+
+  string file_;
+
+  // The library mapped
+  void* map_;
+  size_t map_size_;
+  const IndexEntry* index_;
+  size_t size_;
+  const Peak* peaks_;
+  const char* sequences_;
+
+  // The entries added
+  vector<Entry> added_;
+};
+
+#endif // SPECTRAL_LIBRARY_H
@@ -0,0 +1,100 @@
+// Clusters of near-identical spectra; see spectrum_clusters.h.
+
+#include <algorithm>
+#include <math.h>
+#include "spectrum_clusters.h"
+#include "mass_constants.h"
+
+using google::protobuf::uint64;
+
+namespace {
+
+struct ByMass {
+  explicit ByMass(const vector<SpectrumCollection::SpecCharge>& spec_charges)
+    : spec_charges_(&spec_charges) {}
+  bool operator()(int x, int y) const {
+    return (*spec_charges_)[x].neutral_mass < (*spec_charges_)[y].neutral_mass;
+  }
+  const vector<SpectrumCollection::SpecCharge>* spec_charges_;
+};
+
+}  // namespace
+
+SpectrumClusters::SpectrumClusters(
+  const vector<SpectrumCollection::SpecCharge>& spec_charges,
+  const vector<bool>& searched, int first, int chunk_size, double min_cosine,
+  double tolerance_ppm)
+  : rep_(spec_charges.size()), next_(spec_charges.size(), -1), num_members_(0) {
+  for (size_t i = 0; i < rep_.size(); ++i) {
+    rep_[i] = i;
+  }
+  const int max_bits = SparseSpectrum::MaxSimHashDistance(min_cosine);
+  const int n = spec_charges.size();
+  vector<int> order;
+  vector<SparseSpectrum::Peaks> peaks;
+  vector<uint64> signatures;
+  vector<int> reps, last;
+  for (int begin = max(first, 0); begin < n; begin += chunk_size) {
+    int end = min(begin + chunk_size, n);
+    order.clear();
+    for (int i = begin; i < end; ++i) {
+      if (searched[i]) {
+        order.push_back(i);
+      }
+    }
+    sort(order.begin(), order.end(), ByMass(spec_charges));
+    peaks.resize(order.size());
+    signatures.resize(order.size());
+    for (size_t j = 0; j < order.size(); ++j) {
+      Bin(*spec_charges[order[j]].spectrum, &peaks[j]);
+      signatures[j] = SparseSpectrum::SimHash(peaks[j]);
+    }
+
+    // Each pair joins the first representative before it, lightest last,
+    // that it is close enough to; otherwise it represents a cluster of its
+    // own.
+    reps.clear();
+    last.clear();
+    for (size_t j = 0; j < order.size(); ++j) {
+      const SpectrumCollection::SpecCharge& sc = spec_charges[order[j]];
+      double tolerance = sc.neutral_mass * tolerance_ppm * 1e-6;
+      int joined = -1;
+      for (int r = (int) reps.size() - 1; r >= 0 && joined < 0; --r) {
+        int k = reps[r];
+        const SpectrumCollection::SpecCharge& rep = spec_charges[order[k]];
+        if (rep.neutral_mass < sc.neutral_mass - tolerance) {
+          break;
+        }
+        if (rep.charge == sc.charge &&
+            SparseSpectrum::SimHashDistance(signatures[j], signatures[k]) <= max_bits &&
+            SparseSpectrum::Dot(peaks[j], peaks[k]) >= min_cosine) {
+          joined = r;
+        }
+      }
+      if (joined < 0) {
+        reps.push_back(j);
+        last.push_back(order[j]);
+        continue;
+      }
+      rep_[order[j]] = order[reps[joined]];
+      next_[last[joined]] = order[j];
+      last[joined] = order[j];
+      ++num_members_;
+    }
+  }
+}
+
+void SpectrumClusters::Bin(const Spectrum& spectrum, SparseSpectrum::Peaks* peaks) {
+  peaks->clear();
+  // The peaks are in m/z order, so the bins are too.
+  for (int i = 0; i < spectrum.Size(); ++i) {
+    int bin = MassConstants::mass2bin(spectrum.M_Z(i));
+    double intensity = sqrt(max(spectrum.Intensity(i), 0.0));
+    if (!peaks->empty() && peaks->back().first == bin) {
+      peaks->back().second += intensity;
+    } else {
+      peaks->push_back(make_pair(bin, intensity));
+    }
+  }
+  SparseSpectrum::Normalize(peaks);
+}
@@ -0,0 +1,53 @@
+// Clusters of near-identical spectra among the spectrum-charge pairs of a
+// search (see tide-search's cluster-spectra option), as replicate runs and
+// neighbouring fractions give many of the same precursor. Each cluster has a
+// representative, which is searched against its whole candidate window; the
+// other members are scored only against the best candidates of the
+// representative that fall in their own windows, and reported right after
+// it.
+//
+// Pairs join a cluster if they have the same charge, neutral masses within
+// a tolerance of the representative's and a cosine at or above a threshold
+// between the square roots of their intensities, binned by m/z as for
+// scoring (see sparse_spectrum.h), whose SimHashes rule out most pairs
+// before their cosine is computed.
+//
+// Each cluster lies within one chunk of the search (see
+// spectrum-chunk-size), since the members are scored by the thread that
+// scores the representative, with the peptides of its window.
+
+#ifndef SPECTRUM_CLUSTERS_H
+#define SPECTRUM_CLUSTERS_H
+
+#include <vector>
+#include "sparse_spectrum.h"
+#include "spectrum_collection.h"
+
+using namespace std;
+
+class SpectrumClusters {
+ public:
+  // Cluster those of spec_charges for which searched is set, in chunks of
+  // chunk_size pairs from first on.
+  SpectrumClusters(const vector<SpectrumCollection::SpecCharge>& spec_charges,
+                   const vector<bool>& searched, int first, int chunk_size,
+                   double min_cosine, double tolerance_ppm);
+
+  // Whether pair i is searched only along with its representative.
+  bool Member(int i) const { return rep_[i] != i; }
+
+  // The first member of the cluster of representative i, or the member after
+  // member i; -1 if there is none.
+  int Next(int i) const { return next_[i]; }
+
+  int NumMembers() const { return num_members_; }
+
+ private:
+  static void Bin(const Spectrum& spectrum, SparseSpectrum::Peaks* peaks);
+
+  vector<int> rep_;
+  vector<int> next_;
+  int num_members_;
+};
+
+#endif // SPECTRUM_CLUSTERS_H
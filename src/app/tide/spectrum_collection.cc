@@ -7,14 +7,22 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <map>
+#include <set>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "spectrum.pb.h"
 #include "spectrum_collection.h"
 #include "mass_constants.h"
 #include "max_mz.h"
 #include "records.h"
 #include "records_to_vector-inl.h"
+#include "util/GlobalParams.h"
 #include "util/mass.h"
+#include "util/ParallelSort.h"
+#include "util/MemoryAccounting.h"
 #include "util/Params.h"
+#include "util/ThreadPool.h"
 
 using namespace std;
 using google::protobuf::uint64;
@@ -30,18 +38,39 @@ Spectrum::Spectrum(const pb::Spectrum& spec) {
   rtime_ = spec.rtime();
   for (int i = 0; i < spec.charge_state_size(); ++i)
     charge_states_.push_back(spec.charge_state(i));
+  if (spec.charge_state_m_z_size() > 0) {
+    CHECK(spec.charge_state_m_z_size() == spec.charge_state_size());
+    charge_state_m_z_.assign(spec.charge_state_m_z().begin(),
+                             spec.charge_state_m_z().end());
+  }
   int size = spec.peak_m_z_size();
   CHECK(size == spec.peak_intensity_size());
-  ReservePeaks(size);
+  peak_m_z_.resize(size);
+  peak_intensity_.resize(size);
+  if (size == 0)
+    return;
+  // Decoded in separate passes over the arrays: the running sum of the
+  // m/z deltas, then the divisions, which have no dependences to keep the
+  // compiler from vectorizing them. The values are those of dividing each
+  // sum in turn.
+  const google::protobuf::int64* m_z = spec.peak_m_z().data();
+  const google::protobuf::int64* intensity = spec.peak_intensity().data();
+  double* peak_m_z = &peak_m_z_[0];
+  double* peak_intensity = &peak_intensity_[0];
   uint64 total = 0;
-  double m_z_denom = spec.peak_m_z_denominator();
-  double intensity_denom = spec.peak_intensity_denominator();
+  bool increasing = true;
   for (int i = 0; i < size; ++i) {
-    CHECK(spec.peak_m_z(i) > 0);
-    total += spec.peak_m_z(i); // deltas of m/z are stored
-    peak_m_z_.push_back(total / m_z_denom);
-    peak_intensity_.push_back(spec.peak_intensity(i) / intensity_denom);
+    increasing &= m_z[i] > 0;
+    total += m_z[i]; // deltas of m/z are stored
+    peak_m_z[i] = total;
   }
+  CHECK(increasing);
+  double m_z_denom = spec.peak_m_z_denominator();
+  double intensity_denom = spec.peak_intensity_denominator();
+  for (int i = 0; i < size; ++i)
+    peak_m_z[i] /= m_z_denom;
+  for (int i = 0; i < size; ++i)
+    peak_intensity[i] = intensity[i] / intensity_denom;
 }
 
 // A spectrum can have multiple precursor charges assigned.  This
@@ -51,6 +80,31 @@ int Spectrum::MaxCharge() const {
   return i != charge_states_.end() ? *i : 1;
 }
 
+double Spectrum::HighestPrecursorMZ(int charge) const {
+  double highest = precursor_m_z_;
+  for (size_t i = 0; i < charge_state_m_z_.size(); ++i) {
+    if (charge_states_[i] == charge && charge_state_m_z_[i] > highest)
+      highest = charge_state_m_z_[i];
+  }
+  return highest;
+}
+
+double Spectrum::HighestPrecursorMass() const {
+  double highest = 0;
+  for (int i = 0; i < NumChargeStates(); ++i) {
+    highest = max(highest, (PrecursorMZ(i) - MASS_PROTON) * charge_states_[i]);
+  }
+  return highest;
+}
+
+double Spectrum::PrecursorDistance(double m_z) const {
+  double distance = fabs(m_z - precursor_m_z_);
+  for (size_t i = 0; i < charge_state_m_z_.size(); ++i) {
+    distance = min(distance, fabs(m_z - charge_state_m_z_[i]));
+  }
+  return distance;
+}
+
 // Report maximum intensity peak in the given m/z range.
 double Spectrum::MaxPeakInRange( double min_range, double max_range ) const {
   double return_value = 0.0;
@@ -101,6 +155,8 @@ void Spectrum::FillPB(pb::Spectrum* spec) {
   spec->set_rtime(rtime_);
   for (int i = 0; i < NumChargeStates(); ++i)
     spec->add_charge_state(ChargeState(i));
+  for (size_t i = 0; i < charge_state_m_z_.size(); ++i)
+    spec->add_charge_state_m_z(charge_state_m_z_[i]);
   int size = peak_m_z_.size();
   CHECK(size == peak_intensity_.size());
   int m_z_denom = GetDenom(peak_m_z_);
@@ -148,17 +204,33 @@ vector<double> Spectrum::CreateEvidenceVector(
   double pepMassMonoMean,
   int maxPrecurMass
 ) const {
-  // TODO need to review these constants, decide which can be moved to parameter file
-  const double maxIntensPerRegion = 50.0;
-  const double precursorMZExclude = 15.0;
-  const double BYHeight = 50.0;
-  const double NH3LossHeight = 10.0;
-  const double COLossHeight = 10.0;    // for creating a ions on the fly from b ions
-  const double H2OLossHeight = 10.0;
-  const double FlankingHeight = BYHeight / 2;;
-  // TODO end need to review
+  vector<double> intensObs;
+  PreprocessForEvidence(charge, maxPrecurMass, &intensObs);
+  vector<double> evidence;
+  FillEvidenceVector(intensObs, binWidth, binOffset, charge, pepMassMonoMean,
+                     maxPrecurMass, &evidence);
+  return evidence;
+}
+
+// TODO need to review these constants, decide which can be moved to parameter file
+static const double maxIntensPerRegion = 50.0;
+static const double precursorMZExclude = 15.0;
+static const double BYHeight = 50.0;
+static const double NH3LossHeight = 10.0;
+static const double COLossHeight = 10.0;    // for creating a ions on the fly from b ions
+static const double H2OLossHeight = 10.0;
+static const double FlankingHeight = BYHeight / 2;;
+// TODO end need to review
+
+// The part of CreateEvidenceVector() that depends only on the charge: the
+// normalized, background-subtracted observed intensities.
+void Spectrum::PreprocessForEvidence(
+  int charge,
+  int maxPrecurMass,
+  vector<double>* intensObsOut
+) const {
   int numPeaks = Size();
-  double experimentalMassCutoff = PrecursorMZ() * charge + 50.0;
+  double experimentalMassCutoff = HighestPrecursorMZ(charge) * charge + 50.0;
   double maxIonMass = 0.0;
   double maxIonIntens = 0.0;
   for (int ion = 0; ion < numPeaks; ion++) {
@@ -175,13 +247,14 @@ vector<double> Spectrum::CreateEvidenceVector(
     }
   }
   int regionSelector = (int)floor(MassConstants::mass2bin(maxIonMass) / (double)NUM_SPECTRUM_REGIONS);
-  vector<double> intensObs(maxPrecurMass, 0);
+  vector<double>& intensObs = *intensObsOut;
+  intensObs.assign(maxPrecurMass, 0);
   vector<int> intensRegion(maxPrecurMass, -1);
   for (int ion = 0; ion < numPeaks; ion++) {
     double ionMass = M_Z(ion);
     double ionIntens = Intensity(ion);
     if (ionMass >= experimentalMassCutoff ||
-        (ionMass > PrecursorMZ() - precursorMZExclude && ionMass < PrecursorMZ() + precursorMZExclude)) {
+        PrecursorDistance(ionMass) < precursorMZExclude) {
       continue;
     }
     int ionBin = MassConstants::mass2bin(ionMass);
@@ -233,12 +306,25 @@ vector<double> Spectrum::CreateEvidenceVector(
     int left = std::max(0, i - MAX_XCORR_OFFSET - 1);
     intensObs[i] -= multiplier * (partial_sums[right] - partial_sums[left]);
   }
+}
 
-  bool flankingPeaks = Params::GetBool("use-flanking-peaks");
-  bool nlPeaks = Params::GetBool("use-neutral-loss-peaks");
+// The evidence loop of FillEvidenceVector(), with use-flanking-peaks and
+// use-neutral-loss-peaks as template parameters so that the loop has no
+// tests of them.
+template<bool flankingPeaks, bool nlPeaks>
+static void FillEvidence(
+  const vector<double>& intensObs,
+  double binWidth,
+  double binOffset,
+  int charge,
+  double pepMassMonoMean,
+  int maxPrecurMass,
+  vector<double>* evidenceOut
+) {
   int binFirst = MassConstants::mass2bin(30);
   int binLast = MassConstants::mass2bin(pepMassMonoMean - 47);
-  vector<double> evidence(maxPrecurMass, 0);
+  vector<double>& evidence = *evidenceOut;
+  evidence.assign(maxPrecurMass, 0);
   for (int i = binFirst; i <= binLast; i++) {
     // b ion
     double bIonMass = (i - 0.5 + binOffset) * binWidth;
@@ -304,7 +390,30 @@ vector<double> Spectrum::CreateEvidenceVector(
       }
     }
   }
-  return evidence;
+}
+
+// The part of CreateEvidenceVector() that depends on the peptide mass, given
+// the output of PreprocessForEvidence() for the same charge.
+void Spectrum::FillEvidenceVector(
+  const vector<double>& intensObs,
+  double binWidth,
+  double binOffset,
+  int charge,
+  double pepMassMonoMean,
+  int maxPrecurMass,
+  vector<double>* evidenceOut
+) const {
+  void (*fill)(const vector<double>&, double, double, int, double, int,
+               vector<double>*);
+  if (GlobalParams::getUseFlankingPeaks()) {
+    fill = GlobalParams::getUseNeutralLossPeaks() ?
+      FillEvidence<true, true> : FillEvidence<true, false>;
+  } else {
+    fill = GlobalParams::getUseNeutralLossPeaks() ?
+      FillEvidence<false, true> : FillEvidence<false, false>;
+  }
+  fill(intensObs, binWidth, binOffset, charge, pepMassMonoMean, maxPrecurMass,
+       evidenceOut);
 }
 
 vector<int> Spectrum::CreateEvidenceVectorDiscretized(
@@ -317,13 +426,77 @@ vector<int> Spectrum::CreateEvidenceVectorDiscretized(
   vector<double> evidence =
     CreateEvidenceVector(binWidth, binOffset, charge, pepMassMonoMean, maxPrecurMass);
   vector<int> discretized;
-  discretized.reserve(evidence.size());
-  for (vector<double>::const_iterator i = evidence.begin(); i != evidence.end(); i++) {
-    discretized.push_back((int)floor(*i / EVIDENCE_INT_SCALE + 0.5));
-  }
+  Discretize(evidence, &discretized);
   return discretized;
 }
 
+void Spectrum::Discretize(const vector<double>& evidence, vector<int>* discretized) {
+  discretized->resize(evidence.size());
+  for (size_t i = 0; i < evidence.size(); i++) {
+    (*discretized)[i] = (int)floor(evidence[i] / EVIDENCE_INT_SCALE + 0.5);
+  }
+}
+
+void EvidenceCache::SetSpectrum(const Spectrum* spectrum, int maxPrecurMass) {
+  if (spectrum == spectrum_ && maxPrecurMass == maxPrecurMass_) {
+    return;
+  }
+  Clear();
+  spectrum_ = spectrum;
+  maxPrecurMass_ = maxPrecurMass;
+}
+
+const vector<double>& EvidenceCache::IntensObs(int charge) {
+  map<int, vector<double> >::iterator i = intensObs_.find(charge);
+  if (i == intensObs_.end()) {
+    i = intensObs_.insert(make_pair(charge, vector<double>())).first;
+    spectrum_->PreprocessForEvidence(charge, maxPrecurMass_, &i->second);
+  }
+  return i->second;
+}
+
+const vector<double>& EvidenceCache::Evidence(int charge, int pepMassInt) {
+  pair<int, int> key(charge, pepMassInt);
+  map<pair<int, int>, vector<double> >::iterator i = evidence_.find(key);
+  if (i == evidence_.end()) {
+    i = evidence_.insert(make_pair(key, vector<double>())).first;
+    FillEvidence(charge, pepMassInt, &i->second);
+  }
+  return i->second;
+}
+
+void EvidenceCache::EvidenceDiscretized(int charge, int pepMassInt, vector<int>* out) {
+  map<pair<int, int>, vector<double> >::const_iterator i =
+    evidence_.find(make_pair(charge, pepMassInt));
+  if (i != evidence_.end()) {
+    Spectrum::Discretize(i->second, out);
+    return;
+  }
+  FillEvidence(charge, pepMassInt, &scratch_);
+  Spectrum::Discretize(scratch_, out);
+}
+
+void EvidenceCache::FillEvidence(int charge, int pepMassInt, vector<double>* evidence) {
+  double pepMassMonoMean = (pepMassInt - 0.5 + binOffset_) * binWidth_;
+  spectrum_->FillEvidenceVector(IntensObs(charge), binWidth_, binOffset_, charge,
+                                pepMassMonoMean, maxPrecurMass_, evidence);
+}
+
+SpectrumCollection::~SpectrumCollection() {
+  for (int i = 0; i < spectra_.size(); ++i)
+    delete spectra_[i];
+  MemoryAccounting::Add(MEMORY_SPECTRA, -accounted_bytes_);
+}
+
+void SpectrumCollection::AccountMemory() {
+  long long bytes = spectra_.capacity() * sizeof(Spectrum*) +
+    spec_charges_.capacity() * sizeof(SpecCharge);
+  for (vector<Spectrum*>::const_iterator i = spectra_.begin(); i != spectra_.end(); ++i)
+    bytes += (*i)->MemoryBytes();
+  MemoryAccounting::Add(MEMORY_SPECTRA, bytes - accounted_bytes_);
+  accounted_bytes_ = bytes;
+}
+
 void SpectrumCollection::ReadMS(istream& in, bool ms1) {
   // Parse MS2 file format.
   // Not very fast: uses scanf. CONSIDER speed-up.
@@ -376,8 +549,169 @@ void SpectrumCollection::ReadMS(istream& in, bool ms1) {
   }
   if (spectrum)
     spectra_.push_back(spectrum);
+  highest_mz_ = -1;
+  AccountMemory();
+}
+
+bool SpectrumCollection::ReadSpectrumKeys(const string& filename,
+                                          vector<SpecChargeKey>* keys,
+                                          double* highest_mz) {
+  keys->clear();
+  *highest_mz = 0;
+  pb::Header header;
+  HeadedRecordReader reader(filename, &header);
+  if (header.file_type() != pb::Header::SPECTRA)
+    return false;
+  pb::Spectrum pb_spectrum;
+  while (true) {
+    SpecChargeKey key;
+    key.offset = reader.Reader()->FilePosition();
+    if (reader.Done())
+      break;
+    if (!reader.Read(&pb_spectrum))
+      return false;
+    // As in FindHighestMZ(); the m/z values are stored as deltas.
+    CHECK(pb_spectrum.peak_m_z_size() > 0) << "ERROR: spectrum "
+      << pb_spectrum.spectrum_number() << " has no peaks.\n";
+    uint64 total = 0;
+    for (int i = 0; i < pb_spectrum.peak_m_z_size(); ++i)
+      total += pb_spectrum.peak_m_z(i);
+    double last_peak = total / (double) pb_spectrum.peak_m_z_denominator();
+    if (last_peak > *highest_mz)
+      *highest_mz = last_peak;
+    for (int i = 0; i < pb_spectrum.charge_state_size(); ++i) {
+      double precursor_m_z = pb_spectrum.charge_state_m_z_size() > 0 ?
+        pb_spectrum.charge_state_m_z(i) : pb_spectrum.precursor_m_z();
+      key.charge = pb_spectrum.charge_state(i);
+      key.state = i;
+      key.neutral_mass = (precursor_m_z - MASS_PROTON) * key.charge;
+      keys->push_back(key);
+    }
+  }
+  return reader.OK();
+}
+
+bool SpectrumCollection::ReadSpectrumBatch(const string& filename,
+                                           const vector<SpecChargeKey>& keys) {
+  for (int i = 0; i < spectra_.size(); ++i)
+    delete spectra_[i];
+  spectra_.clear();
+  spec_charges_.clear();
+  highest_mz_ = -1;
+
+  // Read each spectrum once, in file order.
+  vector<google::protobuf::int64> offsets;
+  for (vector<SpecChargeKey>::const_iterator i = keys.begin(); i != keys.end(); ++i)
+    offsets.push_back(i->offset);
+  sort(offsets.begin(), offsets.end());
+  offsets.erase(unique(offsets.begin(), offsets.end()), offsets.end());
+
+  HeadedRecordReader reader(filename);
+  pb::Spectrum pb_spectrum;
+  for (vector<google::protobuf::int64>::const_iterator i = offsets.begin();
+       i != offsets.end(); ++i) {
+    if (!reader.Reader()->SeekRecord(*i) || reader.Done() ||
+        !reader.Read(&pb_spectrum))
+      return false;
+    spectra_.push_back(new Spectrum(pb_spectrum));
+  }
+  for (vector<SpecChargeKey>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
+    int index = lower_bound(offsets.begin(), offsets.end(), i->offset) - offsets.begin();
+    spec_charges_.push_back(SpecCharge(i->neutral_mass, i->charge, spectra_[index],
+                                       index, i->state));
+  }
+  AccountMemory();
+  return true;
 }
 
+namespace {
+
+// Run work(part, begin, end) on each of the parts that [0, n) splits into
+// for threads, the first part on the calling thread.
+template<typename Work>
+void SplitWork(int threads, size_t n, Work work) {
+  ThreadPool::TaskGroup group;
+  for (int t = 1; t < threads; ++t) {
+    group.Run(boost::bind<void>(work, t, n * t / threads,
+                                          n * (t + 1) / threads));
+  }
+  work(0, 0, n / threads);
+  group.Wait();
+}
+
+// Spectra per thread below which threads are not worth starting.
+const size_t kMinSpectraPerThread = 20000;
+
+struct FillSpecCharges {
+  const vector<Spectrum*>* spectra;
+  const vector<int>* first;  // position of the first spec charge of each spectrum
+  double mz_window;
+  vector<SpectrumCollection::SpecCharge>* spec_charges;
+  vector< pair<double, int> >* keys;
+  vector<double>* highest;  // for each part
+
+  void operator()(int part, size_t begin, size_t end) const {
+    double top = 0;
+    for (size_t i = begin; i < end; ++i) {
+      Spectrum* spectrum = (*spectra)[i];
+      CHECK(spectrum->Size() > 0) << "ERROR: spectrum " << spectrum->SpectrumNumber()
+                                  << " has no peaks.\n";
+      top = max(top, spectrum->M_Z(spectrum->Size() - 1));
+      int pos = (*first)[i];
+      for (int j = 0; j < spectrum->NumChargeStates(); ++j, ++pos) {
+        int charge = spectrum->ChargeState(j);
+        double neutral_mass = (spectrum->PrecursorMZ(j) - MASS_PROTON) * charge;
+        (*spec_charges)[pos] = SpectrumCollection::SpecCharge(neutral_mass, charge,
+                                                              spectrum, i, j);
+        if (keys != NULL) {
+          // As TideSearchApplication::ScSortByMz computes it.
+          (*keys)[pos] = make_pair(
+            (spectrum->PrecursorMZ(j) - MASS_PROTON - mz_window) * charge, pos);
+        }
+      }
+    }
+    (*highest)[part] = top;
+  }
+};
+
+// Spectra read at a time by ReadSpectrumRecords(), and per thread below
+// which decoding them is not worth starting threads.
+const size_t kSpectraPerBatch = 1 << 14;
+const size_t kMinSpectraPerDecode = 1024;
+
+struct DecodeSpectra {
+  const vector<string>* records;
+  Spectrum** spectra;  // for each record, in the same order
+  vector<char>* ok;    // for each part, whether all its records parsed
+
+  void operator()(int part, size_t begin, size_t end) const {
+    pb::Spectrum pb_spectrum;
+    bool parsed = true;
+    for (size_t i = begin; i < end; ++i) {
+      if (!pb_spectrum.ParseFromString((*records)[i])) {
+        parsed = false;
+        continue;
+      }
+      spectra[i] = new Spectrum(pb_spectrum);
+    }
+    (*ok)[part] = parsed;
+  }
+};
+
+struct GatherSpecCharges {
+  const vector<SpectrumCollection::SpecCharge>* from;
+  const vector< pair<double, int> >* keys;
+  vector<SpectrumCollection::SpecCharge>* to;
+
+  void operator()(int, size_t begin, size_t end) const {
+    for (size_t i = begin; i < end; ++i) {
+      (*to)[i] = (*from)[(*keys)[i].second];
+    }
+  }
+};
+
+}  // namespace
+
 bool SpectrumCollection::ReadSpectrumRecords(const string& filename,
 					     pb::Header* header) {
   pb::Header tmp_header;
@@ -386,40 +720,66 @@ bool SpectrumCollection::ReadSpectrumRecords(const string& filename,
   HeadedRecordReader reader(filename, header);
   if (header->file_type() != pb::Header::SPECTRA)
     return false;
-  pb::Spectrum pb_spectrum;
-  while (!reader.Done()) {
-    reader.Read(&pb_spectrum);
-    spectra_.push_back(new Spectrum(pb_spectrum));
+  // The records of a batch are read as they are, and parsed and decoded on
+  // the threads.
+  int num_threads = ThreadPool::Threads();
+  vector<string> records(kSpectraPerBatch);
+  vector<char> ok(num_threads);
+  bool parsed = true;
+  bool done = reader.Done();
+  while (parsed && !done) {
+    size_t size = 0;
+    do {
+      reader.Reader()->ReadBytes(&records[size++]);
+      done = reader.Done();
+    } while (!done && size < records.size());
+    size_t first = spectra_.size();
+    spectra_.resize(first + size, NULL);
+    int threads = max(1, min(num_threads, (int) (size / kMinSpectraPerDecode)));
+    DecodeSpectra decode = { &records, &spectra_[first], &ok };
+    SplitWork(threads, size, decode);
+    for (int t = 0; t < threads; ++t)
+      parsed &= ok[t] != 0;
   }
-  if (!reader.OK()) {
+  if (!parsed || !reader.OK()) {
     for (int i = 0; i < spectra_.size(); ++i)
       delete spectra_[i];
     spectra_.clear();
+    AccountMemory();
     return false;
   }
+  highest_mz_ = -1;
+  AccountMemory();
   return true;
 }
 
-void SpectrumCollection::MakeSpecCharges() {
+void SpectrumCollection::MakeSpecCharges(double mz_window, int threads,
+                                         vector< pair<double, int> >* keys) {
   // Create one entry in the spec_charges_ array for each
-  // (spectrum, charge) pair.
-  int spectrum_index = 0;
-  vector<Spectrum*>::iterator i = spectra_.begin();
-  for (; i != spectra_.end(); ++i) {
-    for (int j = 0; j < (*i)->NumChargeStates(); ++j) {
-      int charge = (*i)->ChargeState(j);
-      double neutral_mass = (((*i)->PrecursorMZ() - MASS_PROTON)
-			     * charge);
-      spec_charges_.push_back(SpecCharge(neutral_mass, charge, *i,
-                                         spectrum_index));
-    }
-    spectrum_index++;
+  // (spectrum, charge) pair, spectra split among the threads.
+  vector<int> first(spectra_.size());
+  int total = 0;
+  for (size_t i = 0; i < spectra_.size(); ++i) {
+    first[i] = total;
+    total += spectra_[i]->NumChargeStates();
+  }
+  threads = max(1, min(threads, (int) (spectra_.size() / kMinSpectraPerThread)));
+  spec_charges_.assign(total, SpecCharge(0, 0, NULL, 0));
+  if (keys != NULL) {
+    keys->resize(total);
   }
+  vector<double> highest(threads, 0);
+  FillSpecCharges fill = { &spectra_, &first, mz_window, &spec_charges_, keys, &highest };
+  SplitWork(threads, spectra_.size(), fill);
+  highest_mz_ = *max_element(highest.begin(), highest.end());
 }
 
 double SpectrumCollection::FindHighestMZ() const {
   // Return the maximum MZ seen across all input spectra.
-  double highest = 0;
+  double highest = removed_highest_mz_;
+  if (highest_mz_ >= 0) {
+    return max(highest, highest_mz_);
+  }
   vector<Spectrum*>::const_iterator i = spectra_.begin();
   for (; i != spectra_.end(); ++i) {
     CHECK((*i)->Size() > 0) << "ERROR: spectrum " << (*i)->SpectrumNumber()
@@ -431,7 +791,49 @@ double SpectrumCollection::FindHighestMZ() const {
   return highest;
 }
 
-void SpectrumCollection::Sort() {
-  MakeSpecCharges();
-  sort(spec_charges_.begin(), spec_charges_.end());
+void SpectrumCollection::Sort(double mz_window, int threads) {
+  vector< pair<double, int> > keys;
+  MakeSpecCharges(mz_window, threads, &keys);
+
+  // The keys are distinct, so the order does not depend on the number of
+  // threads.
+  ParallelSort::Sort(keys.begin(), keys.end(), less< pair<double, int> >(), threads);
+  threads = max(1, min(threads, (int) (keys.size() / kMinSpectraPerThread)));
+  vector<SpecCharge> sorted(spec_charges_.size(), SpecCharge(0, 0, NULL, 0));
+  GatherSpecCharges gather = { &spec_charges_, &keys, &sorted };
+  SplitWork(threads, sorted.size(), gather);
+  spec_charges_.swap(sorted);
+  AccountMemory();
+}
+
+void SpectrumCollection::RemoveSpecCharges(const vector<char>& removed) {
+  CHECK(removed.size() == spec_charges_.size());
+  set<const Spectrum*> kept;
+  size_t n = 0;
+  for (size_t i = 0; i < spec_charges_.size(); ++i) {
+    if (!removed[i]) {
+      spec_charges_[n++] = spec_charges_[i];
+      kept.insert(spec_charges_[i].spectrum);
+    }
+  }
+  spec_charges_.erase(spec_charges_.begin() + n, spec_charges_.end());
+
+  double highest = FindHighestMZ();
+  map<const Spectrum*, int> index;
+  n = 0;
+  for (size_t i = 0; i < spectra_.size(); ++i) {
+    if (kept.find(spectra_[i]) == kept.end()) {
+      delete spectra_[i];
+    } else {
+      index[spectra_[i]] = n;
+      spectra_[n++] = spectra_[i];
+    }
+  }
+  spectra_.erase(spectra_.begin() + n, spectra_.end());
+  removed_highest_mz_ = highest;
+
+  for (vector<SpecCharge>::iterator i = spec_charges_.begin(); i != spec_charges_.end(); ++i) {
+    i->spectrum_index = index[i->spectrum];
+  }
+  AccountMemory();
 }
@@ -15,13 +15,22 @@
 // active_peptide_queue.{h,cc}.)
 //
 // SpectrumCollection::FindHighestMZ() returns the maximum MZ seen across all
-// input spectra. This is cached by the MaxMZ class.
+// input spectra. This is cached by the MaxMZ class. Sort() finds it in the
+// same pass over the spectra as it makes the spec charges.
+//
+// A file too large to hold in memory can instead be searched a batch at a
+// time: ReadSpectrumKeys() records each (spectrum, charge) pair with only its
+// mass and where its spectrum is in the file, and after the keys are sorted,
+// ReadSpectrumBatch() reads the spectra of consecutive runs of them.
 
 #ifndef SPECTRUM_COLLECTION_H
 #define SPECTRUM_COLLECTION_H
 
 #include <iostream>
+#include <map>
+#include <utility>
 #include <vector>
+#include <google/protobuf/stubs/common.h>
 #include "header.pb.h"
 #include "spectrum.pb.h"
 
@@ -44,6 +53,12 @@ class Spectrum {
   void AddChargeState(int charge_state) {
     charge_states_.push_back(charge_state);
   }
+  // Add a precursor hypothesis of its own m/z, which makes the spectrum
+  // multiplexed. Not to be mixed with AddChargeState().
+  void AddPrecursor(double m_z, int charge_state) {
+    charge_states_.push_back(charge_state);
+    charge_state_m_z_.push_back(m_z);
+  }
   void AddPeak(double m_z, double intensity) {
     peak_m_z_.push_back(m_z);
     peak_intensity_.push_back(intensity);
@@ -59,6 +74,23 @@ class Spectrum {
   int NumChargeStates() const { return charge_states_.size(); }
   int ChargeState(int index) const { return charge_states_[index]; }
 
+  // Whether the charge states have precursor m/z of their own, as
+  // precursor hypotheses of one multiplexed spectrum (see
+  // multiplexed-spectra).
+  bool Multiplexed() const { return !charge_state_m_z_.empty(); }
+  // The precursor m/z of charge state index
+  double PrecursorMZ(int index) const {
+    return charge_state_m_z_.empty() ? precursor_m_z_ : charge_state_m_z_[index];
+  }
+  // The highest precursor m/z of the charge states of charge, which bounds
+  // the fragments that preprocessing keeps for all of them; PrecursorMZ()
+  // unless the spectrum is multiplexed.
+  double HighestPrecursorMZ(int charge) const;
+  // The highest neutral mass of any charge state
+  double HighestPrecursorMass() const;
+  // The distance from m_z to the nearest precursor m/z
+  double PrecursorDistance(double m_z) const;
+
   int Size() const { return peak_m_z_.size(); } // number of peaks
   double M_Z(int index) const { return peak_m_z_[index]; }
   double Intensity(int index) const { return peak_intensity_[index]; }
@@ -71,33 +103,91 @@ class Spectrum {
 
   int MaxCharge() const;
   double MaxPeakInRange( double min_range, double max_range ) const;
+
+  // Bytes held by the spectrum and its peaks.
+  size_t MemoryBytes() const {
+    return sizeof(*this) + charge_states_.capacity() * sizeof(int) +
+      (charge_state_m_z_.capacity() + peak_m_z_.capacity() +
+       peak_intensity_.capacity()) * sizeof(double);
+  }
   
  private:
+  // The two halves of CreateEvidenceVector(); see EvidenceCache.
+  void PreprocessForEvidence(int charge, int maxPrecurMass, vector<double>* intensObs) const;
+  void FillEvidenceVector(const vector<double>& intensObs, double binWidth,
+                          double binOffset, int charge, double pepMassMonoMean,
+                          int maxPrecurMass, vector<double>* evidence) const;
+  static void Discretize(const vector<double>& evidence, vector<int>* discretized);
+
+  friend class EvidenceCache;
+
   int spectrum_number_;
   double rtime_;
   double precursor_m_z_;
   vector<int> charge_states_;
+  vector<double> charge_state_m_z_;  // empty unless multiplexed
 
   vector<double> peak_m_z_;
   vector<double> peak_intensity_;
 };
 
-class SpectrumCollection {
+// Evidence vectors of one spectrum, as computed by
+// Spectrum::CreateEvidenceVector(), for peptide masses given as integer bins.
+// Most of the work of an evidence vector is in preprocessing the spectrum,
+// which depends only on the charge; that is done once per charge. Evidence
+// vectors asked for with Evidence() are also kept, by (charge, mass bin).
+// Everything is forgotten when a different spectrum is set.
+class EvidenceCache {
  public:
-  ~SpectrumCollection() {
-    for (int i = 0; i < spectra_.size(); ++i)
-      delete spectra_[i];
+  EvidenceCache(double binWidth, double binOffset)
+    : binWidth_(binWidth), binOffset_(binOffset), spectrum_(NULL), maxPrecurMass_(0) {
   }
 
+  // Nothing is recomputed if spectrum and maxPrecurMass are unchanged, so
+  // call Clear() before reusing the memory of a spectrum for another one.
+  void SetSpectrum(const Spectrum* spectrum, int maxPrecurMass);
+  void Clear() { spectrum_ = NULL; intensObs_.clear(); evidence_.clear(); }
+
+  const vector<double>& Evidence(int charge, int pepMassInt);
+
+  // As Spectrum::CreateEvidenceVectorDiscretized(), into out. The evidence
+  // vector itself is not kept.
+  void EvidenceDiscretized(int charge, int pepMassInt, vector<int>* out);
+
+ private:
+  const vector<double>& IntensObs(int charge);
+  void FillEvidence(int charge, int pepMassInt, vector<double>* evidence);
+
+  double binWidth_;
+  double binOffset_;
+  const Spectrum* spectrum_;
+  int maxPrecurMass_;
+  map<int, vector<double> > intensObs_;
+  map<pair<int, int>, vector<double> > evidence_;
+  vector<double> scratch_;
+};
+
+class SpectrumCollection {
+ public:
+  SpectrumCollection() : removed_highest_mz_(0), highest_mz_(-1), accounted_bytes_(0) {}
+  ~SpectrumCollection();
+
   void ReadMS(istream& in, bool ms1);
   bool ReadSpectrumRecords(const string& filename, pb::Header* header = NULL);
-  void Sort();
+
+  // Make the spec charges and sort them by neutral_mass - mz_window * charge,
+  // which with the precursor window as mz_window is the order of the low ends
+  // of their m/z windows; ties keep the order of the spectra. The sort key
+  // of each pair is computed once. Up to threads threads share the work, and
+  // the order does not depend on how many.
+  void Sort(double mz_window = 0, int threads = 1);
   int Size() const { return(spectra_.size()); } // number of spectra
 
   template<typename BinaryPredicate>
   void Sort(BinaryPredicate Predicate) {
     MakeSpecCharges();
     sort(spec_charges_.begin(), spec_charges_.end(), Predicate);
+    AccountMemory();
   }
 
   double FindHighestMZ() const;
@@ -105,28 +195,66 @@ class SpectrumCollection {
   struct SpecCharge {
     double neutral_mass;
     int charge;
+    int state;  // the index of the charge state in spectrum
     Spectrum* spectrum;
     int spectrum_index;
 
     SpecCharge(double neutral_mass_param, int charge_param,
-               Spectrum* spectrum_param, int spectrum_index_param)
-    : neutral_mass(neutral_mass_param), charge(charge_param),
+               Spectrum* spectrum_param, int spectrum_index_param,
+               int state_param = 0)
+    : neutral_mass(neutral_mass_param), charge(charge_param), state(state_param),
       spectrum(spectrum_param), spectrum_index(spectrum_index_param) {
     }
 
+    double PrecursorMZ() const { return spectrum->PrecursorMZ(state); }
+
     bool operator<(const SpecCharge& other) const {
       return (neutral_mass < other.neutral_mass);
     }
   };
 
+  // A (spectrum, charge) pair without its spectrum, which starts at offset
+  // in its file.
+  struct SpecChargeKey {
+    double neutral_mass;
+    int charge;
+    int state;
+    google::protobuf::int64 offset;
+  };
+
+  // Record the (spectrum, charge) pairs of a file of spectrum records, and
+  // the highest m/z of their peaks, reading one spectrum at a time.
+  static bool ReadSpectrumKeys(const string& filename,
+                               vector<SpecChargeKey>* keys, double* highest_mz);
+
+  // Read the spectra of keys, which came from filename, replacing any spectra
+  // already read, and make their spec charges in the order of keys.
+  bool ReadSpectrumBatch(const string& filename,
+                         const vector<SpecChargeKey>& keys);
+
   const vector<SpecCharge>* SpecCharges() const { return &spec_charges_; }
   vector<Spectrum*>* Spectra() { return &spectra_; }
 
+  // Remove the spec charges marked in removed, which is parallel to
+  // SpecCharges(), keeping the order of the rest, and delete the spectra left
+  // without any. FindHighestMZ() still counts the deleted spectra, so that
+  // searching what is left uses the same bins.
+  void RemoveSpecCharges(const vector<char>& removed);
+
  private:
-  void MakeSpecCharges();
+  // With keys, also fill it with the sort key of each spec charge and its
+  // position.
+  void MakeSpecCharges(double mz_window = 0, int threads = 1,
+                       vector< pair<double, int> >* keys = NULL);
+  // Bring the collection's count in MemoryAccounting up to date after the
+  // spectra or spec charges have changed.
+  void AccountMemory();
 
   vector<Spectrum*> spectra_;
   vector<SpecCharge> spec_charges_;
+  double removed_highest_mz_;
+  double highest_mz_;  // of spectra_ as of MakeSpecCharges(), or -1
+  long long accounted_bytes_;
 };
 
 #endif // SPECTRUM_COLLECTION_H
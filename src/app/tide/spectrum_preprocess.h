@@ -101,10 +101,17 @@
 // PeakCombinedY2b represents a charge 2 Y ion, its flanks and neutral losses.
 // The ith entry of this cache vector is:
 //   50*u[i] + 25*u[i-1] + 25*u[i+1] + 10*u[i-8]
+//
+// Precursor removal and deisotoping do not depend on the charge being
+// searched, and deisotoping is quadratic in the number of peaks. When a
+// PeakFilterCache is attached, their outcome for a spectrum with several
+// charge states is computed once and reused for the remaining charges.
 #ifndef SPECTRUM_PREPROCESS_H
 #define SPECTRUM_PREPROCESS_H
 
 #include <iostream>
+#include <map>
+#include <utility>
 #include <vector>
 #include "theoretical_peak_pair.h"
 #include "max_mz.h"
@@ -114,25 +121,57 @@ using namespace std;
 
 class Spectrum;
 
+// Per-peak outcome of the charge-independent filters of PreprocessSpectrum(),
+// kept for spectra that still have charge states to be preprocessed. One
+// cache is meant to be shared by the ObservedPeakSets of a single thread, for
+// the spectra of a single file.
+class PeakFilterCache {
+ public:
+  enum { PEAK_RETAINED = 0, PEAK_PRECURSOR, PEAK_ISOTOPE, PEAK_OUT_OF_TOP };
+
+  void Clear() { entries_.clear(); }
+
+  // Count a charge state of spectrum that was not preprocessed, as it shares
+  // the preprocessed spectrum of another, so that the filters are still
+  // forgotten once every charge state has been through.
+  void Skip(const Spectrum& spectrum);
+
+ private:
+  struct Entry {
+    vector<char> filters;
+    int uses;
+    Entry() : uses(0) {}
+  };
+  map<const Spectrum*, Entry> entries_;
+
+  friend class ObservedPeakSet;
+};
+
 class ObservedPeakSet {
  public:
     
   ObservedPeakSet(double bin_width = MassConstants::bin_width_, 
      double bin_offset = MassConstants::bin_width_, 
-     bool NL = false, bool FP = false)
-    : peaks_(new double[MaxBin::Global().BackgroundBinEnd()]),
-    cache_(new int[MaxBin::Global().CacheBinEnd()*NUM_PEAK_TYPES]) {
-    
-    bin_width_  = bin_width;
-    bin_offset_ = bin_offset;
-    NL_ = NL; //NL means neutral loss
-    FP_ = FP; //FP means flanking peaks
-  }
+     bool NL = false, bool FP = false);
+
+  ~ObservedPeakSet() { delete[] peaks_; delete[] cache_; delete[] cache16_; }
 
-  ~ObservedPeakSet() { delete[] peaks_; delete[] cache_; }
+  // Share precursor removal and deisotoping results between the charge states
+  // of a spectrum. May be NULL, in which case they are recomputed each time.
+  void SetFilterCache(PeakFilterCache* filter_cache) {
+    filter_cache_ = filter_cache;
+  }
 
   const int* GetCache() const { return cache_; } //TODO 261: access restriction?
 
+  // The cache rounded to 16-bit entries, for the 16-bit scoring backends of
+  // peak_index.h: an int giving the shift s, then the entries as shorts,
+  // each the 32-bit entry divided by 2^s, to the nearest. s is the least that
+  // makes every entry fit, so a 16-bit dot product of n peaks, shifted back,
+  // is within n * 2^(s-1) of the 32-bit one. Made on the first call after
+  // each PreprocessSpectrum().
+  const int* GetCache16() const;
+
   // On-the-fly compilation takes the place of this call.
   int DotProd(const TheoreticalPeakArr& theoretical);
 #ifdef DEBUG
@@ -150,6 +189,35 @@ class ObservedPeakSet {
                           long int* num_isotopes_skipped,
                           long int* num_retained);
 
+  // The preprocessed spectrum, as an entry of a PreprocessedStore: the bin
+  // the spectrum was cut off at, the four counts of peaks that
+  // PreprocessSpectrum() added to (in its order), then the PeakMain column
+  // as runs of non-zero bins, each its first bin, its length and its values.
+  // The rest of the cache is computed from PeakMain.
+  void SavePreprocessed(const long int* counts, vector<int>* entry) const;
+
+  // In place of PreprocessSpectrum(), for a spectrum saved by
+  // SavePreprocessed() with the same parameters. Adds the saved counts.
+  void LoadPreprocessed(const int* entry, int size,
+                        long int* num_range_skipped,
+                        long int* num_precursors_skipped,
+                        long int* num_isotopes_skipped,
+                        long int* num_retained);
+
+  // How likely the preprocessed spectrum of a precursor of neutral_mass is
+  // to be identified, from 0 to 1: the mean of the fraction of
+  // kQualityPeaks bins that kept a peak (up to 1), one minus the Shannon
+  // entropy of the kept intensities over its largest value, the log of their
+  // number, and the fraction of the kept bins with a complementary one, as a singly
+  // charged b and y ion pair adds up to the precursor and two protons. Junk
+  // spectra keep few, flat, unrelated peaks. See min-spectrum-quality.
+  double Quality(double neutral_mass) const;
+  static const int kQualityPeaks = 50;
+
+  // The bins of the PeakMain column of the preprocessed spectrum that kept a
+  // peak, with their intensities, in bin order.
+  void MainPeaks(vector<pair<int, double> >* peaks) const;
+
   // For debugging
   void Show(const string& name, TheoreticalPeakType peak_type, bool cache_end) {
     int end = cache_end ? max_mz_.CacheBinEnd() : max_mz_.BackgroundBinEnd();
@@ -189,11 +257,58 @@ class ObservedPeakSet {
     // In context of this class, peak_type feels like the primary selector.
     return cache_[TheoreticalPeakPair(index, peak_type).Code()];
   }
+  void FilterPeaks(const Spectrum& spectrum, double mass_cut_off,
+                   vector<char>* filters) const;
+  void SubtractBackground(int end);
   void MakeInteger();
   void ComputeCache();
 
+  // The same steps for a spectrum with few peaks for the number of bins, as
+  // at high resolution: only the bins within reach of a peak are computed,
+  // with the same arithmetic in the same order, so the cache is the same and
+  // the cost goes with the peaks rather than the bins. peaks_ and cache_ are
+  // kept zero outside the intervals the last sparse spectrum wrote, which
+  // are cleared for the next one.
+  typedef vector<pair<int, int> > Intervals;
+  void ClearSparse();
+  void NormalizeRegionsSparse(int largest_mz, double highest_intensity);
+  void SubtractBackgroundSparse(int end);
+  void MakeIntegerSparse();
+  void ComputeCacheSparse();
+  static void MergeIntervals(Intervals* intervals);
+
   double* peaks_;
   int* cache_;
+  mutable int* cache16_;
+  mutable bool cache16_ready_;
+
+  // The extents of the global range that the last spectra may have left
+  // non-zero: cache_ past cache_dirty_end_ and cache16_ entries past
+  // cache16_dirty_end_ are zero, and peaks_ is clear past peaks_dirty_end_
+  // since the last time all of it was cleared. The programs may look up any
+  // entry of the global range, most of which a spectrum well below the
+  // highest m/z of the file has no reason to touch.
+  int cache_dirty_end_;
+  mutable int cache16_dirty_end_;
+  int peaks_dirty_end_;
+
+  // Preprocessing parameters, looked up once at construction.
+  bool skip_preprocessing_;
+  bool remove_precursor_;
+  double precursor_tolerance_;
+  double deisotope_threshold_;
+
+  int peaks_per_window_;
+  double peak_window_width_;
+
+  PeakFilterCache* filter_cache_;
+  vector<char> filters_;  // used when there is no filter_cache_
+  vector<double> partial_sums_;
+
+  bool sparse_clean_;       // peaks_ and cache_ are zero outside the intervals below
+  vector<int> peak_bins_;   // the bins of peaks_ the sparse steps filled
+  Intervals background_;    // bins of peaks_ and PeakMain with a peak in reach
+  Intervals cache_written_; // bins of cache_ ComputeCacheSparse() wrote
 
   bool NL_;
   bool FP_;
@@ -201,6 +316,7 @@ class ObservedPeakSet {
   double bin_offset_;
 
   MaxBin max_mz_;
+  int preprocessed_mz_;  // what max_mz_ was initialized with
   int cache_end_;
 
   friend class ObservedPeakTester;
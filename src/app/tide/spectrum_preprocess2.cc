@@ -22,6 +22,7 @@
 #include "spectrum_preprocess.h"
 #include "mass_constants.h"
 #include "max_mz.h"
+#include "util/Instrumentation.h"
 #include "util/mass.h"
 #include "util/Params.h"
 
@@ -32,53 +33,187 @@ DEFINE_int32(debug_spectrum_id, -1, "Spectrum number to debug");
 DEFINE_int32(debug_charge, 0, "Charge to debug. 0 for all");
 #endif
 
+void PeakFilterCache::Skip(const Spectrum& spectrum) {
+  map<const Spectrum*, Entry>::iterator i = entries_.find(&spectrum);
+  if (i != entries_.end() && ++i->second.uses == spectrum.NumChargeStates()) {
+    entries_.erase(i);
+  }
+}
+
+ObservedPeakSet::ObservedPeakSet(double bin_width, double bin_offset,
+                                 bool NL, bool FP)
+  : peaks_(new double[MaxBin::Global().BackgroundBinEnd()]),
+    cache_(new int[MaxBin::Global().CacheBinEnd()*NUM_PEAK_TYPES]),
+    cache16_(NULL),
+    cache16_ready_(false),
+    cache_dirty_end_(MaxBin::Global().CacheBinEnd()*NUM_PEAK_TYPES),
+    cache16_dirty_end_(0),
+    peaks_dirty_end_(MaxBin::Global().BackgroundBinEnd()),
+    skip_preprocessing_(Params::GetBool("skip-preprocessing")),
+    remove_precursor_(Params::GetBool("remove-precursor-peak")),
+    precursor_tolerance_(Params::GetDouble("remove-precursor-tolerance")),
+    deisotope_threshold_(Params::GetDouble("deisotope")),
+    peaks_per_window_(Params::GetInt("peaks-per-window")),
+    peak_window_width_(Params::GetDouble("peak-window-width")),
+    filter_cache_(NULL),
+    sparse_clean_(false) {
+  bin_width_  = bin_width;
+  bin_offset_ = bin_offset;
+  NL_ = NL; //NL means neutral loss
+  FP_ = FP; //FP means flanking peaks
+}
+
 // This computes that part of the XCORR function where an average value of the
 // peaks within a window surrounding each peak is subtracted from that peak.
 // This version is a linear-time implementation of the subtraction. Linearity is
 // accomplished by computing an array of partial sums.
-static void SubtractBackground(double* observed, int end) {
+void ObservedPeakSet::SubtractBackground(int end) {
   // operation is as follows: new_observed = observed -
   // average_within_window but average is computed as if the array
   // extended infinitely: denominator is same throughout array, even
   // near edges (where fewer elements have been summed)
   static const double multiplier = 1.0 / (MAX_XCORR_OFFSET * 2);
+  double* observed = peaks_;
 
   double total = 0;
-  vector<double> partial_sums(end+1);
+  partial_sums_.resize(end+1);
+  double* partial_sums = &partial_sums_[0];
   for (int i = 0; i < end; ++i)
     partial_sums[i] = (total += observed[i]);
   partial_sums[end] = total;
 
-  for (int i = 0; i < end; ++i) {
+  // The window is clipped at the ends of the array. Handling the clipped bins
+  // separately leaves a branch-free loop over the interior that the compiler
+  // can vectorize.
+  int interior_begin = min(end, MAX_XCORR_OFFSET + 1);
+  int interior_end = max(interior_begin, end - MAX_XCORR_OFFSET);
+  for (int i = 0; i < interior_begin; ++i) {
+    int right_index = min(end, i + MAX_XCORR_OFFSET);
+    observed[i] -= multiplier * (partial_sums[right_index] - partial_sums[0] - observed[i]);
+  }
+  for (int i = interior_begin; i < interior_end; ++i) {
+    observed[i] -= multiplier * (partial_sums[i + MAX_XCORR_OFFSET]
+                                 - partial_sums[i - MAX_XCORR_OFFSET - 1] - observed[i]);
+  }
+  for (int i = interior_end; i < end; ++i) {
     int right_index = min(end, i + MAX_XCORR_OFFSET);
     int left_index = max(0, i - MAX_XCORR_OFFSET - 1);
     observed[i] -= multiplier * (partial_sums[right_index] - partial_sums[left_index] - observed[i]);
   }
 }
 
+// Classify the peaks of spectrum below mass_cut_off as precursor peaks,
+// isotope peaks or retained peaks. None of this depends on the charge being
+// searched.
+void ObservedPeakSet::FilterPeaks(const Spectrum& spectrum, double mass_cut_off,
+                                  vector<char>* filters) const {
+  int max_charge = spectrum.MaxCharge();
+  filters->assign(spectrum.Size(), PeakFilterCache::PEAK_RETAINED);
+  for (int i = spectrum.Size() - 1; i >= 0; --i) {
+    double peak_location = spectrum.M_Z(i);
+    if (peak_location >= mass_cut_off) {
+      continue;
+    }
+
+    // Remove precursor peaks.
+    if (remove_precursor_ &&
+        spectrum.PrecursorDistance(peak_location) <= precursor_tolerance_ ) {
+      (*filters)[i] = PeakFilterCache::PEAK_PRECURSOR;
+      continue;
+    }
+
+    // Do Morpheus-style simple(-istic?) deisotoping.  "For each
+    // peak, lower m/z peaks are considered. If the reference peak
+    // lies where an expected peak would lie for a charge state from
+    // one to the charge state of the precursor, within mass
+    // tolerance, and is of lower abundance, the reference peak is
+    // considered to be an isotopic peak and removed."
+    if (deisotope_threshold_ != 0.0) {
+      double intensity = spectrum.Intensity(i);
+      for (int fragCharge = 1; fragCharge < max_charge; ++fragCharge) {
+        double isotopic_peak = peak_location - (ISOTOPE_SPACING / fragCharge);
+        double ppm_difference = ( peak_location * deisotope_threshold_ ) / 1e6;
+        double isotopic_intensity = spectrum.MaxPeakInRange(isotopic_peak - ppm_difference,
+                                                            isotopic_peak + ppm_difference);
+
+        if (intensity < isotopic_intensity) {
+          carp(CARP_DETAILED_DEBUG,
+               "Removing isotopic peak (%g, %g) because of peak in [%g, %g] with intensity %g.",
+               peak_location, intensity, isotopic_peak - ppm_difference,
+               isotopic_peak + ppm_difference, isotopic_intensity);
+          (*filters)[i] = PeakFilterCache::PEAK_ISOTOPE;
+          break;
+        }
+      }
+    }
+  }
+
+  // Ranked among all the peaks of each window, whatever the filters above
+  // made of them, so that the outcome does not depend on mass_cut_off.
+  if (peaks_per_window_ > 0) {
+    vector<pair<double, int> > window;
+    for (int i = 0; i < spectrum.Size(); ) {
+      int window_index = (int) (spectrum.M_Z(i) / peak_window_width_);
+      window.clear();
+      for (; i < spectrum.Size() &&
+             (int) (spectrum.M_Z(i) / peak_window_width_) == window_index; ++i) {
+        window.push_back(make_pair(-spectrum.Intensity(i), i));
+      }
+      if ((int) window.size() <= peaks_per_window_) {
+        continue;
+      }
+      sort(window.begin(), window.end());
+      for (size_t j = peaks_per_window_; j < window.size(); ++j) {
+        char& filter = (*filters)[window[j].second];
+        if (filter == PeakFilterCache::PEAK_RETAINED) {
+          filter = PeakFilterCache::PEAK_OUT_OF_TOP;
+        }
+      }
+    }
+  }
+}
+
 void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum, int charge,
                                          long int* num_range_skipped,
                                          long int* num_precursors_skipped,
                                          long int* num_isotopes_skipped,
                                          long int* num_retained) {
+  CRUX_TIME_STAGE(STAGE_PREPROCESS);
 #ifdef DEBUG
   bool debug = (FLAGS_debug_spectrum_id == spectrum.SpectrumNumber()
                 && (FLAGS_debug_charge == 0 || FLAGS_debug_charge == charge));
   if (debug)
     debug = true; // allows a breakpoint
 #endif
-  double precursor_mz = spectrum.PrecursorMZ();
+  // The charge states of a multiplexed spectrum that have the same charge
+  // share one preprocessed spectrum, made for the heaviest of them.
+  double precursor_mz = spectrum.HighestPrecursorMZ(charge);
   double experimental_mass_cut_off = (precursor_mz-MASS_PROTON)*charge+MASS_PROTON + 50;
   double max_peak_mz = spectrum.M_Z(spectrum.Size()-1);
 
   assert(MaxBin::Global().MaxBinEnd() > 0);
 
-  max_mz_.InitBin(min(experimental_mass_cut_off, max_peak_mz));
+  preprocessed_mz_ = (int) min(experimental_mass_cut_off, max_peak_mz);
+  max_mz_.InitBin(preprocessed_mz_);
   cache_end_ = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
 
-  memset(peaks_, 0, sizeof(double) * MaxBin::Global().BackgroundBinEnd());
+  // A spectrum whose peaks, with the bins in reach of them, are a small part
+  // of the bins takes the sparse steps; both give the same cache.
+  bool sparse = (long long) spectrum.Size() * (4 * MAX_XCORR_OFFSET + 2) <
+                MaxBin::Global().CacheBinEnd();
+  int background_end = min(max_mz_.BackgroundBinEnd(),
+                           MaxBin::Global().BackgroundBinEnd());
+  if (sparse) {
+    ClearSparse();
+  } else {
+    sparse_clean_ = false;
+    // Nothing past this spectrum's background range is read, so there is no
+    // need to clear the whole global range.
+    memset(peaks_, 0, sizeof(double) * background_end);
+  }
+  peaks_dirty_end_ = max(peaks_dirty_end_, background_end);
 
-  if (Params::GetBool("skip-preprocessing")) {
+  if (skip_preprocessing_) {
     for (int i = 0; i < spectrum.Size(); ++i) {
       double peak_location = spectrum.M_Z(i);
       if (peak_location >= experimental_mass_cut_off) {
@@ -87,14 +222,27 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum, int charge,
       int mz = MassConstants::mass2bin(peak_location);
       double intensity = spectrum.Intensity(i);
       if (intensity > peaks_[mz]) {
+        if (sparse && peaks_[mz] == 0) {
+          peak_bins_.push_back(mz);
+        }
         peaks_[mz] = intensity;
       }
     }
   } else {
-    bool remove_precursor = Params::GetBool("remove-precursor-peak");
-    double precursor_tolerance = Params::GetDouble("remove-precursor-tolerance");
-    double deisotope_threshold = Params::GetDouble("deisotope");
-    int max_charge = spectrum.MaxCharge();
+    // With a cache, filter every peak any charge state of the spectrum could
+    // use, so the result can be reused for the other charge states.
+    const vector<char>* filters = &filters_;
+    PeakFilterCache::Entry* cached = NULL;
+    if (filter_cache_ != NULL && spectrum.NumChargeStates() > 1) {
+      cached = &filter_cache_->entries_[&spectrum];
+      if (cached->uses++ == 0) {
+        double max_cut_off = spectrum.HighestPrecursorMass()+MASS_PROTON + 50;
+        FilterPeaks(spectrum, max(max_cut_off, experimental_mass_cut_off), &cached->filters);
+      }
+      filters = &cached->filters;
+    } else {
+      FilterPeaks(spectrum, experimental_mass_cut_off, &filters_);
+    }
 
     // Fill peaks
     int largest_mz = 0;
@@ -107,48 +255,19 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum, int charge,
         (*num_range_skipped)++;
         continue;
       }
-
-      // Remove precursor peaks.
-      if (remove_precursor &&
-          fabs(peak_location - precursor_mz) <= precursor_tolerance ) {
+      switch ((*filters)[i]) {
+      case PeakFilterCache::PEAK_PRECURSOR:
         (*num_precursors_skipped)++;
         continue;
-      }
-
-      // Do Morpheus-style simple(-istic?) deisotoping.  "For each
-      // peak, lower m/z peaks are considered. If the reference peak
-      // lies where an expected peak would lie for a charge state from
-      // one to the charge state of the precursor, within mass
-      // tolerance, and is of lower abundance, the reference peak is
-      // considered to be an isotopic peak and removed."
-      double intensity = spectrum.Intensity(i);
-
-      bool skip_peak = false;
-      if (deisotope_threshold != 0.0) {
-        for (int fragCharge = 1; fragCharge < max_charge; ++fragCharge) {
-          double isotopic_peak = peak_location - (ISOTOPE_SPACING / fragCharge);
-          double ppm_difference = ( peak_location * deisotope_threshold ) / 1e6;
-          double isotopic_intensity = spectrum.MaxPeakInRange(isotopic_peak - ppm_difference,
-                                                              isotopic_peak + ppm_difference);
-        
-          if (intensity < isotopic_intensity) {
-            carp(CARP_DETAILED_DEBUG,
-                 "Removing isotopic peak (%g, %g) because of peak in [%g, %g] with intensity %g.",
-                 peak_location, intensity, isotopic_peak - ppm_difference,
-                 isotopic_peak + ppm_difference, isotopic_intensity);
-            skip_peak = true;
-            break;
-          }
-        }
-      }
-
-      if (skip_peak) {
+      case PeakFilterCache::PEAK_ISOTOPE:
         (*num_isotopes_skipped)++;
         continue;
-      } else {
-        (*num_retained)++;
+      case PeakFilterCache::PEAK_OUT_OF_TOP:
+        continue;
       }
+      (*num_retained)++;
 
+      double intensity = spectrum.Intensity(i);
       int mz = MassConstants::mass2bin(peak_location);
       if ((mz > largest_mz) && (intensity > 0)) {
         largest_mz = mz;
@@ -159,36 +278,42 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum, int charge,
         highest_intensity = intensity;
       }
       if (intensity > peaks_[mz]) {
+        if (sparse && peaks_[mz] == 0) {
+          peak_bins_.push_back(mz);
+        }
         peaks_[mz] = intensity;
       }
     }
+    // Once every charge state has been through here the filters are not
+    // needed again.
+    if (cached != NULL && cached->uses == spectrum.NumChargeStates()) {
+      filter_cache_->entries_.erase(&spectrum);
+    }
 
     double intensity_cutoff = highest_intensity * 0.05;
 
-    double normalizer = 0.0;
+    if (sparse) {
+      NormalizeRegionsSparse(largest_mz, intensity_cutoff);
+    }
+    // The loops below are written without branches so that the compiler can
+    // vectorize them. Intensities are non-negative, so scaling the zeroed
+    // bins along with the rest leaves them zero.
     int region_size = largest_mz / NUM_SPECTRUM_REGIONS + 1;
-    for (int i = 0; i < NUM_SPECTRUM_REGIONS; ++i) {
+    for (int i = 0; i < NUM_SPECTRUM_REGIONS && !sparse; ++i) {
+      double* region = peaks_ + i * region_size;
       highest_intensity = 0;
-      int high_index = i;
       for (int j = 0; j < region_size; ++j) {
-        int index = i * region_size + j;
-        if (peaks_[index] <= intensity_cutoff) {
-          peaks_[index] = 0;
-        }
-        if (peaks_[index] > highest_intensity) {
-          highest_intensity = peaks_[index];
-          high_index = index;
-        }
+        region[j] = region[j] > intensity_cutoff ? region[j] : 0;
+      }
+      for (int j = 0; j < region_size; ++j) {
+        highest_intensity = max(highest_intensity, region[j]);
       }
       if (highest_intensity == 0) {
         continue;
       }
-      normalizer = 50.0 / highest_intensity;
+      double normalizer = 50.0 / highest_intensity;
       for (int j = 0; j < region_size; ++j) {
-        int index = i * region_size + j;
-        if (peaks_[index] != 0) {
-          peaks_[index] *= normalizer;
-        }
+        region[j] *= normalizer;
       }
     }
 
@@ -203,79 +328,461 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum, int charge,
     }
 #endif
   }
-  SubtractBackground(peaks_, max_mz_.BackgroundBinEnd());
+  if (sparse) {
+    SubtractBackgroundSparse(max_mz_.BackgroundBinEnd());
+  } else {
+    SubtractBackground(max_mz_.BackgroundBinEnd());
+  }
 
 #ifdef DEBUG
   if (debug)
     ShowPeaks();
 #endif
-  MakeInteger();
-  ComputeCache();
+  if (sparse) {
+    MakeIntegerSparse();
+    ComputeCacheSparse();
+  } else {
+    MakeInteger();
+    ComputeCache();
+  }
+  cache_dirty_end_ = min(cache_end_, max_mz_.CacheBinEnd() * NUM_PEAK_TYPES);
+  cache16_ready_ = false;
 #ifdef DEBUG
   if (debug)
     ShowCache();
 #endif
 }
 
+void ObservedPeakSet::SavePreprocessed(const long int* counts,
+                                       vector<int>* entry) const {
+  entry->clear();
+  entry->push_back(preprocessed_mz_);
+  for (int i = 0; i < 4; ++i) {
+    entry->push_back(counts[i]);
+  }
+  const int end = max_mz_.BackgroundBinEnd();
+  const int* peak_main = cache_ + PeakMain;
+  int i = 0;
+  while (i < end) {
+    if (peak_main[i * NUM_PEAK_TYPES] == 0) {
+      ++i;
+      continue;
+    }
+    int start = i;
+    while (i < end && peak_main[i * NUM_PEAK_TYPES] != 0) {
+      ++i;
+    }
+    entry->push_back(start);
+    entry->push_back(i - start);
+    for (int j = start; j < i; ++j) {
+      entry->push_back(peak_main[j * NUM_PEAK_TYPES]);
+    }
+  }
+}
+
+void ObservedPeakSet::LoadPreprocessed(const int* entry, int size,
+                                       long int* num_range_skipped,
+                                       long int* num_precursors_skipped,
+                                       long int* num_isotopes_skipped,
+                                       long int* num_retained) {
+  CRUX_TIME_STAGE(STAGE_PREPROCESS);
+  if (size < 5) {
+    carp(CARP_FATAL, "Corrupt entry in the store of preprocessed spectra.");
+  }
+  preprocessed_mz_ = entry[0];
+  max_mz_.InitBin(preprocessed_mz_);
+  cache_end_ = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+  *num_range_skipped += entry[1];
+  *num_precursors_skipped += entry[2];
+  *num_isotopes_skipped += entry[3];
+  *num_retained += entry[4];
+
+  // peaks_ is left as it was, so the next sparse spectrum clears all of it.
+  sparse_clean_ = false;
+  const int end = max_mz_.BackgroundBinEnd();
+  int* peak_main = cache_ + PeakMain;
+  for (int i = 0; i < end; ++i) {
+    peak_main[i * NUM_PEAK_TYPES] = 0;
+  }
+  for (int i = 5; i < size; ) {
+    int start = entry[i];
+    int length = i + 1 < size ? entry[i + 1] : -1;
+    if (start < 0 || length < 0 || start + length > end ||
+        i + 2 + length > size) {
+      carp(CARP_FATAL, "Corrupt entry in the store of preprocessed spectra.");
+    }
+    for (int j = 0; j < length; ++j) {
+      peak_main[(start + j) * NUM_PEAK_TYPES] = entry[i + 2 + j];
+    }
+    i += 2 + length;
+  }
+  ComputeCache();
+  cache_dirty_end_ = min(cache_end_, max_mz_.CacheBinEnd() * NUM_PEAK_TYPES);
+  cache16_ready_ = false;
+}
+
+double ObservedPeakSet::Quality(double neutral_mass) const {
+  const int end = max_mz_.BackgroundBinEnd();
+  const int* peak_main = cache_ + PeakMain;
+  int num_peaks = 0;
+  double total = 0;
+  for (int i = 0; i < end; ++i) {
+    int intensity = peak_main[i * NUM_PEAK_TYPES];
+    if (intensity > 0) {
+      ++num_peaks;
+      total += intensity;
+    }
+  }
+  if (num_peaks < 2) {
+    return 0;
+  }
+  double entropy = 0;
+  int complemented = 0;
+  // Within a bin either way, for the rounding of both ions
+  const int sum = MassConstants::mass2bin(neutral_mass + 2 * MASS_PROTON);
+  for (int i = 0; i < end; ++i) {
+    int intensity = peak_main[i * NUM_PEAK_TYPES];
+    if (intensity <= 0) {
+      continue;
+    }
+    double p = intensity / total;
+    entropy -= p * log(p);
+    for (int j = max(sum - i - 1, 0); j <= sum - i + 1 && j < end; ++j) {
+      if (j != i && peak_main[j * NUM_PEAK_TYPES] > 0) {
+        ++complemented;
+        break;
+      }
+    }
+  }
+  double peaks = min(1.0, (double) num_peaks / kQualityPeaks);
+  double spread = entropy / log((double) num_peaks);
+  return (peaks + (1 - spread) + (double) complemented / num_peaks) / 3;
+}
+
+void ObservedPeakSet::MainPeaks(vector<pair<int, double> >* peaks) const {
+  const int end = max_mz_.BackgroundBinEnd();
+  const int* peak_main = cache_ + PeakMain;
+  peaks->clear();
+  for (int i = 0; i < end; ++i) {
+    int intensity = peak_main[i * NUM_PEAK_TYPES];
+    if (intensity > 0) {
+      peaks->push_back(make_pair(i, (double) intensity));
+    }
+  }
+}
+
+const int* ObservedPeakSet::GetCache16() const {
+  if (cache16_ready_) {
+    return cache16_;
+  }
+  if (cache16_ == NULL) {
+    // Room for the shift, the entries, and the two bytes past the last entry
+    // that a 32-bit gather of it reads (see PeakIndexScorer::DotAVX2_16()).
+    cache16_ = new int[1 + (cache_end_ + 2) / 2 + 1];
+    cache16_dirty_end_ = cache_end_ + 1;
+  }
+  // Past cache_dirty_end_ both caches are zero, up to what the last call
+  // left in this one.
+  long long largest = 0;
+  for (int i = 0; i < cache_dirty_end_; ++i) {
+    largest = max(largest, (long long) abs(cache_[i]));
+  }
+  int shift = 0;
+  while (((largest + (shift > 0 ? 1LL << (shift - 1) : 0)) >> shift) > 32767) {
+    ++shift;
+  }
+  long long half = shift > 0 ? 1LL << (shift - 1) : 0;
+  cache16_[0] = shift;
+  short* entries = (short*) (cache16_ + 1);
+  for (int i = 0; i < cache_dirty_end_; ++i) {
+    entries[i] = (short) ((cache_[i] + half) >> shift);
+  }
+  for (int i = cache_dirty_end_; i < cache16_dirty_end_; ++i) {
+    entries[i] = 0;
+  }
+  cache16_dirty_end_ = cache_dirty_end_;
+  cache16_ready_ = true;
+  return cache16_;
+}
+
 inline int round_to_int(double x) {
-  if (x >= 0)
-    return int(x + 0.5);
-  return int(x - 0.5);
+  return x >= 0 ? int(x + 0.5) : int(x - 0.5);
 }
 
 void ObservedPeakSet::MakeInteger() {
   // essentially cheap fixed-point arithmetic for peak intensities
-  for(int i = 0; i < max_mz_.BackgroundBinEnd(); i++)
-    Peak(PeakMain, i) = round_to_int(peaks_[i]*50000);
+  int end = max_mz_.BackgroundBinEnd();
+  int* peak_main = cache_ + PeakMain;
+  for (int i = 0; i < end; i++)
+    peak_main[i * NUM_PEAK_TYPES] = round_to_int(peaks_[i]*50000);
 }
 
 // See .h file. Computes and stores all transformations of the observed peak
 // set.
+//
+// Each transformation is built in its own loop over the bins, with the bins
+// at either end that lack a neighbor handled by the loop bounds rather than
+// by tests inside the loop. The sums are integer, so the order in which the
+// terms are added does not matter.
 void ObservedPeakSet::ComputeCache() {
-  for (int i = 0; i < max_mz_.BackgroundBinEnd(); ++i) {
+  const int background_end = max_mz_.BackgroundBinEnd();
+  const int end = max_mz_.CacheBinEnd();
+  int* peak_main = cache_ + PeakMain;
+  int* loss = cache_ + LossPeak;
+  int* flanking = cache_ + FlankingPeak;
+  int* primary = cache_ + PrimaryPeak;
+  int* b1 = cache_ + PeakCombinedB1;
+  int* y1 = cache_ + PeakCombinedY1;
+  int* b2 = cache_ + PeakCombinedB2;
+  int* y2 = cache_ + PeakCombinedY2;
+
+  for (int i = 0; i < background_end; ++i) {
     // Instead of computing 10 * x, 25 * x, and 50 * x, we compute 2 *
     // x, 5 * x and 10 * x. This results in dot products that are 5
     // times too small, but the adjustments can be made at the last
     // moment e.g. when results are displayed. These smaller
     // multiplications allow us to use addition operations instead of
     // multiplications.
-    int x = Peak(PeakMain, i);
+    int x = peak_main[i * NUM_PEAK_TYPES];
     int y = x+x;
-    Peak(LossPeak, i) = y;
+    loss[i * NUM_PEAK_TYPES] = y;
     int z = y+y+x;
-    Peak(FlankingPeak, i) = z;
-    Peak(PrimaryPeak, i) = z+z;
+    flanking[i * NUM_PEAK_TYPES] = z;
+    primary[i * NUM_PEAK_TYPES] = z+z;
   }
 
-  for (int i = max_mz_.BackgroundBinEnd() * NUM_PEAK_TYPES; i < cache_end_; ++i) {
+  // Past what the last spectrum wrote the cache is zero already.
+  const int zero_end = max(min(cache_end_, end * NUM_PEAK_TYPES), cache_dirty_end_);
+  for (int i = background_end * NUM_PEAK_TYPES; i < zero_end; ++i) {
     cache_[i] = 0;
   }
 
-  for (int i = 0; i < max_mz_.CacheBinEnd(); ++i) {
-    int flanks = Peak(PrimaryPeak, i);
-    if ( FP_ == true) {
-        if (i > 0) {
-          flanks += Peak(FlankingPeak, i-1);
+  // Charge 2 ions: the primary peak and its flanks.
+  for (int i = 0; i < end; ++i) {
+    y2[i * NUM_PEAK_TYPES] = primary[i * NUM_PEAK_TYPES];
+  }
+  if (FP_ == true) {
+    for (int i = 1; i < end; ++i) {
+      y2[i * NUM_PEAK_TYPES] += flanking[(i - 1) * NUM_PEAK_TYPES];
+    }
+    for (int i = 0; i < end - 1; ++i) {
+      y2[i * NUM_PEAK_TYPES] += flanking[(i + 1) * NUM_PEAK_TYPES];
+    }
+  }
+  for (int i = 0; i < end; ++i) {
+    int flanks = y2[i * NUM_PEAK_TYPES];
+    b2[i * NUM_PEAK_TYPES] = flanks;
+    y1[i * NUM_PEAK_TYPES] = flanks;
+  }
+
+  // Charge 1 ions add the neutral losses.
+  if (NL_ == true) {
+    const int bin_nh3 = (int)MassConstants::BIN_NH3;
+    const int bin_h2o = (int)MassConstants::BIN_H2O;
+    for (int i = bin_nh3 + 1; i < end; ++i) {
+      y1[i * NUM_PEAK_TYPES] += loss[(i - bin_nh3) * NUM_PEAK_TYPES];
+    }
+    for (int i = bin_h2o + 1; i < end; ++i) {
+      y1[i * NUM_PEAK_TYPES] += loss[(i - bin_h2o) * NUM_PEAK_TYPES];
+    }
+  }
+  for (int i = 0; i < end; ++i) {
+    b1[i * NUM_PEAK_TYPES] = y1[i * NUM_PEAK_TYPES];
+  }
+}
+
+void ObservedPeakSet::ClearSparse() {
+  if (!sparse_clean_) {
+    // After the dense steps anything may be left up to the dirty ends
+    memset(peaks_, 0, sizeof(double) * peaks_dirty_end_);
+    memset(cache_, 0, sizeof(int) * cache_dirty_end_);
+    peaks_dirty_end_ = 0;
+    sparse_clean_ = true;
+  } else {
+    for (vector<int>::const_iterator i = peak_bins_.begin(); i != peak_bins_.end(); ++i) {
+      peaks_[*i] = 0;
+    }
+    for (Intervals::const_iterator i = background_.begin(); i != background_.end(); ++i) {
+      memset(peaks_ + i->first, 0, sizeof(double) * (i->second - i->first));
+    }
+    for (Intervals::const_iterator i = cache_written_.begin(); i != cache_written_.end(); ++i) {
+      memset(cache_ + i->first * NUM_PEAK_TYPES, 0,
+             sizeof(int) * (i->second - i->first) * NUM_PEAK_TYPES);
+    }
+  }
+  peak_bins_.clear();
+  background_.clear();
+  cache_written_.clear();
+}
+
+// As the region loops of PreprocessSpectrum(), over the filled bins only.
+void ObservedPeakSet::NormalizeRegionsSparse(int largest_mz, double intensity_cutoff) {
+  int region_size = largest_mz / NUM_SPECTRUM_REGIONS + 1;
+  double highest_intensity[NUM_SPECTRUM_REGIONS];
+  for (int i = 0; i < NUM_SPECTRUM_REGIONS; ++i) {
+    highest_intensity[i] = 0;
+  }
+  for (vector<int>::const_iterator i = peak_bins_.begin(); i != peak_bins_.end(); ++i) {
+    int region = *i / region_size;
+    if (region < NUM_SPECTRUM_REGIONS) {
+      double& peak = peaks_[*i];
+      peak = peak > intensity_cutoff ? peak : 0;
+      highest_intensity[region] = max(highest_intensity[region], peak);
+    }
+  }
+  for (vector<int>::const_iterator i = peak_bins_.begin(); i != peak_bins_.end(); ++i) {
+    int region = *i / region_size;
+    if (region < NUM_SPECTRUM_REGIONS && highest_intensity[region] != 0) {
+      double normalizer = 50.0 / highest_intensity[region];
+      peaks_[*i] *= normalizer;
+    }
+  }
+}
+
+// As SubtractBackground(), for the bins within MAX_XCORR_OFFSET of a peak;
+// the rest stay zero, as they come out there. The partial sums only change
+// at the peaks, and adding the zeros between them changes nothing, so the
+// partial sum at any bin is the sum of the peaks up to it, added in order.
+void ObservedPeakSet::SubtractBackgroundSparse(int end) {
+  static const double multiplier = 1.0 / (MAX_XCORR_OFFSET * 2);
+  double* observed = peaks_;
+
+  sort(peak_bins_.begin(), peak_bins_.end());
+  vector<int> bins;
+  double total = 0;
+  partial_sums_.clear();
+  for (vector<int>::const_iterator i = peak_bins_.begin(); i != peak_bins_.end(); ++i) {
+    if (*i < end && observed[*i] != 0) {
+      bins.push_back(*i);
+      partial_sums_.push_back(total += observed[*i]);
+      int begin = max(0, *i - MAX_XCORR_OFFSET);
+      int stop = min(end, *i + MAX_XCORR_OFFSET + 1);
+      if (!background_.empty() && begin <= background_.back().second) {
+        background_.back().second = stop;
+      } else {
+        background_.push_back(make_pair(begin, stop));
+      }
+    }
+  }
+
+  int interior_begin = min(end, MAX_XCORR_OFFSET + 1);
+  int interior_end = max(interior_begin, end - MAX_XCORR_OFFSET);
+  for (Intervals::const_iterator interval = background_.begin();
+       interval != background_.end(); ++interval) {
+    for (int i = interval->first; i < interval->second; ++i) {
+      int right_index, left_index;
+      if (i < interior_begin) {
+        right_index = min(end, i + MAX_XCORR_OFFSET);
+        left_index = 0;
+      } else if (i < interior_end) {
+        right_index = i + MAX_XCORR_OFFSET;
+        left_index = i - MAX_XCORR_OFFSET - 1;
+      } else {
+        right_index = min(end, i + MAX_XCORR_OFFSET);
+        left_index = max(0, i - MAX_XCORR_OFFSET - 1);
+      }
+      int right = upper_bound(bins.begin(), bins.end(), right_index) - bins.begin();
+      int left = upper_bound(bins.begin(), bins.end(), left_index) - bins.begin();
+      double right_sum = right > 0 ? partial_sums_[right - 1] : 0;
+      double left_sum = left > 0 ? partial_sums_[left - 1] : 0;
+      observed[i] -= multiplier * (right_sum - left_sum - observed[i]);
+    }
+  }
+}
+
+void ObservedPeakSet::MakeIntegerSparse() {
+  int* peak_main = cache_ + PeakMain;
+  for (Intervals::const_iterator interval = background_.begin();
+       interval != background_.end(); ++interval) {
+    for (int i = interval->first; i < interval->second; i++)
+      peak_main[i * NUM_PEAK_TYPES] = round_to_int(peaks_[i]*50000);
+  }
+}
+
+void ObservedPeakSet::MergeIntervals(Intervals* intervals) {
+  sort(intervals->begin(), intervals->end());
+  size_t merged = 0;
+  for (size_t i = 1; i < intervals->size(); ++i) {
+    if ((*intervals)[i].first <= (*intervals)[merged].second) {
+      (*intervals)[merged].second = max((*intervals)[merged].second, (*intervals)[i].second);
+    } else {
+      (*intervals)[++merged] = (*intervals)[i];
+    }
+  }
+  if (!intervals->empty()) {
+    intervals->resize(merged + 1);
+  }
+}
+
+// As ComputeCache(), over the bins each transformation can reach from the
+// background_ bins: those themselves, their neighbors (flanking peaks), and
+// the bins a neutral loss away. Everything else is zero already.
+void ObservedPeakSet::ComputeCacheSparse() {
+  const int end = max_mz_.CacheBinEnd();
+  int* peak_main = cache_ + PeakMain;
+  int* loss = cache_ + LossPeak;
+  int* flanking = cache_ + FlankingPeak;
+  int* primary = cache_ + PrimaryPeak;
+  int* b1 = cache_ + PeakCombinedB1;
+  int* y1 = cache_ + PeakCombinedY1;
+  int* b2 = cache_ + PeakCombinedB2;
+  int* y2 = cache_ + PeakCombinedY2;
+  const int bin_nh3 = (int)MassConstants::BIN_NH3;
+  const int bin_h2o = (int)MassConstants::BIN_H2O;
+
+  Intervals charge2, charge1;
+  for (Intervals::const_iterator i = background_.begin(); i != background_.end(); ++i) {
+    for (int j = i->first; j < i->second; ++j) {
+      int x = peak_main[j * NUM_PEAK_TYPES];
+      int y = x+x;
+      loss[j * NUM_PEAK_TYPES] = y;
+      int z = y+y+x;
+      flanking[j * NUM_PEAK_TYPES] = z;
+      primary[j * NUM_PEAK_TYPES] = z+z;
+    }
+    charge2.push_back(make_pair(max(0, i->first - 1), min(end, i->second + 1)));
+    if (NL_ == true) {
+      charge1.push_back(make_pair(min(end, i->first + bin_nh3), min(end, i->second + bin_nh3)));
+      charge1.push_back(make_pair(min(end, i->first + bin_h2o), min(end, i->second + bin_h2o)));
+    }
+  }
+  MergeIntervals(&charge2);
+  charge1.insert(charge1.end(), charge2.begin(), charge2.end());
+  MergeIntervals(&charge1);
+
+  // Charge 2 ions: the primary peak and its flanks.
+  for (Intervals::const_iterator i = charge2.begin(); i != charge2.end(); ++i) {
+    for (int j = i->first; j < i->second; ++j) {
+      y2[j * NUM_PEAK_TYPES] = primary[j * NUM_PEAK_TYPES];
+      if (FP_ == true) {
+        if (j >= 1) {
+          y2[j * NUM_PEAK_TYPES] += flanking[(j - 1) * NUM_PEAK_TYPES];
         }
-        if (i < max_mz_.CacheBinEnd() - 1) {
-          flanks += Peak(FlankingPeak, i+1);
+        if (j < end - 1) {
+          y2[j * NUM_PEAK_TYPES] += flanking[(j + 1) * NUM_PEAK_TYPES];
         }
+      }
     }
-    int Y1 = flanks;
-    if ( NL_ == true) {
-        if (i > MassConstants::BIN_NH3) {
-          Y1 += Peak(LossPeak, i-MassConstants::BIN_NH3);
+  }
+
+  // Charge 1 ions add the neutral losses.
+  for (Intervals::const_iterator i = charge1.begin(); i != charge1.end(); ++i) {
+    for (int j = i->first; j < i->second; ++j) {
+      int flanks = y2[j * NUM_PEAK_TYPES];
+      b2[j * NUM_PEAK_TYPES] = flanks;
+      if (NL_ == true) {
+        if (j >= bin_nh3 + 1) {
+          flanks += loss[(j - bin_nh3) * NUM_PEAK_TYPES];
         }
-        if (i > MassConstants::BIN_H2O) {
-          Y1 += Peak(LossPeak, i-MassConstants::BIN_H2O);
+        if (j >= bin_h2o + 1) {
+          flanks += loss[(j - bin_h2o) * NUM_PEAK_TYPES];
         }
+      }
+      y1[j * NUM_PEAK_TYPES] = flanks;
+      b1[j * NUM_PEAK_TYPES] = flanks;
     }
-    Peak(PeakCombinedY1, i) = Y1;
-    int B1 = Y1;
-    Peak(PeakCombinedB1, i) = B1;
-    Peak(PeakCombinedY2, i) = flanks;
-    Peak(PeakCombinedB2, i) = flanks;
   }
+  cache_written_.swap(charge1);
 }
 
 // This dot product is replaced by calls to on-the-fly compiled code.
@@ -88,6 +88,7 @@
 
 #include <iostream>
 #include <algorithm>
+#include <vector>
 #include "mass_constants.h"
 //#include "peptide.h"
 #include "peptides.pb.h"
@@ -443,7 +444,7 @@ DECLARE_bool(dups_ok);
 // for each Y ion of charge 2.
 class TheoreticalPeakSetBYSparse : public TheoreticalPeakSet {
  public:
-  explicit TheoreticalPeakSetBYSparse(int capacity) {
+  explicit TheoreticalPeakSetBYSparse(int capacity) : generation_(0) {
     peaks_[0].Init(capacity);
     peaks_[1].Init(capacity);
   }
@@ -500,6 +501,45 @@ class TheoreticalPeakSetBYSparse : public TheoreticalPeakSet {
       AddPeakUnordered(&peaks_[charge-1], index_b, series, &peaks_[charge-2]);
   }
 
+  // Add all the B and Y ions of a peptide with residue masses aa_masses, as
+  // Peptide::AddIons() would with AddBIon() and AddYIon(), up to max_peak
+  // for charge 1. Peptides next to each other in the active window often
+  // differ only at one end (mods, or a missed cleavage), so the ion masses
+  // and bins of the previous peptide added this way are kept: the B ions of
+  // the residue masses both peptides start with, and the Y ions of those
+  // they end with, are not recomputed.
+  //
+  // Targets and decoys keep apart what they keep. A decoy in the window sits
+  // next to its target but shares only its termini with it, while the
+  // targets on either side of it, and their decoys, often share much more,
+  // so decoy is whether the peptide is a decoy.
+  void AddIons(const vector<double>& aa_masses, double max_peak,
+               bool decoy = false) {
+    LastPeptide& last = last_[decoy ? 1 : 0];
+    int len = aa_masses.size();
+    int last_len = last.masses.size();
+    int prefix = 0, suffix = 0;
+    while (prefix < len && prefix < last_len &&
+           aa_masses[prefix] == last.masses[prefix])
+      ++prefix;
+    while (suffix < len && suffix < last_len &&
+           aa_masses[len - 1 - suffix] == last.masses[last_len - 1 - suffix])
+      ++suffix;
+    last.b_ions.Update(aa_masses, min(prefix, last_len - 1), false);
+    last.y_ions.Update(aa_masses, min(suffix, last_len - 1), true);
+    last.masses = aa_masses;
+
+    if (++generation_ == 0) {
+      fill(added_.begin(), added_.end(), 0);
+      generation_ = 1;
+    }
+    AddLadder<1>(&last.b_ions, PeakCombinedB1, MassConstants::B, max_peak);
+    AddLadder<1>(&last.y_ions, PeakCombinedY1, MassConstants::Y, max_peak);
+    max_peak = max_peak*2 + 2;  // adjust for larger charge
+    AddLadder<2>(&last.b_ions, PeakCombinedB2, MassConstants::B, max_peak);
+    AddLadder<2>(&last.y_ions, PeakCombinedY2, MassConstants::Y, max_peak);
+  }
+
   // Faster interface needing no copying at all.
   const TheoreticalPeakArr* GetPeaks() const { return peaks_; }
 
@@ -523,7 +563,64 @@ class TheoreticalPeakSetBYSparse : public TheoreticalPeakSet {
   }
 
  private:
+  // The B (or Y) ion ladder of the last peptide given to AddIons(): the
+  // mass of the ion of k+1 residues from the N (or C) terminus in sums[k],
+  // and its bin for charge c in bins[c-1][k], or -1 until needed.
+  struct IonLadder {
+    vector<double> sums;
+    vector<int> bins[2];
+
+    // Recompute the ions after the first keep for residue masses aa_masses,
+    // read from the C terminus if reverse.
+    void Update(const vector<double>& aa_masses, int keep, bool reverse) {
+      int len = aa_masses.size();
+      int ions = len - 1;
+      if (keep < 0)
+        keep = 0;
+      sums.resize(ions);
+      bins[0].resize(ions);
+      bins[1].resize(ions);
+      for (int k = keep; k < ions; ++k) {
+        double residue = aa_masses[reverse ? len - 1 - k : k];
+        sums[k] = k == 0 ? residue : sums[k - 1] + residue;
+        bins[0][k] = bins[1][k] = -1;
+      }
+    }
+  };
+
+  // Add the ions of ladder up to the first heavier than max_peak, skipping
+  // any bin already taken by a peak of either charge, as AddPeakUnordered()
+  // does. The charge is a template parameter so that the loop is compiled
+  // for each charge with no tests of it.
+  template<int charge>
+  void AddLadder(IonLadder* ladder, TheoreticalPeakType series,
+                 double offset, double max_peak) {
+    vector<int>& bins = ladder->bins[charge - 1];
+    for (size_t k = 0; k < ladder->sums.size() && ladder->sums[k] <= max_peak; ++k) {
+      if (bins[k] < 0)
+        bins[k] = MassConstants::mass2bin(ladder->sums[k] + offset + MASS_PROTON, charge);
+      int bin = bins[k];
+      if (bin >= (int)added_.size())
+        added_.resize(bin + 1, 0);
+      if (added_[bin] == generation_)
+        continue;
+      added_[bin] = generation_;
+      peaks_[charge - 1].push_back(TheoreticalPeakPair(bin, series));
+    }
+  }
+
   TheoreticalPeakArr peaks_[2];
+
+  // State kept by AddIons() from one peptide to the next: the residue masses
+  // of the last target (and decoy) and its ions.
+  struct LastPeptide {
+    vector<double> masses;
+    IonLadder b_ions, y_ions;
+  };
+  LastPeptide last_[2];
+  // added_[bin] == generation_ if the current peptide has a peak in bin.
+  vector<unsigned int> added_;
+  unsigned int generation_;
 };
 
 // Subclass of TheoreticalPeakSet similar to TheoreticalPeakSetBYSparse 
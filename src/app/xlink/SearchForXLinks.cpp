@@ -251,6 +251,7 @@ vector<string> SearchForXLinks::getOptions() const {
     "spectrum-parser",
     "use-z-line",
     "top-match",
+    "num-threads",
     "print-search-progress",
     "output-dir",
     "overwrite",
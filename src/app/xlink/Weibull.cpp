@@ -1,4 +1,6 @@
 #include "Weibull.h"
+#include <algorithm>
+#include <functional>
 #include "util/crux-utils.h"
 #include "util/GlobalParams.h"
 #include "model/Scorer.h"
@@ -69,12 +71,16 @@ bool Weibull::fit() {
   carp(CARP_DEBUG, "There were %i dups detected during insert", duplicates_);
   
     
-  sort(scores_.begin(), scores_.end(), greater<FLOAT_T>());
   int num_tail_samples = (int)(nscores * GlobalParams::getFractionToFit());
   carp(CARP_DEBUG, "num tail:%d", num_tail_samples);
+
+  // Only the tail and the 30th score are needed in order
+  int num_sorted = min(nscores, max(num_tail_samples, 30));
+  partial_sort(scores_.begin(), scores_.begin() + num_sorted, scores_.end(),
+               greater<FLOAT_T>());
   
   FLOAT_T max_score = scores_[0];
-  FLOAT_T min_score = scores_[nscores-1];
+  FLOAT_T min_score = *min_element(scores_.begin(), scores_.end());
   
   FLOAT_T xcorr_shift = XCORR_SHIFT * (max_score - min_score) / XCORR_RANGE;
   
@@ -111,8 +117,8 @@ bool Weibull::fit() {
         correlation_,
         nscores,
         num_tail_samples,
-        scores_[nscores-1],
-        scores_[0],
+        min_score,
+        max_score,
         min_shift,
         max_shift
       );
@@ -166,10 +172,12 @@ FLOAT_T Weibull::getECDFPValue(FLOAT_T score, bool logp) {
   if (score > scores_[0]) {
     pvalue = 1.0 / (1.0 + (FLOAT_T)scores_.size());
   } else {
-    //TODO, use upper/lower bound?
+    // scores_ is only sorted at the top, so count the scores at least as high
     int idx = 0;
-    while(idx < scores_.size() && score <= scores_[idx]) {
+    for (vector<FLOAT_T>::const_iterator iter = scores_.begin(); iter != scores_.end(); ++iter) {
+      if (score <= *iter) {
         idx++;
+      }
     }
     pvalue = (FLOAT_T)idx / (FLOAT_T)scores_.size();
   }
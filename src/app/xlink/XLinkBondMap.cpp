@@ -16,7 +16,7 @@ using namespace Crux;
  * Default constructor.
  */
 XLinkBondMap::XLinkBondMap() {
-  ;
+  initMasks();
 }
 
 /**
@@ -70,6 +70,74 @@ void XLinkBondMap::init(
       (*this)[site2].insert(site1);
     }
   }
+  initMasks();
+}
+
+/**
+ * Computes the masks from the map.
+ */
+void XLinkBondMap::initMasks() {
+  sites_.clear();
+  links_.clear();
+  for (int aa = 0; aa < 256; aa++) {
+    aa_sites_[aa] = 0;
+  }
+  terminal_sites_ = 0;
+  use_masks_ = size() <= 32;
+  if (!use_masks_) {
+    return;
+  }
+  for (XLinkBondMap::iterator iter = begin(); iter != end(); ++iter) {
+    sites_.push_back(iter->first);
+  }
+  for (size_t bit = 0; bit < sites_.size(); bit++) {
+    unsigned int mask = 1u << bit;
+    switch (sites_[bit].getType()) {
+      case XLINKSITE_ALL:
+        for (int aa = 0; aa < 256; aa++) {
+          aa_sites_[aa] |= mask;
+        }
+        break;
+      case XLINKSITE_AA:
+        aa_sites_[(unsigned char)sites_[bit].getAA()] |= mask;
+        break;
+      case XLINKSITE_NTERM:
+      case XLINKSITE_CTERM:
+        // These depend on where the peptide is in its proteins.
+        terminal_sites_ |= mask;
+        break;
+      default:
+        carp(CARP_FATAL, "Xlink site not set!");
+    }
+  }
+  for (size_t bit = 0; bit < sites_.size(); bit++) {
+    const set<XLinkSite>& partners = find(sites_[bit])->second;
+    unsigned int mask = 0;
+    for (size_t other = 0; other < sites_.size(); other++) {
+      if (partners.find(sites_[other]) != partners.end()) {
+        mask |= 1u << other;
+      }
+    }
+    links_.push_back(mask);
+  }
+}
+
+/**
+ * \returns the mask of the sites that the peptide has at idx.
+ */
+unsigned int XLinkBondMap::getSites(
+  Peptide* peptide, ///<peptide object pointer
+  int idx             ///<sequence index
+  ) {
+  unsigned int sites = aa_sites_[(unsigned char)peptide->getSequencePointer()[idx]];
+  if (terminal_sites_ != 0 && (idx == 0 || idx == peptide->getLength() - 1)) {
+    for (size_t bit = 0; bit < sites_.size(); bit++) {
+      if ((terminal_sites_ & (1u << bit)) && sites_[bit].hasSite(peptide, idx)) {
+        sites |= 1u << bit;
+      }
+    }
+  }
+  return sites;
 }
 
 /**
@@ -86,6 +154,9 @@ bool XLinkBondMap::canLink(
   Peptide* peptide, ///<peptide object pointer
   int idx             ///<sequence index
   ) {
+  if (use_masks_) {
+    return getSites(peptide, idx) != 0;
+  }
   for (XLinkBondMap::iterator iter = begin();
     iter != end(); ++iter) {
 
@@ -132,6 +203,19 @@ bool XLinkBondMap::canLink(
   int idx2              ///<2nd peptide sequence idx
   ) { //for inter/intra links
 
+  if (use_masks_) {
+    unsigned int sites1 = getSites(peptide1, idx1);
+    if (sites1 == 0) {
+      return false;
+    }
+    unsigned int partners = 0;
+    for (size_t bit = 0; bit < links_.size(); bit++) {
+      if (sites1 & (1u << bit)) {
+        partners |= links_[bit];
+      }
+    }
+    return (partners & getSites(peptide2, idx2)) != 0;
+  }
   for (XLinkBondMap::iterator iter1 = begin();
     iter1 != end(); ++iter1) {
 
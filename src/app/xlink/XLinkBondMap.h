@@ -11,6 +11,7 @@
 #include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 
 /**
@@ -19,6 +20,30 @@
  */
 class XLinkBondMap: public std::map<XLinkSite, std::set<XLinkSite> > {
 
+ protected:
+  /*
+   * Bit i of a mask stands for sites_[i], so that whether residues can
+   * link takes a few table lookups rather than a walk through the map.
+   */
+  std::vector<XLinkSite> sites_;     ///< the sites of the map, by bit
+  std::vector<unsigned int> links_;  ///< the sites each site links to
+  unsigned int aa_sites_[256];       ///< the sites each residue is
+  unsigned int terminal_sites_;      ///< nterm and cterm sites
+  bool use_masks_;                   ///< false if there are over 32 sites
+
+  /**
+   * Computes the masks from the map.
+   */
+  void initMasks();
+
+  /**
+   * \returns the mask of the sites that the peptide has at idx.
+   */
+  unsigned int getSites(
+    Crux::Peptide* peptide, ///<peptide object pointer
+    int idx             ///<sequence idx
+    );
+
  public:
 
   /**
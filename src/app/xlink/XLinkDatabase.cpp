@@ -2,6 +2,9 @@
 #include "util/modifications.h"
 #include "model/ModifiedPeptidesIterator.h"
 #include "util/GlobalParams.h"
+#include "util/ParallelSort.h"
+#include "util/ThreadPool.h"
+#include <boost/bind.hpp>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -9,6 +12,9 @@
 
 using namespace std;
 
+static const size_t PEPTIDE_BATCH_SIZE = 1 << 16; ///< peptides digested per batch
+static const size_t MIN_PEPTIDES_PER_SHARD = 1024; ///< not worth a thread below this
+
 Database* XLinkDatabase::protein_database_;
 XLinkBondMap XLinkDatabase::bondmap_;
 
@@ -32,10 +38,12 @@ std::vector<XLinkablePeptide> XLinkDatabase::target_xlinkable_peptides2_;
 std::vector<XLinkablePeptide> XLinkDatabase::target_xlinkable_peptides_flatten_;
 std::vector<XLinkablePeptide> XLinkDatabase::decoy_xlinkable_peptides_flatten_;
 
-bool XLinkDatabase::addPeptideToDatabase(Crux::Peptide* peptide) {
+bool XLinkDatabase::addPeptideToDatabase(
+  Crux::Peptide* peptide,
+  CandidateLists& candidates) {
   
   bool added = false;
-  vector<int> link_sites;
+  XLinkSiteSet link_sites;
   set<int> skip;
   
   bool dead = GlobalParams::getXLinkIncludeDeadends();
@@ -47,12 +55,12 @@ bool XLinkDatabase::addPeptideToDatabase(Crux::Peptide* peptide) {
       if (peptide->hasMonoLink()) {  //this is implicit
         MonoLinkPeptide mpeptide(peptide);
         mpeptide.getMass(GlobalParams::getIsotopicMass());
-        target_monolink_peptides_.push_back(mpeptide);
+        candidates.monolink.push_back(mpeptide);
         added = true;
       } else if (linear) {
         LinearPeptide lpeptide(peptide);
         lpeptide.getMass(GlobalParams::getIsotopicMass());
-        target_linear_peptides_.push_back(lpeptide);
+        candidates.linear.push_back(lpeptide);
         added = true;
       }
     }
@@ -67,7 +75,7 @@ bool XLinkDatabase::addPeptideToDatabase(Crux::Peptide* peptide) {
       if (!link_sites.empty()) {
 	      XLinkablePeptide xlp(peptide, link_sites);
 	      xlp.getMass(GlobalParams::getIsotopicMass());
-        target_xlinkable_peptides_.push_back(xlp);
+        candidates.xlinkable.push_back(xlp);
         added = true;
       }
     }
@@ -83,7 +91,7 @@ bool XLinkDatabase::addPeptideToDatabase(Crux::Peptide* peptide) {
 	          SelfLoopPeptide self_loop(xlp, xlp.getLinkSite(link1_idx), xlp.getLinkSite(link2_idx));
 	          if (self_loop.getNumMissedCleavages() <= GlobalParams::getMissedCleavages()) {
 	            self_loop.getMass(GlobalParams::getIsotopicMass());
-              target_selfloop_peptides_.push_back(self_loop);
+              candidates.selfloop.push_back(self_loop);
               added=true;
 	          }
 	        }
@@ -97,6 +105,70 @@ bool XLinkDatabase::addPeptideToDatabase(Crux::Peptide* peptide) {
   return(added);
 }
 
+/**
+ * Adds the candidates of peptides [begin, end) to candidates, and marks in
+ * added the peptides that made any.
+ */
+void XLinkDatabase::addPeptidesToDatabase(
+  const vector<Crux::Peptide*>* peptides,
+  size_t begin,
+  size_t end,
+  CandidateLists* candidates,
+  vector<char>* added) {
+
+  for (size_t idx = begin; idx < end; idx++) {
+    (*added)[idx] = addPeptideToDatabase((*peptides)[idx], *candidates);
+  }
+}
+
+/**
+ * Adds the candidates of a batch of digested peptides to the database,
+ * shards of the batch on their own threads. The candidates come out in the
+ * order of the peptides, however the threads run. Peptides that made no
+ * candidate are deleted.
+ * \returns The number of peptides kept.
+ */
+size_t XLinkDatabase::addPeptideBatch(vector<Crux::Peptide*>& peptides) {
+
+  size_t num_shards = min((size_t)ThreadPool::Threads(),
+                          max((size_t)1, peptides.size() / MIN_PEPTIDES_PER_SHARD));
+  vector<CandidateLists> candidates(num_shards);
+  vector<char> added(peptides.size(), false);
+  {
+    ThreadPool::TaskGroup group;
+    for (size_t shard = 0; shard < num_shards; shard++) {
+      group.Run(boost::bind(&XLinkDatabase::addPeptidesToDatabase, &peptides,
+                            peptides.size() * shard / num_shards,
+                            peptides.size() * (shard + 1) / num_shards,
+                            &candidates[shard], &added));
+    }
+    group.Wait();
+  }
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    CandidateLists& current = candidates[shard];
+    target_linear_peptides_.insert(target_linear_peptides_.end(),
+      current.linear.begin(), current.linear.end());
+    target_monolink_peptides_.insert(target_monolink_peptides_.end(),
+      current.monolink.begin(), current.monolink.end());
+    target_xlinkable_peptides_.insert(target_xlinkable_peptides_.end(),
+      current.xlinkable.begin(), current.xlinkable.end());
+    target_selfloop_peptides_.insert(target_selfloop_peptides_.end(),
+      current.selfloop.begin(), current.selfloop.end());
+  }
+
+  size_t used_count = 0;
+  for (size_t idx = 0; idx < peptides.size(); idx++) {
+    Crux::Peptide* peptide = peptides[idx];
+    if (added[idx]) {
+      used_count++;
+      target_peptides_[peptide->getMissedCleavageSites()].push_back(peptide);
+    } else {
+      delete peptide;
+    }
+  }
+  return used_count;
+}
+
 
 void XLinkDatabase::initialize() {
   carp(CARP_INFO, "Initializing database");
@@ -174,20 +246,18 @@ void XLinkDatabase::initialize() {
         protein_database_,
         additional_cleavages+blocked_cleavages);
 
-    //add the targets
+    //add the targets, digesting a batch at a time and finding the
+    //candidates of each batch on all threads.
+    vector<Crux::Peptide*> batch;
     while (peptide_iterator->hasNext()) {
       peptide_count++;
-      Crux::Peptide* peptide = peptide_iterator->next();
-      int missed_cleavages = peptide->getMissedCleavageSites();
-      
-      bool added = addPeptideToDatabase(peptide);
-      if (added) {
-        used_count++;
-        target_peptides_[missed_cleavages].push_back(peptide);
-      } else {
-        delete peptide;
+      batch.push_back(peptide_iterator->next());
+      if (batch.size() == PEPTIDE_BATCH_SIZE) {
+        used_count += addPeptideBatch(batch);
+        batch.clear();
       }
     }
+    used_count += addPeptideBatch(batch);
     delete peptide_iterator;
   }
   
@@ -195,22 +265,22 @@ void XLinkDatabase::initialize() {
   
   if (Params::GetBool("xlink-include-linears")) {
     carp(CARP_INFO, "  The database contains %d linear peptides.", target_linear_peptides_.size());
-    sort(target_linear_peptides_.begin(), target_linear_peptides_.end(), compareLinearPeptideMass);
+    ParallelSort::Sort(target_linear_peptides_.begin(), target_linear_peptides_.end(), compareLinearPeptideMass);
   }
   
   if (GlobalParams::getXLinkIncludeDeadends()) {
     carp(CARP_INFO, "  The database contains %d mono-link peptides.", target_monolink_peptides_.size());
-    sort(target_monolink_peptides_.begin(), target_monolink_peptides_.end(), compareMonoLinkPeptideMass);
+    ParallelSort::Sort(target_monolink_peptides_.begin(), target_monolink_peptides_.end(), compareMonoLinkPeptideMass);
   }
   
   if (Params::GetBool("xlink-include-selfloops")) {
     carp(CARP_INFO, "  The database contains %d selfloop peptides.", target_selfloop_peptides_.size());
-    sort(target_selfloop_peptides_.begin(), target_selfloop_peptides_.end(), compareSelfLoopPeptideMass);
+    ParallelSort::Sort(target_selfloop_peptides_.begin(), target_selfloop_peptides_.end(), compareSelfLoopPeptideMass);
   }
   
   if (generate_xlinkable) {
     carp(CARP_INFO, "  The database contains %d cross-linkable peptides.", target_xlinkable_peptides_.size());
-    sort(target_xlinkable_peptides_.begin(), target_xlinkable_peptides_.end(), compareXLinkablePeptideMass);
+    ParallelSort::Sort(target_xlinkable_peptides_.begin(), target_xlinkable_peptides_.end(), compareXLinkablePeptideMass);
     flattenLinkablePeptides(target_xlinkable_peptides_, target_xlinkable_peptides_flatten_);
   }
 
@@ -361,7 +431,7 @@ void XLinkDatabase::generateAllLinkablePeptides(
   carp(CARP_DEBUG, "XLinkDatabase::generateAllLinkablePeptides: start()");
   carp(CARP_DEBUG, "Number of peptides:%d", peptides.size());
   //Loop through peptides
-  vector<int> link_sites;
+  XLinkSiteSet link_sites;
   for (vector<Crux::Peptide*>::iterator iter = peptides.begin(); 
     iter != peptides.end(); 
        ++iter) {
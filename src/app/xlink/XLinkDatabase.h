@@ -64,7 +64,29 @@ class XLinkDatabase {
     std::vector<XLinkablePeptide>& filtered_xpeptides
     );  
 
-  static bool addPeptideToDatabase(Crux::Peptide* peptide);  
+  /**
+   * The candidates addPeptideToDatabase() makes of digested peptides, kept
+   * apart so that each thread can fill its own.
+   */
+  struct CandidateLists {
+    std::vector<LinearPeptide> linear;
+    std::vector<MonoLinkPeptide> monolink;
+    std::vector<SelfLoopPeptide> selfloop;
+    std::vector<XLinkablePeptide> xlinkable;
+  };
+
+  static bool addPeptideToDatabase(
+    Crux::Peptide* peptide,
+    CandidateLists& candidates);
+
+  static void addPeptidesToDatabase(
+    const std::vector<Crux::Peptide*>* peptides,
+    size_t begin,
+    size_t end,
+    CandidateLists* candidates,
+    std::vector<char>* added);
+
+  static size_t addPeptideBatch(std::vector<Crux::Peptide*>& peptides);
     
  public:
   XLinkDatabase() {;}
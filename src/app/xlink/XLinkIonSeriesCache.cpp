@@ -1,12 +1,43 @@
 #include "XLinkIonSeriesCache.h"
+#include "util/Params.h"
 
 using namespace std;
 
-vector<vector<IonSeries*> > XLinkIonSeriesCache::target_xlinkable_ion_series_;
-
-vector<vector<IonSeries*> > XLinkIonSeriesCache::decoy_xlinkable_ion_series_;
+vector<XLinkIonSeriesCache::ThreadCache*> XLinkIonSeriesCache::thread_caches_;
+boost::thread_specific_ptr<int> XLinkIonSeriesCache::thread_slot_;
+boost::mutex XLinkIonSeriesCache::thread_caches_mutex_;
 vector<IonConstraint*> XLinkIonSeriesCache::xcorr_ion_constraint_;
+boost::mutex XLinkIonSeriesCache::ion_constraint_mutex_;
 
+XLinkIonSeriesCache::ThreadCache::~ThreadCache() {
+  for (list<CacheEntry>::iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+    freeEntry(*iter);
+  }
+}
+
+void XLinkIonSeriesCache::setThreadSlot(int slot) {
+  thread_slot_.reset(new int(slot));
+}
+
+XLinkIonSeriesCache::ThreadCache& XLinkIonSeriesCache::threadCache() {
+  size_t slot = thread_slot_.get() == NULL ? 0 : *thread_slot_;
+  boost::mutex::scoped_lock lock(thread_caches_mutex_);
+  while (thread_caches_.size() <= slot) {
+    thread_caches_.push_back(new ThreadCache(
+      (size_t) max(Params::GetInt("xlink-ion-cache-size"), 1)));
+  }
+  return *thread_caches_[slot];
+}
+
+void XLinkIonSeriesCache::freeEntry(CacheEntry& entry) {
+  // Ions still in a scorer's ion series keep their own references
+  for (size_t charge_idx = 0; charge_idx < entry.ion_series.size(); charge_idx++) {
+    if (entry.ion_series[charge_idx]) {
+      IonSeries::freeIonSeries(entry.ion_series[charge_idx]);
+    }
+  }
+  entry.ion_series.clear();
+}
 
 IonSeries* XLinkIonSeriesCache::getXLinkablePeptideIonSeries(
   XLinkablePeptide& xpep,
@@ -21,22 +52,32 @@ IonSeries* XLinkIonSeriesCache::getXLinkablePeptideIonSeries(
     return NULL;
   } else {
 
-    bool decoy = xpep.isDecoy();
-    //carp(CARP_INFO, "decoy %i pep_idx %i charge %i", decoy, xpep_idx, charge);
-    vector<vector<IonSeries*> >* ion_cache = &target_xlinkable_ion_series_;
-    if (decoy) {
-      ion_cache = &decoy_xlinkable_ion_series_;
-      //carp(CARP_INFO, "Getting decoy cache");
+    ThreadCache& cache = threadCache();
+    CacheKey key(xpep.isDecoy(), xpep_idx);
+    int charge_idx = charge-1;
+
+    map<CacheKey, list<CacheEntry>::iterator>::iterator found = cache.index.find(key);
+    if (found != cache.index.end()) {
+      cache.entries.splice(cache.entries.begin(), cache.entries, found->second);
+    } else {
+      if (cache.entries.size() >= cache.max_entries) {
+        CacheEntry& oldest = cache.entries.back();
+        freeEntry(oldest);
+        cache.index.erase(oldest.key);
+        cache.entries.pop_back();
+        cache.evictions++;
+      }
+      cache.entries.push_front(CacheEntry());
+      cache.entries.front().key = key;
+      found = cache.index.insert(make_pair(key, cache.entries.begin())).first;
     }
 
-    int charge_idx = charge-1;
-    //carp(CARP_INFO, "getting pepidx:%i",xpep_idx);
-    while(ion_cache->size() <= xpep_idx) {
-      //carp(CARP_INFO, "Adding vector<IonSeries*>():%d", ion_cache->size());
-      ion_cache->push_back(vector<IonSeries*>());
+    vector<IonSeries*>& level1 = found->second->ion_series;
+    if ((int) level1.size() > charge_idx) {
+      cache.hits++;
+    } else {
+      cache.misses++;
     }
-  
-    vector<IonSeries*>& level1 = (*ion_cache)[xpep_idx];
 
     if (level1.size() == 0) {
       IonSeries* ion_series1 = new IonSeries(getXCorrIonConstraint(1), 1);
@@ -104,6 +145,7 @@ IonConstraint* XLinkIonSeriesCache::getXCorrIonConstraint(
 
   int charge_idx = charge - 1;
 
+  boost::mutex::scoped_lock lock(ion_constraint_mutex_);
   while(xcorr_ion_constraint_.size() <= charge_idx) {
     xcorr_ion_constraint_.push_back(IonConstraint::newIonConstraintSmart(XCORR, (xcorr_ion_constraint_.size()+1)));
   }
@@ -115,27 +157,22 @@ IonConstraint* XLinkIonSeriesCache::getXCorrIonConstraint(
 
  
 void XLinkIonSeriesCache::finalize() {
-  for (size_t xpep_idx = 0;xpep_idx <  target_xlinkable_ion_series_.size(); xpep_idx++) {
-
-    vector<IonSeries*> &level1 = target_xlinkable_ion_series_[xpep_idx];
-    for (size_t charge_idx=0;charge_idx < level1.size(); charge_idx++) {
-      if (level1[charge_idx]) {
-	IonSeries::freeIonSeries(level1[charge_idx]);
-      }
-    }
+  unsigned long hits = 0, misses = 0, evictions = 0;
+  for (size_t slot = 0; slot < thread_caches_.size(); slot++) {
+    hits += thread_caches_[slot]->hits;
+    misses += thread_caches_[slot]->misses;
+    evictions += thread_caches_[slot]->evictions;
+    delete thread_caches_[slot];
   }
-
-  for (size_t xpep_idx = 0;xpep_idx < decoy_xlinkable_ion_series_.size(); xpep_idx++) {
-    vector<IonSeries*>& level1 = decoy_xlinkable_ion_series_[xpep_idx];
-    for (size_t charge_idx=0;charge_idx < level1.size(); charge_idx++) {
-      if (level1[charge_idx]) {
-	IonSeries::freeIonSeries(level1[charge_idx]);
-      }
-    }
+  thread_caches_.clear();
+  if (hits + misses > 0) {
+    carp(CARP_INFO, "Ion series cache: %lu hits, %lu misses, %lu evictions.",
+         hits, misses, evictions);
   }
 
   for (size_t charge_idx=0;charge_idx < xcorr_ion_constraint_.size();charge_idx++) {
     IonConstraint::free(xcorr_ion_constraint_[charge_idx]);
   }
+  xcorr_ion_constraint_.clear();
   
 }
@@ -1,22 +1,77 @@
-
 #include "model/IonSeries.h"
 #include "XLinkablePeptide.h"
 #include "model/IonConstraint.h"
 
+#include <list>
+#include <map>
+#include <utility>
 #include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
+/**
+ * Caches the ion series of xlinkable peptides, by xpep.getIndex() and charge.
+ *
+ * Each search thread has a cache of its own, so that the reference counts of
+ * the cached ions are only ever changed by one thread.  A cache holds the ion
+ * series of at most xlink-ion-cache-size peptides and drops the least
+ * recently used peptide when it is full.  Candidates are visited in peptide
+ * mass order, so the peptides of one spectrum are mostly those of the spectra
+ * just before it and are still cached.
+ */
 class XLinkIonSeriesCache {
 
  protected:
 
-  //key is: xpep.getIndex(), charge
-  static std::vector<std::vector<IonSeries*> > target_xlinkable_ion_series_; 
-  static std::vector<std::vector<IonSeries*> > decoy_xlinkable_ion_series_; 
+  typedef std::pair<bool, int> CacheKey; ///< is decoy, xpep.getIndex()
+
+  /// The ion series of one peptide, by charge-1
+  struct CacheEntry {
+    CacheKey key;
+    std::vector<IonSeries*> ion_series;
+  };
+
+  /// The cache of one search thread
+  struct ThreadCache {
+    std::list<CacheEntry> entries; ///< most recently used first
+    std::map<CacheKey, std::list<CacheEntry>::iterator> index;
+    size_t max_entries;            ///< peptides kept at most
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+
+    explicit ThreadCache(size_t max)
+      : max_entries(max), hits(0), misses(0), evictions(0) {}
+    ~ThreadCache();
+  };
+
+  // Threads scoring at the same time use different slots; a slot is reused
+  // by the threads of later batches once the earlier ones are joined
+  static std::vector<ThreadCache*> thread_caches_;
+  static boost::thread_specific_ptr<int> thread_slot_;
+  static boost::mutex thread_caches_mutex_;
 
   static std::vector<IonConstraint*> xcorr_ion_constraint_;
+  static boost::mutex ion_constraint_mutex_;
+
+  /**
+   * \returns The cache of the calling thread's slot.
+   */
+  static ThreadCache& threadCache();
+
+  /**
+   * Frees the ion series of an entry.
+   */
+  static void freeEntry(CacheEntry& entry);
 
  public:
 
+  /**
+   * Makes the calling thread use the cache in the given slot, 0 by default.
+   * No two threads may use a slot at the same time.
+   */
+  static void setThreadSlot(int slot);
+
   static IonSeries* getXLinkablePeptideIonSeries(
     XLinkablePeptide& xpep,
     int charge
@@ -24,6 +79,9 @@ class XLinkIonSeriesCache {
 
   static IonConstraint* getXCorrIonConstraint(int charge);
 
+  /**
+   * Logs the cache statistics and frees all caches.
+   */
   static void finalize();
 
 };
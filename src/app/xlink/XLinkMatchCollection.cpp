@@ -17,6 +17,8 @@
 #include "util/Params.h"
 #include "util/StringUtils.h"
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
 
 
@@ -379,15 +381,15 @@ void XLinkMatchCollection::fitWeibull() {
 
   vector<FLOAT_T> xcorrs = extractScores(XCORR);
 
-  // reverse sort the scores
-  std::sort(xcorrs.begin(), xcorrs.end(), greater<FLOAT_T>());
-
   double fraction_to_fit = Params::GetDouble("fraction-top-scores-to-fit");
   int num_tail_samples = (int)(getMatchTotal() * fraction_to_fit);
 
-  FLOAT_T* xcorr_array = new FLOAT_T[xcorrs.size()];
-  std::copy(xcorrs.begin(), xcorrs.end(), xcorr_array);
-  fit_three_parameter_weibull(xcorr_array,
+  // reverse sort the scores of the tail, the only ones fit
+  num_tail_samples = min(num_tail_samples, (int)xcorrs.size());
+  std::partial_sort(xcorrs.begin(), xcorrs.begin() + num_tail_samples, xcorrs.end(),
+                    greater<FLOAT_T>());
+
+  fit_three_parameter_weibull(xcorrs.empty() ? NULL : &xcorrs[0],
             num_tail_samples,
             getMatchTotal(),
             MIN_XCORR_SHIFT,
@@ -398,7 +400,6 @@ void XLinkMatchCollection::fitWeibull() {
             &beta_,
             &shift_,
             &correlation_);
-  delete[] xcorr_array;
 }
 
 /**
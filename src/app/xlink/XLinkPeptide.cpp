@@ -14,6 +14,7 @@
 #include "XLinkablePeptideIterator.h"
 #include "XLinkablePeptideIteratorTopN.h"
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
@@ -281,31 +282,43 @@ int XLinkPeptide::addCandidates(
   
   bool done = false;
 
+  // linkable_peptides is sorted by isotopic-mass masses. When those are the
+  // mono masses used here, the second peptides of each first peptide are
+  // one window of the list, whose start is found by binary search rather
+  // than by walking up from the first peptide.
+  bool sorted_by_mono = GlobalParams::getIsotopicMass() == MONO;
+
   for (size_t pep_idx1=0;pep_idx1 < xpeptide_count-1;pep_idx1++) {
     XLinkablePeptide& pep1 = linkable_peptides.at(pep_idx1);
-    carp(CARP_DEBUG, "pep_idx1:%d %d %f %s",
+    IF_CARP(CARP_DEBUG, carp(CARP_DEBUG, "pep_idx1:%d %d %f %s",
          pep_idx1,
          xpeptide_count-1,
          linkable_peptides[pep_idx1].getMass(MONO),
          pep1.getModifiedSequenceString().c_str()
-         );
+         ));
     FLOAT_T pep1_mass = pep1.getMass(MONO);
     FLOAT_T pep2_min_mass = min_mass - pep1_mass - linker_mass_;
     FLOAT_T pep2_max_mass = max_mass - pep1_mass - linker_mass_;
-    int start_idx2 = pep_idx1+1;
+    size_t start_idx2 = pep_idx1+1;
       
     if (pep1_mass + linker_mass_ + linkable_peptides[start_idx2].getMass(MONO) > max_mass) {
       break;
     }
+    if (sorted_by_mono && linkable_peptides[start_idx2].getMass(MONO) < pep2_min_mass) {
+      start_idx2 = lower_bound(linkable_peptides.begin() + start_idx2,
+                               linkable_peptides.end(),
+                               pep2_min_mass,
+                               compareXLinkablePeptideMassToFLOAT) - linkable_peptides.begin();
+    }
     for (size_t pep_idx2=start_idx2;pep_idx2 < xpeptide_count;pep_idx2++) {
       
       XLinkablePeptide& pep2 = linkable_peptides[pep_idx2];
-      carp(CARP_DEBUG, "pep_idx2:%d %d %f %s",
+      IF_CARP(CARP_DEBUG, carp(CARP_DEBUG, "pep_idx2:%d %d %f %s",
          pep_idx2,
          xpeptide_count,
          linkable_peptides[pep_idx2].getMass(MONO),
          pep2.getModifiedSequenceString().c_str()
-         );
+         ));
       FLOAT_T current_mass = pep2.getMass(MONO);
       if (current_mass > pep2_max_mass) {
 	      if (pep_idx2 == start_idx2) {
@@ -320,11 +333,11 @@ int XLinkPeptide::addCandidates(
         if ((include_intra && ctype == XLINK_INTRA_CANDIDATE) || 
             (include_inter_intra && ctype == XLINK_INTER_INTRA_CANDIDATE) ||
             (include_inter && ctype == XLINK_INTER_CANDIDATE)) {
-		            carp(CARP_DEBUG, "considering %s %s", pep1.getModifiedSequenceString().c_str(), pep2.getModifiedSequenceString().c_str());
+		            IF_CARP(CARP_DEBUG, carp(CARP_DEBUG, "considering %s %s", pep1.getModifiedSequenceString().c_str(), pep2.getModifiedSequenceString().c_str()));
 	
               int mods = pep1.getPeptide()->countModifiedAAs() + pep2.getPeptide()->countModifiedAAs();
               if (mods <= max_mod_xlink) {
-		            carp(CARP_DEBUG, "considering2 %s %s", pep1.getModifiedSequenceString().c_str(), pep2.getModifiedSequenceString().c_str());
+		            IF_CARP(CARP_DEBUG, carp(CARP_DEBUG, "considering2 %s %s", pep1.getModifiedSequenceString().c_str(), pep2.getModifiedSequenceString().c_str()));
                 num_candidates += addXLinkPeptides(pep1, pep2, candidates);
               } // if (mods <= max_mod_xlink ..     
           }
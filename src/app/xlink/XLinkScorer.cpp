@@ -14,6 +14,7 @@
 #include "util/GlobalParams.h"
 
 
+#include <cstdlib>
 #include <iostream>
 
 using namespace std;
@@ -159,6 +160,13 @@ FLOAT_T XLinkScorer::scoreCandidate(
         
     xcorr = xcorr1+xcorr2;
     candidate->setScore(XCORR, xcorr);
+  } else if ((candidate->getCandidateType() == XLINK_INTER_CANDIDATE ||
+              candidate->getCandidateType() == XLINK_INTRA_CANDIDATE ||
+              candidate->getCandidateType() == XLINK_INTER_INTRA_CANDIDATE) &&
+             ((XLinkPeptide*)candidate)->getXLinkablePeptide(0).getPeptide() != NULL &&
+             ((XLinkPeptide*)candidate)->getXLinkablePeptide(1).getPeptide() != NULL) {
+    xcorr = scoreXLinkPeptideXCorr((XLinkPeptide*)candidate);
+    candidate->setScore(XCORR, xcorr);
   } else {
     candidate->predictIons(ion_series_xcorr_, charge_);
     xcorr = scorer_xcorr_->scoreSpectrumVIonSeries(spectrum_, ion_series_xcorr_);
@@ -190,11 +198,101 @@ FLOAT_T XLinkScorer::scoreCandidate(
   return xcorr;
 }
 
+/**
+ * \returns the xcorr ions of the peptide, predicted on first use
+ */
+const vector<XLinkScorer::PeptideIon>& XLinkScorer::getPeptideIons(
+  XLinkablePeptide& xpep
+  ) {
+
+  map<Crux::Peptide*, vector<PeptideIon> >::iterator found =
+    peptide_ions_.find(xpep.getPeptide());
+  if (found != peptide_ions_.end()) {
+    return found->second;
+  }
+  vector<PeptideIon>& ions = peptide_ions_[xpep.getPeptide()];
+  const char* seq = xpep.getSequence();
+  {
+    IonSeries series(ion_constraint_xcorr_, charge_);
+    series.update(seq, xpep.getModifiedSequencePtr());
+    series.predictIons();
+    ions.reserve(series.getNumIons());
+    for (IonIterator ion_iter = series.begin(); ion_iter != series.end(); ++ion_iter) {
+      PeptideIon ion;
+      ion.ion.mass_z = (*ion_iter)->getMassZ();
+      ion.ion.type = (*ion_iter)->getType();
+      ion.ion.charge = (*ion_iter)->getCharge();
+      ion.forward = (*ion_iter)->isForwardType();
+      ion.cleavage_idx = (*ion_iter)->getCleavageIdx();
+      ions.push_back(ion);
+    }
+  }
+  std::free((char*)seq);
+  return ions;
+}
+
+/**
+ * Adds the ions of one peptide of a cross-linked candidate to
+ * candidate_ions_, shifting those that hold the link site by mod_mass, as
+ * XLinkablePeptide::predictIons does.
+ */
+void XLinkScorer::addLinkedPeptideIons(
+  XLinkablePeptide& xpep,
+  int link_idx,
+  FLOAT_T mod_mass
+  ) {
+
+  const vector<PeptideIon>& ions = getPeptideIons(xpep);
+  int link_pos = xpep.getLinkSite(link_idx);
+  int seq_len = xpep.getPeptide()->getLength();
+  for (vector<PeptideIon>::const_iterator ion = ions.begin(); ion != ions.end(); ++ion) {
+    candidate_ions_.push_back(ion->ion);
+    bool shifted = ion->forward
+      ? ion->cleavage_idx > (unsigned int)link_pos
+      : ion->cleavage_idx >= (seq_len-(unsigned int)link_pos);
+    if (shifted) {
+      // Ion::getMassFromMassZ and Ion::setMassZFromMass, step for step
+      Scorer::XcorrIon& shifted_ion = candidate_ions_.back();
+      FLOAT_T mass = (FLOAT_T)((shifted_ion.mass_z - MASS_PROTON) * (FLOAT_T)shifted_ion.charge);
+      mass = mass + mod_mass;
+      FLOAT_T charge = shifted_ion.charge;
+      shifted_ion.mass_z = (mass + MASS_PROTON * charge) / charge;
+    }
+  }
+}
+
+/**
+ * \returns the xcorr of a cross-linked candidate, scored from the cached
+ * ions of its two peptides instead of a predicted ion series
+ */
+FLOAT_T XLinkScorer::scoreXLinkPeptideXCorr(
+  XLinkPeptide* candidate
+  ) {
+
+  // The ions XLinkPeptide::predictIons would make, in the same order
+  MASS_TYPE_T fragment_mass_type = GlobalParams::getFragmentMass();
+  XLinkablePeptide& xpep1 = candidate->getXLinkablePeptide(0);
+  XLinkablePeptide& xpep2 = candidate->getXLinkablePeptide(1);
+  FLOAT_T link_mass = XLinkPeptide::getLinkerMass();
+  FLOAT_T delta_mass0 = xpep1.getMass(fragment_mass_type) + link_mass;
+  FLOAT_T delta_mass1 = xpep2.getMass(fragment_mass_type) + link_mass;
+  candidate_ions_.clear();
+  addLinkedPeptideIons(xpep1, candidate->getLinkIdx(0), delta_mass1);
+  addLinkedPeptideIons(xpep2, candidate->getLinkIdx(1), delta_mass0);
+  return scorer_xcorr_->scoreXcorrIons(spectrum_, charge_, candidate_ions_);
+}
+
 FLOAT_T XLinkScorer::scoreXLinkablePeptide(
   XLinkablePeptide& xlpeptide,
   int link_idx,
   FLOAT_T mod_mass) {
 
+  if (xlpeptide.getPeptide() != NULL) {
+    // Same ions as predictIons, without building an ion series
+    candidate_ions_.clear();
+    addLinkedPeptideIons(xlpeptide, link_idx, mod_mass);
+    return scorer_xcorr_->scoreXcorrIons(spectrum_, charge_, candidate_ions_);
+  }
   xlpeptide.predictIons(ion_series_xcorr_, charge_, link_idx, mod_mass);
   FLOAT_T xcorr = scorer_xcorr_->scoreSpectrumVIonSeries(spectrum_, ion_series_xcorr_);
   return xcorr;
@@ -8,7 +8,12 @@
 #ifndef XLINKSCORER_H_
 #define XLINKSCORER_H_
 #include "model/objects.h"
+#include "model/Scorer.h"
 #include "XLinkMatch.h"
+#include "XLinkPeptide.h"
+
+#include <map>
+#include <vector>
 
 class XLinkScorer {
  protected:
@@ -22,6 +27,44 @@ class XLinkScorer {
   IonSeries* ion_series_xcorr_; ///< current ion series xcorr
   IonSeries* ion_series_sp_; ///< current ion series sp
   bool compute_sp_; ///< calculate sp score
+
+  /**
+   * An ion of a linked peptide before the link mass shift.
+   */
+  struct PeptideIon {
+    Scorer::XcorrIon ion;
+    bool forward;
+    unsigned int cleavage_idx;
+  };
+  /// xcorr ions of each peptide of the cross-linked candidates scored so far
+  std::map<Crux::Peptide*, std::vector<PeptideIon> > peptide_ions_;
+  std::vector<Scorer::XcorrIon> candidate_ions_; ///< ions of the current candidate
+
+  /**
+   * \returns the xcorr ions of the peptide, predicted on first use
+   */
+  const std::vector<PeptideIon>& getPeptideIons(
+    XLinkablePeptide& xpep
+    );
+
+  /**
+   * Adds the ions of one peptide of a cross-linked candidate to
+   * candidate_ions_, shifting those that hold the link site by mod_mass, as
+   * XLinkablePeptide::predictIons does.
+   */
+  void addLinkedPeptideIons(
+    XLinkablePeptide& xpep,
+    int link_idx,
+    FLOAT_T mod_mass
+    );
+
+  /**
+   * \returns the xcorr of a cross-linked candidate, scored from the cached
+   * ions of its two peptides instead of a predicted ion series
+   */
+  FLOAT_T scoreXLinkPeptideXCorr(
+    XLinkPeptide* candidate
+    );
  
   /**
    * initializes the object with the spectrum
@@ -52,6 +52,16 @@ class XLinkSite {
     std::string& protein_sequence,
     int idx
   ) const;
+
+  /**
+   * \returns the type of the site
+   */
+  XLINK_SITE_T getType() const { return type_; }
+
+  /**
+   * \returns the amino acid of an XLINKSITE_AA site
+   */
+  char getAA() const { return aa_; }
     
   /**
    * \returns whether this xlinksite is equal to the passed in xlinksite
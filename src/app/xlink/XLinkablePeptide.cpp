@@ -106,14 +106,11 @@ XLinkablePeptide::XLinkablePeptide(
  */
 XLinkablePeptide::XLinkablePeptide(
   Peptide* peptide, ///< the peptide object 
-  vector<int>& link_sites ///< the linking sites
+  const XLinkSiteSet& link_sites ///< the linking sites
   ) {
   init();
   peptide_ = peptide;
-
-  for (unsigned int idx = 0; idx < link_sites.size(); idx++) {
-    addLinkSite(link_sites[idx]);
-  }
+  link_sites_ = link_sites;
   is_decoy_ = false;
 }
 
@@ -236,7 +233,7 @@ bool XLinkablePeptide::isCleavageSite(
 void XLinkablePeptide::findLinkSites(
   Peptide* peptide,  ///< the peptide object -in
   XLinkBondMap& bondmap,  ///< the bond map -in 
-  vector<int>& link_sites, ///< the found link sites -out
+  XLinkSiteSet& link_sites, ///< the found link sites -out
   int additional_cleavages ///< 0 for xlink, 1 for self-loops
   ) {
 
@@ -306,7 +303,7 @@ void XLinkablePeptide::findLinkSites(
       //passes all three tests, this is a linkable site.
       if (!link_prevented) {
         //if it is a linkable site, then add it to the list.
-        link_sites.push_back(seq_idx);
+        link_sites.insert(seq_idx);
       }
     }
   }
@@ -348,9 +345,9 @@ bool XLinkablePeptide::isLinkable(
     XLinkBondMap& bondmap ///< the bond map
   ) {
 
-  vector<int> link_sites;
+  XLinkSiteSet link_sites;
   findLinkSites(peptide, bondmap, link_sites);
-  return link_sites.size() > 0;
+  return !link_sites.empty();
 
 
 }
@@ -377,6 +374,10 @@ int XLinkablePeptide::getLinkSite(
   int link_site_idx ///< the index of the link site
   ) {
 
+  if (link_site_idx < 0 || (size_t)link_site_idx >= link_sites_.size()) {
+    carp(CARP_FATAL, "Link site %d of %d requested", link_site_idx,
+         (int)link_sites_.size());
+  }
   return link_sites_.at(link_site_idx);
 }
 
@@ -387,8 +388,10 @@ int XLinkablePeptide::getLinkSite(
 int XLinkablePeptide::addLinkSite(
   int seq_idx ///< the sequence index of the link site
   ) {
-  link_sites_.push_back(seq_idx);
-  return link_sites_.size()-1;
+  if (!XLinkSiteSet::fits(seq_idx)) {
+    carp(CARP_FATAL, "Invalid link site %d", seq_idx);
+  }
+  return link_sites_.insert(seq_idx);
 }
 
 
@@ -568,7 +571,7 @@ XLinkablePeptide XLinkablePeptide::shuffle() {
     free(new_seq);
   }
   //cerr<<"Creating new linkable peptide"<<endl;
-  XLinkablePeptide ans(peptide, link_sites);
+  XLinkablePeptide ans(peptide, link_sites_);
   for (size_t idx=0;idx<NUMBER_MASS_TYPES;idx++) {
     if (mass_calculated_[idx]) {
       ans.mass_calculated_[idx] = true;
@@ -689,20 +692,20 @@ void XLinkablePeptide::predictIons(
   FLOAT_T mod_mass,
   bool clear
   ) {
-  const char* seq = NULL;
   IonSeries* cached_ions = NULL;
   bool cached = false;
   if (GlobalParams::getXLinkUseIonCache()) {
     cached_ions = XLinkIonSeriesCache::getXLinkablePeptideIonSeries(*this, charge);
-    bool cached = cached_ions != NULL;
+    cached = cached_ions != NULL;
   }
+  // The shifted copies refer to this sequence whether or not the ions are cached
+  const char* seq = getSequence();
   if (!cached) {
     cached_ions = new IonSeries(ion_series->getIonConstraint(), charge);
-    seq = getSequence();
     cached_ions->update(seq, getModifiedSequencePtr());
     cached_ions->predictIons();
   }
-  int link_pos = link_sites_.at(link_idx);
+  int link_pos = getLinkSite(link_idx);
   int seq_len;
   if (peptide_) {
     seq_len = peptide_->getLength();
@@ -723,11 +726,7 @@ void XLinkablePeptide::predictIons(
     if (ion->isForwardType()) { 
       if (cleavage_idx > (unsigned int)link_pos) {
         ion = Ion::newIon();
-	if (seq) {
-	  Ion::copy(src_ion, ion, seq);
-	} else {
-          Ion::copy(src_ion, ion, sequence_);
-	}
+        Ion::copy(src_ion, ion, seq);
         FLOAT_T mass = ion->getMassFromMassZ() + mod_mass;
         ion->setMassZFromMass(mass); 
         if (isnan(ion->getMassZ())) { 
@@ -737,11 +736,7 @@ void XLinkablePeptide::predictIons(
     } else { 
       if (cleavage_idx >= (seq_len-(unsigned int)link_pos)) { 
         ion = Ion::newIon();
-	if (seq) {
-	  Ion::copy(src_ion, ion, seq);
-	} else {
-	  Ion::copy(src_ion, ion, sequence_);
-	}
+        Ion::copy(src_ion, ion, seq);
         FLOAT_T mass = ion->getMassFromMassZ() + mod_mass;
         ion->setMassZFromMass(mass); 
         if (isnan(ion->getMassZ())) { 
@@ -755,7 +750,7 @@ void XLinkablePeptide::predictIons(
   if (!cached) {
     delete cached_ions;
   }
-  if (seq) {
+  if (peptide_ != NULL) {
     std::free((char*)seq);
   }
 }
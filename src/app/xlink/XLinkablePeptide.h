@@ -9,8 +9,99 @@
 #include "model/objects.h"
 #include "model/Peptide.h"
 #include "util/CacheableMass.h"
+#include <stdint.h>
 #include <vector>
 #include <string>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/**
+ * \class XLinkSiteSet
+ * \brief the link sites of a peptide, one bit per sequence position
+ *
+ * The sites are held inline, so copying an XLinkablePeptide allocates
+ * nothing for them. Sites are numbered in sequence order, which is the
+ * order in which findLinkSites() and the candidates add them.
+ */
+class XLinkSiteSet {
+ public:
+  XLinkSiteSet() { clear(); }
+
+  void clear() {
+    for (int word = 0; word < NUM_WORDS; word++) {
+      words_[word] = 0;
+    }
+    size_ = 0;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  /**
+   * \returns whether seq_idx can hold a site at all
+   */
+  static bool fits(int seq_idx) {
+    return seq_idx >= 0 && seq_idx < NUM_WORDS * 64;
+  }
+
+  /**
+   * Adds the site at seq_idx, which must fit().
+   * \returns the index of the site
+   */
+  size_t insert(int seq_idx) {
+    uint64_t bit = (uint64_t)1 << (seq_idx % 64);
+    uint64_t& word = words_[seq_idx / 64];
+    if (!(word & bit)) {
+      word |= bit;
+      size_++;
+    }
+    size_t idx = countBits(word & (bit - 1));
+    for (int w = 0; w < seq_idx / 64; w++) {
+      idx += countBits(words_[w]);
+    }
+    return idx;
+  }
+
+  /**
+   * \returns the sequence index of site idx, which must be below size()
+   */
+  int at(size_t idx) const {
+    int word = 0;
+    for (size_t bits; idx >= (bits = countBits(words_[word])); word++) {
+      idx -= bits;
+    }
+    uint64_t bits = words_[word];
+    for (; idx > 0; idx--) {
+      bits &= bits - 1;
+    }
+    return word * 64 + lowestBit(bits);
+  }
+
+ private:
+  static const int NUM_WORDS = (MAX_PEPTIDE_LENGTH + 63) / 64;
+
+  static size_t countBits(uint64_t word) {
+#ifdef _MSC_VER
+    return (size_t)__popcnt64(word);
+#else
+    return (size_t)__builtin_popcountll(word);
+#endif
+  }
+
+  static int lowestBit(uint64_t word) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward64(&idx, word);
+    return (int)idx;
+#else
+    return __builtin_ctzll(word);
+#endif
+  }
+
+  uint64_t words_[NUM_WORDS];
+  unsigned short size_;
+};
 
 #include "XLinkBondMap.h"
 
@@ -23,7 +114,7 @@ class XLinkablePeptide : public CacheableMass {
   Crux::Peptide* peptide_; ///< the peptide object of this XLinkablePeptide (can be null)
   XLinkablePeptide* decoy_; ///< a saved decoy of the XLinkablePeptide.
   char* sequence_; ///< the sequence 
-  std::vector<int> link_sites_; ///< the sequence indices where linking is possible
+  XLinkSiteSet link_sites_; ///< the sequence indices where linking is possible
   bool is_decoy_; //Is this from the decoy database?
   size_t xcorr_link_idx_;
   FLOAT_T xcorr_;
@@ -64,7 +155,7 @@ class XLinkablePeptide : public CacheableMass {
    */
   XLinkablePeptide(
     Crux::Peptide* peptide, ///< the peptide object 
-    std::vector<int>& link_sites ///< the linking sites
+    const XLinkSiteSet& link_sites ///< the linking sites
     );
 
   /**
@@ -89,7 +180,7 @@ class XLinkablePeptide : public CacheableMass {
   static void findLinkSites(
     Crux::Peptide* peptide,  ///< the peptide object -in
     XLinkBondMap& bondmap,  ///< the bond map -in 
-    std::vector<int>& link_sites, ///< the found link sites -out
+    XLinkSiteSet& link_sites, ///< the found link sites -out
     int additional_cleavages=0 ///< 0 for xlinks, 1 for selfloops
   );
 
@@ -12,6 +12,7 @@
 #include "XLinkScorer.h"
 #include "XLinkDatabase.h"
 #include "util/GlobalParams.h"
+#include <algorithm>
 #include <iostream>
 
 
@@ -90,9 +91,10 @@ void XLinkablePeptideIteratorTopN::scorePeptides(
     scored_xlp_.push_back(&pep1);
     biter++;
   }
-  if (scored_xlp_.size() > 0) {
-    sort(scored_xlp_.begin(), scored_xlp_.end(), compareXLinkableXCorrPtr);
-  }
+  // Only the first top_n_ are ever returned
+  size_t num_sorted = min((size_t)max(top_n_, 0), scored_xlp_.size());
+  partial_sort(scored_xlp_.begin(), scored_xlp_.begin() + num_sorted,
+               scored_xlp_.end(), compareXLinkableXCorrPtr);
  
   IF_CARP(CARP_DETAILED_DEBUG,
     for (size_t idx = 0;idx < min((size_t)top_n_,scored_xlp_.size());idx++) {
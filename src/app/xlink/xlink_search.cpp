@@ -19,6 +19,7 @@
 #include "io/OutputFiles.h"
 #include "io/SpectrumCollectionFactory.h"
 #include "util/Params.h"
+#include "util/ThreadPool.h"
 #include "XLinkDatabase.h"
 
 
@@ -29,8 +30,10 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <vector>
 
-#include <ctime>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 
 
@@ -99,6 +102,92 @@ void writeTrainingCandidates(XLinkMatchCollection* training_candidates, int scan
 }
 
 
+/**
+ * The candidates of one spectrum-charge, made on the main thread and
+ * scored by a search thread.
+ */
+struct XLinkSearchJob {
+  Crux::Spectrum* spectrum;
+  SpectrumZState zstate;
+  XLinkMatchCollection* target_candidates;
+  XLinkMatchCollection* decoy_candidates;
+  XLinkMatchCollection* target_train_candidates; ///< NULL without p-values
+  XLinkMatchCollection* train_candidates; ///< NULL without p-values
+  Weibull weibull; ///< fit to the training candidates
+  bool write_weibull_points; ///< whether the training candidates should be written
+};
+
+/**
+ * Fits a Weibull to the training candidates of the job and sets the
+ * p-values of its top targets and decoys.
+ */
+static void computeXLinkPValues(
+  XLinkSearchJob& job,
+  int top_match,
+  FLOAT_T min_pvalue
+  ) {
+  XLinkMatchCollection* target_candidates = job.target_candidates;
+  XLinkMatchCollection* decoy_candidates = job.decoy_candidates;
+  XLinkMatchCollection* train_candidates = job.train_candidates;
+  Weibull& weibull = job.weibull;
+
+  weibull.reset();
+  for (int idx = 0;idx < train_candidates->getMatchTotal();idx++) {
+    const string& sequence = (*train_candidates)[idx]->getSequenceStringConst();
+    FLOAT_T score = (*train_candidates)[idx]->getScore(XCORR);
+    weibull.addPoint(sequence, score);
+  }
+  job.write_weibull_points = !weibull.fit();
+
+  target_candidates->sort(XCORR);
+
+  // Calculate pvalues.
+  int nprint = min(top_match,target_candidates->getMatchTotal());
+  carp(CARP_DEBUG, "Calculating %d target p-values.", nprint);
+  for (int idx=0;idx < nprint;idx++) {
+    FLOAT_T score = (*target_candidates)[idx]->getScore(XCORR);
+    (*target_candidates)[idx]->setPValue(weibull.getPValue(score));
+  }
+
+  nprint = min(top_match, (int)decoy_candidates->getMatchTotal());
+  carp(CARP_DEBUG, "Calculating %d decoy p-values.", nprint);
+  decoy_candidates->sort(XCORR);
+  for (int idx=0;idx < nprint;idx++) {
+    FLOAT_T score = (*decoy_candidates)[idx]->getScore(XCORR);
+    (*decoy_candidates)[idx]->setPValue(weibull.getPValue(score));
+    FLOAT_T wpvalue = weibull.getWeibullPValue(score);
+    FLOAT_T bpvalue = bonferroni_correction(wpvalue, decoy_candidates->getMatchTotal()) * 2.0;
+    if ((wpvalue == 0) || (wpvalue != wpvalue) || (bpvalue  < min_pvalue)) {
+      //If we have a bad fit, 0 or too low pvalue, print out the points.
+      job.write_weibull_points = true;
+    }
+  }
+}
+
+/**
+ * Scores the candidates of jobs thread, thread + num_threads, ..., and
+ * computes their p-values if there are training candidates.
+ */
+static void scoreXLinkSearchJobs(
+  vector<XLinkSearchJob>* jobs,
+  int thread,
+  int num_threads,
+  int top_match,
+  FLOAT_T min_pvalue
+  ) {
+  XLinkIonSeriesCache::setThreadSlot(thread);
+  for (size_t idx = thread; idx < jobs->size(); idx += num_threads) {
+    XLinkSearchJob& job = (*jobs)[idx];
+    job.target_candidates->scoreSpectrum(job.spectrum);
+    carp(CARP_DEBUG, "Scoring decoys.");
+    job.decoy_candidates->scoreSpectrum(job.spectrum);
+    if (job.train_candidates != NULL) {
+      job.train_candidates->scoreSpectrum(job.spectrum);
+      computeXLinkPValues(job, top_match, min_pvalue);
+    }
+  }
+}
+
 /**
  * main method for SearchForXLinks that implements the refactored code
  */
@@ -117,6 +206,16 @@ int SearchForXLinks::xlinkSearchMain() {
   XLinkPeptide::setLinkerMass(Params::GetDouble("link mass"));
   int min_weibull_points = Params::GetInt("min-weibull-points");
   bool compute_pvalues = Params::GetBool("compute-p-values");
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = boost::thread::hardware_concurrency();
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  carp(CARP_INFO, "Searching with %d thread%s.", num_threads, num_threads == 1 ? "" : "s");
+  // Spectrum-charges made and scored at a time
+  const size_t batch_size = 8 * num_threads;
 
   /* Prepare input fasta  */
   carp(CARP_INFO, "Preparing database.");
@@ -160,15 +259,20 @@ int SearchForXLinks::xlinkSearchMain() {
     int search_count = 0;
     FLOAT_T num_spectra = (FLOAT_T)spectra->getNumSpectra();
     FLOAT_T min_pvalue = 1.0 / num_spectra;
-    //class for estimating pvalues.
-    Weibull weibull;
   
     // for every observed spectrum 
     carp(CARP_INFO, "Beginning search.");
     int print_interval = Params::GetInt("print-search-progress");
+    vector<XLinkSearchJob> jobs;
 
     while (spectrum_iterator->hasNext()) {
 
+      // Make the candidates of the next batch of spectrum-charges. This
+      // stays on one thread: making decoys draws random numbers, and the
+      // peptides it allocates are tracked in one list.
+      jobs.clear();
+      while (jobs.size() < batch_size && spectrum_iterator->hasNext()) {
+
       spectrum = spectrum_iterator->next(zstate);
       scan_num = spectrum->getFirstScan();
       
@@ -180,8 +284,6 @@ int SearchForXLinks::xlinkSearchMain() {
       }
       search_count++;
 
-      FLOAT_T precursor_mz = spectrum->getPrecursorMz();
-
       XLinkMatchCollection* target_candidates =
 	new XLinkMatchCollection(
 				 spectrum,
@@ -211,25 +313,26 @@ int SearchForXLinks::xlinkSearchMain() {
 	   zstate.getNeutralMass(), 
 	   target_candidates->getMatchTotal());   
 
-      // Score targets.
-      target_candidates->scoreSpectrum(spectrum);
+      XLinkSearchJob job;
+      job.spectrum = spectrum;
+      job.zstate = zstate;
+      job.target_candidates = target_candidates;
 
-      // Score decoys.
       carp(CARP_DEBUG, "Getting decoy candidates.");
-      XLinkMatchCollection* decoy_candidates = new XLinkMatchCollection();
-      target_candidates->shuffle(*decoy_candidates);
-      carp(CARP_DEBUG, "Scoring decoys.");
-      decoy_candidates->scoreSpectrum(spectrum);
-      
+      job.decoy_candidates = new XLinkMatchCollection();
+      target_candidates->shuffle(*job.decoy_candidates);
+
+      job.target_train_candidates = NULL;
+      job.train_candidates = NULL;
+      job.write_weibull_points = false;
       if (compute_pvalues) {
-	weibull.reset();
-	XLinkMatchCollection *target_train_candidates =
+	job.target_train_candidates =
 	  new XLinkMatchCollection(
 				   spectrum,
 				   zstate,
 				   false,
 				   true);
-	XLinkMatchCollection *train_candidates =
+	job.train_candidates =
 	  new XLinkMatchCollection(
 				   spectrum,
 				   zstate,
@@ -237,54 +340,44 @@ int SearchForXLinks::xlinkSearchMain() {
 				   true
 				   );
       
-	for (size_t idx=0;idx < target_train_candidates->getMatchTotal();idx++) {
-	  train_candidates->add(target_train_candidates->at(idx), true);
-	}
-	while(train_candidates->getMatchTotal() < min_weibull_points) {
-	  target_train_candidates->shuffle(*train_candidates);
-	}
-	train_candidates->scoreSpectrum(spectrum);
-	for (int idx = 0;idx < train_candidates->getMatchTotal();idx++) {
-	  const string& sequence = (*train_candidates)[idx]->getSequenceStringConst();
-	  FLOAT_T score = (*train_candidates)[idx]->getScore(XCORR);
-	  weibull.addPoint(sequence, score);
+	for (size_t idx=0;idx < job.target_train_candidates->getMatchTotal();idx++) {
+	  job.train_candidates->add(job.target_train_candidates->at(idx), true);
 	}
-	bool write_weibull_points = !weibull.fit();
-	
-	target_candidates->sort(XCORR);
-	
-	
-	// Calculate pvalues.
-	int nprint = min(top_match,target_candidates->getMatchTotal());
-	carp(CARP_DEBUG, "Calculating %d target p-values.", nprint);
-	for (int idx=0;idx < nprint;idx++) {
-	  FLOAT_T score = (*target_candidates)[idx]->getScore(XCORR);
-	  (*target_candidates)[idx]->setPValue(weibull.getPValue(score));
+	while(job.train_candidates->getMatchTotal() < min_weibull_points) {
+	  job.target_train_candidates->shuffle(*job.train_candidates);
 	}
-	
-	nprint = min(top_match, (int)decoy_candidates->getMatchTotal());
-	carp(CARP_DEBUG, "Calculating %d decoy p-values.", nprint);
-	decoy_candidates->sort(XCORR);
-	for (int idx=0;idx < nprint;idx++) {
-	  FLOAT_T score = (*decoy_candidates)[idx]->getScore(XCORR);
-	  (*decoy_candidates)[idx]->setPValue(weibull.getPValue(score));
-	  FLOAT_T wpvalue = weibull.getWeibullPValue(score);
-	  FLOAT_T bpvalue = bonferroni_correction(wpvalue, decoy_candidates->getMatchTotal()) * 2.0;
-	  if ((wpvalue == 0) || (wpvalue != wpvalue) || (bpvalue  < min_pvalue)) {
-	    //If we have a bad fit, 0 or too low pvalue, print out the points.
-	    write_weibull_points = true;
-	  }
-        
+      }
+      jobs.push_back(job);
+      } // make the next batch
+
+      // Score targets, decoys and training candidates.
+      if (num_threads == 1) {
+	scoreXLinkSearchJobs(&jobs, 0, 1, top_match, min_pvalue);
+      } else {
+	ThreadPool::TaskGroup threads;
+	for (int thread = 0; thread < num_threads; thread++) {
+	  threads.Run(boost::bind(&scoreXLinkSearchJobs, &jobs, thread, num_threads,
+                                          top_match, min_pvalue));
 	}
-      
-      
-	if (write_weibull_points || Params::GetBool("write-weibull-points")) {
-	  writeTrainingCandidates(train_candidates, scan_num, weibull);
+	threads.Wait();
+      }
+
+      // Rank and write the scored spectra in the order they were read.
+      for (vector<XLinkSearchJob>::iterator job = jobs.begin(); job != jobs.end(); ++job) {
+      spectrum = job->spectrum;
+      scan_num = spectrum->getFirstScan();
+      XLinkMatchCollection* target_candidates = job->target_candidates;
+      XLinkMatchCollection* decoy_candidates = job->decoy_candidates;
+
+      if (compute_pvalues) {
+	// The p-values were computed with the scores
+	if (job->write_weibull_points || Params::GetBool("write-weibull-points")) {
+	  writeTrainingCandidates(job->train_candidates, scan_num, job->weibull);
 	}
 	carp(CARP_DEBUG, "Delete train candidates.");
-	delete train_candidates;
+	delete job->train_candidates;
 	carp(CARP_DEBUG, "Delete target train candidates.");
-	delete target_train_candidates;
+	delete job->target_train_candidates;
 	
       } // if (compute_p_values)
       
@@ -329,12 +422,13 @@ int SearchForXLinks::xlinkSearchMain() {
       delete decoy_candidates;
       carp(CARP_DEBUG, "Deleting target candidates.");
       delete target_candidates;
-      XLink::deleteAllocatedPeptides();
     
       //free_spectrum(spectrum);
       
       carp(CARP_DEBUG, "Done with spectrum %d.", scan_num);
       carp(CARP_DEBUG, "=====================================");
+      } // write the batch
+      XLink::deleteAllocatedPeptides();
     } // get next spectrum
 
     carp(CARP_INFO, "Skipped %d (%g%%) spectra with 0 candidates.", 
@@ -42,11 +42,66 @@
 #include "app/ReadSpectrumRecordsApplication.h"
 #include "app/ReadTideIndex.h"
 #include "app/TideSearchApplication.h"
+#include "app/TideServerApplication.h"
+#include "app/TideLibrarySearchApplication.h"
 #include "app/CometApplication.h"
 #include "app/PSMConvertApplication.h"
 #include "app/CascadeSearchApplication.h"
 #include "app/AssignConfidenceApplication.h"
 #include "app/SubtractIndexApplication.h"
+#include "app/BatchApplication.h"
+
+/**
+ * Adds the crux commands to applications, in the order of the usage
+ * statement.
+ */
+static void addApplications(CruxApplicationList* applications) {
+  // Primary commands
+  applications->addMessage(applications->getListName() +
+    " supports the following primary commands:");
+  applications->add(new CruxBullseyeApplication());
+  applications->add(new TideIndexApplication());
+  applications->add(new TideSearchApplication());
+  applications->add(new TideServerApplication());
+  applications->add(new TideLibrarySearchApplication());
+  applications->add(new ReadSpectrumRecordsApplication());
+  applications->add(new ReadTideIndex());
+  applications->add(new CometApplication());
+  applications->add(new PercolatorApplication());
+  applications->add(new QRanker());
+  applications->add(new Barista());
+  applications->add(new SearchForXLinks());
+  applications->add(new SpectralCounts());
+  applications->add(new PipelineApplication());
+  applications->add(new CascadeSearchApplication());
+  applications->add(new AssignConfidenceApplication());
+
+  // Utilities
+  applications->addMessage(applications->getListName() +
+    " supports the following utility commands:");
+  applications->add(new MakePinApplication());
+  applications->add(new PredictPeptideIons());
+  applications->add(new CruxHardklorApplication());
+  applications->add(new ParamMedicApplication());
+  applications->add(new PrintProcessedSpectra());
+  applications->add(new GeneratePeptides());
+  applications->add(new GetMs2Spectrum());
+  applications->add(new CreateDocs());
+  applications->add(new PrintVersion());
+  applications->add(new PSMConvertApplication());
+  applications->add(new SubtractIndexApplication());
+  applications->add(new BatchApplication(addApplications));
+  applications->add(new XLinkAssignIons());
+  applications->add(new XLinkScoreSpectrum());
+  applications->add(new LocalizeModificationApplication());
+
+  // Utilities for processing tab-delimited text files
+  applications->add(new ExtractColumns());
+  applications->add(new ExtractRows());
+  applications->add(new StatColumn());
+  applications->add(new SortColumn());
+}
+
 /**
  * The starting point for crux.  Prints a general usage statement when
  * given no arguments.  Runs one of the crux commands, including
@@ -61,48 +116,7 @@ int main(int argc, char** argv) {
 #endif 
 
     CruxApplicationList applications("crux");
-
-    // Primary commands
-    applications.addMessage(applications.getListName() +
-      " supports the following primary commands:");
-    applications.add(new CruxBullseyeApplication());
-    applications.add(new TideIndexApplication());
-    applications.add(new TideSearchApplication());
-    applications.add(new ReadSpectrumRecordsApplication());
-    applications.add(new ReadTideIndex());
-    applications.add(new CometApplication());
-    applications.add(new PercolatorApplication());
-    applications.add(new QRanker());
-    applications.add(new Barista());
-    applications.add(new SearchForXLinks());
-    applications.add(new SpectralCounts());
-    applications.add(new PipelineApplication());
-    applications.add(new CascadeSearchApplication());
-    applications.add(new AssignConfidenceApplication());
-
-    // Utilities
-    applications.addMessage(applications.getListName() +
-      " supports the following utility commands:");
-    applications.add(new MakePinApplication());
-    applications.add(new PredictPeptideIons());
-    applications.add(new CruxHardklorApplication());
-    applications.add(new ParamMedicApplication());
-    applications.add(new PrintProcessedSpectra());
-    applications.add(new GeneratePeptides());
-    applications.add(new GetMs2Spectrum());
-    applications.add(new CreateDocs());
-    applications.add(new PrintVersion());
-    applications.add(new PSMConvertApplication());
-    applications.add(new SubtractIndexApplication());
-    applications.add(new XLinkAssignIons());
-    applications.add(new XLinkScoreSpectrum());
-    applications.add(new LocalizeModificationApplication());
-
-    // Utilities for processing tab-delimited text files
-    applications.add(new ExtractColumns());
-    applications.add(new ExtractRows());
-    applications.add(new StatColumn());
-    applications.add(new SortColumn());
+    addApplications(&applications);
 
     int ret = applications.main(argc, argv);
     google::protobuf::ShutdownProtobufLibrary();
@@ -0,0 +1,362 @@
+/**
+ * \file BinaryMatchFile.cpp
+ * \brief Crux binary columnar format for tab-delimited PSM files.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "BinaryMatchFile.h"
+#include "carp.h"
+
+using namespace std;
+
+const char BinaryMatchFile::MAGIC[8] = { 'C', 'R', 'U', 'X', 'B', 'I', 'N', '1' };
+
+/**
+ * Appends the bytes of value to out.
+ */
+template<typename T>
+static void Append(string* out, T value) {
+  out->append((const char*) &value, sizeof(T));
+}
+
+/**
+ * \returns The value of type T at *p, moving *p past it.
+ */
+template<typename T>
+static T Take(const char** p) {
+  T value;
+  memcpy(&value, *p, sizeof(T));
+  *p += sizeof(T);
+  return value;
+}
+
+/**
+ * Copies n values of type T at *p into values, moving *p past them.
+ */
+template<typename T>
+static void TakeArray(const char** p, size_t n, vector<T>* values) {
+  values->resize(n);
+  if (n > 0) {
+    memcpy(&(*values)[0], *p, n * sizeof(T));
+  }
+  *p += n * sizeof(T);
+}
+
+/**
+ * \returns Whether data, of the given size, starts a binary match file.
+ */
+bool BinaryMatchFile::IsBinary(const char* data, size_t size) {
+  return size >= sizeof(MAGIC) && memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+/**
+ * Writes the header of a binary match file with the given columns.
+ */
+void BinaryMatchFile::WriteHeader(
+  ostream* out,
+  const vector<string>& column_names
+) {
+  string header;
+  Append<uint32_t>(&header, column_names.size());
+  for (vector<string>::const_iterator i = column_names.begin(); i != column_names.end(); ++i) {
+    Append<uint32_t>(&header, i->length());
+    header += *i;
+  }
+  out->write(MAGIC, sizeof(MAGIC));
+  uint32_t size = header.size();
+  out->write((const char*) &size, sizeof(size));
+  *out << header;
+}
+
+/**
+ * \returns The size of the header starting at data, or 0 if data is too
+ * short to tell.
+ */
+size_t BinaryMatchFile::HeaderSize(const char* data, size_t size) {
+  if (size < sizeof(MAGIC) + sizeof(uint32_t)) {
+    return 0;
+  }
+  const char* p = data + sizeof(MAGIC);
+  return sizeof(MAGIC) + sizeof(uint32_t) + Take<uint32_t>(&p);
+}
+
+/**
+ * \returns The size of the block starting at data, or 0 if data is too
+ * short to tell.
+ */
+size_t BinaryMatchFile::BlockSize(const char* data, size_t size) {
+  if (size < sizeof(uint32_t)) {
+    return 0;
+  }
+  return sizeof(uint32_t) + Take<uint32_t>(&data);
+}
+
+/**
+ * Reads the column names from a whole header.
+ */
+void BinaryMatchFile::ReadHeader(
+  const char* data,
+  vector<string>* column_names
+) {
+  const char* p = data + sizeof(MAGIC) + sizeof(uint32_t);
+  uint32_t num_columns = Take<uint32_t>(&p);
+  column_names->clear();
+  for (uint32_t i = 0; i < num_columns; i++) {
+    uint32_t length = Take<uint32_t>(&p);
+    column_names->push_back(string(p, length));
+    p += length;
+  }
+}
+
+size_t BinaryMatchFile::Column::Size() const {
+  switch (type) {
+  case INT_COLUMN:
+    return ints.size();
+  case DOUBLE_COLUMN:
+    return doubles.size();
+  default:
+    return ends.size();
+  }
+}
+
+void BinaryMatchFile::Column::Pad() {
+  switch (type) {
+  case INT_COLUMN:
+    ints.push_back(0);
+    break;
+  case DOUBLE_COLUMN:
+    doubles.push_back(0);
+    break;
+  default:
+    ends.push_back(chars.size());
+    break;
+  }
+}
+
+BinaryMatchBatch::BinaryMatchBatch() : num_rows_(0), field_(0), bytes_(0) {
+}
+
+/**
+ * \returns The column of the next field, making it if this is the first
+ * row with that many fields, as a column of the given type.
+ */
+BinaryMatchFile::Column* BinaryMatchBatch::nextColumn(char type) {
+  if (field_ == columns_.size()) {
+    columns_.push_back(Column());
+    columns_.back().type = type;
+    for (size_t i = 0; i < num_rows_; i++) {
+      columns_.back().Pad();
+    }
+  }
+  Column* column = &columns_[field_++];
+  if (column->type == BinaryMatchFile::INT_COLUMN && type == BinaryMatchFile::DOUBLE_COLUMN) {
+    // A column of whole numbers so far that turns out to hold doubles
+    column->doubles.assign(column->ints.begin(), column->ints.end());
+    vector<int64_t>().swap(column->ints);
+    column->type = type;
+  } else if (column->type != type &&
+             !(column->type == BinaryMatchFile::DOUBLE_COLUMN && type == BinaryMatchFile::INT_COLUMN)) {
+    carp(CARP_FATAL, "Internal error: column %d of binary PSM output mixes strings "
+         "and numbers", (int) field_);
+  }
+  return column;
+}
+
+void BinaryMatchBatch::addInt(int64_t value) {
+  Column* column = nextColumn(BinaryMatchFile::INT_COLUMN);
+  if (column->type == BinaryMatchFile::INT_COLUMN) {
+    column->ints.push_back(value);
+  } else {
+    column->doubles.push_back(value);
+  }
+  bytes_ += sizeof(int64_t);
+}
+
+void BinaryMatchBatch::addDouble(double value) {
+  nextColumn(BinaryMatchFile::DOUBLE_COLUMN)->doubles.push_back(value);
+  bytes_ += sizeof(double);
+}
+
+void BinaryMatchBatch::addString(const string& value) {
+  Column* column = nextColumn(BinaryMatchFile::STRING_COLUMN);
+  column->chars += value;
+  column->ends.push_back(column->chars.size());
+  bytes_ += sizeof(uint32_t) + value.length();
+}
+
+/**
+ * Ends the current row. Columns the row has no field for get 0 or "".
+ */
+void BinaryMatchBatch::endRow() {
+  for (; field_ < columns_.size(); field_++) {
+    columns_[field_].Pad();
+  }
+  field_ = 0;
+  ++num_rows_;
+}
+
+/**
+ * Appends the block of the rows so far to out and empties the batch.
+ */
+void BinaryMatchBatch::appendTo(string* out) {
+  if (num_rows_ == 0) {
+    return;
+  }
+  size_t start = out->size();
+  Append<uint32_t>(out, 0); // size, set below
+  Append<uint32_t>(out, num_rows_);
+  Append<uint32_t>(out, columns_.size());
+  for (vector<Column>::const_iterator i = columns_.begin(); i != columns_.end(); ++i) {
+    out->push_back(i->type);
+    switch (i->type) {
+    case BinaryMatchFile::INT_COLUMN:
+      out->append((const char*) &i->ints[0], num_rows_ * sizeof(int64_t));
+      break;
+    case BinaryMatchFile::DOUBLE_COLUMN:
+      out->append((const char*) &i->doubles[0], num_rows_ * sizeof(double));
+      break;
+    default:
+      out->append((const char*) &i->ends[0], num_rows_ * sizeof(uint32_t));
+      out->append(i->chars);
+      break;
+    }
+  }
+  uint32_t size = out->size() - start - sizeof(uint32_t);
+  memcpy(&(*out)[start], &size, sizeof(size));
+
+  columns_.clear();
+  num_rows_ = 0;
+  field_ = 0;
+  bytes_ = 0;
+}
+
+BinaryMatchBlock::BinaryMatchBlock() : num_rows_(0) {
+}
+
+/**
+ * Decodes a whole block.
+ * \returns false if the block is malformed.
+ */
+bool BinaryMatchBlock::read(const char* data) {
+  const char* p = data;
+  uint32_t size = Take<uint32_t>(&p);
+  const char* end = p + size;
+  if (size < 2 * sizeof(uint32_t)) {
+    return false;
+  }
+  num_rows_ = Take<uint32_t>(&p);
+  uint32_t num_columns = Take<uint32_t>(&p);
+  columns_.resize(num_columns);
+  for (uint32_t i = 0; i < num_columns; i++) {
+    BinaryMatchFile::Column& column = columns_[i];
+    if (p >= end) {
+      return false;
+    }
+    column.type = *p++;
+    size_t width = column.type == BinaryMatchFile::STRING_COLUMN ? sizeof(uint32_t) : sizeof(int64_t);
+    if ((size_t) (end - p) < num_rows_ * width) {
+      return false;
+    }
+    switch (column.type) {
+    case BinaryMatchFile::INT_COLUMN:
+      TakeArray(&p, num_rows_, &column.ints);
+      break;
+    case BinaryMatchFile::DOUBLE_COLUMN:
+      TakeArray(&p, num_rows_, &column.doubles);
+      break;
+    case BinaryMatchFile::STRING_COLUMN: {
+      TakeArray(&p, num_rows_, &column.ends);
+      size_t length = num_rows_ > 0 ? column.ends.back() : 0;
+      if ((size_t) (end - p) < length) {
+        return false;
+      }
+      column.chars.assign(p, length);
+      p += length;
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return p == end;
+}
+
+bool BinaryMatchBlock::isEmpty(size_t col, size_t row) const {
+  if (col >= columns_.size()) {
+    return true;
+  }
+  const BinaryMatchFile::Column& column = columns_[col];
+  return column.type == BinaryMatchFile::STRING_COLUMN &&
+    column.ends[row] == (row > 0 ? column.ends[row - 1] : 0);
+}
+
+double BinaryMatchBlock::getDouble(size_t col, size_t row) const {
+  if (col >= columns_.size()) {
+    return 0;
+  }
+  const BinaryMatchFile::Column& column = columns_[col];
+  switch (column.type) {
+  case BinaryMatchFile::INT_COLUMN:
+    return (double) column.ints[row];
+  case BinaryMatchFile::DOUBLE_COLUMN:
+    return column.doubles[row];
+  default: {
+    string field;
+    getString(col, row, &field);
+    return atof(field.c_str());
+  }
+  }
+}
+
+int64_t BinaryMatchBlock::getInt(size_t col, size_t row) const {
+  if (col >= columns_.size()) {
+    return 0;
+  }
+  const BinaryMatchFile::Column& column = columns_[col];
+  switch (column.type) {
+  case BinaryMatchFile::INT_COLUMN:
+    return column.ints[row];
+  case BinaryMatchFile::DOUBLE_COLUMN:
+    return (int64_t) column.doubles[row];
+  default: {
+    string field;
+    getString(col, row, &field);
+    return atol(field.c_str());
+  }
+  }
+}
+
+/**
+ * Sets out to the field as it would be written in a tab-delimited file.
+ */
+void BinaryMatchBlock::getString(size_t col, size_t row, string* out) const {
+  out->clear();
+  if (col >= columns_.size()) {
+    return;
+  }
+  const BinaryMatchFile::Column& column = columns_[col];
+  char number[32];
+  switch (column.type) {
+  case BinaryMatchFile::INT_COLUMN:
+    snprintf(number, sizeof(number), "%lld", (long long) column.ints[row]);
+    out->assign(number);
+    break;
+  case BinaryMatchFile::DOUBLE_COLUMN:
+    snprintf(number, sizeof(number), "%.15g", column.doubles[row]);
+    out->assign(number);
+    break;
+  default: {
+    uint32_t begin = row > 0 ? column.ends[row - 1] : 0;
+    out->assign(column.chars, begin, column.ends[row] - begin);
+    break;
+  }
+  }
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
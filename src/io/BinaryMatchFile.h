@@ -0,0 +1,172 @@
+/**
+ * \file BinaryMatchFile.h
+ * \brief Crux binary columnar format for tab-delimited PSM files.
+ *
+ * A binary match file holds the same table as a tab-delimited match file,
+ * but stores each column of a batch of rows as one typed array, so that
+ * neither the writer nor the readers format or parse numbers. The layout,
+ * in native byte order, is
+ *
+ *   header: the 8 bytes "CRUXBIN1", the uint32 size of the rest of the
+ *     header, the uint32 number of columns and then the name of each
+ *     column as a uint32 length and its characters;
+ *   blocks, one after another until the end of the file: the uint32 size
+ *     of the rest of the block, the uint32 numbers of rows and of columns,
+ *     and for each column a type byte and its values, one int64 or double
+ *     per row, or for strings one uint32 end offset per row followed by the
+ *     characters. Columns after the last one of a block are empty.
+ *
+ * Blocks are written by BinaryMatchBatch, one per batch of search results,
+ * and read by DelimitedFileReader, so every reader of tab-delimited PSMs
+ * also reads binary files.
+ */
+#ifndef BINARY_MATCH_FILE_H
+#define BINARY_MATCH_FILE_H
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class BinaryMatchFile {
+ public:
+  enum ColumnType { INT_COLUMN = 0, DOUBLE_COLUMN = 1, STRING_COLUMN = 2 };
+
+  /**
+   * \returns Whether data, of the given size, starts a binary match file.
+   */
+  static bool IsBinary(const char* data, size_t size);
+
+  /**
+   * Writes the header of a binary match file with the given columns.
+   */
+  static void WriteHeader(
+    std::ostream* out,
+    const std::vector<std::string>& column_names
+  );
+
+  /**
+   * \returns The size of the header or block starting at data, including
+   * its magic and size fields, or 0 if data is too short to tell.
+   */
+  static size_t HeaderSize(const char* data, size_t size);
+  static size_t BlockSize(const char* data, size_t size);
+
+  /**
+   * Reads the column names from a whole header.
+   */
+  static void ReadHeader(
+    const char* data,
+    std::vector<std::string>* column_names
+  );
+
+  static const char MAGIC[8];
+
+  /**
+   * The values of one column of a block.
+   */
+  struct Column {
+    char type;
+    std::vector<int64_t> ints;
+    std::vector<double> doubles;
+    std::vector<uint32_t> ends;  ///< of each string in chars
+    std::string chars;
+
+    /**
+     * \returns The number of rows.
+     */
+    size_t Size() const;
+
+    /**
+     * Adds an empty field: 0 or "".
+     */
+    void Pad();
+  };
+};
+
+/**
+ * Rows of PSM fields being gathered into one block.
+ */
+class BinaryMatchBatch {
+ public:
+  BinaryMatchBatch();
+
+  /**
+   * Adds the next field of the current row.
+   */
+  void addInt(int64_t value);
+  void addDouble(double value);
+  void addString(const std::string& value);
+
+  /**
+   * Ends the current row. Columns the row has no field for get 0 or "".
+   */
+  void endRow();
+
+  size_t numRows() const { return num_rows_; }
+  bool empty() const { return num_rows_ == 0; }
+
+  /**
+   * \returns About how many bytes the block will take.
+   */
+  size_t bytes() const { return bytes_; }
+
+  /**
+   * Appends the block of the rows so far to out and empties the batch.
+   */
+  void appendTo(std::string* out);
+
+ protected:
+  typedef BinaryMatchFile::Column Column;
+
+  /**
+   * \returns The column of the next field, making it if this is the first
+   * row with that many fields, as a column of the given type.
+   */
+  Column* nextColumn(char type);
+
+  std::vector<Column> columns_;
+  size_t num_rows_;
+  size_t field_;  ///< index of the next field of the current row
+  size_t bytes_;
+};
+
+/**
+ * One block of a binary match file, decoded.
+ */
+class BinaryMatchBlock {
+ public:
+  BinaryMatchBlock();
+
+  /**
+   * Decodes a whole block.
+   * \returns false if the block is malformed.
+   */
+  bool read(const char* data);
+
+  size_t numRows() const { return num_rows_; }
+  size_t numCols() const { return columns_.size(); }
+  char type(size_t col) const { return columns_[col].type; }
+
+  bool isEmpty(size_t col, size_t row) const;
+  double getDouble(size_t col, size_t row) const;
+  int64_t getInt(size_t col, size_t row) const;
+
+  /**
+   * Sets out to the field as it would be written in a tab-delimited file.
+   */
+  void getString(size_t col, size_t row, std::string* out) const;
+
+ protected:
+  std::vector<BinaryMatchFile::Column> columns_;
+  size_t num_rows_;
+};
+
+#endif // BINARY_MATCH_FILE_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -5,22 +5,89 @@
 
 #include "DelimitedFileReader.h"
 
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <stdexcept>
 
 #include <iostream>
 #include <string>
 
 #include "carp.h"
+#include "BinaryMatchFile.h"
 #include "DelimitedFile.h"
+#include "util/FileUtils.h"
 #include "util/StringUtils.h"
 
 using namespace std;
 
+static const size_t kBlockSize = 1 << 20; // bytes to read from the stream at once
+
+/**
+ * Parses a double from [begin, end) if all of it is a number the way
+ * StringUtils::FromString reads numbers. *end must not be a digit.
+ * \returns false if FromString would have to decide.
+ */
+static bool ParseDouble(const char* begin, const char* end, double* value) {
+  if (begin == end) {
+    return false;
+  }
+  for (const char* p = begin; p < end; p++) {
+    if (isalpha((unsigned char) *p) && *p != 'e' && *p != 'E') {
+      return false; // inf, nan, hex
+    }
+  }
+  char* parsed;
+  errno = 0;
+  *value = strtod(begin, &parsed);
+  return parsed == end && errno == 0;
+}
+
+/**
+ * Parses a float like ParseDouble().
+ */
+static bool ParseFloat(const char* begin, const char* end, FLOAT_T* value) {
+  double d;
+  if (!ParseDouble(begin, end, &d) ||
+      (d != 0 && (fabs(d) > numeric_limits<FLOAT_T>::max() ||
+                  fabs(d) < numeric_limits<FLOAT_T>::min()))) {
+    return false;
+  }
+  errno = 0;
+  *value = strtof(begin, NULL);
+  return errno == 0;
+}
+
+/**
+ * Parses an int like ParseDouble().
+ */
+static bool ParseInteger(const char* begin, const char* end, int* value) {
+  if (begin == end) {
+    return false;
+  }
+  char* parsed;
+  errno = 0;
+  long l = strtol(begin, &parsed, 10);
+  if (parsed != end || errno != 0 ||
+      l > numeric_limits<int>::max() || l < numeric_limits<int>::min()) {
+    return false;
+  }
+  *value = (int) l;
+  return true;
+}
+
 /**
  * \returns a DelimitedFileReader object
  */  
 DelimitedFileReader::DelimitedFileReader():
-  num_rows_valid_(false), istream_ptr_(NULL), delimiter_('\t'), owns_stream_(false) {
+  buffer_size_(0), at_eof_(true), line_begin_(0), line_end_(0), next_line_(0),
+  current_data_valid_(false),
+  num_rows_valid_(false), istream_ptr_(NULL), delimiter_('\t'), owns_stream_(false),
+  compressed_(false), binary_(false), binary_row_(0) {
 }
 
 /**
@@ -31,7 +98,8 @@ DelimitedFileReader::DelimitedFileReader(
   const char *file_name, ///< the path of the file to read
   bool has_header, ///< indicates whether the header exists (default true).
   char delimiter ///< the delimiter to use (default tab).
-): istream_ptr_(NULL), num_rows_valid_(false), delimiter_(delimiter) {
+): istream_ptr_(NULL), num_rows_valid_(false), delimiter_(delimiter),
+  compressed_(false), binary_(false), binary_row_(0) {
   loadData(file_name, has_header);
 }
 
@@ -43,7 +111,8 @@ DelimitedFileReader::DelimitedFileReader(
   const std::string& file_name, ///< the path of the file  to read
   bool has_header, ///< indicates whether the header exists (default true).
   char delimiter ///< the delimiter to use (default tab)
-): istream_ptr_(NULL), delimiter_(delimiter) {
+): istream_ptr_(NULL), delimiter_(delimiter), compressed_(false), binary_(false),
+  binary_row_(0) {
   loadData(file_name, has_header);
 }
 
@@ -56,7 +125,7 @@ DelimitedFileReader::DelimitedFileReader(
   bool has_header, ///<indicates whether header exists
   char delimiter ///< the delimiter to use (default tab)
 ): istream_ptr_(istream_ptr), istream_begin_(istream_ptr->tellg()), delimiter_(delimiter),
-has_header_(has_header), owns_stream_(false) {
+has_header_(has_header), owns_stream_(false), compressed_(false), binary_(false), binary_row_(0) {
   loadData();
 }
 
@@ -77,23 +146,47 @@ unsigned int DelimitedFileReader::numRows() {
   if (!num_rows_valid_) {
     num_rows_ = 0;
 
-    streampos last_pos = istream_ptr_->tellg();
-
-    istream_ptr_->clear();
-    istream_ptr_->seekg(istream_begin_, ios::beg);
-    
-    string temp_str;
-
-    while (getline(*istream_ptr_, temp_str)) {
-      num_rows_++;
+    // compressed streams can't seek, so they are counted on a second stream
+    istream* in = istream_ptr_;
+    streampos last_pos;
+    if (compressed_) {
+      in = FileUtils::GetReadStream(file_name_, binary_);
+    } else {
+      last_pos = istream_ptr_->tellg();
+      istream_ptr_->clear();
+      istream_ptr_->seekg(istream_begin_, ios::beg);
     }
     
-    if (has_header_) {
-      num_rows_--;
+    if (binary_) {
+      // skip the header, then add up the rows of the blocks
+      char magic[sizeof(BinaryMatchFile::MAGIC)];
+      uint32_t size, rows;
+      in->read(magic, sizeof(magic));
+      in->read((char*) &size, sizeof(size));
+      skip(in, size);
+      while (in->read((char*) &size, sizeof(size)) &&
+             in->read((char*) &rows, sizeof(rows))) {
+        num_rows_ += rows;
+        skip(in, size - sizeof(rows));
+      }
+    } else {
+      string temp_str;
+
+      while (getline(*in, temp_str)) {
+        num_rows_++;
+      }
+
+      if (has_header_) {
+        num_rows_--;
+      }
     }
     num_rows_valid_ = true;
-    istream_ptr_->clear();
-    istream_ptr_->seekg(last_pos);
+    if (compressed_) {
+      delete in;
+    } else {
+      istream_ptr_->clear();
+      istream_ptr_->seekg(last_pos);
+    }
   }
   return num_rows_;
 }
@@ -154,12 +247,39 @@ void DelimitedFileReader::loadData() {
   column_mismatch_warned_ = false;
   istream_begin_ = istream_ptr_->tellg(); 
 
-  has_next_ = !getline(*istream_ptr_, next_data_string_).fail();
-  next_data_string_ = StringUtils::Trim(next_data_string_);
+  if (buffer_.size() < kBlockSize + 1) {
+    buffer_.resize(kBlockSize + 1);
+  }
+  buffer_size_ = 0;
+  buffer_[0] = '\0';
+  at_eof_ = false;
+  line_begin_ = line_end_ = next_line_ = 0;
+  fields_.clear();
+
+  fillBuffer();
+  binary_ = BinaryMatchFile::IsBinary(&buffer_[0], buffer_size_);
+  if (binary_) {
+    loadBinaryHeader();
+    has_next_ = moreData();
+    if (has_next_) {
+      next();
+    }
+    return;
+  }
+
+  // The first line is trimmed of whitespace
+  has_next_ = readLine();
+  while (line_begin_ < line_end_ && isspace((unsigned char) buffer_[line_begin_])) {
+    ++line_begin_;
+  }
+  while (line_end_ > line_begin_ && isspace((unsigned char) buffer_[line_end_ - 1])) {
+    --line_end_;
+  }
   if (has_header_) {
     if (has_next_) {
-      column_names_ = StringUtils::Split(next_data_string_, delimiter_);
-      has_next_ = !getline(*istream_ptr_, next_data_string_).fail();
+      column_names_ = StringUtils::Split(
+        string(&buffer_[line_begin_], &buffer_[0] + line_end_), delimiter_);
+      has_next_ = readLine();
     } else {
       carp(CARP_WARNING, "No data/headers found!");
       return;
@@ -171,6 +291,154 @@ void DelimitedFileReader::loadData() {
   } 
 }
 
+/**
+ * Moves in past size bytes, reading through them if in can't seek.
+ */
+void DelimitedFileReader::skip(istream* in, size_t size) const {
+  if (compressed_) {
+    in->ignore(size);
+  } else {
+    in->seekg(size, ios::cur);
+  }
+}
+
+/**
+ * Reads more of the stream into buffer_, first moving the current line
+ * and everything after it to the front.
+ * \returns false if the stream has no more data.
+ */
+bool DelimitedFileReader::fillBuffer() {
+  if (at_eof_) {
+    return false;
+  }
+  if (line_begin_ > 0) {
+    memmove(&buffer_[0], &buffer_[line_begin_], buffer_size_ - line_begin_);
+    buffer_size_ -= line_begin_;
+    line_end_ -= line_begin_;
+    next_line_ -= line_begin_;
+    for (vector<pair<size_t, size_t> >::iterator i = fields_.begin(); i != fields_.end(); ++i) {
+      i->first -= line_begin_;
+      i->second -= line_begin_;
+    }
+    line_begin_ = 0;
+  }
+  if (buffer_.size() - 1 - buffer_size_ < kBlockSize / 2) {
+    buffer_.resize(buffer_.size() + kBlockSize);
+  }
+  istream_ptr_->read(&buffer_[buffer_size_], buffer_.size() - 1 - buffer_size_);
+  size_t read = (size_t) istream_ptr_->gcount();
+  buffer_size_ += read;
+  buffer_[buffer_size_] = '\0';
+  if (!istream_ptr_->good()) {
+    at_eof_ = true;
+  }
+  return read > 0;
+}
+
+/**
+ * Makes the line after the current line current, without splitting it.
+ * \returns false if there is no such line.
+ */
+bool DelimitedFileReader::readLine() {
+  line_begin_ = line_end_ = next_line_;
+  fields_.clear();
+  while (true) {
+    const char* newline = (const char*) memchr(&buffer_[line_end_], '\n',
+                                               buffer_size_ - line_end_);
+    if (newline != NULL) {
+      line_end_ = newline - &buffer_[0];
+      next_line_ = line_end_ + 1;
+      return true;
+    }
+    line_end_ = buffer_size_;
+    if (!fillBuffer()) {
+      next_line_ = line_end_;
+      return line_end_ > line_begin_;
+    }
+  }
+}
+
+/**
+ * \returns Whether any data follows the current line.
+ */
+bool DelimitedFileReader::moreData() {
+  return next_line_ < buffer_size_ || (fillBuffer() && next_line_ < buffer_size_);
+}
+
+/**
+ * Makes size bytes after next_line_ present in buffer_, dropping what
+ * comes before.
+ * \returns false if the stream ends first.
+ */
+bool DelimitedFileReader::fillBinary(size_t size) {
+  line_begin_ = line_end_ = next_line_;
+  while (buffer_size_ - next_line_ < size) {
+    if (!fillBuffer()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Reads the column names of a binary file.
+ */
+void DelimitedFileReader::loadBinaryHeader() {
+  size_t size = fillBinary(sizeof(BinaryMatchFile::MAGIC) + sizeof(uint32_t)) ?
+    BinaryMatchFile::HeaderSize(&buffer_[next_line_], buffer_size_ - next_line_) : 0;
+  if (size == 0 || !fillBinary(size)) {
+    carp(CARP_FATAL, "The header of %s is incomplete", file_name_.c_str());
+  }
+  BinaryMatchFile::ReadHeader(&buffer_[next_line_], &column_names_);
+  next_line_ += size;
+}
+
+/**
+ * Reads the next block of rows of a binary file into binary_block_.
+ * \returns false if there is no such block.
+ */
+bool DelimitedFileReader::readBinaryBlock() {
+  do {
+    if (!fillBinary(sizeof(uint32_t))) {
+      return false;
+    }
+    size_t size = BinaryMatchFile::BlockSize(&buffer_[next_line_], buffer_size_ - next_line_);
+    if (!fillBinary(size) || !binary_block_.read(&buffer_[next_line_])) {
+      carp(CARP_FATAL, "The rows of %s after row %d are damaged",
+           file_name_.c_str(), current_row_);
+    }
+    next_line_ += size;
+  } while (binary_block_.numRows() == 0);
+  return true;
+}
+
+/**
+ * next() for binary files.
+ */
+void DelimitedFileReader::nextBinary() {
+  if (has_next_) {
+    if (!has_current_ || ++binary_row_ >= binary_block_.numRows()) {
+      if (!readBinaryBlock()) {
+        carp(CARP_FATAL, "Cannot read row %d of %s", current_row_ + 1, file_name_.c_str());
+      }
+      binary_row_ = 0;
+    }
+    current_row_++;
+    current_data_valid_ = false;
+    size_t num_fields = max(column_names_.size(), binary_block_.numCols());
+    if (data_.size() < num_fields) {
+      data_.resize(num_fields);
+    }
+    data_valid_.assign(num_fields, false);
+
+    //is there a next row
+    has_next_ = binary_row_ + 1 < binary_block_.numRows() || moreData();
+    has_current_ = true;
+  } else {
+    has_current_ = false;
+  }
+}
+
 /**
  * clears the current data and column names,
  * parses the header if it exists,
@@ -185,13 +453,14 @@ void DelimitedFileReader::loadData(
 
   file_name_ = string(file_name);
   has_header_ = has_header;
+  compressed_ = FileUtils::IsGzip(file_name_);
 
   //special case, if filename is '-', then use standard input.
   if (file_name_ == "-") {
     istream_ptr_ = &cin;
     owns_stream_ = false;
   } else {
-    istream_ptr_ = new ifstream(file_name, ios::in);
+    istream_ptr_ = FileUtils::GetReadStream(file_name_);
     owns_stream_ = true;
   }
   loadData();
@@ -264,20 +533,83 @@ const string& DelimitedFileReader::getString() {
   if (!has_current_) {
     carp(CARP_FATAL, "End of file!");
   }
+  if (!current_data_valid_) {
+    if (binary_) {
+      current_data_string_.clear();
+      for (unsigned int col_idx = 0; col_idx < data_valid_.size(); col_idx++) {
+        if (col_idx > 0) {
+          current_data_string_ += delimiter_;
+        }
+        current_data_string_ += getString(col_idx);
+      }
+    } else {
+      current_data_string_.assign(&buffer_[0] + line_begin_, &buffer_[0] + line_end_);
+    }
+    current_data_valid_ = true;
+  }
   return current_data_string_;
 }
 
+/**
+ * Ends the program if col_idx is not a field of the current line.
+ */
+void DelimitedFileReader::checkColumn(
+  unsigned int col_idx ///< the column index
+  ) {
+  if (col_idx >= (binary_ ? data_valid_.size() : fields_.size())) {
+    carp(CARP_FATAL, "col idx:%i is out of bounds! (0,%i,%i)",
+         col_idx, (column_names_.size()-1), (fields_.size()-1));
+  }
+}
+
 /**
  *\returns the string value of the cell
  */
 const string& DelimitedFileReader::getString(
   unsigned int col_idx ///< the column index
   ) {
-  if (col_idx >= data_.size()) {
-    carp(CARP_FATAL, "col idx:%i is out of bounds! (0,%i,%i)",
-         col_idx, (column_names_.size()-1), (data_.size()-1));
+  checkColumn(col_idx);
+  if (!data_valid_[col_idx]) {
+    if (binary_) {
+      binary_block_.getString(col_idx, binary_row_, &data_[col_idx]);
+    } else {
+      data_[col_idx].assign(fieldBegin(col_idx), fieldEnd(col_idx));
+    }
+    data_valid_[col_idx] = true;
   }
-  return data_.at(col_idx);
+  return data_[col_idx];
+}
+
+/**
+ * Sets begin and end to the characters of a field, which for binary
+ * files are formatted first.
+ */
+void DelimitedFileReader::fieldChars(
+  unsigned int col_idx, ///< the column index
+  const char** begin, ///< first character -out
+  const char** end ///< one past the last character -out
+  ) {
+  if (binary_) {
+    const string& field = getString(col_idx);
+    *begin = field.c_str();
+    *end = *begin + field.length();
+  } else {
+    *begin = fieldBegin(col_idx);
+    *end = fieldEnd(col_idx);
+  }
+}
+
+/**
+ * \returns whether the cell is empty
+ */
+bool DelimitedFileReader::isEmpty(
+  unsigned int col_idx ///< the column index
+  ) {
+  checkColumn(col_idx);
+  if (binary_) {
+    return binary_block_.isEmpty(col_idx, binary_row_);
+  }
+  return fields_[col_idx].first == fields_[col_idx].second;
 }
 
 /** 
@@ -311,14 +643,39 @@ TValue DelimitedFileReader::getValue(
 FLOAT_T DelimitedFileReader::getFloat(
   unsigned int col_idx ///< the column index
   ) {
-  const string& string_ans = getString(col_idx);
-  if (string_ans == "Inf") {
-    return numeric_limits<FLOAT_T>::infinity();
-  } else if (string_ans == "-Inf") {
-    return -numeric_limits<FLOAT_T>::infinity();
-  } else {
-    return getValue<FLOAT_T>(col_idx);
+  checkColumn(col_idx);
+  if (binary_ && binaryNumber(col_idx)) {
+    return (FLOAT_T) binary_block_.getDouble(col_idx, binary_row_);
+  }
+  const char* begin;
+  const char* end;
+  fieldChars(col_idx, &begin, &end);
+  FLOAT_T value;
+  if (!TryFloat(begin, end, &value)) {
+    throw runtime_error("Could not convert string '" + string(begin, end) + "'");
+  }
+  return value;
+}
+
+/**
+ * Parses [begin, end) the way getFloat() reads a cell.
+ * \returns false if it is not a number.
+ */
+bool DelimitedFileReader::TryFloat(
+  const char* begin, ///< first character
+  const char* end, ///< one past the last character, not a digit
+  FLOAT_T* value ///< the value -out
+  ) {
+  if (ParseFloat(begin, end, value)) {
+    return true;
+  } else if (end - begin == 3 && strncmp(begin, "Inf", 3) == 0) {
+    *value = numeric_limits<FLOAT_T>::infinity();
+    return true;
+  } else if (end - begin == 4 && strncmp(begin, "-Inf", 4) == 0) {
+    *value = -numeric_limits<FLOAT_T>::infinity();
+    return true;
   }
+  return StringUtils::TryFromString(string(begin, end), value);
 }
 
 /** 
@@ -344,12 +701,21 @@ FLOAT_T DelimitedFileReader::getFloat(
 double DelimitedFileReader::getDouble(
   unsigned int col_idx ///< the column index 
   ) {
-  const string& string_ans = getString(col_idx);
-  if (string_ans == "") {
+  checkColumn(col_idx);
+  if (binary_ && binaryNumber(col_idx)) {
+    return binary_block_.getDouble(col_idx, binary_row_);
+  }
+  const char* begin;
+  const char* end;
+  fieldChars(col_idx, &begin, &end);
+  double value;
+  if (ParseDouble(begin, end, &value)) {
+    return value;
+  } else if (begin == end) {
     return 0.0;
-  } else if (string_ans == "Inf") {
+  } else if (end - begin == 3 && strncmp(begin, "Inf", 3) == 0) {
     return numeric_limits<double>::infinity();
-  } else if (string_ans == "-Inf") {
+  } else if (end - begin == 4 && strncmp(begin, "-Inf", 4) == 0) {
     return -numeric_limits<double>::infinity();
   } else {
     return getValue<double>(col_idx);
@@ -379,7 +745,31 @@ int DelimitedFileReader::getInteger(
   unsigned int col_idx ///< the column index 
   ) {
   //TODO : check the string for a valid integer.
-  return getValue<int>(col_idx);
+  checkColumn(col_idx);
+  if (binary_ && binaryNumber(col_idx)) {
+    return (int) binary_block_.getInt(col_idx, binary_row_);
+  }
+  const char* begin;
+  const char* end;
+  fieldChars(col_idx, &begin, &end);
+  int value;
+  if (!TryInteger(begin, end, &value)) {
+    throw runtime_error("Could not convert string '" + string(begin, end) + "'");
+  }
+  return value;
+}
+
+/**
+ * Parses [begin, end) the way getInteger() reads a cell.
+ * \returns false if it is not an integer.
+ */
+bool DelimitedFileReader::TryInteger(
+  const char* begin, ///< first character
+  const char* end, ///< one past the last character, not a digit
+  int* value ///< the value -out
+  ) {
+  return ParseInteger(begin, end, value) ||
+    StringUtils::TryFromString(string(begin, end), value);
 }
 
 /**
@@ -458,8 +848,13 @@ void DelimitedFileReader::getDoubleVectorFromCell(
  * resets the file pointer to the beginning of the file.
  */
 void DelimitedFileReader::reset() {
-  istream_ptr_->clear();
-  istream_ptr_->seekg(istream_begin_, ios::beg);
+  if (compressed_) {
+    delete istream_ptr_;
+    istream_ptr_ = FileUtils::GetReadStream(file_name_);
+  } else {
+    istream_ptr_->clear();
+    istream_ptr_->seekg(istream_begin_, ios::beg);
+  }
   loadData();
 }
 
@@ -467,27 +862,48 @@ void DelimitedFileReader::reset() {
  * parses the next line in the file. 
  */
 void DelimitedFileReader::next() {
+  if (binary_) {
+    nextBinary();
+    return;
+  }
   if (has_next_) {
+    if (has_current_ && !readLine()) {
+      carp(CARP_FATAL, "Cannot read line %d of %s", current_row_ + 1, file_name_.c_str());
+    }
     current_row_++;
-    current_data_string_ = next_data_string_;
-    //parse next_data_string_ into data_
-    data_ = StringUtils::Split(current_data_string_, delimiter_);
+    current_data_valid_ = false;
+    //find the fields of the line
+    const char* line = &buffer_[0];
+    size_t begin = line_begin_;
+    while (true) {
+      const char* delimiter = (const char*) memchr(line + begin, delimiter_, line_end_ - begin);
+      size_t end = delimiter == NULL ? line_end_ : delimiter - line;
+      fields_.push_back(make_pair(begin, end));
+      if (delimiter == NULL) {
+        break;
+      }
+      begin = end + 1;
+    }
     //make sure data has the right number of columns for the header.
-    if (data_.size() < column_names_.size()) {
+    if (fields_.size() < column_names_.size()) {
       if (!column_mismatch_warned_) {
         carp(CARP_WARNING, "Column count %d for line %d is less than header %d",
-             data_.size(), current_row_, column_names_.size());
-        carp(CARP_WARNING, "%s", current_data_string_.c_str());
+             fields_.size(), current_row_, column_names_.size());
+        carp(CARP_WARNING, "%s", getString().c_str());
         carp(CARP_WARNING, "Suppressing warnings, other mismatches may exist!");
         column_mismatch_warned_ = true;
       }
-      while (data_.size() < column_names_.size()) {
-        data_.push_back("");
+      while (fields_.size() < column_names_.size()) {
+        fields_.push_back(make_pair(line_end_, line_end_));
       }
     }
+    if (data_.size() < fields_.size()) {
+      data_.resize(fields_.size());
+    }
+    data_valid_.assign(fields_.size(), false);
 
-    //read next line
-    has_next_ = !getline(*istream_ptr_, next_data_string_).fail();
+    //is there a next line
+    has_next_ = moreData();
     has_current_ = true;
   } else {
     has_current_ = false;
@@ -9,7 +9,13 @@
  * Types from each cell of the table.  This class also provides function
  * for reading a list of integers or string from a cell using a delimiter
  * that is different from the column delimiter (default is comma ',').
- * This class reads the data in line by line
+ * This class reads the file a large block at a time and keeps only the
+ * position of each field of the current line in the block; numbers are
+ * parsed straight from the block, and string copies of fields are made
+ * only when asked for. Files in the Crux binary format (see
+ * BinaryMatchFile.h) are read a block of rows at a time instead, and their
+ * cells are read as the same values. Files whose names end in .gz are
+ * decompressed as they are read.
  ****************************************************************************/
 #ifndef DELIMITEDFILEREADER_H
 #define DELIMITEDFILEREADER_H
@@ -23,20 +29,25 @@
 #include <string>
 #include <vector>
 
+#include "BinaryMatchFile.h"
 #include "parameter.h"
 #include "util/Params.h"
 
 class DelimitedFileReader {
 
  protected:
-  /** The data vector is indexed by column, then by row
-   *  Ex. data_[0][4] means 0th column, 4th row
-   *  data_[0] is a string vector of all data in a column.
-   */
-
-  std::string next_data_string_; ///<the next data string.
-  std::string current_data_string_; ///<the current data string.
-  std::vector<std::string> data_; ///<the current vectorized data.
+  std::vector<char> buffer_; ///<block of the file holding the current line.
+  size_t buffer_size_; ///<bytes of buffer_ read from the file.
+  bool at_eof_; ///<indicator of whether the whole stream is in buffer_
+  size_t line_begin_; ///<offset of the current line in buffer_
+  size_t line_end_; ///<offset of the end of the current line, before '\n'
+  size_t next_line_; ///<offset of the line after the current line
+  std::vector<std::pair<size_t, size_t> > fields_; ///<[begin, end) of each field
+
+  std::string current_data_string_; ///<the current data string, once asked for.
+  bool current_data_valid_; ///<indicator of whether current_data_string_ is set
+  std::vector<std::string> data_; ///<fields of the current line, once asked for.
+  std::vector<char> data_valid_; ///<indicator of which of data_ are set
   std::vector<std::string> column_names_; ///<the column names.
 
   char delimiter_; ///<the delimiter to use.
@@ -47,6 +58,7 @@ class DelimitedFileReader {
   bool has_header_; ///<indicator of whether there is a header in the file
 
   bool owns_stream_; ///<indicator of whether the object owns the stream
+  bool compressed_; ///<indicator of whether the file is gzipped, so can't seek
 
   std::istream* istream_ptr_; ///<pointer to the stream itself
 
@@ -59,6 +71,85 @@ class DelimitedFileReader {
 
   bool column_mismatch_warned_; ///<indicator of whether the column mismatch warning has been issued
 
+  bool binary_; ///<indicator of whether the file is in the binary format
+  BinaryMatchBlock binary_block_; ///<block of a binary file holding the current row
+  size_t binary_row_; ///<index of the current row in binary_block_
+
+  /**
+   * Reads more of the stream into buffer_, first moving the current line
+   * and everything after it to the front.
+   * \returns false if the stream has no more data.
+   */
+  bool fillBuffer();
+
+  /**
+   * Moves in past size bytes, reading through them if in can't seek.
+   */
+  void skip(std::istream* in, size_t size) const;
+
+  /**
+   * Makes the line after the current line current, without splitting it.
+   * \returns false if there is no such line.
+   */
+  bool readLine();
+
+  /**
+   * \returns Whether any data follows the current line.
+   */
+  bool moreData();
+
+  /**
+   * Makes size bytes after next_line_ present in buffer_, dropping what
+   * comes before.
+   * \returns false if the stream ends first.
+   */
+  bool fillBinary(size_t size);
+
+  /**
+   * Reads the column names of a binary file.
+   */
+  void loadBinaryHeader();
+
+  /**
+   * Reads the next block of rows of a binary file into binary_block_.
+   * \returns false if there is no such block.
+   */
+  bool readBinaryBlock();
+
+  /**
+   * next() for binary files.
+   */
+  void nextBinary();
+
+  /**
+   * \returns Pointers to the first character of a field and the one after it.
+   */
+  const char* fieldBegin(unsigned int col_idx) const {
+    return &buffer_[0] + fields_[col_idx].first;
+  }
+  const char* fieldEnd(unsigned int col_idx) const {
+    return &buffer_[0] + fields_[col_idx].second;
+  }
+
+  /**
+   * Sets begin and end to the characters of a field, which for binary
+   * files are formatted first.
+   */
+  void fieldChars(unsigned int col_idx, const char** begin, const char** end);
+
+  /**
+   * \returns Whether a field of a binary file is stored as a number.
+   */
+  bool binaryNumber(unsigned int col_idx) const {
+    return col_idx < binary_block_.numCols() &&
+      binary_block_.type(col_idx) != BinaryMatchFile::STRING_COLUMN;
+  }
+
+  /**
+   * Ends the program if col_idx is not a field of the current line.
+   */
+  void checkColumn(unsigned int col_idx);
+
   /**
    * clears the current data and column names,
    * parses the header if it exists,
@@ -190,6 +281,13 @@ class DelimitedFileReader {
     unsigned int col_idx ///< the column index
   );
 
+  /**
+   * \returns whether the cell is empty
+   */
+  bool isEmpty(
+    unsigned int col_idx ///< the column index
+  );
+
   /**
    * \returns the value of the cell
    * using the current row
@@ -235,6 +333,27 @@ class DelimitedFileReader {
     unsigned int col_idx ///<the col index
   );
 
+  /**
+   * Parses [begin, end) the way getFloat() reads a cell, for callers
+   * that find the fields themselves.
+   * \returns false if it is not a number.
+   */
+  static bool TryFloat(
+    const char* begin, ///< first character
+    const char* end, ///< one past the last character, not a digit
+    FLOAT_T* value ///< the value -out
+  );
+
+  /**
+   * Parses [begin, end) the way getInteger() reads a cell.
+   * \returns false if it is not an integer.
+   */
+  static bool TryInteger(
+    const char* begin, ///< first character
+    const char* end, ///< one past the last character, not a digit
+    int* value ///< the value -out
+  );
+
   /**
    * gets an vector of integers from cell where the
    * string in the cell are integers which are separated
@@ -0,0 +1,197 @@
+/**
+ * \file DelimitedFileScan.cpp
+ * \brief Parallel scans of one column of a tab-delimited file.
+ */
+#include <cstddef>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "app/tide/mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "DelimitedFileScan.h"
+#include "BinaryMatchFile.h"
+#include "carp.h"
+#include "util/FileUtils.h"
+#include "util/ThreadPool.h"
+
+using namespace std;
+
+static const size_t kScanBlockSize = 16 << 20; // bytes of rows in a block
+
+/**
+ * \returns An empty DelimitedFileScan object.
+ */
+DelimitedFileScan::DelimitedFileScan()
+  : data_(NULL), size_(0), first_row_(0), delimiter_('\t') {
+}
+
+/**
+ * Destructor unmaps the file.
+ */
+DelimitedFileScan::~DelimitedFileScan() {
+  if (data_ != NULL) {
+    munmap((void*) data_, size_);
+  }
+}
+
+/**
+ * Maps file_name into memory, past its header line.
+ * \returns false if the file cannot be mapped.
+ */
+bool DelimitedFileScan::open(
+  const string& file_name,
+  char delimiter
+) {
+  delimiter_ = delimiter;
+  if (file_name == "-" || !FileUtils::Exists(file_name) || FileUtils::IsGzip(file_name)) {
+    return false;
+  }
+  size_ = (size_t) FileUtils::Size(file_name);
+  int fd = size_ == 0 ? -1 : ::open(file_name.c_str(), O_RDONLY);
+  void* data = fd < 0 ? MAP_FAILED : mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (data == MAP_FAILED) {
+    size_ = 0;
+    return false;
+  }
+  data_ = (const char*) data;
+  if (BinaryMatchFile::IsBinary(data_, size_)) {
+    munmap((void*) data_, size_);
+    data_ = NULL;
+    size_ = 0;
+    return false;
+  }
+  const char* eol = (const char*) memchr(data_, '\n', size_);
+  first_row_ = eol == NULL ? size_ : eol - data_ + 1;
+  return true;
+}
+
+/**
+ * Finds the rows of [begin, end), which start and end at line
+ * boundaries, and their fields of col_idx.
+ */
+void DelimitedFileScan::splitBlock(
+  size_t begin,
+  size_t end,
+  unsigned int col_idx,
+  ScanBlock* block
+) const {
+  block->row_begin.clear();
+  block->row_end.clear();
+  block->field_begin.clear();
+  block->field_end.clear();
+  block->missing = 0;
+  const char* p = data_ + begin;
+  const char* block_end = data_ + end;
+  while (p < block_end) {
+    const char* eol = (const char*) memchr(p, '\n', block_end - p);
+    if (eol == NULL) {
+      // The last line has no newline; parsing numbers must not read past
+      // the end of the file.
+      block->tail.assign(p, block_end);
+      p = block->tail.c_str();
+      block_end = eol = p + block->tail.size();
+    }
+    // skip to the field
+    const char* field = p;
+    for (unsigned int col = 0; col < col_idx && field != NULL; col++) {
+      field = (const char*) memchr(field, delimiter_, eol - field);
+      field = field == NULL ? NULL : field + 1;
+    }
+    block->row_begin.push_back(p);
+    block->row_end.push_back(eol);
+    if (field == NULL) {
+      block->field_begin.push_back(eol);
+      block->field_end.push_back(eol);
+      block->missing++;
+    } else {
+      const char* field_end = (const char*) memchr(field, delimiter_, eol - field);
+      block->field_begin.push_back(field);
+      block->field_end.push_back(field_end == NULL ? eol : field_end);
+    }
+    p = eol + 1;
+  }
+}
+
+/**
+ * Splits a block and visits it.
+ */
+void DelimitedFileScan::visitBlock(
+  size_t begin,
+  size_t end,
+  unsigned int col_idx,
+  size_t slot,
+  ScanBlock* block,
+  ScanVisitor* visitor
+) const {
+  splitBlock(begin, end, col_idx, block);
+  visitor->visit(slot, *block);
+}
+
+/**
+ * Visits the rows of the file, and their fields of col_idx, in blocks on
+ * num_threads threads.
+ * \returns false if the visitor stopped the scan.
+ */
+bool DelimitedFileScan::scan(
+  unsigned int col_idx,
+  int num_threads,
+  ScanVisitor* visitor
+) const {
+  // blocks end after the first newline past each kScanBlockSize bytes
+  vector<size_t> bounds(1, first_row_);
+  while (bounds.back() < size_) {
+    size_t end = bounds.back() + kScanBlockSize;
+    if (end >= size_) {
+      end = size_;
+    } else {
+      const char* eol = (const char*) memchr(data_ + end, '\n', size_ - end);
+      end = eol == NULL ? size_ : eol - data_ + 1;
+    }
+    bounds.push_back(end);
+  }
+
+  size_t num_blocks = bounds.size() - 1;
+  num_threads = max(1, num_threads);
+  vector<ScanBlock> blocks(min((size_t) num_threads, max(num_blocks, (size_t) 1)));
+  bool warned = false;
+  for (size_t first = 0; first < num_blocks; first += blocks.size()) {
+    size_t wave = min(blocks.size(), num_blocks - first);
+    ThreadPool::TaskGroup threads;
+    for (size_t slot = 1; slot < wave; slot++) {
+      threads.Run(boost::bind(
+        &DelimitedFileScan::visitBlock, this, bounds[first + slot],
+        bounds[first + slot + 1], col_idx, slot, &blocks[slot], visitor));
+    }
+    visitBlock(bounds[first], bounds[first + 1], col_idx, 0, &blocks[0], visitor);
+    threads.Wait();
+    for (size_t slot = 0; slot < wave; slot++) {
+      if (blocks[slot].missing > 0 && !warned) {
+        carp(CARP_WARNING, "Some lines have fewer columns than the header; "
+             "their values of the column are empty.");
+        warned = true;
+      }
+      if (!visitor->finish(slot)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
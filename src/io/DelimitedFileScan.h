@@ -0,0 +1,121 @@
+/**
+ * \file DelimitedFileScan.h
+ * \brief Parallel scans of one column of a tab-delimited file.
+ *
+ * DelimitedFileReader splits every row of a file into fields and copies the
+ * cells it is asked for, one row at a time. For tools that look at a single
+ * column of a large file, this class maps the file into memory, cuts it at
+ * line boundaries into blocks, and has one thread per block find the rows
+ * and the column's field in each, as pointers into the mapped file. The
+ * rows are those DelimitedFileReader would give: every line after the
+ * header, with a row missing the column giving an empty field. Standard
+ * input, gzipped and binary files cannot be mapped; for them open() fails
+ * and callers use DelimitedFileReader instead.
+ */
+#ifndef DELIMITEDFILESCAN_H
+#define DELIMITEDFILESCAN_H
+
+#include <string>
+#include <vector>
+
+/**
+ * The rows of one block: row i is [row_begin[i], row_end[i]), without its
+ * newline, and its field of the scanned column [field_begin[i],
+ * field_end[i]). Like the rows of DelimitedFileReader, each is followed by a
+ * character that is not a digit.
+ */
+struct ScanBlock {
+  std::vector<const char*> row_begin;
+  std::vector<const char*> row_end;
+  std::vector<const char*> field_begin;
+  std::vector<const char*> field_end;
+  size_t missing; ///< rows without the column
+  std::string tail; ///< copy of a last line without a newline
+};
+
+/**
+ * Called back by DelimitedFileScan::scan(). visit() is called on the
+ * threads, once for each block, with the slot (less than the number of
+ * threads) that the block has until finish() is called for it. finish() is
+ * called on the calling thread, for the blocks in file order, and stops the
+ * scan by returning false.
+ */
+class ScanVisitor {
+ public:
+  virtual ~ScanVisitor() {}
+  virtual void visit(size_t slot, const ScanBlock& block) = 0;
+  virtual bool finish(size_t slot) = 0;
+};
+
+class DelimitedFileScan {
+
+ protected:
+  const char* data_;  ///< the mapped file
+  size_t size_;       ///< size of the mapped file
+  size_t first_row_;  ///< offset of the line after the header
+  char delimiter_;
+
+  /**
+   * Finds the rows of [begin, end), which start and end at line
+   * boundaries, and their fields of col_idx.
+   */
+  void splitBlock(
+    size_t begin,
+    size_t end,
+    unsigned int col_idx,
+    ScanBlock* block
+  ) const;
+
+  /**
+   * Splits a block and visits it.
+   */
+  void visitBlock(
+    size_t begin,
+    size_t end,
+    unsigned int col_idx,
+    size_t slot,
+    ScanBlock* block,
+    ScanVisitor* visitor
+  ) const;
+
+ public:
+  /**
+   * \returns An empty DelimitedFileScan object.
+   */
+  DelimitedFileScan();
+
+  /**
+   * Destructor unmaps the file.
+   */
+  ~DelimitedFileScan();
+
+  /**
+   * Maps file_name into memory, past its header line.
+   * \returns false if the file cannot be mapped.
+   */
+  bool open(
+    const std::string& file_name,
+    char delimiter
+  );
+
+  /**
+   * Visits the rows of the file, and their fields of col_idx, in blocks on
+   * num_threads threads.
+   * \returns false if the visitor stopped the scan.
+   */
+  bool scan(
+    unsigned int col_idx,
+    int num_threads,
+    ScanVisitor* visitor
+  ) const;
+
+};
+
+#endif // DELIMITEDFILESCAN_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
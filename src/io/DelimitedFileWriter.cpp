@@ -45,7 +45,6 @@ DelimitedFileWriter::DelimitedFileWriter
  */
 DelimitedFileWriter::~DelimitedFileWriter() {
   if( file_ptr_ ) {
-    file_ptr_->close();
     delete file_ptr_;
   }
 }
@@ -58,7 +57,6 @@ void DelimitedFileWriter::openFile(const char* filename) {
   // write any existing data and close file
   if( file_ptr_ ) {
     writeRow();
-    file_ptr_->close();
     delete file_ptr_;
   }
 
@@ -119,8 +117,8 @@ void DelimitedFileWriter::writeRow() {
   for(size_t idx = 1; idx < current_row_.size(); idx++) {
     *file_ptr_ << delimiter_ << current_row_[idx];
   }
-  // end with newline
-  *file_ptr_ << endl;
+  // end with newline, leaving the stream to flush when its buffer fills
+  *file_ptr_ << '\n';
 
   // clear the current_row and refill with blanks
   // if there is a header, that is the min length
@@ -140,7 +138,7 @@ void DelimitedFileWriter::writeHeader() {
     return;
   }
   
-  if( file_ptr_ == NULL || !file_ptr_->is_open() ) {
+  if( file_ptr_ == NULL || !file_ptr_->good() ) {
     carp(CARP_FATAL, "Cannot write to NULL delimited file.");
   }
   
@@ -203,6 +203,20 @@ MatchCollection* MatchCollectionParser::create(
   return collection;
 }
 
+MatchCollection* MatchCollectionParser::create(
+  istream* matches,
+  const string& match_path,
+  const string& fasta_path
+  ) {
+  if (database_ == NULL || decoy_database_ == NULL) {
+    loadDatabase(fasta_path, database_, decoy_database_);
+  }
+  MatchCollection* collection =
+    MatchFileReader(matches, match_path, database_, decoy_database_).parse();
+  collection->setFilePath(match_path, false);
+  return collection;
+}
+
 /*
  * Local Variables:
  * mode: c
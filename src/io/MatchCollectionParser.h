@@ -34,6 +34,16 @@ class MatchCollectionParser {
     const std::string& fasta_path  ///< path to the protein database
   );
 
+  /**
+   * \returns a MatchCollection object from tab-delimited matches already in
+   * memory, named as if they had been read from match_path
+   */
+  MatchCollection* create(
+    std::istream* matches, ///< tab-delimited matches, with their header
+    const std::string& match_path, ///< name of the matches
+    const std::string& fasta_path  ///< path to the protein database
+  );
+
 
   /**
    * Creates database object(s) from fasta or index file
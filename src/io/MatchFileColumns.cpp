@@ -0,0 +1,254 @@
+/**
+ * \file MatchFileColumns.cpp
+ * \brief Typed columns of a tab-delimited PSM file.
+ */
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "app/tide/mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "MatchFileColumns.h"
+#include "MatchFileWriter.h"
+#include "ScoreIndex.h"
+#include "carp.h"
+#include "util/FileUtils.h"
+#include "util/Params.h"
+
+using namespace std;
+
+/**
+ * \returns An empty MatchFileColumns object.
+ */
+MatchFileColumns::MatchFileColumns() : data_(NULL), size_(0), first_row_(0) {
+  for (int idx = 0; idx < NUMBER_MATCH_COLUMNS; idx++) {
+    match_indices_[idx] = -1;
+  }
+}
+
+/**
+ * Destructor unmaps the file.
+ */
+MatchFileColumns::~MatchFileColumns() {
+  if (data_ != NULL) {
+    munmap((void*) data_, size_);
+  }
+}
+
+/**
+ * \returns The end of the line beginning at p, before any '\r'.
+ */
+static const char* LineEnd(const char* p, const char* end, const char** next) {
+  const char* eol = (const char*) memchr(p, '\n', end - p);
+  if (eol == NULL) {
+    eol = end;
+  }
+  *next = (eol == end) ? end : eol + 1;
+  if (eol > p && *(eol - 1) == '\r') {
+    --eol;
+  }
+  return eol;
+}
+
+/**
+ * Maps file_name into memory and reads its header.
+ * \returns false if the file cannot be read.
+ */
+bool MatchFileColumns::open(
+  const string& file_name
+) {
+  size_ = (size_t) FileUtils::Size(file_name);
+  int fd = size_ == 0 ? -1 : ::open(file_name.c_str(), O_RDONLY);
+  void* data = fd < 0 ? MAP_FAILED : mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (data == MAP_FAILED) {
+    carp(CARP_ERROR, "Cannot read the PSM file %s", file_name.c_str());
+    size_ = 0;
+    return false;
+  }
+  data_ = (const char*) data;
+
+  // Find the MATCH_COLUMN of every column in the header line
+  const char* next;
+  const char* end = LineEnd(data_, data_ + size_, &next);
+  first_row_ = next - data_;
+  const char* field = data_;
+  while (true) {
+    const char* tab = (const char*) memchr(field, '\t', end - field);
+    const char* field_end = (tab == NULL) ? end : tab;
+    string name(field, field_end);
+    MATCH_COLUMNS_T col = INVALID_COL;
+    for (int idx = 0; idx < NUMBER_MATCH_COLUMNS; idx++) {
+      if (name == get_column_header(idx)) {
+        col = (MATCH_COLUMNS_T) idx;
+        if (match_indices_[idx] == -1) {
+          match_indices_[idx] = file_columns_.size();
+        }
+        break;
+      }
+    }
+    file_columns_.push_back(col);
+    if (tab == NULL) {
+      break;
+    }
+    field = tab + 1;
+  }
+  return true;
+}
+
+/**
+ * Loads the rows of the open file with an xcorr rank of at most max_rank
+ * (all rows if max_rank is 0), reading scores from score_col.
+ */
+void MatchFileColumns::load(
+  MATCH_COLUMNS_T score_col,
+  int max_rank,
+  bool all_decoys,
+  map<string, int>* file_ids
+) {
+  const char* end = data_ + size_;
+  const char* next;
+  const char* eol;
+
+  // Which value, if any, each column of the file holds
+  enum { NONE, SCORE, FILE_NAME, SCAN, CHARGE, RANK, PROTEIN };
+  vector<char> roles(file_columns_.size(), NONE);
+  MATCH_COLUMNS_T role_cols[] = { INVALID_COL, score_col, FILE_COL, SCAN_COL,
+                                  CHARGE_COL, XCORR_RANK_COL, PROTEIN_ID_COL };
+  for (int role = SCORE; role <= PROTEIN; role++) {
+    if (match_indices_[role_cols[role]] != -1) {
+      roles[match_indices_[role_cols[role]]] = role;
+    }
+  }
+  const string decoy_prefix = Params::GetString("decoy-prefix");
+  string spectrum_file;
+  int no_file = -1;
+  if (!hasColumn(FILE_COL)) {
+    no_file = file_ids->insert(make_pair(string(), (int) file_ids->size())).first->second;
+  }
+
+  for (const char* line = data_ + first_row_; line < end; line = next) {
+    eol = LineEnd(line, end, &next);
+    if (eol == line) {
+      continue;
+    }
+    FLOAT_T score = 0;
+    int file = no_file, scan = -1, charge = -1, rank = -1;
+    bool decoy = all_decoys;
+    const char* field = line;
+    for (size_t col = 0; col < roles.size() && field <= eol; col++) {
+      const char* tab = (const char*) memchr(field, '\t', eol - field);
+      const char* field_end = (tab == NULL) ? eol : tab;
+      switch (roles[col]) {
+      case SCORE:
+        score = (FLOAT_T) strtod(field, NULL);
+        break;
+      case FILE_NAME:
+        spectrum_file.assign(field, field_end);
+        file = file_ids->insert(make_pair(spectrum_file, (int) file_ids->size())).first->second;
+        break;
+      case SCAN:
+        scan = field == field_end ? -1 : atoi(field);
+        break;
+      case CHARGE:
+        charge = field == field_end ? -1 : atoi(field);
+        break;
+      case RANK:
+        rank = field == field_end ? -1 : atoi(field);
+        break;
+      case PROTEIN:
+        decoy = decoy || (field_end - field >= (ptrdiff_t) decoy_prefix.length() &&
+                          strncmp(field, decoy_prefix.data(), decoy_prefix.length()) == 0);
+        break;
+      }
+      field = field_end + 1;
+    }
+    if (max_rank != 0 && rank > max_rank) {
+      continue;
+    }
+    scores_.push_back(score);
+    files_.push_back(file);
+    scans_.push_back(scan);
+    charges_.push_back(charge);
+    ranks_.push_back(rank);
+    decoys_.push_back(decoy ? 1 : 0);
+    rows_.push_back(line - data_);
+  }
+}
+
+/**
+ * Loads the rows of the open file that index lists, in its order, with an
+ * xcorr rank of at most max_rank, without reading the file.
+ */
+bool MatchFileColumns::load(
+  const ScoreIndex& index,
+  int max_rank
+) {
+  const vector<ScoreIndex::Entry>& entries = index.entries();
+  for (vector<ScoreIndex::Entry>::const_iterator i = entries.begin();
+       i != entries.end();
+       ++i) {
+    if (i->offset < first_row_ || i->offset >= size_ ||
+        data_[i->offset - 1] != '\n') {
+      carp(CARP_WARNING, "The score index has a row that the file does not.");
+      scores_.clear();
+      files_.clear();
+      scans_.clear();
+      charges_.clear();
+      ranks_.clear();
+      decoys_.clear();
+      rows_.clear();
+      return false;
+    }
+    if (max_rank != 0 && i->rank > max_rank) {
+      continue;
+    }
+    scores_.push_back((FLOAT_T) i->score);
+    files_.push_back(-1);
+    scans_.push_back(-1);
+    charges_.push_back(-1);
+    ranks_.push_back(i->rank);
+    decoys_.push_back(i->decoy != 0 ? 1 : 0);
+    rows_.push_back(i->offset);
+  }
+  return true;
+}
+
+/**
+ * Sets the columns of the current row of output to the fields of the given
+ * row, for the columns that this file and output have in common.
+ */
+void MatchFileColumns::setColumnsCurrentRow(
+  size_t row,
+  MatchFileWriter* output
+) const {
+  const char* end = data_ + size_;
+  const char* next;
+  const char* field = data_ + rows_[row];
+  const char* eol = LineEnd(field, end, &next);
+  for (size_t col = 0; col < file_columns_.size() && field <= eol; col++) {
+    const char* tab = (const char*) memchr(field, '\t', eol - field);
+    const char* field_end = (tab == NULL) ? eol : tab;
+    MATCH_COLUMNS_T match_col = file_columns_[col];
+    if (match_col != INVALID_COL && match_indices_[match_col] == (int) col) {
+      output->setColumnCurrentRow(match_col, string(field, field_end));
+    }
+    field = field_end + 1;
+  }
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,123 @@
+/**
+ * \file MatchFileColumns.h
+ * \brief Typed columns of a tab-delimited PSM file.
+ *
+ * Unlike MatchFileReader, which builds a Match, Peptide and Spectrum for
+ * every row, this class maps the file into memory and keeps only the few
+ * values target-decoy competition needs (score, spectrum file, scan, charge,
+ * rank and whether the PSM is a decoy) in one array each, plus the position
+ * of every row so that the rows can be written out again unchanged.
+ */
+#ifndef MATCH_FILE_COLUMNS_H
+#define MATCH_FILE_COLUMNS_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "MatchColumns.h"
+#include "model/objects.h"
+
+class MatchFileWriter;
+class ScoreIndex;
+
+class MatchFileColumns {
+
+ protected:
+  const char* data_;      ///< the mapped file
+  size_t size_;           ///< size of the mapped file
+  int match_indices_[NUMBER_MATCH_COLUMNS]; ///< idx of each MATCH_COLUMN in file
+  std::vector<MATCH_COLUMNS_T> file_columns_; ///< MATCH_COLUMN of each idx in file
+
+  std::vector<FLOAT_T> scores_;
+  std::vector<int> files_;   ///< ids from the file_ids map given to load()
+  std::vector<int> scans_;
+  std::vector<int> charges_;
+  std::vector<int> ranks_;
+  std::vector<char> decoys_;
+  std::vector<size_t> rows_; ///< offset of each row in data_
+  size_t first_row_;         ///< offset of the line after the header
+
+ public:
+  /**
+   * \returns An empty MatchFileColumns object.
+   */
+  MatchFileColumns();
+
+  /**
+   * Destructor unmaps the file.
+   */
+  ~MatchFileColumns();
+
+  /**
+   * Maps file_name into memory and reads its header.
+   * \returns false if the file cannot be read.
+   */
+  bool open(
+    const std::string& file_name
+  );
+
+  /**
+   * Loads the rows of the open file with an xcorr rank of at most max_rank
+   * (all rows if max_rank is 0), reading scores from score_col. Spectrum file
+   * names are numbered in file_ids, which may be shared by several objects so
+   * that their ids agree. Rows are decoys if all_decoys is set or their
+   * protein id starts with the decoy prefix.
+   */
+  void load(
+    MATCH_COLUMNS_T score_col,
+    int max_rank,
+    bool all_decoys,
+    std::map<std::string, int>* file_ids
+  );
+
+  /**
+   * Loads the rows of the open file that index lists, in its order, with an
+   * xcorr rank of at most max_rank, without reading the file. The spectrum
+   * file, scan and charge of each row are left at -1, so the rows cannot be
+   * matched with those of a separate decoy file.
+   * \returns false if the index does not fit the file.
+   */
+  bool load(
+    const ScoreIndex& index,
+    int max_rank
+  );
+
+  /**
+   * \returns Whether the file has the given column.
+   */
+  bool hasColumn(MATCH_COLUMNS_T col) const {
+    return match_indices_[col] != -1;
+  }
+
+  /**
+   * \returns The number of rows loaded.
+   */
+  size_t size() const { return rows_.size(); }
+
+  std::vector<FLOAT_T>& getScores() { return scores_; }
+  FLOAT_T getScore(size_t row) const { return scores_[row]; }
+  int getFile(size_t row) const { return files_[row]; }
+  int getScan(size_t row) const { return scans_[row]; }
+  int getCharge(size_t row) const { return charges_[row]; }
+  int getRank(size_t row) const { return ranks_[row]; }
+  bool isDecoy(size_t row) const { return decoys_[row] != 0; }
+
+  /**
+   * Sets the columns of the current row of output to the fields of the given
+   * row, for the columns that this file and output have in common.
+   */
+  void setColumnsCurrentRow(
+    size_t row,
+    MatchFileWriter* output
+  ) const;
+
+};
+
+#endif // MATCH_FILE_COLUMNS_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
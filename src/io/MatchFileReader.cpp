@@ -44,6 +44,15 @@ MatchFileReader::MatchFileReader(istream* iptr) : DelimitedFileReader(iptr, true
   parseHeader();
 }
 
+MatchFileReader::MatchFileReader(
+  istream* iptr,
+  const string& file_name,
+  Database* database,
+  Database* decoy_database
+) : DelimitedFileReader(iptr, true, '\t'), PSMReader(file_name, database, decoy_database) {
+  parseHeader();
+}
+
 /**
  * Destructor
  */
@@ -151,7 +160,7 @@ bool MatchFileReader::empty(
   if (idx == -1) {
     return true;
   }
-  return DelimitedFileReader::getString(idx).empty();
+  return DelimitedFileReader::isEmpty(idx);
 }
 
 /**
@@ -63,6 +63,17 @@ class MatchFileReader: public DelimitedFileReader, public PSMReader {
       std::istream* iptr
     );
 
+    /**
+     * \returns a MatchFileReader object that loads the tab-delimited data
+     * of an input stream, named as if read from file_name
+     */
+    MatchFileReader(
+      std::istream* iptr,
+      const std::string& file_name,
+      Database* database,
+      Database* decoy_database = NULL
+    );
+
     /**
      * Destructor
      */
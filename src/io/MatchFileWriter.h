@@ -97,6 +97,21 @@ class MatchFileWriter : public DelimitedFileWriter {
       StringUtils::ToString(value, match_precision_[col_type], match_fixed_float_[col_type]);
   }
 
+  /**
+   * Set the value in the current row for the given MATCH_COLUMN_T to a
+   * field that is already formatted.
+   */
+  void setColumnCurrentRow
+    (MATCH_COLUMNS_T col_type,
+     const std::string& value) {
+
+    int file_column = match_indices_[col_type];
+    if( file_column == -1 ) {
+      return;
+    }
+    current_row_.at(file_column) = value;
+  }
+
 };
 
 #endif // MATCH_FILE_WRITER_H
@@ -29,6 +29,7 @@ using namespace identdata;
  */
 void MzIdentMLReader::init() {
   match_collection_ = NULL;
+  visitor_ = NULL;
   use_pass_threshold_ = Params::GetBool("mzid-use-pass-threshold");
 }
 
@@ -158,6 +159,26 @@ MatchCollection* MzIdentMLReader::parse() {
   return match_collection_;
 }
 
+/**
+ * Hands each match, and then the spectra of its result, to visitor as read from
+ * the mzid objects
+ */
+void MzIdentMLReader::visit(PSMVisitor* visitor) {
+  // the collection only keeps the scored types
+  match_collection_ = new MatchCollection();
+  match_collection_->preparePostProcess();
+  visitor_ = visitor;
+  pwiz_reader_ = new IdentDataFile(file_path_);
+  parseMods();
+  parseDatabaseSequences();
+  parsePSMs();
+  delete pwiz_reader_;
+  pwiz_reader_ = NULL;
+  visitor_ = NULL;
+  delete match_collection_;
+  match_collection_ = NULL;
+}
+
 void MzIdentMLReader::parseMods() {
   AnalysisProtocolCollection& apc = pwiz_reader_->analysisProtocolCollection;
   for (vector<SpectrumIdentificationProtocolPtr>::const_iterator i = apc.spectrumIdentificationProtocol.begin();
@@ -238,6 +259,7 @@ void MzIdentMLReader::parsePSMs() {
         string filename = result.spectraDataPtr->location;
         carp(CARP_DEBUG, "filename:%s", filename.c_str());
       }
+      vector<Spectrum*> result_spectra; // for the visitor
       for (vector<SpectrumIdentificationItemPtr>::const_iterator k =
              result.spectrumIdentificationItem.begin();
            k != result.spectrumIdentificationItem.end();
@@ -346,11 +368,23 @@ void MzIdentMLReader::parsePSMs() {
         Match* match = new Match(peptide, spectrum, zstate, is_decoy);
         // trying to set lnExperimentSize to -1 -> representing unavailable information on distinct matches/spectrum
         match->setLnExperimentSize(-1);
-        match_collection_->addMatchToPostMatchCollection(match);
+        if (visitor_ == NULL) {
+          match_collection_->addMatchToPostMatchCollection(match);
+        }
         match->setRank(XCORR, item.rank); // Is it safe to assume this?
         carp(CARP_DEBUG, "charge: %i obs mz: %f calc mass: %f sequence: %s",
              charge, obs_mz, calc_mass, sequence.c_str());
         addScores(item, match);
+        if (visitor_ != NULL) {
+          visitor_->visitMatch(match, match_collection_);
+          result_spectra.push_back(spectrum);
+        }
+      }
+      // the spectra are done once every item of the result is
+      for (vector<Spectrum*>::const_iterator k = result_spectra.begin();
+           k != result_spectra.end();
+           ++k) {
+        visitor_->visitSpectrumEnd(*k);
       }
     }
   }
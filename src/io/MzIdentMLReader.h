@@ -23,6 +23,7 @@ class MzIdentMLReader : public PSMReader {
 
   pwiz::identdata::IdentDataFile* pwiz_reader_; ///< proteowizard's reader for mzid.
   MatchCollection* match_collection_; ///<resulting match collection
+  PSMVisitor* visitor_; ///< takes the matches instead of the collection, if set
   bool use_pass_threshold_; ///<indicator of whether to use the passThreshold attribute
 
   /**
@@ -82,6 +83,12 @@ class MzIdentMLReader : public PSMReader {
    */
   MatchCollection* parse();
 
+  /**
+   * Hands each match, and then the spectra of its result, to visitor as read from
+   * the mzid objects
+   */
+  void visit(PSMVisitor* visitor);
+
   /**
    * \returns the MatchCollection resulting from the parsed xml file
    */
@@ -0,0 +1,624 @@
+/**
+ * \file MzmlSpectrumCollection.cpp
+ * \brief Class to read mzML files in parallel, without pwiz.
+ */
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "app/tide/mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <zlib.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "MzmlSpectrumCollection.h"
+#include "PWIZSpectrumCollection.h"
+#include "util/crux-utils.h"
+#include "util/FileUtils.h"
+#include "util/Params.h"
+#include "util/StringUtils.h"
+#include "util/ThreadPool.h"
+#include "parameter.h"
+
+using namespace std;
+
+// Files smaller than this are parsed on one thread.
+static const size_t kMinParallelBytes = 1 << 20;
+
+// The controlled vocabulary terms that are read.
+static const char kMsLevel[] = "\"MS:1000511\"";
+static const char kSpectrumTitle[] = "\"MS:1000796\"";
+static const char kPeakListScans[] = "\"MS:1000797\"";
+static const char kIsolationTarget[] = "\"MS:1000827\"";
+static const char kSelectedIonMz[] = "\"MS:1000744\"";
+static const char kChargeState[] = "\"MS:1000041\"";
+static const char kPossibleChargeState[] = "\"MS:1000633\"";
+static const char kMzArray[] = "\"MS:1000514\"";
+static const char kIntensityArray[] = "\"MS:1000515\"";
+static const char kFloat32[] = "\"MS:1000521\"";
+static const char kFloat64[] = "\"MS:1000523\"";
+static const char kZlib[] = "\"MS:1000574\"";
+static const char kNoCompression[] = "\"MS:1000576\"";
+
+// The values of base64 digits, or -1.
+struct Base64Table {
+  signed char value[256];
+  Base64Table() {
+    const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    memset(value, -1, sizeof(value));
+    for (int i = 0; i < 64; i++) {
+      value[(unsigned char)digits[i]] = i;
+    }
+  }
+};
+static const Base64Table kBase64;
+
+// The first s in [p, end), or end.
+static const char* Find(const char* p, const char* end, const char* s) {
+  size_t n = strlen(s);
+  while (p + n <= end) {
+    const char* q = (const char*) memchr(p, *s, end - p - n + 1);
+    if (q == NULL) {
+      break;
+    } else if (memcmp(q, s, n) == 0) {
+      return q;
+    }
+    p = q + 1;
+  }
+  return end;
+}
+
+// The first element named name (and not one whose name it only starts) in
+// [p, end), or end.
+static const char* FindElement(const char* p, const char* end, const char* name) {
+  size_t n = strlen(name);
+  for (p = Find(p, end, name); p < end; p = Find(p + 1, end, name)) {
+    char next = p + n < end ? p[n] : '\0';
+    if (next == '>' || next == '/' || isspace((unsigned char)next)) {
+      return p;
+    }
+  }
+  return end;
+}
+
+// The value of attribute name in the tag [tag, tag_end).
+static bool Attribute(const char* tag, const char* tag_end, const char* name,
+                      string* value) {
+  string key = string(" ") + name + "=\"";
+  const char* p = Find(tag, tag_end, key.c_str());
+  if (p == tag_end) {
+    return false;
+  }
+  p += key.size();
+  const char* q = (const char*) memchr(p, '"', tag_end - p);
+  if (q == NULL) {
+    return false;
+  }
+  value->assign(p, q);
+  return true;
+}
+
+// The end of the tag that p is in.
+static const char* TagEnd(const char* p, const char* end) {
+  const char* q = (const char*) memchr(p, '>', end - p);
+  return q != NULL ? q : end;
+}
+
+// The start of the tag that p is in.
+static const char* TagStart(const char* begin, const char* p) {
+  while (p > begin && *p != '<') {
+    --p;
+  }
+  return p;
+}
+
+/**
+ * Finds the next cvParam for accession in [*p, end), gets its value and
+ * advances *p past it.
+ * \returns false if there is none.
+ */
+static bool NextCvParam(const char** p, const char* end, const char* accession,
+                        string* value) {
+  const char* q = Find(*p, end, accession);
+  if (q == end) {
+    return false;
+  }
+  const char* tag_end = TagEnd(q, end);
+  value->clear();
+  Attribute(TagStart(*p, q), tag_end, "value", value);
+  *p = tag_end;
+  return true;
+}
+
+static bool CvParam(const char* begin, const char* end, const char* accession,
+                    string* value) {
+  return NextCvParam(&begin, end, accession, value);
+}
+
+static bool HasCvParam(const char* begin, const char* end, const char* accession) {
+  return Find(begin, end, accession) != end;
+}
+
+/**
+ * Reads the scan numbers from a title of the form
+ * <name>.<first scan>.<last scan>.<charge>.dta, as
+ * PWIZSpectrumCollection::parseFirstLastScanFromTitle() does.
+ */
+static bool ScansFromTitle(const string& title, int* first_scan, int* last_scan) {
+  vector<string> tokens = StringUtils::Split(title, '.');
+  size_t n = tokens.size();
+  int charge;
+  return n >= 4 && tokens.back().find("dta") == 0 &&
+    StringUtils::TryFromString(tokens[n - 2], &charge) &&
+    StringUtils::TryFromString(tokens[n - 3], last_scan) &&
+    StringUtils::TryFromString(tokens[n - 4], first_scan);
+}
+
+// The scan number in a native id such as "controllerType=0 controllerNumber=1
+// scan=1234", "scanId=1234" or "index=1233", or 0.
+static int ScanFromId(const string& id) {
+  const char* kKeys[] = { "scan=", "scanId=", "spectrum=", "index=" };
+  for (size_t i = 0; i < sizeof(kKeys) / sizeof(*kKeys); i++) {
+    size_t pos = id.find(kKeys[i]);
+    if (pos != string::npos && (pos == 0 || id[pos - 1] == ' ')) {
+      return atoi(id.c_str() + pos + strlen(kKeys[i]));
+    }
+  }
+  return 0;
+}
+
+/**
+ * Decodes the base64 in [p, end), skipping whitespace, into out. Whole
+ * groups of four digits are decoded without checking for anything else.
+ * \returns false if there is anything but base64 and whitespace.
+ */
+static bool DecodeBase64(const char* p, const char* end, vector<unsigned char>* out) {
+  out->clear();
+  out->reserve((end - p) / 4 * 3 + 3);
+  const signed char* value = kBase64.value;
+  unsigned int bits = 0;
+  int n = 0;
+  while (p < end) {
+    if (n == 0) {
+      while (end - p >= 4) {
+        int a = value[(unsigned char)p[0]];
+        int b = value[(unsigned char)p[1]];
+        int c = value[(unsigned char)p[2]];
+        int d = value[(unsigned char)p[3]];
+        if ((a | b | c | d) < 0) {
+          break;
+        }
+        unsigned int group = a << 18 | b << 12 | c << 6 | d;
+        out->push_back((unsigned char)(group >> 16));
+        out->push_back((unsigned char)(group >> 8));
+        out->push_back((unsigned char)group);
+        p += 4;
+      }
+      if (p == end) {
+        break;
+      }
+    }
+    char ch = *p++;
+    int v = value[(unsigned char)ch];
+    if (v >= 0) {
+      bits = bits << 6 | v;
+      if (++n == 4) {
+        out->push_back((unsigned char)(bits >> 16));
+        out->push_back((unsigned char)(bits >> 8));
+        out->push_back((unsigned char)bits);
+        bits = 0;
+        n = 0;
+      }
+    } else if (ch == '=') {
+      break;
+    } else if (!isspace((unsigned char)ch)) {
+      return false;
+    }
+  }
+  if (n == 2) {
+    out->push_back((unsigned char)(bits >> 4));
+  } else if (n == 3) {
+    out->push_back((unsigned char)(bits >> 10));
+    out->push_back((unsigned char)(bits >> 2));
+  } else if (n == 1) {
+    return false;
+  }
+  return true;
+}
+
+static bool LittleEndian() {
+  unsigned int one = 1;
+  return *(unsigned char*)&one == 1;
+}
+
+/**
+ * Decodes the peak array in the binaryDataArray element [begin, end), of
+ * about length values, into values.
+ * \returns false if its encoding is not one this class reads.
+ */
+static bool DecodeArray(const char* begin, const char* end, int length,
+                        vector<double>* values) {
+  int width;
+  if (HasCvParam(begin, end, kFloat64)) {
+    width = 8;
+  } else if (HasCvParam(begin, end, kFloat32)) {
+    width = 4;
+  } else {
+    return false;
+  }
+  bool zlib = HasCvParam(begin, end, kZlib);
+  if (!zlib && !HasCvParam(begin, end, kNoCompression)) {
+    return false;
+  }
+
+  const char* binary = FindElement(begin, end, "<binary");
+  if (binary == end) {
+    return false;
+  }
+  binary = TagEnd(binary, end);
+  if (binary == end || binary[-1] == '/') {
+    values->clear();  // <binary/>
+    return true;
+  }
+  ++binary;
+  const char* binary_end = Find(binary, end, "</binary>");
+
+  vector<unsigned char> bytes;
+  if (!DecodeBase64(binary, binary_end, &bytes)) {
+    return false;
+  }
+  if (zlib) {
+    vector<unsigned char> inflated((size_t)length * width);
+    uLongf size = inflated.size();
+    if (uncompress(inflated.empty() ? NULL : &inflated[0], &size,
+                   bytes.empty() ? NULL : &bytes[0], bytes.size()) != Z_OK) {
+      return false;
+    }
+    inflated.resize(size);
+    bytes.swap(inflated);
+  }
+
+  // mzML arrays are little-endian
+  size_t count = bytes.size() / width;
+  values->resize(count);
+  bool swap = !LittleEndian();
+  for (size_t i = 0; i < count; i++) {
+    unsigned char* x = &bytes[i * width];
+    if (swap) {
+      reverse(x, x + width);
+    }
+    if (width == 8) {
+      double d;
+      memcpy(&d, x, 8);
+      (*values)[i] = d;
+    } else {
+      float f;
+      memcpy(&f, x, 4);
+      (*values)[i] = f;
+    }
+  }
+  return true;
+}
+
+bool MzmlSpectrumCollection::CanParse(const string& filename) {
+  string extension = FileUtils::Extension(filename);
+  transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  return extension == ".mzml";
+}
+
+/**
+ * Instantiates a new spectrum_collection object from a filename.
+ * Does not parse file.
+ */
+MzmlSpectrumCollection::MzmlSpectrumCollection(
+  const string& filename   ///< The spectrum collection filename.
+) : SpectrumCollection(filename) {
+  use_z_line_ = Params::GetBool("use-z-line");
+}
+
+bool MzmlSpectrumCollection::parseRange(
+  const char* begin,
+  const char* end,
+  vector<Crux::Spectrum*>* spectra
+) const {
+  string value;
+  vector<double> mzs, intensities;
+  for (const char* s = FindElement(begin, end, "<spectrum"); s < end;
+       s = FindElement(s, end, "<spectrum")) {
+    const char* s_end = Find(s, end, "</spectrum>");
+    const char* tag_end = TagEnd(s, s_end);
+    const char* next = s_end;
+    bool has_groups = FindElement(s, s_end, "<referenceableParamGroupRef") != s_end;
+
+    // skip if no peaks or not ms2
+    int length = Attribute(s, tag_end, "defaultArrayLength", &value) ?
+      atoi(value.c_str()) : 0;
+    if (!CvParam(tag_end, s_end, kMsLevel, &value)) {
+      if (has_groups) {
+        return false;  // the ms level may be in a group
+      }
+      s = next;
+      continue;
+    }
+    if (length < 1 || atoi(value.c_str()) != 2) {
+      s = next;
+      continue;
+    }
+
+    // The scan numbers, in the order PWIZSpectrumCollection looks for them
+    int first_scan = 0, last_scan = 0;
+    if (!CvParam(tag_end, s_end, kPeakListScans, &value) ||
+        !get_first_last_scan_from_string(value, first_scan, last_scan)) {
+      if (!CvParam(tag_end, s_end, kSpectrumTitle, &value) ||
+          !ScansFromTitle(value, &first_scan, &last_scan)) {
+        first_scan = last_scan =
+          Attribute(s, tag_end, "id", &value) ? ScanFromId(value) : 0;
+      }
+    }
+
+    // The precursor, and the m/z and charge of each of its selected ions
+    const char* precursor = FindElement(tag_end, s_end, "<precursor");
+    const char* precursor_end = Find(precursor, s_end, "</precursor>");
+    vector<pair<int, double> > ions;
+    vector<int> possible_charges;
+    for (const char* ion = FindElement(precursor, precursor_end, "<selectedIon");
+         ion < precursor_end;
+         ion = FindElement(ion + 1, precursor_end, "<selectedIon")) {
+      const char* ion_end = Find(ion, precursor_end, "</selectedIon>");
+      int charge = CvParam(ion, ion_end, kChargeState, &value) ? atoi(value.c_str()) : 0;
+      double mz = CvParam(ion, ion_end, kSelectedIonMz, &value) ? atof(value.c_str()) : 0;
+      ions.push_back(make_pair(charge, mz));
+      if (ions.size() == 1) {
+        for (const char* p = ion; NextCvParam(&p, ion_end, kPossibleChargeState, &value); ) {
+          possible_charges.push_back(atoi(value.c_str()));
+        }
+      }
+    }
+    if (ions.empty()) {
+      return false;  // pwiz reports the error
+    }
+    double precursor_mz = CvParam(precursor, precursor_end, kIsolationTarget, &value) ?
+      atof(value.c_str()) : ions[0].second;
+
+    Crux::Spectrum* spectrum = new Crux::Spectrum(first_scan, last_scan, precursor_mz,
+                                                  vector<int>(), filename_);
+    spectra->push_back(spectrum);
+    if (ions[0].first > 0) {
+      for (vector<pair<int, double> >::const_iterator i = ions.begin(); i != ions.end(); ++i) {
+        if (i->first <= 0) {
+          continue;
+        } else if (i->second <= 0) {
+          return false;  // pwiz reads other masses, or reports the error
+        }
+        SpectrumZState zstate;
+        zstate.setMZ(i->second, i->first);
+        spectrum->addZState(zstate);
+      }
+    } else {
+      if (use_z_line_) {
+        // "<charge> <m/z>", from MS2 Z lines
+        const char* p = tag_end;
+        while ((p = Find(p, s_end, "name=\"ms2 file charge state\"")) < s_end) {
+          const char* z_end = TagEnd(p, s_end);
+          if (Attribute(TagStart(tag_end, p), z_end, "value", &value)) {
+            vector<string> z = StringUtils::Split(value, ' ');
+            if (z.size() == 2) {
+              SpectrumZState zstate;
+              zstate.setMZ(atof(z[1].c_str()), atoi(z[0].c_str()));
+              spectrum->addZState(zstate);
+            }
+          }
+          p = z_end;
+        }
+      }
+      if (spectrum->getNumZStates() == 0) {
+        for (vector<int>::const_iterator i = possible_charges.begin();
+             i != possible_charges.end();
+             ++i) {
+          SpectrumZState zstate;
+          zstate.setMZ(precursor_mz, *i);
+          spectrum->addZState(zstate);
+        }
+      }
+    }
+
+    // The peaks
+    mzs.clear();
+    intensities.clear();
+    for (const char* array = FindElement(precursor_end, s_end, "<binaryDataArray");
+         array < s_end;
+         array = FindElement(array + 1, s_end, "<binaryDataArray")) {
+      const char* array_end = Find(array, s_end, "</binaryDataArray>");
+      if (FindElement(array, array_end, "<referenceableParamGroupRef") != array_end) {
+        return false;
+      }
+      vector<double>* values = HasCvParam(array, array_end, kMzArray) ? &mzs :
+        HasCvParam(array, array_end, kIntensityArray) ? &intensities : NULL;
+      if (values != NULL && !DecodeArray(array, array_end, length, values)) {
+        return false;
+      }
+    }
+    size_t num_peaks = min(mzs.size(), intensities.size());
+    spectrum->reservePeaks(num_peaks);
+    for (size_t i = 0; i < num_peaks; i++) {
+      spectrum->addPeak(intensities[i], mzs[i]);
+    }
+    s = next;
+  }
+  return true;
+}
+
+/**
+ * Parses all the spectra from file designated by the filename member
+ * variable.
+ * \returns True if the spectra are parsed successfully. False if otherwise.
+ */
+bool MzmlSpectrumCollection::parse() {
+  // spectrum_collection has already been parsed
+  if (is_parsed_) {
+    return false;
+  }
+
+  // get a list of scans to include if requested
+  string range_string = Params::GetString("scan-number");
+  int first_scan = -1;
+  int last_scan = -1;
+  if (!get_range_from_string(range_string, first_scan, last_scan)) {
+    carp(CARP_FATAL, "The scan number range '%s' is invalid. "
+         "Must be of the form <first>-<last>.", range_string.c_str());
+  }
+
+  carp(CARP_DEBUG, "Using the native mzML parser to parse spectra.");
+
+  size_t size = (size_t) FileUtils::Size(filename_);
+  vector< vector<Crux::Spectrum*> > parts;
+  bool parsed = true;
+  if (size > 0) {
+    int fd = open(filename_.c_str(), O_RDONLY);
+    void* data = fd < 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (data == MAP_FAILED) {
+      carp(CARP_ERROR, "Cannot map the spectrum file %s", filename_.c_str());
+      return false;
+    }
+    const char* begin = (const char*) data;
+    const char* end = begin + size;
+
+    int num_threads = Params::GetInt("num-threads");
+    if (num_threads < 1) {
+      num_threads = boost::thread::hardware_concurrency();
+    }
+    if (num_threads < 1 || size < kMinParallelBytes) {
+      num_threads = 1;
+    }
+    // Cut the file at the spectra nearest to equal parts
+    vector<const char*> cuts(num_threads + 1, end);
+    cuts[0] = begin;
+    for (int i = 1; i < num_threads; i++) {
+      cuts[i] = max(cuts[i - 1], FindElement(begin + size / num_threads * i, end,
+                                             "<spectrum"));
+    }
+    parts.resize(num_threads);
+    vector<char> part_parsed(num_threads, 0);
+    if (num_threads > 1) {
+      ThreadPool::TaskGroup workers;
+      for (int i = 0; i < num_threads; i++) {
+        workers.Run(boost::bind(&MzmlSpectrumCollection::parseRangeInto,
+                                          this, cuts[i], cuts[i + 1], &parts[i],
+                                          &part_parsed[i]));
+      }
+      workers.Wait();
+    } else {
+      parseRangeInto(begin, end, &parts[0], &part_parsed[0]);
+    }
+    munmap(data, size);
+    parsed = find(part_parsed.begin(), part_parsed.end(), 0) == part_parsed.end();
+  }
+
+  if (!parsed) {
+    for (size_t i = 0; i < parts.size(); i++) {
+      for (size_t j = 0; j < parts[i].size(); j++) {
+        delete parts[i][j];
+      }
+    }
+    carp(CARP_INFO, "%s uses mzML features the native parser does not read; "
+         "using ProteoWizard instead.", filename_.c_str());
+    return parsePwiz();
+  }
+
+  // Scan numbers are found in file order, so the ones that are missing can
+  // be made ordinals only once all the parts are in
+  bool ordinal = false;
+  for (size_t i = 0; i < parts.size() && !ordinal; i++) {
+    for (size_t j = 0; j < parts[i].size() && !ordinal; j++) {
+      ordinal = parts[i][j]->getFirstScan() <= 0;
+    }
+  }
+  if (ordinal) {
+    carp_once(CARP_INFO, "Parser could not determine scan numbers for this "
+                         "file, using ordinal numbers as scan numbers.");
+  }
+  bool ignore_no_charge = Params::GetBool("pm-ignore-no-charge");
+  int scan_counter = 0;
+  for (size_t i = 0; i < parts.size(); i++) {
+    for (size_t j = 0; j < parts[i].size(); j++) {
+      Crux::Spectrum* spectrum = parts[i][j];
+      if (ordinal) {
+        ++scan_counter;
+        spectrum->setScans(scan_counter, scan_counter);
+      }
+      if (spectrum->getNumPeaks() < 1 ||
+          spectrum->getLastScan() < first_scan ||
+          spectrum->getFirstScan() > last_scan ||
+          (spectrum->getNumZStates() == 0 &&
+           (ignore_no_charge || !spectrum->assignZState()))) {
+        delete spectrum;
+        continue;
+      }
+      addSpectrumToEnd(spectrum);
+      spectraByScan_[spectrum->getFirstScan()] = spectrum;
+    }
+  }
+
+  is_parsed_ = true;
+
+  return true;
+}
+
+bool MzmlSpectrumCollection::parsePwiz() {
+  PWIZSpectrumCollection pwiz(filename_);
+  if (!pwiz.parse()) {
+    return false;
+  }
+  for (SpectrumIterator i = pwiz.begin(); i != pwiz.end(); ++i) {
+    Crux::Spectrum* spectrum = new Crux::Spectrum(**i);
+    addSpectrumToEnd(spectrum);
+    spectraByScan_[spectrum->getFirstScan()] = spectrum;
+  }
+  is_parsed_ = true;
+  return true;
+}
+
+/**
+ * Parses a single spectrum from a spectrum_collection with first scan
+ * number equal to first_scan.  Removes any existing information in
+ * the given spectrum.
+ * \returns True if the spectrum was allocated, false on error.
+ */
+bool MzmlSpectrumCollection::getSpectrum(
+  int first_scan,      ///< The first scan of the spectrum to retrieve -in
+  Crux::Spectrum* spectrum   ///< Put the spectrum info here
+  ) {
+  parse();
+  return SpectrumCollection::getSpectrum(first_scan, spectrum);
+}
+
+/**
+ * Parses a single spectrum from a spectrum_collection with first scan
+ * number equal to first_scan.
+ * \returns The spectrum data from file or NULL.
+ */
+Crux::Spectrum* MzmlSpectrumCollection::getSpectrum(
+  int first_scan      ///< The first scan of the spectrum to retrieve -in
+  ) {
+  parse();
+  return SpectrumCollection::getSpectrum(first_scan);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
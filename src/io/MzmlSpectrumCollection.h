@@ -0,0 +1,102 @@
+/**
+ * \file MzmlSpectrumCollection.h
+ * \brief Class for reading spectra from mzML files without pwiz.
+ *
+ * The file is mapped into memory and cut at <spectrum> elements into one
+ * piece per thread (see num-threads); each piece is scanned for the few
+ * elements Crux needs, and its base64, optionally zlib-compressed, peak
+ * arrays are decoded straight into Crux spectra. Files using anything else
+ * (numpress compression, peak array settings in referenceable parameter
+ * groups) are read with ProteoWizard instead. Selected with
+ * spectrum-parser=native.
+ */
+#ifndef MZML_SPECTRUM_COLLECTION_H
+#define MZML_SPECTRUM_COLLECTION_H
+
+#include <vector>
+#include "SpectrumCollection.h"
+
+class MzmlSpectrumCollection : public Crux::SpectrumCollection {
+
+ protected:
+  bool use_z_line_;  ///< whether "ms2 file charge state" gives the charges
+
+  /**
+   * Parses the spectra whose elements begin in [begin, end) into spectra,
+   * leaving the charge states of the spectra without any to parse().
+   * \returns false if a spectrum uses an encoding this class does not read.
+   */
+  bool parseRange(
+    const char* begin,
+    const char* end,
+    std::vector<Crux::Spectrum*>* spectra
+  ) const;
+
+  /**
+   * parseRange() for a worker thread, which sets *parsed to its result.
+   */
+  void parseRangeInto(
+    const char* begin,
+    const char* end,
+    std::vector<Crux::Spectrum*>* spectra,
+    char* parsed
+  ) const {
+    *parsed = parseRange(begin, end, spectra);
+  }
+
+  /**
+   * Parses the file with ProteoWizard, for the files parseRange() cannot read.
+   */
+  bool parsePwiz();
+
+ public:
+  /**
+   * \returns Whether filename is a .mzML file that this class reads.
+   */
+  static bool CanParse(
+    const std::string& filename
+  );
+
+  /**
+   * Constructor sets filename and initializes member variables.
+   */
+  MzmlSpectrumCollection(
+    const std::string& filename ///< The spectrum collection filename. -in
+  );
+
+  /**
+   * Parses all the spectra from file designated by the filename member
+   * variable.
+   * \returns TRUE if the spectra are parsed successfully. FALSE if otherwise.
+   */
+  virtual bool parse();
+
+  /**
+   * Parses a single spectrum from a spectrum_collection with first scan
+   * number equal to first_scan.
+   * \returns The newly allocated Spectrum or NULL if scan number not found.
+   */
+  virtual Crux::Spectrum* getSpectrum(
+    int first_scan      ///< The first scan of the spectrum to retrieve -in
+  );
+
+  /**
+   * Parses a single spectrum from a spectrum_collection with first scan
+   * number equal to first_scan.  Removes any existing information in the
+   * given spectrum.
+   * \returns True if the spectrum was allocated, false on error.
+   */
+  virtual bool getSpectrum(
+    int first_scan,      ///< The first scan of the spectrum to retrieve -in
+    Crux::Spectrum* spectrum   ///< Put the spectrum info here
+  );
+
+};
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
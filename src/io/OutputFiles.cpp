@@ -71,7 +71,7 @@ OutputFiles::OutputFiles(CruxApplication* program_name)
                 output_directory, 
                 fileroot, 
                 application_, 
-                "txt");
+                Params::GetBool("compress-output") ? "txt.gz" : "txt");
   }
 
   // almost all operations create xml files
@@ -491,7 +491,9 @@ void OutputFiles::writeMatches(
          (int)decoy_matches_array.size(), num_files_ - 1);
   }
 
-  // print to each file type
+  // print to each file type; each match keeps the fields that several
+  // formats write (see Match::getOutputModSequence()), so they are
+  // computed once across the formats
   printMatchesTab(target_matches, decoy_matches_array, rank_type, spectrum);
   printMatchesSqt(target_matches, decoy_matches_array, spectrum);
   printMatchesXml(target_matches, decoy_matches_array, spectrum, rank_type);
@@ -637,6 +639,24 @@ void OutputFiles::writeMatches(
   }
 }
 
+/**
+ * \brief Print one row of a tab-delimited PSM file, with one column added.
+ */
+void OutputFiles::writeMatchRow(
+  const MatchFileColumns& psms, ///< PSMs read from a tab-delimited file
+  size_t row, ///< row of psms to print
+  MATCH_COLUMNS_T added_col, ///< column to set that psms may not have
+  FLOAT_T added_value ///< value of added_col
+) {
+  if (delim_file_array_ == NULL) {
+    return;
+  }
+  MatchFileWriter* file = delim_file_array_[0];
+  psms.setColumnsCurrentRow(row, file);
+  file->setColumnCurrentRow(added_col, added_value);
+  file->writeRow();
+}
+
 /**
  * \brief Print features from one match to file.
  */
@@ -21,6 +21,7 @@
 #include "parameter.h"
 #include "model/objects.h"
 #include "model/MatchCollection.h"
+#include "MatchFileColumns.h"
 #include "MatchFileWriter.h"
 #include "PepXMLWriter.h"
 #include "PinWriter.h"
@@ -43,6 +44,10 @@ class OutputFiles{
                     SCORER_TYPE_T rank_type = XCORR,
                     Crux::Spectrum* spectrum = NULL);
   void writeMatches(MatchCollection* matches);
+  void writeMatchRow(const MatchFileColumns& psms,
+                     size_t row,
+                     MATCH_COLUMNS_T added_col,
+                     FLOAT_T added_value);
   void writeMatchFeatures(Crux::Match* match, 
                           double* features,
                           int num_features);
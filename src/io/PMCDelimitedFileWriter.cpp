@@ -12,6 +12,8 @@ using namespace boost;
 PMCDelimitedFileWriter::PMCDelimitedFileWriter() : PSMWriter() {
   write_html_ = false;
   application_ = NULL;
+  header_written_ = false;
+  write_function_ = NULL;
 }
 
 /**
@@ -47,7 +49,8 @@ void PMCDelimitedFileWriter::openFile(
 
   file_ptr_ = FileUtils::GetWriteStream(filename, Params::GetBool("overwrite"));
   application_ = application;
-  if (!file_ptr_->is_open()) {
+  header_written_ = false;
+  if (file_ptr_ == NULL) {
     carp(CARP_FATAL, "Error creating file '%s'.", filename.c_str());
   }
 
@@ -87,7 +90,6 @@ void PMCDelimitedFileWriter::openFile(
  */
 void PMCDelimitedFileWriter::closeFile() {
   if (file_ptr_) {
-    file_ptr_->close();
     delete file_ptr_;
     file_ptr_ = NULL;
   }
@@ -139,6 +141,13 @@ void PMCDelimitedFileWriter::write(
     carp(CARP_FATAL, "ProteinMatchCollection was null");
   }
 
+  // later writes to the same file append to it
+  if (header_written_) {
+    (this->*this->PMCDelimitedFileWriter::write_function_)(collection);
+    return;
+  }
+  header_written_ = true;
+
   // psm-convert: trying to detect whether additional columns are needed....
   // Is there a better way to do this or move to setUpPSMSColumns? Seems messy...
   SpectrumMatchIterator first_spec = collection->spectrumMatchBegin();
@@ -486,7 +495,7 @@ void PMCDelimitedFileWriter::writePSMs(
   MASS_FORMAT_T mass_format_type =
     get_mass_format_type_parameter("mod-mass-format");
 
-  const map<pair<int, int>, int>& spectrum_counts = collection->getMatchesSpectrum();
+  const ProteinMatchCollection::SpectrumCounts& spectrum_counts = collection->getMatchesSpectrum();
 
   bool distinct_matches = collection->hasDistinctMatches();
   COMMAND_T command = application_->getCommand();
@@ -532,7 +541,7 @@ void PMCDelimitedFileWriter::writePSMs(
     addScoreIfExists(match, PERCOLATOR_PEP, PERCOLATOR_PEP_COL);
     addScoreIfExists(match, PERCOLATOR_QVALUE, PERCOLATOR_QVALUE_COL);
     pair<int, int> scan_charge = make_pair(spectrum->getFirstScan(), zstate.getCharge());
-    map<pair<int, int>, int>::const_iterator lookup = spectrum_counts.find(scan_charge);
+    ProteinMatchCollection::SpectrumCounts::const_iterator lookup = spectrum_counts.find(scan_charge);
     if (distinct_matches) {
       setColumnCurrentRow(DISTINCT_MATCHES_SPECTRUM_COL,
         (lookup != spectrum_counts.end()) ? lookup->second : 0);
@@ -621,6 +630,13 @@ void PMCDelimitedFileWriter::setAndFree(
   }
 }
 
+/**
+ * PSM files can be written a batch of spectra at a time
+ */
+bool PMCDelimitedFileWriter::canAppend() const {
+  return !write_html_ && write_function_ == &PMCDelimitedFileWriter::writePSMs;
+}
+
 /**
   * Sets whether we should write our output in tab delimited or HTML format. Default = false (tab delimited)
   */
@@ -660,7 +676,7 @@ void PMCDelimitedFileWriter::writeHTMLHeader() {
     return;
   }
   
-  if( file_ptr_ == NULL || !file_ptr_->is_open() ) {
+  if( file_ptr_ == NULL || !file_ptr_->good() ) {
     carp(CARP_FATAL, "Cannot write to NULL delimited file.");
   }
   *file_ptr_ << "<table border=\"1\">" << "\t<tr>" << endl
@@ -90,10 +90,16 @@ class PMCDelimitedFileWriter : public MatchFileWriter, public PSMWriter {
     */
   void setWriteHTML(bool write_html);
 
+  /**
+   * PSM files can be written a batch of spectra at a time
+   */
+  bool canAppend() const;
+
  private:
 
   bool write_html_; // this determines whether we want to write in html format. Default value = false;
   CruxApplication* application_; // pointer to the application using this program
+  bool header_written_; // to the open file, by the first write
 
   // function pointer to the appropriate writing function for the current file type
   void (PMCDelimitedFileWriter::*write_function_)(ProteinMatchCollection*);
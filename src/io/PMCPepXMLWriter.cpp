@@ -3,11 +3,19 @@
 
 using namespace Crux;
 
+PMCPepXMLWriter::PMCPepXMLWriter() : header_written_(false) {
+}
+
+PMCPepXMLWriter::~PMCPepXMLWriter() {
+  closeFile();
+}
+
 void PMCPepXMLWriter::openFile(
   string filename,
   bool overwrite
 ) {
   PepXMLWriter::openFile(filename.c_str(), overwrite);
+  header_written_ = false;
 }
 
 void PMCPepXMLWriter::openFile(
@@ -16,6 +24,7 @@ void PMCPepXMLWriter::openFile(
   MATCH_FILE_TYPE type
 ) {
   PepXMLWriter::openFile(filename.c_str(), Params::GetBool("overwrite"));
+  header_written_ = false;
 }
 
 void PMCPepXMLWriter::write(
@@ -26,10 +35,21 @@ void PMCPepXMLWriter::write(
   write(&protein_collection);
 }
 
+/**
+ * Writes the footer, if anything was written, and closes the file
+ */
 void PMCPepXMLWriter::closeFile() {
+  if (file_ && header_written_) {
+    writeFooter();
+  }
+  header_written_ = false;
   PepXMLWriter::closeFile();
 }
 
+bool PMCPepXMLWriter::canAppend() const {
+  return true;
+}
+
 /**
  * Writes the data in a ProteinMatchCollection to the currently open file
  */
@@ -42,9 +62,11 @@ void PMCPepXMLWriter::write(
     carp(CARP_FATAL, "ProteinMatchCollection was null");
   }
 
-  writeHeader();
+  if (!header_written_) {
+    writeHeader();
+    header_written_ = true;
+  }
   writePSMs(collection);
-  writeFooter();
 }
 
 /**
@@ -54,7 +76,7 @@ void PMCPepXMLWriter::writePSMs(
   ProteinMatchCollection* collection ///< collection to be written
 ) {
 
-  const map<pair<int, int>, int>& spectrum_counts = collection->getMatchesSpectrum();
+  const ProteinMatchCollection::SpectrumCounts& spectrum_counts = collection->getMatchesSpectrum();
 
   // iterate over matches
   for (SpectrumMatchIterator spec_iter = collection->spectrumMatchBegin();
@@ -120,7 +142,7 @@ void PMCPepXMLWriter::writePSMs(
     FLOAT_T peptide_mass = peptide->calcModifiedMass();
 
     // write psm
-    map<pair<int, int>, int>::const_iterator lookup =
+    ProteinMatchCollection::SpectrumCounts::const_iterator lookup =
       spectrum_counts.find(make_pair(spec_scan, spec_charge));
     writePSM(spec_scan, spec_filename.c_str(),
              spec_neutral_mass, spec_charge,
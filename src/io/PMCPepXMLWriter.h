@@ -17,6 +17,8 @@ using namespace std;
 class PMCPepXMLWriter : public PepXMLWriter, public PSMWriter {
 
  public:
+  PMCPepXMLWriter();
+  ~PMCPepXMLWriter();
 
   void openFile(
     string filename,
@@ -34,15 +36,21 @@ class PMCPepXMLWriter : public PepXMLWriter, public PSMWriter {
     string database
   );
 
+  /**
+   * Writes the footer, if anything was written, and closes the file
+   */
   void closeFile();
 
   /**
-   * Writes the data in a ProteinMatchCollection to the currently open file
+   * Writes the data in a ProteinMatchCollection to the currently open file;
+   * later calls append to the same spectrum queries
    */
   void write(
     ProteinMatchCollection* collection ///< collection to be written
   );
 
+  bool canAppend() const;
+
  protected:
 
   /**
@@ -52,6 +60,8 @@ class PMCPepXMLWriter : public PepXMLWriter, public PSMWriter {
     ProteinMatchCollection* collection ///< collection to be written
   );
 
+  bool header_written_; ///< to the open file, by the first write
+
 };
 
 #endif // PMCPEPXMLWRITER_H
@@ -50,7 +50,7 @@ void PMCSQTWriter::writePSMs(
   ProteinMatchCollection* collection ///< collection to be written
 ) {
 
-  const map<pair<int, int>, int>& spectrum_counts = collection->getMatchesSpectrum();
+  const ProteinMatchCollection::SpectrumCounts& spectrum_counts = collection->getMatchesSpectrum();
 
   string lastPrintedSpectrum = "";
 
@@ -64,7 +64,7 @@ void PMCSQTWriter::writePSMs(
     // write spectrum
     Crux::Spectrum* spectrum = spec_match->getSpectrum();
     SpectrumZState z_state = spec_match->getZState();
-    map<pair<int, int>, int>::const_iterator lookup =
+    ProteinMatchCollection::SpectrumCounts::const_iterator lookup =
       spectrum_counts.find(make_pair(spectrum->getFirstScan(), z_state.getCharge()));
 
     string spectrum_title = getSpectrumTitle(spectrum->getFirstScan(), z_state.getCharge());
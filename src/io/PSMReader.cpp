@@ -5,6 +5,7 @@ Abstract class for a peptide-spectrum match readers
 #include <cstdio>
 #include "PSMReader.h"
 #include "parameter.h"
+#include "model/MatchIterator.h"
 
 using namespace std;
 
@@ -19,6 +20,17 @@ PSMReader::PSMReader(const string& file_path, Database* database, Database* deco
 PSMReader::~PSMReader() {
 }
 
+void PSMReader::visit(PSMVisitor* visitor) {
+  MatchCollection* collection = parse();
+  MatchIterator match_iter(collection);
+  while (match_iter.hasNext()) {
+    Crux::Match* match = match_iter.next();
+    match->incrementPointerCount();
+    visitor->visitMatch(match, collection);
+  }
+  delete collection;
+}
+
 void PSMReader::setDatabase(Database* database) {
   database_ = database;
 }
@@ -12,6 +12,29 @@ Abstract class for a peptide-spectrum match readers
 #include <iomanip>
 #include <string>
 
+/**
+ * Takes the PSMs of a PSMReader one at a time, in file order, as they are
+ * parsed.
+ */
+class PSMVisitor {
+ public:
+  virtual ~PSMVisitor() {}
+
+  /**
+   * Takes one reference to match, to be released with Match::freeMatch.
+   * state holds the scored types and distinct-matches flag the reader has
+   * seen so far; its matches, if any, are not the visitor's.
+   */
+  virtual void visitMatch(Crux::Match* match, MatchCollection* state) = 0;
+
+  /**
+   * Called once every match of spectrum has been visited, for readers that
+   * do not keep their spectra; the visitor may then delete spectrum once it
+   * has released those matches.
+   */
+  virtual void visitSpectrumEnd(Crux::Spectrum* spectrum) {}
+};
+
 class PSMReader {
 
  public:
@@ -27,6 +50,10 @@ class PSMReader {
   // Pure Virtual Parse Functions
   virtual MatchCollection* parse() = 0;
 
+  // Hands each PSM to visitor as it is parsed rather than keeping them all.
+  // By default the whole file is parsed first and then handed over.
+  virtual void visit(PSMVisitor* visitor);
+
   // Methods usable by all Readers
   void setDatabase(Database* database);
   void setDecoyDatabase(Database* decoy_database);
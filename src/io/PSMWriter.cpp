@@ -9,3 +9,7 @@ PSMWriter::PSMWriter() {
 
 PSMWriter::~PSMWriter() {
 }
+
+bool PSMWriter::canAppend() const {
+  return false;
+}
@@ -31,6 +31,10 @@ class PSMWriter {
   virtual void write(MatchCollection* collection, std::string database) = 0;
 
   virtual void closeFile() = 0;
+
+  // Whether write() may be called again before closeFile(), each time with
+  // the matches of more whole spectra, appending them to the file
+  virtual bool canAppend() const;
 };
 
 #endif
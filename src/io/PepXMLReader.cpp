@@ -84,6 +84,8 @@ void PepXMLReader::init() {
   peptideprophet_result_open_ = false;
 
   current_spectrum_ = NULL;
+  current_match_collection_ = NULL;
+  visitor_ = NULL;
 }
 
 /**
@@ -123,6 +125,31 @@ PepXMLReader::~PepXMLReader() {
  * \returns the MatchCollection resulting from the parsed xml file
  */
 MatchCollection* PepXMLReader::parse() {
+  current_match_collection_ = new MatchCollection();
+  current_match_collection_->preparePostProcess();
+  parseFile();
+  return current_match_collection_;
+}
+
+/**
+ * Hands each match to visitor when its search_hit closes, and each
+ * spectrum when its spectrum_query closes
+ */
+void PepXMLReader::visit(PSMVisitor* visitor) {
+  // the collection only keeps the scored types and distinct-matches flag
+  current_match_collection_ = new MatchCollection();
+  current_match_collection_->preparePostProcess();
+  visitor_ = visitor;
+  parseFile();
+  visitor_ = NULL;
+  delete current_match_collection_;
+  current_match_collection_ = NULL;
+}
+
+/**
+ * Runs the xml file through the element handlers
+ */
+void PepXMLReader::parseFile() {
   FILE* file_ptr = fopen(file_path_.c_str(), "r");
   if (file_ptr == NULL) {
     carp(CARP_FATAL, "Opening %s or reading failed", file_path_.c_str());
@@ -134,8 +161,6 @@ MatchCollection* PepXMLReader::parse() {
     carp(CARP_FATAL, "Couldn't allocate memory for parser");
   }
 
-  current_match_collection_ = new MatchCollection();
-  current_match_collection_->preparePostProcess();
   XML_SetUserData(xml_parser, this);
   XML_SetElementHandler(xml_parser, open_handler, close_handler);
 
@@ -153,8 +178,8 @@ MatchCollection* PepXMLReader::parse() {
            XML_ErrorString(XML_GetErrorCode(xml_parser)));
     }
   }
+  XML_ParserFree(xml_parser);
   fclose(file_ptr);
-  return current_match_collection_;
 }
 
 void PepXMLReader::aminoacidModificationOpen(const char** attr) {
@@ -239,6 +264,10 @@ void PepXMLReader::spectrumQueryOpen(
  */
 void PepXMLReader::spectrumQueryClose() {
   spectrum_query_open_ = false;
+  if (visitor_ != NULL && current_spectrum_ != NULL) {
+    visitor_->visitSpectrumEnd(current_spectrum_);
+    current_spectrum_ = NULL;
+  }
 }
 
 /**
@@ -381,7 +410,15 @@ void PepXMLReader::searchHitClose() {
   search_hit_open_ = false;
   //We should have all the information needed to add the match object.
   if (maxRank_ == 0 || current_match_->getRank(XCORR) <= maxRank_) {
+    if (visitor_ != NULL) {
+      visitor_->visitMatch(current_match_, current_match_collection_);
+      current_match_ = NULL;
+      return;
+    }
     current_match_collection_->addMatch(current_match_);
+  } else if (visitor_ != NULL) {
+    Crux::Match::freeMatch(current_match_);
+    current_match_ = NULL;
   }
 }
 
@@ -28,6 +28,7 @@ class PepXMLReader : public PSMReader {
   Crux::Match* current_match_; ///< keeps track of the current match object
   std::string current_peptide_sequence_; ///< keeps track of the current peptide sequence
   MatchCollection* current_match_collection_; ///< keeps track of the current match collection object
+  PSMVisitor* visitor_; ///< takes the matches instead of the collection, if set
 
   /*State variable for element tags */
   bool aminoacid_modification_open_;
@@ -141,6 +142,11 @@ class PepXMLReader : public PSMReader {
    */
   void init();
 
+  /**
+   * Runs the xml file through the element handlers
+   */
+  void parseFile();
+
 
  public:  
 
@@ -171,6 +177,12 @@ class PepXMLReader : public PSMReader {
    */
   MatchCollection* parse();
 
+  /**
+   * Hands each match to visitor when its search_hit closes, and each
+   * spectrum when its spectrum_query closes
+   */
+  void visit(PSMVisitor* visitor);
+
   /**
    * \returns the MatchCollection resulting from the parsed xml file
    */
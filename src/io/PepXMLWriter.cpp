@@ -2,20 +2,58 @@
  * \file PepXMLWriter.cpp
  * \brief Writes search results in the TPP-compliant .pep.xml format.
  */
+#include <algorithm>
+#include <cstdarg>
 #include <iostream>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "PepXMLWriter.h"
 #include "util/AminoAcidUtil.h"
 #include "util/crux-utils.h"
 #include "util/Params.h"
 #include "util/StringUtils.h"
+#include "util/ThreadPool.h"
 #include "model/MatchCollection.h"
 
 using namespace std;
 
+// PSMs are kept and rendered this many per thread at a time.
+static const size_t kRecordsPerThread = 4096;
+
+/**
+ * Appends the printf formatting of the arguments to out.
+ */
+static void Appendf(string* out, const char* format, ...) {
+  char buf[1024];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (n < 0) {
+    return;
+  } else if ((size_t)n < sizeof(buf)) {
+    out->append(buf, n);
+    return;
+  }
+  // too long for buf, e.g. a long protein description
+  vector<char> big(n + 1);
+  va_start(args, format);
+  vsnprintf(&big[0], big.size(), format, args);
+  va_end(args);
+  out->append(&big[0], n);
+}
+
 PepXMLWriter::PepXMLWriter():
   file_(NULL), current_index_(1), mass_precision_(Params::GetInt("mass-precision")),
   enzyme_(get_enzyme_type_parameter("enzyme")),
-  precision_(Params::GetInt("precision")) {
+  precision_(Params::GetInt("precision")),
+  num_threads_(Params::GetInt("num-threads")) {
+  if (num_threads_ < 1) {
+    num_threads_ = boost::thread::hardware_concurrency();
+  }
+  if (num_threads_ < 1) {
+    num_threads_ = 1;
+  }
 }
 
 PepXMLWriter::~PepXMLWriter() {
@@ -35,6 +73,7 @@ void PepXMLWriter::openFile(const char* filename, bool overwrite) {
  */
 void PepXMLWriter::closeFile() {
   if (file_) {
+    writeRecords();
     fclose(file_);
     file_ = NULL;
   }
@@ -54,7 +93,10 @@ void PepXMLWriter::writeHeader() {
  * Requires OpenFile has been called without CloseFile.
  */
 void PepXMLWriter::writeFooter() {
-  closeSpectrumElement();
+  writeRecords();
+  string out;
+  closeSpectrumElement(&out);
+  fputs(out.c_str(), file_);
   MatchCollection::printXmlFooter(file_);
 }
 
@@ -66,6 +108,9 @@ void PepXMLWriter::writeFooter() {
  * <search_hit> in the list of <search_elements>.  To add more
  * <search_hits>, call writePSM() again with the same spectrum_scan_number
  *
+ * The PSM is kept and rendered later, together with the PSMs around it,
+ * so the arguments need not outlive the call.
+ *
  * Requires that the arrays pre_aas, post_aas,
  * protein_names, protein_descriptions are all num_proteins long.
  * Assumes scores is NUMBER_SCORER_TYPES long. 
@@ -90,52 +135,117 @@ void PepXMLWriter::writePSM(
   unsigned cur_num_matches
 ) {
   string spectrum_title = getSpectrumTitle(spectrum_scan_number, filename, charge);
-  //cerr<<"by_ion_fraction_matched: "<<by_ion_fraction_matched<<endl;
+  records_.push_back(PSMRecord());
+  PSMRecord& record = records_.back();
   // close the last spec element if this is a new spectrum and not the first
-  if (!last_spectrum_printed_.empty() && last_spectrum_printed_ != spectrum_title) {
-    closeSpectrumElement();
-  }
-
+  record.close_spectrum =
+    !last_spectrum_printed_.empty() && last_spectrum_printed_ != spectrum_title;
   // print the spec info if this is a new spectrum
-  if (last_spectrum_printed_ != spectrum_title) {
-    printSpectrumElement(spectrum_scan_number, spectrum_title.c_str(), 
-                         spectrum_neutral_mass, charge);
+  record.open_spectrum = last_spectrum_printed_ != spectrum_title;
+  record.index = record.open_spectrum ? current_index_++ : 0;
+  if (record.open_spectrum) {
     last_spectrum_printed_ = spectrum_title;
   }
   // else, just add to the search_result list
-  //cerr<<"3.LnExperimentSize: "<<current_ln_experiment_size<<endl;
-  printPeptideElement(PSM_ranks, 
-    unmodified_peptide_sequence,
-    modified_peptide_sequence, 
-    peptide_mass,
-    spectrum_neutral_mass,
-    num_proteins,
-    flanking_aas,
-    protein_names,
-    protein_descriptions,
-    scores_computed,
-    scores,
-    cur_num_matches);
+  record.spectrum_scan_number = spectrum_scan_number;
+  record.spectrum_title = spectrum_title;
+  record.spectrum_neutral_mass = spectrum_neutral_mass;
+  record.charge = charge;
+  record.ranks[SP] = PSM_ranks[SP];
+  record.ranks[XCORR] = PSM_ranks[XCORR];
+  record.peptide_sequence = unmodified_peptide_sequence;
+  record.mod_peptide_sequence = modified_peptide_sequence;
+  record.peptide_mass = peptide_mass;
+  record.num_proteins = num_proteins;
+  record.flanking_aas = flanking_aas;
+  record.protein_names = protein_names;
+  record.protein_descriptions = protein_descriptions;
+  copy(scores_computed, scores_computed + NUMBER_SCORER_TYPES, record.scores_computed);
+  copy(scores, scores + NUMBER_SCORER_TYPES, record.scores);
+  record.current_num_matches = cur_num_matches;
+
+  if (records_.size() >= kRecordsPerThread * num_threads_) {
+    writeRecords();
+  }
+}
+
+/**
+ * Renders the kept PSMs on num-threads threads, each taking a contiguous
+ * share of them, and writes the shares to the file in order.
+ */
+void PepXMLWriter::writeRecords() {
+  if (records_.empty()) {
+    return;
+  }
+  size_t num_shares = min((size_t)num_threads_,
+                          (records_.size() + kRecordsPerThread - 1) / kRecordsPerThread);
+  vector<size_t> cuts(num_shares + 1);
+  for (size_t i = 0; i <= num_shares; i++) {
+    cuts[i] = records_.size() * i / num_shares;
+  }
+  vector<string> shares(num_shares);
+  ThreadPool::TaskGroup threads;
+  for (size_t i = 1; i < num_shares; i++) {
+    threads.Run(boost::bind(&PepXMLWriter::renderRecords, this,
+                                      cuts[i], cuts[i + 1], &shares[i]));
+  }
+  renderRecords(cuts[0], cuts[1], &shares[0]);
+  threads.Wait();
+  for (vector<string>::const_iterator i = shares.begin(); i != shares.end(); ++i) {
+    fwrite(i->data(), 1, i->size(), file_);
+  }
+  records_.clear();
+}
+
+/**
+ * Appends the XML of records [begin, end) to out.
+ */
+void PepXMLWriter::renderRecords(size_t begin, size_t end, string* out) const {
+  for (size_t i = begin; i < end; i++) {
+    const PSMRecord& record = records_[i];
+    if (record.close_spectrum) {
+      closeSpectrumElement(out);
+    }
+    if (record.open_spectrum) {
+      printSpectrumElement(out, record.spectrum_scan_number, record.spectrum_title.c_str(),
+                           record.spectrum_neutral_mass, record.charge, record.index);
+    }
+    printPeptideElement(out,
+      record.ranks,
+      record.peptide_sequence.c_str(),
+      record.mod_peptide_sequence.c_str(),
+      record.peptide_mass,
+      record.spectrum_neutral_mass,
+      record.num_proteins,
+      record.flanking_aas.c_str(),
+      record.protein_names,
+      record.protein_descriptions,
+      record.scores_computed,
+      record.scores,
+      record.current_num_matches);
+  }
 }
 
 /**
  * Write the <spectrum_query> element and the <search_result> tag.
  */
-void PepXMLWriter::printSpectrumElement(int spectrum_scan_number, 
+void PepXMLWriter::printSpectrumElement(string* out,
+                                        int spectrum_scan_number, 
                                         const char* spectrum_title,
                                         double spectrum_neutral_mass, 
-                                        int charge) {
-  fprintf(file_, "    <spectrum_query spectrum=\"%s\" start_scan=\"%i\""
+                                        int charge,
+                                        int index) const {
+  Appendf(out, "    <spectrum_query spectrum=\"%s\" start_scan=\"%i\""
           " end_scan=\"%i\" precursor_neutral_mass=\"%.*f\""
           " assumed_charge=\"%i\" index=\"%i\">\n"
           "    <search_result>\n",
           spectrum_title,
           spectrum_scan_number,
           spectrum_scan_number,
-          Params::GetInt("mass-precision"),
+          mass_precision_,
           spectrum_neutral_mass,
           charge,
-          current_index_++);
+          index);
 }
 
 string PepXMLWriter::getSpectrumTitle(int spectrum_scan_number, 
@@ -153,26 +263,27 @@ string PepXMLWriter::getSpectrumTitle(int spectrum_scan_number,
   return spectrum_id.str();
 }
 
-void PepXMLWriter::closeSpectrumElement() {
-  fprintf(file_, "    </search_result>\n    </spectrum_query>\n");
+void PepXMLWriter::closeSpectrumElement(string* out) const {
+  out->append("    </search_result>\n    </spectrum_query>\n");
 }
 
 /**
  * Print everything between the <search_hit> tags for this match
  */
-void PepXMLWriter::printPeptideElement(int *ranks,
+void PepXMLWriter::printPeptideElement(string* out,
+  const int* ranks,
   const char* peptide_sequence,
   const char* modified_peptide_sequence,
   double peptide_mass,
   double spectrum_mass,
   int num_proteins,
   const char* flanking_aas,
-  vector<string>& protein_names,
-  vector<string>& protein_descriptions,
-  bool* scores_computed,
-  double* scores,
+  const vector<string>& protein_names,
+  const vector<string>& protein_descriptions,
+  const bool* scores_computed,
+  const double* scores,
   unsigned current_num_matches  
-) {
+) const {
   // get values
   char flanking_aas_prev = flanking_aas[0];
   char flanking_aas_next = flanking_aas[1];
@@ -187,7 +298,7 @@ void PepXMLWriter::printPeptideElement(int *ranks,
                                                        enzyme_);
 
   // print <search_hit> tag
-  fprintf(file_, "    <search_hit hit_rank=\"%i\" peptide=\"%s\" "
+  Appendf(out, "    <search_hit hit_rank=\"%i\" peptide=\"%s\" "
           "peptide_prev_aa=\"%c\" peptide_next_aa=\"%c\" protein=\"%s\" "
           "num_tot_proteins=\"%i\" ",
           ranks[XCORR], // -1 if unavailable, uses xcorr rank otherwise
@@ -197,14 +308,14 @@ void PepXMLWriter::printPeptideElement(int *ranks,
           protein_id.c_str(),
           num_proteins);
   if (scores_computed[BY_IONS_MATCHED]) {
-    fprintf(file_, "num_matched_ions=\"%i\" ", (unsigned)scores[BY_IONS_MATCHED]);
+    Appendf(out, "num_matched_ions=\"%i\" ", (unsigned)scores[BY_IONS_MATCHED]);
   }
   if (scores_computed[BY_IONS_TOTAL]) {
-    fprintf(file_, "tot_num_ions=\"%i\" ", (unsigned)scores[BY_IONS_TOTAL]);
+    Appendf(out, "tot_num_ions=\"%i\" ", (unsigned)scores[BY_IONS_TOTAL]);
   }
 
   if (flanking_aas_prev != 'X' && flanking_aas_next != 'X') {
-    fprintf(file_, "calc_neutral_pep_mass=\"%.*f\" "
+    Appendf(out, "calc_neutral_pep_mass=\"%.*f\" "
           "massdiff=\"%+.*f\" "
           "num_tol_term=\"%i\" num_missed_cleavages=\"%i\" "
           "num_matched_peptides=\"%i\""
@@ -218,7 +329,7 @@ void PepXMLWriter::printPeptideElement(int *ranks,
           current_num_matches,
           0);
   } else {
-    fprintf(file_, "calc_neutral_pep_mass=\"%.*f\" "
+    Appendf(out, "calc_neutral_pep_mass=\"%.*f\" "
           "massdiff=\"%+.*f\" "
           "num_tol_term=\"\" num_missed_cleavages=\"%i\" "
           "num_matched_peptides=\"%i\""
@@ -232,7 +343,7 @@ void PepXMLWriter::printPeptideElement(int *ranks,
           0);
   }
 
-  fprintf(file_, "protein_descr=\"%s\">\n", protein_annotation.c_str());
+  Appendf(out, "protein_descr=\"%s\">\n", protein_annotation.c_str());
 
   // print additonal proteins
   for(int prot_idx = 1; prot_idx < num_proteins; prot_idx++) {
@@ -245,7 +356,7 @@ void PepXMLWriter::printPeptideElement(int *ranks,
                                              enzyme_);
     protein_id = protein_names[prot_idx];
     protein_annotation = protein_descriptions[prot_idx];
-    fprintf(file_, 
+    Appendf(out, 
             "        <alternative_protein protein=\"%s\" "
             "protein_descr=\"%s\" "
             "num_tol_term=\"%i\"  peptide_prev_aa=\"%c\" "
@@ -258,33 +369,34 @@ void PepXMLWriter::printPeptideElement(int *ranks,
   }
 
   // print modifications
-  print_modifications_xml(modified_peptide_sequence, peptide_sequence, file_);
+  print_modifications_xml(modified_peptide_sequence, peptide_sequence, out);
 
   // print scores
-  printScores(scores, scores_computed, ranks);
+  printScores(out, scores, scores_computed, ranks);
 
   // print post-search (analysis) fields
-  printAnalysis(scores, scores_computed);
+  printAnalysis(out, scores, scores_computed);
 
   // close the search_hit tag
-  fprintf(file_, "    </search_hit>\n");
+  Appendf(out, "    </search_hit>\n");
 }
 
 void PepXMLWriter::printScores(
-  double* scores, 
-  bool* scores_computed,
-  int* ranks
-) {
+  string* out,
+  const double* scores, 
+  const bool* scores_computed,
+  const int* ranks
+) const {
   string ranks_to_string[2] = {"sprank", "xcorr_rank"};
   for (int i = 0; i < NUMBER_SCORER_TYPES; i++) {
     if (i == BY_IONS_MATCHED || i == BY_IONS_TOTAL) {
       continue;
     }
     if (scores_computed[i]) {
-      fprintf(file_, "        <search_score name=\"%s\" value=\"%.*f\" />\n",
+      Appendf(out, "        <search_score name=\"%s\" value=\"%.*f\" />\n",
         scorer_type_to_string((SCORER_TYPE_T)i), precision_, scores[i]);
       if (i < 2) {
-        fprintf(file_, "        <search_score name=\"%s\" value=\"%i\" />\n",
+        Appendf(out, "        <search_score name=\"%s\" value=\"%i\" />\n",
           ranks_to_string[i].c_str(), ranks[i]);
       }
     }
@@ -292,8 +404,9 @@ void PepXMLWriter::printScores(
 }
 
 
-void PepXMLWriter::printAnalysis(double* scores,
-                                 bool* scores_computed) {
+void PepXMLWriter::printAnalysis(string* out,
+                                 const double* scores,
+                                 const bool* scores_computed) const {
   // only write the analysis_result section for post-search psms
   bool post_search = false;
   if( scores_computed[PERCOLATOR_SCORE] 
@@ -327,21 +440,21 @@ void PepXMLWriter::printAnalysis(double* scores,
     pep = LOGP_WEIBULL_PEP;
   }
 
-  fprintf(file_, "<analysis_result analysis=\"peptideprophet\">\n");
-  fprintf(file_, "<peptideprophet_result probability=\"%.*f\">\n", 
+  Appendf(out, "<analysis_result analysis=\"peptideprophet\">\n");
+  Appendf(out, "<peptideprophet_result probability=\"%.*f\">\n", 
           precision_, (1 - scores[pep]));
-  fprintf(file_, "<search_score_summary>\n");
+  Appendf(out, "<search_score_summary>\n");
   if (!score_name.empty()) {
-    fprintf(file_, "<parameter name=\"%s\" value=\"%.*f\"/>\n",
+    Appendf(out, "<parameter name=\"%s\" value=\"%.*f\"/>\n",
             score_name.c_str(), precision_, scores[score]);
   }
-  fprintf(file_, "<parameter name=\"%s\" value=\"%.*f\"/>\n", 
+  Appendf(out, "<parameter name=\"%s\" value=\"%.*f\"/>\n", 
           "qvalue", precision_, scores[qval]);
-  fprintf(file_, "<parameter name=\"%s\" value=\"%.*f\"/>\n", 
+  Appendf(out, "<parameter name=\"%s\" value=\"%.*f\"/>\n", 
           "pep", precision_, scores[pep]);
-  fprintf(file_, "</search_score_summary>\n");
-  fprintf(file_, "</peptideprophet_result>\n");
-  fprintf(file_, "</analysis_result>\n");
+  Appendf(out, "</search_score_summary>\n");
+  Appendf(out, "</peptideprophet_result>\n");
+  Appendf(out, "</analysis_result>\n");
 }
 
 /**
@@ -351,33 +464,33 @@ void PepXMLWriter::printAnalysis(double* scores,
 void PepXMLWriter::print_modifications_xml(
   const char* mod_seq,
   const char* pep_seq,
-  FILE* output_file
-) {
+  string* out
+) const {
   carp(CARP_DEBUG, "print_modifications_xml:%s %s", mod_seq, pep_seq);
   // variable modifications
   int mod_precision = Params::GetInt("mod-precision");
   map<int, double> var_mods = find_variable_modifications(mod_seq);
   if (!var_mods.empty()) {
-    fprintf(output_file, "<modification_info modified_peptide=\"%s\">\n", mod_seq);
+    Appendf(out, "<modification_info modified_peptide=\"%s\">\n", mod_seq);
     for (map<int, double>::iterator it = var_mods.begin(); it != var_mods.end(); ++it) {
-      fprintf(output_file, "<mod_aminoacid_mass position=\"%i\" mass=\"%.*f\"/>\n",
+      Appendf(out, "<mod_aminoacid_mass position=\"%i\" mass=\"%.*f\"/>\n",
               it->first,   //index
               mod_precision, it->second); //mass
     }
-    fprintf(output_file, "</modification_info>\n");
+    Appendf(out, "</modification_info>\n");
   }
 
   // static modifications
   map<int, double> static_mods = find_static_modifications(pep_seq);
   if (!static_mods.empty()) {
     carp(CARP_DEBUG, "<modification_info modified_peptide=\"%s\">", pep_seq);
-    fprintf(output_file, "<modification_info modified_peptide=\"%s\">\n", pep_seq);
+    Appendf(out, "<modification_info modified_peptide=\"%s\">\n", pep_seq);
     for (map<int, double>::iterator it = static_mods.begin(); it != static_mods.end(); ++it) {
-      fprintf(output_file, "<mod_aminoacid_mass position=\"%i\" mass=\"%.*f\"/>\n",
+      Appendf(out, "<mod_aminoacid_mass position=\"%i\" mass=\"%.*f\"/>\n",
               it->first,   //index
               mod_precision, it->second); //mass
     }
-    fprintf(output_file, "</modification_info>\n");
+    Appendf(out, "</modification_info>\n");
   }
 }
 
@@ -386,7 +499,7 @@ void PepXMLWriter::print_modifications_xml(
  * and extract information from mod sequence fill
  * up map
  */
-map<int, double> PepXMLWriter::find_variable_modifications(const char* mod_seq) {
+map<int, double> PepXMLWriter::find_variable_modifications(const char* mod_seq) const {
   bool monoisotopic = get_mass_type_parameter("isotopic-mass") != AVERAGE;
   map<int, double> mods;
   int seq_index = 1;
@@ -429,7 +542,7 @@ map<int, double> PepXMLWriter::find_variable_modifications(const char* mod_seq)
  */
 map<int, double> PepXMLWriter::find_static_modifications(
   const char* peptide_sequence
-) {
+) const {
   map<int, double> static_mods;
   const char* seq_iter = peptide_sequence;
   MASS_TYPE_T isotopic_type = get_mass_type_parameter("isotopic-mass");
@@ -67,41 +67,79 @@ class PepXMLWriter {
   );
 
  protected:
-  void initScoreNames();
-  void printSpectrumElement(int spectrum_scan_number, 
+  /**
+   * The arguments of a writePSM() call, kept until the PSM is rendered.
+   */
+  struct PSMRecord {
+    bool close_spectrum; ///< ends the previous spectrum_query first
+    bool open_spectrum; ///< begins a spectrum_query
+    int index; ///< of the spectrum_query it begins
+    int spectrum_scan_number;
+    std::string spectrum_title;
+    double spectrum_neutral_mass;
+    int charge;
+    int ranks[2]; ///< SP and XCORR
+    std::string peptide_sequence;
+    std::string mod_peptide_sequence;
+    double peptide_mass;
+    int num_proteins;
+    std::string flanking_aas;
+    std::vector<std::string> protein_names;
+    std::vector<std::string> protein_descriptions;
+    bool scores_computed[NUMBER_SCORER_TYPES];
+    double scores[NUMBER_SCORER_TYPES];
+    unsigned current_num_matches;
+  };
+
+  /**
+   * Renders the kept PSMs on num-threads threads, each taking a contiguous
+   * share of them, and writes the shares to the file in order.
+   */
+  void writeRecords();
+
+  /**
+   * Appends the XML of records [begin, end) to out.
+   */
+  void renderRecords(size_t begin, size_t end, std::string* out) const;
+
+  void printSpectrumElement(std::string* out,
+                            int spectrum_scan_number, 
                             const char* filename,
                             double spectrum_neutral_mass, 
-                            int charge);
-  void closeSpectrumElement();
+                            int charge,
+                            int index) const;
+  void closeSpectrumElement(std::string* out) const;
   std::string getSpectrumTitle(int spectrum_scan_number, 
                                const char* filename,
                                int charge);
-  void printPeptideElement(int* rank,
+  void printPeptideElement(std::string* out,
+                           const int* rank,
                            const char* peptide_sequence,
                            const char* mod_peptide_sequence,
                            double peptide_mass,
                            double spectrum_mass,
                            int num_proteins,
                            const char* flanking_aas,
-                           std::vector<std::string>& protein_names, 
-                           std::vector<std::string>& protein_descriptions,
-                           bool* scores_computed,
-                           double* scores,
-                           unsigned current_num_matches);
+                           const std::vector<std::string>& protein_names, 
+                           const std::vector<std::string>& protein_descriptions,
+                           const bool* scores_computed,
+                           const double* scores,
+                           unsigned current_num_matches) const;
 
   void printScores(
-    double* scores, 
-    bool* scores_computed,
-    int* ranks
-  );
+    std::string* out,
+    const double* scores, 
+    const bool* scores_computed,
+    const int* ranks
+  ) const;
 
-  void printAnalysis(double* scores, bool* scores_computed);
+  void printAnalysis(std::string* out, const double* scores, const bool* scores_computed) const;
 
   /**
    * \brief prints both variable and static modifications for 
    *  peptide sequence
    */
-  void print_modifications_xml(const char* mod_seq, const char* sequence, FILE* output_file);
+  void print_modifications_xml(const char* mod_seq, const char* sequence, std::string* out) const;
 
   /**
    * \brief takes an empty mapping of index to mass
@@ -110,14 +148,14 @@ class PepXMLWriter {
    */
   std::map<int, double> find_static_modifications(
     const char* sequence
-  );
+  ) const;
 
   /**
    * \brief takes an empty mapping of index to mass
    * and extract information from mod sequence fill
    * up map
    */
-  std::map<int, double> find_variable_modifications(const char* mod_seq);
+  std::map<int, double> find_variable_modifications(const char* mod_seq) const;
 
   std::string filename_;
   FILE* file_;
@@ -126,6 +164,8 @@ class PepXMLWriter {
   int mass_precision_;
   ENZYME_T enzyme_;
   int precision_;
+  int num_threads_;
+  std::vector<PSMRecord> records_; ///< given to writePSM but not yet written
 };
 
 #endif // PEPXMLWRITER_H
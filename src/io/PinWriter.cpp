@@ -8,6 +8,7 @@
 #include "util/crux-utils.h"
 #include "parameter.h"
 #include "MatchCollectionParser.h"
+#include <algorithm>
 #include <cctype>
 #include <cstdio>
 #include <cstring>
@@ -132,6 +133,20 @@ void PinWriter::write(
   }
 }
 
+void PinWriter::write(
+  MatchCollection* collection,
+  int top_rank,
+  bool decoys
+) {
+  MatchIterator match_iterator(collection);
+  while (match_iterator.hasNext()) {
+    Match* match = match_iterator.next();
+    if (match->getNullPeptide() == decoys && match->getRank(XCORR) <= top_rank) {
+      printPSM(match);
+    }
+  }
+}
+
 void PinWriter::write(MatchCollection* collection, string database) {
   bool sp = collection->getScoredType(SP);
   bool xcorr = collection->getScoredType(XCORR);
@@ -177,6 +192,59 @@ void PinWriter::printHeader() {
   *out_ << StringUtils::Join(enabledFeatures_, '\t') << endl;
 }
 
+void PinWriter::enableAllFeatures() {
+  enabledFeatures_.clear();
+  for (vector< pair<string, bool> >::iterator i = features_.begin(); i != features_.end(); i++) {
+    i->second = true;
+    enabledFeatures_.push_back(i->first);
+  }
+}
+
+void PinWriter::appendRows(
+  const string& file_name,
+  const vector<string>& file_features
+) {
+  // Column of the file that holds each enabled feature
+  vector<size_t> cols;
+  BOOST_FOREACH(const std::string& feature, enabledFeatures_) {
+    vector<string>::const_iterator i =
+      find(file_features.begin(), file_features.end(), feature);
+    if (i == file_features.end()) {
+      carp(CARP_FATAL, "appendRows: feature '%s' not in %s", feature.c_str(), file_name.c_str());
+    }
+    cols.push_back(i - file_features.begin());
+  }
+
+  ifstream in(file_name.c_str());
+  if (!in.good()) {
+    carp(CARP_FATAL, "Can't read file '%s'", file_name.c_str());
+  }
+  // The last column runs to the end of the line; it may hold several
+  // tab-separated proteins
+  size_t last = file_features.size() - 1;
+  string line;
+  vector<string> in_fields;
+  vector<string> out_fields(cols.size());
+  while (getline(in, line)) {
+    in_fields.clear();
+    size_t begin = 0;
+    while (in_fields.size() < last) {
+      size_t tab = line.find('\t', begin);
+      if (tab == string::npos) {
+        break;
+      }
+      in_fields.push_back(line.substr(begin, tab - begin));
+      begin = tab + 1;
+    }
+    in_fields.push_back(line.substr(begin));
+    in_fields.resize(file_features.size());
+    for (size_t i = 0; i < cols.size(); i++) {
+      out_fields[i] = in_fields[cols[i]];
+    }
+    *out_ << StringUtils::Join(out_fields, '\t') << '\n';
+  }
+}
+
 void PinWriter::printPSM(
   Match* match
 ) { 
@@ -263,7 +331,7 @@ void PinWriter::printPSM(
       carp(CARP_FATAL, "Unknown feature: '%s'", feature.c_str());
     }
   }
-  *out_ << StringUtils::Join(fields, '\t') << endl;
+  *out_ << StringUtils::Join(fields, '\t') << '\n';
 }
 
 string PinWriter::getPeptide(Peptide* pep) {
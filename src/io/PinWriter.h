@@ -35,6 +35,31 @@ class PinWriter : public PSMWriter {
     MatchCollection* collection,
     std::string database
   );
+  /**
+   * Writes the matches of collection ranked at most top_rank that are decoys,
+   * or targets if decoys is false, without a header.
+   */
+  void write(
+    MatchCollection* collection,
+    int top_rank,
+    bool decoys
+  );
+
+  /**
+   * Enables every feature and writes rows with all of them, without writing
+   * a header. Used for rows that appendRows() later cuts down.
+   */
+  void enableAllFeatures();
+
+  /**
+   * Copies the rows of a header-less pin file with the given features,
+   * keeping only the features enabled for this file.
+   */
+  void appendRows(
+    const std::string& file_name,
+    const std::vector<std::string>& file_features
+  );
+  const std::vector<std::string>& getRowFeatures() const { return enabledFeatures_; }
 
   void printHeader();
 
@@ -0,0 +1,222 @@
+/**
+ * \file QCStatistics.cpp
+ * \brief Summary statistics of a search and the QC report rendered from them.
+ */
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include "QCStatistics.h"
+#include "util/mass.h"
+
+using namespace std;
+
+static const double kScoreBinWidth = 0.1;
+static const double kMassErrorBinWidth = 1.0; // ppm
+static const int kBarWidth = 400; // pixels for the largest bin
+
+/**
+ * Appends the formatted text to out.
+ */
+static void Print(ostream* out, const char* format, double value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), format, value);
+  *out << buf;
+}
+
+QCHistogram::QCHistogram(double width, bool log_scale)
+  : width_(width), log_scale_(log_scale), count_(0), sum_(0),
+    min_(numeric_limits<double>::infinity()),
+    max_(-numeric_limits<double>::infinity()) {
+}
+
+long QCHistogram::bin(double value) const {
+  if (log_scale_) {
+    value = log(1 + std::max(value, 0.0)) / log(2.0);
+  }
+  return (long) floor(value / width_);
+}
+
+double QCHistogram::binStart(long bin) const {
+  double start = bin * width_;
+  return log_scale_ ? pow(2.0, start) - 1 : start;
+}
+
+void QCHistogram::add(double value) {
+  if (value != value || fabs(value) == numeric_limits<double>::infinity()) {
+    return;
+  }
+  ++bins_[bin(value)];
+  ++count_;
+  sum_ += value;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+}
+
+void QCHistogram::merge(const QCHistogram& other) {
+  for (map<long, unsigned long>::const_iterator i = other.bins_.begin();
+       i != other.bins_.end(); ++i) {
+    bins_[i->first] += i->second;
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+}
+
+double QCHistogram::quantile(double q) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  double target = q * count_;
+  unsigned long seen = 0;
+  for (map<long, unsigned long>::const_iterator i = bins_.begin(); i != bins_.end(); ++i) {
+    if (seen + i->second >= target) {
+      // interpolate within the bin
+      double start = binStart(i->first), end = binStart(i->first + 1);
+      double value = start + (end - start) * (target - seen) / i->second;
+      return std::max(min_, std::min(max_, value));
+    }
+    seen += i->second;
+  }
+  return max_;
+}
+
+void QCHistogram::writeHTML(ostream* out, const string& label) const {
+  if (count_ == 0) {
+    *out << "<p>None.</p>\n";
+    return;
+  }
+  unsigned long largest = 0;
+  for (map<long, unsigned long>::const_iterator i = bins_.begin(); i != bins_.end(); ++i) {
+    largest = std::max(largest, i->second);
+  }
+  *out << "<p>n = " << count_ << ", mean ";
+  Print(out, "%.4g", mean());
+  *out << ", median ";
+  Print(out, "%.4g", quantile(0.5));
+  *out << ", range ";
+  Print(out, "%.4g", min_);
+  *out << " to ";
+  Print(out, "%.4g", max_);
+  *out << "</p>\n<table>\n<tr><th>" << label << "</th><th>Count</th><th></th></tr>\n";
+  for (map<long, unsigned long>::const_iterator i = bins_.begin(); i != bins_.end(); ++i) {
+    *out << "<tr><td>";
+    Print(out, "%.4g", binStart(i->first));
+    *out << " &ndash; ";
+    Print(out, "%.4g", binStart(i->first + 1));
+    *out << "</td><td class=\"n\">" << i->second << "</td><td><div class=\"bar\" style=\"width:"
+         << (int) ceil((double) kBarWidth * i->second / largest) << "px\"></div></td></tr>\n";
+  }
+  *out << "</table>\n";
+}
+
+QCStatistics::QCStatistics()
+  : spectra_(0), candidates_(0.5, true), target_scores_(kScoreBinWidth),
+    decoy_scores_(kScoreBinWidth), mass_errors_(kMassErrorBinWidth) {
+}
+
+void QCStatistics::addSpectrum(int charge, int candidates) {
+  ++spectra_;
+  ++charges_[charge];
+  candidates_.add(candidates);
+}
+
+void QCStatistics::addTopMatch(
+  bool decoy,
+  double score,
+  double spectrum_mass,
+  double peptide_mass
+) {
+  if (decoy) {
+    decoy_scores_.add(score);
+    return;
+  }
+  target_scores_.add(score);
+  double error = spectrum_mass - peptide_mass;
+  int isotope = (int) floor(error / ISOTOPE_SPACING + 0.5);
+  ++isotope_errors_[isotope];
+  if (peptide_mass > 0) {
+    mass_errors_.add((error - isotope * ISOTOPE_SPACING) / peptide_mass * 1e6);
+  }
+}
+
+void QCStatistics::merge(const QCStatistics& other) {
+  spectra_ += other.spectra_;
+  for (map<int, unsigned long>::const_iterator i = other.charges_.begin();
+       i != other.charges_.end(); ++i) {
+    charges_[i->first] += i->second;
+  }
+  candidates_.merge(other.candidates_);
+  target_scores_.merge(other.target_scores_);
+  decoy_scores_.merge(other.decoy_scores_);
+  mass_errors_.merge(other.mass_errors_);
+  for (map<int, unsigned long>::const_iterator i = other.isotope_errors_.begin();
+       i != other.isotope_errors_.end(); ++i) {
+    isotope_errors_[i->first] += i->second;
+  }
+}
+
+/**
+ * Appends an HTML table of counts by a whole-number key to out.
+ */
+static void WriteCounts(ostream* out, const string& label,
+                        const map<int, unsigned long>& counts) {
+  unsigned long total = 0;
+  for (map<int, unsigned long>::const_iterator i = counts.begin(); i != counts.end(); ++i) {
+    total += i->second;
+  }
+  *out << "<table>\n<tr><th>" << label << "</th><th>Count</th><th>%</th></tr>\n";
+  for (map<int, unsigned long>::const_iterator i = counts.begin(); i != counts.end(); ++i) {
+    *out << "<tr><td>" << i->first << "</td><td class=\"n\">" << i->second
+         << "</td><td class=\"n\">";
+    Print(out, "%.1f", total > 0 ? 100.0 * i->second / total : 0.0);
+    *out << "</td></tr>\n";
+  }
+  *out << "</table>\n";
+}
+
+void QCStatistics::writeHTML(
+  ostream* out,
+  const string& title,
+  const string& score_name
+) const {
+  *out << "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n"
+       << "<title>" << title << "</title>\n"
+       << "<style>\n"
+       << "body { font-family: sans-serif; }\n"
+       << "table { border-collapse: collapse; margin-bottom: 1em; }\n"
+       << "td, th { padding: 1px 8px; text-align: left; }\n"
+       << "td.n { text-align: right; }\n"
+       << ".bar { background: #4a7ab5; height: 10px; }\n"
+       << "</style>\n</head>\n<body>\n"
+       << "<h1>" << title << "</h1>\n"
+       << "<p>" << spectra_ << " spectrum-charge pairs searched.</p>\n";
+
+  *out << "<h2>Charge states</h2>\n";
+  WriteCounts(out, "Charge", charges_);
+
+  *out << "<h2>Candidate peptides per spectrum-charge pair</h2>\n";
+  candidates_.writeHTML(out, "Candidates");
+
+  *out << "<h2>Top target " << score_name << "</h2>\n";
+  target_scores_.writeHTML(out, score_name);
+
+  *out << "<h2>Top decoy " << score_name << "</h2>\n";
+  decoy_scores_.writeHTML(out, score_name);
+
+  *out << "<h2>Precursor isotope errors of top targets</h2>\n";
+  WriteCounts(out, "Isotope", isotope_errors_);
+
+  *out << "<h2>Precursor mass errors of top targets (ppm)</h2>\n"
+       << "<p>From the nearest isotope peak.</p>\n";
+  mass_errors_.writeHTML(out, "ppm");
+
+  *out << "</body>\n</html>\n";
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,107 @@
+/**
+ * \file QCStatistics.h
+ * \brief Summary statistics of a search, collected as PSMs are reported,
+ * and the QC report rendered from them.
+ *
+ * Each search thread collects into a QCStatistics of its own; the threads'
+ * statistics are merged at the end, so nothing is locked and no results file
+ * is read back. Distributions are kept as sparse fixed-width histograms,
+ * which merge by adding their bins.
+ */
+#ifndef QCSTATISTICS_H
+#define QCSTATISTICS_H
+
+#include <iostream>
+#include <map>
+#include <string>
+
+class QCHistogram {
+ public:
+  /**
+   * A histogram with bins of the given width; with log_scale, of
+   * log2(1 + value) instead.
+   */
+  explicit QCHistogram(double width, bool log_scale = false);
+
+  void add(double value);
+  void merge(const QCHistogram& other);
+
+  unsigned long count() const { return count_; }
+  double mean() const { return count_ > 0 ? sum_ / count_ : 0; }
+  double min() const { return min_; }
+  double max() const { return max_; }
+
+  /**
+   * \returns An estimate of the value below which fraction q of the values
+   * lie, to within a bin.
+   */
+  double quantile(double q) const;
+
+  /**
+   * Appends an HTML table of the bins, with bars, to out.
+   */
+  void writeHTML(std::ostream* out, const std::string& label) const;
+
+ private:
+  long bin(double value) const;
+  double binStart(long bin) const;
+
+  double width_;
+  bool log_scale_;
+  std::map<long, unsigned long> bins_;
+  unsigned long count_;
+  double sum_;
+  double min_;
+  double max_;
+};
+
+class QCStatistics {
+ public:
+  QCStatistics();
+
+  /**
+   * Counts a spectrum-charge pair and the candidates it was scored against.
+   */
+  void addSpectrum(int charge, int candidates);
+
+  /**
+   * Counts the best target or decoy match of a spectrum-charge pair.
+   */
+  void addTopMatch(
+    bool decoy,
+    double score,
+    double spectrum_mass, ///< neutral mass of the spectrum at its charge
+    double peptide_mass
+  );
+
+  void merge(const QCStatistics& other);
+
+  bool empty() const { return spectra_ == 0; }
+
+  /**
+   * Writes the QC report as an HTML page.
+   */
+  void writeHTML(
+    std::ostream* out,
+    const std::string& title,
+    const std::string& score_name ///< what the match scores are
+  ) const;
+
+ private:
+  unsigned long spectra_;
+  std::map<int, unsigned long> charges_;
+  QCHistogram candidates_;
+  QCHistogram target_scores_;
+  QCHistogram decoy_scores_;
+  QCHistogram mass_errors_; ///< ppm, from the nearest isotope peak
+  std::map<int, unsigned long> isotope_errors_;
+};
+
+#endif // QCSTATISTICS_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
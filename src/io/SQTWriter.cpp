@@ -21,8 +21,7 @@ void SQTWriter::openFile(string filename) {
 }
 
 void SQTWriter::closeFile() {
-  if (file_ && file_->is_open()) {
-    file_->close();
+  if (file_) {
     delete file_;
     file_ = NULL;
   }
@@ -33,7 +32,7 @@ void SQTWriter::writeHeader(
   int num_proteins,
   bool is_decoy
 ) {
-  if (!file_->is_open()) {
+  if (file_ == NULL) {
     return;
   }
 
@@ -145,7 +144,7 @@ void SQTWriter::writeSpectrum(
   SpectrumZState& z_state,
   int num_matches
 ) {
-  if (!file_->is_open()) {
+  if (file_ == NULL) {
     return;
   }
 
@@ -190,7 +189,7 @@ void SQTWriter::writePSM(
   int b_y_total,
   bool is_decoy
 ) {
-  if (!file_->is_open()) {
+  if (file_ == NULL) {
     return;
   }
 
@@ -0,0 +1,121 @@
+/**
+ * \file ScoreIndex.cpp
+ * \brief Score index beside a tab-delimited PSM file.
+ */
+#include <cstdio>
+#include <cstring>
+#include "ScoreIndex.h"
+#include "carp.h"
+#include "model/Match.h"
+#include "util/FileUtils.h"
+#include "util/ParallelSort.h"
+
+using namespace std;
+
+const char ScoreIndex::MAGIC[8] = { 'C', 'R', 'U', 'X', 'S', 'C', 'O', '1' };
+
+/**
+ * Orders entries best score first, as assign-confidence orders the targets
+ * it computes q-values for.
+ */
+class CompareEntryScores {
+ public:
+  explicit CompareEntryScores(bool ascending) : ascending_(ascending) {}
+  bool operator()(const ScoreIndex::Entry& x, const ScoreIndex::Entry& y) const {
+    return ascending_ ? Crux::Match::ScoreLess((FLOAT_T) x.score, (FLOAT_T) y.score)
+                      : Crux::Match::ScoreGreater((FLOAT_T) x.score, (FLOAT_T) y.score);
+  }
+ protected:
+  bool ascending_;
+};
+
+ScoreIndex::ScoreIndex() {
+}
+
+string ScoreIndex::FileName(const string& results_file) {
+  return results_file + ".scores";
+}
+
+bool ScoreIndex::write(
+  const string& results_file,
+  MATCH_COLUMNS_T score_col,
+  bool ascending
+) {
+  // The entries come in file order, and the sort is stable.
+  ParallelSort::Sort(entries_.begin(), entries_.end(), CompareEntryScores(ascending));
+
+  string path = FileName(results_file);
+  FILE* out = fopen(path.c_str(), "wb");
+  if (out == NULL) {
+    carp(CARP_ERROR, "Cannot create the score index %s", path.c_str());
+    return false;
+  }
+  int32_t header[2] = { (int32_t) score_col, ascending ? 1 : 0 };
+  uint64_t sizes[2] = { FileUtils::Size(results_file), entries_.size() };
+  bool ok = fwrite(MAGIC, sizeof(MAGIC), 1, out) == 1 &&
+    fwrite(header, sizeof(header), 1, out) == 1 &&
+    fwrite(sizes, sizeof(sizes), 1, out) == 1 &&
+    (entries_.empty() ||
+     fwrite(&entries_[0], sizeof(Entry), entries_.size(), out) == entries_.size());
+  ok = fclose(out) == 0 && ok;
+  if (!ok) {
+    carp(CARP_ERROR, "Error writing the score index %s", path.c_str());
+    remove(path.c_str());
+    return false;
+  }
+  carp(CARP_DEBUG, "Wrote a score index of %d rows to %s",
+       (int) entries_.size(), path.c_str());
+  return true;
+}
+
+bool ScoreIndex::read(
+  const string& results_file,
+  MATCH_COLUMNS_T score_col,
+  bool ascending
+) {
+  entries_.clear();
+  string path = FileName(results_file);
+  if (!FileUtils::Exists(path)) {
+    return false;
+  }
+  FILE* in = fopen(path.c_str(), "rb");
+  if (in == NULL) {
+    return false;
+  }
+  char magic[sizeof(MAGIC)];
+  int32_t header[2];
+  uint64_t sizes[2];
+  bool ok = fread(magic, sizeof(magic), 1, in) == 1 &&
+    memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 &&
+    fread(header, sizeof(header), 1, in) == 1 &&
+    fread(sizes, sizeof(sizes), 1, in) == 1;
+  if (!ok) {
+    carp(CARP_WARNING, "%s is not a score index", path.c_str());
+  } else if (header[0] != (int32_t) score_col || header[1] != (ascending ? 1 : 0)) {
+    carp(CARP_INFO, "The score index %s is not of the %s score; not using it.",
+         path.c_str(), get_column_header(score_col));
+    ok = false;
+  } else if (sizes[0] != FileUtils::Size(results_file)) {
+    carp(CARP_WARNING, "The score index %s is out of date; not using it.", path.c_str());
+    ok = false;
+  } else {
+    entries_.resize(sizes[1]);
+    ok = entries_.empty() ||
+      fread(&entries_[0], sizeof(Entry), entries_.size(), in) == entries_.size();
+    if (!ok) {
+      carp(CARP_WARNING, "Error reading the score index %s", path.c_str());
+    }
+  }
+  fclose(in);
+  if (!ok) {
+    entries_.clear();
+  }
+  return ok;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,77 @@
+/**
+ * \file ScoreIndex.h
+ * \brief Score index beside a tab-delimited PSM file.
+ *
+ * The score index of a results file holds, for every row, the score,
+ * xcorr rank and target/decoy status of the PSM and the offset of the row
+ * in the file, sorted best score first. tide-search writes it as it writes
+ * its results (see score-index), and assign-confidence computes q-values
+ * from it without reading the scores from the rows or sorting them. The
+ * layout, in native byte order, is the 8 bytes "CRUXSCO1", the int32
+ * score column and whether smaller scores are better, the uint64 size of
+ * the results file it indexes, the uint64 number of entries and then the
+ * entries themselves.
+ */
+#ifndef SCORE_INDEX_H
+#define SCORE_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "MatchColumns.h"
+
+class ScoreIndex {
+ public:
+  struct Entry {
+    double score;     ///< as written to the row
+    uint64_t offset;  ///< of the row in the results file
+    int32_t rank;     ///< xcorr rank
+    int32_t decoy;    ///< 1 for a decoy, 0 for a target
+  };
+
+  ScoreIndex();
+
+  /**
+   * \returns The name of the score index of results_file.
+   */
+  static std::string FileName(const std::string& results_file);
+
+  std::vector<Entry>& entries() { return entries_; }
+  const std::vector<Entry>& entries() const { return entries_; }
+
+  /**
+   * Sorts the entries best score first, rows of equal scores in file
+   * order, and writes them as the index of results_file.
+   * \returns false if the index cannot be written.
+   */
+  bool write(
+    const std::string& results_file,
+    MATCH_COLUMNS_T score_col,
+    bool ascending
+  );
+
+  /**
+   * Reads the index of results_file, if there is one of its current size
+   * for the given score and order.
+   * \returns false if there is none.
+   */
+  bool read(
+    const std::string& results_file,
+    MATCH_COLUMNS_T score_col,
+    bool ascending
+  );
+
+ private:
+  static const char MAGIC[8];
+
+  std::vector<Entry> entries_;
+};
+
+#endif // SCORE_INDEX_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,42 @@
+#include <cstdio>
+#include <sstream>
+#include "SpectrumCache.h"
+#include "app/tide/abspath.h"
+#include "io/carp.h"
+#include "util/FileUtils.h"
+#include "util/Params.h"
+
+using namespace std;
+
+string SpectrumCache::Dir() {
+  string cache_dir = Params::GetString("spectrum-cache-dir");
+  if (!cache_dir.empty() && !FileUtils::IsDir(cache_dir) &&
+      !FileUtils::Mkdir(cache_dir)) {
+    carp(CARP_FATAL, "Cannot create the spectrum cache directory %s",
+         cache_dir.c_str());
+  }
+  return cache_dir;
+}
+
+string SpectrumCache::Path(const string& cache_dir,
+                           const string& spectrum_file,
+                           const string& format,
+                           const vector<string>& params) {
+  ostringstream key;
+  key << format << "-1\t" << AbsPath(spectrum_file)
+      << '\t' << FileUtils::Size(spectrum_file)
+      << '\t' << FileUtils::ModificationTime(spectrum_file);
+  for (vector<string>::const_iterator i = params.begin(); i != params.end(); i++) {
+    key << '\t' << Params::GetString(*i);
+  }
+  // 64-bit FNV-1a, which unlike boost::hash is the same from build to build
+  unsigned long long hash = 14695981039346656037ull;
+  string bytes = key.str();
+  for (string::const_iterator i = bytes.begin(); i != bytes.end(); i++) {
+    hash = (hash ^ (unsigned char)*i) * 1099511628211ull;
+  }
+  char hex[17];
+  sprintf(hex, "%016llx", hash);
+  return FileUtils::Join(cache_dir,
+    FileUtils::BaseName(spectrum_file) + "." + hex + "." + format);
+}
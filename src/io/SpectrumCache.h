@@ -0,0 +1,33 @@
+#ifndef SPECTRUM_CACHE_H
+#define SPECTRUM_CACHE_H
+
+#include <string>
+#include <vector>
+
+/**
+ * The spectrum-cache-dir directory, in which the searches keep the spectrum
+ * files they convert from other formats for reuse by later searches of the
+ * same files.
+ */
+class SpectrumCache {
+ public:
+  /**
+   * The spectrum-cache-dir, created if it does not exist, or "" if the
+   * option is not set.
+   */
+  static std::string Dir();
+
+  /**
+   * The file in cache_dir for the conversion of spectrum_file to format
+   * (also the extension of the file). The name holds a hash of the absolute
+   * path, size and modification time of spectrum_file and of the values of
+   * params, the parameters that affect conversion, so that a changed file or
+   * parameter makes a new entry instead of reusing a stale one.
+   */
+  static std::string Path(const std::string& cache_dir,
+                          const std::string& spectrum_file,
+                          const std::string& format,
+                          const std::vector<std::string>& params);
+};
+
+#endif
@@ -8,11 +8,16 @@
 #include "parameter.h"
 #include "SpectrumCollectionFactory.h"
 #include "MSToolkitSpectrumCollection.h"
+#include "MzmlSpectrumCollection.h"
 #include "PWIZSpectrumCollection.h"
 #include "SpectrumRecordSpectrumCollection.h"
+#include "TextSpectrumCollection.h"
 #include "util/FileUtils.h"
 #include "util/Params.h"
 
+std::string SpectrumCollectionFactory::kept_filename_;
+Crux::SpectrumCollection* SpectrumCollectionFactory::kept_spectra_ = NULL;
+
 /**
  * Instantiates a SpectrumCollection based on the extension of the
  * given file and the use-mstoolkit and msgf options.
@@ -37,12 +42,66 @@ Crux::SpectrumCollection* SpectrumCollectionFactory::create(const string& filena
   } else if (parser == "mstoolkit") {
     carp(CARP_DEBUG, "Using mstoolkit to parse spectra");
     return new MSToolkitSpectrumCollection(filename);
+  } else if (parser == "text") {
+    if (TextSpectrumCollection::CanParse(filename)) {
+      carp(CARP_DEBUG, "Using the text parser to parse spectra");
+      return new TextSpectrumCollection(filename);
+    }
+    carp(CARP_DEBUG, "The text parser reads only .ms2 and .mgf files, using "
+                     "ProteoWizard to parse spectra");
+    return new PWIZSpectrumCollection(filename);
+  } else if (parser == "native") {
+    if (TextSpectrumCollection::CanParse(filename)) {
+      carp(CARP_DEBUG, "Using the text parser to parse spectra");
+      return new TextSpectrumCollection(filename);
+    } else if (MzmlSpectrumCollection::CanParse(filename)) {
+      carp(CARP_DEBUG, "Using the native mzML parser to parse spectra");
+      return new MzmlSpectrumCollection(filename);
+    }
+    carp(CARP_DEBUG, "No native parser reads %s, using ProteoWizard to parse "
+                     "spectra", filename.c_str());
+    return new PWIZSpectrumCollection(filename);
   }
 
   carp(CARP_FATAL, "Unknown spectrum parser type");
   return(NULL); // Avoid compiler warning.
 }
 
+/**
+ * Keeps the parsed spectra of filename for the next tool that reads it.
+ */
+void SpectrumCollectionFactory::keep(
+  const string& filename,
+  Crux::SpectrumCollection* spectra
+) {
+  clearKept();
+  kept_filename_ = filename;
+  kept_spectra_ = spectra;
+}
+
+/**
+ * \returns The parsed spectra kept for filename, now owned by the caller,
+ * or NULL.
+ */
+Crux::SpectrumCollection* SpectrumCollectionFactory::takeKept(const string& filename) {
+  if (kept_spectra_ == NULL || kept_filename_ != filename) {
+    return NULL;
+  }
+  Crux::SpectrumCollection* spectra = kept_spectra_;
+  kept_spectra_ = NULL;
+  kept_filename_.clear();
+  return spectra;
+}
+
+/**
+ * Deletes the kept spectra, if nobody took them.
+ */
+void SpectrumCollectionFactory::clearKept() {
+  delete kept_spectra_;
+  kept_spectra_ = NULL;
+  kept_filename_.clear();
+}
+
 /*
  * Local Variables:
  * mode: c
@@ -19,6 +19,28 @@ class SpectrumCollectionFactory {
  public:
   static Crux::SpectrumCollection* create(const std::string& filename);
 
+  /**
+   * Keeps the parsed spectra of filename, so that the next tool in this run
+   * that needs them can take them instead of reading the file again. Only
+   * one file is kept at a time; the spectra kept before are deleted.
+   */
+  static void keep(const std::string& filename, Crux::SpectrumCollection* spectra);
+
+  /**
+   * \returns The parsed spectra kept for filename, which the caller now
+   * owns, or NULL if they were not kept.
+   */
+  static Crux::SpectrumCollection* takeKept(const std::string& filename);
+
+  /**
+   * Deletes the kept spectra, if nobody took them.
+   */
+  static void clearKept();
+
+ protected:
+  static std::string kept_filename_;
+  static Crux::SpectrumCollection* kept_spectra_;
+
 };
 
 /*
@@ -1,3 +1,4 @@
+#include <memory>
 #include "SpectrumRecordSpectrumCollection.h"
 #include "app/tide/records.h"
 #include "app/tide/spectrum_collection.h"
@@ -7,7 +8,7 @@ using namespace std;
 
 SpectrumRecordSpectrumCollection::SpectrumRecordSpectrumCollection(
   const string& filename
-): SpectrumCollection(filename) {
+): SpectrumCollection(filename), has_index_(-1) {
 }
 
 SpectrumRecordSpectrumCollection::~SpectrumRecordSpectrumCollection() {
@@ -42,22 +43,7 @@ bool SpectrumRecordSpectrumCollection::parse() {
     for (int i = 0; i < pb_spectrum.charge_state_size(); i++) {
       charges.push_back(pb_spectrum.charge_state(i));
     }
-    Crux::Spectrum* spectrum = new Crux::Spectrum(
-      pb_spectrum.spectrum_number(),
-      pb_spectrum.spectrum_number(),
-      pb_spectrum.precursor_m_z(),
-      charges,
-      filename_);
-    double mzDenom = pb_spectrum.peak_m_z_denominator();
-    double intensityDenom = pb_spectrum.peak_intensity_denominator();
-    uint64_t total = 0;
-    for (int i = 0; i < pb_spectrum.peak_m_z_size(); i++) {
-      total += pb_spectrum.peak_m_z(i);
-      spectrum->addPeak(
-        pb_spectrum.peak_intensity(i) / intensityDenom,
-        total / mzDenom);
-    }
-    addSpectrum(spectrum);
+    addSpectrum(newSpectrum(pb_spectrum, charges, filename_));
   }
   if (!reader.OK()) {
     carp(CARP_ERROR, "Error reading spectrum records file '%s'", filename_.c_str());
@@ -70,12 +56,75 @@ bool SpectrumRecordSpectrumCollection::parse() {
   return true;
 }
 
+Crux::Spectrum* SpectrumRecordSpectrumCollection::newSpectrum(
+  const pb::Spectrum& pb_spectrum,
+  const vector<int>& charges,
+  const string& filename
+) {
+  Crux::Spectrum* spectrum = new Crux::Spectrum(
+    pb_spectrum.spectrum_number(),
+    pb_spectrum.spectrum_number(),
+    pb_spectrum.precursor_m_z(),
+    charges,
+    filename);
+  double mzDenom = pb_spectrum.peak_m_z_denominator();
+  double intensityDenom = pb_spectrum.peak_intensity_denominator();
+  uint64_t total = 0;
+  spectrum->reservePeaks(pb_spectrum.peak_m_z_size());
+  for (int i = 0; i < pb_spectrum.peak_m_z_size(); i++) {
+    total += pb_spectrum.peak_m_z(i);
+    spectrum->addPeak(
+      pb_spectrum.peak_intensity(i) / intensityDenom,
+      total / mzDenom);
+  }
+  return spectrum;
+}
+
+bool SpectrumRecordSpectrumCollection::readIndexedSpectrum(
+  const ScanIndex::Entry& entry,
+  Crux::Spectrum* spectrum
+) {
+  HeadedRecordReader reader(filename_);
+  if (!reader.Reader()->SeekRecord(entry.offset)) {
+    return false;
+  }
+  // The records of a scan differ only in their charge state
+  pb::Spectrum first, pb_spectrum;
+  vector<int> charges;
+  for (uint32_t i = 0; i < entry.records; i++) {
+    pb::Spectrum* record = i == 0 ? &first : &pb_spectrum;
+    if (reader.Done() || !reader.Read(record) ||
+        record->spectrum_number() != entry.scan) {
+      carp(CARP_ERROR, "The scan index of '%s' does not match it", filename_.c_str());
+      return false;
+    }
+    for (int j = 0; j < record->charge_state_size(); j++) {
+      charges.push_back(record->charge_state(j));
+    }
+  }
+  auto_ptr<Crux::Spectrum> read(newSpectrum(first, charges, filename_));
+  spectrum->copyFrom(read.get());
+  return true;
+}
+
 Crux::Spectrum* SpectrumRecordSpectrumCollection::getSpectrum(int first_scan) {
-  parse();
   return SpectrumCollection::getSpectrum(first_scan);
 }
 
+/**
+ * Reads the scan with a seek if the file has a scan index (see
+ * app/tide/scan_index.h), or else parses the whole file.
+ */
 bool SpectrumRecordSpectrumCollection::getSpectrum(int first_scan, Crux::Spectrum* spectrum) {
+  if (!is_parsed_) {
+    if (has_index_ < 0) {
+      has_index_ = index_.Read(filename_) ? 1 : 0;
+    }
+    if (has_index_ > 0) {
+      const ScanIndex::Entry* entry = index_.Find(first_scan);
+      return entry != NULL && readIndexedSpectrum(*entry, spectrum);
+    }
+  }
   parse();
   return SpectrumCollection::getSpectrum(first_scan, spectrum);
 }
@@ -2,8 +2,25 @@
 #define SPECTRUM_RECORD_SPECTRUM_COLLECTION_H
 
 #include "SpectrumCollection.h"
+#include "app/tide/scan_index.h"
+
+namespace pb { class Spectrum; }
 
 class SpectrumRecordSpectrumCollection : public Crux::SpectrumCollection {
+ protected:
+  ScanIndex index_;
+  int has_index_;  ///< -1 if the scan index has not been looked for yet
+
+  /**
+   * Reads the records of the scan at entry into spectrum, using the scan
+   * index instead of parsing the file.
+   */
+  bool readIndexedSpectrum(const ScanIndex::Entry& entry, Crux::Spectrum* spectrum);
+
+  static Crux::Spectrum* newSpectrum(const pb::Spectrum& pb_spectrum,
+                                     const std::vector<int>& charges,
+                                     const std::string& filename);
+
  public:
   SpectrumRecordSpectrumCollection(const std::string& filename);
   virtual ~SpectrumRecordSpectrumCollection();
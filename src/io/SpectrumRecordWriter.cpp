@@ -1,13 +1,18 @@
 #include <cmath>
 #include <memory>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "app/tide/records.h"
 #include "app/tide/mass_constants.h"
+#include "app/tide/scan_index.h"
 
 #include "model/Peak.h"
 #include "SpectrumCollectionFactory.h"
 #include "SpectrumRecordWriter.h"
 #include "io/carp.h"
 #include "util/crux-utils.h"
+#include "util/Params.h"
+#include "util/ThreadPool.h"
 
 // For printing uint64_t values
 #define __STDC_FORMAT_MACROS
@@ -23,20 +28,28 @@ int SpectrumRecordWriter::scanCounter_ = 0;
  */
 bool SpectrumRecordWriter::convert(
   const string& infile, ///< spectra file to convert
-  string outfile  ///< spectrumrecords file to output
+  string outfile,  ///< spectrumrecords file to output
+  int num_threads, ///< threads to encode spectra on
+  bool scan_index ///< whether to index outfile by scan
 ) {
-  auto_ptr<Crux::SpectrumCollection> spectra(SpectrumCollectionFactory::create(infile.c_str()));
+  // Use the spectra of infile if an earlier step already parsed them
+  auto_ptr<Crux::SpectrumCollection> spectra(SpectrumCollectionFactory::takeKept(infile));
+  if (spectra.get() != NULL) {
+    carp(CARP_DEBUG, "Reusing the spectra already read from %s", infile.c_str());
+  } else {
+    spectra.reset(SpectrumCollectionFactory::create(infile.c_str()));
 
-  // Open infile
-  try {
-    if (!spectra->parse()) {
+    // Open infile
+    try {
+      if (!spectra->parse()) {
+        return false;
+      }
+    } catch (const std::exception& e) {
+      carp(CARP_ERROR, "%s", e.what());
+      return false;
+    } catch (...) {
       return false;
     }
-  } catch (const std::exception& e) {
-    carp(CARP_ERROR, "%s", e.what());
-    return false;
-  } catch (...) {
-    return false;
   }
 
   // Write outfile
@@ -51,49 +64,133 @@ bool SpectrumRecordWriter::convert(
 
   header.mutable_spectra_header()->set_sorted(false);
 
-  HeadedRecordWriter writer(outfile, header);
-  if (!writer.OK()) {
+  auto_ptr<HeadedRecordWriter> writer(new HeadedRecordWriter(outfile, header));
+  if (!writer->OK()) {
     return false;
   }
+  vector<pair<int, google::protobuf::int64> > record_scans;
 
+  vector<Crux::Spectrum*> all(spectra->begin(), spectra->end());
   scanCounter_ = 0;
+  vector<int> scan_numbers;
+  scan_numbers.reserve(all.size());
+  for (vector<Crux::Spectrum*>::const_iterator i = all.begin(); i != all.end(); ++i) {
+    scan_numbers.push_back(getScanNumber(*i));
+  }
 
-  // Go through the spectrum list and write each spectrum
-  for (SpectrumIterator i = spectra->begin(); i != spectra->end(); ++i) {
-    (*i)->sortPeaks(_PEAK_LOCATION); // Sort by m/z
-    vector<pb::Spectrum> pb_spectra = getPbSpectra(*i);
-    for (vector<pb::Spectrum>::const_iterator j = pb_spectra.begin();
-         j != pb_spectra.end();
-         ++j) { 
-      writer.Write(&*j);
+  // Go through the spectrum list a batch at a time, encoding the spectra of a
+  // batch in parallel and then writing them in order
+  const size_t kBatchSize = 4096;
+  vector< vector<pb::Spectrum> > encoded;
+  for (size_t begin = 0; begin < all.size(); begin += kBatchSize) {
+    size_t end = min(all.size(), begin + kBatchSize);
+    encoded.assign(end - begin, vector<pb::Spectrum>());
+    if (num_threads > 1) {
+      ThreadPool::TaskGroup workers;
+      for (int t = 0; t < num_threads; t++) {
+        workers.Run(boost::bind(&SpectrumRecordWriter::encodeSpectra,
+          &all, &scan_numbers, &encoded, begin, end, begin + t, num_threads));
+      }
+      workers.Wait();
+    } else {
+      encodeSpectra(&all, &scan_numbers, &encoded, begin, end, begin, 1);
+    }
+    for (vector< vector<pb::Spectrum> >::const_iterator i = encoded.begin();
+         i != encoded.end();
+         ++i) {
+      for (vector<pb::Spectrum>::const_iterator j = i->begin(); j != i->end(); ++j) {
+        if (scan_index) {
+          record_scans.push_back(make_pair(j->spectrum_number(),
+                                           writer->Writer()->Position()));
+        }
+        writer->Write(&*j);
+      }
     }
   }
 
+  // The index records the size of the finished file
+  writer.reset();
+  if (scan_index && !ScanIndex::Write(outfile, record_scans)) {
+    carp(CARP_WARNING, "Could not write the scan index of %s", outfile.c_str());
+  }
+
   return true;
 }
 
 /**
- * Return a pb::Spectrum from a pwiz SpectrumPtr
- * If spectrum is ms1, or has no precursors/peaks then return empty pb::Spectrum
+ * Return the scan number to write for a Crux::Spectrum, or 0 if it will not
+ * be written
  */
-vector<pb::Spectrum> SpectrumRecordWriter::getPbSpectra(
+int SpectrumRecordWriter::getScanNumber(
   const Crux::Spectrum* s
 ) {
-  vector<pb::Spectrum> spectra;
-
   if (s->getNumZStates() == 0 || s->getNumPeaks() == 0) {
-    return spectra;
+    return 0;
   }
-
-  // Get scan number
   int scan_num = s->getFirstScan();
   if (scanCounter_ > 0 || scan_num <= 0) {
     carp_once(CARP_INFO, "Parser could not determine scan numbers for this "
                          "file, using ordinal numbers as scan numbers.");
     scan_num = ++scanCounter_;
   }
+  return scan_num;
+}
+
+/**
+ * Sort the peaks of and encode every stride-th spectrum of a batch
+ */
+void SpectrumRecordWriter::encodeSpectra(
+  const vector<Crux::Spectrum*>* spectra,
+  const vector<int>* scan_numbers,
+  vector< vector<pb::Spectrum> >* encoded,
+  size_t begin,
+  size_t end,
+  size_t first,
+  size_t stride
+) {
+  for (size_t i = first; i < end; i += stride) {
+    (*spectra)[i]->sortPeaks(_PEAK_LOCATION); // Sort by m/z
+    (*encoded)[i - begin] = getPbSpectra((*spectra)[i], (*scan_numbers)[i]);
+  }
+}
+
+/**
+ * Return a pb::Spectrum from a pwiz SpectrumPtr
+ * If spectrum is ms1, or has no precursors/peaks then return empty pb::Spectrum
+ */
+vector<pb::Spectrum> SpectrumRecordWriter::getPbSpectra(
+  const Crux::Spectrum* s,
+  int scan_num ///< from getScanNumber()
+) {
+  vector<pb::Spectrum> spectra;
+
+  if (scan_num == 0) {
+    return spectra;
+  }
 
   const vector<SpectrumZState>& zStates = s->getZStates();
+  if (zStates.size() > 1 && Params::GetBool("multiplexed-spectra")) {
+    // One record, with its peaks once, for all of the precursor hypotheses
+    spectra.push_back(pb::Spectrum());
+    pb::Spectrum& newSpectrum = spectra.back();
+    newSpectrum.set_spectrum_number(scan_num);
+    newSpectrum.set_precursor_m_z(zStates.front().getMZ());
+    bool same_mz = true;
+    for (vector<SpectrumZState>::const_iterator i = zStates.begin(); i != zStates.end(); ++i) {
+      newSpectrum.add_charge_state(i->getCharge());
+      same_mz = same_mz && i->getMZ() == zStates.front().getMZ();
+    }
+    if (!same_mz) {
+      for (vector<SpectrumZState>::const_iterator i = zStates.begin(); i != zStates.end(); ++i) {
+        newSpectrum.add_charge_state_m_z(i->getMZ());
+      }
+    }
+    addPeaks(&newSpectrum, s);
+    if (newSpectrum.peak_m_z_size() == 0) {
+      spectra.pop_back();
+    }
+    return spectra;
+  }
   for (vector<SpectrumZState>::const_iterator i = zStates.begin(); i != zStates.end(); ++i) {
     spectra.push_back(pb::Spectrum());
     pb::Spectrum& newSpectrum = spectra.back();
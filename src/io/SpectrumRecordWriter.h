@@ -17,10 +17,15 @@ class SpectrumRecordWriter {
   /**
    * Converts a spectra file to spectrumrecords format for use with tide-search.
    * Spectra file is read by pwiz. Returns true on successful conversion.
+   * The spectra are sorted and encoded on num_threads threads, and written
+   * in their original order. With scan_index, the scan index of outfile is
+   * written too (see app/tide/scan_index.h).
    */
   static bool convert(
     const string& infile, ///< spectra file to convert
-    string outfile  ///< spectrumrecords file to output
+    string outfile,  ///< spectrumrecords file to output
+    int num_threads = 1, ///< threads to encode spectra on
+    bool scan_index = false ///< whether to index outfile by scan
   );
 
  protected:
@@ -28,13 +33,38 @@ class SpectrumRecordWriter {
   static int scanCounter_;
 
   /**
-   * Return a pb::Spectrum from a Crux::Spectrum
-   * Returns a default instance if there is a problem
+   * Return the scan number to write for a Crux::Spectrum, or 0 if it will
+   * not be written. Must be called for the spectra in order, since the scan
+   * numbers may be ordinals.
    */
-  static std::vector<pb::Spectrum> getPbSpectra(
+  static int getScanNumber(
     const Crux::Spectrum* s
   );
 
+  /**
+   * Sort the peaks of and encode spectra[i] into (*encoded)[i - begin] for
+   * the i in [begin, end) that are first + a multiple of stride.
+   */
+  static void encodeSpectra(
+    const std::vector<Crux::Spectrum*>* spectra,
+    const std::vector<int>* scan_numbers,
+    std::vector< std::vector<pb::Spectrum> >* encoded,
+    size_t begin,
+    size_t end,
+    size_t first,
+    size_t stride
+  );
+
+  /**
+   * Return the pb::Spectrums of a Crux::Spectrum, one per charge state, or
+   * with multiplexed-spectra one for all of them
+   * Returns none if there is a problem
+   */
+  static std::vector<pb::Spectrum> getPbSpectra(
+    const Crux::Spectrum* s,
+    int scan_num ///< from getScanNumber()
+  );
+
   /**
    * Add peaks to a pb::Spectrum
    */
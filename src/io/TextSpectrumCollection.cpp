@@ -0,0 +1,463 @@
+/**
+ * \file TextSpectrumCollection.cpp
+ * \brief Class to read .ms2 and .mgf files in parallel, without pwiz.
+ */
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "app/tide/mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "TextSpectrumCollection.h"
+#include "util/crux-utils.h"
+#include "util/FileUtils.h"
+#include "util/Params.h"
+#include "util/StringUtils.h"
+#include "util/ThreadPool.h"
+#include "parameter.h"
+
+using namespace std;
+
+// Files smaller than this are parsed on one thread.
+static const size_t kMinParallelBytes = 1 << 20;
+
+// The powers of ten that a double holds exactly.
+static const double kPow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const char* SkipBlanks(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    ++p;
+  }
+  return p;
+}
+
+static const char* LineEnd(const char* p, const char* end) {
+  const char* eol = (const char*) memchr(p, '\n', end - p);
+  return eol != NULL ? eol : end;
+}
+
+static bool StartsWith(const char* p, const char* end, const char* prefix) {
+  size_t n = strlen(prefix);
+  return (size_t)(end - p) >= n && memcmp(p, prefix, n) == 0;
+}
+
+/**
+ * Parses the decimal number after any blanks at *p and advances *p past it.
+ * When the digits and the power of ten are both exact doubles, one multiply
+ * or divide gives the correctly rounded value; anything else goes to
+ * strtod().
+ * \returns false if there is no number at *p.
+ */
+static bool ParseDouble(const char** p, const char* end, double* value) {
+  const char* start = SkipBlanks(*p, end);
+  const char* q = start;
+  bool negative = false;
+  if (q < end && (*q == '-' || *q == '+')) {
+    negative = *q == '-';
+    ++q;
+  }
+  unsigned long long mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool any = false;
+  for (; q < end && isdigit((unsigned char)*q); ++q) {
+    any = true;
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*q - '0');
+      digits += mantissa > 0;
+    } else {
+      ++exponent;
+    }
+  }
+  if (q < end && *q == '.') {
+    for (++q; q < end && isdigit((unsigned char)*q); ++q) {
+      any = true;
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*q - '0');
+        digits += mantissa > 0;
+        --exponent;
+      }
+    }
+  }
+  if (!any) {
+    return false;
+  }
+  if (q < end && (*q == 'e' || *q == 'E')) {
+    const char* e = q + 1;
+    bool negative_exponent = false;
+    if (e < end && (*e == '-' || *e == '+')) {
+      negative_exponent = *e == '-';
+      ++e;
+    }
+    if (e < end && isdigit((unsigned char)*e)) {
+      int x = 0;
+      for (; e < end && isdigit((unsigned char)*e); ++e) {
+        if (x < 10000) {
+          x = x * 10 + (*e - '0');
+        }
+      }
+      exponent += negative_exponent ? -x : x;
+      q = e;
+    }
+  }
+  if (mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+    *value = (double) mantissa;
+    *value = exponent < 0 ? *value / kPow10[-exponent] : *value * kPow10[exponent];
+    if (negative) {
+      *value = -*value;
+    }
+  } else {
+    char buf[64];
+    size_t n = min((size_t)(q - start), sizeof(buf) - 1);
+    memcpy(buf, start, n);
+    buf[n] = '\0';
+    *value = strtod(buf, NULL);
+  }
+  *p = q;
+  return true;
+}
+
+// Parses the integer after any blanks at *p and advances *p past it.
+static bool ParseInt(const char** p, const char* end, int* value) {
+  const char* q = SkipBlanks(*p, end);
+  bool negative = false;
+  if (q < end && (*q == '-' || *q == '+')) {
+    negative = *q == '-';
+    ++q;
+  }
+  if (q == end || !isdigit((unsigned char)*q)) {
+    return false;
+  }
+  int x = 0;
+  for (; q < end && isdigit((unsigned char)*q); ++q) {
+    x = x * 10 + (*q - '0');
+  }
+  *value = negative ? -x : x;
+  *p = q;
+  return true;
+}
+
+// Whether the line at p starts a scan.
+static bool IsScanStart(const char* p, const char* end, bool mgf) {
+  return mgf ? StartsWith(p, end, "BEGIN IONS") : (p < end && *p == 'S');
+}
+
+// The start of the first scan that begins at or after p, or end.
+static const char* ScanStart(const char* p, const char* begin, const char* end,
+                             bool mgf) {
+  if (p > begin) {
+    p = LineEnd(p - 1, end);
+    p = p < end ? p + 1 : end;
+  }
+  while (p < end && !IsScanStart(p, end, mgf)) {
+    p = LineEnd(p, end);
+    p = p < end ? p + 1 : end;
+  }
+  return p;
+}
+
+/**
+ * Reads the scan numbers from an MGF title of the form
+ * <name>.<first scan>.<last scan>.<charge>.dta, as
+ * PWIZSpectrumCollection::parseFirstLastScanFromTitle() does.
+ */
+static bool ScansFromTitle(const string& title, int* first_scan, int* last_scan) {
+  vector<string> tokens = StringUtils::Split(title, '.');
+  size_t n = tokens.size();
+  int charge;
+  return n >= 4 && tokens.back().find("dta") == 0 &&
+    StringUtils::TryFromString(tokens[n - 2], &charge) &&
+    StringUtils::TryFromString(tokens[n - 3], last_scan) &&
+    StringUtils::TryFromString(tokens[n - 4], first_scan);
+}
+
+bool TextSpectrumCollection::CanParse(const string& filename) {
+  string extension = FileUtils::Extension(filename);
+  transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  return extension == ".ms2" || extension == ".mgf";
+}
+
+/**
+ * Instantiates a new spectrum_collection object from a filename.
+ * Does not parse file.
+ */
+TextSpectrumCollection::TextSpectrumCollection(
+  const string& filename   ///< The spectrum collection filename.
+) : SpectrumCollection(filename) {
+  string extension = FileUtils::Extension(filename);
+  transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  mgf_ = extension == ".mgf";
+  use_z_line_ = Params::GetBool("use-z-line");
+}
+
+void TextSpectrumCollection::parseRange(
+  const char* begin,
+  const char* end,
+  vector<Crux::Spectrum*>* spectra
+) const {
+  Crux::Spectrum* spectrum = NULL;  // MS2: the spectrum being read
+  // MGF: the fields of the spectrum being read
+  bool in_ions = false;
+  double pepmass = 0;
+  int first_scan = 0, last_scan = 0;
+  string title;
+  vector<int> charges;
+  vector<pair<double, double> > peaks;
+
+  for (const char* line = begin; line < end; ) {
+    const char* eol = LineEnd(line, end);
+    const char* p = line;
+    double mz, intensity;
+    if (!mgf_) {
+      switch (*line) {
+      case 'S':
+        if (spectrum != NULL) {
+          spectra->push_back(spectrum);
+        }
+        p = line + 1;
+        first_scan = last_scan = 0;
+        mz = 0;
+        if (ParseInt(&p, eol, &first_scan) && ParseInt(&p, eol, &last_scan)) {
+          ParseDouble(&p, eol, &mz);
+        }
+        spectrum = new Crux::Spectrum(first_scan, last_scan, mz, vector<int>(),
+                                      filename_);
+        break;
+      case 'Z': {
+          int charge;
+          double mh;
+          p = line + 1;
+          if (spectrum != NULL && ParseInt(&p, eol, &charge) &&
+              ParseDouble(&p, eol, &mh)) {
+            SpectrumZState zstate;
+            if (use_z_line_) {
+              zstate.setSinglyChargedMass(mh, charge);
+            } else {
+              zstate.setMZ(spectrum->getPrecursorMz(), charge);
+            }
+            spectrum->addZState(zstate);
+          }
+        }
+        break;
+      default:
+        if (spectrum != NULL && isdigit((unsigned char)*line) &&
+            ParseDouble(&p, eol, &mz) && ParseDouble(&p, eol, &intensity)) {
+          spectrum->addPeak(intensity, mz);
+        }
+        break;
+      }
+    } else if (!in_ions) {
+      if (StartsWith(line, eol, "BEGIN IONS")) {
+        in_ions = true;
+        pepmass = 0;
+        first_scan = last_scan = 0;
+        title.clear();
+        charges.clear();
+        peaks.clear();
+      }
+    } else if (isdigit((unsigned char)*line)) {
+      if (ParseDouble(&p, eol, &mz) && ParseDouble(&p, eol, &intensity)) {
+        peaks.push_back(make_pair(mz, intensity));
+      }
+    } else if (StartsWith(line, eol, "END IONS")) {
+      in_ions = false;
+      if (first_scan <= 0 && !ScansFromTitle(title, &first_scan, &last_scan)) {
+        first_scan = last_scan = 0;
+      }
+      Crux::Spectrum* s = new Crux::Spectrum(first_scan, last_scan, pepmass,
+                                             charges, filename_);
+      s->reservePeaks(peaks.size());
+      for (vector<pair<double, double> >::const_iterator i = peaks.begin();
+           i != peaks.end();
+           ++i) {
+        s->addPeak(i->second, i->first);
+      }
+      spectra->push_back(s);
+    } else if (StartsWith(line, eol, "PEPMASS=")) {
+      p = line + 8;
+      ParseDouble(&p, eol, &pepmass);
+    } else if (StartsWith(line, eol, "CHARGE=")) {
+      // e.g. "2+", "2+ and 3+" or "2+,3+"
+      for (p = line + 7; p < eol; ) {
+        int charge;
+        if (!isdigit((unsigned char)*p) || !ParseInt(&p, eol, &charge)) {
+          ++p;
+        } else if (p == eol || *p != '-') {
+          charges.push_back(charge);
+        }
+      }
+    } else if (StartsWith(line, eol, "SCANS=")) {
+      p = line + 6;
+      if (ParseInt(&p, eol, &first_scan)) {
+        last_scan = first_scan;
+        if (p < eol && (*p == '-' || *p == ',')) {
+          ++p;
+          ParseInt(&p, eol, &last_scan);
+        }
+      }
+    } else if (StartsWith(line, eol, "TITLE=")) {
+      const char* title_end = eol;
+      while (title_end > line + 6 && isspace((unsigned char)title_end[-1])) {
+        --title_end;
+      }
+      title.assign(line + 6, title_end);
+    }
+    line = eol + 1;
+  }
+  if (spectrum != NULL) {
+    spectra->push_back(spectrum);
+  }
+}
+
+/**
+ * Parses all the spectra from file designated by the filename member
+ * variable.
+ * \returns True if the spectra are parsed successfully. False if otherwise.
+ */
+bool TextSpectrumCollection::parse() {
+  // spectrum_collection has already been parsed
+  if (is_parsed_) {
+    return false;
+  }
+
+  // get a list of scans to include if requested
+  string range_string = Params::GetString("scan-number");
+  int first_scan = -1;
+  int last_scan = -1;
+  if (!get_range_from_string(range_string, first_scan, last_scan)) {
+    carp(CARP_FATAL, "The scan number range '%s' is invalid. "
+         "Must be of the form <first>-<last>.", range_string.c_str());
+  }
+
+  carp(CARP_DEBUG, "Using the text parser to parse spectra.");
+
+  size_t size = (size_t) FileUtils::Size(filename_);
+  vector< vector<Crux::Spectrum*> > parts;
+  if (size > 0) {
+    int fd = open(filename_.c_str(), O_RDONLY);
+    void* data = fd < 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (data == MAP_FAILED) {
+      carp(CARP_ERROR, "Cannot map the spectrum file %s", filename_.c_str());
+      return false;
+    }
+    const char* begin = (const char*) data;
+    const char* end = begin + size;
+
+    int num_threads = Params::GetInt("num-threads");
+    if (num_threads < 1) {
+      num_threads = boost::thread::hardware_concurrency();
+    }
+    if (num_threads < 1 || size < kMinParallelBytes) {
+      num_threads = 1;
+    }
+    // Cut the file at the scan boundaries nearest to equal parts
+    vector<const char*> cuts(num_threads + 1, end);
+    cuts[0] = begin;
+    for (int i = 1; i < num_threads; i++) {
+      cuts[i] = max(cuts[i - 1], ScanStart(begin + size / num_threads * i,
+                                           begin, end, mgf_));
+    }
+    parts.resize(num_threads);
+    if (num_threads > 1) {
+      ThreadPool::TaskGroup workers;
+      for (int i = 0; i < num_threads; i++) {
+        workers.Run(boost::bind(&TextSpectrumCollection::parseRange,
+                                          this, cuts[i], cuts[i + 1], &parts[i]));
+      }
+      workers.Wait();
+    } else {
+      parseRange(begin, end, &parts[0]);
+    }
+    munmap(data, size);
+  }
+
+  // Scan numbers are found in file order, so the ones that are missing can
+  // be made ordinals only once all the parts are in
+  bool ordinal = false;
+  for (size_t i = 0; i < parts.size() && !ordinal; i++) {
+    for (size_t j = 0; j < parts[i].size() && !ordinal; j++) {
+      ordinal = parts[i][j]->getFirstScan() <= 0;
+    }
+  }
+  if (ordinal) {
+    carp_once(CARP_INFO, "Parser could not determine scan numbers for this "
+                         "file, using ordinal numbers as scan numbers.");
+  }
+  bool ignore_no_charge = Params::GetBool("pm-ignore-no-charge");
+  int scan_counter = 0;
+  for (size_t i = 0; i < parts.size(); i++) {
+    for (size_t j = 0; j < parts[i].size(); j++) {
+      Crux::Spectrum* spectrum = parts[i][j];
+      if (spectrum->getNumPeaks() < 1) {
+        delete spectrum;
+        continue;
+      }
+      if (ordinal) {
+        ++scan_counter;
+        spectrum->setScans(scan_counter, scan_counter);
+      }
+      if (spectrum->getLastScan() < first_scan ||
+          spectrum->getFirstScan() > last_scan ||
+          (spectrum->getNumZStates() == 0 &&
+           (ignore_no_charge || !spectrum->assignZState()))) {
+        delete spectrum;
+        continue;
+      }
+      addSpectrumToEnd(spectrum);
+      spectraByScan_[spectrum->getFirstScan()] = spectrum;
+    }
+  }
+
+  is_parsed_ = true;
+
+  return true;
+}
+
+/**
+ * Parses a single spectrum from a spectrum_collection with first scan
+ * number equal to first_scan.  Removes any existing information in
+ * the given spectrum.
+ * \returns True if the spectrum was allocated, false on error.
+ */
+bool TextSpectrumCollection::getSpectrum(
+  int first_scan,      ///< The first scan of the spectrum to retrieve -in
+  Crux::Spectrum* spectrum   ///< Put the spectrum info here
+  ) {
+  parse();
+  return SpectrumCollection::getSpectrum(first_scan, spectrum);
+}
+
+/**
+ * Parses a single spectrum from a spectrum_collection with first scan
+ * number equal to first_scan.
+ * \returns The spectrum data from file or NULL.
+ */
+Crux::Spectrum* TextSpectrumCollection::getSpectrum(
+  int first_scan      ///< The first scan of the spectrum to retrieve -in
+  ) {
+  parse();
+  return SpectrumCollection::getSpectrum(first_scan);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,81 @@
+/**
+ * \file TextSpectrumCollection.h
+ * \brief Class for reading spectra from .ms2 and .mgf files without pwiz.
+ *
+ * The file is mapped into memory and cut at scan boundaries into one piece
+ * per thread (see num-threads), and the pieces are parsed in parallel with a
+ * hand-written number parser. Selected with spectrum-parser=text.
+ */
+#ifndef TEXT_SPECTRUM_COLLECTION_H
+#define TEXT_SPECTRUM_COLLECTION_H
+
+#include <vector>
+#include "SpectrumCollection.h"
+
+class TextSpectrumCollection : public Crux::SpectrumCollection {
+
+ protected:
+  bool mgf_;  ///< whether the file is MGF rather than MS2
+  bool use_z_line_;  ///< whether MS2 Z lines give the precursor masses
+
+  /**
+   * Parses the spectra that begin in [begin, end) into spectra, leaving the
+   * charge states of the spectra without any to parse().
+   */
+  void parseRange(
+    const char* begin,
+    const char* end,
+    std::vector<Crux::Spectrum*>* spectra
+  ) const;
+
+ public:
+  /**
+   * \returns Whether filename is a .ms2 or .mgf file that this class reads.
+   */
+  static bool CanParse(
+    const std::string& filename
+  );
+
+  /**
+   * Constructor sets filename and initializes member variables.
+   */
+  TextSpectrumCollection(
+    const std::string& filename ///< The spectrum collection filename. -in
+  );
+
+  /**
+   * Parses all the spectra from file designated by the filename member
+   * variable.
+   * \returns TRUE if the spectra are parsed successfully. FALSE if otherwise.
+   */
+  virtual bool parse();
+
+  /**
+   * Parses a single spectrum from a spectrum_collection with first scan
+   * number equal to first_scan.
+   * \returns The newly allocated Spectrum or NULL if scan number not found.
+   */
+  virtual Crux::Spectrum* getSpectrum(
+    int first_scan      ///< The first scan of the spectrum to retrieve -in
+  );
+
+  /**
+   * Parses a single spectrum from a spectrum_collection with first scan
+   * number equal to first_scan.  Removes any existing information in the
+   * given spectrum.
+   * \returns True if the spectrum was allocated, false on error.
+   */
+  virtual bool getSpectrum(
+    int first_scan,      ///< The first scan of the spectrum to retrieve -in
+    Crux::Spectrum* spectrum   ///< Put the spectrum info here
+  );
+
+};
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
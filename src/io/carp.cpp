@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/once.hpp>
 #include "carp.h"
 #include "util/crux-utils.h"
 #include "parameter.h"
@@ -29,6 +32,116 @@ int get_verbosity_level(void) {
   return G_verbosity;
 }
 
+/**
+ * Messages are formatted by the thread that carps them and written by a
+ * thread of their own, so search threads never wait on stdio. Producers push
+ * onto a lock-free stack; the writer takes the whole stack at once, restores
+ * the order the messages were carped in, writes them and flushes, at least
+ * every FLUSH_MILLIS. A fatal message is written, with everything before it,
+ * by the thread that carps it, before the program exits.
+ */
+struct CarpRecord {
+  std::string text;
+  bool to_stderr;
+  bool to_log;
+  CarpRecord* next;
+};
+
+static const int FLUSH_MILLIS = 100;
+
+static boost::atomic<CarpRecord*> pending_records(NULL);
+static boost::mutex write_mutex; // held while records are written
+static boost::mutex wake_mutex;
+static boost::condition_variable wake_writer;
+static bool writer_stopping = false; // guarded by wake_mutex
+static boost::atomic<bool> writer_running(false);
+static boost::thread* writer_thread = NULL;
+static boost::once_flag writer_once = BOOST_ONCE_INIT;
+
+/**
+ * Writes whatever has been carped so far, oldest first, and flushes.
+ */
+static void write_pending_records() {
+  boost::mutex::scoped_lock lock(write_mutex);
+  CarpRecord* records = pending_records.exchange(NULL, boost::memory_order_acquire);
+  if (records == NULL) {
+    return;
+  }
+  CarpRecord* ordered = NULL;
+  while (records != NULL) {
+    CarpRecord* next = records->next;
+    records->next = ordered;
+    ordered = records;
+    records = next;
+  }
+  bool wrote_log = false;
+  while (ordered != NULL) {
+    CarpRecord* next = ordered->next;
+    if (ordered->to_stderr) {
+      fputs(ordered->text.c_str(), stderr);
+    }
+    if (ordered->to_log && log_file != NULL) {
+      fputs(ordered->text.c_str(), log_file);
+      wrote_log = true;
+    }
+    delete ordered;
+    ordered = next;
+  }
+  fflush(stderr);
+  if (wrote_log) {
+    fflush(log_file);
+  }
+}
+
+static void carp_writer_loop() {
+  boost::mutex::scoped_lock lock(wake_mutex);
+  while (!writer_stopping) {
+    wake_writer.timed_wait(lock, boost::posix_time::milliseconds(FLUSH_MILLIS));
+    lock.unlock();
+    write_pending_records();
+    lock.lock();
+  }
+}
+
+/**
+ * Stops the writer at exit, once everything carped has been written.
+ */
+static void stop_carp_writer() {
+  {
+    boost::mutex::scoped_lock lock(wake_mutex);
+    writer_stopping = true;
+  }
+  wake_writer.notify_one();
+  writer_thread->join();
+  writer_running = false;
+  write_pending_records();
+}
+
+static void start_carp_writer() {
+  try {
+    writer_thread = new boost::thread(carp_writer_loop);
+  } catch (const boost::thread_resource_error&) {
+    return; // write synchronously instead
+  }
+  writer_running = true;
+  atexit(stop_carp_writer);
+}
+
+static void carp_enqueue(const std::string& text, bool to_stderr, bool to_log) {
+  CarpRecord* record = new CarpRecord;
+  record->text = text;
+  record->to_stderr = to_stderr;
+  record->to_log = to_log;
+  record->next = pending_records.load(boost::memory_order_relaxed);
+  while (!pending_records.compare_exchange_weak(record->next, record,
+                                                boost::memory_order_release,
+                                                boost::memory_order_relaxed)) {
+  }
+  if (!writer_running) {
+    write_pending_records();
+  }
+}
+
 /**
  * Open log file for carp messages.
  *
@@ -38,7 +151,23 @@ void open_log_file(string log_file_name) {
   string output_dir = Params::GetString("output-dir");
   bool overwrite = Params::GetBool("overwrite");
   log_file_name = prefix_fileroot_to_name(log_file_name);
-  log_file = create_file_in_path(log_file_name, output_dir.c_str(), overwrite);
+  FILE* file = create_file_in_path(log_file_name, output_dir.c_str(), overwrite);
+  // Messages carped before now were not meant for the log
+  write_pending_records();
+  boost::mutex::scoped_lock lock(write_mutex);
+  log_file = file;
+}
+
+/**
+ * Write the pending messages to the log file, if one is open, and close it.
+ */
+void close_log_file() {
+  write_pending_records();
+  boost::mutex::scoped_lock lock(write_mutex);
+  if (log_file != NULL) {
+    fclose(log_file);
+    log_file = NULL;
+  }
 }
 
 /**
@@ -51,18 +180,13 @@ void log_command_line(int argc, char *argv[]) {
   ++argc;
   --argv;
   if (log_file != NULL) {
-    fprintf(log_file, "COMMAND LINE: ");
+    string line = "COMMAND LINE: ";
     int i = 0;
     for (i = 0; i < argc; ++i) {
-      fprintf(log_file, "%s%c", argv[i], i < (argc - 1) ? ' ' : '\n');
+      line += argv[i];
+      line += i < (argc - 1) ? ' ' : '\n';
     }
-  }
-}
-
-static void carp_print(const char *string) {
-  fprintf(stderr, "%s", string);
-  if (log_file != NULL) {
-    fprintf(log_file, "%s", string);
+    carp_enqueue(line, false, true);
   }
 }
 
@@ -79,38 +203,51 @@ static void carp_print(const char *string) {
  */
 void carp( int verbosity, const char* format, ...) {
   if (verbosity <= G_verbosity) {
-    va_list  argp;
+    boost::call_once(start_carp_writer, writer_once);
 
+    string text;
     if (verbosity == CARP_WARNING) {
-      carp_print("WARNING: ");
+      text = "WARNING: ";
     } else if (verbosity == CARP_ERROR) {
-      carp_print("ERROR: ");
+      text = "ERROR: ";
     } else if (verbosity == CARP_FATAL) {
-      carp_print("FATAL: ");
+      text = "FATAL: ";
     } else if (verbosity == CARP_INFO) {
-      carp_print("INFO: ");
+      text = "INFO: ";
     } else if (verbosity == CARP_DETAILED_INFO) {
-      carp_print("DETAILED INFO: ");
+      text = "DETAILED INFO: ";
     } else if (verbosity == CARP_DEBUG) {
-      carp_print("DEBUG: ");
+      text = "DEBUG: ";
     } else if (verbosity == CARP_DETAILED_DEBUG) {
-      carp_print("DETAILED DEBUG: ");
+      text = "DETAILED DEBUG: ";
     } else {
-      carp_print("UNKNOWN: ");
+      text = "UNKNOWN: ";
     }
 
+    char buffer[1024];
+    va_list argp;
     va_start(argp, format);
-    vfprintf(stderr, format, argp);
+    int length = vsnprintf(buffer, sizeof(buffer), format, argp);
     va_end(argp);
-    if (log_file != NULL) { 
+    if (length < 0) {
+      length = 0;
+      buffer[0] = '\0';
+    }
+    if ((size_t)length < sizeof(buffer)) {
+      text.append(buffer, length);
+    } else {
+      size_t prefix = text.size();
+      text.resize(prefix + length + 1);
       va_start(argp, format); //BF: added to fix segfault
-      vfprintf(log_file, format, argp);
+      vsnprintf(&text[prefix], length + 1, format, argp);
       va_end(argp);
+      text.resize(prefix + length);
     }
-    carp_print("\n");
-    fflush(stderr);
-    if (log_file != NULL) {
-      fflush(log_file);
+    text += '\n';
+
+    carp_enqueue(text, true, log_file != NULL);
+    if (verbosity == CARP_FATAL) {
+      write_pending_records();
     }
   } 
   if (verbosity == CARP_FATAL) {
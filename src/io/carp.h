@@ -99,6 +99,11 @@ int get_verbosity_level(void);
  */
 void open_log_file(std::string log_file_name);
 
+/**
+ * Write the pending messages to the log file, if one is open, and close it.
+ */
+void close_log_file();
+
 /**
  * Print command line to log file.
  *
@@ -14,6 +14,7 @@
 #endif
 #include "util/utils.h"
 #include "util/crux-utils.h"
+#include "util/FileUtils.h"
 #include "Peptide.h"
 #include "Protein.h"
 #include "ProteinPeptideIterator.h"
@@ -35,6 +36,16 @@ using namespace Crux;
 const string Database::binary_suffix = "-binary-fasta";
 const string Database::decoy_binary_suffix = "-binary-fasta-decoy";
 const string Database::decoy_fasta_suffix = "-random.fasta";
+const string Database::offset_index_suffix = ".offsets";
+
+// The offset index of a fasta file, in <file>.offsets, holds
+//
+//     OFFSET_INDEX_MAGIC_NUMBER, the number n of proteins (uint32s)
+//     the size and modification time of the fasta file (uint64, int64)
+//     n file offsets of the ">" of the proteins, in file order (uint64s)
+//
+// in the byte order of the machine that wrote it.
+static const unsigned int OFFSET_INDEX_MAGIC_NUMBER = 0xfead1238u;
 
 /**
  * intializes a database object
@@ -45,6 +56,7 @@ void Database::init(){
   size_ = 0; 
   use_light_protein_ = false; 
   is_memmap_ = false;
+  is_mapped_fasta_ = false;
   data_address_ = NULL;
   pointer_count_ = 1;
   file_size_ = 0;
@@ -126,8 +138,8 @@ Database::~Database() {
     delete proteins_;
     delete protein_map_; // contents already deleted
     
-    // free memory mapped binary file from memory
-    if(is_memmap_){
+    // free memory mapped binary or fasta file from memory
+    if(is_memmap_ || is_mapped_fasta_){
       // un map the memory!!
 #ifdef _MSC_VER
       stub_unmmap(&unmap_info_); 
@@ -320,20 +332,172 @@ bool Database::parseTextFasta()
 }
 
 /**
- * memory maps the binary fasta file for the database
+ * \brief Parses a database from the text fasta file in the filename
+ * member variable without reading its proteins.
+ *
+ * Memory maps the fasta file, copy-on-write, and makes each protein a view
+ * of its record, found from the offset index next to the fasta file.
+ * \returns true if success. false if the file cannot be mapped.
+ */
+bool Database::parseMappedFasta()
+{
+#ifdef _MSC_VER
+  return false;
+#else
+  carp(CARP_DEBUG, "Mapping text fasta file '%s'", fasta_filename_.c_str());
+  // check if already parsed
+  if(is_parsed_){
+    return true;
+  }
+
+  // an empty file cannot be mapped, and has no proteins to map
+  struct stat file_info;
+  if(stat(fasta_filename_.c_str(), &file_info) == -1 || file_info.st_size == 0){
+    return false;
+  }
+  int file_d = open(fasta_filename_.c_str(), O_RDONLY);
+  if(file_d == -1){
+    return false;
+  }
+  // the mapping outlives the descriptor
+  bool mapped = memoryMap(file_d, fasta_filename_, true);
+  close(file_d);
+  if(!mapped){
+    return false;
+  }
+  char* data = (char*)data_address_;
+  char* data_end = data + file_size_;
+
+  // the proteins start at the lines beginning with '>'
+  vector<unsigned long> offsets;
+  if(!readOffsetIndex(offsets)){
+    for(char* line = data; line < data_end; ){
+      if(*line == '>'){
+        offsets.push_back(line - data);
+      }
+      char* next_line = (char*)memchr(line, '\n', data_end - line);
+      if(next_line == NULL){
+        break;
+      }
+      line = next_line + 1;
+    }
+    writeOffsetIndex(offsets);
+  }
+
+  proteins_->reserve(offsets.size());
+  for(size_t protein_idx = 0; protein_idx < offsets.size(); ++protein_idx){
+    char* end = protein_idx + 1 < offsets.size() ?
+      data + offsets[protein_idx + 1] : data_end;
+    Protein* new_protein = new Protein();
+    new_protein->setMappedRecord(data + offsets[protein_idx], end);
+    new_protein->setOffset(offsets[protein_idx]);
+    // add protein to database
+    proteins_->push_back(new_protein);
+    // set protein index, database
+    new_protein->setProteinIdx(proteins_->size()-1);
+    new_protein->setDatabase(this);
+  }
+  carp(CARP_DEBUG, "Mapped %d proteins", proteins_->size());
+
+  is_mapped_fasta_ = true;
+  is_parsed_ = true;
+  return true;
+#endif
+}
+
+/**
+ * Reads the offset index of the fasta file.
+ * \returns false if there is no index, or it is of another version of
+ * the fasta file.
+ */
+bool Database::readOffsetIndex(
+  vector<unsigned long>& offsets ///< the offsets -out
+  )
+{
+  string index_name = fasta_filename_ + offset_index_suffix;
+  FILE* index_file = fopen(index_name.c_str(), "rb");
+  if(index_file == NULL){
+    return false;
+  }
+  unsigned int header[2];
+  unsigned long long size;
+  long long mtime;
+  bool ok = fread(header, sizeof(header), 1, index_file) == 1 &&
+    fread(&size, sizeof(size), 1, index_file) == 1 &&
+    fread(&mtime, sizeof(mtime), 1, index_file) == 1 &&
+    header[0] == OFFSET_INDEX_MAGIC_NUMBER &&
+    size == FileUtils::Size(fasta_filename_) &&
+    mtime == FileUtils::ModificationTime(fasta_filename_);
+  if(ok){
+    vector<unsigned long long> entries(header[1]);
+    ok = entries.empty() ||
+      fread(&entries[0], sizeof(entries[0]), entries.size(), index_file)
+        == entries.size();
+    for(size_t i = 0; ok && i < entries.size(); ++i){
+      // each offset must be the ">" of a title line, past the one before
+      ok = entries[i] < size && (i == 0 || entries[i] > entries[i - 1]) &&
+        ((char*)data_address_)[entries[i]] == '>';
+    }
+    if(ok){
+      offsets.assign(entries.begin(), entries.end());
+      carp(CARP_DEBUG, "Using fasta offset index %s", index_name.c_str());
+    }
+  }
+  fclose(index_file);
+  return ok;
+}
+
+/**
+ * Writes the offset index of the fasta file, if its directory is writable.
+ */
+void Database::writeOffsetIndex(
+  const vector<unsigned long>& offsets ///< the offsets -in
+  )
+{
+  string index_name = fasta_filename_ + offset_index_suffix;
+  // written under another name first, so that a reader never sees half of it
+  string temp_name = index_name + ".tmp";
+  FILE* index_file = fopen(temp_name.c_str(), "wb");
+  if(index_file == NULL){
+    carp(CARP_DEBUG, "Cannot write fasta offset index %s", index_name.c_str());
+    return;
+  }
+  unsigned int header[2] = { OFFSET_INDEX_MAGIC_NUMBER, (unsigned int)offsets.size() };
+  unsigned long long size = FileUtils::Size(fasta_filename_);
+  long long mtime = FileUtils::ModificationTime(fasta_filename_);
+  vector<unsigned long long> entries(offsets.begin(), offsets.end());
+  bool ok = fwrite(header, sizeof(header), 1, index_file) == 1 &&
+    fwrite(&size, sizeof(size), 1, index_file) == 1 &&
+    fwrite(&mtime, sizeof(mtime), 1, index_file) == 1 &&
+    (entries.empty() ||
+     fwrite(&entries[0], sizeof(entries[0]), entries.size(), index_file)
+       == entries.size());
+  ok = fclose(index_file) == 0 && ok;
+  if(ok){
+    FileUtils::Rename(temp_name, index_name);
+  } else {
+    carp(CARP_DEBUG, "Cannot write fasta offset index %s", index_name.c_str());
+    FileUtils::Remove(temp_name);
+  }
+}
+
+/**
+ * memory maps the (binary) fasta file for the database
  *\return true if successfully memory map binary fasta file, else false
  */
 bool Database::memoryMap(
-  int file_d  ///<  file descriptor -in
+  int file_d,  ///<  file descriptor -in
+  const string& filename, ///< the file of file_d -in
+  bool copy_on_write ///< whether to map the file writable -in
   )
 {
   struct stat file_info;
   
   // get information of the binary fasta file
-  if (stat(binary_filename_.c_str(), &file_info) == -1) {
+  if (stat(filename.c_str(), &file_info) == -1) {
     carp(CARP_ERROR,
          "Failed to retrieve information of binary fasta file: %s",
-         binary_filename_.c_str());
+         filename.c_str());
     return false;
   }
   
@@ -343,16 +507,18 @@ bool Database::memoryMap(
   
   // memory map the entire binary fasta file!
 #ifdef _MSC_VER
-  data_address_ = stub_mmap(binary_filename_.c_str(), &unmap_info_);
+  data_address_ = stub_mmap(filename.c_str(), &unmap_info_);
 
 #else
+  // private pages, so that writes to them stay out of the file
   data_address_ = mmap((caddr_t)0, file_info.st_size, 
-                       PROT_READ, MAP_PRIVATE /*MAP_SHARED*/, file_d, 0);
+                       copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_PRIVATE /*MAP_SHARED*/, file_d, 0);
 
   // check if memory mapping has succeeded
   if ((caddr_t)(data_address_) == (caddr_t)(-1)){
     carp(CARP_ERROR, "Failed to use mmap function for binary fasta file: %s", 
-         binary_filename_.c_str());
+         filename.c_str());
     return false;
   }
 #endif
@@ -441,7 +607,7 @@ bool Database::parseMemmapBinary()
   }
 
   // memory map the binary fasta file into memory
-  if(!memoryMap(file_d)){
+  if(!memoryMap(file_d, binary_filename_)){
     carp(CARP_ERROR, "Failed to memory map binary fasta file into memory");
     return false;
   }
@@ -466,8 +632,9 @@ bool Database::parseMemmapBinary()
  * IF is_memmap is true, memory maps the entire binary fasta file into memory
  * and then creates protein objects that point to the memory mapped binary file
  *
- * IF is_memmap is false, uses the traditional text fasta file which
- * it parses out the various peptides for each protein. Only when
+ * IF is_memmap is false, uses the traditional text fasta file, which is
+ * memory mapped too: the proteins are views of their records in the mapped
+ * file, parsed when first read (see parseMappedFasta()). Only when
  * using text fasta file can you use light/heavy protein, in which 
  * if using light_protein functionality will not read in the sequence
  * or id. Will parse sequence if protein  
@@ -485,7 +652,12 @@ bool Database::parse()
   if(is_memmap_){
     return parseMemmapBinary();   
   }
-  else{ // parse database from normal text fasta file, no memory mapping!
+  // parse database from normal text fasta file: as views of the mapped
+  // file, unless the light/heavy functionality reads the proteins from it
+  else if(!use_light_protein_ && parseMappedFasta()){
+    return true;
+  }
+  else{
     return parseTextFasta();
   }
   
@@ -42,6 +42,7 @@ class Database {
   unsigned long int size_; ///< The size of the database in bytes (convenience)
   bool use_light_protein_; ///< should I use the light/heavy protein option
   bool is_memmap_; ///< Are we using a memory mapped fasta file? 
+  bool is_mapped_fasta_; ///< Are the proteins views of the mapped text fasta file?
 #ifdef _MSC_VER
   SIMPLE_UNMMAP unmap_info_;
 #endif
@@ -63,11 +64,42 @@ class Database {
   bool parseTextFasta();
 
   /**
-   * memory maps the binary fasta file for the database
+   * \brief Parses a database from the text fasta file in the filename
+   * member variable without reading its proteins.
+   *
+   * Memory maps the fasta file, copy-on-write, and makes each protein a view
+   * of its record (see Protein::setMappedRecord()), found from the offset
+   * index next to the fasta file. The index is written by the first parse
+   * of the file, and rewritten when the file changes.
+   * \returns true if success. false if the file cannot be mapped.
+   */
+  bool parseMappedFasta();
+
+  /**
+   * Reads the offset index of the fasta file into offsets, the file offset
+   * of the ">" of each protein.
+   * \returns false if there is no index, or it is of another version of
+   * the fasta file.
+   */
+  bool readOffsetIndex(
+    std::vector<unsigned long>& offsets ///< the offsets -out
+    );
+
+  /**
+   * Writes the offset index of the fasta file, if its directory is writable.
+   */
+  void writeOffsetIndex(
+    const std::vector<unsigned long>& offsets ///< the offsets -in
+    );
+
+  /**
+   * memory maps the (binary) fasta file for the database
    *\return true if successfully memory map binary fasta file, else false
    */
   bool memoryMap(
-    int file_d  ///<  file descriptor -in
+    int file_d,  ///<  file descriptor -in
+    const std::string& filename, ///< the file of file_d -in
+    bool copy_on_write = false ///< whether to map the file writable -in
     );
 
   /**
@@ -99,6 +131,7 @@ class Database {
   static const std::string binary_suffix;
   static const std::string decoy_binary_suffix;
   static const std::string decoy_fasta_suffix;
+  static const std::string offset_index_suffix;
 
   /**
    * \returns An (empty) database object.
@@ -22,11 +22,59 @@
 #endif
 
 #include <stack>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 using namespace Crux;
 using namespace std;
 
 
+/**
+ * Ions are allocated in blocks of kIonBlockSize, and the free ions of the
+ * blocks are handed to the thread caches below in batches. The blocks are
+ * shared by all threads and are only released when the program exits, since
+ * an ion may be freed by another thread than the one that made it.
+ */
+static const size_t kIonBlockSize = 1024;
+
+class IonPool {
+ protected:
+  boost::mutex mutex_;
+  vector<Ion*> free_;
+ public:
+  /**
+   * Moves up to kIonBlockSize free ions onto ions, allocating a new block if
+   * there are none.
+   */
+  void take(stack<Ion*>* ions) {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (free_.empty()) {
+      Ion* block = new Ion[kIonBlockSize];
+      for (size_t idx = 0; idx < kIonBlockSize; idx++) {
+        free_.push_back(block + idx);
+      }
+    }
+    for (size_t idx = 0; idx < kIonBlockSize && !free_.empty(); idx++) {
+      ions->push(free_.back());
+      free_.pop_back();
+    }
+  }
+
+  /**
+   * Moves all of ions back to the pool.
+   */
+  void give(stack<Ion*>* ions) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!ions->empty()) {
+      free_.push_back(ions->top());
+      ions->pop();
+    }
+  }
+};
+
+static IonPool* ion_pool_ = new IonPool();
+
 class IonCache {
  protected:
   stack<Ion*> cache_;
@@ -43,11 +91,7 @@ class IonCache {
   }
 
   ~IonCache() {
-    while(!cache_.empty()) {
-      Ion* ion = cache_.top();
-      cache_.pop();
-      delete ion;
-    }
+    ion_pool_->give(&cache_);
     #ifdef DEBUG
     carp(CARP_INFO, "Ion cache check in: %d check out:%d", ncheckin, ncheckout);
     #endif
@@ -58,12 +102,11 @@ class IonCache {
     ncheckout++;
     #endif
     if (cache_.empty()) {
-      return (new Ion());
-    } else {
-      Ion* ion = cache_.top();
-      cache_.pop();
-      return(ion);
+      ion_pool_->take(&cache_);
     }
+    Ion* ion = cache_.top();
+    cache_.pop();
+    return(ion);
   }
   void checkin(Ion* ion) {
     #ifdef DEBUG
@@ -74,7 +117,15 @@ class IonCache {
 };
 
 
-IonCache ion_cache_;
+// One cache per thread, so that threads can make and free ions at once
+static boost::thread_specific_ptr<IonCache> ion_cache_;
+
+static IonCache& localIonCache() {
+  if (ion_cache_.get() == NULL) {
+    ion_cache_.reset(new IonCache());
+  }
+  return *ion_cache_;
+}
 
 
 // At one point I need to reverse the endianness for pfile_create to work
@@ -302,12 +353,12 @@ void Ion::freeIon(
   ion->pointer_count_--;
 
   if (ion->pointer_count_ <= 0) {
-    ion_cache_.checkin(ion);//delete ion;
+    localIonCache().checkin(ion);//delete ion;
   }
 }
 
 Ion* Ion::newIon() {
-  Ion* ion = ion_cache_.checkout();
+  Ion* ion = localIonCache().checkout();
   ion->init();
   return(ion);
 }
@@ -23,6 +23,8 @@
 #include "Spectrum.h"
 
 #include <stack>
+#include <vector>
+#include <boost/thread/tss.hpp>
 
 using namespace Crux;
 
@@ -30,7 +32,8 @@ static const int BINARY_GMTK = 1;
 static const int PRINT_NULL_IONS = 1;
 static const int MIN_FRAMES = 3;
 
-FLOAT_T* IonSeries::mass_matrix_ = NULL;
+/// Pre-allocated mass matrix, one per thread
+static boost::thread_specific_ptr<std::vector<FLOAT_T> > mass_matrix_;
 
 
 /**
@@ -80,7 +83,15 @@ class LossLimitCache {
 
 };
 
-static LossLimitCache loss_limit_cache;
+// One cache per thread, so that threads can make and free ion series at once
+static boost::thread_specific_ptr<LossLimitCache> loss_limit_caches;
+
+static LossLimitCache& localLossLimitCache() {
+  if (loss_limit_caches.get() == NULL) {
+    loss_limit_caches.reset(new LossLimitCache());
+  }
+  return *loss_limit_caches;
+}
 
 
 
@@ -138,7 +149,7 @@ IonSeries::IonSeries(
   peptide_length_ = peptide_.length();
   
   // create the loss limit array
-  loss_limit_ = loss_limit_cache.checkout();
+  loss_limit_ = localLossLimitCache().checkout();
   //loss_limit_ = new LOSS_LIMIT_T[GlobalParams::getMaxLength()];
   memset(loss_limit_, 0, sizeof(LOSS_LIMIT_T) * peptide_length_);
 }
@@ -157,7 +168,7 @@ IonSeries::IonSeries(
   init();
   constraint_ = constraint;
   charge_ = charge;
-  loss_limit_ = loss_limit_cache.checkout();
+  loss_limit_ = localLossLimitCache().checkout();
   //loss_limit_ = new LOSS_LIMIT_T[GlobalParams::getMaxLength()];
 }
 
@@ -245,7 +256,7 @@ IonSeries::~IonSeries()
     freeModSeq(modified_aa_seq_);
   }
   if(loss_limit_){
-    loss_limit_cache.checkin(loss_limit_);
+    localLossLimitCache().checkin(loss_limit_);
   }
   // free constraint?
 
@@ -259,7 +270,7 @@ IonSeries::~IonSeries()
 }
 
 void IonSeries::finalize() {
-  delete []mass_matrix_;
+  mass_matrix_.reset();
 
 }
 
@@ -449,12 +460,13 @@ FLOAT_T* IonSeries::createIonMassMatrix(
     return NULL;
   }
 
-  if (mass_matrix_ == NULL) {
-    //Allocate the static mass_matrix_
-    mass_matrix_ = new FLOAT_T[sizeof(FLOAT_T)*(GlobalParams::getMaxLength()+1)];
+  if (mass_matrix_.get() == NULL) {
+    //Allocate this thread's mass_matrix_
+    mass_matrix_.reset(
+      new std::vector<FLOAT_T>(sizeof(FLOAT_T)*(GlobalParams::getMaxLength()+1)));
   }
 
-  FLOAT_T* mass_matrix = mass_matrix_;
+  FLOAT_T* mass_matrix = &(*mass_matrix_)[0];
   
   // at index 0, the length of the peptide is stored
   mass_matrix[0] = peptide_length;
@@ -54,6 +54,8 @@ void Match::init() {
   null_peptide_ = false;
   peptide_sequence_ = NULL;
   mod_sequence_ = NULL;
+  output_mod_sequence_ = NULL;
+  output_flanking_aas_ = NULL;
   post_process_match_ = 0;
   ln_experiment_size_ = 0;
   num_target_matches_ = 0;
@@ -122,6 +124,8 @@ Match::~Match() {
   if (mod_sequence_ != NULL){
     free(mod_sequence_);
   }
+  free(output_mod_sequence_);
+  free(output_flanking_aas_);
 }
 
 bool Match::ScoreComparer::operator() (const Match* x, const Match* y) {
@@ -181,14 +185,14 @@ void Match::printSqt(
   FLOAT_T score_main = getScore(XCORR);
 
   // write format string with variable precision
-  int precision = Params::GetInt("precision");
+  int precision = GlobalParams::getPrecision();
 
   // print match info
   if (exact_pval_search_) {
     fprintf(file, "M\t%i\t%i\t%.*f\t%.2f\t%.*g\t%.*g\t%.*g\t%i\t%i\t%s\tU\n",
             getRank(XCORR),
             getRank(SP),
-            Params::GetInt("mass-precision"),
+            GlobalParams::getMassPrecision(),
             peptide->calcModifiedMass() + MASS_PROTON,
             delta_cn,
             precision,
@@ -205,7 +209,7 @@ void Match::printSqt(
     fprintf(file, "M\t%i\t%i\t%.*f\t%.2f\t%.*g\t%.*g\t%i\t%i\t%s\tU\n",
             getRank(XCORR),
             getRank(SP),
-            Params::GetInt("mass-precision"),
+            GlobalParams::getMassPrecision(),
             peptide->calcModifiedMass() + MASS_PROTON,
             delta_cn,
             precision,
@@ -235,7 +239,7 @@ void Match::printSqt(
     Database* database = protein->getDatabase();
     if( null_peptide_ 
         && (database != NULL && database->getDecoyType() == NO_DECOYS) ){
-      rand = Params::GetString("decoy-prefix"); 
+      rand = GlobalParams::getDecoyPrefix(); 
     }
 
     // print match info (locus line), add "decoy-prefix" to locus name for decoys
@@ -327,7 +331,7 @@ void Match::printOneMatchField(
     break;
   case XCORR_RANK_COL:
     output_file->setColumnCurrentRow((MATCH_COLUMNS_T)column_idx, 
-      getRank(!Params::GetBool("exact-p-value") ? XCORR : TIDE_SEARCH_EXACT_PVAL));
+      getRank(!GlobalParams::getExactPValue() ? XCORR : TIDE_SEARCH_EXACT_PVAL));
     break;
   case EVALUE_COL:
     output_file->setColumnCurrentRow((MATCH_COLUMNS_T)column_idx,
@@ -475,10 +479,8 @@ void Match::printOneMatchField(
   case SEQUENCE_COL:
     {
       // this should get the sequence from the match, not the peptide
-      char* sequence = getModSequenceStrWithMasses(
-                get_mass_format_type_parameter("mod-mass-format"));
-      output_file->setColumnCurrentRow((MATCH_COLUMNS_T)column_idx, sequence);
-      free(sequence);
+      output_file->setColumnCurrentRow((MATCH_COLUMNS_T)column_idx,
+                                       getOutputModSequence());
     }
     break;
   case MODIFICATIONS_COL:
@@ -510,11 +512,8 @@ void Match::printOneMatchField(
     break;
   case FLANKING_AA_COL:
     {
-      Peptide* peptide = getPeptide();
-      char* flanking_aas = peptide->getFlankingAAs();
       output_file->setColumnCurrentRow((MATCH_COLUMNS_T)column_idx, 
-                                       flanking_aas);
-      free(flanking_aas);
+                                       getOutputFlankingAAs());
     }
     break;
   case TARGET_DECOY_COL:
@@ -527,7 +526,7 @@ void Match::printOneMatchField(
     }      
     break;
   case ORIGINAL_TARGET_SEQUENCE_COL:
-    if (null_peptide_ || Params::GetBool("concat")) {
+    if (null_peptide_ || GlobalParams::getConcat()) {
       output_file->setColumnCurrentRow((MATCH_COLUMNS_T)column_idx,
                                        peptide_->getUnshuffledSequence());
     }
@@ -651,16 +650,10 @@ char* Match::getSequence() {
  */
 char* Match::getSequenceSqt(){
 
-  // get_match_mod_sequence (use method in case match->mod_seq == NULL) 
-  MODIFIED_AA_T* mod_seq = getModSequence();
-  if( mod_seq == NULL ){
+  const char* seq = getOutputModSequence();
+  if( seq == NULL ){
     return NULL;
   }
-  int length = getPeptide()->getLength();
-
-  // turn it into string
-  char* seq = modified_aa_string_to_string_with_masses(mod_seq, length,
-                get_mass_format_type_parameter("mod-mass-format"));
 
   // get peptide flanking residues 
   char c_term = peptide_->getCTermFlankingAA();
@@ -679,9 +672,6 @@ char* Match::getSequenceSqt(){
 
   carp(CARP_DETAILED_DEBUG, "start string %s, final %s", seq, final_string);
 
-  // delete mod seq and string version
-  free(seq);
-  free(mod_seq);
   return final_string;
 }
 
@@ -756,6 +746,21 @@ char* Match::getModSequenceStrWithMasses(
                                                   peptide_->getLength(),
                                                   mass_format);
 }
+
+const char* Match::getOutputModSequence() {
+  if (output_mod_sequence_ == NULL) {
+    output_mod_sequence_ = getModSequenceStrWithMasses(
+      get_mass_format_type_parameter("mod-mass-format"));
+  }
+  return output_mod_sequence_;
+}
+
+const char* Match::getOutputFlankingAAs() {
+  if (output_flanking_aas_ == NULL) {
+    output_flanking_aas_ = getPeptide()->getFlankingAAs();
+  }
+  return output_flanking_aas_;
+}
 /**
  * Must ask for score that has been computed
  *\returns the match_mode score in the match object
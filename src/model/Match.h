@@ -77,6 +77,8 @@ class Match {
   bool null_peptide_; ///< Is the match a null (decoy) peptide match?
   const char* peptide_sequence_; ///< peptide sequence is that of peptide or shuffled
   MODIFIED_AA_T* mod_sequence_; ///< seq of peptide or shuffled if null peptide
+  char* output_mod_sequence_; ///< see getOutputModSequence()
+  char* output_flanking_aas_; ///< see getOutputFlankingAAs()
   SpectrumZState zstate_;
   // post_process match object features
   // only valid when post_process_match is true
@@ -230,6 +232,20 @@ class Match {
    MASS_FORMAT_T mass_format
     );
 
+  /**
+   * \brief The sequence with modification masses in the mod-mass-format,
+   * as every output file writes it.  Computed on the first call and kept,
+   * so that a match written to several formats formats it once.
+   * \returns The sequence, or NULL if no sequence is avaliable.
+   */
+  const char* getOutputModSequence();
+
+  /**
+   * \brief The flanking amino acids of the peptide, as
+   * Peptide::getFlankingAAs() gives them; kept like getOutputModSequence().
+   */
+  const char* getOutputFlankingAAs();
+
   /**
    * Must ask for score that has been computed
    *\returns the match_mode score in the match object
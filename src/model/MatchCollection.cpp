@@ -16,6 +16,8 @@
 #include "util/AminoAcidUtil.h"
 #include "util/Params.h"
 #include "util/GlobalParams.h"
+#include "util/MemoryAccounting.h"
+#include "util/ParallelSort.h"
 #include "util/StringUtils.h"
 #include "util/WinCrux.h"
 
@@ -57,6 +59,14 @@ void MatchCollection::init() {
   top_scoring_sp_ = NULL;
   exact_pval_search_ = false;
   has_distinct_matches_ = false;
+  accountMemory();
+}
+
+void MatchCollection::accountMemory() {
+  long long bytes = match_.capacity() * sizeof(Crux::Match*) +
+    xcorrs_.capacity() * sizeof(FLOAT_T) + match_.size() * sizeof(Crux::Match);
+  MemoryAccounting::Add(MEMORY_MATCHES, bytes - accounted_bytes_);
+  accounted_bytes_ = bytes;
 }
 
 /**
@@ -73,6 +83,7 @@ MatchCollection::~MatchCollection() {
   if(top_scoring_sp_){
     Match::freeMatch(top_scoring_sp_);
   }
+  MemoryAccounting::Add(MEMORY_MATCHES, -accounted_bytes_);
 }
 
 /**
@@ -86,7 +97,7 @@ MatchCollection::~MatchCollection() {
  */
 MatchCollection::MatchCollection(
   bool is_decoy
-  ){
+  ) : accounted_bytes_(0) {
   init();
   null_peptide_collection_ = is_decoy;
 }
@@ -924,10 +935,9 @@ bool MatchCollection::printXml(
     // or if we are at the limit but this match is a tie with the last
     if (count < top_match || last_rank == cur_rank) {
       char* peptide_sequence = match->getSequence();
-      char* mod_peptide_sequence = match->getModSequenceStrWithMasses(
-                            get_mass_format_type_parameter("mod-mass-format"));
+      const char* mod_peptide_sequence = match->getOutputModSequence();
       Peptide* peptide = match->getPeptide();
-      char* flanking_aas = peptide->getFlankingAAs();
+      const char* flanking_aas = match->getOutputFlankingAAs();
       int num_proteins = peptide->getProteinInfo(protein_ids, 
                                                  protein_descriptions);
       for(int score_idx=0; score_idx < NUMBER_SCORER_TYPES; score_idx++){
@@ -954,8 +964,6 @@ bool MatchCollection::printXml(
       count++;
       last_rank = cur_rank;
       free(peptide_sequence);
-      free(mod_peptide_sequence);
-      free(flanking_aas);
     } else if( count >= top_match && last_rank != cur_rank ) {
       break;
     } // else see if there is one more tie to print
@@ -1178,6 +1186,7 @@ bool MatchCollection::addMatch(
   // add a new match to array
   match_.push_back(match);
   match->incrementPointerCount();
+  accountMemory();
   
   return true;
 }
@@ -1207,6 +1216,7 @@ bool MatchCollection::addMatchToPostMatchCollection(
   // add a new match to array
   match_.push_back(match);
   match->incrementPointerCount();
+  accountMemory();
   
   // DEBUG, print total peptided scored so far
   if(match_.size() % 1000 == 0){
@@ -1351,43 +1361,73 @@ vector<FLOAT_T> MatchCollection::extractScores(
 }
 
 /**
- * Given a hash table that maps from a score to its q-value, assign
- * q-values to all of the matches in a given collection.
+ * Orders (score, match) pairs by score alone.
+ */
+class ScoredMatchLess {
+ public:
+  bool operator()(const pair<FLOAT_T, Match*>& x,
+                  const pair<FLOAT_T, Match*>& y) const {
+    return x.first < y.first;
+  }
+};
+
+/**
+ * Given a list of scores and their q-values, assign q-values to all of
+ * the matches in a given collection. A match gets the q-value of the last
+ * entry in the list with its score. Both the list and the matches are
+ * sorted by score, so that one pass over each assigns all the q-values.
  */
 void MatchCollection::assignQValues(
-  const map<FLOAT_T, FLOAT_T>* score_to_qvalue_hash,
+  const vector<FLOAT_T>& scores,
+  const vector<FLOAT_T>& qvalues,
   SCORER_TYPE_T score_type,
   SCORER_TYPE_T derived_score_type
 ){
+  // (score, index in the list), sorted so that equal scores end with the
+  // last of them in the list
+  vector<pair<FLOAT_T, size_t> > score_index;
+  score_index.reserve(scores.size());
+  for (size_t i = 0; i < scores.size(); i++) {
+    if (!isinf(scores[i]) && !isnan(scores[i])) {
+      score_index.push_back(make_pair(scores[i], i));
+    }
+  }
+  ParallelSort::Sort(score_index.begin(), score_index.end(),
+                     less< pair<FLOAT_T, size_t> >());
 
-  // Iterate over the matches filling in the q-values
-  MatchIterator* match_iterator = 
-    new MatchIterator(this, score_type, false);
-
-  while(match_iterator->hasNext()){
-    Match* match = match_iterator->next();
-    FLOAT_T score = match->getScore(score_type);
-
-    FLOAT_T qvalue;
+  vector<pair<FLOAT_T, Match*> > sorted_matches;
+  sorted_matches.reserve(match_.size());
+  for (vector<Match*>::iterator i = match_.begin(); i != match_.end(); ++i) {
+    FLOAT_T score = (*i)->getScore(score_type);
     // If the score is not a number, punt.
-    if ( isinf(score) || isnan(score) ) {
+    if (isinf(score) || isnan(score)) {
       carp(CARP_DEBUG, "Found inf or nan score.");
-      qvalue = numeric_limits<double>::quiet_NaN();
+      (*i)->setScore(derived_score_type, numeric_limits<double>::quiet_NaN());
     } else {
-      // Retrieve the corresponding q-value.
-      map<FLOAT_T, FLOAT_T>::const_iterator map_position 
-	= score_to_qvalue_hash->find(score);
-      if (map_position == score_to_qvalue_hash->end()) {
-	carp(CARP_FATAL,
-	     "Cannot find q-value corresponding to score of %g.",
-	     score);
-      }
-      qvalue = map_position->second;
+      sorted_matches.push_back(make_pair(score, *i));
     }
-    match->setScore(derived_score_type, qvalue);
+  }
+  ParallelSort::Sort(sorted_matches.begin(), sorted_matches.end(), ScoredMatchLess());
+
+  size_t idx = 0;
+  for (vector<pair<FLOAT_T, Match*> >::const_iterator i = sorted_matches.begin();
+       i != sorted_matches.end();
+       ++i) {
+    FLOAT_T score = i->first;
+    while (idx < score_index.size() && score_index[idx].first < score) {
+      ++idx;
+    }
+    if (idx == score_index.size() || score_index[idx].first != score) {
+      carp(CARP_FATAL,
+           "Cannot find q-value corresponding to score of %g.",
+           score);
+    }
+    while (idx + 1 < score_index.size() && score_index[idx + 1].first == score) {
+      ++idx;
+    }
+    i->second->setScore(derived_score_type, qvalues[score_index[idx].second]);
   }
   scored_type_[derived_score_type] = true;
-  delete match_iterator;
 }
 
 /*
@@ -75,12 +75,20 @@ class MatchCollection {
   bool post_process_collection_; 
   ///< Is this a post process match_collection?
   Crux::Match* top_scoring_sp_; ///< the match with Sp rank == 1
+  long long accounted_bytes_; ///< counted in MemoryAccounting
 
   /**
    * initializes a MatchCollection object
    */
   void init();
 
+  /**
+   * Brings the collection's count in MemoryAccounting up to date: the
+   * arrays as reserved, and the matches as if no other collection shared
+   * them.
+   */
+  void accountMemory();
+
 
  public:
   bool exact_pval_search_;
@@ -361,11 +369,13 @@ class MatchCollection {
   );
 
   /**
-   * Given a hash table that maps from a score to its q-value, assign
-   * q-values to all of the matches in a given collection.
+   * Given a list of scores and their q-values, assign q-values to all of
+   * the matches in a given collection. A match gets the q-value of the last
+   * entry in the list with its score.
    */
   void assignQValues(
-    const map<FLOAT_T, FLOAT_T>* score_to_qvalue_hash,
+    const std::vector<FLOAT_T>& scores,
+    const std::vector<FLOAT_T>& qvalues,
     SCORER_TYPE_T score_type,
     SCORER_TYPE_T derived_score_type
     );
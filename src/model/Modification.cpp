@@ -276,13 +276,17 @@ const ModificationDefinition* ModificationDefinition::Find(char symbol) {
 
 const ModificationDefinition* ModificationDefinition::Find(
   double deltaMass, bool isStatic, ModPosition position) {
-  set<ModificationDefinition*> staticMods = modContainer_.StaticMods();
+  set<ModificationDefinition*> staticMods;
+  if (isStatic) {
+    staticMods = modContainer_.StaticMods();
+  }
   set<ModificationDefinition*>* mods = isStatic ? &staticMods : &modContainer_.varMods_;
+  int precision = Params::GetInt("mod-precision");
   for (set<ModificationDefinition*>::const_iterator i = mods->begin();
        i != mods->end();
        i++) {
     if ((position == UNKNOWN || position == (*i)->Position()) &&
-        MathUtil::AlmostEqual((*i)->deltaMass_, deltaMass, Params::GetInt("mod-precision"))) {
+        MathUtil::AlmostEqual((*i)->deltaMass_, deltaMass, precision)) {
       return *i;
     }
   }
@@ -587,6 +591,28 @@ MODIFIED_AA_T* Modification::ToSeq(const string& seq, const vector<Modification>
   return modSeq;
 }
 
+void Modification::AppendStaticMods(const string& seq, vector<Modification>* outMods) {
+  const map< char, set<ModificationDefinition*> >& staticMods = modContainer_.staticMods_;
+  if (staticMods.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < seq.length(); i++) {
+    map< char, set<ModificationDefinition*> >::const_iterator mods = staticMods.find(seq[i]);
+    if (mods == staticMods.end()) {
+      continue;
+    }
+    for (set<ModificationDefinition*>::const_iterator j = mods->second.begin();
+         j != mods->second.end();
+         j++) {
+      if ((*j)->Position() == ANY ||
+          ((*j)->Position() == PEPTIDE_N && i == 0) ||
+          ((*j)->Position() == PEPTIDE_C && i == seq.length() - 1)) {
+        outMods->push_back(Modification(*j, (unsigned char)i));
+      }
+    }
+  }
+}
+
 bool Modification::SortFunction(const Modification& x, const Modification& y) {
   return x.mod_ != y.mod_ ? x.mod_ < y.mod_ : x.index_ < y.index_;
 }
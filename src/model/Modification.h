@@ -109,6 +109,9 @@ public:
   static void FromSeq(MODIFIED_AA_T* seq, int length,
                       std::string* outSeq, std::vector<Modification>* outMods);
   static MODIFIED_AA_T* ToSeq(const std::string& seq, const std::vector<Modification>& mods);
+  // Appends the static mods that apply to each residue of seq, without
+  // copying the definitions of each residue as StaticMods() does.
+  static void AppendStaticMods(const std::string& seq, std::vector<Modification>* outMods);
 
   static bool SortFunction(const Modification& x, const Modification& y);
 protected:
@@ -120,6 +123,7 @@ protected:
 class ModificationDefinitionContainer {
 public:
   friend class ModificationDefinition;
+  friend class Crux::Modification;
 
   ModificationDefinitionContainer();
   virtual ~ModificationDefinitionContainer();
@@ -7,9 +7,10 @@
 #include "PostProcessProtein.h"
 #include <string.h>
 
-#include <numeric>
+#include <algorithm>
 #include <set>
 #include <vector>
+#include <boost/thread/mutex.hpp>
 #include "io/MatchFileReader.h"
 #include "util/AminoAcidUtil.h"
 #include "util/GlobalParams.h"
@@ -37,15 +38,18 @@ struct residue_iterator {
  * \returns An (empty) peptide object.
  */
 Peptide::Peptide() : length_(0), decoy_modified_seq_(NULL) {
+  clearCachedFields();
 }
 
 Peptide::Peptide(string sequence)
   : sequence_(sequence), length_(sequence.length()), decoy_modified_seq_(NULL) {
+  clearCachedFields();
 }
 
-Peptide::Peptide(string sequence, vector<Modification> mods)
+Peptide::Peptide(const string& sequence, const vector<Modification>& mods)
   : sequence_(sequence), varMods_(mods), length_(sequence.length()),
     decoy_modified_seq_(NULL) {
+  clearCachedFields();
 }
 
 // FIXME association part might be need to change
@@ -58,6 +62,7 @@ Peptide::Peptide(
   int start_idx ///< the start index of this peptide in the protein sequence -in
   )
   : length_(length), decoy_modified_seq_(NULL) {
+  clearCachedFields();
   // FIXME: find the level of digest for this specific protein
   peptide_srcs_.push_back(new PeptideSrc(NON_SPECIFIC_DIGEST, parent_protein, start_idx));
 }
@@ -70,6 +75,7 @@ Peptide::Peptide(
 Peptide::Peptide(
   Peptide* src ///< source peptide -in
 ) {
+  clearCachedFields();
   if (!src) {
     carp(CARP_ERROR, "Cannot copy null peptide!");
   } else {
@@ -115,6 +121,32 @@ bool Peptide::mergePeptidesCopySrc(
   return true;
 }
 
+// Search threads may ask for the sequences of peptides they share. The locks
+// only guard the cached strings, which are built outside them, and each
+// peptide hashes to one of several, so that threads asking for their own
+// peptides seldom wait on each other.
+static const size_t NUM_CACHED_STRINGS_MUTEXES = 64;
+static boost::mutex cached_strings_mutexes_[NUM_CACHED_STRINGS_MUTEXES];
+
+static boost::mutex& cachedStringsMutex(const Peptide* peptide) {
+  return cached_strings_mutexes_[
+    (reinterpret_cast<size_t>(peptide) / sizeof(Peptide)) % NUM_CACHED_STRINGS_MUTEXES];
+}
+
+/**
+ * Forgets the cached masses and modified sequences, after the sequence,
+ * sources or modifications change.
+ */
+void Peptide::clearCachedFields() {
+  for (int mass_type = 0; mass_type < NUMBER_MASS_TYPES; mass_type++) {
+    mass_cache_[mass_type] = NAN;
+  }
+  masses_string_cached_ = false;
+  masses_string_.clear();
+  symbols_string_cached_ = false;
+  symbols_string_.clear();
+}
+
 /**
  * Frees an allocated peptide object.
  * Depending on peptide_src implementation determines how to free srcs
@@ -145,6 +177,7 @@ void Peptide::setPeptideSrc(
   ) {
   assert(peptide_srcs_.empty());
   peptide_srcs_.push_back(new_association);
+  clearCachedFields();
 }
 
 /**
@@ -157,6 +190,9 @@ void Peptide::addPeptideSrc(
   PeptideSrc* new_association ///< new peptide_src -in
   ) {
   peptide_srcs_.push_back(new_association);
+  if (peptide_srcs_.size() == 1) {
+    clearCachedFields();
+  }
 }
 
 // TODO: why do we need both of these?
@@ -218,6 +254,7 @@ void Peptide::setLength(
   unsigned char length  ///< the length of sequence -in
   ) {
   length_ = length;
+  clearCachedFields();
 }
 
 /* sequence-related getters and setters */
@@ -394,9 +431,11 @@ char Peptide::getCTermFlankingAA() {
 
 void Peptide::addMod(const ModificationDefinition* mod, unsigned char index) {
   varMods_.push_back(Modification(mod, index));
+  clearCachedFields();
 }
 
 void Peptide::setMods(const vector<Modification>& mods) {
+  clearCachedFields();
   varMods_.clear();
   for (vector<Modification>::const_iterator i = mods.begin(); i != mods.end(); i++) {
     if (!i->Static()) {
@@ -407,8 +446,7 @@ void Peptide::setMods(const vector<Modification>& mods) {
 
 vector<Modification> Peptide::getMods() const {
   vector<Modification> mods = varMods_;
-  vector<Modification> staticMods = getStaticMods();
-  mods.insert(mods.end(), staticMods.begin(), staticMods.end());
+  appendStaticMods(&mods);
   return mods;
 }
 
@@ -417,25 +455,23 @@ vector<Modification> Peptide::getVarMods() const {
 }
 
 vector<Modification> Peptide::getStaticMods() const {
-  char* seq = getSequence();
   vector<Modification> mods;
-  for (unsigned char i = 0; seq[i] != '\0'; i++) {
-    const set<const ModificationDefinition*>& staticMods =
-      ModificationDefinition::StaticMods(seq[i]);
-    for (set<const ModificationDefinition*>::const_iterator j = staticMods.begin();
-         j != staticMods.end();
-         j++) {
-      if ((*j)->Position() == ANY ||
-          ((*j)->Position() == PEPTIDE_N && i == 0) ||
-          ((*j)->Position() == PEPTIDE_C && seq[i + 1] == '\0')) {
-        mods.push_back(Modification(*j, (unsigned char)i));
-      }
-    }
-  }
-  free(seq);
+  appendStaticMods(&mods);
   return mods;
 }
 
+void Peptide::appendStaticMods(vector<Modification>* mods) const {
+  if (!sequence_.empty()) {
+    Modification::AppendStaticMods(sequence_, mods);
+    return;
+  }
+  char* seq = getSequence();
+  if (seq != NULL) {
+    Modification::AppendStaticMods(seq, mods);
+    free(seq);
+  }
+}
+
 bool Peptide::hasMonoLink() const {
   for (vector<Modification>::const_iterator iter = varMods_.begin(); iter != varMods_.end(); iter++) {
     if (iter->MonoLink()) {
@@ -466,18 +502,26 @@ void Peptide::setMod(
   for (vector<Modification>::const_iterator i = newMods.begin(); i != newMods.end(); i++) {
     varMods_.push_back(*i);
   }
+  clearCachedFields();
 }
 
 string Peptide::getModsString() const {
-  vector<string> allMods;
-  vector<Modification> staticMods = getStaticMods();
+  vector<Modification> staticMods;
+  appendStaticMods(&staticMods);
+  string modsString;
   for (vector<Modification>::const_iterator i = staticMods.begin(); i != staticMods.end(); i++) {
-    allMods.push_back(i->String());
+    if (!modsString.empty()) {
+      modsString += ',';
+    }
+    modsString += i->String();
   }
   for (vector<Modification>::const_iterator i = varMods_.begin(); i != varMods_.end(); i++) {
-    allMods.push_back(i->String());
+    if (!modsString.empty()) {
+      modsString += ',';
+    }
+    modsString += i->String();
   }
-  return StringUtils::Join(allMods, ',');
+  return modsString;
 }
 
 bool Peptide::isModified() {
@@ -546,7 +590,7 @@ string Peptide::unmodifySequence(const string& seq) {
 
 void Peptide::setUnmodifiedSequence(const string& sequence) {
   sequence_ = sequence;
-  setLength(sequence.length());
+  setLength(sequence.length()); // clears the cached fields
 }
 
 /**
@@ -557,6 +601,7 @@ void Peptide::setModifiedAASequence(
   bool decoy ///< is the peptide a decoy?
 ) {
   Modification::FromSeq(mod_seq, length_, &sequence_, &varMods_);
+  clearCachedFields();
   if (decoy) {
     if (decoy_modified_seq_) {
       std::free(decoy_modified_seq_);
@@ -567,6 +612,7 @@ void Peptide::setModifiedAASequence(
 
 void Peptide::setDecoyModifiedSeq(MODIFIED_AA_T* decoy_modified_seq) {
   decoy_modified_seq_ = decoy_modified_seq;
+  clearCachedFields();
 }
 
 /**
@@ -577,6 +623,25 @@ void Peptide::setDecoyModifiedSeq(MODIFIED_AA_T* decoy_modified_seq) {
  * \returns The peptide sequence including any modifications.
  */
 string Peptide::getModifiedSequenceWithSymbols() {
+  {
+    boost::mutex::scoped_lock lock(cachedStringsMutex(this));
+    if (symbols_string_cached_) {
+      return symbols_string_;
+    }
+  }
+  string symbols = makeModifiedSequenceWithSymbols();
+  boost::mutex::scoped_lock lock(cachedStringsMutex(this));
+  if (!symbols_string_cached_) {
+    symbols_string_ = symbols;
+    symbols_string_cached_ = true;
+  }
+  return symbols;
+}
+
+/**
+ * \returns The sequence getModifiedSequenceWithSymbols() caches.
+ */
+string Peptide::makeModifiedSequenceWithSymbols() {
   if (decoy_modified_seq_) {
     char* seqTmp = 
       modified_aa_string_to_string_with_symbols(decoy_modified_seq_, length_);
@@ -618,6 +683,29 @@ string Peptide::getModifiedSequenceWithSymbols() {
  * \returns The peptide sequence including any modifications.
  */
 string Peptide::getModifiedSequenceWithMasses() {
+  {
+    boost::mutex::scoped_lock lock(cachedStringsMutex(this));
+    if (masses_string_cached_) {
+      return masses_string_;
+    }
+  }
+  string masses = makeModifiedSequenceWithMasses();
+  boost::mutex::scoped_lock lock(cachedStringsMutex(this));
+  if (!masses_string_cached_) {
+    masses_string_ = masses;
+    masses_string_cached_ = true;
+  }
+  return masses;
+}
+
+static bool compareModIndex(const pair<int, double>& x, const pair<int, double>& y) {
+  return x.first < y.first;
+}
+
+/**
+ * \returns The sequence getModifiedSequenceWithMasses() caches.
+ */
+string Peptide::makeModifiedSequenceWithMasses() {
   if (decoy_modified_seq_) {
     char* seqTmp = modified_aa_string_to_string_with_masses(
       decoy_modified_seq_, length_, GlobalParams::getModMassFormat());
@@ -629,43 +717,55 @@ string Peptide::getModifiedSequenceWithMasses() {
   char* seqC = getSequence();
   string seq(seqC);
   free(seqC);
-  map< int, vector<double> > masses;
+  // (index, delta) of each mod, by index and then in the order they were added
+  vector< pair<int, double> > masses;
+  masses.reserve(varMods_.size());
   for (vector<Modification>::const_iterator i = varMods_.begin(); i != varMods_.end(); i++) {
-    map< int, vector<double> >::const_iterator j = masses.find(i->Index());
-    if (j == masses.end()) {
-      masses[i->Index()] = vector<double>(1, i->DeltaMass());
-    } else {
-      masses[i->Index()].push_back(i->DeltaMass());
-    }
+    masses.push_back(make_pair((int)i->Index(), i->DeltaMass()));
   }
+  stable_sort(masses.begin(), masses.end(), compareModIndex);
   int precision = GlobalParams::getModPrecision();
   MASS_TYPE_T massType = GlobalParams::getIsotopicMass();
-  for (map< int, vector<double> >::const_reverse_iterator i = masses.rbegin();
-       i != masses.rend();
-       i++) {
+  // Insert from the last residue, so that earlier indices stay valid
+  vector< pair<int, double> >::const_iterator end = masses.end();
+  while (end != masses.begin()) {
+    vector< pair<int, double> >::const_iterator begin = end - 1;
+    while (begin != masses.begin() && (begin - 1)->first == end[-1].first) {
+      --begin;
+    }
+    int index = begin->first;
     char buffer[64];
     switch (GlobalParams::getModMassFormat()) {
       case MOD_MASS_ONLY: {
-        double sum = accumulate(i->second.begin(), i->second.end(), 0.0);
+        double sum = 0.0;
+        for (vector< pair<int, double> >::const_iterator j = begin; j != end; j++) {
+          sum += j->second;
+        }
         sprintf(buffer, "[%.*f]", precision, sum);
         break;
       }
       case AA_PLUS_MOD: {
-        double sum = accumulate(i->second.begin(), i->second.end(),
-                                get_mass_amino_acid(seq[i->first], massType));
+        double sum = get_mass_amino_acid(seq[index], massType);
+        for (vector< pair<int, double> >::const_iterator j = begin; j != end; j++) {
+          sum += j->second;
+        }
         sprintf(buffer, "[%.*f]", precision, sum);
         break;
       }
       case MOD_MASSES_SEPARATE: {
-        vector<string> massStrings;
-        for (vector<double>::const_iterator j = i->second.begin(); j != i->second.end(); j++) {
-          massStrings.push_back(StringUtils::ToString(*j, precision));
+        string massStrings;
+        for (vector< pair<int, double> >::const_iterator j = begin; j != end; j++) {
+          if (j != begin) {
+            massStrings += ',';
+          }
+          massStrings += StringUtils::ToString(j->second, precision);
         }
-        sprintf(buffer, "[%s]", StringUtils::Join(massStrings, ',').c_str());
+        sprintf(buffer, "[%s]", massStrings.c_str());
         break;
       }
     }
-    seq.insert(i->first + 1, buffer);
+    seq.insert(index + 1, buffer);
+    end = begin;
   }
 
   return seq;
@@ -711,6 +811,11 @@ FLOAT_T Peptide::calcSequenceMass(
  * \returns The mass of the given peptide.
  */
 FLOAT_T Peptide::calcMass(MASS_TYPE_T mass_type) const {
+  // One store, so that threads sharing the peptide see either NaN or the mass
+  FLOAT_T cached = mass_cache_[mass_type];
+  if (cached == cached) {
+    return cached;
+  }
   FLOAT_T mass = 0;
   char* seq = getSequence();
   for (char* i = seq; *i != '\0'; i++) {
@@ -718,7 +823,9 @@ FLOAT_T Peptide::calcMass(MASS_TYPE_T mass_type) const {
   }
   free(seq);
 
-  return mass_type != AVERAGE ? mass + MASS_H2O_MONO : mass + MASS_H2O_AVERAGE;
+  mass = mass_type != AVERAGE ? mass + MASS_H2O_MONO : mass + MASS_H2O_AVERAGE;
+  mass_cache_[mass_type] = mass;
+  return mass;
 }
 
 FLOAT_T Peptide::calcModifiedMass(MASS_TYPE_T mass_type) const {
@@ -726,7 +833,8 @@ FLOAT_T Peptide::calcModifiedMass(MASS_TYPE_T mass_type) const {
   for (vector<Modification>::const_iterator i = varMods_.begin(); i != varMods_.end(); i++) {
     mass += i->DeltaMass();
   }
-  vector<Modification> staticMods = getStaticMods();
+  vector<Modification> staticMods;
+  appendStaticMods(&staticMods);
   for (vector<Modification>::const_iterator i = staticMods.begin(); i != staticMods.end(); i++) {
     mass += i->DeltaMass();
   }
@@ -893,6 +1001,7 @@ void Peptide::transformToDecoy() {
     convert_to_mod_aa_seq(new_seq, &(decoy_modified_seq_));
     std::free(new_seq);
   }
+  clearCachedFields();
 }
 
 /**
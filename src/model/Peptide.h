@@ -49,6 +49,19 @@ class Peptide {
   std::string sequence_;
   std::vector<Modification> varMods_;
 
+  // Derived from the fields above on first use, and cleared when they change
+  mutable FLOAT_T mass_cache_[NUMBER_MASS_TYPES]; ///< NaN until calculated
+  bool masses_string_cached_;
+  std::string masses_string_; ///< getModifiedSequenceWithMasses()
+  bool symbols_string_cached_;
+  std::string symbols_string_; ///< getModifiedSequenceWithSymbols()
+
+  /**
+   * Forgets the cached masses and modified sequences, after the sequence,
+   * sources or modifications change.
+   */
+  void clearCachedFields();
+
  public:
   /*  Allocators/deallocators  */
   
@@ -57,7 +70,7 @@ class Peptide {
    */
   Peptide();
   Peptide(std::string sequence);
-  Peptide(std::string sequence, std::vector<Modification> mods);
+  Peptide(const std::string& sequence, const std::vector<Modification>& mods);
 
   /**
    * \returns A new peptide object, populated with the user specified
@@ -224,6 +237,7 @@ class Peptide {
   std::vector<Modification> getMods() const;
   std::vector<Modification> getVarMods() const;
   std::vector<Modification> getStaticMods() const;
+  void appendStaticMods(std::vector<Modification>* mods) const;
 
   bool hasMonoLink() const;
   
@@ -289,6 +303,12 @@ class Peptide {
    */
   std::string getModifiedSequenceWithMasses();
 
+ protected:
+  std::string makeModifiedSequenceWithSymbols();
+  std::string makeModifiedSequenceWithMasses();
+
+ public:
+
   void setDecoyModifiedSeq(MODIFIED_AA_T* decoy_modified_seq);
 
   /*  Getters requiring calculation */
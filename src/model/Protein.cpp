@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#include <algorithm>
 #include <vector>
 #include "util/Params.h"
 #include "util/utils.h"
@@ -47,6 +48,8 @@ void Protein::init() {
   sequence_ = NULL;
   length_ = 0;
   annotation_.clear();
+  mapped_record_ = NULL;
+  mapped_end_ = NULL;
 }
 
 /**
@@ -143,7 +146,9 @@ bool Protein::toLight()
     return true;
   }
   // free all char* in protein object
-  free(sequence_);
+  if(!is_memmap_){
+    free(sequence_);
+  }
   sequence_ = NULL;
   annotation_.clear(); 
   id_.clear();
@@ -256,6 +261,7 @@ void Protein::serialize(
   if(is_light_){
     toHeavy();
   }
+  readMappedRecord();
   
   int id_length = id_.length();
   int annotation_length = annotation_.length();
@@ -388,6 +394,91 @@ bool Protein::parseProteinBinaryMemmap(
   return true;
 }
 
+/**
+ * Makes the protein a view of a record of a mapped text fasta file.
+ */
+void Protein::setMappedRecord(
+  char* record, ///< the ">" of the title line -in
+  char* end ///< one past the last byte of the record -in
+  )
+{
+  mapped_record_ = record;
+  mapped_end_ = end;
+  is_light_ = false;
+  is_memmap_ = true;
+}
+
+/**
+ * Parses the mapped record of the protein the way parseProteinFastaFile()
+ * parses the same bytes of the fasta file: readTitleLine() for the id and
+ * annotation, readRawSequence() for the sequence, which is compacted over
+ * the line breaks of the record and ended with a '\0' in their place.
+ */
+void Protein::parseMappedRecord()
+{
+  char* record = mapped_record_;
+  char* end = mapped_end_;
+  mapped_record_ = NULL;
+  mapped_end_ = NULL;
+
+  // The title line, cut at LONGEST_LINE as readTitleLine() cuts it, less its
+  // last character (the end of line)
+  char* line = record + 1;
+  char* line_end = (char*)memchr(line, '\n', end - line);
+  char* sequence = line_end == NULL ? end : line_end + 1;
+  size_t line_length = min((size_t)(sequence - line), (size_t)LONGEST_LINE - 1);
+  line_length = line_length > 0 ? line_length - 1 : 0;
+  const char* id_begin = line;
+  while (id_begin < line + line_length && isspace((unsigned char)*id_begin)) {
+    ++id_begin;
+  }
+  const char* id_end = id_begin;
+  while (id_end < line + line_length && !isspace((unsigned char)*id_end)) {
+    ++id_end;
+  }
+  if (id_begin == id_end) {
+    carp(CARP_FATAL, "Error reading sequence ID.\n%.*s\n", (int)line_length, line);
+  }
+  id_.assign(id_begin, id_end);
+  // the comment starts one past the length of the id from the start of the
+  // line, as in readTitleLine()
+  size_t comment = id_.length() + 1;
+  annotation_ = comment < line_length ?
+    string(line + comment, line_length - comment) : string();
+
+  // The sequence, as readRawSequence() reads it
+  char* write = sequence;
+  for (char* read = sequence; read < end; ++read) {
+    int a_char = (unsigned char)*read;
+    if (!isalpha(a_char)) {
+      if ((a_char != ' ') && (a_char != '\t') && (a_char != '\n') && (a_char != '\r')) {
+        carp(CARP_WARNING,"Skipping character %c in sequence %s.",
+             a_char, id_.c_str());
+      }
+      continue;
+    }
+    a_char = toupper(a_char);
+    if (a_char < 'A' || a_char > 'Z') {
+      carp(CARP_WARNING, "Converting illegal character %c to X ", a_char);
+      carp(CARP_WARNING, "in sequence %s.", id_.c_str());
+      a_char = 'X';
+    }
+    *write++ = a_char;
+  }
+  length_ = write - sequence;
+  if (write < end) {
+    *write = '\0';
+    sequence_ = sequence;
+  } else {
+    // No line break to end the sequence in place: the last record of a file
+    // that does not end with one
+    sequence_ = (char*)mymalloc(length_ + 1);
+    memcpy(sequence_, sequence, length_);
+    sequence_[length_] = '\0';
+    is_memmap_ = false;
+  }
+}
+
 // FIXME ID line and annotation might need to be fixed
 VERBOSE_T verbosity = NORMAL_VERBOSE;
 /**
@@ -580,6 +671,7 @@ void Protein::shuffle(
   carp(CARP_DEBUG, "Shuffling protein %s as %s", 
        id_.c_str(), decoy_str);
   free(decoy_str);
+  readMappedRecord();
 
   switch(decoy_type){
   case NO_DECOYS:
@@ -629,6 +721,7 @@ string Protein::getId()
   if(is_light_){
     carp(CARP_FATAL, "Cannot get ID from light protein.");
   }
+  readMappedRecord();
   
   return id_;
 
@@ -643,6 +736,7 @@ string& Protein::getIdPointer()
   if(is_light_){
     carp(CARP_FATAL, "Cannot get ID pointer from light protein.");
   }
+  readMappedRecord();
   return id_; 
 }
 
@@ -653,6 +747,7 @@ void Protein::setId(
   const string& id ///< the sequence to add -in
   )
 {
+  readMappedRecord();
   id_ = id;
 }
 
@@ -668,6 +763,7 @@ char* Protein::getSequence(
   if(is_light_){
     carp(CARP_FATAL, "Cannot get sequence from light protein.");
   }
+  readMappedRecord();
   unsigned int sequence_length = strlen(sequence_) +1-offset; // +\0
   char * copy_sequence = 
     (char *)mymalloc(sizeof(char)*sequence_length);
@@ -685,6 +781,7 @@ char* Protein::getSequencePointer(
   if(is_light_){
     carp(CARP_FATAL, "Cannot get sequence pointer from light protein.");
   }
+  readMappedRecord();
   return sequence_+offset;
 }
 
@@ -695,8 +792,11 @@ void Protein::setSequence(
   const char* sequence ///< the sequence to add -in
   )
 {
-
-  free(sequence_);
+  readMappedRecord();
+  if(!is_memmap_){
+    free(sequence_);
+  }
+  is_memmap_ = false;
   unsigned int sequence_length = strlen(sequence) +1; // +\0
   char * copy_sequence = 
     (char *)mymalloc(sizeof(char)*sequence_length);
@@ -710,6 +810,7 @@ void Protein::setSequence(
  */
 unsigned int Protein::getLength()
 {
+  readMappedRecord();
   return length_;
 }
 
@@ -720,6 +821,7 @@ void Protein::setLength(
   unsigned int length ///< the length to add -in
   )
 {
+  readMappedRecord();
   length_ = length;
 }
 
@@ -734,7 +836,7 @@ string Protein::getAnnotation()
   if(is_light_){
     carp(CARP_FATAL, "Cannot get annotation from light protein.");
   }
-
+  readMappedRecord();
   return annotation_;
 }
 
@@ -742,6 +844,7 @@ string Protein::getAnnotation()
  *\returns A const pointer to the annotation of the protein.
  */
 const string& Protein::getAnnotationPointer(){
+  readMappedRecord();
   return annotation_;
 }
  
@@ -752,6 +855,7 @@ void Protein::setAnnotation(
   const string& annotation ///< the sequence to add -in
   )
 {
+  readMappedRecord();
   annotation_ = annotation;
 }
 
@@ -27,6 +27,8 @@ class Protein {
   char*        sequence_; ///< The protein sequence.
   unsigned int   length_; ///< The length of the protein sequence.
   std::string      annotation_; ///< Optional protein annotation.
+  char* mapped_record_; ///< the unread record of a mapped fasta file, or NULL
+  char* mapped_end_; ///< the end of mapped_record_
 
   /**
    * Find the beginning of the next sequence, and read the sequence ID
@@ -53,6 +55,19 @@ class Protein {
      unsigned int* sequence_length // the sequence length -chris added
    );
  
+  /**
+   * Fills in the id, annotation and sequence of a protein from its record
+   * of a mapped fasta file, the first time they are needed. The sequence is
+   * compacted in place in the (copy-on-write) mapping, so that it is not
+   * copied to the heap.
+   */
+  void readMappedRecord() {
+    if (mapped_record_ != NULL) {
+      parseMappedRecord();
+    }
+  }
+  void parseMappedRecord();
+
   /**
    * Rearrange the sequence_ between cleavage sites, keeping residues
    * on either side of a cleavage in place.  Get enzyme from
@@ -167,6 +182,18 @@ class Protein {
     ///< a pointer to a pointer to the memory mapped binary fasta file -in
   );
 
+  /**
+   * Makes the protein a view of the record [record, end) of a text fasta
+   * file mapped into memory, from the ">" of its title line to the ">" of
+   * the next one. The record is parsed when the protein is first read, as
+   * parseProteinFastaFile() would, and must stay mapped, writable, for the
+   * life of the protein.
+   */
+  void setMappedRecord(
+    char* record, ///< the ">" of the title line -in
+    char* end ///< one past the last byte of the record -in
+  );
+
   /**
    * Change the sequence of a protein to be a randomized version of
    * itself.  The method of randomization is dependent on the
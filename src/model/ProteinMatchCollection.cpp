@@ -9,10 +9,29 @@
 
 #include "Match.h"
 #include "MatchCollection.h"
+#include "util/ParallelSort.h"
+#include "util/ThreadPool.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace Crux;
 
+/**
+ * Makes the peptide ids of matches [begin, end)
+ */
+static void makePeptideIds(
+  const vector<Match*>* matches, ///< matches to make ids for
+  vector<string>* ids, ///< filled in at the same positions
+  size_t begin, ///< first match
+  size_t end ///< one past the last match
+  ) {
+  for (size_t i = begin; i < end; i++) {
+    (*ids)[i] = (*matches)[i]->getPeptide()->getId();
+  }
+}
+
 /**
  * \returns a blank ProteinMatchCollection
  */
@@ -44,10 +63,10 @@ ProteinMatchCollection::~ProteinMatchCollection() {
   }
 
   // delete peptide matches
-  for (map<string, PeptideMatch*>::iterator iter = peptide_match_map_.begin();
-       iter != peptide_match_map_.end();
+  for (PeptideMatchIterator iter = peptideMatchBegin();
+       iter != peptideMatchEnd();
        ++iter) {
-      delete iter->second;
+    delete *iter;
   }
 
   // delete spectrum matches
@@ -111,15 +130,19 @@ ProteinMatch* ProteinMatchCollection::getProteinMatch(
   bool create ///< Create the ProteinMatch if it doesn't exist
   ) {
 
-  string id = protein->getIdPointer();
+  const string& id = protein->getIdPointer();
 
-  ProteinMatch* ans = getProteinMatch(id);
-  if (ans == NULL) {
-    if (create) {
-      ans = new ProteinMatch(protein);
-      protein_matches_.push_back(ans);
-      protein_match_map_.insert(pair<string, ProteinMatch*>(id, ans));
-    } else {
+  ProteinMatch* ans = NULL;
+  if (create) {
+    int num = protein_ids_.Intern(id);
+    if (num == (int)protein_match_by_id_.size()) {
+      protein_match_by_id_.push_back(new ProteinMatch(protein));
+      protein_matches_.push_back(protein_match_by_id_.back());
+    }
+    ans = protein_match_by_id_[num];
+  } else {
+    ans = getProteinMatch(id);
+    if (ans == NULL) {
       carp(CARP_WARNING, "ProteinMatch for %s not found!", protein->getIdPointer().c_str());
     }
   }
@@ -134,14 +157,28 @@ PeptideMatch* ProteinMatchCollection::getPeptideMatch(
   Peptide* peptide, ///< peptide to find
   bool create ///< create if it doesn't exist?
   ) {
-  PeptideMatch* ans = getPeptideMatch(peptide->getId());
-
-  if (ans == NULL) {
-    if (create) {
-      ans = new PeptideMatch(peptide);
-      peptide_matches_.push_back(ans);
-      peptide_match_map_.insert(pair<string, PeptideMatch*>(peptide->getId(), ans));
-    } else {
+  return getPeptideMatch(peptide, peptide->getId(), create);
+}
+
+/**
+ * getPeptideMatch() for a peptide whose id is already known
+ */
+PeptideMatch* ProteinMatchCollection::getPeptideMatch(
+  Peptide* peptide, ///< peptide to find
+  const string& id, ///< peptide->getId()
+  bool create ///< create if it doesn't exist?
+  ) {
+  PeptideMatch* ans = NULL;
+  if (create) {
+    int num = peptide_ids_.Intern(id);
+    if (num == (int)peptide_match_by_id_.size()) {
+      peptide_match_by_id_.push_back(new PeptideMatch(peptide));
+      peptide_matches_.push_back(peptide_match_by_id_.back());
+    }
+    ans = peptide_match_by_id_[num];
+  } else {
+    ans = getPeptideMatch(id);
+    if (ans == NULL) {
       carp(CARP_FATAL, "Could not find peptidematch for sequence %s",
         peptide->getSequence());
     }
@@ -156,8 +193,8 @@ PeptideMatch* ProteinMatchCollection::getPeptideMatch(
 ProteinMatch* ProteinMatchCollection::getProteinMatch(
   const string& id ///< id of the protein
   ) {
-  map<string, ProteinMatch*>::iterator iter = protein_match_map_.find(id);
-  return (iter != protein_match_map_.end()) ? iter->second : NULL;
+  int num = protein_ids_.Find(id);
+  return (num >= 0) ? protein_match_by_id_[num] : NULL;
 }
 
 /**
@@ -166,8 +203,8 @@ ProteinMatch* ProteinMatchCollection::getProteinMatch(
 PeptideMatch* ProteinMatchCollection::getPeptideMatch(
   const string& id ///< peptide id to find
   ) {
-  map<string, PeptideMatch*>::iterator iter = peptide_match_map_.find(id);
-  return (iter != peptide_match_map_.end()) ? iter->second : NULL;
+  int num = peptide_ids_.Find(id);
+  return (num >= 0) ? peptide_match_by_id_[num] : NULL;
 }
 
 /**
@@ -178,6 +215,17 @@ void ProteinMatchCollection::addMatch(
   MatchCollection* match_collection, ///< Collection from where the match came from
   Match* match ///< Match to add
   ){
+  addMatch(match_collection, match, match->getPeptide()->getId());
+}
+
+/**
+ * addMatch() for a match whose peptide id is already known
+ */
+void ProteinMatchCollection::addMatch(
+  MatchCollection* match_collection, ///< Collection from where the match came from
+  Match* match, ///< Match to add
+  const string& peptide_id ///< match->getPeptide()->getId()
+  ){
 
   //create a spectrum match.
   Spectrum* spectrum = match->getSpectrum();
@@ -189,13 +237,14 @@ void ProteinMatchCollection::addMatch(
   
   pair<int, int> scan_charge = make_pair(spectrum->getFirstScan(), z_state.getCharge());
 
-  if (match->getLnExperimentSize() >= 0 &&
-      spectrum_counts_.find(scan_charge) == spectrum_counts_.end()) {
-    spectrum_counts_[scan_charge] = floor(exp(match->getLnExperimentSize()) + 0.5);
+  // the first match of a spectrum sets its count
+  if (match->getLnExperimentSize() >= 0) {
+    spectrum_counts_.insert(make_pair(scan_charge,
+      (int)floor(exp(match->getLnExperimentSize()) + 0.5)));
   }
 
   Peptide* peptide = match->getPeptide();
-  PeptideMatch* peptide_match = getPeptideMatch(peptide);
+  PeptideMatch* peptide_match = getPeptideMatch(peptide, peptide_id, true);
   
   //add the spectrum match.
   peptide_match->addSpectrumMatch(spectrum_match);
@@ -235,16 +284,40 @@ void ProteinMatchCollection::addMatches(
        match_collection->getMatchTotal());
   distinct_matches_ = match_collection->getHasDistinctMatches();
 
+  vector<Match*> matches;
   MatchIterator match_iter(match_collection);
   while(match_iter.hasNext()) {
-    addMatch(match_collection, match_iter.next());
+    matches.push_back(match_iter.next());
+  }
+
+  // Making the peptide ids is most of the work; the matches are then linked
+  // in order, so that the collection is the same as with addMatch().
+  vector<string> peptide_ids(matches.size());
+  const size_t kMinMatchesPerThread = 10000;
+  int num_threads = ParallelSort::NumThreads();
+  if (num_threads > (int)(matches.size() / kMinMatchesPerThread)) {
+    num_threads = matches.size() / kMinMatchesPerThread;
+  }
+  if (num_threads < 2) {
+    makePeptideIds(&matches, &peptide_ids, 0, matches.size());
+  } else {
+    ThreadPool::TaskGroup threads;
+    for (int i = 0; i < num_threads; i++) {
+      threads.Run(boost::bind(&makePeptideIds, &matches, &peptide_ids,
+        matches.size() * i / num_threads, matches.size() * (i + 1) / num_threads));
+    }
+    threads.Wait();
+  }
+
+  for (size_t i = 0; i < matches.size(); i++) {
+    addMatch(match_collection, matches[i], peptide_ids[i]);
   }
 }
 
 /**
  * Get the matches/spectrum as a map, where the key is <scan, chage>
  */
-const map<pair<int, int>, int>& ProteinMatchCollection::getMatchesSpectrum() {
+const ProteinMatchCollection::SpectrumCounts& ProteinMatchCollection::getMatchesSpectrum() {
   return spectrum_counts_;
 }
 
@@ -9,21 +9,52 @@
 #include "ProteinMatch.h"
 #include "match_objects.h"
 
+#include "util/StringInterner.h"
+
 #include <deque>
 #include <set>
 #include <string>
+#include <vector>
+#include "boost/unordered_map.hpp"
 
 class ProteinMatchCollection {
 
+ public:
+  /**
+   * The number of candidates of each spectrum, keyed by <scan, charge>
+   */
+  typedef boost::unordered_map<std::pair<int, int>, int> SpectrumCounts;
+
  protected:
-  std::map<std::string, ProteinMatch*> protein_match_map_;
-  std::map<std::string, PeptideMatch*> peptide_match_map_;
+  StringInterner protein_ids_; ///< numbers the protein ids
+  StringInterner peptide_ids_; ///< numbers the peptide ids
+  std::vector<ProteinMatch*> protein_match_by_id_; ///< by protein_ids_ number
+  std::vector<PeptideMatch*> peptide_match_by_id_; ///< by peptide_ids_ number
   std::deque<ProteinMatch*> protein_matches_; ///< All protein matches
   std::deque<PeptideMatch*> peptide_matches_; ///< All peptide matches
   std::deque<SpectrumMatch*> spectrum_matches_; ///< All spectrum matches
 
-  std::map<std::pair<int, int>, int> spectrum_counts_; ///< matches/spectrum
+  SpectrumCounts spectrum_counts_; ///< matches/spectrum
   bool distinct_matches_; ///< are matches distinct?
+
+  /**
+   * getPeptideMatch() for a peptide whose id is already known
+   */
+  PeptideMatch* getPeptideMatch(
+    Crux::Peptide* peptide, ///< peptide to find
+    const std::string& id, ///< peptide->getId()
+    bool create ///< create if it doesn't exist?
+  );
+
+  /**
+   * addMatch() for a match whose peptide id is already known
+   */
+  void addMatch(
+    MatchCollection* match_collection, ///< Collection from where the match came from
+    Crux::Match* match, ///< Match to add
+    const std::string& peptide_id ///< match->getPeptide()->getId()
+  );
+
  public:
 
   /**
@@ -118,13 +149,14 @@ class ProteinMatchCollection {
   /**
    * Helper method that adds a Crux match to the ProteinMatchCollection,
    * Adding all SpectrumMatch, PeptideMatch, and ProteinMatch objects.
+   * The peptide ids of the matches are made on several threads first.
    */
   void addMatches(MatchCollection* match_collection);
 
   /**
-   * Get the matches/spectrum as a map, where the key is <scan, charge>
+   * Get the matches/spectrum, where the key is <scan, charge>
    */
-  const std::map<std::pair<int, int>, int>& getMatchesSpectrum();
+  const SpectrumCounts& getMatchesSpectrum();
   
   /**
    * \returns whether matches are distinct are not
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <algorithm>
 #ifndef _MSC_VER
 #include <dirent.h>
 #include <unistd.h>
@@ -109,6 +110,7 @@ void Scorer::init() {
   bin_width_ = 0;
   bin_offset_ = 0;
   observed_ = NULL;
+  observed_size_ = 0;
   theoretical_ = NULL;
 }
 
@@ -328,9 +330,17 @@ void Scorer::zeroPeakMeanStdev(
 
   // iterate over all peaks
   for(; idx < array_size; ++idx){
+    // The mean and stdev are never negative, so an empty bin, or one no
+    // higher than the mean, is not extracted and needs neither.
+    if(original_array[idx] <= 0){
+      continue;
+    }
     peak_count = 0;
     // get mean
     mean = get_mean_from_array(original_array, array_size, idx, &peak_count);
+    if(original_array[idx] <= mean){
+      continue;
+    }
     // get stdev
     stdev = get_stdev_from_array(original_array, array_size, idx, mean, peak_count);
     
@@ -770,22 +780,22 @@ void Scorer::normalizeEachRegion(
   int region_selector ///< the size of each regions -in
   )
 {
-  int region_idx = 0;
-  int next_region = region_selector;
-  FLOAT_T max_intensity = max_intensity_per_region[region_idx];
-
-  // normalize each region
-  for (int i = 0; i < observed.size(); ++i) {
-    // increment the region index and update max_intensity if this
-    // peak is in the next region
-    if (i >= next_region && region_idx < (NUM_REGIONS - 1)) {
-      max_intensity = max_intensity_per_region[++region_idx];
-      next_region += region_selector;
+  int size = observed.size();
+
+  // normalize each region; the last one runs to the end of the array
+  for (int region_idx = 0; region_idx < NUM_REGIONS; ++region_idx) {
+    int begin = min(region_idx * region_selector, size);
+    int end = (region_idx == NUM_REGIONS - 1)
+      ? size : min(begin + region_selector, size);
+    FLOAT_T max_intensity = max_intensity_per_region[region_idx];
+    if (max_intensity == 0) {
+      fill(observed.begin() + begin, observed.begin() + end, 0.0);
+      continue;
     }
     // normalize intensity to max 50
-    observed[i] = (max_intensity != 0)
-      ? (observed[i] / max_intensity) * MAX_PER_REGION
-      : 0.0;
+    for (int i = begin; i < end; ++i) {
+      observed[i] = (observed[i] / max_intensity) * MAX_PER_REGION;
+    }
   }
 }
 
@@ -821,7 +831,8 @@ bool Scorer::createIntensityArrayObserved(
 
   sp_max_mz_ = sp_max_mz;
 
-  vector<FLOAT_T> observed(getMaxBin(), 0);
+  vector<FLOAT_T>& observed = binned_;
+  observed.assign(getMaxBin(), 0);
 
   // Store the max intensity in entire spectrum
   FLOAT_T max_intensity_overall = 0.0;
@@ -911,16 +922,31 @@ bool Scorer::createIntensityArrayObserved(
     normalizeEachRegion(observed, max_intensity_per_region, region_selector);
   }
 
-  observed_ = (FLOAT_T*)mycalloc(observed.size(), sizeof(FLOAT_T));
+  if (observed_ == NULL || observed_size_ != observed.size()) {
+    free(observed_);
+    observed_ = (FLOAT_T*)mycalloc(observed.size(), sizeof(FLOAT_T));
+    observed_size_ = observed.size();
+  }
   copy(observed.begin(), observed.end(), observed_);
 
   if (stop_after == XCORR_STEP) {
-    // TODO maybe replace with a faster implementation that uses cum distribution
-    for (int i = 0; i < observed.size(); i++) {
-      for (int j = i - MAX_XCORR_OFFSET; j <= i + MAX_XCORR_OFFSET; j++) {
-        if (j > 0 && j < observed.size()) {
-          observed_[i] -= (observed[j] / (MAX_XCORR_OFFSET * 2.0 + 1));
-        }
+    // Subtract the mean of the bins within MAX_XCORR_OFFSET, leaving bin 0
+    // out of it as it always has been. Each bin takes off the share of each
+    // neighbor in turn, lowest first, rounding after each just as a loop
+    // over the neighbors of each bin does, so the result is the same to the
+    // last bit; a running sum would not be. Going offset by offset across
+    // all the bins lets the compiler vectorize the subtraction.
+    int num_bins = observed.size();
+    vector<double>& shares = binned_shares_;
+    shares.resize(num_bins);
+    for (int j = 0; j < num_bins; j++) {
+      shares[j] = observed[j] / (MAX_XCORR_OFFSET * 2.0 + 1);
+    }
+    for (int offset = -MAX_XCORR_OFFSET; offset <= MAX_XCORR_OFFSET; offset++) {
+      int begin = max(0, 1 - offset);
+      int end = min(num_bins, num_bins - offset);
+      for (int i = begin; i < end; i++) {
+        observed_[i] -= shares[i + offset];
       }
     }
   }
@@ -952,6 +978,8 @@ void Scorer::getProcessedPeaks(
   // return the observed array and the sp_max_mz
   *intensities = scorer.observed_;
   *max_mz_bin = scorer.getMaxBin();
+  scorer.observed_ = NULL;  // the caller frees it
+  scorer.observed_size_ = 0;
 }
 
 
@@ -1124,6 +1152,65 @@ FLOAT_T Scorer::genScoreXcorr(
   return final_score;
 }
 
+/**
+ * Scores the ions against the spectrum as scoreSpectrumVIonSeries scores
+ * an ion series of the same ions in the same order, for XCORR scorers.
+ * \returns the xcorr score
+ */
+FLOAT_T Scorer::scoreXcorrIons(
+  Spectrum* spectrum, ///< the spectrum to score -in
+  int charge, ///< the charge the ions were predicted for -in
+  const vector<XcorrIon>& ions ///< the theoretical ions -in
+  ) {
+
+  if (!initialized_ && !createIntensityArrayXcorr(spectrum, charge)) {
+    carp(CARP_FATAL, "failed to produce XCORR");
+  }
+
+  // Same sums, in the same order, as scoreIntensityIonSeries
+  FLOAT_T bin_width = bin_width_;
+  FLOAT_T bin_offset = bin_offset_;
+  int max_bin = getMaxBin();
+  FLOAT_T B_Y_sum = 0.0;
+  FLOAT_T FLANK_sum = 0.0;
+  FLOAT_T LOSS_sum = 0.0;
+  for (vector<XcorrIon>::const_iterator ion = ions.begin(); ion != ions.end(); ++ion) {
+    FLOAT_T ion_mass_z = ion->mass_z;
+    int intensity_array_idx = INTEGERIZE(ion_mass_z, bin_width, bin_offset);
+    if (intensity_array_idx >= max_bin) {
+      continue;
+    }
+    if (ion->type == B_ION || ion->type == Y_ION) {
+      B_Y_sum += observed_[intensity_array_idx];
+      if (use_flanks_) {
+        FLANK_sum += observed_[intensity_array_idx-1];
+        if ((intensity_array_idx + 1) < max_bin) {
+          FLANK_sum += observed_[intensity_array_idx+1];
+        }
+      }
+      int ion_charge = ion->charge;
+      if (ion->type == B_ION) {
+        int h2o_array_idx =
+          INTEGERIZE((ion_mass_z - (MASS_H2O_MONO/ion_charge)),
+                       bin_width, bin_offset);
+        LOSS_sum += observed_[h2o_array_idx];
+      }
+      int nh3_array_idx
+        = INTEGERIZE((ion_mass_z -  (MASS_NH3_MONO/ion_charge)),
+                       bin_width, bin_offset);
+      LOSS_sum += observed_[nh3_array_idx];
+    } else if (ion->type == A_ION) {
+      LOSS_sum += observed_[intensity_array_idx];
+    } else {
+      carp(CARP_ERROR, "only should create B, Y, A type ions for xcorr theoretical spectrum");
+      return 0;
+    }
+  }
+
+  FLOAT_T ans = B_Y_sum * B_Y_HEIGHT + FLANK_sum * FLANK_HEIGHT + LOSS_sum * LOSS_HEIGHT;
+  return ans / 10000.0;
+}
+
 /*****************************************************
  * General purpose functions
  * 
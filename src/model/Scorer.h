@@ -16,6 +16,7 @@
 #include <dirent.h>
 #endif
 #include <string>
+#include <vector>
 #ifdef _MSC_VER
 #include "util/windirent.h"
 #endif
@@ -53,6 +54,9 @@ class Scorer {
 
   /// used for xcorr
   FLOAT_T* observed_; ///< used for Xcorr: observed spectrum intensity array
+  size_t observed_size_; ///< used for Xcorr: number of bins allocated for observed_
+  std::vector<FLOAT_T> binned_; ///< used for Xcorr: binned peaks, reused between spectra
+  std::vector<double> binned_shares_; ///< used for Xcorr: each bin of binned_ over the background window size
   FLOAT_T* theoretical_; ///< used for Xcorr: theoretical spectrum intensity array
 
   /**
@@ -183,6 +187,15 @@ class Scorer {
 
  public:
 
+  /**
+   * A theoretical ion given by value, for scoring without Ion objects.
+   */
+  struct XcorrIon {
+    FLOAT_T mass_z;
+    ION_TYPE_T type;
+    int charge;
+  };
+
   /**
    * \returns An (empty) scorer object.
    */
@@ -209,6 +222,17 @@ class Scorer {
     IonSeries* ion_series ///< the ion series to score against the spectrum -in
   );
 
+  /**
+   * Scores the ions against the spectrum as scoreSpectrumVIonSeries scores
+   * an ion series of the same ions in the same order, for XCORR scorers.
+   * \returns the xcorr score
+   */
+  FLOAT_T scoreXcorrIons(
+    Crux::Spectrum* spectrum, ///< the spectrum to score -in
+    int charge, ///< the charge the ions were predicted for -in
+    const std::vector<XcorrIon>& ions ///< the theoretical ions -in
+  );
+
   /**
    * Frees the single_ion_constraints array
    */
@@ -357,7 +381,7 @@ class Scorer {
    * intensities array.  It's implemented here so that
    * create_intensity_array_observed() can remain private and so that
    * the scorer->observed array can be accessed directly.
-   * .
+   * The caller frees *intensities with free().
    */
   static void getProcessedPeaks(
     Crux::Spectrum* spectrum, 
@@ -90,11 +90,15 @@ Spectrum::Spectrum (
  */
 Spectrum::~Spectrum()
 {
-  free_peak_vector(peaks_);
-  
-  if(has_mz_peak_array_){
-    delete [] mz_peak_array_;
-  }
+  clearPeaks();
+}
+
+void Spectrum::clearPeaks() {
+  peaks_.clear();
+  peak_store_.clear();
+  delete [] mz_peak_array_;
+  mz_peak_array_ = NULL;
+  has_mz_peak_array_ = false;
 }
 
 /**
@@ -175,38 +179,60 @@ void Spectrum::printProcessedPeaks(
   int max_mz_bin,       ///< num_bins in intensities
   FILE* file){          ///< print to this file
 
+  string text;
+  formatProcessedPeaks(zstate, intensities, max_mz_bin, &text);
+  fputs(text.c_str(), file);
+}
+
+/**
+ * Appends what printProcessedPeaks() prints to text, so that spectra can be
+ * formatted on several threads and printed in order.
+ */
+void Spectrum::formatProcessedPeaks(
+  const SpectrumZState& zstate,     ///< print at this charge state
+  const FLOAT_T* intensities, ///< intensities of new peaks
+  int max_mz_bin,       ///< num_bins in intensities
+  string* text) const { ///< append to this string
+
   int mass_precision = Params::GetInt("mass-precision");
+  char line[256];  // mass-precision is at most 100
 
   // print S line
-  fprintf(file, "S\t%06d\t%06d\t%.*f\n", 
+  sprintf(line, "S\t%06d\t%06d\t%.*f\n",
           first_scan_,
           last_scan_,
           mass_precision,
-          precursor_mz_);
+          (double)precursor_mz_);
+  *text += line;
 
   // print I line(s)
   for(size_t line_idx = 0; line_idx < i_lines_v_.size(); line_idx++){
-    fprintf(file, "%s\n", (i_lines_v_[line_idx]).c_str());
+    *text += i_lines_v_[line_idx] + "\n";
   }
 
   // print 'Z', 'D' line
   if( zstate.getCharge() != 0 ){  // print only one charge state
-    fprintf(file, "Z\t%d\t%.*f\n", zstate.getCharge(), mass_precision,
+    sprintf(line, "Z\t%d\t%.*f\n", zstate.getCharge(), mass_precision,
             zstate.getSinglyChargedMass());
+    *text += line;
     // TODO find associated Z line and print
   } else {  // print all charge states
 
     for(size_t z_idx = 0; z_idx < zstates_.size(); z_idx++){
-      fprintf(file, "Z\t%d\t%.*f\n", zstates_[z_idx].getCharge(), mass_precision,
-              zstates_[z_idx].getSinglyChargedMass());
+      sprintf(line, "Z\t%d\t%.*f\n", zstates_[z_idx].getCharge(),
+              mass_precision, zstates_[z_idx].getSinglyChargedMass());
+      *text += line;
       // are there any 'D' lines to print?
       if(z_idx < d_lines_v_.size()){
-        fprintf(file, "%s", d_lines_v_[z_idx].c_str());
+        *text += d_lines_v_[z_idx];
       }
     }
   }
 
   // print peaks
+  bool mz_units = Params::GetString("output-units") == "mz";
+  double bin_offset = Params::GetDouble("mz-bin-offset");
+  double bin_width = Params::GetDouble("mz-bin-width");
   for(int bin_idx = 0; bin_idx < max_mz_bin; bin_idx++){
     string intensity = StringUtils::ToString(intensities[bin_idx], mass_precision);
     // Make sure the value has at least one non-zero digit, once it has been
@@ -214,15 +240,16 @@ void Spectrum::printProcessedPeaks(
     if (intensity.find_first_of("123456789") == string::npos) {
       continue;
     }
-    if (Params::GetString("output-units") == "mz") {
-      double mz = (bin_idx - 0.5 + Params::GetDouble("mz-bin-offset")) *
-        Params::GetDouble("mz-bin-width");
-      fprintf(file, "%f %s\n", mz, intensity.c_str());
+    if (mz_units) {
+      double mz = (bin_idx - 0.5 + bin_offset) * bin_width;
+      sprintf(line, "%f ", mz);
     } else {
-      fprintf(file, "%d %s\n", bin_idx, intensity.c_str());
+      sprintf(line, "%d ", bin_idx);
     }
+    *text += line;
+    *text += intensity;
+    *text += '\n';
   }
-  return;
 }
 
 
@@ -269,10 +296,12 @@ void Spectrum::printSqt(
  has_peaks_(old_spectrum.has_peaks_),
  sorted_by_mz_(old_spectrum.sorted_by_mz_),
  sorted_by_intensity_(old_spectrum.sorted_by_intensity_),
- has_mz_peak_array_(old_spectrum.has_mz_peak_array_)
+ has_mz_peak_array_(false),
+ mz_peak_array_(NULL)
 {
 
   // copy each peak
+  reservePeaks(old_spectrum.peaks_.size());
   for(int peak_idx=0; peak_idx < (int)old_spectrum.peaks_.size(); ++peak_idx){
     this->addPeak(old_spectrum.peaks_[peak_idx]->getIntensity(),
                   old_spectrum.peaks_[peak_idx]->getLocation());
@@ -299,8 +328,9 @@ void Spectrum::copyFrom(Spectrum *src) {
  has_peaks_ = src-> has_peaks_;
  sorted_by_mz_ = src->sorted_by_mz_;
  sorted_by_intensity_ = src->sorted_by_intensity_;
- has_mz_peak_array_ = src->has_mz_peak_array_;
  // copy each peak
+ clearPeaks();
+ reservePeaks(src->peaks_.size());
  for(int peak_idx=0; peak_idx < (int)src->peaks_.size(); ++peak_idx){
    this->addPeak(src->peaks_[peak_idx]->getIntensity(),
                   src->peaks_[peak_idx]->getLocation());
@@ -326,10 +356,9 @@ bool Spectrum::parseMstoolkitSpectrum
   // clear any existing values
   zstates_.clear();
 
-  free_peak_vector(peaks_);
+  clearPeaks();
   i_lines_v_.clear();
   d_lines_v_.clear();
-  if( mz_peak_array_ ){ delete [] mz_peak_array_; }
 
   MSToolkit::Spectrum* mst_real_spectrum = (MSToolkit::Spectrum*)mst_spectrum;
 
@@ -342,6 +371,7 @@ bool Spectrum::parseMstoolkitSpectrum
   filename_ = filename;
 
   //add all peaks.
+  reservePeaks(mst_real_spectrum->size());
   for(int peak_idx = 0; peak_idx < (int)mst_real_spectrum->size(); peak_idx++){
     this->addPeak(mst_real_spectrum->at(peak_idx).intensity,
                    mst_real_spectrum->at(peak_idx).mz);
@@ -377,10 +407,9 @@ bool Spectrum::parsePwizSpecInfo(
   // clear any existing values
   zstates_.clear();
   ezstates_.clear();
-  free_peak_vector(peaks_);
+  clearPeaks();
   i_lines_v_.clear();
   d_lines_v_.clear();
-  if( mz_peak_array_ ){ free(mz_peak_array_); }
 
   // assign new values
   first_scan_ = firstScan;
@@ -390,6 +419,7 @@ bool Spectrum::parsePwizSpecInfo(
   int num_peaks = pwiz_spectrum->defaultArrayLength;
   vector<double>& mzs = pwiz_spectrum->getMZArray()->data;
   vector<double>& intensities = pwiz_spectrum->getIntensityArray()->data;
+  reservePeaks(num_peaks);
   for(int peak_idx = 0; peak_idx < num_peaks; peak_idx++){
     addPeak(intensities[peak_idx], mzs[peak_idx]);
   }
@@ -504,12 +534,49 @@ void Spectrum::addPeak
   FLOAT_T location_mz ///< the location of peak to add -in
   )
 {
-  Peak *peak = new Peak(intensity, location_mz);
-  peaks_.push_back(peak);
+  if (peak_store_.size() == peak_store_.capacity()) {
+    reservePeaks(max((size_t)16, 2 * peak_store_.size()));
+  }
+  peak_store_.push_back(Peak(intensity, location_mz));
+  peaks_.push_back(&peak_store_.back());
   updateFields(intensity, location_mz);
   has_peaks_ = true;
 }
 
+/**
+ * The peaks live in one vector rather than in a heap block each, so
+ * growing it moves them; the pointers in the current order (and any
+ * mz_peak_array) are then redone.
+ */
+void Spectrum::reservePeaks(int num_peaks) {
+  if (num_peaks <= (int)peak_store_.capacity()) {
+    return;
+  }
+  const Peak* old_base = peak_store_.empty() ? NULL : &peak_store_[0];
+  peak_store_.reserve(num_peaks);
+  peaks_.reserve(num_peaks);
+  if (old_base != NULL && old_base != &peak_store_[0]) {
+    Peak* base = &peak_store_[0];
+    for (vector<Peak*>::iterator i = peaks_.begin(); i != peaks_.end(); i++) {
+      *i = base + (*i - old_base);
+    }
+    if (has_mz_peak_array_) {
+      delete [] mz_peak_array_;
+      mz_peak_array_ = NULL;
+      has_mz_peak_array_ = false;
+    }
+  }
+}
+
+void Spectrum::addZState(const SpectrumZState& zstate) {
+  zstates_.push_back(zstate);
+}
+
+void Spectrum::setScans(int first_scan, int last_scan) {
+  first_scan_ = first_scan;
+  last_scan_ = last_scan;
+}
+
 void Spectrum::truncatePeaks(int count) {
   if (count < 0) {
     count = 0;
@@ -531,7 +598,6 @@ void Spectrum::truncatePeaks(int count) {
       }
     } else {
       total_energy_ -= (*i)->getIntensity();
-      delete *i;
     }
   }
   peaks_.resize(count);
@@ -49,7 +49,8 @@ class Spectrum{
   FLOAT_T          precursor_mz_;  ///< The m/z of precursor (MS-MS spectra)
   std::vector<SpectrumZState> zstates_;
   std::vector<SpectrumZState> ezstates_;
-  std::vector<Peak*>  peaks_;         ///< The spectrum peaks
+  std::vector<Peak>   peak_store_;    ///< The peaks, in one block, in the order added
+  std::vector<Peak*>  peaks_;         ///< The spectrum peaks; point into peak_store_
   FLOAT_T          min_peak_mz_;   ///< The minimum m/z of all peaks
   FLOAT_T          max_peak_mz_;   ///< The maximum m/z of all peaks
   double           total_energy_;  ///< The sum of intensities in all peaks
@@ -82,6 +83,11 @@ class Spectrum{
      FLOAT_T location  ///< the location of the peak that has been added -in
      );
 
+  /**
+   * Removes all peaks and the mz_peak_array.
+   */
+  void clearPeaks();
+
  public:
   /**
    * Default constructor.
@@ -140,6 +146,16 @@ class Spectrum{
      int max_mz_bin,       ///< num_bins in intensities
      FILE* file);          ///< print to this file
 
+  /**
+   * Appends what printProcessedPeaks() prints to text, so that spectra can
+   * be formatted on several threads and printed in order.
+   */
+  void formatProcessedPeaks
+    (const SpectrumZState& zstate, ///< print at this charge state
+     const FLOAT_T* intensities, ///< intensities of new peaks
+     int max_mz_bin,       ///< num_bins in intensities
+     std::string* text) const; ///< append to this string
+
   /**
    * Prints a spectrum object to file in sqt format.
    */
@@ -334,6 +350,22 @@ class Spectrum{
      FLOAT_T location_mz ///< the location of peak to add -in
      );
 
+  /**
+   * Makes room for num_peaks peaks in all, so that adding them does not
+   * move the peaks again.
+   */
+  void reservePeaks(int num_peaks);
+
+  /**
+   * Adds a charge state to the spectrum.
+   */
+  void addZState(const SpectrumZState& zstate);
+
+  /**
+   * Sets the numbers of the first and last scan.
+   */
+  void setScans(int first_scan, int last_scan);
+
   void truncatePeaks(int count);
 
   /**
@@ -91,6 +91,16 @@ void initialize_parameters(void){
     //initialize_aa_mod(&list_of_mods[mod_idx], mod_idx);     
     list_of_mods[mod_idx] = new AA_MOD_T(mod_idx);              
   }                                                           
+  /* forget the mods of the last command, if crux batch ran one */
+  list_of_variable_mods = NULL;
+  list_of_c_mods = NULL;
+  list_of_n_mods = NULL;
+  fixed_c_mod = -1;
+  fixed_n_mod = -1;
+  num_fixed_mods = 0;
+  num_mods = 0;
+  num_c_mods = 0;
+  num_n_mods = 0;
 
   /* initialize custom enzyme variables */
   pre_list_size = 0;
@@ -101,6 +111,7 @@ void initialize_parameters(void){
   post_for_inclusion = false;
 
   // Default comet enzyme lines
+  comet_enzyme_info_lines_.clear();
   comet_enzyme_info_lines_.push_back("0.  No_enzyme\t\t\t\t0       -           -");
   comet_enzyme_info_lines_.push_back("1.  Trypsin\t\t\t\t1      KR           P");
   comet_enzyme_info_lines_.push_back("2.  Trypsin/P\t\t\t\t1      KR           -");
@@ -13,7 +13,9 @@ class Alphabet {
   /**
    * Converts a character into an int using the global amino_hash 
    */
-  static int aminoToInt(char amino);
+  static int aminoToInt(char amino) {
+    return amino_array_[(unsigned char)amino];
+  }
 
   /**
    * Constants for iterating through all amino acids.
@@ -22,10 +24,7 @@ class Alphabet {
   static const int numAminoAcids;
 
  protected:
-  static const int AMINO_ARRAY_CAPACITY = 100;
-  static int amino_array_[AMINO_ARRAY_CAPACITY];
-  static bool amino_array_populated_;
-  static void populateAminoArray();
+  static const int amino_array_[256];
 
 };
 #endif
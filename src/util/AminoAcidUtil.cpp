@@ -37,67 +37,30 @@ string AminoAcidUtil::GetName(char c) {
   throw runtime_error("'" + string(1, c) + "' is not a valid amino acid");
 }
 
+// The masses of 'A' to 'Z', with NO_MASS for the ambiguous residues, which
+// have none; constant data, so that GetMass() is a bounds check and a load.
+#define NO_MASS -1.0
+static const double kMonoMasses[26] = {
+   71.03711,   NO_MASS, 103.00919, 115.02694, 129.04259, 147.06841, // A-F
+   57.02146, 137.05891, 113.08406, 113.08406, 128.09496, 113.08406, // G-L
+  131.04049, 114.04293, 114.07931,  97.05276, 128.05858, 156.10111, // M-R
+   87.03203, 101.04768, 150.04344,  99.06841, 186.07931,   NO_MASS, // S-X
+  163.06333,   NO_MASS // Y-Z
+};
+static const double kAverageMasses[26] = {
+    71.0788,   NO_MASS,  103.1388,  115.0886,  129.1155,  147.1766, // A-F
+    57.0519,  137.1411,  113.1594,  113.1594,  128.1741,  113.1594, // G-L
+   131.1926,  114.1038,  114.1472,   97.1167,  128.1307,  156.1875, // M-R
+    87.0782,  101.1051,  150.0388,   99.1326,  186.2132,   NO_MASS, // S-X
+   163.1760,   NO_MASS // Y-Z
+};
+#undef NO_MASS
+
 double AminoAcidUtil::GetMass(char c, bool monoisotopic) {
-  if (monoisotopic) {
-    // Monoisotopic masses
-    switch (c) {
-      case 'A': return  71.03711;
-      case 'B': return numeric_limits<double>::quiet_NaN();
-      case 'C': return 103.00919;
-      case 'D': return 115.02694;
-      case 'E': return 129.04259;
-      case 'F': return 147.06841;
-      case 'G': return  57.02146;
-      case 'H': return 137.05891;
-      case 'I': return 113.08406;
-      case 'J': return 113.08406;
-      case 'K': return 128.09496;
-      case 'L': return 113.08406;
-      case 'M': return 131.04049;
-      case 'N': return 114.04293;
-      case 'O': return 114.07931;
-      case 'P': return  97.05276;
-      case 'Q': return 128.05858;
-      case 'R': return 156.10111;
-      case 'S': return  87.03203;
-      case 'T': return 101.04768;
-      case 'U': return 150.04344;
-      case 'V': return  99.06841;
-      case 'W': return 186.07931;
-      case 'X': return numeric_limits<double>::quiet_NaN();
-      case 'Y': return 163.06333;
-      case 'Z': return numeric_limits<double>::quiet_NaN();
-    }
-  } else {
-    // Average masses
-    switch (c) {
-      case 'A': return  71.0788;
-      case 'B': return numeric_limits<double>::quiet_NaN();
-      case 'C': return 103.1388;
-      case 'D': return 115.0886;
-      case 'E': return 129.1155;
-      case 'F': return 147.1766;
-      case 'G': return  57.0519;
-      case 'H': return 137.1411;
-      case 'I': return 113.1594;
-      case 'J': return 113.1594;
-      case 'K': return 128.1741;
-      case 'L': return 113.1594;
-      case 'M': return 131.1926;
-      case 'N': return 114.1038;
-      case 'O': return 114.1472;
-      case 'P': return  97.1167;
-      case 'Q': return 128.1307;
-      case 'R': return 156.1875;
-      case 'S': return  87.0782;
-      case 'T': return 101.1051;
-      case 'U': return 150.0388;
-      case 'V': return  99.1326;
-      case 'W': return 186.2132;
-      case 'X': return numeric_limits<double>::quiet_NaN();
-      case 'Y': return 163.1760;
-      case 'Z': return numeric_limits<double>::quiet_NaN();
-    }
+  unsigned int i = (unsigned char)c - 'A';
+  if (i < 26) {
+    double mass = monoisotopic ? kMonoMasses[i] : kAverageMasses[i];
+    return mass >= 0 ? mass : numeric_limits<double>::quiet_NaN();
   }
   throw runtime_error("'" + string(1, c) + "' is not a valid amino acid");
 }
@@ -1,5 +1,8 @@
 #include "FileUtils.h"
 #include "boost/filesystem.hpp"
+#include "boost/iostreams/device/file.hpp"
+#include "boost/iostreams/filter/gzip.hpp"
+#include "boost/iostreams/filtering_stream.hpp"
 #include <fstream>
 #include <stdexcept>
 
@@ -22,6 +25,15 @@ bool FileUtils::Mkdir(const string& path) {
   return boost::filesystem::create_directory(path);
 }
 
+unsigned long long FileUtils::Size(const string& path) {
+  return boost::filesystem::file_size(path);
+}
+
+// seconds since the epoch
+long long FileUtils::ModificationTime(const string& path) {
+  return boost::filesystem::last_write_time(path);
+}
+
 void FileUtils::Rename(const string& from, const string& to) {
   if (Exists(from)) {
     boost::filesystem::rename(from, to);
@@ -52,15 +64,50 @@ string FileUtils::Read(const string& path) {
   }
 }
 
-ofstream* FileUtils::GetWriteStream(const string& path, bool overwrite) {
+// returns true if the file at path is (to be) gzip compressed, going by
+// its extension
+bool FileUtils::IsGzip(const string& path) {
+  return path.length() > 3 && path.compare(path.length() - 3, 3, ".gz") == 0;
+}
+
+// opens path for reading, decompressing it as it is read if it is gzipped;
+// the caller checks good() and deletes the stream
+istream* FileUtils::GetReadStream(const string& path, bool binary) {
+  ios::openmode mode = binary ? ios::in | ios::binary : ios::in;
+  if (!IsGzip(path)) {
+    return new ifstream(path.c_str(), mode);
+  }
+  boost::iostreams::file_source source(path, ios::in | ios::binary);
+  if (!source.is_open()) {
+    return new ifstream(path.c_str(), mode);
+  }
+  boost::iostreams::filtering_istream* stream = new boost::iostreams::filtering_istream();
+  stream->push(boost::iostreams::gzip_decompressor());
+  stream->push(source);
+  return stream;
+}
+
+// opens path for writing, gzipping what is written if path ends in .gz;
+// the gzip stream is finished when the returned stream is deleted
+ostream* FileUtils::GetWriteStream(const string& path, bool overwrite, bool binary) {
   if (Exists(path) && !overwrite) {
     return NULL;
   }
-  ofstream* stream = new ofstream(path.c_str());
-  if (!stream->good()) {
-    delete stream;
+  if (!IsGzip(path)) {
+    ofstream* stream = new ofstream(path.c_str(), binary ? ios::out | ios::binary : ios::out);
+    if (!stream->good()) {
+      delete stream;
+      return NULL;
+    }
+    return stream;
+  }
+  boost::iostreams::file_sink sink(path, ios::out | ios::binary | ios::trunc);
+  if (!sink.is_open()) {
     return NULL;
   }
+  boost::iostreams::filtering_ostream* stream = new boost::iostreams::filtering_ostream();
+  stream->push(boost::iostreams::gzip_compressor());
+  stream->push(sink);
   return stream;
 }
 
@@ -2,6 +2,7 @@
 #define FILEUTILS_H
 
 #include <fstream>
+#include <iostream>
 #include <string>
 
 class FileUtils {
@@ -10,11 +11,16 @@ class FileUtils {
   static bool IsRegularFile(const std::string& path);
   static bool IsDir(const std::string& path);
   static bool Mkdir(const std::string& path);
+  static unsigned long long Size(const std::string& path);
+  static long long ModificationTime(const std::string& path);
   static void Rename(const std::string& from, const std::string& to);
   static void Remove(const std::string& path);
   static std::string Join(const std::string& path1, const std::string& path2);
   static std::string Read(const std::string& path);
-  static std::ofstream* GetWriteStream(const std::string& path, bool overwrite);
+  static bool IsGzip(const std::string& path);
+  static std::istream* GetReadStream(const std::string& path, bool binary = false);
+  static std::ostream* GetWriteStream(const std::string& path, bool overwrite,
+                                      bool binary = false);
   static std::string BaseName(const std::string& path);
   static std::string DirName(const std::string& path);
   static std::string Stem(const std::string& path);
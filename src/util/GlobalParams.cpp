@@ -37,6 +37,14 @@ vector<int> GlobalParams::isotope_windows_;
 FLOAT_T GlobalParams::fraction_to_fit_;
 bool GlobalParams::xlink_use_ion_cache_;
 MASS_FORMAT_T GlobalParams::mod_mass_format_;
+int GlobalParams::precision_;
+int GlobalParams::mass_precision_;
+bool GlobalParams::concat_;
+bool GlobalParams::exact_p_value_;
+bool GlobalParams::file_column_;
+string GlobalParams::decoy_prefix_;
+bool GlobalParams::use_flanking_peaks_;
+bool GlobalParams::use_neutral_loss_peaks_;
 
 void GlobalParams::set() {
   isotopic_mass_ = get_mass_type_parameter("isotopic-mass");
@@ -70,6 +78,14 @@ void GlobalParams::set() {
   fraction_to_fit_ = Params::GetDouble("fraction-top-scores-to-fit");
   xlink_use_ion_cache_ = Params::GetBool("xlink-use-ion-cache");
   mod_mass_format_ = get_mass_format_type_parameter("mod-mass-format");
+  precision_ = Params::GetInt("precision");
+  mass_precision_ = Params::GetInt("mass-precision");
+  concat_ = Params::GetBool("concat");
+  exact_p_value_ = Params::GetBool("exact-p-value");
+  file_column_ = Params::GetBool("file-column");
+  decoy_prefix_ = Params::GetString("decoy-prefix");
+  use_flanking_peaks_ = Params::GetBool("use-flanking-peaks");
+  use_neutral_loss_peaks_ = Params::GetBool("use-neutral-loss-peaks");
 }
 
 const MASS_TYPE_T& GlobalParams::getIsotopicMass() {
@@ -195,3 +211,34 @@ const MASS_FORMAT_T& GlobalParams::getModMassFormat() {
   return mod_mass_format_;
 }
 
+const int& GlobalParams::getPrecision() {
+  return precision_;
+}
+
+const int& GlobalParams::getMassPrecision() {
+  return mass_precision_;
+}
+
+const bool& GlobalParams::getConcat() {
+  return concat_;
+}
+
+const bool& GlobalParams::getExactPValue() {
+  return exact_p_value_;
+}
+
+const bool& GlobalParams::getFileColumn() {
+  return file_column_;
+}
+
+const string& GlobalParams::getDecoyPrefix() {
+  return decoy_prefix_;
+}
+
+const bool& GlobalParams::getUseFlankingPeaks() {
+  return use_flanking_peaks_;
+}
+
+const bool& GlobalParams::getUseNeutralLossPeaks() {
+  return use_neutral_loss_peaks_;
+}
@@ -48,6 +48,14 @@ class GlobalParams {
   static FLOAT_T fraction_to_fit_;
   static bool xlink_use_ion_cache_;
   static MASS_FORMAT_T mod_mass_format_;
+  static int precision_;
+  static int mass_precision_;
+  static bool concat_;
+  static bool exact_p_value_;
+  static bool file_column_;
+  static std::string decoy_prefix_;
+  static bool use_flanking_peaks_;
+  static bool use_neutral_loss_peaks_;
   
  public:
   /**
@@ -90,6 +98,14 @@ class GlobalParams {
   static const FLOAT_T& getFractionToFit();
   static const bool& getXLinkUseIonCache();
   static const MASS_FORMAT_T& getModMassFormat();
+  static const int& getPrecision();
+  static const int& getMassPrecision();
+  static const bool& getConcat();
+  static const bool& getExactPValue();
+  static const bool& getFileColumn();
+  static const std::string& getDecoyPrefix();
+  static const bool& getUseFlankingPeaks();
+  static const bool& getUseNeutralLossPeaks();
 };
 
 #endif
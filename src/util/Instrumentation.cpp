@@ -0,0 +1,473 @@
+/**
+ * \file Instrumentation.cpp
+ * \brief Per-thread stage timers and counters, their JSON summary and their
+ * OpenMetrics exposition.
+ */
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#ifdef CRUX_PERF_COUNTERS
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "Instrumentation.h"
+#include "MemoryAccounting.h"
+#include "io/carp.h"
+
+using namespace std;
+
+namespace {
+
+typedef boost::atomic<long long> Total;
+
+/**
+ * Adds n to a total of the calling thread. Only the owning thread writes its
+ * totals, so a relaxed load and store do, without a locked instruction; a
+ * reader on another thread sees each total whole, at worst an update late.
+ */
+inline void Bump(Total& total, long long n) {
+  total.store(total.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+}
+
+inline long long Get(const Total& total) {
+  return total.load(boost::memory_order_relaxed);
+}
+
+void Zero(Total* totals, int n) {
+  for (int i = 0; i < n; ++i) {
+    totals[i].store(0, boost::memory_order_relaxed);
+  }
+}
+
+struct ThreadTotals {
+  Total time[NUMBER_INSTRUMENT_STAGES]; ///< us
+  Total calls[NUMBER_INSTRUMENT_STAGES];
+  Total buckets[NUMBER_INSTRUMENT_STAGES][NUMBER_LATENCY_BUCKETS];
+  Total counts[NUMBER_INSTRUMENT_COUNTERS];
+  Total perf[NUMBER_INSTRUMENT_STAGES][NUMBER_PERF_COUNTERS];
+  Total perf_calls[NUMBER_INSTRUMENT_STAGES]; ///< calls with perf counts
+  int perf_fd; ///< group leader, -1 if the counters could not be opened
+  bool perf_opened;
+  ThreadTotals() : perf_fd(-1), perf_opened(false) {
+    Zero(time, NUMBER_INSTRUMENT_STAGES);
+    Zero(calls, NUMBER_INSTRUMENT_STAGES);
+    Zero(&buckets[0][0], NUMBER_INSTRUMENT_STAGES * NUMBER_LATENCY_BUCKETS);
+    Zero(counts, NUMBER_INSTRUMENT_COUNTERS);
+    Zero(&perf[0][0], NUMBER_INSTRUMENT_STAGES * NUMBER_PERF_COUNTERS);
+    Zero(perf_calls, NUMBER_INSTRUMENT_STAGES);
+  }
+};
+
+/**
+ * The bucket of a call of elapsed us: the first whose bound of 2^b us is not
+ * below it.
+ */
+inline int LatencyBucket(long long elapsed) {
+  int bucket = 0;
+  while (bucket < NUMBER_LATENCY_BUCKETS - 1 && (1LL << bucket) < elapsed) {
+    ++bucket;
+  }
+  return bucket;
+}
+
+#ifdef CRUX_PERF_COUNTERS
+/**
+ * Opens one counter of the calling thread, in the group of group_fd (or as
+ * the leader of a new group if it is -1). Returns the descriptor, or -1.
+ */
+int OpenPerfCounter(unsigned int type, unsigned long long config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = group_fd == -1 ? 1 : 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/**
+ * Opens the counters of PERF_COUNTER_T, in that order, as one group so that
+ * they are read together and scheduled onto the PMU together.
+ */
+int OpenPerfGroup() {
+  static const unsigned long long kDtlbReadMiss =
+    PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  int leader = OpenPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (leader == -1) {
+    return -1;
+  }
+  int members[] = {
+    OpenPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, leader),
+    OpenPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, leader),
+    OpenPerfCounter(PERF_TYPE_HW_CACHE, kDtlbReadMiss, leader)
+  };
+  for (int i = 0; i < NUMBER_PERF_COUNTERS - 1; ++i) {
+    if (members[i] == -1) {
+      for (int j = 0; j < NUMBER_PERF_COUNTERS - 1; ++j) {
+        if (members[j] != -1) {
+          close(members[j]);
+        }
+      }
+      close(leader);
+      return -1;
+    }
+  }
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return leader;
+}
+#endif
+
+// The totals outlive their threads, so they are owned by all_totals rather
+// than by the thread_specific_ptr, whose cleanup only closes the thread's
+// counters (their counts after the thread has gone would be meaningless).
+void CloseCounters(ThreadTotals* totals) {
+#ifdef CRUX_PERF_COUNTERS
+  if (totals->perf_fd != -1) {
+    close(totals->perf_fd);
+    totals->perf_fd = -1;
+  }
+#endif
+}
+
+boost::thread_specific_ptr<ThreadTotals> thread_totals(CloseCounters);
+boost::mutex all_totals_mutex;
+vector<ThreadTotals*> all_totals;
+
+ThreadTotals* Totals() {
+  ThreadTotals* totals = thread_totals.get();
+  if (totals == NULL) {
+    totals = new ThreadTotals();
+    thread_totals.reset(totals);
+    boost::mutex::scoped_lock lock(all_totals_mutex);
+    all_totals.push_back(totals);
+  }
+  return totals;
+}
+
+}
+
+void Instrumentation::Add(
+  INSTRUMENT_STAGE_T stage,
+  double elapsed,
+  const long long* perf_counts
+) {
+  ThreadTotals* totals = Totals();
+  // wall_clock() counts whole microseconds.
+  long long us = (long long)elapsed;
+  Bump(totals->time[stage], us);
+  Bump(totals->calls[stage], 1);
+  Bump(totals->buckets[stage][LatencyBucket(us)], 1);
+  if (perf_counts != NULL) {
+    for (int i = 0; i < NUMBER_PERF_COUNTERS; ++i) {
+      Bump(totals->perf[stage][i], perf_counts[i]);
+    }
+    Bump(totals->perf_calls[stage], 1);
+  }
+}
+
+bool Instrumentation::ReadPerfCounters(long long counts[NUMBER_PERF_COUNTERS]) {
+#ifdef CRUX_PERF_COUNTERS
+  ThreadTotals* totals = Totals();
+  if (!totals->perf_opened) {
+    totals->perf_opened = true;
+    totals->perf_fd = OpenPerfGroup();
+    if (totals->perf_fd == -1) {
+      carp_once(CARP_WARNING, "Hardware performance counters are not available; "
+                "only times will be reported.");
+    }
+  }
+  if (totals->perf_fd == -1) {
+    return false;
+  }
+  // PERF_FORMAT_GROUP: the number of counters, then their values in order
+  unsigned long long buf[1 + NUMBER_PERF_COUNTERS];
+  if (read(totals->perf_fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf) ||
+      buf[0] != NUMBER_PERF_COUNTERS) {
+    return false;
+  }
+  for (int i = 0; i < NUMBER_PERF_COUNTERS; ++i) {
+    counts[i] = (long long)buf[1 + i];
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Instrumentation::Count(INSTRUMENT_COUNTER_T counter, long long n) {
+  Bump(Totals()->counts[counter], n);
+}
+
+const char* Instrumentation::StageName(INSTRUMENT_STAGE_T stage) {
+  switch (stage) {
+  case STAGE_SPECTRUM_LOAD: return "spectrum-load";
+  case STAGE_SPECTRUM_SORT: return "spectrum-sort";
+  case STAGE_ACTIVE_RANGE: return "set-active-range";
+  case STAGE_PEPTIDE_READ: return "peptide-read";
+  case STAGE_PEAK_GENERATION: return "peak-generation";
+  case STAGE_PEAK_COMPILE: return "peak-compile";
+  case STAGE_PREPROCESS: return "preprocess-spectrum";
+  case STAGE_SCORE: return "score";
+  case STAGE_REPORT: return "report";
+  case STAGE_OUTPUT: return "output";
+  case STAGE_REALTIME_SEARCH: return "realtime-search";
+  default: return "unknown";
+  }
+}
+
+const char* Instrumentation::PerfCounterName(PERF_COUNTER_T counter) {
+  switch (counter) {
+  case PERF_CYCLES: return "cycles";
+  case PERF_INSTRUCTIONS: return "instructions";
+  case PERF_CACHE_MISSES: return "cache-misses";
+  case PERF_DTLB_MISSES: return "dtlb-misses";
+  default: return "unknown";
+  }
+}
+
+/**
+ * Writes the hardware counts of one stage, and its instructions per cycle,
+ * as JSON members following others.
+ */
+static void WritePerfCounts(ofstream& out, const long long* counts) {
+  for (int i = 0; i < NUMBER_PERF_COUNTERS; ++i) {
+    out << ", \"" << Instrumentation::PerfCounterName((PERF_COUNTER_T)i) << "\": "
+        << counts[i];
+  }
+  out << ", \"ipc\": " << (counts[PERF_CYCLES] > 0 ?
+    (double)counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES] : 0.0);
+}
+
+const char* Instrumentation::CounterName(INSTRUMENT_COUNTER_T counter) {
+  switch (counter) {
+  case COUNTER_CANDIDATES_SCORED: return "candidates-scored";
+  case COUNTER_BYTES_WRITTEN: return "bytes-written";
+  case COUNTER_SPECTRA_SEARCHED: return "spectra-searched";
+  default: return "unknown";
+  }
+}
+
+void Instrumentation::WriteSummary(const string& path) {
+  boost::mutex::scoped_lock lock(all_totals_mutex);
+  ofstream out(path.c_str());
+  if (!out.good()) {
+    carp(CARP_ERROR, "Could not write instrumentation summary to %s", path.c_str());
+    return;
+  }
+  bool perf = false;
+  for (vector<ThreadTotals*>::const_iterator i = all_totals.begin();
+       i != all_totals.end(); ++i) {
+    for (int stage = 0; stage < NUMBER_INSTRUMENT_STAGES; ++stage) {
+      perf = perf || Get((*i)->perf_calls[stage]) > 0;
+    }
+  }
+  out << "{\n  \"threads\": " << all_totals.size()
+#ifdef CRUX_PERF_COUNTERS
+      << ",\n  \"perf-counters\": " << (perf ? "true" : "false")
+#endif
+      << ",\n  \"stages\": {";
+  for (int stage = 0; stage < NUMBER_INSTRUMENT_STAGES; ++stage) {
+    double seconds = 0, max_thread_seconds = 0;
+    long long calls = 0;
+    long long perf_counts[NUMBER_PERF_COUNTERS] = {0};
+    for (vector<ThreadTotals*>::const_iterator i = all_totals.begin();
+         i != all_totals.end(); ++i) {
+      seconds += Get((*i)->time[stage]) / 1e6;
+      max_thread_seconds = max(max_thread_seconds, Get((*i)->time[stage]) / 1e6);
+      calls += Get((*i)->calls[stage]);
+      for (int j = 0; j < NUMBER_PERF_COUNTERS; ++j) {
+        perf_counts[j] += Get((*i)->perf[stage][j]);
+      }
+    }
+    out << (stage > 0 ? "," : "") << "\n    \""
+        << StageName((INSTRUMENT_STAGE_T)stage) << "\": {\"calls\": " << calls
+        << ", \"seconds\": " << seconds
+        << ", \"max-thread-seconds\": " << max_thread_seconds;
+    if (perf) {
+      WritePerfCounts(out, perf_counts);
+    }
+    out << "}";
+  }
+  if (perf) {
+    // Per thread, to tell a thread that waits on memory from one that computes
+    out << "\n  },\n  \"thread-stages\": [";
+    for (size_t i = 0; i < all_totals.size(); ++i) {
+      const ThreadTotals* totals = all_totals[i];
+      out << (i > 0 ? "," : "") << "\n    {";
+      bool first = true;
+      for (int stage = 0; stage < NUMBER_INSTRUMENT_STAGES; ++stage) {
+        if (Get(totals->perf_calls[stage]) == 0) {
+          continue;
+        }
+        long long perf_counts[NUMBER_PERF_COUNTERS];
+        for (int j = 0; j < NUMBER_PERF_COUNTERS; ++j) {
+          perf_counts[j] = Get(totals->perf[stage][j]);
+        }
+        out << (first ? "" : ",") << "\n      \"" << StageName((INSTRUMENT_STAGE_T)stage)
+            << "\": {\"calls\": " << Get(totals->perf_calls[stage])
+            << ", \"seconds\": " << Get(totals->time[stage]) / 1e6;
+        WritePerfCounts(out, perf_counts);
+        out << "}";
+        first = false;
+      }
+      out << "\n    }";
+    }
+    out << "\n  ]";
+  } else {
+    out << "\n  }";
+  }
+  out << ",\n  \"counters\": {";
+  for (int counter = 0; counter < NUMBER_INSTRUMENT_COUNTERS; ++counter) {
+    long long total = 0;
+    for (vector<ThreadTotals*>::const_iterator i = all_totals.begin();
+         i != all_totals.end(); ++i) {
+      total += Get((*i)->counts[counter]);
+    }
+    out << (counter > 0 ? "," : "") << "\n    \""
+        << CounterName((INSTRUMENT_COUNTER_T)counter) << "\": " << total;
+  }
+  out << "\n  },\n  \"peak-memory-bytes\": {";
+  for (int subsystem = 0; subsystem < NUMBER_MEMORY_SUBSYSTEMS; ++subsystem) {
+    out << (subsystem > 0 ? "," : "") << "\n    \""
+        << MemoryAccounting::Name((MEMORY_SUBSYSTEM_T)subsystem) << "\": "
+        << MemoryAccounting::Peak((MEMORY_SUBSYSTEM_T)subsystem);
+  }
+  out << ",\n    \"total\": " << MemoryAccounting::PeakTotal();
+  out << "\n  }\n}\n";
+  carp(CARP_INFO, "Wrote instrumentation summary to %s", path.c_str());
+}
+
+/**
+ * A name of Instrumentation or MemoryAccounting as part of a metric name.
+ */
+static string MetricName(const char* name) {
+  string metric(name);
+  replace(metric.begin(), metric.end(), '-', '_');
+  return metric;
+}
+
+static void WriteFamily(ostringstream& out, const string& name, const char* type,
+                        const char* help) {
+  out << "# TYPE " << name << ' ' << type << "\n# HELP " << name << ' ' << help << '\n';
+}
+
+string Instrumentation::OpenMetrics() {
+  ostringstream out;
+  out.precision(12);
+#ifdef CRUX_INSTRUMENT
+  {
+    // Only a thread's first timed stage waits for this lock.
+    boost::mutex::scoped_lock lock(all_totals_mutex);
+    WriteFamily(out, "crux_instrumented_threads", "gauge",
+                "Threads that have timed a stage or counted.");
+    out << "crux_instrumented_threads " << all_totals.size() << '\n';
+
+    WriteFamily(out, "crux_stage_duration_seconds", "histogram",
+                "Duration of the calls of each stage of a search, over all threads.");
+    for (int stage = 0; stage < NUMBER_INSTRUMENT_STAGES; ++stage) {
+      const char* name = StageName((INSTRUMENT_STAGE_T)stage);
+      long long buckets[NUMBER_LATENCY_BUCKETS] = {0};
+      long long us = 0;
+      for (vector<ThreadTotals*>::const_iterator i = all_totals.begin();
+           i != all_totals.end(); ++i) {
+        for (int b = 0; b < NUMBER_LATENCY_BUCKETS; ++b) {
+          buckets[b] += Get((*i)->buckets[stage][b]);
+        }
+        us += Get((*i)->time[stage]);
+      }
+      // The count is that of the buckets, so that it agrees with them even
+      // while the threads add calls.
+      long long count = 0;
+      for (int b = 0; b < NUMBER_LATENCY_BUCKETS; ++b) {
+        count += buckets[b];
+        out << "crux_stage_duration_seconds_bucket{stage=\"" << name << "\",le=\"";
+        if (b < NUMBER_LATENCY_BUCKETS - 1) {
+          out << (1LL << b) / 1e6;
+        } else {
+          out << "+Inf";
+        }
+        out << "\"} " << count << '\n';
+      }
+      out << "crux_stage_duration_seconds_count{stage=\"" << name << "\"} " << count << '\n'
+          << "crux_stage_duration_seconds_sum{stage=\"" << name << "\"} " << us / 1e6 << '\n';
+    }
+
+    // Per thread, to tell a thread that falls behind
+    WriteFamily(out, "crux_thread_stage_seconds", "counter",
+                "Time each thread has spent in each stage.");
+    for (size_t i = 0; i < all_totals.size(); ++i) {
+      for (int stage = 0; stage < NUMBER_INSTRUMENT_STAGES; ++stage) {
+        if (Get(all_totals[i]->calls[stage]) > 0) {
+          out << "crux_thread_stage_seconds_total{thread=\"" << i << "\",stage=\""
+              << StageName((INSTRUMENT_STAGE_T)stage) << "\"} "
+              << Get(all_totals[i]->time[stage]) / 1e6 << '\n';
+        }
+      }
+    }
+
+#ifdef CRUX_PERF_COUNTERS
+    WriteFamily(out, "crux_stage_perf_events", "counter",
+                "Hardware events counted in each stage, over all threads.");
+    for (int stage = 0; stage < NUMBER_INSTRUMENT_STAGES; ++stage) {
+      for (int j = 0; j < NUMBER_PERF_COUNTERS; ++j) {
+        long long total = 0;
+        for (vector<ThreadTotals*>::const_iterator i = all_totals.begin();
+             i != all_totals.end(); ++i) {
+          total += Get((*i)->perf[stage][j]);
+        }
+        out << "crux_stage_perf_events_total{stage=\""
+            << StageName((INSTRUMENT_STAGE_T)stage) << "\",event=\""
+            << PerfCounterName((PERF_COUNTER_T)j) << "\"} " << total << '\n';
+      }
+    }
+#endif
+
+    for (int counter = 0; counter < NUMBER_INSTRUMENT_COUNTERS; ++counter) {
+      long long total = 0;
+      for (vector<ThreadTotals*>::const_iterator i = all_totals.begin();
+           i != all_totals.end(); ++i) {
+        total += Get((*i)->counts[counter]);
+      }
+      string name = "crux_" + MetricName(CounterName((INSTRUMENT_COUNTER_T)counter));
+      WriteFamily(out, name, "counter", "Instrumentation counter, over all threads.");
+      out << name << "_total " << total << '\n';
+    }
+  }
+#endif
+
+  WriteFamily(out, "crux_memory_bytes", "gauge",
+              "Memory held by each subsystem, as MemoryAccounting estimates it.");
+  for (int subsystem = 0; subsystem < NUMBER_MEMORY_SUBSYSTEMS; ++subsystem) {
+    out << "crux_memory_bytes{subsystem=\""
+        << MemoryAccounting::Name((MEMORY_SUBSYSTEM_T)subsystem) << "\"} "
+        << MemoryAccounting::Current((MEMORY_SUBSYSTEM_T)subsystem) << '\n';
+  }
+  WriteFamily(out, "crux_memory_peak_bytes", "gauge",
+              "The most memory each subsystem, and all of them at once, have held.");
+  for (int subsystem = 0; subsystem < NUMBER_MEMORY_SUBSYSTEMS; ++subsystem) {
+    out << "crux_memory_peak_bytes{subsystem=\""
+        << MemoryAccounting::Name((MEMORY_SUBSYSTEM_T)subsystem) << "\"} "
+        << MemoryAccounting::Peak((MEMORY_SUBSYSTEM_T)subsystem) << '\n';
+  }
+  out << "crux_memory_peak_bytes{subsystem=\"total\"} " << MemoryAccounting::PeakTotal()
+      << "\n# EOF\n";
+  return out.str();
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,154 @@
+/**
+ * \file Instrumentation.h
+ * \brief Scoped timers and counters around the main stages of a search.
+ *
+ * Built only when CRUX_INSTRUMENT is defined (cmake -DCRUX_INSTRUMENT=ON);
+ * otherwise CRUX_TIME_STAGE and CRUX_COUNT expand to nothing. Each thread
+ * adds into totals of its own, so timing costs two clock reads and no
+ * locking; the totals of all threads are summed when the summary is
+ * written. Stages nest, and each is timed inclusively of the stages it
+ * calls.
+ *
+ * With CRUX_PERF_COUNTERS also defined (cmake -DCRUX_PERF_COUNTERS=ON, Linux
+ * only), each stage also counts the cycles, instructions, cache misses and
+ * data TLB misses of its thread, read with perf_event_open(2) from a group of
+ * counters that each thread opens on its first timed stage. If the kernel
+ * refuses the counters (see /proc/sys/kernel/perf_event_paranoid), stages
+ * are timed as before and the summary reports the counters as unavailable.
+ *
+ * Each stage also keeps a histogram of the durations of its calls, in
+ * buckets doubling from 1 us. The totals, histograms and memory accounting
+ * can be read while the search runs, in OpenMetrics text (see metrics-port
+ * and MetricsServer.h): the totals are atomics that only their own thread
+ * writes, with plain loads and stores, so a reader never stalls a search.
+ */
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <string>
+#include "util/utils.h"
+
+enum INSTRUMENT_STAGE_T {
+  STAGE_SPECTRUM_LOAD,     ///< reading a spectrum records file
+  STAGE_SPECTRUM_SORT,     ///< SpectrumCollection::Sort()
+  STAGE_ACTIVE_RANGE,      ///< ActivePeptideQueue::SetActiveRange()
+  STAGE_PEPTIDE_READ,      ///< reading a peptide from the index
+  STAGE_PEAK_GENERATION,   ///< theoretical peaks of a peptide
+  STAGE_PEAK_COMPILE,      ///< compiling a peptide's peaks for scoring
+  STAGE_PREPROCESS,        ///< ObservedPeakSet::PreprocessSpectrum()
+  STAGE_SCORE,             ///< collectScoresCompiled()
+  STAGE_REPORT,            ///< TideMatchSet::report()
+  STAGE_OUTPUT,            ///< writing results files
+  STAGE_REALTIME_SEARCH,   ///< TideRealtimeSearch::search()
+  NUMBER_INSTRUMENT_STAGES
+};
+
+enum PERF_COUNTER_T {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_DTLB_MISSES,
+  NUMBER_PERF_COUNTERS
+};
+
+enum INSTRUMENT_COUNTER_T {
+  COUNTER_CANDIDATES_SCORED,
+  COUNTER_BYTES_WRITTEN,
+  COUNTER_SPECTRA_SEARCHED,   ///< spectrum-charge pairs scored
+  NUMBER_INSTRUMENT_COUNTERS
+};
+
+/**
+ * The duration histograms have buckets up to 1, 2, 4, ... 2^20 us and one
+ * beyond.
+ */
+static const int NUMBER_LATENCY_BUCKETS = 22;
+
+class Instrumentation {
+ public:
+  /**
+   * Times the enclosing scope as the given stage.
+   */
+  class ScopedTimer {
+   public:
+#ifdef CRUX_PERF_COUNTERS
+    explicit ScopedTimer(INSTRUMENT_STAGE_T stage)
+      : stage_(stage), counted_(ReadPerfCounters(start_counts_)), start_(wall_clock()) {}
+    ~ScopedTimer() {
+      double elapsed = wall_clock() - start_;
+      long long end_counts[NUMBER_PERF_COUNTERS];
+      if (counted_ && ReadPerfCounters(end_counts)) {
+        for (int i = 0; i < NUMBER_PERF_COUNTERS; ++i) {
+          end_counts[i] -= start_counts_[i];
+        }
+        Add(stage_, elapsed, end_counts);
+      } else {
+        Add(stage_, elapsed);
+      }
+    }
+   private:
+    INSTRUMENT_STAGE_T stage_;
+    long long start_counts_[NUMBER_PERF_COUNTERS];
+    bool counted_;
+    double start_;
+#else
+    explicit ScopedTimer(INSTRUMENT_STAGE_T stage)
+      : stage_(stage), start_(wall_clock()) {}
+    ~ScopedTimer() { Add(stage_, wall_clock() - start_); }
+   private:
+    INSTRUMENT_STAGE_T stage_;
+    double start_;
+#endif
+  };
+
+  /**
+   * Adds one call of the given duration (us) to the stage, and the hardware
+   * counts of the call if there are any.
+   */
+  static void Add(INSTRUMENT_STAGE_T stage, double elapsed,
+                  const long long* perf_counts = NULL);
+
+  /**
+   * Reads the calling thread's hardware counters into counts, opening them
+   * on the first call. Returns false if they are not available.
+   */
+  static bool ReadPerfCounters(long long counts[NUMBER_PERF_COUNTERS]);
+
+  static void Count(INSTRUMENT_COUNTER_T counter, long long n);
+
+  /**
+   * Writes the totals of all threads so far as JSON.
+   */
+  static void WriteSummary(const std::string& path);
+
+  /**
+   * \returns the totals of all threads so far, the duration histograms and
+   * the memory accounting, as OpenMetrics text.
+   */
+  static std::string OpenMetrics();
+
+  static const char* StageName(INSTRUMENT_STAGE_T stage);
+  static const char* CounterName(INSTRUMENT_COUNTER_T counter);
+  static const char* PerfCounterName(PERF_COUNTER_T counter);
+};
+
+#define CRUX_INSTRUMENT_CAT2(a, b) a##b
+#define CRUX_INSTRUMENT_CAT(a, b) CRUX_INSTRUMENT_CAT2(a, b)
+
+#ifdef CRUX_INSTRUMENT
+#define CRUX_TIME_STAGE(stage) \
+  Instrumentation::ScopedTimer CRUX_INSTRUMENT_CAT(crux_stage_timer_, __LINE__)(stage)
+#define CRUX_COUNT(counter, n) Instrumentation::Count(counter, n)
+#else
+#define CRUX_TIME_STAGE(stage)
+#define CRUX_COUNT(counter, n)
+#endif
+
+#endif // INSTRUMENTATION_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
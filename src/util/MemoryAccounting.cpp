@@ -0,0 +1,78 @@
+/**
+ * \file MemoryAccounting.cpp
+ * \brief Byte counts of the main consumers of memory.
+ */
+#include <boost/atomic.hpp>
+#include "MemoryAccounting.h"
+#include "io/carp.h"
+
+namespace {
+
+boost::atomic<long long> current_bytes[NUMBER_MEMORY_SUBSYSTEMS];
+boost::atomic<long long> peak_bytes[NUMBER_MEMORY_SUBSYSTEMS];
+boost::atomic<long long> current_total(0);
+boost::atomic<long long> peak_total(0);
+
+void RaisePeak(boost::atomic<long long>& peak, long long value) {
+  long long seen = peak.load(boost::memory_order_relaxed);
+  while (value > seen &&
+         !peak.compare_exchange_weak(seen, value, boost::memory_order_relaxed)) {
+  }
+}
+
+}
+
+void MemoryAccounting::Add(MEMORY_SUBSYSTEM_T subsystem, long long bytes) {
+  if (bytes == 0) {
+    return;
+  }
+  long long now = current_bytes[subsystem].fetch_add(bytes, boost::memory_order_relaxed) + bytes;
+  long long total = current_total.fetch_add(bytes, boost::memory_order_relaxed) + bytes;
+  if (bytes > 0) {
+    RaisePeak(peak_bytes[subsystem], now);
+    RaisePeak(peak_total, total);
+  }
+}
+
+long long MemoryAccounting::Current(MEMORY_SUBSYSTEM_T subsystem) {
+  return current_bytes[subsystem].load(boost::memory_order_relaxed);
+}
+
+long long MemoryAccounting::Peak(MEMORY_SUBSYSTEM_T subsystem) {
+  return peak_bytes[subsystem].load(boost::memory_order_relaxed);
+}
+
+long long MemoryAccounting::PeakTotal() {
+  return peak_total.load(boost::memory_order_relaxed);
+}
+
+void MemoryAccounting::LogPeaks() {
+  for (int i = 0; i < NUMBER_MEMORY_SUBSYSTEMS; ++i) {
+    MEMORY_SUBSYSTEM_T subsystem = (MEMORY_SUBSYSTEM_T)i;
+    if (Peak(subsystem) > 0) {
+      carp(CARP_INFO, "Peak memory of %s: %.1f MB", Name(subsystem),
+           Peak(subsystem) / 1048576.0);
+    }
+  }
+  carp(CARP_INFO, "Peak memory of all of these at once: %.1f MB",
+       PeakTotal() / 1048576.0);
+}
+
+const char* MemoryAccounting::Name(MEMORY_SUBSYSTEM_T subsystem) {
+  switch (subsystem) {
+  case MEMORY_SPECTRA: return "spectra";
+  case MEMORY_PEPTIDE_WINDOW: return "peptide-window";
+  case MEMORY_FIFO_PROGRAMS: return "fifo-programs";
+  case MEMORY_PROTEINS: return "proteins";
+  case MEMORY_MATCHES: return "matches";
+  case MEMORY_OUTPUT_BUFFERS: return "output-buffers";
+  default: return "unknown";
+  }
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
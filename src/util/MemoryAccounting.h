@@ -0,0 +1,55 @@
+/**
+ * \file MemoryAccounting.h
+ * \brief Byte counts of the main consumers of memory, and their high-water
+ * marks.
+ *
+ * Each subsystem reports the memory it holds as it grows and shrinks, at a
+ * coarse grain (a spectrum file, a FIFO page, a batch of results), so the
+ * counts are always kept. They are estimates of what the data structures
+ * hold, not of what the heap has handed out. The peaks are logged at the
+ * end of a search and included in the instrumentation summary.
+ */
+#ifndef MEMORYACCOUNTING_H
+#define MEMORYACCOUNTING_H
+
+enum MEMORY_SUBSYSTEM_T {
+  MEMORY_SPECTRA,          ///< SpectrumCollection
+  MEMORY_PEPTIDE_WINDOW,   ///< FIFO pages of ActivePeptideQueue peptides
+  MEMORY_FIFO_PROGRAMS,    ///< FIFO pages of compiled programs and peak lists
+  MEMORY_PROTEINS,         ///< proteins and auxiliary locations of an index
+  MEMORY_MATCHES,          ///< MatchCollection
+  MEMORY_OUTPUT_BUFFERS,   ///< search results waiting to be written
+  NUMBER_MEMORY_SUBSYSTEMS
+};
+
+class MemoryAccounting {
+ public:
+  /**
+   * Adds bytes (negative when memory is given back) to the subsystem's count.
+   */
+  static void Add(MEMORY_SUBSYSTEM_T subsystem, long long bytes);
+
+  static long long Current(MEMORY_SUBSYSTEM_T subsystem);
+  static long long Peak(MEMORY_SUBSYSTEM_T subsystem);
+
+  /**
+   * The highest total of all subsystems at any one time.
+   */
+  static long long PeakTotal();
+
+  /**
+   * Logs the peak of each subsystem that used any memory.
+   */
+  static void LogPeaks();
+
+  static const char* Name(MEMORY_SUBSYSTEM_T subsystem);
+};
+
+#endif // MEMORYACCOUNTING_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,138 @@
+/**
+ * \file MetricsServer.cpp
+ * \brief Serves the instrumentation and memory accounting over HTTP.
+ */
+#include <sstream>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "MetricsServer.h"
+#include "Instrumentation.h"
+#include "io/carp.h"
+
+using namespace std;
+using namespace boost::asio;
+
+namespace {
+
+boost::mutex start_mutex;
+bool started = false;
+
+// How long a client has to send its request, and then to read the answer,
+// and the longest request that is read.
+const int REQUEST_SECONDS = 5;
+const size_t MAX_REQUEST_BYTES = 8192;
+
+void Done(deadline_timer* timer, boost::system::error_code* result,
+          const boost::system::error_code& ec, size_t) {
+  *result = ec;
+  timer->cancel();
+}
+
+void TimedOut(ip::tcp::socket* sock, const boost::system::error_code& ec) {
+  if (ec != error::operation_aborted) {
+    boost::system::error_code ignored;
+    sock->close(ignored);
+  }
+}
+
+/**
+ * Runs the read or write that has just been started on sock, closing sock if
+ * it does not finish in time. Returns the error it finished with.
+ */
+boost::system::error_code RunTimed(io_service* service, ip::tcp::socket& sock,
+                                   deadline_timer& timer, boost::system::error_code& result) {
+  timer.expires_from_now(boost::posix_time::seconds(REQUEST_SECONDS));
+  timer.async_wait(boost::bind(TimedOut, &sock, boost::asio::placeholders::error));
+  service->reset();
+  service->run();
+  return result;
+}
+
+/**
+ * Answers one request of a connection, and closes it.
+ */
+void Answer(io_service* service, ip::tcp::socket& sock) {
+  boost::system::error_code ec;
+  deadline_timer timer(*service);
+  boost::asio::streambuf request(MAX_REQUEST_BYTES);
+  async_read_until(sock, request, "\r\n\r\n",
+                   boost::bind(Done, &timer, &ec, boost::asio::placeholders::error,
+                               boost::asio::placeholders::bytes_transferred));
+  if (RunTimed(service, sock, timer, ec)) {
+    sock.close(ec);
+    return;
+  }
+  istream request_stream(&request);
+  string method, path;
+  request_stream >> method >> path;
+
+  string status, type, body;
+  if (method == "GET" && (path == "/metrics" || path.compare(0, 9, "/metrics?") == 0)) {
+    status = "200 OK";
+    type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    body = Instrumentation::OpenMetrics();
+  } else {
+    status = "404 Not Found";
+    type = "text/plain; charset=utf-8";
+    body = "Metrics are served at /metrics\n";
+  }
+  ostringstream response;
+  response << "HTTP/1.1 " << status << "\r\n"
+           << "Content-Type: " << type << "\r\n"
+           << "Content-Length: " << body.length() << "\r\n"
+           << "Connection: close\r\n"
+           << "\r\n" << body;
+  string answer = response.str();
+  async_write(sock, buffer(answer),
+              boost::bind(Done, &timer, &ec, boost::asio::placeholders::error,
+                          boost::asio::placeholders::bytes_transferred));
+  RunTimed(service, sock, timer, ec);
+  sock.shutdown(ip::tcp::socket::shutdown_both, ec);
+  sock.close(ec);
+}
+
+void Serve(io_service* service, ip::tcp::acceptor* acceptor) {
+  for (;;) {
+    ip::tcp::socket sock(*service);
+    boost::system::error_code ec;
+    acceptor->accept(sock, ec);
+    if (!ec) {
+      Answer(service, sock);
+    }
+  }
+}
+
+}
+
+void MetricsServer::Start(const string& address, int port) {
+  boost::mutex::scoped_lock lock(start_mutex);
+  if (started) {
+    return;
+  }
+  // Both live as long as the process, as the thread that serves does.
+  io_service* service = new io_service();
+  ip::tcp::acceptor* acceptor = NULL;
+  try {
+    acceptor = new ip::tcp::acceptor(*service,
+      ip::tcp::endpoint(ip::address::from_string(address), (unsigned short)port));
+    boost::thread server(Serve, service, acceptor);
+    server.detach();
+  } catch (const std::exception& e) {
+    carp(CARP_WARNING, "Cannot serve metrics on %s port %d: %s", address.c_str(), port,
+         e.what());
+    delete acceptor;
+    delete service;
+    return;
+  }
+  started = true;
+  carp(CARP_INFO, "Serving metrics at http://%s:%d/metrics", address.c_str(), port);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
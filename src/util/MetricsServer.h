@@ -0,0 +1,39 @@
+/**
+ * \file MetricsServer.h
+ * \brief Serves the instrumentation and memory accounting of a running
+ * command over HTTP, in OpenMetrics text, for Prometheus to scrape.
+ *
+ * The server is one thread that answers a request at a time, started by
+ * CruxApplication::initialize() when metrics-port is given, and it runs
+ * until the process exits. A client has a few seconds to send its request
+ * and read the answer, so that one that stalls cannot hold up later
+ * scrapes. There is no authentication, so by default only this machine can
+ * connect (see metrics-address). A request for /metrics is answered with
+ * Instrumentation::OpenMetrics(), which reads the totals of the search
+ * threads without waiting on them; any other path gets a 404. The stage
+ * histograms and counters are there only in builds with CRUX_INSTRUMENT;
+ * the memory of each subsystem always is.
+ */
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <string>
+
+class MetricsServer {
+ public:
+  /**
+   * Starts serving on port of the interface with address, unless the server
+   * is already running. An address or port that cannot be bound is logged,
+   * and the command runs on without the server.
+   */
+  static void Start(const std::string& address, int port);
+};
+
+#endif // METRICSSERVER_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,96 @@
+/**
+ * \file ParallelSort.h
+ * \brief Stable sort of a random access range on several threads.
+ *
+ * The range is cut into one part per thread, the parts are sorted at the
+ * same time, and neighbouring parts are then merged pairwise, also in
+ * parallel, until one sorted range is left.
+ */
+#ifndef PARALLEL_SORT_H
+#define PARALLEL_SORT_H
+
+#include <algorithm>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "Params.h"
+#include "ThreadPool.h"
+
+class ParallelSort {
+ public:
+  /**
+   * \returns The number of threads given by num-threads, or the number of
+   * cores if it is 0.
+   */
+  static int NumThreads() {
+    int num_threads = Params::GetInt("num-threads");
+    if (num_threads < 1) {
+      num_threads = boost::thread::hardware_concurrency();
+    }
+    return num_threads < 1 ? 1 : num_threads;
+  }
+
+  /**
+   * Sorts [begin, end) like std::stable_sort, on up to num_threads threads.
+   */
+  template<typename RandomIt, typename Compare>
+  static void Sort(RandomIt begin, RandomIt end, Compare comp,
+                   int num_threads = NumThreads()) {
+    const size_t kMinPartSize = 1 << 16; // not worth a thread below this
+    size_t size = end - begin;
+    if (num_threads > (int) (size / kMinPartSize)) {
+      num_threads = size / kMinPartSize;
+    }
+    if (num_threads < 2) {
+      std::stable_sort(begin, end, comp);
+      return;
+    }
+
+    std::vector<RandomIt> cuts;
+    for (int i = 0; i <= num_threads; i++) {
+      cuts.push_back(begin + size * i / num_threads);
+    }
+    ThreadPool::TaskGroup sorters;
+    for (int i = 0; i < num_threads; i++) {
+      sorters.Run(boost::bind(&ParallelSort::SortPart<RandomIt, Compare>,
+                                        cuts[i], cuts[i + 1], comp));
+    }
+    sorters.Wait();
+
+    while (cuts.size() > 2) {
+      std::vector<RandomIt> merged(1, cuts[0]);
+      ThreadPool::TaskGroup mergers;
+      for (size_t i = 0; i + 2 < cuts.size(); i += 2) {
+        mergers.Run(boost::bind(&ParallelSort::MergeParts<RandomIt, Compare>,
+                                          cuts[i], cuts[i + 1], cuts[i + 2], comp));
+        merged.push_back(cuts[i + 2]);
+      }
+      // An odd part out waits for the next round
+      if ((cuts.size() - 1) % 2 == 1) {
+        merged.push_back(cuts.back());
+      }
+      mergers.Wait();
+      cuts.swap(merged);
+    }
+  }
+
+ protected:
+  template<typename RandomIt, typename Compare>
+  static void SortPart(RandomIt begin, RandomIt end, Compare comp) {
+    std::stable_sort(begin, end, comp);
+  }
+
+  template<typename RandomIt, typename Compare>
+  static void MergeParts(RandomIt begin, RandomIt middle, RandomIt end, Compare comp) {
+    std::inplace_merge(begin, middle, end, comp);
+  }
+};
+
+#endif // PARALLEL_SORT_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -61,7 +61,7 @@ using namespace std;
 
 static Params paramContainer_;
 
-Params::Params() : finalized_(false) {
+Params::Params() : categorized_(false), finalized_(false) {
   /* generate_peptide arguments */
   InitArgParam("protein fasta file",
     "The name of the file in FASTA format from which to retrieve proteins.");
@@ -95,7 +95,8 @@ Params::Params() : finalized_(false) {
   InitArgParam("peptide-spectrum matches",
     "A collection of target and decoy peptide-spectrum matches (PSMs). Input may "
     "be in one of five formats: PIN, SQT, pepXML, [[html:<a href=\"../file-formats/txt-format.html\">]]"
-    "Crux tab-delimited text[[html:</a>]], or a list of files (when list-of-files=T). "
+    "Crux tab-delimited text[[html:</a>]], a list of files (when list-of-files=T), or a "
+    "shard manifest ending in .shards, listing one result file per line. "
     "Note that if the input is provided as SQT, pepXML, or Crux "
     "tab-delimited text, then a PIN file will be generated in the output directory "
     "prior to execution."
@@ -166,6 +167,18 @@ Params::Params() : finalized_(false) {
     "fatal errors, 20-warnings, 30-information on the progress of execution, 40-more "
     "progress information, 50-debug info, 60-detailed debug info.",
     "Available for all crux programs.", true);
+  InitIntParam("metrics-port", 0, 0, 65535,
+    "Serve the progress of the command over HTTP on this port while it runs, at "
+    "/metrics in OpenMetrics text for Prometheus to scrape: the memory held by each "
+    "part of a search and, in builds with instrumentation, the time spent in each "
+    "stage, as histograms and per thread, and counts such as spectra searched. The "
+    "port is opened on the interface of metrics-address. 0 serves nothing.",
+    "Available for all crux programs.", true);
+  InitStringParam("metrics-address", "127.0.0.1",
+    "The address of the interface that metrics-port is opened on. The metrics are "
+    "served without authentication, so by default only this machine can read "
+    "them. 0.0.0.0 serves them on every interface.",
+    "Available for all crux programs.", true);
   InitStringParam("parameter-file", "", 
     "A file containing parameters. [[html: See the "
     "<a href=\"../file-formats/parameter-file.html\">parameter documentation</a> page for details.]]",
@@ -187,14 +200,62 @@ Params::Params() : finalized_(false) {
   InitDoubleParam("min-mass", 200, 0, BILLION,
     "The minimum mass (in Da) of peptides to consider.",
     "Available from command line or parameter file for "
-    "crux-generate-peptides and crux tide-index. ", true);
+    "crux-generate-peptides and crux tide-index. Also limits the peptides that "
+    "read-tide-index writes, if given.", true);
   InitDoubleParam("max-mass", 7200, 1, BILLION, 
     "The maximum mass (in Da) of peptides to consider.",
     "Available from command line or parameter file for "
-    "crux-generate-peptides and crux tide-index. ", true);
+    "crux-generate-peptides and crux tide-index. Also limits the peptides that "
+    "read-tide-index writes, if given.", true);
   InitIntParam("min-peaks", 20, 0, BILLION,
     "The minimum number of peaks a spectrum must have for it to be searched.",
     "Available for tide-search.", true);
+  InitDoubleParam("min-spectrum-quality", 0, 0, 1,
+    "Skip the spectrum-charge combinations whose preprocessed peaks score "
+    "below this, from 0 to 1, as likely to be identified: the mean of the "
+    "fraction of 50 peaks kept (up to 1), how uneven their intensities are "
+    "(one minus their normalized entropy) and the fraction of them with a "
+    "complementary b or y ion. The number skipped is logged. Not used with "
+    "exact p-values or open searches. 0 searches every combination.",
+    "Available for tide-search.", true);
+  InitIntParam("peaks-per-window", 0, 0, BILLION,
+    "Keep only this many of the most intense peaks in each peak-window-width "
+    "m/z window of a spectrum, before removing precursor and isotope peaks. "
+    "0 keeps every peak.",
+    "Available for tide-search.", true);
+  InitDoubleParam("peak-window-width", 100, 1, BILLION,
+    "Width, in m/z, of the windows of peaks-per-window.",
+    "Available for tide-search.", true);
+  InitStringParam("preprocessed-store", "",
+    "A directory in which to keep the preprocessed spectra of each spectrum "
+    "file, so that later searches of the same spectra with the same "
+    "preprocessing parameters read them instead of preprocessing the spectra "
+    "again. Not used with streamed or merged spectrum files. By "
+    "default the spectra are preprocessed anew for each search.",
+    "Available for tide-search.", true);
+  InitStringParam("result-memo", "",
+    "A directory in which to keep the results of each spectrum file, so that a "
+    "later search of the same spectra with the same parameters, against an index "
+    "that differs in only some of its shards, reuses the results of the "
+    "spectrum-charge combinations whose precursor windows reach no changed shard "
+    "instead of searching them again. Needs an index built with index-shards. Not "
+    "used with streamed or merged spectrum files, exact p-values, "
+    "peptide-centric or open searches, binary results or qc-report. By default "
+    "every spectrum is searched.",
+    "Available for tide-search.", true);
+  InitDoubleParam("cluster-spectra", 0, 0, 1,
+    "Cluster the spectrum-charge combinations of the same charge whose neutral "
+    "masses are within cluster-precursor-tolerance and whose binned peaks have "
+    "at least this cosine similarity. Only one combination of each cluster is "
+    "searched against all of its candidates; the others are scored against its "
+    "best matches that are in their own precursor windows, and reported after "
+    "it. Not used with exact p-values, peptide-centric or open searches, or a "
+    "result-memo. 0 searches every combination against all of its candidates.",
+    "Available for tide-search.", true);
+  InitDoubleParam("cluster-precursor-tolerance", 10, 0, BILLION,
+    "The largest difference, in ppm, between the neutral masses of the "
+    "spectrum-charge combinations of a cluster (see cluster-spectra).",
+    "Available for tide-search.", true);
   InitStringParam("enzyme", "trypsin", "no-enzyme|trypsin|trypsin/p|chymotrypsin|"
     "elastase|clostripain|cyanogen-bromide|iodosobenzoate|proline-endopeptidase|"
     "staph-protease|asp-n|lys-c|lys-n|arg-c|glu-c|pepsin-a|"
@@ -266,18 +327,45 @@ Params::Params() : finalized_(false) {
     "but use the default value in case of failure, fail=try to estimate and "
     "quit in case of failure.",
     "Available for tide-search.", true);
-  InitStringParam("spectrum-parser", "pwiz", "pwiz|mstoolkit",
+  InitDoubleParam("auto-tolerance-multiplier", 1, 0.01, BILLION,
+    "The factor by which auto-precursor-window and auto-mz-bin-width scale "
+    "their estimates before setting precursor-window and mz-bin-width. Below 1 "
+    "narrows the windows, so that fewer candidates are scored, at the risk of "
+    "missing matches with larger errors.",
+    "Available for tide-search.", true);
+  InitIntParam("auto-tolerance-spectra", 0, 0, BILLION,
+    "The number of spectra, the first ones of the spectrum files in order, from "
+    "which auto-precursor-window and auto-mz-bin-width estimate the mass errors. "
+    "0 uses all of them. The estimates pair spectra of the same precursor that "
+    "are close in scan number, so a sample of consecutive spectra suffices if "
+    "it holds a few thousand.",
+    "Available for tide-search.", true);
+  InitStringParam("spectrum-parser", "pwiz", "pwiz|mstoolkit|text|native",
     "Specify the parser to use for reading in MS/MS spectra.[[html: The default, "
     "ProteoWizard parser can read the MS/MS file formats listed <a href=\""
     "http://proteowizard.sourceforge.net/formats.shtml\">here</a>. The alternative is "
     "<a href=\"../mstoolkit.html\">MSToolkit parser</a>. "
     "If the ProteoWizard parser fails to read your files properly, you may want to try the "
-    "MSToolkit parser instead.]]",
+    "MSToolkit parser instead.]] The text parser reads .ms2 and .mgf files itself, "
+    "splitting large files at scan boundaries and parsing the parts on num-threads "
+    "threads; other formats are read with ProteoWizard. The native parser also "
+    "reads .mzML files itself, with uncompressed or zlib-compressed peak arrays, "
+    "and falls back to ProteoWizard for other mzML encodings and other formats.",
     "Available for search-for-xlinks.", true);
   InitBoolParam("use-z-line", true,
     "Specify whether, when parsing an MS2 spectrum file, Crux obtains the "
     "precursor mass information from the \"S\" line or the \"Z\" line. ",
-    "Available when spectrum-parser = pwiz.", true);
+    "Available when spectrum-parser = pwiz, text or native.", true);
+  InitBoolParam("multiplexed-spectra", false,
+    "When converting spectra for tide-search, keep a spectrum with several "
+    "precursors (m/z and charge), as from wide-isolation or DIA-like "
+    "acquisition, as one spectrum with several precursor hypotheses, rather "
+    "than one copy of its peaks per precursor. The hypotheses of a charge "
+    "share one preprocessed spectrum, cut off for the heaviest of them and "
+    "with the peaks near every precursor removed, whose cache each of their "
+    "candidate windows is scored against; each is reported with its own "
+    "precursor m/z.",
+    "Available for tide-search.", true);
   InitStringParam("keep-terminal-aminos", "NC", "N|C|NC|none",
     "When creating decoy peptides using decoy-format=shuffle or decoy-format="
     "peptide-reverse, this option specifies whether the N-terminal and "
@@ -293,10 +381,56 @@ Params::Params() : finalized_(false) {
     "then a second file will be created containing the decoy peptides. Decoys that also "
     "appear in the target database are marked with an asterisk in a third column.",
     "Available for tide-index.", true);
+  InitBoolParam("store-peaks", false,
+    "Store the theoretical peaks of each peptide in the index, discretized with "
+    "the current mz-bin-width and mz-bin-offset. Searches of the index with the "
+    "same mz-bin-width and mz-bin-offset read the peaks instead of recomputing "
+    "them, which saves time when an index is searched many times; other "
+    "searches ignore them. The index is larger.",
+    "Available for tide-index.", true);
   InitIntParam("modsoutputter-threshold", 1000, 0, BILLION,
     "Maximum number of temporary files that would be opened by ModsOutputter "
     "before switching to ModsOutputterAlt.",
     "Available for tide-index.", false);
+  InitStringParam("append-to-index", "",
+    "The name of an existing index to add the proteins of the FASTA file to. "
+    "Only the new proteins are digested; they are numbered after the proteins "
+    "of the existing index, and their peptides are merged into its peptides. "
+    "The result is written to the index named on the command line, and the "
+    "existing index is left as it is. Both must be built with the same "
+    "settings. Decoys are generated from the new proteins alone, and the "
+    "peptide lists and decoy FASTA cover only the new proteins.",
+    "Available for tide-index.", true);
+  InitIntParam("memory-limit", 0, 0, BILLION,
+    "Maximum memory, in megabytes, for the unmodified peptides that tide-index "
+    "collects before sorting them. Beyond it, the peptides collected so far are "
+    "sorted and written to a temporary file in the index directory, and the "
+    "files are merged at the end. 0 means no limit. For sort-by-column, the memory for "
+    "the rows being sorted at once, shared by its threads; 0 means 1024.",
+    "Available for tide-index and sort-by-column.", true);
+  InitIntParam("index-shards", 0, 0, BILLION,
+    "Also split the peptides of the index into this many files by mass, "
+    "listed with their mass ranges in the index file pepix.shards. "
+    "tide-search then reads only the shards that cover the precursor masses "
+    "of the spectra. The shards may be moved elsewhere by editing the paths "
+    "in pepix.shards. 0 or 1 means no shards.",
+    "Available for tide-index.", true);
+  InitIntParam("index-skip-interval", 4096, 0, BILLION,
+    "Record in the index header the mass and file offset of every so many "
+    "peptides, so that tide-search can start reading the index at the first "
+    "peptide that its spectra need. 0 means no skip table. Not used with "
+    "compress-index, whose block index serves the same purpose.",
+    "Available for tide-index.", false);
+  InitBoolParam("compress-index", false,
+    "Compress the peptides of the index in blocks of about 64 KB, with an index "
+    "of the mass at which each block starts, so that tide-search can go "
+    "straight to the first block that its spectra need.",
+    "Available for tide-index.", true);
+  InitBoolParam("flat-auxlocs", false,
+    "Also write the auxiliary locations of the peptides as auxlocs.flat, a flat "
+    "array that tide-search maps into memory instead of parsing auxlocs, to "
+    "start up faster on an index whose peptides occur in many proteins.",
+    "Available for tide-index.", true);
   // print-processed-spectra option
   InitStringParam("stop-after", "xcorr", "remove-precursor|square-root|"
     "remove-grass|ten-bin|xcorr",
@@ -305,6 +439,16 @@ Params::Params() : finalized_(false) {
   InitStringParam("output-units", "bin", "mz|bin",
     "Specify the output units for processed spectra.",
     "Available for print-processed-spectra", true);
+  InitBoolParam("binary-output", false,
+    "Also write the processed spectra to the output file name with \".bin\" "
+    "appended, in a column-oriented binary format for loading into other "
+    "programs. The file starts with the 8 bytes \"CRUXPPS1\", followed by "
+    "blocks of up to 4096 spectrum-charge pairs. Each block is an int32 count n "
+    "of pairs, then the columns int32 scan[n], int32 charge[n], float64 "
+    "precursor m/z[n] and int32 peak count[n], then the int32 bins and float32 "
+    "intensities of the nonzero bins of all n pairs. A count of 0 ends the file. "
+    "Numbers are little-endian.",
+    "Available for print-processed-spectra", true);
   /* more generate_peptide parameters */
   InitBoolParam("sqt-output", false,
     "Outputs an SQT results file to the output directory. Note that if sqt-output is "
@@ -314,8 +458,10 @@ Params::Params() : finalized_(false) {
     "Output an mzIdentML results file to the output directory.",
     "Available for tide-search, percolator.", true);
   InitBoolParam("pin-output", false,
-    "Output a Percolator input (PIN) file to the output directory.",
-    "Available for tide-search.", true);
+    "Output a Percolator input (PIN) file to the output directory. For percolator "
+    "and pipeline, keep the make-pin.pin file converted from search results for "
+    "Percolator to read, which is otherwise removed once Percolator has run.",
+    "Available for tide-search, percolator and pipeline.", true);
   InitBoolParam("pout-output", false,
     "Output a Percolator [[html:<a href=\""
     "https://github.com/percolator/percolator/blob/master/src/xml/percolator_out.xsd\">]]"
@@ -327,6 +473,37 @@ Params::Params() : finalized_(false) {
   InitBoolParam("txt-output", true,
     "Output a tab-delimited results file to the output directory.",
     "Available for tide-search, percolator, q-ranker, barista.", true);
+  InitStringParam("txt-format", "text", "text|binary",
+    "Format of the tab-delimited results files. text writes tab-delimited text "
+    "(.txt). binary writes the same columns in the Crux binary columnar format "
+    "(.bin), which is smaller and faster to write and read; every Crux command "
+    "that reads tab-delimited PSMs also reads it.",
+    "Available for tide-search.", true);
+  InitBoolParam("qc-report", false,
+    "Write an HTML quality-control report of the search: charge states, "
+    "candidate peptides per spectrum, score distributions of the top target "
+    "and decoy matches, and precursor mass errors. The statistics are "
+    "collected as the matches are reported, so no results file is reread.",
+    "Available for tide-search.", true);
+  InitBoolParam("compress-output", false,
+    "Compress the tab-delimited results files with gzip, adding .gz to their "
+    "names. Every Crux command that reads tab-delimited PSMs reads files whose "
+    "names end in .gz the same way.",
+    "Available for tide-search, assign-confidence, spectral-counts, generate-peptides "
+    "and predict-peptide-ions.", true);
+  InitIntParam("checkpoint-interval", 0, 0, BILLION,
+    "Every this many seconds, record in tide-search.checkpoint how far a "
+    "spectrum-centric search has written its results, so that a search that is "
+    "stopped can be continued with --resume. Set to 0 to write no checkpoints. "
+    "Needs ordered-output and results files that are not compressed.",
+    "Available for tide-search.", true);
+  InitBoolParam("resume", false,
+    "Continue the search recorded in tide-search.checkpoint in the output "
+    "directory: skip the spectrum-charge pairs whose results were written before "
+    "the search stopped, and append the rest to the results files. The index, "
+    "spectrum files and parameters have to be those of the stopped search. "
+    "Without a checkpoint the search starts from the beginning.",
+    "Available for tide-search.", true);
   InitStringParam("prelim-score-type", "sp", "sp|xcorr",
     "Initial scoring (sp, xcorr).", 
     "The score applied to all possible psms for a given spectrum. Typically "
@@ -363,13 +540,14 @@ Params::Params() : finalized_(false) {
     "formula for computing the discretized m/z value is floor((x/mz-bin-width) + 1.0 - mz-bin-offset), where x is the observed m/z "
     "value. For low resolution ion trap ms/ms data 1.0005079 and for high resolution ms/ms "
     "0.02 is recommended.",
-    "Available for tide-search and xlink-assign-ions.", true);
+    "Available for tide-search and xlink-assign-ions, and for tide-index with "
+    "store-peaks=T.", true);
   InitDoubleParam("mz-bin-offset", 0.40, 0.0, 1.0,
     "In the discretization of the m/z axes of the observed and theoretical spectra, this "
     "parameter specifies the location of the left edge of the first bin, relative to "
     "mass = 0 (i.e., mz-bin-offset = 0.xx means the left edge of the first bin will be "
     "located at +0.xx Da).",
-    "Available for tide-search.", true);
+    "Available for tide-search, and for tide-index with store-peaks=T.", true);
   InitStringParam("auto-mz-bin-width", "false", "false|warn|fail",
     "Automatically estimate optimal value for the mz-bin-width parameter "
     "from the spectra themselves. false=no estimation, warn=try to estimate "
@@ -460,6 +638,14 @@ Params::Params() : finalized_(false) {
     "The maximum number of modifications that can be applied to a single " 
     "peptide.",
     "Available for tide-index.", true);
+  InitBoolParam("search-time-mods", false,
+    "Store each peptide in the index once, unmodified, and apply the variable "
+    "modifications when the index is searched by tide-search. The index is "
+    "much smaller and faster to build when there are many variable "
+    "modifications, but store-peaks is ignored, protein terminal "
+    "modifications are not supported, and the peptide lists and other "
+    "commands that read the index see only the unmodified peptides.",
+    "Available for tide-index.", true);
   InitIntParam("max-aas-modified", MAX_PEPTIDE_LENGTH, 0, MAX_PEPTIDE_LENGTH,
     "The maximum number of modified amino acids that can appear in one "
     "peptide.  Each aa can be modified multiple times.",
@@ -726,6 +912,15 @@ Params::Params() : finalized_(false) {
     "homopolymers will appear in both the target and decoy database. The protein-reverse "
     "mode reverses the entire protein sequence, irrespective of the composite peptides.",
     "Available for tide-index", true);
+  InitStringParam("search-decoys", "none", "none|shuffle|peptide-reverse",
+    "Generate the decoys during the search instead of reading them from the index, "
+    "which must then be built with --decoy-format none. Each target peptide is "
+    "shuffled or reversed as by decoy-format, leaving the N-terminal and C-terminal "
+    "amino acids in place, with its modifications moving with their amino acids. "
+    "The shuffle is determined by the seed and the peptide sequence, so a search "
+    "with the same seed always gets the same decoys; the decoys are not checked "
+    "against the target peptides.",
+    "Available for tide-search", true);
   InitStringParam("mods-spec", "C+57.02146",
     "[[nohtml:Expression for static and variable mass modifications to include. "
     "Specify a comma-separated list of modification sequences of the form: "
@@ -783,8 +978,25 @@ Params::Params() : finalized_(false) {
     "will be stored. Subsequent runs of crux tide-search will execute more quickly if "
     "provided with the spectra in binary format. The filename is specified relative to "
     "the current working directory, not the Crux output directory (as specified by "
-    "--output-dir). This option is not valid if multiple input spectrum files are given.",
+    "--output-dir). This option is not valid if multiple input spectrum files are given. "
+    "A scan index is written next to the file, with the extension .scans, so that "
+    "get-ms2-spectrum and localize-modification can read single spectra from it "
+    "without parsing the whole file.",
     "Available for tide-search", true);
+  InitStringParam("spectrum-cache-dir", "",
+    "A directory in which to keep the spectrum files converted from other "
+    "spectrum formats, for reuse by later searches of the same files: "
+    "spectrumrecords files for tide-search, and compressed MS2 (cms2) files of "
+    "the mzML, mzXML and raw inputs of comet. A "
+    "cached file is used only while the spectrum file has the same path, size "
+    "and modification time and the parameters that affect conversion "
+    "(spectrum-parser, scan-number, use-z-line and pm-ignore-no-charge for "
+    "tide-search, ms_level for comet) are "
+    "unchanged. The directory is created if it does not exist. Entries are "
+    "never removed automatically. For tide-search this option has no effect "
+    "when store-spectra is given, and for comet none unless activation_method "
+    "is ALL.",
+    "Available for tide-search and comet", true);
   InitBoolParam("exact-p-value", false,
     "Enable the calculation of exact p-values for the XCorr score[[html: as described in "
     "<a href=\"http://www.ncbi.nlm.nih.gov/pubmed/24895379\">this article</a>]]. Calculation "
@@ -800,6 +1012,45 @@ Params::Params() : finalized_(false) {
     "When providing a FASTA file as the index, the generated binary index will be stored at "
     "the given path. This option has no effect if a binary index is provided as the index.",
     "Available for tide-search", true);
+  InitBoolParam("memory-index", false,
+    "When providing a FASTA file as the index, build the index in memory and search it "
+    "directly, rather than running tide-index to write it to disk first. This is meant "
+    "for small databases, such as those of targeted searches. The variable modifications "
+    "are applied during the search, as with search-time-mods, and the decoys of "
+    "decoy-format are generated during the search, as with search-decoys (protein-reverse "
+    "decoys become peptide-reverse ones). Not available with store-index or protein "
+    "terminal modifications. A list of peptide sequences, one per line, may also be "
+    "given as the index, and is always indexed in memory.",
+    "Available for tide-search", true);
+  InitStringParam("server-jobs", "",
+    "The file from which tide-server reads its jobs, one per line: an output "
+    "directory, then the spectrum files to search, separated by tabs. The server "
+    "answers each job on standard output with a line of 'done' or 'failed', a tab "
+    "and the output directory. The file may be a named pipe that clients write "
+    "to; if this option is not given, the jobs are read from standard input.",
+    "Available for tide-server", true);
+  InitStringParam("spectral-library", "",
+    "The spectral library that tide-library-search matches spectra against "
+    "before it searches the rest against the database. A library that does not "
+    "exist yet is made from library-psms.",
+    "Available for tide-library-search", true);
+  InitStringParam("library-psms", "",
+    "Tab-delimited PSMs of the spectra being searched, such as the output of "
+    "assign-confidence, from which tide-library-search adds to the "
+    "spectral-library the spectra of the PSMs with a q-value at or below "
+    "q-value-threshold. The file needs scan, charge and sequence columns, a "
+    "column whose name ends in q-value and, for several spectrum files, a file "
+    "column.",
+    "Available for tide-library-search", true);
+  InitDoubleParam("library-min-cosine", 0.7, 0, 1,
+    "The lowest cosine between the preprocessed peaks of a spectrum and a "
+    "library spectrum for tide-library-search to take the library spectrum's "
+    "peptide as the spectrum's.",
+    "Available for tide-library-search", true);
+  InitDoubleParam("library-precursor-tolerance", 10, 0, BILLION,
+    "The largest difference, in ppm, between the neutral masses of a spectrum "
+    "and a library spectrum it is matched to.",
+    "Available for tide-library-search", true);
   InitBoolParam("concat", false,
     "When set to T, target and decoy search results are reported in a single file, and only "
     "the top-scoring N matches (as specified via --top-match) are reported for each spectrum, "
@@ -855,9 +1106,26 @@ Params::Params() : finalized_(false) {
     "centred in the window is substituted by the geometric mean of the scores "
     "in the window. If windows size is even, then it is increased by 1.",
     "Available for tide-search.", false);
+  InitStringParam("peptide-retention-times", "",
+    "A tab-delimited file of peptides with sequence and retention time columns, "
+    "the times in minutes, such as predicted or observed in earlier runs. In a "
+    "peptide-centric-search, the peptides of the file, by their unmodified "
+    "sequences, and the decoys made from them at search time are matched only "
+    "to spectra within peptide-rt-tolerance of their times. Other peptides are "
+    "matched to every spectrum in their mass windows.",
+    "Available for tide-search.", true);
+  InitDoubleParam("peptide-rt-tolerance", 0, 0, BILLION,
+    "The largest difference, in minutes, between the retention times of a "
+    "peptide and a spectrum it is matched to (see peptide-retention-times). 0 "
+    "matches every spectrum in a peptide's mass window.",
+    "Available for tide-search.", true);
   InitBoolParam("skip-decoys", true,
     "Skips decoys when reading a Tide index.",
-    "Available for read-tide-index", false);
+    "Available for read-tide-index and predict-peptide-ions.", false);
+  InitStringParam("protein-filter", "",
+    "Comma-separated list of protein IDs. Only the peptides that occur in at least "
+    "one of them are written.",
+    "Available for read-tide-index.", false);
   InitBoolParam("skip-preprocessing", false,
     "Skip preprocessing steps on spectra. Default = F.",
     "Available for tide-search", true);
@@ -868,8 +1136,150 @@ Params::Params() : finalized_(false) {
                   "1,2,3,..."
                   "Available for tide-search", true);
   InitIntParam("num-threads", 0, 0, 64,
-               "0=poll CPU to set num threads; else specify num threads directly.",
-               "Available for tide-search tab-delimited files only.", true);
+               "0=poll CPU to set num threads; else specify num threads directly. "
+               "For percolator, this is the number of threads Percolator trains its "
+               "cross-validation folds on, if it was built with OpenMP; the results do "
+               "not depend on it.",
+               "Available for tide-index, tide-search, percolator, search-for-xlinks, hardklor, "
+               "spectral-counts, sort-by-column, extract-rows, stat-column, localize-modification, "
+               "generate-peptides and predict-peptide-ions. For batch, this is the size "
+               "of the pool of worker threads that all of its commands share.",
+               true);
+  InitIntParam("output-pending-bytes", 1 << 26, 1, BILLION,
+    "The bytes of tide-search results that may wait to be written, or to take "
+    "their turn with ordered-output, before the search threads wait. For testing "
+    "the threads against one another with a small limit.",
+    "Available for tide-search.", false);
+  InitBoolParam("ordered-output", true,
+    "Write spectrum-centric tide-search results in the order in which the spectra "
+    "are searched, regardless of the number of threads, so that a search with "
+    "several threads writes the same files, byte for byte, as one with a single "
+    "thread. Otherwise, threads write their results in large batches as they "
+    "finish them.",
+    "Available for tide-search.", true);
+  InitBoolParam("shared-peptide-window", false,
+    "Have all search threads score against a single window of candidate peptides "
+    "instead of each thread reading and preparing its own copy of the index. This "
+    "reduces memory use and index decoding work when many threads are used. Not "
+    "used with exact-p-value, peptide-centric-search or open-search-block-size.",
+    "Available for tide-search.", true);
+  InitBoolParam("mmap-index", false,
+    "Map the peptide index into memory instead of reading it through a private "
+    "buffer. Peptides are then decoded straight from the operating system's file "
+    "cache, which is shared by all search threads and by other searches of the "
+    "same index running on the machine.",
+    "Available for tide-search.", true);
+  InitIntParam("index-read-ahead", 0, 0, BILLION,
+    "Number of peptides that a background thread reads and decodes from the "
+    "peptide index ahead of each search thread, so that reading the index overlaps "
+    "with scoring. Helps most when the index is on slow or network storage. "
+    "0 reads the index on the search threads.",
+    "Available for tide-search.", true);
+  InitStringParam("fifo-huge-pages", "none", "none|transparent|explicit",
+    "Back the memory that holds the active candidate peptides and their "
+    "theoretical peaks with 2MB huge pages, which reduces TLB misses when many "
+    "candidates are active, e.g. with wide precursor windows. transparent asks "
+    "the kernel for transparent huge pages; explicit takes them from the "
+    "reserved huge page pool (vm.nr_hugepages) and falls back to transparent "
+    "huge pages when the pool is empty.",
+    "Available for tide-search.", true);
+  InitBoolParam("numa-placement", false,
+    "On a machine with several NUMA nodes (sockets), spread the search threads "
+    "over the nodes, pin each thread to a core, and keep the memory of each "
+    "thread's candidate peptides on its own node. The proteins and spectra, "
+    "which all the threads read, are interleaved over the nodes. Linux only.",
+    "Available for tide-search.", true);
+  InitIntParam("open-search-block-size", 0, 0, BILLION,
+    "Search the index in blocks of this many peptides instead of keeping every "
+    "candidate of the current precursor windows in memory. Each search thread "
+    "reads the index once, block by block, and scores each block against all "
+    "spectra whose windows overlap it, so memory stays bounded with the very wide "
+    "precursor windows of open-modification searches. Results are unaffected. "
+    "0 searches without blocks. Not used with exact-p-value or "
+    "peptide-centric-search.",
+    "Available for tide-search.", true);
+  InitIntParam("fragment-index-candidates", 0, 0, BILLION,
+    "In a search in blocks (see open-search-block-size), index the b and y ions "
+    "of each block's peptides by m/z bin, and score in full only this many "
+    "candidates per spectrum and block: those with fragments in the most bins of "
+    "the spectrum's most intense peaks (see fragment-index-peaks). This makes "
+    "searches with very wide precursor windows much faster, but matches outside "
+    "the prefiltered candidates are missed. 0 scores every candidate.",
+    "Available for tide-search.", true);
+  InitIntParam("fragment-index-peaks", 50, 1, BILLION,
+    "Number of most intense peaks of each spectrum that the fragment index "
+    "matches against (see fragment-index-candidates).",
+    "Available for tide-search.", true);
+  InitStringParam("scoring-backend", "auto",
+    "auto|jit|scalar|avx2|avx512|neon|cuda|scalar16|avx2-16",
+    "How tide-search computes XCorr dot products. jit generates x86 code for "
+    "each candidate peptide; scalar, avx2, avx512 and neon store each candidate's "
+    "peak positions and sum them with a plain loop, with AVX2 or AVX-512 gather "
+    "instructions, or with ARM64 Advanced SIMD. cuda scores batches of spectra "
+    "(see spectrum-batch-size) on an NVIDIA GPU and needs a build with "
+    "CRUX_CUDA. auto picks the widest vector instructions the CPU supports. "
+    "All of these give identical scores. scalar16 and avx2-16 are scalar and "
+    "avx2 on a copy of each observed spectrum rounded to 16 bits, which is half "
+    "the size and so faster with small mz-bin-width, but gives XCorr scores "
+    "that may be off by up to 1.024e-5 for each peak of the candidate.",
+    "Available for tide-search.", false);
+  InitIntParam("spectrum-batch-size", 1, 1, 256,
+    "Number of consecutive spectrum-charge pairs with overlapping precursor windows "
+    "that tide-search scores together. Each candidate peptide is then read once per "
+    "batch rather than once per spectrum, which helps most with wide precursor "
+    "windows. Scores are unaffected. 1 scores each spectrum on its own.",
+    "Available for tide-search.", false);
+  InitIntParam("max-spectra-in-memory", 0, 0, BILLION,
+    "Read and search the spectra of each spectrum file this many spectrum-charge "
+    "pairs at a time, in order of precursor mass, so that a file larger than "
+    "memory can be searched. Only the precursor masses of the whole file are "
+    "kept. Results are the same, but ordered by batch. 0 reads each file whole. "
+    "Not used with peptide-centric-search or open-search-block-size.",
+    "Available for tide-search.", true);
+  InitIntParam("max-memory", 0, 0, BILLION,
+    "The memory, in megabytes, that tide-search may use. The search estimates "
+    "its peak memory from the index and the spectrum files, and if the estimate "
+    "is larger, reads the spectra in batches (see max-spectra-in-memory) and "
+    "then uses fewer threads until it fits. The estimate and the plan are "
+    "logged. 0 for no limit.",
+    "Available for tide-search.", true);
+  InitIntParam("coordinator-port", 0, 0, 65535,
+    "Coordinate a tide-search spread over several machines rather than searching: "
+    "listen on this port for num-workers workers, started with the same spectrum "
+    "files, index and options and with the coordinator option, give each an "
+    "equal share of the spectrum-charge pairs of each file, in mass order, and "
+    "write the results that they send back in the order that one search would "
+    "have written them. Only tab-delimited results are sent. 0 to search here.",
+    "Available for tide-search.", true);
+  InitStringParam("coordinator-address", "127.0.0.1",
+    "The address of the interface that a coordinator (see coordinator-port) "
+    "listens on, such as the address of one network card. The default only "
+    "accepts workers on the same machine. Workers are not authenticated, so "
+    "this should be on a trusted network. Empty to listen on all interfaces.",
+    "Available for tide-search.", true);
+  InitIntParam("num-workers", 1, 1, 10000,
+    "The number of workers that a coordinator (see coordinator-port) waits for "
+    "and divides the spectra among.",
+    "Available for tide-search.", true);
+  InitStringParam("coordinator", "",
+    "Search, as a worker, the share of the spectra given by the coordinator of a "
+    "search over several machines (see coordinator-port) at host:port, and send "
+    "it the results rather than writing them. A worker reads only the part of "
+    "the index that its spectra need.",
+    "Available for tide-search.", true);
+  InitBoolParam("merge-spectrum-files", false,
+    "Search the spectra of all the spectrum files together, in one pass over the "
+    "index, rather than one file at a time. Each result keeps the name of its "
+    "spectrum file in the file column. All the files are held in memory at once. "
+    "Not used with max-spectra-in-memory or peptide-centric-search.",
+    "Available for tide-search.", true);
+  InitIntParam("spectrum-chunk-size", 0, 0, BILLION,
+    "Number of consecutive spectrum-charge pairs, in order of increasing precursor "
+    "mass, that a search thread claims at a time. Threads claim new chunks as they "
+    "finish old ones, so threads that land on dense mass regions do not hold up the "
+    "rest of the search. Set to 0 to choose a chunk size automatically from the "
+    "number of spectra and threads.",
+    "Available for tide-search.", false);
   /*
    * Comet parameters
    */
@@ -1200,6 +1610,20 @@ Params::Params() : finalized_(false) {
   InitStringParam("optimization", "protein", "protein|peptide|psm",
      "Specifies whether to do optimization at the protein, peptide or psm level.",
      "Available for barista.", true);
+  InitStringParam("barista-sgd", "serial", "serial|hogwild|minibatch",
+    "How protein-level training runs its stochastic gradient steps. serial takes "
+    "them one at a time on one thread. hogwild takes them on num-threads threads "
+    "at once, each writing its steps into the shared weights without locking, so "
+    "that the result also depends on the timing of the threads. minibatch has "
+    "the threads sum the gradients of barista-minibatch-size proteins and takes "
+    "one step with them, which gives the same result for the same num-threads. "
+    "The hinge loss, proteins accepted and time of each epoch are logged at "
+    "verbosity 40.",
+    "Available for barista.", true);
+  InitIntParam("barista-minibatch-size", 128, 1, BILLION,
+    "The number of proteins whose gradients make up one step of "
+    "barista-sgd=minibatch.",
+    "Available for barista.", true);
   /* analyze-matches parameter options */
   InitArgParam("target input",
     "One or more files, each containing a collection of peptide-spectrum matches (PSMs) "
@@ -1213,7 +1637,10 @@ Params::Params() : finalized_(false) {
     "is set to T, then the column "
     "\"peptide\" must be included, and if --sidak is set to T, then the \"distinct "
     "matches/spectrum\" column must be included.[[html:<br>Note that multiple files can "
-    "also be provided either on the command line or using the --list-of-files option.<br>"
+    "also be provided either on the command line or using the --list-of-files option. "
+    "A file ending in .shards is read as a shard manifest, listing one result file per "
+    "line relative to the manifest's directory, such as the outputs of a search split "
+    "by scan range.<br>"
     "Decoys can be provided in two ways: either as a separate file or embedded within the "
     "same file as the targets. Crux will first search the given file for decoys using a "
     "prefix (specified via --decoy-prefix) on the protein name. If no decoys are found, "
@@ -1255,6 +1682,20 @@ Params::Params() : finalized_(false) {
     "Specify this parameter to T in order to treat peptides carrying different or "
     "no modifications as being the same. Works only if estimation = peptide-level.",
     "Used by assign-confidence.", true);
+  InitBoolParam("columnar-psm-loading", false,
+    "Read only the columns that target-decoy competition needs from tab-delimited "
+    "input, instead of building a complete match for each PSM, and copy the other "
+    "fields of each target PSM to the output as they are. Much faster and smaller "
+    "for large inputs. Works only if estimation-method = tdc and sidak = F, without "
+    "pepXML output or cascade-search.",
+    "Used by assign-confidence.", true);
+  InitBoolParam("score-index", false,
+    "Have tide-search write, beside a concatenated tab-delimited results file, an "
+    "index (extension .scores) of the score, xcorr rank and target/decoy status of "
+    "each row, sorted by score. With columnar-psm-loading, assign-confidence then "
+    "computes q-values from the index instead of reading and sorting the scores of "
+    "the rows.",
+    "Available for tide-search and assign-confidence.", true);
   InitStringParam("percolator-intraset-features", "F",
     "Set a feature for percolator that in later versions is not an option.",
     "Shouldn't be variable; hide from user.", false);
@@ -1263,7 +1704,7 @@ Params::Params() : finalized_(false) {
     "The q-value threshold used by cascade search. Each spectrum identified in one search "
     "with q-value less than this threshold will be excluded from all subsequent searches. "
     "Note that the threshold is not applied to the final database in the cascade.",
-    "Used by cascade-search.", true);
+    "Used by cascade-search and tide-library-search.", true);
   InitArgParam("database-series",
     "A comma-separated list of databases, each generated by tide-index. "
     "Cascade-search will search the given spectra against these databases in the given order.");
@@ -1459,6 +1900,11 @@ Params::Params() : finalized_(false) {
 		"Use an ion cache for the xlinkable peptides.  "
                 "May not be scalable for large databases.",
 		"Available for search-for-xlinks.", false);
+  InitIntParam("xlink-ion-cache-size", 20000, 1, BILLION,
+    "Number of xlinkable peptides whose ion series each search thread keeps "
+    "in the ion cache (see xlink-use-ion-cache). When the cache is full, the "
+    "least recently used peptide is dropped.",
+    "Available for search-for-xlinks.", false);
 
   InitBoolParam("xlink-include-linears", true, 
     "Include linear peptides in the search.",
@@ -1664,6 +2110,12 @@ Params::Params() : finalized_(false) {
     "spectrum. Setting this parameter to 0 turns off this feature, and different noise "
     "thresholds will be used for each local mass window in a spectrum.",
     "Available for crux hardklor", true);
+  InitStringParam("hardklor-model-cache", "",
+    "Specifies a file in which to keep the averagine model library that the version2 "
+    "algorithm builds at startup. If the file holds a library built for the same charge "
+    "range, averagine-mod, hardklor-data-file and isotope-data-file, it is mapped into "
+    "memory instead of being rebuilt; otherwise the library is built and written to it.",
+    "Available for crux hardklor", true);
   InitBoolParam("hardklor-xml-output", false,
     "Output XML instead of tab-delimited text.",
     "Available for crux hardklor", false);
@@ -1793,6 +2245,11 @@ Params::Params() : finalized_(false) {
     "Specifies the template to be used for options when generating "
     "documentation.",
     "Available for crux create-docs", false);
+  // batch
+  InitArgParam("batch file",
+    "A file of Crux commands, one per line, each written as on the command line "
+    "but without the leading 'crux' and with no spaces within an argument. "
+    "Blank lines and lines starting with '#' are skipped.");
   // param-medic
   InitArgParam("spectrum-file",
     "File from which to parse fragmentation spectra.");
@@ -1849,7 +2306,9 @@ Params::Params() : finalized_(false) {
 
   InitBoolParam("no-analytics", false, "Don't post data to Google Analytics.", "", false);
 
-  Categorize();
+  // Categories are only used for documentation and are built when first
+  // needed (see GroupByCategory), which keeps them out of every command's
+  // startup.
 }
 
 Params::~Params() {
@@ -1859,6 +2318,10 @@ Params::~Params() {
 }
 
 void Params::Categorize() {
+  if (categorized_) {
+    return;
+  }
+  categorized_ = true;
   set<string> items;
 
   items.clear();
@@ -1897,6 +2360,7 @@ void Params::Categorize() {
   items.insert("nmod");
   items.insert("nterm-peptide-mods-spec");
   items.insert("nterm-protein-mods-spec");
+  items.insert("search-time-mods");
   for (char c = 'A'; c <= 'Z'; c++) {
     items.insert(string(1, c));
   }
@@ -1906,6 +2370,7 @@ void Params::Categorize() {
   items.insert("allow-dups");
   items.insert("decoy-format");
   items.insert("keep-terminal-aminos");
+  items.insert("search-decoys");
   items.insert("seed");
   AddCategory("Decoy database generation", items);
 
@@ -1918,6 +2383,8 @@ void Params::Categorize() {
 
   items.clear();
   items.insert("auto-precursor-window");
+  items.insert("auto-tolerance-multiplier");
+  items.insert("auto-tolerance-spectra");
   items.insert("max-precursor-charge");
   items.insert("precursor-window");
   items.insert("precursor-window-type");
@@ -1929,22 +2396,47 @@ void Params::Categorize() {
   items.insert("compute-sp");
   items.insert("deisotope");
   items.insert("exact-p-value");
+  items.insert("fifo-huge-pages");
+  items.insert("numa-placement");
+  items.insert("fragment-index-candidates");
+  items.insert("fragment-index-peaks");
   items.insert("fragment-mass");
+  items.insert("index-read-ahead");
   items.insert("isotope-error");
   items.insert("isotope-windows");
   items.insert("max-ion-charge");
+  items.insert("max-memory");
+  items.insert("coordinator-address");
+  items.insert("coordinator-port");
+  items.insert("num-workers");
+  items.insert("coordinator");
+  items.insert("max-spectra-in-memory");
+  items.insert("merge-spectrum-files");
   items.insert("min-peaks");
+  items.insert("min-spectrum-quality");
+  items.insert("peaks-per-window");
+  items.insert("peak-window-width");
+  items.insert("preprocessed-store");
+  items.insert("result-memo");
+  items.insert("cluster-spectra");
+  items.insert("cluster-precursor-tolerance");
+  items.insert("peptide-retention-times");
+  items.insert("peptide-rt-tolerance");
   items.insert("min-weibull-points");
+  items.insert("mmap-index");
   items.insert("mod-mass-format");
   items.insert("mz-bin-offset");
   items.insert("mz-bin-width");
+  items.insert("open-search-block-size");
   items.insert("peptide-centric-search");
   items.insert("precursor-window-type-weibull");
   items.insert("precursor-window-weibull");
   items.insert("remove-precursor-peak");
   items.insert("remove-precursor-tolerance");
   items.insert("scan-number");
+  items.insert("scoring-backend");
   items.insert("skip-preprocessing");
+  items.insert("spectrum-batch-size");
   items.insert("spectrum-charge");
   items.insert("spectrum-max-mz");
   items.insert("spectrum-min-mz");
@@ -2001,6 +2493,9 @@ void Params::Categorize() {
   items.clear();
   items.insert("num-threads");
   items.insert("num_threads");
+  items.insert("ordered-output");
+  items.insert("shared-peptide-window");
+  items.insert("spectrum-chunk-size");
   AddCategory("CPU threads", items);
 
   items.clear();
@@ -2127,9 +2622,11 @@ void Params::Categorize() {
   AddCategory("param-medic options", items);
 
   items.clear();
+  items.insert("append-to-index");
   items.insert("ascending");
   items.insert("column-type");
   items.insert("comparison");
+  items.insert("compress-index");
   items.insert("concat");
   items.insert("decoy-prefix");
   items.insert("decoy-xml-output");
@@ -2137,9 +2634,15 @@ void Params::Categorize() {
   items.insert("feature-file-out");
   items.insert("file-column");
   items.insert("fileroot");
+  items.insert("flat-auxlocs");
   items.insert("header");
+  items.insert("index-shards");
   items.insert("list-of-files");
   items.insert("mass-precision");
+  items.insert("memory-index");
+  items.insert("memory-limit");
+  items.insert("metrics-address");
+  items.insert("metrics-port");
   items.insert("mzid-output");
   items.insert("num_output_lines");
   items.insert("output-dir");
@@ -2159,16 +2662,29 @@ void Params::Categorize() {
   items.insert("print-search-progress");
   items.insert("print_expect_score");
   items.insert("sample_enzyme_number");
+  items.insert("server-jobs");
+  items.insert("spectral-library");
+  items.insert("library-psms");
+  items.insert("library-min-cosine");
+  items.insert("library-precursor-tolerance");
   items.insert("show_fragment_ions");
+  items.insert("spectrum-cache-dir");
   items.insert("spectrum-format");
   items.insert("spectrum-parser");
   items.insert("sqt-output");
   items.insert("store-index");
+  items.insert("store-peaks");
   items.insert("store-spectra");
   items.insert("temp-dir");
   items.insert("top-match");
   items.insert("txt-output");
+  items.insert("txt-format");
+  items.insert("compress-output");
+  items.insert("qc-report");
+  items.insert("checkpoint-interval");
+  items.insert("resume");
   items.insert("use-z-line");
+  items.insert("multiplexed-spectra");
   items.insert("verbosity");
   items.insert("xlink-print-db");
   AddCategory("Input and output", items);
@@ -2288,6 +2804,17 @@ void Params::Finalize() {
   paramContainer_.FinalizeParams();
 }
 
+void Params::Reset() {
+  for (map<string, Param*>::iterator i = paramContainer_.params_.begin();
+       i != paramContainer_.params_.end();
+       i++) {
+    i->second->Reset();
+  }
+  // Finalizing defined the static mods, and the command the rest.
+  ModificationDefinition::ClearAll();
+  paramContainer_.finalized_ = false;
+}
+
 void Params::Write(ostream* out, bool defaults) {
   if (out == NULL || !out->good()) {
     throw runtime_error("Bad file stream for writing parameter file");
@@ -2429,6 +2956,8 @@ string Params::ProcessHtmlDocTags(string s, bool html) {
 vector< pair< string, vector<string> > > Params::GroupByCategory(const vector<string>& options) {
   vector< pair< string, vector<string> > > groups;
 
+  paramContainer_.Categorize();
+
   pair< string, vector<string> > uncategorizedPair = make_pair("", vector<string>(options));
   vector<string>& uncategorized = uncategorizedPair.second;
 
@@ -2750,6 +3279,7 @@ void BoolParam::Set(const string& value) {
                         "(expected boolean)");
   }
 }
+void BoolParam::Reset() { value_ = original_; }
 bool BoolParam::From(int i) { return i != 0; }
 bool BoolParam::From(double d) { return d != 0; }
 bool BoolParam::From(string s) {
@@ -2801,6 +3331,7 @@ void IntParam::Set(const string& value) {
                         "(expected int)");
   }
 }
+void IntParam::Reset() { value_ = original_; }
 int IntParam::From(bool b) { return b ? 1 : 0; }
 int IntParam::From(double d) { return (int)d; }
 int IntParam::From(const string& s) { return StringUtils::FromString<int>(s); }
@@ -2844,6 +3375,7 @@ void DoubleParam::Set(const string& value) {
                         "(expected float)");
   }
 }
+void DoubleParam::Reset() { value_ = original_; }
 double DoubleParam::From(bool b) { return b ? 1 : 0; }
 double DoubleParam::From(int i) { return (double)i; }
 double DoubleParam::From(const string& s) { return StringUtils::FromString<double>(s); }
@@ -2885,6 +3417,7 @@ void StringParam::Set(double value) { value_ = From(value); }
 void StringParam::Set(const string& value) {
   value_ = value != "__NULL_STR" ? value : "";
 }
+void StringParam::Reset() { value_ = original_; }
 string StringParam::From(bool b) { return b ? "true" : "false"; }
 string StringParam::From(int i) { return StringUtils::ToString(i); }
 string StringParam::From(double d) { return StringUtils::ToString(d); }
@@ -2915,6 +3448,7 @@ void ArgParam::Set(int value) { values_ = vector<string>(1, StringParam::From(va
 void ArgParam::Set(double value) { values_ = vector<string>(1, StringParam::From(value)); }
 void ArgParam::Set(const string& value) { values_ = vector<string>(1, value); }
 void ArgParam::AddValue(const string& value) { values_.push_back(value); }
+void ArgParam::Reset() { values_.clear(); }
 
 /*
  * Local Variables:
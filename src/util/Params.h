@@ -72,6 +72,10 @@ class Params {
   // Lock parameters and prevent them from being modified
   static void Finalize();
 
+  // Return every parameter to its default and allow them to be modified again,
+  // so that another command can be run in the same process
+  static void Reset();
+
   // Write all contents of the ordered parameter list to file
   static void Write(std::ostream* out, bool defaults = false);
 
@@ -97,7 +101,7 @@ class Params {
     std::set<const Param*> Items;
   };
 
-  // Group parameters by category
+  // Group parameters by category, once
   void Categorize();
 
   // Initialize optional parameters
@@ -184,6 +188,7 @@ class Params {
   std::map<std::string, Param*> params_;
   std::vector<const Param*> paramsOrdered_;
   std::vector<ParamCategory> categories_;
+  bool categorized_;
   bool finalized_;
 };
 
@@ -238,6 +243,9 @@ class Param {
   virtual void Set(const char* value);
   virtual void Set(const std::string& value);
 
+  // Return the parameter to its original value
+  virtual void Reset() = 0;
+
   // Get the parameter as a string to write to a parameter file
   virtual std::string GetParamFileString(bool defaultValue = false) const;
  protected:
@@ -266,6 +274,7 @@ class BoolParam : public Param {
   void Set(int value);
   void Set(double value);
   void Set(const std::string& value);
+  void Reset();
 
   static bool From(int i);
   static bool From(double d);
@@ -298,6 +307,7 @@ class IntParam : public Param {
   void Set(int value);
   void Set(double value);
   void Set(const std::string& value);
+  void Reset();
 
   static int From(bool b);
   static int From(double d);
@@ -330,6 +340,7 @@ class DoubleParam : public Param {
   void Set(int value);
   void Set(double value);
   void Set(const std::string& value);
+  void Reset();
 
   static double From(bool b);
   static double From(int i);
@@ -361,6 +372,7 @@ class StringParam : public Param {
   void Set(int value);
   void Set(double value);
   void Set(const std::string& value);
+  void Reset();
 
   static std::string From(bool b);
   static std::string From(int i);
@@ -390,6 +402,7 @@ class ArgParam : public Param {
   void Set(int value);
   void Set(double value);
   void Set(const std::string& value);
+  void Reset();
   void AddValue(const std::string& value);
  protected:
   std::vector<std::string> values_;
@@ -0,0 +1,64 @@
+/**
+ * \file StringInterner.h
+ * \brief Numbers distinct strings, such as peptide sequences or protein ids.
+ *
+ * Each distinct string is stored once and given the next integer id, so
+ * that callers can keep, compare and hash ids instead of strings.
+ */
+#ifndef STRING_INTERNER_H
+#define STRING_INTERNER_H
+
+#include <string>
+#include <vector>
+#include "boost/unordered_map.hpp"
+
+class StringInterner {
+ public:
+  /**
+   * \returns The id of s, numbering it if it has not been seen.
+   */
+  int Intern(const std::string& s) {
+    std::pair<boost::unordered_map<std::string, int>::iterator, bool> found =
+      ids_.insert(std::make_pair(s, (int) strings_.size()));
+    if (found.second) {
+      strings_.push_back(&found.first->first);
+    }
+    return found.first->second;
+  }
+
+  /**
+   * \returns The id of s, or -1 if it has not been seen.
+   */
+  int Find(const std::string& s) const {
+    boost::unordered_map<std::string, int>::const_iterator found = ids_.find(s);
+    return found == ids_.end() ? -1 : found->second;
+  }
+
+  /**
+   * \returns The string with the given id.
+   */
+  const std::string& Get(int id) const { return *strings_[id]; }
+
+  /**
+   * \returns The number of distinct strings.
+   */
+  size_t Size() const { return strings_.size(); }
+
+  void Clear() {
+    ids_.clear();
+    strings_.clear();
+  }
+
+ protected:
+  boost::unordered_map<std::string, int> ids_;
+  std::vector<const std::string*> strings_; ///< keys of ids_, by id
+};
+
+#endif // STRING_INTERNER_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */
@@ -1,5 +1,10 @@
 #include "StringUtils.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdint.h>
+
 #include "boost/algorithm/string.hpp"
 
 using namespace std;
@@ -18,6 +23,119 @@ vector<string> StringUtils::Fields(const string& s) {
   return Fields<string>(s);
 }
 
+string StringUtils::ToString(double value, int decimals, bool fixedFloat) {
+  char buf[NUMBER_BUFFER_SIZE];
+  return string(buf, FormatNumber(buf, value, decimals, fixedFloat));
+}
+
+string StringUtils::ToString(float value, int decimals, bool fixedFloat) {
+  return ToString((double)value, decimals, fixedFloat);
+}
+
+string StringUtils::ToString(int value, int decimals, bool fixedFloat) {
+  return ToString((long)value, decimals, fixedFloat);
+}
+
+string StringUtils::ToString(unsigned int value, int decimals, bool fixedFloat) {
+  return ToString((unsigned long)value, decimals, fixedFloat);
+}
+
+string StringUtils::ToString(long value, int decimals, bool fixedFloat) {
+  char buf[NUMBER_BUFFER_SIZE];
+  return string(buf, FormatNumber(buf, value));
+}
+
+string StringUtils::ToString(unsigned long value, int decimals, bool fixedFloat) {
+  char buf[NUMBER_BUFFER_SIZE];
+  return string(buf, FormatNumber(buf, value));
+}
+
+/**
+ * Writes the decimal digits of value into buf, returning their number.
+ */
+static size_t WriteDigits(char* buf, uint64_t value) {
+  char digits[32];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = digits[n - 1 - i];
+  }
+  buf[n] = '\0';
+  return n;
+}
+
+/**
+ * printf of value into buf, cut off at StringUtils::NUMBER_BUFFER_SIZE - 1
+ * chars, which only a few hundred decimals can reach.
+ */
+static size_t Print(char* buf, const char* format, int decimals, double value) {
+  int n = snprintf(buf, StringUtils::NUMBER_BUFFER_SIZE, format, decimals, value);
+  return n < 0 ? 0 : std::min((size_t)n, StringUtils::NUMBER_BUFFER_SIZE - 1);
+}
+
+// Fixed notation with few decimals, which is how nearly all scores and masses
+// are written, is done with integer arithmetic: the value is scaled by
+// 10^decimals and rounded. The product may be off from the exact scaled value
+// by a few units in its last place, so when it lies too close to a rounding
+// tie to tell which way printf would round, printf is used instead, as it is
+// for every other notation.
+size_t StringUtils::FormatNumber(char* buf, double value, int decimals, bool fixedFloat) {
+  static const double POWERS[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12
+  };
+  static const int MAX_FAST_DECIMALS = sizeof(POWERS) / sizeof(POWERS[0]) - 1;
+  if (decimals < 0) {
+    return Print(buf, "%.*g", 8, value);
+  } else if (!fixedFloat) {
+    return Print(buf, "%.*g", decimals, value);
+  }
+  if (decimals <= MAX_FAST_DECIMALS) {
+    bool negative = value < 0 || (value == 0 && 1 / value < 0);
+    double scaled = fabs(value) * POWERS[decimals];
+    if (scaled < 1e15) {
+      double whole = floor(scaled);
+      double fraction = scaled - whole;
+      if (fabs(fraction - 0.5) > scaled * 1e-15 + 1e-9) {
+        uint64_t rounded = (uint64_t)whole + (fraction > 0.5 ? 1 : 0);
+        uint64_t power = (uint64_t)POWERS[decimals];
+        char* p = buf;
+        if (negative) {
+          *p++ = '-';
+        }
+        p += WriteDigits(p, rounded / power);
+        if (decimals > 0) {
+          *p++ = '.';
+          uint64_t digits = rounded % power;
+          for (int i = decimals - 1; i >= 0; i--) {
+            p[i] = '0' + digits % 10;
+            digits /= 10;
+          }
+          p += decimals;
+        }
+        *p = '\0';
+        return p - buf;
+      }
+    }
+  }
+  return Print(buf, "%.*f", decimals, value);
+}
+
+size_t StringUtils::FormatNumber(char* buf, long value) {
+  if (value >= 0) {
+    return FormatNumber(buf, (unsigned long)value);
+  }
+  buf[0] = '-';
+  // negate as unsigned so that the most negative value does not overflow
+  return 1 + FormatNumber(buf + 1, 0UL - (unsigned long)value);
+}
+
+size_t StringUtils::FormatNumber(char* buf, unsigned long value) {
+  return WriteDigits(buf, value);
+}
+
 string StringUtils::ToLower(string s) {
   boost::to_lower(s);
   return s;
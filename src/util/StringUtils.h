@@ -49,6 +49,23 @@ class StringUtils {
     return converter.str();
   }
 
+  // Numbers are written into a char buffer rather than through a stream;
+  // the result is the same as for the template above
+  static std::string ToString(double value, int decimals = -1, bool fixedFloat = true);
+  static std::string ToString(float value, int decimals = -1, bool fixedFloat = true);
+  static std::string ToString(int value, int decimals = -1, bool fixedFloat = true);
+  static std::string ToString(unsigned int value, int decimals = -1, bool fixedFloat = true);
+  static std::string ToString(long value, int decimals = -1, bool fixedFloat = true);
+  static std::string ToString(unsigned long value, int decimals = -1, bool fixedFloat = true);
+
+  // Write a number into buf as ToString would, returning its length;
+  // buf must hold NUMBER_BUFFER_SIZE chars, and the number is cut off there
+  static size_t FormatNumber(char* buf, double value, int decimals = -1, bool fixedFloat = true);
+  static size_t FormatNumber(char* buf, long value);
+  static size_t FormatNumber(char* buf, unsigned long value);
+
+  static const size_t NUMBER_BUFFER_SIZE = 512;
+
   // Joins a vector of strings into a single string separated by a delimiter
   template<typename T>
   static std::string Join(const T values, const char delimiter ='\0') {
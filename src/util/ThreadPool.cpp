@@ -0,0 +1,145 @@
+/**
+ * \file ThreadPool.cpp
+ * \brief One pool of worker threads shared by all the applications.
+ */
+#include "ThreadPool.h"
+#include <boost/bind.hpp>
+#include "Params.h"
+#include "io/carp.h"
+
+using namespace std;
+
+namespace {
+
+ThreadPool* pool = NULL;
+boost::once_flag pool_once = BOOST_ONCE_INIT;
+
+}
+
+ThreadPool::TaskGroup::TaskGroup() : pending_(0) {
+  Instance()->Grow(RequestedWorkers());
+}
+
+ThreadPool::TaskGroup::~TaskGroup() {
+  Wait();
+}
+
+void ThreadPool::TaskGroup::Run(const Task& task) {
+  Instance()->Submit(task, this);
+}
+
+void ThreadPool::TaskGroup::Wait() {
+  Instance()->WaitFor(this);
+}
+
+int ThreadPool::Threads() {
+  ThreadPool* instance = Instance();
+  boost::mutex::scoped_lock lock(instance->mutex_);
+  return instance->workers_ + 1;
+}
+
+int ThreadPool::RequestedWorkers() {
+  int threads = Params::GetInt("num-threads");
+  if (threads < 1) {
+    threads = boost::thread::hardware_concurrency();
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  return threads - 1;
+}
+
+void ThreadPool::CreatePool() {
+  // The pool, and its workers, last until the process exits.
+  pool = new ThreadPool(RequestedWorkers());
+}
+
+ThreadPool* ThreadPool::Instance() {
+  boost::call_once(&ThreadPool::CreatePool, pool_once);
+  return pool;
+}
+
+ThreadPool::ThreadPool(int workers) : workers_(0) {
+  Grow(workers);
+}
+
+void ThreadPool::Grow(int workers) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (workers <= workers_) {
+    return;
+  }
+  carp(CARP_DEBUG, "Starting %d more worker threads, for a pool of %d",
+       workers - workers_, workers);
+  for (; workers_ < workers; workers_++) {
+    boost::thread(boost::bind(&ThreadPool::WorkerLoop, this)).detach();
+  }
+}
+
+void ThreadPool::Submit(const Task& task, TaskGroup* group) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (workers_ == 0) {
+    // Nobody else would run it before the group is waited on
+    lock.unlock();
+    task();
+    return;
+  }
+  Entry entry;
+  entry.task = task;
+  entry.group = group;
+  queue_.push_back(entry);
+  ++group->pending_;
+  queued_.notify_one();
+}
+
+void ThreadPool::WaitFor(TaskGroup* group) {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (group->pending_ > 0) {
+    deque<Entry>::iterator i = queue_.begin();
+    while (i != queue_.end() && i->group != group) {
+      ++i;
+    }
+    if (i == queue_.end()) {
+      // The rest of the group is running on the workers
+      done_.wait(lock);
+      continue;
+    }
+    Entry entry = *i;
+    queue_.erase(i);
+    RunEntry(entry, lock);
+  }
+}
+
+void ThreadPool::WorkerLoop() {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    while (queue_.empty()) {
+      queued_.wait(lock);
+    }
+    Entry entry = queue_.front();
+    queue_.pop_front();
+    RunEntry(entry, lock);
+  }
+}
+
+/**
+ * Runs the task of entry with lock released, and counts it done, even if it
+ * throws: the group's destructor waits on it while the exception unwinds.
+ */
+void ThreadPool::RunEntry(const Entry& entry, boost::mutex::scoped_lock& lock) {
+  lock.unlock();
+  try {
+    entry.task();
+  } catch (...) {
+    lock.lock();
+    FinishEntry(entry);
+    throw;
+  }
+  lock.lock();
+  FinishEntry(entry);
+}
+
+void ThreadPool::FinishEntry(const Entry& entry) {
+  if (--entry.group->pending_ == 0) {
+    done_.notify_all();
+  }
+}
@@ -0,0 +1,92 @@
+/**
+ * \file ThreadPool.h
+ * \brief One pool of worker threads shared by all the applications of a
+ * process.
+ *
+ * The pool has num-threads - 1 workers (all the cores for 0), so that with
+ * the thread waiting on a TaskGroup there are num-threads at work. It is
+ * started on first use, and grows when a TaskGroup is made while num-threads
+ * asks for more threads than it has, as a later command of a batch may; it
+ * never shrinks. Work is handed out as TaskGroups: Run() queues a task and
+ * Wait() returns once every task of the group has run. A thread in Wait()
+ * runs the queued tasks of its own group rather than sleep, so a task may
+ * wait on a group of its own, and applications run side by side (as by
+ * Pipeline) share the workers instead of each starting threads for every
+ * core.
+ *
+ * A task may wait only on work that a thread has already claimed or is
+ * running, never on a task that is still queued: with every worker busy, or
+ * no workers at all, the queued task may not run until the waiting one
+ * returns. tide-search's search tasks wait on one another only in that way:
+ * ResultSink::WaitForTurn waits for the thread that claimed the chunk before
+ * its own, and the exclusive lock of a SharedPeptideWindow waits for the
+ * threads holding it shared, which are running.
+ */
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <deque>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+class ThreadPool {
+ public:
+  typedef boost::function<void ()> Task;
+
+  class TaskGroup {
+   public:
+    TaskGroup();
+    /**
+     * Waits for the tasks still queued or running.
+     */
+    ~TaskGroup();
+
+    void Run(const Task& task);
+    void Wait();
+   private:
+    friend class ThreadPool;
+    TaskGroup(const TaskGroup&);
+    TaskGroup& operator=(const TaskGroup&);
+
+    int pending_;  ///< tasks queued or running; guarded by the pool's mutex
+  };
+
+  /**
+   * \returns The threads that work on a TaskGroup: the workers, and the
+   * thread that waits on it.
+   */
+  static int Threads();
+
+ private:
+  struct Entry {
+    Task task;
+    TaskGroup* group;
+  };
+
+  static ThreadPool* Instance();
+  static void CreatePool();
+  /**
+   * \returns num-threads - 1, or one less than the cores for 0.
+   */
+  static int RequestedWorkers();
+  explicit ThreadPool(int workers);
+
+  /**
+   * Starts workers until there are at least workers.
+   */
+  void Grow(int workers);
+
+  void Submit(const Task& task, TaskGroup* group);
+  void WaitFor(TaskGroup* group);
+  void WorkerLoop();
+  void RunEntry(const Entry& entry, boost::mutex::scoped_lock& lock);
+  void FinishEntry(const Entry& entry);
+
+  int workers_;  ///< guarded by mutex_
+  boost::mutex mutex_;
+  boost::condition_variable queued_;  ///< a task was queued
+  boost::condition_variable done_;    ///< a task finished
+  std::deque<Entry> queue_;
+};
+
+#endif // THREADPOOL_H
@@ -1069,7 +1069,8 @@ FILE* create_file_in_path(
 ofstream* create_stream_in_path(
   const char* filename,  ///< the filename to create & open -in
   const char* directory,  ///< the directory to open the file in -in
-  bool overwrite  ///< replace file (T) or die if exists (F)
+  bool overwrite,  ///< replace file (T) or die if exists (F)
+  bool binary  ///< open the file in binary mode
 ) {
   char* file_full_path = get_full_filename(directory, filename);
   // FIXME CEG consider using stat instead
@@ -1091,7 +1092,7 @@ ofstream* create_stream_in_path(
     }
   }
   
-  ofstream* fout = new ofstream(file_full_path);
+  ofstream* fout = new ofstream(file_full_path, binary ? ios::out | ios::binary : ios::out);
 
   if (fout == NULL) {
     carp(CARP_FATAL, "Failed to create and open file: %s", file_full_path);
@@ -1516,21 +1517,25 @@ void get_search_result_paths(
       }
     }
   } else {
-    string target = infile;
-    string decoy = infile;
-    check_target_decoy_files(target, decoy);
-    if (!target.empty()) {
-      if (FileUtils::Exists(target)) {
-        outpaths.push_back(target);
-      } else {
-        carp(CARP_ERROR, "Target file '%s' doesn't exist", target.c_str());
+    vector<string> shards(1, infile);
+    expand_shard_manifests(shards);
+    for (vector<string>::const_iterator i = shards.begin(); i != shards.end(); ++i) {
+      string target = *i;
+      string decoy = *i;
+      check_target_decoy_files(target, decoy);
+      if (!target.empty()) {
+        if (FileUtils::Exists(target)) {
+          outpaths.push_back(target);
+        } else {
+          carp(CARP_ERROR, "Target file '%s' doesn't exist", target.c_str());
+        }
       }
-    }
-    if (!decoy.empty()) {
-      if (FileUtils::Exists(decoy)) {
-        outpaths.push_back(decoy);
-      } else {
-        carp(CARP_ERROR, "Decoy file '%s' doesn't exist", decoy.c_str());
+      if (!decoy.empty()) {
+        if (FileUtils::Exists(decoy)) {
+          outpaths.push_back(decoy);
+        } else {
+          carp(CARP_ERROR, "Decoy file '%s' doesn't exist", decoy.c_str());
+        }
       }
     }
   }
@@ -1557,6 +1562,37 @@ void get_files_from_list(
   }
 }
 
+void expand_shard_manifests(
+  std::vector<std::string> &paths ///< paths of search results -in/out
+  ) {
+  vector<string> expanded;
+  for (vector<string>::const_iterator i = paths.begin(); i != paths.end(); ++i) {
+    if (!StringUtils::IEndsWith(*i, ".shards")) {
+      expanded.push_back(*i);
+      continue;
+    }
+    if (!FileUtils::Exists(*i)) {
+      carp(CARP_FATAL, "Shard manifest '%s' doesn't exist", i->c_str());
+    }
+    string dir = FileUtils::DirName(*i);
+    size_t before = expanded.size();
+    LineFileReader reader(*i);
+    while (reader.hasNext()) {
+      string shard = StringUtils::Trim(reader.next());
+      if (shard.empty() || shard[0] == '#') {
+        continue;
+      }
+      if (shard[0] != '/' && !dir.empty()) {
+        shard = FileUtils::Join(dir, shard);
+      }
+      expanded.push_back(shard);
+    }
+    carp(CARP_INFO, "Shard manifest %s lists %d files.",
+         i->c_str(), (int)(expanded.size() - before));
+  }
+  paths.swap(expanded);
+}
+
 bool parseUrl(string url, string* host, string* path) {
   if (!host || !path) {
     return false;
@@ -237,7 +237,8 @@ FILE* create_file_in_path(
 std::ofstream* create_stream_in_path(
   const char* filename,  ///< the filename to create & open -in
   const char* directory,  ///< the directory to open the file in -in
-  bool overwrite  ///< replace file (T) or die if exists (F)
+  bool overwrite,  ///< replace file (T) or die if exists (F)
+  bool binary = false  ///< open the file in binary mode
   );
 
 /**
@@ -476,6 +477,16 @@ void get_files_from_list(
   std::vector<std::string> &outpaths ///< paths of all search results -out
 );
 
+/**
+ * \brief Replaces each shard manifest (a file ending in .shards) in paths
+ * with the result files it lists, one per line, in order. Relative entries
+ * are taken relative to the manifest's directory; blank lines and lines
+ * starting with '#' are skipped.
+ */
+void expand_shard_manifests(
+  std::vector<std::string> &paths ///< paths of search results -in/out
+);
+
 bool parseUrl(std::string url, std::string* host, std::string* path);
 std::string httpRequest(const std::string& url, const std::string& data = "", bool waitForResponse = true);
 void postToAnalytics(const std::string& appName);
@@ -18,90 +18,59 @@
 
 /* Private Variables */
 
+// Set mass high to prevent peptides containing B, X, Z or any character that
+// is not an amino acid
+#define NOT_AA 7000.0
+#define NOT_AA_ROW \
+  NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, \
+  NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA
+
 /**
- * Array to store the amino acid masses
+ * The average and monoisotopic masses of the amino acids, indexed by mass
+ * type and by character, so that a lookup in the inner loops of the mass
+ * calculations is one load. They are in the program image, and only the
+ * static modifications are added at run time, by increase_amino_acid_mass().
  */
-FLOAT_T amino_masses[('Z' - 'A')*2 + 2];
+FLOAT_T amino_masses[NUMBER_MASS_TYPES][256] = {
+  { // AVERAGE
+    NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW, // 0-63
+    NOT_AA, 71.0788, NOT_AA, 103.1388, 115.0886, 129.1155, 147.1766, 57.0519,
+    137.1411, 113.1594, 113.1594, 128.1741, 113.1594, 131.1926, 114.1038, 114.1472, // '@'-'O'
+    97.1167, 128.1307, 156.1875, 87.0782, 101.1051, 150.0388, 99.1326, 186.2132,
+    NOT_AA, 163.176, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, // 'P'-'_'
+    NOT_AA_ROW, NOT_AA_ROW, // 96-127
+    NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW,
+    NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW // 128-255
+  },
+  { // MONO
+    NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW, // 0-63
+    NOT_AA, 71.03711, NOT_AA, 103.00919, 115.02694, 129.04259, 147.06841, 57.02146,
+    137.05891, 113.08406, 113.08406, 128.09496, 113.08406, 131.04049, 114.04293, 114.07931, // '@'-'O'
+    97.05276, 128.05858, 156.10111, 87.03203, 101.04768, 150.04344, 99.06841, 186.07931,
+    NOT_AA, 163.06333, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, NOT_AA, // 'P'-'_'
+    NOT_AA_ROW, NOT_AA_ROW, // 96-127
+    NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW,
+    NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW, NOT_AA_ROW // 128-255
+  }
+};
+
+#undef NOT_AA_ROW
+#undef NOT_AA
+
 enum {NUM_MOD_MASSES = 2048}; // 2 ^ MAX_AA_MODS = 2^11 = 2048
 FLOAT_T aa_mod_masses[(int)NUM_MOD_MASSES];
 
-
 /**
- * Have we initialized the amino acid masses?
+ * Have we initialized the amino acid modification masses?
  */
-bool initialized_amino_masses = false;
+bool initialized_aa_mod_masses = false;
 
-// FIXME need to find the monoisotopic mass for some AA -chris
 /**
- * initializes the mass array
+ * initializes the array of modification masses
  */
-void initialize_amino_masses() {
-  // average mass
-  amino_masses['A' - 'A'] = 71.0788;
-  // set mass high to prevent peptides containing B
-  amino_masses['B' - 'A'] = 7000.0;
-  amino_masses['C' - 'A'] = 103.1388;
-  amino_masses['D' - 'A'] = 115.0886;
-  amino_masses['E' - 'A'] = 129.1155;
-  amino_masses['F' - 'A'] = 147.1766;
-  amino_masses['G' - 'A'] = 57.0519;
-  amino_masses['H' - 'A'] = 137.1411;
-  amino_masses['I' - 'A'] = 113.1594;
-  amino_masses['J' - 'A'] = 113.1594;
-  amino_masses['K' - 'A'] = 128.1741;
-  amino_masses['L' - 'A'] = 113.1594;
-  amino_masses['M' - 'A'] = 131.1926;
-  amino_masses['N' - 'A'] = 114.1038;
-  amino_masses['O' - 'A'] = 114.1472;
-  amino_masses['P' - 'A'] = 97.1167;
-  amino_masses['Q' - 'A'] = 128.1307;
-  amino_masses['R' - 'A'] = 156.1875;
-  amino_masses['S' - 'A'] = 87.0782;
-  amino_masses['T' - 'A'] = 101.1051;
-  amino_masses['U' - 'A'] = 150.0388;
-  amino_masses['V' - 'A'] = 99.1326;
-  amino_masses['W' - 'A'] = 186.2132;
-  // set mass high to prevent peptides containing X
-  amino_masses['X' - 'A'] = 7000.0;
-  amino_masses['Y' - 'A'] = 163.1760;
-  // set mass high to prevent peptides containing Z
-  amino_masses['Z' - 'A'] = 7000.0;
-  
-  // monoisotopic mass
-  amino_masses['A' - 'A' + 26] = 71.03711;
-  // set mass high to prevent peptides containing B
-  amino_masses['B' - 'A' + 26] = 7000.0;
-  amino_masses['C' - 'A' + 26] = 103.00919;
-  amino_masses['D' - 'A' + 26] = 115.02694;
-  amino_masses['E' - 'A' + 26] = 129.04259;
-  amino_masses['F' - 'A' + 26] = 147.06841;
-  amino_masses['G' - 'A' + 26] = 57.02146;
-  amino_masses['H' - 'A' + 26] = 137.05891;
-  amino_masses['I' - 'A' + 26] = 113.08406;
-  amino_masses['J' - 'A' + 26] = 113.08406;
-  amino_masses['K' - 'A' + 26] = 128.09496;
-  amino_masses['L' - 'A' + 26] = 113.08406;
-  amino_masses['M' - 'A' + 26] = 131.04049;
-  amino_masses['N' - 'A' + 26] = 114.04293;
-  amino_masses['O' - 'A' + 26] = 114.07931;
-  amino_masses['P' - 'A' + 26] = 97.05276;
-  amino_masses['Q' - 'A' + 26] = 128.05858;
-  amino_masses['R' - 'A' + 26] = 156.10111;
-  amino_masses['S' - 'A' + 26] = 87.03203;
-  amino_masses['T' - 'A' + 26] = 101.04768;
-  amino_masses['U' - 'A' + 26] = 150.04344;
-  amino_masses['V' - 'A' + 26] = 99.06841;
-  amino_masses['W' - 'A' + 26] = 186.07931;
-  // set mass high to prevent peptides containing X
-  amino_masses['X' - 'A' + 26] = 7000.0;
-  amino_masses['Y' - 'A' + 26] = 163.06333;
-  // set mass high to prevent peptides containing Z
-  amino_masses['Z' - 'A' + 26] = 7000.0;
-  
-  // modifications
+static void initialize_aa_mod_masses() {
   initialize_aa_mod_combinations_array();
-
-  initialized_amino_masses = true;
+  initialized_aa_mod_masses = true;
 }
 
 /**
@@ -161,14 +130,10 @@ FLOAT_T get_mass_amino_acid(
   char amino_acid, ///< the query amino acid -in
   MASS_TYPE_T mass_type ///< the isotopic mass type (AVERAGE, MONO) -in
 ) {
-  if (mass_type == AVERAGE) {
-    return get_mass_amino_acid_average(amino_acid);
-  } else if (mass_type == MONO) {
-    return get_mass_amino_acid_monoisotopic(amino_acid);
+  if ((unsigned int)mass_type >= NUMBER_MASS_TYPES) {
+    carp(CARP_FATAL, "ERROR: mass type does not exist\n");
   }
-  carp(CARP_FATAL, "ERROR: mass type does not exist\n");
-  // avoid compiler warning
-  return 1;
+  return amino_masses[mass_type][(unsigned char)amino_acid];
 }
 
 /**
@@ -195,12 +160,7 @@ FLOAT_T get_mass_mod_amino_acid(
 FLOAT_T get_mass_amino_acid_average(
   char amino_acid ///< the query amino acid -in
 ) {
-  // has the amino_masses array been initialized?
-  if (!initialized_amino_masses) {
-    initialize_amino_masses();
-    initialized_amino_masses = true;
-  }
-  return(amino_masses[(short int)amino_acid - 'A']);
+  return amino_masses[AVERAGE][(unsigned char)amino_acid];
 }
 
 /**
@@ -209,16 +169,15 @@ FLOAT_T get_mass_amino_acid_average(
 FLOAT_T get_mass_mod_amino_acid_average(
   MODIFIED_AA_T amino_acid ///< the query amino acid -in
 ) {
-  if (!initialized_amino_masses) {
-    initialize_amino_masses();
+  if (!initialized_aa_mod_masses) {
+    initialize_aa_mod_masses();
   }
   //printf("aa is %hu, char %c\n", (unsigned short)amino_acid, modified_aa_to_char(amino_acid));
 
   short int aa = amino_acid & GET_AA_MASK;
   unsigned short int mod = amino_acid & GET_MOD_MASK;
   mod = mod >> 5;
-  //printf("aa idx %hi mass %.3f + mod idx %hu mass %.3f\n", aa,  amino_masses[aa], mod, aa_mod_masses[mod]);
-  return amino_masses[aa] + aa_mod_masses[mod];
+  return amino_masses[AVERAGE]['A' + aa] + aa_mod_masses[mod];
 
 }
 
@@ -230,8 +189,8 @@ FLOAT_T get_mass_mod_amino_acid_average(
  * given mass shift. 
  */
 MODIFIED_AA_T get_mod_identifier(FLOAT_T mass_shift) {
-  if (!initialized_amino_masses) {
-    initialize_amino_masses();
+  if (!initialized_aa_mod_masses) {
+    initialize_aa_mod_masses();
   }
 
   int precision = Params::GetInt("mod-precision");
@@ -257,12 +216,7 @@ MODIFIED_AA_T get_mod_identifier(FLOAT_T mass_shift) {
 FLOAT_T get_mass_amino_acid_monoisotopic(
   char amino_acid ///< the query amino acid -in
 ) {
-  // has the amino_masses array been initialized?
-  if (!initialized_amino_masses) {
-    initialize_amino_masses();
-    initialized_amino_masses = true;
-  }
-  return(amino_masses[(short int)amino_acid - 'A' + 26 ]);
+  return amino_masses[MONO][(unsigned char)amino_acid];
 }
 
 /**
@@ -271,15 +225,14 @@ FLOAT_T get_mass_amino_acid_monoisotopic(
 FLOAT_T get_mass_mod_amino_acid_monoisotopic(
   MODIFIED_AA_T amino_acid ///< the query amino acid -in
 ) {
-  if (!initialized_amino_masses) {
-    initialize_amino_masses();
+  if (!initialized_aa_mod_masses) {
+    initialize_aa_mod_masses();
   }
 
   short int aa = amino_acid & GET_AA_MASK;
   unsigned short int mod = amino_acid & GET_MOD_MASK;
   mod = mod >> 5;
-  //printf("mod aa idx %hi mass %.3f + mod idx %hu mass %.3f\n", aa,  amino_masses[aa+26], mod, aa_mod_masses[mod]);
-  return amino_masses[aa + 26] + aa_mod_masses[mod];
+  return amino_masses[MONO]['A' + aa] + aa_mod_masses[mod];
 
 }
 
@@ -291,17 +244,12 @@ void increase_amino_acid_mass(
   char amino_acid, ///< the query amino acid -in
   FLOAT_T update_mass ///< the mass amount to update for the amino acid -in
 ) {
-  // has the amino_masses array been initialized?
-  if (!initialized_amino_masses) {
-    initialize_amino_masses();
-    initialized_amino_masses = true;
-  }
-
   // check if amino acid
   if ((short int)amino_acid < 'A' || (short int)amino_acid > 'Z') {
-    carp(CARP_ERROR, "Cannot update mass, char: %c not an amino acid");
+    carp(CARP_ERROR, "Cannot update mass, char: %c not an amino acid", amino_acid);
+    return;
   }
   
-  amino_masses[(short int)amino_acid - 'A' + 26 ] += update_mass;
-  amino_masses[(short int)amino_acid - 'A'] += update_mass;
+  amino_masses[MONO][(unsigned char)amino_acid] += update_mass;
+  amino_masses[AVERAGE][(unsigned char)amino_acid] += update_mass;
 }
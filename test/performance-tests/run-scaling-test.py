@@ -0,0 +1,245 @@
+#!/usr/bin/env python
+# CREATE DATE: 14 October 2026
+# Derived from run-performance-test.py.
+
+# This script measures how the running time of the main crux commands
+# scales with the number of threads and with the amount of data.  Each
+# of tide-index, tide-search (XCorr, exact p-value and peptide-centric),
+# assign-confidence and percolator is run once for every combination of
+# --num-threads and input size, on the same data as the performance
+# test.  Input sizes are fractions of the spectra in the MS2 file.
+#
+# For each run the script records the wall time, the peak resident set
+# size, the number of spectra searched per second, and the parallel
+# efficiency relative to one thread (T(1) / (n * T(n))).  The results
+# are written as JSON to scaling-report.json, and as a table to
+# standard output.
+#
+# Given --baseline, the script compares each run with the run of the
+# same command, size and number of threads in an earlier report, and
+# exits with status 1 if any is slower than the baseline by more than
+# --tolerance.  Report files from different machines are not
+# comparable; keep one baseline per machine.
+import sys
+import subprocess
+import os
+import time
+import json
+import platform
+import optparse
+
+# The location of the crux binary.
+CRUX = "../../src/crux"
+
+# Input files.
+database = "worm+contaminants"
+ms2 = "051708-worm-ASMS-10.ms2"
+parameterFileName = "crux.param"
+
+usage = """Usage: run-scaling-test.py [options]
+
+Runs each command for every combination of the given thread counts and
+input sizes, and writes the timings to a JSON report."""
+parser = optparse.OptionParser(usage=usage)
+parser.add_option("--threads", default="1,2,4,8",
+                  help="Comma-separated values of --num-threads [%default]")
+parser.add_option("--sizes", default="0.25,0.5,1",
+                  help="Comma-separated fractions of the spectra to search [%default]")
+parser.add_option("--commands", default="tide-index,tide-search,exact-p-value,"
+                  "peptide-centric,assign-confidence,percolator",
+                  help="Comma-separated commands to run [%default]")
+parser.add_option("--report", default="scaling-report.json",
+                  help="Where to write the report [%default]")
+parser.add_option("--baseline", default="",
+                  help="Earlier report to compare against")
+parser.add_option("--tolerance", type="float", default=0.1,
+                  help="Slowdown relative to the baseline that counts as a "
+                  "regression [%default]")
+parser.add_option("--crux", default=CRUX, help="The crux binary [%default]")
+(options, args) = parser.parse_args()
+if len(args) != 0:
+  parser.print_help()
+  sys.exit(1)
+
+threadCounts = [int(x) for x in options.threads.split(",")]
+sizes = [float(x) for x in options.sizes.split(",")]
+commands = options.commands.split(",")
+
+#############################################################################
+# Run a command, exit if it fails, and return its wall time in seconds
+# and peak resident set size in kilobytes.
+def timeCommand(command, logFileName):
+  sys.stderr.write("RUN: %s\n" % command)
+  logFile = open(logFileName, "w")
+  start = time.time()
+  try:
+    child = subprocess.Popen(command, shell=True, stdout=logFile,
+                             stderr=subprocess.STDOUT)
+  except OSError as e:
+    sys.stderr.write("Execution failed: %s\n" % e)
+    sys.exit(1)
+  (pid, status, usage) = os.wait4(child.pid, 0)
+  seconds = time.time() - start
+  logFile.close()
+  if status != 0:
+    sys.stderr.write("Command failed with status %d; see %s.\n"
+                     % (status, logFileName))
+    sys.exit(1)
+  # ru_maxrss is in kilobytes on Linux and in bytes on OS X.
+  peakRSS = usage.ru_maxrss
+  if platform.system() == "Darwin":
+    peakRSS /= 1024
+  return (seconds, peakRSS)
+
+#############################################################################
+# Write the given fraction of the spectra of ms2File, with its header,
+# to a new file, and return the new file's name and number of spectra.
+def subsetSpectra(ms2File, fraction):
+  total = 0
+  for line in open(ms2File):
+    if line.startswith("S"):
+      total += 1
+  keep = max(1, int(total * fraction))
+  if keep >= total:
+    return (ms2File, total)
+  subsetName = "scaling.%g.ms2" % fraction
+  subset = open(subsetName, "w")
+  spectra = 0
+  for line in open(ms2File):
+    if line.startswith("S"):
+      spectra += 1
+      if spectra > keep:
+        break
+    subset.write(line)
+  subset.close()
+  return (subsetName, keep)
+
+#############################################################################
+# The command line and output directory for one run.
+def commandLine(command, threads, size, spectra):
+  outputDir = "scaling/%s.%g.%d" % (command, size, threads)
+  index = "scaling/index.%d" % threads
+  searchDir = "scaling/tide-search.%g.%d" % (size, threads)
+  common = "--overwrite T --num-threads %d --output-dir %s --parameter-file %s" \
+           % (threads, outputDir, parameterFileName)
+  if command == "tide-index":
+    # The index does not depend on the spectra; build it once for each
+    # number of threads.
+    return ("%s tide-index %s %s.fa %s"
+            % (options.crux, common, database, index), outputDir)
+  if command == "tide-search":
+    return ("%s tide-search %s %s %s" % (options.crux, common, spectra, index),
+            outputDir)
+  if command == "exact-p-value":
+    return ("%s tide-search %s --exact-p-value T %s %s"
+            % (options.crux, common, spectra, index), outputDir)
+  if command == "peptide-centric":
+    return ("%s tide-search %s --peptide-centric-search T %s %s"
+            % (options.crux, common, spectra, index), outputDir)
+  if command == "assign-confidence":
+    return ("%s assign-confidence %s %s/tide-search.txt"
+            % (options.crux, common, searchDir), outputDir)
+  if command == "percolator":
+    return ("%s percolator %s %s/tide-search.txt"
+            % (options.crux, common, searchDir), outputDir)
+  sys.stderr.write("Unknown command %s.\n" % command)
+  sys.exit(1)
+
+#############################################################################
+# MAIN
+#############################################################################
+
+if not os.path.isdir("scaling"):
+  os.mkdir("scaling")
+
+# The post-processors need the XCorr search, and every search needs the
+# index, so they are run in that order whatever the order given.
+order = ["tide-index", "tide-search", "exact-p-value", "peptide-centric",
+         "assign-confidence", "percolator"]
+commands = [c for c in order if c in commands]
+for c in options.commands.split(","):
+  if c not in order:
+    sys.stderr.write("Unknown command %s.\n" % c)
+    sys.exit(1)
+
+runs = []
+for threads in threadCounts:
+  if "tide-index" not in commands and not os.path.isdir("scaling/index.%d" % threads):
+    (command, outputDir) = commandLine("tide-index", threads, 1, "")
+    timeCommand(command, "scaling/index.%d.log" % threads)
+  for size in sizes:
+    (spectraFile, numSpectra) = subsetSpectra(ms2, size)
+    for command in commands:
+      if command == "tide-index" and size != sizes[0]:
+        continue
+      if (command in ["assign-confidence", "percolator"]
+          and "tide-search" not in commands):
+        searchDir = "scaling/tide-search.%g.%d" % (size, threads)
+        if not os.path.exists("%s/tide-search.txt" % searchDir):
+          (line, outputDir) = commandLine("tide-search", threads, size, spectraFile)
+          timeCommand(line, "%s.log" % searchDir)
+      (line, outputDir) = commandLine(command, threads, size, spectraFile)
+      (seconds, peakRSS) = timeCommand(line, "%s.log" % outputDir)
+      run = {"command": command,
+             "threads": threads,
+             "size": size if command != "tide-index" else None,
+             "spectra": numSpectra if command != "tide-index" else None,
+             "seconds": seconds,
+             "peak-rss-kb": peakRSS}
+      if command != "tide-index" and seconds > 0:
+        run["spectra-per-second"] = numSpectra / seconds
+      runs.append(run)
+
+# Parallel efficiency, relative to the run with the fewest threads.
+for run in runs:
+  single = [r for r in runs if r["command"] == run["command"]
+            and r["size"] == run["size"] and r["threads"] == min(threadCounts)]
+  if len(single) > 0 and run["seconds"] > 0:
+    run["parallel-efficiency"] = (single[0]["seconds"] * single[0]["threads"]
+                                  / (run["threads"] * run["seconds"]))
+
+report = {"crux": options.crux,
+          "host": platform.node(),
+          "machine": platform.machine(),
+          "cpus": os.sysconf("SC_NPROCESSORS_ONLN"),
+          "date": time.strftime("%Y-%m-%d %H:%M:%S"),
+          "runs": runs}
+reportFile = open(options.report, "w")
+json.dump(report, reportFile, indent=2, sort_keys=True)
+reportFile.write("\n")
+reportFile.close()
+sys.stderr.write("Wrote %s.\n" % options.report)
+
+# Compare with the baseline.
+regressions = 0
+baseline = {}
+if options.baseline != "":
+  for run in json.load(open(options.baseline))["runs"]:
+    baseline[(run["command"], run["size"], run["threads"])] = run
+
+sys.stdout.write("%-18s %6s %7s %9s %10s %11s %10s %10s\n"
+                 % ("command", "size", "threads", "seconds", "rss-MB",
+                    "spectra/s", "efficiency", "vs-base"))
+for run in runs:
+  key = (run["command"], run["size"], run["threads"])
+  versus = ""
+  if key in baseline and baseline[key]["seconds"] > 0:
+    ratio = run["seconds"] / baseline[key]["seconds"]
+    versus = "%.2fx" % ratio
+    if ratio > 1 + options.tolerance:
+      versus += " SLOWER"
+      regressions += 1
+  sys.stdout.write("%-18s %6s %7d %9.2f %10.1f %11s %10s %10s\n"
+                   % (run["command"],
+                      "" if run["size"] is None else "%g" % run["size"],
+                      run["threads"], run["seconds"], run["peak-rss-kb"] / 1024.0,
+                      "%.1f" % run["spectra-per-second"]
+                      if "spectra-per-second" in run else "",
+                      "%.2f" % run["parallel-efficiency"]
+                      if "parallel-efficiency" in run else "",
+                      versus))
+
+if regressions > 0:
+  sys.stderr.write("%d runs are more than %g%% slower than %s.\n"
+                   % (regressions, 100 * options.tolerance, options.baseline))
+  sys.exit(1)
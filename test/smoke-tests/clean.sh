@@ -4,4 +4,5 @@ rm -f nosp.txt
 rm -rf child ../yeast-index yeast-index ../sib
 rm -f existing_search/percolator.target.*
 rm -f *binary_fasta
+rm -rf tide-order
 rm -f good_results/*.observed
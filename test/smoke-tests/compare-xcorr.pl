@@ -0,0 +1,82 @@
+#!/usr/bin/perl
+
+# A script to compare the best XCorr scores of two tide-search results files
+# that may differ by rounding, as the 16-bit scoring backends do.
+# For each spectrum and charge, the top-ranked XCorr of the two files must
+# be within 4 * (length - 1) peaks (b and y ions of charge 1 and 2) of the
+# longer top-ranked peptide, times the given error of one peak.
+# Prints "within bound" if all are.
+
+use strict;
+
+my $usage = "USAGE: compare-xcorr.pl <per-peak error> <file 1> <file 2>";
+
+die "$usage\n" if @ARGV < 3;
+
+my $per_peak = shift @ARGV;
+my $filename1 = shift @ARGV;
+my $filename2 = shift @ARGV;
+
+# scores printed to 6 decimals or more
+my $print_error = 1e-6;
+
+my %best1 = read_best($filename1);
+my %best2 = read_best($filename2);
+
+my $success = 1;
+if (keys %best1 != keys %best2) {
+    print "The two files score different spectra.\n";
+    exit(1);
+}
+foreach my $key (sort keys %best1) {
+    if (!exists $best2{$key}) {
+        print "Spectrum $key is only in $filename1\n";
+        $success = 0;
+        next;
+    }
+    my ($score1, $length1) = @{$best1{$key}};
+    my ($score2, $length2) = @{$best2{$key}};
+    my $length = $length1 > $length2 ? $length1 : $length2;
+    my $bound = 4 * ($length - 1) * $per_peak + 2 * $print_error;
+    if (abs($score1 - $score2) > $bound) {
+        print "Spectrum $key: XCorr $score1 and $score2 differ by more than $bound\n";
+        $success = 0;
+    }
+}
+
+if ($success) {
+    print "within bound\n";
+    exit(0);
+}
+exit(1);
+
+# Returns the top-ranked XCorr and peptide length of each scan and charge
+# of a results file, keyed by "scan charge".
+sub read_best {
+    my ($filename) = @_;
+    open FILE, "$filename" or die "Can't open file $filename\n";
+    my $header = <FILE>;
+    chomp $header;
+    my @names = split /\t/, $header;
+    my %col;
+    for (my $i = 0; $i < @names; $i++) {
+        $col{$names[$i]} = $i;
+    }
+    foreach my $name ("scan", "charge", "xcorr score", "xcorr rank", "sequence") {
+        die "$filename has no column '$name'\n" if !exists $col{$name};
+    }
+    my %best;
+    while (my $line = <FILE>) {
+        chomp $line;
+        my @parts = split /\t/, $line;
+        next if $parts[$col{"xcorr rank"}] != 1;
+        my $sequence = $parts[$col{"sequence"}];
+        # leave out the modifications
+        $sequence =~ s/\[[^\]]*\]//g;
+        $sequence =~ s/[^A-Z]//g;
+        my $key = $parts[$col{"scan"}] . " " . $parts[$col{"charge"}];
+        $best{$key} = [$parts[$col{"xcorr score"}], length($sequence)];
+    }
+    close FILE;
+    return %best;
+}
@@ -0,0 +1,497 @@
+#include "TideBenchmarks.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <gflags/gflags.h>
+#include "app/TideIndexApplication.h"
+#include "app/tide/compiler.h"
+#include "app/tide/fifo_alloc.h"
+#include "app/tide/max_mz.h"
+#include "app/tide/peak_index.h"
+#include "app/tide/records_to_vector-inl.h"
+#include "app/tide/sp_scorer.h"
+#include "app/tide/theoretical_peak_set.h"
+#include "model/Peptide.h"
+#include "util/FileUtils.h"
+#include "util/Params.h"
+
+using namespace std;
+
+DECLARE_int32(fifo_page_size);
+
+// Peptides kept for the kernels that work on single peptides
+static const int SAMPLE_PEPTIDES = 20000;
+
+TideBenchmarks::TideBenchmarks(
+  const string& index,
+  const string& spectra_file,
+  int max_spec_charges,
+  const string& crux
+) : peptides_file_(FileUtils::Join(index, "pepix")), spectra_file_(spectra_file),
+    crux_(crux), nAA_(0), aaFreqN_(NULL), aaFreqI_(NULL), aaFreqC_(NULL), aaMass_(NULL) {
+  bin_width_ = Params::GetDouble("mz-bin-width");
+  bin_offset_ = Params::GetDouble("mz-bin-offset");
+  negative_isotope_errors_ = getNegativeIsotopeErrors();
+  backend_ = PeakIndexScorer::Select(Params::GetString("scoring-backend"));
+
+  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins_,
+        FileUtils::Join(index, "protix"))) {
+    carp(CARP_FATAL, "Error reading index (%s)", index.c_str());
+  }
+  pb::Header header;
+  HeadedRecordReader reader(peptides_file_, &header);
+  if (header.file_type() != pb::Header::PEPTIDES || !header.has_peptides_header()) {
+    carp(CARP_FATAL, "Error reading index (%s)", peptides_file_.c_str());
+  }
+  const pb::Header::PeptidesHeader& pepHeader = header.peptides_header();
+  MassConstants::Init(&pepHeader.mods(), &pepHeader.nterm_mods(),
+                      &pepHeader.cterm_mods(), bin_width_, bin_offset_);
+
+  // Every so many peptides, so that the sample covers the whole mass range
+  vector<pb::Peptide*> all;
+  while (!reader.Done()) {
+    pb::Peptide* peptide = new pb::Peptide;
+    reader.Read(peptide);
+    all.push_back(peptide);
+  }
+  size_t stride = max<size_t>(1, all.size() / SAMPLE_PEPTIDES);
+  for (size_t i = 0; i < all.size(); ++i) {
+    if (i % stride == 0 && sample_peptides_.size() < SAMPLE_PEPTIDES) {
+      sample_peptides_.push_back(all[i]);
+    } else {
+      delete all[i];
+    }
+  }
+  for (vector<pb::Peptide*>::const_iterator i = sample_peptides_.begin();
+       i != sample_peptides_.end(); ++i) {
+    const pb::Location& location = (*i)->first_location();
+    sample_sequences_.push_back(proteins_[location.protein_id()]->residues().substr(
+      location.pos(), (*i)->length()));
+  }
+
+  if (!spectra_.ReadSpectrumRecords(spectra_file_)) {
+    carp(CARP_FATAL, "Error reading spectrum file %s", spectra_file_.c_str());
+  }
+  spectra_.Sort();
+  highest_mz_ = spectra_.FindHighestMZ();
+  MaxBin::SetGlobalMax(highest_mz_);
+  const vector<SpectrumCollection::SpecCharge>& spec_charges = *spectra_.SpecCharges();
+  size_t sc_stride = max<size_t>(1, spec_charges.size() / max(1, max_spec_charges));
+  for (size_t i = 0; i < spec_charges.size(); i += sc_stride) {
+    spec_charges_.push_back(&spec_charges[i]);
+  }
+
+  HeadedRecordReader aaf_reader(peptides_file_);
+  ActivePeptideQueue aaf_queue(aaf_reader.Reader(), proteins_);
+  nAA_ = aaf_queue.CountAAFrequency(bin_width_, bin_offset_,
+                                    &aaFreqN_, &aaFreqI_, &aaFreqC_, &aaMass_);
+
+  carp(CARP_INFO, "Benchmarking with %d proteins, %d sample peptides and %d of %d "
+       "spectrum-charge pairs.", (int)proteins_.size(), (int)sample_peptides_.size(),
+       (int)spec_charges_.size(), (int)spec_charges.size());
+}
+
+TideBenchmarks::~TideBenchmarks() {
+  for (vector<pb::Peptide*>::iterator i = sample_peptides_.begin();
+       i != sample_peptides_.end(); ++i) {
+    delete *i;
+  }
+  for (ProteinVec::iterator i = proteins_.begin(); i != proteins_.end(); ++i) {
+    delete *i;
+  }
+  delete[] aaFreqN_;
+  delete[] aaFreqI_;
+  delete[] aaFreqC_;
+  delete[] aaMass_;
+}
+
+void TideBenchmarks::run(double min_seconds, const string& filter) {
+  struct Benchmark {
+    const char* name;
+    const char* unit;
+    Kernel kernel;
+  };
+  const Benchmark benchmarks[] = {
+    { "RecordReader", "peptides", &TideBenchmarks::readPeptideRecords },
+    { "ReadSpectrumRecords", "spectra", &TideBenchmarks::readSpectrumRecords },
+    { "FifoAllocator", "allocations", &TideBenchmarks::allocateFifo },
+    { "PreprocessSpectrum", "spectra", &TideBenchmarks::preprocessSpectra },
+    { "TheoreticalPeakCompiler", "peptides", &TideBenchmarks::compilePeaks },
+    { "SetActiveRange", "spectra", &TideBenchmarks::setActiveRange },
+    { "collectScoresCompiled", "candidates", &TideBenchmarks::executeScores },
+    { "calcScoreCount", "spectra", &TideBenchmarks::countScores },
+    { "SpScorer::Score", "peptides", &TideBenchmarks::scoreSp },
+    { "calcSequenceMass", "peptides", &TideBenchmarks::calcPeptideMasses },
+    { "calcPepMassTide", "peptides", &TideBenchmarks::calcPepMassTide },
+    { "Params", "registries", &TideBenchmarks::buildParams },
+    { "CruxStartup", "processes", &TideBenchmarks::startCrux }
+  };
+  printf("%-24s %8s %14s %12s %14s\n", "kernel", "runs", "items/run", "ns/item", "items/s");
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(Benchmark); ++i) {
+    if (benchmarks[i].kernel == &TideBenchmarks::startCrux && crux_.empty()) {
+      continue;
+    }
+    if (filter.empty() || strstr(benchmarks[i].name, filter.c_str()) != NULL) {
+      time(benchmarks[i].name, benchmarks[i].unit, benchmarks[i].kernel, min_seconds);
+    }
+  }
+}
+
+void TideBenchmarks::time(
+  const char* name,
+  const char* unit,
+  Kernel kernel,
+  double min_seconds
+) {
+  double seconds = 0;
+  (this->*kernel)(&seconds); // warm up caches and page in the files
+  seconds = 0;
+  long long items = 0;
+  int runs = 0;
+  do {
+    items += (this->*kernel)(&seconds);
+    ++runs;
+  } while (seconds < min_seconds);
+  printf("%-24s %8d %14.0f %12.1f %14.0f %s\n", name, runs, (double)items / runs,
+         items > 0 ? seconds * 1e9 / items : 0.0, seconds > 0 ? items / seconds : 0.0,
+         unit);
+  fflush(stdout);
+}
+
+ObservedPeakSet* TideBenchmarks::newObservedPeakSet() const {
+  return new ObservedPeakSet(bin_width_, bin_offset_,
+                             Params::GetBool("use-neutral-loss-peaks"),
+                             Params::GetBool("use-flanking-peaks"));
+}
+
+long long TideBenchmarks::readPeptideRecords(double* seconds) {
+  double start = wall_clock();
+  HeadedRecordReader reader(peptides_file_);
+  pb::Peptide peptide;
+  long long n = 0;
+  while (!reader.Done()) {
+    reader.Read(&peptide);
+    ++n;
+  }
+  *seconds += (wall_clock() - start) / 1e6;
+  return n;
+}
+
+long long TideBenchmarks::readSpectrumRecords(double* seconds) {
+  double start = wall_clock();
+  SpectrumCollection spectra;
+  spectra.ReadSpectrumRecords(spectra_file_);
+  *seconds += (wall_clock() - start) / 1e6;
+  return spectra.Size();
+}
+
+long long TideBenchmarks::allocateFifo(double* seconds) {
+  // The pattern of the active peptide queue: allocations of assorted sizes at
+  // the back, released from the front as the mass window moves on
+  const int N = 1000000;
+  const int WINDOW = 5000;
+  double start = wall_clock();
+  FifoAllocator fifo(FLAGS_fifo_page_size << 20, false);
+  vector<void*> allocated(N);
+  for (int i = 0; i < N; ++i) {
+    allocated[i] = fifo.New(16 + (i * 37) % 240);
+    if (i >= WINDOW && i % 64 == 0) {
+      fifo.Release(allocated[i - WINDOW]);
+    }
+  }
+  fifo.ReleaseAll();
+  *seconds += (wall_clock() - start) / 1e6;
+  return N;
+}
+
+long long TideBenchmarks::preprocessSpectra(double* seconds) {
+  ObservedPeakSet* observed = newObservedPeakSet();
+  const vector<SpectrumCollection::SpecCharge>& spec_charges = *spectra_.SpecCharges();
+  double start = wall_clock();
+  for (vector<SpectrumCollection::SpecCharge>::const_iterator i = spec_charges.begin();
+       i != spec_charges.end(); ++i) {
+    observed->PreprocessSpectrum(*i->spectrum, i->charge);
+  }
+  *seconds += (wall_clock() - start) / 1e6;
+  delete observed;
+  return spec_charges.size();
+}
+
+long long TideBenchmarks::compilePeaks(double* seconds) {
+  FifoAllocator fifo_peptides(FLAGS_fifo_page_size << 20, false);
+  FifoAllocator fifo_prog1(FLAGS_fifo_page_size << 20, true);
+  FifoAllocator fifo_prog2(FLAGS_fifo_page_size << 20, true);
+  TheoreticalPeakCompiler compiler_prog1(&fifo_prog1);
+  TheoreticalPeakCompiler compiler_prog2(&fifo_prog2);
+  ST_TheoreticalPeakSet workspace(2000);
+  double start = wall_clock();
+  for (vector<pb::Peptide*>::const_iterator i = sample_peptides_.begin();
+       i != sample_peptides_.end(); ++i) {
+    Peptide* peptide = new(&fifo_peptides) Peptide(**i, proteins_, &fifo_peptides);
+    workspace.Clear();
+    peptide->ComputeTheoreticalPeaks(&workspace, **i, &compiler_prog1, &compiler_prog2);
+  }
+  *seconds += (wall_clock() - start) / 1e6;
+  return sample_peptides_.size();
+}
+
+long long TideBenchmarks::setActiveRange(double* seconds) {
+  WINDOW_TYPE_T window_type = string_to_window_type(Params::GetString("precursor-window-type"));
+  double precursor_window = Params::GetDouble("precursor-window");
+  int max_charge = Params::GetInt("max-precursor-charge");
+  HeadedRecordReader reader(peptides_file_);
+  ActivePeptideQueue queue(reader.Reader(), proteins_, backend_);
+  queue.SetBinSize(bin_width_, bin_offset_);
+  vector<double> min_mass, max_mass;
+  vector<bool> status;
+  double start = wall_clock();
+  for (size_t i = 0; i < spec_charges_.size(); ++i) {
+    min_mass.clear();
+    max_mass.clear();
+    status.clear();
+    double min_range, max_range;
+    computeWindow(*spec_charges_[i], window_type, precursor_window, max_charge,
+                  &negative_isotope_errors_, &min_mass, &max_mass, &min_range, &max_range);
+    queue.SetActiveRange(&min_mass, &max_mass, min_range, max_range, &status);
+  }
+  *seconds += (wall_clock() - start) / 1e6;
+  return spec_charges_.size();
+}
+
+long long TideBenchmarks::executeScores(double* seconds) {
+  WINDOW_TYPE_T window_type = string_to_window_type(Params::GetString("precursor-window-type"));
+  double precursor_window = Params::GetDouble("precursor-window");
+  int max_charge = Params::GetInt("max-precursor-charge");
+  HeadedRecordReader reader(peptides_file_);
+  ActivePeptideQueue queue(reader.Reader(), proteins_, backend_);
+  queue.SetBinSize(bin_width_, bin_offset_);
+  ObservedPeakSet* observed = newObservedPeakSet();
+  TideMatchSet::Arr2 scores;
+  vector<double> min_mass, max_mass;
+  vector<bool> status;
+  long long n = 0;
+  for (size_t i = 0; i < spec_charges_.size(); ++i) {
+    const SpectrumCollection::SpecCharge* sc = spec_charges_[i];
+    min_mass.clear();
+    max_mass.clear();
+    status.clear();
+    double min_range, max_range;
+    computeWindow(*sc, window_type, precursor_window, max_charge,
+                  &negative_isotope_errors_, &min_mass, &max_mass, &min_range, &max_range);
+    if (queue.SetActiveRange(&min_mass, &max_mass, min_range, max_range, &status) == 0) {
+      continue;
+    }
+    observed->PreprocessSpectrum(*sc->spectrum, sc->charge);
+    scores.Reserve(status.size());
+    double start = wall_clock();
+    collectScoresCompiled(&queue, sc->spectrum, *observed, &scores, status.size(), sc->charge);
+    *seconds += (wall_clock() - start) / 1e6;
+    n += status.size();
+  }
+  delete observed;
+  return n;
+}
+
+long long TideBenchmarks::countScores(double* seconds) {
+  // The exact p-value search sizes its bins by the heaviest precursor
+  double highest_mass = spectra_.SpecCharges()->empty() ? highest_mz_ :
+    spectra_.SpecCharges()->back().neutral_mass;
+  MaxBin::SetGlobalMax(highest_mass);
+  int maxPrecurMass = floor(MaxBin::Global().CacheBinEnd() + 50.0);
+  int minDeltaMass = aaMass_[0];
+  EvidenceCache evidence_cache(bin_width_, bin_offset_);
+  vector<int> evidence, sorted;
+  vector<double> p_value_score, dyn_prog;
+  for (size_t i = 0; i < spec_charges_.size(); ++i) {
+    const SpectrumCollection::SpecCharge* sc = spec_charges_[i];
+    int pepMassInt = MassConstants::mass2bin(sc->neutral_mass);
+    evidence_cache.Clear();
+    evidence_cache.SetSpectrum(sc->spectrum, maxPrecurMass);
+    evidence_cache.EvidenceDiscretized(sc->charge, pepMassInt, &evidence);
+    int maxEvidence = *max_element(evidence.begin(), evidence.end());
+    int minEvidence = *min_element(evidence.begin(), evidence.end());
+    int maxNResidue = (int)floor((double)pepMassInt / (double)minDeltaMass);
+    sorted.assign(evidence.begin(), evidence.end());
+    sort(sorted.begin(), sorted.end(), greater<int>());
+    int maxScore = 0;
+    int minScore = 0;
+    for (int j = 0; j < maxNResidue; j++) {
+      maxScore += sorted[j];
+    }
+    for (int j = maxPrecurMass - maxNResidue; j < maxPrecurMass; j++) {
+      minScore += sorted[j];
+    }
+    p_value_score.resize(maxEvidence + 1 - minScore + 1 + maxScore - minEvidence);
+    double start = wall_clock();
+    calcScoreCount(maxPrecurMass, &evidence[0], pepMassInt, maxEvidence, minEvidence,
+                   maxScore, minScore, nAA_, aaFreqN_, aaFreqI_, aaFreqC_, aaMass_,
+                   &p_value_score[0], &dyn_prog);
+    *seconds += (wall_clock() - start) / 1e6;
+  }
+  MaxBin::SetGlobalMax(highest_mz_);
+  return spec_charges_.size();
+}
+
+long long TideBenchmarks::scoreSp(double* seconds) {
+  // Each spectrum against a run of sample peptides, as many as a spectrum
+  // reports on average
+  const int PER_SPECTRUM = 5;
+  FifoAllocator fifo_peptides(FLAGS_fifo_page_size << 20, false);
+  vector<const Peptide*> peptides;
+  for (vector<pb::Peptide*>::const_iterator i = sample_peptides_.begin();
+       i != sample_peptides_.end(); ++i) {
+    peptides.push_back(new(&fifo_peptides) Peptide(**i, proteins_, &fifo_peptides));
+  }
+  vector<const Peptide*> batch(PER_SPECTRUM);
+  vector<SpScorer::SpScoreData> scores;
+  long long n = 0;
+  for (size_t i = 0; i < spec_charges_.size() && !peptides.empty(); ++i) {
+    const SpectrumCollection::SpecCharge* sc = spec_charges_[i];
+    for (int j = 0; j < PER_SPECTRUM; ++j) {
+      batch[j] = peptides[(i * PER_SPECTRUM + j) % peptides.size()];
+    }
+    double start = wall_clock();
+    SpScorer sp_scorer(proteins_, *sc->spectrum, sc->charge, highest_mz_);
+    sp_scorer.Score(batch, &scores);
+    *seconds += (wall_clock() - start) / 1e6;
+    n += PER_SPECTRUM;
+  }
+  return n;
+}
+
+long long TideBenchmarks::calcPeptideMasses(double* seconds) {
+  // The residue mass lookups of generate-peptides and the Crux::Peptide
+  // mass calculations, in both mass types
+  double start = wall_clock();
+  double sum = 0;
+  for (vector<string>::const_iterator i = sample_sequences_.begin();
+       i != sample_sequences_.end(); ++i) {
+    sum += Crux::Peptide::calcSequenceMass(*i, MONO);
+    sum += Crux::Peptide::calcSequenceMass(*i, AVERAGE);
+  }
+  *seconds += (wall_clock() - start) / 1e6;
+  if (sum < 0) {
+    carp(CARP_WARNING, "Negative mass sum %g", sum);
+  }
+  return 2 * sample_sequences_.size();
+}
+
+long long TideBenchmarks::calcPepMassTide(double* seconds) {
+  // The peptide mass of tide-index digestion
+  double start = wall_clock();
+  double sum = 0;
+  for (vector<string>::const_iterator i = sample_sequences_.begin();
+       i != sample_sequences_.end(); ++i) {
+    sum += TideIndexApplication::calcPepMassTide(*i, MONO);
+    sum += TideIndexApplication::calcPepMassTide(*i, AVERAGE);
+  }
+  *seconds += (wall_clock() - start) / 1e6;
+  if (sum < 0) {
+    carp(CARP_WARNING, "Negative mass sum %g", sum);
+  }
+  return 2 * sample_sequences_.size();
+}
+
+long long TideBenchmarks::buildParams(double* seconds) {
+  // Every command builds the whole registry before parsing its options.
+  double start = wall_clock();
+  Params* params = new Params();
+  delete params;
+  *seconds += (wall_clock() - start) / 1e6;
+  return 1;
+}
+
+long long TideBenchmarks::startCrux(double* seconds) {
+  double start = wall_clock();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    execl(crux_.c_str(), crux_.c_str(), "version", "--no-analytics", "T", (char*)NULL);
+    _exit(127);
+  }
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    carp(CARP_FATAL, "Could not run %s version", crux_.c_str());
+  }
+  *seconds += (wall_clock() - start) / 1e6;
+  return 1;
+}
+
+static void usage(const char* program) {
+  cerr << "Usage: " << program << " <fasta> <spectrumrecords> [options]" << endl
+       << "  --index <dir>        tide-index to use, built from the fasta if it does"
+       << " not exist (default tide-benchmarks-index)" << endl
+       << "  --min-time <s>       minimum time for each kernel (default 1)" << endl
+       << "  --spectra <n>        spectrum-charge pairs visited by the sweeping"
+       << " kernels (default 2000)" << endl
+       << "  --filter <name>      only the kernels whose names contain this" << endl
+       << "  --crux <path>        crux binary whose startup is timed" << endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    usage(argv[0]);
+    return 1;
+  }
+  string fasta = argv[1];
+  string spectra = argv[2];
+  string index = "tide-benchmarks-index";
+  double min_seconds = 1;
+  int max_spec_charges = 2000;
+  string filter;
+  string crux;
+  for (int i = 3; i < argc; i++) {
+    string option = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (option == "--index") {
+      index = argv[++i];
+    } else if (option == "--min-time") {
+      min_seconds = atof(argv[++i]);
+    } else if (option == "--spectra") {
+      max_spec_charges = atoi(argv[++i]);
+    } else if (option == "--filter") {
+      filter = argv[++i];
+    } else if (option == "--crux") {
+      crux = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // The index is built, and the parameters set up, as by
+  // "crux tide-index"; the benchmarks then run with the default parameters.
+  string output_dir = index + "-output";
+  const char* index_args[] = {
+    argv[0], "tide-index", "--overwrite", "T", "--output-dir", output_dir.c_str(),
+    fasta.c_str(), index.c_str()
+  };
+  int num_index_args = sizeof(index_args) / sizeof(char*) - 1;
+  TideIndexApplication indexer;
+  indexer.initialize(num_index_args, (char**)index_args + 1);
+  if (!FileUtils::Exists(FileUtils::Join(index, "pepix"))) {
+    if (indexer.main(num_index_args, (char**)index_args + 1) != 0) {
+      carp(CARP_FATAL, "Could not build the index %s", index.c_str());
+    }
+  } else {
+    carp(CARP_INFO, "Using the existing index %s", index.c_str());
+  }
+
+  TideBenchmarks benchmarks(index, spectra, max_spec_charges, crux);
+  benchmarks.run(min_seconds, filter);
+  return 0;
+}
@@ -0,0 +1,86 @@
+/**
+ * \file TideBenchmarks.h
+ * \brief Micro-benchmarks of the Tide search kernels.
+ *
+ * Each kernel is run on the peptides of an index built from worm.fasta and
+ * on the spectra of worm-06-10000.spectrumrecords, repeatedly until it has
+ * taken at least the minimum time, and its throughput is printed. Kernels
+ * time only their own work; setup such as preprocessing the spectra that a
+ * scoring kernel scores against is not counted. The startup kernels time
+ * building the parameter registry, and, given a crux binary, running
+ * "crux version" from exec to exit.
+ */
+#ifndef TIDEBENCHMARKS_H
+#define TIDEBENCHMARKS_H
+
+#include <string>
+#include <vector>
+#include "app/TideSearchApplication.h"
+
+class TideBenchmarks : public TideSearchApplication {
+ public:
+  TideBenchmarks(
+    const std::string& index, ///< directory of a tide-index
+    const std::string& spectra_file, ///< spectrumrecords file
+    int max_spec_charges, ///< spectrum-charge pairs the sweeping kernels visit
+    const std::string& crux ///< crux binary whose startup is timed, or empty
+  );
+  ~TideBenchmarks();
+
+  /**
+   * Runs each kernel whose name contains filter (all if it is empty) for at
+   * least min_seconds, and prints one line of results for each.
+   */
+  void run(double min_seconds, const std::string& filter);
+
+ private:
+  /**
+   * A kernel does one pass of its work, adds the time it spent on the work
+   * being measured to *seconds, and returns the number of items done.
+   */
+  typedef long long (TideBenchmarks::*Kernel)(double* seconds);
+
+  void time(const char* name, const char* unit, Kernel kernel, double min_seconds);
+
+  long long readPeptideRecords(double* seconds);
+  long long readSpectrumRecords(double* seconds);
+  long long allocateFifo(double* seconds);
+  long long preprocessSpectra(double* seconds);
+  long long compilePeaks(double* seconds);
+  long long setActiveRange(double* seconds);
+  long long executeScores(double* seconds);
+  long long countScores(double* seconds);
+  long long scoreSp(double* seconds);
+  long long calcPeptideMasses(double* seconds);
+  long long calcPepMassTide(double* seconds);
+  long long buildParams(double* seconds);
+  long long startCrux(double* seconds);
+
+  ObservedPeakSet* newObservedPeakSet() const;
+
+  std::string peptides_file_;
+  std::string spectra_file_;
+  std::string crux_;
+  ProteinVec proteins_;
+  std::vector<pb::Peptide*> sample_peptides_; ///< spread over the whole index
+  std::vector<std::string> sample_sequences_; ///< of sample_peptides_
+  SpectrumCollection spectra_;
+  std::vector<const SpectrumCollection::SpecCharge*> spec_charges_; ///< in mass order
+  std::vector<int> negative_isotope_errors_;
+  ScoringBackend backend_;
+  double highest_mz_;
+  int nAA_;
+  double* aaFreqN_;
+  double* aaFreqI_;
+  double* aaFreqC_;
+  int* aaMass_;
+};
+
+#endif // TIDEBENCHMARKS_H
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 2
+ * End:
+ */